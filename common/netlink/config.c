@@ -14,7 +14,7 @@ void init_request_hdr(struct request_hdr *hdr, enum config_mode mode,
 	hdr->magic[3] = 'l';
 	hdr->type = xlat_is_nat64() ? 'n' : 's'; /* 'n'at64 or 's'iit. */
 	hdr->castness = 'u';
-	hdr->slop = 0;
+	hdr->seq = 0;
 	hdr->version = htonl(xlat_version());
 	hdr->mode = htons(mode);
 	hdr->operation = htons(operation);
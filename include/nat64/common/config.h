@@ -15,13 +15,22 @@ typedef __u8 config_bool;
 
 #define GNL_JOOL_FAMILY_NAME (xlat_is_siit() ? "SIIT_Jool" : "NAT64_Jool")
 #define GNL_JOOLD_MULTICAST_GRP_NAME "joold"
+#define GNL_EVENTS_MULTICAST_GRP_NAME "events"
 
 enum genl_mc_group_ids {
 	JOOLD_MC_ID = (1 << 0),
+	EVENTS_MC_ID = (1 << 1),
 };
 
 enum genl_commands {
 	JOOL_COMMAND,
+	/**
+	 * Session synchronization traffic from joold. Same payload as
+	 * JOOL_COMMAND's MODE_JOOLD requests, but it skips the configuration
+	 * lock, so the daemons never wait for the administrator (or for each
+	 * other).
+	 */
+	JOOLD_COMMAND,
 };
 
 enum attributes {
@@ -53,6 +62,15 @@ enum config_mode {
 	MODE_JOOLD = (1 << 10),
 
 	MODE_INSTANCE = (1 << 11),
+	/** Userspace only: the maps of the SIIT XDP fast path. */
+	MODE_XDP = (1 << 12),
+	/** The current message is talking about the instance's counters. */
+	MODE_STATS = (1 << 13),
+	/**
+	 * The current message is a batch of BIB/session events. (See
+	 * --logging-stream.) Userspace only listens to these.
+	 */
+	MODE_EVENTS = (1 << 14),
 };
 
 char *configmode_to_string(enum config_mode mode);
@@ -71,10 +89,13 @@ char *configmode_to_string(enum config_mode mode);
 #define BLACKLIST_OPS (DATABASE_OPS)
 #define RFC6791_OPS (DATABASE_OPS)
 #define EAMT_OPS (DATABASE_OPS)
-#define BIB_OPS (DATABASE_OPS & ~OP_FLUSH)
-#define SESSION_OPS (OP_DISPLAY | OP_COUNT)
-#define JOOLD_OPS (OP_ADVERTISE | OP_TEST)
+#define BIB_OPS ((DATABASE_OPS & ~OP_FLUSH) | OP_UPDATE)
+#define SESSION_OPS (OP_DISPLAY | OP_COUNT | OP_ADD | OP_FOLLOW)
+#define JOOLD_OPS (OP_DISPLAY | OP_ADVERTISE | OP_TEST)
 #define INSTANCE_OPS (OP_ADD | OP_REMOVE)
+#define XDP_OPS (OP_UPDATE)
+#define STATS_OPS (OP_DISPLAY)
+#define EVENTS_OPS (OP_DISPLAY)
 /**
  * @}
  */
@@ -107,6 +128,21 @@ enum config_operation {
 	OP_TEST = (1 << 7),
 	/** Somebody is acknowledging reception of a previous message. */
 	OP_ACK = (1 << 8),
+	/**
+	 * A joold peer finished sending its whole session table. (It follows
+	 * the last of the sessions; see struct joold_adv_end.)
+	 */
+	OP_ADVERTISE_END = (1 << 9),
+	/**
+	 * joold wants the module to exchange the sessions with the peers by
+	 * itself. (See struct joold_bind_request.)
+	 */
+	OP_BIND = (1 << 10),
+	/**
+	 * The userspace app wants the table changes that followed some point
+	 * of the change log. (See struct bib_changes_hdr.)
+	 */
+	OP_FOLLOW = (1 << 11),
 };
 
 char *configop_to_string(enum config_operation op);
@@ -132,17 +168,21 @@ enum parse_section {
 #define TABLE_MODES (MODE_EAMT | MODE_BIB | MODE_SESSION)
 #define ANY_MODE 0xFFFF
 
-#define DISPLAY_MODES (MODE_GLOBAL | POOL_MODES | TABLE_MODES)
+#define DISPLAY_MODES (MODE_GLOBAL | POOL_MODES | TABLE_MODES | MODE_STATS \
+		| MODE_EVENTS)
 #define COUNT_MODES (POOL_MODES | TABLE_MODES)
 #define ADD_MODES (POOL_MODES | MODE_EAMT | MODE_BIB | MODE_INSTANCE)
 #define REMOVE_MODES (POOL_MODES | MODE_EAMT | MODE_BIB | MODE_INSTANCE)
 #define FLUSH_MODES (POOL_MODES | MODE_EAMT)
-#define UPDATE_MODES (MODE_GLOBAL | MODE_POOL4 | MODE_PARSE_FILE)
+#define UPDATE_MODES (MODE_GLOBAL | MODE_POOL4 | MODE_BIB | MODE_PARSE_FILE \
+		| MODE_XDP)
 
 #define SIIT_MODES (MODE_GLOBAL | MODE_POOL6 | MODE_BLACKLIST | MODE_RFC6791 \
-		| MODE_EAMT | MODE_PARSE_FILE | MODE_INSTANCE)
+		| MODE_EAMT | MODE_PARSE_FILE | MODE_INSTANCE | MODE_XDP \
+		| MODE_STATS)
 #define NAT64_MODES (MODE_GLOBAL | MODE_POOL6 | MODE_POOL4 | MODE_BIB \
-		| MODE_SESSION | MODE_PARSE_FILE | MODE_INSTANCE | MODE_JOOLD)
+		| MODE_SESSION | MODE_PARSE_FILE | MODE_INSTANCE | MODE_JOOLD \
+		| MODE_STATS | MODE_EVENTS)
 /**
  * @}
  */
@@ -167,11 +207,13 @@ struct request_hdr {
 	__u8 castness;
 
 	/**
-	 * http://www.catb.org/esr/structure-packing/
-	 * Explicit unused space for future functionality and to ensure
-	 * sizeof(struct request_hdr) is a power of 2.
+	 * Sequence number of the joold packet, or of the joold packet being
+	 * acknowledged. Zero and ignored by everyone else.
+	 *
+	 * (This used to be slop. It still ensures sizeof(struct request_hdr) is
+	 * a power of 2; http://www.catb.org/esr/structure-packing/)
 	 */
-	__be16 slop;
+	__be16 seq;
 
 	/** Jool's version. */
 	__be32 version;
@@ -192,6 +234,27 @@ struct response_hdr {
 	config_bool pending_data;
 };
 
+/** Longest --share-tables name, terminating NULL chara included. */
+#define SHARED_TABLES_NAME_LEN 16
+
+/**
+ * Payload of instance additions. (Removals don't have one.)
+ */
+struct request_instance {
+	/**
+	 * Name of the tables the new instance should share with the other
+	 * instances that were added with the same name. (See xlator_add().)
+	 * Empty string means the instance gets its own tables.
+	 */
+	char shared_tables[SHARED_TABLES_NAME_LEN];
+	/**
+	 * File descriptor (in the requester's process) of the network
+	 * namespace whose instance the new one should be a copy of. (See
+	 * xlator_add_from().) Negative means none. Excludes @shared_tables.
+	 */
+	__s32 from;
+};
+
 /**
  * Configuration for the "IPv6 Pool" module.
  */
@@ -259,6 +322,52 @@ union request_pool4 {
 		 */
 		config_bool quick;
 	} flush;
+	/*
+	 * Pool4 usage query. (Pool4 reuses OP_COUNT for this; it doesn't have
+	 * anything else to count.)
+	 */
+	struct {
+		__u8 proto;
+		/** If unset, the response starts with a struct pool4_stats_usr. */
+		config_bool offset_set;
+		/** Address the userspace app received in the last chunk. */
+		struct in_addr offset;
+	} usage;
+};
+
+/**
+ * Length of struct pool4_stats_usr.histogram.
+ * Bucket i counts searches that needed [2^i, 2^(i + 1)) iterations, except the
+ * first one also counts zero, and the last one also counts everything above.
+ */
+#define POOL4_HISTOGRAM_BUCKETS 17
+
+/**
+ * How the mask searches of one protocol have been going since the instance was
+ * created.
+ */
+struct pool4_stats_usr {
+	/** Searches that found a free transport address. */
+	__u64 allocations;
+	/** Searches that ran out of pool4 transport addresses. */
+	__u64 exhaustions;
+	/** Searches that gave up because they hit max-iterations. */
+	__u64 limited;
+	/** Transport addresses tested, by all the searches. */
+	__u64 iterations;
+	/** Searches, grouped by how many transport addresses they tested. */
+	__u64 histogram[POOL4_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * How much of one pool4 address (of one protocol) is being used.
+ */
+struct pool4_usage_usr {
+	struct in_addr addr;
+	/** Ports pool4 assigns to @addr. (Across all marks.) */
+	__u32 ports;
+	/** Ports currently taken by BIB entries or reserved port blocks. */
+	__u32 used;
 };
 
 union request_pool {
@@ -288,6 +397,10 @@ union request_eamt {
 	struct {
 		config_bool prefix4_set;
 		struct ipv4_prefix prefix4;
+		/** Answer with eamt_entry_usrs instead of eamt_entrys? */
+		config_bool counters;
+		/** Zero the counters of the entries being displayed? */
+		config_bool reset;
 	} display;
 	struct {
 		/* Nothing needed here. */
@@ -308,6 +421,84 @@ union request_eamt {
 	} flush;
 };
 
+/* See struct bib_filter.flags. */
+#define BIB_FILTER_SRC6 (1 << 0)
+#define BIB_FILTER_SRC4 (1 << 1)
+#define BIB_FILTER_DST4 (1 << 2)
+#define BIB_FILTER_STATE (1 << 3)
+#define BIB_FILTER_AGE (1 << 4)
+
+/**
+ * Narrows down a BIB or session display, so the kernel doesn't have to send
+ * the whole table. Only the fields whose BIB_FILTER_* flag is set apply.
+ * BIB displays ignore the session-only ones (dst4, states and min_age).
+ */
+struct bib_filter {
+	__u8 flags;
+	/** The entry's IPv6 address must belong to this prefix. */
+	struct ipv6_prefix src6;
+	/** The entry's IPv4 transport address must belong to this range. */
+	struct ipv4_range src4;
+	/** The session's remote IPv4 address must belong to this prefix. */
+	struct ipv4_prefix dst4;
+	/** Accepted TCP states. Bit n stands for the enum tcp_state n. */
+	__u16 states;
+	/** Milliseconds the session must have gone without traffic. */
+	__u32 min_age;
+};
+
+/** One of the entries of a bulk BIB add or remove. */
+struct bib_bulk_entry {
+	struct ipv6_transport_addr addr6;
+	struct ipv4_transport_addr addr4;
+};
+
+/**
+ * Maximum number of entries a single bulk request can carry. (Their error
+ * codes have to fit in one response.)
+ */
+#define BIB_BULK_MAX 512
+
+/** Maximum groups a `--bib --count --top` query can ask for. */
+#define BIB_TOP_MAX 64
+
+enum bib_top_by {
+	/** Group the entries by (a prefix of) their IPv6 transport address. */
+	BIB_TOP_SRC6,
+	/** Group the entries by (a prefix of) their pool4 address. */
+	BIB_TOP_SRC4,
+};
+
+/**
+ * A query for the groups of BIB entries that hold the most ports or sessions,
+ * aggregated by the kernel while it walks the trees. (So finding the heaviest
+ * subscribers doesn't require exporting the whole session table.)
+ */
+struct bib_top_query {
+	/** Maximum groups to return. Zero means this is not such a query. */
+	__u16 count;
+	/** enum bib_top_by. */
+	__u8 by;
+	/** Length of the prefixes the addresses are grouped by. */
+	__u8 plen;
+	/** Rank by session count? (Otherwise, by BIB entry count.) */
+	config_bool sessions;
+};
+
+/**
+ * One of the groups a bib_top_query responds. The response is an array of
+ * these, heaviest first.
+ */
+struct bib_top_usr {
+	/** The group's prefix, host bits zeroed. The query's @by decides. */
+	union {
+		struct in6_addr addr6;
+		struct in_addr addr4;
+	} prefix;
+	__u64 bibs;
+	__u64 sessions;
+};
+
 /**
  * Configuration for the "BIB" module.
  */
@@ -317,6 +508,14 @@ struct request_bib {
 	 * l4_protocol.
 	 */
 	__u8 l4_proto;
+	/**
+	 * If nonzero, this is an OP_ADD or OP_REMOVE of this many static
+	 * entries, which follow the request as an array of
+	 * struct bib_bulk_entry. (The union is not used.)
+	 * The response is an array of as many __s32s; the error code of each
+	 * entry.
+	 */
+	__u16 bulk_count;
 	union {
 		struct {
 			config_bool addr4_set;
@@ -325,9 +524,21 @@ struct request_bib {
 			 * Iteration should contiue from here.
 			 */
 			struct ipv4_transport_addr addr4;
+			/** Which entries the userspace app wants to see. */
+			struct bib_filter filter;
 		} display;
 		struct {
-			/* Nothing needed here. */
+			/**
+			 * Respond a struct bib_stats_usr instead of the BIB
+			 * entry count?
+			 */
+			config_bool details;
+			/**
+			 * If @top.count is nonzero, respond the heaviest
+			 * groups of entries instead. (Takes precedence over
+			 * @details.)
+			 */
+			struct bib_top_query top;
 		} count;
 		struct {
 			/**
@@ -357,6 +568,16 @@ struct request_bib {
 			 */
 			struct ipv4_transport_addr addr4;
 		} rm;
+		struct {
+			/**
+			 * BPF program (a file descriptor of the requesting
+			 * process) that will decide which IPv6 packets get
+			 * BIB entries and sessions. (See
+			 * nat64/common/policy.h.) Negative means "remove the
+			 * current one."
+			 */
+			__s32 fd;
+		} policy;
 	};
 };
 
@@ -364,10 +585,20 @@ struct request_bib {
  * Configuration for the "Session DB"'s tables.
  */
 struct request_session {
-	/** Table the userspace app wants to display. See enum l4_protocol. */
+	/**
+	 * Table the userspace app wants to display. See enum l4_protocol.
+	 * An OP_ADD (import) ignores it; instead, it is followed by an array
+	 * of struct joold_session, which carry their own protocols.
+	 */
 	__u8 l4_proto;
 	union {
 		struct {
+			/**
+			 * Respond struct joold_sessions instead of struct
+			 * session_entry_usrs? (The former can be imported
+			 * later.)
+			 */
+			config_bool export;
 			/** Is offset set? */
 			config_bool offset_set;
 			/**
@@ -375,10 +606,19 @@ struct request_session {
 			 * chunk. Iteration should continue from here.
 			 */
 			struct taddr4_tuple offset;
+			/** Which sessions the userspace app wants to see. */
+			struct bib_filter filter;
 		} display;
 		struct {
 			/* Nothing needed here. */
 		} count;
+		struct {
+			/**
+			 * Respond the change log records that follow this
+			 * sequence number.
+			 */
+			__u64 since;
+		} follow;
 	};
 };
 
@@ -394,6 +634,7 @@ enum global_type {
 	RESET_TOS,
 	NEW_TOS,
 	MTU_PLATEAUS,
+	DEBUG_MODE,
 
 	/* SIIT */
 	COMPUTE_UDP_CSUM_ZERO,
@@ -407,20 +648,166 @@ enum global_type {
 	DROP_EXTERNAL_TCP,
 	SRC_ICMP6ERRS_BETTER,
 	F_ARGS,
+	F_ALGORITHM,
 	HANDLE_RST_DURING_FIN_RCV,
 	UDP_TIMEOUT,
 	ICMP_TIMEOUT,
 	TCP_EST_TIMEOUT,
 	TCP_TRANS_TIMEOUT,
+	TCP_CLOSED_TIMEOUT,
 	FRAGMENT_TIMEOUT,
 	BIB_LOGGING,
 	SESSION_LOGGING,
 	MAX_PKTS,
+	MAX_SESSIONS_TCP,
+	MAX_SESSIONS_UDP,
+	MAX_SESSIONS_ICMP,
+	SUBSCRIBER_PREFIX_LEN,
+	SUBSCRIBER_MAX_BIBS,
+	SUBSCRIBER_MAX_SESSIONS,
+	SUBSCRIBER_MAX_RATE,
+	PORT_BLOCK_SIZE,
+	DETERMINISTIC_BITS,
+	POOL4_BALANCE,
 	SS_ENABLED,
 	SS_FLUSH_ASAP,
 	SS_FLUSH_DEADLINE,
 	SS_CAPACITY,
 	SS_MAX_PAYLOAD,
+	SS_WINDOW,
+	SS_COMPACT,
+	SS_RESYNC_INTERVAL,
+	SS_ADVERTISE_CHUNK,
+	SS_ADVERTISE_RATE,
+	FRAGMENT_HIGH_THRESH,
+	FRAGMENT_LOW_THRESH,
+	FRAGMENT_VIRTUAL,
+	LATENCY_SAMPLING,
+	MIRROR_SAMPLING,
+	LOGGING_STREAM,
+	MAX_STORED_BYTES,
+	STATELESS_SO,
+	MSS_CLAMP,
+	UDP_SHORT_TIMEOUT,
+	UDP_SHORT_PORTS,
+	CLAT_MODE,
+	PACKET_BUDGET,
+	CPS_BUDGET,
+	SS_NODE_COUNT,
+	SS_NODE_ID,
+};
+
+/**
+ * The shape of one protocol's BIB and session tables, and how contended their
+ * locks are. (Summed across shards, except for the maximums.)
+ */
+struct bib_stats_usr {
+	__u64 bib_count;
+	__u64 session_count;
+	/** Sessions queued in each of the expirers. */
+	__u64 est_sessions;
+	__u64 trans_sessions;
+	__u64 syn4_sessions;
+
+	/**
+	 * Largest black height among the shards' trees. The trees are
+	 * red-black, so no path from their roots is shorter than this, nor
+	 * longer than twice this.
+	 */
+	__u32 tree6_black_height;
+	__u32 tree4_black_height;
+
+	/** Lock acquisitions sampled (one out of BIB_LOCK_SAMPLING). */
+	__u64 lock_samples;
+	/** Time spent waiting for the lock in the samples, in nanoseconds. */
+	__u64 lock_wait;
+	__u64 lock_wait_max;
+	/** Time the lock was held in the samples, in nanoseconds. */
+	__u64 lock_hold;
+	__u64 lock_hold_max;
+};
+
+#define BIB_LOCK_SAMPLING 64
+
+enum bib_event_type {
+	BIBEV_BIB_ADD = 1,
+	BIBEV_BIB_RM,
+	BIBEV_SESSION_ADD,
+	BIBEV_SESSION_RM,
+	BIBEV_BLOCK_ADD,
+	BIBEV_BLOCK_RM,
+};
+
+/**
+ * What a session has translated so far. All zeros if the session is not being
+ * counted. (See the session_counters module parameter.)
+ */
+struct session_counters_usr {
+	__u64 packets_6to4;
+	__u64 bytes_6to4;
+	__u64 packets_4to6;
+	__u64 bytes_4to6;
+};
+
+/**
+ * One record of the event stream. Batches of these follow a request_hdr
+ * (MODE_EVENTS) in the messages of the GNL_EVENTS_MULTICAST_GRP_NAME
+ * multicast group.
+ *
+ * BIB events only fill in @src6 and @src4. Port block events store the
+ * subscriber prefix in @src6.l3 and @plen, the block's first transport address
+ * in @src4 and its last port in @dst4.l4. Only session removal events fill in
+ * @counters.
+ */
+struct bib_event_usr {
+	/** When the event happened. (CLOCK_REALTIME, in nanoseconds.) */
+	__u64 timestamp;
+	struct session_counters_usr counters;
+	struct ipv6_transport_addr src6;
+	struct ipv6_transport_addr dst6;
+	struct ipv4_transport_addr src4;
+	struct ipv4_transport_addr dst4;
+	/** enum bib_event_type. */
+	__u8 type;
+	/** enum l4_protocol. */
+	__u8 proto;
+	__u8 plen;
+	__u8 padding;
+};
+
+/**
+ * A record of the change log (see mod/stateful/bib/events.h); a BIB entry or
+ * session that was created or destroyed.
+ */
+struct bib_change_usr {
+	/** Position of the change in the log. The first change is 1. */
+	__u64 seq;
+	struct ipv6_transport_addr src6;
+	/** Zero in BIB entry changes. */
+	struct ipv6_transport_addr dst6;
+	struct ipv4_transport_addr src4;
+	/** Zero in BIB entry changes. */
+	struct ipv4_transport_addr dst4;
+	/** enum bib_event_type. (Never one of the block events.) */
+	__u8 type;
+	/** enum l4_protocol. */
+	__u8 proto;
+};
+
+/**
+ * Response to an OP_FOLLOW. It is followed by the (oldest) records whose
+ * sequence numbers are greater than the request's @since, or as many of them
+ * as fit in the message. (The pending data flag is set if there are more.)
+ *
+ * If @first is greater than @since + 1, the records in between were
+ * overwritten before they were fetched; the client should fall back to a
+ * full dump.
+ */
+struct bib_changes_hdr {
+	/** Sequence number of the oldest record the log still has. */
+	__u64 first;
+	/** Sequence number the next change will get. */
+	__u64 next;
 };
 
 /**
@@ -452,9 +839,20 @@ struct session_entry_usr {
 	struct ipv4_transport_addr src4;
 	struct ipv4_transport_addr dst4;
 	__u64 dying_time;
+	struct session_counters_usr counters;
 	__u8 state;
 };
 
+/**
+ * Response to a session count request.
+ */
+struct session_count_usr {
+	/** Sessions currently in the table. */
+	__u64 count;
+	/** Sessions that have been evicted early because the table was full. */
+	__u64 evicted;
+};
+
 /**
  * Explicit Address Mapping definition.
  * Intended to be a row in the Explicit Address Mapping Table, bind an IPv4
@@ -465,6 +863,18 @@ struct eamt_entry {
 	struct ipv4_prefix prefix4;
 };
 
+/**
+ * An EAMT entry, as displayed when the user asks for counters.
+ * (@entry has to go first; see handle_eamt_display().)
+ */
+struct eamt_entry_usr {
+	struct eamt_entry entry;
+	/** Packets whose addresses were translated by the entry. */
+	__u64 hits;
+	/** Sum of the translated packets' lengths. */
+	__u64 bytes;
+};
+
 enum f_args {
 	F_ARGS_SRC_ADDR = (1 << 3),
 	F_ARGS_SRC_PORT = (1 << 2),
@@ -472,7 +882,22 @@ enum f_args {
 	F_ARGS_DST_PORT = (1 << 0),
 };
 
+/**
+ * Hash functions RFC 6056's F() can be built upon.
+ * MD5 is the one the RFC suggests, SipHash is a lot faster.
+ */
+enum f_algorithm {
+	F_ALGORITHM_MD5 = 0,
+	F_ALGORITHM_SIPHASH = 1,
+
+#define F_ALGORITHM_COUNT 2
+};
+
 #define PLATEAUS_MAX 64
+/** Smallest nonzero --mss-clamp. (IPv4's minimum reassembly buffer size.) */
+#define MSS_CLAMP_MIN 576
+/** Size of the --udp-short-ports list. */
+#define UDP_SHORT_PORTS_MAX 16
 
 /**
  * A copy of the entire running configuration, excluding databases.
@@ -520,6 +945,37 @@ struct global_config_usr {
 	/** Length of the mtu_plateaus array. */
 	__u16 mtu_plateau_count;
 
+	/**
+	 * Record packet snapshots and print log_debug()s?
+	 * Both are skipped via a static key while no instance wants them.
+	 * (And the latter also needs a DEBUG build.)
+	 */
+	config_bool debug;
+
+	/**
+	 * Measure how long each stage of the translation takes for one out of
+	 * this many packets (per CPU). 0 disables the sampling.
+	 * (See `--stats --display`.)
+	 */
+	__u32 latency_sampling;
+	/**
+	 * Hand one out of this many packets (per CPU) to the jool_mirror
+	 * tracepoint, if somebody is listening to it. 0 disables the mirror.
+	 */
+	__u32 mirror_sampling;
+	/**
+	 * Packets (per second, per CPU) the instance is allowed to translate.
+	 * The rest are dropped. 0 means unlimited.
+	 */
+	__u32 packet_budget;
+
+	/**
+	 * Largest packet, in bytes, the segments of translated TCP connections
+	 * should need on either side. The Maximum Segment Size option of
+	 * translated SYNs is lowered to fit it. 0 disables the clamping.
+	 */
+	__u16 mss_clamp;
+
 	union {
 		struct {
 			/**
@@ -554,6 +1010,12 @@ struct global_config_usr {
 			 */
 			struct ipv6_prefix rfc6791_v6_prefix;
 
+			/**
+			 * Translate the 464XLAT CLAT traffic through the
+			 * precomputed pool6/EAM mapping, instead of looking up
+			 * the tables. (See eamt_clat_refresh().)
+			 */
+			config_bool clat;
 		} siit;
 		struct {
 			/** Filter ICMPv6 Informational packets? */
@@ -570,6 +1032,11 @@ struct global_config_usr {
 			 * See "enum f_args".
 			 */
 			__u8 f_args;
+			/**
+			 * Hash function F() is built upon.
+			 * See "enum f_algorithm".
+			 */
+			__u8 f_algorithm;
 			/**
 			 * Decrease timer when a FIN packet is received during the
 			 * `V4 FIN RCV` or `V6 FIN RCV` states?
@@ -584,12 +1051,35 @@ struct bib_config {
 	struct {
 		__u32 tcp_est;
 		__u32 tcp_trans;
+		/**
+		 * Lifetime of the TCP sessions that saw a RST or both FINs.
+		 * Zero means they get @tcp_trans, like the RFC wants.
+		 */
+		__u32 tcp_closed;
 		__u32 udp;
 		__u32 icmp;
+		/** Lifetime of the UDP sessions whose ports are in @udp_short. */
+		__u32 udp_short;
 	} ttl;
 
+	/**
+	 * Remote (IPv4) UDP ports whose sessions are expected to be one-shot
+	 * exchanges (DNS, NTP and the like), and which therefore expire after
+	 * ttl.udp_short instead of ttl.udp. An empty list disables this.
+	 */
+	struct {
+		__u16 ports[UDP_SHORT_PORTS_MAX];
+		/** Length of the @ports array. */
+		__u16 count;
+	} udp_short;
+
 	config_bool bib_logging;
 	config_bool session_logging;
+	/**
+	 * Send the records enabled by @bib_logging and @session_logging to
+	 * the event stream (struct bib_event_usr) instead of the kernel log?
+	 */
+	config_bool logging_stream;
 
 	/** Use Address-Dependent Filtering? */
 	config_bool drop_by_addr;
@@ -597,11 +1087,103 @@ struct bib_config {
 	config_bool drop_external_tcp;
 
 	__u32 max_stored_pkts;
+	/**
+	 * Maximum memory (in bytes, skb truesize included) the type 1 stored
+	 * packets (see pkt_queue.h) can take. Zero means unlimited.
+	 */
+	__u32 max_stored_bytes;
+	/**
+	 * Keep only the headers of the type 1 stored packets, instead of the
+	 * whole skbs? (Their ICMP errors are then rebuilt out of the headers.)
+	 */
+	config_bool stateless_so;
+
+	/**
+	 * Maximum number of sessions each table can hold. Zero means
+	 * unlimited. If a new session would exceed this, the oldest idle one
+	 * is evicted. (Transitory TCP sessions go before established ones.)
+	 */
+	struct {
+		__u32 tcp;
+		__u32 udp;
+		__u32 icmp;
+	} max_sessions;
+
+	/**
+	 * Per-subscriber quotas. IPv6 clients that share a @prefix_len-bit
+	 * prefix count as a single subscriber, and can only have up to
+	 * @max_bibs BIB entries and @max_sessions sessions per protocol, and
+	 * create up to @max_rate sessions per second per protocol.
+	 * (Zero @max_* means unlimited. Zero @prefix_len disables the quotas.)
+	 */
+	struct {
+		__u8 prefix_len;
+		__u32 max_bibs;
+		__u32 max_sessions;
+		__u32 max_rate;
+	} subscriber;
+
+	/**
+	 * Sessions (per second, per CPU) the instance is allowed to create,
+	 * all protocols and subscribers included. 0 means unlimited.
+	 */
+	__u32 cps_budget;
+
+	/**
+	 * Number of ports in each of the blocks subscribers reserve for
+	 * themselves. (RFC 7422.) Zero disables Port Block Allocation.
+	 */
+	__u16 port_block_size;
+
+	/**
+	 * Deterministic NAT: The last @deterministic_bits bits of the
+	 * subscriber prefix index one of the 2^@deterministic_bits equal
+	 * slices of pool4, and the subscriber can only use its slice.
+	 * Zero disables this.
+	 */
+	__u8 deterministic_bits;
+
+	/**
+	 * Start the search for new masks from the pool4 address that is the
+	 * least used, rather than from the one the RFC 6056 algorithm points
+	 * to?
+	 */
+	config_bool pool4_balance;
+
+	/**
+	 * Minimum number of jiffies between two synchronizations (joold) of
+	 * the same session, unless its state changes or the peers' copy would
+	 * expire first. Zero synchronizes on every translated packet.
+	 * (It lives here because the BIB is the one that keeps track of when
+	 * each session was last synchronized.)
+	 */
+	__u32 sync_interval;
+
+	/**
+	 * Active/active joold clusters: The number of nodes that share pool4,
+	 * and which one of them is this one. New BIB entries are only masked
+	 * with ports that are congruent to @node_id modulo @node_count, so the
+	 * nodes never allocate the same mask, no matter how late the others'
+	 * entries are replicated. (Port blocks and ICMP identifiers are split
+	 * the same way.) @node_count 0 and 1 disable the partition.
+	 */
+	__u8 node_count;
+	__u8 node_id;
 };
 
+#define PORT_BLOCK_MAX 32768
+#define DETERMINISTIC_BITS_MAX 24
+/* In milliseconds. See bib_config.sync_interval. */
+#define SYNC_INTERVAL_MAX (3600 * 1000)
+
 /* This has to be <= 32. */
 #define JOOLD_MULTICAST_GROUP 30
 #define JOOLD_MAX_PAYLOAD 2048
+/*
+ * Packets are numbered with 16 bits, so the window needs to be way smaller than
+ * that for old ACKs to be told apart from new ones.
+ */
+#define JOOLD_MAX_WINDOW 1024
 
 struct joold_config {
 	/** Is joold enabled on this Jool instance? */
@@ -612,9 +1194,10 @@ struct joold_config {
 	 *        (Note: In theory, this might be more often than it seems.
 	 *        It's not whenever a connection is initiated;
 	 *        it's on every translated packet except ICMP errors.
-	 *        In practice however, flushes are prohibited until the next
-	 *        ACK (otherwise joold quickly saturates the kernel), so
-	 *        sessions will end up queuing up even in this mode.)
+	 *        In practice however, flushes are prohibited while @window
+	 *        packets are awaiting their ACKs (otherwise joold quickly
+	 *        saturates the kernel), so sessions will end up queuing up
+	 *        even in this mode.)
 	 *        This is the preferred method in active scenarios.
 	 * false: Wait until we have enough sessions to fill a packet before
 	 *        sending them.
@@ -656,10 +1239,133 @@ struct joold_config {
 	 * code. (I guess I'm missing something.)
 	 */
 	__u16 max_payload;
+
+	/**
+	 * Maximum number of packets that can be sent to the daemon before it
+	 * acknowledges them. 1 is stop-and-wait.
+	 */
+	__u16 window;
+
+	/**
+	 * true:  Send sessions in the compact (variable length) encoding,
+	 *        which only the newer Jools understand.
+	 * false: Send them as fixed 64-byte records, like the older Jools.
+	 * Jool always accepts both, so enable this once every instance in the
+	 * cluster has been upgraded.
+	 */
+	config_bool compact;
+
+	/**
+	 * Maximum number of sessions per advertisement packet.
+	 * 0 means as many as fit in @max_payload.
+	 */
+	__u32 advertise_chunk;
+	/**
+	 * Maximum number of sessions advertised per second.
+	 * 0 means unlimited.
+	 */
+	__u32 advertise_rate;
+};
+
+/**
+ * Optional payload of a joold OP_ADVERTISE message. A daemon that notices some
+ * of a peer's messages got lost uses it to ask for the sessions that might have
+ * been in them, instead of the whole table.
+ */
+struct joold_adv_request {
+	/**
+	 * Only advertise the sessions updated during the last @window
+	 * milliseconds. Zero (or no payload at all) means all of them.
+	 */
+	__be32 window;
+};
+
+/**
+ * Payload of a joold OP_BIND message. Has the module send and receive the
+ * sessions through a UDP socket of its own, instead of the daemon's.
+ */
+struct joold_bind_request {
+	/**
+	 * AF_INET or AF_INET6. Zero drops the socket, and joold goes back to
+	 * multicasting the sessions to the daemon.
+	 */
+	__u8 family;
+	/** Set SO_REUSEADDR on the socket? */
+	config_bool reuseaddr;
+	/** Multicast TTL/hop limit. Zero means the kernel's default. */
+	__u8 ttl;
+	__u8 reserved;
+	/** UDP port, both bound and sent to. */
+	__be16 port;
+	__u16 reserved2;
+	/** Multicast interfaces; zero lets the kernel choose. */
+	__u32 in_ifindex;
+	__u32 out_ifindex;
+	/** Where the sessions are sent. Joined if multicast. */
+	union {
+		struct in_addr v4;
+		struct in6_addr v6;
+	} addr;
+};
+
+/** Payload of an OP_ADVERTISE_END message. */
+struct joold_adv_end {
+	/** Number of sessions the advertisement contained. */
+	__be64 sessions;
+};
+
+/**
+ * Response to a joold OP_DISPLAY: how far along the synchronization is.
+ * The times are in milliseconds ago.
+ */
+struct joold_status_usr {
+	/** Sessions received from the peers since the instance was created. */
+	__u64 sessions_received;
+	/** Session messages received from the peers. */
+	__u64 messages_received;
+	/** Time of the last of them. Meaningless if @messages_received is 0. */
+	__u64 last_received;
+
+	/** Peers that finished advertising their tables to us. */
+	__u64 advertisements_received;
+	/** Sessions the last of those advertisements contained. */
+	__u64 advertised_sessions;
+	/**
+	 * Time the last of those advertisements finished. Meaningless if
+	 * @advertisements_received is 0.
+	 */
+	__u64 last_advertisement;
+
+	/** Sessions our own advertisement has sent so far. */
+	__u64 adv_sent;
+	/** (Approximate) sessions our own advertisement will send. */
+	__u64 adv_total;
+
+	/** Sessions waiting to be sent to the peers. */
+	__u32 queued;
+	/** Messages sent to the daemon whose ACKs haven't arrived yet. */
+	__u32 in_flight;
+	config_bool enabled;
+	/** Is our own advertisement still in progress? */
+	config_bool advertising;
 };
 
 struct fragdb_config {
 	__u32 ttl;
+	/**
+	 * Once the reassembly buffers hold more than this many bytes (skb
+	 * truesize), the oldest ones are dropped until they are back down to
+	 * @low_thresh.
+	 * 0 means unlimited.
+	 */
+	__u32 high_thresh;
+	__u32 low_thresh;
+	/**
+	 * true: Translate fragments as they arrive, with the addresses learned
+	 *       from the first one, instead of waiting for the whole packet.
+	 * false: Reassemble packets before translating them.
+	 */
+	config_bool virtual_reassembly;
 };
 
 struct full_config {
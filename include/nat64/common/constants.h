@@ -19,6 +19,13 @@
  * lifetime of UDP bindings, in seconds. We use it as the actual default value.
  */
 #define UDP_DEFAULT (5 * 60)
+/**
+ * Minimum and default lifetimes of the UDP sessions that match
+ * --udp-short-ports, in seconds. (Not an RFC thing; the RFC only knows about
+ * long-lived UDP.)
+ */
+#define UDP_SHORT_MIN 2
+#define UDP_SHORT_DEFAULT 10
 /**
  * Established connection idle timeout (in seconds).
  * In other words, the tolerance time for established and healthy TCP sessions.
@@ -32,6 +39,12 @@
  * soon.
  */
 #define TCP_TRANS (4 * 60)
+/**
+ * Default lifetime of the TCP sessions that are already closed (they saw a RST
+ * or both FINs), in seconds. Zero means they just get TCP_TRANS. (Not an RFC
+ * thing; the RFC lumps them together with the other transitory sessions.)
+ */
+#define TCP_CLOSED_DEFAULT 0
 /**
  * Timeout of TCP sessions started from v4 which we're skeptical as to whether
  * they are going to make it to the established state.
@@ -45,6 +58,13 @@
 
 /** Default time interval fragments are allowed to arrive in. In seconds. */
 #define FRAGMENT_MIN (2)
+/**
+ * Default memory limits of the fragment database, in bytes. (Same as the
+ * kernel's ipfrag_high_thresh and ipfrag_low_thresh.)
+ */
+#define DEFAULT_FRAG_HIGH_THRESH (4 * 1024 * 1024)
+#define DEFAULT_FRAG_LOW_THRESH (3 * 1024 * 1024)
+#define DEFAULT_FRAG_VIRTUAL false
 
 /*
  * The timers will never sleep less than this amount of jiffies. This is because
@@ -70,21 +90,40 @@
 #define DEFAULT_FILTER_ICMPV6_INFO false
 #define DEFAULT_DROP_EXTERNAL_CONNECTIONS false
 #define DEFAULT_MAX_STORED_PKTS 10
+#define DEFAULT_MAX_STORED_BYTES (64 * 1024)
+#define DEFAULT_STATELESS_SO false
+#define DEFAULT_MAX_SESSIONS 0
+#define DEFAULT_SUBSCRIBER_PLEN 0
+#define DEFAULT_SUBSCRIBER_MAX 0
+#define DEFAULT_PORT_BLOCK_SIZE 0
+#define DEFAULT_DETERMINISTIC_BITS 0
+#define DEFAULT_POOL4_BALANCE false
+#define DEFAULT_SS_NODE_COUNT 1
+#define DEFAULT_SS_NODE_ID 0
 #define DEFAULT_SRC_ICMP6ERRS_BETTER false
 #define DEFAULT_F_ARGS 0b1011
+#define DEFAULT_F_ALGORITHM F_ALGORITHM_MD5
 #define DEFAULT_HANDLE_FIN_RCV_RST false
 #define DEFAULT_BIB_LOGGING false
 #define DEFAULT_SESSION_LOGGING false
+#define DEFAULT_LOGGING_STREAM false
 
 #define DEFAULT_INSTANCE_ENABLED true
 #define DEFAULT_RESET_TRAFFIC_CLASS false
 #define DEFAULT_RESET_TOS false
 #define DEFAULT_NEW_TOS 0
+#define DEFAULT_DEBUG false
+#define DEFAULT_LATENCY_SAMPLING 0
+#define DEFAULT_MIRROR_SAMPLING 0
+#define DEFAULT_PACKET_BUDGET 0
+#define DEFAULT_CPS_BUDGET 0
+#define DEFAULT_MSS_CLAMP 0
 #define DEFAULT_COMPUTE_UDP_CSUM0 false
 #define DEFAULT_EAM_HAIRPIN_MODE EAM_HAIRPIN_INTRINSIC
 #define DEFAULT_RANDOMIZE_RFC6791 true
 #define DEFAULT_USE_RFC6791V6_PREFIX false
 #define DEFAULT_RFC6791V6_PREFIX NULL
+#define DEFAULT_CLAT false
 #define DEFAULT_MTU_PLATEAUS { 65535, 32000, 17914, 8166, 4352, 2002, 1492, \
 		1006, 508, 296, 68 }
 #define DEFAULT_JOOLD_ENABLED false
@@ -97,6 +136,11 @@
  * This means we can fit 22 sessions per packet. (Regardless of IPv4/IPv6)
  */
 #define DEFAULT_JOOLD_MAX_PAYLOAD 1452
+#define DEFAULT_JOOLD_WINDOW 1
+#define DEFAULT_JOOLD_COMPACT false
+#define DEFAULT_JOOLD_RESYNC_INTERVAL 0
+#define DEFAULT_JOOLD_ADVERTISE_CHUNK 0
+#define DEFAULT_JOOLD_ADVERTISE_RATE 0
 
 /* -- IPv6 Pool -- */
 
@@ -0,0 +1,40 @@
+#ifndef _JOOL_COMMON_POLICY_H
+#define _JOOL_COMMON_POLICY_H
+
+/**
+ * @file
+ * The contract between the NAT64 and the BPF programs attached through
+ * `jool --bib --update --policy` (see mod/stateful/bib/policy.c), so they can
+ * be written without Jool's other headers.
+ *
+ * The program is a BPF_PROG_TYPE_SOCKET_FILTER. It runs on every IPv6 packet
+ * that reaches the BIB/session lookup (so not on the ones the offload cache
+ * translates), before any BIB entry or session is created for it. It can read
+ * the packet (which starts at the IPv6 header), and the __sk_buff's cb array
+ * holds the incoming tuple's layer-4 information, so the program doesn't have
+ * to walk extension headers or ICMP errors to find it:
+ */
+
+/** enum l4_protocol of the tuple; one of JOOL_POLICY_PROTO_*. */
+#define JOOL_POLICY_CB_PROTO 0
+/** Source port (TCP, UDP) or ICMP identifier. Host byte order. */
+#define JOOL_POLICY_CB_SRC_PORT 1
+/** Destination port (TCP, UDP) or ICMP identifier. Host byte order. */
+#define JOOL_POLICY_CB_DST_PORT 2
+
+#define JOOL_POLICY_PROTO_TCP 0
+#define JOOL_POLICY_PROTO_UDP 1
+#define JOOL_POLICY_PROTO_ICMP 2
+
+/*
+ * Return values. Anything else also lets the packet through, and becomes its
+ * mark before pool4 is queried; that's how a program assigns subscribers to
+ * mark-specific pool4 entries.
+ */
+
+/** Drop the packet; it doesn't get a BIB entry or a session. */
+#define JOOL_POLICY_DENY 0
+/** Translate the packet as usual, mark untouched. */
+#define JOOL_POLICY_ALLOW 1
+
+#endif /* _JOOL_COMMON_POLICY_H */
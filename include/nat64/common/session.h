@@ -1,6 +1,8 @@
 #ifndef _JOOL_COMMON_SESSION_H
 #define _JOOL_COMMON_SESSION_H
 
+#include "nat64/common/types.h"
+
 /** The states from the TCP state machine; RFC 6146 section 3.5.2. */
 typedef enum tcp_state {
 	/**
@@ -38,4 +40,63 @@ typedef enum tcp_state {
 	TRANS,
 } tcp_state;
 
+/**
+ * Subset of fields from struct session_entry which need to be synchronized
+ * across Jool instances.
+ *
+ * It's also the record format of `jool --session --export`, so changing it
+ * breaks both joold compatibility and the already exported files.
+ *
+ * Note: Careful with the layout of this structure! It's currently padded and
+ * packed to fit in exactly 64 bytes.
+ * http://www.catb.org/esr/structure-packing/
+ */
+struct joold_session {
+
+	/**
+	 * This is not actually the same as session_entry->update_time.
+	 * session_entry->update_time is the time at which the session was last
+	 * updated.
+	 * This update_time is the age of the session's last update.
+	 * We do this so we don't have to ask the user to synchronize clocks.
+	 * (We're assuming the session will travel to the other Jools
+	 * instantaneously.)
+	 *
+	 * Also, session->entry->update time is measured in jiffies.
+	 * This one is measured in milliseconds.
+	 */
+	__be64 update_time;
+
+	/* Exactly 8 bytes so far. */
+
+	struct in6_addr src6_addr;
+	struct in6_addr dst6_addr;
+	struct in_addr src4_addr;
+	struct in_addr dst4_addr;
+	__be16 src6_port;
+	__be16 dst6_port;
+	__be16 src4_port;
+	__be16 dst4_port;
+
+	/*
+	 * Exactly 56 bytes so far.
+	 * Notice that the following can be compressed further but there's no
+	 * point currently.
+	 */
+
+	__u8 l4_proto;
+	__u8 state;
+	/* See session_timer_type. */
+	__u8 timer_type;
+
+	/* Exactly 59 bytes so far. */
+
+	/**
+	 * Forces sizeof(struct joold_session) to be exacly 64 bytes.
+	 * If not present, sizeof yields me 60 in a 32-bit machine and 64 in a
+	 * 64-bit machine, which breaks compatibility.
+	 */
+	__u8 padding[5];
+};
+
 #endif /* _JOOL_COMMON_SESSION_H */
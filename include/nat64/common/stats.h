@@ -0,0 +1,192 @@
+#ifndef _JOOL_COMMON_STATS_H
+#define _JOOL_COMMON_STATS_H
+
+/**
+ * @file
+ * Jool's own counters, as seen by both the kernel module and `--stats`.
+ *
+ * The kernel's SNMP counters (see nat64/mod/common/stats.h) are still
+ * increased, but they can only say "INDISCARDS"; these ones tell why.
+ *
+ * Because userspace receives them as an array indexed by this enum, new
+ * counters have to be appended at the end.
+ */
+
+#include <linux/types.h>
+
+enum jool_stat_id {
+	/** Packets Jool received (and which had a translator to handle them). */
+	JSTAT_RECEIVED6,
+	JSTAT_RECEIVED4,
+	/** Packets translated and sent. */
+	JSTAT_SUCCESS,
+
+	/** Packets whose headers were truncated or otherwise malformed. */
+	JSTAT_MALFORMED,
+	/** Packets returned to the kernel because they weren't meant for us. */
+	JSTAT_POOL6_MISMATCH,
+	JSTAT_POOL4_MISMATCH,
+	/** Packets returned to the kernel because an address has no mapping. */
+	JSTAT_UNTRANSLATABLE_ADDR,
+
+	/* NAT64 filtering. */
+	JSTAT_HAIRPIN_LOOP,
+	JSTAT_ICMP6_FILTER,
+	JSTAT_MASK_DOMAIN_NOT_FOUND,
+	JSTAT_POOL4_EXHAUSTED,
+	JSTAT_SUBSCRIBER_LIMIT,
+	JSTAT_BIB4_NOT_FOUND,
+	JSTAT_ADF,
+	JSTAT_BIB_ERROR,
+
+	/* Fragments. */
+	JSTAT_FRAG_TIMEOUT,
+	JSTAT_FRAG_EVICTED,
+
+	/* Translation and sending. */
+	JSTAT_BAD_CHECKSUM,
+	JSTAT_FAILED_ROUTES,
+	JSTAT_PKT_TOO_BIG,
+
+	/*
+	 * ICMP errors suppressed by the rate limit, per error type. (See
+	 * icmp_wrapper.c.) Same order as enum icmp_error_code, minus the
+	 * silent one.
+	 */
+	JSTAT_ICMP_LIMITED_ADDR_UNREACHABLE,
+	JSTAT_ICMP_LIMITED_PORT_UNREACHABLE,
+	JSTAT_ICMP_LIMITED_PROTO_UNREACHABLE,
+	JSTAT_ICMP_LIMITED_HOP_LIMIT,
+	JSTAT_ICMP_LIMITED_FRAG_NEEDED,
+	JSTAT_ICMP_LIMITED_HDR_FIELD,
+	JSTAT_ICMP_LIMITED_SRC_ROUTE,
+	JSTAT_ICMP_LIMITED_FILTER,
+
+	/** Packets that skipped the session table thanks to the offload cache. */
+	JSTAT_OFFLOADED,
+	/** Idle sessions evicted because the kernel ran short on memory. */
+	JSTAT_SESSIONS_RECLAIMED,
+	/** IPv6 packets the BIB policy program dropped. */
+	JSTAT_POLICY_DENY,
+	/** Packets dropped because they exceeded --packet-budget. */
+	JSTAT_BUDGET_PACKETS,
+	/** New connections dropped because they exceeded --cps-budget. */
+	JSTAT_BUDGET_CPS,
+
+	/* Not a counter; keep it last. */
+	JSTAT_COUNT,
+};
+
+/**
+ * The stages of the translation pipeline whose latency can be measured. (See
+ * --latency-sampling.) The first three only exist in NAT64.
+ */
+enum jool_stage {
+	JSTAGE_DETERMINE_TUPLE,
+	JSTAGE_FILTERING,
+	JSTAGE_COMPUTE_TUPLE,
+	JSTAGE_TRANSLATE,
+	JSTAGE_SEND,
+
+	/* Not a stage; keep it last. */
+	JSTAGE_COUNT,
+};
+
+/**
+ * Bucket n of a latency histogram counts the samples that took
+ * [2^n, 2^(n+1)) CPU cycles. (Bucket 0 also gets the zeroes.) The last one also
+ * takes everything slower.
+ */
+#define JSTAT_LATENCY_BUCKETS 32
+
+/**
+ * The NAT64 session histograms, meant for picking the session timeouts.
+ * (They are indexed by enum jool_session_hist and then by l4_protocol.)
+ */
+enum jool_session_hist {
+	/**
+	 * How long sessions lived, from creation to removal. Only sessions
+	 * that were counted (see the session_counters module parameter)
+	 * contribute, since the others don't remember when they were born.
+	 */
+	JHIST_LIFETIME,
+	/**
+	 * The time between the packets that refreshed a session. Refreshes
+	 * that refresh_granularity skips don't reset the clock, so gaps shorter
+	 * than it are overestimated.
+	 */
+	JHIST_IDLE,
+
+	/* Not a histogram; keep it last. */
+	JHIST_COUNT,
+};
+
+/**
+ * Bucket n of a session histogram counts the samples that lasted
+ * [2^n, 2^(n+1)) milliseconds. (Bucket 0 also gets the zeroes.)
+ */
+#define JSTAT_SESSION_BUCKETS 32
+
+/**
+ * What the module's memory is being spent on. (See wkmalloc.h.) These are
+ * module-wide; allocations don't know which instance they belong to.
+ */
+enum jool_mem_class {
+	/** BIB entries. */
+	JMEM_BIB,
+	/** Sessions. */
+	JMEM_SESSION,
+	/** pool4's tables, snapshots and mark indexes. */
+	JMEM_POOL4,
+	/** Reassembly buffers and virtual reassembly flows. */
+	JMEM_FRAGMENT,
+	/** Sessions waiting to be synchronized by joold. */
+	JMEM_JOOLD,
+	/** rtrie chunks and multibit tries. (The EAMT, mostly.) */
+	JMEM_TRIE,
+	/** Everything else. */
+	JMEM_OTHER,
+
+	/* Not a class; keep it last. */
+	JMEM_COUNT,
+};
+
+/** TCP, UDP and ICMP. (Indexes the table counts by l4_protocol.) */
+#define JSTAT_PROTOS 3
+
+/** What the kernel responds to a `MODE_STATS`/`OP_DISPLAY` request. */
+struct jool_stats_usr {
+	__u64 counters[JSTAT_COUNT];
+	__u64 latency[JSTAGE_COUNT][JSTAT_LATENCY_BUCKETS];
+	/** Objects and bytes currently allocated, per enum jool_mem_class. */
+	__u64 mem_objects[JMEM_COUNT];
+	__u64 mem_bytes[JMEM_COUNT];
+	/**
+	 * NAT64 only: the BIB entries, sessions and evicted sessions of each
+	 * protocol, so monitors don't need a `--count` request per table.
+	 */
+	__u64 bibs[JSTAT_PROTOS];
+	__u64 sessions[JSTAT_PROTOS];
+	__u64 evicted[JSTAT_PROTOS];
+	/** NAT64 only. */
+	__u64 session_hist[JHIST_COUNT][JSTAT_PROTOS][JSTAT_SESSION_BUCKETS];
+};
+
+/**
+ * The layout of the stats page. (/proc/net/jool or /proc/net/jool_siit; see
+ * nat64/mod/common/stats_page.h.)
+ *
+ * @seq is odd while the module is writing the page. To get a consistent copy,
+ * read @seq, issue a read barrier, copy the rest, issue another read barrier,
+ * and start over if @seq was odd or has changed since.
+ */
+struct jool_stats_page {
+	__u32 seq;
+	/** sizeof(struct jool_stats_page), so readers can notice mismatches. */
+	__u32 size;
+	/** Wall clock time of the last refresh, in nanoseconds since the epoch. */
+	__u64 timestamp;
+	struct jool_stats_usr stats;
+};
+
+#endif /* _JOOL_COMMON_STATS_H */
@@ -0,0 +1,81 @@
+#ifndef _JOOL_COMMON_XDP_H
+#define _JOOL_COMMON_XDP_H
+
+/**
+ * @file
+ * The maps shared between the SIIT XDP program (mod/xdp/siit.c) and
+ * `jool_siit --xdp --update`, which fills them out of the kernel module's
+ * current configuration (pool6, EAMT, blacklist, the namespace's interface
+ * addresses and a few globals).
+ *
+ * The program only handles the easy cases: plain TCP and UDP, no fragments,
+ * no options or extension headers, a /96 pool6 prefix, and a route the FIB
+ * can resolve to a neighbor. Everything else is passed to the stack, where
+ * the kernel module translates it as usual. So the maps don't have to be
+ * complete; a missing entry means "slow path", not "drop".
+ *
+ * The maps are pinned by iproute2 (`ip link set dev X xdp obj siit.o sec xdp`)
+ * in XDP_PIN_DIR.
+ */
+
+#include <linux/types.h>
+
+#define XDP_PIN_DIR "/sys/fs/bpf/tc/globals"
+
+#define XDP_MAP_CONFIG "jool_config"
+#define XDP_MAP_EAMT6 "jool_eamt6"
+#define XDP_MAP_EAMT4 "jool_eamt4"
+#define XDP_MAP_BLACKLIST4 "jool_blacklist4"
+#define XDP_MAP_LOCAL4 "jool_local4"
+
+#define XDP_EAMT_MAX 4096
+#define XDP_BLACKLIST_MAX 1024
+#define XDP_LOCAL4_MAX 1024
+
+/** The (only) value of the XDP_MAP_CONFIG array. */
+struct xdp_config {
+	/** Nothing is translated while this is zero. */
+	__u8 enabled;
+	/** Nonzero if @pool6 is meaningful. (It's always a /96.) */
+	__u8 pool6_set;
+	__u8 reset_traffic_class;
+	__u8 reset_tos;
+	__u8 new_tos;
+	__u8 pad[3];
+	/** Network byte order. Only the first 96 bits matter. */
+	__u32 pool6[4];
+};
+
+/** Key of XDP_MAP_EAMT6. (BPF_MAP_TYPE_LPM_TRIE format.) */
+struct xdp_key6 {
+	__u32 prefixlen;
+	__u32 addr[4];
+};
+
+/** Key of XDP_MAP_EAMT4 and XDP_MAP_BLACKLIST4. */
+struct xdp_key4 {
+	__u32 prefixlen;
+	__u32 addr;
+};
+
+/*
+ * XDP_MAP_LOCAL4 is a hash of the addresses the module refuses to translate
+ * because they belong to the namespace's interfaces (its own addresses and
+ * their broadcast addresses; see interface_contains()). The key is the address
+ * (network byte order), the value is an unused __u8.
+ */
+
+/**
+ * Value of both EAMT maps; the entry seen from the other side.
+ *
+ * The suffix lengths of both prefixes are always the same (EAMT rule), and
+ * never longer than 32 bits, so translating an address is a matter of keeping
+ * the last @suffix_len bits and replacing the rest.
+ */
+struct xdp_eam {
+	__u32 addr6[4];
+	__u32 addr4;
+	__u32 suffix_len;
+};
+
+#endif /* _JOOL_COMMON_XDP_H */
@@ -75,10 +75,35 @@ static inline int ipv4_addr_cmp(const struct in_addr *a1, const struct in_addr *
 	return memcmp(a1, a2, sizeof(struct in_addr));
 }
 
-int taddr6_compare(const struct ipv6_transport_addr *a1,
-		const struct ipv6_transport_addr *a2);
-int taddr4_compare(const struct ipv4_transport_addr *a1,
-		const struct ipv4_transport_addr *a2);
+/*
+ * These two are the comparators of the BIB and session trees, so they run on
+ * every node visit. They're inline so the rbtree.h macros can flatten them
+ * into the search loops.
+ */
+
+static inline int taddr6_compare(const struct ipv6_transport_addr *a1,
+		const struct ipv6_transport_addr *a2)
+{
+	int gap;
+
+	gap = ipv6_addr_cmp(&a1->l3, &a2->l3);
+	if (gap)
+		return gap;
+
+	return ((int)a1->l4) - ((int)a2->l4);
+}
+
+static inline int taddr4_compare(const struct ipv4_transport_addr *a1,
+		const struct ipv4_transport_addr *a2)
+{
+	int gap;
+
+	gap = ipv4_addr_cmp(&a1->l3, &a2->l3);
+	if (gap)
+		return gap;
+
+	return ((int)a1->l4) - ((int)a2->l4);
+}
 
 bool addr4_is_scope_subnet(const __be32 addr);
 bool prefix4_has_subnet_scope(struct ipv4_prefix *prefix,
@@ -5,6 +5,21 @@
 #include <linux/types.h>
 #include <linux/timer.h>
 
+/**
+ * The entries of one of the candidate's tables, exactly as userspace sent them.
+ * vmalloc()ed, because the table can be massive.
+ */
+struct candidate_list {
+	void *entries;
+	unsigned int count;
+	unsigned int capacity;
+	/**
+	 * Did userspace send this table at all? (An empty list means the table
+	 * has to be emptied; an unset one means it has to be left alone.)
+	 */
+	bool set;
+};
+
 /**
  * This represents the new configuration the user wants to apply to a certain
  * Jool instance.
@@ -20,15 +35,19 @@
  * In an ideal world, a configuration candidate would be a plain struct xlator,
  * but because of the way basic data types and the kref are handled, the
  * candidate needs a slightly different layout.
+ *
+ * The SIIT tables are not rebuilt, though. Their entries are only collected
+ * (see struct candidate_list), and the commit applies the difference between
+ * them and the running tables.
  */
 struct config_candidate {
 	struct full_config *global;
 	struct pool6 *pool6;
 	union {
 		struct {
-			struct eam_table *eamt;
-			struct addr4_pool *blacklist;
-			struct addr4_pool *pool6791;
+			struct candidate_list eamt;
+			struct candidate_list blacklist;
+			struct candidate_list pool6791;
 		} siit;
 		struct {
 			struct pool4 *pool4;
@@ -49,6 +68,9 @@ struct config_candidate {
 };
 
 struct xlator;
+struct pool6;
+struct eam_table;
+struct addr4_pool;
 
 struct config_candidate *cfgcandidate_alloc(void);
 void cfgcandidate_get(struct config_candidate *candidate);
@@ -56,6 +78,11 @@ void cfgcandidate_put(struct config_candidate *candidate);
 
 int atomconfig_add(struct xlator *jool, void *config, size_t config_len);
 
+struct pool6 *atomconfig_clone_pool6(struct pool6 *pool);
+struct eam_table *atomconfig_clone_eamt(struct eam_table *eamt);
+struct addr4_pool *atomconfig_clone_blacklist(struct addr4_pool *pool);
+struct addr4_pool *atomconfig_clone_pool6791(struct addr4_pool *pool);
+
 void cfgcandidate_print_refcount(struct config_candidate *candidate);
 
 #endif /* _JOOL_MOD_ATOMIC_CONFIG_H */
@@ -2,17 +2,27 @@
 #define _JOOL_MOD_CONFIG_H
 
 #include <linux/kref.h>
+#include <linux/rcupdate.h>
 #include "nat64/common/config.h"
 
+/**
+ * Never modified once published. Updates build a new one and swap it in
+ * (see xlator_set_global()), so a packet that reads the pointer once sees a
+ * consistent configuration for the rest of its translation.
+ */
 struct global_config {
 	struct global_config_usr cfg;
 	struct kref refcounter;
+	/** Used to drop the instance's reference after a grace period. */
+	struct rcu_head rcu;
 };
 
 struct global_config *config_alloc(void);
 void config_get(struct global_config *global);
 void config_put(struct global_config *global);
+void config_put_rcu(struct global_config *global);
 
 void config_copy(struct global_config_usr *from, struct global_config_usr *to);
+void config_debug_update(struct global_config *old, struct global_config *new);
 
 #endif /* _JOOL_MOD_CONFIG_H */
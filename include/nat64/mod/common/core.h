@@ -26,4 +26,16 @@ unsigned int core_6to4(struct sk_buff *skb, const struct net_device *dev);
  */
 unsigned int core_4to6(struct sk_buff *skb, const struct net_device *dev);
 
+/**
+ * Batched versions of core_6to4() and core_4to6(), for hooks that receive
+ * several packets at once. All of the packets are assumed to have been
+ * received by @dev.
+ *
+ * The packets Jool translates (or drops) are removed from @skbs. The ones it
+ * decides to leave alone (NF_ACCEPT) remain in @skbs, in their original order,
+ * so the caller can hand them over to the kernel normally.
+ */
+void core_6to4_list(struct sk_buff_head *skbs, const struct net_device *dev);
+void core_4to6_list(struct sk_buff_head *skbs, const struct net_device *dev);
+
 #endif /* _JOOL_MOD_CORE_H */
@@ -12,5 +12,7 @@
 
 bool is_hairpin(struct xlation *state);
 verdict handling_hairpinning(struct xlation *state);
+bool can_hairpin_directly(struct xlation *state);
+verdict handling_hairpinning_direct(struct xlation *state);
 
 #endif /* _JOOL_MOD_HARPINNING_H */
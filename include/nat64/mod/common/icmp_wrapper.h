@@ -30,13 +30,25 @@ typedef enum icmp_error_code {
 	ICMPERR_HDR_FIELD,
 	ICMPERR_SRC_ROUTE,
 	ICMPERR_FILTER,
+
+	/* Not an error; keep it last. */
+	ICMPERR_COUNT,
 } icmp_error_code;
 
+struct jool_stats;
+
 /**
  * Wrappers for icmp_send() and icmpv6_send().
+ *
+ * Each type of error is rate limited separately, by token buckets that belong
+ * to @stats' instance (one set per CPU, so they need no locking). The
+ * suppressed errors are counted by @stats. (See the icmp_rate and icmp_burst module
+ * parameters.) @stats NULL means unlimited.
  */
-void icmp64_send(struct packet *pkt, icmp_error_code code, __u32 info);
-void icmp64_send_skb(struct sk_buff *skb, icmp_error_code error, __u32 info);
+void icmp64_send(struct jool_stats *stats, struct packet *pkt,
+		icmp_error_code code, __u32 info);
+void icmp64_send_skb(struct jool_stats *stats, struct sk_buff *skb,
+		icmp_error_code error, __u32 info);
 
 /**
  * Return the numbers of icmp error that was sent, also reset the static counter
@@ -0,0 +1,32 @@
+#ifndef _JOOL_MOD_INGRESS_H
+#define _JOOL_MOD_INGRESS_H
+
+/**
+ * @file
+ * The alternative to the Netfilter PRE_ROUTING hooks: if the user lists
+ * interfaces in the "ingress" module argument, every instance hooks itself to
+ * those interfaces' ingress instead (NF_NETDEV_INGRESS). Packets get translated
+ * before the IP layer (and therefore conntrack, defrag and the remaining
+ * Netfilter traversal) ever sees them, and the instance ignores traffic coming
+ * from the other interfaces.
+ *
+ * Because the IP layer hasn't validated anything yet, the hook performs the
+ * sanity checks ip_rcv() and ipv6_rcv() would have. Anything Jool doesn't want
+ * continues up the stack normally.
+ *
+ * Needs Linux 4.13+ (where hooks became per-namespace) with
+ * CONFIG_NETFILTER_INGRESS.
+ */
+
+#include <net/net_namespace.h>
+
+struct ingress_hooks;
+
+int ingress_setup(void);
+void ingress_teardown(void);
+
+bool ingress_enabled(void);
+struct ingress_hooks *ingress_register(struct net *ns);
+void ingress_unregister(struct ingress_hooks *hooks);
+
+#endif /* _JOOL_MOD_INGRESS_H */
@@ -14,6 +14,42 @@
 #include <linux/ipv6.h>
 
 
+/**
+ * What the iterator knows about a header type. (See hdr6_classify().)
+ */
+enum hdr6_class {
+	/** Not an extension header the iterator can skip; the chain ends. */
+	HDR6_LAST = 0,
+	/** Hop-by-Hop, Routing or Destination Options; "hdrlen"-sized. */
+	HDR6_OPTIONS,
+	/** Fragment header; fixed size. */
+	HDR6_FRAGMENT,
+};
+
+/** Indexed by Next Header value. */
+extern const __u8 hdr6_classes[256];
+
+static inline enum hdr6_class hdr6_classify(__u8 nexthdr)
+{
+	return hdr6_classes[nexthdr];
+}
+
+/**
+ * The result of walking a header chain in one go. (See hdr6_walk().)
+ */
+struct hdr6_chain {
+	/** Type of the first header that is not an extension header. */
+	__u8 nexthdr;
+	/** Start of that header. */
+	void *l4;
+	/** The first Routing header, or NULL. */
+	void *routing;
+	/** The Fragment header, or NULL. */
+	void *frag;
+};
+
+int hdr6_walk(struct ipv6hdr *hdr6, void *end, struct hdr6_chain *chain);
+
 /**
  * An object that helps you traverse the IPv6 headers of a packet.
  */
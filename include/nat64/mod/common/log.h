@@ -7,15 +7,34 @@
  */
 #include <linux/kernel.h>
 #include <linux/printk.h>
+#include <linux/jump_label.h>
 #include "nat64/common/xlat.h"
 #include "nat64/mod/common/error_pool.h"
 
+/**
+ * Enabled while at least one instance has the "debug" global switched on.
+ * See config_debug_update().
+ */
+extern struct static_key jool_debug;
+
+/**
+ * Should the packet path bother with diagnostics (log_debug()s, packet
+ * snapshots)?
+ * This is a jump label, so while the key is off it costs a NOP, not a branch.
+ */
+#define debug_enabled() static_key_false(&jool_debug)
+
 /**
  * Messages to help us walk through a run. Also covers normal packet drops
  * (bad checksums, bogus addresses, etc) and some failed memory allocations
  * (because the kernel already prints those).
  */
-#define log_debug(text, ...) pr_debug("%s: " text "\n", xlat_get_name(), ##__VA_ARGS__)
+#define log_debug(text, ...) \
+	do { \
+		if (debug_enabled()) \
+			pr_debug("%s: " text "\n", xlat_get_name(), \
+					##__VA_ARGS__); \
+	} while (0)
 /**
  * Responses to events triggered by the user, which might not show signs of life
  * elsehow.
@@ -55,6 +74,9 @@
 	} while (0)
 
 #ifdef UNIT_TESTING
+/* Most unit tests don't link config.c, and they want to see everything. */
+#undef debug_enabled
+#define debug_enabled() true
 #undef log_err
 #define log_err(text, ...) pr_err("%s ERROR (%s): " text "\n", \
 		xlat_get_name(), __func__, ##__VA_ARGS__)
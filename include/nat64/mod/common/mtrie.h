@@ -0,0 +1,40 @@
+#ifndef _JOOL_MOD_MTRIE_H
+#define _JOOL_MOD_MTRIE_H
+
+/**
+ * @file
+ * A read-only multibit trie, for longest prefix matching from the packet path.
+ *
+ * The rtrie is pleasant to update, but a lookup walks one pointer (and very
+ * likely one cache miss) per bit of difference between keys, which adds up
+ * once tables grow to hundreds of thousands of entries. This one consumes the
+ * key a byte at a time instead (stride 8), and all of its nodes and values live
+ * in two contiguous arrays, so a lookup is a handful of array accesses: at most
+ * one per byte left after the prefix all the keys have in common.
+ *
+ * The price is that it can't be modified. It's built in one go out of a
+ * snapshot of the values, published via RCU, and thrown away as a whole when
+ * the set changes. Callers are expected to keep the authoritative copy in an
+ * rtrie and use this one as an index of it.
+ */
+
+#include <linux/types.h>
+#include "nat64/mod/common/rtrie.h"
+
+struct mtrie;
+
+/**
+ * Returns the key under which @value should be indexed. (@key->bytes should
+ * point to @value's own memory.)
+ */
+typedef void (*mtrie_key_fn)(void *value, struct rtrie_key *key);
+
+struct mtrie *mtrie_build(void *values, unsigned int count, size_t value_size,
+		unsigned int key_bytes, mtrie_key_fn get_key);
+void mtrie_destroy(struct mtrie *trie);
+
+/* Safe-to-use-during-packet-translation functions */
+
+void *mtrie_find(struct mtrie *trie, __u8 *addr);
+
+#endif /* _JOOL_MOD_MTRIE_H */
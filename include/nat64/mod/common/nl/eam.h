@@ -5,5 +5,7 @@
 #include "nat64/mod/common/xlator.h"
 
 int handle_eamt_config(struct xlator *jool, struct genl_info *info);
+int handle_eamt_dump(struct xlator *jool, struct sk_buff *skb,
+		struct netlink_callback *cb);
 
 #endif
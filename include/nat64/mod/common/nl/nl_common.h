@@ -8,4 +8,8 @@ int verify_superpriv(void);
 struct request_hdr *get_jool_hdr(struct genl_info *info);
 int validate_request_size(struct genl_info *info, size_t min_expected);
 
+struct nlattr *get_dump_attr(struct netlink_callback *cb);
+struct request_hdr *get_dump_hdr(struct netlink_callback *cb);
+int validate_dump_size(struct netlink_callback *cb, size_t min_expected);
+
 #endif
@@ -35,8 +35,18 @@ struct nlcore_buffer {
 	void *data;
 };
 
+/** Indexes of the family's multicast groups. */
+enum nlcore_group {
+	/** Sessions for the joold daemons. */
+	NLCORE_GROUP_JOOLD,
+	/** BIB/session logging records. (See bib/events.h.) */
+	NLCORE_GROUP_EVENTS,
+	NLCORE_GROUP_COUNT,
+};
+
+/** @new_groups is expected to be indexed by enum nlcore_group. */
 void nlcore_setup(struct genl_family *new_family,
-		struct genl_multicast_group *new_group);
+		struct genl_multicast_group *new_groups);
 /* There's no nlcore_teardown; just destroy the family yourself. */
 
 size_t nlbuffer_response_max_size(void);
@@ -57,4 +67,46 @@ int nlcore_respond(struct genl_info *info, int error);
 
 int nlcore_send_multicast_message(struct net *ns, struct nlcore_buffer *buffer);
 
+/**
+ * A multicast message whose payload is written straight into its skb, so it
+ * doesn't need an nlcore_buffer (and the copy that comes with it).
+ * Only works when the payload can be built incrementally. (ie. joold.)
+ */
+struct nlcore_mcast {
+	/** NULL means the message doesn't exist (yet or anymore). */
+	struct sk_buff *skb;
+	void *msg_head;
+	struct nlattr *attr;
+	/** Payload bytes that can still be written. */
+	size_t room;
+};
+
+int nlcore_mcast_init(struct nlcore_mcast *msg, struct request_hdr *hdr,
+		size_t capacity);
+void *nlcore_mcast_reserve(struct nlcore_mcast *msg, size_t size);
+void *nlcore_mcast_data(struct nlcore_mcast *msg, size_t *len);
+int nlcore_mcast_send(struct net *ns, struct nlcore_mcast *msg);
+int nlcore_mcast_send_group(struct net *ns, struct nlcore_mcast *msg,
+		enum nlcore_group group);
+void nlcore_mcast_clean(struct nlcore_mcast *msg);
+
+/**
+ * Dumps (NLM_F_DUMP requests) are answered by filling the skbs the kernel
+ * hands to our dumpit callback, one buffer per skb, until the callback
+ * returns zero. These are the possible states of netlink_callback.args[0].
+ * (The rest of the args are the handlers' to keep their cursors in.)
+ */
+enum nldump_state {
+	NLDUMP_START = 0,
+	NLDUMP_CONTINUE,
+	NLDUMP_DONE,
+};
+
+int nlbuffer_init_dump(struct nlcore_buffer *buffer, struct sk_buff *skb,
+		struct request_hdr *request);
+int nlbuffer_dump(struct sk_buff *skb, struct netlink_callback *cb,
+		struct nlcore_buffer *buffer);
+int nlcore_dump_error(struct sk_buff *skb, struct netlink_callback *cb,
+		struct request_hdr *request, int error_code);
+
 #endif
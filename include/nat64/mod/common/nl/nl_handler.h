@@ -14,5 +14,7 @@ int nlhandler_setup(void);
 void nlhandler_teardown(void);
 
 int handle_jool_message(struct sk_buff *skb, struct genl_info *info);
+int handle_joold_message(struct sk_buff *skb, struct genl_info *info);
+int handle_jool_dump(struct sk_buff *skb, struct netlink_callback *cb);
 
 #endif /* _JOOL_MOD_NL_HANDLER_H */
@@ -0,0 +1,9 @@
+#ifndef __NL_STATS_H__
+#define __NL_STATS_H__
+
+#include <net/genetlink.h>
+#include "nat64/mod/common/xlator.h"
+
+int handle_stats_request(struct xlator *jool, struct genl_info *info);
+
+#endif
@@ -233,6 +233,22 @@ struct pkt_snapshot {
 	unsigned int frags[SNAPSHOT_FRAGS_SIZE];
 };
 
+/**
+ * The skb metrics bug #247's report prints, when --debug is enabled.
+ *
+ * They used to live in every `struct packet`, which made translations drag
+ * four of these around (and a hairpin, eight) even though they are only ever
+ * written during debugging. Now there's one per CPU, and it describes the
+ * packet the CPU is currently translating. (Translation never sleeps and runs
+ * with bottom halves disabled, so nothing else can overwrite it meanwhile.)
+ */
+struct pkt_debug {
+	/** The skb, as it arrived to Jool. */
+	struct pkt_snapshot shot1;
+	/** The skb, right after pkt_init_ipv6(). */
+	struct pkt_snapshot shot2;
+};
+
 /**
  * We need to store packet metadata, so we encapsulate sk_buffs into this.
  *
@@ -300,10 +316,21 @@ struct packet {
 	 */
 	struct packet *original_pkt;
 
+	/**
+	 * IPv6 only. What pkt_init_ipv6() learned while walking the extension
+	 * headers, so the translator doesn't have to walk them again.
+	 * Offsets are from the network header.
+	 */
 	struct {
-		struct pkt_snapshot shot1;
-		struct pkt_snapshot shot2;
-	} debug;
+		/** Next Header value of the last header in the chain. */
+		__u8 nexthdr;
+		/** Offset of the first Routing header; zero if there is none. */
+		__u16 rt_offset;
+		/** The inner packet's @nexthdr. (If this is an ICMPv6 error.) */
+		__u8 inner_nexthdr;
+		/** Length of the inner packet's IPv6 header plus extensions. */
+		__u16 inner_l3hdr_len;
+	} ext6;
 };
 
 /**
@@ -322,6 +349,7 @@ static inline void pkt_fill(struct packet *pkt, struct sk_buff *skb,
 	pkt->hdr_frag = hdr_frag;
 	pkt->payload = payload;
 	pkt->original_pkt = original_pkt;
+	memset(&pkt->ext6, 0, sizeof(pkt->ext6));
 }
 
 /**
@@ -578,7 +606,11 @@ void pkt_print(struct packet *pkt);
 unsigned char *jskb_pull(struct sk_buff *skb, unsigned int len);
 unsigned char *jskb_push(struct sk_buff *skb, unsigned int len);
 
-void snapshot_record(struct pkt_snapshot *shot, struct sk_buff *skb);
-void snapshot_report(struct pkt_snapshot *shot, char *prefix);
+/*
+ * Only call these if debug_enabled(), and with bottom halves disabled.
+ */
+void pkt_debug_start(struct sk_buff *skb);
+void pkt_debug_mid(struct sk_buff *skb);
+void pkt_debug_report(void);
 
 #endif /* _JOOL_MOD_PACKET_H */
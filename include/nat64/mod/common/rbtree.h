@@ -6,6 +6,11 @@
  * This is just some convenience additions to the kernel's Red-Black Tree
  * implementation.
  * I'm sorry it's a macro maze, but the alternative is a lot of redundant code.
+ *
+ * The macros also mean that the comparison functions are called directly, and
+ * can be inlined into the search loop, as long as they're visible to the
+ * caller. So please don't hand them function pointers, and keep the
+ * comparators static (or static inline, if they're shared).
  */
 
 #include <linux/rbtree.h>
@@ -132,6 +137,12 @@ void treeslot_init(struct tree_slot *slot,
 		struct rb_node *entry);
 /** Adds @slot's node to the tree. Also rebalances while it's at it. */
 void treeslot_commit(struct tree_slot *slot);
+/**
+ * Same as treeslot_commit(), except the node is published in a way that
+ * ensures concurrent lockless (RCU + seqcount validated) readers never see it
+ * half-initialized.
+ */
+void treeslot_commit_rcu(struct tree_slot *slot);
 
 /**
  * rbtree_find_node - Similar to rbtree_find(), except if it doesn't find the
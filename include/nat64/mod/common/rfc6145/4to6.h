@@ -36,4 +36,8 @@ verdict ttp46_tcp(struct xlation *state);
  */
 verdict ttp46_udp(struct xlation *state);
 
+verdict ttp46_siit_addrs(struct xlation *state, bool hairpin,
+		__be32 saddr, __be32 daddr,
+		struct in6_addr *saddr6, struct in6_addr *daddr6);
+
 #endif /* _JOOL_MOD_RFC6145_4TO6_H */
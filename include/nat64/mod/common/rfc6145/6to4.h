@@ -11,6 +11,9 @@
 
 #include "nat64/mod/common/translation_state.h"
 
+int ttp64_setup(void);
+void ttp64_teardown(void);
+
 /**
  * Creates in "state->out.skb" a packet which other functions will fill with the
  * IPv4 version of the IPv6 packet "state->in.skb".
@@ -37,7 +40,9 @@ verdict ttp64_tcp(struct xlation *state);
  */
 verdict ttp64_udp(struct xlation *state);
 
+verdict ttp64_siit_addrs(struct xlation *state, __be32 *saddr, __be32 *daddr,
+		bool *hairpin);
 __u8 ttp64_xlat_tos(struct global_config_usr *config, struct ipv6hdr *hdr);
-__u8 ttp64_xlat_proto(struct ipv6hdr *hdr);
+__u8 ttp64_xlat_proto(struct packet *in);
 
 #endif /* _JOOL_MOD_RFC6145_6TO4_H */
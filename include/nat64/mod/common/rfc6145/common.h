@@ -47,6 +47,23 @@ struct translation_steps {
 	 *
 	 * -----------------------------
 	 *
+	 * That said, copying the payload is the most expensive part of the
+	 * translation, so the workaround from reason 1 is implemented for the
+	 * common case (ie. unfragmented TCP and UDP; see
+	 * ttpcomm_can_xlat_in_place()): This function only allocates room for
+	 * the translated headers, and the payload stays in the incoming skb.
+	 * Once the packet is known to be routable and not too big,
+	 * ttpcomm_commit_in_place() replaces the incoming skb's headers with
+	 * the translated ones (skb_cow_head() takes care of reason 2), and that
+	 * skb is sent instead.
+	 *
+	 * When the translation can't happen in place, the incoming packet's
+	 * paged area (if any) is still not copied; the outgoing skb only gets a
+	 * linear area for the headers and whatever payload sits in the incoming
+	 * packet's linear area, and then references the same pages.
+	 *
+	 * -----------------------------
+	 *
 	 * When translating a fragment chain, this only creates the first
 	 * packet. Subsequent fragments are allocated by translate_subsequent().
 	 */
@@ -90,7 +107,16 @@ typedef enum addrxlat_verdict {
 struct translation_steps *ttpcomm_get_steps(struct packet *in);
 
 void partialize_skb(struct sk_buff *skb, unsigned int csum_offset);
+bool ttpcomm_hw_csum_usable(struct packet *pkt);
+__wsum ttpcomm_hw_csum(struct packet *pkt);
+void ttpcomm_clamp_mss(struct xlation *state, struct tcphdr *hdr);
 int copy_payload(struct xlation *state);
+bool ttpcomm_can_xlat_in_place(struct xlation *state);
+unsigned int ttpcomm_out_len(struct xlation *state);
+unsigned int ttpcomm_shared_len(struct xlation *state);
+void ttpcomm_share_payload(struct xlation *state, struct sk_buff *out);
+int ttpcomm_commit_in_place(struct xlation *state);
+verdict ttpcomm_abandon_in_place(struct xlation *state);
 bool will_need_frag_hdr(const struct iphdr *hdr);
 verdict ttpcomm_translate_inner_packet(struct xlation *state);
 
@@ -1,6 +1,7 @@
 #ifndef _JOOL_MOD_ROUTE_H
 #define _JOOL_MOD_ROUTE_H
 
+#include <net/flow.h>
 #include "nat64/mod/common/packet.h"
 
 struct route4_args {
@@ -39,6 +40,30 @@ struct dst_entry *route6(struct net *ns, struct packet *out);
  */
 struct dst_entry *route(struct net *ns, struct packet *pkt);
 
+/**
+ * The last route a batch of packets yielded, so the following packets can skip
+ * the lookup if they're headed to the same place.
+ * See core_6to4_list() and core_4to6_list().
+ */
+struct route_hint {
+	l3_protocol proto;
+	union {
+		struct flowi4 v4;
+		struct flowi6 v6;
+	} flow;
+	/** NULL means nothing is being remembered yet. */
+	struct dst_entry *dst;
+};
+
+void route_hint_init(struct route_hint *hint);
+void route_hint_clean(struct route_hint *hint);
+struct dst_entry *route_hinted(struct net *ns, struct packet *pkt,
+		struct route_hint *hint);
+
+int route_cache_setup(void);
+void route_cache_teardown(void);
+void route_cache_flush(struct net *ns);
+
 /**
  * Used when you want to send an ICMP error.
  */
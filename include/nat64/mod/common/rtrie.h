@@ -72,6 +72,18 @@ struct rtrie {
 	/** Size of the values being stored (in bytes). */
 	size_t value_size;
 
+	/**
+	 * The nodes are not allocated individually; they are carved out of
+	 * these page-sized chunks instead, and released along with them on
+	 * flush and clean. This keeps the trie compact and saves the per-node
+	 * slab overhead.
+	 */
+	struct list_head chunks;
+	/** Nodes that left the trie. They get reused before new ones. */
+	struct list_head free_nodes;
+	/** Size of every node, key or value included (in bytes). */
+	size_t node_size;
+
 	/**
 	 * Notice that this is a pointer.
 	 * Locking is actually the caller's responsibility; the only reason why
@@ -86,6 +98,7 @@ void rtrie_clean(struct rtrie *trie);
 /* Safe-to-use-during-packet-translation functions */
 
 int rtrie_find(struct rtrie *trie, struct rtrie_key *key, void *result);
+const void *rtrie_find_rcu(struct rtrie *trie, struct rtrie_key *key);
 bool rtrie_contains(struct rtrie *trie, struct rtrie_key *key);
 bool rtrie_is_empty(struct rtrie *trie);
 void rtrie_print(char *prefix, struct rtrie *trie);
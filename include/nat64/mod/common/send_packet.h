@@ -23,4 +23,12 @@
  */
 verdict sendpkt_send(struct xlation *state);
 
+/**
+ * Makes sendpkt_send() do everything except the actual sending, so the
+ * graybox's benchmark can measure the translator without the network.
+ *
+ * Only exists in `make benchmark` builds.
+ */
+void sendpkt_set_discard(bool enabled);
+
 #endif /* _JOOL_MOD_SEND_PACKET_H */
@@ -0,0 +1,37 @@
+#ifndef _JOOL_MOD_SKB_POOL_H
+#define _JOOL_MOD_SKB_POOL_H
+
+/**
+ * @file
+ * Per-CPU stashes of preallocated outgoing packets.
+ *
+ * When the incoming packet cannot be translated in place, the translator needs
+ * a new skb for the outgoing headers (the payload is normally referenced, not
+ * copied). Rather than hitting the slab and page allocators from softirq for
+ * every one of them, small skbs are taken from the current CPU's stash, which
+ * a work item tops up (with GFP_KERNEL) whenever it runs low.
+ *
+ * Requests the stash cannot satisfy (empty, or too big) fall back to a plain
+ * alloc_skb(), so the stash never changes the outcome; only the cost.
+ */
+
+#include <linux/skbuff.h>
+
+#ifndef UNIT_TESTING
+
+int skbpool_setup(void);
+void skbpool_teardown(void);
+
+struct sk_buff *skbpool_alloc(unsigned int size);
+
+#else
+
+/* The unit tests are not linked against skb_pool.o. */
+static inline struct sk_buff *skbpool_alloc(unsigned int size)
+{
+	return alloc_skb(size, GFP_ATOMIC);
+}
+
+#endif /* UNIT_TESTING */
+
+#endif /* _JOOL_MOD_SKB_POOL_H */
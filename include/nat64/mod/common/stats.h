@@ -9,6 +9,13 @@
  * those functions lacking argument validations.
  */
 
+#include <linux/jiffies.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/timex.h>
+#include "nat64/common/stats.h"
+#include "nat64/mod/common/icmp_wrapper.h"
 #include "nat64/mod/common/packet.h"
 
 /**
@@ -27,4 +34,196 @@ void inc_stats_skb4(struct sk_buff *skb, int field);
  * @}
  */
 
+/**
+ * @{
+ * Jool's own counters. (See nat64/common/stats.h.) One set per instance, with
+ * a copy per CPU, so increasing them costs neither atomics nor cache line
+ * bouncing. They are only added up when userspace asks for them.
+ */
+
+/** The things that only look at one out of every so many packets. */
+enum jstat_sampler {
+	/** --latency-sampling. */
+	JSAMPLE_LATENCY,
+	/** --mirror-sampling. */
+	JSAMPLE_MIRROR,
+
+	/* Not a sampler; keep it last. */
+	JSAMPLE_COUNT,
+};
+
+/** The --*-budget token buckets. */
+enum jstat_budget {
+	/** --packet-budget. */
+	JBUDGET_PACKETS,
+	/** --cps-budget. */
+	JBUDGET_CPS,
+
+	/* Not a budget; keep it last. */
+	JBUDGET_COUNT,
+};
+
+struct jstat_cpu {
+	unsigned long counters[JSTAT_COUNT];
+	unsigned long latency[JSTAGE_COUNT][JSTAT_LATENCY_BUCKETS];
+	unsigned long session_hist[JHIST_COUNT][JSTAT_PROTOS]
+			[JSTAT_SESSION_BUCKETS];
+	/** Packets left until the next sample, per enum jstat_sampler. */
+	unsigned int countdown[JSAMPLE_COUNT];
+	/** ICMP error rate limit; see icmp_wrapper.c. Indexed by error code. */
+	struct jstat_bucket {
+		/** Available errors, times HZ. */
+		u64 tokens;
+		/** jiffies of the last refill. */
+		unsigned long stamp;
+	} icmp[ICMPERR_COUNT];
+	/** Indexed by enum jstat_budget. */
+	struct jstat_bucket budget[JBUDGET_COUNT];
+};
+
+struct jool_stats {
+	struct jstat_cpu __percpu *cpu;
+	struct kref refs;
+};
+
+struct jool_stats *jstat_alloc(void);
+void jstat_get(struct jool_stats *stats);
+void jstat_put(struct jool_stats *stats);
+
+bool jstat_bucket_take(struct jstat_bucket *bucket, unsigned int rate,
+		unsigned int burst);
+
+#ifndef UNIT_TESTING
+
+static inline void jstat_inc(struct jool_stats *stats, enum jool_stat_id id)
+{
+	this_cpu_inc(stats->cpu->counters[id]);
+}
+
+static inline void jstat_add(struct jool_stats *stats, enum jool_stat_id id,
+		unsigned int addend)
+{
+	this_cpu_add(stats->cpu->counters[id], addend);
+}
+
+/**
+ * Returns true once every @rate calls (per CPU and @sampler), false otherwise.
+ * @rate zero means never.
+ *
+ * Assumes bottom halves are disabled.
+ */
+static inline bool jstat_sample(struct jool_stats *stats,
+		enum jstat_sampler sampler, unsigned int rate)
+{
+	unsigned int countdown;
+
+	if (likely(!rate))
+		return false;
+
+	countdown = __this_cpu_read(stats->cpu->countdown[sampler]);
+	if (countdown && countdown < rate) {
+		__this_cpu_write(stats->cpu->countdown[sampler], countdown - 1);
+		return false;
+	}
+
+	__this_cpu_write(stats->cpu->countdown[sampler], rate - 1);
+	return true;
+}
+
+/**
+ * Records the time that went by since @start in @stage's histogram. Returns
+ * the current time, so it can be used as the next stage's @start.
+ */
+static inline cycles_t jstat_latency(struct jool_stats *stats,
+		enum jool_stage stage, cycles_t start)
+{
+	cycles_t now = get_cycles();
+	unsigned int bucket;
+
+	bucket = ilog2((u64)(now - start) | 1);
+	if (bucket >= JSTAT_LATENCY_BUCKETS)
+		bucket = JSTAT_LATENCY_BUCKETS - 1;
+	this_cpu_inc(stats->cpu->latency[stage][bucket]);
+
+	return now;
+}
+
+/**
+ * Returns whether the current CPU can spend one more of @budget's tokens. @rate
+ * is tokens per second; zero means unlimited. Bursts of up to a tenth of a
+ * second's worth are allowed.
+ *
+ * Assumes bottom halves are disabled.
+ */
+static inline bool jstat_budget(struct jool_stats *stats,
+		enum jstat_budget budget, unsigned int rate)
+{
+	if (likely(!rate))
+		return true;
+	return jstat_bucket_take(this_cpu_ptr(&stats->cpu->budget[budget]),
+			rate, rate / 10);
+}
+
+/**
+ * Records a session sample that lasted @duration jiffies in @hist's @proto
+ * histogram.
+ */
+static inline void jstat_session(struct jool_stats *stats,
+		enum jool_session_hist hist, l4_protocol proto,
+		unsigned long duration)
+{
+	unsigned int bucket;
+
+	bucket = ilog2(jiffies_to_msecs(duration) | 1);
+	if (bucket >= JSTAT_SESSION_BUCKETS)
+		bucket = JSTAT_SESSION_BUCKETS - 1;
+	this_cpu_inc(stats->cpu->session_hist[hist][proto][bucket]);
+}
+
+#else
+
+/* Most unit tests build their xlators by hand, and don't care about these. */
+static inline void jstat_inc(struct jool_stats *stats, enum jool_stat_id id)
+{
+	/* No code. */
+}
+
+static inline void jstat_add(struct jool_stats *stats, enum jool_stat_id id,
+		unsigned int addend)
+{
+	/* No code. */
+}
+
+static inline bool jstat_sample(struct jool_stats *stats,
+		enum jstat_sampler sampler, unsigned int rate)
+{
+	return false;
+}
+
+static inline cycles_t jstat_latency(struct jool_stats *stats,
+		enum jool_stage stage, cycles_t start)
+{
+	return 0;
+}
+
+static inline bool jstat_budget(struct jool_stats *stats,
+		enum jstat_budget budget, unsigned int rate)
+{
+	return true;
+}
+
+static inline void jstat_session(struct jool_stats *stats,
+		enum jool_session_hist hist, l4_protocol proto,
+		unsigned long duration)
+{
+	/* No code. */
+}
+
+#endif
+
+void jstat_query(struct jool_stats *stats, struct jool_stats_usr *result);
+/**
+ * @}
+ */
+
 #endif /* _JOOL_MOD_STATS_H */
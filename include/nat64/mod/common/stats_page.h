@@ -0,0 +1,43 @@
+#ifndef _JOOL_MOD_STATS_PAGE_H
+#define _JOOL_MOD_STATS_PAGE_H
+
+/**
+ * @file
+ * The stats page: a copy of the instance's `--stats` response, refreshed every
+ * stats_page_interval milliseconds and published as /proc/net/jool (or
+ * /proc/net/jool_siit) in the instance's namespace.
+ *
+ * The file is meant to be mmap()ped read-only, so monitors can sample any
+ * number of instances without syscalls or netlink traffic. (read() works too,
+ * but then it's a syscall again.) See struct jool_stats_page for the layout
+ * and the reading protocol.
+ */
+
+#include <net/net_namespace.h>
+#include "nat64/common/stats.h"
+#include "nat64/mod/common/xlator.h"
+
+struct stats_page;
+
+void jstat_snapshot(struct xlator *jool, struct jool_stats_usr *result);
+
+#ifndef UNIT_TESTING
+
+struct stats_page *stats_page_alloc(struct net *ns);
+void stats_page_destroy(struct stats_page *page);
+
+#else
+
+/* The unit tests are not linked against stats_page.o, and have no procfs. */
+static inline struct stats_page *stats_page_alloc(struct net *ns)
+{
+	return NULL;
+}
+
+static inline void stats_page_destroy(struct stats_page *page)
+{
+}
+
+#endif /* UNIT_TESTING */
+
+#endif /* _JOOL_MOD_STATS_PAGE_H */
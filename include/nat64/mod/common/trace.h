@@ -0,0 +1,322 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM jool
+
+#if !defined(_JOOL_MOD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _JOOL_MOD_TRACE_H
+
+/**
+ * @file
+ * Static tracepoints. Unlike log_debug()s, these are available in production
+ * builds, and cost next to nothing while nobody is listening:
+ *
+ *	perf record -e 'jool:*' -a
+ *	bpftrace -e 'tracepoint:jool:jool_pool4_alloc { @[args->iterations] = count(); }'
+ *
+ * The TRACE_EVENT() boilerplate is instantiated once, by mod/common/trace.c.
+ */
+
+#include <linux/skbuff.h>
+#include <linux/tracepoint.h>
+#include "nat64/common/types.h"
+#include "nat64/mod/common/packet.h"
+#include "nat64/mod/common/types.h"
+
+#ifndef _JOOL_MOD_TRACE_ONCE
+#define _JOOL_MOD_TRACE_ONCE
+
+/** How many bytes of each header jool_mirror copies. */
+#define JOOL_MIRROR_LEN 64
+
+/**
+ * A packet picked by --mirror-sampling: the beginning of its network header,
+ * before and after translation. Filled by core.c.
+ */
+struct jool_mirror {
+	__u8 in[JOOL_MIRROR_LEN];
+	__u8 out[JOOL_MIRROR_LEN];
+	/** Bytes of @in and @out that were copied. (@out_len is 0 if none.) */
+	unsigned int in_len;
+	unsigned int out_len;
+	/** Lengths of the whole packets. */
+	unsigned int in_total;
+	unsigned int out_total;
+};
+
+#endif /* _JOOL_MOD_TRACE_ONCE */
+
+#ifndef UNIT_TESTING
+
+#define JOOL_TRACE_VERDICTS \
+	{ VERDICT_CONTINUE, "CONTINUE" }, \
+	{ VERDICT_DROP, "DROP" }, \
+	{ VERDICT_ACCEPT, "ACCEPT" }, \
+	{ VERDICT_STOLEN, "STOLEN" }
+
+#define JOOL_TRACE_PROTOS \
+	{ L4PROTO_TCP, "TCP" }, \
+	{ L4PROTO_UDP, "UDP" }, \
+	{ L4PROTO_ICMP, "ICMP" }, \
+	{ L4PROTO_OTHER, "other" }
+
+/* -- Pipeline -- */
+
+TRACE_EVENT(jool_xlat_start,
+	TP_PROTO(struct sk_buff *skb),
+	TP_ARGS(skb),
+	TP_STRUCT__entry(
+		__field(const void *, skbaddr)
+		__field(__u16, protocol)
+		__field(unsigned int, len)
+	),
+	TP_fast_assign(
+		__entry->skbaddr = skb;
+		__entry->protocol = ntohs(skb->protocol);
+		__entry->len = skb->len;
+	),
+	TP_printk("skbaddr=%p protocol=0x%04x len=%u", __entry->skbaddr,
+			__entry->protocol, __entry->len)
+);
+
+/* @skb might be gone by now, so it's only used as an ID. */
+TRACE_EVENT(jool_xlat_end,
+	TP_PROTO(struct sk_buff *skb, verdict result),
+	TP_ARGS(skb, result),
+	TP_STRUCT__entry(
+		__field(const void *, skbaddr)
+		__field(int, result)
+	),
+	TP_fast_assign(
+		__entry->skbaddr = skb;
+		__entry->result = result;
+	),
+	TP_printk("skbaddr=%p verdict=%s", __entry->skbaddr,
+			__print_symbolic(__entry->result, JOOL_TRACE_VERDICTS))
+);
+
+/*
+ * Only fired for the packets --mirror-sampling picks, and only while somebody
+ * is listening.
+ */
+TRACE_EVENT(jool_mirror,
+	TP_PROTO(const struct jool_mirror *mirror, verdict result),
+	TP_ARGS(mirror, result),
+	TP_STRUCT__entry(
+		__array(__u8, in, JOOL_MIRROR_LEN)
+		__array(__u8, out, JOOL_MIRROR_LEN)
+		__field(unsigned int, in_len)
+		__field(unsigned int, out_len)
+		__field(unsigned int, in_total)
+		__field(unsigned int, out_total)
+		__field(int, result)
+	),
+	TP_fast_assign(
+		memcpy(__entry->in, mirror->in, JOOL_MIRROR_LEN);
+		memcpy(__entry->out, mirror->out, JOOL_MIRROR_LEN);
+		__entry->in_len = mirror->in_len;
+		__entry->out_len = mirror->out_len;
+		__entry->in_total = mirror->in_total;
+		__entry->out_total = mirror->out_total;
+		__entry->result = result;
+	),
+	TP_printk("verdict=%s in=%u:%s out=%u:%s",
+			__print_symbolic(__entry->result, JOOL_TRACE_VERDICTS),
+			__entry->in_total,
+			__print_hex(__entry->in, __entry->in_len),
+			__entry->out_total,
+			__print_hex(__entry->out, __entry->out_len))
+);
+
+/* -- BIB and sessions -- */
+
+DECLARE_EVENT_CLASS(jool_bib,
+	TP_PROTO(const struct ipv6_transport_addr *src6,
+			const struct ipv4_transport_addr *src4,
+			l4_protocol proto),
+	TP_ARGS(src6, src4, proto),
+	TP_STRUCT__entry(
+		__array(__u8, addr6, 16)
+		__field(__u16, port6)
+		__array(__u8, addr4, 4)
+		__field(__u16, port4)
+		__field(int, proto)
+	),
+	TP_fast_assign(
+		memcpy(__entry->addr6, &src6->l3, 16);
+		__entry->port6 = src6->l4;
+		memcpy(__entry->addr4, &src4->l3, 4);
+		__entry->port4 = src4->l4;
+		__entry->proto = proto;
+	),
+	TP_printk("%pI6c#%u %pI4#%u %s", __entry->addr6, __entry->port6,
+			__entry->addr4, __entry->port4,
+			__print_symbolic(__entry->proto, JOOL_TRACE_PROTOS))
+);
+
+DEFINE_EVENT(jool_bib, jool_bib_add,
+	TP_PROTO(const struct ipv6_transport_addr *src6,
+			const struct ipv4_transport_addr *src4,
+			l4_protocol proto),
+	TP_ARGS(src6, src4, proto)
+);
+
+DEFINE_EVENT(jool_bib, jool_bib_rm,
+	TP_PROTO(const struct ipv6_transport_addr *src6,
+			const struct ipv4_transport_addr *src4,
+			l4_protocol proto),
+	TP_ARGS(src6, src4, proto)
+);
+
+DECLARE_EVENT_CLASS(jool_session,
+	TP_PROTO(const struct ipv6_transport_addr *src6,
+			const struct ipv6_transport_addr *dst6,
+			const struct ipv4_transport_addr *src4,
+			const struct ipv4_transport_addr *dst4,
+			l4_protocol proto),
+	TP_ARGS(src6, dst6, src4, dst4, proto),
+	TP_STRUCT__entry(
+		__array(__u8, src6, 16)
+		__array(__u8, dst6, 16)
+		__array(__u8, src4, 4)
+		__array(__u8, dst4, 4)
+		__field(__u16, src6_port)
+		__field(__u16, dst6_port)
+		__field(__u16, src4_port)
+		__field(__u16, dst4_port)
+		__field(int, proto)
+	),
+	TP_fast_assign(
+		memcpy(__entry->src6, &src6->l3, 16);
+		memcpy(__entry->dst6, &dst6->l3, 16);
+		memcpy(__entry->src4, &src4->l3, 4);
+		memcpy(__entry->dst4, &dst4->l3, 4);
+		__entry->src6_port = src6->l4;
+		__entry->dst6_port = dst6->l4;
+		__entry->src4_port = src4->l4;
+		__entry->dst4_port = dst4->l4;
+		__entry->proto = proto;
+	),
+	TP_printk("%pI6c#%u|%pI6c#%u|%pI4#%u|%pI4#%u|%s",
+			__entry->src6, __entry->src6_port,
+			__entry->dst6, __entry->dst6_port,
+			__entry->src4, __entry->src4_port,
+			__entry->dst4, __entry->dst4_port,
+			__print_symbolic(__entry->proto, JOOL_TRACE_PROTOS))
+);
+
+DEFINE_EVENT(jool_session, jool_session_add,
+	TP_PROTO(const struct ipv6_transport_addr *src6,
+			const struct ipv6_transport_addr *dst6,
+			const struct ipv4_transport_addr *src4,
+			const struct ipv4_transport_addr *dst4,
+			l4_protocol proto),
+	TP_ARGS(src6, dst6, src4, dst4, proto)
+);
+
+DEFINE_EVENT(jool_session, jool_session_rm,
+	TP_PROTO(const struct ipv6_transport_addr *src6,
+			const struct ipv6_transport_addr *dst6,
+			const struct ipv4_transport_addr *src4,
+			const struct ipv4_transport_addr *dst4,
+			l4_protocol proto),
+	TP_ARGS(src6, dst6, src4, dst4, proto)
+);
+
+/* -- pool4 -- */
+
+TRACE_EVENT(jool_pool4_alloc,
+	TP_PROTO(unsigned int iterations, int error),
+	TP_ARGS(iterations, error),
+	TP_STRUCT__entry(
+		__field(unsigned int, iterations)
+		__field(int, error)
+	),
+	TP_fast_assign(
+		__entry->iterations = iterations;
+		__entry->error = error;
+	),
+	TP_printk("iterations=%u error=%d", __entry->iterations,
+			__entry->error)
+);
+
+/* -- joold -- */
+
+TRACE_EVENT(jool_joold_flush,
+	TP_PROTO(__u16 seq, size_t len, unsigned int in_flight),
+	TP_ARGS(seq, len, in_flight),
+	TP_STRUCT__entry(
+		__field(__u16, seq)
+		__field(size_t, len)
+		__field(unsigned int, in_flight)
+	),
+	TP_fast_assign(
+		__entry->seq = seq;
+		__entry->len = len;
+		__entry->in_flight = in_flight;
+	),
+	TP_printk("seq=%u len=%zu in_flight=%u", __entry->seq, __entry->len,
+			__entry->in_flight)
+);
+
+/* -- Fragments -- */
+
+DECLARE_EVENT_CLASS(jool_frag,
+	TP_PROTO(struct packet *pkt),
+	TP_ARGS(pkt),
+	TP_STRUCT__entry(
+		__array(__u8, saddr, 16)
+		__array(__u8, daddr, 16)
+		__field(__u32, id)
+	),
+	TP_fast_assign(
+		memcpy(__entry->saddr, &pkt_ip6_hdr(pkt)->saddr, 16);
+		memcpy(__entry->daddr, &pkt_ip6_hdr(pkt)->daddr, 16);
+		__entry->id = be32_to_cpu(pkt_frag_hdr(pkt)->identification);
+	),
+	TP_printk("%pI6c->%pI6c id=%u", __entry->saddr, __entry->daddr,
+			__entry->id)
+);
+
+DEFINE_EVENT(jool_frag, jool_frag_add,
+	TP_PROTO(struct packet *pkt),
+	TP_ARGS(pkt)
+);
+
+DEFINE_EVENT(jool_frag, jool_frag_expire,
+	TP_PROTO(struct packet *pkt),
+	TP_ARGS(pkt)
+);
+
+DEFINE_EVENT(jool_frag, jool_frag_evict,
+	TP_PROTO(struct packet *pkt),
+	TP_ARGS(pkt)
+);
+
+#else /* UNIT_TESTING */
+
+/* The unit tests are not linked against trace.o. */
+#define trace_jool_xlat_start(...) do {} while (0)
+#define trace_jool_xlat_end(...) do {} while (0)
+#define trace_jool_mirror(...) do {} while (0)
+#define trace_jool_mirror_enabled() false
+#define trace_jool_bib_add(...) do {} while (0)
+#define trace_jool_bib_rm(...) do {} while (0)
+#define trace_jool_session_add(...) do {} while (0)
+#define trace_jool_session_rm(...) do {} while (0)
+#define trace_jool_pool4_alloc(...) do {} while (0)
+#define trace_jool_joold_flush(...) do {} while (0)
+#define trace_jool_frag_add(...) do {} while (0)
+#define trace_jool_frag_expire(...) do {} while (0)
+#define trace_jool_frag_evict(...) do {} while (0)
+
+#endif /* UNIT_TESTING */
+
+#endif /* _JOOL_MOD_TRACE_H */
+
+#ifndef UNIT_TESTING
+/* This part must be outside the header guard. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH nat64/mod/common
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
+#endif
@@ -4,6 +4,9 @@
 #include "nat64/mod/common/xlator.h"
 #include "nat64/mod/common/packet.h"
 #include "nat64/mod/stateful/bib/entry.h"
+#include "nat64/mod/stateful/bib/offload.h"
+
+struct route_hint;
 
 /**
  * State of the current translation.
@@ -12,6 +15,8 @@ struct xlation {
 	/**
 	 * The instance of Jool that's in charge of carrying out this
 	 * translation.
+	 * Borrowed (see xlator_find_rcu()); don't hang on to its members past
+	 * the translation.
 	 */
 	struct xlator jool;
 
@@ -19,6 +24,23 @@ struct xlation {
 	struct packet in;
 	/** The translated version of @in. */
 	struct packet out;
+	/**
+	 * If true, @out's skb only contains the translated headers, and the
+	 * payload is still sitting in @in's skb. @in's skb will become the
+	 * outgoing packet once we're certain it's going to be sent.
+	 * See ttpcomm_commit_in_place().
+	 */
+	bool in_place;
+	/**
+	 * Route cache shared by the packets of the current batch, if there is
+	 * one. (See core_6to4_list().) NULL otherwise.
+	 */
+	struct route_hint *route_hint;
+	/**
+	 * Precomputed layer-4 checksum update, if the packet belongs to an
+	 * offloaded flow. (See offload.h.)
+	 */
+	struct csum_delta csum_delta;
 
 	/**
 	 * Convenient accesor to the BIB and session entries that correspond
@@ -28,6 +50,5 @@ struct xlation {
 };
 
 void xlation_init(struct xlation *state);
-void xlation_clean(struct xlation *state);
 
 #endif /* _JOOL_MOD_TRANSLATION_STATE_H */
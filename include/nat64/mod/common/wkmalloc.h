@@ -1,7 +1,9 @@
 #ifndef _JOOL_MOD_KREF_ANALYZER_H
 #define _JOOL_MOD_KREF_ANALYZER_H
 
+#include <linux/percpu.h>
 #include <linux/slab.h>
+#include "nat64/common/stats.h"
 #include "nat64/common/types.h"
 
 void wkmalloc_add(const char *name);
@@ -9,51 +11,110 @@ void wkmalloc_rm(const char *name, void *obj);
 void wkmalloc_print_leaks(void);
 void wkmalloc_teardown(void);
 
-static inline void *__wkmalloc(const char *name, size_t size, gfp_t flags)
+/**
+ * Memory currently allocated by this CPU, per class. Unlike the JKMEMLEAK
+ * tracker, this is always on. A CPU can free what another one allocated, so
+ * the individual counters can go negative; only their sum means anything.
+ */
+struct wkmalloc_counters {
+	long objects[JMEM_COUNT];
+	long bytes[JMEM_COUNT];
+};
+
+DECLARE_PER_CPU(struct wkmalloc_counters, wkmalloc_counters);
+
+void wkmalloc_query(struct jool_stats_usr *stats);
+
+/**
+ * Records @objects objects and @bytes bytes (either of which can be negative)
+ * as allocated memory of @class.
+ *
+ * Allocators that don't go through the functions below (vmalloc(), mostly)
+ * can call this directly.
+ */
+static inline void wkmalloc_account(enum jool_mem_class class, long objects,
+		long bytes)
+{
+#ifndef UNIT_TESTING
+	this_cpu_add(wkmalloc_counters.objects[class], objects);
+	this_cpu_add(wkmalloc_counters.bytes[class], bytes);
+#endif
+}
+
+static inline void *__wkmalloc_as(enum jool_mem_class class, const char *name,
+		size_t size, gfp_t flags)
 {
 	void *result;
 
 	result = kmalloc(size, flags);
+	if (!result)
+		return NULL;
+
+	wkmalloc_account(class, 1, ksize(result));
 #ifdef JKMEMLEAK
-	if (result)
-		wkmalloc_add(name);
+	wkmalloc_add(name);
 #endif
 
 	return result;
 }
 
+static inline void *__wkmalloc(const char *name, size_t size, gfp_t flags)
+{
+	return __wkmalloc_as(JMEM_OTHER, name, size, flags);
+}
+
 /**
  * A "wrapped kernel memory allocation"; a wrapped kmalloc.
  */
 #define wkmalloc(type, flags) __wkmalloc(#type, sizeof(type), flags)
+#define wkmalloc_as(class, type, flags) \
+	__wkmalloc_as(class, #type, sizeof(type), flags)
 
-static inline void __wkfree(const char *name, void *obj)
+static inline void __wkfree_as(enum jool_mem_class class, const char *name,
+		void *obj)
 {
+	if (!obj)
+		return;
+
+	wkmalloc_account(class, -1, -(long)ksize(obj));
 	kfree(obj);
 #ifdef JKMEMLEAK
 	wkmalloc_rm(name, obj);
 #endif
 }
 
+static inline void __wkfree(const char *name, void *obj)
+{
+	__wkfree_as(JMEM_OTHER, name, obj);
+}
+
 #define wkfree(type, obj) __wkfree(#type, obj)
+#define wkfree_as(class, type, obj) __wkfree_as(class, #type, obj)
 
-static inline void *wkmem_cache_alloc(const char *name,
-		struct kmem_cache *cache, gfp_t flags)
+static inline void *wkmem_cache_alloc(enum jool_mem_class class,
+		const char *name, struct kmem_cache *cache, gfp_t flags)
 {
 	void *result;
 
 	result = kmem_cache_alloc(cache, flags);
+	if (!result)
+		return NULL;
+
+	wkmalloc_account(class, 1, kmem_cache_size(cache));
 #ifdef JKMEMLEAK
-	if (result)
-		wkmalloc_add(name);
+	wkmalloc_add(name);
 #endif
 
 	return result;
 }
 
-static inline void wkmem_cache_free(const char *name, struct kmem_cache *cache,
-		void *obj)
+static inline void wkmem_cache_free(enum jool_mem_class class,
+		const char *name, struct kmem_cache *cache, void *obj)
 {
+	if (!obj)
+		return;
+
+	wkmalloc_account(class, -1, -(long)kmem_cache_size(cache));
 	kmem_cache_free(cache, obj);
 #ifdef JKMEMLEAK
 	wkmalloc_rm(name, obj);
@@ -9,12 +9,33 @@
  *
  * The instance holds all the databases and configuration the translating code
  * should use to handle a packet in the respective namespace.
+ *
+ * There are two ways to hold one:
+ *
+ * - xlator_find() and friends take a reference to every member. This is for
+ *   the control path (which might sleep), and must be reverted by
+ *   xlator_put().
+ * - xlator_find_rcu() takes no references at all; the members are only
+ *   guaranteed to survive until the RCU-bh read-side critical section ends.
+ *   This is for the packet path, so translating costs no shared atomics.
+ *
+ * Removing or replacing an instance waits for an RCU-bh grace period before
+ * dropping the instance's own references, which is what keeps borrowers safe.
+ * Code which needs a member to outlive the packet (eg. deferred work) has to
+ * take its own reference to that member.
  */
 struct xlator {
 	struct net *ns;
 
+	/**
+	 * Published through RCU; see xlator_set_global(). The copies handed
+	 * out by xlator_find() and friends are snapshots, so they keep
+	 * pointing to whatever configuration was current when they were made.
+	 */
 	struct global_config *global;
 	struct pool6 *pool6;
+	/** Survives configuration changes; only dies with the instance. */
+	struct jool_stats *stats;
 	union {
 		struct {
 			struct eam_table *eamt;
@@ -36,16 +57,19 @@ int xlator_setup(void);
 void xlator_teardown(void);
 
 int xlator_add(struct xlator *result);
+int xlator_add_shared(char *tables, struct xlator *result);
+int xlator_add_from(struct net *from, struct xlator *result);
 int xlator_rm(void);
 int xlator_replace(struct xlator *instance);
+int xlator_unshare(struct xlator *instance);
+int xlator_set_global(struct xlator *instance, struct global_config *global);
+void xlator_refresh_clat(struct xlator *instance);
 
 int xlator_find(struct net *ns, struct xlator *result);
+int xlator_find_rcu(struct net *ns, struct xlator *result);
 int xlator_find_current(struct xlator *result);
 void xlator_put(struct xlator *instance);
 
-typedef int (*xlator_foreach_cb)(struct xlator *, void *);
-int xlator_foreach(xlator_foreach_cb cb, void *args);
-
 void xlator_copy_config(struct xlator *instance, struct full_config *copy);
 
 #endif /* _JOOL_MOD_NAMESPACE_H */
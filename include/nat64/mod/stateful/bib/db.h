@@ -13,6 +13,12 @@
 #include "nat64/mod/stateful/bib/entry.h"
 
 struct bib;
+struct bib_table;
+struct tabled_bib;
+struct tabled_session;
+struct jool_stats;
+struct csum_delta;
+struct nlcore_buffer;
 
 enum session_fate {
 	/**
@@ -27,6 +33,11 @@ enum session_fate {
 	 * going to die soon.)
 	 */
 	FATE_TIMER_TRANS,
+	/**
+	 * Like FATE_TIMER_TRANS, except the connection is already dead (it saw
+	 * a RST or both FINs), so it gets the (usually shorter) closed timer.
+	 */
+	FATE_TIMER_CLOSED,
 	/**
 	 * The session expired; it has to be removed from the DB right away.
 	 */
@@ -58,7 +69,7 @@ enum session_fate {
 int bib_setup(void);
 void bib_teardown(void);
 
-struct bib *bib_alloc(void);
+struct bib *bib_alloc(struct net *ns, struct jool_stats *stats);
 void bib_get(struct bib *db);
 void bib_put(struct bib *db);
 
@@ -77,12 +88,34 @@ struct collision_cb {
 	void *arg;
 };
 
+/**
+ * One of the sessions of a bib_add_sessions() batch.
+ */
+struct bib_batch_session {
+	/** The session to add. (Input.) */
+	struct session_entry *session;
+	/**
+	 * What to do if @session already exists. (Input; @cb.cb can be NULL.)
+	 */
+	struct collision_cb cb;
+	/** What bib_add_session() would have returned. (Output.) */
+	int error;
+
+	/* The rest is private to the database. */
+	struct bib_table *table;
+	struct tabled_bib *bib;
+	struct tabled_session *tsession;
+	unsigned int index;
+};
+
 /* These are used by Filtering. */
 
 int bib_add6(struct bib *db, struct mask_domain *masks, struct tuple *tuple6,
-		struct ipv4_transport_addr *dst4, struct bib_session *result);
+		struct ipv4_transport_addr *dst4, unsigned int len,
+		struct bib_session *result);
 int bib_add4(struct bib *db, struct ipv6_transport_addr *dst6,
-		struct tuple *tuple4, struct bib_session *result);
+		struct tuple *tuple4, unsigned int len,
+		struct bib_session *result);
 verdict bib_add_tcp6(struct bib *db, struct mask_domain *masks,
 		struct ipv4_transport_addr *dst4, struct packet *pkt,
 		struct collision_cb *cb, struct bib_session *result);
@@ -96,7 +129,14 @@ int bib_find(struct bib *db, struct tuple *tuple,
 		struct bib_session *result);
 int bib_add_session(struct bib *db, struct session_entry *new,
 		struct collision_cb *cb);
-void bib_clean(struct bib *db, struct net *ns);
+void bib_add_sessions(struct bib *db, struct bib_batch_session *batch,
+		unsigned int count);
+int bib_update_session4(struct bib *db, l4_protocol proto,
+		struct ipv4_transport_addr *src4,
+		struct ipv4_transport_addr *dst4,
+		struct collision_cb *cb);
+void bib_clean(struct bib *db);
+unsigned long bib_next_clean(struct bib *db);
 
 /* These are used by userspace request handling. */
 
@@ -117,10 +157,12 @@ struct session_foreach_offset {
 
 int bib_foreach(struct bib *db, l4_protocol proto,
 		struct bib_foreach_func *func,
-		const struct ipv4_transport_addr *offset);
+		const struct ipv4_transport_addr *offset,
+		const struct bib_filter *filter);
 int bib_foreach_session(struct bib *db, l4_protocol proto,
 		struct session_foreach_func *collision_cb,
-		struct session_foreach_offset *offset);
+		struct session_foreach_offset *offset,
+		const struct bib_filter *filter);
 int bib_find6(struct bib *db, l4_protocol proto,
 		struct ipv6_transport_addr *addr,
 		struct bib_entry *result);
@@ -130,10 +172,43 @@ int bib_find4(struct bib *db, l4_protocol proto,
 int bib_add_static(struct bib *db, struct bib_entry *new,
 		struct bib_entry *old);
 int bib_rm(struct bib *db, struct bib_entry *entry);
+int bib_add_static_bulk(struct bib *db, l4_protocol proto,
+		struct bib_bulk_entry *entries, unsigned int count,
+		int *errors);
+int bib_rm_bulk(struct bib *db, l4_protocol proto,
+		struct bib_bulk_entry *entries, unsigned int count,
+		int *errors);
 void bib_rm_range(struct bib *db, l4_protocol proto, struct ipv4_range *range);
+void bib_rm_range_wait(void);
 void bib_flush(struct bib *db);
+
+void bib_prefetch6(struct bib *db, l4_protocol proto,
+		const struct ipv6_transport_addr *src6,
+		const struct ipv6_transport_addr *dst6);
+void bib_prefetch4(struct bib *db, l4_protocol proto,
+		const struct ipv4_transport_addr *src4,
+		const struct ipv4_transport_addr *dst4);
+
+bool bib_offload_find(struct bib *db, struct packet *in, struct tuple *out,
+		struct csum_delta *delta, int *generation);
+void bib_offload_add(struct bib *db, struct packet *in,
+		struct bib_session *entries, struct tuple *out, int generation);
+void bib_offload_flush(struct bib *db);
+
+int bib_policy_attach(struct bib *db, int fd);
+int bib_policy_apply(struct bib *db, struct packet *pkt);
+
 int bib_count(struct bib *db, l4_protocol proto, __u64 *count);
 int bib_count_sessions(struct bib *db, l4_protocol proto, __u64 *count);
+int bib_count_evicted(struct bib *db, l4_protocol proto, __u64 *count);
+int bib_mask_stats(struct bib *db, l4_protocol proto,
+		struct pool4_stats_usr *stats);
+int bib_stats(struct bib *db, l4_protocol proto, struct bib_stats_usr *stats);
+int bib_count_ports(struct bib *db, l4_protocol proto, struct in_addr *addr,
+		__u32 *count);
+int bib_top(struct bib *db, l4_protocol proto, struct bib_top_query *query,
+		struct bib_top_usr *top, unsigned int *count);
+int bib_follow(struct bib *db, __u64 since, struct nlcore_buffer *buffer);
 
 void bib_print(struct bib *db);
 
@@ -1,6 +1,7 @@
 #ifndef _JOOL_MOD_BIB_ENTRY_H
 #define _JOOL_MOD_BIB_ENTRY_H
 
+#include "nat64/common/config.h"
 #include "nat64/common/session.h"
 #include "nat64/common/types.h"
 
@@ -24,6 +25,7 @@ typedef enum session_timer_type {
 	SESSION_TIMER_EST,
 	SESSION_TIMER_TRANS,
 	SESSION_TIMER_SYN4,
+	SESSION_TIMER_CLOSED,
 } session_timer_type;
 
 /**
@@ -80,6 +82,18 @@ struct session_entry {
 	unsigned long timeout;
 
 	bool has_stored;
+	/**
+	 * Does joold need to synchronize this session?
+	 * Only meaningful in sessions packets just refreshed.
+	 */
+	bool sync_due;
+	/** Is the session's traffic being counted? */
+	bool counted;
+	/**
+	 * Only filled in by bib_foreach_session(); the translation paths don't
+	 * need them.
+	 */
+	struct session_counters_usr counters;
 };
 
 struct bib_session {
@@ -0,0 +1,104 @@
+#ifndef _JOOL_MOD_BIB_EVENTS_H
+#define _JOOL_MOD_BIB_EVENTS_H
+
+/**
+ * @file
+ * The event stream: a binary alternative to the BIB and session logging.
+ *
+ * At a few tens of thousands of connections per second, printk()ing every BIB
+ * entry and session brings the box to its knees. When --logging-stream is
+ * enabled, the records are instead appended (as struct bib_event_usr) to a
+ * per-CPU Generic Netlink message, which is multicasted to the events group
+ * once it's full, or by the next bib_clean() otherwise. (Which happens at
+ * least every BIBEV_FLUSH_PERIOD while the stream is enabled.) A userspace
+ * collector (such as `jool --events`) can then write them anywhere it wants.
+ *
+ * Like any multicast, nobody is waiting for the collector. If it falls
+ * behind, its socket buffer overflows and it learns about it from recvmsg().
+ *
+ * The change log is the pull-based alternative: if the module's
+ * change_log_size is nonzero, every BIB entry and session creation and
+ * destruction is also recorded (as struct bib_change_usr, whether the logging
+ * is enabled or not) in a bounded ring, numbered by a sequence that only
+ * grows. Clients fetch the records that follow the last one they have seen
+ * (`jool --session --follow`), and can tell when the ring overwrote some of
+ * them before they asked.
+ */
+
+#include <linux/spinlock.h>
+#include <net/net_namespace.h>
+#include "nat64/common/config.h"
+
+/** Longest time a record can wait for its batch to fill up. */
+#define BIBEV_FLUSH_PERIOD msecs_to_jiffies(2000)
+
+struct bibev_cpu;
+struct nlcore_buffer;
+
+struct bibev_log {
+	spinlock_t lock;
+	/** Sequence number the next change will get. */
+	__u64 next;
+	/** Slot of @records the next change will be written to. */
+	unsigned int head;
+	/** Number of slots in @records. Zero means the log is disabled. */
+	unsigned int size;
+	/** The ring. */
+	struct bib_change_usr *records;
+};
+
+struct bib_events {
+	/** Namespace where the events will be multicasted. */
+	struct net *ns;
+	struct bibev_cpu __percpu *cpus;
+	struct bibev_log log;
+};
+
+#ifndef UNIT_TESTING
+
+int bibev_init(struct bib_events *events, struct net *ns);
+void bibev_destroy(struct bib_events *events);
+
+void bibev_send(struct bib_events *events, struct bib_event_usr *event);
+void bibev_flush(struct bib_events *events);
+
+void bibev_log(struct bib_events *events, struct bib_change_usr *change);
+int bibev_log_fetch(struct bib_events *events, __u64 since,
+		struct nlcore_buffer *buffer);
+
+#else
+
+/* The unit tests are not linked against events.o. */
+static inline int bibev_init(struct bib_events *events, struct net *ns)
+{
+	events->log.size = 0;
+	return 0;
+}
+
+static inline void bibev_destroy(struct bib_events *events)
+{
+}
+
+static inline void bibev_send(struct bib_events *events,
+		struct bib_event_usr *event)
+{
+}
+
+static inline void bibev_flush(struct bib_events *events)
+{
+}
+
+static inline void bibev_log(struct bib_events *events,
+		struct bib_change_usr *change)
+{
+}
+
+static inline int bibev_log_fetch(struct bib_events *events, __u64 since,
+		struct nlcore_buffer *buffer)
+{
+	return -EINVAL;
+}
+
+#endif /* UNIT_TESTING */
+
+#endif /* _JOOL_MOD_BIB_EVENTS_H */
@@ -0,0 +1,116 @@
+#ifndef _JOOL_MOD_BIB_OFFLOAD_H
+#define _JOOL_MOD_BIB_OFFLOAD_H
+
+/**
+ * @file
+ * The offload cache: a shortcut around the session table for established
+ * flows, in the spirit of the kernel's nf_flowtable.
+ *
+ * Once a TCP connection reaches ESTABLISHED (or a UDP session exists), the
+ * slow path stores the packet's outgoing tuple here, indexed by the incoming
+ * 5-tuple and ingress device. The following packets of the flow find it,
+ * skip filtering, the BIB/session lookup and the outgoing tuple computation,
+ * and go straight to the header translation.
+ *
+ * The cache is per CPU (the flows are normally steered to one CPU anyway), so
+ * hits need neither locks nor atomics. Entries die
+ *
+ * - after offload_lifetime milliseconds, so the session gets refreshed (and
+ *   synchronized by joold) by the slow path every once in a while, and never
+ *   expires while it's being hit,
+ * - on the CPU that sees a SYN, FIN or RST of their flow, because those have
+ *   to go through the TCP state machine, and
+ * - all at once whenever sessions are removed or the configuration changes.
+ *   (See offload_flush().)
+ *
+ * The entries also remember how the translation changes the flow's layer-4
+ * checksum, since that only depends on the addresses and ports.
+ */
+
+#include <linux/atomic.h>
+#include <net/checksum.h>
+#include "nat64/mod/common/packet.h"
+
+struct offload_slot;
+
+/**
+ * What translating the flow does to its TCP/UDP checksum: the outgoing
+ * pseudoheader and ports, minus the incoming ones.
+ */
+struct csum_delta {
+	/** For checksums computed in software. */
+	__wsum full;
+	/**
+	 * For CHECKSUM_PARTIAL. Pseudoheaders only; the ports are in the part
+	 * the device sums.
+	 */
+	__wsum partial;
+	/** false means unknown; the translation has to work it out. */
+	bool set;
+};
+
+static inline __sum16 csum_delta_apply(struct csum_delta *delta,
+		__sum16 csum16)
+{
+	return csum_fold(csum_add(~csum_unfold(csum16), delta->full));
+}
+
+static inline __sum16 csum_delta_apply_partial(struct csum_delta *delta,
+		__sum16 csum16)
+{
+	return ~csum_fold(csum_add(csum_unfold(csum16), delta->partial));
+}
+
+struct bib_offload {
+	/** Array of 2^@bits slots, per CPU. NULL if the cache is disabled. */
+	struct offload_slot __percpu *slots;
+	unsigned int bits;
+	/** Slots that predate the current generation are stale. */
+	atomic_t generation;
+	u32 seed;
+};
+
+#ifndef UNIT_TESTING
+
+int offload_init(struct bib_offload *offload);
+void offload_destroy(struct bib_offload *offload);
+
+bool offload_find(struct bib_offload *offload, struct packet *in,
+		struct tuple *out, struct csum_delta *delta, int *generation);
+void offload_add(struct bib_offload *offload, struct packet *in,
+		struct tuple *out, int generation);
+void offload_flush(struct bib_offload *offload);
+
+#else
+
+/* The unit tests are not linked against offload.o. */
+static inline int offload_init(struct bib_offload *offload)
+{
+	offload->slots = NULL;
+	return 0;
+}
+
+static inline void offload_destroy(struct bib_offload *offload)
+{
+}
+
+static inline bool offload_find(struct bib_offload *offload,
+		struct packet *in, struct tuple *out, struct csum_delta *delta,
+		int *generation)
+{
+	*generation = 0;
+	return false;
+}
+
+static inline void offload_add(struct bib_offload *offload,
+		struct packet *in, struct tuple *out, int generation)
+{
+}
+
+static inline void offload_flush(struct bib_offload *offload)
+{
+}
+
+#endif /* UNIT_TESTING */
+
+#endif /* _JOOL_MOD_BIB_OFFLOAD_H */
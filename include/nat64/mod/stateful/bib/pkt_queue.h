@@ -99,25 +99,42 @@
 #include "nat64/mod/stateful/pool4/db.h"
 
 struct pktqueue;
+struct jool_stats;
+
+/** Longest IPv4 header plus longest TCP header. */
+#define PKTQUEUE_DIGEST_MAX (60 + 60)
 
 struct pktqueue_session {
 	struct ipv6_transport_addr dst6;
 	struct ipv4_transport_addr src4;
 	struct ipv4_transport_addr dst4;
 
+	/** The stored packet. NULL if only @digest was kept. (Stateless.) */
 	struct sk_buff *skb;
 
 	unsigned long update_time;
 	/** Links this packet to the list. See @node_list. */
 	struct list_head list_hook;
-	/** Links this packet to the tree. See @node_tree. */
-	struct rb_node tree_hook;
+	/** Links this packet to its hash bucket. See @buckets. */
+	struct hlist_node hash_hook;
+
+	/** Stateless mode: index of the device the packet arrived from. */
+	int ifindex;
+	/** Stateless mode: length of @digest. (Zero otherwise.) */
+	unsigned int digest_len;
+	/**
+	 * Stateless mode: the packet's IPv4 and TCP headers; all the ICMP
+	 * error needs to quote.
+	 */
+	__u8 digest[];
 };
 
 /**
  * Call during initialization for the remaining functions to work properly.
+ * @ns is the namespace the packets are received in. @stats rate limits the
+ * stored packets' ICMP errors; it has to outlive the queue.
  */
-struct pktqueue *pktqueue_alloc(void);
+struct pktqueue *pktqueue_alloc(struct net *ns, struct jool_stats *stats);
 /**
  * Call during destruction to avoid memory leaks.
  */
@@ -127,7 +144,8 @@ void pktqueue_release(struct pktqueue *queue);
  * Stores packet @pkt.
  */
 int pktqueue_add(struct pktqueue *queue, struct packet *pkt,
-		struct ipv6_transport_addr *dst6, bool too_many);
+		struct ipv6_transport_addr *dst6, bool too_many,
+		size_t max_bytes, bool stateless);
 void pktqueue_rm(struct pktqueue *queue, struct ipv4_transport_addr *src4);
 
 struct pktqueue_session *pktqueue_find(struct pktqueue *queue,
@@ -150,7 +168,12 @@ unsigned int pktqueue_prepare_clean(struct pktqueue *queue,
 /**
  * Sends the ICMP errors contained in the @probe list.
  */
-void pktqueue_clean(struct list_head *probes);
+void pktqueue_clean(struct pktqueue *queue, struct list_head *probes);
+/**
+ * Returns the jiffy at which the oldest packet in @queue will expire. (Or, if
+ * the queue is empty, the earliest a packet stored now could.)
+ */
+unsigned long pktqueue_next_clean(struct pktqueue *queue);
 
 
 #endif /* _JOOL_MOD_PKT_QUEUE_H */
@@ -0,0 +1,57 @@
+#ifndef _JOOL_MOD_BIB_POLICY_H
+#define _JOOL_MOD_BIB_POLICY_H
+
+/**
+ * @file
+ * An optional BPF program that decides whether IPv6 packets are allowed to
+ * create (or use) BIB entries and sessions, and which pool4 mark they draw
+ * their masks from. It runs inside filtering, right before the BIB lookup, so
+ * blocking subscribers or destinations doesn't need a separate iptables pass
+ * over every packet. (See nat64/common/policy.h for the program's side.)
+ */
+
+#include <linux/mutex.h>
+#include "nat64/mod/common/packet.h"
+
+struct bpf_prog;
+
+struct bib_policy {
+	/** NULL means everything is allowed. */
+	struct bpf_prog __rcu *prog;
+	/** Serializes the attachments. */
+	struct mutex lock;
+};
+
+#ifndef UNIT_TESTING
+
+void policy_init(struct bib_policy *policy);
+void policy_destroy(struct bib_policy *policy);
+
+int policy_attach(struct bib_policy *policy, int fd);
+int policy_apply(struct bib_policy *policy, struct packet *pkt);
+
+#else
+
+/* The unit tests are not linked against policy.o. */
+static inline void policy_init(struct bib_policy *policy)
+{
+	policy->prog = NULL;
+}
+
+static inline void policy_destroy(struct bib_policy *policy)
+{
+}
+
+static inline int policy_attach(struct bib_policy *policy, int fd)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline int policy_apply(struct bib_policy *policy, struct packet *pkt)
+{
+	return 0;
+}
+
+#endif /* UNIT_TESTING */
+
+#endif /* _JOOL_MOD_BIB_POLICY_H */
@@ -13,24 +13,33 @@
  * This module queues these fragments in skb_shinfo(skb)->frag_list so the rest
  * of Jool doesn't have to worry about handling fragments differently depending
  * on kernel version.
+ *
+ * The kernel's defragmenters can also be left out entirely (kernel_defrag=0).
+ * Then IPv4 packets are reassembled by fragdb_defrag4(), and IPv6 fragments
+ * arrive as they are, so they are always virtually reassembled.
  */
 
 #include "nat64/common/config.h"
 #include "nat64/mod/common/packet.h"
 
 struct fragdb;
+struct xlation;
+struct jool_stats;
 
 int fragdb_setup(void);
 void fragdb_teardown(void);
 
-struct fragdb *fragdb_alloc(struct net *ns);
+struct fragdb *fragdb_alloc(struct net *ns, struct jool_stats *stats);
 void fragdb_get(struct fragdb *db);
 void fragdb_put(struct fragdb *db);
 
 void fragdb_config_copy(struct fragdb *db, struct fragdb_config *config);
 void fragdb_config_set(struct fragdb *db, struct fragdb_config *config);
 
+bool fragdb_defrag4(struct sk_buff *skb);
 verdict fragdb_handle(struct fragdb *db, struct packet *pkt);
+void fragdb_resolve(struct fragdb *db, struct xlation *state);
 void fragdb_clean(struct fragdb *db);
+unsigned long fragdb_next_clean(struct fragdb *db);
 
 #endif /* _JOOL_MOD_FRAGMENT_DB_H */
@@ -14,6 +14,7 @@ struct joold_queue;
 
 int joold_setup(void);
 void joold_teardown(void);
+void joold_barrier(void);
 
 struct joold_queue *joold_alloc(struct net *ns);
 void joold_get(struct joold_queue *queue);
@@ -23,15 +24,23 @@ void joold_config_copy(struct joold_queue *queue, struct joold_config *config);
 void joold_config_set(struct joold_queue *queue, struct joold_config *config);
 
 int joold_sync(struct xlator *jool, void *data, __u32 size);
+int joold_import(struct xlator *jool, void *data, __u32 size);
+void joold_export(struct session_entry *entry, struct joold_session *out);
+int joold_update(struct xlator *jool, void *data, __u32 size);
+int joold_adv_end(struct xlator *jool, void *data, __u32 size);
+void joold_status(struct xlator *jool, struct joold_status_usr *status);
 void joold_add(struct joold_queue *queue, struct session_entry *entry,
-		struct bib *bib);
+		struct bib *bib, struct pool6 *pool6);
 void joold_update_config(struct joold_queue *queue,
 		struct joold_config *new_config);
 
 int joold_test(struct xlator *jool);
-int joold_advertise(struct xlator *jool);
-void joold_ack(struct xlator *jool);
+int joold_advertise(struct xlator *jool, unsigned int window);
+void joold_ack(struct xlator *jool, __u16 seq);
+int joold_bind(struct xlator *jool, struct joold_bind_request *request);
 
-void joold_clean(struct joold_queue *queue, struct bib *bib);
+void joold_clean(struct joold_queue *queue, struct bib *bib,
+		struct pool6 *pool6);
+unsigned long joold_next_clean(struct joold_queue *queue);
 
 #endif
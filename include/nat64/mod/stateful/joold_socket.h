@@ -0,0 +1,33 @@
+#ifndef _JOOL_MOD_JOOLD_SOCKET_H
+#define _JOOL_MOD_JOOLD_SOCKET_H
+
+/**
+ * @file
+ * joold's in-kernel transport: a UDP socket the module drives itself, so the
+ * sessions don't have to make the kernel -> daemon -> network -> daemon ->
+ * kernel trip.
+ *
+ * Datagrams carry the same bytes the daemon would have sent (a request_hdr
+ * followed by sessions), so instances that use it can still talk to peers that
+ * use the daemon.
+ *
+ * Sending and receiving both happen in a workqueue; the packet path only
+ * copies the message and schedules the work.
+ */
+
+#include "nat64/common/config.h"
+
+struct joold_socket;
+
+int jsock_setup(void);
+void jsock_teardown(void);
+void jsock_barrier(void);
+
+int jsock_create(struct net *ns, struct joold_bind_request *request,
+		struct joold_socket **result);
+void jsock_get(struct joold_socket *jsock);
+void jsock_put(struct joold_socket *jsock);
+
+void jsock_send(struct joold_socket *jsock, void *data, size_t len);
+
+#endif /* _JOOL_MOD_JOOLD_SOCKET_H */
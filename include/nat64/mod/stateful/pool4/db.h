@@ -36,22 +36,51 @@ void pool4db_flush(struct pool4 *pool);
 
 bool pool4db_contains(struct pool4 *pool, struct net *ns,
 		enum l4_protocol proto, struct ipv4_transport_addr *addr);
+bool pool4db_contains_addr(struct pool4 *pool, struct net *ns,
+		struct in_addr *addr);
 int pool4db_foreach_sample(struct pool4 *pool, l4_protocol proto,
 		int (*cb)(struct pool4_sample *, void *), void *arg,
 		struct pool4_sample *offset);
+int pool4db_foreach_addr(struct pool4 *pool, l4_protocol proto,
+		int (*cb)(struct in_addr *, unsigned int, void *), void *arg,
+		struct in_addr *offset);
 
 struct mask_domain;
 
+/**
+ * The domain returned by mask_domain_find() is borrowed from pool4: until you
+ * mask_domain_put() it, you're inside an RCU read-side critical section with
+ * bottom halves disabled. So don't sleep and don't find another domain in the
+ * meantime.
+ * This is meant to wrap a single BIB allocation attempt.
+ */
 struct mask_domain *mask_domain_find(struct pool4 *pool, struct tuple *tuple6,
-		__u8 f_args, struct route4_args *route_args);
+		__u8 f_args, __u8 f_algorithm, struct route4_args *route_args);
 void mask_domain_put(struct mask_domain *masks);
 int mask_domain_next(struct mask_domain *masks,
 		struct ipv4_transport_addr *addr,
 		bool *consecutive);
+int mask_domain_next_free(struct mask_domain *masks,
+		struct ipv4_transport_addr *addr,
+		bool *consecutive,
+		const unsigned long *(*get_taken)(const struct in_addr *, void *),
+		void *arg);
 bool mask_domain_matches(struct mask_domain *masks,
 		struct ipv4_transport_addr *addr);
+bool mask_domain_contains(struct mask_domain *masks, struct in_addr *addr,
+		unsigned int min, unsigned int max);
+void mask_domain_balance(struct mask_domain *masks,
+		unsigned int (*get_used)(const struct in_addr *, void *),
+		void *arg);
+void mask_domain_rewind(struct mask_domain *masks);
+unsigned int mask_domain_count(struct mask_domain *masks);
+unsigned int mask_domain_offset(struct mask_domain *masks);
+int mask_domain_get(struct mask_domain *masks, unsigned int ordinal,
+		struct ipv4_transport_addr *result);
 bool mask_domain_is_dynamic(struct mask_domain *masks);
 __u32 mask_domain_get_mark(struct mask_domain *masks);
+unsigned int mask_domain_get_iterations(struct mask_domain *masks);
+bool mask_domain_is_limited(struct mask_domain *masks);
 
 /*
  * Test functions (Illegal in production code)
@@ -5,7 +5,11 @@
 #include "nat64/mod/common/packet.h"
 #include "nat64/mod/common/route.h"
 
+int pool4empty_setup(void);
+void pool4empty_teardown(void);
+
 bool pool4empty_contains(struct net *ns, const struct ipv4_transport_addr *addr);
+bool pool4empty_contains_addr(struct net *ns, const struct in_addr *addr);
 int pool4empty_find(struct route4_args *route_args, struct pool4_range *range);
 
 #endif /* _JOOL_MOD_POOL4_EMPTY_H */
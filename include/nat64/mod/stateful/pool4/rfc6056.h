@@ -7,6 +7,7 @@
 int rfc6056_setup(void);
 void rfc6056_teardown(void);
 
-int rfc6056_f(const struct tuple *tuple6, __u8 fields, unsigned int *result);
+int rfc6056_f(const struct tuple *tuple6, __u8 fields, __u8 algorithm,
+		unsigned int *result);
 
 #endif /* _JOOL_MOD_BIB_PORT_ALLOCATOR_H */
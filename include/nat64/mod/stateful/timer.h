@@ -3,15 +3,40 @@
 
 /**
  * @file
- * An all-purpose timer used to trigger some of Jool's events. Always runs, as
- * long as Jool is modprobed. At time of writing, this induces session and
- * fragment expiration.
+ * The timer that induces session, fragment and joold expiration.
  *
- * Why don't the session and fragment code manage their own timers?
- * Because that's more code and I don't see how it would improve anything.
+ * Each NAT64 instance has its own, and it is not periodic: Every run asks the
+ * databases when they will next have something to expire, and sleeps until
+ * then. This way, hosts with lots of namespaces don't wake up to clean all of
+ * them at once, and idle instances barely wake up at all.
  */
 
-int jtimer_setup(void);
-void jtimer_teardown(void);
+#include <net/net_namespace.h>
+
+struct jtimer;
+
+#ifndef UNIT_TESTING
+
+struct jtimer *jtimer_alloc(struct net *ns);
+void jtimer_kick(struct jtimer *timer);
+void jtimer_destroy(struct jtimer *timer);
+
+#else
+
+/* The unit tests are not linked against timer.o. */
+static inline struct jtimer *jtimer_alloc(struct net *ns)
+{
+	return (struct jtimer *)ns;
+}
+
+static inline void jtimer_kick(struct jtimer *timer)
+{
+}
+
+static inline void jtimer_destroy(struct jtimer *timer)
+{
+}
+
+#endif /* UNIT_TESTING */
 
 #endif /* _JOOL_MOD_TIMER_H */
@@ -9,6 +9,9 @@
 #include <net/net_namespace.h>
 #include "nat64/mod/stateless/pool.h"
 
+int blacklist_setup(void);
+void blacklist_teardown(void);
+
 struct addr4_pool *blacklist_alloc(void);
 void blacklist_get(struct addr4_pool *pool);
 void blacklist_put(struct addr4_pool *pool);
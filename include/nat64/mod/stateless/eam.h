@@ -16,9 +16,16 @@ void eamt_put(struct eam_table *eamt);
 /* Safe-to-use-during-packet-translation functions */
 
 int eamt_xlat_4to6(struct eam_table *eamt, struct in_addr *addr4,
-		struct in6_addr *result);
+		struct in6_addr *result, unsigned int len);
 int eamt_xlat_6to4(struct eam_table *eamt, struct in6_addr *addr6,
-		struct in_addr *result);
+		struct in_addr *result, unsigned int len);
+
+bool eamt_clat_6to4(struct eam_table *eamt, struct in6_addr *saddr6,
+		struct in6_addr *daddr6, __be32 *saddr, __be32 *daddr,
+		unsigned int len);
+bool eamt_clat_4to6(struct eam_table *eamt, __be32 saddr, __be32 daddr,
+		struct in6_addr *saddr6, struct in6_addr *daddr6,
+		unsigned int len);
 
 bool eamt_contains6(struct eam_table *eamt, struct in6_addr *addr);
 bool eamt_contains4(struct eam_table *eamt, __be32 addr);
@@ -29,14 +36,20 @@ bool eamt_is_empty(struct eam_table *eamt);
 
 int eamt_add(struct eam_table *eamt, struct ipv6_prefix *prefix6,
 		struct ipv4_prefix *prefix4, bool force);
+int eamt_add_bulk(struct eam_table *eamt, struct eamt_entry *eams,
+		unsigned int count, bool force);
 int eamt_rm(struct eam_table *eamt, struct ipv6_prefix *prefix6,
 		struct ipv4_prefix *prefix4);
 void eamt_flush(struct eam_table *eamt);
+void eamt_clat_refresh(struct eam_table *eamt, struct ipv6_prefix *prefix6);
 
 int eamt_count(struct eam_table *eamt, __u64 *count);
 int eamt_foreach(struct eam_table *eamt,
 		int (*cb)(struct eamt_entry *, void *), void *arg,
 		struct ipv4_prefix *offset);
+int eamt_foreach_usr(struct eam_table *eamt,
+		int (*cb)(struct eamt_entry_usr *, void *), void *arg,
+		struct ipv4_prefix *offset, bool reset);
 
 void eamt_print_refcount(struct eam_table *eamt);
 
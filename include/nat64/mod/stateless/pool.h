@@ -28,6 +28,8 @@ int pool_foreach(struct addr4_pool *pool,
 		int (*func)(struct ipv4_prefix *, void *), void *arg,
 		struct ipv4_prefix *offset);
 int pool_count(struct addr4_pool *pool, __u64 *result);
+int pool_get_nth_addr(struct addr4_pool *pool, __u64 n,
+		struct in_addr *result);
 bool pool_is_empty(struct addr4_pool *pool);
 void pool_print_refcount(struct addr4_pool *pool);
 
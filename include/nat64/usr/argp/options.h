@@ -29,6 +29,9 @@ enum argp_flags {
 	ARGP_GLOBAL = 'g',
 	ARGP_PARSE_FILE = 'p',
 	ARGP_INSTANCE = 7001,
+	ARGP_XDP = 7003,
+	ARGP_STATS = 7004,
+	ARGP_EVENTS = 7005,
 
 	/* Operations */
 	ARGP_DISPLAY = 'd',
@@ -47,6 +50,7 @@ enum argp_flags {
 	ARGP_MARK = 'm',
 	ARGP_MAX_ITERATIONS = 3003,
 	ARGP_FORCE = 3002,
+	ARGP_USAGE = 3004,
 
 	/* BIB, session */
 	ARGP_TCP = 't',
@@ -55,6 +59,30 @@ enum argp_flags {
 	ARGP_NUMERIC_HOSTNAME = 'n',
 	ARGP_CSV = 2022,
 	ARGP_NO_HEADERS = 2023,
+	ARGP_DETAILS = 2024,
+	ARGP_FILTER_SRC6 = 2025,
+	ARGP_FILTER_SRC4 = 2026,
+	ARGP_FILTER_SRC4_PORTS = 2027,
+	ARGP_FILTER_DST4 = 2028,
+	ARGP_FILTER_STATE = 2029,
+	ARGP_FILTER_MIN_AGE = 2030,
+	ARGP_BULK = 2031,
+	ARGP_BATCH = 2032,
+	ARGP_EXPORT = 2033,
+	ARGP_IMPORT = 2034,
+	ARGP_SNAPSHOT = 2035,
+	ARGP_RESTORE = 2036,
+	ARGP_COUNTERS = 2037,
+	ARGP_RESET_COUNTERS = 2038,
+	ARGP_WATCH = 2039,
+	ARGP_SHARE_TABLES = 2040,
+	ARGP_FROM = 2041,
+	ARGP_POLICY = 2042,
+	ARGP_TOP = 2043,
+	ARGP_TOP_BY = 2044,
+	ARGP_TOP_SESSIONS = 2045,
+	ARGP_FOLLOW = 2046,
+	ARGP_JSONL = 2047,
 	ARGP_BIB_IPV6 = 2020,
 	ARGP_BIB_IPV4 = 2021,
 
@@ -66,6 +94,10 @@ enum argp_flags {
 	ARGP_RESET_TOS = RESET_TOS,
 	ARGP_NEW_TOS = NEW_TOS,
 	ARGP_PLATEAUS = MTU_PLATEAUS,
+	ARGP_DEBUG = DEBUG_MODE,
+	ARGP_LATENCY_SAMPLING = LATENCY_SAMPLING,
+	ARGP_MIRROR_SAMPLING = MIRROR_SAMPLING,
+	ARGP_MSS_CLAMP = MSS_CLAMP,
 	ARGP_COMPUTE_CSUM_ZERO = COMPUTE_UDP_CSUM_ZERO,
 	ARGP_RANDOMIZE_RFC6791 = RANDOMIZE_RFC6791,
 	ARGP_EAM_HAIRPIN_MODE = EAM_HAIRPINNING_MODE,
@@ -74,21 +106,51 @@ enum argp_flags {
 	ARGP_DROP_TCP = DROP_EXTERNAL_TCP,
 	ARGP_SRC_ICMP6ERRS_BETTER = SRC_ICMP6ERRS_BETTER,
 	ARGP_F_ARGS = F_ARGS,
+	ARGP_F_ALGORITHM = F_ALGORITHM,
 	ARGP_HANDLE_RST_DURING_FIN_RCV = HANDLE_RST_DURING_FIN_RCV,
 	ARGP_UDP_TO = UDP_TIMEOUT,
+	ARGP_UDP_SHORT_TO = UDP_SHORT_TIMEOUT,
+	ARGP_UDP_SHORT_PORTS = UDP_SHORT_PORTS,
 	ARGP_ICMP_TO = ICMP_TIMEOUT,
 	ARGP_TCP_TO = TCP_EST_TIMEOUT,
 	ARGP_TCP_TRANS_TO = TCP_TRANS_TIMEOUT,
+	ARGP_TCP_CLOSED_TO = TCP_CLOSED_TIMEOUT,
 	ARGP_FRAG_TO = FRAGMENT_TIMEOUT,
+	ARGP_FRAG_HIGH_THRESH = FRAGMENT_HIGH_THRESH,
+	ARGP_FRAG_LOW_THRESH = FRAGMENT_LOW_THRESH,
+	ARGP_FRAG_VIRTUAL = FRAGMENT_VIRTUAL,
 	ARGP_BIB_LOGGING = BIB_LOGGING,
 	ARGP_SESSION_LOGGING = SESSION_LOGGING,
+	ARGP_LOGGING_STREAM = LOGGING_STREAM,
 	ARGP_STORED_PKTS = MAX_PKTS,
+	ARGP_STORED_BYTES = MAX_STORED_BYTES,
+	ARGP_STATELESS_SO = STATELESS_SO,
+	ARGP_MAX_SESSIONS_TCP = MAX_SESSIONS_TCP,
+	ARGP_MAX_SESSIONS_UDP = MAX_SESSIONS_UDP,
+	ARGP_MAX_SESSIONS_ICMP = MAX_SESSIONS_ICMP,
+	ARGP_SUBSCRIBER_PLEN = SUBSCRIBER_PREFIX_LEN,
+	ARGP_SUBSCRIBER_MAX_BIBS = SUBSCRIBER_MAX_BIBS,
+	ARGP_SUBSCRIBER_MAX_SESSIONS = SUBSCRIBER_MAX_SESSIONS,
+	ARGP_SUBSCRIBER_MAX_RATE = SUBSCRIBER_MAX_RATE,
+	ARGP_PORT_BLOCK_SIZE = PORT_BLOCK_SIZE,
+	ARGP_DETERMINISTIC_BITS = DETERMINISTIC_BITS,
+	ARGP_POOL4_BALANCE = POOL4_BALANCE,
 	ARGP_SS_ENABLED = SS_ENABLED,
 	ARGP_SS_FLUSH_ASAP = SS_FLUSH_ASAP,
 	ARGP_SS_FLUSH_DEADLINE = SS_FLUSH_DEADLINE,
 	ARGP_SS_CAPACITY = SS_CAPACITY,
 	ARGP_SS_MAX_PAYLOAD = SS_MAX_PAYLOAD,
+	ARGP_SS_WINDOW = SS_WINDOW,
+	ARGP_SS_COMPACT = SS_COMPACT,
+	ARGP_SS_RESYNC_INTERVAL = SS_RESYNC_INTERVAL,
+	ARGP_SS_ADVERTISE_CHUNK = SS_ADVERTISE_CHUNK,
+	ARGP_SS_ADVERTISE_RATE = SS_ADVERTISE_RATE,
 	ARGP_RFC6791V6_PREFIX = RFC6791V6_PREFIX,
+	ARGP_CLAT = CLAT_MODE,
+	ARGP_PACKET_BUDGET = PACKET_BUDGET,
+	ARGP_CPS_BUDGET = CPS_BUDGET,
+	ARGP_SS_NODE_COUNT = SS_NODE_COUNT,
+	ARGP_SS_NODE_ID = SS_NODE_ID,
 };
 
 struct argp_option *build_opts(void);
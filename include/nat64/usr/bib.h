@@ -1,12 +1,13 @@
 #ifndef _JOOL_USR_BIB_H
 #define _JOOL_USR_BIB_H
 
+#include "nat64/common/config.h"
 #include "nat64/common/types.h"
 #include "nat64/usr/types.h"
 
 
-int bib_display(display_flags flags);
-int bib_count(display_flags flags);
+int bib_display(display_flags flags, struct bib_filter *filter);
+int bib_count(display_flags flags, struct bib_top_query *top);
 
 int bib_add(display_flags flags,
 		struct ipv6_transport_addr *ipv6,
@@ -14,6 +15,10 @@ int bib_add(display_flags flags,
 int bib_remove(display_flags flags,
 		struct ipv6_transport_addr *addr6,
 		struct ipv4_transport_addr *addr4);
+int bib_bulk(display_flags flags, enum config_operation op, char *file_name);
+int bib_export(display_flags flags, struct bib_filter *filter, char *file_name);
+int bib_import(display_flags flags, char *file_name);
+int bib_policy(char *path);
 
 
 #endif /* _JOOL_USR_BIB_H */
@@ -5,6 +5,10 @@
 #include "nat64/common/types.h"
 #include "nat64/usr/types.h"
 
+void dns_prefetch6(struct in6_addr *addr, display_flags flags);
+void dns_prefetch4(struct in_addr *addr, display_flags flags);
+void dns_resolve(void);
+
 void print_addr6(struct ipv6_transport_addr *addr6, display_flags flags,
 		char *separator, __u8 l4_proto);
 void print_addr4(struct ipv4_transport_addr *addr4, display_flags flags,
@@ -0,0 +1,14 @@
+#ifndef _JOOL_USR_EVENTS_H
+#define _JOOL_USR_EVENTS_H
+
+#include "nat64/common/config.h"
+#include "nat64/usr/types.h"
+
+typedef void (*events_batch_cb)(struct bib_event_usr *events,
+		unsigned int count, void *arg);
+
+char *event_to_string(__u8 type);
+int events_subscribe(events_batch_cb cb, void *arg);
+int events_listen(display_flags flags);
+
+#endif /* _JOOL_USR_EVENTS_H */
@@ -1,6 +1,65 @@
 #ifndef _JOOL_USR_FILE_H
 #define _JOOL_USR_FILE_H
 
+#include <stdio.h>
+#include "nat64/common/types.h"
+
 int file_to_string(char *file_name, char **result);
 
+/**
+ * @{
+ * Table files: the output of `--export` and the input of `--import`.
+ *
+ * They are a struct table_file_hdr followed by as many records as there were
+ * entries. Everything is in network byte order, so the files can travel
+ * between machines.
+ *
+ * `--instance --remove --snapshot` and `--instance --add --restore` use session
+ * table files to carry the sessions across module reloads.
+ */
+#define TABLE_FILE_MAGIC "JOOL"
+#define TABLE_FILE_VERSION 1
+
+enum table_file_type {
+	/** The records are struct bib_file_records. */
+	TABLE_FILE_BIB = 1,
+	/** The records are struct joold_sessions. */
+	TABLE_FILE_SESSION = 2,
+};
+
+struct table_file_hdr {
+	char magic[4];
+	__u8 version;
+	/** See enum table_file_type. */
+	__u8 type;
+	/** sizeof() one record; catches layout changes. */
+	__be16 record_size;
+	__u8 reserved[4];
+	/**
+	 * Wall clock time (seconds since the epoch) of the export. Sessions
+	 * age by however long the file sat on disk.
+	 */
+	__be64 export_time;
+};
+
+/** A BIB entry, as written in a table file. (28 bytes, no holes.) */
+struct bib_file_record {
+	struct in6_addr addr6;
+	struct in_addr addr4;
+	__be16 port6;
+	__be16 port4;
+	__u8 l4_proto;
+	__u8 is_static;
+	__u8 padding[2];
+};
+
+int table_file_create(char *file_name, enum table_file_type type,
+		size_t record_size, FILE **result);
+int table_file_open(char *file_name, enum table_file_type type,
+		size_t record_size, FILE **result, struct table_file_hdr *hdr);
+int table_file_write(FILE *file, void *records, size_t size, unsigned int count);
+int table_file_read(FILE *file, void *record, size_t size);
+int table_file_close(FILE *file);
+/** @} */
+
 #endif
@@ -16,6 +16,9 @@
 #define OPTNAME_PARSE_FILE		"file"
 #define OPTNAME_JOOLD			"joold"
 #define OPTNAME_INSTANCE		"instance"
+#define OPTNAME_XDP			"xdp"
+#define OPTNAME_STATS			"stats"
+#define OPTNAME_EVENTS			"events"
 
 /* Operations */
 #define OPTNAME_DISPLAY			"display"
@@ -35,28 +38,55 @@
 #define OPTNAME_OVERRIDE_TOS		"override-tos"
 #define OPTNAME_TOS			"tos"
 #define OPTNAME_MTU_PLATEAUS		"mtu-plateaus"
+#define OPTNAME_DEBUG			"debug"
+#define OPTNAME_LATENCY_SAMPLING	"latency-sampling"
+#define OPTNAME_MIRROR_SAMPLING		"mirror-sampling"
+#define OPTNAME_PACKET_BUDGET		"packet-budget"
+#define OPTNAME_MSS_CLAMP		"mss-clamp"
 
 /* SIIT-only flags */
 #define OPTNAME_AMEND_UDP_CSUM		"amend-udp-checksum-zero"
 #define OPTNAME_EAM_HAIRPIN_MODE	"eam-hairpin-mode"
 #define OPTNAME_RANDOMIZE_RFC6791	"randomize-rfc6791-addresses"
 #define OPTNAME_RFC6791V6_PREFIX	"rfc6791v6-prefix"
+#define OPTNAME_CLAT			"clat"
 
 /* NAT64-only flags */
 #define OPTNAME_DROP_BY_ADDR		"address-dependent-filtering"
 #define OPTNAME_DROP_ICMP6_INFO		"drop-icmpv6-info"
 #define OPTNAME_DROP_EXTERNAL_TCP	"drop-externally-initiated-tcp"
 #define OPTNAME_UDP_TIMEOUT		"udp-timeout"
+#define OPTNAME_UDP_SHORT_TIMEOUT	"udp-short-timeout"
+#define OPTNAME_UDP_SHORT_PORTS		"udp-short-ports"
 #define OPTNAME_ICMP_TIMEOUT		"icmp-timeout"
 #define OPTNAME_TCPEST_TIMEOUT		"tcp-est-timeout"
 #define OPTNAME_TCPTRANS_TIMEOUT	"tcp-trans-timeout"
+#define OPTNAME_TCPCLOSED_TIMEOUT	"tcp-closed-timeout"
 #define OPTNAME_FRAG_TIMEOUT		"fragment-arrival-timeout"
+#define OPTNAME_FRAG_HIGH_THRESH	"fragment-high-thresh"
+#define OPTNAME_FRAG_LOW_THRESH		"fragment-low-thresh"
+#define OPTNAME_FRAG_VIRTUAL		"fragment-virtual-reassembly"
 #define OPTNAME_MAX_SO			"maximum-simultaneous-opens"
+#define OPTNAME_MAX_SO_BYTES		"maximum-simultaneous-opens-bytes"
+#define OPTNAME_STATELESS_SO		"stateless-simultaneous-opens"
+#define OPTNAME_MAX_SESSIONS_TCP	"tcp-max-sessions"
+#define OPTNAME_MAX_SESSIONS_UDP	"udp-max-sessions"
+#define OPTNAME_MAX_SESSIONS_ICMP	"icmp-max-sessions"
+#define OPTNAME_SUBSCRIBER_PLEN		"subscriber-prefix-length"
+#define OPTNAME_SUBSCRIBER_MAX_BIBS	"subscriber-max-bibs"
+#define OPTNAME_SUBSCRIBER_MAX_SESSIONS	"subscriber-max-sessions"
+#define OPTNAME_SUBSCRIBER_MAX_RATE	"subscriber-max-rate"
+#define OPTNAME_CPS_BUDGET		"cps-budget"
+#define OPTNAME_PORT_BLOCK_SIZE		"port-block-size"
+#define OPTNAME_DETERMINISTIC_BITS	"deterministic-subscriber-bits"
+#define OPTNAME_POOL4_BALANCE		"pool4-balance"
 #define OPTNAME_SRC_ICMP6E_BETTER	"source-icmpv6-errors-better"
 #define OPTNAME_HANDLE_FIN_RCV_RST	"handle-rst-during-fin-rcv"
 #define OPTNAME_F_ARGS			"f-args"
+#define OPTNAME_F_ALGORITHM		"f-algorithm"
 #define OPTNAME_BIB_LOGGING		"logging-bib"
 #define OPTNAME_SESSION_LOGGING		"logging-session"
+#define OPTNAME_LOGGING_STREAM		"logging-stream"
 
 /* pool4 flags */
 #define OPTNAME_MARK			"mark"
@@ -68,6 +98,13 @@
 #define OPTNAME_SS_FLUSH_DEADLINE	"ss-flush-deadline"
 #define OPTNAME_SS_CAPACITY		"ss-capacity"
 #define OPTNAME_SS_MAX_PAYLOAD		"ss-max-payload"
+#define OPTNAME_SS_WINDOW		"ss-window"
+#define OPTNAME_SS_COMPACT		"ss-compact"
+#define OPTNAME_SS_RESYNC_INTERVAL	"ss-resync-interval"
+#define OPTNAME_SS_ADVERTISE_CHUNK	"ss-advertise-chunk"
+#define OPTNAME_SS_ADVERTISE_RATE	"ss-advertise-rate"
+#define OPTNAME_SS_NODE_COUNT		"ss-node-count"
+#define OPTNAME_SS_NODE_ID		"ss-node-id"
 
 int global_display(display_flags flags);
 int global_update(__u16 type, size_t size, void *data);
@@ -1,7 +1,7 @@
 #ifndef _JOOL_USR_INSTANCE_H
 #define _JOOL_USR_INSTANCE_H
 
-int instance_add(void);
+int instance_add(char *shared_tables, char *from);
 int instance_rm(void);
 
 #endif /* _JOOL_USR_INSTANCE_H */
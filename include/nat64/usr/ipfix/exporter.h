@@ -0,0 +1,37 @@
+#ifndef _JOOL_IPFIX_EXPORTER_H
+#define _JOOL_IPFIX_EXPORTER_H
+
+/**
+ * The IPFIX (RFC 7011) encoder of the NAT event daemon. It turns the kernel's
+ * BIB, session and port block events into RFC 8158 NAT logging records, and
+ * sends them to a single collector over UDP.
+ */
+
+#include "nat64/common/config.h"
+
+/** Well-known IPFIX port. (RFC 7011, section 10.3.) */
+#define IPFIX_DEFAULT_PORT "4739"
+/**
+ * RFC 7011 recommends 600 seconds for templateRefreshTimeout, and collectors
+ * forget the templates in about three times as many.
+ */
+#define IPFIX_DEFAULT_TEMPLATE_REFRESH 600
+
+struct exporter_config {
+	/** Where the records will be sent. Lacks a default. */
+	char *collector_addr;
+	/** UDP port of @collector_addr. */
+	char *collector_port;
+	/** Observation Domain ID of every message. Defaults to zero. */
+	__u32 domain;
+	/** Seconds between template retransmissions. */
+	unsigned int template_refresh;
+};
+
+int exporter_setup(struct exporter_config *config);
+void exporter_teardown(void);
+
+void exporter_add(struct bib_event_usr *event);
+void exporter_flush(void);
+
+#endif /* _JOOL_IPFIX_EXPORTER_H */
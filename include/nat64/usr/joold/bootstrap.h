@@ -0,0 +1,23 @@
+#ifndef _JOOL_JOOLD_BOOTSTRAP_H
+#define _JOOL_JOOLD_BOOTSTRAP_H
+
+/**
+ * Warm standby: before this instance starts sending its own sessions, ask the
+ * peers for their whole tables, and wait until one of them says it's done.
+ */
+
+#include <stdbool.h>
+
+/** Seconds to wait for the peers' tables, unless the configuration says so. */
+#define DEFAULT_BOOTSTRAP_TIMEOUT 60
+
+struct bootstrap_config {
+	/** Ask the peers for an advertisement on start? Defaults to false. */
+	bool enabled;
+	/** Seconds to wait for a complete advertisement. */
+	unsigned int timeout;
+};
+
+int bootstrap_run(struct bootstrap_config *config);
+
+#endif
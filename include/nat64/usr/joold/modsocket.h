@@ -11,6 +11,8 @@ int modsocket_setup(void);
 void modsocket_teardown(void);
 
 void *modsocket_listen(void *arg);
+void *modsocket_write(void *arg);
 void modsocket_send(void *buffer, size_t size);
+void modsocket_advertise(void);
 
 #endif
@@ -5,12 +5,37 @@
  * This is the socket we use to talk to other joold instances in the network.
  */
 
+#include <stdbool.h>
 #include <stddef.h>
+#include "nat64/usr/joold/bootstrap.h"
 
-int netsocket_setup(int argc, char **argv);
+/**
+ * Maximum number of datagrams (or Netlink messages) joold moves per system
+ * call.
+ */
+#define JOOLD_BATCH 32
+
+/**
+ * CPUs the daemon's threads should be pinned to. -1 means "don't pin it."
+ */
+struct joold_cpus {
+	/** The thread that sends the kernel's sessions to the network. */
+	int mod2net;
+	/** The thread that reads the peers' sessions from the network. */
+	int net_reader;
+	/** The thread that writes the peers' sessions to the kernel. */
+	int kernel_writer;
+};
+
+int netsocket_setup(int argc, char **argv, struct joold_cpus *cpus,
+		struct bootstrap_config *bootstrap);
 void netsocket_teardown(void);
+bool netsocket_in_kernel(void);
 
 void *netsocket_listen(void *arg);
+int netsocket_queue(void *buffer, size_t size);
 void netsocket_send(void *buffer, size_t size);
+unsigned int netsocket_queued(void);
+void netsocket_flush(void);
 
 #endif
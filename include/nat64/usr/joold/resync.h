@@ -0,0 +1,30 @@
+#ifndef _JOOL_JOOLD_RESYNC_H
+#define _JOOL_JOOLD_RESYNC_H
+
+/**
+ * Gap detection.
+ *
+ * The kernels number their joold messages (request_hdr.seq), and the daemons
+ * forward them verbatim, so a receiver can tell when some of a peer's
+ * datagrams got lost. Instead of waiting for a full advertisement, it asks the
+ * peers for the sessions that changed since the last datagram that made it.
+ * (See struct joold_adv_request.)
+ *
+ * Peers are told apart by their source addresses.
+ */
+
+#include <sys/socket.h>
+#include "nat64/common/config.h"
+
+/** An OP_ADVERTISE that only wants the latest sessions. */
+struct resync_request {
+	struct request_hdr hdr;
+	struct joold_adv_request adv;
+};
+
+unsigned long long resync_now(void);
+void resync_init(struct resync_request *request, unsigned long long since);
+void resync_check(struct sockaddr *addr, socklen_t addr_len, void *data,
+		size_t data_len);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _JOOL_JOOLD_RING_H
+#define _JOOL_JOOLD_RING_H
+
+/**
+ * Queue of datagrams received from the network, waiting to be written to the
+ * kernel.
+ *
+ * There is exactly one producer (the thread that reads from the network) and
+ * exactly one consumer (the thread that writes to the kernel), so the ring
+ * itself needs no locks. The semaphores only exist so each thread can sleep
+ * while the ring is full or empty.
+ */
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+int ring_setup(void);
+void ring_teardown(void);
+
+/* Producer */
+unsigned int ring_reserve(struct iovec *slots, unsigned int max);
+void ring_publish(unsigned int reserved, unsigned int used, size_t *lengths);
+
+/* Consumer */
+unsigned int ring_peek(struct iovec *slots, unsigned int max);
+void ring_release(unsigned int count);
+
+#endif
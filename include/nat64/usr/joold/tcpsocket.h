@@ -0,0 +1,23 @@
+#ifndef _JOOL_JOOLD_TCPSOCKET_H
+#define _JOOL_JOOLD_TCPSOCKET_H
+
+/**
+ * The optional alternative to netsocket's multicast: sessions travel to a
+ * fixed list of peers over TCP.
+ *
+ * TCP doesn't lose anything, and it pushes back when a peer is slow; a
+ * blocked write stops us from ACKing the kernel, and the kernel stops sending
+ * once its window (--ss-window) is full. So sessions queue up in the kernel
+ * instead of being dropped somewhere in the network.
+ */
+
+#include <stddef.h>
+#include "nat64/usr/cJSON.h"
+
+int tcpsocket_setup(cJSON *json);
+void tcpsocket_teardown(void);
+
+void *tcpsocket_listen(void *arg);
+void tcpsocket_send(void *buffer, size_t size);
+
+#endif
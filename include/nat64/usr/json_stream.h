@@ -0,0 +1,45 @@
+#ifndef _JOOL_USR_JSON_STREAM_H
+#define _JOOL_USR_JSON_STREAM_H
+
+/**
+ * @file
+ * Reads a JSON file incrementally, one value at a time, so its size doesn't
+ * have to fit in memory twice (once as text, once as a cJSON tree).
+ *
+ * Only the top-level object and the arrays right below it are streamed; their
+ * members and elements are handed out as cJSON trees, one at a time. That's
+ * all the configuration files need: the large tables are the arrays, and each
+ * of their entries is tiny.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "nat64/usr/cJSON.h"
+
+struct json_stream {
+	FILE *file;
+	/** Current line, for error messages. */
+	unsigned int line;
+
+	/** Text of the value being read. */
+	char *buffer;
+	size_t len;
+	size_t capacity;
+
+	/** Whether the next key or element is the first of its container. */
+	bool first_key;
+	bool first_element;
+};
+
+int jstream_open(struct json_stream *stream, char *file_name);
+void jstream_close(struct json_stream *stream);
+
+int jstream_object_start(struct json_stream *stream);
+int jstream_next_key(struct json_stream *stream, char **key);
+
+int jstream_array_start(struct json_stream *stream);
+int jstream_next_element(struct json_stream *stream, cJSON **json);
+
+int jstream_value(struct json_stream *stream, cJSON **json);
+
+#endif /* _JOOL_USR_JSON_STREAM_H */
@@ -0,0 +1,56 @@
+#ifndef _JOOL_USR_LINES_H
+#define _JOOL_USR_LINES_H
+
+/**
+ * @file
+ * Formats table records (one per line, CSV or JSON) into a local buffer, and
+ * hands whole lines to a large, fully-buffered stdout.
+ *
+ * The large dumps (millions of sessions) used to spend most of their time in
+ * printf(): parsing format strings and locking stdout, several times per
+ * field. Scripts should use the --csv or --jsonl output, which come straight
+ * from here, instead of parsing the human-readable tables.
+ */
+
+#include <stdbool.h>
+#include <netinet/in.h>
+#include "nat64/common/types.h"
+#include "nat64/usr/types.h"
+
+/* Longest line any record can produce, with room to spare. */
+#define LINE_CAPACITY 1024
+
+struct line {
+	char buffer[LINE_CAPACITY];
+	size_t len;
+	/** JSON object (true) or CSV row (false)? */
+	bool json;
+	/** Number of fields written so far. */
+	unsigned int fields;
+};
+
+/**
+ * Should the records be printed through here? (Hostnames are resolved by the
+ * old printer, so numeric CSV is the only CSV that can.)
+ */
+static inline bool lines_wanted(display_flags flags)
+{
+	return (flags & DF_JSONL) || ((flags & DF_CSV_FORMAT)
+			&& (flags & DF_NUMERIC_HOSTNAME));
+}
+
+void lines_init(void);
+
+void line_start(struct line *line, bool json);
+void line_end(struct line *line);
+
+void line_str(struct line *line, const char *name, const char *value);
+void line_u64(struct line *line, const char *name, __u64 value);
+void line_bool(struct line *line, const char *name, bool value);
+void line_addr6(struct line *line, const char *name,
+		const struct in6_addr *addr);
+void line_addr4(struct line *line, const char *name,
+		const struct in_addr *addr);
+void line_time(struct line *line, const char *name, unsigned int millis);
+
+#endif /* _JOOL_USR_LINES_H */
@@ -19,6 +19,19 @@
 	#error "Unsupported LIBNL library version number (< 3.0)."
 #endif
 
+/**
+ * Largest request payload. The whole request travels in a single attribute,
+ * and attribute lengths are 16-bit.
+ */
+#define NETLINK_REQUEST_MAX (0xFFFFu - NLA_HDRLEN)
+/**
+ * Size of the socket's buffers. The kernel sizes each dump message after the
+ * largest buffer we've offered recvmsg(), so this is also what keeps the
+ * dumps from coming in page-sized chunks.
+ */
+#define NETLINK_SOCKET_BUFSIZE (1024 * 1024)
+#define NETLINK_MSG_BUFSIZE (64 * 1024)
+
 struct jool_response {
 	struct response_hdr *hdr;
 	void *payload;
@@ -29,6 +42,12 @@ typedef int (*jool_response_cb)(struct jool_response *, void *);
 int netlink_request(void *request, __u32 request_len,
 		jool_response_cb cb, void *cb_arg);
 int netlink_request_simple(void *request, __u32 request_len);
+int netlink_dump(void *request, __u32 request_len,
+		jool_response_cb cb, void *cb_arg);
+
+void netlink_pipeline_begin(void);
+void netlink_pipeline_tag(unsigned int tag);
+int netlink_pipeline_end(void);
 
 int netlink_setup(void);
 void netlink_teardown(void);
@@ -6,6 +6,7 @@
 
 
 int pool4_display(display_flags flags);
+int pool4_display_usage(display_flags flags);
 int pool4_count(void);
 int pool4_add(struct pool4_entry_usr *entry, bool force);
 int pool4_update(struct pool4_update *args);
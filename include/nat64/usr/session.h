@@ -1,10 +1,17 @@
 #ifndef _JOOL_USR_SESSION_H
 #define _JOOL_USR_SESSION_H
 
+#include "nat64/common/config.h"
+#include "nat64/common/session.h"
 #include "nat64/usr/types.h"
 
-int session_display(display_flags flags);
+char *tcp_state_to_string(tcp_state state);
+int session_display(display_flags flags, struct bib_filter *filter);
 int session_count(display_flags flags);
+int session_export(display_flags flags, struct bib_filter *filter,
+		char *file_name);
+int session_import(display_flags flags, char *file_name);
+int session_follow(display_flags flags, __u64 *since);
 
 
 #endif /* _JOOL_USR_SESSION_H */
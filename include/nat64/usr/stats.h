@@ -0,0 +1,8 @@
+#ifndef _JOOL_USR_STATS_H
+#define _JOOL_USR_STATS_H
+
+#include "nat64/usr/types.h"
+
+int stats_display(display_flags flags, unsigned int interval);
+
+#endif /* _JOOL_USR_STATS_H */
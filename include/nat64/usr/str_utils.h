@@ -60,6 +60,23 @@ int str_to_addr6_port(const char *str, struct ipv6_transport_addr *out);
 int str_to_prefix6(const char *str, struct ipv6_prefix *out);
 int str_to_prefix4(const char *str, struct ipv4_prefix *out);
 
+/**
+ * Quiet, allocation-free versions of the functions above, for the bulk loaders.
+ * They parse exactly the first @len characters of @str (which therefore doesn't
+ * need to be NUL-terminated) in a single pass, and return -EINVAL on any
+ * syntax error without printing anything; the caller is expected to report
+ * the line (or entry) number.
+ */
+int parse_addr4(const char *str, size_t len, struct in_addr *out);
+int parse_addr6(const char *str, size_t len, struct in6_addr *out);
+int parse_addr4_port(const char *str, size_t len,
+		struct ipv4_transport_addr *out);
+int parse_addr6_port(const char *str, size_t len,
+		struct ipv6_transport_addr *out);
+int parse_prefix4(const char *str, size_t len, struct ipv4_prefix *out);
+int parse_prefix6(const char *str, size_t len, struct ipv6_prefix *out);
+int parse_port_range(const char *str, size_t len, struct port_range *out);
+
 /**
  * Prints the @millis amount of milliseconds as spreadsheet-friendly format in
  * the console.
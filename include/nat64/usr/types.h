@@ -10,11 +10,18 @@ typedef enum display_flags {
 	DF_CSV_FORMAT = 1 << 4,
 	DF_SHOW_HEADERS = 1 << 5,
 	DF_NUMERIC_HOSTNAME = 1 << 6,
+	DF_USAGE = 1 << 7,
+	DF_DETAILS = 1 << 8,
+	DF_COUNTERS = 1 << 9,
+	DF_RESET = 1 << 10,
+	/* One JSON object per line. */
+	DF_JSONL = 1 << 11,
 } display_flags;
 
 static inline bool show_footer(display_flags flags)
 {
-	return (flags & DF_SHOW_HEADERS) && !(flags & DF_CSV_FORMAT);
+	return (flags & DF_SHOW_HEADERS)
+			&& !(flags & (DF_CSV_FORMAT | DF_JSONL));
 }
 
 #endif /* INCLUDE_NAT64_USR_TYPES_H_ */
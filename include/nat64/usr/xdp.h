@@ -0,0 +1,6 @@
+#ifndef _JOOL_USR_XDP_H
+#define _JOOL_USR_XDP_H
+
+int xdp_update(void);
+
+#endif /* _JOOL_USR_XDP_H */
@@ -1,10 +1,14 @@
 #include "nat64/mod/common/atomic_config.h"
 
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
 #include "nat64/mod/common/nl/global.h"
 #include "nat64/mod/common/pool6.h"
 #include "nat64/mod/common/wkmalloc.h"
+#include "nat64/mod/stateless/blacklist4.h"
 #include "nat64/mod/stateless/eam.h"
 #include "nat64/mod/stateless/pool.h"
+#include "nat64/mod/stateless/rfc6791.h"
 #include "nat64/mod/stateful/fragment_db.h"
 #include "nat64/mod/stateful/joold.h"
 #include "nat64/mod/stateful/pool4/db.h"
@@ -19,6 +23,486 @@
 
 static DEFINE_MUTEX(lock);
 
+static void list_clean(struct candidate_list *list)
+{
+	if (list->entries)
+		vfree(list->entries);
+	memset(list, 0, sizeof(*list));
+}
+
+/** Makes sure @list has room for @count more entries of @size bytes. */
+static int list_reserve(struct candidate_list *list, unsigned int count,
+		size_t size)
+{
+	unsigned int capacity;
+	void *entries;
+
+	if (list->count + count <= list->capacity)
+		return 0;
+
+	capacity = max(2 * list->capacity, list->count + count);
+	capacity = max(capacity, 64u);
+	entries = vmalloc(capacity * size);
+	if (!entries)
+		return -ENOMEM;
+
+	if (list->entries) {
+		memcpy(entries, list->entries, list->count * size);
+		vfree(list->entries);
+	}
+	list->entries = entries;
+	list->capacity = capacity;
+	return 0;
+}
+
+static int list_append(struct candidate_list *list, void *entries,
+		unsigned int count, size_t size)
+{
+	int error;
+
+	list->set = true;
+	error = list_reserve(list, count, size);
+	if (error)
+		return error;
+
+	memcpy(list->entries + list->count * size, entries, count * size);
+	list->count += count;
+	return 0;
+}
+
+/**
+ * How commit() diffs one kind of table.
+ */
+struct table_ops {
+	/** Size of an entry. */
+	size_t size;
+	/** Any total order will do; it's only used to line the lists up. */
+	int (*cmp)(const void *, const void *);
+	/** Copies all of @table's entries to @list. */
+	int (*collect)(void *table, struct candidate_list *list);
+	int (*add)(void *table, void *entry);
+	/**
+	 * Optional. Adds @count entries at once, or none of them. For tables
+	 * whose adds are expensive one at a time.
+	 */
+	int (*add_bulk)(void *table, void *entries, unsigned int count);
+	int (*rm)(void *table, void *entry);
+};
+
+/**
+ * The changes commit() is making to a running table, so they can be reverted
+ * if some other part of the commit fails.
+ */
+struct table_diff {
+	const struct table_ops *ops;
+	void *table;
+	/** Entries the table is missing, and how many of them were added. */
+	struct candidate_list adds;
+	unsigned int added;
+	/** Entries the table shouldn't have, and how many were removed. */
+	struct candidate_list rms;
+	unsigned int removed;
+};
+
+static int cmp_eam(const void *a, const void *b)
+{
+	const struct eamt_entry *eam1 = a;
+	const struct eamt_entry *eam2 = b;
+	int gap;
+
+	gap = memcmp(&eam1->prefix6.address, &eam2->prefix6.address,
+			sizeof(eam1->prefix6.address));
+	if (gap)
+		return gap;
+	gap = (int)eam1->prefix6.len - eam2->prefix6.len;
+	if (gap)
+		return gap;
+	gap = memcmp(&eam1->prefix4.address, &eam2->prefix4.address,
+			sizeof(eam1->prefix4.address));
+	if (gap)
+		return gap;
+	return (int)eam1->prefix4.len - eam2->prefix4.len;
+}
+
+static int collect_eam_cb(struct eamt_entry *eam, void *arg)
+{
+	struct candidate_list *list = arg;
+
+	if (list->count == list->capacity)
+		return -EAGAIN;
+	((struct eamt_entry *)list->entries)[list->count++] = *eam;
+	return 0;
+}
+
+static int collect_eamt(void *table, struct candidate_list *list)
+{
+	__u64 count;
+	int error;
+
+	error = eamt_count(table, &count);
+	if (error)
+		return error;
+	error = list_reserve(list, count, sizeof(struct eamt_entry));
+	if (error)
+		return error;
+
+	return eamt_foreach(table, collect_eam_cb, list, NULL);
+}
+
+static int add_eam(void *table, void *entry)
+{
+	struct eamt_entry *eam = entry;
+	/* TODO (issue164) force should be variable. */
+	return eamt_add(table, &eam->prefix6, &eam->prefix4, true);
+}
+
+/* One sort, one validation pass and one index rebuild for the whole batch. */
+static int add_eams(void *table, void *entries, unsigned int count)
+{
+	return eamt_add_bulk(table, entries, count, true);
+}
+
+static int rm_eam(void *table, void *entry)
+{
+	struct eamt_entry *eam = entry;
+	return eamt_rm(table, &eam->prefix6, &eam->prefix4);
+}
+
+static const struct table_ops eamt_ops = {
+	.size = sizeof(struct eamt_entry),
+	.cmp = cmp_eam,
+	.collect = collect_eamt,
+	.add = add_eam,
+	.add_bulk = add_eams,
+	.rm = rm_eam,
+};
+
+static int cmp_prefix4(const void *a, const void *b)
+{
+	const struct ipv4_prefix *prefix1 = a;
+	const struct ipv4_prefix *prefix2 = b;
+	int gap;
+
+	gap = memcmp(&prefix1->address, &prefix2->address,
+			sizeof(prefix1->address));
+	return gap ? : ((int)prefix1->len - prefix2->len);
+}
+
+static int count_prefix4_cb(struct ipv4_prefix *prefix, void *arg)
+{
+	(*((unsigned int *)arg))++;
+	return 0;
+}
+
+static int collect_prefix4_cb(struct ipv4_prefix *prefix, void *arg)
+{
+	struct candidate_list *list = arg;
+
+	if (list->count == list->capacity)
+		return -EAGAIN;
+	((struct ipv4_prefix *)list->entries)[list->count++] = *prefix;
+	return 0;
+}
+
+/* pool_foreach() can't sleep, so the room has to be reserved beforehand. */
+static int collect_addr4_pool(void *table, struct candidate_list *list)
+{
+	unsigned int count = 0;
+	int error;
+
+	error = pool_foreach(table, count_prefix4_cb, &count, NULL);
+	if (error)
+		return error;
+	error = list_reserve(list, count, sizeof(struct ipv4_prefix));
+	if (error)
+		return error;
+
+	return pool_foreach(table, collect_prefix4_cb, list, NULL);
+}
+
+static int add_prefix4(void *table, void *entry)
+{
+	/* TODO (issue164) force should be variable. */
+	return pool_add(table, entry, true);
+}
+
+static int rm_prefix4(void *table, void *entry)
+{
+	return pool_rm(table, entry);
+}
+
+static const struct table_ops addr4_pool_ops = {
+	.size = sizeof(struct ipv4_prefix),
+	.cmp = cmp_prefix4,
+	.collect = collect_addr4_pool,
+	.add = add_prefix4,
+	.rm = rm_prefix4,
+};
+
+static int count_prefix6_cb(struct ipv6_prefix *prefix, void *arg)
+{
+	(*((unsigned int *)arg))++;
+	return 0;
+}
+
+static int collect_prefix6_cb(struct ipv6_prefix *prefix, void *arg)
+{
+	struct candidate_list *list = arg;
+
+	if (list->count == list->capacity)
+		return -EAGAIN;
+	((struct ipv6_prefix *)list->entries)[list->count++] = *prefix;
+	return 0;
+}
+
+/* Same as collect_addr4_pool(); pool6_foreach() can't sleep either. */
+static int collect_pool6(void *table, struct candidate_list *list)
+{
+	unsigned int count = 0;
+	int error;
+
+	error = pool6_foreach(table, count_prefix6_cb, &count, NULL);
+	if (error)
+		return error;
+	error = list_reserve(list, count, sizeof(struct ipv6_prefix));
+	if (error)
+		return error;
+
+	return pool6_foreach(table, collect_prefix6_cb, list, NULL);
+}
+
+static int add_prefix6(void *table, void *entry)
+{
+	return pool6_add(table, entry);
+}
+
+/* pool6 is replaced whole by commits; this is only for cloning. */
+static const struct table_ops pool6_ops = {
+	.size = sizeof(struct ipv6_prefix),
+	.collect = collect_pool6,
+	.add = add_prefix6,
+};
+
+static void *list_get(struct candidate_list *list, unsigned int i, size_t size)
+{
+	return list->entries + i * size;
+}
+
+/**
+ * Copies every entry of @src into @dst, which is expected to be empty.
+ */
+static int clone_table(void *src, void *dst, const struct table_ops *ops)
+{
+	struct candidate_list entries = { NULL };
+	unsigned int i;
+	int error;
+
+	error = ops->collect(src, &entries);
+	if (!error && ops->add_bulk && entries.count > 0)
+		error = ops->add_bulk(dst, entries.entries, entries.count);
+	else
+		for (i = 0; !error && i < entries.count; i++)
+			error = ops->add(dst, list_get(&entries, i, ops->size));
+
+	list_clean(&entries);
+	return error;
+}
+
+/**
+ * Returns a private copy of @pool, or NULL if there's not enough memory.
+ * (The caller is expected to keep everyone else from modifying @pool in the
+ * meantime.)
+ */
+struct pool6 *atomconfig_clone_pool6(struct pool6 *pool)
+{
+	struct pool6 *result;
+
+	result = pool6_alloc();
+	if (!result)
+		return NULL;
+	if (clone_table(pool, result, &pool6_ops)) {
+		pool6_put(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+/** Same as atomconfig_clone_pool6(), for EAMTs. */
+struct eam_table *atomconfig_clone_eamt(struct eam_table *eamt)
+{
+	struct eam_table *result;
+
+	result = eamt_alloc();
+	if (!result)
+		return NULL;
+	if (clone_table(eamt, result, &eamt_ops)) {
+		eamt_put(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+/** Same as atomconfig_clone_pool6(), for blacklist4. */
+struct addr4_pool *atomconfig_clone_blacklist(struct addr4_pool *pool)
+{
+	struct addr4_pool *result;
+
+	result = blacklist_alloc();
+	if (!result)
+		return NULL;
+	if (clone_table(pool, result, &addr4_pool_ops)) {
+		blacklist_put(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+/** Same as atomconfig_clone_pool6(), for the RFC 6791 pool. */
+struct addr4_pool *atomconfig_clone_pool6791(struct addr4_pool *pool)
+{
+	struct addr4_pool *result;
+
+	result = rfc6791_alloc();
+	if (!result)
+		return NULL;
+	if (clone_table(pool, result, &addr4_pool_ops)) {
+		rfc6791_put(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+/**
+ * Fills @diff with the entries that need to be added to and removed from
+ * @table so it ends up containing exactly @new. (Which gets sorted.)
+ * Duplicates are treated like separate entries.
+ */
+static int compute_diff(void *table, const struct table_ops *ops,
+		struct candidate_list *new, struct table_diff *diff)
+{
+	struct candidate_list old = { NULL };
+	unsigned int i = 0, j = 0;
+	void *entry;
+	int gap;
+	int error;
+
+	memset(diff, 0, sizeof(*diff));
+	diff->ops = ops;
+	diff->table = table;
+
+	error = ops->collect(table, &old);
+	if (error) {
+		if (error == -EAGAIN)
+			log_err("The table changed while I was reading it. Please try again.");
+		goto end;
+	}
+
+	sort(new->entries, new->count, ops->size, ops->cmp, NULL);
+	sort(old.entries, old.count, ops->size, ops->cmp, NULL);
+
+	while (i < new->count || j < old.count) {
+		if (i == new->count)
+			gap = 1;
+		else if (j == old.count)
+			gap = -1;
+		else
+			gap = ops->cmp(list_get(new, i, ops->size),
+					list_get(&old, j, ops->size));
+
+		if (gap == 0) {
+			i++;
+			j++;
+			continue;
+		}
+
+		if (gap < 0) {
+			entry = list_get(new, i++, ops->size);
+			error = list_append(&diff->adds, entry, 1, ops->size);
+		} else {
+			entry = list_get(&old, j++, ops->size);
+			error = list_append(&diff->rms, entry, 1, ops->size);
+		}
+		if (error)
+			goto end;
+	}
+	/* Fall through. */
+
+end:
+	list_clean(&old);
+	return error;
+}
+
+static void diff_clean(struct table_diff *diff)
+{
+	list_clean(&diff->adds);
+	list_clean(&diff->rms);
+}
+
+/**
+ * Applies @diff to its table; removals first, so the replaced entries do not
+ * collide with their replacements. If something fails, the caller should
+ * diff_revert().
+ */
+static int diff_apply(struct table_diff *diff)
+{
+	const struct table_ops *ops = diff->ops;
+	int error;
+
+	for (; diff->removed < diff->rms.count; diff->removed++) {
+		error = ops->rm(diff->table, list_get(&diff->rms, diff->removed,
+				ops->size));
+		if (error)
+			return error;
+	}
+
+	if (ops->add_bulk && diff->added == 0 && diff->adds.count > 0) {
+		error = ops->add_bulk(diff->table, diff->adds.entries,
+				diff->adds.count);
+		if (error)
+			return error;
+		diff->added = diff->adds.count;
+	}
+
+	for (; diff->added < diff->adds.count; diff->added++) {
+		error = ops->add(diff->table, list_get(&diff->adds, diff->added,
+				ops->size));
+		if (error)
+			return error;
+	}
+
+	return 0;
+}
+
+/**
+ * Undoes whatever part of @diff was applied.
+ * (Re-adding can fail on memory allocation, which would leave the table
+ * mutilated. It's not much worse than what a failing manual edit does.)
+ */
+static void diff_revert(struct table_diff *diff)
+{
+	const struct table_ops *ops = diff->ops;
+	int error;
+
+	while (diff->added > 0) {
+		diff->added--;
+		ops->rm(diff->table, list_get(&diff->adds, diff->added,
+				ops->size));
+	}
+
+	while (diff->removed > 0) {
+		diff->removed--;
+		error = ops->add(diff->table, list_get(&diff->rms,
+				diff->removed, ops->size));
+		if (error)
+			log_err("Could not restore an entry during a rollback (error %d). The table is now incomplete.",
+					error);
+	}
+}
+
 static void candidate_clean(struct config_candidate *candidate)
 {
 	if (candidate->global) {
@@ -30,18 +514,9 @@ static void candidate_clean(struct config_candidate *candidate)
 		candidate->pool6 = NULL;
 	}
 	if (xlat_is_siit()) {
-		if (candidate->siit.eamt) {
-			eamt_put(candidate->siit.eamt);
-			candidate->siit.eamt = NULL;
-		}
-		if (candidate->siit.blacklist) {
-			pool_put(candidate->siit.blacklist);
-			candidate->siit.blacklist = NULL;
-		}
-		if (candidate->siit.pool6791) {
-			pool_put(candidate->siit.pool6791);
-			candidate->siit.pool6791 = NULL;
-		}
+		list_clean(&candidate->siit.eamt);
+		list_clean(&candidate->siit.blacklist);
+		list_clean(&candidate->siit.pool6791);
 	} else {
 		if (candidate->nat64.pool4) {
 			pool4db_put(candidate->nat64.pool4);
@@ -150,60 +625,28 @@ static int handle_eamt(struct config_candidate *new, void *payload,
 {
 	struct eamt_entry *eams = payload;
 	unsigned int eam_count = payload_len / sizeof(*eams);
-	struct eamt_entry *eam;
-	unsigned int i;
-	int error;
 
 	if (xlat_is_nat64()) {
 		log_err("Stateful NAT64 doesn't have an EAMT.");
 		return -EINVAL;
 	}
 
-	if (!new->siit.eamt) {
-		new->siit.eamt = eamt_alloc();
-		if (!new->siit.eamt)
-			return -ENOMEM;
-	}
-
-	for (i = 0; i < eam_count; i++) {
-		eam = &eams[i];
-		/* TODO (issue164) force should be variable. */
-		error = eamt_add(new->siit.eamt, &eam->prefix6, &eam->prefix4,
-				true);
-		if (error)
-			return error;
-	}
-
-	return 0;
+	/* The entries are validated when they're committed. */
+	return list_append(&new->siit.eamt, eams, eam_count, sizeof(*eams));
 }
 
-static int handle_addr4_pool(struct addr4_pool **pool, void *payload,
+static int handle_addr4_pool(struct candidate_list *pool, void *payload,
 		__u32 payload_len)
 {
 	struct ipv4_prefix *prefixes = payload;
 	unsigned int prefix_count = payload_len / sizeof(*prefixes);
-	unsigned int i;
-	int error;
 
 	if (xlat_is_nat64()) {
 		log_err("Stateful NAT64 doesn't have IPv4 address pools.");
 		return -EINVAL;
 	}
 
-	if (!(*pool)) {
-		*pool = pool_alloc();
-		if (!(*pool))
-			return -ENOMEM;
-	}
-
-	for (i = 0; i < prefix_count; i++) {
-		/* TODO (issue164) force should be variable. */
-		error = pool_add(*pool, &prefixes[i], true);
-		if (error)
-			return error;
-	}
-
-	return 0;
+	return list_append(pool, prefixes, prefix_count, sizeof(*prefixes));
 }
 
 static int handle_blacklist(struct config_candidate *new, void *payload,
@@ -258,11 +701,41 @@ static int handle_bib(struct config_candidate *new, void *payload,
 	return -EINVAL;
 }
 
+/**
+ * Patches @table so it ends up containing exactly the entries in @list (if
+ * userspace sent it). The changes are recorded in the next of @diffs, so they
+ * can be reverted.
+ */
+static int commit_list(void *table, const struct table_ops *ops,
+		struct candidate_list *list, struct table_diff *diffs,
+		unsigned int *diff_count)
+{
+	struct table_diff *diff = &diffs[*diff_count];
+	int error;
+
+	if (!list->set)
+		return 0;
+
+	error = compute_diff(table, ops, list, diff);
+	if (error) {
+		diff_clean(diff);
+		return error;
+	}
+	(*diff_count)++;
+
+	log_debug("Applying %u additions and %u removals.", diff->adds.count,
+			diff->rms.count);
+	return diff_apply(diff);
+}
+
 static int commit(struct xlator *jool)
 {
 	struct config_candidate *new = jool->newcfg;
-	struct global_config *global;
+	struct global_config *global = NULL;
 	struct full_config *remnants = NULL;
+	struct table_diff diffs[3];
+	unsigned int diff_count = 0;
+	unsigned int i;
 	int error;
 
 	/*
@@ -275,6 +748,31 @@ static int commit(struct xlator *jool)
 		global = config_alloc();
 		if (!global)
 			return -ENOMEM;
+	}
+
+	/*
+	 * Rebuilding the SIIT tables from scratch made reloading a massive
+	 * configuration take ages, even if only one entry changed. So they
+	 * are patched in place instead, and unpatched if anything fails.
+	 * (Packets might see the patch being applied, entry by entry, but
+	 * only for as long as it takes to apply it.)
+	 */
+	if (xlat_is_siit()) {
+		error = commit_list(jool->siit.eamt, &eamt_ops,
+				&new->siit.eamt, diffs, &diff_count);
+		if (error)
+			goto revert;
+		error = commit_list(jool->siit.blacklist, &addr4_pool_ops,
+				&new->siit.blacklist, diffs, &diff_count);
+		if (error)
+			goto revert;
+		error = commit_list(jool->siit.pool6791, &addr4_pool_ops,
+				&new->siit.pool6791, diffs, &diff_count);
+		if (error)
+			goto revert;
+	}
+
+	if (new->global) {
 		config_copy(&new->global->global, &global->cfg);
 
 		remnants = new->global;
@@ -289,23 +787,7 @@ static int commit(struct xlator *jool)
 		new->pool6 = NULL;
 	}
 
-	if (xlat_is_siit()) {
-		if (new->siit.eamt) {
-			eamt_put(jool->siit.eamt);
-			jool->siit.eamt = new->siit.eamt;
-			new->siit.eamt = NULL;
-		}
-		if (new->siit.blacklist) {
-			pool_put(jool->siit.blacklist);
-			jool->siit.blacklist = new->siit.blacklist;
-			new->siit.blacklist = NULL;
-		}
-		if (new->siit.pool6791) {
-			pool_put(jool->siit.pool6791);
-			jool->siit.pool6791 = new->siit.pool6791;
-			new->siit.pool6791 = NULL;
-		}
-	} else {
+	if (xlat_is_nat64()) {
 		if (new->nat64.pool4) {
 			pool4db_put(jool->nat64.pool4);
 			jool->nat64.pool4 = new->nat64.pool4;
@@ -316,9 +798,12 @@ static int commit(struct xlator *jool)
 	error = xlator_replace(jool);
 	if (error) {
 		log_err("xlator_replace() failed. Errcode %d", error);
-		return error;
+		goto revert_diffs;
 	}
 
+	for (i = 0; i < diff_count; i++)
+		diff_clean(&diffs[i]);
+
 	/*
 	 * This the little flaw in the design.
 	 * I can't make full new versions of BIB, joold and frag just
@@ -338,6 +823,20 @@ static int commit(struct xlator *jool)
 	jool->newcfg->active = false;
 	log_debug("Configuration replaced.");
 	return 0;
+
+revert:
+	if (global)
+		config_put(global);
+	/* Fall through. */
+
+revert_diffs:
+	if (remnants)
+		wkfree(struct full_config, remnants);
+	for (i = diff_count; i > 0; i--) {
+		diff_revert(&diffs[i - 1]);
+		diff_clean(&diffs[i - 1]);
+	}
+	return error;
 }
 
 int atomconfig_add(struct xlator *jool, void *config, size_t config_len)
@@ -10,6 +10,8 @@
 
 static DEFINE_MUTEX(lock);
 
+struct static_key jool_debug = STATIC_KEY_INIT_FALSE;
+
 RCUTAG_USR
 struct global_config *config_alloc(void)
 {
@@ -28,16 +30,23 @@ struct global_config *config_alloc(void)
 	config->reset_traffic_class = DEFAULT_RESET_TRAFFIC_CLASS;
 	config->reset_tos = DEFAULT_RESET_TOS;
 	config->new_tos = DEFAULT_NEW_TOS;
+	config->debug = DEFAULT_DEBUG;
+	config->latency_sampling = DEFAULT_LATENCY_SAMPLING;
+	config->mirror_sampling = DEFAULT_MIRROR_SAMPLING;
+	config->packet_budget = DEFAULT_PACKET_BUDGET;
+	config->mss_clamp = DEFAULT_MSS_CLAMP;
 
 	if (xlat_is_siit()) {
 		config->siit.compute_udp_csum_zero = DEFAULT_COMPUTE_UDP_CSUM0;
 		config->siit.eam_hairpin_mode = DEFAULT_EAM_HAIRPIN_MODE;
 		config->siit.randomize_error_addresses = DEFAULT_RANDOMIZE_RFC6791;
 		config->siit.use_rfc6791_v6 = DEFAULT_USE_RFC6791V6_PREFIX;
+		config->siit.clat = DEFAULT_CLAT;
 	} else {
 		config->nat64.src_icmp6errs_better = DEFAULT_SRC_ICMP6ERRS_BETTER;
 		config->nat64.drop_icmp6_info = DEFAULT_FILTER_ICMPV6_INFO;
 		config->nat64.f_args = DEFAULT_F_ARGS;
+		config->nat64.f_algorithm = DEFAULT_F_ALGORITHM;
 		config->nat64.handle_rst_during_fin_rcv = DEFAULT_HANDLE_FIN_RCV_RST;
 	}
 
@@ -64,12 +73,50 @@ void config_put(struct global_config *config)
 	kref_put(&config->refcounter, config_release);
 }
 
+static void config_put_cb(struct rcu_head *rcu)
+{
+	config_put(container_of(rcu, struct global_config, rcu));
+}
+
+/**
+ * Same as config_put(), except the reference is only dropped once the current
+ * RCU-bh grace period ends.
+ *
+ * Meant for the reference held by whoever published @config; readers which
+ * found it through rcu_dereference_bh() might still want to config_get() it.
+ */
+void config_put_rcu(struct global_config *config)
+{
+	call_rcu_bh(&config->rcu, config_put_cb);
+}
+
 RCUTAG_PKT
 void config_copy(struct global_config_usr *from, struct global_config_usr *to)
 {
 	memcpy(to, from, sizeof(*from));
 }
 
+/**
+ * Tells the debug key that an instance's configuration just went from @old to
+ * @new. The key counts the listed instances that want diagnostics, so @old is
+ * NULL when the instance is being added, and @new is NULL when it's being
+ * removed.
+ *
+ * Flipping a static key patches code and can sleep, so this has to happen in
+ * process context. That's why it's tied to the instance list and not to the
+ * global_config's refcount; packets can drop the last reference from softirq.
+ */
+void config_debug_update(struct global_config *old, struct global_config *new)
+{
+	bool was = old ? old->cfg.debug : false;
+	bool is = new ? new->cfg.debug : false;
+
+	if (!was && is)
+		static_key_slow_inc(&jool_debug);
+	else if (was && !is)
+		static_key_slow_dec(&jool_debug);
+}
+
 RCUTAG_FREE
 void prepare_config_for_userspace(struct full_config *config, bool pools_empty)
 {
@@ -84,8 +131,11 @@ void prepare_config_for_userspace(struct full_config *config, bool pools_empty)
 	bib = &config->bib;
 	bib->ttl.tcp_est = jiffies_to_msecs(bib->ttl.tcp_est);
 	bib->ttl.tcp_trans = jiffies_to_msecs(bib->ttl.tcp_trans);
+	bib->ttl.tcp_closed = jiffies_to_msecs(bib->ttl.tcp_closed);
 	bib->ttl.udp = jiffies_to_msecs(bib->ttl.udp);
 	bib->ttl.icmp = jiffies_to_msecs(bib->ttl.icmp);
+	bib->ttl.udp_short = jiffies_to_msecs(bib->ttl.udp_short);
+	bib->sync_interval = jiffies_to_msecs(bib->sync_interval);
 
 	frag = &config->frag;
 	frag->ttl = jiffies_to_msecs(frag->ttl);
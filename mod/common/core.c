@@ -2,50 +2,154 @@
 
 #include "nat64/mod/common/config.h"
 #include "nat64/mod/common/handling_hairpinning.h"
+#include "nat64/mod/common/pool6.h"
+#include "nat64/mod/common/route.h"
+#include "nat64/mod/common/stats.h"
+#include "nat64/mod/common/trace.h"
 #include "nat64/mod/common/xlator.h"
 #include "nat64/mod/common/translation_state.h"
+#include "nat64/mod/common/rfc6145/common.h"
 #include "nat64/mod/common/rfc6145/core.h"
 #include "nat64/mod/stateful/compute_outgoing_tuple.h"
 #include "nat64/mod/stateful/determine_incoming_tuple.h"
 #include "nat64/mod/stateful/filtering_and_updating.h"
 #include "nat64/mod/stateful/fragment_db.h"
+#include "nat64/mod/stateful/bib/db.h"
+#include "nat64/mod/stateful/pool4/db.h"
 #include "nat64/mod/common/send_packet.h"
 
-#include <net/netfilter/ipv4/nf_defrag_ipv4.h>
-#include <net/netfilter/ipv6/nf_defrag_ipv6.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
 
 
+/**
+ * If this packet was picked by --latency-sampling, adds the time since @t to
+ * @stage's histogram and restarts @t.
+ */
+#define STAGE_DONE(state, sample, stage, t) \
+	do { \
+		if (unlikely(sample)) \
+			t = jstat_latency((state)->jool.stats, stage, t); \
+	} while (0)
+
+/**
+ * Copies the beginning of @skb's network header to @buffer, for jool_mirror.
+ */
+static void mirror_skb(struct sk_buff *skb, __u8 *buffer, unsigned int *len,
+		unsigned int *total)
+{
+	int offset = skb_network_offset(skb);
+
+	*total = skb->len - offset;
+	*len = min_t(unsigned int, *total, JOOL_MIRROR_LEN);
+	if (skb_copy_bits(skb, offset, buffer, *len))
+		*len = 0;
+}
+
 static verdict core_common(struct xlation *state)
 {
 	verdict result;
+	bool sample;
+	cycles_t t = 0;
+	int generation;
+	struct jool_mirror mirror;
+	bool mirrored;
+
+	sample = jstat_sample(state->jool.stats, JSAMPLE_LATENCY,
+			state->jool.global->cfg.latency_sampling);
+	if (unlikely(sample))
+		t = get_cycles();
+
+	/* The tracepoint check is a static branch; do it first. */
+	mirrored = trace_jool_mirror_enabled()
+			&& jstat_sample(state->jool.stats, JSAMPLE_MIRROR,
+					state->jool.global->cfg.mirror_sampling);
+	if (unlikely(mirrored)) {
+		mirror_skb(state->in.skb, mirror.in, &mirror.in_len,
+				&mirror.in_total);
+		mirror.out_len = 0;
+		mirror.out_total = 0;
+	}
 
 	if (xlat_is_nat64()) {
 		result = determine_in_tuple(state);
+		STAGE_DONE(state, sample, JSTAGE_DETERMINE_TUPLE, t);
 		if (result != VERDICT_CONTINUE)
 			goto end;
+
+		if (bib_offload_find(state->jool.nat64.bib, &state->in,
+				&state->out.tuple, &state->csum_delta,
+				&generation)) {
+			jstat_inc(state->jool.stats, JSTAT_OFFLOADED);
+			goto translate;
+		}
+
 		result = filtering_and_updating(state);
+		STAGE_DONE(state, sample, JSTAGE_FILTERING, t);
 		if (result != VERDICT_CONTINUE)
 			goto end;
 		result = compute_out_tuple(state);
+		STAGE_DONE(state, sample, JSTAGE_COMPUTE_TUPLE, t);
 		if (result != VERDICT_CONTINUE)
 			goto end;
+
+		if (!is_hairpin(state)) {
+			bib_offload_add(state->jool.nat64.bib, &state->in,
+					&state->entries, &state->out.tuple,
+					generation);
+		}
+
+		if (is_hairpin(state) && can_hairpin_directly(state)) {
+			result = handling_hairpinning_direct(state);
+			goto sent;
+		}
+	} else if (can_hairpin_directly(state)) {
+		/* SIIT knows ahead of the translation. */
+		result = handling_hairpinning_direct(state);
+		goto sent;
 	}
+
+translate:
 	result = translating_the_packet(state);
 	if (result != VERDICT_CONTINUE)
 		goto end;
 
+	if (xlat_is_nat64() && !is_hairpin(state))
+		fragdb_resolve(state->jool.nat64.frag, state);
+	STAGE_DONE(state, sample, JSTAGE_TRANSLATE, t);
+
+	if (unlikely(mirrored)) {
+		mirror_skb(state->out.skb, mirror.out, &mirror.out_len,
+				&mirror.out_total);
+	}
+
 	if (is_hairpin(state)) {
+		/* The hairpin will need the whole packet, so make a copy. */
+		result = ttpcomm_abandon_in_place(state);
+		if (result != VERDICT_CONTINUE)
+			goto end;
 		result = handling_hairpinning(state);
 		kfree_skb(state->out.skb); /* Put this inside of hh()? */
 	} else {
 		result = sendpkt_send(state);
+		STAGE_DONE(state, sample, JSTAGE_SEND, t);
 		/* sendpkt_send() releases out's skb regardless of verdict. */
 	}
 
+sent:
+	if (!state->in.skb) {
+		/*
+		 * The incoming skb was recycled as the outgoing one, so it's
+		 * gone regardless of the verdict.
+		 */
+		result = VERDICT_STOLEN;
+		goto end;
+	}
 	if (result != VERDICT_CONTINUE)
 		goto end;
 
 	log_debug("Success.");
+	jstat_inc(state->jool.stats, JSTAT_SUCCESS);
 	/*
 	 * The new packet was sent, so the original one can die; drop it.
 	 *
@@ -59,11 +163,126 @@ static verdict core_common(struct xlation *state)
 	/* Fall through. */
 
 end:
+	if (unlikely(mirrored))
+		trace_jool_mirror(&mirror, result);
 	if (result == VERDICT_ACCEPT)
 		log_debug("Returning the packet to the kernel.");
 	return result;
 }
 
+/**
+ * Returns true if @skb is certainly not meant to be NAT64'd, judging by its
+ * fixed IPv4 header alone. Filtering would return such a packet to the kernel
+ * anyway; this just spares it the validation and the tuple.
+ *
+ * Packets that cannot be judged here (eg. truncated ones) are left to
+ * pkt_init_ipv4().
+ */
+static bool prefilter_4to6(struct xlation *state, struct sk_buff *skb)
+{
+	struct in_addr daddr;
+
+	if (!xlat_is_nat64())
+		return false;
+	if (!pskb_may_pull(skb, sizeof(struct iphdr)))
+		return false;
+
+	daddr.s_addr = ip_hdr(skb)->daddr;
+	if (pool4db_contains_addr(state->jool.nat64.pool4, state->jool.ns,
+			&daddr))
+		return false;
+
+	log_debug("Packet does not belong to pool4.");
+	jstat_inc(state->jool.stats, JSTAT_POOL4_MISMATCH);
+	return true;
+}
+
+/**
+ * IPv6 counterpart of prefilter_4to6(). Packets sourced from pool6 are let
+ * through, so filtering keeps dropping hairpinning loops.
+ */
+static bool prefilter_6to4(struct xlation *state, struct sk_buff *skb)
+{
+	struct ipv6hdr *hdr;
+
+	if (!xlat_is_nat64())
+		return false;
+	if (!pskb_may_pull(skb, sizeof(struct ipv6hdr)))
+		return false;
+
+	hdr = ipv6_hdr(skb);
+	if (pool6_contains(state->jool.pool6, &hdr->daddr)
+			|| pool6_contains(state->jool.pool6, &hdr->saddr))
+		return false;
+
+	log_debug("Packet does not belong to pool6.");
+	jstat_inc(state->jool.stats, JSTAT_POOL6_MISMATCH);
+	return true;
+}
+
+/**
+ * Returns true if the instance has already spent the current CPU's
+ * --packet-budget. Checked before the packet is parsed, so a flood is turned
+ * away before it can cost anything else.
+ */
+static bool over_budget(struct xlation *state)
+{
+	if (jstat_budget(state->jool.stats, JBUDGET_PACKETS,
+			state->jool.global->cfg.packet_budget))
+		return false;
+
+	log_debug("The instance ran out of packet budget.");
+	jstat_inc(state->jool.stats, JSTAT_BUDGET_PACKETS);
+	return true;
+}
+
+static verdict xlat_4to6(struct xlation *state, struct sk_buff *skb)
+{
+	jstat_inc(state->jool.stats, JSTAT_RECEIVED4);
+
+	if (prefilter_4to6(state, skb))
+		return VERDICT_ACCEPT;
+	if (over_budget(state))
+		return VERDICT_DROP;
+
+	/* Reminder: This function might change pointers. */
+	if (pkt_init_ipv4(&state->in, skb) != 0) {
+		jstat_inc(state->jool.stats, JSTAT_MALFORMED);
+		return VERDICT_DROP;
+	}
+
+	return core_common(state);
+}
+
+static verdict xlat_6to4(struct xlation *state, struct sk_buff *skb)
+{
+	verdict result;
+
+	jstat_inc(state->jool.stats, JSTAT_RECEIVED6);
+
+	if (prefilter_6to4(state, skb))
+		return VERDICT_ACCEPT;
+	if (over_budget(state))
+		return VERDICT_DROP;
+
+	/* Reminder: This function might change pointers. */
+	if (pkt_init_ipv6(&state->in, skb) != 0) {
+		jstat_inc(state->jool.stats, JSTAT_MALFORMED);
+		return VERDICT_DROP;
+	}
+
+	if (debug_enabled())
+		pkt_debug_mid(skb);
+
+	if (xlat_is_nat64()) {
+		result = fragdb_handle(state->jool.nat64.frag, &state->in);
+		if (result != VERDICT_CONTINUE)
+			return result;
+	}
+
+	return core_common(state);
+}
+
 unsigned int core_4to6(struct sk_buff *skb, const struct net_device *dev)
 {
 	struct xlation state;
@@ -76,23 +295,24 @@ unsigned int core_4to6(struct sk_buff *skb, const struct net_device *dev)
 
 	xlation_init(&state);
 
-	if (xlator_find(dev_net(dev), &state.jool))
-		return NF_ACCEPT;
-	if (!state.jool.global->cfg.enabled) {
-		xlation_clean(&state);
+	rcu_read_lock_bh();
+	if (debug_enabled())
+		pkt_debug_start(skb);
+	if (xlator_find_rcu(dev_net(dev), &state.jool)
+			|| !state.jool.global->cfg.enabled) {
+		rcu_read_unlock_bh();
 		return NF_ACCEPT;
 	}
 
-	/* Reminder: This function might change pointers. */
-	if (pkt_init_ipv4(&state.in, skb) != 0) {
-		xlation_clean(&state);
-		return NF_DROP;
-	}
-
-	result = core_common(&state);
-	xlation_clean(&state);
+	trace_jool_xlat_start(skb);
+	result = xlat_4to6(&state, skb);
+	trace_jool_xlat_end(skb, result);
+	rcu_read_unlock_bh();
 	return result;
 }
+#ifdef BENCHMARK
+EXPORT_SYMBOL_GPL(core_4to6);
+#endif
 
 unsigned int core_6to4(struct sk_buff *skb, const struct net_device *dev)
 {
@@ -106,32 +326,161 @@ unsigned int core_6to4(struct sk_buff *skb, const struct net_device *dev)
 
 	xlation_init(&state);
 
-	snapshot_record(&state.in.debug.shot1, skb);
-
-	if (xlator_find(dev_net(dev), &state.jool))
-		return NF_ACCEPT;
-	if (!state.jool.global->cfg.enabled) {
-		xlation_clean(&state);
+	rcu_read_lock_bh();
+	if (debug_enabled())
+		pkt_debug_start(skb);
+	if (xlator_find_rcu(dev_net(dev), &state.jool)
+			|| !state.jool.global->cfg.enabled) {
+		rcu_read_unlock_bh();
 		return NF_ACCEPT;
 	}
 
-	/* Reminder: This function might change pointers. */
-	if (pkt_init_ipv6(&state.in, skb) != 0) {
-		xlation_clean(&state);
-		return NF_DROP;
+	trace_jool_xlat_start(skb);
+	result = xlat_6to4(&state, skb);
+	trace_jool_xlat_end(skb, result);
+	rcu_read_unlock_bh();
+	return result;
+}
+#ifdef BENCHMARK
+EXPORT_SYMBOL_GPL(core_6to4);
+#endif
+
+/**
+ * Returns @skb's layer-4 protocol if it's TCP or UDP, L4PROTO_OTHER otherwise.
+ * (@nexthdr is the protocol number.)
+ */
+static l4_protocol prefetch_proto(__u8 nexthdr)
+{
+	switch (nexthdr) {
+	case IPPROTO_TCP:
+		return L4PROTO_TCP;
+	case IPPROTO_UDP:
+		return L4PROTO_UDP;
 	}
+	return L4PROTO_OTHER;
+}
 
-	snapshot_record(&state.in.debug.shot2, skb);
+/**
+ * Reads @skb's flow straight from its headers and asks the BIB to prefetch its
+ * session. Nothing is validated yet, so this only trusts the linear area, and
+ * packets with extension headers or other protocols are simply not prefetched;
+ * the translation will have to look them up the slow way.
+ */
+static void prefetch_6to4(struct xlator *jool, struct sk_buff *skb)
+{
+	struct ipv6hdr *hdr6 = ipv6_hdr(skb);
+	struct ipv6_transport_addr src6, dst6;
+	__be16 *ports = (__be16 *)(hdr6 + 1);
+	l4_protocol proto;
 
-	if (xlat_is_nat64()) {
-		result = fragdb_handle(state.jool.nat64.frag, &state.in);
-		if (result != VERDICT_CONTINUE)
-			goto end;
+	if ((unsigned char *)(ports + 2) > skb_tail_pointer(skb))
+		return;
+	proto = prefetch_proto(hdr6->nexthdr);
+	if (proto == L4PROTO_OTHER)
+		return;
+
+	src6.l3 = hdr6->saddr;
+	src6.l4 = be16_to_cpu(ports[0]);
+	dst6.l3 = hdr6->daddr;
+	dst6.l4 = be16_to_cpu(ports[1]);
+	bib_prefetch6(jool->nat64.bib, proto, &src6, &dst6);
+}
+
+static void prefetch_4to6(struct xlator *jool, struct sk_buff *skb)
+{
+	struct iphdr *hdr4 = ip_hdr(skb);
+	struct ipv4_transport_addr src4, dst4;
+	__be16 *ports;
+	l4_protocol proto;
+
+	if ((unsigned char *)(hdr4 + 1) > skb_tail_pointer(skb))
+		return;
+	if (hdr4->frag_off & htons(IP_OFFSET))
+		return;
+	ports = (__be16 *)((unsigned char *)hdr4 + 4 * hdr4->ihl);
+	if ((unsigned char *)(ports + 2) > skb_tail_pointer(skb))
+		return;
+	proto = prefetch_proto(hdr4->protocol);
+	if (proto == L4PROTO_OTHER)
+		return;
+
+	src4.l3.s_addr = hdr4->saddr;
+	src4.l4 = be16_to_cpu(ports[0]);
+	dst4.l3.s_addr = hdr4->daddr;
+	dst4.l4 = be16_to_cpu(ports[1]);
+	bib_prefetch4(jool->nat64.bib, proto, &src4, &dst4);
+}
+
+/**
+ * The fixed per-packet costs (finding the instance, routing) are paid once per
+ * batch instead of once per packet.
+ * Packets whose route result has already been computed by a previous packet of
+ * the same batch reuse it.
+ *
+ * In NAT64, the sessions of the whole batch are prefetched before the first
+ * packet is translated, so their cache misses overlap.
+ */
+static void core_list(struct sk_buff_head *skbs, const struct net_device *dev,
+		verdict (*xlat_fn)(struct xlation *, struct sk_buff *),
+		void (*prefetch_fn)(struct xlator *, struct sk_buff *))
+{
+	struct xlator jool;
+	struct route_hint hint;
+	struct xlation state;
+	struct sk_buff_head accepted;
+	struct sk_buff *skb;
+	verdict result;
+
+	rcu_read_lock_bh();
+	if (xlator_find_rcu(dev_net(dev), &jool))
+		goto end;
+	if (!jool.global->cfg.enabled)
+		goto end;
+
+	if (xlat_is_nat64())
+		skb_queue_walk(skbs, skb)
+			prefetch_fn(&jool, skb);
+
+	route_hint_init(&hint);
+	__skb_queue_head_init(&accepted);
+
+	while ((skb = __skb_dequeue(skbs)) != NULL) {
+		xlation_init(&state);
+		state.jool = jool;
+		state.route_hint = &hint;
+		if (debug_enabled())
+			pkt_debug_start(skb);
+
+		trace_jool_xlat_start(skb);
+		result = xlat_fn(&state, skb);
+		trace_jool_xlat_end(skb, result);
+
+		switch (result) {
+		case VERDICT_ACCEPT:
+			__skb_queue_tail(&accepted, skb);
+			break;
+		case VERDICT_DROP:
+			kfree_skb(skb);
+			break;
+		default:
+			break; /* Stolen or queued; no longer ours. */
+		}
 	}
 
-	result = core_common(&state);
+	skb_queue_splice(&accepted, skbs);
+	route_hint_clean(&hint);
 	/* Fall through. */
+
 end:
-	xlation_clean(&state);
-	return result;
+	rcu_read_unlock_bh();
+}
+
+void core_4to6_list(struct sk_buff_head *skbs, const struct net_device *dev)
+{
+	core_list(skbs, dev, xlat_4to6, prefetch_4to6);
+}
+
+void core_6to4_list(struct sk_buff_head *skbs, const struct net_device *dev)
+{
+	core_list(skbs, dev, xlat_6to4, prefetch_6to4);
 }
@@ -1,9 +1,13 @@
 #include "nat64/mod/common/error_pool.h"
 
 #include <stdarg.h>
-#include <linux/string.h>
-#include <linux/slab.h>
+#include <linux/hardirq.h>
+#include <linux/list.h>
 #include <linux/printk.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
 #include "nat64/common/types.h"
 #include "nat64/mod/common/wkmalloc.h"
 
@@ -12,8 +16,9 @@
  * Gathers human-friendly error messages during userspace request handling
  * so they can be sent to userspace.
  *
- * This whole module assumes outside locking.
- * (see the caller of error_pool_activate() and error_pool_deactivate().
+ * Read-only requests are handled concurrently, so every request gets its own
+ * pool, which belongs to the task handling it. Messages logged by anyone else
+ * (most notably, by the packet path) are not collected.
  */
 
 struct error_node {
@@ -21,43 +26,97 @@ struct error_node {
 	struct list_head prev_next;
 };
 
-static __u8 activated = 0;
-static size_t msg_size = 0;
-static struct list_head db;
+struct error_pool {
+	/** The task handling the request. */
+	struct task_struct *task;
+	/** The messages. (Only @task touches them.) */
+	struct list_head msgs;
+	/** Sum of the messages' lengths. */
+	size_t msg_size;
+	/** Hook to @pools. */
+	struct list_head hook;
+};
+
+/** The active pools. Usually just one or two, so a list will do. */
+static LIST_HEAD(pools);
+/** Protects @pools, but not the pools themselves. */
+static DEFINE_SPINLOCK(pools_lock);
 
 void error_pool_setup(void)
 {
-	INIT_LIST_HEAD(&db);
+	/* No code. */
 }
 
-static void flush_list(void)
+static void flush_list(struct error_pool *pool)
 {
 	struct error_node *node;
 
-	while (!list_empty(&db)) {
-		node = list_first_entry(&db, struct error_node, prev_next);
+	while (!list_empty(&pool->msgs)) {
+		node = list_first_entry(&pool->msgs, struct error_node,
+				prev_next);
 		list_del(&node->prev_next);
 		__wkfree("error_code.msg", node->msg);
 		wkfree(struct error_node, node);
 	}
+	pool->msg_size = 0;
 }
 
 void error_pool_teardown(void)
 {
-	flush_list();
+	/* No code; every request deactivates its pool before returning. */
+}
+
+/**
+ * Returns the current task's pool, or NULL if it's not handling a request.
+ */
+static struct error_pool *find_pool(void)
+{
+	struct error_pool *pool;
+	struct error_pool *result = NULL;
+
+	/* Interrupts borrow the task, but they're not part of its request. */
+	if (in_irq() || in_serving_softirq() || in_nmi())
+		return NULL;
+
+	spin_lock_bh(&pools_lock);
+	list_for_each_entry(pool, &pools, hook) {
+		if (pool->task == current) {
+			result = pool;
+			break;
+		}
+	}
+	spin_unlock_bh(&pools_lock);
+
+	return result;
 }
 
 void error_pool_activate(void)
 {
-	activated = 1;
-	msg_size = 0;
+	struct error_pool *pool;
+
+	pool = wkmalloc(struct error_pool, GFP_KERNEL);
+	if (!pool) {
+		/* The request can still be handled; just less verbosely. */
+		pr_err("Could not allocate memory to store an error pool!\n");
+		return;
+	}
+
+	pool->task = current;
+	INIT_LIST_HEAD(&pool->msgs);
+	pool->msg_size = 0;
+
+	spin_lock_bh(&pools_lock);
+	list_add(&pool->hook, &pools);
+	spin_unlock_bh(&pools_lock);
 }
 
 int error_pool_add_message(char *msg)
 {
+	struct error_pool *pool;
 	struct error_node *node;
 
-	if (!activated)
+	pool = find_pool();
+	if (!pool)
 		return 0;
 
 	node = wkmalloc(struct error_node, GFP_ATOMIC);
@@ -74,8 +133,8 @@ int error_pool_add_message(char *msg)
 	}
 
 	strcpy(node->msg, msg);
-	list_add_tail(&node->prev_next, &db) ;
-	msg_size += strlen(msg);
+	list_add_tail(&node->prev_next, &pool->msgs);
+	pool->msg_size += strlen(msg);
 	return 0;
 }
 
@@ -84,23 +143,27 @@ int error_pool_add_message(char *msg)
  */
 int error_pool_get_message(char **out_message, size_t *msg_len)
 {
+	struct error_pool *pool;
 	struct error_node *node;
 	char *buffer_pointer;
 
-	if (!activated) {
+	pool = find_pool();
+	if (!pool) {
 		pr_err("error_pool_get_message() seems to have been called ouside of an userspace request handler.\n");
 		return -EINVAL;
 	}
 
-	(*out_message) = __wkmalloc("Error msg out", msg_size + 1, GFP_KERNEL);
+	(*out_message) = __wkmalloc("Error msg out", pool->msg_size + 1,
+			GFP_KERNEL);
 	if (!(*out_message)) {
 		pr_err("Could not allocate the error pool message!\n") ;
 		return -ENOMEM;
 	}
 
 	buffer_pointer = (*out_message);
-	while (!list_empty(&db)) {
-		node = list_first_entry(&db, struct error_node, prev_next);
+	while (!list_empty(&pool->msgs)) {
+		node = list_first_entry(&pool->msgs, struct error_node,
+				prev_next);
 
 		strcpy(buffer_pointer, node->msg);
 		buffer_pointer += strlen(node->msg);
@@ -111,15 +174,24 @@ int error_pool_get_message(char **out_message, size_t *msg_len)
 
 	buffer_pointer[0] = '\0';
 
-	(*msg_len) = msg_size + 1;
-	msg_size = 0;
+	(*msg_len) = pool->msg_size + 1;
+	pool->msg_size = 0;
 
 	return 0;
 }
 
 void error_pool_deactivate(void)
 {
-	flush_list();
-	msg_size = 0;
-	activated = 0;
+	struct error_pool *pool;
+
+	pool = find_pool();
+	if (!pool)
+		return;
+
+	spin_lock_bh(&pools_lock);
+	list_del(&pool->hook);
+	spin_unlock_bh(&pools_lock);
+
+	flush_list(pool);
+	wkfree(struct error_pool, pool);
 }
@@ -3,11 +3,14 @@
  * A generic hash table implementation. Its design is largely based off Java's
  * java.util.LinkedHashMap.
  * One important similarity is that it is not synchronized.
- * One difference is that the internal array does not resize.
- * (Why? the only piece of code that uses this never grows beyond a very small
- * number of entries. I know that sort of defeats the point of an ellaborate
- * constant-timed retrieving data structure, but again, this really only exists
- * for legacy reasons.)
+ *
+ * The internal array doubles whenever there are more than two entries per
+ * bucket on average. To avoid stalling the caller for a whole rehash (which,
+ * because the table is not synchronized, usually means holding a spinlock),
+ * the entries are migrated incrementally: every put and remove moves a few of
+ * the old array's buckets to the new one, and lookups check both arrays until
+ * the old one is empty. If the new array can't be allocated, the table simply
+ * keeps its current size.
  *
  * Uses the kernel's hlist internally.
  * We're not using hlist directly because it implies a lot of code rewriting (eg. the entry
@@ -23,7 +26,10 @@
  * @macro HTABLE_NAME name of the hash table structure to generate. Optional; Default: hash_table.
  * @macro KEY_TYPE data type of the table's keys.
  * @macro VALUE_TYPE data type of the table's values.
- * @macro HASH_TABLE_SIZE The size of the internal array, in slots. MUST be a power of 2.
+ * @macro HASH_TABLE_SIZE The initial size of the internal array, in slots. Rounded down to a power
+ *		of 2.
+ * @macro HASH_TABLE_MAX_SIZE Maximum size of the internal array, in slots. Power of 2. Optional;
+ *		Default: 16384.
  * @macro GENERATE_PRINT just define it if you want the print function; otherwise it will not be
  *		generated.
  * @macro GENERATE_FOR_EACH just define it if you want the for_each function; otherwise it will not
@@ -39,10 +45,19 @@
  * Macros.
  ********************************************/
 
+#include <linux/log2.h>
+
 #ifndef HTABLE_NAME
 #define HTABLE_NAME hash_table
 #endif
 
+#ifndef HASH_TABLE_MAX_SIZE
+#define HASH_TABLE_MAX_SIZE 16384
+#endif
+
+/** Number of old buckets migrated per put/remove while the table grows. */
+#define HTABLE_REHASH_STEP 4
+
 /** Creates a token name by concatenating prefix and suffix. */
 #define CONCAT_AUX(prefix, suffix) prefix ## suffix
 /** Seems useless, but if not present, the compiler won't expand the HTABLE_NAME macro... */
@@ -66,6 +81,12 @@
 #define PRINT			CONCAT(HTABLE_NAME, _print)
 /** The name of the for_each function. */
 #define FOR_EACH		CONCAT(HTABLE_NAME, _for_each)
+/** The name of the auxiliary bucket lookup function. */
+#define BUCKET			CONCAT(HTABLE_NAME, _bucket)
+/** The name of the auxiliary incremental rehash function. */
+#define REHASH			CONCAT(HTABLE_NAME, _rehash)
+/** The name of the auxiliary resize function. */
+#define GROW			CONCAT(HTABLE_NAME, _grow)
 
 /********************************************
  * Structures.
@@ -76,8 +97,26 @@ struct HTABLE_NAME {
 	/**
 	 * The array of linked lists.
 	 * Each of these contains the values mapped to its index's hash code.
+	 * Points to @initial_table until the first resize.
+	 */
+	struct hlist_head *table;
+	/** Number of slots in @table. Power of 2. */
+	unsigned int size;
+
+	/**
+	 * While growing, the previous @table; its entries are still being
+	 * moved to the new one. NULL otherwise.
 	 */
-	struct hlist_head table[HASH_TABLE_SIZE];
+	struct hlist_head *old_table;
+	/** Number of slots in @old_table. */
+	unsigned int old_size;
+	/** @old_table's slots below this one have already been migrated. */
+	unsigned int rehash_index;
+
+	/** Number of key-values in the table. */
+	unsigned int count;
+
+	struct hlist_head initial_table[HASH_TABLE_SIZE];
 	struct list_head list;
 
 	/** Used to locate the slot (within the linked list) of a value. */
@@ -114,17 +153,13 @@ struct KEY_VALUE_PAIR {
  * @param key descriptor to which the associated key-value is to be returned.
  * @return the key-value to which "table" maps "key", "null" if there's no mapping for the key.
  */
-static struct KEY_VALUE_PAIR *GET_AUX(struct HTABLE_NAME *table, const KEY_TYPE *key)
+static struct KEY_VALUE_PAIR *BUCKET(struct HTABLE_NAME *table, struct hlist_head *bucket,
+		const KEY_TYPE *key)
 {
 	struct hlist_node *current_node;
 	struct KEY_VALUE_PAIR *current_pair;
-	unsigned int hash_code;
 
-	if (WARN(!table, "The table is NULL."))
-		return NULL;
-
-	hash_code = table->hash_function(key) & (HASH_TABLE_SIZE - 1);
-	hlist_for_each(current_node, &table->table[hash_code]) {
+	hlist_for_each(current_node, bucket) {
 		current_pair = hlist_entry(current_node, struct KEY_VALUE_PAIR, hlist_hook);
 		if (table->equals_function(key, &current_pair->key))
 			return current_pair;
@@ -133,6 +168,86 @@ static struct KEY_VALUE_PAIR *GET_AUX(struct HTABLE_NAME *table, const KEY_TYPE
 	return NULL;
 }
 
+static struct KEY_VALUE_PAIR *GET_AUX(struct HTABLE_NAME *table, const KEY_TYPE *key)
+{
+	struct KEY_VALUE_PAIR *result;
+	unsigned int hash_code;
+
+	if (WARN(!table, "The table is NULL."))
+		return NULL;
+
+	hash_code = table->hash_function(key);
+	result = BUCKET(table, &table->table[hash_code & (table->size - 1)], key);
+	if (result || !table->old_table)
+		return result;
+
+	/* The entry might not have been migrated yet. */
+	hash_code &= table->old_size - 1;
+	return (hash_code >= table->rehash_index)
+			? BUCKET(table, &table->old_table[hash_code], key)
+			: NULL;
+}
+
+/**
+ * Moves up to @steps of @table's old buckets to the new array.
+ */
+static void REHASH(struct HTABLE_NAME *table, unsigned int steps)
+{
+	struct hlist_node *current_node;
+	struct hlist_node *tmp_node;
+	struct KEY_VALUE_PAIR *current_pair;
+	unsigned int hash_code;
+
+	for (; steps > 0 && table->old_table; steps--) {
+		hlist_for_each_safe(current_node, tmp_node,
+				&table->old_table[table->rehash_index]) {
+			current_pair = hlist_entry(current_node, struct KEY_VALUE_PAIR, hlist_hook);
+			hlist_del(&current_pair->hlist_hook);
+			hash_code = table->hash_function(&current_pair->key) & (table->size - 1);
+			hlist_add_head(&current_pair->hlist_hook, &table->table[hash_code]);
+		}
+
+		table->rehash_index++;
+		if (table->rehash_index == table->old_size) {
+			if (table->old_table != table->initial_table)
+				__wkfree("Hash table array", table->old_table);
+			table->old_table = NULL;
+		}
+	}
+}
+
+/**
+ * Starts migrating @table to an array twice as large, if it's getting crowded.
+ */
+static void GROW(struct HTABLE_NAME *table)
+{
+	struct hlist_head *new_table;
+	unsigned int new_size;
+	unsigned int i;
+
+	if (table->count <= 2 * table->size || table->size >= HASH_TABLE_MAX_SIZE)
+		return;
+
+	/* A previous migration is somehow still ongoing; finish it first. */
+	if (table->old_table)
+		REHASH(table, table->old_size - table->rehash_index);
+
+	new_size = 2 * table->size;
+	new_table = __wkmalloc("Hash table array", new_size * sizeof(*new_table),
+			GFP_ATOMIC | __GFP_NOWARN);
+	if (!new_table)
+		return; /* Fine; keep the current size. */
+
+	for (i = 0; i < new_size; i++)
+		INIT_HLIST_HEAD(&new_table[i]);
+
+	table->old_table = table->table;
+	table->old_size = table->size;
+	table->rehash_index = 0;
+	table->table = new_table;
+	table->size = new_size;
+}
+
 /********************************************
  * "Public" "methods".
  ********************************************/
@@ -158,7 +273,13 @@ static int INIT(struct HTABLE_NAME *table,
 		return -EINVAL;
 
 	for (i = 0; i < HASH_TABLE_SIZE; i++)
-		INIT_HLIST_HEAD(&table->table[i]);
+		INIT_HLIST_HEAD(&table->initial_table[i]);
+	table->table = table->initial_table;
+	table->size = rounddown_pow_of_two(HASH_TABLE_SIZE);
+	table->old_table = NULL;
+	table->old_size = 0;
+	table->rehash_index = 0;
+	table->count = 0;
 	INIT_LIST_HEAD(&table->list);
 
 	table->equals_function = equals_function;
@@ -202,10 +323,13 @@ static int PUT(struct HTABLE_NAME *table, KEY_TYPE *key, VALUE_TYPE *value)
 	key_value->value = value;
 
 	/* Insert the key-value to the table. */
-	hash_code = table->hash_function(key) & (HASH_TABLE_SIZE - 1);
+	hash_code = table->hash_function(key) & (table->size - 1);
 	hlist_add_head(&key_value->hlist_hook, &table->table[hash_code]);
 	list_add_tail(&key_value->list_hook, &table->list);
+	table->count++;
 
+	REHASH(table, HTABLE_REHASH_STEP);
+	GROW(table);
 	return 0;
 }
 
@@ -239,11 +363,13 @@ static bool REMOVE(struct HTABLE_NAME *table, KEY_TYPE *key, void (*destructor)(
 
 	hlist_del(&key_value->hlist_hook);
 	list_del(&key_value->list_hook);
+	table->count--;
 
 	if (destructor)
 		destructor(key_value->value);
 	wkfree(struct KEY_VALUE_PAIR, key_value);
 
+	REHASH(table, HTABLE_REHASH_STEP);
 	return true;
 }
 
@@ -273,6 +399,15 @@ static void EMPTY(struct HTABLE_NAME *table, void (*destructor)(VALUE_TYPE *))
 		wkfree(struct KEY_VALUE_PAIR, current_pair);
 	}
 
+	/* Back to the initial array, so there's nothing left to free. */
+	if (table->old_table && table->old_table != table->initial_table)
+		__wkfree("Hash table array", table->old_table);
+	if (table->table != table->initial_table)
+		__wkfree("Hash table array", table->table);
+	table->table = table->initial_table;
+	table->size = rounddown_pow_of_two(HASH_TABLE_SIZE);
+	table->old_table = NULL;
+	table->count = 0;
 }
 
 #ifdef GENERATE_PRINT
@@ -299,12 +434,21 @@ static void PRINT(struct HTABLE_NAME *table, char *header)
 	 * hash codes will appear sorted, so they're easier to read.
 	 * This code is for debugging purposes anyway, so it doesn't matter if it's slow.
 	 */
-	for (row = 0; row < HASH_TABLE_SIZE; row++) {
+	for (row = 0; row < table->size; row++) {
 		hlist_for_each(current_node, &table->table[row]) {
 			current_pair = hlist_entry(current_node, struct KEY_VALUE_PAIR, hlist_hook);
 			log_debug("  hash:%u", row);
 		}
 	}
+	if (table->old_table) {
+		for (row = table->rehash_index; row < table->old_size; row++) {
+			hlist_for_each(current_node, &table->old_table[row]) {
+				current_pair = hlist_entry(current_node, struct KEY_VALUE_PAIR,
+						hlist_hook);
+				log_debug("  old hash:%u", row);
+			}
+		}
+	}
 
 	/* Fall through.*/
 end:
@@ -349,5 +493,6 @@ static int FOR_EACH(struct HTABLE_NAME *table, int (*func)(VALUE_TYPE *, void *)
 #undef KEY_TYPE
 #undef VALUE_TYPE
 #undef HASH_TABLE_SIZE
+#undef HASH_TABLE_MAX_SIZE
 #undef GENERATE_PRINT
 #undef GENERATE_FOR_EACH
@@ -1,10 +1,25 @@
 #include "nat64/mod/common/icmp_wrapper.h"
 
 #include <linux/icmpv6.h>
+#include <linux/module.h>
 #include <linux/version.h>
 #include <net/icmp.h>
 #include "nat64/common/types.h"
 #include "nat64/mod/common/route.h"
+#include "nat64/mod/common/stats.h"
+
+/*
+ * The kernel's own ICMP rate limit only kicks in at icmp_send(), which is after
+ * the route lookup and the rest of the expensive part. These buckets are
+ * emptied long before that.
+ */
+static unsigned int icmp_rate = 1000;
+module_param(icmp_rate, uint, 0644);
+MODULE_PARM_DESC(icmp_rate, "Maximum number of ICMP errors of each type each instance generates per second, per CPU. Zero means unlimited.");
+
+static unsigned int icmp_burst = 50;
+module_param(icmp_burst, uint, 0644);
+MODULE_PARM_DESC(icmp_burst, "Number of ICMP errors of each type each instance can generate in a row (per CPU) before icmp_rate kicks in.");
 
 static char *icmp_error_to_string(icmp_error_code error)
 {
@@ -135,7 +150,40 @@ static void icmp64_send6(struct sk_buff *skb, icmp_error_code error, __u32 info)
 #endif
 }
 
-void icmp64_send(struct packet *pkt, icmp_error_code error, __u32 info)
+/**
+ * Token bucket. Returns true if the current CPU's @error bucket still had a
+ * token for the caller, false (and counts the error as suppressed) otherwise.
+ */
+static bool icmp64_allow(struct jool_stats *stats, icmp_error_code error)
+{
+	unsigned int rate = icmp_rate;
+	bool allowed;
+
+	BUILD_BUG_ON(JSTAT_ICMP_LIMITED_FILTER
+			- JSTAT_ICMP_LIMITED_ADDR_UNREACHABLE
+			!= ICMPERR_FILTER - ICMPERR_ADDR_UNREACHABLE);
+
+	if (!stats || !rate || error == ICMPERR_SILENT || error >= ICMPERR_COUNT)
+		return true;
+
+	/* Softirqs and timers both send errors; they share the buckets. */
+	local_bh_disable();
+	allowed = jstat_bucket_take(this_cpu_ptr(&stats->cpu->icmp[error]),
+			rate, icmp_burst);
+	local_bh_enable();
+
+	if (!allowed) {
+		log_debug("ICMP error rate limit reached; dropping the %s.",
+				icmp_error_to_string(error));
+		jstat_inc(stats, JSTAT_ICMP_LIMITED_ADDR_UNREACHABLE
+				+ (error - ICMPERR_ADDR_UNREACHABLE));
+	}
+
+	return allowed;
+}
+
+void icmp64_send(struct jool_stats *stats, struct packet *pkt,
+		icmp_error_code error, __u32 info)
 {
 	if (unlikely(!pkt))
 		return;
@@ -143,13 +191,16 @@ void icmp64_send(struct packet *pkt, icmp_error_code error, __u32 info)
 	if (unlikely(!pkt))
 		return;
 
-	icmp64_send_skb(pkt->skb, error, info);
+	icmp64_send_skb(stats, pkt->skb, error, info);
 }
 
-void icmp64_send_skb(struct sk_buff *skb, icmp_error_code error, __u32 info)
+void icmp64_send_skb(struct jool_stats *stats, struct sk_buff *skb,
+		icmp_error_code error, __u32 info)
 {
 	if (unlikely(!skb) || !skb->dev)
 		return;
+	if (!icmp64_allow(stats, error))
+		return;
 
 	switch (ntohs(skb->protocol)) {
 	case ETH_P_IP:
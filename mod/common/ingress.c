@@ -0,0 +1,307 @@
+#include "nat64/mod/common/ingress.h"
+
+#include <linux/moduleparam.h>
+#include <linux/netdevice.h>
+#include <linux/netfilter.h>
+#include <linux/rtnetlink.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+#include "nat64/common/types.h"
+#include "nat64/common/xlat.h"
+#include "nat64/mod/common/core.h"
+#include "nat64/mod/common/linux_version.h"
+#include "nat64/mod/common/nf_wrapper.h"
+#include "nat64/mod/common/wkmalloc.h"
+
+#define INGRESS_MAX_DEVS 16
+
+static char *ingress[INGRESS_MAX_DEVS];
+static int ingress_count;
+module_param_array(ingress, charp, &ingress_count, 0);
+MODULE_PARM_DESC(ingress, "Translate from these interfaces' ingress instead of Netfilter's PRE_ROUTING.");
+
+bool ingress_enabled(void)
+{
+	return ingress_count > 0;
+}
+
+#if LINUX_VERSION_AT_LEAST(4, 13, 0, 9999, 0) && defined(CONFIG_NETFILTER_INGRESS)
+
+/** The hooks of one instance. */
+struct ingress_hooks {
+	struct net *ns;
+	struct list_head list_hook;
+	unsigned int count;
+	/**
+	 * One per interface. An entry whose dev is NULL was already
+	 * unregistered, because its interface went away.
+	 */
+	struct nf_hook_ops ops[];
+};
+
+/** All the registered ingress_hooks. Protected by the RTNL. */
+static LIST_HEAD(all_hooks);
+
+/**
+ * Performs the validations ip_rcv() would have, and initializes the stuff it
+ * would have initialized.
+ * Returns false if the packet is not something Jool should touch.
+ */
+static bool validate4(struct sk_buff *skb)
+{
+	const struct iphdr *hdr;
+	unsigned int len;
+
+	if (!pskb_may_pull(skb, sizeof(struct iphdr)))
+		return false;
+	hdr = ip_hdr(skb);
+	if (hdr->ihl < 5 || hdr->version != 4)
+		return false;
+	if (!pskb_may_pull(skb, hdr->ihl << 2))
+		return false;
+	hdr = ip_hdr(skb);
+	if (unlikely(ip_fast_csum((u8 *)hdr, hdr->ihl)))
+		return false;
+
+	len = ntohs(hdr->tot_len);
+	if (skb->len < len || len < (hdr->ihl << 2))
+		return false;
+	if (pskb_trim_rcsum(skb, len))
+		return false;
+
+	skb->transport_header = skb->network_header + (hdr->ihl << 2);
+	memset(IPCB(skb), 0, sizeof(struct inet_skb_parm));
+	IPCB(skb)->iif = skb->skb_iif;
+	return true;
+}
+
+/** Same as validate4(), except for ipv6_rcv(). */
+static bool validate6(struct sk_buff *skb)
+{
+	const struct ipv6hdr *hdr;
+	unsigned int len;
+
+	if (!pskb_may_pull(skb, sizeof(struct ipv6hdr)))
+		return false;
+	hdr = ipv6_hdr(skb);
+	if (hdr->version != 6)
+		return false;
+
+	/* Jumbograms (payload_len 0) are left to the kernel. */
+	len = ntohs(hdr->payload_len);
+	if (len == 0 || len + sizeof(struct ipv6hdr) > skb->len)
+		return false;
+	if (pskb_trim_rcsum(skb, len + sizeof(struct ipv6hdr)))
+		return false;
+
+	skb->transport_header = skb->network_header + sizeof(struct ipv6hdr);
+	memset(IP6CB(skb), 0, sizeof(struct inet6_skb_parm));
+	IP6CB(skb)->iif = skb->skb_iif;
+	IP6CB(skb)->nhoff = offsetof(struct ipv6hdr, nexthdr);
+	return true;
+}
+
+/**
+ * At PRE_ROUTING, nf_defrag_ipv4 has already reassembled IPv4 fragments. NAT64
+ * needs that (non-first fragments lack ports), so do it ourselves.
+ * SIIT translates fragments individually, and NAT64 has its own IPv6 fragment
+ * database, so nothing else needs this.
+ *
+ * Returns false if the kernel took the fragment.
+ */
+static bool defrag4(struct sk_buff *skb)
+{
+	if (!xlat_is_nat64() || !ip_is_fragment(ip_hdr(skb)))
+		return true;
+	return !ip_defrag(dev_net(skb->dev), skb, IP_DEFRAG_CONNTRACK_IN);
+}
+
+static unsigned int translate(struct sk_buff *skb)
+{
+	switch (ntohs(skb->protocol)) {
+	case ETH_P_IPV6:
+		if (!validate6(skb))
+			return NF_ACCEPT;
+		return core_6to4(skb, skb->dev);
+	case ETH_P_IP:
+		if (!validate4(skb))
+			return NF_ACCEPT;
+		if (!defrag4(skb))
+			return NF_STOLEN;
+		return core_4to6(skb, skb->dev);
+	}
+
+	return NF_ACCEPT;
+}
+
+static NF_CALLBACK(hook_ingress, skb)
+{
+	struct sk_buff *clone;
+	unsigned int result;
+
+	/* ip_rcv() and ipv6_rcv() would drop these. */
+	if (skb->pkt_type == PACKET_OTHERHOST)
+		return NF_ACCEPT;
+
+	if (!skb_shared(skb))
+		return translate(skb);
+
+	/*
+	 * Some tap (eg. a packet socket) is also holding the packet, so we're
+	 * not allowed to modify it. This is the equivalent of
+	 * skb_share_check(), except we can't replace @skb.
+	 */
+	clone = skb_clone(skb, GFP_ATOMIC);
+	if (!clone)
+		return NF_ACCEPT;
+
+	result = translate(clone);
+	switch (result) {
+	case NF_STOLEN:
+		consume_skb(skb);
+		return NF_STOLEN;
+	case NF_DROP:
+		kfree_skb(clone);
+		return NF_DROP;
+	}
+
+	/* Not for us; let the original continue. */
+	kfree_skb(clone);
+	return NF_ACCEPT;
+}
+
+struct ingress_hooks *ingress_register(struct net *ns)
+{
+	struct ingress_hooks *hooks;
+	struct net_device *dev;
+	unsigned int i;
+	int error;
+
+	hooks = __wkmalloc("ingress hooks", sizeof(*hooks)
+			+ ingress_count * sizeof(hooks->ops[0]), GFP_KERNEL);
+	if (!hooks)
+		return ERR_PTR(-ENOMEM);
+	memset(hooks, 0, sizeof(*hooks)
+			+ ingress_count * sizeof(hooks->ops[0]));
+	hooks->ns = ns;
+	hooks->count = ingress_count;
+
+	rtnl_lock();
+
+	for (i = 0; i < hooks->count; i++) {
+		dev = __dev_get_by_name(ns, ingress[i]);
+		if (!dev) {
+			log_err("Interface '%s' does not exist in this namespace.",
+					ingress[i]);
+			error = -ENODEV;
+			goto fail;
+		}
+
+		hooks->ops[i].hook = hook_ingress;
+		hooks->ops[i].pf = NFPROTO_NETDEV;
+		hooks->ops[i].hooknum = NF_NETDEV_INGRESS;
+		hooks->ops[i].priority = 0;
+		hooks->ops[i].dev = dev;
+	}
+
+	error = nf_register_net_hooks(ns, hooks->ops, hooks->count);
+	if (error)
+		goto fail;
+
+	list_add(&hooks->list_hook, &all_hooks);
+	rtnl_unlock();
+	return hooks;
+
+fail:
+	rtnl_unlock();
+	__wkfree("ingress hooks", hooks);
+	return ERR_PTR(error);
+}
+
+void ingress_unregister(struct ingress_hooks *hooks)
+{
+	unsigned int i;
+
+	rtnl_lock();
+	for (i = 0; i < hooks->count; i++)
+		if (hooks->ops[i].dev)
+			nf_unregister_net_hook(hooks->ns, &hooks->ops[i]);
+	list_del(&hooks->list_hook);
+	rtnl_unlock();
+
+	__wkfree("ingress hooks", hooks);
+}
+
+/**
+ * Netfilter doesn't clean up the ingress hooks of vanishing interfaces, so
+ * we have to.
+ */
+static int ingress_netdev_event(struct notifier_block *nb,
+		unsigned long event, void *ptr)
+{
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+	struct ingress_hooks *hooks;
+	unsigned int i;
+
+	if (event != NETDEV_UNREGISTER)
+		return NOTIFY_DONE;
+
+	list_for_each_entry(hooks, &all_hooks, list_hook) {
+		for (i = 0; i < hooks->count; i++) {
+			if (hooks->ops[i].dev == dev) {
+				nf_unregister_net_hook(hooks->ns,
+						&hooks->ops[i]);
+				hooks->ops[i].dev = NULL;
+				log_info("Interface '%s' is gone; no longer translating its traffic.",
+						dev->name);
+			}
+		}
+	}
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block ingress_netdev_nb = {
+	.notifier_call = ingress_netdev_event,
+};
+
+int ingress_setup(void)
+{
+	if (!ingress_enabled())
+		return 0;
+	return register_netdevice_notifier(&ingress_netdev_nb);
+}
+
+void ingress_teardown(void)
+{
+	if (ingress_enabled())
+		unregister_netdevice_notifier(&ingress_netdev_nb);
+}
+
+#else /* Kernel too old, or no CONFIG_NETFILTER_INGRESS. */
+
+int ingress_setup(void)
+{
+	if (!ingress_enabled())
+		return 0;
+
+	log_err("The 'ingress' argument needs Linux 4.13+ and CONFIG_NETFILTER_INGRESS.");
+	return -EINVAL;
+}
+
+void ingress_teardown(void)
+{
+	/* No code. */
+}
+
+struct ingress_hooks *ingress_register(struct net *ns)
+{
+	return ERR_PTR(-EINVAL);
+}
+
+void ingress_unregister(struct ingress_hooks *hooks)
+{
+	/* No code. */
+}
+
+#endif
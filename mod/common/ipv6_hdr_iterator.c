@@ -1,6 +1,13 @@
 #include "nat64/mod/common/ipv6_hdr_iterator.h"
 #include <net/ipv6.h>
 
+const __u8 hdr6_classes[256] = {
+	[NEXTHDR_HOP] = HDR6_OPTIONS,
+	[NEXTHDR_ROUTING] = HDR6_OPTIONS,
+	[NEXTHDR_DEST] = HDR6_OPTIONS,
+	[NEXTHDR_FRAGMENT] = HDR6_FRAGMENT,
+};
+
 void hdr_iterator_init(struct hdr_iterator *iterator, struct ipv6hdr *main_hdr)
 {
 	struct hdr_iterator defaults = HDR_ITERATOR_INIT(main_hdr);
@@ -14,16 +21,14 @@ int hdr_iterator_next(struct hdr_iterator *iterator)
 		struct frag_hdr *frag;
 	} hdr;
 
-	switch (iterator->hdr_type) {
-	case NEXTHDR_HOP:
-	case NEXTHDR_ROUTING:
-	case NEXTHDR_DEST:
+	switch (hdr6_classify(iterator->hdr_type)) {
+	case HDR6_OPTIONS:
 		hdr.opt = iterator->data;
 		iterator->hdr_type = hdr.opt->nexthdr;
 		iterator->data += 8 + 8 * hdr.opt->hdrlen;
 		break;
 
-	case NEXTHDR_FRAGMENT:
+	case HDR6_FRAGMENT:
 		hdr.frag = iterator->data;
 		iterator->hdr_type = hdr.frag->nexthdr;
 		iterator->data += sizeof(*hdr.frag);
@@ -36,6 +41,57 @@ int hdr_iterator_next(struct hdr_iterator *iterator)
 	return EAGAIN; /* It's positive because it's not really an error ;p */
 }
 
+/**
+ * Walks the whole extension header chain that follows @hdr6 in one pass, and
+ * summarizes it in @chain. Unlike the iterator, it never reads past @end, so
+ * it doesn't need the chain to have been validated first.
+ *
+ * Returns -EINVAL if the chain is truncated, and -ELOOP if there's more than
+ * one Fragment header.
+ */
+int hdr6_walk(struct ipv6hdr *hdr6, void *end, struct hdr6_chain *chain)
+{
+	__u8 nexthdr = hdr6->nexthdr;
+	void *data = hdr6 + 1;
+	struct ipv6_opt_hdr *opt;
+	struct frag_hdr *frag;
+
+	chain->routing = NULL;
+	chain->frag = NULL;
+
+	do {
+		switch (hdr6_classify(nexthdr)) {
+		case HDR6_OPTIONS:
+			opt = data;
+			if (data + sizeof(*opt) > end)
+				return -EINVAL;
+			if (nexthdr == NEXTHDR_ROUTING && !chain->routing)
+				chain->routing = data;
+			nexthdr = opt->nexthdr;
+			data += ipv6_optlen(opt);
+			break;
+
+		case HDR6_FRAGMENT:
+			if (chain->frag)
+				return -ELOOP;
+			frag = data;
+			if (data + sizeof(*frag) > end)
+				return -EINVAL;
+			chain->frag = data;
+			nexthdr = frag->nexthdr;
+			data += sizeof(*frag);
+			break;
+
+		case HDR6_LAST:
+			if (data > end)
+				return -EINVAL;
+			chain->nexthdr = nexthdr;
+			chain->l4 = data;
+			return 0;
+		}
+	} while (true);
+}
+
 void hdr_iterator_last(struct hdr_iterator *iterator)
 {
 	while (hdr_iterator_next(iterator) == EAGAIN)
@@ -0,0 +1,291 @@
+#include "nat64/mod/common/mtrie.h"
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "nat64/common/types.h"
+#include "nat64/mod/common/wkmalloc.h"
+
+#define MTRIE_STRIDE 8
+#define MTRIE_SLOTS (1u << MTRIE_STRIDE)
+#define MTRIE_MAX_KEY_BYTES 16
+/**
+ * Nodes are 1 KB each, and sparse tables of long prefixes need about one per
+ * entry, so this caps the index at 32 MB. Past that, the rtrie will have to do.
+ */
+#define MTRIE_MAX_NODES 32768
+
+/* A slot is either empty, a child node or a value. */
+#define SLOT_EMPTY 0u
+#define SLOT_CHILD (1u << 31)
+#define SLOT_VALUE(index) ((index) + 1u)
+
+struct mtrie {
+	/**
+	 * The bytes every key starts with. They are not represented by the
+	 * nodes; lookups compare them in one go and then skip them.
+	 */
+	__u8 skip[MTRIE_MAX_KEY_BYTES];
+	/** Length of @skip, in bytes. Always smaller than @key_bytes. */
+	unsigned int skip_len;
+	/** Length of the addresses being looked up, in bytes. */
+	unsigned int key_bytes;
+
+	/**
+	 * nodes[0] is the root; it consumes byte @skip_len of the address.
+	 * Children consume one more byte each.
+	 */
+	__u32 (*nodes)[MTRIE_SLOTS];
+	unsigned int node_count;
+	unsigned int node_capacity;
+
+	/** Copies of the values, sorted by key length. */
+	void *values;
+	size_t value_size;
+
+	/** Bytes currently vmalloc()ed for @nodes and @values. */
+	size_t vmalloc_bytes;
+};
+
+static void account_vmalloc(struct mtrie *trie, long bytes)
+{
+	trie->vmalloc_bytes += bytes;
+	wkmalloc_account(JMEM_TRIE, 0, bytes);
+}
+
+static void *get_value(struct mtrie *trie, unsigned int index)
+{
+	return trie->values + index * trie->value_size;
+}
+
+/**
+ * Returns the index of the new node, or a negative error code.
+ * Beware: @trie->nodes might move.
+ */
+static int node_alloc(struct mtrie *trie, __u32 fill)
+{
+	__u32 (*nodes)[MTRIE_SLOTS];
+	unsigned int capacity;
+	unsigned int i;
+
+	if (trie->node_count == trie->node_capacity) {
+		if (trie->node_capacity >= MTRIE_MAX_NODES)
+			return -ENOSPC;
+
+		capacity = min(2 * trie->node_capacity, MTRIE_MAX_NODES);
+		nodes = vmalloc(capacity * sizeof(*nodes));
+		if (!nodes)
+			return -ENOMEM;
+
+		memcpy(nodes, trie->nodes, trie->node_count * sizeof(*nodes));
+		vfree(trie->nodes);
+		account_vmalloc(trie, (long)(capacity - trie->node_capacity)
+				* sizeof(*nodes));
+		trie->nodes = nodes;
+		trie->node_capacity = capacity;
+	}
+
+	for (i = 0; i < MTRIE_SLOTS; i++)
+		trie->nodes[trie->node_count][i] = fill;
+	return trie->node_count++;
+}
+
+/**
+ * Copies @values into @trie, shortest keys first (counting sort), and figures
+ * out @trie->skip.
+ */
+static void load_values(struct mtrie *trie, void *values, unsigned int count,
+		mtrie_key_fn get_key)
+{
+	unsigned int next[8 * MTRIE_MAX_KEY_BYTES + 1] = { 0 };
+	unsigned int i, b, total;
+	unsigned int skip_len;
+	struct rtrie_key key;
+	void *value;
+
+	skip_len = trie->key_bytes - 1;
+
+	for (i = 0; i < count; i++) {
+		value = values + i * trie->value_size;
+		get_key(value, &key);
+		next[key.len]++;
+
+		if (i == 0) {
+			skip_len = min(skip_len, (unsigned int)key.len >> 3);
+			memcpy(trie->skip, key.bytes, skip_len);
+			continue;
+		}
+
+		skip_len = min(skip_len, (unsigned int)key.len >> 3);
+		for (b = 0; b < skip_len; b++) {
+			if (key.bytes[b] != trie->skip[b]) {
+				skip_len = b;
+				break;
+			}
+		}
+	}
+
+	trie->skip_len = skip_len;
+
+	/* Turn the counters into the first index of each length. */
+	total = 0;
+	for (i = 0; i <= 8 * trie->key_bytes; i++) {
+		b = next[i];
+		next[i] = total;
+		total += b;
+	}
+
+	for (i = 0; i < count; i++) {
+		value = values + i * trie->value_size;
+		get_key(value, &key);
+		memcpy(get_value(trie, next[key.len]++), value,
+				trie->value_size);
+	}
+}
+
+/**
+ * Controlled prefix expansion: a prefix that ends within a node's byte takes
+ * over all the slots it covers.
+ *
+ * Because the keys arrive shortest first, a slot that needs to become a child
+ * can only hold a shorter prefix (which the child inherits), and a slot that
+ * needs to be taken over can never be a child yet.
+ */
+static int insert(struct mtrie *trie, struct rtrie_key *key, __u32 value)
+{
+	unsigned int node = 0;
+	unsigned int byte = trie->skip_len;
+	unsigned int bits = key->len - 8 * trie->skip_len;
+	unsigned int first, last;
+	unsigned int i;
+	__u32 slot;
+	int child;
+
+	for (; bits > MTRIE_STRIDE; bits -= MTRIE_STRIDE, byte++) {
+		slot = trie->nodes[node][key->bytes[byte]];
+		if (!(slot & SLOT_CHILD)) {
+			child = node_alloc(trie, slot);
+			if (child < 0)
+				return child;
+			slot = SLOT_CHILD | child;
+			trie->nodes[node][key->bytes[byte]] = slot;
+		}
+		node = slot & ~SLOT_CHILD;
+	}
+
+	first = bits ? (key->bytes[byte] & (0xFFu << (8 - bits)) & 0xFFu) : 0;
+	last = first + (1u << (8 - bits));
+	for (i = first; i < last; i++) {
+		if (WARN(trie->nodes[node][i] & SLOT_CHILD,
+				"Multibit trie slot is already a child."))
+			return -EINVAL;
+		trie->nodes[node][i] = value;
+	}
+
+	return 0;
+}
+
+/**
+ * Builds a multibit trie out of the @count values (each @value_size bytes
+ * long) @values points to. The trie keeps its own copy; @values can be
+ * released right away.
+ *
+ * All lookup addresses will be @key_bytes long. No two values can share a
+ * key.
+ *
+ * Returns NULL if the trie would be too large or memory is exhausted; the
+ * caller should fall back to whatever it was using.
+ *
+ * Please note: this function can sleep.
+ */
+struct mtrie *mtrie_build(void *values, unsigned int count, size_t value_size,
+		unsigned int key_bytes, mtrie_key_fn get_key)
+{
+	struct mtrie *trie;
+	struct rtrie_key key;
+	unsigned int i;
+	int error;
+
+	if (WARN(key_bytes == 0 || key_bytes > MTRIE_MAX_KEY_BYTES,
+			"Unsupported key length: %u", key_bytes))
+		return NULL;
+
+	trie = __wkmalloc_as(JMEM_TRIE, "mtrie", sizeof(*trie), GFP_KERNEL);
+	if (!trie)
+		return NULL;
+	memset(trie, 0, sizeof(*trie));
+	trie->key_bytes = key_bytes;
+	trie->value_size = value_size;
+
+	if (count) {
+		trie->values = vmalloc(count * value_size);
+		if (!trie->values)
+			goto fail;
+		account_vmalloc(trie, count * value_size);
+		load_values(trie, values, count, get_key);
+	}
+
+	trie->nodes = vmalloc(16 * sizeof(*trie->nodes));
+	if (!trie->nodes)
+		goto fail;
+	trie->node_capacity = 16;
+	account_vmalloc(trie, 16 * sizeof(*trie->nodes));
+	node_alloc(trie, SLOT_EMPTY); /* The root. */
+
+	for (i = 0; i < count; i++) {
+		get_key(get_value(trie, i), &key);
+		error = insert(trie, &key, SLOT_VALUE(i));
+		if (error) {
+			if (error == -ENOSPC)
+				log_debug("%u prefixes need more than %u multibit trie nodes.",
+						count, MTRIE_MAX_NODES);
+			goto fail;
+		}
+	}
+
+	return trie;
+
+fail:
+	mtrie_destroy(trie);
+	return NULL;
+}
+
+/**
+ * The caller is responsible for making sure there are no readers left.
+ */
+void mtrie_destroy(struct mtrie *trie)
+{
+	if (trie->nodes)
+		vfree(trie->nodes);
+	if (trie->values)
+		vfree(trie->values);
+	wkmalloc_account(JMEM_TRIE, 0, -(long)trie->vmalloc_bytes);
+	__wkfree_as(JMEM_TRIE, "mtrie", trie);
+}
+
+/**
+ * Returns the value whose key is the longest prefix of @addr (which must be
+ * `key_bytes` long), or NULL if there's no such value.
+ *
+ * The value belongs to @trie; copy it before leaving the RCU read-side
+ * critical section.
+ */
+void *mtrie_find(struct mtrie *trie, __u8 *addr)
+{
+	unsigned int node = 0;
+	unsigned int i;
+	__u32 slot = SLOT_EMPTY;
+
+	if (memcmp(addr, trie->skip, trie->skip_len))
+		return NULL;
+
+	for (i = trie->skip_len; i < trie->key_bytes; i++) {
+		slot = trie->nodes[node][addr[i]];
+		if (!(slot & SLOT_CHILD))
+			break;
+		node = slot & ~SLOT_CHILD;
+	}
+
+	return (slot != SLOT_EMPTY) ? get_value(trie, slot - 1) : NULL;
+}
@@ -2,6 +2,7 @@
 
 #include "nat64/mod/common/nl/nl_common.h"
 #include "nat64/mod/common/nl/nl_core2.h"
+#include "nat64/mod/common/wkmalloc.h"
 #include "nat64/mod/stateful/pool4/db.h"
 #include "nat64/mod/stateful/bib/db.h"
 
@@ -40,7 +41,8 @@ static int handle_bib_display(struct bib *db, struct genl_info *info,
 		return nlcore_respond(info, error);
 
 	offset = request->display.addr4_set ? &request->display.addr4 : NULL;
-	error = bib_foreach(db, request->l4_proto, &func, offset);
+	error = bib_foreach(db, request->l4_proto, &func, offset,
+			&request->display.filter);
 	nlbuffer_set_pending_data(&buffer, error > 0);
 	error = (error >= 0)
 			? nlbuffer_send(info, &buffer)
@@ -50,12 +52,119 @@ static int handle_bib_display(struct bib *db, struct genl_info *info,
 	return error;
 }
 
+/*
+ * The dump's cursor (the last entry sent so far) lives in @cb->args[1] and
+ * @cb->args[2].
+ */
+static void save_bib_cursor(struct netlink_callback *cb,
+		struct ipv4_transport_addr *addr)
+{
+	cb->args[1] = (__force u32)addr->l3.s_addr;
+	cb->args[2] = addr->l4;
+}
+
+static void load_bib_cursor(struct netlink_callback *cb,
+		struct ipv4_transport_addr *addr)
+{
+	addr->l3.s_addr = (__force __be32)(u32)cb->args[1];
+	addr->l4 = cb->args[2];
+}
+
+/**
+ * Streams the BIB to userspace, one full skb per call.
+ * Unlike handle_bib_display(), userspace only needs to send one request.
+ */
+static int handle_bib_dump_display(struct bib *db, struct sk_buff *skb,
+		struct netlink_callback *cb, struct request_hdr *hdr,
+		struct request_bib *request)
+{
+	struct nlcore_buffer buffer;
+	struct bib_foreach_func func = {
+			.cb = bib_entry_to_userspace,
+			.arg = &buffer,
+	};
+	struct ipv4_transport_addr cursor;
+	struct ipv4_transport_addr *offset;
+	struct bib_entry_usr *last;
+	int error;
+
+	if (verify_superpriv())
+		return nlcore_dump_error(skb, cb, hdr, -EPERM);
+
+	error = nlbuffer_init_dump(&buffer, skb, hdr);
+	if (error)
+		return nlcore_dump_error(skb, cb, hdr, error);
+
+	if (cb->args[0] == NLDUMP_CONTINUE) {
+		load_bib_cursor(cb, &cursor);
+		offset = &cursor;
+	} else {
+		log_debug("Dumping the BIB to userspace.");
+		offset = request->display.addr4_set
+				? &request->display.addr4
+				: NULL;
+	}
+
+	error = bib_foreach(db, request->l4_proto, &func, offset,
+			&request->display.filter);
+	if (error < 0) {
+		nlbuffer_clean(&buffer);
+		return nlcore_dump_error(skb, cb, hdr, error);
+	}
+
+	if (buffer.len > sizeof(struct response_hdr)) {
+		last = buffer.data + buffer.len - sizeof(*last);
+		save_bib_cursor(cb, &last->addr4);
+	}
+	cb->args[0] = (error > 0) ? NLDUMP_CONTINUE : NLDUMP_DONE;
+	nlbuffer_set_pending_data(&buffer, error > 0);
+
+	error = nlbuffer_dump(skb, cb, &buffer);
+	nlbuffer_clean(&buffer);
+	return error ? : skb->len;
+}
+
+static int handle_bib_top(struct bib *db, struct genl_info *info,
+		struct request_bib *request)
+{
+	struct bib_top_usr *top;
+	unsigned int count;
+	int error;
+
+	log_debug("Returning the heaviest BIB groups.");
+
+	top = __wkmalloc("BIB top", BIB_TOP_MAX * sizeof(*top), GFP_KERNEL);
+	if (!top)
+		return nlcore_respond(info, -ENOMEM);
+
+	error = bib_top(db, request->l4_proto, &request->count.top, top,
+			&count);
+	error = error
+			? nlcore_respond(info, error)
+			: nlcore_respond_struct(info, top, count * sizeof(*top));
+
+	__wkfree("BIB top", top);
+	return error;
+}
+
 static int handle_bib_count(struct bib *db, struct genl_info *info,
 		struct request_bib *request)
 {
+	struct bib_stats_usr stats;
 	int error;
 	__u64 count;
 
+	if (request->count.top.count)
+		return handle_bib_top(db, info, request);
+
+	if (request->count.details) {
+		log_debug("Returning BIB statistics.");
+		error = bib_stats(db, request->l4_proto, &stats);
+		if (error)
+			return nlcore_respond(info, error);
+		return nlcore_respond_struct(info, &stats, sizeof(stats));
+	}
+
 	log_debug("Returning BIB count.");
 	error = bib_count(db, request->l4_proto, &count);
 	if (error)
@@ -152,6 +261,76 @@ esrch:
 	return -ESRCH;
 }
 
+/**
+ * Runs in the requester's context, so the file descriptor means what it meant
+ * to userspace.
+ */
+static int handle_bib_policy(struct xlator *jool, struct request_bib *request)
+{
+	if (verify_superpriv())
+		return -EPERM;
+
+	log_debug("Attaching BIB policy.");
+	return bib_policy_attach(jool->nat64.bib, request->policy.fd);
+}
+
+/**
+ * Adds or removes (depending on @op) several static entries in one go.
+ * Unlike the single-entry versions, the response is not just an error code;
+ * it's the outcome of every entry.
+ */
+static int handle_bib_bulk(struct xlator *jool, struct genl_info *info,
+		struct request_bib *request, enum config_operation op)
+{
+	struct bib_bulk_entry *entries;
+	unsigned int count = request->bulk_count;
+	int *results;
+	unsigned int i;
+	int error;
+
+	if (verify_superpriv())
+		return nlcore_respond(info, -EPERM);
+
+	if (count > BIB_BULK_MAX) {
+		log_err("Bulk requests can carry up to %u entries; got %u.",
+				BIB_BULK_MAX, count);
+		return nlcore_respond(info, -EINVAL);
+	}
+	error = validate_request_size(info, sizeof(*request)
+			+ count * sizeof(*entries));
+	if (error)
+		return nlcore_respond(info, error);
+
+	log_debug("%s %u BIB entries.", (op == OP_ADD) ? "Adding" : "Removing",
+			count);
+
+	entries = (struct bib_bulk_entry *)(request + 1);
+	results = __wkmalloc("bulk BIB results", count * sizeof(*results),
+			GFP_KERNEL);
+	if (!results)
+		return nlcore_respond(info, -ENOMEM);
+
+	for (i = 0; i < count; i++) {
+		results[i] = 0;
+		if (op == OP_ADD && !pool4db_contains(jool->nat64.pool4,
+				jool->ns, request->l4_proto, &entries[i].addr4))
+			results[i] = -EINVAL;
+	}
+
+	error = (op == OP_ADD)
+			? bib_add_static_bulk(jool->nat64.bib, request->l4_proto,
+					entries, count, results)
+			: bib_rm_bulk(jool->nat64.bib, request->l4_proto,
+					entries, count, results);
+	error = error
+			? nlcore_respond(info, error)
+			: nlcore_respond_struct(info, results,
+					count * sizeof(*results));
+
+	__wkfree("bulk BIB results", results);
+	return error;
+}
+
 int handle_bib_config(struct xlator *jool, struct genl_info *info)
 {
 	struct request_hdr *hdr = get_jool_hdr(info);
@@ -167,6 +346,17 @@ int handle_bib_config(struct xlator *jool, struct genl_info *info)
 	if (error)
 		return nlcore_respond(info, error);
 
+	if (request->bulk_count) {
+		switch (be16_to_cpu(hdr->operation)) {
+		case OP_ADD:
+			return handle_bib_bulk(jool, info, request, OP_ADD);
+		case OP_REMOVE:
+			return handle_bib_bulk(jool, info, request, OP_REMOVE);
+		}
+		log_err("Only adds and removes can be bulk requests.");
+		return nlcore_respond(info, -EINVAL);
+	}
+
 	switch (be16_to_cpu(hdr->operation)) {
 	case OP_DISPLAY:
 		return handle_bib_display(jool->nat64.bib, info, request);
@@ -178,6 +368,9 @@ int handle_bib_config(struct xlator *jool, struct genl_info *info)
 	case OP_REMOVE:
 		error = handle_bib_rm(jool, request);
 		break;
+	case OP_UPDATE:
+		error = handle_bib_policy(jool, request);
+		break;
 	default:
 		log_err("Unknown operation: %u", be16_to_cpu(hdr->operation));
 		error = -EINVAL;
@@ -185,3 +378,30 @@ int handle_bib_config(struct xlator *jool, struct genl_info *info)
 
 	return nlcore_respond(info, error);
 }
+
+int handle_bib_dump(struct xlator *jool, struct sk_buff *skb,
+		struct netlink_callback *cb)
+{
+	struct request_hdr *hdr = get_dump_hdr(cb);
+	struct request_bib *request = (struct request_bib *)(hdr + 1);
+	int error;
+
+	if (cb->args[0] == NLDUMP_DONE)
+		return 0;
+
+	if (xlat_is_siit()) {
+		log_err("SIIT doesn't have BIBs.");
+		return nlcore_dump_error(skb, cb, hdr, -EINVAL);
+	}
+
+	error = validate_dump_size(cb, sizeof(*request));
+	if (error)
+		return nlcore_dump_error(skb, cb, hdr, error);
+
+	if (be16_to_cpu(hdr->operation) != OP_DISPLAY) {
+		log_err("Only BIB displays can be dumped.");
+		return nlcore_dump_error(skb, cb, hdr, -EINVAL);
+	}
+
+	return handle_bib_dump_display(jool->nat64.bib, skb, cb, hdr, request);
+}
@@ -11,6 +11,47 @@ static int eam_entry_to_userspace(struct eamt_entry *entry, void *arg)
 	return nlbuffer_write(buffer, entry, sizeof(*entry));
 }
 
+static int eam_usr_to_userspace(struct eamt_entry_usr *entry, void *arg)
+{
+	struct nlcore_buffer *buffer = (struct nlcore_buffer *)arg;
+	return nlbuffer_write(buffer, entry, sizeof(*entry));
+}
+
+/**
+ * Writes the entries that follow @offset (along with their counters, if the
+ * user asked for them) to @buffer.
+ */
+static int eamt_write(struct eam_table *eamt, struct nlcore_buffer *buffer,
+		union request_eamt *request, struct ipv4_prefix *offset)
+{
+	int error;
+
+	if (!request->display.counters) {
+		return eamt_foreach(eamt, eam_entry_to_userspace, buffer,
+				offset);
+	}
+
+	if (request->display.reset) {
+		error = verify_superpriv();
+		if (error)
+			return error;
+	}
+
+	return eamt_foreach_usr(eamt, eam_usr_to_userspace, buffer, offset,
+			request->display.reset);
+}
+
+/**
+ * The size of the elements eamt_write() writes. (An eamt_entry_usr starts with
+ * its eamt_entry, so either way the prefixes are at the same place.)
+ */
+static size_t element_size(union request_eamt *request)
+{
+	return request->display.counters
+			? sizeof(struct eamt_entry_usr)
+			: sizeof(struct eamt_entry);
+}
+
 static int handle_eamt_display(struct eam_table *eamt, struct genl_info *info,
 		union request_eamt *request)
 {
@@ -25,7 +66,7 @@ static int handle_eamt_display(struct eam_table *eamt, struct genl_info *info,
 		nlcore_respond(info, error);
 
 	prefix4 = request->display.prefix4_set ? &request->display.prefix4 : NULL;
-	error = eamt_foreach(eamt, eam_entry_to_userspace, &buffer, prefix4);
+	error = eamt_write(eamt, &buffer, request, prefix4);
 	nlbuffer_set_pending_data(&buffer, error > 0);
 	error = (error >= 0)
 			? nlbuffer_send(info, &buffer)
@@ -35,6 +76,70 @@ static int handle_eamt_display(struct eam_table *eamt, struct genl_info *info,
 	return error;
 }
 
+/*
+ * The dump's cursor (the IPv4 prefix of the last entry sent so far) lives in
+ * @cb->args[1] and @cb->args[2].
+ */
+static void save_eamt_cursor(struct netlink_callback *cb,
+		struct ipv4_prefix *prefix)
+{
+	cb->args[1] = (__force u32)prefix->address.s_addr;
+	cb->args[2] = prefix->len;
+}
+
+static void load_eamt_cursor(struct netlink_callback *cb,
+		struct ipv4_prefix *prefix)
+{
+	prefix->address.s_addr = (__force __be32)(u32)cb->args[1];
+	prefix->len = cb->args[2];
+}
+
+/**
+ * Streams the EAMT to userspace, one full skb per call.
+ * Unlike handle_eamt_display(), userspace only needs to send one request.
+ */
+static int handle_eamt_dump_display(struct eam_table *eamt,
+		struct sk_buff *skb, struct netlink_callback *cb,
+		struct request_hdr *hdr, union request_eamt *request)
+{
+	struct nlcore_buffer buffer;
+	struct ipv4_prefix cursor;
+	struct ipv4_prefix *offset;
+	struct eamt_entry *last;
+	int error;
+
+	error = nlbuffer_init_dump(&buffer, skb, hdr);
+	if (error)
+		return nlcore_dump_error(skb, cb, hdr, error);
+
+	if (cb->args[0] == NLDUMP_CONTINUE) {
+		load_eamt_cursor(cb, &cursor);
+		offset = &cursor;
+	} else {
+		log_debug("Dumping the EAMT to userspace.");
+		offset = request->display.prefix4_set
+				? &request->display.prefix4
+				: NULL;
+	}
+
+	error = eamt_write(eamt, &buffer, request, offset);
+	if (error < 0) {
+		nlbuffer_clean(&buffer);
+		return nlcore_dump_error(skb, cb, hdr, error);
+	}
+
+	if (buffer.len > sizeof(struct response_hdr)) {
+		last = buffer.data + buffer.len - element_size(request);
+		save_eamt_cursor(cb, &last->prefix4);
+	}
+	cb->args[0] = (error > 0) ? NLDUMP_CONTINUE : NLDUMP_DONE;
+	nlbuffer_set_pending_data(&buffer, error > 0);
+
+	error = nlbuffer_dump(skb, cb, &buffer);
+	nlbuffer_clean(&buffer);
+	return error ? : skb->len;
+}
+
 static int handle_eamt_count(struct eam_table *eamt, struct genl_info *info)
 {
 	__u64 count;
@@ -120,5 +225,33 @@ int handle_eamt_config(struct xlator *jool, struct genl_info *info)
 		error = -EINVAL;
 	}
 
+	xlator_refresh_clat(jool);
 	return nlcore_respond(info, error);
 }
+
+int handle_eamt_dump(struct xlator *jool, struct sk_buff *skb,
+		struct netlink_callback *cb)
+{
+	struct request_hdr *hdr = get_dump_hdr(cb);
+	union request_eamt *request = (union request_eamt *)(hdr + 1);
+	int error;
+
+	if (cb->args[0] == NLDUMP_DONE)
+		return 0;
+
+	if (xlat_is_nat64()) {
+		log_err("Stateful NAT64 doesn't have an EAMT.");
+		return nlcore_dump_error(skb, cb, hdr, -EINVAL);
+	}
+
+	error = validate_dump_size(cb, sizeof(*request));
+	if (error)
+		return nlcore_dump_error(skb, cb, hdr, error);
+
+	if (be16_to_cpu(hdr->operation) != OP_DISPLAY) {
+		log_err("Only EAMT displays can be dumped.");
+		return nlcore_dump_error(skb, cb, hdr, -EINVAL);
+	}
+
+	return handle_eamt_dump_display(jool->siit.eamt, skb, cb, hdr, request);
+}
@@ -195,6 +195,49 @@ static int update_plateaus(struct global_config_usr *config,
 	return 0;
 }
 
+static int update_udp_short_ports(struct bib_config *config,
+		struct global_value *hdr,
+		size_t max_size)
+{
+	__u16 *list;
+	int list_length;
+	unsigned int i, j;
+
+	list_length = (hdr->len - sizeof(*hdr)) / sizeof(__u16);
+	if (list_length > ARRAY_SIZE(config->udp_short.ports)) {
+		log_err("Too many short-lived UDP ports; there's only room for %zu.",
+				ARRAY_SIZE(config->udp_short.ports));
+		return -EINVAL;
+	}
+
+	list = (__u16 *)(hdr + 1);
+
+	if (list_length * sizeof(*list) > max_size - sizeof(*hdr)) {
+		log_err("The request seems truncated.");
+		return -EINVAL;
+	}
+
+	/*
+	 * Sort descending, so the zeroes end up at the end. (Zeroes are how
+	 * the user empties the list, since userspace won't send empty lists.)
+	 */
+	sort(list, list_length, sizeof(*list), be16_compare, be16_swap);
+
+	/* Remove zeroes and duplicates. */
+	for (i = 0, j = 0; j < list_length; j++) {
+		if (list[j] == 0)
+			break;
+		if (i == 0 || list[i - 1] != list[j])
+			list[i++] = list[j];
+	}
+
+	/* Update. */
+	memcpy(config->udp_short.ports, list, i * sizeof(*list));
+	config->udp_short.count = i;
+
+	return 0;
+}
+
 static int handle_global_display(struct xlator *jool, struct genl_info *info)
 {
 	struct full_config config;
@@ -237,6 +280,24 @@ static int massive_switch(struct full_config *cfg, struct global_value *chunk,
 		return parse_u8(&cfg->global.new_tos, chunk, size);
 	case MTU_PLATEAUS:
 		return update_plateaus(&cfg->global, chunk, size);
+	case DEBUG_MODE:
+		return parse_bool(&cfg->global.debug, chunk, size);
+	case LATENCY_SAMPLING:
+		return parse_u32(&cfg->global.latency_sampling, chunk, size);
+	case MIRROR_SAMPLING:
+		return parse_u32(&cfg->global.mirror_sampling, chunk, size);
+	case PACKET_BUDGET:
+		return parse_u32(&cfg->global.packet_budget, chunk, size);
+	case MSS_CLAMP:
+		error = parse_u16(&cfg->global.mss_clamp, chunk, size, 0xFFFF);
+		if (error)
+			return error;
+		if (cfg->global.mss_clamp && cfg->global.mss_clamp < MSS_CLAMP_MIN) {
+			log_err("%s must be zero or at least %u.", OPTNAME_MSS_CLAMP,
+					MSS_CLAMP_MIN);
+			return -EINVAL;
+		}
+		return 0;
 	case COMPUTE_UDP_CSUM_ZERO:
 		error = ensure_siit(OPTNAME_AMEND_UDP_CSUM);
 		return error ? : parse_bool(&cfg->global.siit.compute_udp_csum_zero, chunk, size);
@@ -249,6 +310,9 @@ static int massive_switch(struct full_config *cfg, struct global_value *chunk,
 	case RFC6791V6_PREFIX:
 		error = ensure_siit(OPTNAME_RFC6791V6_PREFIX);
 		return error ? : parse_ipv6_prefix(&cfg->global, chunk, size);
+	case CLAT_MODE:
+		error = ensure_siit(OPTNAME_CLAT);
+		return error ? : parse_bool(&cfg->global.siit.clat, chunk, size);
 	case DROP_BY_ADDR:
 		error = ensure_nat64(OPTNAME_DROP_BY_ADDR);
 		return error ? : parse_bool(&cfg->bib.drop_by_addr, chunk, size);
@@ -264,12 +328,31 @@ static int massive_switch(struct full_config *cfg, struct global_value *chunk,
 	case F_ARGS:
 		error = ensure_nat64(OPTNAME_F_ARGS);
 		return error ? : parse_u8(&cfg->global.nat64.f_args, chunk, size);
+	case F_ALGORITHM:
+		error = ensure_nat64(OPTNAME_F_ALGORITHM);
+		if (error)
+			return error;
+		error = parse_u8(&cfg->global.nat64.f_algorithm, chunk, size);
+		if (error)
+			return error;
+		if (cfg->global.nat64.f_algorithm >= F_ALGORITHM_COUNT) {
+			log_err("Unknown %s: %u", OPTNAME_F_ALGORITHM,
+					cfg->global.nat64.f_algorithm);
+			return -EINVAL;
+		}
+		return 0;
 	case HANDLE_RST_DURING_FIN_RCV:
 		error = ensure_nat64(OPTNAME_F_ARGS);
 		return error ? : parse_bool(&cfg->global.nat64.handle_rst_during_fin_rcv, chunk, size);
 	case UDP_TIMEOUT:
 		error = ensure_nat64(OPTNAME_UDP_TIMEOUT);
 		return error ? : parse_timeout(&cfg->bib.ttl.udp, chunk, size, UDP_MIN);
+	case UDP_SHORT_TIMEOUT:
+		error = ensure_nat64(OPTNAME_UDP_SHORT_TIMEOUT);
+		return error ? : parse_timeout(&cfg->bib.ttl.udp_short, chunk, size, UDP_SHORT_MIN);
+	case UDP_SHORT_PORTS:
+		error = ensure_nat64(OPTNAME_UDP_SHORT_PORTS);
+		return error ? : update_udp_short_ports(&cfg->bib, chunk, size);
 	case ICMP_TIMEOUT:
 		error = ensure_nat64(OPTNAME_ICMP_TIMEOUT);
 		return error ? : parse_timeout(&cfg->bib.ttl.icmp, chunk, size, 0);
@@ -279,24 +362,139 @@ static int massive_switch(struct full_config *cfg, struct global_value *chunk,
 	case TCP_TRANS_TIMEOUT:
 		error = ensure_nat64(OPTNAME_TCPTRANS_TIMEOUT);
 		return error ? : parse_timeout(&cfg->bib.ttl.tcp_trans, chunk, size, TCP_TRANS);
+	case TCP_CLOSED_TIMEOUT:
+		error = ensure_nat64(OPTNAME_TCPCLOSED_TIMEOUT);
+		return error ? : parse_timeout(&cfg->bib.ttl.tcp_closed, chunk, size, 0);
 	case FRAGMENT_TIMEOUT:
 		error = ensure_nat64(OPTNAME_FRAG_TIMEOUT);
 		return error ? : parse_timeout(&cfg->frag.ttl, chunk, size, FRAGMENT_MIN);
+	case FRAGMENT_HIGH_THRESH:
+		error = ensure_nat64(OPTNAME_FRAG_HIGH_THRESH);
+		return error ? : parse_u32(&cfg->frag.high_thresh, chunk, size);
+	case FRAGMENT_LOW_THRESH:
+		error = ensure_nat64(OPTNAME_FRAG_LOW_THRESH);
+		return error ? : parse_u32(&cfg->frag.low_thresh, chunk, size);
+	case FRAGMENT_VIRTUAL:
+		error = ensure_nat64(OPTNAME_FRAG_VIRTUAL);
+		return error ? : parse_bool(&cfg->frag.virtual_reassembly, chunk,
+				size);
 	case BIB_LOGGING:
 		error = ensure_nat64(OPTNAME_BIB_LOGGING);
 		return error ? : parse_bool(&cfg->bib.bib_logging, chunk, size);
 	case SESSION_LOGGING:
 		error = ensure_nat64(OPTNAME_SESSION_LOGGING);
 		return error ? : parse_bool(&cfg->bib.session_logging, chunk, size);
+	case LOGGING_STREAM:
+		error = ensure_nat64(OPTNAME_LOGGING_STREAM);
+		return error ? : parse_bool(&cfg->bib.logging_stream, chunk, size);
 	case MAX_PKTS:
 		error = ensure_nat64(OPTNAME_MAX_SO);
 		return error ? : parse_u32(&cfg->bib.max_stored_pkts, chunk, size);
+	case MAX_STORED_BYTES:
+		error = ensure_nat64(OPTNAME_MAX_SO_BYTES);
+		return error ? : parse_u32(&cfg->bib.max_stored_bytes, chunk, size);
+	case STATELESS_SO:
+		error = ensure_nat64(OPTNAME_STATELESS_SO);
+		return error ? : parse_bool(&cfg->bib.stateless_so, chunk, size);
+	case MAX_SESSIONS_TCP:
+		error = ensure_nat64(OPTNAME_MAX_SESSIONS_TCP);
+		return error ? : parse_u32(&cfg->bib.max_sessions.tcp, chunk, size);
+	case MAX_SESSIONS_UDP:
+		error = ensure_nat64(OPTNAME_MAX_SESSIONS_UDP);
+		return error ? : parse_u32(&cfg->bib.max_sessions.udp, chunk, size);
+	case MAX_SESSIONS_ICMP:
+		error = ensure_nat64(OPTNAME_MAX_SESSIONS_ICMP);
+		return error ? : parse_u32(&cfg->bib.max_sessions.icmp, chunk, size);
+	case SUBSCRIBER_PREFIX_LEN:
+		error = ensure_nat64(OPTNAME_SUBSCRIBER_PLEN);
+		if (error)
+			return error;
+		error = parse_u8(&cfg->bib.subscriber.prefix_len, chunk, size);
+		if (error)
+			return error;
+		if (cfg->bib.subscriber.prefix_len > 128) {
+			log_err("%s cannot exceed 128.", OPTNAME_SUBSCRIBER_PLEN);
+			return -EINVAL;
+		}
+		return 0;
+	case SUBSCRIBER_MAX_BIBS:
+		error = ensure_nat64(OPTNAME_SUBSCRIBER_MAX_BIBS);
+		return error ? : parse_u32(&cfg->bib.subscriber.max_bibs, chunk, size);
+	case SUBSCRIBER_MAX_SESSIONS:
+		error = ensure_nat64(OPTNAME_SUBSCRIBER_MAX_SESSIONS);
+		return error ? : parse_u32(&cfg->bib.subscriber.max_sessions, chunk, size);
+	case SUBSCRIBER_MAX_RATE:
+		error = ensure_nat64(OPTNAME_SUBSCRIBER_MAX_RATE);
+		return error ? : parse_u32(&cfg->bib.subscriber.max_rate, chunk, size);
+	case CPS_BUDGET:
+		error = ensure_nat64(OPTNAME_CPS_BUDGET);
+		return error ? : parse_u32(&cfg->bib.cps_budget, chunk, size);
+	case PORT_BLOCK_SIZE:
+		error = ensure_nat64(OPTNAME_PORT_BLOCK_SIZE);
+		return error ? : parse_u16(&cfg->bib.port_block_size, chunk, size,
+				PORT_BLOCK_MAX);
+	case DETERMINISTIC_BITS:
+		error = ensure_nat64(OPTNAME_DETERMINISTIC_BITS);
+		if (error)
+			return error;
+		error = parse_u8(&cfg->bib.deterministic_bits, chunk, size);
+		if (error)
+			return error;
+		if (cfg->bib.deterministic_bits > DETERMINISTIC_BITS_MAX) {
+			log_err("%s cannot exceed %u.", OPTNAME_DETERMINISTIC_BITS,
+					DETERMINISTIC_BITS_MAX);
+			return -EINVAL;
+		}
+		return 0;
+	case POOL4_BALANCE:
+		error = ensure_nat64(OPTNAME_POOL4_BALANCE);
+		return error ? : parse_bool(&cfg->bib.pool4_balance, chunk, size);
+	case SS_WINDOW:
+		error = ensure_nat64(OPTNAME_SS_WINDOW);
+		if (error)
+			return error;
+		error = parse_u16(&cfg->joold.window, chunk, size, JOOLD_MAX_WINDOW);
+		if (!error && !cfg->joold.window) {
+			log_err("%s cannot be zero.", OPTNAME_SS_WINDOW);
+			return -EINVAL;
+		}
+		return error;
+	case SS_ADVERTISE_CHUNK:
+		error = ensure_nat64(OPTNAME_SS_ADVERTISE_CHUNK);
+		return error ? : parse_u32(&cfg->joold.advertise_chunk, chunk,
+				size);
+	case SS_ADVERTISE_RATE:
+		error = ensure_nat64(OPTNAME_SS_ADVERTISE_RATE);
+		return error ? : parse_u32(&cfg->joold.advertise_rate, chunk,
+				size);
 	case SS_ENABLED:
 		error = ensure_nat64(OPTNAME_SS_ENABLED);
 		return error ? : parse_bool(&cfg->joold.enabled, chunk, size);
 	case SS_FLUSH_ASAP:
 		error = ensure_nat64(OPTNAME_SS_FLUSH_ASAP);
 		return error ? : parse_bool(&cfg->joold.flush_asap, chunk, size);
+	case SS_COMPACT:
+		error = ensure_nat64(OPTNAME_SS_COMPACT);
+		return error ? : parse_bool(&cfg->joold.compact, chunk, size);
+	case SS_RESYNC_INTERVAL:
+		error = ensure_nat64(OPTNAME_SS_RESYNC_INTERVAL);
+		if (error)
+			return error;
+		error = parse_timeout(&cfg->bib.sync_interval, chunk, size, 0);
+		if (!error && cfg->bib.sync_interval
+				> msecs_to_jiffies(SYNC_INTERVAL_MAX)) {
+			log_err("%s cannot exceed %u milliseconds.",
+					OPTNAME_SS_RESYNC_INTERVAL,
+					SYNC_INTERVAL_MAX);
+			return -EINVAL;
+		}
+		return error;
+	case SS_NODE_COUNT:
+		error = ensure_nat64(OPTNAME_SS_NODE_COUNT);
+		return error ? : parse_u8(&cfg->bib.node_count, chunk, size);
+	case SS_NODE_ID:
+		error = ensure_nat64(OPTNAME_SS_NODE_ID);
+		return error ? : parse_u8(&cfg->bib.node_id, chunk, size);
 	case SS_FLUSH_DEADLINE:
 		error = ensure_nat64(OPTNAME_SS_FLUSH_DEADLINE);
 		return error ? : parse_timeout(&cfg->joold.flush_deadline, chunk, size, 0);
@@ -336,22 +534,33 @@ int config_parse(struct full_config *config, void *payload, size_t payload_len)
 		bytes_read += chunk->len;
 	}
 
+	if (config->frag.high_thresh
+			&& config->frag.low_thresh > config->frag.high_thresh) {
+		log_err("%s (%u) cannot be greater than %s (%u).",
+				OPTNAME_FRAG_LOW_THRESH,
+				config->frag.low_thresh,
+				OPTNAME_FRAG_HIGH_THRESH,
+				config->frag.high_thresh);
+		return -EINVAL;
+	}
+
 	return bytes_read;
 }
 
 static int commit_config(struct xlator *jool, struct full_config *config)
 {
-	config_put(jool->global);
-	jool->global = config_alloc();
-	if (!jool->global)
+	struct global_config *global;
+
+	global = config_alloc();
+	if (!global)
 		return -ENOMEM;
+	config_copy(&config->global, &global->cfg);
 
-	config_copy(&config->global, &jool->global->cfg);
 	bib_config_set(jool->nat64.bib, &config->bib);
 	joold_config_set(jool->nat64.joold, &config->joold);
 	fragdb_config_set(jool->nat64.frag, &config->frag);
 
-	return xlator_replace(jool);
+	return xlator_set_global(jool, global);
 }
 
 static int handle_global_update(struct xlator *jool, struct genl_info *info)
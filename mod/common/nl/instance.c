@@ -1,14 +1,67 @@
 #include "nat64/mod/common/nl/instance.h"
 
+#include <net/net_namespace.h>
 #include "nat64/common/types.h"
 #include "nat64/mod/common/xlator.h"
 #include "nat64/mod/common/nl/nl_common.h"
 #include "nat64/mod/common/nl/nl_core2.h"
 
+/*
+ * Generic Netlink runs the handlers in the context of the requester, so its
+ * file descriptors are the current ones.
+ */
+static int handle_instance_clone(struct genl_info *info,
+		struct request_instance *request)
+{
+	struct net *from;
+	int error;
+
+	if (request->shared_tables[0]) {
+		log_err("A copied instance already shares its tables with the original.");
+		return nlcore_respond(info, -EINVAL);
+	}
+
+	from = get_net_ns_by_fd(request->from);
+	if (IS_ERR(from)) {
+		log_err("Could not retrieve the source namespace.");
+		return nlcore_respond(info, PTR_ERR(from));
+	}
+
+	log_debug("Copying the Jool instance of another namespace.");
+	error = xlator_add_from(from, NULL);
+	put_net(from);
+	return nlcore_respond(info, error);
+}
+
 static int handle_instance_add(struct genl_info *info)
 {
+	struct request_instance *request;
+	size_t size;
+
 	log_debug("Adding Jool instance.");
-	return nlcore_respond(info, xlator_add(NULL));
+
+	/* Older clients don't send a payload. */
+	size = nla_len(info->attrs[ATTR_DATA]) - sizeof(struct request_hdr);
+	if (size == 0)
+		return nlcore_respond(info, xlator_add(NULL));
+	if (size != sizeof(*request)) {
+		log_err("Expected a %zu-byte instance request; got %zu bytes.",
+				sizeof(*request), size);
+		return nlcore_respond(info, -EINVAL);
+	}
+
+	request = (struct request_instance *)(get_jool_hdr(info) + 1);
+	if (request->from >= 0)
+		return handle_instance_clone(info, request);
+	if (strnlen(request->shared_tables, SHARED_TABLES_NAME_LEN)
+			== SHARED_TABLES_NAME_LEN) {
+		log_err("The name of the shared tables is not terminated.");
+		return nlcore_respond(info, -EINVAL);
+	}
+
+	return nlcore_respond(info, xlator_add_shared(
+			request->shared_tables[0] ? request->shared_tables : NULL,
+			NULL));
 }
 
 static int handle_instance_rm(struct genl_info *info)
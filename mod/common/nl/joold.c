@@ -4,6 +4,42 @@
 #include "nat64/mod/common/nl/nl_common.h"
 #include "nat64/mod/common/nl/nl_core2.h"
 
+static int handle_joold_status(struct xlator *jool, struct genl_info *info)
+{
+	struct joold_status_usr status;
+
+	log_debug("Returning the joold status.");
+	joold_status(jool, &status);
+	return nlcore_respond_struct(info, &status, sizeof(status));
+}
+
+static int handle_joold_advertise(struct xlator *jool, struct genl_info *info)
+{
+	struct joold_adv_request *request;
+	unsigned int window = 0;
+
+	/* The payload is optional; older daemons and the client don't send it. */
+	if (nla_len(info->attrs[ATTR_DATA]) >= sizeof(struct request_hdr)
+			+ sizeof(*request)) {
+		request = (struct joold_adv_request *)(get_jool_hdr(info) + 1);
+		window = be32_to_cpu(request->window);
+	}
+
+	return joold_advertise(jool, window);
+}
+
+static int handle_joold_bind(struct xlator *jool, struct genl_info *info)
+{
+	int error;
+
+	error = validate_request_size(info, sizeof(struct joold_bind_request));
+	if (error)
+		return error;
+
+	return joold_bind(jool, (struct joold_bind_request *)
+			(get_jool_hdr(info) + 1));
+}
+
 int handle_joold_request(struct xlator *jool, struct genl_info *info)
 {
 	struct request_hdr *hdr;
@@ -31,14 +67,31 @@ int handle_joold_request(struct xlator *jool, struct genl_info *info)
 			return 0;
 		}
 		break;
+	case OP_UPDATE:
+		total_len = nla_len(info->attrs[ATTR_DATA]);
+		error = joold_update(jool, hdr + 1, total_len - sizeof(*hdr));
+		if (!error)
+			return 0; /* Same as OP_ADD. */
+		break;
+	case OP_ADVERTISE_END:
+		total_len = nla_len(info->attrs[ATTR_DATA]);
+		error = joold_adv_end(jool, hdr + 1, total_len - sizeof(*hdr));
+		if (!error)
+			return 0; /* Same as OP_ADD. */
+		break;
+	case OP_DISPLAY:
+		return handle_joold_status(jool, info);
 	case OP_TEST:
 		error = joold_test(jool);
 		break;
 	case OP_ADVERTISE:
-		error = joold_advertise(jool);
+		error = handle_joold_advertise(jool, info);
+		break;
+	case OP_BIND:
+		error = handle_joold_bind(jool, info);
 		break;
 	case OP_ACK:
-		joold_ack(jool);
+		joold_ack(jool, be16_to_cpu(hdr->seq));
 		return 0; /* Do not ack the ack! */
 	default:
 		log_err("Unknown operation: %u", be16_to_cpu(hdr->operation));
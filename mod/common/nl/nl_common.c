@@ -30,3 +30,40 @@ int validate_request_size(struct genl_info *info, size_t min_expected)
 
 	return 0;
 }
+
+/**
+ * Returns the request's payload attribute, or NULL if it doesn't have one.
+ *
+ * (Dumps don't get a genl_info, and the attributes are not parsed for us.)
+ */
+struct nlattr *get_dump_attr(struct netlink_callback *cb)
+{
+	return nlmsg_find_attr(cb->nlh, GENL_HDRLEN, ATTR_DATA);
+}
+
+/**
+ * Dump version of get_jool_hdr(). Returns NULL if the request lacks payload.
+ */
+struct request_hdr *get_dump_hdr(struct netlink_callback *cb)
+{
+	struct nlattr *attr = get_dump_attr(cb);
+	return attr ? nla_data(attr) : NULL;
+}
+
+/**
+ * Dump version of validate_request_size().
+ */
+int validate_dump_size(struct netlink_callback *cb, size_t min_expected)
+{
+	struct nlattr *attr = get_dump_attr(cb);
+	size_t request_size = attr ? nla_len(attr) : 0;
+
+	min_expected += sizeof(struct request_hdr);
+	if (request_size < min_expected) {
+		log_err("The minimum expected request size was %zu bytes; got %zu instead.",
+				min_expected, request_size);
+		return -EINVAL;
+	}
+
+	return 0;
+}
@@ -54,10 +54,10 @@
 #define NLBUFFER_MAX_PAYLOAD ((size_t)(GENLMSG_DEFAULT_SIZE - 256))
 
 static struct genl_family *family;
-static struct genl_multicast_group *group;
+static struct genl_multicast_group *groups;
 
 void nlcore_setup(struct genl_family *new_family,
-		struct genl_multicast_group *new_group)
+		struct genl_multicast_group *new_groups)
 {
 	/*
 	 * If this triggers, GENLMSG_DEFAULT_SIZE is too small.
@@ -67,7 +67,7 @@ void nlcore_setup(struct genl_family *new_family,
 	BUILD_BUG_ON(GENLMSG_DEFAULT_SIZE <= 256);
 
 	family = new_family;
-	group = new_group;
+	groups = new_groups;
 }
 
 static int respond_single_msg(struct genl_info *info, struct nlcore_buffer *buffer)
@@ -305,6 +305,47 @@ int nlcore_respond_struct(struct genl_info *info, void *content,
 	return error;
 }
 
+/**
+ * Sends (and consumes) @skb to @ns's listeners of @group.
+ */
+static int __multicast(struct net *ns, struct sk_buff *skb,
+		enum nlcore_group group)
+{
+#if LINUX_VERSION_LOWER_THAN(3, 13, 0, 7, 1)
+	return genlmsg_multicast_netns(ns, skb, 0, groups[group].id,
+			GFP_ATOMIC);
+#else
+	/*
+	 * Note: Starting from kernel 3.13, all groups of a common family share
+	 * a group offset (from a common pool), and they are numbered
+	 * monotonically from there. That means the group's "id" is just its
+	 * index in the family's array.
+	 *
+	 * That's the reason why so many callers of this function stopped
+	 * providing a group when the API started forcing them to provide a
+	 * family.
+	 */
+	return genlmsg_multicast_netns(family, ns, skb, 0, group, GFP_ATOMIC);
+#endif
+}
+
+/**
+ * Sends (and consumes) @skb to @ns's joold daemons.
+ */
+static int multicast(struct net *ns, struct sk_buff *skb)
+{
+	int error;
+
+	error = __multicast(ns, skb, NLCORE_GROUP_JOOLD);
+	if (error) {
+		log_warn_once("Looks like nobody received my multicast message. Is the joold daemon really active? (errcode %d)",
+				error);
+		return error;
+	}
+
+	return 0;
+}
+
 int nlcore_send_multicast_message(struct net *ns, struct nlcore_buffer *buffer)
 {
 	int error;
@@ -318,6 +359,7 @@ int nlcore_send_multicast_message(struct net *ns, struct nlcore_buffer *buffer)
 	msg_head = genlmsg_put(skb, 0, 0, family, 0, 0);
 	if (!msg_head) {
 		pr_err("genlmsg_put() returned NULL.\n");
+		kfree_skb(skb);
 		return -ENOMEM;
 	}
 
@@ -329,27 +371,225 @@ int nlcore_send_multicast_message(struct net *ns, struct nlcore_buffer *buffer)
 	}
 
 	genlmsg_end(skb, msg_head);
+	return multicast(ns, skb);
+}
 
-#if LINUX_VERSION_LOWER_THAN(3, 13, 0, 7, 1)
-	error = genlmsg_multicast_netns(ns, skb, 0, group->id, GFP_ATOMIC);
+/**
+ * Prepares @msg so up to @capacity bytes (other than @hdr) can be written on
+ * it.
+ */
+int nlcore_mcast_init(struct nlcore_mcast *msg, struct request_hdr *hdr,
+		size_t capacity)
+{
+	capacity += sizeof(*hdr);
+	if (WARN(capacity > NLBUFFER_MAX_PAYLOAD,
+			"Message size is too big. (%zu > %zu)",
+			capacity, NLBUFFER_MAX_PAYLOAD))
+		return -EINVAL;
+
+	msg->skb = genlmsg_new(nla_total_size(capacity), GFP_ATOMIC);
+	if (!msg->skb)
+		return -ENOMEM;
+
+	msg->msg_head = genlmsg_put(msg->skb, 0, 0, family, 0, 0);
+	if (!msg->msg_head)
+		goto fail;
+	/* The attribute grows as the payload is written. */
+	msg->attr = nla_reserve(msg->skb, ATTR_DATA, 0);
+	if (!msg->attr)
+		goto fail;
+
+	msg->room = capacity;
+	memcpy(nlcore_mcast_reserve(msg, sizeof(*hdr)), hdr, sizeof(*hdr));
+	return 0;
+
+fail:
+	kfree_skb(msg->skb);
+	msg->skb = NULL;
+	return -ENOMEM;
+}
+
+/**
+ * Appends @size bytes to @msg's payload, and returns them so the caller can
+ * fill them. Returns NULL if the message is full.
+ */
+void *nlcore_mcast_reserve(struct nlcore_mcast *msg, size_t size)
+{
+	if (size > msg->room || size > skb_tailroom(msg->skb))
+		return NULL;
+
+	msg->room -= size;
+	return skb_put(msg->skb, size);
+}
+
+/**
+ * Returns the payload written on @msg so far, header included.
+ * (Its length goes in @len.)
+ */
+void *nlcore_mcast_data(struct nlcore_mcast *msg, size_t *len)
+{
+	*len = skb_tail_pointer(msg->skb) - (unsigned char *)nla_data(msg->attr);
+	return nla_data(msg->attr);
+}
+
+/**
+ * Closes @msg's attribute and message, and hands its skb over.
+ */
+static struct sk_buff *mcast_finish(struct nlcore_mcast *msg)
+{
+	struct sk_buff *skb = msg->skb;
+	size_t len;
+	size_t padding;
+
+	nlcore_mcast_data(msg, &len);
+	msg->attr->nla_len = nla_attr_size(len);
+	padding = nla_padlen(len);
+	if (padding)
+		memset(skb_put(skb, padding), 0, padding);
+	genlmsg_end(skb, msg->msg_head);
+
+	msg->skb = NULL;
+	return skb;
+}
+
+/**
+ * Multicasts @msg. @msg's memory is consumed either way.
+ */
+int nlcore_mcast_send(struct net *ns, struct nlcore_mcast *msg)
+{
+	return multicast(ns, mcast_finish(msg));
+}
+
+/**
+ * Like nlcore_mcast_send(), except to @group, and quietly. (Nobody listening
+ * is not an error for anything other than joold.)
+ */
+int nlcore_mcast_send_group(struct net *ns, struct nlcore_mcast *msg,
+		enum nlcore_group group)
+{
+	return __multicast(ns, mcast_finish(msg), group);
+}
+
+/**
+ * Releases @msg, if it hasn't been sent.
+ */
+void nlcore_mcast_clean(struct nlcore_mcast *msg)
+{
+	if (msg->skb) {
+		kfree_skb(msg->skb);
+		msg->skb = NULL;
+	}
+}
+
+/**
+ * Initializes @buffer so it can fill as much of the dump skb @skb as possible.
+ * (This is usually a lot more than NLBUFFER_MAX_PAYLOAD.)
+ */
+int nlbuffer_init_dump(struct nlcore_buffer *buffer, struct sk_buff *skb,
+		struct request_hdr *request)
+{
+	struct response_hdr response;
+	size_t overhead;
+	size_t capacity;
+
+	overhead = nlmsg_total_size(GENL_HDRLEN) + nla_total_size(0);
+	capacity = skb_tailroom(skb);
+	if (capacity < overhead + sizeof(response))
+		return -EMSGSIZE;
+	capacity -= overhead;
+	/* The buffer and the attribute lengths are 16-bit. */
+	if (capacity > 0xFFFFu - NLA_HDRLEN)
+		capacity = 0xFFFFu - NLA_HDRLEN;
+
+	buffer->len = 0;
+	buffer->capacity = capacity;
+	buffer->data = __wkmalloc("nlcore_buffer.data", capacity, GFP_KERNEL);
+	if (!buffer->data)
+		return -ENOMEM;
+
+	memcpy(&response.req, request, sizeof(response.req));
+	response.req.castness = 'u';
+	response.error_code = 0;
+	response.pending_data = false;
+	return nlbuffer_write(buffer, &response, sizeof(response));
+}
+
+/**
+ * Writes @buffer into the dump skb @skb. (The kernel sends it.)
+ */
+int nlbuffer_dump(struct sk_buff *skb, struct netlink_callback *cb,
+		struct nlcore_buffer *buffer)
+{
+	struct response_hdr *hdr = buffer->data;
+	void *msg_head;
+	uint32_t portid;
+	int error;
+
+#if LINUX_VERSION_LOWER_THAN(3, 7, 0, 7, 0)
+	portid = NETLINK_CB(cb->skb).pid;
 #else
-	/*
-	 * Note: Starting from kernel 3.13, all groups of a common family share
-	 * a group offset (from a common pool), and they are numbered
-	 * monotonically from there. That means if all we have is one group,
-	 * its id will always be zero.
-	 *
-	 * That's the reason why so many callers of this function stopped
-	 * providing a group when the API started forcing them to provide a
-	 * family.
-	 */
-	error = genlmsg_multicast_netns(family, ns, skb, 0, 0, GFP_ATOMIC);
+	portid = NETLINK_CB(cb->skb).portid;
 #endif
+
+	msg_head = genlmsg_put(skb, portid, cb->nlh->nlmsg_seq, family,
+			NLM_F_MULTI, be16_to_cpu(hdr->req.mode));
+	if (!msg_head) {
+		pr_err("genlmsg_put() failed.\n");
+		return -EMSGSIZE;
+	}
+
+	error = nla_put(skb, ATTR_DATA, buffer->len, buffer->data);
 	if (error) {
-		log_warn_once("Looks like nobody received my multicast message. Is the joold daemon really active? (errcode %d)",
-				error);
+		pr_err("nla_put() failed. (errcode %d)\n", error);
+		genlmsg_cancel(skb, msg_head);
 		return error;
 	}
 
+	genlmsg_end(skb, msg_head);
 	return 0;
 }
+
+/**
+ * Ends the dump by sending @error_code (and the error pool's message) to
+ * userspace. Returns what the dumpit callback should return.
+ */
+int nlcore_dump_error(struct sk_buff *skb, struct netlink_callback *cb,
+		struct request_hdr *request, int error_code)
+{
+	struct nlcore_buffer buffer;
+	char *error_msg;
+	size_t error_msg_size;
+	size_t room;
+	int error;
+
+	cb->args[0] = NLDUMP_DONE;
+
+	error = error_pool_get_message(&error_msg, &error_msg_size);
+	if (error)
+		return error; /* Error msg already printed. */
+
+	error = nlbuffer_init_dump(&buffer, skb, request);
+	if (error) {
+		pr_err("Errcode %d while initializing a response to userspace.\n",
+				error);
+		goto end_simple;
+	}
+
+	nlbuffer_set_errcode(&buffer, error_code);
+
+	room = buffer.capacity - buffer.len;
+	if (error_msg_size > room) {
+		error_msg_size = room;
+		if (room)
+			error_msg[room - 1] = '\0';
+	}
+	nlbuffer_write(&buffer, error_msg, error_msg_size);
+
+	log_debug("Sending error code %d to userspace.", error_code);
+	error = nlbuffer_dump(skb, cb, &buffer);
+
+	nlbuffer_clean(&buffer);
+end_simple:
+	__wkfree("Error msg out", error_msg);
+	return error ? : skb->len;
+}
@@ -1,6 +1,6 @@
 #include "nat64/mod/common/nl/nl_handler.h"
 
-#include <linux/mutex.h>
+#include <linux/rwsem.h>
 #include <linux/version.h>
 #include <linux/genetlink.h>
 #include "nat64/common/types.h"
@@ -19,12 +19,19 @@
 #include "nat64/mod/common/nl/pool4.h"
 #include "nat64/mod/common/nl/pool6.h"
 #include "nat64/mod/common/nl/session.h"
+#include "nat64/mod/common/nl/stats.h"
 
-static struct genl_multicast_group mc_groups[1] = {
-	{
+static struct genl_multicast_group mc_groups[NLCORE_GROUP_COUNT] = {
+	[NLCORE_GROUP_JOOLD] = {
 		.name = GNL_JOOLD_MULTICAST_GRP_NAME,
 #if LINUX_VERSION_LOWER_THAN(3, 13, 0, 7, 1)
 		.id = JOOLD_MC_ID,
+#endif
+	},
+	[NLCORE_GROUP_EVENTS] = {
+		.name = GNL_EVENTS_MULTICAST_GRP_NAME,
+#if LINUX_VERSION_LOWER_THAN(3, 13, 0, 7, 1)
+		.id = EVENTS_MC_ID,
 #endif
 	},
 };
@@ -36,7 +43,11 @@ static struct genl_ops ops[] = {
 	{
 		.cmd = JOOL_COMMAND,
 		.doit = handle_jool_message,
-		.dumpit = NULL,
+		.dumpit = handle_jool_dump,
+	},
+	{
+		.cmd = JOOLD_COMMAND,
+		.doit = handle_joold_message,
 	},
 };
 
@@ -55,11 +66,13 @@ static struct genl_family jool_family = {
 	 * In kernel 3.10, they added a variable here called "parallel_ops".
 	 * Documentation about it can be found in Linux's commit
 	 * def3117493eafd9dfa1f809d861e0031b2cc8a07.
-	 * It appears to be an attempt to free genetlink users from the task of
-	 * locking.
-	 * We need to support older kernels, so we need to lock anyway, so this
-	 * feature is of no use to us.
+	 * Without it, genetlink serializes every request behind genl_mutex,
+	 * which would defeat @config_sem's readers. We lock by ourselves
+	 * regardless, so older kernels just lose the concurrency.
 	 */
+#if LINUX_VERSION_AT_LEAST(3, 10, 0, 7, 0)
+	.parallel_ops = true,
+#endif
 	/*
 	 * "pre_doit" and "post_doit" are a pain in the ass; there is no doit
 	 * function so I have no idea. Whatever; they can be null. Fuck 'em.
@@ -86,7 +99,13 @@ static struct genl_family jool_family = {
 #endif
 };
 
-static DEFINE_MUTEX(config_mutex);
+/**
+ * Requests that change the configuration hold this for writing. Queries and
+ * joold traffic only need it for reading, so they don't wait for each other;
+ * the databases they touch have their own locks (or RCU), just like in the
+ * packet path.
+ */
+static DECLARE_RWSEM(config_sem);
 
 static int multiplex_request(struct xlator *jool, struct genl_info *info)
 {
@@ -115,12 +134,36 @@ static int multiplex_request(struct xlator *jool, struct genl_info *info)
 		return handle_joold_request(jool, info);
 	case MODE_INSTANCE:
 		return handle_instance_request(info);
+	case MODE_STATS:
+		return handle_stats_request(jool, info);
 	}
 
 	log_err("Unknown configuration mode: %d", be16_to_cpu(hdr->mode));
 	return nlcore_respond(info, -EINVAL);
 }
 
+static bool is_shared_request(struct genl_info *info);
+
+/**
+ * Returns true if the request in @info might modify one of the tables the
+ * instance could be sharing with other instances. (See xlator_unshare().)
+ */
+static bool modifies_shareable(struct genl_info *info)
+{
+	if (is_shared_request(info))
+		return false;
+
+	switch (be16_to_cpu(get_jool_hdr(info)->mode)) {
+	case MODE_POOL6:
+	case MODE_EAMT:
+	case MODE_BLACKLIST:
+	case MODE_PARSE_FILE:
+		return true;
+	}
+
+	return false;
+}
+
 static int __handle_jool_message(struct genl_info *info)
 {
 	struct xlator translator;
@@ -151,28 +194,209 @@ static int __handle_jool_message(struct genl_info *info)
 		return nlcore_respond(info, error);
 	}
 
+	if (modifies_shareable(info)) {
+		error = xlator_unshare(&translator);
+		if (error) {
+			log_err("Could not copy the shared tables: %d", error);
+			xlator_put(&translator);
+			return nlcore_respond(info, error);
+		}
+	}
+
 	error = multiplex_request(&translator, info);
 	xlator_put(&translator);
 	return error;
 }
 
+/**
+ * Returns true if the request in @info can be handled alongside others.
+ * Requests too short to tell are validated (and rejected) the slow way.
+ */
+static bool is_shared_request(struct genl_info *info)
+{
+	struct nlattr *attr = info->attrs[ATTR_DATA];
+	struct request_hdr *hdr;
+
+	if (!attr || nla_len(attr) < sizeof(struct request_hdr))
+		return false;
+	hdr = nla_data(attr);
+
+	switch (be16_to_cpu(hdr->mode)) {
+	case MODE_JOOLD:
+		/* Binds are rare, and two of them shouldn't race. */
+		return be16_to_cpu(hdr->operation) != OP_BIND;
+	case MODE_PARSE_FILE:
+	case MODE_INSTANCE:
+		return false;
+	}
+
+	switch (be16_to_cpu(hdr->operation)) {
+	case OP_DISPLAY:
+	case OP_COUNT:
+		return true;
+	}
+
+	return false;
+}
+
 int handle_jool_message(struct sk_buff *skb, struct genl_info *info)
 {
+	bool shared;
 	int error;
 
-	mutex_lock(&config_mutex);
+	shared = is_shared_request(info);
+	if (shared)
+		down_read(&config_sem);
+	else
+		down_write(&config_sem);
 
 	error_pool_activate();
 	error = __handle_jool_message(info);
 	error_pool_deactivate();
 
-	mutex_unlock(&config_mutex);
+	if (shared)
+		up_read(&config_sem);
+	else
+		up_write(&config_sem);
+
+	return error;
+}
+
+static int __handle_joold_message(struct genl_info *info)
+{
+	struct xlator translator;
+	bool client_is_jool;
+	int error;
+
+	error = validate_request(nla_data(info->attrs[ATTR_DATA]),
+			nla_len(info->attrs[ATTR_DATA]),
+			"joold",
+			"kernel module",
+			&client_is_jool);
+	if (error)
+		return client_is_jool ? nlcore_respond(info, error) : error;
+
+	if (be16_to_cpu(get_jool_hdr(info)->mode) != MODE_JOOLD) {
+		log_err("The joold command only takes joold requests.");
+		return nlcore_respond(info, -EINVAL);
+	}
+
+	error = xlator_find_current(&translator);
+	if (error) {
+		log_err("This namespace lacks a Jool instance.");
+		return nlcore_respond(info, error);
+	}
+
+	error = handle_joold_request(&translator, info);
+	xlator_put(&translator);
+	return error;
+}
+
+/**
+ * doit callback of JOOLD_COMMAND.
+ *
+ * Unlike handle_jool_message(), this one doesn't touch @config_sem. joold only
+ * deals with the session database and its own queue, which are locked the same
+ * way they are for the packet path, and the instance reference keeps the rest
+ * alive even if the configuration is replaced in the meantime.
+ */
+int handle_joold_message(struct sk_buff *skb, struct genl_info *info)
+{
+	int error;
+
+	if (!info->attrs[ATTR_DATA]) {
+		log_debug("joold request lacks a payload.");
+		return -EINVAL;
+	}
+
+	error_pool_activate();
+	error = __handle_joold_message(info);
+	error_pool_deactivate();
+
+	return error;
+}
+
+static int __handle_jool_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct nlattr *attr;
+	struct request_hdr *hdr;
+	struct xlator translator;
+	bool client_is_jool;
+	int error;
+
+	log_debug("===============================================");
+	log_debug("Received a dump request from userspace.");
+
+	attr = get_dump_attr(cb);
+	if (!attr)
+		return -EINVAL;
+	hdr = nla_data(attr);
+
+	error = validate_request(hdr, nla_len(attr),
+			"userspace client",
+			"kernel module",
+			&client_is_jool);
+	if (error)
+		return client_is_jool ? nlcore_dump_error(skb, cb, hdr, error) : error;
+
+	error = xlator_find_current(&translator);
+	if (error == -ESRCH) {
+		log_err("This namespace lacks a Jool instance.");
+		return nlcore_dump_error(skb, cb, hdr, -ESRCH);
+	}
+	if (error) {
+		log_err("Unknown error %d; Jool instance not found.", error);
+		return nlcore_dump_error(skb, cb, hdr, error);
+	}
+
+	switch (be16_to_cpu(hdr->mode)) {
+	case MODE_BIB:
+		error = handle_bib_dump(&translator, skb, cb);
+		break;
+	case MODE_SESSION:
+		error = handle_session_dump(&translator, skb, cb);
+		break;
+	case MODE_EAMT:
+		error = handle_eamt_dump(&translator, skb, cb);
+		break;
+	default:
+		log_err("Configuration mode %d cannot be dumped.",
+				be16_to_cpu(hdr->mode));
+		error = nlcore_dump_error(skb, cb, hdr, -EINVAL);
+	}
+
+	xlator_put(&translator);
+	return error;
+}
+
+/**
+ * dumpit callback. The kernel calls this repeatedly, with a fresh skb each
+ * time, until it returns zero (or an error).
+ *
+ * The instance is looked up again on every call, because the dump can span
+ * several recvmsg()s from userspace.
+ */
+int handle_jool_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	int error;
+
+	/* Dumps are displays. */
+	down_read(&config_sem);
+
+	error_pool_activate();
+	error = __handle_jool_dump(skb, cb);
+	error_pool_deactivate();
+
+	up_read(&config_sem);
 
 	return error;
 }
 
 static int register_family(void)
 {
+#if LINUX_VERSION_LOWER_THAN(3, 13, 0, 7, 1)
+	unsigned int i;
+#endif
 	int error;
 
 	log_debug("Registering Generic Netlink family...");
@@ -188,10 +412,12 @@ static int register_family(void)
 		return error;
 	}
 
-	error = genl_register_mc_group(&jool_family, &(mc_groups[0]));
-	if (error) {
-		log_err("Couldn't register multicast group!");
-		return error;
+	for (i = 0; i < ARRAY_SIZE(mc_groups); i++) {
+		error = genl_register_mc_group(&jool_family, &mc_groups[i]);
+		if (error) {
+			log_err("Couldn't register multicast group!");
+			return error;
+		}
 	}
 
 #elif LINUX_VERSION_LOWER_THAN(4, 10, 0, 7, 5)
@@ -209,7 +435,7 @@ static int register_family(void)
 	}
 #endif
 
-	nlcore_setup(&jool_family, &mc_groups[0]);
+	nlcore_setup(&jool_family, mc_groups);
 	return 0;
 }
 
@@ -77,7 +77,8 @@ static int handle_addr4pool_flush(struct addr4_pool *pool)
 	return pool_flush(pool);
 }
 
-static int handle_addr4pool(struct addr4_pool *pool, struct genl_info *info)
+static int handle_addr4pool(struct xlator *jool, struct addr4_pool *pool,
+		struct genl_info *info)
 {
 	struct request_hdr *hdr = get_jool_hdr(info);
 	union request_pool *request = (union request_pool *)(hdr + 1);
@@ -111,15 +112,18 @@ static int handle_addr4pool(struct addr4_pool *pool, struct genl_info *info)
 		error = -EINVAL;
 	}
 
+	/* The CLAT mode needs an empty blacklist. */
+	if (pool == jool->siit.blacklist)
+		xlator_refresh_clat(jool);
 	return nlcore_respond(info, error);
 }
 
 int handle_blacklist_config(struct xlator *jool, struct genl_info *info)
 {
-	return handle_addr4pool(jool->siit.blacklist, info);
+	return handle_addr4pool(jool, jool->siit.blacklist, info);
 }
 
 int handle_pool6791_config(struct xlator *jool, struct genl_info *info)
 {
-	return handle_addr4pool(jool->siit.pool6791, info);
+	return handle_addr4pool(jool, jool->siit.pool6791, info);
 }
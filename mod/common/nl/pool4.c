@@ -37,6 +37,70 @@ static int handle_pool4_display(struct pool4 *pool, struct genl_info *info,
 	return error;
 }
 
+struct usage_args {
+	struct bib *bib;
+	l4_protocol proto;
+	struct nlcore_buffer *buffer;
+};
+
+static int usage_to_usr(struct in_addr *addr, unsigned int ports, void *arg)
+{
+	struct usage_args *args = arg;
+	struct pool4_usage_usr usage;
+	int error;
+
+	usage.addr = *addr;
+	usage.ports = ports;
+	error = bib_count_ports(args->bib, args->proto, addr, &usage.used);
+	if (error)
+		return error;
+
+	return nlbuffer_write(args->buffer, &usage, sizeof(usage));
+}
+
+static int handle_pool4_usage(struct xlator *jool, struct genl_info *info,
+		union request_pool4 *request)
+{
+	struct nlcore_buffer buffer;
+	struct pool4_stats_usr stats;
+	struct usage_args args;
+	struct in_addr *offset = NULL;
+	int error;
+
+	log_debug("Sending pool4 usage to userspace.");
+
+	error = nlbuffer_init_response(&buffer, info, nlbuffer_response_max_size());
+	if (error)
+		return nlcore_respond(info, error);
+
+	if (request->usage.offset_set) {
+		offset = &request->usage.offset;
+	} else {
+		error = bib_mask_stats(jool->nat64.bib, request->usage.proto,
+				&stats);
+		if (error)
+			goto end;
+		error = nlbuffer_write(&buffer, &stats, sizeof(stats));
+		if (error)
+			goto end;
+	}
+
+	args.bib = jool->nat64.bib;
+	args.proto = request->usage.proto;
+	args.buffer = &buffer;
+	error = pool4db_foreach_addr(jool->nat64.pool4, request->usage.proto,
+			usage_to_usr, &args, offset);
+	nlbuffer_set_pending_data(&buffer, error > 0);
+
+end:
+	error = (error >= 0)
+			? nlbuffer_send(info, &buffer)
+			: nlcore_respond(info, error);
+
+	nlbuffer_clean(&buffer);
+	return error;
+}
+
 static int handle_pool4_add(struct pool4 *pool, struct genl_info *info,
 		union request_pool4 *request)
 {
@@ -116,6 +180,8 @@ int handle_pool4_config(struct xlator *jool, struct genl_info *info)
 	switch (be16_to_cpu(hdr->operation)) {
 	case OP_DISPLAY:
 		return handle_pool4_display(jool->nat64.pool4, info, request);
+	case OP_COUNT:
+		return handle_pool4_usage(jool, info, request);
 	case OP_ADD:
 		return handle_pool4_add(jool->nat64.pool4, info, request);
 	case OP_UPDATE:
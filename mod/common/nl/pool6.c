@@ -131,5 +131,6 @@ int handle_pool6_config(struct xlator *jool, struct genl_info *info)
 		error = -EINVAL;
 	}
 
+	xlator_refresh_clat(jool);
 	return nlcore_respond(info, error);
 }
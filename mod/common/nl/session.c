@@ -2,6 +2,7 @@
 
 #include "nat64/mod/common/nl/nl_common.h"
 #include "nat64/mod/common/nl/nl_core2.h"
+#include "nat64/mod/stateful/joold.h"
 #include "nat64/mod/stateful/bib/db.h"
 
 static int session_entry_to_userspace(struct session_entry *entry, void *arg)
@@ -15,6 +16,7 @@ static int session_entry_to_userspace(struct session_entry *entry, void *arg)
 	entry_usr.src4 = entry->src4;
 	entry_usr.dst4 = entry->dst4;
 	entry_usr.state = entry->state;
+	entry_usr.counters = entry->counters;
 
 	dying_time = entry->update_time + entry->timeout;
 	entry_usr.dying_time = (dying_time > jiffies)
@@ -24,6 +26,15 @@ static int session_entry_to_userspace(struct session_entry *entry, void *arg)
 	return nlbuffer_write(buffer, &entry_usr, sizeof(entry_usr));
 }
 
+static int session_entry_to_export(struct session_entry *entry, void *arg)
+{
+	struct nlcore_buffer *buffer = (struct nlcore_buffer *) arg;
+	struct joold_session record;
+
+	joold_export(entry, &record);
+	return nlbuffer_write(buffer, &record, sizeof(record));
+}
+
 static int handle_session_display(struct bib *db, struct genl_info *info,
 		struct request_session *request)
 {
@@ -51,7 +62,8 @@ static int handle_session_display(struct bib *db, struct genl_info *info,
 		offset = &offset_struct;
 	}
 
-	error = bib_foreach_session(db, request->l4_proto, &func, offset);
+	error = bib_foreach_session(db, request->l4_proto, &func, offset,
+			&request->display.filter);
 	nlbuffer_set_pending_data(&buffer, error > 0);
 	error = (error >= 0)
 			? nlbuffer_send(info, &buffer)
@@ -61,21 +73,174 @@ static int handle_session_display(struct bib *db, struct genl_info *info,
 	return error;
 }
 
+/*
+ * The dump's cursor (the last session sent so far) lives in @cb->args[1]
+ * through @cb->args[4].
+ */
+static void save_session_cursor(struct netlink_callback *cb,
+		struct in_addr src4_addr, __u16 src4_port,
+		struct in_addr dst4_addr, __u16 dst4_port)
+{
+	cb->args[1] = (__force u32)src4_addr.s_addr;
+	cb->args[2] = src4_port;
+	cb->args[3] = (__force u32)dst4_addr.s_addr;
+	cb->args[4] = dst4_port;
+}
+
+/**
+ * Remembers the last record of @buffer (which is a struct joold_session if
+ * @export, and a struct session_entry_usr otherwise) as the dump's cursor.
+ */
+static void save_last_session(struct netlink_callback *cb,
+		struct nlcore_buffer *buffer, bool export)
+{
+	struct session_entry_usr *usr;
+	struct joold_session *record;
+
+	if (export) {
+		record = buffer->data + buffer->len - sizeof(*record);
+		save_session_cursor(cb, record->src4_addr,
+				be16_to_cpu(record->src4_port),
+				record->dst4_addr,
+				be16_to_cpu(record->dst4_port));
+	} else {
+		usr = buffer->data + buffer->len - sizeof(*usr);
+		save_session_cursor(cb, usr->src4.l3, usr->src4.l4,
+				usr->dst4.l3, usr->dst4.l4);
+	}
+}
+
+static void load_session_cursor(struct netlink_callback *cb,
+		struct taddr4_tuple *cursor)
+{
+	cursor->src.l3.s_addr = (__force __be32)(u32)cb->args[1];
+	cursor->src.l4 = cb->args[2];
+	cursor->dst.l3.s_addr = (__force __be32)(u32)cb->args[3];
+	cursor->dst.l4 = cb->args[4];
+}
+
+/**
+ * Streams the session table to userspace, one full skb per call.
+ * Unlike handle_session_display(), userspace only needs to send one request.
+ *
+ * If @request->display.export, the records are struct joold_sessions, which
+ * handle_session_import() can take back.
+ */
+static int handle_session_dump_display(struct bib *db, struct sk_buff *skb,
+		struct netlink_callback *cb, struct request_hdr *hdr,
+		struct request_session *request)
+{
+	struct nlcore_buffer buffer;
+	struct session_foreach_func func = {
+			.cb = session_entry_to_userspace,
+			.arg = &buffer,
+	};
+	struct session_foreach_offset offset_struct;
+	struct session_foreach_offset *offset = NULL;
+	int error;
+
+	if (verify_superpriv())
+		return nlcore_dump_error(skb, cb, hdr, -EPERM);
+
+	error = nlbuffer_init_dump(&buffer, skb, hdr);
+	if (error)
+		return nlcore_dump_error(skb, cb, hdr, error);
+
+	if (request->display.export)
+		func.cb = session_entry_to_export;
+
+	if (cb->args[0] == NLDUMP_CONTINUE) {
+		load_session_cursor(cb, &offset_struct.offset);
+		offset_struct.include_offset = false;
+		offset = &offset_struct;
+	} else {
+		log_debug("Dumping the session table to userspace.");
+		if (request->display.offset_set) {
+			offset_struct.offset = request->display.offset;
+			offset_struct.include_offset = false;
+			offset = &offset_struct;
+		}
+	}
+
+	error = bib_foreach_session(db, request->l4_proto, &func, offset,
+			&request->display.filter);
+	if (error < 0) {
+		nlbuffer_clean(&buffer);
+		return nlcore_dump_error(skb, cb, hdr, error);
+	}
+
+	if (buffer.len > sizeof(struct response_hdr))
+		save_last_session(cb, &buffer, request->display.export);
+	cb->args[0] = (error > 0) ? NLDUMP_CONTINUE : NLDUMP_DONE;
+	nlbuffer_set_pending_data(&buffer, error > 0);
+
+	error = nlbuffer_dump(skb, cb, &buffer);
+	nlbuffer_clean(&buffer);
+	return error ? : skb->len;
+}
+
 static int handle_session_count(struct bib *db, struct genl_info *info,
 		struct request_session *request)
 {
+	struct session_count_usr count;
 	int error;
-	__u64 count;
 
 	log_debug("Returning session count.");
 
-	error = bib_count_sessions(db, request->l4_proto, &count);
+	error = bib_count_sessions(db, request->l4_proto, &count.count);
+	if (error)
+		return nlcore_respond(info, error);
+	error = bib_count_evicted(db, request->l4_proto, &count.evicted);
 	if (error)
 		return nlcore_respond(info, error);
 
 	return nlcore_respond_struct(info, &count, sizeof(count));
 }
 
+static int handle_session_follow(struct bib *db, struct genl_info *info,
+		struct request_session *request)
+{
+	struct nlcore_buffer buffer;
+	int error;
+
+	if (verify_superpriv())
+		return nlcore_respond(info, -EPERM);
+
+	log_debug("Sending the changes since %llu.", request->follow.since);
+
+	error = nlbuffer_init_response(&buffer, info, nlbuffer_response_max_size());
+	if (error)
+		return nlcore_respond(info, error);
+
+	error = bib_follow(db, request->follow.since, &buffer);
+	nlbuffer_set_pending_data(&buffer, error > 0);
+	error = (error >= 0)
+			? nlbuffer_send(info, &buffer)
+			: nlcore_respond(info, error);
+
+	nlbuffer_clean(&buffer);
+	return error;
+}
+
+/**
+ * Adds the struct joold_sessions that follow @request. (These are the records
+ * of a `--session --export`.)
+ */
+static int handle_session_import(struct xlator *jool, struct genl_info *info,
+		struct request_session *request)
+{
+	size_t len;
+
+	if (verify_superpriv())
+		return nlcore_respond(info, -EPERM);
+
+	len = nla_len(info->attrs[ATTR_DATA]) - sizeof(struct request_hdr)
+			- sizeof(*request);
+	log_debug("Importing %zu sessions.", len / sizeof(struct joold_session));
+
+	return nlcore_respond(info, joold_import(jool, request + 1, len));
+}
+
 int handle_session_config(struct xlator *jool, struct genl_info *info)
 {
 	struct request_hdr *hdr;
@@ -99,8 +264,40 @@ int handle_session_config(struct xlator *jool, struct genl_info *info)
 		return handle_session_display(jool->nat64.bib, info, request);
 	case OP_COUNT:
 		return handle_session_count(jool->nat64.bib, info, request);
+	case OP_FOLLOW:
+		return handle_session_follow(jool->nat64.bib, info, request);
+	case OP_ADD:
+		return handle_session_import(jool, info, request);
 	}
 
 	log_err("Unknown operation: %u", be16_to_cpu(hdr->operation));
 	return nlcore_respond(info, -EINVAL);
 }
+
+int handle_session_dump(struct xlator *jool, struct sk_buff *skb,
+		struct netlink_callback *cb)
+{
+	struct request_hdr *hdr = get_dump_hdr(cb);
+	struct request_session *request = (struct request_session *)(hdr + 1);
+	int error;
+
+	if (cb->args[0] == NLDUMP_DONE)
+		return 0;
+
+	if (xlat_is_siit()) {
+		log_err("SIIT doesn't have session tables.");
+		return nlcore_dump_error(skb, cb, hdr, -EINVAL);
+	}
+
+	error = validate_dump_size(cb, sizeof(*request));
+	if (error)
+		return nlcore_dump_error(skb, cb, hdr, error);
+
+	if (be16_to_cpu(hdr->operation) != OP_DISPLAY) {
+		log_err("Only session displays can be dumped.");
+		return nlcore_dump_error(skb, cb, hdr, -EINVAL);
+	}
+
+	return handle_session_dump_display(jool->nat64.bib, skb, cb, hdr,
+			request);
+}
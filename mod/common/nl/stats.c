@@ -0,0 +1,38 @@
+#include "nat64/mod/common/nl/stats.h"
+
+#include "nat64/mod/common/stats_page.h"
+#include "nat64/mod/common/wkmalloc.h"
+#include "nat64/mod/common/nl/nl_common.h"
+#include "nat64/mod/common/nl/nl_core2.h"
+
+static int handle_stats_display(struct xlator *jool, struct genl_info *info)
+{
+	struct jool_stats_usr *result;
+	int error;
+
+	log_debug("Returning the counters.");
+
+	/* Too big for the stack, what with the histograms. */
+	result = wkmalloc(struct jool_stats_usr, GFP_KERNEL);
+	if (!result)
+		return nlcore_respond(info, -ENOMEM);
+
+	jstat_snapshot(jool, result);
+	error = nlcore_respond_struct(info, result, sizeof(*result));
+
+	wkfree(struct jool_stats_usr, result);
+	return error;
+}
+
+int handle_stats_request(struct xlator *jool, struct genl_info *info)
+{
+	struct request_hdr *hdr = get_jool_hdr(info);
+
+	switch (be16_to_cpu(hdr->operation)) {
+	case OP_DISPLAY:
+		return handle_stats_display(jool, info);
+	}
+
+	log_err("Unknown operation: %u", be16_to_cpu(hdr->operation));
+	return nlcore_respond(info, -EINVAL);
+}
@@ -2,12 +2,14 @@
 
 #include <linux/version.h>
 #include <linux/icmp.h>
+#include <linux/percpu.h>
 #include <net/route.h>
 #include "nat64/common/types.h"
 #include "nat64/common/constants.h"
 #include "nat64/common/str_utils.h"
 #include "nat64/mod/common/config.h"
 #include "nat64/mod/common/icmp_wrapper.h"
+#include "nat64/mod/common/ipv6_hdr_iterator.h"
 #include "nat64/mod/common/stats.h"
 
 /*
@@ -28,6 +30,13 @@ struct pkt_metadata {
 	unsigned int l4_offset;
 	/* Offset is from skb->data. */
 	unsigned int payload_offset;
+	/* Next Header value of the last header. */
+	u8 nexthdr;
+	/* Offset is from skb->data. Zero if there is no routing header. */
+	unsigned int rt_offset;
+	/* The inner packet's nexthdr and IPv6 headers length, if any. */
+	u8 inner_nexthdr;
+	unsigned int inner_l3hdr_len;
 };
 
 #define skb_hdr_ptr(skb, offset, buffer) skb_header_pointer(skb, offset, sizeof(buffer), &buffer)
@@ -137,6 +146,109 @@ static int paranoid_validations(struct sk_buff *skb, size_t basic_hdr_size)
 	return 0;
 }
 
+/**
+ * Returns true if @skb is the kind of packet that can skip the careful path
+ * of pkt_init_ipv4() and pkt_init_ipv6(): linear, unshared, and containing at
+ * least @l3hdr_len bytes past its network header.
+ *
+ * Linear means everything is in the head already, so there is nothing to pull
+ * and the headers can be read in place.
+ */
+static bool is_fast_skb(struct sk_buff *skb, unsigned int l3hdr_len)
+{
+	return !skb_is_nonlinear(skb)
+			&& !skb_shared(skb)
+			&& skb_network_offset(skb) >= 0
+			&& skb_network_offset(skb) + l3hdr_len <= skb->len;
+}
+
+/**
+ * Fills @meta for an @is_fast_skb() packet whose layer-4 header (of protocol
+ * @proto) starts right after its layer-3 header, at @l4_offset.
+ *
+ * Only TCP and UDP are handled; returns false if @skb needs the careful path.
+ */
+static bool summarize_fast(struct sk_buff *skb, unsigned int l4_offset,
+		u8 proto, struct pkt_metadata *meta)
+{
+	switch (proto) {
+	case IPPROTO_TCP:
+		if (l4_offset + sizeof(struct tcphdr) > skb->len)
+			return false;
+		meta->l4_proto = L4PROTO_TCP;
+		meta->payload_offset = l4_offset
+				+ tcp_hdr_len(offset_to_ptr(skb, l4_offset));
+		break;
+	case IPPROTO_UDP:
+		meta->l4_proto = L4PROTO_UDP;
+		meta->payload_offset = l4_offset + sizeof(struct udphdr);
+		break;
+	default:
+		return false;
+	}
+
+	if (meta->payload_offset > skb->len)
+		return false;
+
+	meta->has_frag_hdr = false;
+	meta->l4_offset = l4_offset;
+	meta->nexthdr = proto;
+	meta->rt_offset = 0;
+	meta->inner_nexthdr = 0;
+	meta->inner_l3hdr_len = 0;
+	return true;
+}
+
+/**
+ * The shortcut for unfragmented TCP and UDP over IPv6. Hop-by-Hop, Routing
+ * and Destination Options headers are skipped in place, in a single pass.
+ * Returns false if @skb needs the careful path.
+ */
+static bool summarize_fast6(struct sk_buff *skb, struct pkt_metadata *meta)
+{
+	struct ipv6hdr *hdr6;
+	struct hdr6_chain chain;
+
+	if (!is_fast_skb(skb, sizeof(struct ipv6hdr)))
+		return false;
+	if (skb->len != get_tot_len_ipv6(skb))
+		return false;
+
+	hdr6 = ipv6_hdr(skb);
+	/* Most packets; don't bother walking. */
+	if (hdr6_classify(hdr6->nexthdr) == HDR6_LAST)
+		return summarize_fast(skb, skb_network_offset(skb)
+				+ sizeof(*hdr6), hdr6->nexthdr, meta);
+
+	if (hdr6_walk(hdr6, skb_tail_pointer(skb), &chain) || chain.frag)
+		return false;
+	if (!summarize_fast(skb, chain.l4 - (void *)skb->data, chain.nexthdr,
+			meta))
+		return false;
+
+	if (chain.routing)
+		meta->rt_offset = chain.routing - (void *)skb->data;
+	return true;
+}
+
+/**
+ * The shortcut for unfragmented TCP and UDP over IPv4 with no options.
+ * Returns false if @skb needs the careful path.
+ */
+static bool summarize_fast4(struct sk_buff *skb, struct pkt_metadata *meta)
+{
+	struct iphdr *hdr4;
+
+	if (!is_fast_skb(skb, sizeof(struct iphdr)))
+		return false;
+	hdr4 = ip_hdr(skb);
+	if (hdr4->ihl != 5 || is_fragmented_ipv4(hdr4))
+		return false;
+
+	return summarize_fast(skb, skb_network_offset(skb) + sizeof(*hdr4),
+			hdr4->protocol, meta);
+}
+
 /**
  * Walks through @skb's headers, collecting data and adding it to @meta.
  *
@@ -169,10 +281,12 @@ static int summarize_skb6(struct sk_buff *skb, unsigned int hdr6_offset, struct
 	offset = hdr6_offset + sizeof(struct ipv6hdr);
 
 	meta->has_frag_hdr = false;
+	meta->rt_offset = 0;
 
 	do {
 		switch (nexthdr) {
 		case NEXTHDR_TCP:
+			meta->nexthdr = nexthdr;
 			meta->l4_proto = L4PROTO_TCP;
 			meta->l4_offset = offset;
 			meta->payload_offset = offset;
@@ -187,12 +301,14 @@ static int summarize_skb6(struct sk_buff *skb, unsigned int hdr6_offset, struct
 			return 0;
 
 		case NEXTHDR_UDP:
+			meta->nexthdr = nexthdr;
 			meta->l4_proto = L4PROTO_UDP;
 			meta->l4_offset = offset;
 			meta->payload_offset = is_first ? (offset + sizeof(struct udphdr)) : offset;
 			return 0;
 
 		case NEXTHDR_ICMP:
+			meta->nexthdr = nexthdr;
 			meta->l4_proto = L4PROTO_ICMP;
 			meta->l4_offset = offset;
 			meta->payload_offset = is_first ? (offset + sizeof(struct icmp6hdr)) : offset;
@@ -217,12 +333,15 @@ static int summarize_skb6(struct sk_buff *skb, unsigned int hdr6_offset, struct
 			ptr.opt = skb_hdr_ptr(skb, offset, buffer.opt);
 			if (!ptr.opt)
 				return truncated6(skb, "extension header");
+			if (nexthdr == NEXTHDR_ROUTING && !meta->rt_offset)
+				meta->rt_offset = offset;
 
 			offset += ipv6_optlen(ptr.opt);
 			nexthdr = ptr.opt->nexthdr;
 			break;
 
 		default:
+			meta->nexthdr = nexthdr;
 			meta->l4_proto = L4PROTO_OTHER;
 			meta->l4_offset = offset;
 			meta->payload_offset = offset;
@@ -233,8 +352,7 @@ static int summarize_skb6(struct sk_buff *skb, unsigned int hdr6_offset, struct
 	return 0; /* whatever. */
 }
 
-static int validate_inner6(struct sk_buff *skb,
-		struct pkt_metadata const *outer_meta)
+static int validate_inner6(struct sk_buff *skb, struct pkt_metadata *outer_meta)
 {
 	union {
 		struct ipv6hdr ip6;
@@ -281,10 +399,12 @@ static int validate_inner6(struct sk_buff *skb,
 		return -EINVAL;
 	}
 
+	outer_meta->inner_nexthdr = meta.nexthdr;
+	outer_meta->inner_l3hdr_len = meta.l4_offset - outer_meta->payload_offset;
 	return 0;
 }
 
-static int handle_icmp6(struct sk_buff *skb, struct pkt_metadata const *meta)
+static int handle_icmp6(struct sk_buff *skb, struct pkt_metadata *meta)
 {
 	union {
 		struct icmp6hdr icmp;
@@ -336,6 +456,13 @@ int pkt_init_ipv6(struct packet *pkt, struct sk_buff *skb)
 
 	log_debug("===============================================");
 
+	if (likely(summarize_fast6(skb, &meta))) {
+		log_debug("Catching IPv6 packet: %pI6c->%pI6c",
+				&ipv6_hdr(skb)->saddr,
+				&ipv6_hdr(skb)->daddr);
+		goto fill;
+	}
+
 	error = paranoid_validations(skb, sizeof(struct ipv6hdr));
 	if (error)
 		return error;
@@ -350,6 +477,8 @@ int pkt_init_ipv6(struct packet *pkt, struct sk_buff *skb)
 	error = summarize_skb6(skb, skb_network_offset(skb), &meta);
 	if (error)
 		return error;
+	meta.inner_nexthdr = 0;
+	meta.inner_l3hdr_len = 0;
 
 	if (meta.l4_proto == L4PROTO_ICMP) {
 		/* Do not move this to summarize_skb6(), because it risks infinite recursion. */
@@ -363,6 +492,7 @@ int pkt_init_ipv6(struct packet *pkt, struct sk_buff *skb)
 		return -EINVAL;
 	}
 
+fill:
 	pkt->skb = skb;
 	pkt->l3_proto = L3PROTO_IPV6;
 	pkt->l4_proto = meta.l4_proto;
@@ -372,6 +502,12 @@ int pkt_init_ipv6(struct packet *pkt, struct sk_buff *skb)
 	skb_set_transport_header(skb, meta.l4_offset);
 	pkt->payload = offset_to_ptr(skb, meta.payload_offset);
 	pkt->original_pkt = pkt;
+	pkt->ext6.nexthdr = meta.nexthdr;
+	pkt->ext6.rt_offset = meta.rt_offset
+			? (meta.rt_offset - skb_network_offset(skb))
+			: 0;
+	pkt->ext6.inner_nexthdr = meta.inner_nexthdr;
+	pkt->ext6.inner_l3hdr_len = meta.inner_l3hdr_len;
 
 	return 0;
 }
@@ -506,6 +642,13 @@ int pkt_init_ipv4(struct packet *pkt, struct sk_buff *skb)
 
 	log_debug("===============================================");
 
+	if (likely(summarize_fast4(skb, &meta))) {
+		log_debug("Catching IPv4 packet: %pI4->%pI4",
+				&ip_hdr(skb)->saddr,
+				&ip_hdr(skb)->daddr);
+		goto fill;
+	}
+
 	error = paranoid_validations(skb, sizeof(struct iphdr));
 	if (error)
 		return error;
@@ -523,6 +666,7 @@ int pkt_init_ipv4(struct packet *pkt, struct sk_buff *skb)
 		return -EINVAL;
 	}
 
+fill:
 	pkt->skb = skb;
 	pkt->l3_proto = L3PROTO_IPV4;
 	pkt->l4_proto = meta.l4_proto;
@@ -571,9 +715,11 @@ unsigned char *jskb_push(struct sk_buff *skb, unsigned int len)
 	return result;
 }
 
+static DEFINE_PER_CPU(struct pkt_debug, pkt_debug);
+
 #define SIMPLE_MIN(a, b) ((a < b) ? a : b)
 
-void snapshot_record(struct pkt_snapshot *shot, struct sk_buff *skb)
+static void snapshot_record(struct pkt_snapshot *shot, struct sk_buff *skb)
 {
 	struct skb_shared_info *shinfo = skb_shinfo(skb);
 	unsigned int limit;
@@ -619,7 +765,7 @@ void snapshot_record(struct pkt_snapshot *shot, struct sk_buff *skb)
 	}
 }
 
-void snapshot_report(struct pkt_snapshot *shot, char *prefix)
+static void snapshot_report(struct pkt_snapshot *shot, char *prefix)
 {
 	unsigned int limit;
 	unsigned int i;
@@ -632,3 +778,27 @@ void snapshot_report(struct pkt_snapshot *shot, char *prefix)
 	for (i = 0; i < limit; i++)
 		pr_err("    %s frag %u: %u\n", prefix, i, shot->frags[i]);
 }
+
+/**
+ * Forgets the previous packet's snapshots and takes @skb's first one.
+ */
+void pkt_debug_start(struct sk_buff *skb)
+{
+	struct pkt_debug *debug = this_cpu_ptr(&pkt_debug);
+
+	snapshot_record(&debug->shot1, skb);
+	memset(&debug->shot2, 0, sizeof(debug->shot2));
+}
+
+void pkt_debug_mid(struct sk_buff *skb)
+{
+	snapshot_record(&this_cpu_ptr(&pkt_debug)->shot2, skb);
+}
+
+void pkt_debug_report(void)
+{
+	struct pkt_debug *debug = this_cpu_ptr(&pkt_debug);
+
+	snapshot_report(&debug->shot1, "initial");
+	snapshot_report(&debug->shot2, "mid");
+}
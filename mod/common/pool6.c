@@ -174,6 +174,10 @@ int pool6_flush(struct pool6 *pool)
  * pool6_find - Returns (in @result) @pool's prefix corresponding to @addr.
  *
  * You're not actually borrowing the prefix, so you don't have to return it.
+ *
+ * The walk is not a problem, because pool6_add() never lets the pool hold more
+ * than one prefix. If that ever changes, index the prefixes in an rtrie (see
+ * eam.c) instead of walking them.
  */
 RCUTAG_PKT
 int pool6_find(struct pool6 *pool, const struct in6_addr *addr,
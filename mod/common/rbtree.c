@@ -1,5 +1,6 @@
 #include "nat64/mod/common/rbtree.h"
 #include <linux/module.h>
+#include <linux/rcupdate.h>
 
 void treeslot_init(struct tree_slot *slot,
 		struct rb_root *root,
@@ -17,6 +18,20 @@ void treeslot_commit(struct tree_slot *slot)
 	rb_insert_color(slot->entry, slot->tree);
 }
 
+void treeslot_commit_rcu(struct tree_slot *slot)
+{
+	struct rb_node *dummy;
+
+	/*
+	 * This is rb_link_node_rcu(), which is not available in old kernels.
+	 * Initialize the node first, publish it later.
+	 */
+	rb_link_node(slot->entry, slot->parent, &dummy);
+	rcu_assign_pointer(*slot->rb_link, slot->entry);
+
+	rb_insert_color(slot->entry, slot->tree);
+}
+
 /*
  * Safe postorder traversal.
  *
@@ -5,124 +5,111 @@
 #include "nat64/common/types.h"
 #include "nat64/mod/common/pool6.h"
 
-union ipv4_address {
-	__be32 as32;
-	__u8 as8[4];
-};
+/*
+ * RFC 6052 only allows six prefix lengths, and the only thing that makes them
+ * awkward is bits 64-71 (the "u" octet), which the embedded IPv4 address has to
+ * jump over. So instead of moving the address byte by byte, these functions
+ * view the relevant piece of the IPv6 address as a 64-bit integer:
+ *
+ * - /32 and /96 are a single 32-bit copy.
+ * - /64 is a shift of bytes 8-15 (the u octet is the top byte).
+ * - /40, /48 and /56 share bytes 4-11. Squeezing the u octet out of them leaves
+ *   a 56-bit integer, in which the IPv4 address lies (56 - len) bits away from
+ *   the bottom.
+ */
+
+static u64 load64(const struct in6_addr *addr, unsigned int word)
+{
+	return ((u64)be32_to_cpu(addr->s6_addr32[word]) << 32)
+			| be32_to_cpu(addr->s6_addr32[word + 1]);
+}
+
+static void store64(struct in6_addr *addr, unsigned int word, u64 value)
+{
+	addr->s6_addr32[word] = cpu_to_be32(value >> 32);
+	addr->s6_addr32[word + 1] = cpu_to_be32(value);
+}
+
+/** Removes the u octet (bits 24-31) from @value. */
+static u64 squeeze_u(u64 value)
+{
+	return ((value >> 8) & 0xFFFFFFFF000000ULL) | (value & 0xFFFFFFULL);
+}
+
+/** Inverse of squeeze_u(); the u octet ends up zero. */
+static u64 stretch_u(u64 value)
+{
+	return ((value & 0xFFFFFFFF000000ULL) << 8) | (value & 0xFFFFFFULL);
+}
 
 int addr_6to4(const struct in6_addr *src, struct ipv6_prefix *prefix,
 		struct in_addr *dst)
 {
-	union ipv4_address dst_aux;
-
 	switch (prefix->len) {
 	case 32:
-		dst_aux.as32 = src->s6_addr32[1];
-		break;
+		dst->s_addr = src->s6_addr32[1];
+		return 0;
 	case 40:
-		dst_aux.as8[0] = src->s6_addr[5];
-		dst_aux.as8[1] = src->s6_addr[6];
-		dst_aux.as8[2] = src->s6_addr[7];
-		dst_aux.as8[3] = src->s6_addr[9];
-		break;
 	case 48:
-		dst_aux.as8[0] = src->s6_addr[6];
-		dst_aux.as8[1] = src->s6_addr[7];
-		dst_aux.as8[2] = src->s6_addr[9];
-		dst_aux.as8[3] = src->s6_addr[10];
-		break;
 	case 56:
-		dst_aux.as8[0] = src->s6_addr[7];
-		dst_aux.as8[1] = src->s6_addr[9];
-		dst_aux.as8[2] = src->s6_addr[10];
-		dst_aux.as8[3] = src->s6_addr[11];
-		break;
+		dst->s_addr = cpu_to_be32(squeeze_u(load64(src, 1))
+				>> (56 - prefix->len));
+		return 0;
 	case 64:
-		dst_aux.as8[0] = src->s6_addr[9];
-		dst_aux.as8[1] = src->s6_addr[10];
-		dst_aux.as8[2] = src->s6_addr[11];
-		dst_aux.as8[3] = src->s6_addr[12];
-		break;
+		dst->s_addr = cpu_to_be32(load64(src, 2) >> 24);
+		return 0;
 	case 96:
-		dst_aux.as32 = src->s6_addr32[3];
-		break;
-	default:
-		/*
-		 * Critical because enforcing valid prefixes is pool6's
-		 * responsibility, not ours.
-		 */
-		WARN(true, "Prefix has an invalid length: %u.", prefix->len);
-		return -EINVAL;
+		dst->s_addr = src->s6_addr32[3];
+		return 0;
 	}
 
-	dst->s_addr = dst_aux.as32;
-	return 0;
+	/*
+	 * Critical because enforcing valid prefixes is pool6's
+	 * responsibility, not ours.
+	 */
+	WARN(true, "Prefix has an invalid length: %u.", prefix->len);
+	return -EINVAL;
 }
 
 int addr_4to6(struct in_addr *src, struct ipv6_prefix *prefix,
 		struct in6_addr *dst)
 {
-	union ipv4_address src_aux;
-
-	src_aux.as32 = src->s_addr;
-	memset(dst, 0, sizeof(*dst));
+	u64 addr4 = be32_to_cpu(src->s_addr);
+	u64 mask;
 
 	switch (prefix->len) {
 	case 32:
 		dst->s6_addr32[0] = prefix->address.s6_addr32[0];
-		dst->s6_addr32[1] = src_aux.as32;
-		break;
+		dst->s6_addr32[1] = src->s_addr;
+		dst->s6_addr32[2] = 0;
+		dst->s6_addr32[3] = 0;
+		return 0;
 	case 40:
-		dst->s6_addr32[0] = prefix->address.s6_addr32[0];
-		dst->s6_addr[4] = prefix->address.s6_addr[4];
-		dst->s6_addr[5] = src_aux.as8[0];
-		dst->s6_addr[6] = src_aux.as8[1];
-		dst->s6_addr[7] = src_aux.as8[2];
-		dst->s6_addr[9] = src_aux.as8[3];
-		break;
 	case 48:
-		dst->s6_addr32[0] = prefix->address.s6_addr32[0];
-		dst->s6_addr[4] = prefix->address.s6_addr[4];
-		dst->s6_addr[5] = prefix->address.s6_addr[5];
-		dst->s6_addr[6] = src_aux.as8[0];
-		dst->s6_addr[7] = src_aux.as8[1];
-		dst->s6_addr[9] = src_aux.as8[2];
-		dst->s6_addr[10] = src_aux.as8[3];
-		break;
 	case 56:
+		/* The prefix's bits within bytes 4-11. */
+		mask = ~0ULL << (96 - prefix->len);
 		dst->s6_addr32[0] = prefix->address.s6_addr32[0];
-		dst->s6_addr[4] = prefix->address.s6_addr[4];
-		dst->s6_addr[5] = prefix->address.s6_addr[5];
-		dst->s6_addr[6] = prefix->address.s6_addr[6];
-		dst->s6_addr[7] = src_aux.as8[0];
-		dst->s6_addr[9] = src_aux.as8[1];
-		dst->s6_addr[10] = src_aux.as8[2];
-		dst->s6_addr[11] = src_aux.as8[3];
-		break;
+		store64(dst, 1, (load64(&prefix->address, 1) & mask)
+				| stretch_u(addr4 << (56 - prefix->len)));
+		dst->s6_addr32[3] = 0;
+		return 0;
 	case 64:
 		dst->s6_addr32[0] = prefix->address.s6_addr32[0];
 		dst->s6_addr32[1] = prefix->address.s6_addr32[1];
-		dst->s6_addr[9] = src_aux.as8[0];
-		dst->s6_addr[10] = src_aux.as8[1];
-		dst->s6_addr[11] = src_aux.as8[2];
-		dst->s6_addr[12] = src_aux.as8[3];
-		break;
+		store64(dst, 2, addr4 << 24);
+		return 0;
 	case 96:
 		dst->s6_addr32[0] = prefix->address.s6_addr32[0];
 		dst->s6_addr32[1] = prefix->address.s6_addr32[1];
 		dst->s6_addr32[2] = prefix->address.s6_addr32[2];
-		dst->s6_addr32[3] = src_aux.as32;
-		break;
-	default:
-		/*
-		 * Critical because enforcing valid prefixes is pool6's
-		 * responsibility, not ours.
-		 */
-		WARN(true, "Prefix has an invalid length: %u.", prefix->len);
-		return -EINVAL;
+		dst->s6_addr32[3] = src->s_addr;
+		return 0;
 	}
 
-	return 0;
+	/* See addr_6to4(). */
+	WARN(true, "Prefix has an invalid length: %u.", prefix->len);
+	return -EINVAL;
 }
 
 int rfc6052_6to4(struct pool6 *pool, const struct in6_addr *addr6,
@@ -8,6 +8,7 @@
 #include "nat64/mod/common/pool6.h"
 #include "nat64/mod/common/rfc6052.h"
 #include "nat64/mod/common/route.h"
+#include "nat64/mod/common/skb_pool.h"
 #include "nat64/mod/common/stats.h"
 #include "nat64/mod/stateless/blacklist4.h"
 #include "nat64/mod/stateless/eam.h"
@@ -19,9 +20,12 @@ verdict ttp46_alloc_skb(struct xlation *state)
 	size_t l3_hdr_len;
 	size_t total_len;
 	size_t reserve = LL_MAX_HEADER;
+	unsigned int shared_len;
 	struct sk_buff *skb;
 	struct frag_hdr *hdr_frag = NULL;
 
+	state->in_place = ttpcomm_can_xlat_in_place(state);
+
 	/*
 	 * These are my assumptions to compute total_len:
 	 *
@@ -58,7 +62,14 @@ verdict ttp46_alloc_skb(struct xlation *state)
 			total_len = IPV6_MIN_MTU;
 	}
 
-	skb = alloc_skb(reserve + total_len, GFP_ATOMIC);
+	/* The payload stays in @in. */
+	if (state->in_place)
+		total_len = l3_hdr_len + pkt_l4hdr_len(in);
+	/* The paged area is not copied, so don't reserve room for it. */
+	shared_len = ttpcomm_shared_len(state);
+	total_len -= shared_len;
+
+	skb = skbpool_alloc(reserve + total_len);
 	if (!skb) {
 		inc_stats(in, IPSTATS_MIB_INDISCARDS);
 		return VERDICT_DROP;
@@ -76,6 +87,8 @@ verdict ttp46_alloc_skb(struct xlation *state)
 	pkt_fill(&state->out, skb, L3PROTO_IPV6, pkt_l4_proto(in),
 			hdr_frag, skb_transport_header(skb) + pkt_l4hdr_len(in),
 			pkt_original_pkt(in));
+	if (shared_len)
+		ttpcomm_share_payload(state, skb);
 
 	skb->mark = in->skb->mark;
 	skb->protocol = htons(ETH_P_IPV6);
@@ -83,10 +96,12 @@ verdict ttp46_alloc_skb(struct xlation *state)
 	return VERDICT_CONTINUE;
 }
 
-static __be16 build_payload_len(struct packet *in, struct packet *out)
+static __be16 build_payload_len(struct xlation *state)
 {
 	/* See build_tot_len() for relevant comments. */
 
+	struct packet *in = &state->in;
+	struct packet *out = &state->out;
 	__u16 total_len;
 
 	if (pkt_is_inner(out)) { /* Internal packets */
@@ -97,7 +112,7 @@ static __be16 build_payload_len(struct packet *in, struct packet *out)
 		total_len = in->skb->len - pkt_hdrs_len(in) + pkt_hdrs_len(out);
 
 	} else { /* Real full packets and fragmented packets */
-		total_len = out->skb->len;
+		total_len = ttpcomm_out_len(state);
 		/*
 		 * Though ICMPv4 errors are supposed to be max 576 bytes long,
 		 * a good portion of the Internet seems prepared against bigger
@@ -151,7 +166,8 @@ static addrxlat_verdict generate_addr6_siit(struct xlation *state,
 	}
 
 	if (enable_eam) {
-		error = eamt_xlat_4to6(state->jool.siit.eamt, &tmp, addr6);
+		error = eamt_xlat_4to6(state->jool.siit.eamt, &tmp, addr6,
+				pkt_len(&state->in));
 		if (!error)
 			return ADDRXLAT_CONTINUE;
 		if (error != -ESRCH)
@@ -200,29 +216,34 @@ static bool disable_dst_eam(struct packet *in, bool hairpin)
 	return hairpin && pkt_is_inner(in);
 }
 
-static verdict translate_addrs46_siit(struct xlation *state)
+/**
+ * Translates IPv4 addresses @saddr and @daddr into @saddr6 and @daddr6, the
+ * SIIT way. @state->in is only queried for its kind (inner, ICMP error or
+ * neither). @hairpin is whether the packet is being hairpinned.
+ */
+verdict ttp46_siit_addrs(struct xlation *state, bool hairpin,
+		__be32 saddr, __be32 daddr,
+		struct in6_addr *saddr6, struct in6_addr *daddr6)
 {
 	struct packet *in = &state->in;
-	struct iphdr *hdr4 = pkt_ip4_hdr(in);
-	struct ipv6hdr *hdr6 = pkt_ip6_hdr(&state->out);
-	enum eam_hairpinning_mode hairpin_mode;
-	bool hairpin;
 	addrxlat_verdict result;
 
-	hairpin_mode = state->jool.global->cfg.siit.eam_hairpin_mode;
-	hairpin = (hairpin_mode == EAM_HAIRPIN_SIMPLE)
-			|| pkt_is_intrinsic_hairpin(in);
+	if (state->jool.global->cfg.siit.clat && pkt_is_outer(in) && !hairpin
+			&& eamt_clat_4to6(state->jool.siit.eamt, saddr, daddr,
+					saddr6, daddr6, pkt_len(in)))
+		return VERDICT_CONTINUE;
 
 	/* Src address. */
-	result = generate_addr6_siit(state, hdr4->saddr, &hdr6->saddr,
+	result = generate_addr6_siit(state, saddr, saddr6,
 			!disable_src_eam(in, hairpin));
 	switch (result) {
 	case ADDRXLAT_CONTINUE:
 		break;
 	case ADDRXLAT_TRY_SOMETHING_ELSE:
 		if (pkt_is_icmp4_error(in)
-				&& !rfc6791_find_v6(state, &hdr6->saddr))
+				&& !rfc6791_find_v6(state, saddr6))
 			break; /* Ok, success. */
+		jstat_inc(state->jool.stats, JSTAT_UNTRANSLATABLE_ADDR);
 		return VERDICT_ACCEPT;
 	case ADDRXLAT_ACCEPT:
 	case ADDRXLAT_DROP:
@@ -230,22 +251,36 @@ static verdict translate_addrs46_siit(struct xlation *state)
 	}
 
 	/* Dst address. */
-	result = generate_addr6_siit(state, hdr4->daddr, &hdr6->daddr,
+	result = generate_addr6_siit(state, daddr, daddr6,
 			!disable_dst_eam(in, hairpin));
 	switch (result) {
 	case ADDRXLAT_CONTINUE:
 		break;
 	case ADDRXLAT_TRY_SOMETHING_ELSE:
+		jstat_inc(state->jool.stats, JSTAT_UNTRANSLATABLE_ADDR);
 		return VERDICT_ACCEPT;
 	case ADDRXLAT_ACCEPT:
 	case ADDRXLAT_DROP:
 		return (verdict)result;
 	}
 
-	log_debug("Result: %pI6c->%pI6c", &hdr6->saddr, &hdr6->daddr);
+	log_debug("Result: %pI6c->%pI6c", saddr6, daddr6);
 	return VERDICT_CONTINUE;
 }
 
+static verdict translate_addrs46_siit(struct xlation *state)
+{
+	struct packet *in = &state->in;
+	struct iphdr *hdr4 = pkt_ip4_hdr(in);
+	struct ipv6hdr *hdr6 = pkt_ip6_hdr(&state->out);
+	bool hairpin;
+
+	hairpin = (state->jool.global->cfg.siit.eam_hairpin_mode
+			== EAM_HAIRPIN_SIMPLE) || pkt_is_intrinsic_hairpin(in);
+	return ttp46_siit_addrs(state, hairpin, hdr4->saddr, hdr4->daddr,
+			&hdr6->saddr, &hdr6->daddr);
+}
+
 /**
  * Returns "true" if "hdr" contains a source route option and the last address
  * from it hasn't been reached.
@@ -337,13 +372,13 @@ verdict ttp46_ipv6(struct xlation *state)
 	}
 	hdr6->flow_lbl[1] = 0;
 	hdr6->flow_lbl[2] = 0;
-	hdr6->payload_len = build_payload_len(in, out);
+	hdr6->payload_len = build_payload_len(state);
 	hdr6->nexthdr = (hdr4->protocol == IPPROTO_ICMP)
 			? NEXTHDR_ICMP
 			: hdr4->protocol;
 	if (pkt_is_outer(in) && !pkt_is_intrinsic_hairpin(in)) {
 		if (hdr4->ttl <= 1) {
-			icmp64_send(in, ICMPERR_HOP_LIMIT, 0);
+			icmp64_send(state->jool.stats, in, ICMPERR_HOP_LIMIT, 0);
 			inc_stats(in, IPSTATS_MIB_INHDRERRORS);
 			return VERDICT_DROP;
 		}
@@ -360,7 +395,7 @@ verdict ttp46_ipv6(struct xlation *state)
 
 	if (pkt_is_outer(in) && has_unexpired_src_route(hdr4)) {
 		log_debug("Packet has an unexpired source route.");
-		icmp64_send(in, ICMPERR_SRC_ROUTE, 0);
+		icmp64_send(state->jool.stats, in, ICMPERR_SRC_ROUTE, 0);
 		inc_stats(in, IPSTATS_MIB_INHDRERRORS);
 		return VERDICT_DROP;
 	}
@@ -385,6 +420,30 @@ verdict ttp46_ipv6(struct xlation *state)
 	return VERDICT_CONTINUE;
 }
 
+/**
+ * Returns the largest of the first @count @plateaus that is smaller than
+ * @tot_len, or zero if there is none.
+ *
+ * The configuration code keeps the plateaus sorted in descending order and
+ * free of duplicates, so this is a binary search for the first one that fits.
+ */
+static __u16 find_plateau(__u16 *plateaus, __u16 count, __u16 tot_len)
+{
+	unsigned int left = 0;
+	unsigned int right = count;
+	unsigned int middle;
+
+	while (left < right) {
+		middle = left + (right - left) / 2;
+		if (plateaus[middle] < tot_len)
+			right = middle;
+		else
+			left = middle + 1;
+	}
+
+	return (left < count) ? plateaus[left] : 0;
+}
+
 /**
  * One liner for creating the ICMPv6 header's MTU field.
  * Returns the smallest out of the three first parameters. It also handles some
@@ -404,16 +463,9 @@ static __be32 icmp6_minimum_mtu(struct xlation *state,
 		 * Got to determine a likely path MTU.
 		 * See RFC 1191 sections 5, 7 and 7.1.
 		 */
-		__u16 *plateaus = state->jool.global->cfg.mtu_plateaus;
-		__u16 count = state->jool.global->cfg.mtu_plateau_count;
-		int i;
-
-		for (i = 0; i < count; i++) {
-			if (plateaus[i] < tot_len_field) {
-				packet_mtu = plateaus[i];
-				break;
-			}
-		}
+		packet_mtu = find_plateau(state->jool.global->cfg.mtu_plateaus,
+				state->jool.global->cfg.mtu_plateau_count,
+				tot_len_field);
 	}
 
 	/* Here's the core comparison. */
@@ -433,7 +485,12 @@ static int compute_mtu6(struct xlation *state)
 	struct icmphdr *in_icmp = pkt_icmp4_hdr(&state->in);
 	unsigned int in_mtu;
 
-	out_dst = route6(state->jool.ns, &state->out);
+	/*
+	 * Errors tend to arrive in bursts towards the same destination, so
+	 * route through the route cache. The dst stays attached to the packet
+	 * so it can be sent later.
+	 */
+	out_dst = route_hinted(state->jool.ns, &state->out, NULL);
 	if (!out_dst)
 		return -EINVAL;
 	/*
@@ -619,13 +676,27 @@ static int compute_icmp6_csum(struct packet *out)
 
 static verdict validate_icmp4_csum(struct packet *in)
 {
+	struct sk_buff *skb = in->skb;
 	__sum16 csum;
 
-	if (in->skb->ip_summed != CHECKSUM_NONE)
+	switch (skb->ip_summed) {
+	case CHECKSUM_NONE:
+		csum = csum_fold(skb_checksum(skb, skb_transport_offset(skb),
+				pkt_datagram_len(in), 0));
+		break;
+	case CHECKSUM_COMPLETE:
+		if (!ttpcomm_hw_csum_usable(in))
+			return VERDICT_CONTINUE;
+		csum = csum_fold(ttpcomm_hw_csum(in));
+		break;
+	default:
+		/*
+		 * UNNECESSARY means the NIC already validated it.
+		 * PARTIAL means it's ours, and hasn't been computed yet.
+		 */
 		return VERDICT_CONTINUE;
+	}
 
-	csum = csum_fold(skb_checksum(in->skb, skb_transport_offset(in->skb),
-			pkt_datagram_len(in), 0));
 	if (csum != 0) {
 		log_debug("Checksum doesn't match.");
 		inc_stats(in, IPSTATS_MIB_INHDRERRORS);
@@ -658,8 +729,10 @@ static verdict post_icmp6error(struct xlation *state)
 	 * so validate first.
 	 */
 	result = validate_icmp4_csum(&state->in);
-	if (result != VERDICT_CONTINUE)
+	if (result != VERDICT_CONTINUE) {
+		jstat_inc(state->jool.stats, JSTAT_BAD_CHECKSUM);
 		return result;
+	}
 
 	result = ttpcomm_translate_inner_packet(state);
 	if (result != VERDICT_CONTINUE)
@@ -740,7 +813,7 @@ verdict ttp46_icmp(struct xlation *state)
 	return error ? VERDICT_DROP : VERDICT_CONTINUE;
 }
 
-static __sum16 update_csum_4to6(__sum16 csum16,
+static __sum16 update_csum_4to6(struct csum_delta *delta, __sum16 csum16,
 		struct iphdr *in_ip4, void *in_l4_hdr,
 		struct ipv6hdr *out_ip6, void *out_l4_hdr,
 		size_t l4_hdr_len)
@@ -748,6 +821,8 @@ static __sum16 update_csum_4to6(__sum16 csum16,
 	__wsum csum, pseudohdr_csum;
 
 	/* See comments at update_csum_6to4(). */
+	if (delta->set)
+		return csum_delta_apply(delta, csum16);
 
 	csum = ~csum_unfold(csum16);
 
@@ -764,11 +839,14 @@ static __sum16 update_csum_4to6(__sum16 csum16,
 	return csum_fold(csum);
 }
 
-static __sum16 update_csum_4to6_partial(__sum16 csum16, struct iphdr *in4,
-		struct ipv6hdr *out6)
+static __sum16 update_csum_4to6_partial(struct csum_delta *delta,
+		__sum16 csum16, struct iphdr *in4, struct ipv6hdr *out6)
 {
 	__wsum csum, pseudohdr_csum;
 
+	if (delta->set)
+		return csum_delta_apply_partial(delta, csum16);
+
 	csum = csum_unfold(csum16);
 
 	pseudohdr_csum = csum_tcpudp_nofold(in4->saddr, in4->daddr, 0, 0, 0);
@@ -829,6 +907,18 @@ static int handle_zero_csum(struct xlation *state)
 	if (!can_compute_csum(state))
 		return -EINVAL;
 
+	/*
+	 * Unless the NIC already summed in's datagram for us, leave the whole
+	 * thing to the egress NIC (or to the kernel, if the NIC can't do it).
+	 * We only need to seed the pseudoheader.
+	 */
+	if (!ttpcomm_hw_csum_usable(in)) {
+		hdr_udp->check = ~csum_ipv6_magic(&hdr6->saddr, &hdr6->daddr,
+				pkt_datagram_len(in), IPPROTO_UDP, 0);
+		partialize_skb(state->out.skb, offsetof(struct udphdr, check));
+		return 0;
+	}
+
 	/*
 	 * Here's the deal:
 	 * We want to compute out's checksum. **out is a packet whose fragment
@@ -843,14 +933,14 @@ static int handle_zero_csum(struct xlation *state)
 	 * checksum:
 	 * - out's pseudoheader (this will actually be summed last).
 	 * - out's UDP header.
-	 * - in's payload.
+	 * - in's payload. (The NIC's sum, minus in's UDP header.)
 	 *
 	 * That's the reason why we needed in as an argument.
 	 */
 
 	csum = csum_partial(hdr_udp, sizeof(*hdr_udp), 0);
-	csum = skb_checksum(in->skb, pkt_payload_offset(in),
-			pkt_payload_len_pkt(in), csum);
+	csum = csum_add(csum, csum_sub(ttpcomm_hw_csum(in),
+			csum_partial(pkt_udp_hdr(in), sizeof(*hdr_udp), 0)));
 	hdr_udp->check = csum_ipv6_magic(&hdr6->saddr, &hdr6->daddr,
 			pkt_datagram_len(in), IPPROTO_UDP, csum);
 
@@ -878,16 +968,20 @@ verdict ttp46_tcp(struct xlation *state)
 		tcp_copy.check = 0;
 
 		tcp_out->check = 0;
-		tcp_out->check = update_csum_4to6(tcp_in->check,
+		tcp_out->check = update_csum_4to6(&state->csum_delta,
+				tcp_in->check,
 				pkt_ip4_hdr(in), &tcp_copy,
 				pkt_ip6_hdr(out), tcp_out,
 				sizeof(*tcp_out));
 	} else {
-		tcp_out->check = update_csum_4to6_partial(tcp_in->check,
+		tcp_out->check = update_csum_4to6_partial(&state->csum_delta,
+				tcp_in->check,
 				pkt_ip4_hdr(in), pkt_ip6_hdr(out));
 		partialize_skb(out->skb, offsetof(struct tcphdr, check));
 	}
 
+	ttpcomm_clamp_mss(state, tcp_out);
+
 	/* Payload */
 	return copy_payload(state) ? VERDICT_DROP : VERDICT_CONTINUE;
 }
@@ -914,20 +1008,18 @@ verdict ttp46_udp(struct xlation *state)
 			udp_copy.check = 0;
 
 			udp_out->check = 0;
-			udp_out->check = update_csum_4to6(udp_in->check,
+			udp_out->check = update_csum_4to6(&state->csum_delta,
+					udp_in->check,
 					pkt_ip4_hdr(in), &udp_copy,
 					pkt_ip6_hdr(out), udp_out,
 					sizeof(*udp_out));
 		} else {
-			udp_out->check = update_csum_4to6_partial(udp_in->check,
+			udp_out->check = update_csum_4to6_partial(
+					&state->csum_delta, udp_in->check,
 					pkt_ip4_hdr(in), pkt_ip6_hdr(out));
 			partialize_skb(out->skb, offsetof(struct udphdr, check));
 		}
 	} else {
-		/*
-		 * TODO (performance) handling this as partial might work just
-		 * as well, or better.
-		 */
 		if (handle_zero_csum(state))
 			return VERDICT_DROP;
 	}
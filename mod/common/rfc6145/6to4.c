@@ -1,25 +1,86 @@
 #include "nat64/mod/common/rfc6145/6to4.h"
 
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
 #include <net/ip6_checksum.h>
 
 #include "nat64/mod/common/config.h"
 #include "nat64/mod/common/icmp_wrapper.h"
-#include "nat64/mod/common/ipv6_hdr_iterator.h"
+#include "nat64/mod/common/linux_version.h"
 #include "nat64/mod/common/pool6.h"
 #include "nat64/mod/common/rfc6052.h"
 #include "nat64/mod/common/stats.h"
 #include "nat64/mod/common/route.h"
+#include "nat64/mod/common/skb_pool.h"
 #include "nat64/mod/common/rfc6145/common.h"
 #include "nat64/mod/stateless/blacklist4.h"
 #include "nat64/mod/stateless/rfc6791.h"
 #include "nat64/mod/stateless/eam.h"
 
+/*
+ * IPv4 Identification generator, after the kernel's ip_idents: a packet's ID
+ * comes from a counter selected by hashing its addresses and protocol with a
+ * secret. The counter advances by one per packet, plus a random amount
+ * whenever a jiffy passes between uses, so the IDs of idle destinations can't
+ * be predicted from the ones an attacker can see.
+ *
+ * Unlike ip_idents, the counters are per CPU, which means no atomics and no
+ * cache line bouncing. (Flows are normally steered to a single CPU anyway.)
+ */
+#define IDENT_BITS 8
+
+struct ident_bucket {
+	u32 id;
+	u32 stamp;
+};
+
+static struct ident_bucket __percpu *idents;
+static u32 ident_secret;
+
+int ttp64_setup(void)
+{
+	unsigned int cpu;
+
+	idents = __alloc_percpu(sizeof(struct ident_bucket) << IDENT_BITS,
+			__alignof__(struct ident_bucket));
+	if (!idents)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		get_random_bytes(per_cpu_ptr(idents, cpu),
+				sizeof(struct ident_bucket) << IDENT_BITS);
+	}
+	get_random_bytes(&ident_secret, sizeof(ident_secret));
+	return 0;
+}
+
+void ttp64_teardown(void)
+{
+	free_percpu(idents);
+	idents = NULL;
+}
+
+/** Returns a random number in [0, @range). */
+static u32 ident_jitter(u32 range)
+{
+#if LINUX_VERSION_AT_LEAST(3, 14, 0, 7, 1)
+	return prandom_u32_max(range);
+#else
+	return ((u64)random32() * range) >> 32;
+#endif
+}
+
 verdict ttp64_alloc_skb(struct xlation *state)
 {
 	struct packet *in = &state->in;
 	size_t total_len;
+	unsigned int shared_len;
 	struct sk_buff *skb;
 
+	state->in_place = ttpcomm_can_xlat_in_place(state);
+
 	/*
 	 * These are my assumptions to compute total_len:
 	 *
@@ -35,13 +96,8 @@ verdict ttp64_alloc_skb(struct xlation *state)
 	 */
 	total_len = sizeof(struct iphdr) + pkt_l3payload_len(in);
 	if (is_first_frag6(pkt_frag_hdr(in)) && pkt_is_icmp6_error(in)) {
-		struct ipv6hdr *hdr = pkt_payload(in);
-		struct hdr_iterator iterator = HDR_ITERATOR_INIT(hdr);
-		hdr_iterator_last(&iterator);
-
 		/* Add the IPv4 subheader, remove the IPv6 subheaders. */
-		total_len += sizeof(struct iphdr) - (iterator.data
-				- pkt_payload(in));
+		total_len += sizeof(struct iphdr) - in->ext6.inner_l3hdr_len;
 
 		/*
 		 * RFC1812 section 4.3.2.3.
@@ -51,7 +107,14 @@ verdict ttp64_alloc_skb(struct xlation *state)
 			total_len = 576;
 	}
 
-	skb = alloc_skb(LL_MAX_HEADER + total_len, GFP_ATOMIC);
+	/* The payload stays in @in. */
+	if (state->in_place)
+		total_len = sizeof(struct iphdr) + pkt_l4hdr_len(in);
+	/* The paged area is not copied, so don't reserve room for it. */
+	shared_len = ttpcomm_shared_len(state);
+	total_len -= shared_len;
+
+	skb = skbpool_alloc(LL_MAX_HEADER + total_len);
 	if (!skb) {
 		inc_stats(in, IPSTATS_MIB_INDISCARDS);
 		return VERDICT_DROP;
@@ -66,6 +129,8 @@ verdict ttp64_alloc_skb(struct xlation *state)
 	pkt_fill(&state->out, skb, L3PROTO_IPV4, pkt_l4_proto(in),
 			NULL, skb_transport_header(skb) + pkt_l4hdr_len(in),
 			pkt_original_pkt(in));
+	if (shared_len)
+		ttpcomm_share_payload(state, skb);
 
 	skb->mark = in->skb->mark;
 	skb->protocol = htons(ETH_P_IP);
@@ -81,19 +146,17 @@ __u8 ttp64_xlat_tos(struct global_config_usr *config, struct ipv6hdr *hdr)
 /**
  * One-liner for creating the IPv4 header's Protocol field.
  */
-__u8 ttp64_xlat_proto(struct ipv6hdr *hdr6)
+__u8 ttp64_xlat_proto(struct packet *in)
 {
-	struct hdr_iterator iterator = HDR_ITERATOR_INIT(hdr6);
-	hdr_iterator_last(&iterator);
-	return (iterator.hdr_type == NEXTHDR_ICMP)
+	return (in->ext6.nexthdr == NEXTHDR_ICMP)
 			? IPPROTO_ICMP
-			: iterator.hdr_type;
+			: in->ext6.nexthdr;
 }
 
 /**
  * One-liner for creating the IPv4 header's Total Length field.
  */
-static __be16 build_tot_len(struct packet *in, struct packet *out)
+static __be16 build_tot_len(struct xlation *state)
 {
 	/*
 	 * The RFC's equation is wrong, as the errata claims.
@@ -116,6 +179,8 @@ static __be16 build_tot_len(struct packet *in, struct packet *out)
 	 * SIGH.
 	 */
 
+	struct packet *in = &state->in;
+	struct packet *out = &state->out;
 	__u16 total_len;
 
 	if (pkt_is_inner(out)) { /* Internal packets */
@@ -130,7 +195,7 @@ static __be16 build_tot_len(struct packet *in, struct packet *out)
 		total_len = in->skb->len - pkt_hdrs_len(in) + pkt_hdrs_len(out);
 
 	} else { /* Real full packets and fragmented packets */
-		total_len = out->skb->len;
+		total_len = ttpcomm_out_len(state);
 		if (pkt_is_icmp4_error(out) && total_len > 576)
 			total_len = 576;
 
@@ -141,29 +206,47 @@ static __be16 build_tot_len(struct packet *in, struct packet *out)
 
 /**
  * One-liner for creating the IPv4 header's Identification field.
+ * @hdr4's addresses and protocol need to be already translated.
  */
-static __be16 generate_ipv4_id(struct frag_hdr *hdr_frag)
+static __be16 generate_ipv4_id(struct iphdr *hdr4, struct frag_hdr *hdr_frag)
 {
+	struct ident_bucket *bucket;
 	__be16 random;
+	u32 hash;
+	u32 now;
+	u16 id;
 
-	/*
-	 * get_random_bytes() is a little slow; we don't want to call it
-	 * pointlessly.
-	 * That's the reason why we consider fragmentation prematurely.
-	 */
 	if (hdr_frag)
 		return cpu_to_be16(be32_to_cpu(hdr_frag->identification));
 
-	get_random_bytes(&random, 2);
-	return random;
+	/* Nobody called ttp64_setup(). (Some unit tests.) */
+	if (unlikely(!idents)) {
+		get_random_bytes(&random, 2);
+		return random;
+	}
+
+	hash = jhash_3words((__force u32)hdr4->daddr, (__force u32)hdr4->saddr,
+			hdr4->protocol, ident_secret);
+	now = (u32)jiffies;
+
+	bucket = get_cpu_ptr(idents);
+	bucket += hash_32(hash, IDENT_BITS);
+	if (bucket->stamp != now) {
+		bucket->id += ident_jitter(now - bucket->stamp);
+		bucket->stamp = now;
+	}
+	id = ++bucket->id;
+	put_cpu_ptr(idents);
+
+	return cpu_to_be16(id);
 }
 
 /**
  * One-liner for creating the IPv4 header's Dont Fragment flag.
  */
-static bool generate_df_flag(struct packet *out)
+static bool generate_df_flag(struct xlation *state)
 {
-	return pkt_len(out) > 1260;
+	return ttpcomm_out_len(state) > 1260;
 }
 
 static addrxlat_verdict generate_addr4_siit(struct xlation *state,
@@ -175,7 +258,8 @@ static addrxlat_verdict generate_addr4_siit(struct xlation *state,
 
 	*was_6052 = false;
 
-	error = eamt_xlat_6to4(state->jool.siit.eamt, addr6, &tmp);
+	error = eamt_xlat_6to4(state->jool.siit.eamt, addr6, &tmp,
+			pkt_len(&state->in));
 	if (!error)
 		goto success;
 	if (error != -ESRCH)
@@ -212,21 +296,34 @@ success:
 	return ADDRXLAT_CONTINUE;
 }
 
-static verdict translate_addrs64_siit(struct xlation *state)
+/**
+ * Translates @state->in's (IPv6) addresses into @saddr and @daddr, the SIIT
+ * way. Sets @hairpin if the resulting packet will need intrinsic hairpinning.
+ * (@hairpin is left alone otherwise.)
+ */
+verdict ttp64_siit_addrs(struct xlation *state, __be32 *saddr, __be32 *daddr,
+		bool *hairpin)
 {
 	struct ipv6hdr *hdr6 = pkt_ip6_hdr(&state->in);
-	struct iphdr *hdr4 = pkt_ip4_hdr(&state->out);
 	bool src_was_6052, dst_was_6052;
 	enum eam_hairpinning_mode hairpin_mode;
 	addrxlat_verdict result;
 
+	/* CLAT traffic never needs hairpinning, so @hairpin stays untouched. */
+	if (state->jool.global->cfg.siit.clat && pkt_is_outer(&state->in)
+			&& eamt_clat_6to4(state->jool.siit.eamt, &hdr6->saddr,
+					&hdr6->daddr, saddr, daddr,
+					pkt_len(&state->in)))
+		return VERDICT_CONTINUE;
+
 	/* Dst address. (SRC DEPENDS CON DST, SO WE NEED TO XLAT DST FIRST!) */
-	result = generate_addr4_siit(state, &hdr6->daddr, &hdr4->daddr,
+	result = generate_addr4_siit(state, &hdr6->daddr, daddr,
 			&dst_was_6052);
 	switch (result) {
 	case ADDRXLAT_CONTINUE:
 		break;
 	case ADDRXLAT_TRY_SOMETHING_ELSE:
+		jstat_inc(state->jool.stats, JSTAT_UNTRANSLATABLE_ADDR);
 		return VERDICT_ACCEPT;
 	case ADDRXLAT_ACCEPT:
 	case ADDRXLAT_DROP:
@@ -234,15 +331,16 @@ static verdict translate_addrs64_siit(struct xlation *state)
 	}
 
 	/* Src address. */
-	result = generate_addr4_siit(state, &hdr6->saddr, &hdr4->saddr,
+	result = generate_addr4_siit(state, &hdr6->saddr, saddr,
 			&src_was_6052);
 	switch (result) {
 	case ADDRXLAT_CONTINUE:
 		break;
 	case ADDRXLAT_TRY_SOMETHING_ELSE:
 		if (pkt_is_icmp6_error(&state->in)
-				&& !rfc6791_find(state, &hdr4->saddr))
+				&& !rfc6791_find(state, saddr))
 			break; /* Ok, success. */
+		jstat_inc(state->jool.stats, JSTAT_UNTRANSLATABLE_ADDR);
 		return VERDICT_ACCEPT;
 	case ADDRXLAT_ACCEPT:
 	case ADDRXLAT_DROP:
@@ -261,43 +359,42 @@ static verdict translate_addrs64_siit(struct xlation *state)
 		/* Condition set A */
 		if (pkt_is_outer(&state->in) && !pkt_is_icmp6_error(&state->in)
 				&& dst_was_6052
-				&& eamt_contains4(eamt, hdr4->daddr)) {
-			state->out.is_hairpin = true;
+				&& eamt_contains4(eamt, *daddr)) {
+			*hairpin = true;
 
 		/* Condition set B */
 		} else if (pkt_is_inner(&state->in)
 				&& src_was_6052
-				&& eamt_contains4(eamt, hdr4->saddr)) {
-			state->out.is_hairpin = true;
+				&& eamt_contains4(eamt, *saddr)) {
+			*hairpin = true;
 		}
 	}
 
-	log_debug("Result: %pI4->%pI4", &hdr4->saddr, &hdr4->daddr);
+	log_debug("Result: %pI4->%pI4", saddr, daddr);
 	return VERDICT_CONTINUE;
 }
 
 /**
- * has_nonzero_segments_left - Returns true if @hdr6's packet has a routing
- * header, and its Segments Left field is not zero.
+ * has_nonzero_segments_left - Returns true if @in has a routing header, and
+ * its Segments Left field is not zero.
  *
  * @location: if the packet has nonzero segments left, the offset
- *		of the segments left field (from the start of @hdr6) will be
- *		stored here.
+ *		of the segments left field (from the start of the IPv6 header)
+ *		will be stored here.
  */
-static bool has_nonzero_segments_left(struct ipv6hdr *hdr6, __u32 *location)
+static bool has_nonzero_segments_left(struct packet *in, __u32 *location)
 {
 	struct ipv6_rt_hdr *rt_hdr;
-	unsigned int offset;
 
-	rt_hdr = hdr_iterator_find(hdr6, NEXTHDR_ROUTING);
-	if (!rt_hdr)
+	if (!in->ext6.rt_offset)
 		return false;
 
+	rt_hdr = ((void *)pkt_ip6_hdr(in)) + in->ext6.rt_offset;
 	if (rt_hdr->segments_left == 0)
 		return false;
 
-	offset = ((void *)rt_hdr) - (void *)hdr6;
-	*location = offset + offsetof(struct ipv6_rt_hdr, segments_left);
+	*location = in->ext6.rt_offset
+			+ offsetof(struct ipv6_rt_hdr, segments_left);
 	return true;
 }
 
@@ -317,30 +414,31 @@ verdict ttp64_ipv4(struct xlation *state)
 	verdict result;
 
 	/*
-	 * translate_addrs64_siit->rfc6791_get->get_host_address needs tos
+	 * ttp64_siit_addrs->rfc6791_get->get_host_address needs tos
 	 * and protocol, so translate them first.
 	 */
 	hdr4->tos = ttp64_xlat_tos(&state->jool.global->cfg, hdr6);
-	hdr4->protocol = ttp64_xlat_proto(hdr6);
+	hdr4->protocol = ttp64_xlat_proto(in);
 
 	/* Translate the address before TTL because of issue #167. */
 	if (xlat_is_nat64()) {
 		hdr4->saddr = out->tuple.src.addr4.l3.s_addr;
 		hdr4->daddr = out->tuple.dst.addr4.l3.s_addr;
 	} else {
-		result = translate_addrs64_siit(state);
+		result = ttp64_siit_addrs(state, &hdr4->saddr, &hdr4->daddr,
+				&out->is_hairpin);
 		if (result != VERDICT_CONTINUE)
 			return result;
 	}
 
 	hdr4->version = 4;
 	hdr4->ihl = 5;
-	hdr4->tot_len = build_tot_len(in, out);
-	hdr4->id = generate_ipv4_id(hdr_frag);
-	hdr4->frag_off = build_ipv4_frag_off_field(generate_df_flag(out), 0, 0);
+	hdr4->tot_len = build_tot_len(state);
+	hdr4->id = generate_ipv4_id(hdr4, hdr_frag);
+	hdr4->frag_off = build_ipv4_frag_off_field(generate_df_flag(state), 0, 0);
 	if (pkt_is_outer(in)) {
 		if (hdr6->hop_limit <= 1) {
-			icmp64_send(in, ICMPERR_HOP_LIMIT, 0);
+			icmp64_send(state->jool.stats, in, ICMPERR_HOP_LIMIT, 0);
 			inc_stats(in, IPSTATS_MIB_INHDRERRORS);
 			return VERDICT_DROP;
 		}
@@ -352,9 +450,10 @@ verdict ttp64_ipv4(struct xlation *state)
 
 	if (pkt_is_outer(in)) {
 		__u32 nonzero_location;
-		if (has_nonzero_segments_left(hdr6, &nonzero_location)) {
+		if (has_nonzero_segments_left(in, &nonzero_location)) {
 			log_debug("Packet's segments left field is nonzero.");
-			icmp64_send(in, ICMPERR_HDR_FIELD, nonzero_location);
+			icmp64_send(state->jool.stats, in, ICMPERR_HDR_FIELD,
+					nonzero_location);
 			inc_stats(in, IPSTATS_MIB_INHDRERRORS);
 			return VERDICT_DROP;
 		}
@@ -401,7 +500,8 @@ static int compute_mtu4(struct xlation *state)
 	struct dst_entry *out_dst;
 	struct icmp6hdr *in_icmp = pkt_icmp6_hdr(&state->in);
 
-	out_dst = route4(state->jool.ns, &state->out);
+	/* See compute_mtu6(). */
+	out_dst = route_hinted(state->jool.ns, &state->out, NULL);
 	if (!out_dst)
 		return -EINVAL;
 	if (!state->in.skb->dev)
@@ -609,18 +709,31 @@ static int compute_icmp4_csum(struct packet *out)
 
 static verdict validate_icmp6_csum(struct packet *in)
 {
+	struct sk_buff *skb = in->skb;
 	struct ipv6hdr *hdr6;
 	unsigned int len;
+	__wsum datagram_csum;
 	__sum16 csum;
 
-	if (in->skb->ip_summed != CHECKSUM_NONE)
+	switch (skb->ip_summed) {
+	case CHECKSUM_NONE:
+		datagram_csum = skb_checksum(skb, skb_transport_offset(skb),
+				pkt_datagram_len(in), 0);
+		break;
+	case CHECKSUM_COMPLETE:
+		if (!ttpcomm_hw_csum_usable(in))
+			return VERDICT_CONTINUE;
+		datagram_csum = ttpcomm_hw_csum(in);
+		break;
+	default:
+		/* See validate_icmp4_csum(). */
 		return VERDICT_CONTINUE;
+	}
 
 	hdr6 = pkt_ip6_hdr(in);
 	len = pkt_datagram_len(in);
 	csum = csum_ipv6_magic(&hdr6->saddr, &hdr6->daddr, len, NEXTHDR_ICMP,
-			skb_checksum(in->skb, skb_transport_offset(in->skb),
-					len, 0));
+			datagram_csum);
 	if (csum != 0) {
 		log_debug("Checksum doesn't match.");
 		inc_stats(in, IPSTATS_MIB_INHDRERRORS);
@@ -648,8 +761,10 @@ static verdict post_icmp4error(struct xlation *state)
 	log_debug("Translating the inner packet (6->4)...");
 
 	result = validate_icmp6_csum(&state->in);
-	if (result != VERDICT_CONTINUE)
+	if (result != VERDICT_CONTINUE) {
+		jstat_inc(state->jool.stats, JSTAT_BAD_CHECKSUM);
 		return result;
+	}
 
 	result = ttpcomm_translate_inner_packet(state);
 	if (result != VERDICT_CONTINUE)
@@ -753,12 +868,16 @@ static __wsum pseudohdr4_csum(struct iphdr *hdr)
 	return csum_tcpudp_nofold(hdr->saddr, hdr->daddr, 0, 0, 0);
 }
 
-static __sum16 update_csum_6to4(__sum16 csum16,
+static __sum16 update_csum_6to4(struct csum_delta *delta, __sum16 csum16,
 		struct ipv6hdr *in_ip6, void *in_l4_hdr, size_t in_l4_hdr_len,
 		struct iphdr *out_ip4, void *out_l4_hdr, size_t out_l4_hdr_len)
 {
 	__wsum csum;
 
+	/* Offloaded flows already know the answer. */
+	if (delta->set)
+		return csum_delta_apply(delta, csum16);
+
 	csum = ~csum_unfold(csum16);
 
 	/*
@@ -781,10 +900,15 @@ static __sum16 update_csum_6to4(__sum16 csum16,
 	return csum_fold(csum);
 }
 
-static __sum16 update_csum_6to4_partial(__sum16 csum16, struct ipv6hdr *in_ip6,
-		struct iphdr *out_ip4)
+static __sum16 update_csum_6to4_partial(struct csum_delta *delta,
+		__sum16 csum16, struct ipv6hdr *in_ip6, struct iphdr *out_ip4)
 {
-	__wsum csum = csum_unfold(csum16);
+	__wsum csum;
+
+	if (delta->set)
+		return csum_delta_apply_partial(delta, csum16);
+
+	csum = csum_unfold(csum16);
 	csum = csum_sub(csum, pseudohdr6_csum(in_ip6));
 	csum = csum_add(csum, pseudohdr4_csum(out_ip4));
 	return ~csum_fold(csum);
@@ -811,16 +935,20 @@ verdict ttp64_tcp(struct xlation *state)
 		tcp_copy.check = 0;
 
 		tcp_out->check = 0;
-		tcp_out->check = update_csum_6to4(tcp_in->check,
+		tcp_out->check = update_csum_6to4(&state->csum_delta,
+				tcp_in->check,
 				pkt_ip6_hdr(in), &tcp_copy, sizeof(tcp_copy),
 				pkt_ip4_hdr(out), tcp_out, sizeof(*tcp_out));
 		out->skb->ip_summed = CHECKSUM_NONE;
 	} else {
-		tcp_out->check = update_csum_6to4_partial(tcp_in->check,
+		tcp_out->check = update_csum_6to4_partial(&state->csum_delta,
+				tcp_in->check,
 				pkt_ip6_hdr(in), pkt_ip4_hdr(out));
 		partialize_skb(out->skb, offsetof(struct tcphdr, check));
 	}
 
+	ttpcomm_clamp_mss(state, tcp_out);
+
 	/* Payload */
 	return copy_payload(state) ? VERDICT_DROP : VERDICT_CONTINUE;
 }
@@ -846,14 +974,16 @@ verdict ttp64_udp(struct xlation *state)
 		udp_copy.check = 0;
 
 		udp_out->check = 0;
-		udp_out->check = update_csum_6to4(udp_in->check,
+		udp_out->check = update_csum_6to4(&state->csum_delta,
+				udp_in->check,
 				pkt_ip6_hdr(in), &udp_copy, sizeof(udp_copy),
 				pkt_ip4_hdr(out), udp_out, sizeof(*udp_out));
 		if (udp_out->check == 0)
 			udp_out->check = CSUM_MANGLED_0;
 		out->skb->ip_summed = CHECKSUM_NONE;
 	} else {
-		udp_out->check = update_csum_6to4_partial(udp_in->check,
+		udp_out->check = update_csum_6to4_partial(&state->csum_delta,
+				udp_in->check,
 				pkt_ip6_hdr(in), pkt_ip4_hdr(out));
 		partialize_skb(out->skb, offsetof(struct udphdr, check));
 	}
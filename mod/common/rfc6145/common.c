@@ -1,13 +1,19 @@
 #include "nat64/mod/common/rfc6145/common.h"
 #include "nat64/mod/common/config.h"
-#include "nat64/mod/common/ipv6_hdr_iterator.h"
 #include "nat64/mod/common/packet.h"
 #include "nat64/mod/common/stats.h"
 #include "nat64/mod/common/rfc6145/4to6.h"
 #include "nat64/mod/common/rfc6145/6to4.h"
 #include "nat64/mod/stateless/blacklist4.h"
 #include <linux/icmp.h>
+#include <net/dst.h>
+#include <net/tcp.h>
+#include <asm/unaligned.h>
 
+/**
+ * The parts of an outer packet that get overridden while its inner packet is
+ * being translated. (The tuple is swapped in place instead.)
+ */
 struct backup_skb {
 	unsigned int pulled;
 	struct {
@@ -16,7 +22,7 @@ struct backup_skb {
 	} offset;
 	void *payload;
 	l4_protocol l4_proto;
-	struct tuple tuple;
+	__u8 nexthdr6;
 };
 
 static verdict handle_unknown_l4(struct xlation *state)
@@ -75,6 +81,9 @@ int copy_payload(struct xlation *state)
 {
 	int error;
 
+	if (state->in_place)
+		return 0; /* The payload never leaves the incoming skb. */
+
 	error = skb_copy_bits(state->in.skb, pkt_payload_offset(&state->in),
 			pkt_payload(&state->out),
 			/*
@@ -82,14 +91,347 @@ int copy_payload(struct xlation *state)
 			 * length must be extracted from the outgoing packet:
 			 * the outgoing packet might be truncated. See
 			 * ttp46_create_skb() and ttp64_create_skb().
+			 * Also, only the linear area needs to be copied; the
+			 * paged area, if any, is shared with the incoming packet.
+			 * (See ttpcomm_share_payload().)
 			 */
-			pkt_payload_len_frag(&state->out));
+			skb_tail_pointer(state->out.skb)
+					- (unsigned char *)pkt_payload(&state->out));
 	if (error)
 		log_debug("The payload copy threw errcode %d.", error);
 
 	return error;
 }
 
+/**
+ * Returns true if @pkt's CHECKSUM_COMPLETE sum can be used to validate its
+ * layer-4 checksum.
+ *
+ * Our own fragment database does not maintain skb->csum while it glues
+ * fragments together, so don't trust it when there is a frag list.
+ */
+bool ttpcomm_hw_csum_usable(struct packet *pkt)
+{
+	return pkt->skb->ip_summed == CHECKSUM_COMPLETE
+			&& !skb_shinfo(pkt->skb)->frag_list;
+}
+
+/**
+ * Returns the sum of @pkt's layer-4 header and payload, as computed by the NIC
+ * when it received the packet. (ie. without having to walk the payload.)
+ *
+ * The NIC's sum covers everything from skb->data onwards, so this subtracts
+ * the layer-3 headers from it. Those were pulled, so they're linear.
+ */
+__wsum ttpcomm_hw_csum(struct packet *pkt)
+{
+	struct sk_buff *skb = pkt->skb;
+
+	return csum_sub(skb->csum, csum_partial(skb->data,
+			skb_transport_offset(skb), 0));
+}
+
+/**
+ * Lowers the Maximum Segment Size option of @hdr (the outgoing copy of a
+ * translated TCP header, checksum already computed) so the connection's
+ * segments fit in --mss-clamp-sized packets. The limit assumes IPv6 headers,
+ * since the segments will exist on both sides.
+ *
+ * Only SYNs carry the option, so everything else returns right away.
+ */
+void ttpcomm_clamp_mss(struct xlation *state, struct tcphdr *hdr)
+{
+	unsigned int mtu = state->jool.global->cfg.mss_clamp;
+	unsigned char *opts;
+	unsigned int len;
+	unsigned int i;
+	__u16 max;
+	__be16 old, new;
+	__wsum csum;
+
+	if (!mtu || !hdr->syn)
+		return;
+
+	max = mtu - sizeof(struct ipv6hdr) - sizeof(struct tcphdr);
+	opts = (unsigned char *)(hdr + 1);
+	len = tcp_hdr_len(hdr) - sizeof(struct tcphdr);
+
+	i = 0;
+	while (i < len) {
+		switch (opts[i]) {
+		case TCPOPT_EOL:
+			return;
+		case TCPOPT_NOP:
+			i++;
+			continue;
+		}
+
+		/* Malformed options are the endpoint's problem, not ours. */
+		if (i + 1 >= len || opts[i + 1] < 2 || i + opts[i + 1] > len)
+			return;
+
+		if (opts[i] == TCPOPT_MSS && opts[i + 1] == TCPOLEN_MSS)
+			break;
+		i += opts[i + 1];
+	}
+	if (i >= len)
+		return;
+
+	old = get_unaligned((__be16 *)&opts[i + 2]);
+	if (be16_to_cpu(old) <= max)
+		return;
+	new = cpu_to_be16(max);
+	put_unaligned(new, (__be16 *)&opts[i + 2]);
+
+	/*
+	 * CHECKSUM_PARTIAL: The device will sum the header (new MSS included)
+	 * by itself.
+	 */
+	if (state->in.skb->ip_summed == CHECKSUM_PARTIAL)
+		return;
+
+	/* The option can start on an odd byte, hence the block functions. */
+	i += sizeof(struct tcphdr) + 2;
+	csum = ~csum_unfold(hdr->check);
+	csum = csum_block_sub(csum, csum_partial(&old, sizeof(old), 0), i);
+	csum = csum_block_add(csum, csum_partial(&new, sizeof(new), 0), i);
+	hdr->check = csum_fold(csum);
+}
+
+/**
+ * Returns true if @state->in's skb can be recycled as the outgoing packet. (See
+ * the comments above translation_steps.skb_alloc_fn.)
+ *
+ * Fragments, ICMP and frag lists are left to the normal translation because
+ * their headers (or their length) might change in ways other than the layer-3
+ * swap.
+ */
+bool ttpcomm_can_xlat_in_place(struct xlation *state)
+{
+	struct packet *in = &state->in;
+	struct sk_buff *skb = in->skb;
+
+	/*
+	 * If @in is not the packet the kernel handed us (ie. we're
+	 * hairpinning), its skb belongs to somebody else.
+	 */
+	if (pkt_original_pkt(in) != in)
+		return false;
+	if (skb_shared(skb) || skb_shinfo(skb)->frag_list)
+		return false;
+
+	switch (pkt_l4_proto(in)) {
+	case L4PROTO_TCP:
+		break;
+	case L4PROTO_UDP:
+		/* translate_gso() only knows TCP. */
+		if (skb_is_gso(skb))
+			return false;
+		break;
+	default:
+		return false;
+	}
+
+	switch (pkt_l3_proto(in)) {
+	case L3PROTO_IPV6:
+		return !pkt_frag_hdr(in);
+	case L3PROTO_IPV4:
+		return !will_need_frag_hdr(pkt_ip4_hdr(in));
+	}
+
+	return false;
+}
+
+/**
+ * Returns the length the outgoing packet has (or will have, once the in-place
+ * translation is committed).
+ */
+unsigned int ttpcomm_out_len(struct xlation *state)
+{
+	unsigned int len = pkt_len(&state->out);
+
+	if (state->in_place)
+		len += pkt_payload_len_frag(&state->in);
+
+	return len;
+}
+
+/**
+ * Returns the number of bytes at the end of @state->in's payload that can be
+ * handed over to the outgoing packet by reference instead of copied (ie. the
+ * length of its paged area), or zero if everything has to be copied.
+ */
+unsigned int ttpcomm_shared_len(struct xlation *state)
+{
+	struct packet *in = &state->in;
+	struct sk_buff *skb = in->skb;
+
+	if (state->in_place)
+		return 0;
+
+	/* These might be truncated, and their inner packets get translated. */
+	switch (pkt_l3_proto(in)) {
+	case L3PROTO_IPV6:
+		if (pkt_is_icmp6_error(in))
+			return 0;
+		break;
+	case L3PROTO_IPV4:
+		if (pkt_is_icmp4_error(in))
+			return 0;
+		break;
+	}
+
+	/* Userspace pages must not outlive the incoming packet. */
+	if (skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY)
+		return 0;
+
+	/* The headers were pulled, so the paged area is all payload. */
+	return pkt_len(in) - skb_headlen(skb);
+}
+
+/**
+ * Makes @out's paged area the same pages as @state->in's. @out is expected to
+ * have been allocated without room for them (see ttpcomm_shared_len()).
+ */
+void ttpcomm_share_payload(struct xlation *state, struct sk_buff *out)
+{
+	struct sk_buff *in = state->in.skb;
+	struct skb_shared_info *shinfo = skb_shinfo(in);
+	unsigned int len = 0;
+	unsigned int i;
+
+	for (i = 0; i < shinfo->nr_frags; i++) {
+		skb_shinfo(out)->frags[i] = shinfo->frags[i];
+		skb_frag_ref(in, i);
+		len += skb_frag_size(&shinfo->frags[i]);
+	}
+	skb_shinfo(out)->nr_frags = shinfo->nr_frags;
+
+	out->len += len;
+	out->data_len += len;
+	out->truesize += len;
+}
+
+/**
+ * Moves the translated headers from @state->out's skb to @skb, which is
+ * expected to already contain the payload, and makes @skb @state->out's.
+ */
+static void paste_headers(struct xlation *state, struct sk_buff *skb)
+{
+	struct sk_buff *hdrs = state->out.skb;
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+
+	memcpy(skb->data, hdrs->data, hdrs->len);
+	skb_reset_mac_header(skb);
+	skb_reset_network_header(skb);
+	skb_set_transport_header(skb, skb_transport_offset(hdrs));
+	skb->mark = hdrs->mark;
+	skb->protocol = hdrs->protocol;
+	if (hdrs->ip_summed == CHECKSUM_PARTIAL)
+		partialize_skb(skb, hdrs->csum_offset);
+	else
+		skb->ip_summed = CHECKSUM_NONE;
+	shinfo->gso_size = skb_shinfo(hdrs)->gso_size;
+	shinfo->gso_segs = skb_shinfo(hdrs)->gso_segs;
+	shinfo->gso_type = skb_shinfo(hdrs)->gso_type;
+
+	state->out.skb = skb;
+	state->out.payload = skb->data + hdrs->len;
+	state->in_place = false;
+
+	kfree_skb(hdrs);
+}
+
+/**
+ * Replaces @state->in's headers with @state->out's, so @state->in's skb can be
+ * sent instead of a copy.
+ *
+ * Call this only after you're done with @state->in; it will no longer have an
+ * skb after this. (ICMP errors and NF_ACCEPTs are no longer possible, for
+ * example.) On error, both packets are left untouched.
+ */
+int ttpcomm_commit_in_place(struct xlation *state)
+{
+	struct sk_buff *skb = state->in.skb;
+	struct sk_buff *hdrs = state->out.skb;
+	unsigned int old_len = pkt_payload_offset(&state->in);
+	unsigned int headroom = skb_headroom(hdrs);
+	int error;
+
+	if (hdrs->len > old_len)
+		headroom += hdrs->len - old_len;
+
+	/* This also makes the headers writable if the skb is a clone. */
+	error = skb_cow_head(skb, headroom);
+	if (error) {
+		log_debug("skb_cow_head() threw errcode %d.", error);
+		return error;
+	}
+
+	/* The headers were pulled during pkt_init_ipv*(); they're linear. */
+	if (!jskb_pull(skb, old_len))
+		return -EINVAL;
+	if (!jskb_push(skb, hdrs->len))
+		return -EINVAL;
+
+	/* We're going out through a different path, so forget the old one. */
+	skb_orphan(skb);
+	nf_reset(skb);
+	memset(skb->cb, 0, sizeof(skb->cb));
+	skb_dst_drop(skb);
+	skb_dst_copy(skb, hdrs);
+	skb->dev = hdrs->dev;
+
+	paste_headers(state, skb);
+	state->in.skb = NULL;
+	return 0;
+}
+
+/**
+ * Turns an in-place translation back into a normal one; ie. an outgoing skb
+ * that contains its own copy of the payload.
+ * This is for code that needs both packets to remain intact (eg.
+ * hairpinning). Does nothing if the translation is not in place.
+ *
+ * Releases @state->out's skb on failure.
+ */
+verdict ttpcomm_abandon_in_place(struct xlation *state)
+{
+	struct sk_buff *hdrs = state->out.skb;
+	struct sk_buff *skb;
+	unsigned int payload_len;
+	int error;
+
+	if (!state->in_place)
+		return VERDICT_CONTINUE;
+
+	payload_len = pkt_payload_len_frag(&state->in);
+	skb = alloc_skb(skb_headroom(hdrs) + hdrs->len + payload_len,
+			GFP_ATOMIC);
+	if (!skb) {
+		inc_stats(&state->in, IPSTATS_MIB_INDISCARDS);
+		goto fail;
+	}
+
+	skb_reserve(skb, skb_headroom(hdrs));
+	skb_put(skb, hdrs->len + payload_len);
+
+	error = skb_copy_bits(state->in.skb, pkt_payload_offset(&state->in),
+			skb->data + hdrs->len, payload_len);
+	if (error) {
+		log_debug("The payload copy threw errcode %d.", error);
+		kfree_skb(skb);
+		goto fail;
+	}
+
+	paste_headers(state, skb);
+	return VERDICT_CONTINUE;
+
+fail:
+	kfree_skb(hdrs);
+	return VERDICT_DROP;
+}
+
 bool will_need_frag_hdr(const struct iphdr *hdr)
 {
 	return is_mf_set_ipv4(hdr) || get_fragment_offset_ipv4(hdr);
@@ -110,8 +452,11 @@ static int report_bug247(struct packet *pkt, __u8 proto)
 	pr_err("Page shift: %u\n", PAGE_SHIFT);
 	pr_err("protocols: %u %u %u\n", pkt->l3_proto, pkt->l4_proto, proto);
 
-	snapshot_report(&pkt->debug.shot1, "initial");
-	snapshot_report(&pkt->debug.shot2, "mid");
+	if (debug_enabled()) {
+		pkt_debug_report();
+	} else {
+		pr_err("(Enable --debug to also get the packet's snapshots.)\n");
+	}
 
 	pr_err("current len: %u\n", skb->len);
 	pr_err("current data_len: %u\n", skb->data_len);
@@ -212,16 +557,14 @@ static int move_pointers4(struct xlation *state)
 
 static int move_pointers6(struct packet *in, struct packet *out)
 {
-	struct ipv6hdr *hdr6 = pkt_payload(in);
-	struct hdr_iterator iterator = HDR_ITERATOR_INIT(hdr6);
 	int error;
 
-	hdr_iterator_last(&iterator);
-
-	error = move_pointers_in(in, iterator.hdr_type,
-			iterator.data - (void *)hdr6);
+	/* pkt_init_ipv6() already walked the inner headers. */
+	error = move_pointers_in(in, in->ext6.inner_nexthdr,
+			in->ext6.inner_l3hdr_len);
 	if (error)
 		return error;
+	in->ext6.nexthdr = in->ext6.inner_nexthdr;
 
 	return move_pointers_out(in, out, sizeof(struct iphdr));
 }
@@ -233,8 +576,7 @@ static void backup(struct packet *pkt, struct backup_skb *bkp)
 	bkp->offset.l4 = skb_transport_offset(pkt->skb);
 	bkp->payload = pkt_payload(pkt);
 	bkp->l4_proto = pkt_l4_proto(pkt);
-	if (xlat_is_nat64())
-		bkp->tuple = pkt->tuple;
+	bkp->nexthdr6 = pkt->ext6.nexthdr;
 }
 
 static int restore(struct packet *pkt, struct backup_skb *bkp)
@@ -245,18 +587,75 @@ static int restore(struct packet *pkt, struct backup_skb *bkp)
 	skb_set_transport_header(pkt->skb, bkp->offset.l4);
 	pkt->payload = bkp->payload;
 	pkt->l4_proto = bkp->l4_proto;
+	pkt->ext6.nexthdr = bkp->nexthdr6;
 	pkt->is_inner = 0;
-	if (xlat_is_nat64())
-		pkt->tuple = bkp->tuple;
 	return 0;
 }
 
+/**
+ * The inner packet travels in the opposite direction, so its tuples are the
+ * outer ones, reversed. Calling this again undoes it.
+ */
+static void swap_tuples(struct xlation *state)
+{
+	if (xlat_is_nat64()) {
+		swap(state->in.tuple.src, state->in.tuple.dst);
+		swap(state->out.tuple.src, state->out.tuple.dst);
+	}
+}
+
+/**
+ * Runs the inner packet's translation steps. Same as the steps table, minus
+ * the indirect calls; ICMP errors are way too common to pay for them twice.
+ */
+static verdict translate_inner_steps(struct xlation *state)
+{
+	verdict result;
+
+	switch (pkt_l3_proto(&state->in)) {
+	case L3PROTO_IPV6:
+		result = ttp64_ipv4(state);
+		if (result != VERDICT_CONTINUE)
+			return result;
+
+		switch (pkt_l4_proto(&state->in)) {
+		case L4PROTO_TCP:
+			return ttp64_tcp(state);
+		case L4PROTO_UDP:
+			return ttp64_udp(state);
+		case L4PROTO_ICMP:
+			return ttp64_icmp(state);
+		case L4PROTO_OTHER:
+			return handle_unknown_l4(state);
+		}
+		break;
+
+	case L3PROTO_IPV4:
+		result = ttp46_ipv6(state);
+		if (result != VERDICT_CONTINUE)
+			return result;
+
+		switch (pkt_l4_proto(&state->in)) {
+		case L4PROTO_TCP:
+			return ttp46_tcp(state);
+		case L4PROTO_UDP:
+			return ttp46_udp(state);
+		case L4PROTO_ICMP:
+			return ttp46_icmp(state);
+		case L4PROTO_OTHER:
+			return handle_unknown_l4(state);
+		}
+		break;
+	}
+
+	return VERDICT_DROP;
+}
+
 verdict ttpcomm_translate_inner_packet(struct xlation *state)
 {
 	struct packet *in = &state->in;
 	struct packet *out = &state->out;
 	struct backup_skb bkp_in, bkp_out;
-	struct translation_steps *current_steps;
 	verdict result;
 
 	backup(in, &bkp_in);
@@ -276,16 +675,9 @@ verdict ttpcomm_translate_inner_packet(struct xlation *state)
 		return VERDICT_DROP;
 	}
 
-	if (xlat_is_nat64()) {
-		in->tuple.src = bkp_in.tuple.dst;
-		in->tuple.dst = bkp_in.tuple.src;
-		out->tuple.src = bkp_out.tuple.dst;
-		out->tuple.dst = bkp_out.tuple.src;
-	}
-
-	current_steps = &steps[pkt_l3_proto(in)][pkt_l4_proto(in)];
+	swap_tuples(state);
 
-	result = current_steps->l3_hdr_fn(state);
+	result = translate_inner_steps(state);
 	if (result == VERDICT_ACCEPT) {
 		/*
 		 * Accepting because of an inner packet doesn't make sense.
@@ -296,12 +688,7 @@ verdict ttpcomm_translate_inner_packet(struct xlation *state)
 	if (result != VERDICT_CONTINUE)
 		return result;
 
-	result = current_steps->l3_payload_fn(state);
-	if (result == VERDICT_ACCEPT)
-		return VERDICT_DROP;
-	if (result != VERDICT_CONTINUE)
-		return result;
-
+	swap_tuples(state);
 	if (restore(in, &bkp_in))
 		return VERDICT_DROP;
 	if (restore(out, &bkp_out))
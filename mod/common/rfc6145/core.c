@@ -1,23 +1,98 @@
 #include "nat64/mod/common/icmp_wrapper.h"
+#include "nat64/mod/common/skb_pool.h"
 #include "nat64/mod/common/stats.h"
 #include "nat64/mod/common/rfc6145/core.h"
 #include "nat64/mod/common/rfc6145/common.h"
+#include "nat64/mod/common/rfc6145/4to6.h"
+#include "nat64/mod/common/rfc6145/6to4.h"
+
+/**
+ * Carries @state->in's segmentation offload metadata over to @state->out, so
+ * GRO'd super-packets can be translated as a whole and only segmented once, by
+ * the egress device.
+ *
+ * Only TCP is supported. Anything else is sent as one big packet, as it used to
+ * be.
+ */
+static void translate_gso(struct xlation *state)
+{
+	struct skb_shared_info *in = skb_shinfo(state->in.skb);
+	struct skb_shared_info *out = skb_shinfo(state->out.skb);
+	unsigned int hdrs_in;
+	unsigned int hdrs_out;
+	unsigned int gso_type;
+	unsigned int gso_size;
+
+	if (!skb_is_gso(state->in.skb))
+		return;
+
+	switch (pkt_l3_proto(&state->out)) {
+	case L3PROTO_IPV6:
+		if (!(in->gso_type & SKB_GSO_TCPV4))
+			goto unsupported;
+		gso_type = (in->gso_type & ~SKB_GSO_TCPV4) | SKB_GSO_TCPV6;
+		break;
+	case L3PROTO_IPV4:
+		if (!(in->gso_type & SKB_GSO_TCPV6))
+			goto unsupported;
+		gso_type = (in->gso_type & ~SKB_GSO_TCPV6) | SKB_GSO_TCPV4;
+		break;
+	default:
+		goto unsupported;
+	}
 
-static verdict translate_first(struct xlation *state)
+	/* The device will need to compute the checksum of every segment. */
+	if (state->out.skb->ip_summed != CHECKSUM_PARTIAL)
+		goto unsupported;
+
+	/*
+	 * gso_size is the payload length of each segment. If the headers grew,
+	 * shrink it so the segments stay as long as the ones the sender sent
+	 * (which presumably fit the path).
+	 * Don't grow it when the headers shrink, though; segments must not
+	 * exceed the MSS the receiver announced.
+	 */
+	hdrs_in = pkt_hdrs_len(&state->in);
+	hdrs_out = pkt_hdrs_len(&state->out);
+	gso_size = in->gso_size;
+	if (hdrs_out > hdrs_in) {
+		if (gso_size <= hdrs_out - hdrs_in)
+			goto unsupported;
+		gso_size -= hdrs_out - hdrs_in;
+	}
+
+	out->gso_type = gso_type;
+	out->gso_size = gso_size;
+	out->gso_segs = DIV_ROUND_UP(pkt_payload_len_pkt(&state->in), gso_size);
+	return;
+
+unsupported:
+	log_debug("Cannot translate GSO type 0x%x; sending the packet whole.",
+			in->gso_type);
+}
+
+/**
+ * Runs the translation steps. It's always inlined so constant arguments
+ * become direct calls.
+ */
+static __always_inline verdict run_steps(struct xlation *state,
+		verdict (*skb_alloc_fn)(struct xlation *),
+		verdict (*l3_hdr_fn)(struct xlation *),
+		verdict (*l3_payload_fn)(struct xlation *))
 {
-	struct translation_steps *steps = ttpcomm_get_steps(&state->in);
 	verdict result;
 
-	result = steps->skb_alloc_fn(state);
+	result = skb_alloc_fn(state);
 	if (result != VERDICT_CONTINUE)
 		return result;
-	result = steps->l3_hdr_fn(state);
+	result = l3_hdr_fn(state);
 	if (result != VERDICT_CONTINUE)
 		goto revert;
-	result = steps->l3_payload_fn(state);
+	result = l3_payload_fn(state);
 	if (result != VERDICT_CONTINUE)
 		goto revert;
 
+	translate_gso(state);
 	return result;
 
 revert:
@@ -25,6 +100,39 @@ revert:
 	return result;
 }
 
+static verdict translate_first(struct xlation *state)
+{
+	struct translation_steps *steps;
+
+	/*
+	 * TCP and UDP skip the steps table, because indirect calls are
+	 * expensive when retpolines are enabled. The table is still the
+	 * reference; keep both in sync.
+	 */
+	switch (pkt_l3_proto(&state->in)) {
+	case L3PROTO_IPV6:
+		if (pkt_l4_proto(&state->in) == L4PROTO_TCP)
+			return run_steps(state, ttp64_alloc_skb, ttp64_ipv4,
+					ttp64_tcp);
+		if (pkt_l4_proto(&state->in) == L4PROTO_UDP)
+			return run_steps(state, ttp64_alloc_skb, ttp64_ipv4,
+					ttp64_udp);
+		break;
+	case L3PROTO_IPV4:
+		if (pkt_l4_proto(&state->in) == L4PROTO_TCP)
+			return run_steps(state, ttp46_alloc_skb, ttp46_ipv6,
+					ttp46_tcp);
+		if (pkt_l4_proto(&state->in) == L4PROTO_UDP)
+			return run_steps(state, ttp46_alloc_skb, ttp46_ipv6,
+					ttp46_udp);
+		break;
+	}
+
+	steps = ttpcomm_get_steps(&state->in);
+	return run_steps(state, steps->skb_alloc_fn, steps->l3_hdr_fn,
+			steps->l3_payload_fn);
+}
+
 static verdict translate_subsequent(struct xlation *state, struct sk_buff *in,
 		struct sk_buff **out)
 {
@@ -44,7 +152,7 @@ static verdict translate_subsequent(struct xlation *state, struct sk_buff *in,
 		break;
 	}
 
-	result = alloc_skb(LL_MAX_HEADER + hdrs_len + in->len, GFP_ATOMIC);
+	result = skbpool_alloc(LL_MAX_HEADER + hdrs_len + in->len);
 	if (!result) {
 		inc_stats(&state->in, IPSTATS_MIB_INDISCARDS);
 		return VERDICT_DROP;
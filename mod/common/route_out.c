@@ -1,47 +1,80 @@
 #include "nat64/mod/common/route.h"
 
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/netdevice.h>
+#include <linux/percpu.h>
 #include <linux/version.h>
+#include <net/dst.h>
 #include <net/flow.h>
+#include <net/ip6_fib.h>
 #include <net/ip6_route.h>
 #include <net/route.h>
 #include "nat64/mod/common/ipv6_hdr_iterator.h"
+#include "nat64/mod/common/linux_version.h"
 
 /**
- * Callers of this function need to mind hairpinning. What happens if @daddr
- * belongs to the translator?
+ * A NAT64 session keeps talking to the same node, so its translated packets
+ * keep yielding the same flow. SIIT has no sessions, but its traffic tends to
+ * head towards a handful of destinations all the same. Each CPU remembers the
+ * routes its recent flows led to, so most packets don't need a FIB lookup.
  *
- * The @pkt can be NULL. If this happens, make sure the resulting dst is
- * dst_release()d.
+ * Direct-mapped, so a query is one hash and one memcmp(). An entry is
+ * considered stale once the namespace's routing generation or @generation (see
+ * below) moves on. Otherwise it is still revalidated through dst_check() (ie.
+ * the FIB's own obsolescence tracking) every time it is about to be reused.
  */
-struct dst_entry *__route4(struct route4_args *args, struct sk_buff *skb)
-{
-	struct flowi4 flow;
-	struct rtable *table;
+#define ROUTE_CACHE_SLOTS 64
+
+struct route_cache_slot {
+	struct net *ns;
+	l3_protocol proto;
+	union {
+		struct flowi4 v4;
+		struct flowi6 v6;
+	} flow;
+	/** NULL means the slot is empty. */
 	struct dst_entry *dst;
+	/** The IPv6 FIB's version of @dst's node, for dst_check(). */
+	u32 cookie;
+	/** @generation when the slot was filled. */
+	unsigned int gen;
+	/** The namespace's routing generation when the slot was filled. */
+	int fib_gen;
+};
 
-	/*
-	 * Sometimes Jool needs to route prematurely,
-	 * so don't sweat this on the normal pipelines.
+struct route_cache {
+	/**
+	 * Only ever contended when route_cache_flush() visits from another
+	 * CPU.
 	 */
-	if (skb) {
-		dst = skb_dst(skb);
-		if (dst)
-			return dst;
-	}
+	spinlock_t lock;
+	struct route_cache_slot slots[ROUTE_CACHE_SLOTS];
+};
 
+/** NULL means the cache is disabled. */
+static struct route_cache __percpu *cache;
+/**
+ * Bumped whenever an interface changes state, which invalidates every slot
+ * at once.
+ */
+static atomic_t generation = ATOMIC_INIT(0);
+
+static void init_flow4(struct route4_args *args, struct flowi4 *flow)
+{
 	/**
 	 * The flowi's XFRM fields don't matter because "any protocols that
 	 * protect IP header information are essentially incompatible with
 	 * NAT64" (RFC 6146).
 	 */
 
-	memset(&flow, 0, sizeof(flow));
-	/* flow.flowi4_oif; */
-	/* flow.flowi4_iif; */
-	flow.flowi4_mark = args->mark;
-	flow.flowi4_tos = args->tos;
-	flow.flowi4_scope = RT_SCOPE_UNIVERSE;
-	flow.flowi4_proto = args->proto;
+	memset(flow, 0, sizeof(*flow));
+	/* flow->flowi4_oif; */
+	/* flow->flowi4_iif; */
+	flow->flowi4_mark = args->mark;
+	flow->flowi4_tos = args->tos;
+	flow->flowi4_scope = RT_SCOPE_UNIVERSE;
+	flow->flowi4_proto = args->proto;
 	/*
 	 * TODO (help) Don't know if we should set FLOWI_FLAG_PRECOW_METRICS.
 	 * Does the kernel ever create routes on Jool's behalf?
@@ -49,12 +82,12 @@ struct dst_entry *__route4(struct route4_args *args, struct sk_buff *skb)
 	 * virtual-interfaceless support). If you change it, the corresponding
 	 * attribute in route6() should probably follow.
 	 */
-	flow.flowi4_flags = 0;
+	flow->flowi4_flags = 0;
 	/* Only used by XFRM ATM (kernel/Documentation/networking/secid.txt). */
-	/* flow.flowi4_secid; */
+	/* flow->flowi4_secid; */
 	/* It appears this one only introduces harmful noise. */
-	/* flow.saddr = saddr; */
-	flow.daddr = args->daddr.s_addr;
+	/* flow->saddr = saddr; */
+	flow->daddr = args->daddr.s_addr;
 
 	/*
 	 * I'm no longer setting fl4_sport, fl4_dport, fl4_icmp_type nor
@@ -62,12 +95,18 @@ struct dst_entry *__route4(struct route4_args *args, struct sk_buff *skb)
 	 * the respective fields yet, and 2) I can't find any users of them
 	 * aside from XFRM code.
 	 */
+}
+
+static struct dst_entry *lookup4(struct net *ns, struct flowi4 *flow)
+{
+	struct rtable *table;
+	struct dst_entry *dst;
 
 	/*
 	 * I'm using neither ip_route_output_key() nor ip_route_output_flow()
 	 * because they only add XFRM overhead.
 	 */
-	table = __ip_route_output_key(args->ns, &flow);
+	table = __ip_route_output_key(ns, flow);
 	if (!table || IS_ERR(table)) {
 		log_debug("__ip_route_output_key() returned %ld. Cannot route packet.",
 				PTR_ERR(table));
@@ -87,6 +126,35 @@ struct dst_entry *__route4(struct route4_args *args, struct sk_buff *skb)
 	}
 
 	log_debug("Packet routed via device '%s'.", dst->dev->name);
+	return dst;
+}
+
+/**
+ * Callers of this function need to mind hairpinning. What happens if @daddr
+ * belongs to the translator?
+ *
+ * The @pkt can be NULL. If this happens, make sure the resulting dst is
+ * dst_release()d.
+ */
+struct dst_entry *__route4(struct route4_args *args, struct sk_buff *skb)
+{
+	struct flowi4 flow;
+	struct dst_entry *dst;
+
+	/*
+	 * Sometimes Jool needs to route prematurely,
+	 * so don't sweat this on the normal pipelines.
+	 */
+	if (skb) {
+		dst = skb_dst(skb);
+		if (dst)
+			return dst;
+	}
+
+	init_flow4(args, &flow);
+	dst = lookup4(args->ns, &flow);
+	if (!dst)
+		return NULL;
 
 	if (skb) {
 		skb_dst_set(skb, dst);
@@ -97,53 +165,53 @@ struct dst_entry *__route4(struct route4_args *args, struct sk_buff *skb)
 	return dst;
 }
 
-struct dst_entry *route4(struct net *ns, struct packet *out)
+static void init_args4(struct net *ns, struct packet *out,
+		struct route4_args *args)
 {
 	struct iphdr *hdr = pkt_ip4_hdr(out);
-	struct route4_args args = {
-			.ns = ns,
-			.daddr.s_addr = hdr->daddr,
-			.tos = hdr->tos,
-			.proto = hdr->protocol,
-			.mark = out->skb->mark,
-	};
+
+	args->ns = ns;
+	args->daddr.s_addr = hdr->daddr;
+	args->tos = hdr->tos;
+	args->proto = hdr->protocol;
+	args->mark = out->skb->mark;
+}
+
+struct dst_entry *route4(struct net *ns, struct packet *out)
+{
+	struct route4_args args;
+	init_args4(ns, out, &args);
 	return __route4(&args, out->skb);
 }
 
-struct dst_entry *__route6(struct net *ns, struct sk_buff *skb,
-		l4_protocol proto)
+static void init_flow6(struct sk_buff *skb, l4_protocol proto,
+		struct flowi6 *flow)
 {
 	struct ipv6hdr *hdr_ip = ipv6_hdr(skb);
-	struct flowi6 flow;
-	struct dst_entry *dst;
 	struct hdr_iterator iterator;
 
-	dst = skb_dst(skb);
-	if (dst)
-		return dst;
-
 	hdr_iterator_init(&iterator, hdr_ip);
 	hdr_iterator_last(&iterator);
 
-	memset(&flow, 0, sizeof(flow));
+	memset(flow, 0, sizeof(*flow));
 	/* flow->flowi6_oif; */
 	/* flow->flowi6_iif; */
-	flow.flowi6_mark = skb->mark;
+	flow->flowi6_mark = skb->mark;
 	/*
 	 * BTW: They removed this because nobody was using it.
 	 * https://github.com/torvalds/linux/commit/69716a2b51aeb68fe295c0d09e26c8781eacebde
 	 * Perhaps we don't gain anything from it either.
 	 */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 6, 0)
-	flow.flowi6_tos = get_traffic_class(hdr_ip);
+	flow->flowi6_tos = get_traffic_class(hdr_ip);
 #endif
-	flow.flowi6_scope = RT_SCOPE_UNIVERSE;
-	flow.flowi6_proto = iterator.hdr_type;
-	flow.flowi6_flags = 0;
+	flow->flowi6_scope = RT_SCOPE_UNIVERSE;
+	flow->flowi6_proto = iterator.hdr_type;
+	flow->flowi6_flags = 0;
 	/* flow->flowi6_secid; */
-	flow.saddr = hdr_ip->saddr;
-	flow.daddr = hdr_ip->daddr;
-	flow.flowlabel = get_flow_label(hdr_ip);
+	flow->saddr = hdr_ip->saddr;
+	flow->daddr = hdr_ip->daddr;
+	flow->flowlabel = get_flow_label(hdr_ip);
 	{
 		union {
 			struct tcphdr *tcp;
@@ -154,25 +222,30 @@ struct dst_entry *__route6(struct net *ns, struct sk_buff *skb,
 		switch (proto) {
 		case L4PROTO_TCP:
 			hdr.tcp = tcp_hdr(skb);
-			flow.fl6_sport = hdr.tcp->source;
-			flow.fl6_dport = hdr.tcp->dest;
+			flow->fl6_sport = hdr.tcp->source;
+			flow->fl6_dport = hdr.tcp->dest;
 			break;
 		case L4PROTO_UDP:
 			hdr.udp = udp_hdr(skb);
-			flow.fl6_sport = hdr.udp->source;
-			flow.fl6_dport = hdr.udp->dest;
+			flow->fl6_sport = hdr.udp->source;
+			flow->fl6_dport = hdr.udp->dest;
 			break;
 		case L4PROTO_ICMP:
 			hdr.icmp6 = icmp6_hdr(skb);
-			flow.fl6_icmp_type = hdr.icmp6->icmp6_type;
-			flow.fl6_icmp_code = hdr.icmp6->icmp6_code;
+			flow->fl6_icmp_type = hdr.icmp6->icmp6_type;
+			flow->fl6_icmp_code = hdr.icmp6->icmp6_code;
 			break;
 		case L4PROTO_OTHER:
 			break;
 		}
 	}
+}
 
-	dst = ip6_route_output(ns, NULL, &flow);
+static struct dst_entry *lookup6(struct net *ns, struct flowi6 *flow)
+{
+	struct dst_entry *dst;
+
+	dst = ip6_route_output(ns, NULL, flow);
 	if (!dst) {
 		log_debug("ip6_route_output() returned NULL. Cannot route packet.");
 		return NULL;
@@ -185,6 +258,24 @@ struct dst_entry *__route6(struct net *ns, struct sk_buff *skb,
 	}
 
 	log_debug("Packet routed via device '%s'.", dst->dev->name);
+	return dst;
+}
+
+struct dst_entry *__route6(struct net *ns, struct sk_buff *skb,
+		l4_protocol proto)
+{
+	struct flowi6 flow;
+	struct dst_entry *dst;
+
+	dst = skb_dst(skb);
+	if (dst)
+		return dst;
+
+	init_flow6(skb, proto, &flow);
+	dst = lookup6(ns, &flow);
+	if (!dst)
+		return NULL;
+
 	skb_dst_set(skb, dst);
 	return dst;
 }
@@ -206,3 +297,268 @@ struct dst_entry *route(struct net *ns, struct packet *pkt)
 	WARN(true, "Unsupported network protocol: %u.", pkt_l3_proto(pkt));
 	return NULL;
 }
+
+void route_hint_init(struct route_hint *hint)
+{
+	hint->dst = NULL;
+}
+
+void route_hint_clean(struct route_hint *hint)
+{
+	if (hint->dst)
+		dst_release(hint->dst);
+	hint->dst = NULL;
+}
+
+static void route_hint_update(struct route_hint *hint, l3_protocol proto,
+		void *flow, size_t flow_size, struct dst_entry *dst)
+{
+	route_hint_clean(hint);
+	hint->proto = proto;
+	memcpy(&hint->flow, flow, flow_size);
+	hint->dst = dst_clone(dst);
+}
+
+static bool route_hint_matches(struct route_hint *hint, l3_protocol proto,
+		void *flow, size_t flow_size)
+{
+	return hint->dst && hint->proto == proto
+			&& memcmp(&hint->flow, flow, flow_size) == 0;
+}
+
+static void slot_clean(struct route_cache_slot *slot)
+{
+	if (slot->dst)
+		dst_release(slot->dst);
+	slot->dst = NULL;
+}
+
+/**
+ * Forgets the routes that belong to @ns. (Or all of them, if @ns is NULL.)
+ * The namespace is about to die; its pointer might be recycled, and its
+ * devices shouldn't be kept referenced.
+ */
+void route_cache_flush(struct net *ns)
+{
+	struct route_cache *rc;
+	unsigned int cpu;
+	unsigned int i;
+
+	if (!cache)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		rc = per_cpu_ptr(cache, cpu);
+		spin_lock_bh(&rc->lock);
+		for (i = 0; i < ROUTE_CACHE_SLOTS; i++)
+			if (!ns || rc->slots[i].ns == ns)
+				slot_clean(&rc->slots[i]);
+		spin_unlock_bh(&rc->lock);
+	}
+}
+
+static int route_cache_netdev_event(struct notifier_block *nb,
+		unsigned long event, void *ptr)
+{
+	switch (event) {
+	case NETDEV_UNREGISTER:
+		/*
+		 * The slots reference the device through their dsts, so waiting
+		 * for them to be overridden could stall the unregistration.
+		 */
+		route_cache_flush(NULL);
+		/* Fall through. */
+	case NETDEV_UP:
+	case NETDEV_DOWN:
+	case NETDEV_CHANGE:
+	case NETDEV_CHANGEMTU:
+	case NETDEV_CHANGEADDR:
+		atomic_inc(&generation);
+		break;
+	}
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block route_cache_netdev_nb = {
+	.notifier_call = route_cache_netdev_event,
+};
+
+int route_cache_setup(void)
+{
+	unsigned int cpu;
+	int error;
+
+	cache = alloc_percpu(struct route_cache);
+	if (!cache)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(cache, cpu)->lock);
+
+	error = register_netdevice_notifier(&route_cache_netdev_nb);
+	if (error) {
+		free_percpu(cache);
+		cache = NULL;
+		return error;
+	}
+
+	return 0;
+}
+
+void route_cache_teardown(void)
+{
+	if (!cache)
+		return;
+
+	unregister_netdevice_notifier(&route_cache_netdev_nb);
+	route_cache_flush(NULL);
+	free_percpu(cache);
+	cache = NULL;
+}
+
+/**
+ * The kernel's own "the FIB (or the addresses) changed" counters.
+ * Older kernels don't export them; on those, dst_check() has to do.
+ */
+static int get_fib_gen(struct net *ns, l3_protocol proto)
+{
+#if LINUX_VERSION_AT_LEAST(3, 11, 0, 7, 0)
+	return (proto == L3PROTO_IPV6) ? rt_genid_ipv6(ns) : rt_genid_ipv4(ns);
+#else
+	return 0;
+#endif
+}
+
+static u32 get_cookie(l3_protocol proto, struct dst_entry *dst)
+{
+	struct rt6_info *rt;
+
+	if (proto != L3PROTO_IPV6)
+		return 0;
+
+	rt = (struct rt6_info *)dst;
+#if LINUX_VERSION_AT_LEAST(4, 2, 0, 9999, 0)
+	return rt6_get_cookie(rt);
+#else
+	return rt->rt6i_node ? rt->rt6i_node->fn_sernum : 0;
+#endif
+}
+
+static struct dst_entry *lookup(struct net *ns, l3_protocol proto, void *flow)
+{
+	return (proto == L3PROTO_IPV6)
+			? lookup6(ns, flow)
+			: lookup4(ns, flow);
+}
+
+/**
+ * lookup(), except it first queries the current CPU's route cache, and
+ * remembers the result there.
+ */
+static struct dst_entry *lookup_cached(struct net *ns, l3_protocol proto,
+		void *flow, size_t flow_size)
+{
+	struct route_cache *rc;
+	struct route_cache_slot *slot;
+	struct dst_entry *dst;
+	unsigned int gen;
+	int fib_gen;
+	u32 hash;
+
+	if (!cache)
+		return lookup(ns, proto, flow);
+
+	hash = jhash(flow, flow_size, hash_ptr(ns, 32));
+	gen = atomic_read(&generation);
+	fib_gen = get_fib_gen(ns, proto);
+
+	local_bh_disable();
+	rc = this_cpu_ptr(cache);
+	spin_lock(&rc->lock);
+
+	slot = &rc->slots[hash % ROUTE_CACHE_SLOTS];
+	if (slot->dst && slot->ns == ns && slot->proto == proto
+			&& slot->gen == gen && slot->fib_gen == fib_gen
+			&& memcmp(&slot->flow, flow, flow_size) == 0
+			&& dst_check(slot->dst, slot->cookie)) {
+		dst = dst_clone(slot->dst);
+		goto end;
+	}
+
+	slot_clean(slot);
+	dst = lookup(ns, proto, flow);
+	if (dst) {
+		slot->ns = ns;
+		slot->proto = proto;
+		memcpy(&slot->flow, flow, flow_size);
+		slot->dst = dst_clone(dst);
+		slot->cookie = get_cookie(proto, dst);
+		slot->gen = gen;
+		slot->fib_gen = fib_gen;
+	}
+	/* Fall through. */
+
+end:
+	spin_unlock(&rc->lock);
+	local_bh_enable();
+	return dst;
+}
+
+/**
+ * Same as route(), except the result is remembered in @hint, and reused if the
+ * next packet yields the same flow. Misses fall back to the route cache, if
+ * it's enabled.
+ * (The flows are memset() before being filled, so memcmp() is safe.)
+ *
+ * @hint can be NULL, in which case only the route cache is queried.
+ */
+struct dst_entry *route_hinted(struct net *ns, struct packet *pkt,
+		struct route_hint *hint)
+{
+	struct sk_buff *skb = pkt->skb;
+	struct route4_args args;
+	union {
+		struct flowi4 v4;
+		struct flowi6 v6;
+	} flow;
+	struct dst_entry *dst;
+	l3_protocol proto;
+	size_t flow_size;
+
+	if (!hint && !cache)
+		return route(ns, pkt);
+
+	dst = skb_dst(skb);
+	if (dst)
+		return dst;
+
+	proto = pkt_l3_proto(pkt);
+	switch (proto) {
+	case L3PROTO_IPV6:
+		init_flow6(skb, pkt_l4_proto(pkt), &flow.v6);
+		flow_size = sizeof(flow.v6);
+		break;
+	case L3PROTO_IPV4:
+		init_args4(ns, pkt, &args);
+		init_flow4(&args, &flow.v4);
+		flow_size = sizeof(flow.v4);
+		break;
+	default:
+		WARN(true, "Unsupported network protocol: %u.", proto);
+		return NULL;
+	}
+
+	if (hint && route_hint_matches(hint, proto, &flow, flow_size)) {
+		dst = dst_clone(hint->dst);
+	} else {
+		dst = lookup_cached(ns, proto, &flow, flow_size);
+		if (!dst)
+			return NULL;
+		if (hint)
+			route_hint_update(hint, proto, &flow, flow_size, dst);
+	}
+
+	skb_dst_set(skb, dst);
+	return dst;
+}
@@ -1,6 +1,7 @@
 #include "nat64/mod/common/rtrie.h"
 
 #include <linux/rcupdate.h>
+#include <linux/slab.h>
 
 #include "nat64/common/types.h"
 #include "nat64/mod/common/wkmalloc.h"
@@ -23,7 +24,80 @@ static __u8 bits_to_bytes(__u8 bits)
 	return (bits != 0u) ? (((bits - 1u) >> 3) + 1u) : 0u;
 }
 
-static struct rtrie_node *create_inode(struct rtrie_key *key,
+/** Inner nodes store their own keys; this is the longest one. */
+#define RTRIE_MAX_KEY_BYTES 16
+
+/** A bunch of nodes, allocated in one go. */
+struct rtrie_chunk {
+	struct list_head list_hook;
+	/** Number of nodes from this chunk that have been handed out. */
+	unsigned int used;
+	/* The nodes hang off the end. */
+};
+
+static size_t chunk_size(struct rtrie *trie)
+{
+	return max_t(size_t, PAGE_SIZE,
+			sizeof(struct rtrie_chunk) + trie->node_size);
+}
+
+static unsigned int nodes_per_chunk(struct rtrie *trie)
+{
+	return (chunk_size(trie) - sizeof(struct rtrie_chunk))
+			/ trie->node_size;
+}
+
+static struct rtrie_node *node_alloc(struct rtrie *trie)
+{
+	struct rtrie_chunk *chunk;
+	struct rtrie_node *node;
+
+	if (!list_empty(&trie->free_nodes)) {
+		node = list_first_entry(&trie->free_nodes, struct rtrie_node,
+				list_hook);
+		list_del(&node->list_hook);
+		return node;
+	}
+
+	/* The newest chunk is always the first one. */
+	chunk = list_empty(&trie->chunks) ? NULL : list_first_entry(
+			&trie->chunks, struct rtrie_chunk, list_hook);
+	if (!chunk || chunk->used == nodes_per_chunk(trie)) {
+		chunk = __wkmalloc_as(JMEM_TRIE, "Rtrie chunk", chunk_size(trie),
+				GFP_ATOMIC);
+		if (!chunk)
+			return NULL;
+		chunk->used = 0;
+		list_add(&chunk->list_hook, &trie->chunks);
+	}
+
+	node = ((void *)(chunk + 1)) + chunk->used * trie->node_size;
+	chunk->used++;
+	return node;
+}
+
+/**
+ * @node must not be reachable by readers anymore, because it can be reused
+ * right away.
+ */
+static void node_free(struct rtrie *trie, struct rtrie_node *node)
+{
+	list_add(&node->list_hook, &trie->free_nodes);
+}
+
+static void free_chunks(struct list_head *chunks)
+{
+	struct rtrie_chunk *chunk;
+	struct rtrie_chunk *tmp_chunk;
+
+	list_for_each_entry_safe(chunk, tmp_chunk, chunks, list_hook) {
+		list_del(&chunk->list_hook);
+		__wkfree_as(JMEM_TRIE, "Rtrie chunk", chunk);
+	}
+}
+
+static struct rtrie_node *create_inode(struct rtrie *trie,
+		struct rtrie_key *key,
 		struct rtrie_node *left_child,
 		struct rtrie_node *right_child)
 {
@@ -31,7 +105,11 @@ static struct rtrie_node *create_inode(struct rtrie_key *key,
 	__u8 key_len;
 
 	key_len = bits_to_bytes(key->len);
-	inode = __wkmalloc("Rtrie node", sizeof(*inode) + key_len, GFP_ATOMIC);
+	if (WARN(key_len > RTRIE_MAX_KEY_BYTES, "Key too long: %u bits",
+			key->len))
+		return NULL;
+
+	inode = node_alloc(trie);
 	if (!inode)
 		return NULL;
 
@@ -47,12 +125,12 @@ static struct rtrie_node *create_inode(struct rtrie_key *key,
 	return inode;
 }
 
-static struct rtrie_node *create_leaf(void *content, size_t content_len,
-		size_t key_offset, __u8 key_len)
+static struct rtrie_node *create_leaf(struct rtrie *trie, void *content,
+		size_t content_len, size_t key_offset, __u8 key_len)
 {
 	struct rtrie_node *leaf;
 
-	leaf = __wkmalloc("Rtrie node", sizeof(*leaf) + content_len, GFP_ATOMIC);
+	leaf = node_alloc(trie);
 	if (!leaf)
 		return NULL;
 
@@ -142,6 +220,11 @@ void rtrie_init(struct rtrie *trie, size_t size, struct mutex *lock)
 	trie->root = NULL;
 	INIT_LIST_HEAD(&trie->list);
 	trie->value_size = size;
+	INIT_LIST_HEAD(&trie->chunks);
+	INIT_LIST_HEAD(&trie->free_nodes);
+	trie->node_size = ALIGN(sizeof(struct rtrie_node)
+			+ max_t(size_t, size, RTRIE_MAX_KEY_BYTES),
+			sizeof(void *));
 	trie->lock = lock;
 }
 
@@ -154,9 +237,10 @@ void rtrie_clean(struct rtrie *trie)
 	/* rtrie_print("Destroying trie", trie); */
 	list_for_each_entry_safe(node, tmp_node, &trie->list, list_hook) {
 		list_del(&node->list_hook);
-		__wkfree("Rtrie node", node);
 		i++;
 	}
+	INIT_LIST_HEAD(&trie->free_nodes);
+	free_chunks(&trie->chunks);
 
 	log_debug("Deleted %u nodes.", i);
 	/* rtrie_print("Trie after", trie); */
@@ -236,7 +320,9 @@ static void swap_nodes(struct rtrie *trie, struct rtrie_node *old,
 	list_add(&new->list_hook, &trie->list);
 	list_del(&old->list_hook);
 
-	__wkfree("Rtrie node", old);
+	/* node_free() might hand @old out again right away. */
+	synchronize_rcu_bh();
+	node_free(trie, old);
 }
 
 static int add_to_root(struct rtrie *trie, struct rtrie_node *new)
@@ -262,7 +348,7 @@ static int add_to_root(struct rtrie *trie, struct rtrie_node *new)
 	key.bytes = new->key.bytes;
 	key.len = key_match(&root->key, &new->key);
 
-	inode = create_inode(&key, root, new);
+	inode = create_inode(trie, &key, root, new);
 	if (!inode)
 		return -ENOMEM;
 
@@ -337,7 +423,8 @@ static int add_full_collision(struct rtrie *trie, struct rtrie_node *parent,
 	}
 	inode_prefix.bytes = higher_prefix1->key.bytes;
 
-	inode = create_inode(&inode_prefix, higher_prefix1, higher_prefix2);
+	inode = create_inode(trie, &inode_prefix, higher_prefix1,
+			higher_prefix2);
 	if (!inode)
 		return -ENOMEM;
 
@@ -365,7 +452,7 @@ int rtrie_add(struct rtrie *trie, void *value, size_t key_offset, __u8 key_len)
 	bool contains_left;
 	bool contains_right;
 
-	new = create_leaf(value, trie->value_size, key_offset, key_len);
+	new = create_leaf(trie, value, trie->value_size, key_offset, key_len);
 	if (!new)
 		return -ENOMEM;
 
@@ -378,7 +465,7 @@ int rtrie_add(struct rtrie *trie, void *value, size_t key_offset, __u8 key_len)
 			swap_nodes(trie, parent, new);
 			return 0;
 		}
-		__wkfree("Rtrie node", new);
+		node_free(trie, new);
 		return -EEXIST;
 	}
 
@@ -458,6 +545,21 @@ int rtrie_find(struct rtrie *trie, struct rtrie_key *key, void *result)
 	return 0;
 }
 
+/**
+ * rtrie_find_rcu - Same as rtrie_find(), except it returns a pointer to the
+ * node's value instead of a copy (NULL if there's no node).
+ *
+ * The caller has to be inside an RCU-bh read-side critical section, and the
+ * value is only valid until it leaves it.
+ */
+const void *rtrie_find_rcu(struct rtrie *trie, struct rtrie_key *key)
+{
+	struct rtrie_node *node;
+
+	node = find_longest_common_prefix(trie, key, true);
+	return node ? (node + 1) : NULL;
+}
+
 bool rtrie_contains(struct rtrie *trie, struct rtrie_key *key)
 {
 	bool result;
@@ -492,7 +594,7 @@ int rtrie_rm(struct rtrie *trie, struct rtrie_key *key)
 		return -ESRCH;
 
 	if (node->left && node->right) {
-		new = create_inode(&node->key,
+		new = create_inode(trie, &node->key,
 				deref_updater(trie, node->left),
 				deref_updater(trie, node->right));
 		if (!new)
@@ -508,7 +610,7 @@ int rtrie_rm(struct rtrie *trie, struct rtrie_key *key)
 		deref_updater(trie, new->right)->parent = new;
 		list_add(&new->list_hook, &trie->list);
 		list_del(&node->list_hook);
-		__wkfree("Rtrie node", node);
+		node_free(trie, node);
 		return 0;
 	}
 
@@ -526,7 +628,7 @@ int rtrie_rm(struct rtrie *trie, struct rtrie_key *key)
 			synchronize_rcu_bh();
 			deref_updater(trie, node->left)->parent = parent;
 			list_del(&node->list_hook);
-			__wkfree("Rtrie node", node);
+			node_free(trie, node);
 			return 0;
 		}
 
@@ -535,14 +637,14 @@ int rtrie_rm(struct rtrie *trie, struct rtrie_key *key)
 			synchronize_rcu_bh();
 			deref_updater(trie, node->right)->parent = parent;
 			list_del(&node->list_hook);
-			__wkfree("Rtrie node", node);
+			node_free(trie, node);
 			return 0;
 		}
 
 		rcu_assign_pointer(*parent_ptr, NULL);
 		synchronize_rcu_bh();
 		list_del(&node->list_hook);
-		__wkfree("Rtrie node", node);
+		node_free(trie, node);
 
 		node = parent;
 	} while (node && node->color == COLOR_BLACK);
@@ -554,7 +656,7 @@ void rtrie_flush(struct rtrie *trie)
 {
 	struct rtrie_node *node;
 	struct rtrie_node *tmp_node;
-	struct list_head tmp_list;
+	struct list_head tmp_chunks;
 	unsigned int i = 0;
 
 	/* rtrie_print("Flushing trie", trie); */
@@ -563,15 +665,16 @@ void rtrie_flush(struct rtrie *trie)
 		goto end;
 
 	rcu_assign_pointer(trie->root, NULL);
-	list_replace_init(&trie->list, &tmp_list);
-
-	synchronize_rcu_bh();
-
-	list_for_each_entry_safe(node, tmp_node, &tmp_list, list_hook) {
+	list_for_each_entry_safe(node, tmp_node, &trie->list, list_hook) {
 		list_del(&node->list_hook);
-		__wkfree("Rtrie node", node);
 		i++;
 	}
+	INIT_LIST_HEAD(&trie->free_nodes);
+	list_replace_init(&trie->chunks, &tmp_chunks);
+
+	synchronize_rcu_bh();
+
+	free_chunks(&tmp_chunks);
 
 end:
 	log_debug("Deleted %u nodes.", i);
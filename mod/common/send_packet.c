@@ -1,11 +1,39 @@
 #include "nat64/mod/common/send_packet.h"
 
+#include <linux/module.h>
+#include <linux/netdevice.h>
 #include <linux/version.h>
+#include <net/dst.h>
+#include <net/ipv6.h>
+#include <net/neighbour.h>
 
 #include "nat64/mod/common/linux_version.h"
 #include "nat64/mod/common/icmp_wrapper.h"
 #include "nat64/mod/common/packet.h"
 #include "nat64/mod/common/route.h"
+#include "nat64/mod/common/stats.h"
+#include "nat64/mod/common/rfc6145/common.h"
+
+#ifdef BENCHMARK
+/** Drop translated packets right before they reach the network? */
+static bool discard;
+
+void sendpkt_set_discard(bool enabled)
+{
+	WRITE_ONCE(discard, enabled);
+}
+EXPORT_SYMBOL_GPL(sendpkt_set_discard);
+#endif
+
+/*
+ * Translated packets are not expected to meet the local netfilter rules again
+ * (they've already been through PREROUTING), so they can skip LOCAL_OUT,
+ * POST_ROUTING and the generic output path as long as the neighbour is ready.
+ * Off by default because it does hide them from POST_ROUTING.
+ */
+static bool fast_xmit;
+module_param(fast_xmit, bool, 0644);
+MODULE_PARM_DESC(fast_xmit, "Hand translated packets whose neighbour is resolved straight to dev_queue_xmit(), skipping LOCAL_OUT and POST_ROUTING.");
 
 static unsigned int get_nexthop_mtu(struct packet *pkt)
 {
@@ -16,15 +44,21 @@ static unsigned int get_nexthop_mtu(struct packet *pkt)
 #endif
 }
 
-static int whine_if_too_big(struct packet *in, struct packet *out)
+static int whine_if_too_big(struct xlation *state)
 {
+	struct packet *in = &state->in;
+	struct packet *out = &state->out;
 	unsigned int len;
 	unsigned int mtu;
 
 	if (pkt_l3_proto(in) == L3PROTO_IPV4 && !is_df_set(pkt_ip4_hdr(in)))
 		return 0;
 
-	len = pkt_len(out);
+	/* GSO packets will reach the wire in gso_size chunks. */
+	if (skb_is_gso(out->skb))
+		len = pkt_hdrs_len(out) + skb_shinfo(out->skb)->gso_size;
+	else
+		len = ttpcomm_out_len(state);
 	mtu = get_nexthop_mtu(out);
 	if (len > mtu) {
 		/*
@@ -41,7 +75,7 @@ static int whine_if_too_big(struct packet *in, struct packet *out)
 			mtu += 20;
 			break;
 		}
-		icmp64_send(out, ICMPERR_FRAG_NEEDED, mtu);
+		icmp64_send(state->jool.stats, out, ICMPERR_FRAG_NEEDED, mtu);
 
 		return -EINVAL;
 	}
@@ -49,12 +83,230 @@ static int whine_if_too_big(struct packet *in, struct packet *out)
 	return 0;
 }
 
+/**
+ * Sends @skb the way ip_finish_output2() and ip6_finish_output2() would, minus
+ * the hooks, if its neighbour is resolved and has a cached L2 header.
+ *
+ * Returns -EAGAIN (and leaves @skb alone) if the packet needs the full output
+ * path. Otherwise, @skb is gone.
+ */
+static int xmit_direct(struct sk_buff *skb)
+{
+	struct dst_entry *dst = skb_dst(skb);
+	struct net_device *dev = dst->dev;
+	struct neighbour *neigh;
+	int error = -EAGAIN;
+
+	/* IPsec, tunnels without L2 headers, fragmentation, loopback. */
+	if (dst->xfrm || skb_is_gso(skb) || skb->len > dst_mtu(dst))
+		return -EAGAIN;
+	if ((dev->flags & IFF_LOOPBACK) || !dev->header_ops)
+		return -EAGAIN;
+	if (skb_headroom(skb) < LL_RESERVED_SPACE(dev))
+		return -EAGAIN;
+
+	neigh = dst_neigh_lookup_skb(dst, skb);
+	if (!neigh)
+		return -EAGAIN;
+
+	if ((neigh->nud_state & NUD_CONNECTED) && READ_ONCE(neigh->hh.hh_len))
+		error = neigh_hh_output(&neigh->hh, skb);
+
+	neigh_release(neigh);
+	return error;
+}
+
+/**
+ * Puts @skb on the network. Implicit kfree_skb(@skb) here, even on failure.
+ */
+static int xmit(struct xlation *state, struct sk_buff *skb)
+{
+	int error;
+
+	if (READ_ONCE(fast_xmit)) {
+		error = xmit_direct(skb);
+		if (error != -EAGAIN)
+			return error;
+	}
+
+	/*
+	 * At time of writing, RHEL hasn't yet upgraded to the messy version of
+	 * dst_output().
+	 */
+#if LINUX_VERSION_AT_LEAST(4, 4, 0, 9999, 0)
+	return dst_output(state->jool.ns, NULL, skb);
+#else
+	return dst_output(skb);
+#endif
+}
+
+/**
+ * Returns true if @state->out is an IPv6 packet too big for its next hop.
+ * whine_if_too_big() already dropped the ones whose IPv4 counterpart had DF
+ * set, so these are the ones we're allowed to fragment.
+ *
+ * Has to be called before the in-place translation is committed, because it
+ * needs to read the incoming packet. @id will be the Identification the
+ * fragments need if the packet doesn't already have a fragment header.
+ */
+static bool must_fragment(struct xlation *state, __be32 *id)
+{
+	struct packet *out = &state->out;
+
+	if (pkt_l3_proto(out) != L3PROTO_IPV6 || skb_is_gso(out->skb))
+		return false;
+	if (ttpcomm_out_len(state) <= get_nexthop_mtu(out))
+		return false;
+
+	/* Same as the translation does for fragments. (RFC 6145 section 4.1) */
+	*id = cpu_to_be32(be16_to_cpu(pkt_ip4_hdr(&state->in)->id));
+	return true;
+}
+
+/**
+ * Copies bytes @offset through @offset + @len of @skb's IPv6 payload (starting
+ * at @data_off) into a new fragment whose headers are @skb's IPv6 header and
+ * @tmpl.
+ */
+static struct sk_buff *build_fragment(struct sk_buff *skb,
+		unsigned int data_off, struct frag_hdr *tmpl,
+		__u16 frag_off, unsigned int offset, unsigned int len)
+{
+	struct net_device *dev = skb_dst(skb)->dev;
+	struct sk_buff *frag;
+	struct ipv6hdr *hdr6;
+	struct frag_hdr *hdr_frag;
+
+	frag = alloc_skb(LL_RESERVED_SPACE(dev) + sizeof(*hdr6)
+			+ sizeof(*hdr_frag) + len, GFP_ATOMIC);
+	if (!frag)
+		return NULL;
+
+	skb_reserve(frag, LL_RESERVED_SPACE(dev));
+	skb_reset_network_header(frag);
+	hdr6 = (struct ipv6hdr *)skb_put(frag, sizeof(*hdr6));
+	*hdr6 = *ipv6_hdr(skb);
+	hdr6->nexthdr = NEXTHDR_FRAGMENT;
+	hdr6->payload_len = cpu_to_be16(sizeof(*hdr_frag) + len);
+
+	hdr_frag = (struct frag_hdr *)skb_put(frag, sizeof(*hdr_frag));
+	*hdr_frag = *tmpl;
+	hdr_frag->frag_off = cpu_to_be16(frag_off);
+	skb_set_transport_header(frag, sizeof(*hdr6) + sizeof(*hdr_frag));
+
+	if (skb_copy_bits(skb, data_off + offset, skb_put(frag, len), len)) {
+		kfree_skb(frag);
+		return NULL;
+	}
+
+	frag->protocol = htons(ETH_P_IPV6);
+	frag->mark = skb->mark;
+	frag->dev = dev;
+	skb_dst_set(frag, dst_clone(skb_dst(skb)));
+	return frag;
+}
+
+/**
+ * Splits @state->out (already committed, if it was translated in place) into
+ * fragments that fit its next hop, and sends them.
+ *
+ * The kernel would also do this (we set ignore_df), but it doesn't know the
+ * packet might already be a fragment, so it would stack a second fragment
+ * header on top of ours. It would also make up its own Identification, rather
+ * than derive it from the IPv4 one.
+ *
+ * Every fragment gets a copy of the same fragment header; only the offset and
+ * MF change. All of them are built before the first one is sent, so a failed
+ * allocation doesn't leak half a packet.
+ */
+static verdict send_fragments(struct xlation *state, __be32 id)
+{
+	struct sk_buff *skb = state->out.skb;
+	struct frag_hdr *hdr_frag;
+	struct frag_hdr tmpl;
+	struct sk_buff_head frags;
+	struct sk_buff *frag;
+	unsigned int data_off;
+	unsigned int payload_len;
+	unsigned int max_len;
+	unsigned int offset;
+	unsigned int len;
+	__u16 base;
+	bool mf;
+	int error = 0;
+
+	/* The fragments can't be checksummed by the hardware. */
+	if (skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb))
+		goto drop;
+
+	hdr_frag = pkt_frag_hdr(&state->out);
+	if (hdr_frag) {
+		/* A fragment already; the new ones are pieces of it. */
+		tmpl = *hdr_frag;
+		base = get_fragment_offset_ipv6(hdr_frag);
+		mf = is_mf_set_ipv6(hdr_frag);
+		data_off = sizeof(struct ipv6hdr) + sizeof(struct frag_hdr);
+	} else {
+		tmpl.nexthdr = ipv6_hdr(skb)->nexthdr;
+		tmpl.reserved = 0;
+		tmpl.identification = id;
+		base = 0;
+		mf = false;
+		data_off = sizeof(struct ipv6hdr);
+	}
+
+	payload_len = skb->len - data_off;
+	max_len = (get_nexthop_mtu(&state->out) - sizeof(struct ipv6hdr)
+			- sizeof(struct frag_hdr)) & ~7U;
+	log_debug("Splitting a %u-byte payload into %u-byte fragments.",
+			payload_len, max_len);
+
+	__skb_queue_head_init(&frags);
+	for (offset = 0; offset < payload_len; offset += len) {
+		len = min(max_len, payload_len - offset);
+		frag = build_fragment(skb, data_off, &tmpl,
+				(base + offset) | ((mf || offset + len < payload_len)
+						? IP6_MF : 0),
+				offset, len);
+		if (!frag) {
+			__skb_queue_purge(&frags);
+			goto drop;
+		}
+		__skb_queue_tail(&frags, frag);
+	}
+
+	kfree_skb(skb);
+	while ((frag = __skb_dequeue(&frags)) != NULL) {
+#if LINUX_VERSION_AT_LEAST(3, 16, 0, 7, 2)
+		frag->ignore_df = true;
+#else
+		frag->local_df = true;
+#endif
+		if (xmit(state, frag))
+			error = -EINVAL;
+	}
+
+	if (error) {
+		log_debug("Some fragments could not be sent.");
+		return VERDICT_DROP;
+	}
+	return VERDICT_CONTINUE;
+
+drop:
+	inc_stats(&state->out, IPSTATS_MIB_FRAGFAILS);
+	kfree_skb(skb);
+	return VERDICT_DROP;
+}
+
 verdict sendpkt_send(struct xlation *state)
 {
 	struct packet *out = &state->out;
+	bool fragment;
+	__be32 frag_id = 0;
 	int error;
 
-	if (!route(state->jool.ns, out)) {
+	if (!route_hinted(state->jool.ns, out, state->route_hint)) {
+		jstat_inc(state->jool.stats, JSTAT_FAILED_ROUTES);
 		kfree_skb(out->skb);
 		return VERDICT_ACCEPT;
 	}
@@ -62,29 +314,42 @@ verdict sendpkt_send(struct xlation *state)
 	out->skb->dev = skb_dst(out->skb)->dev;
 	log_debug("Sending skb.");
 
-	error = whine_if_too_big(&state->in, out);
+	error = whine_if_too_big(state);
 	if (error) {
+		jstat_inc(state->jool.stats, JSTAT_PKT_TOO_BIG);
 		kfree_skb(out->skb);
 		return VERDICT_DROP;
 	}
 
+	fragment = must_fragment(state, &frag_id);
+
+	/* Nothing else needs the incoming packet, so it can be recycled now. */
+	if (state->in_place) {
+		error = ttpcomm_commit_in_place(state);
+		if (error) {
+			kfree_skb(out->skb);
+			return VERDICT_DROP;
+		}
+	}
+
 #if LINUX_VERSION_AT_LEAST(3, 16, 0, 7, 2)
 	out->skb->ignore_df = true; /* FFS, kernel. */
 #else
 	out->skb->local_df = true; /* FFS, kernel. */
 #endif
 
-	/*
-	 * Implicit kfree_skb(out->skb) here.
-	 *
-	 * At time of writing, RHEL hasn't yet upgraded to the messy version of
-	 * dst_output().
-	 */
-#if LINUX_VERSION_AT_LEAST(4, 4, 0, 9999, 0)
-	error = dst_output(state->jool.ns, NULL, out->skb);
-#else
-	error = dst_output(out->skb);
+#ifdef BENCHMARK
+	if (READ_ONCE(discard)) {
+		kfree_skb(out->skb);
+		return VERDICT_CONTINUE;
+	}
 #endif
+
+	if (fragment)
+		return send_fragments(state, frag_id);
+
+	/* Implicit kfree_skb(out->skb) here. */
+	error = xmit(state, out->skb);
 	if (error) {
 		log_debug("dst_output() returned errcode %d.", error);
 		return VERDICT_DROP;
@@ -0,0 +1,93 @@
+#include "nat64/mod/common/skb_pool.h"
+
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+
+/*
+ * Enough for the fixed headers of a translated packet (plus some payload),
+ * and the link layer headroom the translator reserves.
+ */
+#define SKBPOOL_SKB_LEN (LL_MAX_HEADER + 256)
+
+static unsigned int skb_pool_size;
+module_param(skb_pool_size, uint, 0);
+MODULE_PARM_DESC(skb_pool_size, "Number of preallocated small outgoing packets each CPU keeps around. Zero disables the stashes. (Only read during module insertion.)");
+
+struct skbpool_cpu {
+	/* Locked, but only the owner CPU and the refill work ever touch it. */
+	struct sk_buff_head skbs;
+};
+
+static struct skbpool_cpu __percpu *pools;
+static struct work_struct refill_work;
+
+static void refill(struct work_struct *work)
+{
+	struct sk_buff_head *skbs;
+	struct sk_buff *skb;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		skbs = &per_cpu_ptr(pools, cpu)->skbs;
+		while (skb_queue_len(skbs) < skb_pool_size) {
+			skb = alloc_skb(SKBPOOL_SKB_LEN, GFP_KERNEL);
+			if (!skb)
+				return; /* Try again next time. */
+			skb_queue_tail(skbs, skb);
+		}
+	}
+}
+
+int skbpool_setup(void)
+{
+	unsigned int cpu;
+
+	if (!skb_pool_size)
+		return 0;
+
+	pools = alloc_percpu(struct skbpool_cpu);
+	if (!pools)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		skb_queue_head_init(&per_cpu_ptr(pools, cpu)->skbs);
+
+	INIT_WORK(&refill_work, refill);
+	refill(&refill_work);
+	return 0;
+}
+
+void skbpool_teardown(void)
+{
+	unsigned int cpu;
+
+	if (!pools)
+		return;
+
+	cancel_work_sync(&refill_work);
+	for_each_possible_cpu(cpu)
+		skb_queue_purge(&per_cpu_ptr(pools, cpu)->skbs);
+	free_percpu(pools);
+	pools = NULL;
+}
+
+/**
+ * Returns a fresh skb with at least @size bytes of tailroom, or NULL.
+ * Assumes bottom halves are disabled.
+ */
+struct sk_buff *skbpool_alloc(unsigned int size)
+{
+	struct sk_buff_head *skbs;
+	struct sk_buff *skb;
+
+	if (!pools || size > SKBPOOL_SKB_LEN)
+		return alloc_skb(size, GFP_ATOMIC);
+
+	skbs = &this_cpu_ptr(pools)->skbs;
+	skb = skb_dequeue(skbs);
+	if (skb_queue_len(skbs) < skb_pool_size / 2)
+		schedule_work(&refill_work);
+
+	return skb ? skb : alloc_skb(size, GFP_ATOMIC);
+}
@@ -1,5 +1,6 @@
 #include "nat64/mod/common/stats.h"
 
+#include <linux/math64.h>
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
 #include <linux/version.h>
@@ -8,6 +9,7 @@
 #include <net/ipv6.h>
 #include "nat64/common/types.h"
 #include "nat64/mod/common/packet.h"
+#include "nat64/mod/common/wkmalloc.h"
 
 
 static int validate_skb(struct sk_buff *skb)
@@ -100,3 +102,97 @@ void inc_stats(struct packet *pkt, int field)
 		break;
 	}
 }
+
+struct jool_stats *jstat_alloc(void)
+{
+	struct jool_stats *result;
+
+	result = wkmalloc(struct jool_stats, GFP_KERNEL);
+	if (!result)
+		return NULL;
+
+	result->cpu = alloc_percpu(struct jstat_cpu);
+	if (!result->cpu) {
+		wkfree(struct jool_stats, result);
+		return NULL;
+	}
+
+	kref_init(&result->refs);
+	return result;
+}
+
+void jstat_get(struct jool_stats *stats)
+{
+	kref_get(&stats->refs);
+}
+
+static void jstat_release(struct kref *refs)
+{
+	struct jool_stats *stats;
+	stats = container_of(refs, struct jool_stats, refs);
+	free_percpu(stats->cpu);
+	wkfree(struct jool_stats, stats);
+}
+
+void jstat_put(struct jool_stats *stats)
+{
+	kref_put(&stats->refs, jstat_release);
+}
+
+/**
+ * Token bucket. @bucket refills at @rate tokens per second, and holds up to
+ * @burst of them. Returns true (and takes a token) if it still had one.
+ *
+ * Tokens are stored times HZ, so slow rates don't round down to nothing.
+ * @bucket has to belong to the current CPU, and the caller has to keep the
+ * other contexts of this CPU away from it.
+ */
+bool jstat_bucket_take(struct jstat_bucket *bucket, unsigned int rate,
+		unsigned int burst)
+{
+	u64 capacity = (u64)max(burst, 1u) * HZ;
+	unsigned long now = jiffies;
+	unsigned long elapsed;
+
+	/* Checked first so the multiplication can't overflow. */
+	elapsed = now - bucket->stamp;
+	if (elapsed > div_u64(capacity, rate))
+		bucket->tokens = capacity;
+	else
+		bucket->tokens = min(bucket->tokens + (u64)elapsed * rate,
+				capacity);
+	bucket->stamp = now;
+
+	if (bucket->tokens < HZ)
+		return false;
+	bucket->tokens -= HZ;
+	return true;
+}
+
+/**
+ * Adds up every CPU's copy of the counters. The counters can move while this
+ * is happening, but userspace is only getting a snapshot anyway.
+ */
+void jstat_query(struct jool_stats *stats, struct jool_stats_usr *result)
+{
+	struct jstat_cpu *cpu_stats;
+	unsigned int cpu;
+	unsigned int i, p, b;
+
+	memset(result, 0, sizeof(*result));
+
+	for_each_possible_cpu(cpu) {
+		cpu_stats = per_cpu_ptr(stats->cpu, cpu);
+		for (i = 0; i < JSTAT_COUNT; i++)
+			result->counters[i] += READ_ONCE(cpu_stats->counters[i]);
+		for (i = 0; i < JSTAGE_COUNT; i++)
+			for (b = 0; b < JSTAT_LATENCY_BUCKETS; b++)
+				result->latency[i][b] += READ_ONCE(
+						cpu_stats->latency[i][b]);
+		for (i = 0; i < JHIST_COUNT; i++)
+			for (p = 0; p < JSTAT_PROTOS; p++)
+				for (b = 0; b < JSTAT_SESSION_BUCKETS; b++)
+					result->session_hist[i][p][b] +=
+						READ_ONCE(cpu_stats->session_hist[i][p][b]);
+	}
+}
@@ -0,0 +1,256 @@
+#include "nat64/mod/common/stats_page.h"
+
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/proc_fs.h>
+#include <linux/workqueue.h>
+#include "nat64/common/xlat.h"
+#include "nat64/mod/common/linux_version.h"
+#include "nat64/mod/common/stats.h"
+#include "nat64/common/types.h"
+#include "nat64/mod/common/wkmalloc.h"
+#include "nat64/mod/stateful/bib/db.h"
+
+static unsigned int stats_page_interval = 1000;
+module_param(stats_page_interval, uint, 0644);
+MODULE_PARM_DESC(stats_page_interval, "Milliseconds between refreshes of the /proc/net stats page. Zero disables the page. (Only read during instance creation.)");
+
+struct stats_page {
+	/**
+	 * The published copy. A single page, allocated on its own so mmap()
+	 * can hand it out; mappings hold their own references to it, so they
+	 * can outlive the instance.
+	 */
+	struct jool_stats_page *shared;
+	/** Refreshes @shared. */
+	struct delayed_work work;
+	/** @stats_page_interval, in jiffies, as it was during creation. */
+	unsigned long interval;
+	/**
+	 * The namespace whose instance is being published. No reference is
+	 * held; the instance owns the page, and it holds one.
+	 */
+	struct net *ns;
+};
+
+/**
+ * Fills @result with everything `--stats` reports: the counters, the memory
+ * classes and (in NAT64) the table sizes.
+ */
+void jstat_snapshot(struct xlator *jool, struct jool_stats_usr *result)
+{
+	l4_protocol proto;
+
+	jstat_query(jool->stats, result);
+	wkmalloc_query(result);
+
+	memset(result->bibs, 0, sizeof(result->bibs));
+	memset(result->sessions, 0, sizeof(result->sessions));
+	memset(result->evicted, 0, sizeof(result->evicted));
+	if (!xlat_is_nat64())
+		return;
+
+	for (proto = L4PROTO_TCP; proto < JSTAT_PROTOS; proto++) {
+		bib_count(jool->nat64.bib, proto, &result->bibs[proto]);
+		bib_count_sessions(jool->nat64.bib, proto,
+				&result->sessions[proto]);
+		bib_count_evicted(jool->nat64.bib, proto,
+				&result->evicted[proto]);
+	}
+}
+
+static char *proc_name(void)
+{
+	return xlat_is_siit() ? "jool_siit" : "jool";
+}
+
+/**
+ * The only writer of @page->shared. It snapshots into a buffer first so the
+ * odd-sequence window (during which readers spin) is just a memcpy().
+ */
+static void refresh(struct stats_page *page)
+{
+	struct jool_stats_page *shared = page->shared;
+	struct jool_stats_usr *snapshot;
+	struct xlator jool;
+
+	snapshot = wkmalloc(struct jool_stats_usr, GFP_KERNEL);
+	if (!snapshot)
+		return; /* Readers will see an old timestamp; try again later. */
+
+	/*
+	 * The instance can be replaced by configuration changes; always
+	 * publish the current one.
+	 */
+	rcu_read_lock_bh();
+	if (xlator_find_rcu(page->ns, &jool)) {
+		rcu_read_unlock_bh();
+		goto end;
+	}
+	jstat_snapshot(&jool, snapshot);
+	rcu_read_unlock_bh();
+
+	WRITE_ONCE(shared->seq, shared->seq + 1);
+	smp_wmb();
+	shared->timestamp = ktime_to_ns(ktime_get_real());
+	memcpy(&shared->stats, snapshot, sizeof(*snapshot));
+	smp_wmb();
+	WRITE_ONCE(shared->seq, shared->seq + 1);
+
+end:
+	wkfree(struct jool_stats_usr, snapshot);
+}
+
+static void refresh_work(struct work_struct *work)
+{
+	struct stats_page *page;
+
+	page = container_of(to_delayed_work(work), struct stats_page, work);
+	refresh(page);
+	schedule_delayed_work(&page->work, page->interval);
+}
+
+static int page_open(struct inode *inode, struct file *file)
+{
+#if LINUX_VERSION_AT_LEAST(5, 17, 0, 9999, 0)
+	file->private_data = pde_data(inode);
+#else
+	file->private_data = PDE_DATA(inode);
+#endif
+	return 0;
+}
+
+static ssize_t page_read(struct file *file, char __user *buf, size_t size,
+		loff_t *offset)
+{
+	struct stats_page *page = file->private_data;
+	struct jool_stats_page *copy;
+	__u32 seq;
+	ssize_t result;
+
+	copy = wkmalloc(struct jool_stats_page, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	do {
+		seq = READ_ONCE(page->shared->seq);
+		smp_rmb();
+		memcpy(copy, page->shared, sizeof(*copy));
+		smp_rmb();
+	} while ((seq & 1) || seq != READ_ONCE(page->shared->seq));
+	copy->seq = seq;
+
+	result = simple_read_from_buffer(buf, size, offset, copy,
+			sizeof(*copy));
+	wkfree(struct jool_stats_page, copy);
+	return result;
+}
+
+/**
+ * Read-only, starting at offset zero, one page at most. The page is inserted
+ * (rather than remapped) so the mapping takes its own reference to it.
+ */
+static int page_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct stats_page *page = file->private_data;
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+#if LINUX_VERSION_AT_LEAST(6, 3, 0, 9999, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(page->shared));
+}
+
+#if LINUX_VERSION_AT_LEAST(5, 6, 0, 9999, 0)
+static const struct proc_ops page_ops = {
+	.proc_open = page_open,
+	.proc_read = page_read,
+	.proc_mmap = page_mmap,
+	.proc_lseek = default_llseek,
+};
+#else
+static const struct file_operations page_ops = {
+	.owner = THIS_MODULE,
+	.open = page_open,
+	.read = page_read,
+	.mmap = page_mmap,
+	.llseek = default_llseek,
+};
+#endif
+
+/**
+ * Creates and publishes the stats page of the instance that is about to be
+ * published in @ns.
+ *
+ * Returns NULL if the page is disabled, and an ERR_PTR() if it could not be
+ * created. The caller has to make sure @ns has no other instance (and
+ * therefore, no other page).
+ */
+struct stats_page *stats_page_alloc(struct net *ns)
+{
+	struct stats_page *page;
+	int error;
+
+	BUILD_BUG_ON(sizeof(struct jool_stats_page) > PAGE_SIZE);
+
+	if (!stats_page_interval)
+		return NULL;
+
+	page = wkmalloc(struct stats_page, GFP_KERNEL);
+	if (!page)
+		return ERR_PTR(-ENOMEM);
+
+	page->shared = (struct jool_stats_page *)get_zeroed_page(GFP_KERNEL);
+	if (!page->shared) {
+		error = -ENOMEM;
+		goto page_fail;
+	}
+	wkmalloc_account(JMEM_OTHER, 1, PAGE_SIZE);
+	page->shared->size = sizeof(struct jool_stats_page);
+	INIT_DELAYED_WORK(&page->work, refresh_work);
+	page->interval = msecs_to_jiffies(stats_page_interval);
+	page->ns = ns;
+
+	if (!proc_create_data(proc_name(), 0444, ns->proc_net, &page_ops,
+			page)) {
+		log_err("Could not create /proc/net/%s.", proc_name());
+		error = -EINVAL;
+		goto proc_fail;
+	}
+
+	/* The instance is not published yet; the first refresh can wait. */
+	schedule_delayed_work(&page->work, page->interval);
+	return page;
+
+proc_fail:
+	free_page((unsigned long)page->shared);
+	wkmalloc_account(JMEM_OTHER, -1, -PAGE_SIZE);
+page_fail:
+	wkfree(struct stats_page, page);
+	return ERR_PTR(error);
+}
+
+/**
+ * Unpublishes and releases @page. Existing mappings keep the last snapshot.
+ */
+void stats_page_destroy(struct stats_page *page)
+{
+	if (!page)
+		return;
+
+	/* This waits for the ongoing reads and mmap()s. */
+	remove_proc_entry(proc_name(), page->ns->proc_net);
+	cancel_delayed_work_sync(&page->work);
+	free_page((unsigned long)page->shared);
+	wkmalloc_account(JMEM_OTHER, -1, -PAGE_SIZE);
+	wkfree(struct stats_page, page);
+}
@@ -0,0 +1,2 @@
+#define CREATE_TRACE_POINTS
+#include "nat64/mod/common/trace.h"
@@ -4,11 +4,7 @@
 void xlation_init(struct xlation *state)
 {
 	bib_session_init(&state->entries);
-	memset(&state->in.debug, 0, sizeof(state->in.debug));
-	memset(&state->out.debug, 0, sizeof(state->out.debug));
-}
-
-void xlation_clean(struct xlation *state)
-{
-	xlator_put(&state->jool);
+	state->in_place = false;
+	state->route_hint = NULL;
+	state->csum_delta.set = false;
 }
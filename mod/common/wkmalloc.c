@@ -1,5 +1,35 @@
+#include "nat64/mod/common/wkmalloc.h"
+
+DEFINE_PER_CPU(struct wkmalloc_counters, wkmalloc_counters);
+
 /**
- * This is exactly the same as kmemleak.
+ * Adds up the CPUs' wkmalloc_counters into @stats.
+ */
+void wkmalloc_query(struct jool_stats_usr *stats)
+{
+	struct wkmalloc_counters *counters;
+	long objects[JMEM_COUNT] = { 0 };
+	long bytes[JMEM_COUNT] = { 0 };
+	unsigned int i;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		counters = per_cpu_ptr(&wkmalloc_counters, cpu);
+		for (i = 0; i < JMEM_COUNT; i++) {
+			objects[i] += READ_ONCE(counters->objects[i]);
+			bytes[i] += READ_ONCE(counters->bytes[i]);
+		}
+	}
+
+	/* The sum can be briefly off if a CPU is racing us. */
+	for (i = 0; i < JMEM_COUNT; i++) {
+		stats->mem_objects[i] = (objects[i] > 0) ? objects[i] : 0;
+		stats->mem_bytes[i] = (bytes[i] > 0) ? bytes[i] : 0;
+	}
+}
+
+/**
+ * The rest of this file is exactly the same as kmemleak.
  * https://www.kernel.org/doc/Documentation/kmemleak.txt
  * I didn't want to recompile the kernel yet again so I made this.
  * It's nowhere near as good but it took much less time. Sorry.
@@ -13,7 +43,6 @@
 
 #ifdef JKMEMLEAK
 
-#include "nat64/mod/common/wkmalloc.h"
 #include "nat64/mod/common/rbtree.h"
 
 struct kmalloc_entry {
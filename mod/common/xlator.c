@@ -1,12 +1,18 @@
 #include "nat64/mod/common/xlator.h"
 
 #include <linux/sched.h>
+#include <linux/workqueue.h>
+#include <net/netns/generic.h>
 #include "nat64/common/types.h"
 #include "nat64/common/xlat.h"
 #include "nat64/mod/common/atomic_config.h"
+#include "nat64/mod/common/ingress.h"
 #include "nat64/mod/common/linux_version.h"
 #include "nat64/mod/common/nf_hook.h"
 #include "nat64/mod/common/pool6.h"
+#include "nat64/mod/common/route.h"
+#include "nat64/mod/common/stats.h"
+#include "nat64/mod/common/stats_page.h"
 #include "nat64/mod/common/wkmalloc.h"
 #include "nat64/mod/stateless/blacklist4.h"
 #include "nat64/mod/stateless/eam.h"
@@ -14,6 +20,7 @@
 #include "nat64/mod/stateful/fragment_db.h"
 #include "nat64/mod/stateful/joold.h"
 #include "nat64/mod/stateful/pool4/db.h"
+#include "nat64/mod/stateful/timer.h"
 #include "nat64/mod/stateful/bib/db.h"
 
 /**
@@ -21,13 +28,30 @@
  * namespace (@ns).
  */
 struct jool_instance {
+	/*
+	 * Packets find their instance through @jool.ns's net_generic()
+	 * storage (see struct jool_net), and every NAT64 instance runs its own
+	 * @timer, so nothing needs a global list of instances.
+	 */
 	struct xlator jool;
 
-	/*
-	 * I want to turn this into a hash table, but it doesn't seem like
-	 * @jool.ns holds anything reminiscent of an identifier...
+	/**
+	 * The NAT64 instance's expiration timer. (NULL in SIIT.)
+	 * Like @nf_ops, it survives atomic configuration; replacements inherit
+	 * it.
+	 */
+	struct jtimer *timer;
+	/**
+	 * The instance's /proc/net file. (NULL if disabled.) Survives atomic
+	 * configuration, same as @timer.
+	 */
+	struct stats_page *page;
+	/**
+	 * The tables this instance shares with others. (NULL if it has its
+	 * own.) Survives atomic configuration, same as @timer. Protected by
+	 * @lock.
 	 */
-	struct list_head list_hook;
+	struct shared_tables *shared;
 
 #if LINUX_VERSION_AT_LEAST(4, 13, 0, 9999, 0)
 	/**
@@ -37,16 +61,116 @@ struct jool_instance {
 	 * It needs to be a pointer to an array and not an array because the
 	 * ops needs to survive atomic configuration; the jool_instance needs to
 	 * be replaced but the ops needs to survive.
+	 *
+	 * NULL if the instance is hooked via @ingress instead.
 	 */
 	struct nf_hook_ops *nf_ops;
+	/** Same as @nf_ops, except for ingress mode. (See ingress.h.) */
+	struct ingress_hooks *ingress;
 #endif
+
+	/**
+	 * For replaced instances, which are destroyed once the RCU-bh grace
+	 * period elapses. (See xlator_replace().)
+	 */
+	struct rcu_head rcu;
+	/** Hook to @graveyard. */
+	struct list_head graveyard_hook;
+};
+
+/**
+ * Tables several instances are using at the same time. (See xlator_add().)
+ *
+ * Only the tables that are filled by the administrator and never by the
+ * traffic can be shared: pool6 and, in SIIT, the EAMT and blacklist4.
+ * The first instance that asks for a name lends its own tables; the following
+ * ones drop theirs and take references to these instead.
+ *
+ * Sharing is copy-on-write. Before an instance's tables are modified (see
+ * xlator_unshare()), the instance gets private copies and leaves the group.
+ * If it's the only one left, it just modifies them in place.
+ */
+struct shared_tables {
+	char name[SHARED_TABLES_NAME_LEN];
+	struct pool6 *pool6;
+	/* These are NULL in NAT64. */
+	struct eam_table *eamt;
+	struct addr4_pool *blacklist;
+	/** Number of instances using the tables. */
+	unsigned int users;
+	/** Hook to @shared_list. */
+	struct list_head hook;
 };
 
-static struct list_head __rcu *pool;
 static DEFINE_MUTEX(lock);
+/** The struct shared_tables in use. Protected by @lock. */
+static LIST_HEAD(shared_list);
+
+/**
+ * Replaced instances whose grace period is over, waiting for @reaper.
+ * (The databases they reference might need to sleep while being released, so
+ * the RCU callbacks can't destroy them themselves.)
+ */
+static LIST_HEAD(graveyard);
+static DEFINE_SPINLOCK(graveyard_lock);
+static void reap(struct work_struct *work);
+static DECLARE_WORK(reaper, reap);
+
+/** Jool's per-namespace storage. */
+struct jool_net {
+	/** Writers need to hold @lock. NULL if the namespace has no instance. */
+	struct jool_instance __rcu *instance;
+};
+
+static unsigned int jool_net_id;
+
+static struct jool_net *jool_net(struct net *ns)
+{
+	return net_generic(ns, jool_net_id);
+}
+
+#if LINUX_VERSION_AT_LEAST(4, 13, 0, 9999, 0)
+static int register_hooks(struct jool_instance *instance)
+{
+	struct net *ns = instance->jool.ns;
+	int error;
+
+	if (ingress_enabled()) {
+		instance->ingress = ingress_register(ns);
+		if (!IS_ERR(instance->ingress))
+			return 0;
+		error = PTR_ERR(instance->ingress);
+		instance->ingress = NULL;
+		return error;
+	}
+
+	instance->nf_ops = __wkmalloc("nf_hook_ops",
+			2 * sizeof(struct nf_hook_ops),
+			GFP_KERNEL);
+	if (!instance->nf_ops)
+		return -ENOMEM;
+
+	init_nf_hook_op6(&instance->nf_ops[0]);
+	init_nf_hook_op4(&instance->nf_ops[1]);
+
+	return nf_register_net_hooks(ns, instance->nf_ops, 2);
+}
+
+static void unregister_hooks(struct jool_instance *instance)
+{
+	if (instance->ingress) {
+		ingress_unregister(instance->ingress);
+		instance->ingress = NULL;
+	} else {
+		nf_unregister_net_hooks(instance->jool.ns, instance->nf_ops, 2);
+	}
+}
+#endif
 
 static void destroy_jool_instance(struct jool_instance *instance)
 {
+	jtimer_destroy(instance->timer);
+	stats_page_destroy(instance->page);
 #if LINUX_VERSION_AT_LEAST(4, 13, 0, 9999, 0)
 	__wkfree("nf_hook_ops", instance->nf_ops);
 #endif
@@ -54,12 +178,191 @@ static void destroy_jool_instance(struct jool_instance *instance)
 	wkfree(struct jool_instance, instance);
 }
 
+static void reap(struct work_struct *work)
+{
+	struct jool_instance *instance;
+	LIST_HEAD(dead);
+
+	spin_lock_bh(&graveyard_lock);
+	list_splice_init(&graveyard, &dead);
+	spin_unlock_bh(&graveyard_lock);
+
+	while (!list_empty(&dead)) {
+		instance = list_first_entry(&dead, struct jool_instance,
+				graveyard_hook);
+		list_del(&instance->graveyard_hook);
+		destroy_jool_instance(instance);
+	}
+}
+
+static void bury_jool_instance(struct rcu_head *rcu)
+{
+	struct jool_instance *instance;
+
+	instance = container_of(rcu, struct jool_instance, rcu);
+
+	spin_lock_bh(&graveyard_lock);
+	list_add_tail(&instance->graveyard_hook, &graveyard);
+	spin_unlock_bh(&graveyard_lock);
+
+	schedule_work(&reaper);
+}
+
+/**
+ * Creates a group of shared tables out of @instance's own tables, and puts
+ * @instance in it. @name can be empty, in which case nobody can join the group
+ * by name. (See xlator_add_from().) Assumes @lock is held.
+ */
+static int create_shared(struct jool_instance *instance, char *name)
+{
+	struct xlator *jool = &instance->jool;
+	struct shared_tables *tables;
+
+	tables = wkmalloc(struct shared_tables, GFP_KERNEL);
+	if (!tables)
+		return -ENOMEM;
+	strcpy(tables->name, name);
+	tables->pool6 = jool->pool6;
+	pool6_get(tables->pool6);
+	if (xlat_is_siit()) {
+		tables->eamt = jool->siit.eamt;
+		eamt_get(tables->eamt);
+		tables->blacklist = jool->siit.blacklist;
+		blacklist_get(tables->blacklist);
+	} else {
+		tables->eamt = NULL;
+		tables->blacklist = NULL;
+	}
+	tables->users = 1;
+	list_add(&tables->hook, &shared_list);
+	instance->shared = tables;
+	return 0;
+}
+
+/**
+ * Makes @instance drop its own tables and use @tables' instead. Assumes @lock
+ * is held.
+ */
+static void adopt_shared(struct jool_instance *instance,
+		struct shared_tables *tables)
+{
+	struct xlator *jool = &instance->jool;
+
+	pool6_put(jool->pool6);
+	jool->pool6 = tables->pool6;
+	pool6_get(jool->pool6);
+	if (xlat_is_siit()) {
+		eamt_put(jool->siit.eamt);
+		jool->siit.eamt = tables->eamt;
+		eamt_get(jool->siit.eamt);
+		blacklist_put(jool->siit.blacklist);
+		jool->siit.blacklist = tables->blacklist;
+		blacklist_get(jool->siit.blacklist);
+	}
+
+	tables->users++;
+	instance->shared = tables;
+	log_debug("%u instance(s) are now sharing the '%s' tables.",
+			tables->users, tables->name);
+}
+
+/**
+ * Makes @instance use the tables named @name, creating the group (out of
+ * @instance's own tables) if it doesn't exist yet. Assumes @lock is held.
+ */
+static int join_shared(struct jool_instance *instance, char *name)
+{
+	struct shared_tables *tables;
+
+	list_for_each_entry(tables, &shared_list, hook) {
+		if (tables->name[0] && strcmp(tables->name, name) == 0) {
+			adopt_shared(instance, tables);
+			return 0;
+		}
+	}
+
+	return create_shared(instance, name);
+}
+
+/**
+ * Turns @instance into a copy of @source: same configuration, the same
+ * (shared) pool6, EAMT and blacklist4, and a copy of the RFC 6791 pool.
+ * (pool4 is left empty; see xlator_add_from().) Assumes @lock is held.
+ */
+static int clone_instance(struct jool_instance *instance,
+		struct jool_instance *source)
+{
+	struct xlator *jool = &instance->jool;
+	struct xlator *src = &source->jool;
+	struct global_config *global;
+	struct addr4_pool *pool6791;
+	struct full_config *config;
+	int error;
+
+	if (!source->shared) {
+		error = create_shared(source, "");
+		if (error)
+			return error;
+	}
+	adopt_shared(instance, source->shared);
+
+	global = rcu_dereference_protected(src->global, lockdep_is_held(&lock));
+	config_copy(&global->cfg, &jool->global->cfg);
+
+	if (xlat_is_siit()) {
+		pool6791 = atomconfig_clone_pool6791(src->siit.pool6791);
+		if (!pool6791)
+			return -ENOMEM;
+		rfc6791_put(jool->siit.pool6791);
+		jool->siit.pool6791 = pool6791;
+		return 0;
+	}
+
+	config = wkmalloc(struct full_config, GFP_KERNEL);
+	if (!config)
+		return -ENOMEM;
+	bib_config_copy(src->nat64.bib, &config->bib);
+	bib_config_set(jool->nat64.bib, &config->bib);
+	joold_config_copy(src->nat64.joold, &config->joold);
+	joold_config_set(jool->nat64.joold, &config->joold);
+	fragdb_config_copy(src->nat64.frag, &config->frag);
+	fragdb_config_set(jool->nat64.frag, &config->frag);
+	wkfree(struct full_config, config);
+	return 0;
+}
+
+/**
+ * Removes @instance from its group of shared tables. (Its own references to
+ * the tables are left alone.) Assumes @lock is held.
+ */
+static void leave_shared(struct jool_instance *instance)
+{
+	struct shared_tables *tables = instance->shared;
+
+	if (!tables)
+		return;
+
+	instance->shared = NULL;
+	tables->users--;
+	if (tables->users)
+		return;
+
+	list_del(&tables->hook);
+	pool6_put(tables->pool6);
+	if (tables->eamt)
+		eamt_put(tables->eamt);
+	if (tables->blacklist)
+		blacklist_put(tables->blacklist);
+	wkfree(struct shared_tables, tables);
+}
+
 static void xlator_get(struct xlator *jool)
 {
 	get_net(jool->ns);
 
 	config_get(jool->global);
 	pool6_get(jool->pool6);
+	jstat_get(jool->stats);
 
 	if (xlat_is_siit()) {
 		eamt_get(jool->siit.eamt);
@@ -80,50 +383,60 @@ static void xlator_get(struct xlator *jool)
  */
 static int exit_net(struct net *ns)
 {
-	struct list_head *list;
+	struct jool_net *jnet = jool_net(ns);
 	struct jool_instance *instance;
 
 	mutex_lock(&lock);
 
-	list = rcu_dereference_protected(pool, lockdep_is_held(&lock));
-	list_for_each_entry(instance, list, list_hook) {
-		if (instance->jool.ns == ns) {
+	instance = rcu_dereference_protected(jnet->instance,
+			lockdep_is_held(&lock));
+	if (!instance) {
+		mutex_unlock(&lock);
+		return -ESRCH;
+	}
+
 #if LINUX_VERSION_AT_LEAST(4, 13, 0, 9999, 0)
-			nf_unregister_net_hooks(ns, instance->nf_ops, 2);
+	unregister_hooks(instance);
 #endif
 
-			/* Remove the instance from the list FIRST. */
-			list_del_rcu(&instance->list_hook);
-			mutex_unlock(&lock);
-
-			/* Then wait for the grace period. */
-			synchronize_rcu_bh();
-
-			/*
-			 * Nobody can kref_get the databases now:
-			 * Other code should not do it because of the
-			 * xlator_find() contract, and xlator_find()'s
-			 * xlator_get() already happened. Other xlator_find()'s
-			 * xlator_get()s are not going to get in the way either
-			 * because the instance is no longer listed.
-			 * So finally return everything.
-			 */
-			destroy_jool_instance(instance);
-			return 0;
-		}
-	}
-
+	/* Unpublish the instance FIRST. */
+	RCU_INIT_POINTER(jnet->instance, NULL);
+	leave_shared(instance);
 	mutex_unlock(&lock);
-	return -ESRCH;
+	config_debug_update(instance->jool.global, NULL);
+
+	/*
+	 * Then wait for the grace period. This also waits for the packets
+	 * which borrowed the instance through xlator_find_rcu().
+	 */
+	synchronize_rcu_bh();
+	/* No more packets can be routed on @ns's behalf. */
+	route_cache_flush(ns);
+
+	/*
+	 * Nobody can kref_get the databases now:
+	 * Other code should not do it because of the xlator_find() contract,
+	 * and xlator_find()'s xlator_get() already happened. Other
+	 * xlator_find()'s xlator_get()s are not going to get in the way
+	 * either because the instance is no longer published.
+	 * So finally return everything.
+	 */
+	destroy_jool_instance(instance);
+	return 0;
 }
 
 static void __net_exit joolns_exit_net(struct net *ns)
 {
 	exit_net(ns);
+	/* The joold socket has to be released before @ns is. */
+	if (xlat_is_nat64())
+		joold_barrier();
 }
 
 static struct pernet_operations joolns_ops = {
 	.exit = joolns_exit_net,
+	.id = &jool_net_id,
+	.size = sizeof(struct jool_net),
 };
 
 /**
@@ -132,22 +445,7 @@ static struct pernet_operations joolns_ops = {
  */
 int xlator_setup(void)
 {
-	struct list_head *list;
-	int error;
-
-	list = __wkmalloc("xlator DB", sizeof(struct list_head), GFP_KERNEL);
-	if (!list)
-		return -ENOMEM;
-	INIT_LIST_HEAD(list);
-	RCU_INIT_POINTER(pool, list);
-
-	error = register_pernet_subsys(&joolns_ops);
-	if (error) {
-		__wkfree("xlator DB", list);
-		return error;
-	}
-
-	return 0;
+	return register_pernet_subsys(&joolns_ops);
 }
 
 /**
@@ -157,7 +455,12 @@ int xlator_setup(void)
 void xlator_teardown(void)
 {
 	unregister_pernet_subsys(&joolns_ops);
-	__wkfree("xlator DB", rcu_dereference_raw(pool));
+	/*
+	 * Wait for the config_put_rcu()s and the replaced instances; they
+	 * point to this module's code.
+	 */
+	rcu_barrier_bh();
+	flush_work(&reaper);
 }
 
 static int init_siit(struct xlator *jool)
@@ -168,6 +471,9 @@ static int init_siit(struct xlator *jool)
 	jool->pool6 = pool6_alloc();
 	if (!jool->pool6)
 		goto pool6_fail;
+	jool->stats = jstat_alloc();
+	if (!jool->stats)
+		goto stats_fail;
 	jool->siit.eamt = eamt_alloc();
 	if (!jool->siit.eamt)
 		goto eamt_fail;
@@ -190,6 +496,8 @@ rfc6791_fail:
 blacklist_fail:
 	eamt_put(jool->siit.eamt);
 eamt_fail:
+	jstat_put(jool->stats);
+stats_fail:
 	pool6_put(jool->pool6);
 pool6_fail:
 	config_put(jool->global);
@@ -205,13 +513,16 @@ static int init_nat64(struct xlator *jool)
 	jool->pool6 = pool6_alloc();
 	if (!jool->pool6)
 		goto pool6_fail;
-	jool->nat64.frag = fragdb_alloc(jool->ns);
+	jool->stats = jstat_alloc();
+	if (!jool->stats)
+		goto stats_fail;
+	jool->nat64.frag = fragdb_alloc(jool->ns, jool->stats);
 	if (!jool->nat64.frag)
 		goto fragdb_fail;
 	jool->nat64.pool4 = pool4db_alloc();
 	if (!jool->nat64.pool4)
 		goto pool4_fail;
-	jool->nat64.bib = bib_alloc();
+	jool->nat64.bib = bib_alloc(jool->ns, jool->stats);
 	if (!jool->nat64.bib)
 		goto bib_fail;
 	jool->nat64.joold = joold_alloc(jool->ns);
@@ -232,6 +543,8 @@ bib_fail:
 pool4_fail:
 	fragdb_put(jool->nat64.frag);
 fragdb_fail:
+	jstat_put(jool->stats);
+stats_fail:
 	pool6_put(jool->pool6);
 pool6_fail:
 	config_put(jool->global);
@@ -239,16 +552,10 @@ config_fail:
 	return -ENOMEM;
 }
 
-/**
- * xlator_add - Whenever called, starts translation of packets traveling through
- * the namespace running in the caller's context.
- * @result: Will be initialized with a reference to the new translator. Send
- *     NULL if you're not interested.
- */
-int xlator_add(struct xlator *result)
+static int add(struct net *from, char *tables, struct xlator *result)
 {
-	struct list_head *list;
 	struct jool_instance *instance;
+	struct jool_instance *source;
 	struct net *ns;
 	int error;
 
@@ -265,6 +572,9 @@ int xlator_add(struct xlator *result)
 	}
 
 	instance->jool.ns = ns;
+	instance->timer = NULL;
+	instance->page = NULL;
+	instance->shared = NULL;
 	error = xlat_is_siit()
 			? init_siit(&instance->jool)
 			: init_nat64(&instance->jool);
@@ -275,18 +585,20 @@ int xlator_add(struct xlator *result)
 	}
 
 #if LINUX_VERSION_AT_LEAST(4, 13, 0, 9999, 0)
-	instance->nf_ops = __wkmalloc("nf_hook_ops",
-			2 * sizeof(struct nf_hook_ops),
-			GFP_KERNEL);
-	if (!instance->nf_ops) {
-		destroy_jool_instance(instance);
-		return -ENOMEM;
-	}
+	instance->nf_ops = NULL;
+	instance->ingress = NULL;
+#endif
 
-	init_nf_hook_op6(&instance->nf_ops[0]);
-	init_nf_hook_op4(&instance->nf_ops[1]);
+	if (!xlat_is_siit()) {
+		instance->timer = jtimer_alloc(ns);
+		if (!instance->timer) {
+			destroy_jool_instance(instance);
+			return -ENOMEM;
+		}
+	}
 
-	error = nf_register_net_hooks(ns, instance->nf_ops, 2);
+#if LINUX_VERSION_AT_LEAST(4, 13, 0, 9999, 0)
+	error = register_hooks(instance);
 	if (error) {
 		destroy_jool_instance(instance);
 		return error;
@@ -307,8 +619,35 @@ int xlator_add(struct xlator *result)
 		goto mutex_fail;
 	}
 
-	list = rcu_dereference_protected(pool, lockdep_is_held(&lock));
-	list_add_tail_rcu(&instance->list_hook, list);
+	/* Needs to happen after the check; the file name is per namespace. */
+	instance->page = stats_page_alloc(ns);
+	if (IS_ERR(instance->page)) {
+		error = PTR_ERR(instance->page);
+		instance->page = NULL;
+		goto mutex_fail;
+	}
+
+	if (from) {
+		source = rcu_dereference_protected(jool_net(from)->instance,
+				lockdep_is_held(&lock));
+		if (!source) {
+			log_err("The source namespace doesn't have a Jool instance.");
+			error = -ESRCH;
+			goto mutex_fail;
+		}
+		error = clone_instance(instance, source);
+		if (error)
+			goto mutex_fail;
+	} else if (tables) {
+		error = join_shared(instance, tables);
+		if (error)
+			goto mutex_fail;
+	}
+
+	rcu_assign_pointer(jool_net(ns)->instance, instance);
+	config_debug_update(NULL, instance->jool.global);
+	if (instance->timer)
+		jtimer_kick(instance->timer);
 
 	if (result) {
 		xlator_get(&instance->jool);
@@ -319,11 +658,50 @@ int xlator_add(struct xlator *result)
 	return 0;
 
 mutex_fail:
+	leave_shared(instance);
 	mutex_unlock(&lock);
+#if LINUX_VERSION_AT_LEAST(4, 13, 0, 9999, 0)
+	unregister_hooks(instance);
+#endif
 	destroy_jool_instance(instance);
 	return error;
 }
 
+/**
+ * xlator_add - Whenever called, starts translation of packets traveling through
+ * the namespace running in the caller's context.
+ * @result: Will be initialized with a reference to the new translator. Send
+ *     NULL if you're not interested.
+ */
+int xlator_add(struct xlator *result)
+{
+	return add(NULL, NULL, result);
+}
+
+/**
+ * xlator_add_shared - Same as xlator_add(), except the new instance borrows the
+ * tables of the other instances that were added with the same @tables name.
+ * (See struct shared_tables.) NULL means the instance gets its own tables.
+ */
+int xlator_add_shared(char *tables, struct xlator *result)
+{
+	return add(NULL, tables, result);
+}
+
+/**
+ * xlator_add_from - Same as xlator_add(), except the new instance starts as a
+ * copy of the one in namespace @from: it gets the same configuration, and
+ * shares its pool6 (and EAMT and blacklist4, in SIIT). This is much cheaper
+ * than loading the same configuration file over and over.
+ *
+ * pool4 is not copied; two NAT64s masking behind the same addresses would
+ * step on each other's connections.
+ */
+int xlator_add_from(struct net *from, struct xlator *result)
+{
+	return add(from, NULL, result);
+}
+
 /**
  * xlator_rm - Whenever called, stops translation of packets traveling through
  * the namespace running in the caller's context.
@@ -355,9 +733,13 @@ int xlator_rm(void)
 	return error;
 }
 
-int xlator_replace(struct xlator *jool)
+/**
+ * @unshare: Also take the instance out of its group of shared tables? (Only
+ *     if @jool no longer points to any of them.)
+ */
+static int replace(struct xlator *jool, bool unshare)
 {
-	struct list_head *list;
+	struct jool_net *jnet = jool_net(jool->ns);
 	struct jool_instance *old;
 	struct jool_instance *new;
 
@@ -369,28 +751,207 @@ int xlator_replace(struct xlator *jool)
 
 	mutex_lock(&lock);
 
-	list = rcu_dereference_protected(pool, lockdep_is_held(&lock));
-	list_for_each_entry_rcu(old, list, list_hook) {
-		if (old->jool.ns == new->jool.ns) {
-			/* The comments at exit_net() also apply here. */
+	old = rcu_dereference_protected(jnet->instance, lockdep_is_held(&lock));
+	if (!old) {
+		mutex_unlock(&lock);
+		new->timer = NULL;
+		new->page = NULL;
+		new->shared = NULL;
 #if LINUX_VERSION_AT_LEAST(4, 13, 0, 9999, 0)
-			new->nf_ops = old->nf_ops;
+		new->nf_ops = NULL;
+		new->ingress = NULL;
 #endif
-			list_replace_rcu(&old->list_hook, &new->list_hook);
-			mutex_unlock(&lock);
-
-			synchronize_rcu_bh();
+		destroy_jool_instance(new);
+		return -ESRCH;
+	}
 
+	/* The comments at exit_net() also apply here. */
+	new->timer = old->timer;
+	new->page = old->page;
+	new->shared = old->shared;
+	old->shared = NULL;
+	if (unshare)
+		leave_shared(new);
 #if LINUX_VERSION_AT_LEAST(4, 13, 0, 9999, 0)
-			old->nf_ops = NULL;
+	new->nf_ops = old->nf_ops;
+	new->ingress = old->ingress;
 #endif
-			destroy_jool_instance(old);
-			return 0;
-		}
+	rcu_assign_pointer(jnet->instance, new);
+	/* The new configuration might want things to die sooner. */
+	if (new->timer)
+		jtimer_kick(new->timer);
+	mutex_unlock(&lock);
+	config_debug_update(old->jool.global, new->jool.global);
+	/* pool6 might have changed, and with it the offloaded flows. */
+	if (xlat_is_nat64())
+		bib_offload_flush(new->jool.nat64.bib);
+	xlator_refresh_clat(&new->jool);
+
+	old->timer = NULL;
+	old->page = NULL;
+#if LINUX_VERSION_AT_LEAST(4, 13, 0, 9999, 0)
+	old->nf_ops = NULL;
+	old->ingress = NULL;
+#endif
+
+	/*
+	 * Packets might still be using @old, but there's no reason to make
+	 * the request wait for them. (Userspace tends to send lots of small
+	 * changes in a row.)
+	 */
+	call_rcu_bh(&old->rcu, bury_jool_instance);
+	return 0;
+}
+
+/**
+ * xlator_refresh_clat - Recomputes the mapping of the SIIT CLAT mode (see
+ * --clat), which is derived from pool6, the EAMT and blacklist4. Has to be
+ * called after any of them changes.
+ */
+void xlator_refresh_clat(struct xlator *jool)
+{
+	struct ipv6_prefix prefix;
+	__u64 count;
+	bool eligible;
+
+	if (!xlat_is_siit())
+		return;
+
+	eligible = !pool6_count(jool->pool6, &count) && count == 1
+			&& !pool6_peek(jool->pool6, &prefix)
+			&& blacklist_is_empty(jool->siit.blacklist);
+	eamt_clat_refresh(jool->siit.eamt, eligible ? &prefix : NULL);
+}
+
+/**
+ * xlator_replace - Publishes @jool as the new version of the instance of its
+ * namespace. (See atomic_config.c.)
+ *
+ * Doesn't wait for the packets that are still being translated by the old
+ * version; it is released later, by the RCU callback and @reaper.
+ */
+int xlator_replace(struct xlator *jool)
+{
+	return replace(jool, false);
+}
+
+/**
+ * xlator_unshare - If @jool's instance is sharing its tables with other
+ * instances (see struct shared_tables), gives it private copies of them, so
+ * they can be modified without affecting the others. @jool is updated to
+ * point to the copies.
+ *
+ * The caller must keep anyone else from modifying the tables meanwhile.
+ * (The Netlink handler does this by holding its configuration semaphore.)
+ */
+int xlator_unshare(struct xlator *jool)
+{
+	struct jool_instance *instance;
+	struct xlator copy;
+	bool shared;
+	int error = -ENOMEM;
+
+	mutex_lock(&lock);
+	instance = rcu_dereference_protected(jool_net(jool->ns)->instance,
+			lockdep_is_held(&lock));
+	shared = instance && instance->shared && instance->shared->users > 1;
+	mutex_unlock(&lock);
+	if (!shared)
+		return 0;
+
+	log_debug("Copying the shared tables.");
+	memcpy(&copy, jool, sizeof(copy));
+	copy.pool6 = atomconfig_clone_pool6(jool->pool6);
+	if (!copy.pool6)
+		return -ENOMEM;
+	if (xlat_is_siit()) {
+		copy.siit.eamt = atomconfig_clone_eamt(jool->siit.eamt);
+		if (!copy.siit.eamt)
+			goto eamt_fail;
+		copy.siit.blacklist = atomconfig_clone_blacklist(
+				jool->siit.blacklist);
+		if (!copy.siit.blacklist)
+			goto blacklist_fail;
+	}
+
+	error = replace(&copy, true);
+	if (error)
+		goto replace_fail;
+
+	/* Hand the clones' initial references over to @jool. */
+	pool6_put(jool->pool6);
+	jool->pool6 = copy.pool6;
+	if (xlat_is_siit()) {
+		eamt_put(jool->siit.eamt);
+		jool->siit.eamt = copy.siit.eamt;
+		blacklist_put(jool->siit.blacklist);
+		jool->siit.blacklist = copy.siit.blacklist;
+	}
+	return 0;
+
+replace_fail:
+	if (xlat_is_siit())
+		blacklist_put(copy.siit.blacklist);
+blacklist_fail:
+	if (xlat_is_siit())
+		eamt_put(copy.siit.eamt);
+eamt_fail:
+	pool6_put(copy.pool6);
+	return error;
+}
+
+/**
+ * xlator_set_global - Publishes @global as the configuration of the instance
+ * @jool belongs to. Unlike xlator_replace(), the instance itself is left
+ * alone, so this never waits for the packets in flight: they just finish
+ * translating with the configuration they started with.
+ *
+ * Takes over the caller's reference to @global, even on failure.
+ * @jool itself is not updated; it is still a snapshot of the old version.
+ */
+int xlator_set_global(struct xlator *jool, struct global_config *global)
+{
+	struct jool_instance *instance;
+	struct global_config *old;
+
+	mutex_lock(&lock);
+
+	instance = rcu_dereference_protected(jool_net(jool->ns)->instance,
+			lockdep_is_held(&lock));
+	if (!instance) {
+		mutex_unlock(&lock);
+		config_put(global);
+		return -ESRCH;
 	}
 
+	old = instance->jool.global;
+	rcu_assign_pointer(instance->jool.global, global);
+	/* The new configuration might want things to die sooner. */
+	if (instance->timer)
+		jtimer_kick(instance->timer);
+	if (xlat_is_nat64())
+		bib_offload_flush(instance->jool.nat64.bib);
 	mutex_unlock(&lock);
-	return -ESRCH;
+
+	config_debug_update(old, global);
+	/*
+	 * Readers don't take the instance's lock, so somebody might have
+	 * fetched @old just before the swap, and still be about to
+	 * config_get() it.
+	 */
+	config_put_rcu(old);
+	return 0;
+}
+
+/**
+ * Copies @instance's xlator into @result, reading the configuration pointer
+ * once. Has to happen inside a RCU-bh read-side critical section.
+ */
+static void xlator_snapshot(struct jool_instance *instance,
+		struct xlator *result)
+{
+	memcpy(result, &instance->jool, sizeof(instance->jool));
+	result->global = rcu_dereference_bh(instance->jool.global);
 }
 
 /**
@@ -404,26 +965,42 @@ int xlator_replace(struct xlator *jool)
  */
 int xlator_find(struct net *ns, struct xlator *result)
 {
-	struct list_head *list;
 	struct jool_instance *instance;
 
 	rcu_read_lock_bh();
 
-	list = rcu_dereference_bh(pool);
-	list_for_each_entry_rcu(instance, list, list_hook) {
-		if (instance->jool.ns == ns) {
-			if (result) {
-				xlator_get(&instance->jool);
-				memcpy(result, &instance->jool,
-						sizeof(instance->jool));
-			}
-			rcu_read_unlock_bh();
-			return 0;
-		}
+	instance = rcu_dereference_bh(jool_net(ns)->instance);
+	if (!instance) {
+		rcu_read_unlock_bh();
+		return -ESRCH;
+	}
+
+	if (result) {
+		xlator_snapshot(instance, result);
+		xlator_get(result);
 	}
 
 	rcu_read_unlock_bh();
-	return -ESRCH;
+	return 0;
+}
+
+/**
+ * xlator_find_rcu - Same as xlator_find(), except @result is only borrowed:
+ * No references are taken, so it is only valid until you rcu_read_unlock_bh().
+ *
+ * Meant for the packet path, which runs entirely inside a single RCU-bh read
+ * side critical section anyway. Do NOT xlator_put() @result.
+ */
+int xlator_find_rcu(struct net *ns, struct xlator *result)
+{
+	struct jool_instance *instance;
+
+	instance = rcu_dereference_bh(jool_net(ns)->instance);
+	if (!instance)
+		return -ESRCH;
+
+	xlator_snapshot(instance, result);
+	return 0;
 }
 
 /**
@@ -463,6 +1040,7 @@ void xlator_put(struct xlator *jool)
 
 	config_put(jool->global);
 	pool6_put(jool->pool6);
+	jstat_put(jool->stats);
 
 	if (xlat_is_siit()) {
 		eamt_put(jool->siit.eamt);
@@ -478,25 +1056,6 @@ void xlator_put(struct xlator *jool)
 	cfgcandidate_put(jool->newcfg);
 }
 
-int xlator_foreach(xlator_foreach_cb cb, void *args)
-{
-	struct list_head *list;
-	struct jool_instance *instance;
-	int error = 0;
-
-	rcu_read_lock_bh();
-
-	list = rcu_dereference_bh(pool);
-	list_for_each_entry_rcu(instance, list, list_hook) {
-		error = cb(&instance->jool, args);
-		if (error)
-			break;
-	}
-
-	rcu_read_unlock_bh();
-	return error;
-}
-
 void xlator_copy_config(struct xlator *jool, struct full_config *copy)
 {
 	config_copy(&jool->global->cfg, &copy->global);
@@ -1,6 +1,28 @@
 #include "nat64/mod/stateful/bib/db.h"
 
+#include <linux/bitmap.h>
+#include <linux/delay.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/nodemask.h>
+#include <linux/percpu.h>
+#include <linux/prefetch.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/seqlock.h>
+#include <linux/shrinker.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <net/ip6_checksum.h>
+#include <net/ipv6.h>
+#include <asm/unaligned.h>
 
 #include "nat64/common/constants.h"
 #include "nat64/common/str_utils.h"
@@ -8,38 +30,89 @@
 #include "nat64/mod/common/linux_version.h"
 #include "nat64/mod/common/rbtree.h"
 #include "nat64/mod/common/route.h"
+#include "nat64/mod/common/stats.h"
+#include "nat64/mod/common/trace.h"
 #include "nat64/mod/common/wkmalloc.h"
+#include "nat64/mod/stateful/bib/events.h"
+#include "nat64/mod/stateful/bib/offload.h"
 #include "nat64/mod/stateful/bib/pkt_queue.h"
+#include "nat64/mod/stateful/bib/policy.h"
 
 /*
- * TODO (performance) Maybe pack this?
+ * Fields are ordered so neither this nor tabled_session have padding holes.
+ * (Please keep it that way; these are the bulk of Jool's memory footprint.)
  */
 struct tabled_bib {
 	struct ipv6_transport_addr src6;
 	struct ipv4_transport_addr src4;
-	l4_protocol proto;
+	/* l4_protocol. Shrunk because it is always small. */
+	__u8 proto;
 	bool is_static;
+	/** Lives in a tabled_pair? (Fits in what used to be padding.) */
+	bool paired;
 
 	struct rb_node hook6;
 	struct rb_node hook4;
 
 	struct rb_root sessions;
+
+	struct rcu_head rcu;
 };
 
 /*
- * TODO (performance) Maybe pack this?
+ * The first cache line contains everything the lockless lookups and refreshes
+ * need, bar some of @dst6's bytes. (See session_cache.)
+ * On 64-bit machines, this is exactly two cache lines long.
  */
 struct tabled_session {
+	/** Hooks to the 5-tuple indexes, if they are enabled. */
+	struct hlist_node hash6_hook;
+	struct hlist_node hash4_hook;
+
+	/** MUST NOT be NULL. */
+	struct tabled_bib *bib;
+	unsigned long update_time;
+
+	struct ipv4_transport_addr dst4;
+	/* tcp_state. Shrunk because it is always small. */
+	__u8 state;
+	/**
+	 * session_timer_type. Identifies the table's expire_timer this session
+	 * is queued on. (See get_expirer().)
+	 * This used to be a pointer to the timer itself. It is shrunk to save
+	 * a whole word per session.
+	 */
+	__u8 timer : 6;
+	/**
+	 * Lives in a tabled_pair? A bit stolen from @timer, because the
+	 * session has no padding left to spare.
+	 */
+	__u8 paired : 1;
+	/**
+	 * Followed by a struct session_counters? (See session_counters().)
+	 * Also stolen from @timer.
+	 */
+	__u8 counted : 1;
+	/**
+	 * sync_stamp() of the last time the session was handed to joold.
+	 * Shrunk so it fits in what used to be padding. (See sync_due().)
+	 */
+	__u16 sync_time;
+
 	/**
 	 * We don't strictly need to store @dst6; @dst6 is always @dst4 plus the
 	 * pool6 prefix. But we store it anyway so I don't have to make more
 	 * mess constatly in this module.
+	 * (Also, the database doesn't know the pool6 prefix, and ICMP's dst6.l4
+	 * cannot be inferred from dst4.l4.)
 	 */
 	struct ipv6_transport_addr dst6;
-	struct ipv4_transport_addr dst4;
-	tcp_state state;
-	/** MUST NOT be NULL. */
-	struct tabled_bib *bib;
+
+	/**
+	 * See pke_queue.h for some thoughts on stored packets.
+	 * Almost always NULL, so it lives away from the hot fields.
+	 */
+	struct sk_buff *stored;
 
 	/**
 	 * Sessions only need one tree. The rationale is different for TCP/UDP
@@ -68,13 +141,60 @@ struct tabled_session {
 	 */
 	struct rb_node tree_hook;
 
-	unsigned long update_time;
-	/** MUST NOT be NULL. */
-	struct expire_timer *expirer;
-	struct list_head list_hook;
+	union {
+		/** Hook to one of the expire_timer's wheel slots. */
+		struct list_head list_hook;
+		/*
+		 * The list hook is always unhooked before the session is
+		 * released, so they can share the space.
+		 */
+		struct rcu_head rcu;
+	};
+};
 
-	/** See pke_queue.h for some thoughts on stored packets. */
-	struct sk_buff *stored;
+/*
+ * ICMP mappings are nearly always a BIB entry with a single session (one ping
+ * process, one destination), so ICMP creates both halves out of one object.
+ * That's one slab (and magazine) round trip per mapping instead of two, and
+ * the BIB lookup drags the session into the cache along with it.
+ *
+ * The halves are still released independently (the session might die before
+ * its static BIB entry, or the BIB half might turn out to be redundant), so
+ * the object goes back to the slab once both have been.
+ */
+struct tabled_pair {
+	struct tabled_session session;
+	struct tabled_bib bib;
+	/** Halves that haven't been released yet. */
+	atomic_t refs;
+};
+
+/*
+ * Per-session traffic accounting (see the session_counters module parameter)
+ * doesn't fit in the sessions themselves, so counted sessions are allocated
+ * from their own caches, with the counters appended at the end. Uncounted
+ * sessions don't pay anything for it.
+ *
+ * The counters are atomic because the two directions of a flow are often
+ * translated on different CPUs.
+ */
+struct session_counters {
+	atomic64_t packets_6to4;
+	atomic64_t bytes_6to4;
+	atomic64_t packets_4to6;
+	atomic64_t bytes_4to6;
+	/** jiffies of the session's creation. (See JHIST_LIFETIME.) */
+	unsigned long born;
+};
+
+struct counted_session {
+	struct tabled_session session;
+	struct session_counters counters;
+};
+
+struct counted_pair {
+	struct tabled_pair pair;
+	struct session_counters counters;
 };
 
 struct bib_session_tuple {
@@ -98,23 +218,181 @@ struct probing_session {
 	struct list_head list_hook;
 };
 
+/*
+ * Sessions are expired by means of a hashed timer wheel.
+ *
+ * Each slot of the wheel holds the sessions whose expiration date falls within
+ * a WHEEL_GRANULARITY-sized window of time. (Or one window a wheel revolution,
+ * or several, later.) Queuing or refreshing a session is therefore O(1), and
+ * the cleaner only needs to visit the slots whose windows have already ended.
+ * Sessions that still have time left when their slot is visited (because they
+ * were refreshed, or because their expiration lies more than one revolution
+ * away) are simply hashed again.
+ *
+ * The granularity is the largest power of two number of jiffies that doesn't
+ * exceed one second. (Power of two because this way the slot index survives
+ * jiffies wraparounds.)
+ */
+#define WHEEL_SHIFT ilog2(HZ)
+#define WHEEL_GRANULARITY (1UL << WHEEL_SHIFT)
+#define WHEEL_SLOTS 256
+
 struct expire_timer {
-	struct list_head sessions;
+	/** The wheel. Slots are lists of tabled_sessions. */
+	struct list_head slots[WHEEL_SLOTS];
+	/**
+	 * Start of the window of the next slot the cleaner needs to visit.
+	 * (In jiffies, and always a multiple of WHEEL_GRANULARITY.)
+	 */
+	unsigned long next_slot;
+	/** The timeout the sessions are currently hashed with. */
 	unsigned long timeout;
+	/**
+	 * The timeout the user configured. @timeout is this, unless the table
+	 * is under pressure and @adaptive. (See apply_pressure().)
+	 */
+	unsigned long base_timeout;
+	/** Does @timeout shrink as the table fills up? */
+	bool adaptive;
 	session_timer_type type;
 	fate_cb decide_fate_cb;
+	/**
+	 * Number of sessions queued in the wheel. (Including the ones the
+	 * cleaner has temporarily taken out of it.)
+	 */
+	unsigned int count;
+};
+
+#define SUBSCRIBER_BUCKETS 256
+
+/**
+ * The counters of an IPv6 "subscriber"; the group of clients that share a
+ * prefix of bib_table.subscriber_plen bits.
+ */
+struct subscriber {
+	/** The subscriber's prefix, host bits zeroed. */
+	struct in6_addr prefix;
+	unsigned int bibs;
+	unsigned int sessions;
+	/**
+	 * Token bucket that limits the rate at which the subscriber creates
+	 * connections. @tokens is what was left at jiffy @refill_time.
+	 */
+	unsigned int tokens;
+	unsigned long refill_time;
+	struct hlist_node hook;
+};
+
+#define STATIC_BUCKETS 256
+
+/**
+ * Hook of a static BIB entry to its table's static index. (See find_static4().)
+ * Kept apart from the entry, so the dynamic ones (which are the vast majority)
+ * don't have to carry it.
+ */
+struct static_node {
+	struct tabled_bib *bib;
+	struct hlist_node hook;
+	struct rcu_head rcu;
+};
+
+#define PORT_BITMAP_BUCKETS 64
+
+/**
+ * The ports of one IPv4 address that are taken by the BIB entries of a table.
+ * Lets find_available_mask() jump over taken ports instead of probing the
+ * tree for each one.
+ *
+ * The bitmaps are only hints. They are created lazily (with GFP_ATOMIC, so the
+ * creation can fail), which means a bitmap might lack a few taken ports, and
+ * the tree still has the final word. A port marked as taken, on the other
+ * hand, is always taken.
+ */
+struct port_bitmap {
+	struct in_addr addr;
+	/** Number of bits set in @ports. The bitmap dies when this hits zero. */
+	unsigned int used;
+	struct hlist_node hook;
+	/** 65536 bits; one per port. (Kept apart to dodge high-order slabs.) */
+	unsigned long *ports;
+};
+
+#define PORT_BITMAP_SIZE (BITS_TO_LONGS(65536) * sizeof(unsigned long))
+
+#define PORT_BLOCK_BUCKETS 256
+
+/**
+ * A range of ports of one pool4 address, reserved for the exclusive use of one
+ * subscriber. (RFC 7422 Port Block Allocation.)
+ *
+ * The block's ports are marked as taken in the port bitmap of @addr from the
+ * moment the block is reserved, so nobody else picks them. The block itself
+ * tracks which of them are actually in use.
+ */
+struct port_block {
+	/** The owner's prefix, host bits zeroed. */
+	struct in6_addr owner;
+	struct in_addr addr;
+	/** First port in the block. */
+	unsigned int first;
+	/** Number of bits set in @ports. The block is released when zero. */
+	unsigned int used;
+	l4_protocol proto;
+	struct hlist_node hook;
+	/* One bit per block port (bib_table.active_block_size bits) follow. */
+	unsigned long ports[];
 };
 
+/**
+ * One shard of a protocol's BIB and session table.
+ *
+ * If sharding is disabled (bib_shards = 1), each protocol has exactly one of
+ * these and it behaves like the classic, monolithic table.
+ *
+ * Otherwise every protocol is split into @shard_count independently locked
+ * tables. The shard an entry belongs to is decided by a hash of its IPv4
+ * transport address, and the BIB entries are allocated so the hash of their
+ * IPv6 transport address points to the same shard. That way both 6-to-4 and
+ * 4-to-6 lookups always know which shard (and therefore which spinlock) they
+ * need, without ever touching the other ones.
+ */
 struct bib_table {
 	/** Indexes the entries using their IPv6 identifiers. */
 	struct rb_root tree6;
 	/** Indexes the entries using their IPv4 identifiers. */
 	struct rb_root tree4;
 
+	/**
+	 * Optional exact-match indexes of the sessions, keyed by their full
+	 * IPv6 (src6, dst6) and IPv4 (src4, dst4) 5-tuples, respectively.
+	 * They are only meant for packet lookups; the trees are still the
+	 * ones in charge of ordered iteration and mask allocation.
+	 * NULL if session_hash_bits is zero.
+	 */
+	struct hlist_head *hash6;
+	struct hlist_head *hash4;
+	/** Number of buckets in each of the indexes, minus one. */
+	unsigned int hash_mask;
+
+	/**
+	 * Optional Address-Dependent Filtering prefilter. (See
+	 * adf_rejects_rcu().) A counting Bloom filter of the (BIB IPv4
+	 * transport address, remote IPv4 address) pairs of the table's
+	 * sessions. NULL if adf_filter_bits is zero, and in the TCP and ICMP
+	 * tables, since only UDP drops packets because of ADF.
+	 */
+	u8 *adf_counters;
+	/** Number of counters, minus one. */
+	unsigned int adf_mask;
+
 	/* Write BIB entries on the log as they are created and destroyed? */
 	bool log_bibs;
 	/* Write sessions on the log as they are created and destroyed? */
 	bool log_sessions;
+	/* Send the above to @events instead of the kernel log? */
+	bool log_stream;
+	/** The struct bib's event stream. */
+	struct bib_events *events;
 	/**
 	 * Is Address-Dependent Filtering active?
 	 * This is only relevant in TCP and UDP; ADF does not make sense on
@@ -125,8 +403,109 @@ struct bib_table {
 	/* Number of entries in this table. */
 	u64 bib_count;
 	u64 session_count;
+	/**
+	 * Maximum number of sessions the protocol (ie. all of its shards) can
+	 * hold. Zero means unlimited.
+	 */
+	unsigned int session_limit;
+	/**
+	 * How many times the adaptive timeouts are currently halved, because
+	 * the table is nearing @session_limit. (See apply_pressure().)
+	 */
+	unsigned int pressure_level;
+	/* Number of sessions that had to be evicted to honor @session_limit. */
+	u64 evicted;
+	/** How find_available_mask() has been faring in this table. */
+	struct pool4_stats_usr mask_stats;
+
+	/**
+	 * Length of the prefix that groups IPv6 clients into subscribers.
+	 * Zero disables the subscriber quotas, and their bookkeeping.
+	 */
+	__u8 subscriber_plen;
+	/**
+	 * Maximum BIB entries and sessions a subscriber can have in the
+	 * protocol (ie. in all of its shards). Zero means unlimited.
+	 */
+	unsigned int subscriber_max_bibs;
+	unsigned int subscriber_max_sessions;
+	/**
+	 * Maximum number of connections (new sessions) a subscriber can create
+	 * per second in the protocol. Zero means unlimited.
+	 */
+	unsigned int subscriber_max_rate;
+	/** The subscribers' counters, hashed by prefix. */
+	struct hlist_head subscribers[SUBSCRIBER_BUCKETS];
+	/** The struct port_bitmaps, hashed by address. */
+	struct hlist_head port_bitmaps[PORT_BITMAP_BUCKETS];
+	/**
+	 * The static BIB entries (as struct static_nodes), hashed by IPv4
+	 * transport address. Only the control plane changes it, so the 4-to-6
+	 * lookups of port forwards don't have to walk @tree4, among the
+	 * churning dynamic entries.
+	 */
+	struct hlist_head statics[STATIC_BUCKETS];
+
+	/**
+	 * Size of the port blocks new subscribers should reserve. Zero
+	 * disables Port Block Allocation.
+	 */
+	unsigned int block_size;
+	/**
+	 * The block size and owner prefix length the existing blocks were
+	 * created with. Only meaningful while @block_count is nonzero.
+	 * (Blocks with different parameters cannot coexist, so configuration
+	 * changes only take effect once the old blocks die.)
+	 */
+	unsigned int active_block_size;
+	__u8 active_block_plen;
+	/** Number of reserved blocks. */
+	unsigned int block_count;
+	/** The struct port_blocks, hashed by owner. */
+	struct hlist_head blocks[PORT_BLOCK_BUCKETS];
+
+	/**
+	 * Deterministic NAT: Number of trailing subscriber prefix bits that
+	 * select the subscriber's pool4 slice. Zero disables it.
+	 */
+	__u8 det_bits;
+	/** See bib_config.pool4_balance. */
+	bool balance_masks;
+	/** See bib_config.node_count and bib_config.node_id. */
+	__u8 node_count;
+	__u8 node_id;
+
+	/** See bib_config.sync_interval. */
+	unsigned long sync_interval;
+
+	/**
+	 * See bib_config.udp_short. Only the UDP tables fill this. Their
+	 * sessions towards these ports are queued on @trans_timer instead of
+	 * @est_timer, so one-shot exchanges don't squat on the table (and on
+	 * their BIB entries) for the whole UDP timeout.
+	 */
+	__u16 short_ports[UDP_SHORT_PORTS_MAX];
+	unsigned int short_port_count;
 
 	spinlock_t lock;
+	/** See table_lock(). Protected by @lock. */
+	struct {
+		/** Is the current holder of @lock being measured? */
+		bool sampled;
+		/** local_clock() at the moment the sampled holder got @lock. */
+		u64 acquired;
+		/* These are struct bib_stats_usr's lock fields. */
+		u64 samples;
+		u64 wait;
+		u64 wait_max;
+		u64 hold;
+		u64 hold_max;
+	} lock_stats;
+	/**
+	 * Bumped by anyone who modifies the trees while holding @lock.
+	 * This is what allows the lockless lookups to validate themselves.
+	 */
+	seqcount_t seq;
 
 	/** Expires this table's established sessions. */
 	struct expire_timer est_timer;
@@ -141,8 +520,9 @@ struct bib_table {
 
 	/**
 	 * Expires this table's transitory sessions.
-	 * This is initialized in the UDP/ICMP tables, but all their operations
-	 * become no-ops.
+	 * The UDP tables borrow it for their short-lived sessions. (See
+	 * @short_ports.) In the ICMP tables it's initialized, but all its
+	 * operations become no-ops.
 	 */
 	struct expire_timer trans_timer;
 	/**
@@ -151,11 +531,23 @@ struct bib_table {
 	 * become no-ops.
 	 */
 	struct expire_timer syn4_timer;
+	/**
+	 * Expires this table's dead sessions (the ones that saw a RST or both
+	 * FINs). Its timeout is bib_config.ttl.tcp_closed, or @trans_timer's
+	 * if that's zero. Initialized, but unused, in the UDP/ICMP tables.
+	 */
+	struct expire_timer closed_timer;
+	/** bib_config.ttl.tcp_closed, as the user wrote it. */
+	unsigned long closed_ttl;
 
 	/** Current number of packets (of both types) in the table. */
 	int pkt_count;
 	/** Maximum storable packets (of both types) in the table. */
 	unsigned int pkt_limit;
+	/** Maximum bytes the type 1 packets can take. (Zero is unlimited.) */
+	unsigned int pkt_byte_limit;
+	/** Store only digests of the type 1 packets? */
+	bool stateless_so;
 	/** Drop externally initiated TCP connections? */
 	bool drop_v4_syn;
 
@@ -164,2267 +556,7407 @@ struct bib_table {
 	 * This is NULL in UDP/ICMP.
 	 */
 	struct pktqueue *pkt_queue;
+
+	/** Index of this table in its protocol's shard array. */
+	unsigned int shard;
+	/** Length of this table's protocol's shard array. */
+	unsigned int shard_count;
+
+	/** Runs clean_table() on this table, in clean_wq. */
+	struct work_struct clean_work;
+	/** The database this table belongs to. (For @clean_work's sake.) */
+	struct bib *db;
+};
+
+/**
+ * The TCP probes an instance still has to send. They are sent in paced batches
+ * by @work, so a wave of idle connections expiring at once does not turn into
+ * a burst of tens of thousands of packets.
+ */
+struct probe_queue {
+	spinlock_t lock;
+	/** The probing_sessions waiting for their turn. */
+	struct list_head list;
+	/** Is @work queued or running? (It holds a BIB reference meanwhile.) */
+	bool sending;
+	struct work_struct work;
 };
 
+/** Toeplitz key bytes needed to hash two IPv4 addresses and two ports. */
+#define RSS_KEY_LEN 16
+/** Entries of the NICs' RSS indirection table. (The most common size.) */
+#define RSS_INDIR_SIZE 128
+
 struct bib {
-	/** The session table for UDP conversations. */
-	struct bib_table udp;
-	/** The session table for TCP connections. */
-	struct bib_table tcp;
-	/** The session table for ICMP conversations. */
-	struct bib_table icmp;
+	/** The session tables for UDP conversations. (One per shard.) */
+	struct bib_table *udp;
+	/** The session tables for TCP connections. (One per shard.) */
+	struct bib_table *tcp;
+	/** The session tables for ICMP conversations. (One per shard.) */
+	struct bib_table *icmp;
+	/** Where the tables send their logs if --logging-stream is enabled. */
+	struct bib_events events;
+	/** Shortcuts around the tables for established flows. */
+	struct bib_offload offload;
+	/** Decides which IPv6 packets can create entries and sessions. */
+	struct bib_policy policy;
+	/** --cps-budget. (See cps_allows().) */
+	unsigned int cps_budget;
+	/** Length of the arrays above. */
+	unsigned int shard_count;
+	/**
+	 * Namespace the TCP probes and stored packet ICMP errors are sent to.
+	 * (@events holds the reference.)
+	 */
+	struct net *ns;
+	/**
+	 * The instance's counters, and its ICMP error rate limit. Can be NULL
+	 * (unit tests).
+	 */
+	struct jool_stats *stats;
+	/** TCP probes waiting to be sent. */
+	struct probe_queue probes;
+
+	/**
+	 * Number of RX queues the port selection steers toward. Zero means
+	 * no steering. (See rss_steers().)
+	 */
+	unsigned int rss_queues;
+	/** The NICs' Toeplitz key; as much of it as a 4-tuple needs. */
+	u8 rss_key[RSS_KEY_LEN];
+
+	/**
+	 * Evicts idle sessions when the kernel runs short on memory. (See
+	 * shrink_scan().) NULL if it could not be registered, or if the kernel
+	 * is too old for it.
+	 */
+	struct shrinker *shrinker;
+#if LINUX_VERSION_AT_LEAST(3, 12, 0, 9999, 0) \
+		&& LINUX_VERSION_LOWER_THAN(6, 7, 0, 9999, 0)
+	struct shrinker shrinker_storage;
+#endif
 
 	struct kref refs;
 };
 
-static struct kmem_cache *bib_cache;
-static struct kmem_cache *session_cache;
+static unsigned int bib_shards = 1;
+module_param(bib_shards, uint, 0);
+MODULE_PARM_DESC(bib_shards, "Number of independently locked partitions of each BIB/session table. (Only read during instance creation.)");
 
-#define alloc_bib(flags) wkmem_cache_alloc("bib entry", bib_cache, flags)
-#define alloc_session(flags) wkmem_cache_alloc("session", session_cache, flags)
-#define free_bib(bib) wkmem_cache_free("bib entry", bib_cache, bib)
-#define free_session(session) wkmem_cache_free("session", session_cache, session)
+static unsigned int probe_rate = 10000;
+module_param(probe_rate, uint, 0644);
+MODULE_PARM_DESC(probe_rate, "Maximum number of TCP keepalive probes each instance sends per second. Zero means unlimited.");
 
-static struct tabled_bib *bib6_entry(const struct rb_node *node)
-{
-	return node ? rb_entry(node, struct tabled_bib, hook6) : NULL;
-}
+static unsigned int refresh_granularity = 1000;
+module_param(refresh_granularity, uint, 0644);
+MODULE_PARM_DESC(refresh_granularity, "Milliseconds a session's update time has to advance before a packet rewrites it (and moves the session in the expiration wheel). Sessions may expire up to this much early. Zero means every packet refreshes.");
 
-static struct tabled_bib *bib4_entry(const struct rb_node *node)
-{
-	return node ? rb_entry(node, struct tabled_bib, hook4) : NULL;
-}
+static unsigned int session_hash_bits;
+module_param(session_hash_bits, uint, 0);
+MODULE_PARM_DESC(session_hash_bits, "log2 of the bucket count of each table's 5-tuple session index. Zero disables the index. (Only read during instance creation.)");
 
-static struct tabled_session *node2session(const struct rb_node *node)
-{
-	return node ? rb_entry(node, struct tabled_session, tree_hook) : NULL;
-}
+static unsigned int adf_filter_bits;
+module_param(adf_filter_bits, uint, 0);
+MODULE_PARM_DESC(adf_filter_bits, "log2 of the number of counters (one byte each) of each UDP table's Address-Dependent Filtering prefilter, which lets packets from unknown remote addresses be dropped without locking the table or walking the BIB entry's sessions. Zero disables the prefilter. (Only read during instance creation.)");
+
+static unsigned int rss_steering_queues;
+module_param(rss_steering_queues, uint, 0);
+MODULE_PARM_DESC(rss_steering_queues, "Number of RX queues (each serviced by the CPU of the same index modulo this) the IPv4 NIC spreads TCP and UDP over. If nonzero, new masks are chosen so their replies hash back to the CPU that translated the first IPv6 packet. Zero disables the steering. (Only read during instance creation.)");
+
+static unsigned int clean_budget;
+module_param(clean_budget, uint, 0644);
+MODULE_PARM_DESC(clean_budget, "Maximum number of sessions each table visits (while holding its lock) per cleaning run. The rest are postponed to the next run. Zero means unlimited.");
+
+static unsigned int timeout_pressure;
+module_param(timeout_pressure, uint, 0644);
+MODULE_PARM_DESC(timeout_pressure, "Percentage of --max-sessions past which the UDP, ICMP and transitory TCP timeouts start shrinking (down to an eighth, as the table approaches the limit). Zero disables the adaptive timeouts.");
+
+static bool session_counters_enabled;
+module_param_named(session_counters, session_counters_enabled, bool, 0644);
+MODULE_PARM_DESC(session_counters, "Count the packets and bytes each session translates, in each direction. Costs 32 bytes per session, and counted sessions skip the offload cache. (Only sessions created while this is enabled are counted.)");
+
+static unsigned int arena_objects;
+module_param(arena_objects, uint, 0);
+MODULE_PARM_DESC(arena_objects, "Number of BIB entries and of sessions (each) to carve out of a contiguous region reserved during module load, instead of the slab. Extra ones still come from the slab. Zero disables the arenas. (Only read during module load.)");
+
+static bool shrink_sessions = true;
+module_param(shrink_sessions, bool, 0644);
+MODULE_PARM_DESC(shrink_sessions, "Let the kernel evict the oldest UDP, ICMP and transitory TCP sessions when it runs short on memory?");
+
+/** Lock acquisitions seen by each CPU. Decides which ones are sampled. */
+static DEFINE_PER_CPU(unsigned int, lock_sample_seq);
 
 /**
- * "[Convert] tabled BIB to BIB entry"
+ * spin_lock_bh(&table->lock), except one out of every BIB_LOCK_SAMPLING
+ * acquisitions (per CPU) is timed. (See bib_stats().)
  */
-static void tbtobe(struct tabled_bib *tabled, struct bib_entry *bib)
+static void table_lock(struct bib_table *table)
 {
-	if (!bib)
+	u64 start;
+	u64 wait;
+
+	if (likely(this_cpu_inc_return(lock_sample_seq)
+			& (BIB_LOCK_SAMPLING - 1))) {
+		spin_lock_bh(&table->lock);
+		table->lock_stats.sampled = false;
 		return;
+	}
 
-	bib->ipv6 = tabled->src6;
-	bib->ipv4 = tabled->src4;
-	bib->l4_proto = tabled->proto;
+	start = local_clock();
+	spin_lock_bh(&table->lock);
+	table->lock_stats.acquired = local_clock();
+	table->lock_stats.sampled = true;
+
+	wait = table->lock_stats.acquired - start;
+	table->lock_stats.samples++;
+	table->lock_stats.wait += wait;
+	if (wait > table->lock_stats.wait_max)
+		table->lock_stats.wait_max = wait;
 }
 
-/**
- * "[Convert] tabled session to session entry"
- */
-static void tstose(struct tabled_session *tsession,
-		struct session_entry *session)
+static void table_unlock(struct bib_table *table)
 {
-	session->src6 = tsession->bib->src6;
-	session->dst6 = tsession->dst6;
-	session->src4 = tsession->bib->src4;
-	session->dst4 = tsession->dst4;
-	session->proto = tsession->bib->proto;
-	session->state = tsession->state;
-	session->timer_type = tsession->expirer->type;
-	session->update_time = tsession->update_time;
-	session->timeout = tsession->expirer->timeout;
-	session->has_stored = !!tsession->stored;
+	u64 hold;
+
+	if (unlikely(table->lock_stats.sampled)) {
+		hold = local_clock() - table->lock_stats.acquired;
+		table->lock_stats.hold += hold;
+		if (hold > table->lock_stats.hold_max)
+			table->lock_stats.hold_max = hold;
+	}
+
+	spin_unlock_bh(&table->lock);
 }
 
-/**
- * "[Convert] tabled BIB to bib_session"
+/*
+ * Creating a flow needs a BIB entry and a session, and expiring it releases
+ * them. At high connection rates, going to the slab for each of them one by
+ * one is noticeable, so every CPU keeps a small "magazine" of spare objects.
+ * Magazines are refilled from (and drained to) the slab in batches.
  */
-static void tbtobs(struct tabled_bib *tabled, struct bib_session *bs)
-{
-	if (!bs)
-		return;
+#define MAGAZINE_SIZE 32
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
 
-	bs->bib_set = true;
-	bs->session.src6 = tabled->src6;
-	bs->session.src4 = tabled->src4;
-	bs->session.proto = tabled->proto;
-}
+struct magazine {
+	unsigned int count;
+	void *objs[MAGAZINE_SIZE];
+};
+
+#define ARENA_NIL ((u32)-1)
 
 /**
- * [Convert] tabled session to bib_session"
+ * A contiguous region the objects of a cache are carved out of before the slab
+ * is bothered. (See arena_objects.) Being virtually contiguous (and backed by
+ * huge pages where vmalloc_huge() exists), big tables take fewer TLB entries,
+ * and the objects carry no slab metadata.
+ *
+ * Free objects are linked by their 32-bit indexes, stored in their first bytes.
+ * Objects nobody has used yet are not linked at all; @unused just marks where
+ * they start, so the region doesn't need to be walked during module load.
  */
-static void tstobs(struct tabled_session *session, struct bib_session *bs)
-{
-	if (!bs)
-		return;
+struct obj_arena {
+	void *base;
+	/** Size of each object, padded the same way the slab would. */
+	size_t obj_size;
+	/** Capacity, in objects. Zero means there's no arena. */
+	u32 count;
+	/** Index of the first object that has never been handed out. */
+	u32 unused;
+	/** Index of the first recycled free object, or ARENA_NIL. */
+	u32 free;
+	spinlock_t lock;
+};
 
-	bs->bib_set = true;
-	bs->session_set = true;
-	tstose(session, &bs->session);
+struct obj_cache {
+	/* For wkmalloc's accounting and leak tracking. */
+	enum jool_mem_class class;
+	const char *name;
+	struct kmem_cache *slab;
+	struct magazine __percpu *mags;
+	struct obj_arena arena;
+};
+
+static bool arena_contains(struct obj_arena *arena, void *obj)
+{
+	return arena->count && obj >= arena->base
+			&& obj < arena->base + arena->count * arena->obj_size;
 }
 
 /**
- * One-liner to get the session table corresponding to the @proto protocol.
+ * Moves up to @max free objects out of @cache's arena, into @batch. Returns how
+ * many it got.
  */
-static struct bib_table *get_table(struct bib *db, l4_protocol proto)
+static unsigned int arena_take(struct obj_cache *cache, void **batch,
+		unsigned int max)
 {
-	switch (proto) {
-	case L4PROTO_TCP:
-		return &db->tcp;
-	case L4PROTO_UDP:
-		return &db->udp;
-	case L4PROTO_ICMP:
-		return &db->icmp;
-	case L4PROTO_OTHER:
-		break;
+	struct obj_arena *arena = &cache->arena;
+	void *obj;
+	unsigned int n;
+
+	if (!arena->count)
+		return 0;
+
+	spin_lock_bh(&arena->lock);
+	for (n = 0; n < max; n++) {
+		if (arena->free != ARENA_NIL) {
+			obj = arena->base + arena->free * arena->obj_size;
+			arena->free = *(u32 *)obj;
+		} else if (arena->unused < arena->count) {
+			obj = arena->base + arena->unused * arena->obj_size;
+			arena->unused++;
+		} else {
+			break;
+		}
+		batch[n] = obj;
 	}
+	spin_unlock_bh(&arena->lock);
 
-	WARN(true, "Unsupported transport protocol: %u.", proto);
-	return NULL;
+	wkmalloc_account(cache->class, n, n * arena->obj_size);
+	return n;
 }
 
-static void kill_stored_pkt(struct bib_table *table,
-		struct tabled_session *session)
+static void arena_put(struct obj_cache *cache, void *obj)
 {
-	if (!session->stored)
-		return;
+	struct obj_arena *arena = &cache->arena;
 
-	log_debug("Deleting stored type 2 packet.");
-	kfree_skb(session->stored);
-	session->stored = NULL;
-	table->pkt_count--;
+	spin_lock_bh(&arena->lock);
+	*(u32 *)obj = arena->free;
+	arena->free = (obj - arena->base) / arena->obj_size;
+	spin_unlock_bh(&arena->lock);
+
+	wkmalloc_account(cache->class, -1, -(long)arena->obj_size);
 }
 
-int bib_setup(void)
+/** Returns @obj to wherever it came from. */
+static void cache_release(struct obj_cache *cache, void *obj)
 {
-	bib_cache = kmem_cache_create("bib_nodes",
-			sizeof(struct tabled_bib),
-			0, 0, NULL);
-	if (!bib_cache)
-		return -ENOMEM;
-
-	session_cache = kmem_cache_create("session_nodes",
-			sizeof(struct tabled_session),
-			0, 0, NULL);
-	if (!session_cache) {
-		kmem_cache_destroy(bib_cache);
-		return -ENOMEM;
-	}
-
-	return 0;
+	if (arena_contains(&cache->arena, obj))
+		arena_put(cache, obj);
+	else
+		wkmem_cache_free(cache->class, cache->name, cache->slab, obj);
 }
 
-void bib_teardown(void)
+static struct obj_cache bib_cache = {
+	.class = JMEM_BIB,
+	.name = "bib entry",
+};
+static struct obj_cache session_cache = {
+	.class = JMEM_SESSION,
+	.name = "session",
+};
+static struct obj_cache pair_cache = {
+	.class = JMEM_SESSION,
+	.name = "ICMP pair",
+};
+static struct obj_cache counted_session_cache = {
+	.class = JMEM_SESSION,
+	.name = "counted session",
+};
+static struct obj_cache counted_pair_cache = {
+	.class = JMEM_SESSION,
+	.name = "counted ICMP pair",
+};
+
+static void *cache_alloc(struct obj_cache *cache, gfp_t flags)
 {
-	kmem_cache_destroy(bib_cache);
-	kmem_cache_destroy(session_cache);
+	void *batch[MAGAZINE_BATCH];
+	struct magazine *mag;
+	void *result;
+	unsigned int i, n;
+
+	local_bh_disable();
+	mag = this_cpu_ptr(cache->mags);
+	if (mag->count) {
+		result = mag->objs[--mag->count];
+		local_bh_enable();
+		return result;
+	}
+	local_bh_enable();
+
+	/* Empty magazine; refill it. */
+	n = arena_take(cache, batch, MAGAZINE_BATCH);
+	for (; n < MAGAZINE_BATCH; n++) {
+		batch[n] = wkmem_cache_alloc(cache->class, cache->name,
+				cache->slab, flags);
+		if (!batch[n])
+			break;
+	}
+	if (n == 0)
+		return NULL;
+	result = batch[--n];
+
+	/* We might have migrated, or been refilled by a softirq meanwhile. */
+	local_bh_disable();
+	mag = this_cpu_ptr(cache->mags);
+	for (i = 0; i < n && mag->count < MAGAZINE_SIZE; i++)
+		mag->objs[mag->count++] = batch[i];
+	local_bh_enable();
+
+	for (; i < n; i++)
+		cache_release(cache, batch[i]);
+	return result;
 }
 
-static enum session_fate just_die(struct session_entry *session, void *arg)
+static void cache_free(struct obj_cache *cache, void *obj)
 {
-	return FATE_RM;
-}
+	void *batch[MAGAZINE_BATCH];
+	struct magazine *mag;
+	unsigned int i, n = 0;
 
-static void init_expirer(struct expire_timer *expirer,
-		unsigned long timeout,
-		session_timer_type type,
-		fate_cb fate_cb)
-{
-	INIT_LIST_HEAD(&expirer->sessions);
-	expirer->timeout = msecs_to_jiffies(1000 * timeout);
-	expirer->type = type;
-	expirer->decide_fate_cb = fate_cb;
-}
+	/*
+	 * Sessions often die on a CPU other than the one that created them.
+	 * Objects that live on another NUMA node go straight back to the slab
+	 * (which returns them to their node), or this CPU's next sessions
+	 * would be built out of remote memory. (The arena spans nodes anyway.)
+	 */
+	if (!arena_contains(&cache->arena, obj)
+			&& page_to_nid(virt_to_head_page(obj)) != numa_node_id()) {
+		wkmem_cache_free(cache->class, cache->name, cache->slab, obj);
+		return;
+	}
 
-static void init_table(struct bib_table *table,
-		unsigned long est_timeout,
-		unsigned long trans_timeout,
-		fate_cb est_cb)
-{
-	table->tree6 = RB_ROOT;
-	table->tree4 = RB_ROOT;
-	table->log_bibs = DEFAULT_BIB_LOGGING;
-	table->log_sessions = DEFAULT_SESSION_LOGGING;
-	table->drop_by_addr = DEFAULT_ADDR_DEPENDENT_FILTERING;
-	table->bib_count = 0;
-	table->session_count = 0;
-	spin_lock_init(&table->lock);
-	init_expirer(&table->est_timer, est_timeout, SESSION_TIMER_EST, est_cb);
+	local_bh_disable();
+	mag = this_cpu_ptr(cache->mags);
+	if (mag->count == MAGAZINE_SIZE) {
+		/* Full magazine; hand half of it back to the slab. */
+		mag->count -= MAGAZINE_BATCH;
+		for (n = 0; n < MAGAZINE_BATCH; n++)
+			batch[n] = mag->objs[mag->count + n];
+	}
+	mag->objs[mag->count++] = obj;
+	local_bh_enable();
 
-	init_expirer(&table->trans_timer, trans_timeout, SESSION_TIMER_TRANS,
-			just_die);
-	/* TODO "just_die"? what about the stored packet? */
-	init_expirer(&table->syn4_timer, TCP_INCOMING_SYN, SESSION_TIMER_SYN4,
-			just_die);
-	table->pkt_count = 0;
-	table->pkt_limit = 0;
-	table->drop_v4_syn = DEFAULT_DROP_EXTERNAL_CONNECTIONS;
-	table->pkt_queue = NULL;
+	for (i = 0; i < n; i++)
+		cache_release(cache, batch[i]);
 }
 
-struct bib *bib_alloc(void)
+/**
+ * Reserves room for @objects objects of @size bytes. Failure is not fatal; the
+ * cache just uses the slab for everything.
+ */
+static void arena_init(struct obj_cache *cache, size_t size,
+		unsigned long slab_flags, unsigned int objects)
 {
-	struct bib *db;
+	struct obj_arena *arena = &cache->arena;
+	size_t obj_size;
 
-	db = wkmalloc(struct bib, GFP_KERNEL);
-	if (!db)
-		return NULL;
+	arena->count = 0;
+	if (!objects)
+		return;
 
-	init_table(&db->udp, UDP_DEFAULT, 0, just_die);
-	init_table(&db->tcp, TCP_EST, TCP_TRANS, tcp_est_expire_cb);
-	init_table(&db->icmp, ICMP_DEFAULT, 0, just_die);
+	obj_size = ALIGN(max(size, sizeof(u32)), sizeof(void *));
+	if (slab_flags & SLAB_HWCACHE_ALIGN)
+		obj_size = ALIGN(obj_size, L1_CACHE_BYTES);
 
-	db->tcp.pkt_limit = DEFAULT_MAX_STORED_PKTS;
-	db->tcp.pkt_queue = pktqueue_alloc();
-	if (!db->tcp.pkt_queue) {
-		wkfree(struct bib, db);
-		return NULL;
+#if LINUX_VERSION_AT_LEAST(5, 18, 0, 9999, 0)
+	arena->base = vmalloc_huge((size_t)objects * obj_size, GFP_KERNEL);
+#else
+	arena->base = vmalloc((size_t)objects * obj_size);
+#endif
+	if (!arena->base) {
+		log_warn_once("Could not allocate the %s arena; the slab will have to do.",
+				cache->name);
+		return;
 	}
-	/*
-	 * Just in case some crazy psycho decides to change the default.
-	 * THERE IS NO ADRESS-DEPENDENT FILTERING ON ICMP; the RFC is wrong.
-	 */
-	db->icmp.drop_by_addr = false;
 
-	kref_init(&db->refs);
-
-	return db;
+	arena->obj_size = obj_size;
+	arena->count = objects;
+	arena->unused = 0;
+	arena->free = ARENA_NIL;
+	spin_lock_init(&arena->lock);
 }
 
-void bib_get(struct bib *db)
+static int cache_init(struct obj_cache *cache, char *slab_name, size_t size,
+		unsigned long slab_flags, unsigned int arena_size)
 {
-	kref_get(&db->refs);
+	cache->slab = kmem_cache_create(slab_name, size, 0, slab_flags, NULL);
+	if (!cache->slab)
+		return -ENOMEM;
+
+	cache->mags = alloc_percpu(struct magazine);
+	if (!cache->mags) {
+		kmem_cache_destroy(cache->slab);
+		return -ENOMEM;
+	}
+
+	arena_init(cache, size, slab_flags, arena_size);
+	return 0;
 }
 
-/**
- * Potentially includes a laggy packet fetch; please do not hold spinlocks while
- * calling this function!
- */
-static void release_session(struct rb_node *node, void *arg)
+static void cache_destroy(struct obj_cache *cache)
 {
-	struct tabled_session *session = node2session(node);
+	struct magazine *mag;
+	int cpu;
 
-	if (session->stored) {
-		icmp64_send_skb(session->stored, ICMPERR_PORT_UNREACHABLE, 0);
-		kfree_skb(session->stored);
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(cache->mags, cpu);
+		while (mag->count)
+			cache_release(cache, mag->objs[--mag->count]);
 	}
 
-	free_session(session);
+	free_percpu(cache->mags);
+	kmem_cache_destroy(cache->slab);
+	if (cache->arena.count)
+		vfree(cache->arena.base);
 }
 
-/**
- * Potentially includes laggy packet fetches; please do not hold spinlocks while
- * calling this function!
- */
-static void release_bib_entry(struct rb_node *node, void *arg)
+static struct tabled_bib *alloc_bib(gfp_t flags)
 {
-	struct tabled_bib *bib = bib4_entry(node);
-	rbtree_clear(&bib->sessions, release_session, NULL);
-	free_bib(bib);
+	struct tabled_bib *bib;
+
+	bib = cache_alloc(&bib_cache, flags);
+	if (bib)
+		bib->paired = false;
+	return bib;
 }
 
-static void bib_release(struct kref *refs)
+static void init_counters(struct session_counters *counters)
 {
-	struct bib *db;
-	db = container_of(refs, struct bib, refs);
+	atomic64_set(&counters->packets_6to4, 0);
+	atomic64_set(&counters->bytes_6to4, 0);
+	atomic64_set(&counters->packets_4to6, 0);
+	atomic64_set(&counters->bytes_4to6, 0);
+	counters->born = jiffies;
+}
 
-	/*
-	 * The trees share the entries, so only one tree of each protocol
-	 * needs to be emptied.
-	 */
-	rbtree_clear(&db->udp.tree4, release_bib_entry, NULL);
-	rbtree_clear(&db->tcp.tree4, release_bib_entry, NULL);
-	rbtree_clear(&db->icmp.tree4, release_bib_entry, NULL);
+static struct tabled_session *alloc_session(gfp_t flags)
+{
+	struct counted_session *counted;
+	struct tabled_session *session;
 
-	pktqueue_release(db->tcp.pkt_queue);
+	if (READ_ONCE(session_counters_enabled)) {
+		counted = cache_alloc(&counted_session_cache, flags);
+		if (!counted)
+			return NULL;
+		init_counters(&counted->counters);
+		counted->session.paired = false;
+		counted->session.counted = true;
+		return &counted->session;
+	}
 
-	wkfree(struct bib, db);
+	session = cache_alloc(&session_cache, flags);
+	if (session) {
+		session->paired = false;
+		session->counted = false;
+	}
+	return session;
 }
 
-void bib_put(struct bib *db)
+static struct tabled_pair *alloc_pair(gfp_t flags)
 {
-	kref_put(&db->refs, bib_release);
+	struct counted_pair *counted;
+	struct tabled_pair *pair;
+
+	if (READ_ONCE(session_counters_enabled)) {
+		counted = cache_alloc(&counted_pair_cache, flags);
+		if (!counted)
+			return NULL;
+		init_counters(&counted->counters);
+		pair = &counted->pair;
+		pair->session.counted = true;
+	} else {
+		pair = cache_alloc(&pair_cache, flags);
+		if (!pair)
+			return NULL;
+		pair->session.counted = false;
+	}
+
+	pair->bib.paired = true;
+	pair->session.paired = true;
+	atomic_set(&pair->refs, 2);
+	return pair;
 }
 
-void bib_config_copy(struct bib *db, struct bib_config *config)
+static void put_pair(struct tabled_pair *pair)
 {
-	spin_lock_bh(&db->tcp.lock);
-	config->bib_logging = db->tcp.log_bibs;
-	config->session_logging = db->tcp.log_sessions;
-	config->drop_by_addr = db->tcp.drop_by_addr;
-	config->ttl.tcp_est = db->tcp.est_timer.timeout;
-	config->ttl.tcp_trans = db->tcp.trans_timer.timeout;
-	config->max_stored_pkts = db->tcp.pkt_limit;
-	config->drop_external_tcp = db->tcp.drop_v4_syn;
-	spin_unlock_bh(&db->tcp.lock);
-
-	spin_lock_bh(&db->udp.lock);
-	config->ttl.udp = db->udp.est_timer.timeout;
-	spin_unlock_bh(&db->udp.lock);
+	if (!atomic_dec_and_test(&pair->refs))
+		return;
 
-	spin_lock_bh(&db->icmp.lock);
-	config->ttl.icmp = db->icmp.est_timer.timeout;
-	spin_unlock_bh(&db->icmp.lock);
+	/* The session half is dead, but its bits are still there. */
+	if (pair->session.counted)
+		cache_free(&counted_pair_cache, pair);
+	else
+		cache_free(&pair_cache, pair);
 }
 
-void bib_config_set(struct bib *db, struct bib_config *config)
+static void free_bib(struct tabled_bib *bib)
 {
-	spin_lock_bh(&db->tcp.lock);
-	db->tcp.log_bibs = config->bib_logging;
-	db->tcp.log_sessions = config->session_logging;
-	db->tcp.drop_by_addr = config->drop_by_addr;
-	db->tcp.est_timer.timeout = config->ttl.tcp_est;
-	db->tcp.trans_timer.timeout = config->ttl.tcp_trans;
-	db->tcp.pkt_limit = config->max_stored_pkts;
-	db->tcp.drop_v4_syn = config->drop_external_tcp;
-	spin_unlock_bh(&db->tcp.lock);
-
-	spin_lock_bh(&db->udp.lock);
-	db->udp.log_bibs = config->bib_logging;
-	db->udp.log_sessions = config->session_logging;
-	db->udp.drop_by_addr = config->drop_by_addr;
-	db->udp.est_timer.timeout = config->ttl.udp;
-	spin_unlock_bh(&db->udp.lock);
-
-	spin_lock_bh(&db->icmp.lock);
-	db->icmp.log_bibs = config->bib_logging;
-	db->icmp.log_sessions = config->session_logging;
-	db->icmp.est_timer.timeout = config->ttl.icmp;
-	spin_unlock_bh(&db->icmp.lock);
+	if (bib->paired)
+		put_pair(container_of(bib, struct tabled_pair, bib));
+	else
+		cache_free(&bib_cache, bib);
 }
 
-static void log_bib(struct bib_table *table,
-		struct tabled_bib *bib,
-		char *action)
+static void free_session(struct tabled_session *session)
 {
-	struct timeval tval;
-	struct tm t;
-
-	if (!table->log_bibs)
-		return;
-
-	do_gettimeofday(&tval);
-	time_to_tm(tval.tv_sec, 0, &t);
-	log_info("%ld/%d/%d %d:%d:%d (GMT) - %s %pI6c#%u to %pI4#%u (%s)",
-			1900 + t.tm_year, t.tm_mon + 1, t.tm_mday,
-			t.tm_hour, t.tm_min, t.tm_sec, action,
-			&bib->src6.l3, bib->src6.l4,
-			&bib->src4.l3, bib->src4.l4,
-			l4proto_to_string(bib->proto));
+	if (session->paired)
+		put_pair(container_of(session, struct tabled_pair, session));
+	else if (session->counted)
+		cache_free(&counted_session_cache, session);
+	else
+		cache_free(&session_cache, session);
 }
 
-static void log_new_bib(struct bib_table *table, struct tabled_bib *bib)
+/**
+ * Returns @session's traffic counters, or NULL if it isn't being counted.
+ */
+static struct session_counters *session_counters(
+		struct tabled_session *session)
 {
-	return log_bib(table, bib, "Mapped");
+	if (!session->counted)
+		return NULL;
+	if (session->paired) {
+		return &container_of(session, struct counted_pair,
+				pair.session)->counters;
+	}
+	return &container_of(session, struct counted_session,
+			session)->counters;
 }
 
-static void log_session(struct bib_table *table,
-		struct tabled_session *session,
-		char *action)
+/**
+ * Accounts a packet of @len bytes, which arrived through @l3_proto, to
+ * @session.
+ */
+static void count_packet(struct tabled_session *session,
+		l3_protocol l3_proto, unsigned int len)
 {
-	struct timeval tval;
-	struct tm t;
+	struct session_counters *counters;
 
-	if (!table->log_sessions)
+	counters = session_counters(session);
+	if (!counters)
 		return;
 
-	do_gettimeofday(&tval);
-	time_to_tm(tval.tv_sec, 0, &t);
-	log_info("%ld/%d/%d %d:%d:%d (GMT) - %s %pI6c#%u|%pI6c#%u|"
-			"%pI4#%u|%pI4#%u|%s",
-			1900 + t.tm_year, t.tm_mon + 1, t.tm_mday,
-			t.tm_hour, t.tm_min, t.tm_sec, action,
-			&session->bib->src6.l3, session->bib->src6.l4,
-			&session->dst6.l3, session->dst6.l4,
-			&session->bib->src4.l3, session->bib->src4.l4,
-			&session->dst4.l3, session->dst4.l4,
-			l4proto_to_string(session->bib->proto));
+	if (l3_proto == L3PROTO_IPV6) {
+		atomic64_inc(&counters->packets_6to4);
+		atomic64_add(len, &counters->bytes_6to4);
+	} else {
+		atomic64_inc(&counters->packets_4to6);
+		atomic64_add(len, &counters->bytes_4to6);
+	}
 }
 
-static void log_new_session(struct bib_table *table,
-		struct tabled_session *session)
+/**
+ * Feeds the time that went by since @session's previous stamp (@last) to the
+ * idle histogram. Called whenever a packet refreshes @session.
+ */
+static void sample_idle(struct bib_table *table,
+		struct tabled_session *session,
+		unsigned long last)
 {
-	return log_session(table, session, "Added session");
+	if (table->db->stats)
+		jstat_session(table->db->stats, JHIST_IDLE, session->bib->proto,
+				jiffies - last);
 }
 
 /**
- * This function does not return a result because whatever needs to happen later
- * needs to happen regardless of probe status.
- *
- * This function does not actually send the probe; it merely prepares it so the
- * caller can commit to sending it after releasing the spinlock.
+ * Feeds @session's age to the lifetime histogram. Called when @session dies.
  */
-static void handle_probe(struct bib_table *table,
-		struct list_head *probes,
-		struct tabled_session *session,
-		struct session_entry *tmp)
+static void sample_lifetime(struct bib_table *table,
+		struct tabled_session *session)
 {
-	struct probing_session *probe;
+	struct session_counters *counters;
 
-	if (WARN(!probes, "Probe needed but caller doesn't support it"))
-		goto discard_probe;
+	counters = session_counters(session);
+	if (counters && table->db->stats)
+		jstat_session(table->db->stats, JHIST_LIFETIME,
+				session->bib->proto, jiffies - counters->born);
+}
 
-	/*
-	 * Why add a dummy session instead of the real one?
-	 * In the case of TCP probes it's because the real session's list hook
-	 * must remain attached to the database.
-	 * In the case of ICMP errors it's because the fact that a session
-	 * removal can cascade into a BIB entry removal really complicates
-	 * things.
-	 * This way requires this malloc but it's otherwise very clean.
-	 */
-	probe = wkmalloc(struct probing_session, GFP_ATOMIC);
-	if (!probe)
-		goto discard_probe;
+static void read_counters(struct tabled_session *session,
+		struct session_counters_usr *result)
+{
+	struct session_counters *counters;
 
-	probe->session = *tmp;
-	if (session->stored) {
-		probe->skb = session->stored;
-		session->stored = NULL;
-		table->pkt_count--;
-	} else {
-		probe->skb = NULL;
+	counters = session_counters(session);
+	if (!counters) {
+		memset(result, 0, sizeof(*result));
+		return;
 	}
-	list_add(&probe->list_hook, probes);
-	return;
 
-discard_probe:
-	/*
-	 * We're going to have to pretend that we sent it anyway; a probe
-	 * failure should not prevent the state from evolving from V4 INIT and
-	 * we do not want that massive thing to linger in the database anymore,
-	 * especially if we failed due to a memory allocation.
-	 */
-	kill_stored_pkt(table, session);
+	result->packets_6to4 = atomic64_read(&counters->packets_6to4);
+	result->bytes_6to4 = atomic64_read(&counters->bytes_6to4);
+	result->packets_4to6 = atomic64_read(&counters->packets_4to6);
+	result->bytes_4to6 = atomic64_read(&counters->bytes_4to6);
 }
 
-static void rm(struct bib_table *table,
-		struct list_head *probes,
-		struct tabled_session *session,
-		struct session_entry *tmp)
+static void __free_bib_rcu(struct rcu_head *rcu)
 {
-	struct tabled_bib *bib = session->bib;
+	free_bib(container_of(rcu, struct tabled_bib, rcu));
+}
 
-	if (session->stored)
-		handle_probe(table, probes, session, tmp);
+static void __free_session_rcu(struct rcu_head *rcu)
+{
+	free_session(container_of(rcu, struct tabled_session, rcu));
+}
 
-	rb_erase(&session->tree_hook, &bib->sessions);
-	list_del(&session->list_hook);
-	log_session(table, session, "Forgot session");
-	free_session(session);
-	table->session_count--;
+/*
+ * Entries that have been visible to the lockless lookups need to outlive them,
+ * so use these instead of the ones above once the entry has been committed.
+ */
+#define free_bib_rcu(bib) call_rcu(&(bib)->rcu, __free_bib_rcu)
+#define free_session_rcu(session) call_rcu(&(session)->rcu, __free_session_rcu)
 
-	if (!bib->is_static && RB_EMPTY_ROOT(&bib->sessions)) {
-		rb_erase(&bib->hook6, &table->tree6);
-		rb_erase(&bib->hook4, &table->tree4);
-		log_bib(table, bib, "Forgot");
-		free_bib(bib);
-		table->bib_count--;
-	}
+static struct tabled_bib *bib6_entry(const struct rb_node *node)
+{
+	return node ? rb_entry(node, struct tabled_bib, hook6) : NULL;
 }
 
-static void handle_fate_timer(struct tabled_session *session,
-		struct expire_timer *timer)
+static struct tabled_bib *bib4_entry(const struct rb_node *node)
 {
-	session->update_time = jiffies;
-	session->expirer = timer;
-	list_del(&session->list_hook);
-	list_add_tail(&session->list_hook, &timer->sessions);
+	return node ? rb_entry(node, struct tabled_bib, hook4) : NULL;
 }
 
-static int queue_unsorted_session(struct bib_table *table,
-		struct tabled_session *session,
-		session_timer_type timer_type,
-		bool remove_first)
+static struct tabled_session *node2session(const struct rb_node *node)
 {
-	struct expire_timer *expirer;
-	struct list_head *list;
-	struct list_head *cursor;
-	struct tabled_session *old;
+	return node ? rb_entry(node, struct tabled_session, tree_hook) : NULL;
+}
 
-	switch (timer_type) {
+/**
+ * "[Convert] tabled BIB to BIB entry"
+ */
+static void tbtobe(struct tabled_bib *tabled, struct bib_entry *bib)
+{
+	if (!bib)
+		return;
+
+	bib->ipv6 = tabled->src6;
+	bib->ipv4 = tabled->src4;
+	bib->l4_proto = tabled->proto;
+}
+
+static struct expire_timer *get_expirer(struct bib_table *table,
+		struct tabled_session *session)
+{
+	switch (session->timer) {
 	case SESSION_TIMER_EST:
-		expirer = &table->est_timer;
-		break;
+		return &table->est_timer;
 	case SESSION_TIMER_TRANS:
-		expirer = &table->trans_timer;
-		break;
+		return &table->trans_timer;
 	case SESSION_TIMER_SYN4:
-		expirer = &table->syn4_timer;
-		break;
-	default:
-		log_warn_once("incoming joold session's timer (%d) is unknown.",
-				timer_type);
-		return -EINVAL;
-	}
-
-	list = &expirer->sessions;
-	for (cursor = list->prev; cursor != list; cursor = cursor->prev) {
-		old = list_entry(cursor, struct tabled_session, list_hook);
-		if (old->update_time < session->update_time)
-			break;
+		return &table->syn4_timer;
+	case SESSION_TIMER_CLOSED:
+		return &table->closed_timer;
 	}
 
-	if (remove_first)
-		list_del(&session->list_hook);
-	list_add(&session->list_hook, cursor);
-	session->expirer = expirer;
-	return 0;
+	WARN(true, "Unknown session timer: %u", session->timer);
+	return &table->est_timer;
 }
 
 /**
- * Assumes result->session has been set (result->session_set is true).
+ * Returns the timer @session belongs to while it's established: @table's
+ * est_timer, unless @session is UDP and its remote port is one of the
+ * short-lived ones, in which case it's @table's trans_timer.
  */
-static verdict decide_fate(struct collision_cb *cb,
-		struct bib_table *table,
-		struct tabled_session *session,
-		struct list_head *probes)
+static struct expire_timer *get_est_expirer(struct bib_table *table,
+		struct tabled_session *session)
 {
-	struct session_entry tmp;
-	enum session_fate fate;
-
-	if (!cb)
-		return VERDICT_CONTINUE;
-
-	tstose(session, &tmp);
-	fate = cb->cb(&tmp, cb->arg);
-
-	/* The callback above is entitled to tweak these fields. */
-	session->state = tmp.state;
-	session->update_time = tmp.update_time;
-	if (!tmp.has_stored)
-		kill_stored_pkt(table, session);
-	/* Also the expirer, which is down below. */
-
-	switch (fate) {
-	case FATE_TIMER_EST:
-		handle_fate_timer(session, &table->est_timer);
-		break;
-
-	case FATE_PROBE:
-		/* TODO ICMP errors aren't supposed to drop down to TRANS. */
-		handle_probe(table, probes, session, &tmp);
-		/* Fall through. */
-	case FATE_TIMER_TRANS:
-		handle_fate_timer(session, &table->trans_timer);
-		break;
-
-	case FATE_RM:
-		rm(table, probes, session, &tmp);
-		break;
+	unsigned int i;
 
-	case FATE_PRESERVE:
-		break;
-	case FATE_DROP:
-		return VERDICT_DROP;
+	for (i = 0; i < table->short_port_count; i++)
+		if (table->short_ports[i] == session->dst4.l4)
+			return &table->trans_timer;
 
-	case FATE_TIMER_SLOW:
-		/*
-		 * Nothing to do with the return value.
-		 * If timer type was invalid, well don't change the expirer.
-		 * We left a warning in the log.
-		 */
-		queue_unsorted_session(table, session, tmp.timer_type, true);
-		break;
-	}
+	return &table->est_timer;
+}
 
-	return VERDICT_CONTINUE;
+/**
+ * "[Convert] tabled session to session entry"
+ */
+static void tstose(struct bib_table *table,
+		struct tabled_session *tsession,
+		struct session_entry *session)
+{
+	session->src6 = tsession->bib->src6;
+	session->dst6 = tsession->dst6;
+	session->src4 = tsession->bib->src4;
+	session->dst4 = tsession->dst4;
+	session->proto = tsession->bib->proto;
+	session->state = tsession->state;
+	session->timer_type = tsession->timer;
+	session->update_time = tsession->update_time;
+	session->timeout = get_expirer(table, tsession)->timeout;
+	session->has_stored = !!tsession->stored;
+	session->sync_due = false;
+	session->counted = tsession->counted;
 }
 
+/* The current time, in truncated seconds. */
+#define sync_stamp() ((__u16)(jiffies / HZ))
+/*
+ * Sync stamps wrap around every 2^16 seconds. If a session is idle for this
+ * long, its stamp is no longer trusted.
+ */
+#define SYNC_STAMP_RANGE ((1UL << 15) * HZ)
+
 /**
- * send_probe_packet - Sends a probe packet to @session's IPv6 endpoint,
- * to trigger a confirmation ACK if the connection is still alive.
- *
- * From RFC 6146 page 30.
+ * Decides whether @session, which a packet just refreshed through the lockless
+ * path, needs to be synchronized (by joold) again. If so, records that it is
+ * going to be.
  *
- * @session: the established session that has been inactive for too long.
+ * The lockless path never changes the state; sessions whose state changes are
+ * always synchronized (by tstobs()). So the only question is whether it has
+ * been at least @table->sync_interval since the last time, or whether the
+ * peers' copy would expire before the next chance to refresh it.
  *
- * Best if not called with spinlocks held.
+ * @prev_update is the session's update time before the packet.
  */
-static void send_probe_packet(struct net *ns, struct session_entry *session)
+static bool sync_due(struct bib_table *table, struct tabled_session *session,
+		unsigned long prev_update, unsigned long timeout)
 {
-	struct packet pkt;
-	struct sk_buff *skb;
-	struct ipv6hdr *iph;
-	struct tcphdr *th;
-	int error;
-
-	unsigned int l3_hdr_len = sizeof(*iph);
-	unsigned int l4_hdr_len = sizeof(*th);
-
-	skb = alloc_skb(LL_MAX_HEADER + l3_hdr_len + l4_hdr_len, GFP_ATOMIC);
-	if (!skb) {
-		log_debug("Could now allocate a probe packet.");
-		goto fail;
-	}
-
-	skb_reserve(skb, LL_MAX_HEADER);
-	skb_put(skb, l3_hdr_len + l4_hdr_len);
-	skb_reset_mac_header(skb);
-	skb_reset_network_header(skb);
-	skb_set_transport_header(skb, l3_hdr_len);
-
-	iph = ipv6_hdr(skb);
-	iph->version = 6;
-	iph->priority = 0;
-	iph->flow_lbl[0] = 0;
-	iph->flow_lbl[1] = 0;
-	iph->flow_lbl[2] = 0;
-	iph->payload_len = cpu_to_be16(l4_hdr_len);
-	iph->nexthdr = NEXTHDR_TCP;
-	iph->hop_limit = 255;
-	iph->saddr = session->dst6.l3;
-	iph->daddr = session->src6.l3;
-
-	th = tcp_hdr(skb);
-	th->source = cpu_to_be16(session->dst6.l4);
-	th->dest = cpu_to_be16(session->src6.l4);
-	th->seq = htonl(0);
-	th->ack_seq = htonl(0);
-	th->res1 = 0;
-	th->doff = l4_hdr_len / 4;
-	th->fin = 0;
-	th->syn = 0;
-	th->rst = 0;
-	th->psh = 0;
-	th->ack = 1;
-	th->urg = 0;
-	th->ece = 0;
-	th->cwr = 0;
-	th->window = htons(8192);
-	th->check = 0;
-	th->urg_ptr = 0;
-
-	/* TODO (performance) can't we just defer this to somebody else? */
-	th->check = csum_ipv6_magic(&iph->saddr, &iph->daddr, l4_hdr_len,
-			IPPROTO_TCP, csum_partial(th, l4_hdr_len, 0));
-	skb->ip_summed = CHECKSUM_UNNECESSARY;
-
-	pkt_fill(&pkt, skb, L3PROTO_IPV6, L4PROTO_TCP, NULL, th + 1, NULL);
+	unsigned long interval = table->sync_interval;
+	unsigned long elapsed;
+	__u16 now = sync_stamp();
 
-	if (!route6(ns, &pkt)) {
-		kfree_skb(skb);
-		goto fail;
+	/*
+	 * The interval is capped at SYNC_INTERVAL_MAX, so the stamp cannot
+	 * have wrapped around unless the session was idle for a long time.
+	 */
+	if (interval && time_before(jiffies, prev_update + SYNC_STAMP_RANGE)) {
+		/* Round up; the peers' copy deserves the benefit of the doubt. */
+		elapsed = ((__u16)(now - session->sync_time) + 1) * HZ;
+		if (elapsed < interval && elapsed + interval < timeout)
+			return false;
 	}
 
-	/* Implicit kfree_skb(skb) here. */
-#if LINUX_VERSION_AT_LEAST(4, 4, 0, 9999, 0)
-	error = dst_output(ns, NULL, skb);
-#else
-	error = dst_output(skb);
-#endif
-	if (error) {
-		log_debug("dst_output() returned errcode %d.", error);
-		goto fail;
-	}
+	session->sync_time = now;
+	return true;
+}
 
-	return;
+/**
+ * "[Convert] tabled BIB to bib_session"
+ */
+static void tbtobs(struct tabled_bib *tabled, struct bib_session *bs)
+{
+	if (!bs)
+		return;
 
-fail:
-	log_debug("A TCP connection will probably break.");
+	bs->bib_set = true;
+	bs->session.src6 = tabled->src6;
+	bs->session.src4 = tabled->src4;
+	bs->session.proto = tabled->proto;
 }
 
 /**
- * Sends all the probes and ICMP errors listed in @probes.
+ * [Convert] tabled session to bib_session"
  */
-static void post_fate(struct net *ns, struct list_head *probes)
+static void tstobs(struct bib_table *table,
+		struct tabled_session *session,
+		struct bib_session *bs)
 {
-	struct probing_session *probe;
-	struct probing_session *tmp;
+	if (!bs)
+		return;
 
-	list_for_each_entry_safe(probe, tmp, probes, list_hook) {
-		if (probe->skb) {
-			/* The "probe" is not a probe; it's an ICMP error. */
-			icmp64_send_skb(probe->skb, ICMPERR_PORT_UNREACHABLE, 0);
-			kfree_skb(probe->skb);
-		} else {
-			/* Actual TCP probe. */
-			send_probe_packet(ns, &probe->session);
-		}
-		wkfree(struct probing_session, probe);
-	}
+	bs->bib_set = true;
+	bs->session_set = true;
+	tstose(table, session, &bs->session);
+	/*
+	 * Only the locked paths create sessions and change their states, so
+	 * whatever comes out of them is always synchronized.
+	 */
+	bs->session.sync_due = true;
+	session->sync_time = sync_stamp();
 }
 
-struct slot_group {
-	struct tree_slot bib6;
-	struct tree_slot bib4;
-	struct tree_slot session;
-};
-
-static void commit_bib_add(struct bib_table *table, struct slot_group *slots)
+/**
+ * Returns the index of the shard @addr's BIB entry belongs to.
+ */
+static unsigned int shard4(const struct ipv4_transport_addr *addr,
+		unsigned int shard_count)
 {
-	treeslot_commit(&slots->bib6);
-	treeslot_commit(&slots->bib4);
-	table->bib_count++;
+	if (shard_count == 1)
+		return 0;
+	return jhash_2words((__force u32)addr->l3.s_addr, addr->l4, 0)
+			% shard_count;
 }
 
-static void commit_session_add(struct bib_table *table, struct tree_slot *slot)
+/**
+ * Returns the index of the shard @addr's BIB entry belongs to.
+ *
+ * Dynamic BIB entries are always masked in a way that makes this agree with
+ * shard4(), so lookups from both directions land on the same shard.
+ */
+static unsigned int shard6(const struct ipv6_transport_addr *addr,
+		unsigned int shard_count)
 {
-	treeslot_commit(slot);
-	table->session_count++;
+	if (shard_count == 1)
+		return 0;
+	return jhash2((const u32 *)&addr->l3, 4, addr->l4) % shard_count;
 }
 
-static void attach_timer(struct tabled_session *session,
-		struct expire_timer *expirer)
+/**
+ * Returns true if @bib6 and @bib4 would be stored in the same shard.
+ * BIB entries that fail this test cannot be stored in a sharded database.
+ */
+static bool shards_match(struct bib *db,
+		const struct ipv6_transport_addr *bib6,
+		const struct ipv4_transport_addr *bib4)
 {
-	session->update_time = jiffies;
-	session->expirer = expirer;
-	list_add_tail(&session->list_hook, &expirer->sessions);
+	return shard6(bib6, db->shard_count) == shard4(bib4, db->shard_count);
 }
 
-static int compare_src6(struct tabled_bib *a, struct ipv6_transport_addr *b)
+/**
+ * One-liner to get the session table shard array corresponding to the @proto
+ * protocol.
+ */
+static struct bib_table *get_tables(struct bib *db, l4_protocol proto)
 {
-	return taddr6_compare(&a->src6, b);
+	switch (proto) {
+	case L4PROTO_TCP:
+		return db->tcp;
+	case L4PROTO_UDP:
+		return db->udp;
+	case L4PROTO_ICMP:
+		return db->icmp;
+	case L4PROTO_OTHER:
+		break;
+	}
+
+	WARN(true, "Unsupported transport protocol: %u.", proto);
+	return NULL;
 }
 
-static int compare_src6_rbnode(struct rb_node *a, struct rb_node *b)
+/**
+ * Returns the @proto shard in charge of the BIB entry whose IPv6 transport
+ * address is @addr.
+ */
+static struct bib_table *get_table6(struct bib *db, l4_protocol proto,
+		const struct ipv6_transport_addr *addr)
 {
-	return taddr6_compare(&bib6_entry(a)->src6, &bib6_entry(b)->src6);
+	struct bib_table *tables = get_tables(db, proto);
+	return tables ? &tables[shard6(addr, db->shard_count)] : NULL;
 }
 
-static int compare_src4(struct tabled_bib const *a,
-		struct ipv4_transport_addr const *b)
+/**
+ * Returns the @proto shard in charge of the BIB entry whose IPv4 transport
+ * address is @addr.
+ */
+static struct bib_table *get_table4(struct bib *db, l4_protocol proto,
+		const struct ipv4_transport_addr *addr)
 {
-	return taddr4_compare(&a->src4, b);
+	struct bib_table *tables = get_tables(db, proto);
+	return tables ? &tables[shard4(addr, db->shard_count)] : NULL;
 }
 
-static int compare_src4_rbnode(struct rb_node *a, struct rb_node *b)
+static u32 hash6(const struct ipv6_transport_addr *src6,
+		const struct ipv6_transport_addr *dst6)
 {
-	return taddr4_compare(&bib4_entry(a)->src4, &bib4_entry(b)->src4);
+	return jhash2((const u32 *)&src6->l3, 4,
+			jhash2((const u32 *)&dst6->l3, 4,
+					(src6->l4 << 16) | dst6->l4));
 }
 
-static int compare_dst4(struct tabled_session *a, struct tabled_session *b)
+static u32 hash4(const struct ipv4_transport_addr *src4,
+		const struct ipv4_transport_addr *dst4)
 {
-	return taddr4_compare(&a->dst4, &b->dst4);
+	return jhash_3words((__force u32)src4->l3.s_addr,
+			(__force u32)dst4->l3.s_addr,
+			(src4->l4 << 16) | dst4->l4, 0);
 }
 
-static struct tabled_bib *find_bib6(struct bib_table *table,
-		struct ipv6_transport_addr *addr)
+static struct hlist_head *bucket6(struct bib_table *table,
+		const struct ipv6_transport_addr *src6,
+		const struct ipv6_transport_addr *dst6)
 {
-	return rbtree_find(addr, &table->tree6, compare_src6, struct tabled_bib,
-			hook6);
+	return &table->hash6[hash6(src6, dst6) & table->hash_mask];
 }
 
-static struct tabled_bib *find_bib4(struct bib_table *table,
-		struct ipv4_transport_addr *addr)
+static struct hlist_head *bucket4(struct bib_table *table,
+		const struct ipv4_transport_addr *src4,
+		const struct ipv4_transport_addr *dst4)
 {
-	return rbtree_find(addr, &table->tree4, compare_src4, struct tabled_bib,
-			hook4);
+	return &table->hash4[hash4(src4, dst4) & table->hash_mask];
 }
 
-static struct tabled_bib *find_bibtree6_slot(struct bib_table *table,
-		struct tabled_bib *new,
-		struct tree_slot *slot)
+/* Counters that reach this stay there; they no longer know their count. */
+#define ADF_COUNTER_MAX 0xFFu
+
+static u8 *adf_counter(struct bib_table *table,
+		const struct ipv4_transport_addr *src4,
+		__be32 remote,
+		u32 seed)
 {
-	struct rb_node *collision;
-	collision = rbtree_find_slot(&new->hook6, &table->tree6,
-			compare_src6_rbnode, slot);
-	return bib6_entry(collision);
+	u32 hash = jhash_3words((__force u32)src4->l3.s_addr,
+			(__force u32)remote, src4->l4, seed);
+	return &table->adf_counters[hash & table->adf_mask];
 }
 
-static struct tabled_bib *find_bibtree4_slot(struct bib_table *table,
-		struct tabled_bib *new,
-		struct tree_slot *slot)
+static void adf_count(struct bib_table *table,
+		struct tabled_session *session,
+		int delta)
 {
-	struct rb_node *collision;
-	collision = rbtree_find_slot(&new->hook4, &table->tree4,
-			compare_src4_rbnode, slot);
-	return bib4_entry(collision);
-}
+	u8 *counter;
+	u32 seed;
 
-/**
- * Attempts to find the slot where @new would be inserted if you wanted to add
- * it to @bib's session tree.
- *
- * On success:
- * - Initializes @slots as the place (in @bib's session tree) where @new would
- *   be inserted if you wanted to do so.
- * - Returns NULL.
- *
- * If @session collides with @bib's session S:
- * - @slot is undefined.
- * - S is returned.
- *
- * As a side effect, @allow will tell you whether the entry is allowed to be
- * added to the tree if address-dependent filtering is enabled. Send NULL if you
- * don't care about that.
- *
- * Please notice: This searches via @new's dst4, *not* dst6. @new *must* carry
- * an initialized dst4.
- */
-static struct tabled_session *find_session_slot(struct tabled_bib *bib,
-		struct tabled_session *new,
-		bool *allow,
-		struct tree_slot *slot)
-{
-	struct tabled_session *session;
-	struct rb_node *node;
-	int comparison;
-
-	treeslot_init(slot, &bib->sessions, &new->tree_hook);
-	node = bib->sessions.rb_node;
-	if (allow)
-		*allow = false;
-
-	while (node) {
-		session = node2session(node);
-		comparison = compare_dst4(session, new);
-
-		if (allow && session->dst4.l3.s_addr == new->dst4.l3.s_addr)
-			*allow = true;
+	if (!table->adf_counters)
+		return;
 
-		slot->parent = node;
-		if (comparison < 0) {
-			slot->rb_link = &node->rb_right;
-			node = node->rb_right;
-		} else if (comparison > 0) {
-			slot->rb_link = &node->rb_left;
-			node = node->rb_left;
-		} else {
-			return session;
-		}
+	/* Two hash functions. */
+	for (seed = 0; seed < 2; seed++) {
+		counter = adf_counter(table, &session->bib->src4,
+				session->dst4.l3.s_addr, seed);
+		if (*counter != ADF_COUNTER_MAX)
+			WRITE_ONCE(*counter, *counter + delta);
 	}
-
-	return NULL;
 }
 
-static int alloc_bib_session(struct bib_session_tuple *tuple)
+/**
+ * Returns true if none of the sessions of @src4's BIB entry can possibly
+ * be headed to @remote. Bloom false positives make this return false when it
+ * could have returned true; that's fine, since the locked path still knows.
+ */
+static bool adf_excludes(struct bib_table *table,
+		const struct ipv4_transport_addr *src4,
+		__be32 remote)
 {
-	tuple->bib = alloc_bib(GFP_ATOMIC);
-	if (!tuple->bib)
-		return -ENOMEM;
+	u32 seed;
 
-	tuple->session = alloc_session(GFP_ATOMIC);
-	if (!tuple->session) {
-		free_bib(tuple->bib);
-		return -ENOMEM;
-	}
+	for (seed = 0; seed < 2; seed++)
+		if (!READ_ONCE(*adf_counter(table, src4, remote, seed)))
+			return true;
 
-	return 0;
+	return false;
 }
 
-static int create_bib_session6(struct bib_session_tuple *tuple,
-		struct tuple *tuple6,
-		struct ipv4_transport_addr *dst4,
-		tcp_state state)
+/**
+ * Adds @session to @table's 5-tuple indexes (and to the ADF prefilter).
+ * @session->bib has to be already set.
+ */
+static void hash_session(struct bib_table *table,
+		struct tabled_session *session)
 {
-	int error;
+	adf_count(table, session, 1);
+	if (!table->hash6)
+		return;
 
-	error = alloc_bib_session(tuple);
-	if (error)
-		return error;
+	hlist_add_head_rcu(&session->hash6_hook, bucket6(table,
+			&session->bib->src6, &session->dst6));
+	hlist_add_head_rcu(&session->hash4_hook, bucket4(table,
+			&session->bib->src4, &session->dst4));
+}
 
-	/*
-	 * Hooks, expirer fields and session->bib are left uninitialized since
-	 * they depend on database knowledge.
-	 */
+static void unhash_session(struct bib_table *table,
+		struct tabled_session *session)
+{
+	adf_count(table, session, -1);
+	if (!table->hash6)
+		return;
 
-	tuple->bib->src6 = tuple6->src.addr6;
-	/*
-	 * src4 is left uninitialized on purpose.
-	 * It needs to be inferred later by comparing the masks and the existing
-	 * BIB entries.
-	 */
-	tuple->bib->proto = tuple6->l4_proto;
-	tuple->bib->is_static = false;
-	tuple->bib->sessions = RB_ROOT;
-	tuple->session->dst6 = tuple6->dst.addr6;
-	tuple->session->dst4 = *dst4;
-	tuple->session->state = state;
-	tuple->session->stored = NULL;
-	return 0;
+	hlist_del_rcu(&session->hash6_hook);
+	hlist_del_rcu(&session->hash4_hook);
 }
 
-static struct tabled_session *create_session4(struct tuple *tuple4,
-		struct ipv6_transport_addr *dst6,
-		tcp_state state)
+#define foreach_bucket_rcu(head, node) \
+		for (node = rcu_dereference(hlist_first_rcu(head)); \
+				node; \
+				node = rcu_dereference(hlist_next_rcu(node)))
+
+static struct tabled_session *hash_find6(struct bib_table *table,
+		const struct ipv6_transport_addr *src6,
+		const struct ipv6_transport_addr *dst6)
 {
 	struct tabled_session *session;
+	struct hlist_node *node;
 
-	session = alloc_session(GFP_ATOMIC);
-	if (!session)
-		return NULL;
+	foreach_bucket_rcu(bucket6(table, src6, dst6), node) {
+		session = hlist_entry(node, struct tabled_session, hash6_hook);
+		if (taddr6_equals(&session->dst6, dst6)
+				&& taddr6_equals(&session->bib->src6, src6))
+			return session;
+	}
 
-	/*
-	 * Hooks, expirer fields and session->bib are left uninitialized since
-	 * they depend on database knowledge.
-	 */
-	session->dst6 = *dst6;
-	session->dst4 = tuple4->src.addr4;
-	session->state = state;
-	session->stored = NULL;
-	return session;
+	return NULL;
 }
 
-static int create_bib_session(struct session_entry *session,
-		struct bib_session_tuple *tuple)
+static struct tabled_session *hash_find4(struct bib_table *table,
+		const struct ipv4_transport_addr *src4,
+		const struct ipv4_transport_addr *dst4)
 {
-	int error;
+	struct tabled_session *session;
+	struct hlist_node *node;
 
-	error = alloc_bib_session(tuple);
-	if (error)
-		return error;
+	foreach_bucket_rcu(bucket4(table, src4, dst4), node) {
+		session = hlist_entry(node, struct tabled_session, hash4_hook);
+		if (taddr4_equals(&session->dst4, dst4)
+				&& taddr4_equals(&session->bib->src4, src4))
+			return session;
+	}
 
-	/*
-	 * Hooks, most expirer fields and session->bib are left uninitialized
-	 * since they depend on database knowledge.
-	 */
-	tuple->bib->src6 = session->src6;
-	tuple->bib->src4 = session->src4;
-	tuple->bib->proto = session->proto;
-	tuple->bib->is_static = false;
-	tuple->bib->sessions = RB_ROOT;
-	tuple->session->dst6 = session->dst6;
-	tuple->session->dst4 = session->dst4;
-	tuple->session->state = session->state;
-	tuple->session->update_time = session->update_time;
-	tuple->session->stored = NULL;
-	return 0;
+	return NULL;
+}
+
+static struct hlist_head *static_bucket(struct bib_table *table,
+		const struct ipv4_transport_addr *addr)
+{
+	return &table->statics[jhash_2words((__force u32)addr->l3.s_addr,
+			addr->l4, 0) & (STATIC_BUCKETS - 1)];
 }
 
 /**
- * Boilerplate code to finish hanging @new->session (and potentially @new->bib
- * as well) on one af @table's trees. 6-to-4 direction.
- *
- * It assumes @slots already describes the tree containers where the entries are
- * supposed to be added.
+ * Returns @addr's BIB entry if it's static, NULL otherwise. Safe both in RCU
+ * read-side critical sections and with the table locked.
  */
-static void commit_add6(struct bib_table *table,
-		struct bib_session_tuple *old,
-		struct bib_session_tuple *new,
-		struct slot_group *slots,
-		struct expire_timer *expirer,
-		struct bib_session *result)
+static struct tabled_bib *find_static4(struct bib_table *table,
+		const struct ipv4_transport_addr *addr)
 {
-	new->session->bib = old->bib ? : new->bib;
-	commit_session_add(table, &slots->session);
-	attach_timer(new->session, expirer);
-	log_new_session(table, new->session);
-	tstobs(new->session, result);
-	new->session = NULL; /* Do not free! */
+	struct static_node *snode;
+	struct hlist_node *node;
 
-	if (!old->bib) {
-		commit_bib_add(table, slots);
-		log_new_bib(table, new->bib);
-		new->bib = NULL; /* Do not free! */
+	foreach_bucket_rcu(static_bucket(table, addr), node) {
+		snode = hlist_entry(node, struct static_node, hook);
+		if (taddr4_equals(&snode->bib->src4, addr))
+			return snode->bib;
 	}
+
+	return NULL;
 }
 
+#undef foreach_bucket_rcu
+
 /**
- * Boilerplate code to finish hanging *@new on one af @table's trees.
- * 4-to-6 direction.
- *
- * It assumes @slot already describes the tree container where the session is
- * supposed to be added.
+ * Adds @bib, which just became static, to the static index. @snode is consumed.
  */
-static void commit_add4(struct bib_table *table,
-		struct bib_session_tuple *old,
-		struct tabled_session **new,
-		struct tree_slot *slot,
-		struct expire_timer *expirer,
-		struct bib_session *result)
+static void index_static(struct bib_table *table, struct tabled_bib *bib,
+		struct static_node *snode)
 {
-	struct tabled_session *session = *new;
+	snode->bib = bib;
+	hlist_add_head_rcu(&snode->hook, static_bucket(table, &bib->src4));
+}
 
-	session->bib = old->bib;
-	commit_session_add(table, slot);
-	attach_timer(session, expirer);
-	log_new_session(table, session);
-	tstobs(session, result);
-	*new = NULL; /* Do not free! */
+static void __free_static_rcu(struct rcu_head *rcu)
+{
+	wkfree(struct static_node, container_of(rcu, struct static_node, rcu));
 }
 
 /**
- * Boilerplate code to finish hanging *@new on one af @table's trees.
- * joold version.
- *
- * It assumes @slots already describes the tree containers where the entries are
- * supposed to be added.
+ * Reverts index_static(). Has to be called whenever a static @bib leaves
+ * @table's tree4.
  */
-static int commit_add(struct bib_table *table,
-		struct bib_session_tuple *old,
-		struct bib_session_tuple *new,
-		struct slot_group *slots,
-		session_timer_type timer_type)
+static void unindex_static(struct bib_table *table, struct tabled_bib *bib)
 {
-	int error;
-
-	error = queue_unsorted_session(table, new->session, timer_type, false);
-	if (error)
-		return error;
+	struct static_node *snode;
+	struct hlist_node *node;
 
-	new->session->bib = old->bib ? : new->bib;
-	commit_session_add(table, &slots->session);
-	log_new_session(table, new->session);
-	new->session = NULL; /* Do not free! */
+	if (!bib->is_static)
+		return;
 
-	if (!old->bib) {
-		commit_bib_add(table, slots);
-		log_new_bib(table, new->bib);
-		new->bib = NULL; /* Do not free! */
+	hlist_for_each(node, static_bucket(table, &bib->src4)) {
+		snode = hlist_entry(node, struct static_node, hook);
+		if (snode->bib == bib) {
+			hlist_del_rcu(node);
+			call_rcu(&snode->rcu, __free_static_rcu);
+			return;
+		}
 	}
 
-	return 0;
+	WARN(true, "Static BIB entry %pI4#%u was not indexed.",
+			&bib->src4.l3, bib->src4.l4);
 }
 
-struct detach_args {
-	struct bib_table *table;
-	struct sk_buff *probes;
-	unsigned int detached;
-};
-
-static void detach_session(struct rb_node *node, void *arg)
+/** Assumes nobody can be looking up anything anymore. */
+static void flush_statics(struct bib_table *table)
 {
-	struct tabled_session *session = node2session(node);
-	struct detach_args *args = arg;
-
-	list_del(&session->list_hook);
-	if (session->stored)
-		args->table->pkt_count--;
-	args->detached++;
+	struct hlist_node *node;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	for (i = 0; i < STATIC_BUCKETS; i++) {
+		hlist_for_each_safe(node, tmp, &table->statics[i]) {
+			hlist_del(node);
+			wkfree(struct static_node, hlist_entry(node,
+					struct static_node, hook));
+		}
+	}
 }
 
-static unsigned int detach_sessions(struct bib_table *table,
-		struct tabled_bib *bib)
+#define foreach_shard(db, tables, table) \
+		for (table = tables; table < (tables) + (db)->shard_count; table++)
+
+static struct hlist_head *subscriber_bucket(struct bib_table *table,
+		const struct in6_addr *prefix)
 {
-	struct detach_args arg = { .table = table, .detached = 0, };
-	rbtree_foreach(&bib->sessions, detach_session, &arg);
-	return arg.detached;
+	return &table->subscribers[jhash2((const u32 *)prefix, 4, 0)
+			& (SUBSCRIBER_BUCKETS - 1)];
 }
 
-static void detach_bib(struct bib_table *table, struct tabled_bib *bib)
+static struct subscriber *find_subscriber(struct bib_table *table,
+		const struct in6_addr *addr)
 {
-	rb_erase(&bib->hook6, &table->tree6);
-	rb_erase(&bib->hook4, &table->tree4);
-	table->bib_count--;
-	table->session_count -= detach_sessions(table, bib);
-}
+	struct subscriber *subscriber;
+	struct hlist_node *node;
+	struct in6_addr prefix;
+
+	ipv6_addr_prefix(&prefix, addr, table->subscriber_plen);
+	hlist_for_each(node, subscriber_bucket(table, &prefix)) {
+		subscriber = hlist_entry(node, struct subscriber, hook);
+		if (ipv6_addr_equal(&subscriber->prefix, &prefix))
+			return subscriber;
+	}
 
-struct bib_delete_list {
-	struct rb_node *first;
-};
+	return NULL;
+}
 
-static void add_to_delete_list(struct bib_delete_list *list, struct rb_node *node)
+/**
+ * Size of the subscribers' token buckets; @table's share of a second's worth
+ * of connections.
+ */
+static unsigned int subscriber_capacity(struct bib_table *table)
 {
-	node->rb_right = list->first;
-	list->first = node;
+	return DIV_ROUND_UP(table->subscriber_max_rate, table->shard_count);
 }
 
-static void commit_delete_list(struct bib_delete_list *list)
+/**
+ * Adds @bibs and @sessions (which can be negative) to the counters of the
+ * subscriber @addr belongs to.
+ */
+static void account_subscriber(struct bib_table *table,
+		const struct in6_addr *addr,
+		int bibs, int sessions)
 {
-	struct rb_node *node;
-	struct rb_node *next;
+	struct subscriber *subscriber;
 
-	for (node = list->first; node; node = next) {
-		next = node->rb_right;
-		release_bib_entry(node, NULL);
+	if (!table->subscriber_plen)
+		return;
+
+	subscriber = find_subscriber(table, addr);
+	if (!subscriber) {
+		if (bibs < 0 || sessions < 0)
+			return; /* Allocation failed back when it was created. */
+		subscriber = wkmalloc(struct subscriber, GFP_ATOMIC);
+		if (!subscriber)
+			return; /* Quotas are best-effort. */
+		ipv6_addr_prefix(&subscriber->prefix, addr,
+				table->subscriber_plen);
+		subscriber->bibs = 0;
+		subscriber->sessions = 0;
+		subscriber->tokens = subscriber_capacity(table);
+		subscriber->refill_time = jiffies;
+		hlist_add_head(&subscriber->hook,
+				subscriber_bucket(table, &subscriber->prefix));
+	}
+
+	subscriber->bibs = max_t(int, 0, (int)subscriber->bibs + bibs);
+	subscriber->sessions = max_t(int, 0, (int)subscriber->sessions
+			+ sessions);
+
+	if (!subscriber->bibs && !subscriber->sessions) {
+		hlist_del(&subscriber->hook);
+		wkfree(struct subscriber, subscriber);
 	}
 }
 
-/**
- * Tests whether @predecessor's immediate succesor tree slot is a suitable
- * placeholder for @bib. Returns the colliding node.
- *
- * (That is, returns NULL on success, a collision on failure.)
- *
- * In other words:
- * Assumes that @predecessor belongs to @table's v4 tree and that it is @bib's
- * predecessor. (ie. @predecessor's transport address is @bib's transport
- * address - 1.) You want to test whether @bib can be inserted to the tree.
- * If @predecessor's succesor collides with @bib (ie. it has @bib's v4 address),
- * it returns the colliding succesor.
- * If @predecessor's succesor does not collide with @bib, it returns NULL and
- * initializes @slot so you can actually add @bib to the tree.
- */
-static struct tabled_bib *try_next(struct bib_table *table,
-		struct tabled_bib *predecessor,
-		struct tabled_bib *bib,
-		struct tree_slot *slot)
+static void flush_subscribers(struct bib_table *table)
 {
-	struct tabled_bib *next;
-
-	next = bib4_entry(rb_next(&predecessor->hook4));
-	if (!next) {
-		/* There is no succesor and therefore no collision. */
-		slot->tree = &table->tree4;
-		slot->entry = &bib->hook4;
-		slot->parent = &predecessor->hook4;
-		slot->rb_link = &slot->parent->rb_right;
-		return NULL;
+	struct subscriber *subscriber;
+	struct hlist_node *node;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	for (i = 0; i < SUBSCRIBER_BUCKETS; i++) {
+		hlist_for_each_safe(node, tmp, &table->subscribers[i]) {
+			subscriber = hlist_entry(node, struct subscriber, hook);
+			hlist_del(node);
+			wkfree(struct subscriber, subscriber);
+		}
 	}
+}
 
-	if (taddr4_equals(&next->src4, &bib->src4))
-		return next; /* Next is yet another collision. */
+static void count_subscriber_sessions(struct rb_node *node, void *arg)
+{
+	(*((int *)arg))++;
+}
 
-	slot->tree = &table->tree4;
-	slot->entry = &bib->hook4;
-	if (predecessor->hook4.rb_right) {
-		slot->parent = &next->hook4;
-		slot->rb_link = &slot->parent->rb_left;
-	} else {
-		slot->parent = &predecessor->hook4;
-		slot->rb_link = &slot->parent->rb_right;
+static void recount_subscriber(struct rb_node *node, void *arg)
+{
+	struct tabled_bib *bib = bib6_entry(node);
+	int sessions = 0;
+
+	rbtree_foreach(&bib->sessions, count_subscriber_sessions, &sessions);
+	account_subscriber(arg, &bib->src6.l3, 1, sessions);
+}
+
+static struct hlist_head *port_bitmap_bucket(struct bib_table *table,
+		const struct in_addr *addr)
+{
+	return &table->port_bitmaps[hash_32((__force u32)addr->s_addr, 32)
+			& (PORT_BITMAP_BUCKETS - 1)];
+}
+
+static struct port_bitmap *find_port_bitmap(struct bib_table *table,
+		const struct in_addr *addr)
+{
+	struct port_bitmap *bitmap;
+	struct hlist_node *node;
+
+	hlist_for_each(node, port_bitmap_bucket(table, addr)) {
+		bitmap = hlist_entry(node, struct port_bitmap, hook);
+		if (bitmap->addr.s_addr == addr->s_addr)
+			return bitmap;
 	}
+
 	return NULL;
 }
 
+static void destroy_port_bitmap(struct port_bitmap *bitmap)
+{
+	__wkfree("port bitmap", bitmap->ports);
+	wkfree(struct port_bitmap, bitmap);
+}
+
+static struct port_bitmap *get_port_bitmap(struct bib_table *table,
+		const struct in_addr *addr)
+{
+	struct port_bitmap *bitmap;
+
+	bitmap = find_port_bitmap(table, addr);
+	if (bitmap)
+		return bitmap;
+
+	bitmap = wkmalloc(struct port_bitmap, GFP_ATOMIC);
+	if (!bitmap)
+		return NULL;
+	bitmap->ports = __wkmalloc("port bitmap", PORT_BITMAP_SIZE, GFP_ATOMIC);
+	if (!bitmap->ports) {
+		wkfree(struct port_bitmap, bitmap);
+		return NULL;
+	}
+	bitmap->addr = *addr;
+	bitmap->used = 0;
+	bitmap_zero(bitmap->ports, 65536);
+	hlist_add_head(&bitmap->hook, port_bitmap_bucket(table, addr));
+	return bitmap;
+}
+
 /**
- * This is this function in pseudocode form:
- *
- * 	// wraps around until offset - 1
- * 	foreach (mask in @masks starting from some offset)
- * 		if (mask is not taken by an existing BIB entry from @table)
- * 			init the new BIB entry, @bib, using mask
- * 			init @slot as the tree slot where @bib should be added
- * 			return success (0)
- * 	return failure (-ENOENT)
- *
+ * Clears ports @first through @first + @count - 1 of @addr's bitmap.
  */
-static int find_available_mask(struct bib_table *table,
-		struct mask_domain *masks,
-		struct tabled_bib *bib,
-		struct tree_slot *slot)
+static void clear_ports(struct bib_table *table, const struct in_addr *addr,
+		unsigned int first, unsigned int count)
 {
-	struct tabled_bib *collision = NULL;
-	bool consecutive;
-	int error;
-
-	/*
-	 * We're going to assume the masks are generally consecutive.
-	 * I think it's a fair assumption until someone requests otherwise as a
-	 * new feature.
-	 * This allows us to find an unoccupied mask with minimal further tree
-	 * traversal.
-	 */
-	do {
-		error = mask_domain_next(masks, &bib->src4, &consecutive);
-		if (error)
-			return error;
+	struct port_bitmap *bitmap;
+	unsigned int port;
 
-		/*
-		 * Just for the sake of clarity:
-		 * @consecutive is never true on the first iteration.
-		 */
-		collision = consecutive
-				? try_next(table, collision, bib, slot)
-				: find_bibtree4_slot(table, bib, slot);
+	bitmap = find_port_bitmap(table, addr);
+	if (!bitmap)
+		return;
 
-	} while (collision);
+	for (port = first; port < first + count; port++)
+		if (__test_and_clear_bit(port, bitmap->ports))
+			bitmap->used--;
 
-	return 0;
+	if (!bitmap->used) {
+		hlist_del(&bitmap->hook);
+		destroy_port_bitmap(bitmap);
+	}
 }
 
-static int upgrade_pktqueue_session(struct bib_table *table,
-		struct mask_domain *masks,
-		struct bib_session_tuple *new,
-		struct bib_session_tuple *old)
+static struct hlist_head *block_bucket(struct bib_table *table,
+		const struct in6_addr *owner)
 {
-	struct pktqueue_session *sos; /* "simultaneous open" session */
-	struct tabled_bib *bib;
-	struct tabled_bib *collision;
-	struct tabled_session *session;
-	struct tree_slot bib_slot6;
-	struct tree_slot bib_slot4;
-	int error;
+	return &table->blocks[jhash2((const u32 *)owner, 4, 0)
+			& (PORT_BLOCK_BUCKETS - 1)];
+}
 
-	if (new->bib->proto != L4PROTO_TCP)
-		return -ESRCH;
+/**
+ * Returns the block @bib's IPv4 transport address was borrowed from, if any.
+ */
+static struct port_block *find_covering_block(struct bib_table *table,
+		struct tabled_bib *bib)
+{
+	struct port_block *block;
+	struct hlist_node *node;
+	struct in6_addr owner;
 
-	sos = pktqueue_find(table->pkt_queue, &new->session->dst6, masks);
-	if (!sos)
-		return -ESRCH;
-	table->pkt_count--;
+	if (!table->block_count)
+		return NULL;
 
-	if (!masks) {
-		/*
-		 * This happens during joold adds. It's a lost cause.
-		 *
-		 * The point of SO is that the v4 node decides session [*, dst6,
-		 * src4, dst4] and the first v6 packet needing a new mask that
-		 * matches that session keeps it.
-		 *
-		 * But we're not synchronizing pktqueue sessions, because we
-		 * want to keep joold as simple as possible (which is not simple
-		 * enough), at least so long as it remains a niche thing.
-		 *
-		 * So if one Jool instance gets the v4 SO packet and some other
-		 * instance gets the v6 SO packet, the latter will choose a
-		 * random src4 and mess up the SO. That situation is this if.
-		 * Our reaction is to go like "whatever" and pretend that we
-		 * never received the v4 packet.
-		 *
-		 * One might argue that we should send the ICMP error when this
-		 * happens. But that doesn't yield satisfactory behavior either;
-		 * The SO failed anyway. To fix this properly we would need to
-		 * sync the pktqueue sessions. Combine that with the fact that
-		 * sending the ICMP error would be a pain in the ass (because we
-		 * want to do it outside of the spinlock, and we don't want to
-		 * send it if the random src4 selected happens to match the
-		 * stored session), and the result is a big fat meh. I really
-		 * don't want to do it.
-		 *
-		 * The admin signed a best-effort contract when s/he enabled
-		 * joold anyway. And this is only a problem in active-active
-		 * scenarios.
-		 */
-		pktqueue_put_node(sos);
-		return -ESRCH;
+	ipv6_addr_prefix(&owner, &bib->src6.l3, table->active_block_plen);
+	hlist_for_each(node, block_bucket(table, &owner)) {
+		block = hlist_entry(node, struct port_block, hook);
+		if (ipv6_addr_equal(&block->owner, &owner)
+				&& block->addr.s_addr == bib->src4.l3.s_addr
+				&& bib->src4.l4 >= block->first
+				&& bib->src4.l4 < block->first
+						+ table->active_block_size)
+			return block;
 	}
 
-	log_debug("Simultaneous Open!");
-	/*
-	 * We're going to pretend that @sos has been a valid V4 INIT session all
-	 * along.
-	 */
-	error = alloc_bib_session(old);
-	if (error) {
-		pktqueue_put_node(sos);
-		return error;
-	}
+	return NULL;
+}
 
-	bib = old->bib;
-	session = old->session;
+static void log_block(struct bib_table *table, struct port_block *block,
+		enum bib_event_type type, char *action);
 
-	bib->src6 = new->bib->src6;
-	bib->src4 = sos->src4;
-	bib->proto = L4PROTO_TCP;
-	bib->is_static = false;
-	bib->sessions = RB_ROOT;
+static void release_block(struct bib_table *table, struct port_block *block)
+{
+	log_block(table, block, BIBEV_BLOCK_RM, "Released block");
+	clear_ports(table, &block->addr, block->first,
+			table->active_block_size);
+	hlist_del(&block->hook);
+	__wkfree("port block", block);
+	table->block_count--;
+}
 
-	session->dst6 = sos->dst6;
-	session->dst4 = sos->dst4;
-	session->state = V4_INIT;
-	session->bib = bib;
-	session->update_time = jiffies;
-	session->stored = NULL;
+static void flush_port_blocks(struct bib_table *table)
+{
+	struct port_block *block;
+	struct hlist_node *node;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	for (i = 0; i < PORT_BLOCK_BUCKETS; i++) {
+		hlist_for_each_safe(node, tmp, &table->blocks[i]) {
+			block = hlist_entry(node, struct port_block, hook);
+			hlist_del(node);
+			__wkfree("port block", block);
+		}
+	}
+	table->block_count = 0;
+}
 
-	/*
-	 * This *has* to work. src6 wasn't in the database because we just
-	 * looked it up and src4 wasn't either because pktqueue had it.
-	 */
-	collision = find_bibtree6_slot(table, bib, &bib_slot6);
-	if (WARN(collision, "BIB entry was and then wasn't in the v6 tree."))
-		goto trainwreck;
-	collision = find_bibtree4_slot(table, bib, &bib_slot4);
-	if (WARN(collision, "BIB entry was and then wasn't in the v4 tree."))
-		goto trainwreck;
-	treeslot_commit(&bib_slot6);
-	treeslot_commit(&bib_slot4);
+/**
+ * Marks @bib's IPv4 transport address as taken.
+ * Has to be called whenever @bib joins @table's tree4.
+ */
+static void take_port(struct bib_table *table, struct tabled_bib *bib)
+{
+	struct port_block *block;
+	struct port_bitmap *bitmap;
+
+	block = find_covering_block(table, bib);
+	if (block) {
+		/* The bitmap already knows; the port was reserved. */
+		if (!__test_and_set_bit(bib->src4.l4 - block->first,
+				block->ports))
+			block->used++;
+		return;
+	}
 
-	rb_link_node(&session->tree_hook, NULL, &bib->sessions.rb_node);
-	rb_insert_color(&session->tree_hook, &bib->sessions);
-	attach_timer(session, &table->syn4_timer);
+	bitmap = get_port_bitmap(table, &bib->src4.l3);
+	if (!bitmap)
+		return; /* It's only a hint. */
 
-	pktqueue_put_node(sos);
+	if (!__test_and_set_bit(bib->src4.l4, bitmap->ports))
+		bitmap->used++;
+}
 
-	log_new_bib(table, bib);
-	log_new_session(table, session);
-	return 0;
+/**
+ * Reverts take_port(). Has to be called whenever @bib leaves @table's tree4.
+ */
+static void release_port(struct bib_table *table, struct tabled_bib *bib)
+{
+	struct port_block *block;
+
+	block = find_covering_block(table, bib);
+	if (block) {
+		if (__test_and_clear_bit(bib->src4.l4 - block->first,
+				block->ports))
+			block->used--;
+		if (!block->used)
+			release_block(table, block);
+		return;
+	}
 
-trainwreck:
-	pktqueue_put_node(sos);
-	free_bib(bib);
-	free_session(session);
-	return -EINVAL;
+	clear_ports(table, &bib->src4.l3, bib->src4.l4, 1);
 }
 
-static bool issue216_needed(struct mask_domain *masks,
-		struct bib_session_tuple *old)
+static void flush_port_bitmaps(struct bib_table *table)
 {
-	if (!masks)
-		return false;
-	return mask_domain_is_dynamic(masks)
-			&& !mask_domain_matches(masks, &old->bib->src4);
+	struct port_bitmap *bitmap;
+	struct hlist_node *node;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	for (i = 0; i < PORT_BITMAP_BUCKETS; i++) {
+		hlist_for_each_safe(node, tmp, &table->port_bitmaps[i]) {
+			bitmap = hlist_entry(node, struct port_bitmap, hook);
+			hlist_del(node);
+			destroy_port_bitmap(bitmap);
+		}
+	}
 }
 
 /**
- * This is a find and an add at the same time, for both @new->bib and
- * @new->session.
- *
- * If @new->bib needs to be added, initializes @slots->bib*.
- * If @new->session needs to be added, initializes @slots->session.
- * If @new->bib collides, you will find the collision in @old->bib.
- * If @new->session collides, you will find the collision in @old->session.
- *
- * @masks will be used to init @new->bib.src4 if applies.
+ * mask_domain_next_free() callback. (@arg is the table.)
  */
-static int find_bib_session6(struct bib_table *table,
-		struct mask_domain *masks,
-		struct bib_session_tuple *new,
-		struct bib_session_tuple *old,
-		struct slot_group *slots,
-		struct bib_delete_list *rm_list)
+static const unsigned long *get_taken_ports(const struct in_addr *addr,
+		void *arg)
 {
-	int error;
+	struct port_bitmap *bitmap;
+	bitmap = find_port_bitmap(arg, addr);
+	return bitmap ? bitmap->ports : NULL;
+}
 
-	/*
-	 * Please be careful around this function. All it wants to do is
-	 * find/add, but it is constrained by several requirements at the same
-	 * time:
-	 *
-	 * 1. If @new->bib->proto is ICMP (ie. 3-tuple), then
-	 *    @new->session->dst4.l4 is invalid and needs to be patched. Though
-	 *    it cannot be patched until we acquire a valid BIB entry.
-	 *    (dst4.l4 is just fat that should not be used in 3-tuple
-	 *    translation code, but a chunk of Jool assumes that
-	 *    dst4.l4 == dst6.l4 in 5-tuples and dst4.l4 == src4.l4 in
-	 *    3-tuples.)
-	 * 2. @masks can be NULL!
+/**
+ * mask_domain_balance() callback. (@arg is the table.)
+ */
+static unsigned int get_used_ports(const struct in_addr *addr, void *arg)
+{
+	struct port_bitmap *bitmap;
+	bitmap = find_port_bitmap(arg, addr);
+	return bitmap ? bitmap->used : 0;
+}
+
+/**
+ * Changes the length of @table's subscriber prefixes, and recomputes the
+ * counters accordingly.
+ * This is O(n), but only happens during configuration.
+ */
+static void set_subscriber_plen(struct bib_table *table, __u8 plen)
+{
+	if (table->subscriber_plen == plen)
+		return;
+
+	flush_subscribers(table);
+	table->subscriber_plen = plen;
+	if (plen)
+		rbtree_foreach(&table->tree6, recount_subscriber, table);
+}
+
+/**
+ * Refills @subscriber's bucket according to the time that has elapsed since
+ * the last refill, then takes a token from it. Returns false if there was
+ * none left.
+ */
+static bool subscriber_take_token(struct bib_table *table,
+		struct subscriber *subscriber)
+{
+	unsigned int capacity = subscriber_capacity(table);
+	unsigned long elapsed = jiffies - subscriber->refill_time;
+	u64 tokens;
+
+	if (elapsed >= HZ) {
+		subscriber->tokens = capacity;
+		subscriber->refill_time = jiffies;
+	} else {
+		tokens = div_u64((u64)elapsed * capacity, HZ);
+		if (tokens) {
+			subscriber->tokens = min_t(u64, capacity,
+					subscriber->tokens + tokens);
+			subscriber->refill_time = jiffies;
+		}
+	}
+
+	if (!subscriber->tokens)
+		return false;
+	subscriber->tokens--;
+	return true;
+}
+
+/**
+ * Returns whether the subscriber @src6 belongs to is allowed to create a new
+ * session (and also a new BIB entry, if @old->bib is NULL).
+ */
+static bool subscriber_allows(struct bib_table *table,
+		const struct ipv6_transport_addr *src6,
+		struct bib_session_tuple *old)
+{
+	struct subscriber *subscriber;
+
+	if (!table->subscriber_plen)
+		return true;
+	subscriber = find_subscriber(table, &src6->l3);
+	if (!subscriber)
+		return true;
+
+	if (!old->bib && table->subscriber_max_bibs && subscriber->bibs
+			* table->shard_count >= table->subscriber_max_bibs) {
+		log_debug("%pI6c/%u has reached its BIB entry quota.",
+				&subscriber->prefix, table->subscriber_plen);
+		return false;
+	}
+	if (table->subscriber_max_sessions && subscriber->sessions
+			* table->shard_count >= table->subscriber_max_sessions) {
+		log_debug("%pI6c/%u has reached its session quota.",
+				&subscriber->prefix, table->subscriber_plen);
+		return false;
+	}
+	if (table->subscriber_max_rate && !subscriber_take_token(table,
+			subscriber)) {
+		log_debug("%pI6c/%u is creating connections too fast.",
+				&subscriber->prefix, table->subscriber_plen);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Returns whether the instance's --cps-budget lets the current CPU create
+ * another session. Unlike the subscriber quotas, this one is shared by every
+ * protocol and subscriber, so a single tenant's connection flood can only take
+ * so much of the CPU away from the other instances.
+ */
+static bool cps_allows(struct bib_table *table)
+{
+	struct bib *db = table->db;
+
+	if (!db->stats || jstat_budget(db->stats, JBUDGET_CPS,
+			READ_ONCE(db->cps_budget)))
+		return true;
+
+	log_debug("The instance ran out of connection budget.");
+	jstat_inc(db->stats, JSTAT_BUDGET_CPS);
+	return false;
+}
+
+/**
+ * Whether @table holds as many stored packets as it's allowed to.
+ * (The limit is shared by all the shards.)
+ */
+static bool pkt_limit_reached(struct bib_table *table)
+{
+	return table->pkt_count * table->shard_count >= table->pkt_limit;
+}
+
+/**
+ * This shard's portion of @table's type 1 stored packet byte limit.
+ * (Zero means unlimited.)
+ */
+static size_t pkt_byte_limit(struct bib_table *table)
+{
+	if (!table->pkt_byte_limit)
+		return 0;
+	return max(table->pkt_byte_limit / table->shard_count, 1u);
+}
+
+/**
+ * Locks @table for writing. (Lockless readers will retry or fall back to the
+ * spinlock if they overlap with this.)
+ */
+static void lock_table(struct bib_table *table)
+{
+	table_lock(table);
+	write_seqcount_begin(&table->seq);
+}
+
+static void unlock_table(struct bib_table *table)
+{
+	write_seqcount_end(&table->seq);
+	table_unlock(table);
+}
+
+static void kill_stored_pkt(struct bib_table *table,
+		struct tabled_session *session)
+{
+	if (!session->stored)
+		return;
+
+	log_debug("Deleting stored type 2 packet.");
+	kfree_skb(session->stored);
+	session->stored = NULL;
+	table->pkt_count--;
+}
+
+/**
+ * A bib_rm_range() that hasn't been carried out yet.
+ */
+struct rm_range_work {
+	struct work_struct work;
+	struct bib *db;
+	l4_protocol proto;
+	struct ipv4_range range;
+};
+
+/** BIB entries rm_range_batch() visits per lock acquisition. */
+#define RM_RANGE_BATCH 256
+
+/** BIB entries a table_flush frees between cond_resched()s. */
+#define FLUSH_BATCH 1024
+
+/**
+ * The contents of a table, which flush_table() detached in one go, waiting to
+ * be freed by flush_work_fn().
+ */
+struct table_flush {
+	struct work_struct work;
+	/* (Holds a reference.) */
+	struct bib *db;
+	/** The BIB entries (by hook4), and their sessions. */
+	struct rb_root tree4;
+	/** The old session index. NULL if the table doesn't have one. */
+	struct hlist_head *hash;
+	struct hlist_head subscribers[SUBSCRIBER_BUCKETS];
+	struct hlist_head port_bitmaps[PORT_BITMAP_BUCKETS];
+	struct hlist_head blocks[PORT_BLOCK_BUCKETS];
+	struct hlist_head statics[STATIC_BUCKETS];
+	/** BIB entries freed so far. */
+	unsigned int freed;
+};
+
+/** Entries a foreach copies out of a table at a time. */
+#define FOREACH_CHUNK 32
+/**
+ * Nodes a lockless chunk may visit before it gives up. rb_next() is not
+ * guaranteed to make sense while writers rotate the trees, so this is what
+ * keeps a confused walk from going on forever; the locked retry sorts it out.
+ */
+#define FOREACH_CHUNK_VISITS (16 * FOREACH_CHUNK)
+
+/**
+ * Where the foreaches stage the entries of a table, so the callbacks can run
+ * once the chunk is known to be consistent. (See collect_sessions().)
+ *
+ * Per CPU. The foreaches run with bottom halves disabled, so nobody else can be
+ * using it at the same time.
+ */
+struct foreach_chunk {
+	union {
+		struct session_entry sessions[FOREACH_CHUNK];
+		struct {
+			struct bib_entry entry;
+			bool is_static;
+		} bibs[FOREACH_CHUNK];
+	};
+	unsigned int count;
+	/**
+	 * The last entry of the chunk. Only meaningful if @more; the next
+	 * chunk starts right after it.
+	 */
+	struct taddr4_tuple cursor;
+	/** Did the chunk stop only because it was full? */
+	bool more;
+};
+
+static struct foreach_chunk __percpu *chunks;
+
+/** Runs the rm_range_works and table_flushes. (One at a time.) */
+static struct workqueue_struct *rm_range_wq;
+/**
+ * Runs the tables' clean_works. Unbound, so the tables of a busy instance
+ * expire in parallel on whatever CPUs are idle, instead of one after the other
+ * on the softirq of the CPU the timer happened to fire on.
+ * The probe_queues' works run here too.
+ */
+static struct workqueue_struct *clean_wq;
+
+int bib_setup(void)
+{
+	int error;
+
+	error = cache_init(&bib_cache, "bib_nodes", sizeof(struct tabled_bib),
+			0, arena_objects);
+	if (error)
+		return error;
+
+	/* Keep the hot half of each session in a single cache line. */
+	error = cache_init(&session_cache, "session_nodes",
+			sizeof(struct tabled_session), SLAB_HWCACHE_ALIGN,
+			arena_objects);
+	if (error) {
+		cache_destroy(&bib_cache);
+		return error;
+	}
+
+	error = cache_init(&pair_cache, "icmp_pair_nodes",
+			sizeof(struct tabled_pair), SLAB_HWCACHE_ALIGN, 0);
+	if (error)
+		goto pair_fail;
+	error = cache_init(&counted_session_cache, "counted_session_nodes",
+			sizeof(struct counted_session), SLAB_HWCACHE_ALIGN, 0);
+	if (error)
+		goto counted_session_fail;
+	error = cache_init(&counted_pair_cache, "counted_icmp_pair_nodes",
+			sizeof(struct counted_pair), SLAB_HWCACHE_ALIGN, 0);
+	if (error)
+		goto counted_pair_fail;
+
+	rm_range_wq = alloc_ordered_workqueue("jool-bib-rm", 0);
+	if (!rm_range_wq)
+		goto rm_range_fail;
+	clean_wq = alloc_workqueue("jool-bib-clean", WQ_UNBOUND, 0);
+	if (!clean_wq)
+		goto clean_fail;
+	chunks = alloc_percpu(struct foreach_chunk);
+	if (!chunks)
+		goto chunks_fail;
+
+	return 0;
+
+chunks_fail:
+	destroy_workqueue(clean_wq);
+clean_fail:
+	destroy_workqueue(rm_range_wq);
+rm_range_fail:
+	error = -ENOMEM;
+	cache_destroy(&counted_pair_cache);
+counted_pair_fail:
+	cache_destroy(&counted_session_cache);
+counted_session_fail:
+	cache_destroy(&pair_cache);
+pair_fail:
+	cache_destroy(&session_cache);
+	cache_destroy(&bib_cache);
+	return error;
+}
+
+void bib_teardown(void)
+{
+	/*
+	 * Finish the pending bib_clean()s, bib_rm_range()s and bib_flush()es.
+	 * (They hold BIB references.)
+	 */
+	destroy_workqueue(clean_wq);
+	destroy_workqueue(rm_range_wq);
+	/*
+	 * Wait for the pending free_*_rcu()s. (This also covers pool4's
+	 * destroy_snapshot_rcu()s, since the xlators are gone by now.)
+	 */
+	rcu_barrier();
+	free_percpu(chunks);
+	cache_destroy(&bib_cache);
+	cache_destroy(&session_cache);
+	cache_destroy(&pair_cache);
+	cache_destroy(&counted_session_cache);
+	cache_destroy(&counted_pair_cache);
+}
+
+static enum session_fate just_die(struct session_entry *session, void *arg)
+{
+	return FATE_RM;
+}
+
+static unsigned long wheel_align(unsigned long time)
+{
+	return time & ~(WHEEL_GRANULARITY - 1);
+}
+
+static struct list_head *wheel_slot(struct expire_timer *expirer,
+		unsigned long time)
+{
+	return &expirer->slots[(time >> WHEEL_SHIFT) & (WHEEL_SLOTS - 1)];
+}
+
+/**
+ * Hashes @session into @expirer's wheel, according to its current
+ * update_time.
+ * (@session must not be listed anywhere.)
+ */
+static void wheel_add(struct expire_timer *expirer,
+		struct tabled_session *session)
+{
+	unsigned long expiration;
+
+	expiration = session->update_time + expirer->timeout;
+	/* Don't hash into slots that were already visited. */
+	if (time_before(expiration, expirer->next_slot))
+		expiration = expirer->next_slot;
+
+	list_add_tail(&session->list_hook, wheel_slot(expirer, expiration));
+	session->timer = expirer->type;
+	expirer->count++;
+}
+
+/**
+ * Unlists @session from its expirer's wheel.
+ */
+static void wheel_del(struct bib_table *table, struct tabled_session *session)
+{
+	list_del(&session->list_hook);
+	get_expirer(table, session)->count--;
+}
+
+/**
+ * Moves all of @expirer's sessions to @list.
+ */
+static void wheel_empty(struct expire_timer *expirer, struct list_head *list)
+{
+	unsigned int i;
+	for (i = 0; i < WHEEL_SLOTS; i++)
+		list_splice_init(&expirer->slots[i], list);
+}
+
+/**
+ * Changes @expirer's timeout, and rehashes its sessions accordingly.
+ * This is O(n), but only happens during configuration.
+ */
+static void wheel_set_timeout(struct expire_timer *expirer,
+		unsigned long timeout)
+{
+	struct tabled_session *session;
+	struct tabled_session *tmp;
+	LIST_HEAD(sessions);
+
+	if (expirer->timeout == timeout)
+		return;
+
+	expirer->timeout = timeout;
+	wheel_empty(expirer, &sessions);
+	expirer->count = 0;
+	list_for_each_entry_safe(session, tmp, &sessions, list_hook) {
+		list_del(&session->list_hook);
+		wheel_add(expirer, session);
+	}
+}
+
+/**
+ * Number of times the adaptive timeouts can be halved. (The last level
+ * starts right at the session limit.)
+ */
+#define PRESSURE_LEVELS 3
+/**
+ * Percentage points the occupancy has to drop below a level's threshold
+ * before the table leaves the level. Otherwise, a table hovering around a
+ * threshold would rehash its wheels on every cleaning run.
+ */
+#define PRESSURE_HYSTERESIS 5
+
+/** Returns the occupancy percentage at which @level starts. */
+static unsigned int level_start(unsigned int threshold, unsigned int level)
+{
+	return threshold + (level - 1) * (100 - threshold)
+			/ (PRESSURE_LEVELS - 1);
+}
+
+static unsigned long pressured_timeout(unsigned long base, unsigned int level)
+{
+	/* Sessions should still survive a couple of slots. */
+	return max(base >> level, min(base, 2 * WHEEL_GRANULARITY));
+}
+
+/**
+ * Sets @expirer's configured timeout, and rehashes its sessions with whatever
+ * that means at the moment.
+ */
+static void expirer_set_timeout(struct expire_timer *expirer,
+		unsigned long timeout, unsigned int level)
+{
+	expirer->base_timeout = timeout;
+	if (expirer->adaptive)
+		timeout = pressured_timeout(timeout, level);
+	wheel_set_timeout(expirer, timeout);
+}
+
+/**
+ * Returns the pressure level @table should be in, according to how close it
+ * is to its session limit.
+ */
+static unsigned int compute_pressure(struct bib_table *table)
+{
+	unsigned int threshold = READ_ONCE(timeout_pressure);
+	unsigned int level = table->pressure_level;
+	unsigned int percent;
+
+	if (!threshold || threshold >= 100 || !table->session_limit)
+		return 0;
+
+	percent = div64_u64(100 * table->session_count * table->shard_count,
+			table->session_limit);
+
+	while (level < PRESSURE_LEVELS
+			&& percent >= level_start(threshold, level + 1))
+		level++;
+	while (level > 0
+			&& percent + PRESSURE_HYSTERESIS
+			< level_start(threshold, level))
+		level--;
+
+	return level;
+}
+
+/**
+ * Shrinks (or restores) @table's adaptive timeouts, if its occupancy has
+ * crossed one of the thresholds since the last time.
+ *
+ * Rehashing the wheels is O(n), but the hysteresis keeps it rare.
+ */
+static void apply_pressure(struct bib_table *table)
+{
+	unsigned int level;
+
+	level = compute_pressure(table);
+	if (level == table->pressure_level)
+		return;
+
+	log_debug("Session table pressure level: %u -> %u",
+			table->pressure_level, level);
+	table->pressure_level = level;
+	expirer_set_timeout(&table->est_timer, table->est_timer.base_timeout,
+			level);
+	expirer_set_timeout(&table->trans_timer,
+			table->trans_timer.base_timeout, level);
+	expirer_set_timeout(&table->closed_timer,
+			table->closed_timer.base_timeout, level);
+}
+
+static void init_expirer(struct expire_timer *expirer,
+		unsigned long timeout,
+		session_timer_type type,
+		fate_cb fate_cb)
+{
+	unsigned int i;
+
+	for (i = 0; i < WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&expirer->slots[i]);
+	expirer->next_slot = wheel_align(jiffies);
+	expirer->timeout = msecs_to_jiffies(1000 * timeout);
+	expirer->base_timeout = expirer->timeout;
+	expirer->adaptive = false;
+	expirer->type = type;
+	expirer->decide_fate_cb = fate_cb;
+}
+
+static void clean_work_fn(struct work_struct *work);
+static void probe_work_fn(struct work_struct *work);
+static void register_session_shrinker(struct bib *db);
+static void unregister_session_shrinker(struct bib *db);
+
+static void init_table(struct bib_table *table,
+		unsigned int shard,
+		unsigned int shard_count,
+		unsigned long est_timeout,
+		unsigned long trans_timeout,
+		fate_cb est_cb)
+{
+	unsigned int i;
+
+	table->tree6 = RB_ROOT;
+	table->tree4 = RB_ROOT;
+	table->log_bibs = DEFAULT_BIB_LOGGING;
+	table->log_sessions = DEFAULT_SESSION_LOGGING;
+	table->log_stream = DEFAULT_LOGGING_STREAM;
+	table->drop_by_addr = DEFAULT_ADDR_DEPENDENT_FILTERING;
+	table->bib_count = 0;
+	table->session_count = 0;
+	table->session_limit = DEFAULT_MAX_SESSIONS;
+	table->pressure_level = 0;
+	table->evicted = 0;
+	memset(&table->mask_stats, 0, sizeof(table->mask_stats));
+	memset(&table->lock_stats, 0, sizeof(table->lock_stats));
+	table->subscriber_plen = DEFAULT_SUBSCRIBER_PLEN;
+	table->subscriber_max_bibs = DEFAULT_SUBSCRIBER_MAX;
+	table->subscriber_max_sessions = DEFAULT_SUBSCRIBER_MAX;
+	table->subscriber_max_rate = DEFAULT_SUBSCRIBER_MAX;
+	for (i = 0; i < SUBSCRIBER_BUCKETS; i++)
+		INIT_HLIST_HEAD(&table->subscribers[i]);
+	for (i = 0; i < PORT_BITMAP_BUCKETS; i++)
+		INIT_HLIST_HEAD(&table->port_bitmaps[i]);
+	for (i = 0; i < STATIC_BUCKETS; i++)
+		INIT_HLIST_HEAD(&table->statics[i]);
+	table->block_size = DEFAULT_PORT_BLOCK_SIZE;
+	table->active_block_size = 0;
+	table->active_block_plen = 0;
+	table->block_count = 0;
+	for (i = 0; i < PORT_BLOCK_BUCKETS; i++)
+		INIT_HLIST_HEAD(&table->blocks[i]);
+	table->det_bits = DEFAULT_DETERMINISTIC_BITS;
+	table->balance_masks = DEFAULT_POOL4_BALANCE;
+	table->node_count = DEFAULT_SS_NODE_COUNT;
+	table->node_id = DEFAULT_SS_NODE_ID;
+	table->sync_interval = DEFAULT_JOOLD_RESYNC_INTERVAL;
+	table->short_port_count = 0;
+	spin_lock_init(&table->lock);
+	INIT_WORK(&table->clean_work, clean_work_fn);
+	seqcount_init(&table->seq);
+	init_expirer(&table->est_timer, est_timeout, SESSION_TIMER_EST, est_cb);
+
+	init_expirer(&table->trans_timer, trans_timeout, SESSION_TIMER_TRANS,
+			just_die);
+	/* TODO "just_die"? what about the stored packet? */
+	init_expirer(&table->syn4_timer, TCP_INCOMING_SYN, SESSION_TIMER_SYN4,
+			just_die);
+	init_expirer(&table->closed_timer, TCP_CLOSED_DEFAULT ? : trans_timeout,
+			SESSION_TIMER_CLOSED, just_die);
+	table->closed_ttl = msecs_to_jiffies(1000 * TCP_CLOSED_DEFAULT);
+	table->pkt_count = 0;
+	table->pkt_limit = 0;
+	table->pkt_byte_limit = 0;
+	table->stateless_so = DEFAULT_STATELESS_SO;
+	table->drop_v4_syn = DEFAULT_DROP_EXTERNAL_CONNECTIONS;
+	table->pkt_queue = NULL;
+	table->shard = shard;
+	table->shard_count = shard_count;
+	table->hash6 = NULL;
+	table->hash4 = NULL;
+	table->hash_mask = 0;
+	table->adf_counters = NULL;
+	table->adf_mask = 0;
+}
+
+/**
+ * Returns the NUMA node @shard's memory should live in.
+ *
+ * A packet's shard depends on its addresses, not on the CPU that handles it,
+ * so no placement can make every lookup local. The shards are dealt among the
+ * online nodes instead, so the lookups (and their memory traffic) are spread
+ * evenly rather than all landing on whichever node ran the netlink command.
+ */
+static int shard_node(unsigned int shard)
+{
+	unsigned int n = shard % num_online_nodes();
+	int node;
+
+	for_each_online_node(node)
+		if (n-- == 0)
+			return node;
+
+	return first_online_node;
+}
+
+/**
+ * Returns a new, empty session index for @table. Both halves (6 and 4) share
+ * one allocation.
+ */
+static struct hlist_head *alloc_table_hash(struct bib_table *table,
+		size_t buckets)
+{
+	struct hlist_head *hash;
+	size_t i;
+
+	hash = vmalloc_node(2 * buckets * sizeof(struct hlist_head),
+			shard_node(table->shard));
+	if (!hash)
+		return NULL;
+
+	for (i = 0; i < 2 * buckets; i++)
+		INIT_HLIST_HEAD(&hash[i]);
+	return hash;
+}
+
+static int init_table_hash(struct bib_table *table, unsigned int bits)
+{
+	size_t buckets = 1 << bits;
+
+	table->hash6 = alloc_table_hash(table, buckets);
+	if (!table->hash6)
+		return -ENOMEM;
+	table->hash4 = table->hash6 + buckets;
+	table->hash_mask = buckets - 1;
+	return 0;
+}
+
+static void release_table_hashes(struct bib *db)
+{
+	unsigned int i;
+
+	for (i = 0; i < db->shard_count; i++) {
+		vfree(db->udp[i].hash6);
+		vfree(db->tcp[i].hash6);
+		vfree(db->icmp[i].hash6);
+		vfree(db->udp[i].adf_counters);
+	}
+}
+
+static int init_adf_filters(struct bib *db)
+{
+	unsigned int bits = adf_filter_bits;
+	struct bib_table *table;
+	unsigned int i;
+
+	if (!bits)
+		return 0;
+	if (bits > 24) {
+		log_warn_once("adf_filter_bits %u is too big; using 24.", bits);
+		bits = 24;
+	}
+
+	for (i = 0; i < db->shard_count; i++) {
+		table = &db->udp[i];
+		table->adf_counters = vzalloc_node(1 << bits,
+				shard_node(table->shard));
+		if (!table->adf_counters)
+			return -ENOMEM;
+		table->adf_mask = (1 << bits) - 1;
+	}
+
+	return 0;
+}
+
+static int init_hashes(struct bib *db)
+{
+	unsigned int bits = session_hash_bits;
+	unsigned int i;
+
+	if (!bits)
+		return 0;
+	if (bits > 24) {
+		log_warn_once("session_hash_bits %u is too big; using 24.",
+				bits);
+		bits = 24;
+	}
+
+	for (i = 0; i < db->shard_count; i++) {
+		if (init_table_hash(&db->udp[i], bits))
+			return -ENOMEM;
+		if (init_table_hash(&db->tcp[i], bits))
+			return -ENOMEM;
+		if (init_table_hash(&db->icmp[i], bits))
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void init_rss(struct bib *db)
+{
+	db->rss_queues = rss_steering_queues;
+	if (!db->rss_queues)
+		return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	netdev_rss_key_fill(db->rss_key, sizeof(db->rss_key));
+#else
+	log_warn_once("This kernel doesn't expose its RSS key; rss_steering_queues will be ignored.");
+	db->rss_queues = 0;
+#endif
+}
+
+/*
+ * The tables are vmalloc'd because the timer wheels make them fairly large.
+ */
+static struct bib_table *alloc_tables(unsigned int shard_count)
+{
+	return vmalloc(shard_count * sizeof(struct bib_table));
+}
+
+static void free_tables(struct bib_table *tables)
+{
+	vfree(tables);
+}
+
+static void release_pkt_queues(struct bib *db)
+{
+	struct bib_table *table;
+
+	foreach_shard(db, db->tcp, table)
+		if (table->pkt_queue)
+			pktqueue_release(table->pkt_queue);
+}
+
+struct bib *bib_alloc(struct net *ns, struct jool_stats *stats)
+{
+	struct bib *db;
+	unsigned int i;
+
+	db = wkmalloc(struct bib, GFP_KERNEL);
+	if (!db)
+		return NULL;
+
+	db->shard_count = bib_shards ? : 1;
+	db->udp = alloc_tables(db->shard_count);
+	if (!db->udp)
+		goto udp_fail;
+	db->tcp = alloc_tables(db->shard_count);
+	if (!db->tcp)
+		goto tcp_fail;
+	db->icmp = alloc_tables(db->shard_count);
+	if (!db->icmp)
+		goto icmp_fail;
+
+	for (i = 0; i < db->shard_count; i++) {
+		init_table(&db->udp[i], i, db->shard_count, UDP_DEFAULT,
+				UDP_SHORT_DEFAULT, just_die);
+		init_table(&db->tcp[i], i, db->shard_count, TCP_EST, TCP_TRANS,
+				tcp_est_expire_cb);
+		init_table(&db->icmp[i], i, db->shard_count, ICMP_DEFAULT, 0,
+				just_die);
+
+		db->tcp[i].pkt_limit = DEFAULT_MAX_STORED_PKTS;
+		db->tcp[i].pkt_byte_limit = DEFAULT_MAX_STORED_BYTES;
+		/*
+		 * Just in case some crazy psycho decides to change the default.
+		 * THERE IS NO ADRESS-DEPENDENT FILTERING ON ICMP; the RFC is
+		 * wrong.
+		 */
+		db->icmp[i].drop_by_addr = false;
+
+		db->udp[i].events = &db->events;
+		db->tcp[i].events = &db->events;
+		db->icmp[i].events = &db->events;
+
+		db->udp[i].db = db;
+		db->tcp[i].db = db;
+		db->icmp[i].db = db;
+
+		/* Established TCP connections are left alone. */
+		db->udp[i].est_timer.adaptive = true;
+		db->udp[i].trans_timer.adaptive = true;
+		db->tcp[i].trans_timer.adaptive = true;
+		db->tcp[i].closed_timer.adaptive = true;
+		db->icmp[i].est_timer.adaptive = true;
+	}
+
+	for (i = 0; i < db->shard_count; i++) {
+		db->tcp[i].pkt_queue = pktqueue_alloc(ns, stats);
+		if (!db->tcp[i].pkt_queue)
+			goto pktqueue_fail;
+	}
+
+	init_rss(db);
+	policy_init(&db->policy);
+	if (offload_init(&db->offload))
+		goto pktqueue_fail;
+	if (init_hashes(db) || init_adf_filters(db))
+		goto offload_fail;
+	if (bibev_init(&db->events, ns))
+		goto offload_fail;
+
+	db->ns = ns;
+	db->cps_budget = DEFAULT_CPS_BUDGET;
+	db->stats = stats;
+	if (stats)
+		jstat_get(stats);
+	spin_lock_init(&db->probes.lock);
+	INIT_LIST_HEAD(&db->probes.list);
+	db->probes.sending = false;
+	INIT_WORK(&db->probes.work, probe_work_fn);
+	kref_init(&db->refs);
+	register_session_shrinker(db);
+
+	return db;
+
+offload_fail:
+	offload_destroy(&db->offload);
+pktqueue_fail:
+	release_table_hashes(db);
+	release_pkt_queues(db);
+	free_tables(db->icmp);
+icmp_fail:
+	free_tables(db->tcp);
+tcp_fail:
+	free_tables(db->udp);
+udp_fail:
+	wkfree(struct bib, db);
+	return NULL;
+}
+
+void bib_get(struct bib *db)
+{
+	kref_get(&db->refs);
+}
+
+/**
+ * Potentially includes a laggy packet fetch; please do not hold spinlocks while
+ * calling this function!
+ */
+static void release_stored_pkt(struct bib *db, struct tabled_session *session)
+{
+	if (session->stored) {
+		icmp64_send_skb(db->stats, session->stored,
+				ICMPERR_PORT_UNREACHABLE, 0);
+		kfree_skb(session->stored);
+	}
+}
+
+static void release_session(struct rb_node *node, void *arg)
+{
+	struct bib *db = arg;
+	struct tabled_session *session = node2session(node);
+
+	release_stored_pkt(db, session);
+	free_session_rcu(session);
+}
+
+/**
+ * Potentially includes laggy packet fetches; please do not hold spinlocks while
+ * calling this function!
+ */
+static void release_bib_entry(struct rb_node *node, void *arg)
+{
+	struct tabled_bib *bib = bib4_entry(node);
+	rbtree_clear(&bib->sessions, release_session, arg);
+	free_bib_rcu(bib);
+}
+
+static void bib_release(struct kref *refs)
+{
+	struct bib *db;
+	unsigned int i;
+	db = container_of(refs, struct bib, refs);
+
+	/* Also waits for the shrinker to stop running, if it's doing so. */
+	unregister_session_shrinker(db);
+
+	/*
+	 * The trees share the entries, so only one tree of each protocol
+	 * needs to be emptied.
+	 */
+	for (i = 0; i < db->shard_count; i++) {
+		rbtree_clear(&db->udp[i].tree4, release_bib_entry, db);
+		rbtree_clear(&db->tcp[i].tree4, release_bib_entry, db);
+		rbtree_clear(&db->icmp[i].tree4, release_bib_entry, db);
+		flush_subscribers(&db->udp[i]);
+		flush_subscribers(&db->tcp[i]);
+		flush_subscribers(&db->icmp[i]);
+		flush_port_blocks(&db->udp[i]);
+		flush_port_blocks(&db->tcp[i]);
+		flush_port_blocks(&db->icmp[i]);
+		flush_port_bitmaps(&db->udp[i]);
+		flush_port_bitmaps(&db->tcp[i]);
+		flush_port_bitmaps(&db->icmp[i]);
+		flush_statics(&db->udp[i]);
+		flush_statics(&db->tcp[i]);
+		flush_statics(&db->icmp[i]);
+	}
+
+	release_pkt_queues(db);
+	release_table_hashes(db);
+	bibev_destroy(&db->events);
+	offload_destroy(&db->offload);
+	policy_destroy(&db->policy);
+
+	free_tables(db->icmp);
+	free_tables(db->tcp);
+	free_tables(db->udp);
+	if (db->stats)
+		jstat_put(db->stats);
+	wkfree(struct bib, db);
+}
+
+void bib_put(struct bib *db)
+{
+	kref_put(&db->refs, bib_release);
+}
+
+/**
+ * All the shards share the same configuration, so the first one speaks for
+ * the rest.
+ */
+void bib_config_copy(struct bib *db, struct bib_config *config)
+{
+	struct bib_table *tcp = &db->tcp[0];
+	struct bib_table *udp = &db->udp[0];
+	struct bib_table *icmp = &db->icmp[0];
+
+	spin_lock_bh(&tcp->lock);
+	config->bib_logging = tcp->log_bibs;
+	config->session_logging = tcp->log_sessions;
+	config->logging_stream = tcp->log_stream;
+	config->drop_by_addr = tcp->drop_by_addr;
+	config->ttl.tcp_est = tcp->est_timer.base_timeout;
+	config->ttl.tcp_trans = tcp->trans_timer.base_timeout;
+	config->ttl.tcp_closed = tcp->closed_ttl;
+	config->max_stored_pkts = tcp->pkt_limit;
+	config->max_stored_bytes = tcp->pkt_byte_limit;
+	config->stateless_so = tcp->stateless_so;
+	config->drop_external_tcp = tcp->drop_v4_syn;
+	config->max_sessions.tcp = tcp->session_limit;
+	config->subscriber.prefix_len = tcp->subscriber_plen;
+	config->subscriber.max_bibs = tcp->subscriber_max_bibs;
+	config->subscriber.max_sessions = tcp->subscriber_max_sessions;
+	config->subscriber.max_rate = tcp->subscriber_max_rate;
+	config->cps_budget = READ_ONCE(db->cps_budget);
+	config->port_block_size = tcp->block_size;
+	config->deterministic_bits = tcp->det_bits;
+	config->pool4_balance = tcp->balance_masks;
+	config->node_count = tcp->node_count;
+	config->node_id = tcp->node_id;
+	config->sync_interval = tcp->sync_interval;
+	spin_unlock_bh(&tcp->lock);
+
+	spin_lock_bh(&udp->lock);
+	config->ttl.udp = udp->est_timer.base_timeout;
+	config->ttl.udp_short = udp->trans_timer.base_timeout;
+	memcpy(config->udp_short.ports, udp->short_ports,
+			udp->short_port_count * sizeof(*udp->short_ports));
+	config->udp_short.count = udp->short_port_count;
+	config->max_sessions.udp = udp->session_limit;
+	spin_unlock_bh(&udp->lock);
+
+	spin_lock_bh(&icmp->lock);
+	config->ttl.icmp = icmp->est_timer.base_timeout;
+	config->max_sessions.icmp = icmp->session_limit;
+	spin_unlock_bh(&icmp->lock);
+}
+
+void bib_config_set(struct bib *db, struct bib_config *config)
+{
+	struct bib_table *table;
+
+	WRITE_ONCE(db->cps_budget, config->cps_budget);
+
+	foreach_shard(db, db->tcp, table) {
+		table_lock(table);
+		table->log_bibs = config->bib_logging;
+		table->log_sessions = config->session_logging;
+		table->log_stream = config->logging_stream;
+		table->drop_by_addr = config->drop_by_addr;
+		expirer_set_timeout(&table->est_timer, config->ttl.tcp_est,
+				table->pressure_level);
+		expirer_set_timeout(&table->trans_timer, config->ttl.tcp_trans,
+				table->pressure_level);
+		table->closed_ttl = config->ttl.tcp_closed;
+		expirer_set_timeout(&table->closed_timer,
+				config->ttl.tcp_closed ? : config->ttl.tcp_trans,
+				table->pressure_level);
+		table->pkt_limit = config->max_stored_pkts;
+		table->pkt_byte_limit = config->max_stored_bytes;
+		table->stateless_so = config->stateless_so;
+		table->drop_v4_syn = config->drop_external_tcp;
+		table->session_limit = config->max_sessions.tcp;
+		set_subscriber_plen(table, config->subscriber.prefix_len);
+		table->subscriber_max_bibs = config->subscriber.max_bibs;
+		table->subscriber_max_sessions = config->subscriber.max_sessions;
+		table->subscriber_max_rate = config->subscriber.max_rate;
+		table->block_size = config->port_block_size;
+		table->det_bits = config->deterministic_bits;
+		table->balance_masks = config->pool4_balance;
+		table->sync_interval = config->sync_interval;
+		table->node_count = config->node_count;
+		table->node_id = config->node_id;
+		table_unlock(table);
+	}
+
+	foreach_shard(db, db->udp, table) {
+		table_lock(table);
+		table->log_bibs = config->bib_logging;
+		table->log_sessions = config->session_logging;
+		table->log_stream = config->logging_stream;
+		table->drop_by_addr = config->drop_by_addr;
+		expirer_set_timeout(&table->est_timer, config->ttl.udp,
+				table->pressure_level);
+		expirer_set_timeout(&table->trans_timer, config->ttl.udp_short,
+				table->pressure_level);
+		memcpy(table->short_ports, config->udp_short.ports,
+				config->udp_short.count * sizeof(*table->short_ports));
+		table->short_port_count = config->udp_short.count;
+		table->session_limit = config->max_sessions.udp;
+		set_subscriber_plen(table, config->subscriber.prefix_len);
+		table->subscriber_max_bibs = config->subscriber.max_bibs;
+		table->subscriber_max_sessions = config->subscriber.max_sessions;
+		table->subscriber_max_rate = config->subscriber.max_rate;
+		table->block_size = config->port_block_size;
+		table->det_bits = config->deterministic_bits;
+		table->balance_masks = config->pool4_balance;
+		table->sync_interval = config->sync_interval;
+		table->node_count = config->node_count;
+		table->node_id = config->node_id;
+		table_unlock(table);
+	}
+
+	foreach_shard(db, db->icmp, table) {
+		table_lock(table);
+		table->log_bibs = config->bib_logging;
+		table->log_sessions = config->session_logging;
+		table->log_stream = config->logging_stream;
+		expirer_set_timeout(&table->est_timer, config->ttl.icmp,
+				table->pressure_level);
+		table->session_limit = config->max_sessions.icmp;
+		set_subscriber_plen(table, config->subscriber.prefix_len);
+		table->subscriber_max_bibs = config->subscriber.max_bibs;
+		table->subscriber_max_sessions = config->subscriber.max_sessions;
+		table->subscriber_max_rate = config->subscriber.max_rate;
+		table->block_size = config->port_block_size;
+		table->det_bits = config->deterministic_bits;
+		table->balance_masks = config->pool4_balance;
+		table->sync_interval = config->sync_interval;
+		table->node_count = config->node_count;
+		table->node_id = config->node_id;
+		table_unlock(table);
+	}
+}
+
+/**
+ * Appends the creation or destruction of @bib (or of @session, if not NULL) to
+ * the change log. Unlike the logging, this is not optional once the log
+ * exists, so it doesn't care about the blocks either.
+ */
+static void log_change(struct bib_table *table, enum bib_event_type type,
+		struct tabled_bib *bib, struct tabled_session *session)
+{
+	struct bib_change_usr change;
+
+	if (!table->events->log.size)
+		return;
+
+	memset(&change, 0, sizeof(change));
+	change.type = type;
+	change.proto = bib->proto;
+	change.src6 = bib->src6;
+	change.src4 = bib->src4;
+	if (session) {
+		change.dst6 = session->dst6;
+		change.dst4 = session->dst4;
+	}
+	bibev_log(table->events, &change);
+}
+
+static void log_bib(struct bib_table *table,
+		struct tabled_bib *bib,
+		enum bib_event_type type,
+		char *action)
+{
+	struct bib_event_usr event;
+	struct timeval tval;
+	struct tm t;
+
+	log_change(table, type, bib, NULL);
+
+	if (!table->log_bibs)
+		return;
+	/* Blocks log themselves instead of their BIB entries. */
+	if (find_covering_block(table, bib))
+		return;
+
+	if (table->log_stream) {
+		memset(&event, 0, sizeof(event));
+		event.type = type;
+		event.proto = bib->proto;
+		event.src6 = bib->src6;
+		event.src4 = bib->src4;
+		bibev_send(table->events, &event);
+		return;
+	}
+
+	do_gettimeofday(&tval);
+	time_to_tm(tval.tv_sec, 0, &t);
+	log_info("%ld/%d/%d %d:%d:%d (GMT) - %s %pI6c#%u to %pI4#%u (%s)",
+			1900 + t.tm_year, t.tm_mon + 1, t.tm_mday,
+			t.tm_hour, t.tm_min, t.tm_sec, action,
+			&bib->src6.l3, bib->src6.l4,
+			&bib->src4.l3, bib->src4.l4,
+			l4proto_to_string(bib->proto));
+}
+
+static void log_new_bib(struct bib_table *table, struct tabled_bib *bib)
+{
+	trace_jool_bib_add(&bib->src6, &bib->src4, bib->proto);
+	return log_bib(table, bib, BIBEV_BIB_ADD, "Mapped");
+}
+
+static void log_block(struct bib_table *table, struct port_block *block,
+		enum bib_event_type type, char *action)
+{
+	struct bib_event_usr event;
+	struct timeval tval;
+	struct tm t;
+
+	if (!table->log_bibs)
+		return;
+
+	if (table->log_stream) {
+		memset(&event, 0, sizeof(event));
+		event.type = type;
+		event.proto = block->proto;
+		event.src6.l3 = block->owner;
+		event.plen = table->active_block_plen;
+		event.src4.l3 = block->addr;
+		event.src4.l4 = block->first;
+		event.dst4.l4 = block->first + table->active_block_size - 1;
+		bibev_send(table->events, &event);
+		return;
+	}
+
+	do_gettimeofday(&tval);
+	time_to_tm(tval.tv_sec, 0, &t);
+	log_info("%ld/%d/%d %d:%d:%d (GMT) - %s %pI6c/%u to %pI4#%u-%u (%s)",
+			1900 + t.tm_year, t.tm_mon + 1, t.tm_mday,
+			t.tm_hour, t.tm_min, t.tm_sec, action,
+			&block->owner, table->active_block_plen, &block->addr,
+			block->first,
+			block->first + table->active_block_size - 1,
+			l4proto_to_string(block->proto));
+}
+
+static void log_session(struct bib_table *table,
+		struct tabled_session *session,
+		enum bib_event_type type,
+		char *action)
+{
+	struct bib_event_usr event;
+	struct timeval tval;
+	struct tm t;
+
+	log_change(table, type, session->bib, session);
+
+	if (!table->log_sessions)
+		return;
+
+	if (table->log_stream) {
+		memset(&event, 0, sizeof(event));
+		event.type = type;
+		event.proto = session->bib->proto;
+		event.src6 = session->bib->src6;
+		event.dst6 = session->dst6;
+		event.src4 = session->bib->src4;
+		event.dst4 = session->dst4;
+		if (type == BIBEV_SESSION_RM)
+			read_counters(session, &event.counters);
+		bibev_send(table->events, &event);
+		return;
+	}
+
+	do_gettimeofday(&tval);
+	time_to_tm(tval.tv_sec, 0, &t);
+	log_info("%ld/%d/%d %d:%d:%d (GMT) - %s %pI6c#%u|%pI6c#%u|"
+			"%pI4#%u|%pI4#%u|%s",
+			1900 + t.tm_year, t.tm_mon + 1, t.tm_mday,
+			t.tm_hour, t.tm_min, t.tm_sec, action,
+			&session->bib->src6.l3, session->bib->src6.l4,
+			&session->dst6.l3, session->dst6.l4,
+			&session->bib->src4.l3, session->bib->src4.l4,
+			&session->dst4.l3, session->dst4.l4,
+			l4proto_to_string(session->bib->proto));
+}
+
+static void log_new_session(struct bib_table *table,
+		struct tabled_session *session)
+{
+	trace_jool_session_add(&session->bib->src6, &session->dst6,
+			&session->bib->src4, &session->dst4,
+			session->bib->proto);
+	return log_session(table, session, BIBEV_SESSION_ADD, "Added session");
+}
+
+/**
+ * This function does not return a result because whatever needs to happen later
+ * needs to happen regardless of probe status.
+ *
+ * This function does not actually send the probe; it merely prepares it so the
+ * caller can commit to sending it after releasing the spinlock.
+ */
+static void handle_probe(struct bib_table *table,
+		struct list_head *probes,
+		struct tabled_session *session,
+		struct session_entry *tmp)
+{
+	struct probing_session *probe;
+
+	if (WARN(!probes, "Probe needed but caller doesn't support it"))
+		goto discard_probe;
+
+	/*
+	 * Why add a dummy session instead of the real one?
+	 * In the case of TCP probes it's because the real session's list hook
+	 * must remain attached to the database.
+	 * In the case of ICMP errors it's because the fact that a session
+	 * removal can cascade into a BIB entry removal really complicates
+	 * things.
+	 * This way requires this malloc but it's otherwise very clean.
+	 */
+	probe = wkmalloc(struct probing_session, GFP_ATOMIC);
+	if (!probe)
+		goto discard_probe;
+
+	probe->session = *tmp;
+	if (session->stored) {
+		probe->skb = session->stored;
+		session->stored = NULL;
+		table->pkt_count--;
+	} else {
+		probe->skb = NULL;
+	}
+	list_add(&probe->list_hook, probes);
+	return;
+
+discard_probe:
+	/*
+	 * We're going to have to pretend that we sent it anyway; a probe
+	 * failure should not prevent the state from evolving from V4 INIT and
+	 * we do not want that massive thing to linger in the database anymore,
+	 * especially if we failed due to a memory allocation.
+	 */
+	kill_stored_pkt(table, session);
+}
+
+static void rm(struct bib_table *table,
+		struct list_head *probes,
+		struct tabled_session *session,
+		struct session_entry *tmp)
+{
+	struct tabled_bib *bib = session->bib;
+
+	if (session->stored)
+		handle_probe(table, probes, session, tmp);
+
+	rb_erase(&session->tree_hook, &bib->sessions);
+	unhash_session(table, session);
+	wheel_del(table, session);
+	trace_jool_session_rm(&bib->src6, &session->dst6, &bib->src4,
+			&session->dst4, bib->proto);
+	log_session(table, session, BIBEV_SESSION_RM, "Forgot session");
+	sample_lifetime(table, session);
+	free_session_rcu(session);
+	table->session_count--;
+
+	if (!bib->is_static && RB_EMPTY_ROOT(&bib->sessions)) {
+		account_subscriber(table, &bib->src6.l3, -1, -1);
+		rb_erase(&bib->hook6, &table->tree6);
+		rb_erase(&bib->hook4, &table->tree4);
+		trace_jool_bib_rm(&bib->src6, &bib->src4, bib->proto);
+		log_bib(table, bib, BIBEV_BIB_RM, "Forgot");
+		release_port(table, bib);
+		free_bib_rcu(bib);
+		table->bib_count--;
+	} else {
+		account_subscriber(table, &bib->src6.l3, 0, -1);
+	}
+}
+
+/**
+ * Is it worth rewriting @session's update_time (and moving it in the wheel)
+ * because of a packet that arrived at @now?
+ *
+ * On hot sessions, refreshing on every packet means millions of writes per
+ * second to the same cache lines, bouncing between whatever CPUs are handling
+ * the flow. Skipping the refreshes that would move the stamp by less than
+ * refresh_granularity costs at most that much expiration accuracy.
+ *
+ * The granularity never exceeds half of @expirer's timeout, so a session the
+ * cleaner finds expired is always due.
+ */
+static bool refresh_due(struct expire_timer *expirer,
+		struct tabled_session *session, unsigned long now)
+{
+	/* The lockless refresh can be writing this on another CPU. */
+	unsigned long last = READ_ONCE(session->update_time);
+	unsigned long granularity;
+
+	granularity = min(msecs_to_jiffies(refresh_granularity),
+			expirer->timeout / 2);
+	return !time_in_range(now, last, last + granularity - 1);
+}
+
+/**
+ * Does @fate leave @session in the expirer it already is in? (ie. is it a
+ * mere refresh?)
+ */
+static bool fate_is_refresh(struct tabled_session *session,
+		enum session_fate fate)
+{
+	switch (fate) {
+	case FATE_TIMER_EST:
+		return session->timer == SESSION_TIMER_EST;
+	case FATE_TIMER_TRANS:
+		return session->timer == SESSION_TIMER_TRANS;
+	case FATE_TIMER_CLOSED:
+		return session->timer == SESSION_TIMER_CLOSED;
+	default:
+		return false;
+	}
+}
+
+static void handle_fate_timer(struct bib_table *table,
+		struct tabled_session *session,
+		struct expire_timer *timer)
+{
+	session->update_time = jiffies;
+	wheel_del(table, session);
+	wheel_add(timer, session);
+}
+
+static int queue_unsorted_session(struct bib_table *table,
+		struct tabled_session *session,
+		session_timer_type timer_type,
+		bool remove_first)
+{
+	struct expire_timer *expirer;
+
+	switch (timer_type) {
+	case SESSION_TIMER_EST:
+		expirer = &table->est_timer;
+		break;
+	case SESSION_TIMER_TRANS:
+		expirer = &table->trans_timer;
+		break;
+	case SESSION_TIMER_SYN4:
+		expirer = &table->syn4_timer;
+		break;
+	case SESSION_TIMER_CLOSED:
+		expirer = &table->closed_timer;
+		break;
+	default:
+		log_warn_once("incoming joold session's timer (%d) is unknown.",
+				timer_type);
+		return -EINVAL;
+	}
+
+	if (remove_first)
+		wheel_del(table, session);
+	wheel_add(expirer, session);
+	return 0;
+}
+
+/**
+ * Assumes result->session has been set (result->session_set is true).
+ */
+static verdict decide_fate(struct collision_cb *cb,
+		struct bib_table *table,
+		struct tabled_session *session,
+		struct list_head *probes)
+{
+	struct session_entry tmp;
+	enum session_fate fate;
+	bool coalesce;
+
+	if (!cb)
+		return VERDICT_CONTINUE;
+
+	tstose(table, session, &tmp);
+	fate = cb->cb(&tmp, cb->arg);
+	coalesce = fate_is_refresh(session, fate)
+			&& !refresh_due(get_expirer(table, session), session,
+					jiffies);
+
+	/* The callback above is entitled to tweak these fields. */
+	if (session->state != tmp.state)
+		session->state = tmp.state;
+	if (!coalesce)
+		session->update_time = tmp.update_time;
+	if (!tmp.has_stored)
+		kill_stored_pkt(table, session);
+	/* Also the expirer, which is down below. */
+
+	switch (fate) {
+	case FATE_TIMER_EST:
+		if (!coalesce)
+			handle_fate_timer(table, session,
+					get_est_expirer(table, session));
+		break;
+
+	case FATE_PROBE:
+		/* TODO ICMP errors aren't supposed to drop down to TRANS. */
+		handle_probe(table, probes, session, &tmp);
+		/* Fall through. */
+	case FATE_TIMER_TRANS:
+		if (!coalesce)
+			handle_fate_timer(table, session, &table->trans_timer);
+		break;
+
+	case FATE_TIMER_CLOSED:
+		if (!coalesce)
+			handle_fate_timer(table, session, &table->closed_timer);
+		break;
+
+	case FATE_RM:
+		rm(table, probes, session, &tmp);
+		break;
+
+	case FATE_PRESERVE:
+		break;
+	case FATE_DROP:
+		return VERDICT_DROP;
+
+	case FATE_TIMER_SLOW:
+		/*
+		 * Nothing to do with the return value.
+		 * If timer type was invalid, well don't change the expirer.
+		 * We left a warning in the log.
+		 */
+		queue_unsorted_session(table, session, tmp.timer_type, true);
+		break;
+	}
+
+	return VERDICT_CONTINUE;
+}
+
+/** Destinations each probe batch remembers the route of. */
+#define PROBE_ROUTES 8
+/** Time between probe batches. */
+#define PROBE_PERIOD_MS 100
+
+/**
+ * A route a probe batch already looked up. Probes share the source address
+ * (pool6) and tend to share destinations (the clients behind the NAT64), so
+ * most of them don't need their own route6().
+ */
+struct probe_route {
+	struct in6_addr saddr;
+	struct in6_addr daddr;
+	/** NULL means the slot is empty. */
+	struct dst_entry *dst;
+};
+
+static struct dst_entry *route_probe(struct net *ns, struct packet *pkt,
+		struct probe_route *routes)
+{
+	struct ipv6hdr *hdr = pkt_ip6_hdr(pkt);
+	struct probe_route *slot;
+	struct dst_entry *dst;
+
+	slot = &routes[ipv6_addr_hash(&hdr->daddr) & (PROBE_ROUTES - 1)];
+	if (slot->dst && ipv6_addr_equal(&slot->daddr, &hdr->daddr)
+			&& ipv6_addr_equal(&slot->saddr, &hdr->saddr)) {
+		dst = dst_clone(slot->dst);
+		skb_dst_set(pkt->skb, dst);
+		return dst;
+	}
+
+	dst = route6(ns, pkt);
+	if (!dst)
+		return NULL;
+
+	if (slot->dst)
+		dst_release(slot->dst);
+	slot->saddr = hdr->saddr;
+	slot->daddr = hdr->daddr;
+	slot->dst = dst_clone(dst);
+	return dst;
+}
+
+static void release_probe_routes(struct probe_route *routes)
+{
+	unsigned int i;
+
+	for (i = 0; i < PROBE_ROUTES; i++) {
+		if (routes[i].dst)
+			dst_release(routes[i].dst);
+		routes[i].dst = NULL;
+	}
+}
+
+/**
+ * send_probe_packet - Sends a probe packet to @session's IPv6 endpoint,
+ * to trigger a confirmation ACK if the connection is still alive.
+ *
+ * From RFC 6146 page 30.
+ *
+ * @session: the established session that has been inactive for too long.
+ * @routes: the batch's route cache. (PROBE_ROUTES slots.)
+ *
+ * Best if not called with spinlocks held.
+ */
+static void send_probe_packet(struct net *ns, struct session_entry *session,
+		struct probe_route *routes)
+{
+	struct packet pkt;
+	struct sk_buff *skb;
+	struct ipv6hdr *iph;
+	struct tcphdr *th;
+	int error;
+
+	unsigned int l3_hdr_len = sizeof(*iph);
+	unsigned int l4_hdr_len = sizeof(*th);
+
+	skb = alloc_skb(LL_MAX_HEADER + l3_hdr_len + l4_hdr_len, GFP_ATOMIC);
+	if (!skb) {
+		log_debug("Could now allocate a probe packet.");
+		goto fail;
+	}
+
+	skb_reserve(skb, LL_MAX_HEADER);
+	skb_put(skb, l3_hdr_len + l4_hdr_len);
+	skb_reset_mac_header(skb);
+	skb_reset_network_header(skb);
+	skb_set_transport_header(skb, l3_hdr_len);
+
+	iph = ipv6_hdr(skb);
+	iph->version = 6;
+	iph->priority = 0;
+	iph->flow_lbl[0] = 0;
+	iph->flow_lbl[1] = 0;
+	iph->flow_lbl[2] = 0;
+	iph->payload_len = cpu_to_be16(l4_hdr_len);
+	iph->nexthdr = NEXTHDR_TCP;
+	iph->hop_limit = 255;
+	iph->saddr = session->dst6.l3;
+	iph->daddr = session->src6.l3;
+
+	th = tcp_hdr(skb);
+	th->source = cpu_to_be16(session->dst6.l4);
+	th->dest = cpu_to_be16(session->src6.l4);
+	th->seq = htonl(0);
+	th->ack_seq = htonl(0);
+	th->res1 = 0;
+	th->doff = l4_hdr_len / 4;
+	th->fin = 0;
+	th->syn = 0;
+	th->rst = 0;
+	th->psh = 0;
+	th->ack = 1;
+	th->urg = 0;
+	th->ece = 0;
+	th->cwr = 0;
+	th->window = htons(8192);
+	th->check = 0;
+	th->urg_ptr = 0;
+
+	/* TODO (performance) can't we just defer this to somebody else? */
+	th->check = csum_ipv6_magic(&iph->saddr, &iph->daddr, l4_hdr_len,
+			IPPROTO_TCP, csum_partial(th, l4_hdr_len, 0));
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+
+	pkt_fill(&pkt, skb, L3PROTO_IPV6, L4PROTO_TCP, NULL, th + 1, NULL);
+
+	if (!route_probe(ns, &pkt, routes)) {
+		kfree_skb(skb);
+		goto fail;
+	}
+
+	/* Implicit kfree_skb(skb) here. */
+#if LINUX_VERSION_AT_LEAST(4, 4, 0, 9999, 0)
+	error = dst_output(ns, NULL, skb);
+#else
+	error = dst_output(skb);
+#endif
+	if (error) {
+		log_debug("dst_output() returned errcode %d.", error);
+		goto fail;
+	}
+
+	return;
+
+fail:
+	log_debug("A TCP connection will probably break.");
+}
+
+/** Probes each batch is allowed to send, according to probe_rate. */
+static unsigned int probe_quota(void)
+{
+	unsigned int rate = probe_rate;
+
+	if (rate == 0)
+		return UINT_MAX;
+	rate /= MSEC_PER_SEC / PROBE_PERIOD_MS;
+	return rate ? : 1;
+}
+
+/**
+ * Sends @db's queued probes, one batch every PROBE_PERIOD_MS, until the queue
+ * is empty.
+ */
+static void probe_work_fn(struct work_struct *work)
+{
+	struct bib *db = container_of(work, struct bib, probes.work);
+	struct probe_queue *queue = &db->probes;
+	struct probe_route routes[PROBE_ROUTES];
+	struct probing_session *probe;
+	struct probing_session *tmp;
+	LIST_HEAD(batch);
+	unsigned int quota;
+	bool done;
+
+	memset(routes, 0, sizeof(routes));
+
+	do {
+		quota = probe_quota();
+
+		spin_lock_bh(&queue->lock);
+		list_for_each_entry_safe(probe, tmp, &queue->list, list_hook) {
+			if (quota-- == 0)
+				break;
+			list_move_tail(&probe->list_hook, &batch);
+		}
+		done = list_empty(&queue->list);
+		if (done)
+			queue->sending = false;
+		spin_unlock_bh(&queue->lock);
+
+		list_for_each_entry_safe(probe, tmp, &batch, list_hook) {
+			send_probe_packet(db->ns, &probe->session, routes);
+			list_del(&probe->list_hook);
+			wkfree(struct probing_session, probe);
+		}
+		/* Routes can change; don't hold on to them between batches. */
+		release_probe_routes(routes);
+
+		if (!done)
+			msleep(PROBE_PERIOD_MS);
+	} while (!done);
+
+	bib_put(db);
+}
+
+/**
+ * Sends the ICMP errors listed in @probes, and hands the actual probes over to
+ * @db's probe queue.
+ */
+static void post_fate(struct bib *db, struct list_head *probes)
+{
+	struct probe_queue *queue = &db->probes;
+	struct probing_session *probe;
+	struct probing_session *tmp;
+	bool start;
+
+	list_for_each_entry_safe(probe, tmp, probes, list_hook) {
+		if (probe->skb) {
+			/* The "probe" is not a probe; it's an ICMP error. */
+			icmp64_send_skb(db->stats, probe->skb,
+					ICMPERR_PORT_UNREACHABLE, 0);
+			kfree_skb(probe->skb);
+			list_del(&probe->list_hook);
+			wkfree(struct probing_session, probe);
+		}
+	}
+
+	if (list_empty(probes))
+		return;
+
+	spin_lock_bh(&queue->lock);
+	list_splice_tail(probes, &queue->list);
+	start = !queue->sending;
+	queue->sending = true;
+	spin_unlock_bh(&queue->lock);
+
+	if (start) {
+		bib_get(db);
+		queue_work(clean_wq, &queue->work);
+	}
+}
+
+struct slot_group {
+	struct tree_slot bib6;
+	struct tree_slot bib4;
+	struct tree_slot session;
+};
+
+static void commit_bib_add(struct bib_table *table, struct slot_group *slots)
+{
+	struct tabled_bib *bib = bib6_entry(slots->bib6.entry);
+
+	treeslot_commit_rcu(&slots->bib6);
+	treeslot_commit_rcu(&slots->bib4);
+	table->bib_count++;
+	take_port(table, bib);
+	account_subscriber(table, &bib->src6.l3, 1, 0);
+}
+
+/**
+ * Note: The session's bib field has to be already set.
+ */
+static void commit_session_add(struct bib_table *table, struct tree_slot *slot)
+{
+	struct tabled_session *session = node2session(slot->entry);
+
+	treeslot_commit_rcu(slot);
+	hash_session(table, session);
+	table->session_count++;
+	account_subscriber(table, &session->bib->src6.l3, 0, 1);
+}
+
+static void attach_timer(struct tabled_session *session,
+		struct expire_timer *expirer)
+{
+	session->update_time = jiffies;
+	wheel_add(expirer, session);
+}
+
+static int compare_src6(struct tabled_bib *a, struct ipv6_transport_addr *b)
+{
+	return taddr6_compare(&a->src6, b);
+}
+
+static int compare_src6_rbnode(struct rb_node *a, struct rb_node *b)
+{
+	return taddr6_compare(&bib6_entry(a)->src6, &bib6_entry(b)->src6);
+}
+
+static int compare_src4(struct tabled_bib const *a,
+		struct ipv4_transport_addr const *b)
+{
+	return taddr4_compare(&a->src4, b);
+}
+
+static int compare_src4_rbnode(struct rb_node *a, struct rb_node *b)
+{
+	return taddr4_compare(&bib4_entry(a)->src4, &bib4_entry(b)->src4);
+}
+
+static int compare_dst4(struct tabled_session *a, struct tabled_session *b)
+{
+	return taddr4_compare(&a->dst4, &b->dst4);
+}
+
+static struct tabled_bib *find_bib6(struct bib_table *table,
+		struct ipv6_transport_addr *addr)
+{
+	return rbtree_find(addr, &table->tree6, compare_src6, struct tabled_bib,
+			hook6);
+}
+
+static struct tabled_bib *find_bib4(struct bib_table *table,
+		struct ipv4_transport_addr *addr)
+{
+	return rbtree_find(addr, &table->tree4, compare_src4, struct tabled_bib,
+			hook4);
+}
+
+/**
+ * find_bib4() for the packet path. Port forwards are checked first, because
+ * their index is small and never changes because of the traffic.
+ */
+static struct tabled_bib *find_bib4_pkt(struct bib_table *table,
+		struct ipv4_transport_addr *addr)
+{
+	struct tabled_bib *bib;
+
+	bib = find_static4(table, addr);
+	return bib ? bib : find_bib4(table, addr);
+}
+
+static struct tabled_bib *find_bibtree6_slot(struct bib_table *table,
+		struct tabled_bib *new,
+		struct tree_slot *slot)
+{
+	struct rb_node *collision;
+	collision = rbtree_find_slot(&new->hook6, &table->tree6,
+			compare_src6_rbnode, slot);
+	return bib6_entry(collision);
+}
+
+static struct tabled_bib *find_bibtree4_slot(struct bib_table *table,
+		struct tabled_bib *new,
+		struct tree_slot *slot)
+{
+	struct rb_node *collision;
+	collision = rbtree_find_slot(&new->hook4, &table->tree4,
+			compare_src4_rbnode, slot);
+	return bib4_entry(collision);
+}
+
+/**
+ * Attempts to find the slot where @new would be inserted if you wanted to add
+ * it to @bib's session tree.
+ *
+ * On success:
+ * - Initializes @slots as the place (in @bib's session tree) where @new would
+ *   be inserted if you wanted to do so.
+ * - Returns NULL.
+ *
+ * If @session collides with @bib's session S:
+ * - @slot is undefined.
+ * - S is returned.
+ *
+ * As a side effect, @allow will tell you whether the entry is allowed to be
+ * added to the tree if address-dependent filtering is enabled. Send NULL if you
+ * don't care about that.
+ *
+ * Please notice: This searches via @new's dst4, *not* dst6. @new *must* carry
+ * an initialized dst4.
+ */
+static struct tabled_session *find_session_slot(struct tabled_bib *bib,
+		struct tabled_session *new,
+		bool *allow,
+		struct tree_slot *slot)
+{
+	struct tabled_session *session;
+	struct rb_node *node;
+	int comparison;
+
+	treeslot_init(slot, &bib->sessions, &new->tree_hook);
+	node = bib->sessions.rb_node;
+	if (allow)
+		*allow = false;
+
+	while (node) {
+		session = node2session(node);
+		comparison = compare_dst4(session, new);
+
+		if (allow && session->dst4.l3.s_addr == new->dst4.l3.s_addr)
+			*allow = true;
+
+		slot->parent = node;
+		if (comparison < 0) {
+			slot->rb_link = &node->rb_right;
+			node = node->rb_right;
+		} else if (comparison > 0) {
+			slot->rb_link = &node->rb_left;
+			node = node->rb_left;
+		} else {
+			return session;
+		}
+	}
+
+	return NULL;
+}
+
+static int alloc_bib_session(struct bib_session_tuple *tuple,
+		l4_protocol proto)
+{
+	struct tabled_pair *pair;
+
+	if (proto == L4PROTO_ICMP) {
+		pair = alloc_pair(GFP_ATOMIC);
+		if (!pair)
+			return -ENOMEM;
+		tuple->bib = &pair->bib;
+		tuple->session = &pair->session;
+		return 0;
+	}
+
+	tuple->bib = alloc_bib(GFP_ATOMIC);
+	if (!tuple->bib)
+		return -ENOMEM;
+
+	tuple->session = alloc_session(GFP_ATOMIC);
+	if (!tuple->session) {
+		free_bib(tuple->bib);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int create_bib_session6(struct bib_session_tuple *tuple,
+		struct tuple *tuple6,
+		struct ipv4_transport_addr *dst4,
+		tcp_state state)
+{
+	int error;
+
+	error = alloc_bib_session(tuple, tuple6->l4_proto);
+	if (error)
+		return error;
+
+	/*
+	 * Hooks, expirer fields and session->bib are left uninitialized since
+	 * they depend on database knowledge.
+	 */
+
+	tuple->bib->src6 = tuple6->src.addr6;
+	/*
+	 * src4 is left uninitialized on purpose.
+	 * It needs to be inferred later by comparing the masks and the existing
+	 * BIB entries.
+	 */
+	tuple->bib->proto = tuple6->l4_proto;
+	tuple->bib->is_static = false;
+	tuple->bib->sessions = RB_ROOT;
+	tuple->session->dst6 = tuple6->dst.addr6;
+	tuple->session->dst4 = *dst4;
+	tuple->session->state = state;
+	tuple->session->sync_time = sync_stamp();
+	tuple->session->stored = NULL;
+	return 0;
+}
+
+static struct tabled_session *create_session4(struct tuple *tuple4,
+		struct ipv6_transport_addr *dst6,
+		tcp_state state)
+{
+	struct tabled_session *session;
+
+	session = alloc_session(GFP_ATOMIC);
+	if (!session)
+		return NULL;
+
+	/*
+	 * Hooks, expirer fields and session->bib are left uninitialized since
+	 * they depend on database knowledge.
+	 */
+	session->dst6 = *dst6;
+	session->dst4 = tuple4->src.addr4;
+	session->state = state;
+	session->sync_time = sync_stamp();
+	session->stored = NULL;
+	return session;
+}
+
+static int create_bib_session(struct session_entry *session,
+		struct bib_session_tuple *tuple)
+{
+	int error;
+
+	error = alloc_bib_session(tuple, session->proto);
+	if (error)
+		return error;
+
+	/*
+	 * Hooks, most expirer fields and session->bib are left uninitialized
+	 * since they depend on database knowledge.
+	 */
+	tuple->bib->src6 = session->src6;
+	tuple->bib->src4 = session->src4;
+	tuple->bib->proto = session->proto;
+	tuple->bib->is_static = false;
+	tuple->bib->sessions = RB_ROOT;
+	tuple->session->dst6 = session->dst6;
+	tuple->session->dst4 = session->dst4;
+	tuple->session->state = session->state;
+	tuple->session->update_time = session->update_time;
+	/* It came from a peer, so the peers already know about it. */
+	tuple->session->sync_time = sync_stamp();
+	tuple->session->stored = NULL;
+	return 0;
+}
+
+/**
+ * Returns the session from @expirer that has been idle the longest, or at
+ * least a close approximation. (Sessions that expire one or more wheel
+ * revolutions later share slots with the current ones, so only the heads of
+ * the slots are compared against the current revolution.)
+ *
+ * Never returns @exclude.
+ */
+static struct tabled_session *find_oldest(struct expire_timer *expirer,
+		struct tabled_session *exclude)
+{
+	struct tabled_session *session;
+	struct tabled_session *fallback = NULL;
+	unsigned long horizon;
+	unsigned long time;
+	unsigned int i;
+
+	horizon = expirer->next_slot + WHEEL_SLOTS * WHEEL_GRANULARITY;
+
+	for (i = 0; i < WHEEL_SLOTS; i++) {
+		time = expirer->next_slot + i * WHEEL_GRANULARITY;
+		list_for_each_entry(session, wheel_slot(expirer, time), list_hook) {
+			if (session == exclude)
+				continue;
+			if (time_before(session->update_time + expirer->timeout,
+					horizon))
+				return session;
+			if (!fallback)
+				fallback = session;
+			break;
+		}
+	}
+
+	return fallback;
+}
+
+/**
+ * Makes room for @new, if the table has outgrown its session limit.
+ *
+ * Dead TCP sessions go first, since nobody is going to miss them. Transitory
+ * ones are sacrificed before established ones, because they are the ones an
+ * attacker can create most cheaply.
+ *
+ * Must be called after @new (and its BIB entry) have been committed, because
+ * it edits the trees.
+ */
+static void evict_if_full(struct bib_table *table, struct tabled_session *new)
+{
+	struct tabled_session *victim;
+
+	if (!table->session_limit)
+		return;
+	if (table->session_count * table->shard_count <= table->session_limit)
+		return;
+
+	victim = find_oldest(&table->closed_timer, new);
+	if (!victim)
+		victim = find_oldest(&table->trans_timer, new);
+	if (!victim)
+		victim = find_oldest(&table->syn4_timer, new);
+	if (!victim)
+		victim = find_oldest(&table->est_timer, new);
+	if (!victim)
+		return;
+
+	/*
+	 * This is the packet path; don't bother with the ICMP error (and the
+	 * probe list it would need).
+	 */
+	kill_stored_pkt(table, victim);
+	rm(table, NULL, victim, NULL);
+	table->evicted++;
+}
+
+/*
+ * The shrinker. Under memory pressure, the kernel asks the instance to give
+ * up the sessions it can most easily live without: the ones that are queued
+ * for expiration anyway. Established TCP sessions are never touched, since
+ * killing them breaks connections that are still in use.
+ *
+ * (Kernels older than 3.12 have a different shrinker API, and don't get one.)
+ */
+#if LINUX_VERSION_AT_LEAST(3, 12, 0, 9999, 0)
+
+static struct bib *shrinker_db(struct shrinker *shrinker)
+{
+#if LINUX_VERSION_AT_LEAST(6, 7, 0, 9999, 0)
+	return shrinker->private_data;
+#else
+	return container_of(shrinker, struct bib, shrinker_storage);
+#endif
+}
+
+static unsigned long count_idle(struct bib_table *table, bool tcp)
+{
+	if (tcp) {
+		return READ_ONCE(table->closed_timer.count)
+				+ READ_ONCE(table->trans_timer.count)
+				+ READ_ONCE(table->syn4_timer.count);
+	}
+
+	return READ_ONCE(table->est_timer.count)
+			+ READ_ONCE(table->trans_timer.count);
+}
+
+static unsigned long shrink_count(struct shrinker *shrinker,
+		struct shrink_control *sc)
+{
+	struct bib *db = shrinker_db(shrinker);
+	struct bib_table *table;
+	unsigned long count = 0;
+
+	if (!READ_ONCE(shrink_sessions))
+		return 0;
+
+	foreach_shard(db, db->udp, table)
+		count += count_idle(table, false);
+	foreach_shard(db, db->icmp, table)
+		count += count_idle(table, false);
+	foreach_shard(db, db->tcp, table)
+		count += count_idle(table, true);
+
+	return count;
+}
+
+/**
+ * Evicts up to @budget of @table's idle sessions, oldest first. Returns the
+ * number of sessions it killed.
+ */
+static unsigned long shrink_table(struct bib_table *table, bool tcp,
+		unsigned long budget)
+{
+	struct tabled_session *victim;
+	unsigned long freed = 0;
+
+	lock_table(table);
+	while (freed < budget) {
+		victim = tcp ? find_oldest(&table->closed_timer, NULL) : NULL;
+		if (!victim)
+			victim = find_oldest(&table->trans_timer, NULL);
+		if (!victim)
+			victim = find_oldest(tcp ? &table->syn4_timer
+					: &table->est_timer, NULL);
+		if (!victim)
+			break;
+
+		kill_stored_pkt(table, victim);
+		rm(table, NULL, victim, NULL);
+		table->evicted++;
+		freed++;
+	}
+	unlock_table(table);
+
+	return freed;
+}
+
+static unsigned long shrink_scan(struct shrinker *shrinker,
+		struct shrink_control *sc)
+{
+	struct bib *db = shrinker_db(shrinker);
+	struct bib_table *table;
+	unsigned long freed = 0;
+
+	if (!READ_ONCE(shrink_sessions))
+		return SHRINK_STOP;
+
+	/* UDP and ICMP first; their sessions are the cheapest to rebuild. */
+	foreach_shard(db, db->udp, table)
+		freed += shrink_table(table, false, sc->nr_to_scan - freed);
+	foreach_shard(db, db->icmp, table)
+		freed += shrink_table(table, false, sc->nr_to_scan - freed);
+	foreach_shard(db, db->tcp, table)
+		freed += shrink_table(table, true, sc->nr_to_scan - freed);
+
+	if (!freed)
+		return SHRINK_STOP;
+
+	offload_flush(&db->offload);
+	if (db->stats)
+		jstat_add(db->stats, JSTAT_SESSIONS_RECLAIMED, freed);
+	log_debug("Memory pressure: Evicted %lu sessions.", freed);
+	return freed;
+}
+
+#endif /* 3.12 */
+
+static void register_session_shrinker(struct bib *db)
+{
+	db->shrinker = NULL;
+
+#if LINUX_VERSION_AT_LEAST(6, 7, 0, 9999, 0)
+	db->shrinker = shrinker_alloc(0, "jool-sessions");
+	if (!db->shrinker)
+		goto fail;
+	db->shrinker->count_objects = shrink_count;
+	db->shrinker->scan_objects = shrink_scan;
+	db->shrinker->seeks = DEFAULT_SEEKS;
+	db->shrinker->private_data = db;
+	shrinker_register(db->shrinker);
+	return;
+#elif LINUX_VERSION_AT_LEAST(3, 12, 0, 9999, 0)
+	memset(&db->shrinker_storage, 0, sizeof(db->shrinker_storage));
+	db->shrinker_storage.count_objects = shrink_count;
+	db->shrinker_storage.scan_objects = shrink_scan;
+	db->shrinker_storage.seeks = DEFAULT_SEEKS;
+#if LINUX_VERSION_AT_LEAST(6, 0, 0, 9999, 0)
+	if (register_shrinker(&db->shrinker_storage, "jool-sessions"))
+		goto fail;
+#else
+	if (register_shrinker(&db->shrinker_storage))
+		goto fail;
+#endif
+	db->shrinker = &db->shrinker_storage;
+	return;
+#else
+	return;
+#endif
+
+#if LINUX_VERSION_AT_LEAST(3, 12, 0, 9999, 0)
+fail:
+	/* Not fatal; the sessions just wait for their timeouts. */
+	log_warn_once("Could not register the session shrinker.");
+#endif
+}
+
+static void unregister_session_shrinker(struct bib *db)
+{
+	if (!db->shrinker)
+		return;
+
+#if LINUX_VERSION_AT_LEAST(6, 7, 0, 9999, 0)
+	shrinker_free(db->shrinker);
+#elif LINUX_VERSION_AT_LEAST(3, 12, 0, 9999, 0)
+	unregister_shrinker(db->shrinker);
+#endif
+}
+
+/**
+ * Boilerplate code to finish hanging @new->session (and potentially @new->bib
+ * as well) on one af @table's trees. 6-to-4 direction.
+ *
+ * It assumes @slots already describes the tree containers where the entries are
+ * supposed to be added.
+ */
+static void commit_add6(struct bib_table *table,
+		struct bib_session_tuple *old,
+		struct bib_session_tuple *new,
+		struct slot_group *slots,
+		struct expire_timer *expirer,
+		struct bib_session *result)
+{
+	struct tabled_session *session = new->session;
+
+	session->bib = old->bib ? : new->bib;
+	commit_session_add(table, &slots->session);
+	attach_timer(session, expirer);
+	log_new_session(table, session);
+	tstobs(table, session, result);
+	new->session = NULL; /* Do not free! */
+
+	if (!old->bib) {
+		commit_bib_add(table, slots);
+		log_new_bib(table, new->bib);
+		new->bib = NULL; /* Do not free! */
+	}
+
+	evict_if_full(table, session);
+}
+
+/**
+ * Boilerplate code to finish hanging *@new on one af @table's trees.
+ * 4-to-6 direction.
+ *
+ * It assumes @slot already describes the tree container where the session is
+ * supposed to be added.
+ */
+static void commit_add4(struct bib_table *table,
+		struct bib_session_tuple *old,
+		struct tabled_session **new,
+		struct tree_slot *slot,
+		struct expire_timer *expirer,
+		struct bib_session *result)
+{
+	struct tabled_session *session = *new;
+
+	session->bib = old->bib;
+	commit_session_add(table, slot);
+	attach_timer(session, expirer);
+	log_new_session(table, session);
+	tstobs(table, session, result);
+	*new = NULL; /* Do not free! */
+
+	evict_if_full(table, session);
+}
+
+/**
+ * Boilerplate code to finish hanging *@new on one af @table's trees.
+ * joold version.
+ *
+ * It assumes @slots already describes the tree containers where the entries are
+ * supposed to be added.
+ */
+static int commit_add(struct bib_table *table,
+		struct bib_session_tuple *old,
+		struct bib_session_tuple *new,
+		struct slot_group *slots,
+		session_timer_type timer_type)
+{
+	struct tabled_session *session = new->session;
+	int error;
+
+	error = queue_unsorted_session(table, session, timer_type, false);
+	if (error)
+		return error;
+
+	session->bib = old->bib ? : new->bib;
+	commit_session_add(table, &slots->session);
+	log_new_session(table, session);
+	new->session = NULL; /* Do not free! */
+
+	if (!old->bib) {
+		commit_bib_add(table, slots);
+		log_new_bib(table, new->bib);
+		new->bib = NULL; /* Do not free! */
+	}
+
+	evict_if_full(table, session);
+	return 0;
+}
+
+struct detach_args {
+	struct bib_table *table;
+	struct sk_buff *probes;
+	unsigned int detached;
+};
+
+static void detach_session(struct rb_node *node, void *arg)
+{
+	struct tabled_session *session = node2session(node);
+	struct detach_args *args = arg;
+
+	wheel_del(args->table, session);
+	unhash_session(args->table, session);
+	if (session->stored)
+		args->table->pkt_count--;
+	log_change(args->table, BIBEV_SESSION_RM, session->bib, session);
+	args->detached++;
+}
+
+static unsigned int detach_sessions(struct bib_table *table,
+		struct tabled_bib *bib)
+{
+	struct detach_args arg = { .table = table, .detached = 0, };
+	rbtree_foreach(&bib->sessions, detach_session, &arg);
+	return arg.detached;
+}
+
+static void detach_bib(struct bib_table *table, struct tabled_bib *bib)
+{
+	unsigned int detached;
+
+	rb_erase(&bib->hook6, &table->tree6);
+	rb_erase(&bib->hook4, &table->tree4);
+	unindex_static(table, bib);
+	release_port(table, bib);
+	table->bib_count--;
+	detached = detach_sessions(table, bib);
+	log_change(table, BIBEV_BIB_RM, bib, NULL);
+	table->session_count -= detached;
+	account_subscriber(table, &bib->src6.l3, -1, -(int)detached);
+}
+
+struct bib_delete_list {
+	struct rb_node *first;
+};
+
+static void add_to_delete_list(struct bib_delete_list *list, struct rb_node *node)
+{
+	node->rb_right = list->first;
+	list->first = node;
+}
+
+static void commit_delete_list(struct bib *db, struct bib_delete_list *list)
+{
+	struct rb_node *node;
+	struct rb_node *next;
+
+	if (list->first)
+		offload_flush(&db->offload);
+
+	for (node = list->first; node; node = next) {
+		next = node->rb_right;
+		release_bib_entry(node, db);
+	}
+}
+
+/**
+ * Tests whether @predecessor's immediate succesor tree slot is a suitable
+ * placeholder for @bib. Returns the colliding node.
+ *
+ * (That is, returns NULL on success, a collision on failure.)
+ *
+ * In other words:
+ * Assumes that @predecessor belongs to @table's v4 tree and that it is @bib's
+ * predecessor. (ie. @predecessor's transport address is @bib's transport
+ * address - 1.) You want to test whether @bib can be inserted to the tree.
+ * If @predecessor's succesor collides with @bib (ie. it has @bib's v4 address),
+ * it returns the colliding succesor.
+ * If @predecessor's succesor does not collide with @bib, it returns NULL and
+ * initializes @slot so you can actually add @bib to the tree.
+ */
+static struct tabled_bib *try_next(struct bib_table *table,
+		struct tabled_bib *predecessor,
+		struct tabled_bib *bib,
+		struct tree_slot *slot)
+{
+	struct tabled_bib *next;
+
+	next = bib4_entry(rb_next(&predecessor->hook4));
+	if (!next) {
+		/* There is no succesor and therefore no collision. */
+		slot->tree = &table->tree4;
+		slot->entry = &bib->hook4;
+		slot->parent = &predecessor->hook4;
+		slot->rb_link = &slot->parent->rb_right;
+		return NULL;
+	}
+
+	if (taddr4_equals(&next->src4, &bib->src4))
+		return next; /* Next is yet another collision. */
+
+	slot->tree = &table->tree4;
+	slot->entry = &bib->hook4;
+	if (predecessor->hook4.rb_right) {
+		slot->parent = &next->hook4;
+		slot->rb_link = &slot->parent->rb_left;
+	} else {
+		slot->parent = &predecessor->hook4;
+		slot->rb_link = &slot->parent->rb_right;
+	}
+	return NULL;
+}
+
+/**
+ * Is the pool4 partition of an active/active cluster in effect?
+ * (See bib_config.node_count.)
+ */
+static bool is_partitioned(struct bib_table *table)
+{
+	return table->node_count > 1;
+}
+
+/**
+ * Does @index (a port, or a port block's index) belong to this node's pool4
+ * partition? An out-of-range node ID wraps around.
+ */
+static bool in_partition(struct bib_table *table, unsigned int index)
+{
+	if (!is_partitioned(table))
+		return true;
+	return index % table->node_count == table->node_id % table->node_count;
+}
+
+/**
+ * Returns the last @bits bits of @addr's first @plen bits.
+ */
+static unsigned int subscriber_index(const struct in6_addr *addr, __u8 plen,
+		__u8 bits)
+{
+	unsigned int result = 0;
+	unsigned int i;
+
+	for (i = plen - bits; i < plen; i++) {
+		result <<= 1;
+		result |= (addr->s6_addr[i >> 3] >> (7 - (i & 7))) & 1;
+	}
+
+	return result;
+}
+
+/**
+ * Deterministic NAT version of find_available_mask(): @masks is split into
+ * 2^det_bits slices of the same size, and @bib can only be masked with
+ * transport addresses from its subscriber's slice.
+ *
+ * Returns 1 if deterministic NAT doesn't apply, so the caller can fall back
+ * to the other algorithms.
+ */
+static int find_deterministic_mask(struct bib_table *table,
+		struct mask_domain *masks,
+		struct tabled_bib *bib,
+		struct tree_slot *slot)
+{
+	const unsigned long *taken;
+	unsigned int per_slice;
+	unsigned int first;
+	unsigned int offset;
+	unsigned int i;
+
+	if (!table->det_bits)
+		return 1;
+	if (table->shard_count > 1 || mask_domain_is_dynamic(masks))
+		return 1;
+	if (table->det_bits > table->subscriber_plen) {
+		log_warn_once("Deterministic NAT needs a subscriber prefix length of at least %u bits.",
+				table->det_bits);
+		return 1;
+	}
+
+	per_slice = mask_domain_count(masks) >> table->det_bits;
+	if (!per_slice) {
+		log_warn_once("pool4 mark %u is too small to give every deterministic subscriber a slice.",
+				mask_domain_get_mark(masks));
+		return -ENOENT;
+	}
+
+	first = subscriber_index(&bib->src6.l3, table->subscriber_plen,
+			table->det_bits) * per_slice;
+	offset = mask_domain_offset(masks);
+
+	for (i = 0; i < per_slice; i++) {
+		if (mask_domain_get(masks, first + (offset + i) % per_slice,
+				&bib->src4))
+			return -ENOENT;
+		if (!in_partition(table, bib->src4.l4))
+			continue;
+		taken = get_taken_ports(&bib->src4.l3, table);
+		if (taken && test_bit(bib->src4.l4, taken))
+			continue;
+		if (!find_bibtree4_slot(table, bib, slot))
+			return 0;
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * Masks @bib with some free port from @block.
+ */
+static int take_block_port(struct bib_table *table, struct port_block *block,
+		struct tabled_bib *bib, struct tree_slot *slot)
+{
+	unsigned int size = table->active_block_size;
+	unsigned int i;
+
+	for (i = find_first_zero_bit(block->ports, size);
+			i < size;
+			i = find_next_zero_bit(block->ports, size, i + 1)) {
+		bib->src4.l3 = block->addr;
+		bib->src4.l4 = block->first + i;
+		/* (Collisions only happen if the port bitmap lacked a few.) */
+		if (!find_bibtree4_slot(table, bib, slot))
+			return 0;
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * Finds a run of @size free ports in @masks, starting at a multiple of @size,
+ * and reserves it as a block for @owner.
+ */
+static struct port_block *reserve_block(struct bib_table *table,
+		struct mask_domain *masks, struct tabled_bib *bib,
+		struct in6_addr *owner, __u8 plen, unsigned int size)
+{
+	struct port_block *block;
+	struct port_bitmap *bitmap;
+	struct ipv4_transport_addr candidate;
+	const unsigned long *taken;
+	unsigned int first;
+	unsigned int port;
+	bool consecutive;
+
+	do {
+		if (mask_domain_next_free(masks, &candidate, &consecutive,
+				get_taken_ports, table))
+			return NULL;
+
+		first = candidate.l4 - candidate.l4 % size;
+		if (first + size - 1 > 65535)
+			continue;
+		if (!in_partition(table, first / size))
+			continue;
+		if (!mask_domain_contains(masks, &candidate.l3, first,
+				first + size - 1))
+			continue;
+		taken = get_taken_ports(&candidate.l3, table);
+		if (!taken)
+			break;
+		if (find_next_bit(taken, first + size, first) >= first + size)
+			break;
+	} while (true);
+
+	block = __wkmalloc("port block", sizeof(struct port_block)
+			+ BITS_TO_LONGS(size) * sizeof(unsigned long),
+			GFP_ATOMIC);
+	if (!block)
+		return NULL;
+	/* Unlike the others, this bitmap is mandatory; it's the reservation. */
+	bitmap = get_port_bitmap(table, &candidate.l3);
+	if (!bitmap) {
+		__wkfree("port block", block);
+		return NULL;
+	}
+
+	for (port = first; port < first + size; port++)
+		if (!__test_and_set_bit(port, bitmap->ports))
+			bitmap->used++;
+
+	block->owner = *owner;
+	block->addr = candidate.l3;
+	block->first = first;
+	block->used = 0;
+	block->proto = bib->proto;
+	bitmap_zero(block->ports, size);
+	hlist_add_head(&block->hook, block_bucket(table, owner));
+
+	if (!table->block_count) {
+		table->active_block_size = size;
+		table->active_block_plen = plen;
+	}
+	table->block_count++;
+
+	log_block(table, block, BIBEV_BLOCK_ADD, "Reserved block");
+	return block;
+}
+
+/**
+ * Port Block Allocation version of find_available_mask(): Masks @bib with a
+ * port from one of its subscriber's blocks, reserving a new block if needed.
+ *
+ * Returns 1 if blocks don't apply (or couldn't be reserved); in that case
+ * @masks is rewound and the caller should fall back to the normal allocation.
+ */
+static int find_block_mask(struct bib_table *table,
+		struct mask_domain *masks,
+		struct tabled_bib *bib,
+		struct tree_slot *slot)
+{
+	struct port_block *block;
+	struct hlist_node *node;
+	struct in6_addr owner;
+	unsigned int size;
+	__u8 plen;
+
+	if (!table->block_size && !table->block_count)
+		return 1;
+	/*
+	 * Blocks would span several shards. Also, dynamic domains are
+	 * volatile (see issue216_needed()), and blocks are meant to last.
+	 */
+	if (table->shard_count > 1 || mask_domain_is_dynamic(masks))
+		return 1;
+
+	plen = table->subscriber_plen ? : 128;
+	if (table->block_count) {
+		size = table->active_block_size;
+		ipv6_addr_prefix(&owner, &bib->src6.l3, table->active_block_plen);
+		hlist_for_each(node, block_bucket(table, &owner)) {
+			block = hlist_entry(node, struct port_block, hook);
+			if (!ipv6_addr_equal(&block->owner, &owner))
+				continue;
+			if (block->used >= size)
+				continue;
+			if (!mask_domain_contains(masks, &block->addr,
+					block->first, block->first + size - 1))
+				continue; /* pool4 or the mark changed. */
+			if (!take_block_port(table, block, bib, slot))
+				return 0;
+		}
+
+		/* Don't mix blocks of different shapes. */
+		if (table->block_size != size
+				|| plen != table->active_block_plen)
+			return 1;
+	} else {
+		size = table->block_size;
+		ipv6_addr_prefix(&owner, &bib->src6.l3, plen);
+	}
+
+	if (!size)
+		return 1;
+
+	block = reserve_block(table, masks, bib, &owner, plen, size);
+	if (!block || take_block_port(table, block, bib, slot)) {
+		mask_domain_rewind(masks);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Returns the Toeplitz hash of @data (@len bytes) under @key, as computed by
+ * RSS hardware. @key has to be @len + 4 bytes long.
+ */
+static u32 toeplitz(const u8 *key, const u8 *data, unsigned int len)
+{
+	u32 window = get_unaligned_be32(key);
+	u32 result = 0;
+	unsigned int i, b;
+
+	for (i = 0; i < len; i++) {
+		for (b = 0; b < 8; b++) {
+			if (data[i] & (0x80 >> b))
+				result ^= window;
+			window = (window << 1) | ((key[i + 4] >> (7 - b)) & 1);
+		}
+	}
+
+	return result;
+}
+
+static bool rss_applies(struct bib_table *table, struct tabled_bib *bib)
+{
+	/* ICMP is normally hashed by address only, so its id is no help. */
+	return table->db->rss_queues
+			&& (bib->proto == L4PROTO_TCP || bib->proto == L4PROTO_UDP);
+}
+
+/**
+ * Returns true if the IPv4 NIC would hand the replies to @bib's mask (sent by
+ * @remote) to the RX queue of the current CPU.
+ *
+ * Assumes the NIC uses the kernel's RSS key and default indirection table
+ * (queue = entry % queues), and that queue N is serviced by CPU N. The 6-to-4
+ * direction is whatever the IPv6 side's RSS decided; this only makes the
+ * 4-to-6 direction agree with it, so the session stays in one CPU's cache.
+ */
+static bool rss_steers(struct bib_table *table, struct tabled_bib *bib,
+		const struct ipv4_transport_addr *remote)
+{
+	unsigned int queues = table->db->rss_queues;
+	u8 data[12];
+	u32 hash;
+
+	/* The reply's 4-tuple, in the order the hardware reads it. */
+	memcpy(&data[0], &remote->l3, 4);
+	memcpy(&data[4], &bib->src4.l3, 4);
+	put_unaligned_be16(remote->l4, &data[8]);
+	put_unaligned_be16(bib->src4.l4, &data[10]);
+
+	hash = toeplitz(table->db->rss_key, data, sizeof(data));
+	return (hash & (RSS_INDIR_SIZE - 1)) % queues
+			== smp_processor_id() % queues;
+}
+
+/**
+ * find_available_mask() for masks that also have to pass a test: land on
+ * @table's shard and this node's pool4 partition and, if RSS steering is
+ * enabled, steer.
+ *
+ * The candidates are no longer consecutive from the point of view of @table's
+ * tree, so full lookups are needed.
+ *
+ * Steering is a preference, not a requirement. After 4 * rss_queues free
+ * masks that don't steer (each one does with probability 1 / rss_queues),
+ * the next free one is taken regardless. If the domain runs out before that,
+ * the first free mask is used.
+ */
+static int find_filtered_mask(struct bib_table *table,
+		struct mask_domain *masks,
+		struct tabled_bib *bib,
+		const struct ipv4_transport_addr *remote,
+		struct tree_slot *slot)
+{
+	struct ipv4_transport_addr fallback;
+	unsigned int misses = 0;
+	unsigned int limit;
+	bool consecutive;
+	int error;
+
+	limit = rss_applies(table, bib) ? (4 * table->db->rss_queues) : 0;
+
+	while (true) {
+		error = mask_domain_next_free(masks, &bib->src4, &consecutive,
+				get_taken_ports, table);
+		if (error)
+			break;
+		/*
+		 * Only masks that hash into @table are candidates, otherwise
+		 * the 4-to-6 lookups would search the wrong shard.
+		 */
+		if (shard4(&bib->src4, table->shard_count) != table->shard)
+			continue;
+		if (!in_partition(table, bib->src4.l4))
+			continue;
+		if (find_bibtree4_slot(table, bib, slot))
+			continue;
+
+		if (misses >= limit || rss_steers(table, bib, remote))
+			return 0;
+		if (!misses)
+			fallback = bib->src4;
+		misses++;
+	}
+
+	if (!misses)
+		return error;
+
+	/* Nobody could have taken it; we hold the lock. */
+	bib->src4 = fallback;
+	find_bibtree4_slot(table, bib, slot);
+	return 0;
+}
+
+/**
+ * This is this function in pseudocode form:
+ *
+ * 	// wraps around until offset - 1
+ * 	foreach (mask in @masks starting from some offset)
+ * 		// (The port bitmaps let us skip most of the taken masks
+ * 		// without looking at the tree.)
+ * 		if (mask is not taken by an existing BIB entry from @table)
+ * 			init the new BIB entry, @bib, using mask
+ * 			init @slot as the tree slot where @bib should be added
+ * 			return success (0)
+ * 	return failure (-ENOENT)
+ *
+ * @remote is the address the session will talk to; it feeds the RSS steering.
+ */
+static int find_available_mask(struct bib_table *table,
+		struct mask_domain *masks,
+		struct tabled_bib *bib,
+		const struct ipv4_transport_addr *remote,
+		struct tree_slot *slot)
+{
+	struct tabled_bib *collision = NULL;
+	bool consecutive;
+	int error;
+
+	error = find_deterministic_mask(table, masks, bib, slot);
+	if (error <= 0)
+		return error;
+	if (table->balance_masks)
+		mask_domain_balance(masks, get_used_ports, table);
+	error = find_block_mask(table, masks, bib, slot);
+	if (error <= 0)
+		return error;
+
+	if (table->shard_count > 1 || rss_applies(table, bib)
+			|| is_partitioned(table))
+		return find_filtered_mask(table, masks, bib, remote, slot);
+
+	/*
+	 * We're going to assume the masks are generally consecutive.
+	 * I think it's a fair assumption until someone requests otherwise as a
+	 * new feature.
+	 * This allows us to find an unoccupied mask with minimal further tree
+	 * traversal.
+	 */
+	do {
+		error = mask_domain_next_free(masks, &bib->src4, &consecutive,
+				get_taken_ports, table);
+		if (error)
+			return error;
+
+		/*
+		 * Just for the sake of clarity:
+		 * @consecutive is never true on the first iteration.
+		 */
+		collision = consecutive
+				? try_next(table, collision, bib, slot)
+				: find_bibtree4_slot(table, bib, slot);
+
+	} while (collision);
+
+	return 0;
+}
+
+static void account_mask_search(struct bib_table *table,
+		struct mask_domain *masks, int error)
+{
+	struct pool4_stats_usr *stats = &table->mask_stats;
+	unsigned int iterations;
+	unsigned int bucket;
+
+	iterations = mask_domain_get_iterations(masks);
+	trace_jool_pool4_alloc(iterations, error);
+	bucket = iterations ? (fls(iterations) - 1) : 0;
+	if (bucket >= POOL4_HISTOGRAM_BUCKETS)
+		bucket = POOL4_HISTOGRAM_BUCKETS - 1;
+
+	if (!error)
+		stats->allocations++;
+	else if (mask_domain_is_limited(masks))
+		stats->limited++;
+	else
+		stats->exhaustions++;
+	stats->iterations += iterations;
+	stats->histogram[bucket]++;
+}
+
+static int upgrade_pktqueue_session(struct bib_table *table,
+		struct mask_domain *masks,
+		struct bib_session_tuple *new,
+		struct bib_session_tuple *old)
+{
+	struct pktqueue_session *sos; /* "simultaneous open" session */
+	struct tabled_bib *bib;
+	struct tabled_bib *collision;
+	struct tabled_session *session;
+	struct tree_slot bib_slot6;
+	struct tree_slot bib_slot4;
+	int error;
+
+	if (new->bib->proto != L4PROTO_TCP)
+		return -ESRCH;
+
+	sos = pktqueue_find(table->pkt_queue, &new->session->dst6, masks);
+	if (!sos)
+		return -ESRCH;
+	table->pkt_count--;
+
+	if (!masks) {
+		/*
+		 * This happens during joold adds. It's a lost cause.
+		 *
+		 * The point of SO is that the v4 node decides session [*, dst6,
+		 * src4, dst4] and the first v6 packet needing a new mask that
+		 * matches that session keeps it.
+		 *
+		 * But we're not synchronizing pktqueue sessions, because we
+		 * want to keep joold as simple as possible (which is not simple
+		 * enough), at least so long as it remains a niche thing.
+		 *
+		 * So if one Jool instance gets the v4 SO packet and some other
+		 * instance gets the v6 SO packet, the latter will choose a
+		 * random src4 and mess up the SO. That situation is this if.
+		 * Our reaction is to go like "whatever" and pretend that we
+		 * never received the v4 packet.
+		 *
+		 * One might argue that we should send the ICMP error when this
+		 * happens. But that doesn't yield satisfactory behavior either;
+		 * The SO failed anyway. To fix this properly we would need to
+		 * sync the pktqueue sessions. Combine that with the fact that
+		 * sending the ICMP error would be a pain in the ass (because we
+		 * want to do it outside of the spinlock, and we don't want to
+		 * send it if the random src4 selected happens to match the
+		 * stored session), and the result is a big fat meh. I really
+		 * don't want to do it.
+		 *
+		 * The admin signed a best-effort contract when s/he enabled
+		 * joold anyway. And this is only a problem in active-active
+		 * scenarios.
+		 */
+		pktqueue_put_node(sos);
+		return -ESRCH;
+	}
+
+	log_debug("Simultaneous Open!");
+	/*
+	 * We're going to pretend that @sos has been a valid V4 INIT session all
+	 * along.
+	 */
+	error = alloc_bib_session(old);
+	if (error) {
+		pktqueue_put_node(sos);
+		return error;
+	}
+
+	bib = old->bib;
+	session = old->session;
+
+	bib->src6 = new->bib->src6;
+	bib->src4 = sos->src4;
+	bib->proto = L4PROTO_TCP;
+	bib->is_static = false;
+	bib->sessions = RB_ROOT;
+
+	session->dst6 = sos->dst6;
+	session->dst4 = sos->dst4;
+	session->state = V4_INIT;
+	session->bib = bib;
+	session->update_time = jiffies;
+	session->stored = NULL;
+
+	/*
+	 * This *has* to work. src6 wasn't in the database because we just
+	 * looked it up and src4 wasn't either because pktqueue had it.
+	 */
+	collision = find_bibtree6_slot(table, bib, &bib_slot6);
+	if (WARN(collision, "BIB entry was and then wasn't in the v6 tree."))
+		goto trainwreck;
+	collision = find_bibtree4_slot(table, bib, &bib_slot4);
+	if (WARN(collision, "BIB entry was and then wasn't in the v4 tree."))
+		goto trainwreck;
+	treeslot_commit_rcu(&bib_slot6);
+	treeslot_commit_rcu(&bib_slot4);
+	table->bib_count++;
+	take_port(table, bib);
+
+	treeslot_init(&bib_slot4, &bib->sessions, &session->tree_hook);
+	treeslot_commit_rcu(&bib_slot4);
+	hash_session(table, session);
+	table->session_count++;
+	account_subscriber(table, &bib->src6.l3, 1, 1);
+	attach_timer(session, &table->syn4_timer);
+
+	pktqueue_put_node(sos);
+
+	log_new_bib(table, bib);
+	log_new_session(table, session);
+	return 0;
+
+trainwreck:
+	pktqueue_put_node(sos);
+	free_bib(bib);
+	free_session(session);
+	return -EINVAL;
+}
+
+static bool issue216_needed(struct mask_domain *masks, struct tabled_bib *bib)
+{
+	if (!masks)
+		return false;
+	return mask_domain_is_dynamic(masks)
+			&& !mask_domain_matches(masks, &bib->src4);
+}
+
+/**
+ * This is a find and an add at the same time, for both @new->bib and
+ * @new->session.
+ *
+ * If @new->bib needs to be added, initializes @slots->bib*.
+ * If @new->session needs to be added, initializes @slots->session.
+ * If @new->bib collides, you will find the collision in @old->bib.
+ * If @new->session collides, you will find the collision in @old->session.
+ *
+ * @masks will be used to init @new->bib.src4 if applies.
+ */
+static int find_bib_session6(struct bib_table *table,
+		struct mask_domain *masks,
+		struct bib_session_tuple *new,
+		struct bib_session_tuple *old,
+		struct slot_group *slots,
+		struct bib_delete_list *rm_list)
+{
+	int error;
+
+	/*
+	 * Please be careful around this function. All it wants to do is
+	 * find/add, but it is constrained by several requirements at the same
+	 * time:
+	 *
+	 * 1. If @new->bib->proto is ICMP (ie. 3-tuple), then
+	 *    @new->session->dst4.l4 is invalid and needs to be patched. Though
+	 *    it cannot be patched until we acquire a valid BIB entry.
+	 *    (dst4.l4 is just fat that should not be used in 3-tuple
+	 *    translation code, but a chunk of Jool assumes that
+	 *    dst4.l4 == dst6.l4 in 5-tuples and dst4.l4 == src4.l4 in
+	 *    3-tuples.)
+	 * 2. @masks can be NULL!
 	 *    If this happens, just assume that @old->bib->src4 and
 	 *    (once acquired) @new->bib->src4 are both valid.
 	 *
-	 * See below for more stuff.
+	 * See below for more stuff.
+	 */
+
+	old->bib = find_bibtree6_slot(table, new->bib, &slots->bib6);
+	if (old->bib) {
+		if (!issue216_needed(masks, old->bib)) {
+			if (new->bib->proto == L4PROTO_ICMP)
+				new->session->dst4.l4 = old->bib->src4.l4;
+
+			old->session = find_session_slot(old->bib, new->session,
+					NULL, &slots->session);
+			return 0; /* Typical happy path for existing sessions */
+		}
+
+		/*
+		 * Issue #216:
+		 * If pool4 was empty (when @masks was generated) and the BIB
+		 * entry's IPv4 address is no longer a mask candidate, drop the
+		 * BIB entry and recompute it from scratch.
+		 * https://github.com/NICMx/Jool/issues/216
+		 */
+		log_debug("Issue #216.");
+		detach_bib(table, old->bib);
+		add_to_delete_list(rm_list, &old->bib->hook4);
+
+		/*
+		 * The detaching above might have involved a rebalance.
+		 * I believe that completely invalidates the bib6 slot.
+		 * Tough luck; we'll need another lookup.
+		 * At least this only happens on empty pool4s. (Low traffic.)
+		 */
+		old->bib = find_bibtree6_slot(table, new->bib, &slots->bib6);
+		if (WARN(old->bib, "Found a BIB entry I just removed!"))
+			return -EINVAL;
+
+	} else {
+		/*
+		 * No BIB nor session in the main database? Try the SO
+		 * sub-database.
+		 */
+		error = upgrade_pktqueue_session(table, masks, new, old);
+		if (!error)
+			return 0; /* Unusual happy path for existing sessions */
+	}
+
+	/*
+	 * In case you're tweaking this function: By this point, old->bib has to
+	 * be NULL and slots->bib6 has to be a valid potential tree slot. We're
+	 * now in create-new-BIB-and-session mode.
+	 * Time to worry about slots->bib4.
+	 *
+	 * (BTW: If old->bib is NULL, then old->session is also supposed to be
+	 * NULL.)
+	 */
+	if (masks) {
+		error = find_available_mask(table, masks, new->bib,
+				&new->session->dst4, &slots->bib4);
+		account_mask_search(table, masks, error);
+		if (error) {
+			if (WARN(error != -ENOENT, "Unknown error: %d", error))
+				return error;
+			/*
+			 * TODO the rate limit might be a bit of a problem.
+			 * If both mark 0 and mark 1 are running out of
+			 * addresses, only one of them will be logged.
+			 * The problem is that remembering which marks have been
+			 * logged might get pretty ridiculous.
+			 * I don't think it's too bad because there will still
+			 * be at least one message every minute.
+			 * Also, it's better than what we had before. (Not
+			 * logging the offending mark.)
+			 * Might not be worth fixing since #175 is in the radar.
+			 */
+			log_warn_once("I'm running out of pool4 addresses for mark %u.",
+					mask_domain_get_mark(masks));
+			return error;
+		}
+
+		if (new->bib->proto == L4PROTO_ICMP)
+			new->session->dst4.l4 = new->bib->src4.l4;
+
+	} else {
+		/*
+		 * TODO (issue113) perhaps the sender's session shold be trusted
+		 * more.
+		 */
+		if (find_bibtree4_slot(table, new->bib, &slots->bib4))
+			return -EEXIST;
+	}
+
+	/* Ok, time to worry about slots->session now. */
+
+	treeslot_init(&slots->session, &new->bib->sessions,
+			&new->session->tree_hook);
+	old->session = NULL;
+
+	return 0; /* Happy path for new sessions */
+}
+
+static struct tabled_session *find_session(struct tabled_bib *bib,
+		struct ipv4_transport_addr *dst4)
+{
+	struct tabled_session key;
+	key.dst4 = *dst4;
+	return rbtree_find(&key, &bib->sessions, compare_dst4,
+			struct tabled_session, tree_hook);
+}
+
+/**
+ * Lockless lookup of the session described by 6-to-4 packet @tuple6.
+ * Only meant for the fast path; see refresh_rcu().
+ */
+static struct tabled_session *find_session6_rcu(struct bib_table *table,
+		struct mask_domain *masks,
+		struct tuple *tuple6,
+		struct ipv4_transport_addr *dst4)
+{
+	struct tabled_session *session;
+	struct tabled_bib *bib;
+	struct ipv4_transport_addr key;
+
+	if (table->hash6) {
+		session = hash_find6(table, &tuple6->src.addr6,
+				&tuple6->dst.addr6);
+		if (!session || issue216_needed(masks, session->bib))
+			return NULL;
+		return session;
+	}
+
+	bib = find_bib6(table, &tuple6->src.addr6);
+	if (!bib || issue216_needed(masks, bib))
+		return NULL;
+
+	key = *dst4;
+	if (tuple6->l4_proto == L4PROTO_ICMP)
+		key.l4 = bib->src4.l4;
+	return find_session(bib, &key);
+}
+
+/**
+ * Lockless lookup of the session described by 4-to-6 packet @tuple4.
+ * Only meant for the fast path; see refresh_rcu().
+ */
+static struct tabled_session *find_session4_rcu(struct bib_table *table,
+		struct tuple *tuple4)
+{
+	struct tabled_bib *bib;
+
+	if (table->hash4)
+		return hash_find4(table, &tuple4->dst.addr4, &tuple4->src.addr4);
+
+	bib = find_bib4_pkt(table, &tuple4->dst.addr4);
+	return bib ? find_session(bib, &tuple4->src.addr4) : NULL;
+}
+
+/**
+ * The lockless "session already exists" fast path.
+ *
+ * Most packets belong to established sessions, and all they need to do is
+ * bump the session's lifetime. This does exactly that, except it does not move
+ * the session to its new wheel slot (because that needs the spinlock); the
+ * cleaner will notice the session is still alive and rehash it when it visits
+ * the old slot.
+ *
+ * @session is the result of a lockless lookup that started when @table->seq
+ * was @seq. If the tables changed since, the lookup might have been bogus, so
+ * this gives up.
+ *
+ * If @cb is not NULL, the session is TCP, and @cb is its state machine. Only
+ * established sessions that stay established are handled here.
+ *
+ * Returns true if the packet was handled. Returns false if the caller needs to
+ * fall back to the locked path.
+ *
+ * Must be called inside an RCU read-side critical section.
+ */
+static bool refresh_rcu(struct bib_table *table,
+		struct tabled_session *session,
+		unsigned int seq,
+		struct collision_cb *cb,
+		struct bib_session *result)
+{
+	struct session_entry tmp;
+	struct expire_timer *expirer;
+	unsigned long prev_update;
+
+	if (!session || session->stored)
+		return false;
+	/* Real transitions need the lock; don't bother copying the session. */
+	if (cb && READ_ONCE(session->state) != ESTABLISHED)
+		return false;
+	/*
+	 * This can race with bib_config_set()'s update of the short ports;
+	 * the worst that can happen is an unnecessary trip to the locked path.
+	 */
+	expirer = get_est_expirer(table, session);
+	if (session->timer != expirer->type)
+		return false;
+
+	tstose(table, session, &tmp);
+	prev_update = tmp.update_time;
+	if (cb) {
+		if (tmp.state != ESTABLISHED)
+			return false;
+		if (cb->cb(&tmp, cb->arg) != FATE_TIMER_EST)
+			return false;
+		if (tmp.state != ESTABLISHED)
+			return false;
+	}
+
+	if (read_seqcount_retry(&table->seq, seq))
+		return false;
+
+	tmp.update_time = jiffies;
+	sample_idle(table, session, prev_update);
+	/*
+	 * A single word store, so it cannot tear. If another CPU refreshes the
+	 * session at the same time, either stamp is fine.
+	 */
+	if (refresh_due(expirer, session, tmp.update_time))
+		WRITE_ONCE(session->update_time, tmp.update_time);
+	/*
+	 * This only writes the stamp once per interval. If several CPUs race
+	 * here, the session is merely synchronized more than once.
+	 */
+	tmp.sync_due = sync_due(table, session, prev_update, tmp.timeout);
+
+	if (result) {
+		result->bib_set = true;
+		result->session_set = true;
+		result->session = tmp;
+	}
+	return true;
+}
+
+static bool add6_rcu(struct bib_table *table,
+		struct mask_domain *masks,
+		struct tuple *tuple6,
+		struct ipv4_transport_addr *dst4,
+		struct collision_cb *cb,
+		unsigned int len,
+		struct bib_session *result)
+{
+	struct tabled_session *session;
+	unsigned int seq;
+	bool success;
+
+	rcu_read_lock();
+	seq = raw_seqcount_begin(&table->seq);
+	session = find_session6_rcu(table, masks, tuple6, dst4);
+	success = refresh_rcu(table, session, seq, cb, result);
+	if (success)
+		count_packet(session, L3PROTO_IPV6, len);
+	rcu_read_unlock();
+
+	return success;
+}
+
+static bool add4_rcu(struct bib_table *table,
+		struct tuple *tuple4,
+		struct collision_cb *cb,
+		unsigned int len,
+		struct bib_session *result)
+{
+	struct tabled_session *session;
+	unsigned int seq;
+	bool success;
+
+	rcu_read_lock();
+	seq = raw_seqcount_begin(&table->seq);
+	session = find_session4_rcu(table, tuple4);
+	success = refresh_rcu(table, session, seq, cb, result);
+	if (success)
+		count_packet(session, L3PROTO_IPV4, len);
+	rcu_read_unlock();
+
+	return success;
+}
+
+/**
+ * The lockless "Address-Dependent Filtering says no" fast path.
+ *
+ * Servers behind the NAT64 can pile up thousands of sessions in one BIB entry,
+ * and unsolicited IPv4 traffic towards them would otherwise have to allocate a
+ * session, lock the table and walk the entry's session tree just to be told
+ * off. The prefilter answers most of those without any of that.
+ *
+ * Returns true if @tuple4's packet is certainly blocked by ADF. (It has a BIB
+ * entry, but no session towards its source address.)
+ */
+static bool adf_rejects_rcu(struct bib_table *table, struct tuple *tuple4)
+{
+	unsigned int seq;
+	bool rejects;
+
+	if (!table->adf_counters || !READ_ONCE(table->drop_by_addr))
+		return false;
+	if (!adf_excludes(table, &tuple4->dst.addr4, tuple4->src.addr4.l3.s_addr))
+		return false;
+
+	/* -EPERM and -ESRCH are handled differently, so make sure. */
+	rcu_read_lock();
+	seq = raw_seqcount_begin(&table->seq);
+	rejects = !!find_bib4_pkt(table, &tuple4->dst.addr4);
+	if (read_seqcount_retry(&table->seq, seq))
+		rejects = false;
+	rcu_read_unlock();
+
+	return rejects;
+}
+
+/**
+ * @db current BIB & session database.
+ * @masks Should a BIB entry be created, its IPv4 address mask will be allocated
+ *     from one of these candidates.
+ * @tuple6 The connection that you want to mask.
+ * @dst4 translated version of @tuple.dst.addr6.
+ * @len length of @tuple6's packet, for the session's counters.
+ * @result A copy of the resulting BIB entry and session from the database will
+ *     be placed here. (if not NULL)
+ */
+int bib_add6(struct bib *db,
+		struct mask_domain *masks,
+		struct tuple *tuple6,
+		struct ipv4_transport_addr *dst4,
+		unsigned int len,
+		struct bib_session *result)
+{
+	struct bib_table *table;
+	struct bib_session_tuple new;
+	struct bib_session_tuple old;
+	struct slot_group slots;
+	struct bib_delete_list rm_list = { NULL };
+	int error;
+
+	table = get_table6(db, tuple6->l4_proto, &tuple6->src.addr6);
+	if (!table)
+		return -EINVAL;
+
+	if (add6_rcu(table, masks, tuple6, dst4, NULL, len, result))
+		return 0;
+
+	/*
+	 * We might have a lot to do. This function may index three RB-trees
+	 * so spinlock time is tight.
+	 *
+	 * (That's 3 potential lookups (2 guaranteed) and 3 potential
+	 * rebalances, though at least one of the trees is usually minuscule.)
+	 *
+	 * There's also the optional port allocation thing, which in the worst
+	 * case is an unfortunate full traversal of @masks.
+	 *
+	 * Let's start by allocating and initializing the objects as much as we
+	 * can, even if we end up not needing them.
+	 */
+	error = create_bib_session6(&new, tuple6, dst4, ESTABLISHED);
+	if (error)
+		return error;
+
+	lock_table(table); /* Here goes... */
+
+	error = find_bib_session6(table, masks, &new, &old, &slots, &rm_list);
+	if (error)
+		goto end;
+
+	if (old.session) { /* Session already exists. */
+		sample_idle(table, old.session, old.session->update_time);
+		handle_fate_timer(table, old.session,
+				get_est_expirer(table, old.session));
+		count_packet(old.session, L3PROTO_IPV6, len);
+		tstobs(table, old.session, result);
+		goto end;
+	}
+
+	if (!subscriber_allows(table, &tuple6->src.addr6, &old)
+			|| !cps_allows(table)) {
+		error = -ENOSPC;
+		goto end;
+	}
+
+	/* New connection; add the session. (And maybe the BIB entry as well) */
+	count_packet(new.session, L3PROTO_IPV6, len);
+	commit_add6(table, &old, &new, &slots,
+			get_est_expirer(table, new.session), result);
+	/* Fall through */
+
+end:
+	unlock_table(table);
+
+	if (new.bib)
+		free_bib(new.bib);
+	if (new.session)
+		free_session(new.session);
+	commit_delete_list(db, &rm_list);
+
+	return error;
+}
+
+static void find_bib_session4(struct bib_table *table,
+		struct tuple *tuple4,
+		struct tabled_session *new,
+		struct bib_session_tuple *old,
+		bool *allow,
+		struct tree_slot *slot)
+{
+	old->bib = find_bib4_pkt(table, &tuple4->dst.addr4);
+	old->session = old->bib
+			? find_session_slot(old->bib, new, allow, slot)
+			: NULL;
+}
+
+/**
+ * See @bib_add6.
+ */
+int bib_add4(struct bib *db,
+		struct ipv6_transport_addr *dst6,
+		struct tuple *tuple4,
+		unsigned int len,
+		struct bib_session *result)
+{
+	struct bib_table *table;
+	struct bib_session_tuple old;
+	struct tabled_session *new;
+	struct tree_slot session_slot;
+	bool allow;
+	int error = 0;
+
+	table = get_table4(db, tuple4->l4_proto, &tuple4->dst.addr4);
+	if (!table)
+		return -EINVAL;
+
+	if (add4_rcu(table, tuple4, NULL, len, result))
+		return 0;
+	if (adf_rejects_rcu(table, tuple4))
+		return -EPERM;
+
+	new = create_session4(tuple4, dst6, ESTABLISHED);
+	if (!new)
+		return -ENOMEM;
+
+	lock_table(table);
+
+	find_bib_session4(table, tuple4, new, &old, &allow, &session_slot);
+
+	if (old.session) {
+		sample_idle(table, old.session, old.session->update_time);
+		handle_fate_timer(table, old.session,
+				get_est_expirer(table, old.session));
+		count_packet(old.session, L3PROTO_IPV4, len);
+		tstobs(table, old.session, result);
+		goto end;
+	}
+
+	if (!old.bib) {
+		error = -ESRCH;
+		goto end;
+	}
+
+	/* Address-Dependent Filtering. */
+	if (table->drop_by_addr && !allow) {
+		error = -EPERM;
+		goto end;
+	}
+
+	/* Ok, no issues; add the session. */
+	count_packet(new, L3PROTO_IPV4, len);
+	commit_add4(table, &old, &new, &session_slot,
+			get_est_expirer(table, new), result);
+	/* Fall through */
+
+end:
+	unlock_table(table);
+	if (new)
+		free_session(new);
+	return error;
+}
+
+/**
+ * Can @pkt possibly leave its session where it is? SYN, FIN and RST are the
+ * only flags the state machine cares about, so established sessions only ever
+ * transition (or get created) because of them. The others can skip straight to
+ * the lockless refresh.
+ */
+static bool tcp_is_refresh(struct packet *pkt)
+{
+	struct tcphdr *hdr = pkt_tcp_hdr(pkt);
+	return !hdr->syn && !hdr->fin && !hdr->rst;
+}
+
+/**
+ * Note: This particular incarnation of fate_cb is not prepared to return
+ * FATE_PROBE.
+ */
+verdict bib_add_tcp6(struct bib *db,
+		struct mask_domain *masks,
+		struct ipv4_transport_addr *dst4,
+		struct packet *pkt,
+		struct collision_cb *cb,
+		struct bib_session *result)
+{
+	struct bib_table *table;
+	struct bib_session_tuple new;
+	struct bib_session_tuple old;
+	struct slot_group slots;
+	struct bib_delete_list rm_list = { NULL };
+	verdict verdict;
+
+	if (WARN(pkt->tuple.l4_proto != L4PROTO_TCP, "Incorrect l4 proto in TCP handler."))
+		return VERDICT_DROP;
+
+	table = &db->tcp[shard6(&pkt->tuple.src.addr6, db->shard_count)];
+	if (tcp_is_refresh(pkt) && add6_rcu(table, masks, &pkt->tuple, dst4,
+			cb, pkt_len(pkt), result))
+		return VERDICT_CONTINUE;
+
+	if (create_bib_session6(&new, &pkt->tuple, dst4, V6_INIT))
+		return VERDICT_DROP;
+
+	lock_table(table);
+
+	if (find_bib_session6(table, masks, &new, &old, &slots, &rm_list)) {
+		verdict = VERDICT_DROP;
+		goto end;
+	}
+
+	if (old.session) {
+		/* All states except CLOSED. */
+		sample_idle(table, old.session, old.session->update_time);
+		verdict = decide_fate(cb, table, old.session, NULL);
+		if (verdict == VERDICT_CONTINUE) {
+			count_packet(old.session, L3PROTO_IPV6, pkt_len(pkt));
+			tstobs(table, old.session, result);
+		}
+		goto end;
+	}
+
+	/* CLOSED state beginning now. */
+
+	if (!pkt_tcp_hdr(pkt)->syn) {
+		if (old.bib) {
+			tbtobs(old.bib, result);
+			verdict = VERDICT_CONTINUE;
+		} else {
+			log_debug("Packet is not SYN and lacks state.");
+			verdict = VERDICT_DROP;
+		}
+		goto end;
+	}
+
+	if (!subscriber_allows(table, &pkt->tuple.src.addr6, &old)
+			|| !cps_allows(table)) {
+		verdict = VERDICT_DROP;
+		goto end;
+	}
+
+	/* All exits up till now require @new.* to be deleted. */
+
+	count_packet(new.session, L3PROTO_IPV6, pkt_len(pkt));
+	commit_add6(table, &old, &new, &slots, &table->trans_timer, result);
+	verdict = VERDICT_CONTINUE;
+	/* Fall through */
+
+end:
+	unlock_table(table);
+
+	if (new.bib)
+		free_bib(new.bib);
+	if (new.session)
+		free_session(new.session);
+	commit_delete_list(db, &rm_list);
+
+	return verdict;
+}
+
+/**
+ * Note: This particular incarnation of fate_cb is not prepared to return
+ * FATE_PROBE.
+ */
+verdict bib_add_tcp4(struct bib *db,
+		struct ipv6_transport_addr *dst6,
+		struct packet *pkt,
+		struct collision_cb *cb,
+		struct bib_session *result)
+{
+	struct bib_table *table;
+	struct tabled_session *new;
+	struct bib_session_tuple old;
+	struct tree_slot session_slot;
+	verdict verdict;
+	int error;
+
+	if (WARN(pkt->tuple.l4_proto != L4PROTO_TCP, "Incorrect l4 proto in TCP handler."))
+		return VERDICT_DROP;
+
+	table = &db->tcp[shard4(&pkt->tuple.dst.addr4, db->shard_count)];
+	if (tcp_is_refresh(pkt)
+			&& add4_rcu(table, &pkt->tuple, cb, pkt_len(pkt), result))
+		return VERDICT_CONTINUE;
+
+	new = create_session4(&pkt->tuple, dst6, V4_INIT);
+	if (!new)
+		return VERDICT_DROP;
+
+	lock_table(table);
+
+	find_bib_session4(table, &pkt->tuple, new, &old, NULL, &session_slot);
+
+	if (old.session) {
+		/* All states except CLOSED. */
+		sample_idle(table, old.session, old.session->update_time);
+		verdict = decide_fate(cb, table, old.session, NULL);
+		if (verdict == VERDICT_CONTINUE) {
+			count_packet(old.session, L3PROTO_IPV4, pkt_len(pkt));
+			tstobs(table, old.session, result);
+		}
+		goto end;
+	}
+
+	/* CLOSED state beginning now. */
+
+	if (!pkt_tcp_hdr(pkt)->syn) {
+		if (old.bib) {
+			tbtobs(old.bib, result);
+			verdict = VERDICT_CONTINUE;
+		} else {
+			log_debug("Packet is not SYN and lacks state.");
+			verdict = VERDICT_DROP;
+		}
+		goto end;
+	}
+
+	if (table->drop_v4_syn) {
+		log_debug("Externally initiated TCP connections are prohibited.");
+		verdict = VERDICT_DROP;
+		goto end;
+	}
+
+	if (!old.bib) {
+		bool too_many;
+
+		log_debug("Potential Simultaneous Open; storing type 1 packet.");
+		too_many = pkt_limit_reached(table);
+		error = pktqueue_add(table->pkt_queue, pkt, dst6, too_many,
+				pkt_byte_limit(table), table->stateless_so);
+		switch (error) {
+		case 0:
+			verdict = VERDICT_STOLEN;
+			table->pkt_count++;
+			goto end;
+		case -EEXIST:
+			log_debug("Simultaneous Open already exists.");
+			break;
+		case -ENOSPC:
+			goto too_many_pkts;
+		case -ENOMEM:
+		case -EINVAL:
+			break;
+		default:
+			WARN(1, "pktqueue_add() threw unknown error %d", error);
+			break;
+		}
+
+		verdict = VERDICT_DROP;
+		goto end;
+	}
+
+	verdict = VERDICT_CONTINUE;
+
+	if (table->drop_by_addr) {
+		if (pkt_limit_reached(table))
+			goto too_many_pkts;
+
+		log_debug("Potential Simultaneous Open; storing type 2 packet.");
+		new->stored = pkt_original_pkt(pkt)->skb;
+		verdict = VERDICT_STOLEN;
+		table->pkt_count++;
+		/*
+		 * Yes, fall through. No goto; we need to add this session.
+		 * Notice that if you need to cancel before the spin unlock then
+		 * you need to revert the packet storing above.
+		 */
+	}
+
+	/* Stored packets are not being translated yet, so they don't count. */
+	if (verdict == VERDICT_CONTINUE)
+		count_packet(new, L3PROTO_IPV4, pkt_len(pkt));
+	commit_add4(table, &old, &new, &session_slot,
+			new->stored ? &table->syn4_timer : &table->trans_timer,
+			result);
+	/* Fall through */
+
+end:
+	unlock_table(table);
+
+	if (new)
+		free_session(new);
+
+	return verdict;
+
+too_many_pkts:
+	unlock_table(table);
+	free_session(new);
+	log_debug("Too many Simultaneous Opens.");
+	/* Fall back to assume there's no SO. */
+	icmp64_send(db->stats, pkt, ICMPERR_PORT_UNREACHABLE, 0);
+	return VERDICT_DROP;
+}
+
+/**
+ * Copies the BIB entry @tuple's packet belongs to into @result.
+ * Returns -ESRCH if there is no such entry.
+ */
+static int find_bib_pkt(struct bib_table *table, struct tuple *tuple,
+		struct bib_entry *result)
+{
+	struct tabled_bib *bib;
+
+	bib = (tuple->l3_proto == L3PROTO_IPV6)
+			? find_bib6(table, &tuple->src.addr6)
+			: find_bib4_pkt(table, &tuple->dst.addr4);
+	if (!bib)
+		return -ESRCH;
+
+	tbtobe(bib, result);
+	return 0;
+}
+
+/**
+ * The lockless BIB entry lookup of the packets Filtering doesn't handle.
+ *
+ * These are mostly ICMP errors, and they tend to arrive in storms (PMTUD,
+ * unreachable destinations), all of them towards a handful of BIB entries.
+ * They don't touch the sessions, so they don't need the lock unless a writer
+ * gets in the way.
+ *
+ * Returns 0 if @tuple's BIB entry was found, -ESRCH if it certainly doesn't
+ * exist, and -EAGAIN if the caller needs to fall back to the locked path.
+ */
+static int find_bib_rcu(struct bib_table *table, struct tuple *tuple,
+		struct bib_entry *result)
+{
+	unsigned int seq;
+	int error;
+
+	rcu_read_lock();
+	seq = raw_seqcount_begin(&table->seq);
+	error = find_bib_pkt(table, tuple, result);
+	if (read_seqcount_retry(&table->seq, seq))
+		error = -EAGAIN;
+	rcu_read_unlock();
+
+	return error;
+}
+
+int bib_find(struct bib *db, struct tuple *tuple, struct bib_session *result)
+{
+	struct bib_table *table;
+	struct bib_entry tmp;
+	int error;
+
+	switch (tuple->l3_proto) {
+	case L3PROTO_IPV6:
+		table = get_table6(db, tuple->l4_proto, &tuple->src.addr6);
+		break;
+	case L3PROTO_IPV4:
+		table = get_table4(db, tuple->l4_proto, &tuple->dst.addr4);
+		break;
+	default:
+		WARN(true, "Unknown layer 3 protocol: %u", tuple->l3_proto);
+		return -EINVAL;
+	}
+
+	if (!table)
+		return -EINVAL;
+
+	error = find_bib_rcu(table, tuple, &tmp);
+	if (error == -EAGAIN) {
+		table_lock(table);
+		error = find_bib_pkt(table, tuple, &tmp);
+		table_unlock(table);
+	}
+	if (error)
+		return error;
+
+	result->bib_set = true;
+	result->session.src6 = tmp.ipv6;
+	result->session.src4 = tmp.ipv4;
+	result->session.proto = tmp.l4_proto;
+	return 0;
+}
+
+/**
+ * Returns the table @session belongs to. (Or NULL, if it doesn't fit in any.)
+ */
+static struct bib_table *get_session_table(struct bib *db,
+		struct session_entry *session)
+{
+	struct bib_table *table;
+
+	table = get_table6(db, session->proto, &session->src6);
+	if (!table)
+		return NULL;
+
+	if (!shards_match(db, &session->src6, &session->src4)) {
+		/* The peer is probably configured with a different bib_shards. */
+		log_warn_once("Incoming joold session's BIB entry does not belong to a single BIB shard.");
+		return NULL;
+	}
+
+	return table;
+}
+
+/**
+ * bib_add_session()'s locked half. Whatever is left in @new afterwards has to
+ * be freed.
+ */
+static int add_session_locked(struct bib_table *table,
+		struct bib_session_tuple *new,
+		session_timer_type timer_type,
+		struct collision_cb *cb,
+		struct bib_delete_list *rm_list)
+{
+	struct bib_session_tuple old;
+	struct slot_group slots;
+	int error;
+
+	error = find_bib_session6(table, NULL, new, &old, &slots, rm_list);
+	if (error)
+		return error;
+
+	if (old.session) {
+		/* There's no packet; ignore the verdict. */
+		decide_fate(cb, table, old.session, NULL);
+		return 0;
+	}
+
+	return commit_add(table, &old, new, &slots, timer_type);
+}
+
+static void free_bib_session(struct bib_session_tuple *tuple)
+{
+	if (tuple->bib)
+		free_bib(tuple->bib);
+	if (tuple->session)
+		free_session(tuple->session);
+}
+
+int bib_add_session(struct bib *db,
+		struct session_entry *session,
+		struct collision_cb *cb)
+{
+	struct bib_table *table;
+	struct bib_session_tuple new;
+	struct bib_delete_list rm_list = { NULL };
+	int error;
+
+	table = get_session_table(db, session);
+	if (!table)
+		return -EINVAL;
+
+	error = create_bib_session(session, &new);
+	if (error)
+		return error;
+
+	lock_table(table);
+	error = add_session_locked(table, &new, session->timer_type, cb,
+			&rm_list);
+	unlock_table(table);
+
+	free_bib_session(&new);
+	commit_delete_list(db, &rm_list);
+
+	return error;
+}
+
+/* Groups the sessions by table, but otherwise keeps them in order. */
+static int batch_cmp(const void *a, const void *b)
+{
+	const struct bib_batch_session *s1 = a;
+	const struct bib_batch_session *s2 = b;
+
+	if (s1->table != s2->table)
+		return (s1->table < s2->table) ? -1 : 1;
+	return (s1->index < s2->index) ? -1 : (s1->index > s2->index);
+}
+
+/**
+ * bib_add_session(), for several sessions at once.
+ *
+ * All the allocations happen before any table is locked, and each table is
+ * locked only once, no matter how many of the sessions belong to it.
+ * Sessions are added in order, unless they belong to different tables.
+ *
+ * Each @batch entry's result is left in its @error field. Note that @batch is
+ * reordered in the process.
+ */
+void bib_add_sessions(struct bib *db, struct bib_batch_session *batch,
+		unsigned int count)
+{
+	struct bib_batch_session *entry;
+	struct bib_table *table;
+	struct bib_session_tuple new;
+	struct bib_delete_list rm_list = { NULL };
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		entry = &batch[i];
+		entry->index = i;
+		entry->table = get_session_table(db, entry->session);
+		if (!entry->table) {
+			entry->error = -EINVAL;
+			continue;
+		}
+
+		entry->error = create_bib_session(entry->session, &new);
+		if (entry->error) {
+			entry->table = NULL;
+			continue;
+		}
+		entry->bib = new.bib;
+		entry->tsession = new.session;
+	}
+
+	sort(batch, count, sizeof(*batch), batch_cmp, NULL);
+
+	table = NULL;
+	for (i = 0; i < count; i++) {
+		entry = &batch[i];
+		if (!entry->table)
+			continue;
+
+		if (entry->table != table) {
+			if (table)
+				unlock_table(table);
+			table = entry->table;
+			lock_table(table);
+		}
+
+		new.bib = entry->bib;
+		new.session = entry->tsession;
+		entry->error = add_session_locked(table, &new,
+				entry->session->timer_type,
+				entry->cb.cb ? &entry->cb : NULL, &rm_list);
+		entry->bib = new.bib;
+		entry->tsession = new.session;
+	}
+	if (table)
+		unlock_table(table);
+
+	for (i = 0; i < count; i++) {
+		entry = &batch[i];
+		if (!entry->table)
+			continue;
+		new.bib = entry->bib;
+		new.session = entry->tsession;
+		free_bib_session(&new);
+	}
+	commit_delete_list(db, &rm_list);
+}
+
+/**
+ * Hands the session whose IPv4 transport addresses are @src4 (ours) and @dst4
+ * (the remote node's) over to @cb, so it can be updated.
+ *
+ * Returns -ESRCH if there is no such session.
+ */
+int bib_update_session4(struct bib *db, l4_protocol proto,
+		struct ipv4_transport_addr *src4,
+		struct ipv4_transport_addr *dst4,
+		struct collision_cb *cb)
+{
+	struct bib_table *table;
+	struct tabled_bib *bib;
+	struct tabled_session *session;
+	int error = -ESRCH;
+
+	table = get_table4(db, proto, src4);
+	if (!table)
+		return -EINVAL;
+
+	lock_table(table);
+
+	bib = find_bib4(table, src4);
+	session = bib ? find_session(bib, dst4) : NULL;
+	if (session) {
+		/* There's no packet; ignore the verdict. */
+		decide_fate(cb, table, session, NULL);
+		error = 0;
+	}
+
+	unlock_table(table);
+	return error;
+}
+
+/**
+ * Visits the sessions of @expirer's due slots, spending one unit of @budget
+ * per session. If the budget runs out, the rest stay where they are, and the
+ * next run resumes from them.
+ */
+static void __clean(struct expire_timer *expirer,
+		struct bib_table *table,
+		struct list_head *probes,
+		unsigned int *budget)
+{
+	struct tabled_session *session;
+	struct tabled_session *tmp;
+	struct collision_cb cb;
+	unsigned int visited = 0;
+	LIST_HEAD(due);
+	LIST_HEAD(preserved);
+
+	cb.cb = expirer->decide_fate_cb;
+	cb.arg = NULL;
+
+	/* Visit the slots whose windows have already ended. */
+	while (!time_before(jiffies, expirer->next_slot + WHEEL_GRANULARITY)) {
+		list_splice_init(wheel_slot(expirer, expirer->next_slot), &due);
+
+		list_for_each_entry_safe(session, tmp, &due, list_hook) {
+			if (*budget == 0) {
+				list_splice(&due, wheel_slot(expirer,
+						expirer->next_slot));
+				goto end;
+			}
+			(*budget)--;
+
+			if (time_before(jiffies, session->update_time
+					+ expirer->timeout)) {
+				/* Refreshed, or expires in a later revolution. */
+				wheel_del(table, session);
+				wheel_add(expirer, session);
+				continue;
+			}
+
+			/*
+			 * decide_fate() moves the session elsewhere, unless it
+			 * is preserved.
+			 */
+			list_move_tail(&session->list_hook, &preserved);
+			decide_fate(&cb, table, session, probes);
+		}
+
+		expirer->next_slot += WHEEL_GRANULARITY;
+
+		visited++;
+		if (visited >= WHEEL_SLOTS) {
+			/* We fell more than a revolution behind; catch up. */
+			expirer->next_slot = wheel_align(jiffies);
+			break;
+		}
+	}
+
+end:
+	/*
+	 * FATE_PRESERVE leaves expired sessions where they are.
+	 * Have them reconsidered during the next run.
+	 */
+	list_splice_tail(&preserved, wheel_slot(expirer, expirer->next_slot));
+}
+
+static void clean_table(struct bib_table *table, unsigned int budget)
+{
+	LIST_HEAD(probes);
+	LIST_HEAD(icmps);
+
+	lock_table(table);
+	apply_pressure(table);
+	/*
+	 * The SYN4, CLOSED and TRANS timers go first because they are usually
+	 * small, and their sessions are the ones that hold resources (stored
+	 * packets, pool4 ports of dead connections) hostage.
+	 */
+	__clean(&table->syn4_timer, table, &probes, &budget);
+	__clean(&table->closed_timer, table, &probes, &budget);
+	__clean(&table->trans_timer, table, &probes, &budget);
+	__clean(&table->est_timer, table, &probes, &budget);
+	if (table->pkt_queue) {
+		table->pkt_count -= pktqueue_prepare_clean(table->pkt_queue,
+				&icmps);
+	}
+	unlock_table(table);
+
+	post_fate(table->db, &probes);
+	pktqueue_clean(table->pkt_queue, &icmps);
+}
+
+static void clean_work_fn(struct work_struct *work)
+{
+	struct bib_table *table;
+	struct bib *db;
+	unsigned int budget;
+
+	table = container_of(work, struct bib_table, clean_work);
+	db = table->db;
+
+	budget = clean_budget;
+	if (budget == 0)
+		budget = UINT_MAX;
+
+	clean_table(table, budget);
+	bib_put(db);
+}
+
+static void queue_clean(struct bib_table *table)
+{
+	bib_get(table->db);
+	/* If it's already pending, that run will do. */
+	if (!queue_work(clean_wq, &table->clean_work))
+		bib_put(table->db);
+}
+
+/**
+ * Forgets or downgrades (from EST to TRANS) old sessions.
+ *
+ * This only schedules the work; every table is cleaned by its own work item in
+ * clean_wq, in process context. At most clean_budget sessions per table are
+ * visited. Whatever is left is picked up by the next call.
+ */
+void bib_clean(struct bib *db)
+{
+	unsigned int i;
+
+	for (i = 0; i < db->shard_count; i++) {
+		queue_clean(&db->udp[i]);
+		queue_clean(&db->tcp[i]);
+		queue_clean(&db->icmp[i]);
+	}
+
+	bibev_flush(&db->events);
+}
+
+/**
+ * Returns the earliest of @next and the jiffy at which cleaning @expirer might
+ * have something to do.
+ *
+ * The first slot that holds anything is the answer, even though its sessions
+ * might have been refreshed since; waking up a little early is harmless.
+ * If @new_sessions, the sessions that have yet to be queued into @expirer are
+ * also considered. (None of them can expire before @expirer's timeout.)
+ */
+static unsigned long expirer_next_clean(struct expire_timer *expirer,
+		unsigned long next, bool new_sessions)
+{
+	unsigned long slot;
+	unsigned int i;
+
+	if (new_sessions && time_before(jiffies + expirer->timeout, next))
+		next = jiffies + expirer->timeout;
+	if (!expirer->count)
+		return next;
+
+	slot = expirer->next_slot;
+	for (i = 0; i < WHEEL_SLOTS; i++, slot += WHEEL_GRANULARITY) {
+		if (!time_before(slot + WHEEL_GRANULARITY, next))
+			break; /* Can't improve on @next anymore. */
+		if (!list_empty(wheel_slot(expirer, slot)))
+			return slot + WHEEL_GRANULARITY;
+	}
+
+	return next;
+}
+
+static unsigned long table_next_clean(struct bib_table *table,
+		unsigned long next)
+{
+	/*
+	 * Only TCP has packet queues, and only TCP uses the other timers.
+	 * (Except for UDP's short-lived sessions; see short_ports.)
+	 */
+	bool tcp = !!table->pkt_queue;
+	unsigned long pkt;
+
+	table_lock(table);
+	next = expirer_next_clean(&table->est_timer, next, true);
+	next = expirer_next_clean(&table->trans_timer, next,
+			tcp || table->short_port_count);
+	next = expirer_next_clean(&table->syn4_timer, next, tcp);
+	next = expirer_next_clean(&table->closed_timer, next, tcp);
+	if (tcp) {
+		pkt = pktqueue_next_clean(table->pkt_queue);
+		if (time_before(pkt, next))
+			next = pkt;
+	}
+	table_unlock(table);
+
+	return next;
+}
+
+/**
+ * Returns the jiffy at which the next bib_clean() will (probably) have
+ * something to do, for the sessions that exist now as well as for the ones
+ * that might be created in the meantime.
+ */
+unsigned long bib_next_clean(struct bib *db)
+{
+	unsigned long next;
+	unsigned int i;
+
+	/* The event batches are only flushed by bib_clean(). */
+	next = jiffies + (READ_ONCE(db->tcp[0].log_stream)
+			? BIBEV_FLUSH_PERIOD
+			: MAX_JIFFY_OFFSET);
+
+	for (i = 0; i < db->shard_count; i++) {
+		next = table_next_clean(&db->udp[i], next);
+		next = table_next_clean(&db->tcp[i], next);
+		next = table_next_clean(&db->icmp[i], next);
+	}
+
+	return next;
+}
+
+static struct rb_node *find_starting_point(struct bib_table *table,
+		const struct ipv4_transport_addr *offset,
+		bool include_offset)
+{
+	struct tabled_bib *bib;
+	struct rb_node **node;
+	struct rb_node *parent;
+
+	/* If there's no offset, start from the beginning. */
+	if (!offset)
+		return rb_first(&table->tree4);
+
+	/* If offset is found, start from offset or offset's next. */
+	rbtree_find_node(offset, &table->tree4, compare_src4, struct tabled_bib,
+			hook4, parent, node);
+	if (*node)
+		return include_offset ? (*node) : rb_next(*node);
+
+	if (!parent)
+		return NULL;
+
+	/*
+	 * If offset is not found, start from offset's next anyway.
+	 * (If offset was meant to exist, it probably timed out and died while
+	 * the caller wasn't holding the spinlock; it's nothing to worry about.)
 	 */
+	bib = rb_entry(parent, struct tabled_bib, hook4);
+	return (compare_src4(bib, offset) < 0) ? rb_next(parent) : parent;
+}
+
+static bool filter_has(const struct bib_filter *filter, __u8 flag)
+{
+	return filter && (filter->flags & flag);
+}
+
+static int validate_filter(const struct bib_filter *filter)
+{
+	int error;
+
+	if (filter_has(filter, BIB_FILTER_SRC6)) {
+		error = prefix6_validate(&filter->src6);
+		if (error)
+			return error;
+	}
+	if (filter_has(filter, BIB_FILTER_SRC4)) {
+		error = prefix4_validate(&filter->src4.prefix);
+		if (error)
+			return error;
+		if (filter->src4.ports.min > filter->src4.ports.max) {
+			log_err("The filter's port range is backwards: %u-%u",
+					filter->src4.ports.min,
+					filter->src4.ports.max);
+			return -EINVAL;
+		}
+	}
+	if (filter_has(filter, BIB_FILTER_DST4))
+		return prefix4_validate(&filter->dst4);
+
+	return 0;
+}
+
+/**
+ * Returns @node if it belongs to @filter's src4 range, or else the first node
+ * that follows it and does. The gaps between the range's pieces (addresses
+ * below the prefix, ports outside of the range) are jumped over with tree
+ * lookups, not walked.
+ */
+static struct rb_node *seek_src4(struct bib_table *table, struct rb_node *node,
+		const struct bib_filter *filter)
+{
+	const struct ipv4_range *range;
+	struct ipv4_transport_addr target;
+	struct tabled_bib *bib;
+
+	if (!filter_has(filter, BIB_FILTER_SRC4))
+		return node;
+	range = &filter->src4;
+
+	while (node) {
+		bib = bib4_entry(node);
+
+		if (!prefix4_contains(&range->prefix, &bib->src4.l3)) {
+			if (ipv4_addr_cmp(&bib->src4.l3, &range->prefix.address) > 0)
+				return NULL; /* Past the end of the prefix. */
+			target.l3 = range->prefix.address;
+			target.l4 = range->ports.min;
+		} else if (bib->src4.l4 < range->ports.min) {
+			target.l3 = bib->src4.l3;
+			target.l4 = range->ports.min;
+		} else if (bib->src4.l4 > range->ports.max) {
+			if (bib->src4.l3.s_addr == cpu_to_be32(0xFFFFFFFFu))
+				return NULL;
+			target.l3.s_addr = cpu_to_be32(be32_to_cpu(
+					bib->src4.l3.s_addr) + 1);
+			target.l4 = range->ports.min;
+		} else {
+			return node;
+		}
+
+		node = find_starting_point(table, &target, true);
+	}
+
+	return NULL;
+}
+
+/**
+ * The BIB-level conditions of @filter. (@bib's src4 is normally already known
+ * to match, but resumed iterations might not have started from a match.)
+ */
+static bool bib_matches(struct tabled_bib *bib, const struct bib_filter *filter)
+{
+	if (filter_has(filter, BIB_FILTER_SRC4)) {
+		if (!prefix4_contains(&filter->src4.prefix, &bib->src4.l3))
+			return false;
+		if (!port_range_contains(&filter->src4.ports, bib->src4.l4))
+			return false;
+	}
+	if (filter_has(filter, BIB_FILTER_SRC6)
+			&& !prefix6_contains(&filter->src6, &bib->src6.l3))
+		return false;
+	return true;
+}
+
+/**
+ * Copies the next FOREACH_CHUNK BIB entries that follow @offset (and match
+ * @filter) to @chunk.
+ *
+ * If @lockless, gives up (returns false) once the walk starts looking
+ * suspiciously long.
+ */
+static bool collect_bibs(struct bib_table *table,
+		const struct ipv4_transport_addr *offset,
+		const struct bib_filter *filter,
+		struct foreach_chunk *chunk,
+		bool lockless)
+{
+	struct rb_node *node;
+	struct tabled_bib *tabled;
+	unsigned int visits = 0;
+
+	chunk->count = 0;
+	chunk->more = false;
+
+	node = find_starting_point(table, offset, false);
+	node = seek_src4(table, node, filter);
+	for (; node; node = seek_src4(table, rb_next(node), filter)) {
+		if (lockless && ++visits > FOREACH_CHUNK_VISITS)
+			return false;
+
+		tabled = bib4_entry(node);
+		if (!bib_matches(tabled, filter))
+			continue;
+
+		tbtobe(tabled, &chunk->bibs[chunk->count].entry);
+		chunk->bibs[chunk->count].is_static = tabled->is_static;
+		if (++chunk->count == FOREACH_CHUNK) {
+			chunk->cursor.src = tabled->src4;
+			chunk->more = true;
+			break;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Fills @chunk without blocking the writers, unless they keep getting in the
+ * way. Either way, the result is a snapshot of the table at a single moment.
+ */
+static void collect_bib_chunk(struct bib_table *table,
+		const struct ipv4_transport_addr *offset,
+		const struct bib_filter *filter,
+		struct foreach_chunk *chunk)
+{
+	unsigned int seq;
+	bool success;
+
+	rcu_read_lock();
+	seq = raw_seqcount_begin(&table->seq);
+	success = collect_bibs(table, offset, filter, chunk, true);
+	if (read_seqcount_retry(&table->seq, seq))
+		success = false;
+	rcu_read_unlock();
+	if (success)
+		return;
+
+	table_lock(table);
+	collect_bibs(table, offset, filter, chunk, false);
+	table_unlock(table);
+}
+
+static int foreach_table(struct bib_table *table,
+		struct bib_foreach_func *func,
+		const struct ipv4_transport_addr *offset,
+		const struct bib_filter *filter)
+{
+	struct foreach_chunk *chunk;
+	struct ipv4_transport_addr cursor;
+	unsigned int i;
+	int error = 0;
+
+	local_bh_disable();
+	chunk = this_cpu_ptr(chunks);
+
+	do {
+		collect_bib_chunk(table, offset, filter, chunk);
+		for (i = 0; i < chunk->count && !error; i++)
+			error = func->cb(&chunk->bibs[i].entry,
+					chunk->bibs[i].is_static, func->arg);
+		cursor = chunk->cursor.src;
+		offset = &cursor;
+	} while (!error && chunk->more);
+
+	local_bh_enable();
+	return error;
+}
+
+/**
+ * Iterates shard by shard. Since @offset always belongs to a known shard,
+ * resuming a fragmented iteration from the last entry returned still works.
+ *
+ * Only the entries that match @filter (if not NULL) are handed to @func.
+ * The src4 range is sought through the trees; src6 is checked entry by entry,
+ * because the IPv6 tree's order is not the one the iteration (and therefore
+ * @offset) follows.
+ */
+int bib_foreach(struct bib *db, l4_protocol proto,
+		struct bib_foreach_func *func,
+		const struct ipv4_transport_addr *offset,
+		const struct bib_filter *filter)
+{
+	struct bib_table *tables;
+	struct bib_table *table;
+	int error = 0;
+
+	tables = get_tables(db, proto);
+	if (!tables)
+		return -EINVAL;
+	error = validate_filter(filter);
+	if (error)
+		return error;
+
+	table = offset ? &tables[shard4(offset, db->shard_count)] : tables;
+	for (; table < tables + db->shard_count && !error; table++) {
+		error = foreach_table(table, func, offset, filter);
+		offset = NULL;
+	}
+
+	return error;
+}
+
+static struct rb_node *slot_next(struct tree_slot *slot)
+{
+	if (!slot->parent)
+		return NULL;
+	if (&slot->parent->rb_left == slot->rb_link)
+		return slot->parent;
+	/* else if (slot->parent->rb_right == &slot->rb_link) */
+	return rb_next(slot->parent);
+}
+
+static void next_bib(struct rb_node *next, struct bib_session_tuple *pos)
+{
+	pos->bib = bib4_entry(next);
+}
+
+static void next_session(struct rb_node *next, struct bib_session_tuple *pos)
+{
+	pos->session = node2session(next);
+	if (!pos->session) {
+		/* Tree was empty or the previous was the last session. */
+		/* Cascade "next" to the supertree. */
+		next_bib(rb_next(&pos->bib->hook4), pos);
+	}
+}
+
+/**
+ * Finds the BIB entry and/or session where a foreach of the sessions should
+ * start with, based on @offset.
+ *
+ * If a session that matches @offset is found, will initialize both @pos->bib
+ * and @pos->session to point to this session.
+ * If @pos->bib is defined but @pos->session is not, the foreach should start
+ * from @pos->bib's first session.
+ * If neither @pos->bib nor @pos->session are defined, iteration ended.
+ * (offset lies after the last session.)
+ *
+ * If @offset is not found, it always tries to return the session that would
+ * follow one that would match perfectly. This is because sessions expiring
+ * during ongoing fragmented foreaches are not considered a problem.
+ */
+static void find_session_offset(struct bib_table *table,
+		struct session_foreach_offset *offset,
+		struct bib_session_tuple *pos)
+{
+	struct tabled_bib tmp_bib;
+	struct tabled_session tmp_session;
+	struct tree_slot slot;
 
-	old->bib = find_bibtree6_slot(table, new->bib, &slots->bib6);
-	if (old->bib) {
-		if (!issue216_needed(masks, old)) {
-			if (new->bib->proto == L4PROTO_ICMP)
-				new->session->dst4.l4 = old->bib->src4.l4;
+	memset(pos, 0, sizeof(*pos));
 
-			old->session = find_session_slot(old->bib, new->session,
-					NULL, &slots->session);
-			return 0; /* Typical happy path for existing sessions */
-		}
+	tmp_bib.src4 = offset->offset.src;
+	pos->bib = find_bibtree4_slot(table, &tmp_bib, &slot);
+	if (!pos->bib) {
+		next_bib(slot_next(&slot), pos);
+		return;
+	}
 
-		/*
-		 * Issue #216:
-		 * If pool4 was empty (when @masks was generated) and the BIB
-		 * entry's IPv4 address is no longer a mask candidate, drop the
-		 * BIB entry and recompute it from scratch.
-		 * https://github.com/NICMx/Jool/issues/216
-		 */
-		log_debug("Issue #216.");
-		detach_bib(table, old->bib);
-		add_to_delete_list(rm_list, &old->bib->hook4);
+	tmp_session.dst4 = offset->offset.dst;
+	pos->session = find_session_slot(pos->bib, &tmp_session, NULL, &slot);
+	if (!pos->session) {
+		next_session(slot_next(&slot), pos);
+		return;
+	}
 
-		/*
-		 * The detaching above might have involved a rebalance.
-		 * I believe that completely invalidates the bib6 slot.
-		 * Tough luck; we'll need another lookup.
-		 * At least this only happens on empty pool4s. (Low traffic.)
-		 */
-		old->bib = find_bibtree6_slot(table, new->bib, &slots->bib6);
-		if (WARN(old->bib, "Found a BIB entry I just removed!"))
-			return -EINVAL;
+	if (!offset->include_offset)
+		next_session(rb_next(&pos->session->tree_hook), pos);
+}
 
-	} else {
-		/*
-		 * No BIB nor session in the main database? Try the SO
-		 * sub-database.
-		 */
-		error = upgrade_pktqueue_session(table, masks, new, old);
-		if (!error)
-			return 0; /* Unusual happy path for existing sessions */
+/**
+ * Returns @bib's first session whose dst4 might belong to @filter's dst4
+ * prefix. (The session tree is sorted by dst4.)
+ */
+static struct tabled_session *first_session(struct tabled_bib *bib,
+		const struct bib_filter *filter)
+{
+	struct tabled_session tmp;
+	struct tabled_session *session;
+	struct tree_slot slot;
+
+	if (!filter_has(filter, BIB_FILTER_DST4))
+		return node2session(rb_first(&bib->sessions));
+
+	tmp.dst4.l3 = filter->dst4.address;
+	tmp.dst4.l4 = 0;
+	session = find_session_slot(bib, &tmp, NULL, &slot);
+	return session ? : node2session(slot_next(&slot));
+}
+
+/**
+ * The session-level conditions of @filter.
+ * Returns 1 if @session matches, 0 if it doesn't, and -1 if none of the
+ * sessions that follow it (in its BIB entry) can match either.
+ */
+static int session_matches(struct tabled_session *session,
+		const struct bib_filter *filter, unsigned long now)
+{
+	unsigned long min_age;
+
+	if (filter_has(filter, BIB_FILTER_DST4)
+			&& !prefix4_contains(&filter->dst4, &session->dst4.l3)) {
+		return (ipv4_addr_cmp(&session->dst4.l3,
+				&filter->dst4.address) > 0) ? -1 : 0;
+	}
+	if (filter_has(filter, BIB_FILTER_STATE)
+			&& !(filter->states & (1u << session->state)))
+		return 0;
+	if (filter_has(filter, BIB_FILTER_AGE)) {
+		min_age = msecs_to_jiffies(filter->min_age);
+		if (time_before(now, session->update_time + min_age))
+			return 0;
 	}
 
-	/*
-	 * In case you're tweaking this function: By this point, old->bib has to
-	 * be NULL and slots->bib6 has to be a valid potential tree slot. We're
-	 * now in create-new-BIB-and-session mode.
-	 * Time to worry about slots->bib4.
-	 *
-	 * (BTW: If old->bib is NULL, then old->session is also supposed to be
-	 * NULL.)
-	 */
-	if (masks) {
-		error = find_available_mask(table, masks, new->bib, &slots->bib4);
-		if (error) {
-			if (WARN(error != -ENOENT, "Unknown error: %d", error))
-				return error;
-			/*
-			 * TODO the rate limit might be a bit of a problem.
-			 * If both mark 0 and mark 1 are running out of
-			 * addresses, only one of them will be logged.
-			 * The problem is that remembering which marks have been
-			 * logged might get pretty ridiculous.
-			 * I don't think it's too bad because there will still
-			 * be at least one message every minute.
-			 * Also, it's better than what we had before. (Not
-			 * logging the offending mark.)
-			 * Might not be worth fixing since #175 is in the radar.
-			 */
-			log_warn_once("I'm running out of pool4 addresses for mark %u.",
-					mask_domain_get_mark(masks));
-			return error;
-		}
+	return 1;
+}
 
-		if (new->bib->proto == L4PROTO_ICMP)
-			new->session->dst4.l4 = new->bib->src4.l4;
+/**
+ * Copies the next FOREACH_CHUNK sessions that follow @offset (and match
+ * @filter) to @chunk.
+ *
+ * If @lockless, gives up (returns false) once the walk starts looking
+ * suspiciously long.
+ */
+static bool collect_sessions(struct bib_table *table,
+		struct session_foreach_offset *offset,
+		const struct bib_filter *filter,
+		unsigned long now,
+		struct foreach_chunk *chunk,
+		bool lockless)
+{
+	struct bib_session_tuple pos;
+	struct session_entry *out;
+	unsigned int visits = 0;
+	bool resume = false;
+	int match;
+
+	chunk->count = 0;
+	chunk->more = false;
 
+	if (offset) {
+		find_session_offset(table, offset, &pos);
+		/* if pos.session != NULL, then pos.bib != NULL. */
+		resume = pos.session && bib_matches(pos.bib, filter);
 	} else {
-		/*
-		 * TODO (issue113) perhaps the sender's session shold be trusted
-		 * more.
-		 */
-		if (find_bibtree4_slot(table, new->bib, &slots->bib4))
-			return -EEXIST;
+		pos.bib = bib4_entry(seek_src4(table, rb_first(&table->tree4),
+				filter));
 	}
 
-	/* Ok, time to worry about slots->session now. */
+	for (; pos.bib; pos.bib = bib4_entry(seek_src4(table,
+			rb_next(&pos.bib->hook4), filter))) {
+		if (lockless && ++visits > FOREACH_CHUNK_VISITS)
+			return false;
 
-	treeslot_init(&slots->session, &new->bib->sessions,
-			&new->session->tree_hook);
-	old->session = NULL;
+		if (!resume) {
+			if (!bib_matches(pos.bib, filter))
+				continue;
+			pos.session = first_session(pos.bib, filter);
+		}
+		resume = false;
+
+		for (; pos.session; pos.session = node2session(
+				rb_next(&pos.session->tree_hook))) {
+			if (lockless && ++visits > FOREACH_CHUNK_VISITS)
+				return false;
+
+			match = session_matches(pos.session, filter, now);
+			if (match < 0)
+				break;
+			if (match == 0)
+				continue;
+
+			out = &chunk->sessions[chunk->count];
+			tstose(table, pos.session, out);
+			read_counters(pos.session, &out->counters);
+			if (++chunk->count == FOREACH_CHUNK) {
+				chunk->cursor.src = pos.bib->src4;
+				chunk->cursor.dst = pos.session->dst4;
+				chunk->more = true;
+				return true;
+			}
+		}
+	}
 
-	return 0; /* Happy path for new sessions */
+	return true;
+}
+
+/** Session version of collect_bib_chunk(). */
+static void collect_session_chunk(struct bib_table *table,
+		struct session_foreach_offset *offset,
+		const struct bib_filter *filter,
+		unsigned long now,
+		struct foreach_chunk *chunk)
+{
+	unsigned int seq;
+	bool success;
+
+	rcu_read_lock();
+	seq = raw_seqcount_begin(&table->seq);
+	success = collect_sessions(table, offset, filter, now, chunk, true);
+	if (read_seqcount_retry(&table->seq, seq))
+		success = false;
+	rcu_read_unlock();
+	if (success)
+		return;
+
+	table_lock(table);
+	collect_sessions(table, offset, filter, now, chunk, false);
+	table_unlock(table);
 }
 
 /**
- * @db current BIB & session database.
- * @masks Should a BIB entry be created, its IPv4 address mask will be allocated
- *     from one of these candidates.
- * @tuple6 The connection that you want to mask.
- * @dst4 translated version of @tuple.dst.addr6.
- * @result A copy of the resulting BIB entry and session from the database will
- *     be placed here. (if not NULL)
+ * Hands @table's sessions to @func, FOREACH_CHUNK at a time. Each chunk is a
+ * consistent snapshot, taken without the lock whenever the writers allow it,
+ * and the callbacks run with the table released.
  */
-int bib_add6(struct bib *db,
-		struct mask_domain *masks,
-		struct tuple *tuple6,
-		struct ipv4_transport_addr *dst4,
-		struct bib_session *result)
+static int foreach_session_table(struct bib_table *table,
+		struct session_foreach_func *func,
+		struct session_foreach_offset *offset,
+		const struct bib_filter *filter)
+{
+	struct foreach_chunk *chunk;
+	struct session_foreach_offset cursor;
+	unsigned long now = jiffies;
+	unsigned int i;
+	int error = 0;
+
+	local_bh_disable();
+	chunk = this_cpu_ptr(chunks);
+
+	do {
+		collect_session_chunk(table, offset, filter, now, chunk);
+		for (i = 0; i < chunk->count && !error; i++)
+			error = func->cb(&chunk->sessions[i], func->arg);
+		cursor.offset = chunk->cursor;
+		cursor.include_offset = false;
+		offset = &cursor;
+	} while (!error && chunk->more);
+
+	local_bh_enable();
+	return error;
+}
+
+/**
+ * See bib_foreach(). Sessions are also sought by dst4 within each BIB entry;
+ * states and ages are checked one by one.
+ */
+int bib_foreach_session(struct bib *db, l4_protocol proto,
+		struct session_foreach_func *func,
+		struct session_foreach_offset *offset,
+		const struct bib_filter *filter)
 {
+	struct bib_table *tables;
 	struct bib_table *table;
-	struct bib_session_tuple new;
-	struct bib_session_tuple old;
-	struct slot_group slots;
-	struct bib_delete_list rm_list = { NULL };
-	int error;
+	int error = 0;
+
+	tables = get_tables(db, proto);
+	if (!tables)
+		return -EINVAL;
+	error = validate_filter(filter);
+	if (error)
+		return error;
+
+	table = offset
+			? &tables[shard4(&offset->offset.src, db->shard_count)]
+			: tables;
+	for (; table < tables + db->shard_count && !error; table++) {
+		error = foreach_session_table(table, func, offset, filter);
+		offset = NULL;
+	}
+
+	return error;
+}
+
+int bib_find6(struct bib *db, l4_protocol proto,
+		struct ipv6_transport_addr *addr,
+		struct bib_entry *result)
+{
+	struct bib_table *table;
+	struct tabled_bib *bib;
+
+	table = get_table6(db, proto, addr);
+	if (!table)
+		return -EINVAL;
+
+	table_lock(table);
+	bib = find_bib6(table, addr);
+	if (bib)
+		tbtobe(bib, result);
+	table_unlock(table);
+
+	return bib ? 0 : -ESRCH;
+}
+
+int bib_find4(struct bib *db, l4_protocol proto,
+		struct ipv4_transport_addr *addr,
+		struct bib_entry *result)
+{
+	struct bib_table *table;
+	struct tabled_bib *bib;
 
-	table = get_table(db, tuple6->l4_proto);
+	table = get_table4(db, proto, addr);
 	if (!table)
 		return -EINVAL;
 
+	table_lock(table);
+	bib = find_bib4(table, addr);
+	if (bib)
+		tbtobe(bib, result);
+	table_unlock(table);
+
+	return bib ? 0 : -ESRCH;
+}
+
+static void bib2tabled(struct bib_entry *bib, struct tabled_bib *tabled)
+{
+	tabled->src6 = bib->ipv6;
+	tabled->src4 = bib->ipv4;
+	tabled->proto = bib->l4_proto;
+	tabled->is_static = true;
+	tabled->sessions = RB_ROOT;
+}
+
+/**
+ * The locked part of bib_add_static().
+ *
+ * Returns 0 if @bib was inserted (@table now owns it), 1 if an identical entry
+ * was already there (and merely became static), and -EEXIST if @bib collides
+ * with some other entry (which is copied to @old, unless NULL). @bib still
+ * belongs to the caller in the last two cases.
+ *
+ * @snode is the entry's node in the static index. It's set to NULL if the
+ * table took it over.
+ */
+static int __add_static(struct bib_table *table, struct tabled_bib *bib,
+		struct static_node **snode, struct bib_entry *old)
+{
+	struct tabled_bib *collision;
+	struct tree_slot slot6;
+	struct tree_slot slot4;
+
+	collision = find_bibtree6_slot(table, bib, &slot6);
+	if (collision) {
+		if (taddr4_equals(&bib->src4, &collision->src4)) {
+			if (!collision->is_static) {
+				index_static(table, collision, *snode);
+				*snode = NULL;
+				collision->is_static = true;
+			}
+			return 1;
+		}
+		goto eexist;
+	}
+
+	collision = find_bibtree4_slot(table, bib, &slot4);
+	if (collision)
+		goto eexist;
+
+	treeslot_commit_rcu(&slot6);
+	treeslot_commit_rcu(&slot4);
+	index_static(table, bib, *snode);
+	*snode = NULL;
+	table->bib_count++;
+	take_port(table, bib);
+	account_subscriber(table, &bib->src6.l3, 1, 0);
+	log_change(table, BIBEV_BIB_ADD, bib, NULL);
+
 	/*
-	 * We might have a lot to do. This function may index three RB-trees
-	 * so spinlock time is tight.
-	 *
-	 * (That's 3 potential lookups (2 guaranteed) and 3 potential
-	 * rebalances, though at least one of the trees is usually minuscule.)
-	 *
-	 * There's also the optional port allocation thing, which in the worst
-	 * case is an unfortunate full traversal of @masks.
-	 *
-	 * Let's start by allocating and initializing the objects as much as we
-	 * can, even if we end up not needing them.
-	 */
-	error = create_bib_session6(&new, tuple6, dst4, ESTABLISHED);
-	if (error)
-		return error;
+	 * Since the BIB entry is now available, and assuming ADF is disabled,
+	 * it would make sense to translate the relevant type 1 stored packets.
+	 * That's bound to be a lot of messy code though, and the v4 client is
+	 * going to retry anyway, so let's just forget the packets instead.
+	 */
+	if (bib->proto == L4PROTO_TCP)
+		pktqueue_rm(table->pkt_queue, &bib->src4);
 
-	spin_lock_bh(&table->lock); /* Here goes... */
+	return 0;
 
-	error = find_bib_session6(table, masks, &new, &old, &slots, &rm_list);
-	if (error)
-		goto end;
+eexist:
+	if (old)
+		tbtobe(collision, old);
+	return -EEXIST;
+}
 
-	if (old.session) { /* Session already exists. */
-		handle_fate_timer(old.session, &table->est_timer);
-		tstobs(old.session, result);
-		goto end;
-	}
+int bib_add_static(struct bib *db, struct bib_entry *new,
+		struct bib_entry *old)
+{
+	struct bib_table *table;
+	struct tabled_bib *bib;
+	struct static_node *snode;
+	int error;
 
-	/* New connection; add the session. (And maybe the BIB entry as well) */
-	commit_add6(table, &old, &new, &slots, &table->est_timer, result);
-	/* Fall through */
+	table = get_table4(db, new->l4_proto, &new->ipv4);
+	if (!table)
+		return -EINVAL;
 
-end:
-	spin_unlock_bh(&table->lock);
+	if (!shards_match(db, &new->ipv6, &new->ipv4)) {
+		log_err("The BIB is sharded (bib_shards = %u), and %pI6c#%u and %pI4#%u do not hash into the same shard. Please try a different port.",
+				db->shard_count,
+				&new->ipv6.l3, new->ipv6.l4,
+				&new->ipv4.l3, new->ipv4.l4);
+		return -EINVAL;
+	}
 
-	if (new.bib)
-		free_bib(new.bib);
-	if (new.session)
-		free_session(new.session);
-	commit_delete_list(&rm_list);
+	bib = alloc_bib(GFP_ATOMIC);
+	if (!bib)
+		return -ENOMEM;
+	bib2tabled(new, bib);
+	snode = wkmalloc(struct static_node, GFP_ATOMIC);
+	if (!snode) {
+		free_bib(bib);
+		return -ENOMEM;
+	}
 
-	return error;
-}
+	lock_table(table);
+	error = __add_static(table, bib, &snode, old);
+	unlock_table(table);
 
-static void find_bib_session4(struct bib_table *table,
-		struct tuple *tuple4,
-		struct tabled_session *new,
-		struct bib_session_tuple *old,
-		bool *allow,
-		struct tree_slot *slot)
-{
-	old->bib = find_bib4(table, &tuple4->dst.addr4);
-	old->session = old->bib
-			? find_session_slot(old->bib, new, allow, slot)
-			: NULL;
+	if (error)
+		free_bib(bib);
+	if (snode)
+		wkfree(struct static_node, snode);
+	return (error > 0) ? 0 : error;
 }
 
 /**
- * See @bib_add6.
+ * Adds the @count static entries @entries to @proto's BIB, locking each shard
+ * once, instead of once per entry.
+ *
+ * @errors[i] ends up holding what bib_add_static() would have returned for
+ * @entries[i]. Entries whose @errors slot is already nonzero (because the
+ * caller found something wrong with them) are skipped.
+ *
+ * Can sleep.
  */
-int bib_add4(struct bib *db,
-		struct ipv6_transport_addr *dst6,
-		struct tuple *tuple4,
-		struct bib_session *result)
+int bib_add_static_bulk(struct bib *db, l4_protocol proto,
+		struct bib_bulk_entry *entries, unsigned int count,
+		int *errors)
 {
+	struct bib_table *tables;
 	struct bib_table *table;
-	struct bib_session_tuple old;
-	struct tabled_session *new;
-	struct tree_slot session_slot;
-	bool allow;
-	int error = 0;
+	struct tabled_bib **bibs;
+	struct static_node **snodes;
+	struct bib_entry tmp;
+	unsigned int i;
+	bool locked;
 
-	table = get_table(db, tuple4->l4_proto);
-	if (!table)
+	tables = get_tables(db, proto);
+	if (!tables)
 		return -EINVAL;
 
-	new = create_session4(tuple4, dst6, ESTABLISHED);
-	if (!new)
+	bibs = __wkmalloc("bulk BIB array", count * sizeof(*bibs), GFP_KERNEL);
+	if (!bibs)
+		return -ENOMEM;
+	snodes = __wkmalloc("bulk static node array", count * sizeof(*snodes),
+			GFP_KERNEL);
+	if (!snodes) {
+		__wkfree("bulk BIB array", bibs);
 		return -ENOMEM;
+	}
 
-	spin_lock_bh(&table->lock);
+	for (i = 0; i < count; i++) {
+		bibs[i] = NULL;
+		snodes[i] = NULL;
+		if (errors[i])
+			continue;
 
-	find_bib_session4(table, tuple4, new, &old, &allow, &session_slot);
+		if (!shards_match(db, &entries[i].addr6, &entries[i].addr4)) {
+			errors[i] = -EINVAL;
+			continue;
+		}
 
-	if (old.session) {
-		handle_fate_timer(old.session, &table->est_timer);
-		tstobs(old.session, result);
-		goto end;
-	}
+		bibs[i] = alloc_bib(GFP_KERNEL);
+		if (!bibs[i]) {
+			errors[i] = -ENOMEM;
+			continue;
+		}
+		snodes[i] = wkmalloc(struct static_node, GFP_KERNEL);
+		if (!snodes[i]) {
+			free_bib(bibs[i]);
+			bibs[i] = NULL;
+			errors[i] = -ENOMEM;
+			continue;
+		}
 
-	if (!old.bib) {
-		error = -ESRCH;
-		goto end;
+		tmp.ipv6 = entries[i].addr6;
+		tmp.ipv4 = entries[i].addr4;
+		tmp.l4_proto = proto;
+		bib2tabled(&tmp, bibs[i]);
 	}
 
-	/* Address-Dependent Filtering. */
-	if (table->drop_by_addr && !allow) {
-		error = -EPERM;
-		goto end;
+	for (table = tables; table < tables + db->shard_count; table++) {
+		locked = false;
+
+		for (i = 0; i < count; i++) {
+			if (!bibs[i])
+				continue;
+			if (&tables[shard4(&bibs[i]->src4, db->shard_count)]
+					!= table)
+				continue;
+
+			if (!locked) {
+				lock_table(table);
+				locked = true;
+			}
+
+			errors[i] = __add_static(table, bibs[i], &snodes[i],
+					NULL);
+			if (!errors[i])
+				bibs[i] = NULL;
+			else if (errors[i] > 0)
+				errors[i] = 0;
+		}
+
+		if (locked)
+			unlock_table(table);
 	}
 
-	/* Ok, no issues; add the session. */
-	commit_add4(table, &old, &new, &session_slot, &table->est_timer, result);
-	/* Fall through */
+	/* The ones that were not inserted. */
+	for (i = 0; i < count; i++) {
+		if (bibs[i])
+			free_bib(bibs[i]);
+		if (snodes[i])
+			wkfree(struct static_node, snodes[i]);
+	}
 
-end:
-	spin_unlock_bh(&table->lock);
-	if (new)
-		free_session(new);
-	return error;
+	__wkfree("bulk static node array", snodes);
+	__wkfree("bulk BIB array", bibs);
+	return 0;
 }
 
-/**
- * Note: This particular incarnation of fate_cb is not prepared to return
- * FATE_PROBE.
- */
-verdict bib_add_tcp6(struct bib *db,
-		struct mask_domain *masks,
-		struct ipv4_transport_addr *dst4,
-		struct packet *pkt,
-		struct collision_cb *cb,
-		struct bib_session *result)
+int bib_rm(struct bib *db, struct bib_entry *entry)
 {
 	struct bib_table *table;
-	struct bib_session_tuple new;
-	struct bib_session_tuple old;
-	struct slot_group slots;
-	struct bib_delete_list rm_list = { NULL };
-	verdict verdict;
-
-	if (WARN(pkt->tuple.l4_proto != L4PROTO_TCP, "Incorrect l4 proto in TCP handler."))
-		return VERDICT_DROP;
+	struct tabled_bib key;
+	struct tabled_bib *bib;
+	int error = -ESRCH;
 
-	if (create_bib_session6(&new, &pkt->tuple, dst4, V6_INIT))
-		return VERDICT_DROP;
+	table = get_table6(db, entry->l4_proto, &entry->ipv6);
+	if (!table)
+		return -EINVAL;
 
-	table = &db->tcp;
-	spin_lock_bh(&table->lock);
+	bib2tabled(entry, &key);
 
-	if (find_bib_session6(table, masks, &new, &old, &slots, &rm_list)) {
-		verdict = VERDICT_DROP;
-		goto end;
-	}
+	lock_table(table);
 
-	if (old.session) {
-		/* All states except CLOSED. */
-		verdict = decide_fate(cb, table, old.session, NULL);
-		if (verdict == VERDICT_CONTINUE)
-			tstobs(old.session, result);
-		goto end;
+	bib = find_bib6(table, &key.src6);
+	if (bib && taddr4_equals(&key.src4, &bib->src4)) {
+		detach_bib(table, bib);
+		error = 0;
 	}
 
-	/* CLOSED state beginning now. */
+	unlock_table(table);
 
-	if (!pkt_tcp_hdr(pkt)->syn) {
-		if (old.bib) {
-			tbtobs(old.bib, result);
-			verdict = VERDICT_CONTINUE;
-		} else {
-			log_debug("Packet is not SYN and lacks state.");
-			verdict = VERDICT_DROP;
-		}
-		goto end;
+	if (!error) {
+		offload_flush(&db->offload);
+		release_bib_entry(&bib->hook4, db);
 	}
 
-	/* All exits up till now require @new.* to be deleted. */
-
-	commit_add6(table, &old, &new, &slots, &table->trans_timer, result);
-	verdict = VERDICT_CONTINUE;
-	/* Fall through */
-
-end:
-	spin_unlock_bh(&table->lock);
-
-	if (new.bib)
-		free_bib(new.bib);
-	if (new.session)
-		free_session(new.session);
-	commit_delete_list(&rm_list);
-
-	return verdict;
+	return error;
 }
 
 /**
- * Note: This particular incarnation of fate_cb is not prepared to return
- * FATE_PROBE.
+ * Removes the @count entries @entries from @proto's BIB, locking each shard
+ * once. Both of each entry's addresses have to match.
+ *
+ * @errors[i] ends up holding what bib_rm() would have returned for
+ * @entries[i]. Entries whose @errors slot is already nonzero are skipped.
  */
-verdict bib_add_tcp4(struct bib *db,
-		struct ipv6_transport_addr *dst6,
-		struct packet *pkt,
-		struct collision_cb *cb,
-		struct bib_session *result)
+int bib_rm_bulk(struct bib *db, l4_protocol proto,
+		struct bib_bulk_entry *entries, unsigned int count,
+		int *errors)
 {
+	struct bib_table *tables;
 	struct bib_table *table;
-	struct tabled_session *new;
-	struct bib_session_tuple old;
-	struct tree_slot session_slot;
-	verdict verdict;
-	int error;
-
-	if (WARN(pkt->tuple.l4_proto != L4PROTO_TCP, "Incorrect l4 proto in TCP handler."))
-		return VERDICT_DROP;
-
-	new = create_session4(&pkt->tuple, dst6, V4_INIT);
-	if (!new)
-		return VERDICT_DROP;
+	struct tabled_bib *bib;
+	struct bib_delete_list delete_list = { NULL };
+	unsigned int i;
+	bool locked;
 
-	table = &db->tcp;
-	spin_lock_bh(&table->lock);
+	tables = get_tables(db, proto);
+	if (!tables)
+		return -EINVAL;
 
-	find_bib_session4(table, &pkt->tuple, new, &old, NULL, &session_slot);
+	for (table = tables; table < tables + db->shard_count; table++) {
+		locked = false;
+
+		for (i = 0; i < count; i++) {
+			if (errors[i])
+				continue;
+			if (&tables[shard6(&entries[i].addr6, db->shard_count)]
+					!= table)
+				continue;
+
+			if (!locked) {
+				lock_table(table);
+				locked = true;
+			}
+
+			/* (Entries listed twice are not found the second time.) */
+			bib = find_bib6(table, &entries[i].addr6);
+			if (bib && taddr4_equals(&entries[i].addr4, &bib->src4)) {
+				detach_bib(table, bib);
+				add_to_delete_list(&delete_list, &bib->hook4);
+			} else {
+				errors[i] = -ESRCH;
+			}
+		}
 
-	if (old.session) {
-		/* All states except CLOSED. */
-		verdict = decide_fate(cb, table, old.session, NULL);
-		if (verdict == VERDICT_CONTINUE)
-			tstobs(old.session, result);
-		goto end;
+		if (locked)
+			unlock_table(table);
 	}
 
-	/* CLOSED state beginning now. */
+	commit_delete_list(db, &delete_list);
+	return 0;
+}
 
-	if (!pkt_tcp_hdr(pkt)->syn) {
-		if (old.bib) {
-			tbtobs(old.bib, result);
-			verdict = VERDICT_CONTINUE;
-		} else {
-			log_debug("Packet is not SYN and lacks state.");
-			verdict = VERDICT_DROP;
-		}
-		goto end;
-	}
+/**
+ * Visits up to RM_RANGE_BATCH of @table's entries, starting from @offset, and
+ * removes the ones that belong to @range.
+ * Returns true (and updates @offset) if there might be more left.
+ */
+static bool rm_range_batch(struct bib_table *table, struct ipv4_range *range,
+		struct ipv4_transport_addr *offset)
+{
+	struct rb_node *node;
+	struct rb_node *next;
+	struct tabled_bib *bib;
+	struct bib_delete_list delete_list = { NULL };
+	unsigned int visited = 0;
+	bool more = false;
 
-	if (table->drop_v4_syn) {
-		log_debug("Externally initiated TCP connections are prohibited.");
-		verdict = VERDICT_DROP;
-		goto end;
-	}
+	lock_table(table);
 
-	if (!old.bib) {
-		bool too_many;
+	node = find_starting_point(table, offset, true);
+	for (; node; node = next) {
+		next = rb_next(node);
+		bib = bib4_entry(node);
 
-		log_debug("Potential Simultaneous Open; storing type 1 packet.");
-		too_many = table->pkt_count >= table->pkt_limit;
-		error = pktqueue_add(table->pkt_queue, pkt, dst6, too_many);
-		switch (error) {
-		case 0:
-			verdict = VERDICT_STOLEN;
-			table->pkt_count++;
-			goto end;
-		case -EEXIST:
-			log_debug("Simultaneous Open already exists.");
-			break;
-		case -ENOSPC:
-			goto too_many_pkts;
-		case -ENOMEM:
+		if (!prefix4_contains(&range->prefix, &bib->src4.l3))
 			break;
-		default:
-			WARN(1, "pktqueue_add() threw unknown error %d", error);
+		if (visited++ == RM_RANGE_BATCH) {
+			*offset = bib->src4;
+			more = true;
 			break;
 		}
-
-		verdict = VERDICT_DROP;
-		goto end;
-	}
-
-	verdict = VERDICT_CONTINUE;
-
-	if (table->drop_by_addr) {
-		if (table->pkt_count >= table->pkt_limit)
-			goto too_many_pkts;
-
-		log_debug("Potential Simultaneous Open; storing type 2 packet.");
-		new->stored = pkt_original_pkt(pkt)->skb;
-		verdict = VERDICT_STOLEN;
-		table->pkt_count++;
-		/*
-		 * Yes, fall through. No goto; we need to add this session.
-		 * Notice that if you need to cancel before the spin unlock then
-		 * you need to revert the packet storing above.
-		 */
+		if (port_range_contains(&range->ports, bib->src4.l4)) {
+			detach_bib(table, bib);
+			add_to_delete_list(&delete_list, node);
+		}
 	}
 
-	commit_add4(table, &old, &new, &session_slot,
-			new->stored ? &table->syn4_timer : &table->trans_timer,
-			result);
-	/* Fall through */
+	unlock_table(table);
 
-end:
-	spin_unlock_bh(&table->lock);
+	commit_delete_list(table->db, &delete_list);
+	return more;
+}
 
-	if (new)
-		free_session(new);
+/**
+ * Releases the lock every once in a while, so the packet path doesn't spin on
+ * it for the whole duration of a big removal.
+ */
+static void rm_range_table(struct bib_table *table, struct ipv4_range *range)
+{
+	struct ipv4_transport_addr offset;
 
-	return verdict;
+	offset.l3 = range->prefix.address;
+	offset.l4 = range->ports.min;
 
-too_many_pkts:
-	spin_unlock_bh(&table->lock);
-	free_session(new);
-	log_debug("Too many Simultaneous Opens.");
-	/* Fall back to assume there's no SO. */
-	icmp64_send(pkt, ICMPERR_PORT_UNREACHABLE, 0);
-	return VERDICT_DROP;
+	while (rm_range_batch(table, range, &offset))
+		cond_resched();
 }
 
-int bib_find(struct bib *db, struct tuple *tuple, struct bib_session *result)
+static void __bib_rm_range(struct bib *db, l4_protocol proto,
+		struct ipv4_range *range)
 {
-	struct bib_entry tmp;
-	int error;
+	struct bib_table *tables;
+	struct bib_table *table;
 
-	switch (tuple->l3_proto) {
-	case L3PROTO_IPV6:
-		error = bib_find6(db, tuple->l4_proto, &tuple->src.addr6, &tmp);
-		break;
-	case L3PROTO_IPV4:
-		error = bib_find4(db, tuple->l4_proto, &tuple->dst.addr4, &tmp);
-		break;
-	default:
-		WARN(true, "Unknown layer 3 protocol: %u", tuple->l3_proto);
-		return -EINVAL;
-	}
+	tables = get_tables(db, proto);
+	if (!tables)
+		return;
 
-	if (error)
-		return error;
+	foreach_shard(db, tables, table)
+		rm_range_table(table, range);
+}
 
-	result->bib_set = true;
-	result->session.src6 = tmp.ipv6;
-	result->session.src4 = tmp.ipv4;
-	result->session.proto = tmp.l4_proto;
-	return 0;
+static void rm_range_work_fn(struct work_struct *work)
+{
+	struct rm_range_work *rm;
+
+	rm = container_of(work, struct rm_range_work, work);
+	__bib_rm_range(rm->db, rm->proto, &rm->range);
+	bib_put(rm->db);
+	wkfree(struct rm_range_work, rm);
 }
 
-int bib_add_session(struct bib *db,
-		struct session_entry *session,
-		struct collision_cb *cb)
+/**
+ * Removes the entries that belong to @range, in the background.
+ *
+ * Removals are processed in order, so the BIB catches up with pool4 in the same
+ * order the user changed it. (The caller is expected to have already removed
+ * @range from pool4, so nothing should be adding entries to it meanwhile.)
+ */
+void bib_rm_range(struct bib *db, l4_protocol proto, struct ipv4_range *range)
 {
-	struct bib_table *table;
-	struct bib_session_tuple new;
-	struct bib_session_tuple old;
-	struct slot_group slots;
-	struct bib_delete_list rm_list = { NULL };
-	int error;
+	struct rm_range_work *rm;
 
-	table = get_table(db, session->proto);
-	if (!table)
-		return -EINVAL;
+	rm = wkmalloc(struct rm_range_work, GFP_KERNEL);
+	if (!rm) {
+		/* Can't defer it; do it now. */
+		__bib_rm_range(db, proto, range);
+		return;
+	}
 
-	error = create_bib_session(session, &new);
-	if (error)
-		return error;
+	INIT_WORK(&rm->work, rm_range_work_fn);
+	bib_get(db);
+	rm->db = db;
+	rm->proto = proto;
+	rm->range = *range;
+	queue_work(rm_range_wq, &rm->work);
+}
 
-	spin_lock_bh(&table->lock);
+/**
+ * Waits until the pending bib_rm_range()s (and the memory releases of
+ * bib_flush()) have been carried out.
+ */
+void bib_rm_range_wait(void)
+{
+	flush_workqueue(rm_range_wq);
+}
 
-	error = find_bib_session6(table, NULL, &new, &old, &slots, &rm_list);
-	if (error)
-		goto end;
+/**
+ * Entry by entry version of flush_table(). Only used if the latter cannot
+ * allocate its memory.
+ */
+static void flush_table_slow(struct bib_table *table)
+{
+	struct rb_node *node;
+	struct rb_node *next;
+	struct bib_delete_list delete_list = { NULL };
 
-	if (old.session) {
-		/* There's no packet; ignore the verdict. */
-		decide_fate(cb, table, old.session, NULL);
-		goto end;
+	lock_table(table);
+
+	for (node = rb_first(&table->tree4); node; node = next) {
+		next = rb_next(node);
+		detach_bib(table, bib4_entry(node));
+		add_to_delete_list(&delete_list, node);
 	}
 
-	error = commit_add(table, &old, &new, &slots, session->timer_type);
-	/* Fall through */
+	unlock_table(table);
 
-end:
-	spin_unlock_bh(&table->lock);
+	commit_delete_list(table->db, &delete_list);
+}
 
-	if (new.bib)
-		free_bib(new.bib);
-	if (new.session)
-		free_session(new.session);
-	commit_delete_list(&rm_list);
+static void empty_wheel(struct expire_timer *expirer)
+{
+	unsigned int i;
 
-	return error;
+	for (i = 0; i < WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&expirer->slots[i]);
+	expirer->count = 0;
 }
 
-static void __clean(struct expire_timer *expirer,
-		struct bib_table *table,
-		struct list_head *probes)
+/**
+ * Hands everything @table indexes over to @flush, and leaves @table empty.
+ * @hash is the table's new session index. (NULL if it doesn't have one.)
+ *
+ * None of this depends on the number of entries, except for the blocks (which
+ * have to be logged now, while the table still knows their shape) and the
+ * type 2 packets (which are bounded by --maximum-simultaneous-opens).
+ */
+static void detach_table(struct bib_table *table, struct table_flush *flush,
+		struct hlist_head *hash)
 {
 	struct tabled_session *session;
-	struct tabled_session *tmp;
-	struct collision_cb cb;
+	struct hlist_node *node;
+	unsigned int i;
 
-	cb.cb = expirer->decide_fate_cb;
-	cb.arg = NULL;
+	flush->tree4 = table->tree4;
+	table->tree4 = RB_ROOT;
+	table->tree6 = RB_ROOT;
 
-	list_for_each_entry_safe(session, tmp, &expirer->sessions, list_hook) {
-		/*
-		 * "list" is sorted by expiration date,
-		 * so stop on the first unexpired session.
-		 */
-		if (time_before(jiffies, session->update_time + expirer->timeout))
-			break;
-		decide_fate(&cb, table, session, probes);
+	flush->hash = table->hash6;
+	if (hash) {
+		table->hash6 = hash;
+		table->hash4 = hash + table->hash_mask + 1;
 	}
-}
-
-static void clean_table(struct bib_table *table, struct net *ns)
-{
-	LIST_HEAD(probes);
-	LIST_HEAD(icmps);
 
-	spin_lock_bh(&table->lock);
-	__clean(&table->est_timer, table, &probes);
-	__clean(&table->trans_timer, table, &probes);
-	__clean(&table->syn4_timer, table, &probes);
-	if (table->pkt_queue) {
-		table->pkt_count -= pktqueue_prepare_clean(table->pkt_queue,
-				&icmps);
+	/* The type 2 packets live in the SYN4 wheel. */
+	for (i = 0; i < WHEEL_SLOTS; i++)
+		list_for_each_entry(session, &table->syn4_timer.slots[i],
+				list_hook)
+			if (session->stored)
+				table->pkt_count--;
+	empty_wheel(&table->est_timer);
+	empty_wheel(&table->trans_timer);
+	empty_wheel(&table->syn4_timer);
+	empty_wheel(&table->closed_timer);
+	if (table->adf_counters)
+		memset(table->adf_counters, 0, table->adf_mask + 1);
+
+	for (i = 0; i < PORT_BLOCK_BUCKETS; i++) {
+		hlist_for_each(node, &table->blocks[i])
+			log_block(table, hlist_entry(node, struct port_block,
+					hook), BIBEV_BLOCK_RM, "Released block");
+		hlist_move_list(&table->blocks[i], &flush->blocks[i]);
 	}
-	spin_unlock_bh(&table->lock);
+	for (i = 0; i < SUBSCRIBER_BUCKETS; i++)
+		hlist_move_list(&table->subscribers[i], &flush->subscribers[i]);
+	for (i = 0; i < PORT_BITMAP_BUCKETS; i++)
+		hlist_move_list(&table->port_bitmaps[i],
+				&flush->port_bitmaps[i]);
+	/* (The lockless readers can finish their walks; see flush_work_fn().) */
+	for (i = 0; i < STATIC_BUCKETS; i++)
+		hlist_move_list(&table->statics[i], &flush->statics[i]);
 
-	post_fate(ns, &probes);
-	pktqueue_clean(&icmps);
+	table->bib_count = 0;
+	table->session_count = 0;
+	table->block_count = 0;
 }
 
-/**
- * Forgets or downgrades (from EST to TRANS) old sessions.
- */
-void bib_clean(struct bib *db, struct net *ns)
+static void release_flushed_session(struct rb_node *node, void *arg)
 {
-	clean_table(&db->udp, ns);
-	clean_table(&db->tcp, ns);
-	clean_table(&db->icmp, ns);
+	struct tabled_session *session = node2session(node);
+	struct table_flush *flush = arg;
+
+	release_stored_pkt(flush->db, session);
+	free_session(session);
 }
 
-static struct rb_node *find_starting_point(struct bib_table *table,
-		const struct ipv4_transport_addr *offset,
-		bool include_offset)
+static void release_flushed_bib(struct rb_node *node, void *arg)
 {
-	struct tabled_bib *bib;
-	struct rb_node **node;
-	struct rb_node *parent;
+	struct tabled_bib *bib = bib4_entry(node);
+	struct table_flush *flush = arg;
 
-	/* If there's no offset, start from the beginning. */
-	if (!offset)
-		return rb_first(&table->tree4);
+	rbtree_clear(&bib->sessions, release_flushed_session, flush);
+	free_bib(bib);
 
-	/* If offset is found, start from offset or offset's next. */
-	rbtree_find_node(offset, &table->tree4, compare_src4, struct tabled_bib,
-			hook4, parent, node);
-	if (*node)
-		return include_offset ? (*node) : rb_next(*node);
+	if (++flush->freed % FLUSH_BATCH == 0)
+		cond_resched();
+}
 
-	if (!parent)
-		return NULL;
+static void flush_work_fn(struct work_struct *work)
+{
+	struct table_flush *flush;
+	struct port_bitmap *bitmap;
+	struct hlist_node *node;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	flush = container_of(work, struct table_flush, work);
 
 	/*
-	 * If offset is not found, start from offset's next anyway.
-	 * (If offset was meant to exist, it probably timed out and died while
-	 * the caller wasn't holding the spinlock; it's nothing to worry about.)
+	 * Lockless readers might still be walking the old trees and index.
+	 * After this, nobody can; the entries can skip call_rcu().
 	 */
-	bib = rb_entry(parent, struct tabled_bib, hook4);
-	return (compare_src4(bib, offset) < 0) ? rb_next(parent) : parent;
+	synchronize_rcu();
+
+	rbtree_clear(&flush->tree4, release_flushed_bib, flush);
+	vfree(flush->hash);
+
+	for (i = 0; i < PORT_BLOCK_BUCKETS; i++)
+		hlist_for_each_safe(node, tmp, &flush->blocks[i])
+			__wkfree("port block",
+					hlist_entry(node, struct port_block, hook));
+	for (i = 0; i < SUBSCRIBER_BUCKETS; i++)
+		hlist_for_each_safe(node, tmp, &flush->subscribers[i])
+			wkfree(struct subscriber,
+					hlist_entry(node, struct subscriber, hook));
+	for (i = 0; i < PORT_BITMAP_BUCKETS; i++) {
+		hlist_for_each_safe(node, tmp, &flush->port_bitmaps[i]) {
+			bitmap = hlist_entry(node, struct port_bitmap, hook);
+			destroy_port_bitmap(bitmap);
+		}
+	}
+	for (i = 0; i < STATIC_BUCKETS; i++)
+		hlist_for_each_safe(node, tmp, &flush->statics[i])
+			wkfree(struct static_node,
+					hlist_entry(node, struct static_node, hook));
+
+	bib_put(flush->db);
+	wkfree(struct table_flush, flush);
 }
 
-int bib_foreach(struct bib *db, l4_protocol proto,
-		struct bib_foreach_func *func,
-		const struct ipv4_transport_addr *offset)
+/**
+ * Empties @table. The entries are detached all at once (so the lock is held
+ * for a constant-ish time, regardless of the table's size) and freed later,
+ * in the background, in FLUSH_BATCH-sized chunks.
+ */
+static void flush_table(struct bib_table *table)
 {
-	struct bib_table *table;
-	struct rb_node *node;
-	struct tabled_bib *tabled;
-	struct bib_entry bib;
-	int error = 0;
+	struct table_flush *flush;
+	struct hlist_head *hash = NULL;
+
+	flush = wkmalloc(struct table_flush, GFP_KERNEL);
+	if (!flush)
+		goto slow;
+	if (table->hash6) {
+		hash = alloc_table_hash(table, table->hash_mask + 1);
+		if (!hash) {
+			wkfree(struct table_flush, flush);
+			goto slow;
+		}
+	}
 
-	table = get_table(db, proto);
-	if (!table)
-		return -EINVAL;
+	INIT_WORK(&flush->work, flush_work_fn);
+	flush->freed = 0;
 
-	spin_lock_bh(&table->lock);
+	lock_table(table);
+	detach_table(table, flush, hash);
+	unlock_table(table);
 
-	node = find_starting_point(table, offset, false);
-	for (; node && !error; node = rb_next(node)) {
-		tabled = bib4_entry(node);
-		tbtobe(tabled, &bib);
-		error = func->cb(&bib, tabled->is_static, func->arg);
-	}
+	offload_flush(&table->db->offload);
+	bib_get(table->db);
+	flush->db = table->db;
+	queue_work(rm_range_wq, &flush->work);
+	return;
 
-	spin_unlock_bh(&table->lock);
-	return error;
+slow:
+	flush_table_slow(table);
 }
 
-static struct rb_node *slot_next(struct tree_slot *slot)
+void bib_flush(struct bib *db)
 {
-	if (!slot->parent)
-		return NULL;
-	if (&slot->parent->rb_left == slot->rb_link)
-		return slot->parent;
-	/* else if (slot->parent->rb_right == &slot->rb_link) */
-	return rb_next(slot->parent);
+	unsigned int i;
+
+	for (i = 0; i < db->shard_count; i++) {
+		flush_table(&db->tcp[i]);
+		flush_table(&db->udp[i]);
+		flush_table(&db->icmp[i]);
+	}
 }
 
-static void next_bib(struct rb_node *next, struct bib_session_tuple *pos)
+/**
+ * Starts pulling into the cache the session index bucket the 6-to-4 lookup of
+ * the @src6 -> @dst6 flow will read, so the lookup doesn't stall on it.
+ *
+ * This is meant for batches: prefetch every packet's bucket first, then
+ * translate them, and the memory latencies overlap instead of adding up.
+ * It's only a hint; it does nothing if the index is disabled.
+ */
+void bib_prefetch6(struct bib *db, l4_protocol proto,
+		const struct ipv6_transport_addr *src6,
+		const struct ipv6_transport_addr *dst6)
 {
-	pos->bib = bib4_entry(next);
+	struct bib_table *table = get_table6(db, proto, src6);
+	if (table && table->hash6)
+		prefetch(bucket6(table, src6, dst6));
 }
 
-static void next_session(struct rb_node *next, struct bib_session_tuple *pos)
+/**
+ * 4-to-6 version of bib_prefetch6(). @src4 is the remote node, @dst4 is the
+ * mask.
+ */
+void bib_prefetch4(struct bib *db, l4_protocol proto,
+		const struct ipv4_transport_addr *src4,
+		const struct ipv4_transport_addr *dst4)
 {
-	pos->session = node2session(next);
-	if (!pos->session) {
-		/* Tree was empty or the previous was the last session. */
-		/* Cascade "next" to the supertree. */
-		next_bib(rb_next(&pos->bib->hook4), pos);
-	}
+	struct bib_table *table = get_table4(db, proto, dst4);
+	if (table && table->hash4)
+		prefetch(bucket4(table, dst4, src4));
 }
 
 /**
- * Finds the BIB entry and/or session where a foreach of the sessions should
- * start with, based on @offset.
- *
- * If a session that matches @offset is found, will initialize both @pos->bib
- * and @pos->session to point to this session.
- * If @pos->bib is defined but @pos->session is not, the foreach should start
- * from @pos->bib's first session.
- * If neither @pos->bib nor @pos->session are defined, iteration ended.
- * (offset lies after the last session.)
- *
- * If @offset is not found, it always tries to return the session that would
- * follow one that would match perfectly. This is because sessions expiring
- * during ongoing fragmented foreaches are not considered a problem.
+ * Replaces @db's policy program with @fd's. (See policy.h.) A negative @fd
+ * removes the program.
  */
-static void find_session_offset(struct bib_table *table,
-		struct session_foreach_offset *offset,
-		struct bib_session_tuple *pos)
+int bib_policy_attach(struct bib *db, int fd)
 {
-	struct tabled_bib tmp_bib;
-	struct tabled_session tmp_session;
-	struct tree_slot slot;
+	int error;
 
-	memset(pos, 0, sizeof(*pos));
+	error = policy_attach(&db->policy, fd);
+	if (error)
+		return error;
 
-	tmp_bib.src4 = offset->offset.src;
-	pos->bib = find_bibtree4_slot(table, &tmp_bib, &slot);
-	if (!pos->bib) {
-		next_bib(slot_next(&slot), pos);
-		return;
-	}
+	/* The cached flows were allowed by the old program. */
+	offload_flush(&db->offload);
+	return 0;
+}
 
-	tmp_session.dst4 = offset->offset.dst;
-	pos->session = find_session_slot(pos->bib, &tmp_session, NULL, &slot);
-	if (!pos->session) {
-		next_session(slot_next(&slot), pos);
+/**
+ * Returns -EPERM if @db's policy program does not want @pkt to be translated.
+ * Might change @pkt's mark.
+ */
+int bib_policy_apply(struct bib *db, struct packet *pkt)
+{
+	return policy_apply(&db->policy, pkt);
+}
+
+/**
+ * Offload cache lookup. (See offload.h.) If @in's flow is not cached, run the
+ * slow path and then hand @generation over to bib_offload_add().
+ */
+bool bib_offload_find(struct bib *db, struct packet *in, struct tuple *out,
+		struct csum_delta *delta, int *generation)
+{
+	return offload_find(&db->offload, in, out, delta, generation);
+}
+
+/**
+ * Caches @in's outgoing tuple (@out), if @entries (the result of the slow
+ * path) says the session is not going to change state anytime soon.
+ */
+void bib_offload_add(struct bib *db, struct packet *in,
+		struct bib_session *entries, struct tuple *out, int generation)
+{
+	if (!entries->session_set)
+		return;
+	/* The counters are only reachable from the slow path. */
+	if (entries->session.counted)
+		return;
+
+	switch (entries->session.proto) {
+	case L4PROTO_UDP:
+		break;
+	case L4PROTO_TCP:
+		if (entries->session.state != ESTABLISHED)
+			return;
+		break;
+	default:
 		return;
 	}
 
-	if (!offset->include_offset)
-		next_session(rb_next(&pos->session->tree_hook), pos);
+	offload_add(&db->offload, in, out, generation);
 }
 
-#define foreach_bib(table, node) \
-		for (node = bib4_entry(rb_first(&(table)->tree4)); \
-				node; \
-				node = bib4_entry(rb_next(&node->hook4)))
-#define foreach_session(tree, node) \
-		for (node = node2session(rb_first(tree)); \
-				node; \
-				node = node2session(rb_next(&node->tree_hook)))
+/**
+ * Invalidates the offload cache. For configuration changes that might change
+ * the outgoing tuples of existing sessions.
+ */
+void bib_offload_flush(struct bib *db)
+{
+	offload_flush(&db->offload);
+}
 
-int bib_foreach_session(struct bib *db, l4_protocol proto,
-		struct session_foreach_func *func,
-		struct session_foreach_offset *offset)
+/**
+ * The counts are read without the table locks, so polling them doesn't get
+ * in the packet path's way. Each shard's count is exact, but the sum is
+ * only a snapshot if the shards are changing.
+ */
+int bib_count(struct bib *db, l4_protocol proto, __u64 *count)
 {
+	struct bib_table *tables;
 	struct bib_table *table;
-	struct bib_session_tuple pos;
-	struct session_entry tmp;
-	int error = 0;
 
-	table = get_table(db, proto);
-	if (!table)
+	tables = get_tables(db, proto);
+	if (!tables)
 		return -EINVAL;
 
-	spin_lock_bh(&table->lock);
+	*count = 0;
+	foreach_shard(db, tables, table)
+		*count += READ_ONCE(table->bib_count);
+	return 0;
+}
 
-	if (offset) {
-		find_session_offset(table, offset, &pos);
-		/* if pos.session != NULL, then pos.bib != NULL. */
-		if (pos.session)
-			goto goto_session;
-		if (pos.bib)
-			goto goto_bib;
-		goto end;
-	}
+int bib_count_sessions(struct bib *db, l4_protocol proto, __u64 *count)
+{
+	struct bib_table *tables;
+	struct bib_table *table;
 
-	foreach_bib(table, pos.bib) {
-goto_bib:	foreach_session(&pos.bib->sessions, pos.session) {
-goto_session:		tstose(pos.session, &tmp);
-			error = func->cb(&tmp, func->arg);
-			if (error)
-				goto end;
-		}
-	}
+	tables = get_tables(db, proto);
+	if (!tables)
+		return -EINVAL;
 
-end:
-	spin_unlock_bh(&table->lock);
-	return error;
+	*count = 0;
+	foreach_shard(db, tables, table)
+		*count += READ_ONCE(table->session_count);
+	return 0;
 }
 
-#undef foreach_session
-#undef foreach_bib
-
-int bib_find6(struct bib *db, l4_protocol proto,
-		struct ipv6_transport_addr *addr,
-		struct bib_entry *result)
+/**
+ * Returns the number of @proto sessions that have been evicted early so far,
+ * to honor the session limit.
+ */
+int bib_count_evicted(struct bib *db, l4_protocol proto, __u64 *count)
 {
+	struct bib_table *tables;
 	struct bib_table *table;
-	struct tabled_bib *bib;
 
-	table = get_table(db, proto);
-	if (!table)
+	tables = get_tables(db, proto);
+	if (!tables)
 		return -EINVAL;
 
-	spin_lock_bh(&table->lock);
-	bib = find_bib6(table, addr);
-	if (bib)
-		tbtobe(bib, result);
-	spin_unlock_bh(&table->lock);
-
-	return bib ? 0 : -ESRCH;
+	*count = 0;
+	foreach_shard(db, tables, table)
+		*count += READ_ONCE(table->evicted);
+	return 0;
 }
 
-int bib_find4(struct bib *db, l4_protocol proto,
-		struct ipv4_transport_addr *addr,
-		struct bib_entry *result)
+/**
+ * Returns (in @stats) how the @proto mask searches have been going so far.
+ */
+int bib_mask_stats(struct bib *db, l4_protocol proto,
+		struct pool4_stats_usr *stats)
 {
+	struct bib_table *tables;
 	struct bib_table *table;
-	struct tabled_bib *bib;
+	unsigned int i;
 
-	table = get_table(db, proto);
-	if (!table)
+	tables = get_tables(db, proto);
+	if (!tables)
 		return -EINVAL;
 
-	spin_lock_bh(&table->lock);
-	bib = find_bib4(table, addr);
-	if (bib)
-		tbtobe(bib, result);
-	spin_unlock_bh(&table->lock);
-
-	return bib ? 0 : -ESRCH;
+	memset(stats, 0, sizeof(*stats));
+	foreach_shard(db, tables, table) {
+		table_lock(table);
+		stats->allocations += table->mask_stats.allocations;
+		stats->exhaustions += table->mask_stats.exhaustions;
+		stats->limited += table->mask_stats.limited;
+		stats->iterations += table->mask_stats.iterations;
+		for (i = 0; i < POOL4_HISTOGRAM_BUCKETS; i++)
+			stats->histogram[i] += table->mask_stats.histogram[i];
+		table_unlock(table);
+	}
+	return 0;
 }
 
-static void bib2tabled(struct bib_entry *bib, struct tabled_bib *tabled)
+/**
+ * Number of black nodes between @root and its leftmost leaf. Red-black trees
+ * have the same number of black nodes in all of their root-to-leaf paths, so
+ * this bounds the tree's depth without having to visit it all.
+ */
+static __u32 black_height(struct rb_root *root)
 {
-	tabled->src6 = bib->ipv6;
-	tabled->src4 = bib->ipv4;
-	tabled->proto = bib->l4_proto;
-	tabled->is_static = true;
-	tabled->sessions = RB_ROOT;
+	struct rb_node *node;
+	__u32 result = 0;
+
+	for (node = root->rb_node; node; node = node->rb_left)
+		if (rb_is_black(node))
+			result++;
+
+	return result;
 }
 
-int bib_add_static(struct bib *db, struct bib_entry *new,
-		struct bib_entry *old)
+/**
+ * Reports the shape of @proto's tables and their lock statistics (see
+ * table_lock()) in @stats.
+ */
+int bib_stats(struct bib *db, l4_protocol proto, struct bib_stats_usr *stats)
 {
+	struct bib_table *tables;
 	struct bib_table *table;
-	struct tabled_bib *bib;
-	struct tabled_bib *collision;
-	struct tree_slot slot6;
-	struct tree_slot slot4;
 
-	table = get_table(db, new->l4_proto);
-	if (!table)
+	tables = get_tables(db, proto);
+	if (!tables)
 		return -EINVAL;
 
-	bib = alloc_bib(GFP_ATOMIC);
-	if (!bib)
-		return -ENOMEM;
-	bib2tabled(new, bib);
-
-	spin_lock_bh(&table->lock);
-
-	collision = find_bibtree6_slot(table, bib, &slot6);
-	if (collision) {
-		if (taddr4_equals(&bib->src4, &collision->src4))
-			goto upgrade;
-		goto eexist;
+	memset(stats, 0, sizeof(*stats));
+	foreach_shard(db, tables, table) {
+		table_lock(table);
+		stats->bib_count += table->bib_count;
+		stats->session_count += table->session_count;
+		stats->est_sessions += table->est_timer.count;
+		stats->trans_sessions += table->trans_timer.count
+				+ table->closed_timer.count;
+		stats->syn4_sessions += table->syn4_timer.count;
+		stats->tree6_black_height = max(stats->tree6_black_height,
+				black_height(&table->tree6));
+		stats->tree4_black_height = max(stats->tree4_black_height,
+				black_height(&table->tree4));
+		stats->lock_samples += table->lock_stats.samples;
+		stats->lock_wait += table->lock_stats.wait;
+		stats->lock_wait_max = max(stats->lock_wait_max,
+				table->lock_stats.wait_max);
+		stats->lock_hold += table->lock_stats.hold;
+		stats->lock_hold_max = max(stats->lock_hold_max,
+				table->lock_stats.hold_max);
+		table_unlock(table);
 	}
-
-	collision = find_bibtree4_slot(table, bib, &slot4);
-	if (collision)
-		goto eexist;
-
-	treeslot_commit(&slot6);
-	treeslot_commit(&slot4);
-	table->bib_count++;
-
-	/*
-	 * Since the BIB entry is now available, and assuming ADF is disabled,
-	 * it would make sense to translate the relevant type 1 stored packets.
-	 * That's bound to be a lot of messy code though, and the v4 client is
-	 * going to retry anyway, so let's just forget the packets instead.
-	 */
-	if (new->l4_proto == L4PROTO_TCP)
-		pktqueue_rm(db->tcp.pkt_queue, &new->ipv4);
-
-	spin_unlock_bh(&table->lock);
-	return 0;
-
-upgrade:
-	collision->is_static = true;
-	spin_unlock_bh(&table->lock);
-	free_bib(bib);
 	return 0;
-
-eexist:
-	tbtobe(collision, old);
-	spin_unlock_bh(&table->lock);
-	free_bib(bib);
-	return -EEXIST;
 }
 
-int bib_rm(struct bib *db, struct bib_entry *entry)
+/**
+ * Returns (in @count) the number of @addr's @proto ports that are currently
+ * taken by BIB entries or reserved by port blocks.
+ */
+int bib_count_ports(struct bib *db, l4_protocol proto, struct in_addr *addr,
+		__u32 *count)
 {
+	struct bib_table *tables;
 	struct bib_table *table;
-	struct tabled_bib key;
-	struct tabled_bib *bib;
-	int error = -ESRCH;
+	struct port_bitmap *bitmap;
 
-	table = get_table(db, entry->l4_proto);
-	if (!table)
+	tables = get_tables(db, proto);
+	if (!tables)
 		return -EINVAL;
 
-	bib2tabled(entry, &key);
-
-	spin_lock_bh(&table->lock);
-
-	bib = find_bib6(table, &key.src6);
-	if (bib && taddr4_equals(&key.src4, &bib->src4)) {
-		detach_bib(table, bib);
-		error = 0;
+	*count = 0;
+	foreach_shard(db, tables, table) {
+		table_lock(table);
+		bitmap = find_port_bitmap(table, addr);
+		if (bitmap)
+			*count += bitmap->used;
+		table_unlock(table);
 	}
+	return 0;
+}
 
-	spin_unlock_bh(&table->lock);
+/**
+ * Where one shard stands while bib_top() merges the shards' trees.
+ */
+struct top_cursor {
+	/** Key (masked address) of the shard's current group... */
+	struct in6_addr key;
+	/** ...and its counters. */
+	__u64 bibs;
+	__u64 sessions;
+	/** The next group starts at the first entry at or after this. */
+	struct in6_addr addr;
+	__u16 port;
+	/** No groups left? */
+	bool done;
+	/** No entries left after the current group? */
+	bool exhausted;
+};
 
-	if (!error)
-		release_bib_entry(&bib->hook4, NULL);
+/**
+ * Entries bib_top() visits per lock acquisition, so a large group doesn't
+ * starve the packets.
+ */
+#define TOP_CHUNK 256
 
-	return error;
+/*
+ * bib_top() handles both trees the same way; the IPv4 addresses are treated
+ * as the first 32 bits of IPv6 ones. (They sort the same way.)
+ */
+static struct rb_node *top_root(struct bib_table *table,
+		struct bib_top_query *query)
+{
+	return (query->by == BIB_TOP_SRC4)
+			? table->tree4.rb_node
+			: table->tree6.rb_node;
 }
 
-void bib_rm_range(struct bib *db, l4_protocol proto, struct ipv4_range *range)
+static void top_position(struct rb_node *node, struct bib_top_query *query,
+		struct in6_addr *addr, __u16 *port)
 {
-	struct bib_table *table;
-	struct ipv4_transport_addr offset;
-	struct rb_node *node;
-	struct rb_node *next;
 	struct tabled_bib *bib;
-	struct bib_delete_list delete_list = { NULL };
 
-	table = get_table(db, proto);
-	if (!table)
-		return;
-
-	offset.l3 = range->prefix.address;
-	offset.l4 = range->ports.min;
+	if (query->by == BIB_TOP_SRC4) {
+		bib = bib4_entry(node);
+		memset(addr, 0, sizeof(*addr));
+		addr->s6_addr32[0] = bib->src4.l3.s_addr;
+		*port = bib->src4.l4;
+	} else {
+		bib = bib6_entry(node);
+		*addr = bib->src6.l3;
+		*port = bib->src6.l4;
+	}
+}
 
-	spin_lock_bh(&table->lock);
+/**
+ * Returns the first entry of @table whose address and port are not smaller
+ * than @addr and @port.
+ */
+static struct rb_node *top_lower_bound(struct bib_table *table,
+		struct bib_top_query *query, struct in6_addr *addr, __u16 port)
+{
+	struct rb_node *node;
+	struct rb_node *result = NULL;
+	struct in6_addr node_addr;
+	__u16 node_port;
+	int gap;
 
-	node = find_starting_point(table, &offset, true);
-	for (; node; node = next) {
-		next = rb_next(node);
-		bib = bib4_entry(node);
+	node = top_root(table, query);
+	while (node) {
+		top_position(node, query, &node_addr, &node_port);
+		gap = ipv6_addr_cmp(&node_addr, addr);
+		if (!gap)
+			gap = ((int)node_port) - ((int)port);
 
-		if (!prefix4_contains(&range->prefix, &bib->src4.l3))
-			break;
-		if (port_range_contains(&range->ports, bib->src4.l4)) {
-			detach_bib(table, bib);
-			add_to_delete_list(&delete_list, node);
+		if (gap >= 0) {
+			result = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
 		}
 	}
 
-	spin_unlock_bh(&table->lock);
+	return result;
+}
 
-	commit_delete_list(&delete_list);
+static struct tabled_bib *top_entry(struct rb_node *node,
+		struct bib_top_query *query)
+{
+	return (query->by == BIB_TOP_SRC4) ? bib4_entry(node) : bib6_entry(node);
 }
 
-static void flush_table(struct bib_table *table)
+/**
+ * Moves @cursor to @table's next group. The trees are sorted by address, so
+ * every group is a contiguous run of entries.
+ *
+ * The lock is released every TOP_CHUNK entries, so the result is not an atomic
+ * snapshot; entries that are created or die meanwhile might or might not be
+ * counted.
+ */
+static void top_next_group(struct bib_table *table,
+		struct bib_top_query *query, struct top_cursor *cursor)
 {
 	struct rb_node *node;
-	struct rb_node *next;
-	struct bib_delete_list delete_list = { NULL };
+	struct in6_addr addr;
+	struct in6_addr key;
+	__u16 port;
+	unsigned int visited;
+	int sessions;
+	bool started = false;
+
+	if (cursor->exhausted) {
+		cursor->done = true;
+		return;
+	}
 
-	spin_lock_bh(&table->lock);
+	cursor->bibs = 0;
+	cursor->sessions = 0;
 
-	for (node = rb_first(&table->tree4); node; node = next) {
-		next = rb_next(node);
-		detach_bib(table, bib4_entry(node));
-		add_to_delete_list(&delete_list, node);
-	}
+	do {
+		visited = 0;
+		table_lock(table);
+
+		node = top_lower_bound(table, query, &cursor->addr, cursor->port);
+		for (; node && visited < TOP_CHUNK; node = rb_next(node)) {
+			top_position(node, query, &addr, &port);
+			ipv6_addr_prefix(&key, &addr, query->plen);
+			if (!started) {
+				cursor->key = key;
+				started = true;
+			} else if (!ipv6_addr_equal(&key, &cursor->key)) {
+				break;
+			}
+
+			sessions = 0;
+			rbtree_foreach(&top_entry(node, query)->sessions,
+					count_subscriber_sessions, &sessions);
+			cursor->bibs++;
+			cursor->sessions += sessions;
+			visited++;
+		}
 
-	spin_unlock_bh(&table->lock);
+		if (node)
+			top_position(node, query, &cursor->addr, &cursor->port);
+		else
+			cursor->exhausted = true;
 
-	commit_delete_list(&delete_list);
+		table_unlock(table);
+		cond_resched();
+	} while (node && visited == TOP_CHUNK);
+
+	if (!started)
+		cursor->done = true;
 }
 
-void bib_flush(struct bib *db)
+static __u64 top_weight(struct bib_top_usr *group, struct bib_top_query *query)
 {
-	flush_table(&db->tcp);
-	flush_table(&db->udp);
-	flush_table(&db->icmp);
+	return query->sessions ? group->sessions : group->bibs;
 }
 
-int bib_count(struct bib *db, l4_protocol proto, __u64 *count)
+/**
+ * Adds @group to @top (which is sorted, heaviest first, and holds @count of
+ * the query's maximum groups) if it is heavy enough.
+ */
+static void top_insert(struct bib_top_usr *top, unsigned int *count,
+		struct bib_top_query *query, struct bib_top_usr *group)
 {
-	struct bib_table *table;
+	__u64 weight = top_weight(group, query);
+	unsigned int i;
 
-	table = get_table(db, proto);
-	if (!table)
-		return -EINVAL;
+	if (*count < query->count) {
+		i = (*count)++;
+	} else {
+		if (weight <= top_weight(&top[query->count - 1], query))
+			return;
+		i = query->count - 1;
+	}
 
-	spin_lock_bh(&table->lock);
-	*count = table->bib_count;
-	spin_unlock_bh(&table->lock);
-	return 0;
+	for (; i > 0 && top_weight(&top[i - 1], query) < weight; i--)
+		top[i] = top[i - 1];
+	top[i] = *group;
 }
 
-int bib_count_sessions(struct bib *db, l4_protocol proto, __u64 *count)
+/**
+ * Finds the (up to) @query->count groups of @proto BIB entries that have the
+ * most entries or sessions, and writes them in @top, heaviest first. @count
+ * is set to the number of groups written.
+ *
+ * A group can be spread over every shard, so the shards' trees are merged
+ * (like in a merge sort) as they are walked; each lock is only held while its
+ * shard's current group is being counted.
+ */
+int bib_top(struct bib *db, l4_protocol proto, struct bib_top_query *query,
+		struct bib_top_usr *top, unsigned int *count)
 {
-	struct bib_table *table;
+	struct bib_table *tables;
+	struct top_cursor *cursors;
+	struct bib_top_usr group;
+	struct in6_addr key;
+	unsigned int i;
+	bool found;
+
+	tables = get_tables(db, proto);
+	if (!tables)
+		return -EINVAL;
 
-	table = get_table(db, proto);
-	if (!table)
+	if (query->count < 1 || query->count > BIB_TOP_MAX) {
+		log_err("The group count must range between 1 and %u.",
+				BIB_TOP_MAX);
+		return -EINVAL;
+	}
+	switch (query->by) {
+	case BIB_TOP_SRC6:
+		if (query->plen > 128) {
+			log_err("IPv6 prefix lengths cannot exceed 128.");
+			return -EINVAL;
+		}
+		break;
+	case BIB_TOP_SRC4:
+		if (query->plen > 32) {
+			log_err("IPv4 prefix lengths cannot exceed 32.");
+			return -EINVAL;
+		}
+		break;
+	default:
+		log_err("Unknown grouping: %u", query->by);
 		return -EINVAL;
+	}
 
-	spin_lock_bh(&table->lock);
-	*count = table->session_count;
-	spin_unlock_bh(&table->lock);
+	cursors = __wkmalloc("top cursors", db->shard_count * sizeof(*cursors),
+			GFP_KERNEL);
+	if (!cursors)
+		return -ENOMEM;
+	memset(cursors, 0, db->shard_count * sizeof(*cursors));
+
+	for (i = 0; i < db->shard_count; i++)
+		top_next_group(&tables[i], query, &cursors[i]);
+
+	*count = 0;
+	while (true) {
+		found = false;
+		for (i = 0; i < db->shard_count; i++) {
+			if (cursors[i].done)
+				continue;
+			if (!found || ipv6_addr_cmp(&cursors[i].key, &key) < 0)
+				key = cursors[i].key;
+			found = true;
+		}
+		if (!found)
+			break;
+
+		memset(&group, 0, sizeof(group));
+		if (query->by == BIB_TOP_SRC4)
+			group.prefix.addr4.s_addr = key.s6_addr32[0];
+		else
+			group.prefix.addr6 = key;
+
+		for (i = 0; i < db->shard_count; i++) {
+			if (cursors[i].done)
+				continue;
+			if (!ipv6_addr_equal(&cursors[i].key, &key))
+				continue;
+			group.bibs += cursors[i].bibs;
+			group.sessions += cursors[i].sessions;
+			top_next_group(&tables[i], query, &cursors[i]);
+		}
+
+		top_insert(top, count, query, &group);
+	}
+
+	__wkfree("top cursors", cursors);
 	return 0;
 }
 
+/**
+ * Writes the change log records that follow @since on @buffer. (See
+ * bibev_log_fetch().)
+ */
+int bib_follow(struct bib *db, __u64 since, struct nlcore_buffer *buffer)
+{
+	return bibev_log_fetch(&db->events, since, buffer);
+}
+
 static void print_tabs(int tabs)
 {
 	int i;
@@ -2470,10 +8002,14 @@ static void print_bib(struct rb_node *node, int tabs)
 
 void bib_print(struct bib *db)
 {
-	log_debug("TCP:");
-	print_bib(db->tcp.tree4.rb_node, 1);
-	log_debug("UDP:");
-	print_bib(db->udp.tree4.rb_node, 1);
-	log_debug("ICMP:");
-	print_bib(db->icmp.tree4.rb_node, 1);
+	unsigned int i;
+
+	for (i = 0; i < db->shard_count; i++) {
+		log_debug("TCP (shard %u):", i);
+		print_bib(db->tcp[i].tree4.rb_node, 1);
+		log_debug("UDP (shard %u):", i);
+		print_bib(db->udp[i].tree4.rb_node, 1);
+		log_debug("ICMP (shard %u):", i);
+		print_bib(db->icmp[i].tree4.rb_node, 1);
+	}
 }
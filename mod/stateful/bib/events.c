@@ -0,0 +1,205 @@
+#include "nat64/mod/stateful/bib/events.h"
+
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include "nat64/mod/common/types.h"
+#include "nat64/mod/common/nl/nl_core2.h"
+
+static unsigned int change_log_size;
+module_param(change_log_size, uint, 0);
+MODULE_PARM_DESC(change_log_size, "Number of BIB and session changes each instance remembers for `jool --session --follow`. Zero disables the change log. (Only read during instance creation.)");
+
+struct bibev_cpu {
+	/*
+	 * Only contended when bibev_flush() visits this CPU, but the BIB runs
+	 * during both softirqs and process context.
+	 */
+	spinlock_t lock;
+	/** The records this CPU is accumulating. Not started if skb is NULL. */
+	struct nlcore_mcast msg;
+};
+
+/** Payload room for records in each message. (Whole records only.) */
+static size_t bibev_capacity(void)
+{
+	size_t max = nlbuffer_response_max_size();
+	return max - (max % sizeof(struct bib_event_usr));
+}
+
+int bibev_init(struct bib_events *events, struct net *ns)
+{
+	struct bibev_cpu *cpu;
+	int i;
+
+	events->cpus = alloc_percpu(struct bibev_cpu);
+	if (!events->cpus)
+		return -ENOMEM;
+
+	for_each_possible_cpu(i) {
+		cpu = per_cpu_ptr(events->cpus, i);
+		spin_lock_init(&cpu->lock);
+		cpu->msg.skb = NULL;
+	}
+
+	spin_lock_init(&events->log.lock);
+	events->log.next = 1;
+	events->log.head = 0;
+	events->log.size = change_log_size;
+	events->log.records = NULL;
+	if (change_log_size) {
+		events->log.records = vmalloc(change_log_size
+				* sizeof(*events->log.records));
+		if (!events->log.records) {
+			free_percpu(events->cpus);
+			return -ENOMEM;
+		}
+	}
+
+	events->ns = ns;
+	get_net(ns);
+	return 0;
+}
+
+/**
+ * Sends whatever @events has accumulated, and releases it.
+ * Please note that this can happen in atomic context.
+ */
+void bibev_destroy(struct bib_events *events)
+{
+	bibev_flush(events);
+	free_percpu(events->cpus);
+	vfree(events->log.records);
+	put_net(events->ns);
+}
+
+static void send_cpu(struct bib_events *events, struct bibev_cpu *cpu)
+{
+	/* Errors mean nobody was listening; the records are gone either way. */
+	nlcore_mcast_send_group(events->ns, &cpu->msg, NLCORE_GROUP_EVENTS);
+}
+
+/**
+ * Appends @event to the current CPU's batch, and stamps it.
+ * @event is copied, so it can live in the stack.
+ */
+void bibev_send(struct bib_events *events, struct bib_event_usr *event)
+{
+	struct bibev_cpu *cpu;
+	struct request_hdr hdr;
+	void *slot;
+
+	event->timestamp = ktime_to_ns(ktime_get_real());
+
+	/* Migrating after this is fine; we'd just be borrowing a buffer. */
+	cpu = raw_cpu_ptr(events->cpus);
+	spin_lock_bh(&cpu->lock);
+
+	if (!cpu->msg.skb) {
+		init_request_hdr(&hdr, MODE_EVENTS, OP_ADD);
+		if (nlcore_mcast_init(&cpu->msg, &hdr, bibev_capacity()))
+			goto end;
+	}
+
+	slot = nlcore_mcast_reserve(&cpu->msg, sizeof(*event));
+	if (WARN(!slot, "Event message has no room left."))
+		goto end;
+	memcpy(slot, event, sizeof(*event));
+
+	if (cpu->msg.room < sizeof(*event))
+		send_cpu(events, cpu);
+	/* Fall through. */
+
+end:
+	spin_unlock_bh(&cpu->lock);
+}
+
+/**
+ * Sends the batches that haven't filled up yet. Meant to be called
+ * periodically, so records are not held back forever during quiet times.
+ */
+void bibev_flush(struct bib_events *events)
+{
+	struct bibev_cpu *cpu;
+	int i;
+
+	for_each_possible_cpu(i) {
+		cpu = per_cpu_ptr(events->cpus, i);
+		spin_lock_bh(&cpu->lock);
+		if (cpu->msg.skb)
+			send_cpu(events, cpu);
+		spin_unlock_bh(&cpu->lock);
+	}
+}
+
+/**
+ * Appends @change to the change log, and numbers it.
+ * @change is copied, so it can live in the stack.
+ */
+void bibev_log(struct bib_events *events, struct bib_change_usr *change)
+{
+	struct bibev_log *log = &events->log;
+
+	if (!log->size)
+		return;
+
+	spin_lock_bh(&log->lock);
+	change->seq = log->next++;
+	log->records[log->head] = *change;
+	log->head = (log->head + 1 == log->size) ? 0 : (log->head + 1);
+	spin_unlock_bh(&log->lock);
+}
+
+/**
+ * Writes a struct bib_changes_hdr on @buffer, followed by as many of the
+ * records that come after @since as fit.
+ * Returns 1 if some of them didn't fit, 0 if they all did, and a negative
+ * error code otherwise.
+ */
+int bibev_log_fetch(struct bib_events *events, __u64 since,
+		struct nlcore_buffer *buffer)
+{
+	struct bibev_log *log = &events->log;
+	struct bib_changes_hdr hdr;
+	__u64 seq;
+	unsigned int slot;
+	int result = 0;
+
+	if (!log->size) {
+		log_err("The change log is disabled. (See the change_log_size module parameter.)");
+		return -EINVAL;
+	}
+
+	spin_lock_bh(&log->lock);
+
+	hdr.next = log->next;
+	hdr.first = (log->next > log->size) ? (log->next - log->size) : 1;
+	if (nlbuffer_write(buffer, &hdr, sizeof(hdr))) {
+		result = -ENOSPC;
+		goto end;
+	}
+
+	if (since >= hdr.next - 1)
+		goto end; /* Up to date. */
+
+	seq = max(since + 1, hdr.first);
+	/* hdr.next - seq <= log->size, so this doesn't underflow. */
+	slot = log->head + log->size - (unsigned int)(hdr.next - seq);
+	if (slot >= log->size)
+		slot -= log->size;
+
+	for (; seq < hdr.next; seq++) {
+		if (nlbuffer_write(buffer, &log->records[slot],
+				sizeof(log->records[slot]))) {
+			result = 1;
+			break;
+		}
+		slot = (slot + 1 == log->size) ? 0 : (slot + 1);
+	}
+	/* Fall through. */
+
+end:
+	spin_unlock_bh(&log->lock);
+	return result;
+}
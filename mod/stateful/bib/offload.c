@@ -0,0 +1,262 @@
+#include "nat64/mod/stateful/bib/offload.h"
+
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <net/ip6_checksum.h>
+#include "nat64/mod/common/types.h"
+
+static unsigned int offload_bits;
+module_param(offload_bits, uint, 0);
+MODULE_PARM_DESC(offload_bits, "log2 of the number of flows each CPU's offload cache can hold. Zero disables the cache. (Only read during instance creation.)");
+
+static unsigned int offload_lifetime = 1000;
+module_param(offload_lifetime, uint, 0644);
+MODULE_PARM_DESC(offload_lifetime, "Milliseconds an offloaded flow skips the session table before one of its packets takes the slow path (and refreshes the session) again.");
+
+/** Word aligned and zero padded, so it can be hashed and compared whole. */
+struct offload_key {
+	__u32 src[4];
+	__u32 dst[4];
+	/** Source port on the upper half, destination port on the lower. */
+	__u32 ports;
+	__u32 ifindex;
+	/** l3_proto on the upper half, l4_proto on the lower. */
+	__u32 protos;
+};
+
+struct offload_slot {
+	struct offload_key key;
+	/** What compute_out_tuple() came up with for the flow. */
+	struct tuple out;
+	struct csum_delta delta;
+	/** jiffies at which the slot stops being usable. */
+	unsigned long expires;
+	int generation;
+	bool used;
+};
+
+int offload_init(struct bib_offload *offload)
+{
+	unsigned int bits = offload_bits;
+
+	offload->slots = NULL;
+	atomic_set(&offload->generation, 0);
+	get_random_bytes(&offload->seed, sizeof(offload->seed));
+
+	if (!bits)
+		return 0;
+	if (bits > 20) {
+		log_warn_once("offload_bits %u is too big; using 20.", bits);
+		bits = 20;
+	}
+
+	offload->slots = __alloc_percpu(sizeof(struct offload_slot) << bits,
+			__alignof__(struct offload_slot));
+	if (!offload->slots)
+		return -ENOMEM;
+	offload->bits = bits;
+	return 0;
+}
+
+void offload_destroy(struct bib_offload *offload)
+{
+	if (offload->slots)
+		free_percpu(offload->slots);
+}
+
+/**
+ * Returns true if @in is the kind of packet the cache can take care of.
+ * ICMP, fragments and TCP packets that might change the state of their
+ * session always take the slow path.
+ */
+static bool is_offloadable(struct packet *in)
+{
+	struct tcphdr *hdr;
+
+	if (pkt_is_inner(in) || in->is_hairpin)
+		return false;
+
+	switch (pkt_l3_proto(in)) {
+	case L3PROTO_IPV6:
+		if (pkt_frag_hdr(in))
+			return false;
+		break;
+	case L3PROTO_IPV4:
+		if (is_fragmented_ipv4(pkt_ip4_hdr(in)))
+			return false;
+		break;
+	}
+
+	switch (pkt_l4_proto(in)) {
+	case L4PROTO_UDP:
+		return true;
+	case L4PROTO_TCP:
+		hdr = pkt_tcp_hdr(in);
+		return !hdr->syn && !hdr->fin && !hdr->rst;
+	default:
+		return false;
+	}
+}
+
+static void build_key(struct packet *in, struct offload_key *key)
+{
+	struct tuple *tuple = &in->tuple;
+
+	memset(key, 0, sizeof(*key));
+
+	switch (tuple->l3_proto) {
+	case L3PROTO_IPV6:
+		memcpy(key->src, &tuple->src.addr6.l3, sizeof(key->src));
+		memcpy(key->dst, &tuple->dst.addr6.l3, sizeof(key->dst));
+		key->ports = (tuple->src.addr6.l4 << 16) | tuple->dst.addr6.l4;
+		break;
+	case L3PROTO_IPV4:
+		key->src[0] = tuple->src.addr4.l3.s_addr;
+		key->dst[0] = tuple->dst.addr4.l3.s_addr;
+		key->ports = (tuple->src.addr4.l4 << 16) | tuple->dst.addr4.l4;
+		break;
+	}
+
+	key->ifindex = in->skb->dev ? in->skb->dev->ifindex : 0;
+	key->protos = (tuple->l3_proto << 16) | tuple->l4_proto;
+}
+
+/** Returns the checksum of @tuple's pseudoheader, minus length and protocol. */
+static __wsum pseudohdr_csum(struct tuple *tuple)
+{
+	switch (tuple->l3_proto) {
+	case L3PROTO_IPV6:
+		return ~csum_unfold(csum_ipv6_magic(&tuple->src.addr6.l3,
+				&tuple->dst.addr6.l3, 0, 0, 0));
+	case L3PROTO_IPV4:
+		return csum_tcpudp_nofold(tuple->src.addr4.l3.s_addr,
+				tuple->dst.addr4.l3.s_addr, 0, 0, 0);
+	}
+
+	return 0;
+}
+
+static __wsum ports_csum(struct tuple *tuple)
+{
+	__be16 ports[2];
+
+	switch (tuple->l3_proto) {
+	case L3PROTO_IPV6:
+		ports[0] = cpu_to_be16(tuple->src.addr6.l4);
+		ports[1] = cpu_to_be16(tuple->dst.addr6.l4);
+		break;
+	case L3PROTO_IPV4:
+		ports[0] = cpu_to_be16(tuple->src.addr4.l4);
+		ports[1] = cpu_to_be16(tuple->dst.addr4.l4);
+		break;
+	default:
+		return 0;
+	}
+
+	return csum_partial(ports, sizeof(ports), 0);
+}
+
+/**
+ * The same thing update_csum_6to4() and update_csum_4to6() compute for every
+ * packet. The length and protocol are left out there too, and the rest of the
+ * layer-4 header cancels itself out.
+ */
+static void compute_delta(struct tuple *in, struct tuple *out,
+		struct csum_delta *delta)
+{
+	delta->partial = csum_sub(pseudohdr_csum(out), pseudohdr_csum(in));
+	delta->full = csum_add(delta->partial,
+			csum_sub(ports_csum(out), ports_csum(in)));
+	delta->set = true;
+}
+
+/**
+ * Returns the current CPU's slot for @key. Assumes bottom halves are disabled.
+ */
+static struct offload_slot *get_slot(struct bib_offload *offload,
+		struct offload_key *key)
+{
+	u32 hash;
+
+	hash = jhash2((u32 *)key, sizeof(*key) / sizeof(u32), offload->seed);
+	return this_cpu_ptr(offload->slots) + hash_32(hash, offload->bits);
+}
+
+/**
+ * If @in's flow is cached, copies its outgoing tuple to @out, its checksum
+ * delta to @delta, and returns true.
+ *
+ * Returns false if @in has to take the slow path. In this case, @generation
+ * is the generation the slow path starts in; hand it over to offload_add(), so
+ * the result is not cached if sessions are removed in the meantime.
+ *
+ * Assumes bottom halves are disabled.
+ */
+bool offload_find(struct bib_offload *offload, struct packet *in,
+		struct tuple *out, struct csum_delta *delta, int *generation)
+{
+	struct offload_key key;
+	struct offload_slot *slot;
+	bool offloadable;
+
+	*generation = atomic_read(&offload->generation);
+	if (!offload->slots)
+		return false;
+
+	build_key(in, &key);
+	slot = get_slot(offload, &key);
+	if (!slot->used || memcmp(&slot->key, &key, sizeof(key)))
+		return false;
+
+	offloadable = is_offloadable(in);
+	if (!offloadable
+			|| slot->generation != *generation
+			|| time_after_eq(jiffies, slot->expires)) {
+		/* SYN, FIN or RST, most likely; the state machine wants it. */
+		slot->used = false;
+		return false;
+	}
+
+	*out = slot->out;
+	*delta = slot->delta;
+	return true;
+}
+
+/**
+ * Remembers that @in's flow translates into @out. The caller is responsible
+ * for only doing this for flows whose sessions are stable (UDP and established
+ * TCP). @generation is offload_find()'s.
+ *
+ * Assumes bottom halves are disabled.
+ */
+void offload_add(struct bib_offload *offload, struct packet *in,
+		struct tuple *out, int generation)
+{
+	struct offload_key key;
+	struct offload_slot *slot;
+
+	if (!offload->slots || !is_offloadable(in))
+		return;
+	if (generation != atomic_read(&offload->generation))
+		return;
+
+	build_key(in, &key);
+	slot = get_slot(offload, &key);
+	slot->key = key;
+	slot->out = *out;
+	compute_delta(&in->tuple, out, &slot->delta);
+	slot->expires = jiffies + msecs_to_jiffies(offload_lifetime);
+	slot->generation = generation;
+	slot->used = true;
+}
+
+/**
+ * Forgets every flow, on every CPU. Cheap; it only bumps the generation.
+ */
+void offload_flush(struct bib_offload *offload)
+{
+	atomic_inc(&offload->generation);
+}
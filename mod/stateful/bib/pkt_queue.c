@@ -1,46 +1,130 @@
 #include "nat64/mod/stateful/bib/pkt_queue.h"
 
+#include <linux/jhash.h>
+#include <linux/netdevice.h>
+#include <linux/random.h>
+#include <linux/tcp.h>
+#include <net/ip.h>
 #include "nat64/common/constants.h"
 #include "nat64/mod/common/config.h"
 #include "nat64/mod/common/icmp_wrapper.h"
-#include "nat64/mod/common/rbtree.h"
 #include "nat64/mod/common/wkmalloc.h"
 
+#define PKTQUEUE_HASH_BITS 8
+#define PKTQUEUE_BUCKETS (1 << PKTQUEUE_HASH_BITS)
+
 struct pktqueue {
 	/** The stored packets, sorted by expiration date. (oldest to newest) */
 	struct list_head node_list;
-	/** The same packets, sorted by IPv4 identifiers. */
-	struct rb_root node_tree;
+	/** The same packets, hashed by dst6. */
+	struct hlist_head buckets[PKTQUEUE_BUCKETS];
+	/** Random; keeps scanners from aiming at a single bucket. */
+	u32 seed;
+	/** Memory currently held by the stored packets. See node_cost(). */
+	size_t bytes;
+	/** Namespace the stateless mode's incoming devices belong to. */
+	struct net *ns;
+	/** Rate limits the ICMP errors. Belongs to the BIB. */
+	struct jool_stats *stats;
 };
 
+/**
+ * What storing @node costs, as far as the byte limit is concerned.
+ * truesize covers the skb's data and metadata; the node is added on top.
+ */
+static size_t node_cost(struct pktqueue_session *node)
+{
+	if (!node->skb)
+		return sizeof(*node) + node->digest_len;
+	return node->skb->truesize + sizeof(*node);
+}
+
+static struct hlist_head *get_bucket(struct pktqueue *queue,
+		const struct ipv6_transport_addr *addr)
+{
+	u32 hash;
+
+	hash = jhash2((const u32 *)&addr->l3, 4, queue->seed ^ addr->l4);
+	return &queue->buckets[hash >> (32 - PKTQUEUE_HASH_BITS)];
+}
+
 static unsigned long get_timeout(void)
 {
 	return msecs_to_jiffies(1000 * TCP_INCOMING_SYN);
 }
 
-static void send_icmp_error(struct pktqueue_session *node)
+/**
+ * Stateless mode: rebuilds @node's SYN out of its digest (which lacks the
+ * payload, if there was any), as if it had just arrived from @dev, and errors
+ * it.
+ */
+static void send_digest_error(struct pktqueue *queue,
+		struct pktqueue_session *node, struct net_device *dev)
 {
-	icmp64_send_skb(node->skb, ICMPERR_PORT_UNREACHABLE, 0);
-	kfree_skb(node->skb);
+	struct sk_buff *skb;
+
+	skb = alloc_skb(LL_MAX_HEADER + node->digest_len, GFP_ATOMIC);
+	if (!skb) {
+		log_debug("Could not allocate the stored packet's ICMP error.");
+		return;
+	}
+
+	skb_reserve(skb, LL_MAX_HEADER);
+	skb_reset_mac_header(skb);
+	skb_reset_network_header(skb);
+	memcpy(skb_put(skb, node->digest_len), node->digest,
+			node->digest_len);
+	skb_set_transport_header(skb, ip_hdrlen(skb));
+	skb->protocol = htons(ETH_P_IP);
+	skb->dev = dev;
+
+	icmp64_send_skb(queue->stats, skb, ICMPERR_PORT_UNREACHABLE, 0);
+	kfree_skb(skb);
+}
+
+static void send_icmp_error(struct pktqueue *queue,
+		struct pktqueue_session *node)
+{
+	struct net_device *dev;
+
+	if (node->skb) {
+		icmp64_send_skb(queue->stats, node->skb,
+				ICMPERR_PORT_UNREACHABLE, 0);
+		kfree_skb(node->skb);
+	} else {
+		dev = dev_get_by_index(queue->ns, node->ifindex);
+		if (dev) {
+			send_digest_error(queue, node, dev);
+			dev_put(dev);
+		}
+	}
+
 	wkfree(struct pktqueue_session, node);
 }
 
 static void rm(struct pktqueue *queue, struct pktqueue_session *node)
 {
 	list_del(&node->list_hook);
-	rb_erase(&node->tree_hook, &queue->node_tree);
+	hlist_del(&node->hash_hook);
+	queue->bytes -= node_cost(node);
 }
 
-struct pktqueue *pktqueue_alloc(void)
+struct pktqueue *pktqueue_alloc(struct net *ns, struct jool_stats *stats)
 {
 	struct pktqueue *result;
+	unsigned int i;
 
 	result = wkmalloc(struct pktqueue, GFP_KERNEL);
 	if (!result)
 		return NULL;
 
 	INIT_LIST_HEAD(&result->node_list);
-	result->node_tree = RB_ROOT;
+	for (i = 0; i < PKTQUEUE_BUCKETS; i++)
+		INIT_HLIST_HEAD(&result->buckets[i]);
+	get_random_bytes(&result->seed, sizeof(result->seed));
+	result->bytes = 0;
+	result->ns = ns;
+	result->stats = stats;
 
 	return result;
 }
@@ -51,47 +135,51 @@ void pktqueue_release(struct pktqueue *queue)
 	struct pktqueue_session *tmp;
 
 	list_for_each_entry_safe(node, tmp, &queue->node_list, list_hook)
-		send_icmp_error(node);
+		send_icmp_error(queue, node);
 	wkfree(struct pktqueue, queue);
 }
 
-static struct pktqueue_session *pktqueue_entry(const struct rb_node *node)
+static struct pktqueue_session *__hash_find(struct hlist_head *bucket,
+		const struct ipv6_transport_addr *addr)
 {
-	return rb_entry(node, struct pktqueue_session, tree_hook);
-}
+	struct pktqueue_session *node;
 
-static int compare_rbnode(const struct rb_node *n1, const struct rb_node *n2)
-{
-	return taddr6_compare(&pktqueue_entry(n1)->dst6,
-			&pktqueue_entry(n2)->dst6);
+	hlist_for_each_entry(node, bucket, hash_hook)
+		if (taddr6_equals(&node->dst6, addr))
+			return node;
+
+	return NULL;
 }
 
 /**
  * On success, assumes the caller's reference to @pkt's skb is being transferred
  * to @queue.
  *
+ * @max_bytes is the most memory (see node_cost()) @queue can hold once @pkt is
+ * stored. Zero means unlimited.
+ *
+ * If @stateless, only a digest of @pkt (its IPv4 and TCP headers) is kept, and
+ * the skb is released right away. The ICMP error is rebuilt from the digest if
+ * it's ever needed.
+ *
  * The typical return values are
  * 0: success; packet stored.
  * -EEXIST: SO already exists; @pkt is redundant.
- * -ENOSPC: SO is valid but we're already storing too many packets. Please fail
- * gracefully somehow.
+ * -ENOSPC: SO is valid but we're already storing too many packets (or bytes).
+ * Please fail gracefully somehow.
  */
 int pktqueue_add(struct pktqueue *queue, struct packet *pkt,
-		struct ipv6_transport_addr *dst6, bool too_many)
+		struct ipv6_transport_addr *dst6, bool too_many,
+		size_t max_bytes, bool stateless)
 {
 	struct pktqueue_session *new;
-	struct rb_node *collision;
-	struct tree_slot slot;
+	struct hlist_head *bucket;
+	struct sk_buff *skb;
+	unsigned int digest_len;
+	size_t cost;
 
-	new = wkmalloc(struct pktqueue_session, GFP_ATOMIC);
-	if (!new)
-		return -ENOMEM;
-	new->dst6 = *dst6;
-
-	collision = rbtree_find_slot(&new->tree_hook, &queue->node_tree,
-			compare_rbnode, &slot);
-	if (collision) {
-		wkfree(struct pktqueue_session, new);
+	bucket = get_bucket(queue, dst6);
+	if (__hash_find(bucket, dst6)) {
 		/*
 		 * Should we reset the timer of the existing session?
 		 * Don't know; the RFC is silent on this.
@@ -117,17 +205,53 @@ int pktqueue_add(struct pktqueue *queue, struct packet *pkt,
 	 * So if -ENOSPC is validated before, we would end up fetching lots of
 	 * misplaced ICMP errors.
 	 */
-	if (too_many) {
-		wkfree(struct pktqueue_session, new);
-		return -ENOSPC;
+	skb = pkt_original_pkt(pkt)->skb;
+	if (stateless) {
+		digest_len = skb_transport_header(skb) - skb_network_header(skb)
+				+ tcp_hdrlen(skb);
+		if (WARN(digest_len > PKTQUEUE_DIGEST_MAX,
+				"IPv4 and TCP headers are %u bytes long.",
+				digest_len))
+			return -EINVAL;
+		cost = sizeof(*new) + digest_len;
+	} else {
+		digest_len = 0;
+		cost = skb->truesize + sizeof(*new);
 	}
 
+	if (too_many)
+		return -ENOSPC;
+	if (max_bytes && queue->bytes + cost > max_bytes)
+		return -ENOSPC;
+
+	new = __wkmalloc("struct pktqueue_session", sizeof(*new) + digest_len,
+			GFP_ATOMIC);
+	if (!new)
+		return -ENOMEM;
+
+	new->dst6 = *dst6;
 	new->src4 = pkt->tuple.dst.addr4;
 	new->dst4 = pkt->tuple.src.addr4;
-	new->skb = pkt_original_pkt(pkt)->skb;
 	new->update_time = jiffies;
-	treeslot_commit(&slot);
+	new->digest_len = digest_len;
+	if (stateless) {
+		new->skb = NULL;
+		new->ifindex = skb->dev ? skb->dev->ifindex : 0;
+		if (skb_copy_bits(skb, skb_network_offset(skb), new->digest,
+				digest_len)) {
+			wkfree(struct pktqueue_session, new);
+			return -EINVAL;
+		}
+		/* The caller's reference was ours to release. */
+		kfree_skb(skb);
+	} else {
+		new->skb = skb;
+		new->ifindex = 0;
+	}
+
+	hlist_add_head(&new->hash_hook, bucket);
 	list_add_tail(&new->list_hook, &queue->node_list);
+	queue->bytes += cost;
 	return 0;
 }
 
@@ -142,39 +266,20 @@ void pktqueue_rm(struct pktqueue *queue, struct ipv4_transport_addr *src4)
 	 */
 	list_for_each_entry_safe(node, tmp, &queue->node_list, list_hook) {
 		if (taddr4_equals(&node->src4, src4)) {
-			list_del(&node->list_hook);
-			rb_erase(&node->tree_hook, &queue->node_tree);
+			rm(queue, node);
 			kfree_skb(node->skb);
 			wkfree(struct pktqueue_session, node);
 		}
 	}
 }
 
-/**
- * Returns > 0 if node.session.*4 > session.*4.
- * Returns < 0 if node.session.*4 < session.*4.
- * Returns 0 if node.session.*4 == session.*4.
- */
-static int compare_simple(const struct pktqueue_session *node,
-		const struct ipv6_transport_addr *addr)
-{
-	return taddr6_compare(&node->dst6, addr);
-}
-
-static struct pktqueue_session *__tree_find(struct pktqueue *queue,
-		struct ipv6_transport_addr *addr)
-{
-	return rbtree_find(addr, &queue->node_tree, compare_simple,
-			struct pktqueue_session, tree_hook);
-}
-
 struct pktqueue_session *pktqueue_find(struct pktqueue *queue,
 		struct ipv6_transport_addr *addr,
 		struct mask_domain *masks)
 {
 	struct pktqueue_session *node;
 
-	node = __tree_find(queue, addr);
+	node = __hash_find(get_bucket(queue, addr), addr);
 	if (!node)
 		return NULL;
 
@@ -219,9 +324,21 @@ unsigned int pktqueue_prepare_clean(struct pktqueue *queue,
 	return removed;
 }
 
-void pktqueue_clean(struct list_head *probes)
+unsigned long pktqueue_next_clean(struct pktqueue *queue)
+{
+	struct pktqueue_session *node;
+
+	if (list_empty(&queue->node_list))
+		return jiffies + get_timeout();
+
+	node = list_first_entry(&queue->node_list, struct pktqueue_session,
+			list_hook);
+	return node->update_time + get_timeout();
+}
+
+void pktqueue_clean(struct pktqueue *queue, struct list_head *probes)
 {
 	struct pktqueue_session *node, *tmp;
 	list_for_each_entry_safe(node, tmp, probes, list_hook)
-		send_icmp_error(node);
+		send_icmp_error(queue, node);
 }
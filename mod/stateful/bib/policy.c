@@ -0,0 +1,152 @@
+#include "nat64/mod/stateful/bib/policy.h"
+
+#include <linux/filter.h>
+#include <linux/rcupdate.h>
+#include <linux/skbuff.h>
+#include "nat64/common/policy.h"
+#include "nat64/mod/common/linux_version.h"
+#include "nat64/mod/common/types.h"
+
+/*
+ * Older kernels can run socket filters too, but they don't let modules fetch
+ * them out of file descriptors.
+ */
+#if defined(CONFIG_BPF_SYSCALL) && LINUX_VERSION_AT_LEAST(4, 15, 0, 9999, 0)
+#define POLICY_SUPPORTED 1
+#endif
+
+void policy_init(struct bib_policy *policy)
+{
+	RCU_INIT_POINTER(policy->prog, NULL);
+	mutex_init(&policy->lock);
+}
+
+#ifdef POLICY_SUPPORTED
+
+void policy_destroy(struct bib_policy *policy)
+{
+	struct bpf_prog *prog;
+
+	/* The BIB is dead, so nobody is reading @policy anymore. */
+	prog = rcu_dereference_protected(policy->prog, true);
+	if (prog)
+		bpf_prog_put(prog);
+}
+
+/**
+ * Replaces @policy's program with the one @fd (a file descriptor of the
+ * current process) refers to. A negative @fd detaches the current program.
+ */
+int policy_attach(struct bib_policy *policy, int fd)
+{
+	struct bpf_prog *new = NULL;
+	struct bpf_prog *old;
+
+	if (fd >= 0) {
+		new = bpf_prog_get_type(fd, BPF_PROG_TYPE_SOCKET_FILTER);
+		if (IS_ERR(new)) {
+			log_err("The policy has to be a socket filter BPF program. (errcode %ld)",
+					PTR_ERR(new));
+			return PTR_ERR(new);
+		}
+	}
+
+	mutex_lock(&policy->lock);
+	old = rcu_dereference_protected(policy->prog,
+			lockdep_is_held(&policy->lock));
+	rcu_assign_pointer(policy->prog, new);
+	mutex_unlock(&policy->lock);
+
+	if (old) {
+		synchronize_rcu_bh();
+		bpf_prog_put(old);
+	}
+
+	log_debug("BIB policy %s.", new ? "attached" : "detached");
+	return 0;
+}
+
+static u32 run(struct bpf_prog *prog, struct packet *pkt)
+{
+	struct sk_buff *skb = pkt->skb;
+	u8 saved_cb[BPF_SKB_CB_LEN];
+	u32 *cb;
+	int offset;
+	u32 result;
+
+	/* The program sees what a socket filter would; it starts at IPv6. */
+	offset = skb_network_offset(skb);
+	if (offset > 0)
+		__skb_pull(skb, offset);
+	else if (offset < 0)
+		__skb_push(skb, -offset);
+
+	cb = (u32 *)bpf_skb_cb(skb);
+	memcpy(saved_cb, cb, BPF_SKB_CB_LEN);
+	memset(cb, 0, BPF_SKB_CB_LEN);
+	cb[JOOL_POLICY_CB_PROTO] = pkt->tuple.l4_proto;
+	cb[JOOL_POLICY_CB_SRC_PORT] = pkt->tuple.src.addr6.l4;
+	cb[JOOL_POLICY_CB_DST_PORT] = pkt->tuple.dst.addr6.l4;
+
+#if LINUX_VERSION_AT_LEAST(5, 15, 0, 9999, 0)
+	result = bpf_prog_run(prog, skb);
+#else
+	result = BPF_PROG_RUN(prog, skb);
+#endif
+
+	memcpy(cb, saved_cb, BPF_SKB_CB_LEN);
+	if (offset > 0)
+		__skb_push(skb, offset);
+	else if (offset < 0)
+		__skb_pull(skb, -offset);
+
+	return result;
+}
+
+/**
+ * Asks @policy's program about @pkt, and applies the mark it returns, if any.
+ * Returns -EPERM if @pkt has to be dropped.
+ */
+int policy_apply(struct bib_policy *policy, struct packet *pkt)
+{
+	struct bpf_prog *prog;
+	u32 result;
+
+	/* Most instances never attach anything. */
+	if (!rcu_access_pointer(policy->prog))
+		return 0;
+
+	rcu_read_lock_bh();
+	prog = rcu_dereference_bh(policy->prog);
+	result = prog ? run(prog, pkt) : JOOL_POLICY_ALLOW;
+	rcu_read_unlock_bh();
+
+	switch (result) {
+	case JOOL_POLICY_DENY:
+		return -EPERM;
+	case JOOL_POLICY_ALLOW:
+		return 0;
+	}
+
+	pkt->skb->mark = result;
+	return 0;
+}
+
+#else
+
+void policy_destroy(struct bib_policy *policy)
+{
+}
+
+int policy_attach(struct bib_policy *policy, int fd)
+{
+	log_err("This kernel cannot attach BPF programs to Jool. (Needs Linux 4.15+ and CONFIG_BPF_SYSCALL.)");
+	return -EOPNOTSUPP;
+}
+
+int policy_apply(struct bib_policy *policy, struct packet *pkt)
+{
+	return 0;
+}
+
+#endif /* POLICY_SUPPORTED */
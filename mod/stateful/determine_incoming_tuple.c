@@ -1,7 +1,6 @@
 #include "nat64/mod/stateful/determine_incoming_tuple.h"
 
 #include "nat64/mod/common/icmp_wrapper.h"
-#include "nat64/mod/common/ipv6_hdr_iterator.h"
 #include "nat64/mod/common/pool6.h"
 #include "nat64/mod/common/stats.h"
 
@@ -186,7 +185,7 @@ static verdict ipv6_icmp_info(struct packet *pkt, struct tuple *tuple6)
 static verdict ipv6_icmp_err(struct packet *pkt, struct tuple *tuple6)
 {
 	struct ipv6hdr *inner_ip6 = (struct ipv6hdr *) (pkt_icmp6_hdr(pkt) + 1);
-	struct hdr_iterator iterator = HDR_ITERATOR_INIT(inner_ip6);
+	void *inner_l4 = ((void *)inner_ip6) + pkt->ext6.inner_l3hdr_len;
 	struct udphdr *inner_udp;
 	struct tcphdr *inner_tcp;
 	struct icmp6hdr *inner_icmp;
@@ -195,24 +194,23 @@ static verdict ipv6_icmp_err(struct packet *pkt, struct tuple *tuple6)
 	tuple6->src.addr6.l3 = inner_ip6->daddr;
 	tuple6->dst.addr6.l3 = inner_ip6->saddr;
 
-	hdr_iterator_last(&iterator);
-	switch (iterator.hdr_type) {
+	switch (pkt->ext6.inner_nexthdr) {
 	case NEXTHDR_UDP:
-		inner_udp = iterator.data;
+		inner_udp = inner_l4;
 		tuple6->src.addr6.l4 = be16_to_cpu(inner_udp->dest);
 		tuple6->dst.addr6.l4 = be16_to_cpu(inner_udp->source);
 		tuple6->l4_proto = L4PROTO_UDP;
 		break;
 
 	case NEXTHDR_TCP:
-		inner_tcp = iterator.data;
+		inner_tcp = inner_l4;
 		tuple6->src.addr6.l4 = be16_to_cpu(inner_tcp->dest);
 		tuple6->dst.addr6.l4 = be16_to_cpu(inner_tcp->source);
 		tuple6->l4_proto = L4PROTO_TCP;
 		break;
 
 	case NEXTHDR_ICMP:
-		inner_icmp = iterator.data;
+		inner_icmp = inner_l4;
 
 		if (is_icmp6_error(inner_icmp->icmp6_type)) {
 			log_debug("Bogus pkt: ICMP error inside ICMP error.");
@@ -227,7 +225,7 @@ static verdict ipv6_icmp_err(struct packet *pkt, struct tuple *tuple6)
 		break;
 
 	default:
-		return unknown_inner_proto(iterator.hdr_type);
+		return unknown_inner_proto(pkt->ext6.inner_nexthdr);
 	}
 
 	tuple6->l3_proto = L3PROTO_IPV6;
@@ -340,7 +338,7 @@ unknown_proto_ipv6:
 		return VERDICT_ACCEPT;
 
 	/* RFC6146 logic. */
-	icmp64_send(pkt, ICMPERR_PROTO_UNREACHABLE, 0);
+	icmp64_send(state->jool.stats, pkt, ICMPERR_PROTO_UNREACHABLE, 0);
 	inc_stats(pkt, IPSTATS_MIB_INUNKNOWNPROTOS);
 	return VERDICT_DROP;
 }
@@ -94,10 +94,13 @@ static verdict succeed(struct xlation *state)
 	 * - These special no-changes cases are rare.
 	 *
 	 * So let's simplify everything by just joold_add()ing here.
+	 *
+	 * The BIB does tell us, however, when the session was synchronized
+	 * recently enough. (See --ss-resync-interval.)
 	 */
-	if (state->entries.session_set) {
+	if (state->entries.session_set && state->entries.session.sync_due) {
 		joold_add(state->jool.nat64.joold, &state->entries.session,
-				state->jool.nat64.bib);
+				state->jool.nat64.bib, state->jool.pool6);
 	}
 	return VERDICT_CONTINUE;
 }
@@ -132,20 +135,36 @@ static int find_mask_domain(struct xlation *state,
 		.ns = state->jool.ns,
 		.daddr = dst->l3,
 		.tos = ttp64_xlat_tos(&state->jool.global->cfg, hdr6),
-		.proto = ttp64_xlat_proto(hdr6),
+		.proto = ttp64_xlat_proto(&state->in),
 		.mark = state->in.skb->mark,
 	};
 
 	*masks = mask_domain_find(state->jool.nat64.pool4, &state->in.tuple,
-			state->jool.global->cfg.nat64.f_args, &args);
+			state->jool.global->cfg.nat64.f_args,
+			state->jool.global->cfg.nat64.f_algorithm, &args);
 	if (*masks)
 		return 0;
 
 	log_debug("There is no mask domain mapped to mark %u.",
 			state->in.skb->mark);
+	jstat_inc(state->jool.stats, JSTAT_MASK_DOMAIN_NOT_FOUND);
 	return -EINVAL;
 }
 
+/**
+ * Runs the BIB policy program, if the instance has one. Has to happen before
+ * find_mask_domain(), since the program can change the packet's mark.
+ */
+static int apply_policy(struct xlation *state)
+{
+	if (!bib_policy_apply(state->jool.nat64.bib, &state->in))
+		return 0;
+
+	log_debug("The BIB policy denied the packet.");
+	jstat_inc(state->jool.stats, JSTAT_POLICY_DENY);
+	return -EPERM;
+}
+
 /**
  * Assumes that "tuple" represents a IPv6-UDP or ICMP packet, and filters and
  * updates based on it.
@@ -161,26 +180,37 @@ static verdict ipv6_simple(struct xlation *state)
 	struct mask_domain *masks;
 	int error;
 
+	if (apply_policy(state))
+		return breakdown(state);
 	if (xlat_dst_6to4(state, &dst4))
 		return breakdown(state);
 	if (find_mask_domain(state, &dst4, &masks))
 		return breakdown(state);
 
 	error = bib_add6(state->jool.nat64.bib, masks, &state->in.tuple, &dst4,
-			&state->entries);
+			pkt_len(&state->in), &state->entries);
 	mask_domain_put(masks);
 
 	switch (error) {
 	case 0:
 		return succeed(state);
+	case -ENOENT:
+		jstat_inc(state->jool.stats, JSTAT_POOL4_EXHAUSTED);
+		break;
+	case -ENOSPC:
+		jstat_inc(state->jool.stats, JSTAT_SUBSCRIBER_LIMIT);
+		break;
 	default:
-		/*
-		 * Error msg already printed, but since bib_add6() sprawls
-		 * messily, let's leave this here just in case.
-		 */
-		log_debug("bib_add6() threw error code %d.", error);
-		return breakdown(state);
+		jstat_inc(state->jool.stats, JSTAT_BIB_ERROR);
+		break;
 	}
+
+	/*
+	 * Error msg already printed, but since bib_add6() sprawls messily,
+	 * let's leave this here just in case.
+	 */
+	log_debug("bib_add6() threw error code %d.", error);
+	return breakdown(state);
 }
 
 /**
@@ -205,7 +235,7 @@ static verdict ipv4_simple(struct xlation *state)
 	dst6.l4 = src4->l4;
 
 	error = bib_add4(state->jool.nat64.bib, &dst6, &state->in.tuple,
-			&state->entries);
+			pkt_len(&state->in), &state->entries);
 
 	switch (error) {
 	case 0:
@@ -213,14 +243,18 @@ static verdict ipv4_simple(struct xlation *state)
 	case -ESRCH:
 		log_debug("There is no BIB entry for the IPv4 packet.");
 		inc_stats(&state->in, IPSTATS_MIB_INNOROUTES);
+		jstat_inc(state->jool.stats, JSTAT_BIB4_NOT_FOUND);
 		return VERDICT_ACCEPT;
 	case -EPERM:
 		log_debug("Packet was blocked by Address-Dependent Filtering.");
-		icmp64_send(&state->in, ICMPERR_FILTER, 0);
+		jstat_inc(state->jool.stats, JSTAT_ADF);
+		icmp64_send(state->jool.stats, &state->in, ICMPERR_FILTER, 0);
 		return breakdown(state);
 	default:
 		log_debug("Errcode %d while finding a BIB entry.", error);
-		icmp64_send(&state->in, ICMPERR_ADDR_UNREACHABLE, 0);
+		jstat_inc(state->jool.stats, JSTAT_BIB_ERROR);
+		icmp64_send(state->jool.stats, &state->in,
+				ICMPERR_ADDR_UNREACHABLE, 0);
 		return breakdown(state);
 	}
 }
@@ -354,7 +388,7 @@ static enum session_fate tcp_established_state(struct session_entry *session,
 
 	} else if (pkt_tcp_hdr(pkt)->rst) {
 		session->state = TRANS;
-		return FATE_TIMER_TRANS;
+		return FATE_TIMER_CLOSED;
 	}
 
 	return FATE_TIMER_EST;
@@ -379,11 +413,11 @@ static enum session_fate tcp_v4_fin_rcv_state(struct session_entry *session,
 		hdr = pkt_tcp_hdr(pkt);
 		if (hdr->fin) {
 			session->state = V4_FIN_V6_FIN_RCV;
-			return FATE_TIMER_TRANS;
+			return FATE_TIMER_CLOSED;
 		}
 		if (hdr->rst && handle_rst_during_fin_rcv(state)) {
 			/* https://github.com/NICMx/Jool/issues/212 */
-			return FATE_TIMER_TRANS;
+			return FATE_TIMER_CLOSED;
 		}
 	}
 
@@ -404,11 +438,11 @@ static enum session_fate tcp_v6_fin_rcv_state(struct session_entry *session,
 		hdr = pkt_tcp_hdr(pkt);
 		if (hdr->fin) {
 			session->state = V4_FIN_V6_FIN_RCV;
-			return FATE_TIMER_TRANS;
+			return FATE_TIMER_CLOSED;
 		}
 		if (hdr->rst && handle_rst_during_fin_rcv(state)) {
 			/* https://github.com/NICMx/Jool/issues/212 */
-			return FATE_TIMER_TRANS;
+			return FATE_TIMER_CLOSED;
 		}
 	}
 
@@ -476,6 +510,8 @@ static verdict ipv6_tcp(struct xlation *state)
 	struct mask_domain *masks;
 	verdict verdict;
 
+	if (apply_policy(state))
+		return breakdown(state);
 	if (xlat_dst_6to4(state, &dst4))
 		return breakdown(state);
 	if (find_mask_domain(state, &dst4, &masks))
@@ -556,10 +592,12 @@ verdict filtering_and_updating(struct xlation *state)
 		if (pool6_contains(state->jool.pool6, &hdr_ip6->saddr)) {
 			log_debug("Hairpinning loop. Dropping...");
 			inc_stats(in, IPSTATS_MIB_INADDRERRORS);
+			jstat_inc(state->jool.stats, JSTAT_HAIRPIN_LOOP);
 			return VERDICT_DROP;
 		}
 		if (!pool6_contains(state->jool.pool6, &hdr_ip6->daddr)) {
 			log_debug("Packet does not belong to pool6.");
+			jstat_inc(state->jool.stats, JSTAT_POOL6_MISMATCH);
 			return VERDICT_ACCEPT;
 		}
 
@@ -574,6 +612,7 @@ verdict filtering_and_updating(struct xlation *state)
 		if (!pool4db_contains(state->jool.nat64.pool4, state->jool.ns,
 				in->tuple.l4_proto, &in->tuple.dst.addr4)) {
 			log_debug("Packet does not belong to pool4.");
+			jstat_inc(state->jool.stats, JSTAT_POOL4_MISMATCH);
 			return VERDICT_ACCEPT;
 		}
 
@@ -614,6 +653,7 @@ verdict filtering_and_updating(struct xlation *state)
 			if (state->jool.global->cfg.nat64.drop_icmp6_info) {
 				log_debug("Packet is ICMPv6 info (ping); dropping due to policy.");
 				inc_stats(in, IPSTATS_MIB_INDISCARDS);
+				jstat_inc(state->jool.stats, JSTAT_ICMP6_FILTER);
 				return VERDICT_DROP;
 			}
 
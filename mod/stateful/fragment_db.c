@@ -2,12 +2,18 @@
 #include "nat64/common/constants.h"
 #include "nat64/mod/common/config.h"
 #include "nat64/mod/common/linux_version.h"
+#include "nat64/mod/common/route.h"
 #include "nat64/mod/common/stats.h"
+#include "nat64/mod/common/trace.h"
 #include "nat64/mod/common/packet.h"
+#include "nat64/mod/common/translation_state.h"
 
 #include <linux/version.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
+#include <linux/module.h>
+#include <net/dst.h>
+#include <net/ip.h>
 #include <net/ipv6.h>
 #include <net/netfilter/ipv4/nf_defrag_ipv4.h>
 #include <net/netfilter/ipv6/nf_defrag_ipv6.h>
@@ -19,6 +25,8 @@ struct reassembly_buffer {
 	struct sk_buff **next_slot;
 	/* Jiffy at which the fragment timer will delete this buffer. */
 	unsigned long dying_time;
+	/** Bytes (truesize) this buffer is charged to fragdb->mem. */
+	unsigned int mem;
 
 	struct list_head list_hook;
 };
@@ -26,10 +34,69 @@ struct reassembly_buffer {
 /** Cache for struct reassembly_buffers, for efficient allocation. */
 static struct kmem_cache *buffer_cache;
 
+static bool kernel_defrag = true;
+module_param(kernel_defrag, bool, 0);
+MODULE_PARM_DESC(kernel_defrag, "Have nf_defrag_ipv4 and nf_defrag_ipv6 reassemble packets before they reach Jool. If disabled, those modules are not even loaded; Jool reassembles IPv4 itself, and IPv6 is always virtually reassembled.");
+
+/*
+ * The defragmenters are requested at runtime (rather than linked against) so
+ * the module doesn't drag them (and their hooks) in when they're not wanted.
+ */
+static typeof(&nf_defrag_ipv4_enable) defrag4_enable;
+static typeof(&nf_defrag_ipv6_enable) defrag6_enable;
+
+/*
+ * Initial bucket count of every shard's tables. They grow on their own; this is
+ * only a knob for fragdb-benchmark.
+ */
+#ifndef FRAGDB_TABLE_SIZE
+#define FRAGDB_TABLE_SIZE 32
+#endif
+
 #define HTABLE_NAME fragdb_table
 #define KEY_TYPE struct packet
 #define VALUE_TYPE struct reassembly_buffer
-#define HASH_TABLE_SIZE 256
+#define HASH_TABLE_SIZE FRAGDB_TABLE_SIZE
+#include "../common/hash_table.c"
+
+/** The fields that tell the fragments of one packet apart from other's. */
+struct vflow_key {
+	struct in6_addr src;
+	struct in6_addr dst;
+	__be32 id;
+	l4_protocol proto;
+};
+
+/**
+ * What virtual reassembly remembers about a fragmented packet.
+ *
+ * Instead of waiting for all the fragments, the first one is translated right
+ * away (it has the layer-4 header, so it can find its session), and the rest
+ * are translated as they arrive, by reusing the first one's IPv4 header.
+ * (Their payload can be copied as is; the checksum lives in the first one.)
+ */
+struct virtual_flow {
+	struct vflow_key key;
+	/**
+	 * The IPv4 header the first fragment was translated into.
+	 * Only meaningful if @resolved.
+	 */
+	struct iphdr hdr4;
+	bool resolved;
+	/** Fragments that arrived before the first one was translated. */
+	struct sk_buff_head pending;
+	/** Bytes this flow is charged to fragdb->mem. */
+	unsigned int mem;
+	/* Jiffy at which the fragment timer will delete this flow. */
+	unsigned long dying_time;
+
+	struct list_head list_hook;
+};
+
+#define HTABLE_NAME vflow_table
+#define KEY_TYPE struct vflow_key
+#define VALUE_TYPE struct virtual_flow
+#define HASH_TABLE_SIZE FRAGDB_TABLE_SIZE
 #include "../common/hash_table.c"
 
 /**
@@ -40,17 +107,54 @@ static struct kmem_cache *buffer_cache;
  */
 static u32 rnd;
 
-struct fragdb {
-	struct fragdb_table table;
+/*
+ * The database is split in shards (by fragment hash), each with its own lock,
+ * so fragments of different packets don't contend for the same spinlock.
+ * The unit tests peek at the structure, so they only get one. (Unless they
+ * define their own; see fragdb-benchmark.)
+ */
+#ifndef FRAGDB_SHARD_BITS
+#ifdef UNIT_TESTING
+#define FRAGDB_SHARD_BITS 0
+#else
+#define FRAGDB_SHARD_BITS 4
+#endif
+#endif
+#define FRAGDB_SHARDS (1 << FRAGDB_SHARD_BITS)
 
+struct fragdb_shard {
+	struct fragdb_table table;
+	/** Sorted by dying_time, because they all share @timeout. */
 	struct list_head expire_list;
+	/** Virtual reassembly's state. */
+	struct vflow_table flows;
+	/** Same as @expire_list, except for @flows. */
+	struct list_head flow_list;
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+struct fragdb {
+	/**
+	 * Array of FRAGDB_SHARDS shards. Most instances never see a fragment,
+	 * so this stays NULL until the first one arrives. (See get_shards().)
+	 */
+	struct fragdb_shard *shards;
 	/**
 	 * Maximum number of jiffies any entry in this database should survive
 	 * idle.
+	 * Not protected by any lock; it's a word.
 	 */
 	unsigned long timeout;
+	/** See struct fragdb_config. Same as @timeout regarding locking. */
+	__u32 high_thresh;
+	__u32 low_thresh;
+	/** See struct fragdb_config. Same as @timeout regarding locking. */
+	bool virtual_reassembly;
+	/** Sum of the truesizes of every buffer and flow, in every shard. */
+	atomic_long_t mem;
+	/** The instance's counters. (We hold a reference.) */
+	struct jool_stats *stats;
 
-	spinlock_t lock;
 	struct kref ref;
 };
 
@@ -106,12 +210,147 @@ static unsigned int hash_function(const struct packet *key)
 			&hdr->saddr, &hdr->daddr, rnd);
 }
 
+static bool vflow_equals(const struct vflow_key *k1,
+		const struct vflow_key *k2)
+{
+	return addr6_equals(&k1->src, &k2->src)
+			&& addr6_equals(&k1->dst, &k2->dst)
+			&& k1->id == k2->id
+			&& k1->proto == k2->proto;
+}
+
+/** Has to agree with hash_function(), so both agree on the shard. */
+static unsigned int vflow_hash(const struct vflow_key *key)
+{
+	return inet6_hash_frag(key->id, &key->src, &key->dst, rnd);
+}
+
+static void vflow_key_init(struct vflow_key *key, struct packet *pkt)
+{
+	struct ipv6hdr *hdr = pkt_ip6_hdr(pkt);
+
+	memset(key, 0, sizeof(*key));
+	key->src = hdr->saddr;
+	key->dst = hdr->daddr;
+	key->id = pkt_frag_hdr(pkt)->identification;
+	key->proto = pkt_l4_proto(pkt);
+}
+
+/**
+ * The tables index their buckets with the low bits of the hash, so the shard
+ * is chosen with the high ones.
+ */
+static struct fragdb_shard *get_shard(struct fragdb_shard *shards,
+		struct packet *pkt)
+{
+#if FRAGDB_SHARD_BITS > 0
+	return &shards[hash_function(pkt) >> (32 - FRAGDB_SHARD_BITS)];
+#else
+	return &shards[0];
+#endif
+}
+
+static struct fragdb_shard *alloc_shards(gfp_t flags)
+{
+	struct fragdb_shard *shards;
+	struct fragdb_shard *shard;
+	unsigned int i;
+
+	shards = __wkmalloc_as(JMEM_FRAGMENT, "fragdb shards",
+			FRAGDB_SHARDS * sizeof(*shards), flags);
+	if (!shards)
+		return NULL;
+
+	for (i = 0; i < FRAGDB_SHARDS; i++) {
+		shard = &shards[i];
+		/* (These only fail on NULL arguments.) */
+		fragdb_table_init(&shard->table, equals_function,
+				hash_function);
+		INIT_LIST_HEAD(&shard->expire_list);
+		vflow_table_init(&shard->flows, vflow_equals, vflow_hash);
+		INIT_LIST_HEAD(&shard->flow_list);
+		spin_lock_init(&shard->lock);
+	}
+
+	return shards;
+}
+
+/**
+ * Returns @db's shards, allocating them if this is the first fragment @db
+ * sees. Returns NULL on memory allocation failure.
+ */
+static struct fragdb_shard *get_shards(struct fragdb *db)
+{
+	struct fragdb_shard *shards;
+	struct fragdb_shard *old;
+
+	shards = READ_ONCE(db->shards);
+	if (likely(shards))
+		return shards;
+
+	shards = alloc_shards(GFP_ATOMIC);
+	if (!shards)
+		return NULL;
+
+	/* (cmpxchg() also orders the initialization above.) */
+	old = cmpxchg(&db->shards, NULL, shards);
+	if (old) {
+		/* Another CPU beat us to it. */
+		__wkfree_as(JMEM_FRAGMENT, "fragdb shards", shards);
+		return old;
+	}
+
+	return shards;
+}
+
+static int request_defrag(void)
+{
+#ifndef UNIT_TESTING
+	defrag4_enable = symbol_request(nf_defrag_ipv4_enable);
+	if (!defrag4_enable) {
+		log_err("Could not load nf_defrag_ipv4. (Try kernel_defrag=0.)");
+		return -ENOENT;
+	}
+
+	defrag6_enable = symbol_request(nf_defrag_ipv6_enable);
+	if (!defrag6_enable) {
+		log_err("Could not load nf_defrag_ipv6. (Try kernel_defrag=0.)");
+		symbol_put(nf_defrag_ipv4_enable);
+		defrag4_enable = NULL;
+		return -ENOENT;
+	}
+#endif
+
+	return 0;
+}
+
+static void release_defrag(void)
+{
+#ifndef UNIT_TESTING
+	if (defrag6_enable)
+		symbol_put(nf_defrag_ipv6_enable);
+	if (defrag4_enable)
+		symbol_put(nf_defrag_ipv4_enable);
+#endif
+}
+
 int fragdb_setup(void)
 {
+	int error;
+
+	if (kernel_defrag) {
+		error = request_defrag();
+		if (error)
+			return error;
+	} else {
+		log_info("Kernel defragmentation disabled; IPv6 fragments will be virtually reassembled.");
+	}
+
 	buffer_cache = kmem_cache_create("jool_reassembly_buffers",
 			sizeof(struct reassembly_buffer), 0, 0, NULL);
 	if (!buffer_cache) {
 		log_err("Could not allocate the reassembly buffer cache.");
+		release_defrag();
 		return -ENOMEM;
 	}
 
@@ -123,36 +362,71 @@ int fragdb_setup(void)
 void fragdb_teardown(void)
 {
 	kmem_cache_destroy(buffer_cache);
+	release_defrag();
 }
 
-struct fragdb *fragdb_alloc(struct net *ns)
+/**
+ * Returns true if the translation of @skb, an IPv4 packet, can proceed.
+ * Returns false if the kernel took it.
+ *
+ * Non-first fragments have no ports, so NAT64 has to reassemble. nf_defrag_ipv4
+ * normally does that before Jool's hook; if it's not around (kernel_defrag=0),
+ * this does it in its place.
+ */
+bool fragdb_defrag4(struct sk_buff *skb)
 {
-	struct fragdb *db;
 	int error;
 
+	if (kernel_defrag || !ip_is_fragment(ip_hdr(skb)))
+		return true;
+
+	local_bh_disable();
+#if LINUX_VERSION_AT_LEAST(4, 4, 0, 9999, 0)
+	error = ip_defrag(dev_net(skb->dev), skb, IP_DEFRAG_CONNTRACK_IN);
+#else
+	error = ip_defrag(skb, IP_DEFRAG_CONNTRACK_IN);
+#endif
+	local_bh_enable();
+	if (error)
+		return false;
+
+#if LINUX_VERSION_AT_LEAST(3, 16, 0, 7, 2)
+	skb->ignore_df = true;
+#else
+	skb->local_df = true;
+#endif
+	return true;
+}
+
+struct fragdb *fragdb_alloc(struct net *ns, struct jool_stats *stats)
+{
+	struct fragdb *db;
+
 	db = wkmalloc(struct fragdb, GFP_KERNEL);
 	if (!db)
 		return NULL;
 
-	error = fragdb_table_init(&db->table, equals_function, hash_function);
-	if (error) {
-		wkfree(struct fragdb, db);
-		return NULL;
-	}
-
-	INIT_LIST_HEAD(&db->expire_list);
+	db->shards = NULL;
 	db->timeout = msecs_to_jiffies(1000 * FRAGMENT_MIN);
-	spin_lock_init(&db->lock);
+	db->high_thresh = DEFAULT_FRAG_HIGH_THRESH;
+	db->low_thresh = DEFAULT_FRAG_LOW_THRESH;
+	db->virtual_reassembly = DEFAULT_FRAG_VIRTUAL;
+	atomic_long_set(&db->mem, 0);
+	db->stats = stats;
+	if (stats)
+		jstat_get(stats);
 	kref_init(&db->ref);
 
 #ifndef UNIT_TESTING
+	if (kernel_defrag) {
 #if LINUX_VERSION_AT_LEAST(4, 10, 0, 9999, 0)
-	nf_defrag_ipv4_enable(ns);
-	nf_defrag_ipv6_enable(ns);
+		defrag4_enable(ns);
+		defrag6_enable(ns);
 #else
-	nf_defrag_ipv4_enable();
-	nf_defrag_ipv6_enable();
+		defrag4_enable();
+		defrag6_enable();
 #endif
+	}
 #endif
 
 	return db;
@@ -166,14 +440,32 @@ void fragdb_get(struct fragdb *db)
 static void buffer_dealloc(struct reassembly_buffer *buffer)
 {
 	kfree_skb(buffer->pkt.skb);
-	wkmem_cache_free("reassembly buffer", buffer_cache, buffer);
+	wkmem_cache_free(JMEM_FRAGMENT, "reassembly buffer", buffer_cache,
+			buffer);
+}
+
+static void flow_dealloc(struct virtual_flow *flow)
+{
+	__skb_queue_purge(&flow->pending);
+	wkfree_as(JMEM_FRAGMENT, struct virtual_flow, flow);
 }
 
 static void fragdb_release(struct kref *ref)
 {
 	struct fragdb *db;
+	unsigned int i;
+
 	db = container_of(ref, struct fragdb, ref);
-	fragdb_table_empty(&db->table, buffer_dealloc);
+	if (db->shards) {
+		for (i = 0; i < FRAGDB_SHARDS; i++) {
+			fragdb_table_empty(&db->shards[i].table,
+					buffer_dealloc);
+			vflow_table_empty(&db->shards[i].flows, flow_dealloc);
+		}
+		__wkfree_as(JMEM_FRAGMENT, "fragdb shards", db->shards);
+	}
+	if (db->stats)
+		jstat_put(db->stats);
 	wkfree(struct fragdb, db);
 	/*
 	 * Welp. There is no nf_defrag_ipv*_disable(). Guess we'll just have to
@@ -188,21 +480,24 @@ void fragdb_put(struct fragdb *db)
 
 void fragdb_config_copy(struct fragdb *db, struct fragdb_config *config)
 {
-	spin_lock_bh(&db->lock);
-	config->ttl = db->timeout;
-	spin_unlock_bh(&db->lock);
+	config->ttl = READ_ONCE(db->timeout);
+	config->high_thresh = READ_ONCE(db->high_thresh);
+	config->low_thresh = READ_ONCE(db->low_thresh);
+	config->virtual_reassembly = READ_ONCE(db->virtual_reassembly);
 }
 
 void fragdb_config_set(struct fragdb *db, struct fragdb_config *config)
 {
-	spin_lock_bh(&db->lock);
-	db->timeout = config->ttl;
-	spin_unlock_bh(&db->lock);
+	WRITE_ONCE(db->timeout, config->ttl);
+	WRITE_ONCE(db->high_thresh, config->high_thresh);
+	WRITE_ONCE(db->low_thresh, config->low_thresh);
+	WRITE_ONCE(db->virtual_reassembly, config->virtual_reassembly);
 }
 
 #define COMMON_MSG " Looks like nf_defrag_ipv6 is not sorting the fragments, " \
 		"or something's shuffling them later. Please report."
-static struct reassembly_buffer *add_pkt(struct fragdb *db, struct packet *pkt)
+static struct reassembly_buffer *add_pkt(struct fragdb *db,
+		struct fragdb_shard *shard, struct packet *pkt)
 {
 	struct reassembly_buffer *buffer;
 	struct frag_hdr *hdr_frag = pkt_frag_hdr(pkt);
@@ -210,7 +505,7 @@ static struct reassembly_buffer *add_pkt(struct fragdb *db, struct packet *pkt)
 	unsigned int truesize;
 
 	/* Does it already exist? If so, add to and return existing buffer */
-	buffer = fragdb_table_get(&db->table, pkt);
+	buffer = fragdb_table_get(&shard->table, pkt);
 	if (buffer) {
 		if (WARN(is_first_frag6(hdr_frag),
 				"Non-first fragment's offset is zero."
@@ -239,6 +534,8 @@ static struct reassembly_buffer *add_pkt(struct fragdb *db, struct packet *pkt)
 		buffer->pkt.skb->len += payload_len;
 		buffer->pkt.skb->data_len += payload_len;
 		buffer->pkt.skb->truesize += truesize;
+		buffer->mem += truesize;
+		atomic_long_add(truesize, &db->mem);
 
 		return buffer;
 	}
@@ -263,22 +560,27 @@ static struct reassembly_buffer *add_pkt(struct fragdb *db, struct packet *pkt)
 	}
 
 	/* Create buffer, add the packet to it, index */
-	buffer = wkmem_cache_alloc("reassembly buffer", buffer_cache, GFP_ATOMIC);
+	buffer = wkmem_cache_alloc(JMEM_FRAGMENT, "reassembly buffer",
+			buffer_cache, GFP_ATOMIC);
 	if (!buffer)
 		return NULL;
 
 	buffer->pkt = *pkt;
 	buffer->pkt.original_pkt = &buffer->pkt;
 	buffer->next_slot = &skb_shinfo(pkt->skb)->frag_list;
-	buffer->dying_time = jiffies + db->timeout;
+	buffer->dying_time = jiffies + READ_ONCE(db->timeout);
 
-	if (fragdb_table_put(&db->table, pkt, buffer)) {
-		wkmem_cache_free("reassembly buffer", buffer_cache, buffer);
+	if (fragdb_table_put(&shard->table, pkt, buffer)) {
+		wkmem_cache_free(JMEM_FRAGMENT, "reassembly buffer",
+				buffer_cache, buffer);
 		return NULL;
 	}
 
 	/* Schedule for automatic deletion */
-	list_add_tail(&buffer->list_hook, &db->expire_list);
+	list_add_tail(&buffer->list_hook, &shard->expire_list);
+	buffer->mem = pkt->skb->truesize;
+	atomic_long_add(buffer->mem, &db->mem);
+	trace_jool_frag_add(&buffer->pkt);
 
 	return buffer;
 }
@@ -287,43 +589,208 @@ static struct reassembly_buffer *add_pkt(struct fragdb *db, struct packet *pkt)
 /**
  * Removes "buffer" from the database and destroys it.
  */
-static void buffer_destroy(struct fragdb *db, struct reassembly_buffer *buffer,
-		struct packet *pkt)
+static void buffer_destroy(struct fragdb *db, struct fragdb_shard *shard,
+		struct reassembly_buffer *buffer, struct packet *pkt)
 {
-	if (WARN(!fragdb_table_remove(&db->table, pkt, NULL),
+	if (WARN(!fragdb_table_remove(&shard->table, pkt, NULL),
 			"Something is attempting to delete a buffer that wasn't stored in the database."))
 		return;
 
 	list_del(&buffer->list_hook);
+	atomic_long_sub(buffer->mem, &db->mem);
 	buffer_dealloc(buffer);
 }
 
+static struct virtual_flow *flow_add(struct fragdb *db,
+		struct fragdb_shard *shard, struct vflow_key *key)
+{
+	struct virtual_flow *flow;
+
+	flow = wkmalloc_as(JMEM_FRAGMENT, struct virtual_flow, GFP_ATOMIC);
+	if (!flow)
+		return NULL;
+
+	flow->key = *key;
+	flow->resolved = false;
+	__skb_queue_head_init(&flow->pending);
+	flow->mem = sizeof(*flow);
+	flow->dying_time = jiffies + READ_ONCE(db->timeout);
+
+	if (vflow_table_put(&shard->flows, &flow->key, flow)) {
+		wkfree_as(JMEM_FRAGMENT, struct virtual_flow, flow);
+		return NULL;
+	}
+
+	list_add_tail(&flow->list_hook, &shard->flow_list);
+	atomic_long_add(flow->mem, &db->mem);
+	return flow;
+}
+
+static void flow_destroy(struct fragdb *db, struct fragdb_shard *shard,
+		struct virtual_flow *flow)
+{
+	if (WARN(!vflow_table_remove(&shard->flows, &flow->key, NULL),
+			"Something is attempting to delete a flow that wasn't stored in the database."))
+		return;
+
+	list_del(&flow->list_hook);
+	atomic_long_sub(flow->mem, &db->mem);
+	flow_dealloc(flow);
+}
+
+/**
+ * If the database is using more memory than its high threshold, drops the
+ * oldest buffers and flows of @shard (other than @keep) until it's back down to
+ * the low one. Other shards shed their own buffers as their own fragments arrive (or
+ * the cleaner runs), so this never has to hold more than one lock.
+ *
+ * The caller must hold @shard->lock.
+ */
+static unsigned int evict(struct fragdb *db, struct fragdb_shard *shard,
+		void *keep)
+{
+	struct reassembly_buffer *buffer;
+	struct reassembly_buffer *tmp;
+	struct virtual_flow *flow;
+	struct virtual_flow *tmp_flow;
+	unsigned long high;
+	unsigned long low;
+	unsigned int b = 0;
+
+	high = READ_ONCE(db->high_thresh);
+	if (!high || atomic_long_read(&db->mem) <= high)
+		return 0;
+	low = READ_ONCE(db->low_thresh);
+
+	list_for_each_entry_safe(buffer, tmp, &shard->expire_list, list_hook) {
+		if (atomic_long_read(&db->mem) <= low)
+			break;
+		if (buffer == keep)
+			continue;
+
+		inc_stats(&buffer->pkt, IPSTATS_MIB_REASMFAILS);
+		jstat_inc(db->stats, JSTAT_FRAG_EVICTED);
+		trace_jool_frag_evict(&buffer->pkt);
+		buffer_destroy(db, shard, buffer, &buffer->pkt);
+		b++;
+	}
+
+	list_for_each_entry_safe(flow, tmp_flow, &shard->flow_list, list_hook) {
+		if (atomic_long_read(&db->mem) <= low)
+			break;
+		if (flow == keep)
+			continue;
+
+		jstat_inc(db->stats, JSTAT_FRAG_EVICTED);
+		flow_destroy(db, shard, flow);
+		b++;
+	}
+
+	if (b)
+		log_debug("Out of fragment memory; evicted %u reassembly buffers.",
+				b);
+	return b;
+}
+
 /**
  * Executed every once in a while to exterminate expired fragments.
  */
-void fragdb_clean(struct fragdb *db)
+static unsigned int clean_shard(struct fragdb *db, struct fragdb_shard *shard)
 {
 	unsigned int b = 0;
 	struct reassembly_buffer *buffer;
+	struct virtual_flow *flow;
 
-	spin_lock_bh(&db->lock);
+	spin_lock_bh(&shard->lock);
 
-	while (!list_empty(&db->expire_list)) {
-		buffer = list_entry(db->expire_list.next,
+	while (!list_empty(&shard->expire_list)) {
+		buffer = list_entry(shard->expire_list.next,
 				struct reassembly_buffer,
 				list_hook);
 
-		if (time_after(buffer->dying_time, jiffies)) {
-			spin_unlock_bh(&db->lock);
-			log_debug("Deleted %u reassembly buffers.", b);
-			return;
-		}
+		if (time_after(buffer->dying_time, jiffies))
+			break;
 
-		buffer_destroy(db, buffer, &buffer->pkt);
+		inc_stats(&buffer->pkt, IPSTATS_MIB_REASMTIMEOUT);
+		jstat_inc(db->stats, JSTAT_FRAG_TIMEOUT);
+		trace_jool_frag_expire(&buffer->pkt);
+		buffer_destroy(db, shard, buffer, &buffer->pkt);
 		b++;
 	}
 
-	spin_unlock_bh(&db->lock);
+	while (!list_empty(&shard->flow_list)) {
+		flow = list_entry(shard->flow_list.next, struct virtual_flow,
+				list_hook);
+		if (time_after(flow->dying_time, jiffies))
+			break;
+
+		jstat_inc(db->stats, JSTAT_FRAG_TIMEOUT);
+		flow_destroy(db, shard, flow);
+		b++;
+	}
+
+	evict(db, shard, NULL);
+
+	spin_unlock_bh(&shard->lock);
+	return b;
+}
+
+void fragdb_clean(struct fragdb *db)
+{
+	struct fragdb_shard *shards;
+	unsigned int b = 0;
+	unsigned int i;
+
+	shards = READ_ONCE(db->shards);
+	if (!shards)
+		return;
+
+	for (i = 0; i < FRAGDB_SHARDS; i++)
+		b += clean_shard(db, &shards[i]);
+
+	log_debug("Deleted %u reassembly buffers.", b);
+}
+
+/**
+ * Returns the jiffy at which the next fragdb_clean() will have something to
+ * do. Buffers created later can't die any sooner, because they all share the
+ * same timeout.
+ */
+unsigned long fragdb_next_clean(struct fragdb *db)
+{
+	struct fragdb_shard *shards;
+	struct fragdb_shard *shard;
+	struct reassembly_buffer *buffer;
+	struct virtual_flow *flow;
+	unsigned long next;
+	unsigned int i;
+
+	next = jiffies + READ_ONCE(db->timeout);
+	shards = READ_ONCE(db->shards);
+	if (!shards)
+		return next;
+
+	for (i = 0; i < FRAGDB_SHARDS; i++) {
+		shard = &shards[i];
+		spin_lock_bh(&shard->lock);
+
+		if (!list_empty(&shard->expire_list)) {
+			buffer = list_first_entry(&shard->expire_list,
+					struct reassembly_buffer, list_hook);
+			if (time_before(buffer->dying_time, next))
+				next = buffer->dying_time;
+		}
+		if (!list_empty(&shard->flow_list)) {
+			flow = list_first_entry(&shard->flow_list,
+					struct virtual_flow, list_hook);
+			if (time_before(flow->dying_time, next))
+				next = flow->dying_time;
+		}
+
+		spin_unlock_bh(&shard->lock);
+	}
+
+	return next;
 }
 
 #define COMMON_MSG " I will not be able to translate; aborting.\n" \
@@ -348,6 +815,219 @@ static int validate_skb(struct sk_buff *skb)
 }
 #undef COMMON_MSG
 
+/**
+ * Translates @skb, a subsequent fragment whose first fragment was translated
+ * into @tmpl, and sends the result.
+ * Does not release @skb.
+ */
+static int xlat_subsequent(struct sk_buff *skb, struct iphdr *tmpl)
+{
+	struct packet in;
+	struct sk_buff *out;
+	struct iphdr *hdr4;
+	struct frag_hdr *hdr_frag;
+	struct route4_args args;
+	struct dst_entry *dst;
+	unsigned int hdrs_len;
+	unsigned int payload_len;
+	__u8 hop_limit;
+	int error;
+
+	error = pkt_init_ipv6(&in, skb);
+	if (error)
+		return error;
+
+	hop_limit = pkt_ip6_hdr(&in)->hop_limit;
+	if (hop_limit <= 1) {
+		log_debug("Fragment's hop limit expired.");
+		return -EINVAL;
+	}
+
+	hdr_frag = pkt_frag_hdr(&in);
+	hdrs_len = pkt_hdrs_len(&in);
+	payload_len = skb->len - hdrs_len;
+
+	out = alloc_skb(LL_MAX_HEADER + sizeof(*hdr4) + payload_len, GFP_ATOMIC);
+	if (!out) {
+		inc_stats(&in, IPSTATS_MIB_INDISCARDS);
+		return -ENOMEM;
+	}
+
+	skb_reserve(out, LL_MAX_HEADER);
+	skb_reset_network_header(out);
+	hdr4 = (struct iphdr *)skb_put(out, sizeof(*hdr4));
+	error = skb_copy_bits(skb, hdrs_len, skb_put(out, payload_len),
+			payload_len);
+	if (error) {
+		log_debug("The payload copy threw errcode %d.", error);
+		goto fail;
+	}
+
+	*hdr4 = *tmpl;
+	hdr4->tot_len = cpu_to_be16(sizeof(*hdr4) + payload_len);
+	hdr4->ttl = hop_limit - 1;
+	hdr4->frag_off = build_ipv4_frag_off_field(0,
+			is_mf_set_ipv6(hdr_frag),
+			get_fragment_offset_ipv6(hdr_frag));
+	hdr4->check = 0;
+	hdr4->check = ip_fast_csum(hdr4, hdr4->ihl);
+
+	out->protocol = htons(ETH_P_IP);
+	out->mark = skb->mark;
+
+	args.ns = dev_net(skb->dev);
+	args.daddr.s_addr = hdr4->daddr;
+	args.tos = hdr4->tos;
+	args.proto = hdr4->protocol;
+	args.mark = out->mark;
+	dst = __route4(&args, out);
+	if (!dst) {
+		error = -EHOSTUNREACH;
+		goto fail;
+	}
+	out->dev = dst->dev;
+
+#if LINUX_VERSION_AT_LEAST(3, 16, 0, 7, 2)
+	out->ignore_df = true;
+#else
+	out->local_df = true;
+#endif
+
+#if LINUX_VERSION_AT_LEAST(4, 4, 0, 9999, 0)
+	error = dst_output(args.ns, NULL, out);
+#else
+	error = dst_output(out);
+#endif
+	if (error)
+		log_debug("dst_output() returned errcode %d.", error);
+	return error;
+
+fail:
+	kfree_skb(out);
+	return error;
+}
+
+/**
+ * fragdb_handle()'s virtual reassembly mode. The skb is either stolen (and
+ * translated or queued) or passed on to the rest of the pipeline, so it can
+ * be translated normally. (Only first fragments take the latter route.)
+ */
+/**
+ * Without nf_defrag_ipv6, nobody sorts the fragments, and the reassembly
+ * buffers can't cope with that. Virtual reassembly doesn't care about order.
+ */
+static bool is_virtual(struct fragdb *db)
+{
+	return !kernel_defrag || READ_ONCE(db->virtual_reassembly);
+}
+
+static verdict handle_virtual(struct fragdb *db, struct fragdb_shard *shards,
+		struct packet *pkt)
+{
+	struct vflow_key key;
+	struct virtual_flow *flow;
+	struct fragdb_shard *shard;
+	struct iphdr hdr4;
+
+	vflow_key_init(&key, pkt);
+	shard = get_shard(shards, pkt);
+	spin_lock_bh(&shard->lock);
+
+	flow = vflow_table_get(&shard->flows, &key);
+	if (!flow) {
+		flow = flow_add(db, shard, &key);
+		if (!flow) {
+			spin_unlock_bh(&shard->lock);
+			return VERDICT_DROP;
+		}
+	}
+
+	if (is_first_frag6(pkt_frag_hdr(pkt))) {
+		/* fragdb_resolve() will take it from here. */
+		spin_unlock_bh(&shard->lock);
+		return VERDICT_CONTINUE;
+	}
+
+	if (!flow->resolved) {
+		log_debug("The first fragment hasn't arrived yet; queuing.");
+		__skb_queue_tail(&flow->pending, pkt->skb);
+		flow->mem += pkt->skb->truesize;
+		atomic_long_add(pkt->skb->truesize, &db->mem);
+		evict(db, shard, flow);
+		spin_unlock_bh(&shard->lock);
+		return VERDICT_STOLEN;
+	}
+
+	hdr4 = flow->hdr4;
+	spin_unlock_bh(&shard->lock);
+
+	if (xlat_subsequent(pkt->skb, &hdr4))
+		return VERDICT_DROP;
+
+	kfree_skb(pkt->skb);
+	return VERDICT_STOLEN;
+}
+
+/**
+ * Called after @state->in has been translated into @state->out, but before
+ * the latter is sent. If @state->in is the first fragment of a packet being
+ * virtually reassembled, this remembers @state->out's header so the rest of
+ * the fragments can use it, and translates the ones that were waiting for it.
+ */
+void fragdb_resolve(struct fragdb *db, struct xlation *state)
+{
+	struct packet *in = &state->in;
+	struct frag_hdr *hdr_frag;
+	struct fragdb_shard *shards;
+	struct fragdb_shard *shard;
+	struct vflow_key key;
+	struct virtual_flow *flow;
+	struct sk_buff_head pending;
+	struct sk_buff *skb;
+	struct iphdr hdr4;
+
+	if (!is_virtual(db))
+		return;
+	if (pkt_l3_proto(in) != L3PROTO_IPV6)
+		return;
+	hdr_frag = pkt_frag_hdr(in);
+	if (!hdr_frag || !is_fragmented_ipv6(hdr_frag))
+		return;
+
+	/* No shards, no flows. */
+	shards = READ_ONCE(db->shards);
+	if (!shards)
+		return;
+
+	vflow_key_init(&key, in);
+	__skb_queue_head_init(&pending);
+	hdr4 = *pkt_ip4_hdr(&state->out);
+
+	shard = get_shard(shards, in);
+	spin_lock_bh(&shard->lock);
+
+	flow = vflow_table_get(&shard->flows, &key);
+	if (!flow) {
+		/* Evicted, or the mode was just enabled. */
+		spin_unlock_bh(&shard->lock);
+		return;
+	}
+
+	flow->hdr4 = hdr4;
+	flow->resolved = true;
+	skb_queue_splice_init(&flow->pending, &pending);
+	atomic_long_sub(flow->mem - sizeof(*flow), &db->mem);
+	flow->mem = sizeof(*flow);
+
+	spin_unlock_bh(&shard->lock);
+
+	while ((skb = __skb_dequeue(&pending)) != NULL) {
+		log_debug("Translating a queued fragment.");
+		xlat_subsequent(skb, &hdr4);
+		kfree_skb(skb);
+	}
+}
+
 /**
  * Groups "skb_in" with the rest of its fragments.
  * If the rest of the fragments have not yet arrived, this will return
@@ -360,6 +1040,8 @@ verdict fragdb_handle(struct fragdb *db, struct packet *pkt)
 {
 	/* The fragment collector skb belongs to. */
 	struct reassembly_buffer *buffer;
+	struct fragdb_shard *shards;
+	struct fragdb_shard *shard;
 	struct frag_hdr *hdr_frag = pkt_frag_hdr(pkt);
 	int error;
 
@@ -368,13 +1050,16 @@ verdict fragdb_handle(struct fragdb *db, struct packet *pkt)
 
 	/*
 	 * Because the packet *is* fragmented, we know we're being compiled in
-	 * kernel 3.12 or lower at this point.
+	 * kernel 3.12 or lower at this point, or nf_defrag_ipv6 is out of the
+	 * picture.
 	 * (Other defragmenters conceal the fragment header, effectively
 	 * pretending there's no fragmentation.)
 	 */
 #if LINUX_VERSION_AT_LEAST(3, 13, 0, 7, 0)
-	log_debug("This code is supposed to be unreachable in kernels 3.13+!");
-	return VERDICT_DROP;
+	if (kernel_defrag) {
+		log_debug("This code is supposed to be unreachable in kernels 3.13+!");
+		return VERDICT_DROP;
+	}
 #endif
 
 	log_debug("Adding fragment to database.");
@@ -383,13 +1068,22 @@ verdict fragdb_handle(struct fragdb *db, struct packet *pkt)
 	if (error)
 		return VERDICT_DROP;
 
-	spin_lock_bh(&db->lock);
+	shards = get_shards(db);
+	if (!shards)
+		return VERDICT_DROP;
+
+	if (is_virtual(db))
+		return handle_virtual(db, shards, pkt);
+
+	shard = get_shard(shards, pkt);
+	spin_lock_bh(&shard->lock);
 
-	buffer = add_pkt(db, pkt);
+	buffer = add_pkt(db, shard, pkt);
 	if (!buffer) {
-		spin_unlock_bh(&db->lock);
+		spin_unlock_bh(&shard->lock);
 		return VERDICT_DROP;
 	}
+	evict(db, shard, buffer);
 
 	/*
 	 * nf_defrag_ipv6 is supposed to sort the fragments, so this condition
@@ -400,7 +1094,7 @@ verdict fragdb_handle(struct fragdb *db, struct packet *pkt)
 	 * that in Jool 3.2, so you might be able to reuse it.
 	 */
 	if (is_mf_set_ipv6(hdr_frag)) {
-		spin_unlock_bh(&db->lock);
+		spin_unlock_bh(&shard->lock);
 		return VERDICT_STOLEN;
 	}
 
@@ -408,8 +1102,8 @@ verdict fragdb_handle(struct fragdb *db, struct packet *pkt)
 	pkt->original_pkt = pkt;
 	buffer->pkt.skb = NULL;
 	/* Note, at this point, buffer->pkt is invalid. Do not use. */
-	buffer_destroy(db, buffer, pkt);
-	spin_unlock_bh(&db->lock);
+	buffer_destroy(db, shard, buffer, pkt);
+	spin_unlock_bh(&shard->lock);
 
 	if (!skb_make_writable(pkt->skb, pkt_l3hdr_len(pkt)))
 		return VERDICT_DROP;
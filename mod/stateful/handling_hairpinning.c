@@ -1,5 +1,9 @@
 #include "nat64/mod/common/handling_hairpinning.h"
 
+#include <net/checksum.h>
+#include "nat64/mod/common/icmp_wrapper.h"
+#include "nat64/mod/common/route.h"
+#include "nat64/mod/common/rfc6145/6to4.h"
 #include "nat64/mod/common/rfc6145/core.h"
 #include "nat64/mod/common/send_packet.h"
 #include "nat64/mod/stateful/compute_outgoing_tuple.h"
@@ -49,6 +53,7 @@ verdict handling_hairpinning(struct xlation *old)
 	xlation_init(&new);
 	new.jool = old->jool;
 	new.in = old->out;
+	new.route_hint = old->route_hint;
 
 	result = filtering_and_updating(&new);
 	if (result != VERDICT_CONTINUE)
@@ -66,3 +71,225 @@ verdict handling_hairpinning(struct xlation *old)
 	log_debug("Done step 5.");
 	return VERDICT_CONTINUE;
 }
+
+/**
+ * Can @state (a hairpin whose outgoing tuple has already been computed) skip
+ * the trip through IPv4? See handling_hairpinning_direct().
+ *
+ * Anything that would need the intermediate IPv4 packet for something other
+ * than its tuple is left to handling_hairpinning():
+ *
+ * - ICMP, because errors need their inner packets translated.
+ * - Fragments and extension headers, because the IPv4 leg would change them.
+ * - TCP SYNs, because they might need to be stored (Simultaneous Open).
+ * - Hop limits the double translation would exhaust, since they need ICMP
+ *   errors.
+ */
+bool can_hairpin_directly(struct xlation *state)
+{
+	struct packet *in = &state->in;
+	struct ipv6hdr *hdr = pkt_ip6_hdr(in);
+
+	if (pkt_original_pkt(in) != in || skb_shared(in->skb))
+		return false;
+	if (pkt_frag_hdr(in) || hdr->hop_limit <= 2)
+		return false;
+
+	switch (pkt_l4_proto(in)) {
+	case L4PROTO_TCP:
+		return hdr->nexthdr == NEXTHDR_TCP && !pkt_tcp_hdr(in)->syn;
+	case L4PROTO_UDP:
+		return hdr->nexthdr == NEXTHDR_UDP;
+	default:
+		return false;
+	}
+}
+
+/**
+ * The bytes handling_hairpinning_direct() overrides, so it can give the packet
+ * back if it turns out it cannot send it.
+ */
+struct hairpin_backup {
+	struct ipv6hdr hdr6;
+	union {
+		struct tcphdr tcp;
+		struct udphdr udp;
+	} l4;
+	__u8 ip_summed;
+	__wsum csum;
+};
+
+static void backup_hdrs(struct packet *pkt, struct hairpin_backup *backup)
+{
+	struct sk_buff *skb = pkt->skb;
+
+	memcpy(&backup->hdr6, ipv6_hdr(skb), sizeof(backup->hdr6));
+	if (pkt_l4_proto(pkt) == L4PROTO_TCP)
+		memcpy(&backup->l4.tcp, tcp_hdr(skb), sizeof(backup->l4.tcp));
+	else
+		memcpy(&backup->l4.udp, udp_hdr(skb), sizeof(backup->l4.udp));
+	backup->ip_summed = skb->ip_summed;
+	backup->csum = skb->csum;
+}
+
+static void restore_hdrs(struct packet *pkt, struct hairpin_backup *backup)
+{
+	struct sk_buff *skb = pkt->skb;
+
+	memcpy(ipv6_hdr(skb), &backup->hdr6, sizeof(backup->hdr6));
+	if (pkt_l4_proto(pkt) == L4PROTO_TCP)
+		memcpy(tcp_hdr(skb), &backup->l4.tcp, sizeof(backup->l4.tcp));
+	else
+		memcpy(udp_hdr(skb), &backup->l4.udp, sizeof(backup->l4.udp));
+	skb->ip_summed = backup->ip_summed;
+	skb->csum = backup->csum;
+	skb_dst_drop(skb);
+}
+
+static void rewrite_ports(struct sk_buff *skb, __sum16 *check,
+		__be16 *src, __be16 *dst, struct tuple *tuple)
+{
+	__be16 new_src = cpu_to_be16(tuple->src.addr6.l4);
+	__be16 new_dst = cpu_to_be16(tuple->dst.addr6.l4);
+
+	inet_proto_csum_replace2(check, skb, *src, new_src, false);
+	inet_proto_csum_replace2(check, skb, *dst, new_dst, false);
+	*src = new_src;
+	*dst = new_dst;
+}
+
+/**
+ * Turns @pkt into the packet the IPv6 -> IPv4 -> IPv6 translation would have
+ * yielded: @tuple's addresses and ports, the traffic class both legs would have
+ * computed, no flow label, and the hop limit decremented twice.
+ */
+static void rewrite_hdrs(struct xlation *state, struct packet *pkt,
+		struct tuple *tuple)
+{
+	struct global_config_usr *cfg = &state->jool.global->cfg;
+	struct sk_buff *skb = pkt->skb;
+	struct ipv6hdr *hdr6 = ipv6_hdr(skb);
+	struct tcphdr *tcp;
+	struct udphdr *udp;
+	__sum16 *check;
+	__u8 tclass;
+
+	tclass = cfg->reset_traffic_class ? 0 : ttp64_xlat_tos(cfg, hdr6);
+	hdr6->priority = tclass >> 4;
+	hdr6->flow_lbl[0] = tclass << 4;
+	hdr6->flow_lbl[1] = 0;
+	hdr6->flow_lbl[2] = 0;
+	hdr6->hop_limit -= 2;
+
+	switch (pkt_l4_proto(pkt)) {
+	case L4PROTO_TCP:
+		tcp = tcp_hdr(skb);
+		check = &tcp->check;
+		rewrite_ports(skb, check, &tcp->source, &tcp->dest, tuple);
+		break;
+	default: /* UDP */
+		udp = udp_hdr(skb);
+		check = &udp->check;
+		rewrite_ports(skb, check, &udp->source, &udp->dest, tuple);
+		break;
+	}
+
+	inet_proto_csum_replace16(check, skb, hdr6->saddr.s6_addr32,
+			tuple->src.addr6.l3.s6_addr32, true);
+	inet_proto_csum_replace16(check, skb, hdr6->daddr.s6_addr32,
+			tuple->dst.addr6.l3.s6_addr32, true);
+	hdr6->saddr = tuple->src.addr6.l3;
+	hdr6->daddr = tuple->dst.addr6.l3;
+
+	if (pkt_l4_proto(pkt) == L4PROTO_UDP && skb->ip_summed != CHECKSUM_PARTIAL
+			&& !*check)
+		*check = CSUM_MANGLED_0;
+
+	/* The IPv6 header is part of the NIC's sum, and it just changed. */
+	if (skb->ip_summed == CHECKSUM_COMPLETE)
+		skb->ip_summed = CHECKSUM_NONE;
+}
+
+/**
+ * Same as handling_hairpinning(), except it doesn't create (nor translate) the
+ * intermediate IPv4 packet; the IPv4 leg's filtering and tuple computation
+ * only need its tuple, so the original packet is rewritten into the final one
+ * in one go. The caller should have already checked can_hairpin_directly().
+ *
+ * Once the packet is handed to sendpkt_send(), @old->in no longer has an skb.
+ */
+verdict handling_hairpinning_direct(struct xlation *old)
+{
+	struct xlation new;
+	struct packet *pkt = &old->in;
+	struct sk_buff *skb = pkt->skb;
+	struct hairpin_backup backup;
+	struct dst_entry *dst;
+	unsigned int len;
+	verdict result;
+
+	log_debug("Step 5: Handling Hairpinning (directly)...");
+
+	/* The IPv4 leg, except @new.in is just a tuple with a TCP header. */
+	xlation_init(&new);
+	new.jool = old->jool;
+	new.in = old->in;
+	new.in.tuple = old->out.tuple;
+	new.in.l3_proto = L3PROTO_IPV4;
+	new.in.original_pkt = pkt;
+	new.route_hint = old->route_hint;
+
+	result = filtering_and_updating(&new);
+	if (result != VERDICT_CONTINUE)
+		return result;
+	result = compute_out_tuple(&new);
+	if (result != VERDICT_CONTINUE)
+		return result;
+
+	/* The headers were pulled; this makes them writable if cloned. */
+	if (skb_cow_head(skb, 0)) {
+		inc_stats(pkt, IPSTATS_MIB_INDISCARDS);
+		return VERDICT_DROP;
+	}
+
+	backup_hdrs(pkt, &backup);
+	skb_dst_drop(skb);
+	rewrite_hdrs(old, pkt, &new.out.tuple);
+
+	/* Only the outgoing packet matters from now on. */
+	new.in = old->in;
+	pkt_fill(&new.out, skb, L3PROTO_IPV6, pkt_l4_proto(pkt), NULL,
+			pkt_payload(pkt), pkt);
+
+	dst = route_hinted(old->jool.ns, &new.out, new.route_hint);
+	if (!dst) {
+		restore_hdrs(pkt, &backup);
+		return VERDICT_ACCEPT;
+	}
+
+	len = skb_is_gso(skb)
+			? (pkt_hdrs_len(pkt) + skb_shinfo(skb)->gso_size)
+			: skb->len;
+	if (len > dst_mtu(dst)) {
+		log_debug("Packet is too big (len: %u, mtu: %u).", len,
+				dst_mtu(dst));
+		restore_hdrs(pkt, &backup);
+		icmp64_send(old->jool.stats, pkt, ICMPERR_FRAG_NEEDED,
+				dst_mtu(dst));
+		return VERDICT_DROP;
+	}
+
+	/* We're going out through a different path, so forget the old one. */
+	skb_orphan(skb);
+	nf_reset(skb);
+	memset(skb->cb, 0, sizeof(skb->cb));
+
+	/* sendpkt_send() releases the skb regardless of verdict. */
+	result = sendpkt_send(&new);
+	pkt->skb = NULL;
+	if (result != VERDICT_CONTINUE)
+		return result;
+
+	log_debug("Done step 5.");
+	return VERDICT_CONTINUE;
+}
@@ -47,6 +47,12 @@ bool blacklist_contains(struct addr4_pool *pool, struct in_addr *addr)
 	return false;
 }
 
+bool blacklist_is_empty(struct addr4_pool *pool)
+{
+	fail(__func__);
+	return true;
+}
+
 struct addr4_pool *rfc6791_alloc(void)
 {
 	fail(__func__);
@@ -113,17 +119,38 @@ bool eamt_contains4(struct eam_table *eamt, __be32 addr)
 }
 
 int eamt_xlat_4to6(struct eam_table *eamt, struct in_addr *addr4,
-		struct in6_addr *result)
+		struct in6_addr *result, unsigned int len)
 {
 	return fail(__func__);
 }
 
 int eamt_xlat_6to4(struct eam_table *eamt, struct in6_addr *addr6,
-		struct in_addr *result)
+		struct in_addr *result, unsigned int len)
 {
 	return fail(__func__);
 }
 
+bool eamt_clat_6to4(struct eam_table *eamt, struct in6_addr *saddr6,
+		struct in6_addr *daddr6, __be32 *saddr, __be32 *daddr,
+		unsigned int len)
+{
+	fail(__func__);
+	return false;
+}
+
+bool eamt_clat_4to6(struct eam_table *eamt, __be32 saddr, __be32 daddr,
+		struct in6_addr *saddr6, struct in6_addr *daddr6,
+		unsigned int len)
+{
+	fail(__func__);
+	return false;
+}
+
+void eamt_clat_refresh(struct eam_table *eamt, struct ipv6_prefix *prefix6)
+{
+	fail(__func__);
+}
+
 int eamt_foreach(struct eam_table *eamt,
 		int (*cb)(struct eamt_entry *, void *), void *arg,
 		struct ipv4_prefix *offset)
@@ -131,6 +158,13 @@ int eamt_foreach(struct eam_table *eamt,
 	return fail(__func__);
 }
 
+int eamt_foreach_usr(struct eam_table *eamt,
+		int (*cb)(struct eamt_entry_usr *, void *), void *arg,
+		struct ipv4_prefix *offset, bool reset)
+{
+	return fail(__func__);
+}
+
 int eamt_count(struct eam_table *eamt, __u64 *count)
 {
 	return fail(__func__);
@@ -2,16 +2,74 @@
 
 #include "nat64/common/constants.h"
 #include "nat64/common/str_utils.h"
+#include "nat64/mod/common/address.h"
+#include "nat64/mod/common/linux_version.h"
+#include "nat64/mod/common/rfc6052.h"
+#include "nat64/mod/common/trace.h"
 #include "nat64/mod/common/wkmalloc.h"
 #include "nat64/mod/common/xlator.h"
 #include "nat64/mod/common/nl/nl_core2.h"
+#include "nat64/mod/stateful/joold_socket.h"
 #include "nat64/mod/stateful/bib/db.h"
 
+#include <linux/hrtimer.h>
 #include <linux/inet.h>
+#include <linux/jhash.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+
+/**
+ * Number of slots in joold_queue.synced. Has to be a power of two.
+ */
+#define JOOLD_SYNCED_SLOTS 256
+/**
+ * A session the peers were told about less than this amount of jiffies ago is
+ * refreshed with a TOUCH record. Otherwise it's sent whole again, in case the
+ * peers missed it.
+ */
+#define JOOLD_COMPACT_REFRESH msecs_to_jiffies(10000)
+/**
+ * Seconds' worth of --ss-advertise-rate an idle advertisement can save up.
+ * Once it runs out of budget, it only resumes on the next timer tick, so this
+ * should be at least the timer's period. (See timer.c.)
+ */
+#define JOOLD_ADVERTISE_BURST 2
+/**
+ * Maximum number of incoming sessions handed to the database at once.
+ * (A typical packet carries less than this.)
+ */
+#define JOOLD_ADD_BATCH 32
+/**
+ * Number of sessions each CPU can stage before it has to hand them over to the
+ * queue.
+ */
+#define JOOLD_STAGE_SIZE 16
+/** Bit of joold_queue.flush_armed. */
+#define JOOLD_FLUSH_ARMED 0
+
+/**
+ * Sessions translated by one CPU, waiting to be moved into the queue.
+ *
+ * joold_add() runs on every translated packet, so it only touches its own
+ * CPU's stage. @lock is only ever contended by the flushes, which drain every
+ * CPU's stage while holding the queue's lock.
+ */
+struct joold_stage {
+	struct session_entry sessions[JOOLD_STAGE_SIZE];
+	unsigned int count;
+	spinlock_t lock;
+};
 
 struct joold_advertise_struct {
 	struct taddr4_tuple offset;
 	struct nlcore_buffer *buffer;
+	/** Number of sessions this packet can still take. */
+	unsigned int remaining;
+	/** Number of sessions written on the packet. */
+	unsigned int count;
+	/** If @windowed, sessions last updated before this jiffy are skipped. */
+	unsigned long since;
+	bool windowed;
 };
 
 /*
@@ -23,31 +81,115 @@ struct joold_advertise_struct {
 
 struct joold_queue {
 	/**
-	 * Sessions so far listed to be sent to the daemon.
+	 * Multicast message the sessions are serialized into as they arrive,
+	 * so sending them doesn't involve any copying.
+	 * Sessions only fall back to @sessions when this is full, or when
+	 * @sessions is not empty (so they are still sent in order).
+	 */
+	struct nlcore_mcast pending;
+	/** Number of sessions in @pending. */
+	unsigned int pending_count;
+	/**
+	 * Is @pending an OP_UPDATE (compact encoding) message?
+	 * (Otherwise it's an OP_ADD one.) Only meaningful while @pending
+	 * exists; @config.compact is only checked when it's created.
+	 */
+	bool pending_compact;
+	/**
+	 * Sessions recently sent whole in compact messages, indexed by their
+	 * hash. It does not need to be exact; a collision only costs a few
+	 * bytes, or a TOUCH the peers don't know what to do with until the
+	 * next refresh.
+	 */
+	struct {
+		/** joold_key() of the session. */
+		u32 key;
+		/** (Truncated) jiffy at which it was sent whole. */
+		u32 time;
+	} synced[JOOLD_SYNCED_SLOTS];
+
+	/**
+	 * Sessions that didn't make it into @pending.
 	 *
-	 * TODO (performance) this might be slightly optimizable, but I don't
-	 * care enough at the moment.
-	 * Sessions are accumulated in this list. When the module decides it
-	 * needs to send them, it copies them to a buffer (so they can be fed to
-	 * the nl core module), and then nl core copies that into an skb.
-	 * Instead of adding to a list, we should probably build the buffer
-	 * directly (or the skb).
-	 * On the downside, this might mean the spinlock would need to be held
-	 * for longer times (as the list splicing is very fast and cheap
-	 * currently).
+	 * When the module decides it needs to send them, it copies them to a
+	 * buffer (so they can be fed to the nl core module), and then nl core
+	 * copies that into an skb.
 	 */
 	struct list_head sessions;
-	/** Number of nodes in @sessions. */
+	/** Number of nodes in @sessions, plus @pending_count. */
 	unsigned int count;
-	/** Number of advertisement nodes in @sessions. */
-	unsigned int advertisement_count;
 
 	/**
-	 * Can we send a packet?
+	 * The user issued an --advertise, so the whole database needs to be
+	 * transmitted.
+	 * A typical table won't fit in a single packet, so this is a
+	 * background job which sends a chunk whenever the window has room
+	 * for it and there are no regular sessions waiting. It keeps track of
+	 * what is yet to be sent.
+	 */
+	struct {
+		/** Is there an advertisement in progress? */
+		bool active;
+		/** Protocol table currently being sent. */
+		l4_protocol proto;
+		/** IPv4 ID of the next session to send. */
+		struct taddr4_tuple offset;
+		/**
+		 * true - @offset above is valid.
+		 * false - no sessions from @proto have been sent.
+		 */
+		bool offset_set;
+		/** Sessions sent so far. */
+		__u64 sent;
+		/** (Approximate) number of sessions to send. */
+		__u64 total;
+		/**
+		 * Sessions that can still be sent before --ss-advertise-rate
+		 * kicks in.
+		 */
+		unsigned int budget;
+		/** Jiffy at which @budget was last refilled. */
+		unsigned long budget_time;
+		/**
+		 * The advertisement is over, but the peers still need to be
+		 * told. (See build_adv_end().)
+		 */
+		bool end_pending;
+		/**
+		 * true - only the sessions updated since @since are being
+		 * sent. (A peer lost some of our messages.)
+		 * false - everything is being sent.
+		 */
+		bool windowed;
+		unsigned long since;
+	} adv;
+
+	/**
+	 * What arrived from the peers. Only used to tell the user whether this
+	 * instance has caught up. (See joold_status().)
+	 */
+	struct {
+		__u64 sessions;
+		__u64 messages;
+		/** Jiffy at which the last message arrived. */
+		unsigned long last_time;
+		/** Number of OP_ADVERTISE_ENDs received. */
+		__u64 advertisements;
+		/** Sessions the last of them claimed. */
+		__u64 advertised;
+		/** Jiffy at which the last of them arrived. */
+		unsigned long last_adv_time;
+	} peers;
+
+	/**
+	 * Number of packets sent whose ACKs haven't arrived yet.
 	 * We need to wait for ACKs because the kernel can't handle too many
-	 * Netlink messages at once.
+	 * Netlink messages at once, but the user can allow up to
+	 * @config.window of them to be in flight at the same time.
 	 */
-	bool ack_received;
+	unsigned int in_flight;
+	/** Sequence number the next packet will be sent with. */
+	__u16 next_seq;
 	/**
 	 * Jiffy at which the last batch of sessions was sent.
 	 * If the ACK was lost for some reason, this should get us back on
@@ -55,114 +197,133 @@ struct joold_queue {
 	 */
 	unsigned long last_flush_time;
 
+	/**
+	 * Sends the sessions once @config.flush_deadline expires, in case no
+	 * packet or ACK does it first. (See arm_flush_timer().)
+	 */
+	struct hrtimer flush_timer;
+	/** @flush_timer fires in interrupt context; this does the flushing. */
+	struct work_struct flush_work;
+	/**
+	 * JOOLD_FLUSH_ARMED is set from the moment @flush_timer is armed until
+	 * @flush_work is done, so there's never more than one of them in play.
+	 */
+	unsigned long flush_armed;
+
 	/* User-defined values (--global). */
 	struct joold_config config;
 
 	/** Namespace where the sessions will be multicasted. */
 	struct net *ns;
+	/**
+	 * If not NULL, the sessions are sent to the peers through this instead
+	 * of multicasted to the daemon. (See joold_bind().)
+	 */
+	struct joold_socket *sock;
+
+	/** Per-CPU sessions that haven't reached @pending or @sessions yet. */
+	struct joold_stage __percpu *stages;
 
 	spinlock_t lock;
 	struct kref refs;
 };
 
 /**
- * Subset of fields from struct session_entry which need to be synchronized
- * across Jool instances.
- *
- * Note: Careful with the layout of this structure! It's currently padded and
- * packed to fit in exactly 64 bytes.
- * http://www.catb.org/esr/structure-packing/
+ * First thing in the payload of an OP_UPDATE (compact encoding) message.
+ * It's followed by as many struct joold_records as fit.
  */
-struct joold_session {
+struct joold_compact_hdr {
+	/** Always JOOLD_COMPACT_VERSION, for now. */
+	__u8 version;
+	__u8 reserved[3];
+};
 
+#define JOOLD_COMPACT_VERSION 1
+
+enum joold_record_type {
 	/**
-	 * This is not actually the same as session_entry->update_time.
-	 * session_entry->update_time is the time at which the session was last
-	 * updated.
-	 * This update_time is the age of the session's last update.
-	 * We do this so we don't have to ask the user to synchronize clocks.
-	 * (We're assuming the session will travel to the other Jools
-	 * instantaneously.)
-	 *
-	 * Also, session->entry->update time is measured in jiffies.
-	 * This one is measured in milliseconds.
+	 * Only the session's IPv4 side, state and update time.
+	 * Refreshes a session the peers already know.
 	 */
-	__be64 update_time;
+	JOOLD_REC_TOUCH = 1,
+	/**
+	 * Everything except the destination IPv6 address, which is computed
+	 * out of the destination IPv4 address and pool6.
+	 */
+	JOOLD_REC_NEW,
+	/** Everything. */
+	JOOLD_REC_FULL,
+};
 
-	/* Exactly 8 bytes so far. */
+/**
+ * The compact, variable length, version of struct joold_session.
+ * Records only span the fields their @type needs; see joold_record_len().
+ * They are all multiples of 4 bytes, so every record stays aligned.
+ */
+struct joold_record {
+	/* See enum joold_record_type. */
+	__u8 type;
+	__u8 l4_proto;
+	__u8 state;
+	__u8 timer_type;
+
+	/**
+	 * Same as joold_session.update_time, except 32 bits long.
+	 * (It's still measured in jiffies while the record is queued.)
+	 */
+	__be32 update_time;
 
-	struct in6_addr src6_addr;
-	struct in6_addr dst6_addr;
 	struct in_addr src4_addr;
 	struct in_addr dst4_addr;
-	__be16 src6_port;
-	__be16 dst6_port;
 	__be16 src4_port;
 	__be16 dst4_port;
 
-	/*
-	 * Exactly 56 bytes so far.
-	 * Notice that the following can be compressed further but there's no
-	 * point currently.
-	 */
+	/* Exactly 20 bytes so far; that's a TOUCH. */
 
-	__u8 l4_proto;
-	__u8 state;
-	/* See session_timer_type. */
-	__u8 timer_type;
+	struct in6_addr src6_addr;
+	__be16 src6_port;
+	/* (ICMP sessions' dst6 identifier differs from the dst4 one.) */
+	__be16 dst6_port;
 
-	/* Exactly 59 bytes so far. */
+	/* Exactly 40 bytes so far; that's a NEW. */
 
-	/**
-	 * Forces sizeof(struct joold_session) to be exacly 64 bytes.
-	 * If not present, sizeof yields me 60 in a 32-bit machine and 64 in a
-	 * 64-bit machine, which breaks compatibility.
-	 */
-	__u8 padding[5];
+	struct in6_addr dst6_addr;
+
+	/* Exactly 56 bytes; that's a FULL. */
 };
 
 /**
- * A session or group of sessions that need to be transmitted to other Jool
- * instances in the near future.
+ * Returns the number of bytes a record of type @type spans, or zero if @type is
+ * unknown.
+ */
+static size_t joold_record_len(__u8 type)
+{
+	switch (type) {
+	case JOOLD_REC_TOUCH:
+		return offsetof(struct joold_record, src6_addr);
+	case JOOLD_REC_NEW:
+		return offsetof(struct joold_record, dst6_addr);
+	case JOOLD_REC_FULL:
+		return sizeof(struct joold_record);
+	}
+
+	return 0;
+}
+
+/**
+ * A session that needs to be transmitted to other Jool instances in the near
+ * future. These are added whenever a translating packet updates a session.
  */
 struct joold_node {
-	/**
-	 * true - @group below is valid.
-	 * false - @single below is valid.
-	 */
-	bool is_group;
-	union {
-		/**
-		 * If @single is valid, this node represents a lone session.
-		 * These are added whenever a translating packet updates a
-		 * session.
-		 */
-		struct joold_session single;
-		/**
-		 * If @group is valid, the user issued an --advertise.
-		 * The whole database needs to be transmitted.
-		 * Unfortunately, a typical table won't fit in a single
-		 * packet so this node might stick for several iterations and
-		 * keep track of what is yet to be sent.
-		 */
-		struct {
-			/** IPv4 ID of the session sent in the last packet. */
-			struct taddr4_tuple offset;
-			/**
-			 * true - @offset above is valid.
-			 * false - @no sessions from this node have been sent.
-			 */
-			bool offset_set;
-			/** Protocol table this group belongs to. */
-			l4_protocol proto;
-		} group;
-	};
+	struct joold_session single;
 
 	/** List hook to joold_queue.sessions.  */
 	struct list_head nextprev;
 };
 
 static struct kmem_cache *node_cache;
+/** Runs the joold_queue.flush_works. */
+static struct workqueue_struct *flush_wq;
 
 /**
  * joold_setup - Initializes this module. Make sure you call this before other
@@ -170,6 +331,8 @@ static struct kmem_cache *node_cache;
  */
 int joold_setup(void)
 {
+	int error;
+
 	node_cache = kmem_cache_create("jool_joold_nodes",
 			sizeof(struct joold_node), 0, 0, NULL);
 	if (!node_cache) {
@@ -177,7 +340,24 @@ int joold_setup(void)
 		return -ENOMEM;
 	}
 
+	flush_wq = alloc_workqueue("jool_joold_flush", 0, 0);
+	if (!flush_wq) {
+		log_err("Could not allocate the joold flush workqueue.");
+		error = -ENOMEM;
+		goto wq_fail;
+	}
+
+	error = jsock_setup();
+	if (error)
+		goto jsock_fail;
+
 	return 0;
+
+jsock_fail:
+	destroy_workqueue(flush_wq);
+wq_fail:
+	kmem_cache_destroy(node_cache);
+	return error;
 }
 
 /**
@@ -185,32 +365,100 @@ int joold_setup(void)
  */
 void joold_teardown(void)
 {
+	/*
+	 * The pending flushes might release the last queues, which might hand
+	 * their sockets over to jsock's workqueue. So this goes first.
+	 */
+	destroy_workqueue(flush_wq);
+	jsock_teardown();
 	kmem_cache_destroy(node_cache);
 }
 
+/**
+ * Waits until the queues (and sockets) whose last references are already gone
+ * have been released. A dying namespace has to do this before it is freed:
+ * the queue drops its namespace reference as soon as it hands its socket to
+ * the workqueue, and the socket doesn't hold one of its own.
+ */
+void joold_barrier(void)
+{
+	/* Same order as joold_teardown(). */
+	flush_workqueue(flush_wq);
+	jsock_barrier();
+}
+
+/**
+ * Returns the number of sessions the advertisement can send right now.
+ */
+static unsigned int adv_budget(struct joold_queue *queue)
+{
+	unsigned int rate = queue->config.advertise_rate;
+	unsigned long elapsed;
+	u64 added;
+	u64 max;
+
+	if (!queue->adv.active)
+		return 0;
+	if (!rate)
+		return UINT_MAX;
+
+	elapsed = jiffies - queue->adv.budget_time;
+	added = div_u64((u64)rate * elapsed, HZ);
+	max = (u64)rate * JOOLD_ADVERTISE_BURST;
+
+	if (queue->adv.budget + added >= max) {
+		queue->adv.budget = min_t(u64, max, UINT_MAX);
+		queue->adv.budget_time = jiffies;
+	} else if (added) {
+		queue->adv.budget += added;
+		/* Don't lose the fraction of a session we didn't add. */
+		queue->adv.budget_time += div_u64(added * HZ, rate);
+	}
+
+	return queue->adv.budget;
+}
+
 static bool should_send(struct joold_queue *queue)
 {
 	unsigned long deadline;
 	unsigned int max_sessions;
+	bool adv_ready;
 
-	if (queue->count == 0)
+	adv_ready = adv_budget(queue) > 0 || queue->adv.end_pending;
+	if (queue->count == 0 && !adv_ready)
 		return false;
 
 	deadline = queue->config.flush_deadline;
-	if (time_before(queue->last_flush_time + deadline, jiffies))
+	if (time_before(queue->last_flush_time + deadline, jiffies)) {
+		/*
+		 * A full window this old means the ACKs were lost (or the
+		 * daemon stopped sending them). Start over, like joold_bind()
+		 * does, so @in_flight never outgrows the window. Otherwise the
+		 * 16-bit sequence arithmetic of joold_ack() would eventually
+		 * mistake stale ACKs for current ones.
+		 */
+		if (queue->in_flight >= queue->config.window)
+			queue->in_flight = 0;
 		return true;
+	}
 
-	if (!queue->ack_received)
+	if (queue->in_flight >= queue->config.window)
 		return false;
 
 	if (queue->config.flush_asap)
 		return true;
 
-	if (queue->advertisement_count > 0)
+	if (adv_ready)
+		return true;
+
+	/* @pending might not be able to take the next session. */
+	if (queue->pending.skb && queue->pending.room < (queue->pending_compact
+			? sizeof(struct joold_record)
+			: sizeof(struct joold_session)))
 		return true;
 
 	max_sessions = queue->config.max_payload / sizeof(struct joold_session);
-	return queue->count >= max_sessions;
+	return queue->count - queue->pending_count >= max_sessions;
 }
 
 static int write_single_node(struct joold_node *node,
@@ -235,94 +483,100 @@ static int write_single_node(struct joold_node *node,
 	return full;
 }
 
+/**
+ * Note: @out->update_time is left in jiffies.
+ */
+static void session_to_joold(struct session_entry *entry,
+		struct joold_session *out)
+{
+	out->update_time = cpu_to_be64(entry->update_time);
+	out->src6_addr = entry->src6.l3;
+	out->dst6_addr = entry->dst6.l3;
+	out->src4_addr = entry->src4.l3;
+	out->dst4_addr = entry->dst4.l3;
+	out->src6_port = cpu_to_be16(entry->src6.l4);
+	out->dst6_port = cpu_to_be16(entry->dst6.l4);
+	out->src4_port = cpu_to_be16(entry->src4.l4);
+	out->dst4_port = cpu_to_be16(entry->dst4.l4);
+	out->l4_proto = entry->proto;
+	out->state = entry->state;
+	out->timer_type = entry->timer_type;
+	memset(out->padding, 0, sizeof(out->padding));
+}
+
+/**
+ * Like session_to_joold(), except @out->update_time becomes the age of the
+ * session, in milliseconds. (Which is what sessions look like on the wire.)
+ */
+void joold_export(struct session_entry *entry, struct joold_session *out)
+{
+	session_to_joold(entry, out);
+	out->update_time = cpu_to_be64(jiffies_to_msecs(jiffies
+			- entry->update_time));
+}
+
 static int foreach_cb(struct session_entry *entry, void *arg)
 {
 	int status;
 	struct joold_advertise_struct *adv = arg;
 	struct joold_session session;
-	__u64 update_time;
-
-	update_time = jiffies_to_msecs(jiffies - entry->update_time);
-	session.update_time = cpu_to_be64(update_time);
 
-	session.src6_addr = entry->src6.l3;
-	session.dst6_addr = entry->dst6.l3;
-	session.src4_addr = entry->src4.l3;
-	session.dst4_addr = entry->dst4.l3;
-	session.src6_port = cpu_to_be16(entry->src6.l4);
-	session.dst6_port = cpu_to_be16(entry->dst6.l4);
-	session.src4_port = cpu_to_be16(entry->src4.l4);
-	session.dst4_port = cpu_to_be16(entry->dst4.l4);
+	if (adv->remaining == 0) {
+		status = 1;
+		goto stop;
+	}
+	/* The peer already has it, unless it was in one of the lost messages. */
+	if (adv->windowed && time_before(entry->update_time, adv->since))
+		return 0;
 
-	session.l4_proto = entry->proto;
-	session.state = entry->state;
-	session.timer_type = entry->timer_type;
-	memset(session.padding, 0, sizeof(session.padding));
+	joold_export(entry, &session);
 
 	status = nlbuffer_write(adv->buffer, &session, sizeof(session));
-	if (status) {
-		adv->offset.src = entry->src4;
-		adv->offset.dst = entry->dst4;
-	}
+	if (status)
+		goto stop;
 
+	adv->remaining--;
+	adv->count++;
+	return 0;
+
+stop:
+	/* We'll resume from this session in the next packet. */
+	adv->offset.src = entry->src4;
+	adv->offset.dst = entry->dst4;
 	return status;
 }
 
-static int write_group_node(struct joold_node *node,
-		struct nlcore_buffer *buffer,
-		struct bib *bib)
+static int init_buffer(struct nlcore_buffer *buffer, struct joold_queue *queue)
 {
-	struct joold_advertise_struct arg;
-	struct session_foreach_func func = {
-		.cb = foreach_cb,
-		.arg = &arg,
-	};
-	struct session_foreach_offset offset_struct;
-	struct session_foreach_offset *offset = NULL;
+	struct request_hdr jool_hdr;
 	int error;
 
-	arg.buffer = buffer;
-	if (node->group.offset_set) {
-		offset_struct.offset = node->group.offset;
-		offset_struct.include_offset = true;
-		offset = &offset_struct;
-	}
-
-	error = bib_foreach_session(bib, node->group.proto, &func, offset);
-	if (error > 0) {
-		node->group.offset = arg.offset;
-		node->group.offset_set = true;
-	}
+	init_request_hdr(&jool_hdr, MODE_JOOLD, OP_ADD);
+	jool_hdr.castness = 'm';
 
+	error = nlbuffer_init_request(buffer, &jool_hdr,
+			queue->config.max_payload - sizeof(jool_hdr));
+	if (error)
+		log_debug("nlbuffer_init_request() threw error %d.", error);
 	return error;
 }
 
 /**
  * Builds an nl-core-compatible buffer out of @sessions.
  */
-static int build_buffer(struct nlcore_buffer *buffer, struct joold_queue *queue,
-		struct bib *bib)
+static int build_buffer(struct nlcore_buffer *buffer, struct joold_queue *queue)
 {
-	struct request_hdr jool_hdr;
 	struct joold_node *node;
 	int error;
 
-	init_request_hdr(&jool_hdr, MODE_JOOLD, OP_ADD);
-	jool_hdr.castness = 'm';
-
-	error = nlbuffer_init_request(buffer, &jool_hdr,
-			queue->config.max_payload - sizeof(jool_hdr));
-	if (error) {
-		log_debug("nlbuffer_init_request() threw error %d.", error);
+	error = init_buffer(buffer, queue);
+	if (error)
 		return error;
-	}
 
 	while (!list_empty(&queue->sessions)) {
 		node = list_first_entry(&queue->sessions, struct joold_node,
 				nextprev);
-		error = (node->is_group)
-				? write_group_node(node, buffer, bib)
-				: write_single_node(node, buffer);
+		error = write_single_node(node, buffer);
 		if (error > 0) {
 			return 0;
 		} else if (error) {
@@ -331,104 +585,498 @@ static int build_buffer(struct nlcore_buffer *buffer, struct joold_queue *queue,
 		}
 
 		queue->count--;
-		if (node->is_group)
-			queue->advertisement_count--;
-
 		list_del(&node->nextprev);
-		wkmem_cache_free("joold node", node_cache, node);
-	}
-
-	/*
-	 * This can happen when the list only had group nodes and the session
-	 * database was empty.
-	 */
-	if (sizeof(jool_hdr) == buffer->len) {
-		log_debug("There was nothing to send after all.");
-		nlbuffer_clean(buffer);
-		return -ENOENT;
+		wkmem_cache_free(JMEM_JOOLD, "joold node", node_cache, node);
 	}
 
 	return 0;
 }
 
-struct joold_buffer {
-	struct nlcore_buffer buffer;
-	struct net *ns;
-	bool initialized;
-};
-
-#define JOOLD_BUFFER_INIT { .initialized = false }
-
 /**
- * Assumes the lock is held.
- * YOU HAVE TO CALL send_to_userspace() AFTER YOU RELEASE THE SPINLOCK!!!
+ * Tells the user how far along the advertisement is.
  */
-static void send_to_userspace_prepare(struct joold_queue *queue,
-		struct bib *bib, struct joold_buffer *buffer)
+static void report_advertisement(struct joold_queue *queue, char *what)
 {
-	if (!should_send(queue))
-		return;
+	log_info("Advertisement %s: %llu/%llu sessions sent.", what,
+			queue->adv.sent, max(queue->adv.sent, queue->adv.total));
+}
 
-	if (build_buffer(&buffer->buffer, queue, bib))
-		return;
+/**
+ * Moves the advertisement to the next protocol table. Returns false if there
+ * are no more tables.
+ */
+static bool next_adv_proto(struct joold_queue *queue)
+{
+	queue->adv.offset_set = false;
 
-	buffer->initialized = true;
-	/*
-	 * Caller has a reference and the buffer is not going to outlive it so
-	 * this should be alright.
-	 */
-	buffer->ns = queue->ns;
+	switch (queue->adv.proto) {
+	case L4PROTO_TCP:
+		queue->adv.proto = L4PROTO_UDP;
+		return true;
+	case L4PROTO_UDP:
+		queue->adv.proto = L4PROTO_ICMP;
+		return true;
+	case L4PROTO_ICMP:
+	case L4PROTO_OTHER:
+		break;
+	}
 
-	/*
-	 * BTW: This sucks.
-	 * We're assuming that the nlcore_send_multicast_message() during
-	 * send_to_userspace() is going to succeed.
-	 * But the alternative is to do the nlcore_send_multicast_message()
-	 * with the lock held, and I don't have the stomach for that.
-	 */
-	queue->ack_received = false;
-	queue->last_flush_time = jiffies;
+	queue->adv.active = false;
+	queue->adv.end_pending = true;
+	report_advertisement(queue, "complete");
+	return false;
 }
 
-static void send_to_userspace(struct joold_buffer *buffer)
+/**
+ * Builds an nl-core-compatible buffer out of the next chunk of the
+ * advertisement.
+ */
+static int build_adv_buffer(struct nlcore_buffer *buffer,
+		struct joold_queue *queue, struct bib *bib)
 {
+	struct joold_advertise_struct arg;
+	struct session_foreach_func func = {
+		.cb = foreach_cb,
+		.arg = &arg,
+	};
+	struct session_foreach_offset offset_struct;
+	struct session_foreach_offset *offset;
 	int error;
 
-	if (!buffer->initialized)
-		return;
+	error = init_buffer(buffer, queue);
+	if (error)
+		return error;
 
-	log_debug("Sending multicast message.");
-	error = nlcore_send_multicast_message(buffer->ns, &buffer->buffer);
-	if (!error)
-		log_debug("Multicast message sent.");
+	arg.buffer = buffer;
+	arg.remaining = adv_budget(queue);
+	if (queue->config.advertise_chunk)
+		arg.remaining = min(arg.remaining,
+				queue->config.advertise_chunk);
+	arg.count = 0;
+	arg.since = queue->adv.since;
+	arg.windowed = queue->adv.windowed;
+
+	do {
+		offset = NULL;
+		if (queue->adv.offset_set) {
+			offset_struct.offset = queue->adv.offset;
+			offset_struct.include_offset = true;
+			offset = &offset_struct;
+		}
+
+		error = bib_foreach_session(bib, queue->adv.proto, &func,
+				offset, NULL);
+		if (error > 0) {
+			queue->adv.offset = arg.offset;
+			queue->adv.offset_set = true;
+			break;
+		} else if (error) {
+			nlbuffer_clean(buffer);
+			return error;
+		}
+	} while (next_adv_proto(queue));
 
-	nlbuffer_clean(&buffer->buffer);
+	queue->adv.sent += arg.count;
+	if (queue->config.advertise_rate)
+		queue->adv.budget -= arg.count;
+	log_debug("Advertising %u sessions.", arg.count);
+
+	/* This can happen when the rest of the database was empty. */
+	if (arg.count == 0) {
+		log_debug("There was nothing to send after all.");
+		nlbuffer_clean(buffer);
+		return -ENOENT;
+	}
+
+	return 0;
 }
 
 /**
- * joold_create - Constructor for joold_queue structs.
+ * Builds the message that tells the peers the advertisement is over, so they
+ * know they have the whole table. (It travels behind the advertisement's
+ * sessions, so they've already arrived by the time it does.)
  */
-struct joold_queue *joold_alloc(struct net *ns)
+static int build_adv_end(struct nlcore_buffer *buffer,
+		struct joold_queue *queue)
 {
-	struct joold_queue *queue;
+	struct request_hdr hdr;
+	struct joold_adv_end end;
+	int error;
 
-	queue = wkmalloc(struct joold_queue, GFP_KERNEL);
-	if (!queue)
-		return NULL;
+	init_request_hdr(&hdr, MODE_JOOLD, OP_ADVERTISE_END);
+	hdr.castness = 'm';
 
-	INIT_LIST_HEAD(&queue->sessions);
-	queue->count = 0;
-	queue->advertisement_count = 0;
-	queue->ack_received = true;
-	queue->last_flush_time = jiffies;
-	queue->config.enabled = DEFAULT_JOOLD_ENABLED;
-	queue->config.flush_asap = DEFAULT_JOOLD_FLUSH_ASAP;
-	queue->config.flush_deadline = DEFAULT_JOOLD_DEADLINE;
-	queue->config.capacity = DEFAULT_JOOLD_CAPACITY;
-	queue->config.max_payload = DEFAULT_JOOLD_MAX_PAYLOAD;
+	error = nlbuffer_init_request(buffer, &hdr, sizeof(end));
+	if (error)
+		return error;
+
+	end.sessions = cpu_to_be64(queue->adv.sent);
+	error = nlbuffer_write(buffer, &end, sizeof(end));
+	if (error) {
+		nlbuffer_clean(buffer);
+		return error;
+	}
+
+	queue->adv.end_pending = false;
+	return 0;
+}
+
+/**
+ * finish_pending() for compact messages.
+ */
+static void finish_records(void *data, size_t len)
+{
+	struct joold_record *record;
+	size_t record_len;
+	u32 time;
+
+	data += sizeof(struct joold_compact_hdr);
+	len -= sizeof(struct joold_compact_hdr);
+
+	while (len > 0) {
+		record = data;
+		record_len = joold_record_len(record->type);
+
+		time = be32_to_cpu(record->update_time);
+		time = jiffies_to_msecs((u32)jiffies - time);
+		record->update_time = cpu_to_be32(time);
+
+		data += record_len;
+		len -= record_len;
+	}
+}
+
+/**
+ * Converts the update times of @queue's pending sessions from jiffies to ages.
+ * (See struct joold_session.update_time.)
+ */
+static void finish_pending(struct joold_queue *queue)
+{
+	struct joold_session *session;
+	struct joold_session *end;
+	void *data;
+	size_t len;
+	__u64 time;
+
+	data = nlcore_mcast_data(&queue->pending, &len);
+	data += sizeof(struct request_hdr);
+	len -= sizeof(struct request_hdr);
+
+	if (queue->pending_compact) {
+		finish_records(data, len);
+		return;
+	}
+
+	session = data;
+	end = session + len / sizeof(*session);
+
+	for (; session < end; session++) {
+		time = be64_to_cpu(session->update_time);
+		time = jiffies_to_msecs(jiffies - time);
+		session->update_time = cpu_to_be64(time);
+	}
+}
+
+/**
+ * Message that was taken out of the queue, and is meant to be sent after the
+ * lock is released. Either @mcast (if @is_mcast) or @buffer.
+ */
+struct joold_buffer {
+	struct nlcore_buffer buffer;
+	struct nlcore_mcast mcast;
+	bool is_mcast;
+	struct net *ns;
+	/** If not NULL, the message goes here instead of to the daemon. */
+	struct joold_socket *sock;
+	bool initialized;
+};
+
+#define JOOLD_BUFFER_INIT { .sock = NULL, .initialized = false }
+
+/**
+ * Assumes the lock is held.
+ * YOU HAVE TO CALL send_to_userspace() AFTER YOU RELEASE THE SPINLOCK!!!
+ */
+static void send_to_userspace_prepare(struct joold_queue *queue,
+		struct bib *bib, struct joold_buffer *buffer)
+{
+	struct request_hdr *hdr;
+	size_t len;
+
+	if (!should_send(queue))
+		return;
+
+	if (queue->pending_count > 0) {
+		/* These are older than the list's, so they go first. */
+		finish_pending(queue);
+		buffer->mcast = queue->pending;
+		buffer->is_mcast = true;
+		queue->pending.skb = NULL;
+		queue->count -= queue->pending_count;
+		queue->pending_count = 0;
+	} else if (!list_empty(&queue->sessions)) {
+		if (build_buffer(&buffer->buffer, queue))
+			return;
+		buffer->is_mcast = false;
+	} else {
+		/*
+		 * The advertisement only gets what the sessions leave.
+		 * (If it just ran out of sessions, it's time for the end.)
+		 */
+		if (!queue->adv.active || !bib
+				|| build_adv_buffer(&buffer->buffer, queue, bib)) {
+			if (!queue->adv.end_pending)
+				return;
+			if (build_adv_end(&buffer->buffer, queue))
+				return;
+		}
+		buffer->is_mcast = false;
+	}
+
+	if (buffer->is_mcast) {
+		hdr = nlcore_mcast_data(&buffer->mcast, &len);
+	} else {
+		hdr = buffer->buffer.data;
+		len = buffer->buffer.len;
+	}
+	hdr->seq = cpu_to_be16(queue->next_seq);
+	trace_jool_joold_flush(queue->next_seq, len, queue->in_flight);
+	queue->next_seq++;
+
+	buffer->initialized = true;
+	/*
+	 * Caller has a reference and the buffer is not going to outlive it so
+	 * this should be alright.
+	 */
+	buffer->ns = queue->ns;
+
+	queue->last_flush_time = jiffies;
+
+	if (queue->sock) {
+		/*
+		 * Nobody on the other side of the socket is going to ACK this;
+		 * the network is the peers', and it's lossy anyway.
+		 */
+		jsock_get(queue->sock);
+		buffer->sock = queue->sock;
+		return;
+	}
+
+	/*
+	 * BTW: This sucks.
+	 * We're assuming that the nlcore_send_multicast_message() during
+	 * send_to_userspace() is going to succeed.
+	 * But the alternative is to do the nlcore_send_multicast_message()
+	 * with the lock held, and I don't have the stomach for that.
+	 */
+	queue->in_flight++;
+}
+
+static void send_to_peers(struct joold_buffer *buffer)
+{
+	void *data;
+	size_t len;
+
+	if (buffer->is_mcast) {
+		data = nlcore_mcast_data(&buffer->mcast, &len);
+		jsock_send(buffer->sock, data, len);
+		nlcore_mcast_clean(&buffer->mcast);
+	} else {
+		jsock_send(buffer->sock, buffer->buffer.data,
+				buffer->buffer.len);
+		nlbuffer_clean(&buffer->buffer);
+	}
+
+	jsock_put(buffer->sock);
+}
+
+static void send_to_userspace(struct joold_buffer *buffer)
+{
+	int error;
+
+	if (!buffer->initialized)
+		return;
+
+	if (buffer->sock) {
+		send_to_peers(buffer);
+		return;
+	}
+
+	log_debug("Sending multicast message.");
+	if (buffer->is_mcast) {
+		error = nlcore_mcast_send(buffer->ns, &buffer->mcast);
+	} else {
+		error = nlcore_send_multicast_message(buffer->ns,
+				&buffer->buffer);
+		nlbuffer_clean(&buffer->buffer);
+	}
+	if (!error)
+		log_debug("Multicast message sent.");
+}
+
+/**
+ * Makes @queue forget which sessions were sent whole recently, so they will be
+ * sent whole again.
+ */
+static void forget_synced(struct joold_queue *queue)
+{
+	unsigned int i;
+
+	for (i = 0; i < JOOLD_SYNCED_SLOTS; i++) {
+		queue->synced[i].key = 0;
+		queue->synced[i].time = (u32)jiffies - JOOLD_COMPACT_REFRESH;
+	}
+}
+
+/**
+ * Is there anything @queue should eventually send? Lockless, so it's only a
+ * hint.
+ */
+static bool has_sessions(struct joold_queue *queue)
+{
+	struct joold_stage __percpu *stages;
+	unsigned int cpu;
+
+	if (READ_ONCE(queue->count))
+		return true;
+
+	stages = READ_ONCE(queue->stages);
+	if (!stages)
+		return false;
+	for_each_possible_cpu(cpu)
+		if (READ_ONCE(per_cpu_ptr(stages, cpu)->count))
+			return true;
+
+	return false;
+}
+
+/**
+ * Makes sure @queue will be flushed by the time its deadline expires (counting
+ * from the last flush, as should_send() does), even if no packets or ACKs come
+ * along to do it. Does nothing if that is already taken care of.
+ *
+ * Can be called in any context.
+ */
+static void arm_flush_timer(struct joold_queue *queue)
+{
+	long delay;
+
+	/* Test first; the atomic is a write, and this is the packet path. */
+	if (test_bit(JOOLD_FLUSH_ARMED, &queue->flush_armed)
+			|| test_and_set_bit(JOOLD_FLUSH_ARMED,
+					&queue->flush_armed))
+		return;
+
+	delay = (long)(READ_ONCE(queue->last_flush_time)
+			+ READ_ONCE(queue->config.flush_deadline)
+			+ 1 - jiffies);
+	/* If the flush failed, don't spin on it. */
+	if (delay < 1)
+		delay = 1;
+
+	hrtimer_start(&queue->flush_timer,
+			ns_to_ktime((u64)jiffies_to_usecs(delay) * NSEC_PER_USEC),
+			HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart flush_timer_fn(struct hrtimer *timer)
+{
+	struct joold_queue *queue;
+
+	queue = container_of(timer, struct joold_queue, flush_timer);
+	/* If this fails, joold_release() is waiting for us to return. */
+	if (kref_get_unless_zero(&queue->refs))
+		queue_work(flush_wq, &queue->flush_work);
+
+	return HRTIMER_NORESTART;
+}
+
+static unsigned int queue_refcount(struct joold_queue *queue)
+{
+#if LINUX_VERSION_AT_LEAST(4, 11, 0, 9999, 0)
+	return kref_read(&queue->refs);
+#else
+	return atomic_read(&queue->refs.refcount);
+#endif
+}
+
+static void joold_flush(struct joold_queue *queue, struct bib *bib,
+		struct pool6 *pool6);
+
+/**
+ * The queue is flushed without its instance, because the instance is not
+ * reachable from here: The timer-driven flushes leave the advertisements to
+ * joold_clean() and the ACKs, and they don't omit dst6 from compact records.
+ */
+static void flush_work_fn(struct work_struct *work)
+{
+	struct joold_queue *queue;
+
+	queue = container_of(work, struct joold_queue, flush_work);
+
+	joold_flush(queue, NULL, NULL);
+
+	clear_bit(JOOLD_FLUSH_ARMED, &queue->flush_armed);
+	/* Pairs with the smp_mb() in joold_add(). */
+	smp_mb();
+	/*
+	 * Whatever arrived during the flush could not arm the timer.
+	 * If our reference is the last one, the instance is gone, so nothing
+	 * else is going to be sent; in particular, joold_teardown() might be
+	 * draining the workqueue.
+	 */
+	if (queue_refcount(queue) > 1 && READ_ONCE(queue->config.enabled)
+			&& has_sessions(queue))
+		arm_flush_timer(queue);
+
+	joold_put(queue);
+}
+
+/**
+ * joold_create - Constructor for joold_queue structs.
+ */
+struct joold_queue *joold_alloc(struct net *ns)
+{
+	struct joold_queue *queue;
+
+	queue = wkmalloc(struct joold_queue, GFP_KERNEL);
+	if (!queue)
+		return NULL;
+
+	queue->stages = NULL;
+	queue->pending.skb = NULL;
+	queue->pending_count = 0;
+	queue->pending_compact = false;
+	forget_synced(queue);
+	INIT_LIST_HEAD(&queue->sessions);
+	queue->count = 0;
+	memset(&queue->adv, 0, sizeof(queue->adv));
+	memset(&queue->peers, 0, sizeof(queue->peers));
+	queue->in_flight = 0;
+	queue->next_seq = 0;
+	queue->last_flush_time = jiffies;
+#if LINUX_VERSION_AT_LEAST(6, 13, 0, 9999, 0)
+	hrtimer_setup(&queue->flush_timer, flush_timer_fn, CLOCK_MONOTONIC,
+			HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&queue->flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	queue->flush_timer.function = flush_timer_fn;
+#endif
+	INIT_WORK(&queue->flush_work, flush_work_fn);
+	queue->flush_armed = 0;
+	queue->config.enabled = DEFAULT_JOOLD_ENABLED;
+	queue->config.flush_asap = DEFAULT_JOOLD_FLUSH_ASAP;
+	queue->config.flush_deadline = DEFAULT_JOOLD_DEADLINE;
+	queue->config.capacity = DEFAULT_JOOLD_CAPACITY;
+	queue->config.max_payload = DEFAULT_JOOLD_MAX_PAYLOAD;
+	queue->config.window = DEFAULT_JOOLD_WINDOW;
+	queue->config.compact = DEFAULT_JOOLD_COMPACT;
+	queue->config.advertise_chunk = DEFAULT_JOOLD_ADVERTISE_CHUNK;
+	queue->config.advertise_rate = DEFAULT_JOOLD_ADVERTISE_RATE;
 
 	queue->ns = ns;
 	get_net(ns);
+	queue->sock = NULL;
 
 	spin_lock_init(&queue->lock);
 	kref_init(&queue->refs);
@@ -449,12 +1097,17 @@ static void purge_sessions(struct joold_queue *queue)
 		node = list_first_entry(&queue->sessions, struct joold_node,
 				nextprev);
 		list_del(&node->nextprev);
-		wkmem_cache_free("joold node", node_cache, node);
+		wkmem_cache_free(JMEM_JOOLD, "joold node", node_cache, node);
 	}
 
+	nlcore_mcast_clean(&queue->pending);
+	queue->pending_count = 0;
+	/* Some of the dropped sessions might have been new to the peers. */
+	forget_synced(queue);
 	queue->count = 0;
-	queue->advertisement_count = 0;
-	queue->ack_received = true;
+	queue->adv.active = false;
+	queue->adv.end_pending = false;
+	queue->in_flight = 0;
 	queue->last_flush_time = jiffies;
 }
 
@@ -463,8 +1116,17 @@ static void joold_release(struct kref *refs)
 	struct joold_queue *queue;
 	queue = container_of(refs, struct joold_queue, refs);
 
+	/*
+	 * The timer doesn't hold a reference, but @flush_work does, so it
+	 * cannot be pending.
+	 */
+	hrtimer_cancel(&queue->flush_timer);
+	if (queue->sock)
+		jsock_put(queue->sock);
 	put_net(queue->ns);
 	purge_sessions(queue);
+	if (queue->stages)
+		free_percpu(queue->stages);
 	wkfree(struct joold_queue, queue);
 }
 
@@ -480,8 +1142,40 @@ void joold_config_copy(struct joold_queue *queue, struct joold_config *config)
 	spin_unlock_bh(&queue->lock);
 }
 
+/**
+ * The stages are only needed once joold is enabled, and they are per CPU, so
+ * they are allocated the first time that happens rather than along with every
+ * instance. Once allocated, they stay until the queue dies.
+ *
+ * If they cannot be allocated, @config is downgraded to disabled.
+ */
+static void prepare_stages(struct joold_queue *queue,
+		struct joold_config *config)
+{
+	struct joold_stage __percpu *stages;
+	unsigned int cpu;
+
+	if (!config->enabled || queue->stages)
+		return;
+
+	stages = alloc_percpu(struct joold_stage);
+	if (!stages) {
+		log_err("Could not allocate the joold stages; joold will remain disabled.");
+		config->enabled = false;
+		return;
+	}
+	for_each_possible_cpu(cpu) {
+		per_cpu_ptr(stages, cpu)->count = 0;
+		spin_lock_init(&per_cpu_ptr(stages, cpu)->lock);
+	}
+
+	/* Configuration is serialized, so there are no other writers. */
+	smp_store_release(&queue->stages, stages);
+}
+
 void joold_config_set(struct joold_queue *queue, struct joold_config *config)
 {
+	prepare_stages(queue, config);
 	spin_lock_bh(&queue->lock);
 	memcpy(&queue->config, config, sizeof(*config));
 	spin_unlock_bh(&queue->lock);
@@ -496,71 +1190,318 @@ void joold_config_set(struct joold_queue *queue, struct joold_config *config)
 void joold_update_config(struct joold_queue *queue,
 		struct joold_config *new_config)
 {
+	prepare_stages(queue, new_config);
 	spin_lock_bh(&queue->lock);
 	memcpy(&queue->config, new_config, sizeof(*new_config));
 	spin_unlock_bh(&queue->lock);
 }
 
+static u32 joold_key(struct session_entry *entry)
+{
+	return jhash_3words((__force u32)entry->src4.l3.s_addr,
+			(__force u32)entry->dst4.l3.s_addr,
+			(entry->src4.l4 << 16) | entry->dst4.l4,
+			jhash2((const u32 *)&entry->src6.l3, 4,
+					(entry->src6.l4 << 8) | entry->proto));
+}
+
 /**
- * joold_add - Add the @entry session to @queue.
- *
- * This is the function that gets called whenever a packet translation
- * successfully triggers the creation of a session entry. @entry will be sent
- * to the joold daemon.
+ * Decides how much of @entry needs to be sent in a compact message.
+ * @slot is @entry's slot in @queue->synced.
  */
-void joold_add(struct joold_queue *queue, struct session_entry *entry,
-		struct bib *bib)
+static __u8 choose_record_type(struct joold_queue *queue,
+		struct session_entry *entry, struct pool6 *pool6,
+		unsigned int slot, u32 key)
 {
-	struct joold_node *copy;
-	struct joold_buffer buffer = JOOLD_BUFFER_INIT;
+	struct in6_addr dst6;
 
-	spin_lock_bh(&queue->lock);
+	if (queue->synced[slot].key == key && (u32)jiffies
+			- queue->synced[slot].time < JOOLD_COMPACT_REFRESH)
+		return JOOLD_REC_TOUCH;
 
-	if (!queue->config.enabled) {
-		spin_unlock_bh(&queue->lock);
+	/*
+	 * Receivers compute dst6 the same way, so only leave it out when it's
+	 * known to come out right. (No @pool6 means no way to know.)
+	 */
+	if (pool6 && !rfc6052_4to6(pool6, &entry->dst4.l3, &dst6)
+			&& addr6_equals(&dst6, &entry->dst6.l3))
+		return JOOLD_REC_NEW;
+
+	return JOOLD_REC_FULL;
+}
+
+/**
+ * Note: @out->update_time is left in (truncated) jiffies.
+ */
+static void session_to_record(struct session_entry *entry, __u8 type,
+		struct joold_record *out)
+{
+	out->type = type;
+	out->l4_proto = entry->proto;
+	out->state = entry->state;
+	out->timer_type = entry->timer_type;
+	out->update_time = cpu_to_be32((u32)entry->update_time);
+	out->src4_addr = entry->src4.l3;
+	out->dst4_addr = entry->dst4.l3;
+	out->src4_port = cpu_to_be16(entry->src4.l4);
+	out->dst4_port = cpu_to_be16(entry->dst4.l4);
+	if (type == JOOLD_REC_TOUCH)
 		return;
-	}
 
-	copy = wkmem_cache_alloc("joold node", node_cache, GFP_ATOMIC);
-	if (!copy) {
-		spin_unlock_bh(&queue->lock);
+	out->src6_addr = entry->src6.l3;
+	out->src6_port = cpu_to_be16(entry->src6.l4);
+	out->dst6_port = cpu_to_be16(entry->dst6.l4);
+	if (type == JOOLD_REC_NEW)
 		return;
+
+	out->dst6_addr = entry->dst6.l3;
+}
+
+static bool add_record_to_pending(struct joold_queue *queue,
+		struct session_entry *entry, struct pool6 *pool6)
+{
+	struct joold_record *record;
+	unsigned int slot;
+	u32 key;
+	__u8 type;
+
+	key = joold_key(entry);
+	slot = key & (JOOLD_SYNCED_SLOTS - 1);
+	type = choose_record_type(queue, entry, pool6, slot, key);
+
+	record = nlcore_mcast_reserve(&queue->pending, joold_record_len(type));
+	if (!record)
+		return false;
+
+	/* The time is converted in finish_pending(). */
+	session_to_record(entry, type, record);
+	if (type != JOOLD_REC_TOUCH) {
+		queue->synced[slot].key = key;
+		queue->synced[slot].time = (u32)jiffies;
+	}
+	return true;
+}
+
+static int init_pending(struct joold_queue *queue)
+{
+	struct request_hdr hdr;
+	struct joold_compact_hdr *compact;
+	bool is_compact;
+	int error;
+
+	is_compact = queue->config.compact;
+	init_request_hdr(&hdr, MODE_JOOLD, is_compact ? OP_UPDATE : OP_ADD);
+	hdr.castness = 'm';
+
+	error = nlcore_mcast_init(&queue->pending, &hdr,
+			queue->config.max_payload - sizeof(hdr));
+	if (error)
+		return error;
+
+	if (is_compact) {
+		compact = nlcore_mcast_reserve(&queue->pending,
+				sizeof(*compact));
+		if (!compact) {
+			nlcore_mcast_clean(&queue->pending);
+			return -EINVAL;
+		}
+		compact->version = JOOLD_COMPACT_VERSION;
+		memset(compact->reserved, 0, sizeof(compact->reserved));
+	}
+
+	queue->pending_compact = is_compact;
+	return 0;
+}
+
+/**
+ * Tries to serialize @entry straight into @queue's pending multicast message.
+ */
+static bool add_to_pending(struct joold_queue *queue,
+		struct session_entry *entry, struct pool6 *pool6)
+{
+	struct joold_session *session;
+
+	if (!list_empty(&queue->sessions))
+		return false;
+
+	if (!queue->pending.skb && init_pending(queue))
+		return false;
+
+	if (queue->pending_compact) {
+		if (!add_record_to_pending(queue, entry, pool6))
+			return false;
+	} else {
+		session = nlcore_mcast_reserve(&queue->pending,
+				sizeof(*session));
+		if (!session)
+			return false;
+		/* The time is converted in finish_pending(). */
+		session_to_joold(entry, session);
 	}
 
-	copy->is_group = false;
+	queue->pending_count++;
+	return true;
+}
+
+static bool add_to_list(struct joold_queue *queue, struct session_entry *entry)
+{
+	struct joold_node *copy;
+
+	copy = wkmem_cache_alloc(JMEM_JOOLD, "joold node", node_cache,
+			GFP_ATOMIC);
+	if (!copy)
+		return false;
+
 	/*
 	 * Do not convert the time yet; if the session is queued for a long
 	 * time, these will be horribly inaccurate.
 	 */
-	copy->single.update_time = cpu_to_be64(entry->update_time);
-	copy->single.src6_addr = entry->src6.l3;
-	copy->single.dst6_addr = entry->dst6.l3;
-	copy->single.src4_addr = entry->src4.l3;
-	copy->single.dst4_addr = entry->dst4.l3;
-	copy->single.src6_port = cpu_to_be16(entry->src6.l4);
-	copy->single.dst6_port = cpu_to_be16(entry->dst6.l4);
-	copy->single.src4_port = cpu_to_be16(entry->src4.l4);
-	copy->single.dst4_port = cpu_to_be16(entry->dst4.l4);
-	copy->single.l4_proto = entry->proto;
-	copy->single.state = entry->state;
-	copy->single.timer_type = entry->timer_type;
-	memset(copy->single.padding, 0, sizeof(copy->single.padding));
+	session_to_joold(entry, &copy->single);
 
 	list_add_tail(&copy->nextprev, &queue->sessions);
-	queue->count++;
+	return true;
+}
+
+/**
+ * Moves the sessions from every CPU's stage into @queue. (Or drops them, if
+ * joold is disabled.)
+ * Assumes the lock is held.
+ *
+ * @pool6 is only used to compact the sessions, if the user asked for that.
+ */
+static void drain_stages(struct joold_queue *queue, struct pool6 *pool6)
+{
+	struct joold_stage __percpu *stages;
+	struct joold_stage *stage;
+	struct session_entry *entry;
+	unsigned int cpu;
+	unsigned int i;
+
+	stages = READ_ONCE(queue->stages);
+	if (!stages)
+		return; /* joold has never been enabled. */
+
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(stages, cpu);
+		/* Peek first; most of them are usually empty. */
+		if (!READ_ONCE(stage->count))
+			continue;
+
+		spin_lock(&stage->lock);
+		for (i = 0; i < stage->count; i++) {
+			entry = &stage->sessions[i];
+			if (queue->config.enabled
+					&& (add_to_pending(queue, entry, pool6)
+					|| add_to_list(queue, entry)))
+				queue->count++;
+		}
+		stage->count = 0;
+		spin_unlock(&stage->lock);
+	}
 
 	if (queue->count > queue->config.capacity) {
 		log_warn_once("Too many sessions are queuing up!\n"
 				"Cannot synchronize fast enough; I will have to drop some sessions.\n"
 				"Sorry.");
 		purge_sessions(queue);
-	} else {
-		send_to_userspace_prepare(queue, bib, &buffer);
 	}
+}
+
+/**
+ * Moves the staged sessions into @queue, and sends whatever needs to be sent.
+ *
+ * @bib is only needed by the advertisements, and @pool6 only by the compact
+ * records. Either can be NULL.
+ */
+static void joold_flush(struct joold_queue *queue, struct bib *bib,
+		struct pool6 *pool6)
+{
+	struct joold_buffer buffer = JOOLD_BUFFER_INIT;
+
+	spin_lock_bh(&queue->lock);
+
+	drain_stages(queue, pool6);
+	if (queue->config.enabled)
+		send_to_userspace_prepare(queue, bib, &buffer);
 
 	spin_unlock_bh(&queue->lock);
 
 	send_to_userspace(&buffer);
+
+	/* Whatever couldn't be sent now has a deadline. */
+	if (READ_ONCE(queue->count))
+		arm_flush_timer(queue);
+}
+
+/**
+ * Is @queue waiting for sessions it could send right away?
+ * Lockless, so it's only a hint.
+ */
+static bool is_idle(struct joold_queue *queue)
+{
+	return READ_ONCE(queue->config.flush_asap)
+			&& READ_ONCE(queue->in_flight)
+			< READ_ONCE(queue->config.window);
+}
+
+/**
+ * joold_add - Add the @entry session to @queue.
+ *
+ * This is the function that gets called whenever a packet translation
+ * successfully triggers the creation of a session entry. @entry will be sent
+ * to the joold daemon.
+ *
+ * @entry is only staged in this CPU's buffer; it reaches the queue during the
+ * next flush. (Which happens here if the buffer is full, or if the queue is
+ * idle. Otherwise, the next ACK or the flush timer will do it.) So, while the
+ * daemon is keeping up, the queue's lock stays away from the packet path.
+ *
+ * @pool6 is only used to compact @entry, if the user asked for that.
+ */
+void joold_add(struct joold_queue *queue, struct session_entry *entry,
+		struct bib *bib, struct pool6 *pool6)
+{
+	struct joold_stage __percpu *stages;
+	struct joold_stage *stage;
+	bool added;
+	bool first;
+	bool flush;
+
+	if (!READ_ONCE(queue->config.enabled))
+		return;
+	/* (The flag might be visible before the stages are.) */
+	stages = smp_load_acquire(&queue->stages);
+	if (!stages)
+		return;
+
+	do {
+		local_bh_disable();
+		stage = this_cpu_ptr(stages);
+
+		spin_lock(&stage->lock);
+		added = stage->count < JOOLD_STAGE_SIZE;
+		if (added) {
+			stage->sessions[stage->count] = *entry;
+			stage->count++;
+		}
+		first = stage->count == 1;
+		flush = stage->count == JOOLD_STAGE_SIZE || is_idle(queue);
+		spin_unlock(&stage->lock);
+
+		local_bh_enable();
+
+		if (flush) {
+			joold_flush(queue, bib, pool6);
+		} else if (first) {
+			/*
+			 * Pairs with the smp_mb() in flush_work_fn(): Either
+			 * it sees our session, or we see the timer disarmed.
+			 */
+			smp_mb();
+			arm_flush_timer(queue);
+		}
+		/* If the stage was full, the flush emptied it. */
+	} while (!added);
 }
 
 static void init_session_entry(struct joold_session *in,
@@ -587,7 +1528,6 @@ static void init_session_entry(struct joold_session *in,
 
 struct add_params {
 	struct session_entry new;
-	struct joold_session *newd;
 	bool success;
 };
 
@@ -598,7 +1538,7 @@ static enum session_fate collision_cb(struct session_entry *old, void *arg)
 
 	if (session_equals(old, new)) { /* It's the same session; update it. */
 		old->state = new->state;
-		old->timer_type = params->newd->timer_type;
+		old->timer_type = new->timer_type;
 		old->update_time = new->update_time;
 		params->success = true;
 		return FATE_TIMER_SLOW;
@@ -618,30 +1558,197 @@ static enum session_fate collision_cb(struct session_entry *old, void *arg)
 	return FATE_PRESERVE;
 }
 
-static bool add_new_session(struct xlator *jool, struct joold_session *in)
+/**
+ * Sessions from a joold packet, waiting to be handed to the database together.
+ * The database can then lock each table once per batch, rather than once per
+ * session.
+ */
+struct add_batch {
+	struct add_params params[JOOLD_ADD_BATCH];
+	struct bib_batch_session sessions[JOOLD_ADD_BATCH];
+	unsigned int count;
+};
+
+static bool add_result(struct add_params *params, int error)
+{
+	if (error == -EEXIST)
+		return params->success;
+	if (error) {
+		log_err("sessiondb_add() threw unknown error code %d.", error);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Adds the sessions waiting in @batch to the database.
+ */
+static bool add_batch_flush(struct xlator *jool, struct add_batch *batch)
+{
+	struct bib_batch_session *session;
+	unsigned int i;
+	bool success = true;
+
+	if (batch->count == 0)
+		return true;
+
+	log_debug("Adding %u sessions!", batch->count);
+	bib_add_sessions(jool->nat64.bib, batch->sessions, batch->count);
+
+	/* (The sessions were reordered, but they still know their params.) */
+	for (i = 0; i < batch->count; i++) {
+		session = &batch->sessions[i];
+		success &= add_result(session->cb.arg, session->error);
+	}
+
+	batch->count = 0;
+	return success;
+}
+
+/**
+ * Returns the params the next session of @batch should be initialized into.
+ */
+static struct add_params *add_batch_next(struct add_batch *batch)
+{
+	return &batch->params[batch->count];
+}
+
+/**
+ * Queues the session from the last add_batch_next() into @batch. Flushes the
+ * batch once it is full.
+ */
+static bool add_batch_commit(struct xlator *jool, struct add_batch *batch)
+{
+	struct add_params *params = &batch->params[batch->count];
+	struct bib_batch_session *session = &batch->sessions[batch->count];
+
+	params->success = false;
+	session->session = &params->new;
+	session->cb.cb = collision_cb;
+	session->cb.arg = params;
+	batch->count++;
+
+	return (batch->count == JOOLD_ADD_BATCH)
+			? add_batch_flush(jool, batch)
+			: true;
+}
+
+static struct add_batch *add_batch_alloc(void)
+{
+	struct add_batch *batch;
+
+	/* Too big for the stack. */
+	batch = wkmalloc(struct add_batch, GFP_KERNEL);
+	if (!batch) {
+		log_err("Out of memory.");
+		return NULL;
+	}
+
+	batch->count = 0;
+	return batch;
+}
+
+static void add_batch_free(struct add_batch *batch)
+{
+	wkfree(struct add_batch, batch);
+}
+
+static enum session_fate touch_cb(struct session_entry *old, void *arg)
+{
+	struct session_entry *new = arg;
+
+	old->state = new->state;
+	old->timer_type = new->timer_type;
+	old->update_time = new->update_time;
+	return FATE_TIMER_SLOW;
+}
+
+static bool touch_session(struct xlator *jool, struct session_entry *new)
 {
-	struct add_params params;
 	struct collision_cb cb = {
-			.cb = collision_cb,
-			.arg = &params,
+			.cb = touch_cb,
+			.arg = new,
 	};
 	int error;
 
-	log_debug("Adding session!");
-
-	init_session_entry(in, &params.new);
-	params.newd = in;
-	error = bib_add_session(jool->nat64.bib, &params.new, &cb);
-	if (error == -EEXIST)
-		return params.success;
+	error = bib_update_session4(jool->nat64.bib, new->proto, &new->src4,
+			&new->dst4, &cb);
+	if (error == -ESRCH) {
+		/*
+		 * We probably missed the session's NEW or FULL record. That's
+		 * not fatal; the sender will send it whole again shortly.
+		 */
+		log_debug("TOUCH record does not match any session; ignoring.");
+		return true;
+	}
 	if (error) {
-		log_err("sessiondb_add() threw unknown error code %d.", error);
+		log_err("bib_update_session4() threw unknown error code %d.",
+				error);
 		return false;
 	}
 
 	return true;
 }
 
+/**
+ * Initializes @out out of @in's fields. (Only the IPv4 ones if @in is a TOUCH.)
+ */
+static int init_session_entry_compact(struct xlator *jool,
+		struct joold_record *in, struct session_entry *out)
+{
+	int error;
+
+	out->src4.l3 = in->src4_addr;
+	out->src4.l4 = be16_to_cpu(in->src4_port);
+	out->dst4.l3 = in->dst4_addr;
+	out->dst4.l4 = be16_to_cpu(in->dst4_port);
+	out->proto = in->l4_proto;
+	out->state = in->state;
+	out->timer_type = in->timer_type;
+	out->update_time = jiffies
+			- msecs_to_jiffies(be32_to_cpu(in->update_time));
+	out->has_stored = false;
+	if (in->type == JOOLD_REC_TOUCH)
+		return 0;
+
+	out->src6.l3 = in->src6_addr;
+	out->src6.l4 = be16_to_cpu(in->src6_port);
+	out->dst6.l4 = be16_to_cpu(in->dst6_port);
+	if (in->type == JOOLD_REC_FULL) {
+		out->dst6.l3 = in->dst6_addr;
+		return 0;
+	}
+
+	error = rfc6052_4to6(jool->pool6, &out->dst4.l3, &out->dst6.l3);
+	if (error) {
+		log_warn_once("Cannot compute the destination IPv6 address of an incoming joold session. Is pool6 the same across all instances?");
+		return error;
+	}
+
+	return 0;
+}
+
+static bool add_record(struct xlator *jool, struct add_batch *batch,
+		struct joold_record *record)
+{
+	struct add_params *params = add_batch_next(batch);
+	bool success;
+
+	if (init_session_entry_compact(jool, record, &params->new))
+		return false;
+
+	if (record->type != JOOLD_REC_TOUCH)
+		return add_batch_commit(jool, batch);
+
+	/*
+	 * The TOUCH might refer to one of the sessions in the batch, so add
+	 * them first. (@params is past them, so it survives the flush.)
+	 */
+	success = add_batch_flush(jool, batch);
+	return touch_session(jool, &params->new) && success;
+}
+
 static int __validate_enabled(struct joold_queue *queue)
 {
 	if (!queue->config.enabled) {
@@ -665,116 +1772,318 @@ static int validate_enabled(struct xlator *jool)
 }
 
 /**
- * joold_sync - Parses a bunch of sessions out of @data and adds them to @jool's
- * session database.
+ * joold_import - Parses a bunch of sessions out of @data and adds them to
+ * @jool's session database.
  *
- * This is the function that gets called whenever the jool daemon sends data to
- * the @jool Jool instance.
+ * Unlike joold_sync(), this doesn't care whether joold is enabled; it's meant
+ * for `jool --session --import`.
  */
-int joold_sync(struct xlator *jool, void *data, __u32 data_len)
+int joold_import(struct xlator *jool, void *data, __u32 data_len)
 {
 	struct joold_session *session;
+	struct add_batch *batch;
 	unsigned int num_sessions;
 	unsigned int i;
-	int error;
 	bool success;
 
-	error = validate_enabled(jool);
-	if (error)
-		return error;
-
 	if (data_len % sizeof(struct joold_session) != 0) {
 		log_err("The Netlink packet seems corrupted.");
 		return -EINVAL;
 	}
 
+	batch = add_batch_alloc();
+	if (!batch)
+		return -ENOMEM;
+
 	session = data;
 	num_sessions = data_len / sizeof(struct joold_session);
 
 	success = true;
-	for (i = 0; i < num_sessions; i++, session++)
-		success &= add_new_session(jool, session);
+	for (i = 0; i < num_sessions; i++, session++) {
+		init_session_entry(session, &add_batch_next(batch)->new);
+		success &= add_batch_commit(jool, batch);
+	}
+	success &= add_batch_flush(jool, batch);
 
+	add_batch_free(batch);
 	log_debug("Added %u sessions.", i);
 	return success ? 0 : -EINVAL;
 }
 
-int joold_test(struct xlator *jool)
+/**
+ * Updates the peer statistics after a message with @sessions sessions
+ * arrived.
+ */
+static void note_received(struct xlator *jool, unsigned int sessions)
+{
+	struct joold_queue *queue = jool->nat64.joold;
+
+	spin_lock_bh(&queue->lock);
+	queue->peers.sessions += sessions;
+	queue->peers.messages++;
+	queue->peers.last_time = jiffies;
+	spin_unlock_bh(&queue->lock);
+}
+
+/**
+ * joold_sync - joold_import(), except it's the function that gets called
+ * whenever the jool daemon sends data to the @jool Jool instance.
+ */
+int joold_sync(struct xlator *jool, void *data, __u32 data_len)
 {
-	struct nlcore_buffer buffer;
-	struct request_hdr hdr;
 	int error;
 
 	error = validate_enabled(jool);
 	if (error)
 		return error;
 
-	init_request_hdr(&hdr, MODE_JOOLD, OP_ADD);
-	hdr.castness = 'm';
+	error = joold_import(jool, data, data_len);
+	note_received(jool, data_len / sizeof(struct joold_session));
+	return error;
+}
 
-	error = nlbuffer_init_request(&buffer, &hdr, 0);
+/**
+ * joold_update - joold_sync(), for the compact encoding. (OP_UPDATE messages.)
+ */
+int joold_update(struct xlator *jool, void *data, __u32 data_len)
+{
+	struct joold_compact_hdr *hdr;
+	struct joold_record *record;
+	struct add_batch *batch;
+	size_t record_len;
+	unsigned int i;
+	int error;
+	bool success;
+
+	error = validate_enabled(jool);
 	if (error)
 		return error;
 
-	error = nlcore_send_multicast_message(jool->ns, &buffer);
-	nlbuffer_clean(&buffer);
+	if (data_len < sizeof(*hdr)) {
+		log_err("The Netlink packet seems corrupted.");
+		return -EINVAL;
+	}
+
+	hdr = data;
+	if (hdr->version != JOOLD_COMPACT_VERSION) {
+		log_err("Unknown joold session encoding version: %u",
+				hdr->version);
+		return -EINVAL;
+	}
+
+	data += sizeof(*hdr);
+	data_len -= sizeof(*hdr);
+
+	batch = add_batch_alloc();
+	if (!batch)
+		return -ENOMEM;
+
+	success = true;
+	for (i = 0; data_len > 0; i++) {
+		record = data;
+		record_len = joold_record_len(record->type);
+		if (!record_len || record_len > data_len) {
+			log_err("The Netlink packet seems corrupted.");
+			success = false;
+			break;
+		}
+
+		success &= add_record(jool, batch, record);
+
+		data += record_len;
+		data_len -= record_len;
+	}
+	success &= add_batch_flush(jool, batch);
+
+	add_batch_free(batch);
+	log_debug("Added %u sessions.", i);
+	note_received(jool, i);
+	return success ? 0 : -EINVAL;
+}
+
+/**
+ * joold_adv_end - A peer is telling us its advertisement is over.
+ */
+int joold_adv_end(struct xlator *jool, void *data, __u32 data_len)
+{
+	struct joold_queue *queue = jool->nat64.joold;
+	struct joold_adv_end *end = data;
+	int error;
+
+	if (data_len < sizeof(*end)) {
+		log_err("The Netlink packet seems corrupted.");
+		return -EINVAL;
+	}
+
+	spin_lock_bh(&queue->lock);
+	error = __validate_enabled(queue);
+	if (!error) {
+		queue->peers.advertisements++;
+		queue->peers.advertised = be64_to_cpu(end->sessions);
+		queue->peers.last_adv_time = jiffies;
+	}
+	spin_unlock_bh(&queue->lock);
+
+	if (!error)
+		log_info("A peer finished advertising its %llu sessions.",
+				be64_to_cpu(end->sessions));
 	return error;
 }
 
+static __u64 msecs_since(unsigned long time)
+{
+	return jiffies_to_msecs(jiffies - time);
+}
 
-static int add_advertise_node(struct joold_queue *queue, l4_protocol proto)
+/**
+ * joold_status - Tells the user how far along the synchronization is.
+ */
+void joold_status(struct xlator *jool, struct joold_status_usr *status)
 {
-	struct joold_node *node;
+	struct joold_queue *queue = jool->nat64.joold;
 
-	node = wkmem_cache_alloc("joold node", node_cache, GFP_ATOMIC);
-	if (!node) {
-		log_err("Out of memory.");
-		return -ENOMEM;
-	}
+	memset(status, 0, sizeof(*status));
 
-	node->is_group = true;
-	memset(&node->group.offset, 0, sizeof(node->group.offset));
-	node->group.offset_set = false;
-	node->group.proto = proto;
+	spin_lock_bh(&queue->lock);
 
-	list_add_tail(&node->nextprev, &queue->sessions);
-	queue->count++;
-	queue->advertisement_count++;
+	status->sessions_received = queue->peers.sessions;
+	status->messages_received = queue->peers.messages;
+	if (queue->peers.messages)
+		status->last_received = msecs_since(queue->peers.last_time);
+	status->advertisements_received = queue->peers.advertisements;
+	status->advertised_sessions = queue->peers.advertised;
+	if (queue->peers.advertisements)
+		status->last_advertisement = msecs_since(
+				queue->peers.last_adv_time);
+	status->adv_sent = queue->adv.sent;
+	status->adv_total = max(queue->adv.sent, queue->adv.total);
+	status->queued = queue->count;
+	status->in_flight = queue->in_flight;
+	status->enabled = queue->config.enabled;
+	status->advertising = queue->adv.active || queue->adv.end_pending;
 
-	return 0;
+	spin_unlock_bh(&queue->lock);
 }
 
-static int prepare_advertisement(struct joold_queue *queue)
+int joold_test(struct xlator *jool)
 {
+	struct joold_queue *queue = jool->nat64.joold;
+	struct nlcore_buffer buffer;
+	struct request_hdr hdr;
 	int error;
 
-	error = add_advertise_node(queue, L4PROTO_TCP);
+	init_request_hdr(&hdr, MODE_JOOLD, OP_ADD);
+	hdr.castness = 'm';
+
+	spin_lock_bh(&queue->lock);
+	error = __validate_enabled(queue);
+	/*
+	 * The daemon will ACK this too. Number it like the last packet that
+	 * was already acknowledged, so that ACK doesn't change anything.
+	 */
+	hdr.seq = cpu_to_be16(queue->next_seq - queue->in_flight - 1);
+	spin_unlock_bh(&queue->lock);
 	if (error)
 		return error;
 
-	error = add_advertise_node(queue, L4PROTO_UDP);
+	error = nlbuffer_init_request(&buffer, &hdr, 0);
 	if (error)
 		return error;
 
-	return add_advertise_node(queue, L4PROTO_ICMP);
+	error = nlcore_send_multicast_message(jool->ns, &buffer);
+	nlbuffer_clean(&buffer);
+	return error;
+}
+
+
+/**
+ * Returns (more or less) the number of sessions an advertisement will have to
+ * send.
+ */
+static __u64 count_sessions(struct bib *bib)
+{
+	l4_protocol protos[] = { L4PROTO_TCP, L4PROTO_UDP, L4PROTO_ICMP };
+	__u64 total = 0;
+	__u64 count;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(protos); i++)
+		if (!bib_count_sessions(bib, protos[i], &count))
+			total += count;
+
+	return total;
+}
+
+/**
+ * @window is the number of milliseconds the advertisement should reach into the
+ * past. Zero means the whole table.
+ */
+static void prepare_advertisement(struct joold_queue *queue, __u64 total,
+		unsigned int window)
+{
+	unsigned long since;
+	bool windowed;
+
+	windowed = window != 0;
+	since = jiffies - msecs_to_jiffies(window);
+
+	/*
+	 * A peer that asks for an advertisement might have missed whatever was
+	 * already sent, so start over. Windows never shrink what's already
+	 * being sent, though.
+	 */
+	if (queue->adv.active) {
+		if (!queue->adv.windowed)
+			windowed = false;
+		else if (windowed && time_before(queue->adv.since, since))
+			since = queue->adv.since;
+		report_advertisement(queue, "restarted");
+	}
+
+	queue->adv.active = true;
+	queue->adv.end_pending = false;
+	queue->adv.proto = L4PROTO_TCP;
+	queue->adv.offset_set = false;
+	queue->adv.sent = 0;
+	/* We don't know how many sessions fit the window. */
+	queue->adv.total = windowed ? 0 : total;
+	queue->adv.windowed = windowed;
+	queue->adv.since = since;
+	/* Allow a second's worth of sessions right away. */
+	queue->adv.budget = queue->config.advertise_rate;
+	queue->adv.budget_time = jiffies;
+
+	if (windowed)
+		log_info("Advertising the sessions updated during the last %u milliseconds.",
+				jiffies_to_msecs(jiffies - since));
+	else
+		log_info("Advertising %llu sessions.", total);
 }
 
-int joold_advertise(struct xlator *jool)
+/**
+ * joold_advertise - Starts sending the whole session database to the other
+ * Jool instances. The advertisement continues in the background; see
+ * send_to_userspace_prepare().
+ *
+ * If @window is nonzero, only the sessions updated during the last @window
+ * milliseconds are sent. (This is how the daemons recover lost messages.)
+ */
+int joold_advertise(struct xlator *jool, unsigned int window)
 {
 	struct joold_queue *queue = jool->nat64.joold;
 	struct joold_buffer buffer = JOOLD_BUFFER_INIT;
+	__u64 total;
 	int error;
 
+	total = count_sessions(jool->nat64.bib);
+
 	spin_lock_bh(&queue->lock);
 
 	error = __validate_enabled(queue);
 	if (error)
 		goto end;
 
-	error = prepare_advertisement(queue);
-	if (error)
-		goto end;
-
+	prepare_advertisement(queue, total, window);
 	send_to_userspace_prepare(queue, jool->nat64.bib, &buffer);
 	/* Fall through */
 
@@ -784,44 +2093,98 @@ end:
 	return error;
 }
 
-void joold_ack(struct xlator *jool)
+/**
+ * joold_ack - The daemon is acknowledging packet @seq (and, since it handles
+ * them in order, every packet before it).
+ */
+void joold_ack(struct xlator *jool, __u16 seq)
 {
 	struct joold_queue *queue = jool->nat64.joold;
 	struct joold_buffer buffer = JOOLD_BUFFER_INIT;
+	__u16 outstanding;
 
 	spin_lock_bh(&queue->lock);
 
 	if (__validate_enabled(queue))
 		goto end;
 
-	queue->ack_received = true;
+	/* Old (or duplicate) ACKs yield large numbers, and are ignored. */
+	outstanding = queue->next_seq - seq - 1;
+	if (outstanding < queue->in_flight)
+		queue->in_flight = outstanding;
+	drain_stages(queue, jool->pool6);
 	send_to_userspace_prepare(queue, jool->nat64.bib, &buffer);
 	/* Fall through */
 
 end:
 	spin_unlock_bh(&queue->lock);
 	send_to_userspace(&buffer);
+
+	if (READ_ONCE(queue->count))
+		arm_flush_timer(queue);
 }
 
 /**
- * Called every now and then to flush the queue in case nodes have been queued,
- * the deadline is in the past and no new packets have triggered a flush.
- * It's just a last-resort attempt to prevent nodes from lingering here for too
- * long that's generally only useful in non-flush-asap mode.
+ * joold_bind - Makes @jool exchange the sessions with the peers through a
+ * socket of its own, as described by @request. (A zero family goes back to the
+ * daemon.)
+ *
+ * The messages are the same the daemon would have sent, so the peers don't
+ * need to be using the socket themselves.
  */
-void joold_clean(struct joold_queue *queue, struct bib *bib)
+int joold_bind(struct xlator *jool, struct joold_bind_request *request)
 {
-	struct joold_buffer buffer = JOOLD_BUFFER_INIT;
+	struct joold_queue *queue = jool->nat64.joold;
+	struct joold_socket *new = NULL;
+	struct joold_socket *old;
+	int error;
+
+	if (request->family) {
+		error = jsock_create(jool->ns, request, &new);
+		if (error)
+			return error;
+	}
 
 	spin_lock_bh(&queue->lock);
+	old = queue->sock;
+	queue->sock = new;
+	/* Whatever was waiting for the daemon's ACKs is not anymore. */
+	queue->in_flight = 0;
+	spin_unlock_bh(&queue->lock);
 
-	if (!queue->config.enabled)
-		goto end;
+	if (old)
+		jsock_put(old);
 
-	send_to_userspace_prepare(queue, bib, &buffer);
-	/* Fall through */
+	log_info("joold is now talking to the peers %s.",
+			new ? "directly" : "through the daemon");
+	return 0;
+}
 
-end:
-	spin_unlock_bh(&queue->lock);
-	send_to_userspace(&buffer);
+/**
+ * Called every now and then to push the advertisements along, and as a last
+ * resort for the sessions. (The flush timer normally beats it to them; this
+ * timer is coarse and deferrable, so it can be seconds late.)
+ */
+void joold_clean(struct joold_queue *queue, struct bib *bib,
+		struct pool6 *pool6)
+{
+	joold_flush(queue, bib, pool6);
+}
+
+/**
+ * Returns the jiffy by which joold_clean() should run again. This is only a
+ * hint, so nothing is locked.
+ */
+unsigned long joold_next_clean(struct joold_queue *queue)
+{
+	unsigned long deadline;
+	unsigned long next;
+
+	deadline = READ_ONCE(queue->config.flush_deadline);
+	if (!READ_ONCE(queue->config.enabled))
+		/* Enabling joold is a configuration change; it kicks the timer. */
+		return jiffies + MAX_JIFFY_OFFSET;
+
+	next = READ_ONCE(queue->last_flush_time) + deadline;
+	return time_before(next, jiffies) ? (jiffies + deadline) : next;
 }
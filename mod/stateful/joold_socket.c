@@ -0,0 +1,508 @@
+#include "nat64/mod/stateful/joold_socket.h"
+
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/kref.h>
+#include <linux/net.h>
+#include <linux/netdevice.h>
+#include <linux/workqueue.h>
+#include <net/ipv6.h>
+#include <net/net_namespace.h>
+#include <net/sock.h>
+#include "nat64/common/types.h"
+#include "nat64/mod/common/linux_version.h"
+#include "nat64/mod/common/wkmalloc.h"
+#include "nat64/mod/common/xlator.h"
+#include "nat64/mod/stateful/joold.h"
+
+/**
+ * Messages that can wait for the transmission work. Beyond this, they are
+ * dropped; it's UDP anyway, and the peers can ask for an advertisement.
+ */
+#define JSOCK_TX_MAX 256
+
+/** A message waiting for the transmission work. */
+struct jsock_msg {
+	struct list_head hook;
+	size_t len;
+	unsigned char data[];
+};
+
+struct joold_socket {
+	struct socket *sock;
+	/** Where the messages are sent. */
+	union {
+		struct sockaddr_in v4;
+		struct sockaddr_in6 v6;
+	} peers;
+	int peers_len;
+	struct net *ns;
+
+	/** Messages waiting for @tx_work. */
+	struct list_head tx;
+	unsigned int tx_count;
+	spinlock_t tx_lock;
+	struct work_struct tx_work;
+
+	/** Drains the socket; scheduled by data_ready(). */
+	struct work_struct rx_work;
+	/** Only @rx_work touches this. */
+	unsigned char *rx_buffer;
+#if LINUX_VERSION_AT_LEAST(3, 15, 0, 7, 2)
+	void (*old_data_ready)(struct sock *sk);
+#else
+	void (*old_data_ready)(struct sock *sk, int bytes);
+#endif
+
+	/** The socket has to be released in process context. */
+	struct work_struct destroy_work;
+	struct kref refs;
+};
+
+static struct workqueue_struct *wq;
+
+int jsock_setup(void)
+{
+	wq = alloc_workqueue("jool_joold", 0, 0);
+	if (!wq) {
+		log_err("Could not allocate the joold workqueue.");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void jsock_teardown(void)
+{
+	/* Also waits for the pending destructions. */
+	destroy_workqueue(wq);
+}
+
+/**
+ * Waits until every socket whose last reference is already gone has been
+ * released.
+ */
+void jsock_barrier(void)
+{
+	flush_workqueue(wq);
+}
+
+static int set_opt(struct socket *sock, int level, int name, void *value,
+		unsigned int len)
+{
+	int error;
+
+#if LINUX_VERSION_AT_LEAST(5, 9, 0, 9999, 0)
+	error = sock->ops->setsockopt(sock, level, name, KERNEL_SOCKPTR(value),
+			len);
+#elif LINUX_VERSION_LOWER_THAN(5, 8, 0, 9999, 0)
+	error = kernel_setsockopt(sock, level, name, value, len);
+#else
+	error = -EOPNOTSUPP;
+#endif
+
+	if (error)
+		log_err("Could not set socket option %d/%d: %d", level, name,
+				error);
+	return error;
+}
+
+static int set_opt_int(struct socket *sock, int level, int name, int value)
+{
+	return set_opt(sock, level, name, &value, sizeof(value));
+}
+
+static int bind4(struct joold_socket *jsock, struct joold_bind_request *req)
+{
+	struct sockaddr_in addr;
+	struct ip_mreqn mreq;
+	int error;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = req->port;
+	error = kernel_bind(jsock->sock, (struct sockaddr *)&addr,
+			sizeof(addr));
+	if (error) {
+		log_err("Could not bind the joold socket: %d", error);
+		return error;
+	}
+
+	jsock->peers.v4 = addr;
+	jsock->peers.v4.sin_addr = req->addr.v4;
+	jsock->peers_len = sizeof(jsock->peers.v4);
+
+	if (!ipv4_is_multicast(req->addr.v4.s_addr))
+		return 0;
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.imr_multiaddr = req->addr.v4;
+	mreq.imr_ifindex = req->in_ifindex;
+	error = set_opt(jsock->sock, SOL_IP, IP_ADD_MEMBERSHIP, &mreq,
+			sizeof(mreq));
+	if (error)
+		return error;
+
+	/* Our own messages are not news to us. */
+	error = set_opt_int(jsock->sock, SOL_IP, IP_MULTICAST_LOOP, 0);
+	if (error)
+		return error;
+
+	if (req->ttl) {
+		error = set_opt_int(jsock->sock, SOL_IP, IP_MULTICAST_TTL,
+				req->ttl);
+		if (error)
+			return error;
+	}
+
+	if (req->out_ifindex) {
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.imr_ifindex = req->out_ifindex;
+		error = set_opt(jsock->sock, SOL_IP, IP_MULTICAST_IF, &mreq,
+				sizeof(mreq));
+	}
+
+	return error;
+}
+
+static int bind6(struct joold_socket *jsock, struct joold_bind_request *req)
+{
+	struct sockaddr_in6 addr;
+	struct ipv6_mreq mreq;
+	int error;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_port = req->port;
+	error = kernel_bind(jsock->sock, (struct sockaddr *)&addr,
+			sizeof(addr));
+	if (error) {
+		log_err("Could not bind the joold socket: %d", error);
+		return error;
+	}
+
+	jsock->peers.v6 = addr;
+	jsock->peers.v6.sin6_addr = req->addr.v6;
+	jsock->peers_len = sizeof(jsock->peers.v6);
+
+	if (!ipv6_addr_is_multicast(&req->addr.v6))
+		return 0;
+
+	mreq.ipv6mr_multiaddr = req->addr.v6;
+	mreq.ipv6mr_ifindex = req->in_ifindex;
+	error = set_opt(jsock->sock, SOL_IPV6, IPV6_ADD_MEMBERSHIP, &mreq,
+			sizeof(mreq));
+	if (error)
+		return error;
+
+	error = set_opt_int(jsock->sock, SOL_IPV6, IPV6_MULTICAST_LOOP, 0);
+	if (error)
+		return error;
+
+	if (req->ttl) {
+		error = set_opt_int(jsock->sock, SOL_IPV6, IPV6_MULTICAST_HOPS,
+				req->ttl);
+		if (error)
+			return error;
+	}
+
+	if (req->out_ifindex)
+		error = set_opt_int(jsock->sock, SOL_IPV6, IPV6_MULTICAST_IF,
+				req->out_ifindex);
+
+	return error;
+}
+
+/**
+ * Hands one peer's message to the instance, the same way
+ * handle_joold_request() would have if the daemon had written it.
+ */
+static void handle_msg(struct joold_socket *jsock, void *data, size_t len)
+{
+	struct request_hdr *hdr = data;
+	struct joold_adv_request *adv;
+	struct xlator jool;
+	unsigned int window;
+
+	/* Don't pester the log about whatever else reaches the port. */
+	if (len < sizeof(*hdr) || memcmp(hdr->magic, "jool", 4) != 0)
+		return;
+	if (validate_request(data, len, "joold peer", "kernel module", NULL))
+		return;
+	if (be16_to_cpu(hdr->mode) != MODE_JOOLD)
+		return;
+
+	if (xlator_find(jsock->ns, &jool))
+		return;
+
+	data += sizeof(*hdr);
+	len -= sizeof(*hdr);
+
+	switch (be16_to_cpu(hdr->operation)) {
+	case OP_ADD:
+		joold_sync(&jool, data, len);
+		break;
+	case OP_UPDATE:
+		joold_update(&jool, data, len);
+		break;
+	case OP_ADVERTISE_END:
+		joold_adv_end(&jool, data, len);
+		break;
+	case OP_ADVERTISE:
+		window = 0;
+		if (len >= sizeof(*adv)) {
+			adv = data;
+			window = be32_to_cpu(adv->window);
+		}
+		joold_advertise(&jool, window);
+		break;
+	default:
+		log_debug("Ignoring joold operation %u from the network.",
+				be16_to_cpu(hdr->operation));
+	}
+
+	xlator_put(&jool);
+}
+
+static void rx_work_fn(struct work_struct *work)
+{
+	struct joold_socket *jsock;
+	struct msghdr msg;
+	struct kvec iov;
+	int len;
+
+	jsock = container_of(work, struct joold_socket, rx_work);
+
+	do {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = jsock->rx_buffer;
+		iov.iov_len = JOOLD_MAX_PAYLOAD;
+		len = kernel_recvmsg(jsock->sock, &msg, &iov, 1,
+				JOOLD_MAX_PAYLOAD, MSG_DONTWAIT);
+		if (len < 0)
+			break;
+		if (msg.msg_flags & MSG_TRUNC) {
+			log_debug("Dropping an oversized joold message.");
+			continue;
+		}
+		handle_msg(jsock, jsock->rx_buffer, len);
+	} while (true);
+
+	if (len != -EAGAIN)
+		log_debug("kernel_recvmsg() returned %d.", len);
+}
+
+#if LINUX_VERSION_AT_LEAST(3, 15, 0, 7, 2)
+static void data_ready(struct sock *sk)
+#else
+static void data_ready(struct sock *sk, int bytes)
+#endif
+{
+	struct joold_socket *jsock;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	jsock = sk->sk_user_data;
+	if (jsock)
+		queue_work(wq, &jsock->rx_work);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void tx_work_fn(struct work_struct *work)
+{
+	struct joold_socket *jsock;
+	struct jsock_msg *node;
+	struct jsock_msg *tmp;
+	struct msghdr msg;
+	struct kvec iov;
+	LIST_HEAD(list);
+	int error;
+
+	jsock = container_of(work, struct joold_socket, tx_work);
+
+	spin_lock_bh(&jsock->tx_lock);
+	list_splice_init(&jsock->tx, &list);
+	jsock->tx_count = 0;
+	spin_unlock_bh(&jsock->tx_lock);
+
+	list_for_each_entry_safe(node, tmp, &list, hook) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &jsock->peers;
+		msg.msg_namelen = jsock->peers_len;
+		msg.msg_flags = MSG_DONTWAIT;
+		iov.iov_base = node->data;
+		iov.iov_len = node->len;
+
+		error = kernel_sendmsg(jsock->sock, &msg, &iov, 1, node->len);
+		if (error < 0)
+			log_debug("kernel_sendmsg() returned %d.", error);
+
+		list_del(&node->hook);
+		__wkfree("joold tx msg", node);
+	}
+}
+
+/**
+ * Queues a copy of @data (a request_hdr and its payload) for transmission to
+ * the peers. Can be called in any context.
+ */
+void jsock_send(struct joold_socket *jsock, void *data, size_t len)
+{
+	struct jsock_msg *node;
+
+	node = __wkmalloc("joold tx msg", sizeof(*node) + len, GFP_ATOMIC);
+	if (!node)
+		return;
+	node->len = len;
+	memcpy(node->data, data, len);
+
+	spin_lock_bh(&jsock->tx_lock);
+	if (jsock->tx_count >= JSOCK_TX_MAX) {
+		spin_unlock_bh(&jsock->tx_lock);
+		log_debug("The joold transmission queue is full; dropping.");
+		__wkfree("joold tx msg", node);
+		return;
+	}
+	list_add_tail(&node->hook, &jsock->tx);
+	jsock->tx_count++;
+	spin_unlock_bh(&jsock->tx_lock);
+
+	queue_work(wq, &jsock->tx_work);
+}
+
+static void destroy_work_fn(struct work_struct *work)
+{
+	struct joold_socket *jsock;
+	struct sock *sk;
+	struct jsock_msg *node;
+	struct jsock_msg *tmp;
+
+	jsock = container_of(work, struct joold_socket, destroy_work);
+	sk = jsock->sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_data_ready = jsock->old_data_ready;
+	sk->sk_user_data = NULL;
+	write_unlock_bh(&sk->sk_callback_lock);
+
+	/* Nobody can schedule these anymore. */
+	cancel_work_sync(&jsock->rx_work);
+	cancel_work_sync(&jsock->tx_work);
+	list_for_each_entry_safe(node, tmp, &jsock->tx, hook)
+		__wkfree("joold tx msg", node);
+
+	sock_release(jsock->sock);
+	__wkfree("joold rx buffer", jsock->rx_buffer);
+	wkfree(struct joold_socket, jsock);
+	log_debug("The joold socket is gone.");
+}
+
+/**
+ * Creates a socket bound to @request's port, subscribed to its address (if
+ * multicast), and ready to exchange sessions with the peers on behalf of
+ * @ns's instance.
+ */
+int jsock_create(struct net *ns, struct joold_bind_request *request,
+		struct joold_socket **result)
+{
+	struct joold_socket *jsock;
+	struct sock *sk;
+	int error;
+
+	if (request->family != AF_INET && request->family != AF_INET6) {
+		log_err("Unknown address family: %u", request->family);
+		return -EINVAL;
+	}
+
+	jsock = wkmalloc(struct joold_socket, GFP_KERNEL);
+	if (!jsock)
+		return -ENOMEM;
+	jsock->rx_buffer = __wkmalloc("joold rx buffer", JOOLD_MAX_PAYLOAD,
+			GFP_KERNEL);
+	if (!jsock->rx_buffer) {
+		error = -ENOMEM;
+		goto buffer_fail;
+	}
+
+#if LINUX_VERSION_AT_LEAST(4, 2, 0, 9999, 0)
+	error = sock_create_kern(ns, request->family, SOCK_DGRAM, IPPROTO_UDP,
+			&jsock->sock);
+#else
+	error = sock_create_kern(request->family, SOCK_DGRAM, IPPROTO_UDP,
+			&jsock->sock);
+	if (!error)
+		sk_change_net(jsock->sock->sk, ns);
+#endif
+	if (error) {
+		log_err("Could not create the joold socket: %d", error);
+		goto sock_fail;
+	}
+
+	sk = jsock->sock->sk;
+	/* A daemon (or another instance) on the same host might want it too. */
+	if (request->reuseaddr)
+		sk->sk_reuse = SK_CAN_REUSE;
+
+	error = (request->family == AF_INET)
+			? bind4(jsock, request)
+			: bind6(jsock, request);
+	if (error)
+		goto bind_fail;
+
+	/*
+	 * Like every kernel socket, this one doesn't hold a reference to @ns.
+	 * The instance and its joold queue already do, and the socket dies
+	 * with the queue. It's released on the workqueue, though, possibly
+	 * after the queue drops the last reference; joolns_exit_net() waits
+	 * for that through jsock_barrier().
+	 */
+	jsock->ns = ns;
+	INIT_LIST_HEAD(&jsock->tx);
+	jsock->tx_count = 0;
+	spin_lock_init(&jsock->tx_lock);
+	INIT_WORK(&jsock->tx_work, tx_work_fn);
+	INIT_WORK(&jsock->rx_work, rx_work_fn);
+	INIT_WORK(&jsock->destroy_work, destroy_work_fn);
+	kref_init(&jsock->refs);
+
+	write_lock_bh(&sk->sk_callback_lock);
+	jsock->old_data_ready = sk->sk_data_ready;
+	sk->sk_user_data = jsock;
+	sk->sk_data_ready = data_ready;
+	write_unlock_bh(&sk->sk_callback_lock);
+
+	/* Whatever arrived while we were getting ready. */
+	queue_work(wq, &jsock->rx_work);
+
+	*result = jsock;
+	return 0;
+
+bind_fail:
+	sock_release(jsock->sock);
+sock_fail:
+	__wkfree("joold rx buffer", jsock->rx_buffer);
+buffer_fail:
+	wkfree(struct joold_socket, jsock);
+	return error;
+}
+
+void jsock_get(struct joold_socket *jsock)
+{
+	kref_get(&jsock->refs);
+}
+
+static void jsock_release(struct kref *refs)
+{
+	struct joold_socket *jsock;
+
+	jsock = container_of(refs, struct joold_socket, refs);
+	queue_work(wq, &jsock->destroy_work);
+}
+
+/**
+ * Can be called in any context; the socket is actually released later, by the
+ * workqueue.
+ */
+void jsock_put(struct joold_socket *jsock)
+{
+	kref_put(&jsock->refs, jsock_release);
+}
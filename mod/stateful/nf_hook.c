@@ -5,16 +5,20 @@
 #include "nat64/common/constants.h"
 #include "nat64/common/xlat.h"
 #include "nat64/mod/common/core.h"
+#include "nat64/mod/common/ingress.h"
 #include "nat64/mod/common/linux_version.h"
 #include "nat64/mod/common/nf_wrapper.h"
 #include "nat64/mod/common/pool6.h"
+#include "nat64/mod/common/route.h"
+#include "nat64/mod/common/rfc6145/6to4.h"
+#include "nat64/mod/common/skb_pool.h"
 #include "nat64/mod/common/wkmalloc.h"
 #include "nat64/mod/common/xlator.h"
 #include "nat64/mod/common/nl/nl_handler.h"
 #include "nat64/mod/stateful/fragment_db.h"
 #include "nat64/mod/stateful/joold.h"
-#include "nat64/mod/stateful/timer.h"
 #include "nat64/mod/stateful/pool4/db.h"
+#include "nat64/mod/stateful/pool4/empty.h"
 #include "nat64/mod/stateful/pool4/rfc6056.h"
 #include "nat64/mod/stateful/bib/db.h"
 
@@ -67,6 +71,8 @@ static NF_CALLBACK(hook_ipv6, skb)
 
 static NF_CALLBACK(hook_ipv4, skb)
 {
+	if (!fragdb_defrag4(skb))
+		return NF_STOLEN;
 	return core_4to6(skb, skb->dev);
 }
 
@@ -139,15 +145,27 @@ static int __init jool_init(void)
 	error = rfc6056_setup();
 	if (error)
 		goto rfc6056_fail;
+	error = pool4empty_setup();
+	if (error)
+		goto pool4empty_fail;
+	error = route_cache_setup();
+	if (error)
+		goto route_cache_fail;
+	error = ttp64_setup();
+	if (error)
+		goto ttp64_fail;
+	error = skbpool_setup();
+	if (error)
+		goto skbpool_fail;
+	error = ingress_setup();
+	if (error)
+		goto ingress_fail;
 	error = xlator_setup();
 	if (error)
 		goto xlator_fail;
 	error = nlhandler_setup();
 	if (error)
 		goto nlhandler_fail;
-	error = jtimer_setup();
-	if (error)
-		goto jtimer_fail;
 
 	/* This needs to be last! (except for the hook registering.) */
 	error = add_instance();
@@ -155,7 +173,7 @@ static int __init jool_init(void)
 		goto instance_fail;
 
 #if LINUX_VERSION_LOWER_THAN(4, 13, 0, 9999, 0)
-	/* Hook Jool to Netfilter. */
+	/* Hook Jool to Netfilter. (ingress_setup() rejects ingress mode here.) */
 	error = nf_register_hooks(nfho, ARRAY_SIZE(nfho));
 	if (error)
 		goto nf_register_hooks_fail;
@@ -170,12 +188,20 @@ nf_register_hooks_fail:
 	xlator_rm();
 #endif
 instance_fail:
-	jtimer_teardown();
-jtimer_fail:
 	nlhandler_teardown();
 nlhandler_fail:
 	xlator_teardown();
 xlator_fail:
+	ingress_teardown();
+ingress_fail:
+	skbpool_teardown();
+skbpool_fail:
+	ttp64_teardown();
+ttp64_fail:
+	route_cache_teardown();
+route_cache_fail:
+	pool4empty_teardown();
+pool4empty_fail:
 	rfc6056_teardown();
 rfc6056_fail:
 	joold_teardown();
@@ -193,9 +219,13 @@ static void __exit jool_exit(void)
 	nf_unregister_hooks(nfho, ARRAY_SIZE(nfho));
 #endif
 
-	jtimer_teardown();
 	nlhandler_teardown();
 	xlator_teardown();
+	ingress_teardown();
+	skbpool_teardown();
+	ttp64_teardown();
+	route_cache_teardown();
+	pool4empty_teardown();
 	rfc6056_teardown();
 	joold_teardown();
 	fragdb_teardown();
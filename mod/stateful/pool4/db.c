@@ -1,7 +1,11 @@
 #include "nat64/mod/stateful/pool4/db.h"
 
+#include <linux/bitops.h>
 #include <linux/hash.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
 #include "nat64/common/str_utils.h"
 #include "nat64/common/types.h"
@@ -19,11 +23,24 @@
  * Each table is made out of entries (struct pool4_range).
  * Entries are roughly what the user --pool4 --added.
  *
- * There's also struct mask_domain, which is a copy of a table, and with
+ * There's also struct mask_domain, which is a view of a table, and with
  * the ability to iterate through its entries' transport addresses easily.
  * So tables are the compact version meant for storage and need locking, domains
  * are more versatile, disposable, meant for outside use and don't need locking.
  *
+ * The packet path never sees the trees the writers edit, though. Whenever
+ * pool4 changes, the writer clones both tree groups into a struct
+ * pool4_snapshot and publishes it through RCU. Snapshots are never modified
+ * after they're published, so lookups only need rcu_read_lock(), and a reader
+ * can never be preempted by (or spin behind) a writer. The old snapshot is
+ * freed after a grace period. Snapshots also hash their mark tables (struct
+ * mark_index), so the number of marks doesn't slow down connection setup.
+ *
+ * Since snapshot tables don't change, domains don't copy them either; they
+ * point to the snapshot's ranges and keep the RCU read-side critical section
+ * open until mask_domain_put(). The domain itself is a per-CPU scratch
+ * structure, so connection setup neither allocates nor copies.
+ *
  * Only pool4 and mask_domain are public, and only in declaration form.
  *
  * Unlike the BIB, these terms haven't been documented in the user manual so
@@ -64,6 +81,14 @@ struct pool4_table {
 	 * ITERATIONS_SET is not relevant here.
 	 */
 	enum iteration_flags max_iterations_flags;
+	/**
+	 * What compute_max_iterations() yields for this table, given its
+	 * current @taddr_count and flags.
+	 *
+	 * Refreshed by publish(), so the packet path (and the userspace dumps)
+	 * don't have to run the heuristics every time.
+	 */
+	unsigned int max_iterations;
 
 	/*
 	 * An array of struct pool4_range hangs off here.
@@ -85,13 +110,47 @@ struct pool4_trees {
 	struct rb_root icmp;
 };
 
+/**
+ * Open-addressing hash table of a snapshot's mark tables, so massively
+ * multi-tenant pool4s don't have to descend a tree per new connection.
+ * (Linear probing; at most half of the slots are used.)
+ */
+struct mark_index {
+	unsigned int bits;
+	struct pool4_table *tables[];
+};
+
+/**
+ * A read-only copy of pool4's trees. This is what the packet path queries.
+ */
+struct pool4_snapshot {
+	struct pool4_trees tree_mark;
+	struct pool4_trees tree_addr;
+	/**
+	 * Indexes @tree_mark, one per protocol. NULL means the index could not
+	 * be allocated, and the tree has to be used instead.
+	 */
+	struct mark_index *mark_index[L4PROTO_OTHER];
+	struct rcu_head rcu;
+};
+
 struct pool4 {
 	/** Entries indexed via mark. (Normally used in 6->4) */
 	struct pool4_trees tree_mark;
 	/** Entries indexed via address. (Normally used in 4->6) */
 	struct pool4_trees tree_addr;
 
-	spinlock_t lock;
+	/**
+	 * Clone of the trees above, as of the last write.
+	 * NULL means pool4 is empty.
+	 */
+	struct pool4_snapshot __rcu *snapshot;
+
+	/**
+	 * Serializes writers, and protects the trees above from the foreach.
+	 * Readers of @snapshot don't need it.
+	 */
+	struct mutex lock;
 	struct kref refcounter;
 };
 
@@ -99,13 +158,26 @@ struct mask_domain {
 	__u32 pool_mark;
 
 	unsigned int taddr_count;
+	/** Transport addresses visited so far, including the skipped ones. */
 	unsigned int taddr_counter;
+	/** Transport addresses handed to the caller so far. */
+	unsigned int iterations;
 	/* ITERATIONS_INFINITE is represented by this being zero. */
 	unsigned int max_iterations;
 
+	/**
+	 * The ranges. Static domains point to a snapshot table, dynamic
+	 * domains point to @dynamic_range.
+	 */
+	struct pool4_range *ranges;
 	unsigned int range_count;
 	struct pool4_range *current_range;
 	int current_port;
+	/** The RFC 6056 F() result the domain was built for. */
+	unsigned int offset;
+	/** Where the iteration started. (For mask_domain_rewind().) */
+	struct pool4_range *first_range;
+	int first_port;
 
 	/**
 	 * A "dynamic" domain is one that was generated on the fly - that is,
@@ -118,13 +190,18 @@ struct mask_domain {
 	 * static domains.
 	 */
 	bool dynamic;
+	/** Storage for the single range of a dynamic domain. */
+	struct pool4_range dynamic_range;
 
-	/*
-	 * An array of struct pool4_range hangs off here.
-	 * (The array length is @sample_count.)
+	/**
+	 * Is some mask_domain_find() caller still using this?
+	 * (Only here to catch nested finds; they'd clobber each other.)
 	 */
+	bool busy;
 };
 
+static DEFINE_PER_CPU(struct mask_domain, scratch_domain);
+
 /**
  * Assumes @domain has at least one entry.
  */
@@ -208,7 +285,7 @@ static struct pool4_range *last_table_entry(struct pool4_table *table)
 
 static struct pool4_range *first_domain_entry(struct mask_domain *domain)
 {
-	return (struct pool4_range *)(domain + 1);
+	return domain->ranges;
 }
 
 /* Leaves table->addr and table->mark undefined! */
@@ -217,7 +294,7 @@ static struct pool4_table *create_table(struct pool4_range *range)
 	struct pool4_table *table;
 	struct pool4_range *entry;
 
-	table = __wkmalloc("pool4table",
+	table = __wkmalloc_as(JMEM_POOL4, "pool4table",
 			sizeof(struct pool4_table) + sizeof(struct pool4_range),
 			GFP_ATOMIC);
 	if (!table)
@@ -227,6 +304,7 @@ static struct pool4_table *create_table(struct pool4_range *range)
 	table->sample_count = 1;
 	table->max_iterations_allowed = 0;
 	table->max_iterations_flags = ITERATIONS_AUTO;
+	table->max_iterations = 0;
 
 	entry = first_table_entry(table);
 	*entry = *range;
@@ -238,7 +316,7 @@ struct pool4 *pool4db_alloc(void)
 {
 	struct pool4 *result;
 
-	result = wkmalloc(struct pool4, GFP_KERNEL);
+	result = wkmalloc_as(JMEM_POOL4, struct pool4, GFP_KERNEL);
 	if (!result)
 		return NULL;
 
@@ -248,7 +326,8 @@ struct pool4 *pool4db_alloc(void)
 	result->tree_addr.tcp = RB_ROOT;
 	result->tree_addr.udp = RB_ROOT;
 	result->tree_addr.icmp = RB_ROOT;
-	spin_lock_init(&result->lock);
+	RCU_INIT_POINTER(result->snapshot, NULL);
+	mutex_init(&result->lock);
 	kref_init(&result->refcounter);
 
 	return result;
@@ -261,7 +340,7 @@ void pool4db_get(struct pool4 *pool)
 
 static void destroy_table(struct pool4_table *table)
 {
-	__wkfree("pool4table", table);
+	__wkfree_as(JMEM_POOL4, "pool4table", table);
 }
 
 static void destroy_table_by_node(struct rb_node *node, void *arg)
@@ -271,22 +350,321 @@ static void destroy_table_by_node(struct rb_node *node, void *arg)
 	destroy_table(table);
 }
 
+static void clear_group(struct pool4_trees *trees)
+{
+	rbtree_clear(&trees->tcp, destroy_table_by_node, NULL);
+	rbtree_clear(&trees->udp, destroy_table_by_node, NULL);
+	rbtree_clear(&trees->icmp, destroy_table_by_node, NULL);
+}
+
 static void clear_trees(struct pool4 *pool)
 {
-	rbtree_clear(&pool->tree_mark.tcp, destroy_table_by_node, NULL);
-	rbtree_clear(&pool->tree_mark.udp, destroy_table_by_node, NULL);
-	rbtree_clear(&pool->tree_mark.icmp, destroy_table_by_node, NULL);
-	rbtree_clear(&pool->tree_addr.tcp, destroy_table_by_node, NULL);
-	rbtree_clear(&pool->tree_addr.udp, destroy_table_by_node, NULL);
-	rbtree_clear(&pool->tree_addr.icmp, destroy_table_by_node, NULL);
+	clear_group(&pool->tree_mark);
+	clear_group(&pool->tree_addr);
+}
+
+static void destroy_snapshot(struct pool4_snapshot *snapshot)
+{
+	unsigned int i;
+
+	for (i = 0; i < L4PROTO_OTHER; i++)
+		if (snapshot->mark_index[i])
+			__wkfree_as(JMEM_POOL4, "pool4 mark index",
+					snapshot->mark_index[i]);
+	clear_group(&snapshot->tree_mark);
+	clear_group(&snapshot->tree_addr);
+	wkfree_as(JMEM_POOL4, struct pool4_snapshot, snapshot);
+}
+
+static void destroy_snapshot_rcu(struct rcu_head *rcu)
+{
+	destroy_snapshot(container_of(rcu, struct pool4_snapshot, rcu));
+}
+
+static unsigned int compute_max_iterations(const struct pool4_table *table)
+{
+	unsigned int result;
+
+	if (table->max_iterations_flags & ITERATIONS_INFINITE)
+		return 0;
+	if (!(table->max_iterations_flags & ITERATIONS_AUTO))
+		return table->max_iterations_allowed;
+
+	/*
+	 * The following heuristics are based on a few tests I ran. Keep in mind
+	 * that none of them are imposed on the user; they only define the
+	 * default value.
+	 *
+	 * The tests were as follows:
+	 *
+	 * For every one of the following pool4 sizes (in transport addresses),
+	 * I exhausted the corresponding pool4 16 times and kept track of how
+	 * many iterations I needed to allocate a connection in every step.
+	 *
+	 * The sizes were 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536,
+	 * 131072, 196608, 262144, 327680, 393216, 458752, 524288, 1048576 and
+	 * 2097152.
+	 *
+	 * I did not test larger pool4s because I feel like more than 32 full
+	 * addresses is rather pushing it and would all the likely require
+	 * manual intervention anyway.
+	 */
+
+	/*
+	 * Right shift 7 is the same as division by 128. Why 128?
+	 * Because I want roughly 1% of the total size, and also don't want any
+	 * floating point arithmetic.
+	 * Integer division by 100 would be acceptable, but this is faster.
+	 */
+	result = table->taddr_count >> 7;
+
+	/*
+	 * If the limit is too big, the NAT64 will iterate too much.
+	 * If the limit is too small, the NAT64 will start losing connections
+	 * early.
+	 *
+	 * So first of all, prevent the algorithm from iterating too little.
+	 *
+	 * (The values don't have to be powers or multiples of anything; I just
+	 * really like base 8.)
+	 *
+	 * A result lower than 1024 will be yielded when pool4 is 128k ports
+	 * large or smaller, so the following paragraph (and conditional) only
+	 * applies to this range:
+	 *
+	 * In all of the tests I ran, a max iterations of 1024 would have been a
+	 * reasonable limit that would have completely prevented the NAT64 from
+	 * dropping *any* connections, at least until pool4 was about 91%
+	 * exhausted. (Connections can be technically dropped regardless, but
+	 * it's very unlikely.) Also, on average, most connections would have
+	 * kept succeeding until pool4 reached 98% utilization.
+	 */
+	if (result < 1024)
+		return 1024;
+	/*
+	 * And finally: Prevent the algorithm from iterating too much.
+	 *
+	 * 8k will begin dropping connections at 95% utilization and most
+	 * connections will remain on the success side until 99% exhaustion.
+	 */
+	if (result > 8192)
+		return 8192;
+	return result;
+}
+
+/**
+ * Refreshes the cached max_iterations of every table in @tree.
+ */
+static void update_max_iterations(struct rb_root *tree)
+{
+	struct rb_node *node;
+	struct pool4_table *table;
+
+	for (node = rb_first(tree); node; node = rb_next(node)) {
+		table = rb_entry(node, struct pool4_table, tree_hook);
+		table->max_iterations = compute_max_iterations(table);
+	}
+}
+
+/**
+ * Clones @src into @dst. @dst is assumed to be empty.
+ *
+ * Because @src is traversed in order, every new node is the rightmost one, so
+ * there's no need to compare keys.
+ */
+static int clone_tree(struct rb_root *src, struct rb_root *dst)
+{
+	struct rb_node *node;
+	struct rb_node *last = NULL;
+	struct pool4_table *table;
+	struct pool4_table *clone;
+	size_t size;
+
+	for (node = rb_first(src); node; node = rb_next(node)) {
+		table = rb_entry(node, struct pool4_table, tree_hook);
+		size = sizeof(struct pool4_table)
+				+ table->sample_count * sizeof(struct pool4_range);
+
+		clone = __wkmalloc_as(JMEM_POOL4, "pool4table", size,
+				GFP_KERNEL);
+		if (!clone)
+			return -ENOMEM;
+		memcpy(clone, table, size);
+
+		rb_link_node(&clone->tree_hook, last,
+				last ? &last->rb_right : &dst->rb_node);
+		rb_insert_color(&clone->tree_hook, dst);
+		last = &clone->tree_hook;
+	}
+
+	return 0;
+}
+
+static int clone_group(struct pool4_trees *src, struct pool4_trees *dst)
+{
+	int error;
+
+	error = clone_tree(&src->tcp, &dst->tcp);
+	if (error)
+		return error;
+	error = clone_tree(&src->udp, &dst->udp);
+	if (error)
+		return error;
+	return clone_tree(&src->icmp, &dst->icmp);
+}
+
+/**
+ * Builds the mark index of @tree. Returns NULL if the tree is empty or memory
+ * is short; the tree is still usable in that case, so that's not an error.
+ */
+static struct mark_index *index_marks(struct rb_root *tree)
+{
+	struct mark_index *index;
+	struct rb_node *node;
+	struct pool4_table *table;
+	unsigned int count = 0;
+	unsigned int bits;
+	unsigned int mask;
+	unsigned int i;
+
+	for (node = rb_first(tree); node; node = rb_next(node))
+		count++;
+	if (!count)
+		return NULL;
+
+	bits = ilog2(roundup_pow_of_two(2 * count));
+	index = __wkmalloc_as(JMEM_POOL4, "pool4 mark index",
+			sizeof(struct mark_index)
+			+ (sizeof(struct pool4_table *) << bits),
+			GFP_KERNEL | __GFP_NOWARN);
+	if (!index)
+		return NULL;
+
+	index->bits = bits;
+	mask = (1U << bits) - 1;
+	memset(index->tables, 0, sizeof(struct pool4_table *) << bits);
+
+	for (node = rb_first(tree); node; node = rb_next(node)) {
+		table = rb_entry(node, struct pool4_table, tree_hook);
+		i = hash_32(table->mark, bits);
+		while (index->tables[i])
+			i = (i + 1) & mask;
+		index->tables[i] = table;
+	}
+
+	return index;
+}
+
+static struct pool4_table *find_by_mark_index(struct mark_index *index,
+		__u32 mark)
+{
+	struct pool4_table *table;
+	unsigned int mask = (1U << index->bits) - 1;
+	unsigned int i;
+
+	for (i = hash_32(mark, index->bits); (table = index->tables[i]);
+			i = (i + 1) & mask) {
+		if (table->mark == mark)
+			return table;
+	}
+
+	return NULL;
+}
+
+/**
+ * find_by_mark(), for snapshots. Uses the index if there's one.
+ */
+static struct pool4_table *find_snapshot_mark(struct pool4_snapshot *snapshot,
+		l4_protocol proto, __u32 mark)
+{
+	if (proto < L4PROTO_OTHER && snapshot->mark_index[proto])
+		return find_by_mark_index(snapshot->mark_index[proto], mark);
+	return find_by_mark(get_tree(&snapshot->tree_mark, proto), mark);
+}
+
+static struct pool4_snapshot *get_snapshot(struct pool4 *pool)
+{
+	return rcu_dereference_protected(pool->snapshot,
+			lockdep_is_held(&pool->lock));
+}
+
+/**
+ * Replaces @pool's snapshot with a fresh clone of its trees.
+ * Has to be called, with the lock held, after every write.
+ *
+ * If this fails, the packet path keeps seeing the previous state of pool4
+ * until some later write manages to publish.
+ */
+static int publish(struct pool4 *pool)
+{
+	struct pool4_snapshot *old;
+	struct pool4_snapshot *new;
+	int error;
+
+	/*
+	 * Only the mark tables are ever iterated on. (The address tables are
+	 * 4->6, and don't need to allocate anything.)
+	 * This happens before the clone so the sample dumps (which query the
+	 * writer trees) see the new values even if the allocation fails.
+	 */
+	update_max_iterations(&pool->tree_mark.tcp);
+	update_max_iterations(&pool->tree_mark.udp);
+	update_max_iterations(&pool->tree_mark.icmp);
+
+	if (is_empty(pool)) {
+		new = NULL;
+	} else {
+		new = wkmalloc_as(JMEM_POOL4, struct pool4_snapshot,
+				GFP_KERNEL);
+		if (!new)
+			goto enomem;
+
+		new->tree_mark.tcp = RB_ROOT;
+		new->tree_mark.udp = RB_ROOT;
+		new->tree_mark.icmp = RB_ROOT;
+		new->tree_addr.tcp = RB_ROOT;
+		new->tree_addr.udp = RB_ROOT;
+		new->tree_addr.icmp = RB_ROOT;
+
+		memset(new->mark_index, 0, sizeof(new->mark_index));
+
+		error = clone_group(&pool->tree_mark, &new->tree_mark);
+		if (!error)
+			error = clone_group(&pool->tree_addr, &new->tree_addr);
+		if (error) {
+			destroy_snapshot(new);
+			goto enomem;
+		}
+
+		new->mark_index[L4PROTO_TCP] = index_marks(&new->tree_mark.tcp);
+		new->mark_index[L4PROTO_UDP] = index_marks(&new->tree_mark.udp);
+		new->mark_index[L4PROTO_ICMP] = index_marks(&new->tree_mark.icmp);
+	}
+
+	old = get_snapshot(pool);
+	rcu_assign_pointer(pool->snapshot, new);
+	if (old)
+		call_rcu(&old->rcu, destroy_snapshot_rcu);
+	return 0;
+
+enomem:
+	log_err("Could not allocate the new pool4 snapshot. The translator will keep using the old one until the next successful pool4 change.");
+	return -ENOMEM;
 }
 
 static void pool4db_release(struct kref *refcounter)
 {
 	struct pool4 *pool;
+	struct pool4_snapshot *snapshot;
+
 	pool = container_of(refcounter, struct pool4, refcounter);
+
+	/* Nobody else holds a reference, so nobody is reading this. */
+	snapshot = rcu_dereference_protected(pool->snapshot, 1);
+	if (snapshot)
+		destroy_snapshot(snapshot);
 	clear_trees(pool);
-	wkfree(struct pool4, pool);
+	wkfree_as(JMEM_POOL4, struct pool4, pool);
 }
 
 void pool4db_put(struct pool4 *pool)
@@ -460,7 +838,7 @@ static int add_to_mark_tree(struct pool4 *pool,
 
 	collision = rbtree_add(table, entry->mark, tree, cmp_mark,
 			struct pool4_table, tree_hook);
-	/* The spinlock is held, so this is critical. */
+	/* The lock is held, so this is critical. */
 	if (WARN(collision, "Table wasn't and then was in the tree.")) {
 		destroy_table(table);
 		return -EINVAL;
@@ -494,7 +872,7 @@ static int add_to_addr_tree(struct pool4 *pool,
 
 	collision = rbtree_add(table, &table->addr, tree, cmp_addr,
 			struct pool4_table, tree_hook);
-	/* The spinlock is held, so this is critical. */
+	/* The lock is held, so this is critical. */
 	if (WARN(collision, "Table wasn't and then was in the tree.")) {
 		destroy_table(table);
 		return -EINVAL;
@@ -507,7 +885,7 @@ int pool4db_add(struct pool4 *pool, const struct pool4_entry_usr *entry)
 {
 	struct pool4_range addend = { .ports = entry->range.ports };
 	u64 tmp;
-	int error;
+	int error = 0;
 
 	error = prefix4_validate(&entry->range.prefix);
 	if (error)
@@ -526,23 +904,29 @@ int pool4db_add(struct pool4 *pool, const struct pool4_entry_usr *entry)
 			&range->prefix.address, range->prefix.len,
 			range->ports.min, range->ports.max); */
 
+	mutex_lock(&pool->lock);
+
 	foreach_addr4(addend.addr, tmp, &entry->range.prefix) {
-		spin_lock_bh(&pool->lock);
 		error = add_to_mark_tree(pool, entry, &addend);
-		if (!error) {
-			error = add_to_addr_tree(pool, entry, &addend);
-			if (error)
-				goto trainwreck;
-		}
-		spin_unlock_bh(&pool->lock);
 		if (error)
-			return error;
+			break;
+		error = add_to_addr_tree(pool, entry, &addend);
+		if (error)
+			goto trainwreck;
 	}
 
-	return 0;
+	/*
+	 * The addresses that were added before a failure (if any) stay, so
+	 * publish regardless.
+	 */
+	if (publish(pool) && !error)
+		error = -ENOMEM;
+	mutex_unlock(&pool->lock);
+	return error;
 
 trainwreck:
-	spin_unlock_bh(&pool->lock);
+	publish(pool);
+	mutex_unlock(&pool->lock);
 	/*
 	 * We're in a serious conundrum.
 	 * We cannot revert the add_to_mark_tree() because of port range fusing;
@@ -605,17 +989,17 @@ int pool4db_update(struct pool4 *pool, const struct pool4_update *update)
 	if (error)
 		return error;
 
-	spin_lock_bh(&pool->lock);
+	mutex_lock(&pool->lock);
 
 	tree = get_tree(&pool->tree_mark, update->l4_proto);
 	if (!tree) {
-		spin_unlock_bh(&pool->lock);
+		mutex_unlock(&pool->lock);
 		return -EINVAL;
 	}
 
 	table = find_by_mark(tree, update->mark);
 	if (!table) {
-		spin_unlock_bh(&pool->lock);
+		mutex_unlock(&pool->lock);
 		log_err("No entries match mark %u (protocol %s).", update->mark,
 				l4proto_to_string(update->l4_proto));
 		return -ESRCH;
@@ -626,8 +1010,9 @@ int pool4db_update(struct pool4 *pool, const struct pool4_update *update)
 		table->max_iterations_allowed = update->iterations;
 	}
 
-	spin_unlock_bh(&pool->lock);
-	return 0;
+	error = publish(pool);
+	mutex_unlock(&pool->lock);
+	return error;
 }
 
 static int remove_range(struct rb_root *tree, struct pool4_table *table,
@@ -709,7 +1094,7 @@ static int remove_range(struct rb_root *tree, struct pool4_table *table,
 
 	if (table->sample_count == 0) {
 		rb_erase(&table->tree_hook, tree);
-		wkfree(struct pool4_table, table);
+		wkfree_as(JMEM_POOL4, struct pool4_table, table);
 	}
 
 	return error;
@@ -790,13 +1175,16 @@ int pool4db_rm(struct pool4 *pool, const __u32 mark, l4_protocol proto,
 	if (range->ports.min > range->ports.max)
 		swap(range->ports.min, range->ports.max);
 
-	spin_lock_bh(&pool->lock);
+	mutex_lock(&pool->lock);
 
 	error = rm_from_mark_tree(pool, mark, proto, range);
 	if (!error)
 		error = rm_from_addr_tree(pool, proto, range);
 
-	spin_unlock_bh(&pool->lock);
+	/* Also on failure; the trees might have changed partially. */
+	if (publish(pool) && !error)
+		error = -ENOMEM;
+	mutex_unlock(&pool->lock);
 	return error;
 }
 
@@ -807,33 +1195,56 @@ int pool4db_rm_usr(struct pool4 *pool, struct pool4_entry_usr *entry)
 
 void pool4db_flush(struct pool4 *pool)
 {
-	spin_lock_bh(&pool->lock);
+	mutex_lock(&pool->lock);
 	clear_trees(pool);
-	spin_unlock_bh(&pool->lock);
+	publish(pool); /* Empty pool4 doesn't need memory; can't fail. */
+	mutex_unlock(&pool->lock);
 }
 
-static struct pool4_range *find_port_range(struct pool4_table *entry, __u16 port)
+/**
+ * Returns the range (out of the @count @ranges) that contains @addr#@port, or
+ * NULL if there's none.
+ *
+ * Relies on the fact that table ranges are always sorted by address and then
+ * port, and never overlap. (See pool4_add_range() and fix_collisions().)
+ * Domains share their table's order, so this also works on them.
+ */
+static struct pool4_range *bsearch_range(struct pool4_range *ranges,
+		unsigned int count, const struct in_addr *addr, __u16 port)
 {
-	struct pool4_range *first = first_table_entry(entry);
 	struct pool4_range *middle;
-	struct pool4_range *last = first + entry->sample_count - 1;
+	unsigned int left = 0;
+	unsigned int right = count;
+	int gap;
 
-	do {
-		middle = first + ((last - first) / 2);
-		if (port < middle->ports.min) {
-			last = middle - 1;
-			continue;
-		}
-		if (port > middle->ports.max) {
-			first = middle + 1;
-			continue;
+	while (left < right) {
+		middle = ranges + left + (right - left) / 2;
+
+		gap = ipv4_addr_cmp(addr, &middle->addr);
+		if (!gap) {
+			if (port < middle->ports.min)
+				gap = -1;
+			else if (port > middle->ports.max)
+				gap = 1;
+			else
+				return middle;
 		}
-		return middle;
-	} while (first <= last);
+
+		if (gap < 0)
+			right = middle - ranges;
+		else
+			left = middle - ranges + 1;
+	}
 
 	return NULL;
 }
 
+static struct pool4_range *find_port_range(struct pool4_table *entry, __u16 port)
+{
+	return bsearch_range(first_table_entry(entry), entry->sample_count,
+			&entry->addr, port);
+}
+
 /**
  * BTW: The reason why this doesn't care about mark is because it's an
  * inherently 4-to-6 function (it doesn't make sense otherwise).
@@ -842,21 +1253,52 @@ static struct pool4_range *find_port_range(struct pool4_table *entry, __u16 port
 bool pool4db_contains(struct pool4 *pool, struct net *ns, l4_protocol proto,
 		struct ipv4_transport_addr *addr)
 {
+	struct pool4_snapshot *snapshot;
 	struct pool4_table *table;
 	bool found = false;
 
-	spin_lock_bh(&pool->lock);
+	rcu_read_lock();
 
-	if (is_empty(pool)) {
-		spin_unlock_bh(&pool->lock);
+	snapshot = rcu_dereference(pool->snapshot);
+	if (!snapshot) {
+		rcu_read_unlock();
 		return pool4empty_contains(ns, addr);
 	}
 
-	table = find_by_addr(get_tree(&pool->tree_addr, proto), &addr->l3);
+	table = find_by_addr(get_tree(&snapshot->tree_addr, proto), &addr->l3);
 	if (table)
 		found = find_port_range(table, addr->l4) != NULL;
 
-	spin_unlock_bh(&pool->lock);
+	rcu_read_unlock();
+	return found;
+}
+
+/**
+ * Returns whether @addr belongs to any of @pool's entries, regardless of
+ * protocol and port.
+ *
+ * This is a coarser (but header-independent) version of pool4db_contains();
+ * packets it rejects are certainly not meant to be translated.
+ */
+bool pool4db_contains_addr(struct pool4 *pool, struct net *ns,
+		struct in_addr *addr)
+{
+	struct pool4_snapshot *snapshot;
+	bool found;
+
+	rcu_read_lock();
+
+	snapshot = rcu_dereference(pool->snapshot);
+	if (!snapshot) {
+		rcu_read_unlock();
+		return pool4empty_contains_addr(ns, addr);
+	}
+
+	found = find_by_addr(&snapshot->tree_addr.tcp, addr)
+			|| find_by_addr(&snapshot->tree_addr.udp, addr)
+			|| find_by_addr(&snapshot->tree_addr.icmp, addr);
+
+	rcu_read_unlock();
 	return found;
 }
 
@@ -875,84 +1317,12 @@ static int find_offset(struct pool4_table *table, struct pool4_range *offset,
 	return -ESRCH;
 }
 
-static unsigned int compute_max_iterations(const struct pool4_table *table)
-{
-	unsigned int result;
-
-	if (table->max_iterations_flags & ITERATIONS_INFINITE)
-		return 0;
-	if (!(table->max_iterations_flags & ITERATIONS_AUTO))
-		return table->max_iterations_allowed;
-
-	/*
-	 * The following heuristics are based on a few tests I ran. Keep in mind
-	 * that none of them are imposed on the user; they only define the
-	 * default value.
-	 *
-	 * The tests were as follows:
-	 *
-	 * For every one of the following pool4 sizes (in transport addresses),
-	 * I exhausted the corresponding pool4 16 times and kept track of how
-	 * many iterations I needed to allocate a connection in every step.
-	 *
-	 * The sizes were 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536,
-	 * 131072, 196608, 262144, 327680, 393216, 458752, 524288, 1048576 and
-	 * 2097152.
-	 *
-	 * I did not test larger pool4s because I feel like more than 32 full
-	 * addresses is rather pushing it and would all the likely require
-	 * manual intervention anyway.
-	 */
-
-	/*
-	 * Right shift 7 is the same as division by 128. Why 128?
-	 * Because I want roughly 1% of the total size, and also don't want any
-	 * floating point arithmetic.
-	 * Integer division by 100 would be acceptable, but this is faster.
-	 * (Recall that we have a spinlock held.)
-	 */
-	result = table->taddr_count >> 7;
-
-	/*
-	 * If the limit is too big, the NAT64 will iterate too much.
-	 * If the limit is too small, the NAT64 will start losing connections
-	 * early.
-	 *
-	 * So first of all, prevent the algorithm from iterating too little.
-	 *
-	 * (The values don't have to be powers or multiples of anything; I just
-	 * really like base 8.)
-	 *
-	 * A result lower than 1024 will be yielded when pool4 is 128k ports
-	 * large or smaller, so the following paragraph (and conditional) only
-	 * applies to this range:
-	 *
-	 * In all of the tests I ran, a max iterations of 1024 would have been a
-	 * reasonable limit that would have completely prevented the NAT64 from
-	 * dropping *any* connections, at least until pool4 was about 91%
-	 * exhausted. (Connections can be technically dropped regardless, but
-	 * it's very unlikely.) Also, on average, most connections would have
-	 * kept succeeding until pool4 reached 98% utilization.
-	 */
-	if (result < 1024)
-		return 1024;
-	/*
-	 * And finally: Prevent the algorithm from iterating too much.
-	 *
-	 * 8k will begin dropping connections at 95% utilization and most
-	 * connections will remain on the success side until 99% exhaustion.
-	 */
-	if (result > 8192)
-		return 8192;
-	return result;
-}
-
 static void __update_sample(struct pool4_sample *sample,
 		const struct pool4_table *table)
 {
 	sample->mark = table->mark;
 	sample->iterations_flags = table->max_iterations_flags;
-	sample->iterations = compute_max_iterations(table);
+	sample->iterations = table->max_iterations;
 }
 
 /**
@@ -975,7 +1345,7 @@ int pool4db_foreach_sample(struct pool4 *pool, l4_protocol proto,
 	struct pool4_sample sample = { .proto = proto };
 	int error = 0;
 
-	spin_lock_bh(&pool->lock);
+	mutex_lock(&pool->lock);
 
 	tree = get_tree(&pool->tree_mark, proto);
 	if (!tree) {
@@ -1011,15 +1381,53 @@ offset_start:; /* <- The semicolon prevents a compiler error. */
 	}
 
 end:
-	spin_unlock_bh(&pool->lock);
+	mutex_unlock(&pool->lock);
 	return error;
 
 eagain:
-	spin_unlock_bh(&pool->lock);
+	mutex_unlock(&pool->lock);
 	log_err("Oops. Pool4 changed while I was iterating so I lost track of where I was. Try again.");
 	return -EAGAIN;
 }
 
+/**
+ * Calls @cb once for every @proto address in pool4, in ascending order, along
+ * with the number of ports pool4 assigns to it. (Across all marks.)
+ * If @offset is present, iteration starts after it.
+ *
+ * Same contract as pool4db_foreach_sample().
+ */
+int pool4db_foreach_addr(struct pool4 *pool, l4_protocol proto,
+		int (*cb)(struct in_addr *, unsigned int, void *), void *arg,
+		struct in_addr *offset)
+{
+	struct rb_root *tree;
+	struct rb_node *node;
+	struct pool4_table *table;
+	int error = 0;
+
+	mutex_lock(&pool->lock);
+
+	tree = get_tree(&pool->tree_addr, proto);
+	if (!tree) {
+		error = -EINVAL;
+		goto end;
+	}
+
+	for (node = rb_first(tree); node; node = rb_next(node)) {
+		table = rb_entry(node, struct pool4_table, tree_hook);
+		if (offset && ipv4_addr_cmp(&table->addr, offset) <= 0)
+			continue;
+		error = cb(&table->addr, table->taddr_count, arg);
+		if (error)
+			break;
+	}
+
+end:
+	mutex_unlock(&pool->lock);
+	return error;
+}
+
 static void print_tree(struct rb_root *tree, bool mark)
 {
 	struct rb_node *node = rb_first(tree);
@@ -1068,98 +1476,113 @@ void pool4db_print(struct pool4 *pool)
 	print_tree(&pool->tree_addr.icmp, false);
 }
 
-static struct mask_domain *find_empty(struct route4_args *args,
+static int find_empty(struct mask_domain *masks, struct route4_args *args,
 		unsigned int offset)
 {
-	struct mask_domain *masks;
-	struct pool4_range *range;
-
-	masks = __wkmalloc("mask_domain",
-			sizeof(struct mask_domain) * sizeof(struct pool4_range),
-			GFP_ATOMIC);
-	if (!masks)
-		return NULL;
+	struct pool4_range *range = &masks->dynamic_range;
+	int error;
 
-	range = (struct pool4_range *)(masks + 1);
-	if (pool4empty_find(args, range)) {
-		__wkfree("mask_domain", masks);
-		return NULL;
-	}
+	error = pool4empty_find(args, range);
+	if (error)
+		return error;
 
 	masks->pool_mark = 0;
 	masks->taddr_count = port_range_count(&range->ports);
 	masks->taddr_counter = 0;
+	masks->iterations = 0;
 	masks->max_iterations = 0;
+	masks->ranges = range;
 	masks->range_count = 1;
 	masks->current_range = range;
 	masks->current_port = range->ports.min + offset % masks->taddr_count;
+	masks->offset = offset;
+	masks->first_range = masks->current_range;
+	masks->first_port = masks->current_port;
 	masks->dynamic = true;
-	return masks;
+	return 0;
 }
 
 struct mask_domain *mask_domain_find(struct pool4 *pool, struct tuple *tuple6,
-		__u8 f_args, struct route4_args *route_args)
+		__u8 f_args, __u8 f_algorithm, struct route4_args *route_args)
 {
+	struct pool4_snapshot *snapshot;
 	struct pool4_table *table;
 	struct pool4_range *entry;
 	struct mask_domain *masks;
 	unsigned int offset;
 
-	if (rfc6056_f(tuple6, f_args, &offset))
+	if (rfc6056_f(tuple6, f_args, f_algorithm, &offset))
 		return NULL;
 
-	spin_lock_bh(&pool->lock);
+	/*
+	 * Both of these stay until mask_domain_put().
+	 * The RCU lock keeps the snapshot (and therefore the ranges) alive,
+	 * the BH lock keeps us on this CPU's scratch domain.
+	 */
+	rcu_read_lock();
+	local_bh_disable();
+
+	masks = this_cpu_ptr(&scratch_domain);
+	if (WARN(masks->busy, "Bug: Nested mask_domain_find()s."))
+		goto fail;
 
-	if (is_empty(pool)) {
-		spin_unlock_bh(&pool->lock);
-		return find_empty(route_args, offset);
+	snapshot = rcu_dereference(pool->snapshot);
+	if (!snapshot) {
+		if (find_empty(masks, route_args, offset))
+			goto fail;
+		masks->busy = true;
+		return masks;
 	}
 
-	table = find_by_mark(get_tree(&pool->tree_mark, tuple6->l4_proto),
-			route_args->mark);
+	table = find_snapshot_mark(snapshot, tuple6->l4_proto, route_args->mark);
 	if (!table)
 		goto fail;
 
-	masks = __wkmalloc("mask_domain", sizeof(struct mask_domain)
-			+ table->sample_count * sizeof(struct pool4_range),
-			GFP_ATOMIC);
-	if (!masks)
-		goto fail;
-
-	memcpy(masks + 1, table + 1,
-			table->sample_count * sizeof(struct pool4_range));
-	masks->taddr_count = table->taddr_count;
-	masks->max_iterations = compute_max_iterations(table);
-	masks->range_count = table->sample_count;
-
-	spin_unlock_bh(&pool->lock);
-
 	masks->pool_mark = route_args->mark;
+	masks->taddr_count = table->taddr_count;
 	masks->taddr_counter = 0;
+	masks->iterations = 0;
+	masks->max_iterations = table->max_iterations;
+	masks->ranges = first_table_entry(table);
+	masks->range_count = table->sample_count;
 	masks->dynamic = false;
+	masks->offset = offset;
 	offset %= masks->taddr_count;
 
 	foreach_domain_range(entry, masks) {
 		if (offset <= port_range_count(&entry->ports)) {
 			masks->current_range = entry;
 			masks->current_port = entry->ports.min + offset - 1;
+			masks->first_range = masks->current_range;
+			masks->first_port = masks->current_port;
+			masks->busy = true;
 			return masks; /* Happy path */
 		}
 		offset -= port_range_count(&entry->ports);
 	}
 
 	WARN(true, "Bug: pool4 entry counter does not match entry count.");
-	__wkfree("mask_domain", masks);
-	return NULL;
+	/* Fall through. */
 
 fail:
-	spin_unlock_bh(&pool->lock);
+	local_bh_enable();
+	rcu_read_unlock();
 	return NULL;
 }
 
 void mask_domain_put(struct mask_domain *masks)
 {
-	__wkfree("mask_domain", masks);
+	masks->busy = false;
+	local_bh_enable();
+	rcu_read_unlock();
+}
+
+static void next_range(struct mask_domain *masks)
+{
+	masks->current_range++;
+	if (masks->current_range >= first_domain_entry(masks) + masks->range_count)
+		masks->current_range = first_domain_entry(masks);
+	masks->current_port = masks->current_range->ports.min;
 }
 
 int mask_domain_next(struct mask_domain *masks,
@@ -1169,17 +1592,15 @@ int mask_domain_next(struct mask_domain *masks,
 	masks->taddr_counter++;
 	if (masks->taddr_counter > masks->taddr_count)
 		return -ENOENT;
+	masks->iterations++;
 	if (masks->max_iterations)
-		if (masks->taddr_counter > masks->max_iterations)
+		if (masks->iterations > masks->max_iterations)
 			return -ENOENT;
 
 	masks->current_port++;
 	if (masks->current_port > masks->current_range->ports.max) {
 		*consecutive = false;
-		masks->current_range++;
-		if (masks->current_range >= first_domain_entry(masks) + masks->range_count)
-			masks->current_range = first_domain_entry(masks);
-		masks->current_port = masks->current_range->ports.min;
+		next_range(masks);
 	} else {
 		*consecutive = (masks->taddr_counter != 1);
 	}
@@ -1189,19 +1610,188 @@ int mask_domain_next(struct mask_domain *masks,
 	return 0;
 }
 
+/**
+ * Same as mask_domain_next(), except ports @get_taken claims are taken are
+ * skipped over without being returned.
+ *
+ * @get_taken returns the bitmap of the taken ports of the address it's given
+ * (one bit per port), or NULL if it doesn't know.
+ *
+ * Skipped ports don't count as iterations, so max_iterations effectively
+ * becomes the number of candidates the caller is allowed to verify.
+ */
+int mask_domain_next_free(struct mask_domain *masks,
+		struct ipv4_transport_addr *addr,
+		bool *consecutive,
+		const unsigned long *(*get_taken)(const struct in_addr *, void *),
+		void *arg)
+{
+	const unsigned long *taken;
+	unsigned int max;
+	unsigned int port;
+	int error;
+
+	error = mask_domain_next(masks, addr, consecutive);
+	if (error)
+		return error;
+
+	do {
+		taken = get_taken(&masks->current_range->addr, arg);
+		if (!taken || !test_bit(masks->current_port, taken))
+			break;
+
+		max = masks->current_range->ports.max;
+		port = find_next_zero_bit(taken, max + 1, masks->current_port);
+		*consecutive = false;
+
+		if (port <= max) {
+			masks->taddr_counter += port - masks->current_port;
+			masks->current_port = port;
+		} else {
+			/* The rest of the range is taken. Move to the next. */
+			masks->taddr_counter += max - masks->current_port + 1;
+			next_range(masks);
+		}
+
+		if (masks->taddr_counter > masks->taddr_count)
+			return -ENOENT;
+	} while (true);
+
+	addr->l3 = masks->current_range->addr;
+	addr->l4 = masks->current_port;
+	return 0;
+}
+
 bool mask_domain_matches(struct mask_domain *masks,
 		struct ipv4_transport_addr *addr)
+{
+	return bsearch_range(first_domain_entry(masks), masks->range_count,
+			&addr->l3, addr->l4) != NULL;
+}
+
+/**
+ * Returns true if ports @min through @max of @addr all belong to @masks.
+ */
+bool mask_domain_contains(struct mask_domain *masks, struct in_addr *addr,
+		unsigned int min, unsigned int max)
+{
+	struct pool4_range *entry;
+
+	/* Ranges never touch, so @min and @max have to share the same one. */
+	entry = bsearch_range(first_domain_entry(masks), masks->range_count,
+			addr, min);
+	return entry && max <= entry->ports.max;
+}
+
+/**
+ * Number of transport addresses in @masks.
+ */
+unsigned int mask_domain_count(struct mask_domain *masks)
+{
+	return masks->taddr_count;
+}
+
+/**
+ * The RFC 6056 F() result @masks's iteration starts from. Callers that pick
+ * masks on their own can use it to spread out the same way.
+ */
+unsigned int mask_domain_offset(struct mask_domain *masks)
+{
+	return masks->offset;
+}
+
+/**
+ * Returns (in @result) the @ordinal'th transport address of @masks.
+ * (The order is the same mask_domain_next() uses, minus the offset.)
+ */
+int mask_domain_get(struct mask_domain *masks, unsigned int ordinal,
+		struct ipv4_transport_addr *result)
 {
 	struct pool4_range *entry;
+	unsigned int count;
 
 	foreach_domain_range(entry, masks) {
-		if (entry->addr.s_addr != addr->l3.s_addr)
-			continue;
-		if (port_range_contains(&entry->ports, addr->l4))
-			return true;
+		count = port_range_count(&entry->ports);
+		if (ordinal < count) {
+			result->l3 = entry->addr;
+			result->l4 = entry->ports.min + ordinal;
+			return 0;
+		}
+		ordinal -= count;
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * Moves the start of @masks's iteration to the address that has the fewest
+ * taken transport addresses (relative to the number of ports @masks has on
+ * it), so new connections spread evenly instead of piling on whichever
+ * address F() happens to point to until it runs out.
+ *
+ * @get_used returns the number of ports of the address it's given that are
+ * taken. The port the iteration starts from within the address is still
+ * derived from F(). If the address the iteration already starts on is as
+ * good as any other, nothing changes.
+ *
+ * Has to be called before the first mask_domain_next().
+ */
+void mask_domain_balance(struct mask_domain *masks,
+		unsigned int (*get_used)(const struct in_addr *, void *),
+		void *arg)
+{
+	struct pool4_range *entry;
+	struct pool4_range *first;
+	struct pool4_range *best = NULL;
+	u64 best_used = 0, best_total = 1;
+	u64 used, total;
+
+	if (masks->dynamic || masks->range_count < 2)
+		return;
+
+	/* The ranges are sorted by address, so each address is a run. */
+	entry = first_domain_entry(masks);
+	while (entry < first_domain_entry(masks) + masks->range_count) {
+		first = entry;
+		total = 0;
+		do {
+			total += port_range_count(&entry->ports);
+			entry++;
+		} while (entry < first_domain_entry(masks) + masks->range_count
+				&& entry->addr.s_addr == first->addr.s_addr);
+		used = get_used(&first->addr, arg);
+
+		/* (Ties go to the address F() chose.) */
+		if (!best || used * best_total < best_used * total
+				|| (used * best_total == best_used * total
+				&& first->addr.s_addr
+				== masks->first_range->addr.s_addr)) {
+			best = first;
+			best_used = used;
+			best_total = total;
+		}
 	}
 
-	return false;
+	if (best->addr.s_addr == masks->first_range->addr.s_addr)
+		return;
+
+	masks->current_range = best;
+	masks->current_port = best->ports.min
+			+ masks->offset % port_range_count(&best->ports) - 1;
+	masks->first_range = masks->current_range;
+	masks->first_port = masks->current_port;
+}
+
+/**
+ * Resets @masks's iteration, so the next mask_domain_next() returns the same
+ * mask as the first one did.
+ */
+void mask_domain_rewind(struct mask_domain *masks)
+{
+	masks->taddr_counter = 0;
+	masks->iterations = 0;
+	masks->current_range = masks->first_range;
+	masks->current_port = masks->first_port;
 }
 
 bool mask_domain_is_dynamic(struct mask_domain *masks)
@@ -1213,3 +1803,21 @@ __u32 mask_domain_get_mark(struct mask_domain *masks)
 {
 	return masks->pool_mark;
 }
+
+/**
+ * Number of transport addresses the iteration has handed to the caller so far.
+ */
+unsigned int mask_domain_get_iterations(struct mask_domain *masks)
+{
+	return masks->iterations;
+}
+
+/**
+ * Returns true if the iteration stopped because of max_iterations, as opposed
+ * to running out of transport addresses.
+ */
+bool mask_domain_is_limited(struct mask_domain *masks)
+{
+	return masks->max_iterations
+			&& masks->iterations > masks->max_iterations;
+}
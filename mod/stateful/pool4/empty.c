@@ -1,12 +1,51 @@
 #include "nat64/mod/stateful/pool4/empty.h"
 
+#include <linux/hash.h>
 #include <linux/inetdevice.h>
 #include <linux/in_route.h>
 #include <linux/netdevice.h>
+#include <linux/rculist.h>
+#include <linux/rtnetlink.h>
+#include <linux/slab.h>
+#include <net/netns/generic.h>
 #include "nat64/common/constants.h"
 #include "nat64/mod/common/ipv6_hdr_iterator.h"
 #include "nat64/mod/common/xlator.h"
 
+#define IFADDR_HASH_BITS 6
+
+/** One of the namespace's usable interface addresses. */
+struct ifaddr_entry {
+	__be32 addr;
+	/** Number of interface addresses that yield @addr. */
+	unsigned int refs;
+	struct hlist_node hook;
+	struct rcu_head rcu;
+};
+
+/**
+ * The addresses empty pool4 mode masks with, hashed. (The primary, universe
+ * scoped addresses of the namespace's interfaces.)
+ *
+ * Kept up to date by the inetaddr notifier, so 4-to-6 packets don't have to
+ * walk every interface of the namespace. Writers are serialized by the RTNL;
+ * readers only need RCU.
+ */
+struct ifaddr_table {
+	struct hlist_head buckets[1 << IFADDR_HASH_BITS];
+	/**
+	 * The table couldn't keep up because memory ran out. Lookups walk the
+	 * interfaces until the next resync.
+	 */
+	bool degraded;
+};
+
+/* Zero until pool4empty_setup(). (The kernel hands out ids from 1.) */
+static unsigned int ifaddr_net_id;
+
+/**
+ * The slow version of the table lookup, which walks every interface in @ns.
+ */
 static bool contains_addr(struct net *ns, const struct in_addr *addr)
 {
 	struct net_device *dev;
@@ -28,21 +67,220 @@ static bool contains_addr(struct net *ns, const struct in_addr *addr)
 	return false;
 }
 
-bool pool4empty_contains(struct net *ns, const struct ipv4_transport_addr *addr)
+static struct hlist_head *get_bucket(struct ifaddr_table *table, __be32 addr)
+{
+	return &table->buckets[hash_32((__force u32)addr, IFADDR_HASH_BITS)];
+}
+
+static struct ifaddr_entry *ifaddr_find(struct ifaddr_table *table,
+		__be32 addr)
 {
+	struct ifaddr_entry *entry;
+
+	hlist_for_each_entry(entry, get_bucket(table, addr), hook)
+		if (entry->addr == addr)
+			return entry;
+
+	return NULL;
+}
+
+static void ifaddr_add(struct ifaddr_table *table, __be32 addr)
+{
+	struct ifaddr_entry *entry;
+
+	entry = ifaddr_find(table, addr);
+	if (entry) {
+		entry->refs++;
+		return;
+	}
+
+	entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry) {
+		log_err("Out of memory; interface addresses will be looked up the slow way.");
+		table->degraded = true;
+		return;
+	}
+
+	entry->addr = addr;
+	entry->refs = 1;
+	hlist_add_head_rcu(&entry->hook, get_bucket(table, addr));
+}
+
+static void ifaddr_rm(struct ifaddr_table *table, __be32 addr)
+{
+	struct ifaddr_entry *entry;
+
+	entry = ifaddr_find(table, addr);
+	if (!entry || --entry->refs)
+		return;
+
+	hlist_del_rcu(&entry->hook);
+	kfree_rcu(entry, rcu);
+}
+
+/**
+ * Applies contains_addr()'s rules to @ifa. (Must be kept in sync.)
+ * Secondary addresses that get promoted are announced again, as primaries.
+ */
+static void ifaddr_update(struct ifaddr_table *table, struct in_ifaddr *ifa,
+		void (*fn)(struct ifaddr_table *, __be32))
+{
+	if (ifa->ifa_flags & IFA_F_SECONDARY)
+		return;
+	if (ifa->ifa_scope != RT_SCOPE_UNIVERSE)
+		return;
+	fn(table, ifa->ifa_local);
+}
+
+static void ifaddr_flush(struct ifaddr_table *table)
+{
+	struct ifaddr_entry *entry;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(table->buckets); i++) {
+		hlist_for_each_entry_safe(entry, tmp, &table->buckets[i],
+				hook) {
+			hlist_del_rcu(&entry->hook);
+			kfree_rcu(entry, rcu);
+		}
+	}
+}
+
+/**
+ * Rebuilds @ns's table from scratch. Needs the RTNL.
+ */
+static void ifaddr_resync(struct net *ns)
+{
+	struct ifaddr_table *table = net_generic(ns, ifaddr_net_id);
+	struct net_device *dev;
+	struct in_device *in_dev;
+	struct in_ifaddr *ifa;
+
+	ifaddr_flush(table);
+	table->degraded = false;
+
+	for_each_netdev(ns, dev) {
+		in_dev = __in_dev_get_rtnl(dev);
+		if (!in_dev)
+			continue;
+		for (ifa = in_dev->ifa_list; ifa; ifa = ifa->ifa_next)
+			ifaddr_update(table, ifa, ifaddr_add);
+	}
+}
+
+static int ifaddr_inetaddr_event(struct notifier_block *nb,
+		unsigned long event, void *ptr)
+{
+	struct in_ifaddr *ifa = ptr;
+	struct ifaddr_table *table;
+
+	table = net_generic(dev_net(ifa->ifa_dev->dev), ifaddr_net_id);
+
+	switch (event) {
+	case NETDEV_UP:
+		ifaddr_update(table, ifa, ifaddr_add);
+		break;
+	case NETDEV_DOWN:
+		ifaddr_update(table, ifa, ifaddr_rm);
+		break;
+	}
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block ifaddr_inetaddr_nb = {
+	.notifier_call = ifaddr_inetaddr_event,
+};
+
+static void __net_exit ifaddr_exit_net(struct net *ns)
+{
+	rtnl_lock();
+	ifaddr_flush(net_generic(ns, ifaddr_net_id));
+	rtnl_unlock();
+}
+
+static struct pernet_operations ifaddr_net_ops = {
+	.exit = ifaddr_exit_net,
+	.id = &ifaddr_net_id,
+	.size = sizeof(struct ifaddr_table),
+};
+
+/**
+ * The inetaddr notifier is registered before the tables are first filled, so
+ * no address changes fall through the cracks. (Both happen under the RTNL.)
+ */
+int pool4empty_setup(void)
+{
+	struct net *ns;
+	int error;
+
+	error = register_pernet_subsys(&ifaddr_net_ops);
+	if (error)
+		return error;
+	error = register_inetaddr_notifier(&ifaddr_inetaddr_nb);
+	if (error) {
+		unregister_pernet_subsys(&ifaddr_net_ops);
+		return error;
+	}
+
+	rtnl_lock();
+	for_each_net(ns)
+		ifaddr_resync(ns);
+	rtnl_unlock();
+
+	return 0;
+}
+
+void pool4empty_teardown(void)
+{
+	unregister_inetaddr_notifier(&ifaddr_inetaddr_nb);
+	unregister_pernet_subsys(&ifaddr_net_ops);
+	/* Wait for the kfree_rcu()s. */
+	rcu_barrier();
+}
+
+static bool table_contains(struct ifaddr_table *table, __be32 addr)
+{
+	struct ifaddr_entry *entry;
+
+	hlist_for_each_entry_rcu(entry, get_bucket(table, addr), hook)
+		if (entry->addr == addr)
+			return true;
+
+	return false;
+}
+
+/**
+ * Returns whether empty pool4 would mask packets using @addr, regardless of
+ * port.
+ */
+bool pool4empty_contains_addr(struct net *ns, const struct in_addr *addr)
+{
+	struct ifaddr_table *table;
 	bool found;
 
+	rcu_read_lock();
+	/* (The unit tests never set the table up.) */
+	table = ifaddr_net_id ? net_generic(ns, ifaddr_net_id) : NULL;
+	if (table && likely(!READ_ONCE(table->degraded)))
+		found = table_contains(table, addr->s_addr);
+	else
+		found = contains_addr(ns, addr);
+	rcu_read_unlock();
+
+	return found;
+}
+
+bool pool4empty_contains(struct net *ns, const struct ipv4_transport_addr *addr)
+{
 	if (addr->l4 < DEFAULT_POOL4_MIN_PORT)
 		return false;
 	/* I sure hope this gets compiled out :p */
 	if (DEFAULT_POOL4_MAX_PORT < addr->l4)
 		return false;
 
-	rcu_read_lock();
-	found = contains_addr(ns, &addr->l3);
-	rcu_read_unlock();
-
-	return found;
+	return pool4empty_contains_addr(ns, &addr->l3);
 }
 
 /**
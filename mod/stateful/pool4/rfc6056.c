@@ -1,15 +1,30 @@
 #include "nat64/mod/stateful/pool4/rfc6056.h"
 
 #include <crypto/hash.h>
+#include <linux/percpu.h>
+#include "nat64/mod/common/linux_version.h"
 #include "nat64/mod/common/wkmalloc.h"
 
+#if LINUX_VERSION_AT_LEAST(4, 11, 0, 8, 0)
+#include <linux/siphash.h>
+#define HAVE_SIPHASH
+#endif
+
 /* TODO (issue175) RFC 6056 wants us to change this from time to time. */
 static unsigned char *secret_key;
 static size_t secret_key_len;
 static atomic_t next_ephemeral;
 
 static struct crypto_shash *shash;
-static DEFINE_SPINLOCK(tfm_lock);
+/**
+ * One MD5 context per CPU, so hashing doesn't need to allocate or lock.
+ * (Each is a struct shash_desc followed by the transform's private data.)
+ */
+static char __percpu *descs;
+
+#ifdef HAVE_SIPHASH
+static siphash_key_t siphash_key;
+#endif
 
 int rfc6056_setup(void)
 {
@@ -22,6 +37,9 @@ int rfc6056_setup(void)
 	if (!secret_key)
 		return -ENOMEM;
 	get_random_bytes(secret_key, secret_key_len);
+#ifdef HAVE_SIPHASH
+	get_random_bytes(&siphash_key, sizeof(siphash_key));
+#endif
 
 	/* Next ephemeral stuff */
 	get_random_bytes(&tmp, sizeof(tmp));
@@ -33,15 +51,29 @@ int rfc6056_setup(void)
 		error = PTR_ERR(shash);
 		log_warn_once("Failed to load transform for MD5; errcode %d",
 				error);
-		__wkfree("Secret key", secret_key);
-		return error;
+		goto shash_fail;
+	}
+
+	descs = __alloc_percpu(sizeof(struct shash_desc)
+			+ crypto_shash_descsize(shash),
+			__alignof__(struct shash_desc));
+	if (!descs) {
+		error = -ENOMEM;
+		goto descs_fail;
 	}
 
 	return 0;
+
+descs_fail:
+	crypto_free_shash(shash);
+shash_fail:
+	__wkfree("Secret key", secret_key);
+	return error;
 }
 
 void rfc6056_teardown(void)
 {
+	free_percpu(descs);
 	crypto_free_shash(shash);
 	__wkfree("Secret key", secret_key);
 }
@@ -79,10 +111,8 @@ static int hash_tuple(struct shash_desc *desc, __u8 fields,
 	return crypto_shash_update(desc, secret_key, secret_key_len);
 }
 
-/**
- * RFC 6056, Algorithm 3.
- */
-int rfc6056_f(const struct tuple *tuple6, __u8 fields, unsigned int *result)
+static int f_md5(const struct tuple *tuple6, __u8 fields,
+		unsigned int *result)
 {
 	union {
 		__be32 as32[4];
@@ -91,20 +121,13 @@ int rfc6056_f(const struct tuple *tuple6, __u8 fields, unsigned int *result)
 	struct shash_desc *desc;
 	int error = 0;
 
-	desc = __wkmalloc("shash desc", sizeof(struct shash_desc)
-			+ crypto_shash_descsize(shash), GFP_ATOMIC);
-	if (!desc)
-		return -ENOMEM;
+	/* BHs stay disabled so nobody else can use this CPU's context. */
+	local_bh_disable();
 
+	desc = (struct shash_desc *)this_cpu_ptr(descs);
 	desc->tfm = shash;
 	desc->flags = 0;
 
-	/*
-	 * TODO (performance) it would appear this is a good opportunity to use
-	 * per-cpu variables instead of a spinlock.
-	 */
-	spin_lock_bh(&tfm_lock);
-
 	error = crypto_shash_init(desc);
 	if (error) {
 		log_debug("crypto_hash_init() failed. Errcode: %d", error);
@@ -127,7 +150,74 @@ int rfc6056_f(const struct tuple *tuple6, __u8 fields, unsigned int *result)
 	/* Fall through. */
 
 end:
-	spin_unlock_bh(&tfm_lock);
-	__wkfree("shash desc", desc);
+	local_bh_enable();
 	return error;
 }
+
+#ifdef HAVE_SIPHASH
+
+/**
+ * Same as f_md5(), except with SipHash, which was designed for exactly this
+ * (short inputs, secret key) and is a lot cheaper.
+ * It's also stateless, so it doesn't need the per-CPU contexts.
+ */
+static int f_siphash(const struct tuple *tuple6, __u8 fields,
+		unsigned int *result)
+{
+	struct {
+		struct in6_addr addrs[2];
+		__u16 ports[2];
+	} input;
+	unsigned char *cursor = (unsigned char *)&input;
+
+	if (fields & F_ARGS_SRC_ADDR) {
+		memcpy(cursor, &tuple6->src.addr6.l3, sizeof(struct in6_addr));
+		cursor += sizeof(struct in6_addr);
+	}
+	if (fields & F_ARGS_SRC_PORT) {
+		memcpy(cursor, &tuple6->src.addr6.l4, sizeof(__u16));
+		cursor += sizeof(__u16);
+	}
+	if (fields & F_ARGS_DST_ADDR) {
+		memcpy(cursor, &tuple6->dst.addr6.l3, sizeof(struct in6_addr));
+		cursor += sizeof(struct in6_addr);
+	}
+	if (fields & F_ARGS_DST_PORT) {
+		memcpy(cursor, &tuple6->dst.addr6.l4, sizeof(__u16));
+		cursor += sizeof(__u16);
+	}
+
+	*result = (unsigned int)siphash(&input,
+			cursor - (unsigned char *)&input, &siphash_key);
+	return 0;
+}
+
+#else
+
+static int f_siphash(const struct tuple *tuple6, __u8 fields,
+		unsigned int *result)
+{
+	log_warn_once("This kernel lacks SipHash; falling back to MD5.");
+	return f_md5(tuple6, fields, result);
+}
+
+#endif
+
+/**
+ * RFC 6056, Algorithm 3.
+ *
+ * @algorithm is the hash F() is built upon. See "enum f_algorithm".
+ */
+int rfc6056_f(const struct tuple *tuple6, __u8 fields, __u8 algorithm,
+		unsigned int *result)
+{
+	switch (algorithm) {
+	case F_ALGORITHM_MD5:
+		return f_md5(tuple6, fields, result);
+	case F_ALGORITHM_SIPHASH:
+		return f_siphash(tuple6, fields, result);
+	}
+
+	WARN(true, "Unknown F() algorithm: %u", algorithm);
+	return -EINVAL;
+}
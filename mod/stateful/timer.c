@@ -1,34 +1,46 @@
 #include "nat64/mod/stateful/timer.h"
 
+#include <linux/timer.h>
 #include "nat64/mod/common/linux_version.h"
+#include "nat64/mod/common/wkmalloc.h"
 #include "nat64/mod/common/xlator.h"
 #include "nat64/mod/stateful/fragment_db.h"
 #include "nat64/mod/stateful/joold.h"
 #include "nat64/mod/stateful/bib/db.h"
 
-/*
- * TODO We don't cancel the timer much at all; it seems like we should be using
- * a hrtimer instead.
- *
- * 	the kernel has two core timer mechanisms. One of those — the
- * 	high-resolution timer (or "hrtimer") — subsystem, is focused on
- * 	near-term events where the timer is expected to run to completion. The
- * 	other subsystem is just called "kernel timers"; it offers less precision
- * 	but is more efficient in situations where the timer will probably be
- * 	canceled before it fires.
- * 		(Jonathan Corbet, 2017)
+/**
+ * The timer never sleeps less than this. Cleaning more often than the session
+ * wheel's granularity would be pointless.
  */
+#define TIMER_MIN_DELAY msecs_to_jiffies(1000)
 
-#define TIMER_PERIOD msecs_to_jiffies(2000)
+struct jtimer {
+	struct timer_list timer;
+	/**
+	 * The namespace whose instance this timer cleans. No reference is
+	 * held; the instance owns the timer, and it holds one.
+	 */
+	struct net *ns;
+};
 
-static struct timer_list timer;
-
-static int clean_state(struct xlator *jool, void *args)
+/**
+ * Returns the jiffy at which @jool's databases will next need attention.
+ */
+static unsigned long next_clean(struct xlator *jool)
 {
-	fragdb_clean(jool->nat64.frag);
-	bib_clean(jool->nat64.bib, jool->ns);
-	joold_clean(jool->nat64.joold, jool->nat64.bib);
-	return 0;
+	unsigned long next;
+	unsigned long candidate;
+
+	next = fragdb_next_clean(jool->nat64.frag);
+	candidate = bib_next_clean(jool->nat64.bib);
+	if (time_before(candidate, next))
+		next = candidate;
+	candidate = joold_next_clean(jool->nat64.joold);
+	if (time_before(candidate, next))
+		next = candidate;
+
+	candidate = jiffies + TIMER_MIN_DELAY;
+	return time_before(next, candidate) ? candidate : next;
 }
 
 static void timer_function(
@@ -39,31 +51,84 @@ static void timer_function(
 #endif
 		)
 {
-	xlator_foreach(clean_state, NULL);
-	mod_timer(&timer, jiffies + TIMER_PERIOD);
+#if LINUX_VERSION_AT_LEAST(4, 15, 0, 9999, 0)
+	struct jtimer *timer = from_timer(timer, arg, timer);
+#else
+	struct jtimer *timer = (struct jtimer *)arg;
+#endif
+	struct xlator jool;
+
+	/*
+	 * The instance can be replaced by configuration changes; always clean
+	 * the current one.
+	 */
+	rcu_read_lock_bh();
+
+	if (xlator_find_rcu(timer->ns, &jool)) {
+		/* The instance is being removed; don't come back. */
+		rcu_read_unlock_bh();
+		return;
+	}
+
+	fragdb_clean(jool.nat64.frag);
+	bib_clean(jool.nat64.bib);
+	joold_clean(jool.nat64.joold, jool.nat64.bib, jool.pool6);
+
+	/*
+	 * This has to happen inside the RCU-bh critical section, so
+	 * jtimer_destroy() (which runs after a grace period) can catch it.
+	 */
+	mod_timer(&timer->timer, next_clean(&jool));
+
+	rcu_read_unlock_bh();
 }
 
 /**
- * This function should be always called *after* other init()s.
+ * Creates the timer of the instance that is about to be published in @ns.
+ * It does nothing until the first jtimer_kick().
+ *
+ * It's deferrable because expiration is not urgent; an idle CPU can wait until
+ * something else wakes it up.
  */
-int jtimer_setup(void)
+struct jtimer *jtimer_alloc(struct net *ns)
 {
+	struct jtimer *timer;
+
+	timer = wkmalloc(struct jtimer, GFP_KERNEL);
+	if (!timer)
+		return NULL;
+
 #if LINUX_VERSION_AT_LEAST(4, 15, 0, 9999, 0)
-	timer_setup(&timer, timer_function, 0);
+	timer_setup(&timer->timer, timer_function, TIMER_DEFERRABLE);
 #else
-	init_timer(&timer);
-	timer.function = timer_function;
-	timer.expires = 0;
-	timer.data = 0;
+	init_timer_deferrable(&timer->timer);
+	timer->timer.function = timer_function;
+	timer->timer.data = (unsigned long)timer;
 #endif
-	mod_timer(&timer, jiffies + TIMER_PERIOD);
-	return 0;
+	timer->ns = ns;
+
+	return timer;
 }
 
 /**
- * This function should be always called *before* other destroy()s.
+ * Asks @timer to clean soon, and to reconsider its schedule afterwards.
+ * Meant for after the instance is published, and whenever its configuration
+ * changes (because the new timeouts might be shorter).
  */
-void jtimer_teardown(void)
+void jtimer_kick(struct jtimer *timer)
 {
-	del_timer_sync(&timer);
+	mod_timer(&timer->timer, jiffies + TIMER_MIN_DELAY);
+}
+
+/**
+ * Stops and releases @timer. Only call this once its instance is no longer
+ * published, and an RCU-bh grace period has elapsed since.
+ */
+void jtimer_destroy(struct jtimer *timer)
+{
+	if (!timer)
+		return;
+
+	del_timer_sync(&timer->timer);
+	wkfree(struct jtimer, timer);
 }
@@ -1,15 +1,51 @@
 #include "nat64/mod/stateless/blacklist4.h"
 
+#include <linux/hash.h>
 #include <linux/rculist.h>
 #include <linux/inet.h>
 #include <linux/netdevice.h>
 #include <linux/inetdevice.h>
+#include <linux/rtnetlink.h>
+#include <linux/slab.h>
+#include <net/netns/generic.h>
 
 #include "nat64/common/str_utils.h"
 #include "nat64/mod/common/address.h"
 #include "nat64/mod/common/xlator.h"
 #include "nat64/mod/common/rcu.h"
 
+#define LOCAL4_HASH_BITS 8
+
+/**
+ * One of the namespace's non-translatable interface addresses. (See
+ * interface_contains().)
+ */
+struct local4_entry {
+	__be32 addr;
+	/** Number of interface addresses that yield @addr. */
+	unsigned int refs;
+	struct hlist_node hook;
+	struct rcu_head rcu;
+};
+
+/**
+ * The namespace's non-translatable interface addresses, hashed.
+ *
+ * Kept up to date by the inetaddr notifier, so the packet path doesn't have
+ * to walk every interface of the namespace. Writers are serialized by the
+ * RTNL; readers only need RCU.
+ */
+struct local4_table {
+	struct hlist_head buckets[1 << LOCAL4_HASH_BITS];
+	/**
+	 * The table couldn't keep up because memory ran out. Lookups walk the
+	 * interfaces until the next resync.
+	 */
+	bool degraded;
+};
+
+static unsigned int local4_net_id;
+
 struct addr4_pool *blacklist_alloc(void)
 {
 	return pool_alloc();
@@ -41,14 +77,10 @@ int blacklist_flush(struct addr4_pool *pool)
 }
 
 /**
- * Is @addr *NOT* translatable, according to the interfaces?
- *
- * The name comes from the fact that interface addresses are usually
- * non-translatable (ie. the traffic is meant for the translator box).
- *
- * Recognizable directed broadcast is also not translatable.
+ * The slow version of interface_contains(), which walks every interface in
+ * @ns.
  */
-bool interface_contains(struct net *ns, struct in_addr *addr)
+static bool interface_scan(struct net *ns, struct in_addr *addr)
 {
 	struct net_device *dev;
 	struct in_device *in_dev;
@@ -90,6 +122,208 @@ dont_translate:
 	return true;
 }
 
+static struct hlist_head *get_bucket(struct local4_table *table, __be32 addr)
+{
+	return &table->buckets[hash_32((__force u32)addr, LOCAL4_HASH_BITS)];
+}
+
+static struct local4_entry *local4_find(struct local4_table *table,
+		__be32 addr)
+{
+	struct local4_entry *entry;
+
+	hlist_for_each_entry(entry, get_bucket(table, addr), hook)
+		if (entry->addr == addr)
+			return entry;
+
+	return NULL;
+}
+
+static void local4_add(struct local4_table *table, __be32 addr)
+{
+	struct local4_entry *entry;
+
+	entry = local4_find(table, addr);
+	if (entry) {
+		entry->refs++;
+		return;
+	}
+
+	entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry) {
+		log_err("Out of memory; interface addresses will be looked up the slow way.");
+		table->degraded = true;
+		return;
+	}
+
+	entry->addr = addr;
+	entry->refs = 1;
+	hlist_add_head_rcu(&entry->hook, get_bucket(table, addr));
+}
+
+static void local4_rm(struct local4_table *table, __be32 addr)
+{
+	struct local4_entry *entry;
+
+	entry = local4_find(table, addr);
+	if (!entry || --entry->refs)
+		return;
+
+	hlist_del_rcu(&entry->hook);
+	kfree_rcu(entry, rcu);
+}
+
+/**
+ * Applies interface_scan()'s rules to @ifa. (Must be kept in sync.)
+ */
+static void local4_update(struct local4_table *table, struct in_ifaddr *ifa,
+		void (*fn)(struct local4_table *, __be32))
+{
+	/* https://github.com/NICMx/Jool/issues/223 */
+	if (ifa->ifa_prefixlen != 32)
+		fn(table, ifa->ifa_local);
+	/* RFC3021: /31 (and /32) networks lack broadcast. */
+	if (ifa->ifa_prefixlen < 31)
+		fn(table, ifa->ifa_local | ~ifa->ifa_mask);
+}
+
+static void local4_flush(struct local4_table *table)
+{
+	struct local4_entry *entry;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(table->buckets); i++) {
+		hlist_for_each_entry_safe(entry, tmp, &table->buckets[i],
+				hook) {
+			hlist_del_rcu(&entry->hook);
+			kfree_rcu(entry, rcu);
+		}
+	}
+}
+
+/**
+ * Rebuilds @ns's table from scratch. Needs the RTNL.
+ */
+static void local4_resync(struct net *ns)
+{
+	struct local4_table *table = net_generic(ns, local4_net_id);
+	struct net_device *dev;
+	struct in_device *in_dev;
+	struct in_ifaddr *ifa;
+
+	local4_flush(table);
+	table->degraded = false;
+
+	for_each_netdev(ns, dev) {
+		in_dev = __in_dev_get_rtnl(dev);
+		if (!in_dev)
+			continue;
+		for (ifa = in_dev->ifa_list; ifa; ifa = ifa->ifa_next)
+			local4_update(table, ifa, local4_add);
+	}
+}
+
+static int local4_inetaddr_event(struct notifier_block *nb,
+		unsigned long event, void *ptr)
+{
+	struct in_ifaddr *ifa = ptr;
+	struct local4_table *table;
+
+	table = net_generic(dev_net(ifa->ifa_dev->dev), local4_net_id);
+
+	switch (event) {
+	case NETDEV_UP:
+		local4_update(table, ifa, local4_add);
+		break;
+	case NETDEV_DOWN:
+		local4_update(table, ifa, local4_rm);
+		break;
+	}
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block local4_inetaddr_nb = {
+	.notifier_call = local4_inetaddr_event,
+};
+
+static void __net_exit local4_exit_net(struct net *ns)
+{
+	rtnl_lock();
+	local4_flush(net_generic(ns, local4_net_id));
+	rtnl_unlock();
+}
+
+static struct pernet_operations local4_net_ops = {
+	.exit = local4_exit_net,
+	.id = &local4_net_id,
+	.size = sizeof(struct local4_table),
+};
+
+/**
+ * The inetaddr notifier is registered before the tables are first filled, so
+ * no address changes fall through the cracks. (Both happen under the RTNL.)
+ */
+int blacklist_setup(void)
+{
+	struct net *ns;
+	int error;
+
+	error = register_pernet_subsys(&local4_net_ops);
+	if (error)
+		return error;
+	error = register_inetaddr_notifier(&local4_inetaddr_nb);
+	if (error) {
+		unregister_pernet_subsys(&local4_net_ops);
+		return error;
+	}
+
+	rtnl_lock();
+	for_each_net(ns)
+		local4_resync(ns);
+	rtnl_unlock();
+
+	return 0;
+}
+
+void blacklist_teardown(void)
+{
+	unregister_inetaddr_notifier(&local4_inetaddr_nb);
+	unregister_pernet_subsys(&local4_net_ops);
+	/* Wait for the kfree_rcu()s. */
+	rcu_barrier();
+}
+
+/**
+ * Is @addr *NOT* translatable, according to the interfaces?
+ *
+ * The name comes from the fact that interface addresses are usually
+ * non-translatable (ie. the traffic is meant for the translator box).
+ *
+ * Recognizable directed broadcast is also not translatable.
+ */
+bool interface_contains(struct net *ns, struct in_addr *addr)
+{
+	struct local4_table *table = net_generic(ns, local4_net_id);
+	struct local4_entry *entry;
+	bool found = false;
+
+	if (unlikely(READ_ONCE(table->degraded)))
+		return interface_scan(ns, addr);
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(entry, get_bucket(table, addr->s_addr), hook) {
+		if (entry->addr == addr->s_addr) {
+			found = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return found;
+}
+
 bool blacklist_contains(struct addr4_pool *pool, struct in_addr *addr)
 {
 	return pool_contains(pool, addr);
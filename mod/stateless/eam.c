@@ -1,7 +1,14 @@
 #include "nat64/mod/stateless/eam.h"
 
+#include <linux/hash.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "nat64/common/types.h"
 #include "nat64/mod/common/address.h"
+#include "nat64/mod/common/mtrie.h"
 #include "nat64/mod/common/wkmalloc.h"
 
 #define ADDR6_BITS		128
@@ -11,6 +18,85 @@
 #define ADDR_TO_KEY(addr)	INIT_KEY(addr, 8 * sizeof(*addr))
 #define PREFIX_TO_KEY(prefix)	INIT_KEY(&(prefix)->address, (prefix)->len)
 
+/**
+ * How long the table has to stay still before its indexes are rebuilt.
+ * Loading a large table is a long sequence of adds; rebuilding after every
+ * single one would be quadratic.
+ */
+#define INDEX_REBUILD_DELAY	(HZ / 10)
+
+#define CACHE_BITS		8
+#define CACHE_SIZE		(1 << CACHE_BITS)
+
+static bool eam_counters;
+module_param(eam_counters, bool, 0644);
+MODULE_PARM_DESC(eam_counters, "Count the packets and bytes each EAMT entry translates. Costs 16 bytes per entry per CPU. (Only entries added while this is enabled are counted.)");
+
+/** What an EAMT entry has translated, on one CPU. */
+struct eam_stats {
+	u64 hits;
+	u64 bytes;
+};
+
+/** Shared by the two copies of an entry (trie6's and trie4's). */
+struct eam_counters {
+	struct eam_stats __percpu *stats;
+	/** Hook to eam_table.counters or eam_table.dead. */
+	struct list_head list_hook;
+};
+
+/**
+ * What the tries and indexes actually store. @entry goes first, so the nodes
+ * can be treated as plain eamt_entries wherever the counters don't matter.
+ */
+struct eam_node {
+	struct eamt_entry entry;
+	/** NULL if the entry is not being counted. */
+	struct eam_counters *counters;
+};
+
+/**
+ * A small direct-mapped memo of recent translations (or failures to
+ * translate), because traffic tends to concentrate on a few hosts.
+ *
+ * Each CPU has its own, so the packet path doesn't need to lock anything.
+ * A slot is only valid if its @generation matches the table's.
+ */
+struct cache_slot6 {
+	unsigned int generation;
+	int error;
+	struct in6_addr addr;
+	struct in_addr result;
+	struct eam_counters *counters;
+};
+
+struct cache_slot4 {
+	unsigned int generation;
+	int error;
+	struct in_addr addr;
+	struct in6_addr result;
+	struct eam_counters *counters;
+};
+
+struct eamt_cache {
+	struct cache_slot6 slots6[CACHE_SIZE];
+	struct cache_slot4 slots4[CACHE_SIZE];
+};
+
+/**
+ * The whole configuration of a 464XLAT CLAT, precomputed so the packets can be
+ * translated without any lookups. (See eamt_clat_refresh().)
+ */
+struct clat_mapping {
+	/** pool6's only prefix. It's a /96, so only the first 3 words matter. */
+	struct in6_addr prefix6;
+	/** The only EAM entry. Both of its prefixes are host addresses. */
+	struct in6_addr addr6;
+	__be32 addr4;
+	/** The entry's counters; NULL if it's not being counted. */
+	struct eam_counters *counters;
+};
+
 /**
  * Well, it really goes without saying, but I'll say it anyway:
  *
@@ -27,20 +113,251 @@
  * Notice that this only applies to updates to running EAMTs. Atomic
  * configuration does not fall in this category because the full table is
  * set up before it is actually committed to serve packets.
+ *
+ * @trie6 and @trie4 are the authoritative copies of the table. @index6 and
+ * @index4 are multibit tries built out of them, because the rtries get slow
+ * once the table has a few hundred thousand entries. The indexes can't be
+ * modified, so any change drops them (lookups fall back to the rtries) and
+ * schedules @rebuild_work to replace them once the table calms down.
  */
 struct eam_table {
 	struct rtrie trie6;
 	struct rtrie trie4;
+	struct mtrie __rcu *index6;
+	struct mtrie __rcu *index4;
+	struct delayed_work rebuild_work;
+	/**
+	 * Bumped on every change, which invalidates every @cache slot at
+	 * once. Never zero, so zeroed slots are invalid.
+	 */
+	atomic_t generation;
+	struct eamt_cache __percpu *cache;
+	/**
+	 * NULL unless the table (and the instance's pool6 and blacklist4)
+	 * look like a CLAT's. Any change to the table drops it; the control
+	 * path recomputes it afterwards.
+	 */
+	struct clat_mapping __rcu *clat;
 	/**
 	 * This one is not RCU-friendly. Touch only while you're holding the
 	 * mutex.
 	 */
 	u64 count;
+	/**
+	 * The entries' counters. Also mutex-protected.
+	 * The ones in @dead belong to removed entries. The cache slots (and
+	 * the lookups running right now) might still point to them, so only
+	 * invalidate_indexes() is allowed to free them.
+	 */
+	struct list_head counters;
+	struct list_head dead;
 	struct kref refcount;
 };
 
 static DEFINE_MUTEX(lock);
 
+#define deref_index(eamt, field) \
+	rcu_dereference_protected((eamt)->field, lockdep_is_held(&lock))
+
+static void eam_key6(void *value, struct rtrie_key *key)
+{
+	struct eamt_entry *eam = value;
+	key->bytes = (__u8 *)&eam->prefix6.address;
+	key->len = eam->prefix6.len;
+}
+
+static void eam_key4(void *value, struct rtrie_key *key)
+{
+	struct eamt_entry *eam = value;
+	key->bytes = (__u8 *)&eam->prefix4.address;
+	key->len = eam->prefix4.len;
+}
+
+static int collect_cb(void *eam, void *arg)
+{
+	struct eam_node **next = arg;
+	memcpy(*next, eam, sizeof(**next));
+	(*next)++;
+	return 0;
+}
+
+/**
+ * Builds and publishes the indexes, if they're missing.
+ *
+ * If they can't be built (too large, or no memory), lookups simply keep using
+ * the rtries.
+ */
+static void rebuild_indexes(struct eam_table *eamt)
+{
+	struct eam_node *entries;
+	struct eam_node *next;
+	struct mtrie *index;
+
+	if (deref_index(eamt, index6) || deref_index(eamt, index4))
+		return;
+	if (eamt->count == 0)
+		return;
+
+	entries = vmalloc(eamt->count * sizeof(*entries));
+	if (!entries)
+		return;
+
+	/* Both tries contain the same entries, so one of them is enough. */
+	next = entries;
+	rtrie_foreach(&eamt->trie4, collect_cb, &next, NULL);
+	if (WARN(next - entries != eamt->count,
+			"The EAMT has %llu entries, but I found %zu.",
+			eamt->count, (size_t)(next - entries)))
+		goto end;
+
+	index = mtrie_build(entries, eamt->count, sizeof(*entries),
+			sizeof(struct in6_addr), eam_key6);
+	if (index)
+		rcu_assign_pointer(eamt->index6, index);
+
+	index = mtrie_build(entries, eamt->count, sizeof(*entries),
+			sizeof(struct in_addr), eam_key4);
+	if (index)
+		rcu_assign_pointer(eamt->index4, index);
+
+	if (!deref_index(eamt, index6) || !deref_index(eamt, index4))
+		log_debug("Could not index the EAMT; lookups will be slower.");
+
+end:
+	vfree(entries);
+}
+
+static void rebuild_work_fn(struct work_struct *work)
+{
+	struct eam_table *eamt;
+
+	eamt = container_of(to_delayed_work(work), struct eam_table,
+			rebuild_work);
+
+	mutex_lock(&lock);
+	rebuild_indexes(eamt);
+	mutex_unlock(&lock);
+}
+
+static void free_counters(struct list_head *list)
+{
+	struct eam_counters *counters;
+	struct eam_counters *tmp;
+
+	list_for_each_entry_safe(counters, tmp, list, list_hook) {
+		list_del(&counters->list_hook);
+		free_percpu(counters->stats);
+		wkfree(struct eam_counters, counters);
+	}
+}
+
+static struct eam_counters *counters_alloc(struct eam_table *eamt)
+{
+	struct eam_counters *counters;
+
+	counters = wkmalloc(struct eam_counters, GFP_KERNEL);
+	if (!counters)
+		return NULL;
+
+	counters->stats = alloc_percpu(struct eam_stats);
+	if (!counters->stats) {
+		wkfree(struct eam_counters, counters);
+		return NULL;
+	}
+
+	list_add(&counters->list_hook, &eamt->counters);
+	return counters;
+}
+
+/**
+ * Gives @node counters, if the user wants them.
+ */
+static int node_init(struct eam_table *eamt, struct eam_node *node,
+		struct ipv6_prefix *prefix6, struct ipv4_prefix *prefix4)
+{
+	node->entry.prefix6 = *prefix6;
+	node->entry.prefix4 = *prefix4;
+	node->counters = NULL;
+
+	if (!READ_ONCE(eam_counters))
+		return 0;
+
+	node->counters = counters_alloc(eamt);
+	return node->counters ? 0 : -ENOMEM;
+}
+
+/**
+ * Frees the counters of an entry that never made it to the table.
+ */
+static void node_abort(struct eam_node *node)
+{
+	struct list_head tmp;
+
+	if (!node->counters)
+		return;
+
+	INIT_LIST_HEAD(&tmp);
+	list_move(&node->counters->list_hook, &tmp);
+	free_counters(&tmp);
+}
+
+/**
+ * node_abort() for entries the packet path might have already seen. Their
+ * counters are freed by the invalidate_indexes() the caller has to run next.
+ */
+static void node_bury(struct eam_table *eamt, struct eam_node *node)
+{
+	if (node->counters)
+		list_move(&node->counters->list_hook, &eamt->dead);
+}
+
+/**
+ * Call after every change to the tries. (Invalidates the lookup caches too.)
+ */
+static void invalidate_indexes(struct eam_table *eamt)
+{
+	struct mtrie *index6 = deref_index(eamt, index6);
+	struct mtrie *index4 = deref_index(eamt, index4);
+	struct clat_mapping *clat = deref_index(eamt, clat);
+
+	/*
+	 * The stale indexes have to be unreachable before the generation
+	 * changes. Otherwise, a lookup could read the new generation, find
+	 * its answer in an old index, and cache it as if it were current.
+	 */
+	if (index6 || index4 || clat) {
+		RCU_INIT_POINTER(eamt->index6, NULL);
+		RCU_INIT_POINTER(eamt->index4, NULL);
+		RCU_INIT_POINTER(eamt->clat, NULL);
+		synchronize_rcu_bh();
+		if (index6)
+			mtrie_destroy(index6);
+		if (index4)
+			mtrie_destroy(index4);
+		if (clat)
+			wkfree(struct clat_mapping, clat);
+	}
+
+	/* Pairs with smp_rmb() in get_generation(). */
+	smp_wmb();
+	if (atomic_inc_return(&eamt->generation) == 0)
+		atomic_inc(&eamt->generation);
+
+	/*
+	 * The cache slots still point to the dead counters, and a lookup that
+	 * read the old generation can still hit one of them and write to its
+	 * counters. So they can only be freed after a grace period that
+	 * starts after the bump. From then on, every slot that points to them
+	 * is stale, and no index reaches them anymore.
+	 */
+	if (!list_empty(&eamt->dead)) {
+		synchronize_rcu_bh();
+		free_counters(&eamt->dead);
+	}
+
+	mod_delayed_work(system_wq, &eamt->rebuild_work, INDEX_REBUILD_DELAY);
+}
+
 static bool eamt_entry_equals(const struct eamt_entry *eam1,
 		const struct eamt_entry *eam2)
 {
@@ -137,7 +454,7 @@ static int validate_overlapping(struct eam_table *eamt,
 		struct ipv4_prefix *prefix4,
 		bool force)
 {
-	struct eamt_entry old;
+	struct eam_node old;
 	struct rtrie_key key6 = PREFIX_TO_KEY(prefix6);
 	struct rtrie_key key4 = PREFIX_TO_KEY(prefix4);
 	int error;
@@ -149,14 +466,14 @@ static int validate_overlapping(struct eam_table *eamt,
 
 	error = rtrie_find(&eamt->trie6, &key6, &old);
 	if (!error) {
-		error = collision6(prefix6, prefix4, &old, force);
+		error = collision6(prefix6, prefix4, &old.entry, force);
 		if (error)
 			return error;
 	}
 
 	error = rtrie_find(&eamt->trie4, &key4, &old);
 	if (!error) {
-		error = collision4(prefix6, prefix4, &old, force);
+		error = collision4(prefix6, prefix4, &old.entry, force);
 		if (error)
 			return error;
 	}
@@ -174,13 +491,14 @@ static void __revert_add6(struct eam_table *eamt, struct ipv6_prefix *prefix6)
 			error);
 }
 
-static int eamt_add6(struct eam_table *eamt, struct eamt_entry *eam)
+static int eamt_add6(struct eam_table *eamt, struct eam_node *node)
 {
+	struct eamt_entry *eam = &node->entry;
 	size_t addr_offset;
 	int error;
 
-	addr_offset = offsetof(typeof(*eam), prefix6.address);
-	error = rtrie_add(&eamt->trie6, eam, addr_offset, eam->prefix6.len);
+	addr_offset = offsetof(typeof(*node), entry.prefix6.address);
+	error = rtrie_add(&eamt->trie6, node, addr_offset, eam->prefix6.len);
 	if (error == -EEXIST) {
 		log_err("Prefix %pI6c/%u already exists.",
 				&eam->prefix6.address, eam->prefix6.len);
@@ -191,13 +509,14 @@ static int eamt_add6(struct eam_table *eamt, struct eamt_entry *eam)
 	return error;
 }
 
-static int eamt_add4(struct eam_table *eamt, struct eamt_entry *eam)
+static int eamt_add4(struct eam_table *eamt, struct eam_node *node)
 {
+	struct eamt_entry *eam = &node->entry;
 	size_t addr_offset;
 	int error;
 
-	addr_offset = offsetof(typeof(*eam), prefix4.address);
-	error = rtrie_add(&eamt->trie4, eam, addr_offset, eam->prefix4.len);
+	addr_offset = offsetof(typeof(*node), entry.prefix4.address);
+	error = rtrie_add(&eamt->trie4, node, addr_offset, eam->prefix4.len);
 	if (error == -EEXIST) {
 		log_err("Prefix %pI4/%u already exists.",
 				&eam->prefix4.address, eam->prefix4.len);
@@ -213,7 +532,7 @@ int eamt_add(struct eam_table *eamt,
 		struct ipv4_prefix *prefix4,
 		bool force)
 {
-	struct eamt_entry new;
+	struct eam_node new;
 	int error;
 
 	error = validate_prefixes(prefix6, prefix4);
@@ -226,48 +545,210 @@ int eamt_add(struct eam_table *eamt,
 	if (error)
 		goto end;
 
-	new.prefix6 = *prefix6;
-	new.prefix4 = *prefix4;
+	error = node_init(eamt, &new, prefix6, prefix4);
+	if (error)
+		goto end;
 
 	error = eamt_add6(eamt, &new);
 	if (error)
-		goto end;
+		goto abort;
 	error = eamt_add4(eamt, &new);
 	if (error) {
 		__revert_add6(eamt, prefix6);
+		/* The packet path might have seen (and cached) it. */
+		node_bury(eamt, &new);
+		invalidate_indexes(eamt);
 		goto end;
 	}
 
 	eamt->count++;
+	invalidate_indexes(eamt);
+	goto end;
+
+abort:
+	node_abort(&new);
 end:
 	mutex_unlock(&lock);
 	return error;
 }
 
+static int cmp_eam6(const void *a, const void *b)
+{
+	const struct eamt_entry *eam1 = a;
+	const struct eamt_entry *eam2 = b;
+	int gap;
+
+	gap = ipv6_addr_cmp(&eam1->prefix6.address, &eam2->prefix6.address);
+	return gap ? gap : (eam1->prefix6.len - eam2->prefix6.len);
+}
+
+static int cmp_eam4(const void *a, const void *b)
+{
+	const struct eamt_entry *eam1 = a;
+	const struct eamt_entry *eam2 = b;
+	int gap;
+
+	gap = ipv4_addr_cmp(&eam1->prefix4.address, &eam2->prefix4.address);
+	return gap ? gap : (eam1->prefix4.len - eam2->prefix4.len);
+}
+
+/**
+ * Once the entries are sorted by address (and then by length), any prefix
+ * that contains other prefixes is immediately followed by one of them. So
+ * checking adjacent pairs is the same as checking all of them.
+ */
+static int validate_sorted6(struct eamt_entry *eams, unsigned int count,
+		bool force)
+{
+	unsigned int i;
+	int error;
+
+	for (i = 1; i < count; i++) {
+		if (!prefix6_contains(&eams[i - 1].prefix6,
+				&eams[i].prefix6.address))
+			continue;
+		error = collision6(&eams[i].prefix6, &eams[i].prefix4,
+				&eams[i - 1], force);
+		if (error)
+			return error;
+	}
+
+	return 0;
+}
+
+static int validate_sorted4(struct eamt_entry *eams, unsigned int count,
+		bool force)
+{
+	unsigned int i;
+	int error;
+
+	for (i = 1; i < count; i++) {
+		if (!prefix4_contains(&eams[i - 1].prefix4,
+				&eams[i].prefix4.address))
+			continue;
+		error = collision4(&eams[i].prefix6, &eams[i].prefix4,
+				&eams[i - 1], force);
+		if (error)
+			return error;
+	}
+
+	return 0;
+}
+
+static int __rm(struct eam_table *eamt,
+		struct ipv6_prefix *prefix6,
+		struct ipv4_prefix *prefix4);
+
+/**
+ * Same as eamt_add(), except for @count entries in one go. Either all of them
+ * are added or none are.
+ *
+ * The overlap validations among the new entries are a sort and a linear pass
+ * rather than a trie lookup per entry, and the indexes are only rebuilt once.
+ *
+ * Please note: this function can sleep.
+ */
+int eamt_add_bulk(struct eam_table *eamt, struct eamt_entry *eams,
+		unsigned int count, bool force)
+{
+	struct eamt_entry *sorted;
+	struct eam_node node;
+	unsigned int i;
+	int error;
+
+	if (count == 0)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		error = validate_prefixes(&eams[i].prefix6, &eams[i].prefix4);
+		if (error)
+			return error;
+	}
+
+	sorted = vmalloc(count * sizeof(*sorted));
+	if (!sorted)
+		return -ENOMEM;
+	memcpy(sorted, eams, count * sizeof(*sorted));
+
+	sort(sorted, count, sizeof(*sorted), cmp_eam4, NULL);
+	error = validate_sorted4(sorted, count, force);
+	if (error)
+		goto end;
+	sort(sorted, count, sizeof(*sorted), cmp_eam6, NULL);
+	error = validate_sorted6(sorted, count, force);
+	if (error)
+		goto end;
+
+	mutex_lock(&lock);
+
+	/* The new entries are fine among themselves; now the old ones. */
+	if (eamt->count) {
+		for (i = 0; i < count; i++) {
+			error = validate_overlapping(eamt, &sorted[i].prefix6,
+					&sorted[i].prefix4, force);
+			if (error)
+				goto unlock;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		error = node_init(eamt, &node, &sorted[i].prefix6,
+				&sorted[i].prefix4);
+		if (error)
+			goto revert;
+		error = eamt_add6(eamt, &node);
+		if (error) {
+			node_abort(&node);
+			goto revert;
+		}
+		error = eamt_add4(eamt, &node);
+		if (error) {
+			__revert_add6(eamt, &sorted[i].prefix6);
+			node_bury(eamt, &node);
+			goto revert;
+		}
+		eamt->count++;
+	}
+
+	invalidate_indexes(eamt);
+	goto unlock;
+
+revert:
+	while (i-- > 0)
+		__rm(eamt, &sorted[i].prefix6, &sorted[i].prefix4);
+	/* The packet path might have seen (and cached) some of them. */
+	invalidate_indexes(eamt);
+unlock:
+	mutex_unlock(&lock);
+end:
+	vfree(sorted);
+	return error;
+}
+
 static int get_exact6(struct eam_table *eamt, struct ipv6_prefix *prefix,
-		struct eamt_entry *eam)
+		struct eam_node *node)
 {
 	struct rtrie_key key = PREFIX_TO_KEY(prefix);
 	int error;
 
-	error = rtrie_find(&eamt->trie6, &key, eam);
+	error = rtrie_find(&eamt->trie6, &key, node);
 	if (error)
 		return error;
 
-	return (eam->prefix6.len == prefix->len) ? 0 : -ESRCH;
+	return (node->entry.prefix6.len == prefix->len) ? 0 : -ESRCH;
 }
 
 static int get_exact4(struct eam_table *eamt, struct ipv4_prefix *prefix,
-		struct eamt_entry *eam)
+		struct eam_node *node)
 {
 	struct rtrie_key key = PREFIX_TO_KEY(prefix);
 	int error;
 
-	error = rtrie_find(&eamt->trie4, &key, eam);
+	error = rtrie_find(&eamt->trie4, &key, node);
 	if (error)
 		return error;
 
-	return (eam->prefix4.len == prefix->len) ? 0 : -ESRCH;
+	return (node->entry.prefix4.len == prefix->len) ? 0 : -ESRCH;
 }
 
 static int __rm(struct eam_table *eamt,
@@ -276,8 +757,12 @@ static int __rm(struct eam_table *eamt,
 {
 	struct rtrie_key key6 = PREFIX_TO_KEY(prefix6);
 	struct rtrie_key key4 = PREFIX_TO_KEY(prefix4);
+	struct eam_node node;
 	int error;
 
+	error = get_exact6(eamt, prefix6, &node);
+	if (error)
+		goto corrupted;
 	error = rtrie_rm(&eamt->trie6, &key6);
 	if (error)
 		goto corrupted;
@@ -285,6 +770,9 @@ static int __rm(struct eam_table *eamt,
 	if (error)
 		goto corrupted;
 	eamt->count--;
+	/* The caller's invalidate_indexes() frees them. */
+	if (node.counters)
+		list_move(&node.counters->list_hook, &eamt->dead);
 
 	/* rtrie_print("IPv6 trie after remove", &eamt.trie6); */
 	/* rtrie_print("IPv4 trie after remove", &eamt.trie4); */
@@ -300,18 +788,18 @@ static int eamt_rm_lockless(struct eam_table *eamt,
 		struct ipv6_prefix *prefix6,
 		struct ipv4_prefix *prefix4)
 {
-	struct eamt_entry eam6;
-	struct eamt_entry eam4;
+	struct eam_node eam6;
+	struct eam_node eam4;
 	int error;
 
 	if (!prefix4) {
 		error = get_exact6(eamt, prefix6, &eam6);
-		return error ? error : __rm(eamt, prefix6, &eam6.prefix4);
+		return error ? error : __rm(eamt, prefix6, &eam6.entry.prefix4);
 	}
 
 	if (!prefix6) {
 		error = get_exact4(eamt, prefix4, &eam4);
-		return error ? error : __rm(eamt, &eam4.prefix6, prefix4);
+		return error ? error : __rm(eamt, &eam4.entry.prefix6, prefix4);
 	}
 
 	error = get_exact6(eamt, prefix6, &eam6);
@@ -321,7 +809,7 @@ static int eamt_rm_lockless(struct eam_table *eamt,
 	if (error)
 		return error;
 
-	return eamt_entry_equals(&eam6, &eam4)
+	return eamt_entry_equals(&eam6.entry, &eam4.entry)
 			? __rm(eamt, prefix6, prefix4)
 			: -ESRCH;
 }
@@ -337,76 +825,384 @@ int eamt_rm(struct eam_table *eamt,
 
 	mutex_lock(&lock);
 	error = eamt_rm_lockless(eamt, prefix6, prefix4);
+	if (!error)
+		invalidate_indexes(eamt);
 	mutex_unlock(&lock);
 
 	return error;
 }
 
-bool eamt_contains6(struct eam_table *eamt, struct in6_addr *addr)
+/**
+ * Returns the entry @addr belongs to, or NULL. Queries the index if it's
+ * available, the rtrie otherwise.
+ *
+ * Has to be called inside an RCU-bh read-side critical section; the result is
+ * only valid until it ends.
+ */
+static const struct eam_node *find6(struct eam_table *eamt,
+		struct in6_addr *addr)
 {
 	struct rtrie_key key = ADDR_TO_KEY(addr);
-	return rtrie_contains(&eamt->trie6, &key);
+	struct mtrie *index;
+
+	index = rcu_dereference_bh(eamt->index6);
+	return index ? mtrie_find(index, (__u8 *)addr)
+			: rtrie_find_rcu(&eamt->trie6, &key);
+}
+
+/** IPv4 version of find6(). */
+static const struct eam_node *find4(struct eam_table *eamt,
+		struct in_addr *addr)
+{
+	struct rtrie_key key = ADDR_TO_KEY(addr);
+	struct mtrie *index;
+
+	index = rcu_dereference_bh(eamt->index4);
+	return index ? mtrie_find(index, (__u8 *)addr)
+			: rtrie_find_rcu(&eamt->trie4, &key);
+}
+
+bool eamt_contains6(struct eam_table *eamt, struct in6_addr *addr)
+{
+	bool result;
+
+	rcu_read_lock_bh();
+	result = !!find6(eamt, addr);
+	rcu_read_unlock_bh();
+
+	return result;
 }
 
 bool eamt_contains4(struct eam_table *eamt, __be32 addr)
 {
 	struct in_addr tmp = { .s_addr = addr };
-	struct rtrie_key key = ADDR_TO_KEY(&tmp);
-	return rtrie_contains(&eamt->trie4, &key);
+	bool result;
+
+	rcu_read_lock_bh();
+	result = !!find4(eamt, &tmp);
+	rcu_read_unlock_bh();
+
+	return result;
 }
 
-int eamt_xlat_6to4(struct eam_table *eamt, struct in6_addr *addr6,
-		struct in_addr *result)
+/**
+ * Has to be read before the lookup whose result is going to be cached; that
+ * way, if the table changes in the meantime, the result is stale on arrival.
+ */
+static unsigned int get_generation(struct eam_table *eamt)
+{
+	unsigned int generation = atomic_read(&eamt->generation);
+	smp_rmb();
+	return generation;
+}
+
+static unsigned int hash6(struct in6_addr *addr)
 {
-	struct rtrie_key key = ADDR_TO_KEY(addr6);
-	struct eamt_entry eam;
+	return hash_32(addr->s6_addr32[0] ^ addr->s6_addr32[1]
+			^ addr->s6_addr32[2] ^ addr->s6_addr32[3],
+			CACHE_BITS);
+}
+
+static unsigned int hash4(struct in_addr *addr)
+{
+	return hash_32((__force u32)addr->s_addr, CACHE_BITS);
+}
+
+/**
+ * The entry is read in place (see find6()), so the caller has to be inside an
+ * RCU-bh read-side critical section.
+ */
+static int __xlat_6to4(struct eam_table *eamt, struct in6_addr *addr6,
+		struct in_addr *result, struct eam_counters **counters)
+{
+	const struct eam_node *node;
+	const struct eamt_entry *eam;
 	unsigned int i;
-	int error;
 
 	/* Find the entry. */
-	error = rtrie_find(&eamt->trie6, &key, &eam);
-	if (error)
-		return error;
+	node = find6(eamt, addr6);
+	if (!node)
+		return -ESRCH;
+	eam = &node->entry;
+	*counters = node->counters;
+
+	/* I'm assuming the prefix address is already zero-trimmed. */
+	*result = eam->prefix4.address;
 
 	/* Translate the address. */
-	for (i = 0; i < ADDR4_BITS - eam.prefix4.len; i++) {
-		unsigned int offset4 = eam.prefix4.len + i;
-		unsigned int offset6 = eam.prefix6.len + i;
-		addr4_set_bit(&eam.prefix4.address, offset4,
-				addr6_get_bit(addr6, offset6));
+	for (i = 0; i < ADDR4_BITS - eam->prefix4.len; i++) {
+		unsigned int offset4 = eam->prefix4.len + i;
+		unsigned int offset6 = eam->prefix6.len + i;
+		addr4_set_bit(result, offset4, addr6_get_bit(addr6, offset6));
 	}
 
-	/* I'm assuming the prefix address is already zero-trimmed. */
-	*result = eam.prefix4.address;
 	return 0;
 }
 
-int eamt_xlat_4to6(struct eam_table *eamt, struct in_addr *addr4,
-		struct in6_addr *result)
+/** Same as __xlat_6to4(), except the other way around. */
+static int __xlat_4to6(struct eam_table *eamt, struct in_addr *addr4,
+		struct in6_addr *result, struct eam_counters **counters)
 {
-	struct rtrie_key key = ADDR_TO_KEY(addr4);
-	struct eamt_entry eam;
+	const struct eam_node *node;
+	const struct eamt_entry *eam;
 	unsigned int i;
-	int error;
 
 	/* Find the entry. */
-	error = rtrie_find(&eamt->trie4, &key, &eam);
-	if (error)
-		return error;
+	node = find4(eamt, addr4);
+	if (!node)
+		return -ESRCH;
+	eam = &node->entry;
+	*counters = node->counters;
+
+	/* I'm assuming the prefix address is already zero-trimmed. */
+	*result = eam->prefix6.address;
 
 	/* Translate the address. */
-	for (i = 0; i < ADDR4_BITS - eam.prefix4.len; i++) {
-		unsigned int offset4 = eam.prefix4.len + i;
-		unsigned int offset6 = eam.prefix6.len + i;
-		addr6_set_bit(&eam.prefix6.address, offset6,
-				addr4_get_bit(addr4, offset4));
+	for (i = 0; i < ADDR4_BITS - eam->prefix4.len; i++) {
+		unsigned int offset4 = eam->prefix4.len + i;
+		unsigned int offset6 = eam->prefix6.len + i;
+		addr6_set_bit(result, offset6, addr4_get_bit(addr4, offset4));
 	}
 
-	/* I'm assuming the prefix address is already zero-trimmed. */
-	*result = eam.prefix6.address;
 	return 0;
 }
 
+/**
+ * Accounts one packet of @len bytes to @counters. Assumes bottom halves are
+ * disabled, and that we're inside the RCU-bh read-side critical section the
+ * counters were found in.
+ */
+static void count(struct eam_counters *counters, unsigned int len)
+{
+	struct eam_stats *stats;
+
+	if (!counters)
+		return;
+
+	stats = this_cpu_ptr(counters->stats);
+	stats->hits++;
+	stats->bytes += len;
+}
+
+/**
+ * @len is the length of the packet the address belongs to, for the entry's
+ * counters.
+ */
+int eamt_xlat_6to4(struct eam_table *eamt, struct in6_addr *addr6,
+		struct in_addr *result, unsigned int len)
+{
+	struct cache_slot6 *slot;
+	struct eam_counters *counters = NULL;
+	unsigned int generation;
+	int error;
+
+	/* The _bh also keeps us on this CPU. */
+	rcu_read_lock_bh();
+
+	generation = get_generation(eamt);
+	slot = &this_cpu_ptr(eamt->cache)->slots6[hash6(addr6)];
+	if (slot->generation == generation
+			&& ipv6_addr_equal(&slot->addr, addr6)) {
+		error = slot->error;
+		if (!error) {
+			*result = slot->result;
+			count(slot->counters, len);
+		}
+		goto end;
+	}
+
+	error = __xlat_6to4(eamt, addr6, result, &counters);
+
+	slot->generation = generation;
+	slot->error = error;
+	slot->addr = *addr6;
+	slot->counters = counters;
+	if (!error) {
+		slot->result = *result;
+		count(counters, len);
+	}
+
+end:
+	rcu_read_unlock_bh();
+	return error;
+}
+
+int eamt_xlat_4to6(struct eam_table *eamt, struct in_addr *addr4,
+		struct in6_addr *result, unsigned int len)
+{
+	struct cache_slot4 *slot;
+	struct eam_counters *counters = NULL;
+	unsigned int generation;
+	int error;
+
+	rcu_read_lock_bh();
+
+	generation = get_generation(eamt);
+	slot = &this_cpu_ptr(eamt->cache)->slots4[hash4(addr4)];
+	if (slot->generation == generation
+			&& slot->addr.s_addr == addr4->s_addr) {
+		error = slot->error;
+		if (!error) {
+			*result = slot->result;
+			count(slot->counters, len);
+		}
+		goto end;
+	}
+
+	error = __xlat_4to6(eamt, addr4, result, &counters);
+
+	slot->generation = generation;
+	slot->error = error;
+	slot->addr = *addr4;
+	slot->counters = counters;
+	if (!error) {
+		slot->result = *result;
+		count(counters, len);
+	}
+
+end:
+	rcu_read_unlock_bh();
+	return error;
+}
+
+static bool prefix96_contains(struct in6_addr *prefix, struct in6_addr *addr)
+{
+	return prefix->s6_addr32[0] == addr->s6_addr32[0]
+			&& prefix->s6_addr32[1] == addr->s6_addr32[1]
+			&& prefix->s6_addr32[2] == addr->s6_addr32[2];
+}
+
+/**
+ * eamt_clat_6to4 - The CLAT mode's translation of an IPv6 packet coming from
+ * the PLAT: @saddr6 has to be pool6 + some IPv4 address, and @daddr6 has to be
+ * the EAM entry's IPv6 address.
+ *
+ * Returns false if @eamt has no CLAT mapping or the addresses don't fit it, in
+ * which case the packet has to take the normal path.
+ *
+ * Unlike the normal path, this does not check whether the resulting addresses
+ * belong to the translator's own interfaces.
+ */
+bool eamt_clat_6to4(struct eam_table *eamt, struct in6_addr *saddr6,
+		struct in6_addr *daddr6, __be32 *saddr, __be32 *daddr,
+		unsigned int len)
+{
+	struct clat_mapping *clat;
+	bool success = false;
+
+	rcu_read_lock_bh();
+
+	clat = rcu_dereference_bh(eamt->clat);
+	if (!clat)
+		goto end;
+	if (!ipv6_addr_equal(daddr6, &clat->addr6))
+		goto end;
+	if (!prefix96_contains(&clat->prefix6, saddr6))
+		goto end;
+	/* Hairpinning, or the EAM entry itself; the normal path knows. */
+	if (saddr6->s6_addr32[3] == clat->addr4)
+		goto end;
+	if (addr4_is_scope_subnet(saddr6->s6_addr32[3]))
+		goto end;
+
+	*saddr = saddr6->s6_addr32[3];
+	*daddr = clat->addr4;
+	count(clat->counters, len);
+	success = true;
+	/* Fall through. */
+
+end:
+	rcu_read_unlock_bh();
+	return success;
+}
+
+/**
+ * eamt_clat_4to6 - The CLAT mode's translation of an IPv4 packet coming from
+ * the EAM entry's IPv4 address, headed towards the PLAT. (See
+ * eamt_clat_6to4().)
+ */
+bool eamt_clat_4to6(struct eam_table *eamt, __be32 saddr, __be32 daddr,
+		struct in6_addr *saddr6, struct in6_addr *daddr6,
+		unsigned int len)
+{
+	struct clat_mapping *clat;
+	bool success = false;
+
+	rcu_read_lock_bh();
+
+	clat = rcu_dereference_bh(eamt->clat);
+	if (!clat)
+		goto end;
+	if (saddr != clat->addr4 || daddr == clat->addr4)
+		goto end;
+	if (addr4_is_scope_subnet(daddr))
+		goto end;
+
+	*saddr6 = clat->addr6;
+	*daddr6 = clat->prefix6;
+	daddr6->s6_addr32[3] = daddr;
+	count(clat->counters, len);
+	success = true;
+	/* Fall through. */
+
+end:
+	rcu_read_unlock_bh();
+	return success;
+}
+
+static int clat_node_cb(void *value, void *arg)
+{
+	struct eam_node **result = arg;
+	*result = value;
+	return 0;
+}
+
+/**
+ * eamt_clat_refresh - Recomputes @eamt's CLAT mapping. @prefix6 is the
+ * instance's pool6 prefix, or NULL if pool6 and blacklist4 disqualify the
+ * instance. (The caller decides that; see xlator_refresh_clat().)
+ *
+ * The mapping only exists if @prefix6 is a /96, and @eamt has exactly one
+ * entry, which maps a single IPv6 address to a single IPv4 one.
+ */
+void eamt_clat_refresh(struct eam_table *eamt, struct ipv6_prefix *prefix6)
+{
+	struct clat_mapping *new = NULL;
+	struct clat_mapping *old;
+	struct eam_node *node = NULL;
+
+	mutex_lock(&lock);
+
+	if (!prefix6 || prefix6->len != 96 || eamt->count != 1)
+		goto publish;
+	rtrie_foreach(&eamt->trie4, clat_node_cb, &node, NULL);
+	if (!node || node->entry.prefix6.len != 128
+			|| node->entry.prefix4.len != 32)
+		goto publish;
+	if (addr4_is_scope_subnet(node->entry.prefix4.address.s_addr))
+		goto publish;
+
+	new = wkmalloc(struct clat_mapping, GFP_KERNEL);
+	if (!new)
+		goto publish; /* Fine; the normal path still works. */
+	new->prefix6 = prefix6->address;
+	new->addr6 = node->entry.prefix6.address;
+	new->addr4 = node->entry.prefix4.address.s_addr;
+	new->counters = node->counters;
+	/* Fall through. */
+
+publish:
+	old = deref_index(eamt, clat);
+	rcu_assign_pointer(eamt->clat, new);
+	mutex_unlock(&lock);
+
+	if (old) {
+		synchronize_rcu_bh();
+		wkfree(struct clat_mapping, old);
+	}
+	log_debug("CLAT mapping %s.", new ? "computed" : "disabled");
+}
+
 int eamt_count(struct eam_table *eamt, __u64 *count)
 {
 	mutex_lock(&lock);
@@ -452,12 +1248,83 @@ int eamt_foreach(struct eam_table *eamt,
 	return error;
 }
 
+struct foreach_usr_args {
+	int (*cb)(struct eamt_entry_usr *, void *);
+	void *arg;
+	bool reset;
+};
+
+static int foreach_usr_cb(void *value, void *arg)
+{
+	struct foreach_usr_args *args = arg;
+	struct eam_node *node = value;
+	struct eamt_entry_usr usr;
+	struct eam_stats *stats;
+	int cpu;
+	int error;
+
+	usr.entry = node->entry;
+	usr.hits = 0;
+	usr.bytes = 0;
+	if (node->counters) {
+		for_each_possible_cpu(cpu) {
+			stats = per_cpu_ptr(node->counters->stats, cpu);
+			usr.hits += stats->hits;
+			usr.bytes += stats->bytes;
+		}
+	}
+
+	error = args->cb(&usr, args->arg);
+	if (error || !args->reset || !node->counters)
+		return error;
+
+	/*
+	 * The packet path doesn't lock the counters, so a packet or two
+	 * translated during the reset might survive it (or be lost).
+	 */
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(node->counters->stats, cpu);
+		stats->hits = 0;
+		stats->bytes = 0;
+	}
+	return 0;
+}
+
+/**
+ * Same as eamt_foreach(), except the entries come with their counters.
+ * If @reset is true, the counters of every entry @cb accepts (returns zero
+ * for) are zeroed.
+ */
+int eamt_foreach_usr(struct eam_table *eamt,
+		int (*cb)(struct eamt_entry_usr *, void *), void *arg,
+		struct ipv4_prefix *offset, bool reset)
+{
+	struct foreach_usr_args args = { .cb = cb, .arg = arg, .reset = reset };
+	struct rtrie_key offset_key;
+	struct rtrie_key *offset_key_ptr = NULL;
+	int error;
+
+	if (offset) {
+		offset_key.bytes = (__u8 *) &offset->address;
+		offset_key.len = offset->len;
+		offset_key_ptr = &offset_key;
+	}
+
+	mutex_lock(&lock);
+	error = rtrie_foreach(&eamt->trie4, foreach_usr_cb, &args,
+			offset_key_ptr);
+	mutex_unlock(&lock);
+	return error;
+}
+
 void eamt_flush(struct eam_table *eamt)
 {
 	mutex_lock(&lock);
 	rtrie_flush(&eamt->trie6);
 	rtrie_flush(&eamt->trie4);
 	eamt->count = 0;
+	list_splice_init(&eamt->counters, &eamt->dead);
+	invalidate_indexes(eamt);
 	mutex_unlock(&lock);
 }
 
@@ -469,9 +1336,22 @@ struct eam_table *eamt_alloc(void)
 	if (!result)
 		return NULL;
 
-	rtrie_init(&result->trie6, sizeof(struct eamt_entry), &lock);
-	rtrie_init(&result->trie4, sizeof(struct eamt_entry), &lock);
+	result->cache = alloc_percpu(struct eamt_cache);
+	if (!result->cache) {
+		wkfree(struct eam_table, result);
+		return NULL;
+	}
+	atomic_set(&result->generation, 1);
+
+	rtrie_init(&result->trie6, sizeof(struct eam_node), &lock);
+	rtrie_init(&result->trie4, sizeof(struct eam_node), &lock);
+	RCU_INIT_POINTER(result->index6, NULL);
+	RCU_INIT_POINTER(result->index4, NULL);
+	RCU_INIT_POINTER(result->clat, NULL);
+	INIT_DELAYED_WORK(&result->rebuild_work, rebuild_work_fn);
 	result->count = 0;
+	INIT_LIST_HEAD(&result->counters);
+	INIT_LIST_HEAD(&result->dead);
 	kref_init(&result->refcount);
 
 	return result;
@@ -490,8 +1370,19 @@ static void eamt_release(struct kref *refcount)
 	struct eam_table *eamt;
 	eamt = container_of(refcount, struct eam_table, refcount);
 	log_debug("Emptying EAMT...");
+	cancel_delayed_work_sync(&eamt->rebuild_work);
+	/* Nobody can be reading the table anymore, so no grace period. */
+	if (rcu_access_pointer(eamt->index6))
+		mtrie_destroy(rcu_access_pointer(eamt->index6));
+	if (rcu_access_pointer(eamt->index4))
+		mtrie_destroy(rcu_access_pointer(eamt->index4));
+	if (rcu_access_pointer(eamt->clat))
+		wkfree(struct clat_mapping, rcu_access_pointer(eamt->clat));
 	rtrie_clean(&eamt->trie6);
 	rtrie_clean(&eamt->trie4);
+	free_counters(&eamt->counters);
+	free_counters(&eamt->dead);
+	free_percpu(eamt->cache);
 	wkfree(struct eam_table, eamt);
 }
 
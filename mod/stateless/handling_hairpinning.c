@@ -1,7 +1,15 @@
 #include "nat64/mod/common/handling_hairpinning.h"
 
+#include <net/checksum.h>
+#include "nat64/mod/common/icmp_wrapper.h"
+#include "nat64/mod/common/pool6.h"
+#include "nat64/mod/common/rfc6052.h"
+#include "nat64/mod/common/route.h"
 #include "nat64/mod/common/send_packet.h"
+#include "nat64/mod/common/rfc6145/4to6.h"
+#include "nat64/mod/common/rfc6145/6to4.h"
 #include "nat64/mod/common/rfc6145/core.h"
+#include "nat64/mod/stateless/eam.h"
 
 bool is_hairpin(struct xlation *state)
 {
@@ -17,6 +25,8 @@ verdict handling_hairpinning(struct xlation *old)
 
 	new.jool = old->jool;
 	new.in = old->out;
+	new.route_hint = old->route_hint;
+	new.csum_delta.set = false;
 
 	result = translating_the_packet(&new);
 	if (result != VERDICT_CONTINUE)
@@ -28,3 +38,224 @@ verdict handling_hairpinning(struct xlation *old)
 	log_debug("Done hairpinning.");
 	return VERDICT_CONTINUE;
 }
+
+/**
+ * Is @state->in (not translated yet) an intrinsic hairpin (condition set A of
+ * ttp64_siit_addrs()) that can skip the trip through IPv4? That is, an IPv6
+ * packet from one EAM-mapped host to the RFC 6052 address of another one.
+ * See handling_hairpinning_direct().
+ *
+ * This runs for every packet, so it only spends an EAMT lookup on the ones
+ * headed to pool6. Anything that would need the intermediate IPv4 packet for
+ * something other than its addresses is left to handling_hairpinning():
+ *
+ * - ICMP, because errors need their inner packets translated.
+ * - Fragments and extension headers, because the IPv4 leg would change them.
+ * - Hop limits the double translation would exhaust, since they need ICMP
+ *   errors.
+ * - TCP SYNs, if --mss-clamp wants to edit them.
+ */
+bool can_hairpin_directly(struct xlation *state)
+{
+	struct packet *in = &state->in;
+	struct ipv6hdr *hdr;
+	struct ipv6_prefix prefix;
+	struct in_addr daddr4;
+
+	if (state->jool.global->cfg.siit.eam_hairpin_mode
+			!= EAM_HAIRPIN_INTRINSIC)
+		return false;
+	if (pkt_l3_proto(in) != L3PROTO_IPV6)
+		return false;
+	if (pkt_original_pkt(in) != in || skb_shared(in->skb))
+		return false;
+
+	hdr = pkt_ip6_hdr(in);
+	if (pkt_frag_hdr(in) || hdr->hop_limit <= 2)
+		return false;
+
+	switch (pkt_l4_proto(in)) {
+	case L4PROTO_TCP:
+		if (hdr->nexthdr != NEXTHDR_TCP)
+			return false;
+		if (pkt_tcp_hdr(in)->syn && state->jool.global->cfg.mss_clamp)
+			return false;
+		break;
+	case L4PROTO_UDP:
+		if (hdr->nexthdr != NEXTHDR_UDP)
+			return false;
+		break;
+	default:
+		return false;
+	}
+
+	/* EAMT first, pool6 second; same as generate_addr4_siit(). */
+	if (eamt_contains6(state->jool.siit.eamt, &hdr->daddr))
+		return false;
+	if (pool6_find(state->jool.pool6, &hdr->daddr, &prefix))
+		return false;
+	if (addr_6to4(&hdr->daddr, &prefix, &daddr4))
+		return false;
+	return eamt_contains4(state->jool.siit.eamt, daddr4.s_addr);
+}
+
+/**
+ * The bytes handling_hairpinning_direct() overrides, so it can give the packet
+ * back if it turns out it cannot send it.
+ */
+struct hairpin_backup {
+	struct ipv6hdr hdr6;
+	__sum16 check;
+	__u8 ip_summed;
+	__wsum csum;
+};
+
+static __sum16 *l4_check(struct packet *pkt)
+{
+	return (pkt_l4_proto(pkt) == L4PROTO_TCP)
+			? &tcp_hdr(pkt->skb)->check
+			: &udp_hdr(pkt->skb)->check;
+}
+
+static void backup_hdrs(struct packet *pkt, struct hairpin_backup *backup)
+{
+	struct sk_buff *skb = pkt->skb;
+
+	memcpy(&backup->hdr6, ipv6_hdr(skb), sizeof(backup->hdr6));
+	backup->check = *l4_check(pkt);
+	backup->ip_summed = skb->ip_summed;
+	backup->csum = skb->csum;
+}
+
+static void restore_hdrs(struct packet *pkt, struct hairpin_backup *backup)
+{
+	struct sk_buff *skb = pkt->skb;
+
+	memcpy(ipv6_hdr(skb), &backup->hdr6, sizeof(backup->hdr6));
+	*l4_check(pkt) = backup->check;
+	skb->ip_summed = backup->ip_summed;
+	skb->csum = backup->csum;
+	skb_dst_drop(skb);
+}
+
+/**
+ * Turns @pkt into the packet the IPv6 -> IPv4 -> IPv6 translation would have
+ * yielded: the addresses the two legs would have computed, their traffic
+ * class, no flow label, and the hop limit decremented twice. The ports are
+ * untouched, so the layer-4 checksum only needs the address deltas.
+ */
+static void rewrite_hdrs(struct xlation *state, struct packet *pkt,
+		struct in6_addr *saddr, struct in6_addr *daddr)
+{
+	struct global_config_usr *cfg = &state->jool.global->cfg;
+	struct sk_buff *skb = pkt->skb;
+	struct ipv6hdr *hdr6 = ipv6_hdr(skb);
+	__sum16 *check = l4_check(pkt);
+	__u8 tclass;
+
+	tclass = cfg->reset_traffic_class ? 0 : ttp64_xlat_tos(cfg, hdr6);
+	hdr6->priority = tclass >> 4;
+	hdr6->flow_lbl[0] = tclass << 4;
+	hdr6->flow_lbl[1] = 0;
+	hdr6->flow_lbl[2] = 0;
+	hdr6->hop_limit -= 2;
+
+	inet_proto_csum_replace16(check, skb, hdr6->saddr.s6_addr32,
+			saddr->s6_addr32, true);
+	inet_proto_csum_replace16(check, skb, hdr6->daddr.s6_addr32,
+			daddr->s6_addr32, true);
+	hdr6->saddr = *saddr;
+	hdr6->daddr = *daddr;
+
+	if (pkt_l4_proto(pkt) == L4PROTO_UDP && skb->ip_summed != CHECKSUM_PARTIAL
+			&& !*check)
+		*check = CSUM_MANGLED_0;
+
+	/* The IPv6 header is part of the NIC's sum, and it just changed. */
+	if (skb->ip_summed == CHECKSUM_COMPLETE)
+		skb->ip_summed = CHECKSUM_NONE;
+}
+
+/**
+ * Same as translating @state->in and then handling_hairpinning() the result,
+ * except the intermediate IPv4 packet is never built (nor routed): both legs'
+ * address translations are computed up front, and the original packet is
+ * rewritten into the final one. The caller should have already checked
+ * can_hairpin_directly().
+ *
+ * Once the packet is handed to sendpkt_send(), @state->in no longer has an skb.
+ */
+verdict handling_hairpinning_direct(struct xlation *state)
+{
+	struct xlation new;
+	struct packet *pkt = &state->in;
+	struct sk_buff *skb = pkt->skb;
+	struct hairpin_backup backup;
+	struct dst_entry *dst;
+	__be32 saddr4, daddr4;
+	struct in6_addr saddr6, daddr6;
+	bool hairpin = false;
+	unsigned int len;
+	verdict result;
+
+	log_debug("Packet is a hairpin. U-turning (directly)...");
+
+	result = ttp64_siit_addrs(state, &saddr4, &daddr4, &hairpin);
+	if (result != VERDICT_CONTINUE)
+		return result;
+	if (WARN(!hairpin, "can_hairpin_directly() let a non-hairpin through."))
+		return VERDICT_DROP;
+	result = ttp46_siit_addrs(state, true, saddr4, daddr4, &saddr6,
+			&daddr6);
+	if (result != VERDICT_CONTINUE)
+		return result;
+
+	/* The headers were pulled; this makes them writable if cloned. */
+	if (skb_cow_head(skb, 0)) {
+		inc_stats(pkt, IPSTATS_MIB_INDISCARDS);
+		return VERDICT_DROP;
+	}
+
+	backup_hdrs(pkt, &backup);
+	skb_dst_drop(skb);
+	rewrite_hdrs(state, pkt, &saddr6, &daddr6);
+
+	xlation_init(&new);
+	new.jool = state->jool;
+	new.in = state->in;
+	new.route_hint = state->route_hint;
+	pkt_fill(&new.out, skb, L3PROTO_IPV6, pkt_l4_proto(pkt), NULL,
+			pkt_payload(pkt), pkt);
+
+	dst = route_hinted(state->jool.ns, &new.out, new.route_hint);
+	if (!dst) {
+		restore_hdrs(pkt, &backup);
+		return VERDICT_ACCEPT;
+	}
+
+	len = skb_is_gso(skb)
+			? (pkt_hdrs_len(pkt) + skb_shinfo(skb)->gso_size)
+			: skb->len;
+	if (len > dst_mtu(dst)) {
+		log_debug("Packet is too big (len: %u, mtu: %u).", len,
+				dst_mtu(dst));
+		restore_hdrs(pkt, &backup);
+		icmp64_send(state->jool.stats, pkt, ICMPERR_FRAG_NEEDED,
+				dst_mtu(dst));
+		return VERDICT_DROP;
+	}
+
+	/* We're going out through a different path, so forget the old one. */
+	skb_orphan(skb);
+	nf_reset(skb);
+	memset(skb->cb, 0, sizeof(skb->cb));
+
+	/* sendpkt_send() releases the skb regardless of verdict. */
+	result = sendpkt_send(&new);
+	pkt->skb = NULL;
+	if (result != VERDICT_CONTINUE)
+		return result;
+
+	log_debug("Done hairpinning.");
+	return VERDICT_CONTINUE;
+}
@@ -4,6 +4,7 @@
 #include "nat64/mod/stateful/fragment_db.h"
 #include "nat64/mod/stateful/joold.h"
 #include "nat64/mod/stateful/pool4/db.h"
+#include "nat64/mod/stateful/timer.h"
 #include "nat64/mod/stateful/bib/db.h"
 
 /**
@@ -38,6 +39,11 @@ verdict compute_out_tuple(struct xlation *state)
 	return VERDICT_DROP;
 }
 
+void joold_barrier(void)
+{
+	fail(__func__);
+}
+
 struct joold_queue *joold_alloc(struct net *ns)
 {
 	fail(__func__);
@@ -69,17 +75,22 @@ int joold_sync(struct xlator *jool, void *data, __u32 size)
 	return fail(__func__);
 }
 
+int joold_update(struct xlator *jool, void *data, __u32 size)
+{
+	return fail(__func__);
+}
+
 int joold_test(struct xlator *jool)
 {
 	return fail(__func__);
 }
 
-int joold_advertise(struct xlator *jool)
+int joold_advertise(struct xlator *jool, unsigned int window)
 {
 	return fail(__func__);
 }
 
-struct fragdb *fragdb_alloc(struct net *ns)
+struct fragdb *fragdb_alloc(struct net *ns, struct jool_stats *stats)
 {
 	fail(__func__);
 	return NULL;
@@ -111,6 +122,11 @@ verdict fragdb_handle(struct fragdb *db, struct packet *pkt)
 	return VERDICT_DROP;
 }
 
+void fragdb_resolve(struct fragdb *db, struct xlation *state)
+{
+	fail(__func__);
+}
+
 struct pool4 *pool4db_alloc(void)
 {
 	fail(__func__);
@@ -161,7 +177,14 @@ bool pool4db_contains(struct pool4 *pool, struct net *ns,
 	return false;
 }
 
-struct bib *bib_alloc(void)
+bool pool4db_contains_addr(struct pool4 *pool, struct net *ns,
+		struct in_addr *addr)
+{
+	fail(__func__);
+	return false;
+}
+
+struct bib *bib_alloc(struct net *ns, struct jool_stats *stats)
 {
 	fail(__func__);
 	return NULL;
@@ -211,6 +234,20 @@ int bib_rm(struct bib *db, struct bib_entry *entry)
 	return fail(__func__);
 }
 
+int bib_add_static_bulk(struct bib *db, l4_protocol proto,
+		struct bib_bulk_entry *entries, unsigned int count,
+		int *errors)
+{
+	return fail(__func__);
+}
+
+int bib_rm_bulk(struct bib *db, l4_protocol proto,
+		struct bib_bulk_entry *entries, unsigned int count,
+		int *errors)
+{
+	return fail(__func__);
+}
+
 void bib_rm_range(struct bib *db, l4_protocol proto, struct ipv4_range *range)
 {
 	fail(__func__);
@@ -221,16 +258,50 @@ void bib_flush(struct bib *db)
 	fail(__func__);
 }
 
+void bib_prefetch6(struct bib *db, l4_protocol proto,
+		const struct ipv6_transport_addr *src6,
+		const struct ipv6_transport_addr *dst6)
+{
+	fail(__func__);
+}
+
+void bib_prefetch4(struct bib *db, l4_protocol proto,
+		const struct ipv4_transport_addr *src4,
+		const struct ipv4_transport_addr *dst4)
+{
+	fail(__func__);
+}
+
+bool bib_offload_find(struct bib *db, struct packet *in, struct tuple *out,
+		struct csum_delta *delta, int *generation)
+{
+	fail(__func__);
+	return false;
+}
+
+void bib_offload_add(struct bib *db, struct packet *in,
+		struct bib_session *entries, struct tuple *out, int generation)
+{
+	fail(__func__);
+}
+
+void bib_offload_flush(struct bib *db)
+{
+	fail(__func__);
+}
+
 int bib_foreach(struct bib *db, l4_protocol proto,
 		struct bib_foreach_func *func,
-		const struct ipv4_transport_addr *offset)
+		const struct ipv4_transport_addr *offset,
+		const struct bib_filter *filter)
 {
 	return fail(__func__);
 }
 
 int bib_foreach_session(struct bib *db, l4_protocol proto,
 		struct session_foreach_func *collision_cb,
-		struct session_foreach_offset *offset)
+		struct session_foreach_offset *offset,
+		const struct bib_filter *filter)
 {
 	return fail(__func__);
 }
@@ -245,6 +316,22 @@ int bib_count_sessions(struct bib *db, l4_protocol proto, __u64 *count)
 	return fail(__func__);
 }
 
+int bib_count_evicted(struct bib *db, l4_protocol proto, __u64 *count)
+{
+	return fail(__func__);
+}
+
+int bib_top(struct bib *db, l4_protocol proto, struct bib_top_query *query,
+		struct bib_top_usr *top, unsigned int *count)
+{
+	return fail(__func__);
+}
+
+int bib_follow(struct bib *db, __u64 since, struct nlcore_buffer *buffer)
+{
+	return fail(__func__);
+}
+
 void bib_session_init(struct bib_session *bs)
 {
 	/* No code. */
@@ -254,3 +341,23 @@ void joold_ack(struct xlator *jool)
 {
 	fail(__func__);
 }
+
+#ifndef UNIT_TESTING
+
+struct jtimer *jtimer_alloc(struct net *ns)
+{
+	fail(__func__);
+	return NULL;
+}
+
+void jtimer_kick(struct jtimer *timer)
+{
+	fail(__func__);
+}
+
+void jtimer_destroy(struct jtimer *timer)
+{
+	/* SIIT instances don't have timers; this is always NULL. */
+}
+
+#endif
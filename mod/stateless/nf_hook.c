@@ -5,12 +5,17 @@
 #include <linux/version.h>
 #include "nat64/common/types.h"
 #include "nat64/mod/common/core.h"
+#include "nat64/mod/common/ingress.h"
 #include "nat64/mod/common/linux_version.h"
 #include "nat64/mod/common/nf_wrapper.h"
 #include "nat64/mod/common/pool6.h"
+#include "nat64/mod/common/route.h"
+#include "nat64/mod/common/rfc6145/6to4.h"
+#include "nat64/mod/common/skb_pool.h"
 #include "nat64/mod/common/wkmalloc.h"
 #include "nat64/mod/common/xlator.h"
 #include "nat64/mod/common/nl/nl_handler.h"
+#include "nat64/mod/stateless/blacklist4.h"
 #include "nat64/mod/stateless/pool.h"
 
 MODULE_LICENSE(JOOL_LICENSE);
@@ -105,6 +110,21 @@ static int __init jool_init(void)
 	log_debug("Inserting %s...", xlat_get_name());
 
 	/* Init Jool's submodules. */
+	error = route_cache_setup();
+	if (error)
+		goto route_cache_fail;
+	error = ttp64_setup();
+	if (error)
+		goto ttp64_fail;
+	error = skbpool_setup();
+	if (error)
+		goto skbpool_fail;
+	error = ingress_setup();
+	if (error)
+		goto ingress_fail;
+	error = blacklist_setup();
+	if (error)
+		goto blacklist_fail;
 	error = xlator_setup();
 	if (error)
 		goto xlator_fail;
@@ -140,6 +160,16 @@ instance_fail:
 nlhandler_fail:
 	xlator_teardown();
 xlator_fail:
+	blacklist_teardown();
+blacklist_fail:
+	ingress_teardown();
+ingress_fail:
+	skbpool_teardown();
+skbpool_fail:
+	ttp64_teardown();
+ttp64_fail:
+	route_cache_teardown();
+route_cache_fail:
 	return error;
 }
 
@@ -151,6 +181,11 @@ static void __exit jool_exit(void)
 
 	nlhandler_teardown();
 	xlator_teardown();
+	blacklist_teardown();
+	ingress_teardown();
+	skbpool_teardown();
+	ttp64_teardown();
+	route_cache_teardown();
 
 #ifdef JKMEMLEAK
 	wkmalloc_print_leaks();
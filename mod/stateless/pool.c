@@ -3,6 +3,7 @@
 #include <linux/inet.h>
 #include <linux/kref.h>
 #include <linux/rculist.h>
+#include <linux/sort.h>
 #include "nat64/common/str_utils.h"
 #include "nat64/common/types.h"
 #include "nat64/mod/common/address.h"
@@ -15,8 +16,47 @@ struct pool_entry {
 	struct list_head list_hook;
 };
 
+/** A range of addresses, in host byte order. Both ends are included. */
+struct pool_range {
+	__u32 first;
+	__u32 last;
+};
+
+/** A list entry, and the number of pool addresses that precede it. */
+struct pool_slice {
+	struct ipv4_prefix prefix;
+	__u64 preceding;
+};
+
+/**
+ * A read-only summary of a pool's list, so the packet path doesn't have to
+ * walk it.
+ */
+struct pool_index {
+	/** Sum of the addresses of every entry. (Duplicates included.) */
+	__u64 addr_count;
+
+	/** The addresses covered by the pool, sorted and merged. */
+	struct pool_range *ranges;
+	unsigned int range_count;
+
+	/** The list entries, in list order. */
+	struct pool_slice *slices;
+	unsigned int slice_count;
+
+	struct rcu_head rcu;
+
+	/* @ranges and @slices hang off the end. */
+};
+
 struct addr4_pool {
+	/** The pool itself. */
 	struct list_head __rcu *list;
+	/**
+	 * Rebuilt after every change to @list. NULL if the last rebuild ran
+	 * out of memory; readers walk @list in that case.
+	 */
+	struct pool_index __rcu *index;
 	struct kref refcounter;
 };
 
@@ -68,6 +108,101 @@ static void __destroy(struct list_head *list)
 	__wkfree("IPv4 address pool list", list);
 }
 
+static void destroy_index(struct pool_index *index)
+{
+	__wkfree("IPv4 address pool index", index);
+}
+
+static void destroy_index_rcu(struct rcu_head *rcu)
+{
+	destroy_index(container_of(rcu, struct pool_index, rcu));
+}
+
+static int cmp_range(const void *a, const void *b)
+{
+	const struct pool_range *r1 = a;
+	const struct pool_range *r2 = b;
+
+	if (r1->first != r2->first)
+		return (r1->first < r2->first) ? -1 : 1;
+	return 0;
+}
+
+RCUTAG_USR
+static struct pool_index *build_index(struct list_head *list)
+{
+	struct pool_index *index;
+	struct pool_entry *entry;
+	struct pool_range *range;
+	unsigned int count = 0;
+	unsigned int i;
+	__u64 addrs;
+
+	list_for_each_entry(entry, list, list_hook)
+		count++;
+
+	index = __wkmalloc("IPv4 address pool index", sizeof(*index)
+			+ count * (sizeof(*range) + sizeof(*index->slices)),
+			GFP_KERNEL);
+	if (!index)
+		return NULL;
+
+	index->addr_count = 0;
+	index->ranges = (struct pool_range *)(index + 1);
+	index->slices = (struct pool_slice *)(index->ranges + count);
+	index->slice_count = count;
+
+	i = 0;
+	list_for_each_entry(entry, list, list_hook) {
+		addrs = prefix4_get_addr_count(&entry->prefix);
+
+		index->slices[i].prefix = entry->prefix;
+		index->slices[i].preceding = index->addr_count;
+		index->ranges[i].first = ntohl(entry->prefix.address.s_addr);
+		index->ranges[i].last = index->ranges[i].first + (addrs - 1);
+
+		index->addr_count += addrs;
+		i++;
+	}
+
+	/* Merge the ranges that overlap or touch. */
+	sort(index->ranges, count, sizeof(*index->ranges), cmp_range, NULL);
+	range = index->ranges;
+	for (i = 1; i < count; i++) {
+		if (range->last == U32_MAX
+				|| index->ranges[i].first <= range->last + 1) {
+			range->last = max(range->last, index->ranges[i].last);
+		} else {
+			range++;
+			*range = index->ranges[i];
+		}
+	}
+	index->range_count = count ? (range - index->ranges + 1) : 0;
+
+	return index;
+}
+
+/**
+ * Call after every change to @pool's list, while holding the lock.
+ */
+RCUTAG_USR
+static void publish_index(struct addr4_pool *pool)
+{
+	struct list_head *list;
+	struct pool_index *old;
+	struct pool_index *new;
+
+	list = rcu_dereference_protected(pool->list, lockdep_is_held(&lock));
+	new = build_index(list);
+	if (!new)
+		log_debug("Out of memory; the IPv4 pool will be slow until its next change.");
+
+	old = rcu_dereference_protected(pool->index, lockdep_is_held(&lock));
+	rcu_assign_pointer(pool->index, new);
+	if (old)
+		call_rcu(&old->rcu, destroy_index_rcu);
+}
+
 RCUTAG_USR /* Only because of GFP_KERNEL. Can be easily upgraded to FREE. */
 static struct list_head *alloc_list(void)
 {
@@ -98,6 +233,7 @@ struct addr4_pool *pool_alloc(void)
 	}
 
 	RCU_INIT_POINTER(result->list, list);
+	RCU_INIT_POINTER(result->index, build_index(list));
 	kref_init(&result->refcounter);
 
 	return result;
@@ -113,6 +249,8 @@ static void pool_release(struct kref *refcounter)
 {
 	struct addr4_pool *pool;
 	pool = container_of(refcounter, struct addr4_pool, refcounter);
+	if (rcu_dereference_raw(pool->index))
+		destroy_index(rcu_dereference_raw(pool->index));
 	__destroy(rcu_dereference_raw(pool->list));
 	wkfree(struct addr4_pool, pool);
 }
@@ -178,6 +316,7 @@ int pool_add(struct addr4_pool *pool, struct ipv4_prefix *prefix, bool force)
 
 	list = rcu_dereference_protected(pool->list, lockdep_is_held(&lock));
 	list_add_tail_rcu(&entry->list_hook, list);
+	publish_index(pool);
 
 end:
 	mutex_unlock(&lock);
@@ -218,6 +357,7 @@ int pool_rm(struct addr4_pool *pool, struct ipv4_prefix *prefix)
 		entry = get_entry(node);
 		if (prefix4_equals(prefix, &entry->prefix)) {
 			list_del_rcu(&entry->list_hook);
+			publish_index(pool);
 			mutex_unlock(&lock);
 			synchronize_rcu_bh();
 			wkfree(struct pool_entry, entry);
@@ -243,6 +383,7 @@ int pool_flush(struct addr4_pool *pool)
 	mutex_lock(&lock);
 	old = rcu_dereference_protected(pool->list, lockdep_is_held(&lock));
 	rcu_assign_pointer(pool->list, new);
+	publish_index(pool);
 	mutex_unlock(&lock);
 
 	synchronize_rcu_bh();
@@ -251,15 +392,65 @@ int pool_flush(struct addr4_pool *pool)
 	return 0;
 }
 
+/**
+ * Returns the index of the last slice that starts at or before the @n'th
+ * address of the pool.
+ */
+RCUTAG_PKT
+static unsigned int find_slice(struct pool_index *index, __u64 n)
+{
+	unsigned int lo = 0;
+	unsigned int hi = index->slice_count - 1;
+	unsigned int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (index->slices[mid].preceding <= n)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+RCUTAG_PKT
+static bool index_contains(struct pool_index *index, __u32 addr)
+{
+	unsigned int lo = 0;
+	unsigned int hi = index->range_count;
+	unsigned int mid;
+
+	/* Find the first range that ends at or after @addr. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->ranges[mid].last < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo < index->range_count && index->ranges[lo].first <= addr;
+}
+
 RCUTAG_PKT
 bool pool_contains(struct addr4_pool *pool, struct in_addr *addr)
 {
 	struct list_head *list;
 	struct list_head *node;
 	struct pool_entry *entry;
+	struct pool_index *index;
+	bool result;
 
 	rcu_read_lock_bh();
 
+	index = rcu_dereference_bh(pool->index);
+	if (index) {
+		result = index_contains(index, ntohl(addr->s_addr));
+		rcu_read_unlock_bh();
+		return result;
+	}
+
 	list = rcu_dereference_bh(pool->list);
 	list_for_each_rcu_bh(node, list) {
 		entry = get_entry(node);
@@ -306,9 +497,17 @@ int pool_count(struct addr4_pool *pool, __u64 *result)
 {
 	struct list_head *list;
 	struct list_head *node;
+	struct pool_index *index;
 	__u64 count = 0;
 
 	rcu_read_lock_bh();
+	index = rcu_dereference_bh(pool->index);
+	if (index) {
+		*result = index->addr_count;
+		rcu_read_unlock_bh();
+		return 0;
+	}
+
 	list = rcu_dereference_bh(pool->list);
 	list_for_each_rcu_bh(node, list) {
 		count += prefix4_get_addr_count(&get_entry(node)->prefix);
@@ -319,6 +518,62 @@ int pool_count(struct addr4_pool *pool, __u64 *result)
 	return 0;
 }
 
+/**
+ * Returns in @result the (@n modulo pool_count())'th address of @pool,
+ * counting entries in list order. (Duplicates included.)
+ *
+ * Returns -ESRCH if the pool is empty.
+ */
+RCUTAG_PKT
+int pool_get_nth_addr(struct addr4_pool *pool, __u64 n, struct in_addr *result)
+{
+	struct list_head *list;
+	struct pool_entry *entry;
+	struct pool_index *index;
+	struct pool_slice *slice;
+	__u64 count;
+	__u64 addrs;
+
+	rcu_read_lock_bh();
+
+	index = rcu_dereference_bh(pool->index);
+	if (index) {
+		if (index->addr_count == 0)
+			goto not_found;
+		n %= index->addr_count;
+		slice = &index->slices[find_slice(index, n)];
+		result->s_addr = htonl(ntohl(slice->prefix.address.s_addr)
+				| (__u32)(n - slice->preceding));
+		rcu_read_unlock_bh();
+		return 0;
+	}
+
+	/* Slow path; memory ran out last time the index was built. */
+	count = 0;
+	list = rcu_dereference_bh(pool->list);
+	list_for_each_entry_rcu(entry, list, list_hook)
+		count += prefix4_get_addr_count(&entry->prefix);
+	if (count == 0)
+		goto not_found;
+
+	n %= count;
+	list_for_each_entry_rcu(entry, list, list_hook) {
+		addrs = prefix4_get_addr_count(&entry->prefix);
+		if (n < addrs) {
+			result->s_addr = htonl(ntohl(entry->prefix.address.s_addr)
+					| (__u32)n);
+			rcu_read_unlock_bh();
+			return 0;
+		}
+		n -= addrs;
+	}
+	/* Fall through. */
+
+not_found:
+	rcu_read_unlock_bh();
+	return -ESRCH;
+}
+
 RCUTAG_PKT
 bool pool_is_empty(struct addr4_pool *pool)
 {
@@ -43,63 +43,27 @@ int rfc6791_flush(struct addr4_pool *pool)
 	return pool_flush(pool);
 }
 
-struct foreach_args {
-	unsigned int n;
-	__be32 *result;
-	bool flushed;
-};
-
-static int find_nth_addr(struct ipv4_prefix *prefix, void *void_args)
-{
-	struct foreach_args *args = void_args;
-	unsigned int count;
-
-	args->flushed = false;
-
-	count = prefix4_get_addr_count(prefix);
-	if (count < args->n) {
-		args->n -= count;
-		return 0; /* Keep iterating. */
-	}
-
-	*args->result = htonl(ntohl(prefix->address.s_addr) | args->n);
-	return 1; /* Success. */
-}
-
 /**
  * Returns in "result" the IPv4 address an ICMP error towards "out"'s
  * destination should be sourced with.
+ *
+ * Returns -ESRCH if the pool is empty.
  */
-static int get_rfc6791_address(struct xlation *state, unsigned int count,
-		__be32 *result)
+static int get_rfc6791_address(struct xlation *state, __be32 *result)
 {
-	struct foreach_args args;
-	int done;
+	struct in_addr addr;
+	unsigned int n;
+	int error;
 
 	if (state->jool.global->cfg.siit.randomize_error_addresses)
-		get_random_bytes(&args.n, sizeof(args.n));
+		get_random_bytes(&n, sizeof(n));
 	else
-		args.n = pkt_ip6_hdr(&state->in)->hop_limit;
-	args.n %= count;
-	args.result = result;
-
-	/*
-	 * The list can change between the last loop (the pool_count()) and the
-	 * following one. So use @count and @addr_index only as a hint. That's
-	 * the rationale for the do while true.
-	 * Just ensure @args.n keeps decreasing.
-	 */
-	do {
-		args.flushed = true;
-
-		done = pool_foreach(state->jool.siit.pool6791, find_nth_addr,
-				&args, NULL);
-		if (done)
-			return 0;
+		n = pkt_ip6_hdr(&state->in)->hop_limit;
 
-		if (args.flushed)
-			return -ESRCH;
-	} while (true);
+	error = pool_get_nth_addr(state->jool.siit.pool6791, n, &addr);
+	if (!error)
+		*result = addr.s_addr;
+	return error;
 }
 
 /**
@@ -140,27 +104,15 @@ static int get_host_address(struct xlation *state, __be32 *result)
 
 int rfc6791_find(struct xlation *state, __be32 *result)
 {
-	__u64 count;
-	int error;
-
 	/*
-	 * I'm counting the list elements instead of using an algorithm like
-	 * reservoir sampling (http://stackoverflow.com/questions/54059) because
-	 * the random function can be really expensive. Reservoir sampling
+	 * I'm indexing the pool instead of using an algorithm like reservoir
+	 * sampling (http://stackoverflow.com/questions/54059) because the
+	 * random function can be really expensive. Reservoir sampling
 	 * requires one random per iteration, this way requires one random
 	 * period.
 	 */
-	error = pool_count(state->jool.siit.pool6791, &count);
-	if (error) {
-		log_debug("pool_count failed with errcode %d.", error);
-		return error;
-	}
-
-	if (count != 0) {
-		error = get_rfc6791_address(state, count, result);
-		if (!error)
-			return 0;
-	}
+	if (!get_rfc6791_address(state, result))
+		return 0;
 
 	return get_host_address(state, result);
 }
@@ -0,0 +1,521 @@
+/**
+ * @file
+ * Optional XDP fast path for SIIT.
+ *
+ * Translates the packets that don't need any of the kernel module's
+ * intelligence (plain TCP/UDP, not fragmented, no IPv4 options, no IPv6
+ * extension headers, addresses covered by the EAMT or a /96 pool6 prefix, and
+ * which the module would not leave alone because they are low-scoped or belong
+ * to the host),
+ * and forwards them straight out of the interface the FIB picks. Everything
+ * else (ICMP, fragments, hairpinning, unresolved neighbors, packets which would
+ * need an ICMP error...) is XDP_PASSed untouched, so the module handles it
+ * through the normal path.
+ *
+ * The configuration lives in the maps described in nat64/common/xdp.h, which
+ * are filled by `jool_siit --xdp --update`.
+ *
+ * Build with `make` (needs clang), then attach with
+ *	ip link set dev <interface> xdp obj siit.o sec xdp
+ *
+ * Needs Linux 4.18+ (bpf_fib_lookup()).
+ */
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include "nat64/common/xdp.h"
+
+#define SEC(name) __attribute__((section(name), used))
+#define INLINE static __attribute__((always_inline)) inline
+
+#define AF_INET 2
+#define AF_INET6 10
+
+#define IP_DF 0x4000
+#define IP_MF 0x2000
+#define IP_OFFSET 0x1FFF
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define htons(x) ((__be16)__builtin_bswap16(x))
+#define ntohs(x) __builtin_bswap16(x)
+#define htonl(x) ((__be32)__builtin_bswap32(x))
+#else
+#define htons(x) ((__be16)(x))
+#define ntohs(x) ((__u16)(x))
+#define htonl(x) ((__be32)(x))
+#endif
+
+/* Helpers. */
+static void *(*bpf_map_lookup_elem)(void *map, const void *key)
+		= (void *)BPF_FUNC_map_lookup_elem;
+static int (*bpf_xdp_adjust_head)(struct xdp_md *ctx, int delta)
+		= (void *)BPF_FUNC_xdp_adjust_head;
+static int (*bpf_fib_lookup)(void *ctx, struct bpf_fib_lookup *params,
+		int plen, __u32 flags) = (void *)BPF_FUNC_fib_lookup;
+static int (*bpf_redirect)(int ifindex, int flags)
+		= (void *)BPF_FUNC_redirect;
+static __s64 (*bpf_csum_diff)(void *from, int from_size, void *to,
+		int to_size, int seed) = (void *)BPF_FUNC_csum_diff;
+static __u32 (*bpf_get_prandom_u32)(void)
+		= (void *)BPF_FUNC_get_prandom_u32;
+
+/* iproute2's map definition format. */
+struct bpf_elf_map {
+	__u32 type;
+	__u32 size_key;
+	__u32 size_value;
+	__u32 max_elem;
+	__u32 flags;
+	__u32 id;
+	__u32 pinning;
+	__u32 inner_id;
+	__u32 inner_idx;
+};
+
+#define PIN_GLOBAL_NS 2
+
+struct bpf_elf_map SEC("maps") jool_config = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.size_key = sizeof(__u32),
+	.size_value = sizeof(struct xdp_config),
+	.max_elem = 1,
+	.pinning = PIN_GLOBAL_NS,
+};
+
+struct bpf_elf_map SEC("maps") jool_eamt6 = {
+	.type = BPF_MAP_TYPE_LPM_TRIE,
+	.size_key = sizeof(struct xdp_key6),
+	.size_value = sizeof(struct xdp_eam),
+	.max_elem = XDP_EAMT_MAX,
+	.flags = BPF_F_NO_PREALLOC,
+	.pinning = PIN_GLOBAL_NS,
+};
+
+struct bpf_elf_map SEC("maps") jool_eamt4 = {
+	.type = BPF_MAP_TYPE_LPM_TRIE,
+	.size_key = sizeof(struct xdp_key4),
+	.size_value = sizeof(struct xdp_eam),
+	.max_elem = XDP_EAMT_MAX,
+	.flags = BPF_F_NO_PREALLOC,
+	.pinning = PIN_GLOBAL_NS,
+};
+
+struct bpf_elf_map SEC("maps") jool_blacklist4 = {
+	.type = BPF_MAP_TYPE_LPM_TRIE,
+	.size_key = sizeof(struct xdp_key4),
+	.size_value = sizeof(__u8),
+	.max_elem = XDP_BLACKLIST_MAX,
+	.flags = BPF_F_NO_PREALLOC,
+	.pinning = PIN_GLOBAL_NS,
+};
+
+struct bpf_elf_map SEC("maps") jool_local4 = {
+	.type = BPF_MAP_TYPE_HASH,
+	.size_key = sizeof(__u32),
+	.size_value = sizeof(__u8),
+	.max_elem = XDP_LOCAL4_MAX,
+	.pinning = PIN_GLOBAL_NS,
+};
+
+/** Everything we need to know about a packet before we start writing. */
+struct xlat_args {
+	__u32 saddr[4];
+	__u32 daddr[4];
+	__u16 tot_len;
+	__u8 proto;
+	__u8 ttl;
+	__u8 tos;
+	__s64 csum_diff;
+	struct bpf_fib_lookup fib;
+};
+
+/** Returns @addr, with its first (32 - @suffix_len) bits replaced by @prefix's. */
+INLINE __u32 replace_prefix(__u32 prefix, __u32 addr, __u32 suffix_len)
+{
+	__u32 mask;
+
+	if (suffix_len == 0)
+		return prefix;
+	if (suffix_len >= 32)
+		return addr;
+
+	mask = htonl((1U << suffix_len) - 1);
+	return (prefix & ~mask) | (addr & mask);
+}
+
+INLINE int is_blacklisted(__u32 addr)
+{
+	struct xdp_key4 key = { .prefixlen = 32, .addr = addr };
+	return bpf_map_lookup_elem(&jool_blacklist4, &key) != NULL;
+}
+
+/** Same as the module's addr4_is_scope_subnet(). */
+INLINE int is_scope_subnet(__u32 addr)
+{
+	return (addr & htonl(0xff000000)) == 0 /* 0.0.0.0/8 */
+		|| (addr & htonl(0xff000000)) == htonl(0x7f000000) /* 127/8 */
+		|| (addr & htonl(0xffff0000)) == htonl(0xa9fe0000) /* 169.254/16 */
+		|| (addr & htonl(0xf0000000)) == htonl(0xe0000000) /* 224/4 */
+		|| addr == 0xffffffff;
+}
+
+/** Same as the module's must_not_translate(). */
+INLINE int must_not_translate(__u32 addr)
+{
+	__u32 key = addr;
+
+	if (is_scope_subnet(addr))
+		return 1;
+	return bpf_map_lookup_elem(&jool_local4, &key) != NULL;
+}
+
+/** Same rules as the module: EAMT first, pool6 otherwise. */
+INLINE int addr_6to4(struct xdp_config *cfg, __u32 *addr6, __u32 *addr4)
+{
+	struct xdp_key6 key;
+	struct xdp_eam *eam;
+
+	key.prefixlen = 128;
+	key.addr[0] = addr6[0];
+	key.addr[1] = addr6[1];
+	key.addr[2] = addr6[2];
+	key.addr[3] = addr6[3];
+	eam = bpf_map_lookup_elem(&jool_eamt6, &key);
+	if (eam) {
+		*addr4 = replace_prefix(eam->addr4, addr6[3], eam->suffix_len);
+		return must_not_translate(*addr4) ? -1 : 0;
+	}
+
+	if (!cfg->pool6_set)
+		return -1;
+	if (addr6[0] != cfg->pool6[0] || addr6[1] != cfg->pool6[1]
+			|| addr6[2] != cfg->pool6[2])
+		return -1;
+	if (is_blacklisted(addr6[3]) || must_not_translate(addr6[3]))
+		return -1;
+
+	*addr4 = addr6[3];
+	return 0;
+}
+
+INLINE int addr_4to6(struct xdp_config *cfg, __u32 addr4, __u32 *addr6)
+{
+	struct xdp_key4 key = { .prefixlen = 32, .addr = addr4 };
+	struct xdp_eam *eam;
+
+	if (must_not_translate(addr4))
+		return -1;
+
+	eam = bpf_map_lookup_elem(&jool_eamt4, &key);
+	if (eam) {
+		addr6[0] = eam->addr6[0];
+		addr6[1] = eam->addr6[1];
+		addr6[2] = eam->addr6[2];
+		addr6[3] = replace_prefix(eam->addr6[3], addr4, eam->suffix_len);
+		return 0;
+	}
+
+	if (!cfg->pool6_set || is_blacklisted(addr4))
+		return -1;
+
+	addr6[0] = cfg->pool6[0];
+	addr6[1] = cfg->pool6[1];
+	addr6[2] = cfg->pool6[2];
+	addr6[3] = addr4;
+	return 0;
+}
+
+INLINE int is_eam4(__u32 addr4)
+{
+	struct xdp_key4 key = { .prefixlen = 32, .addr = addr4 };
+	return bpf_map_lookup_elem(&jool_eamt4, &key) != NULL;
+}
+
+INLINE __u16 csum_fold(__u64 csum)
+{
+	csum = (csum & 0xFFFFFFFF) + (csum >> 32);
+	csum = (csum & 0xFFFF) + (csum >> 16);
+	csum = (csum & 0xFFFF) + (csum >> 16);
+	return ~csum;
+}
+
+INLINE __u16 ip4_checksum(struct iphdr *hdr)
+{
+	__u16 *words = (__u16 *)hdr;
+	__u64 csum = 0;
+	int i;
+
+#pragma unroll
+	for (i = 0; i < sizeof(*hdr) >> 1; i++)
+		csum += words[i];
+
+	return csum_fold(csum);
+}
+
+/**
+ * Applies the pseudoheader difference to the transport checksum.
+ * Returns nonzero if the packet got too short under our feet.
+ */
+INLINE int update_l4_csum(void *l4, void *end, __u8 proto, __s64 diff)
+{
+	__u16 *check;
+	__u16 result;
+
+	if (proto == IPPROTO_TCP) {
+		struct tcphdr *tcp = l4;
+		if ((void *)(tcp + 1) > end)
+			return -1;
+		check = &tcp->check;
+	} else {
+		struct udphdr *udp = l4;
+		if ((void *)(udp + 1) > end)
+			return -1;
+		check = &udp->check;
+	}
+
+	result = csum_fold((__u16)~(*check) + (__u64)(__u32)diff);
+	if (proto == IPPROTO_UDP && result == 0)
+		result = 0xFFFF;
+	*check = result;
+	return 0;
+}
+
+/** Returns nonzero if the transport header is not entirely in the packet. */
+INLINE int read_ports(void *l4, void *end, __u8 proto,
+		struct bpf_fib_lookup *fib)
+{
+	if (proto == IPPROTO_TCP) {
+		struct tcphdr *tcp = l4;
+		if ((void *)(tcp + 1) > end)
+			return -1;
+		fib->sport = tcp->source;
+		fib->dport = tcp->dest;
+		return 0;
+	}
+
+	/* UDP */
+	{
+		struct udphdr *udp = l4;
+		if ((void *)(udp + 1) > end)
+			return -1;
+		/* Zero checksum; the module knows what to do with it. */
+		if (udp->check == 0)
+			return -1;
+		fib->sport = udp->source;
+		fib->dport = udp->dest;
+		return 0;
+	}
+}
+
+INLINE int write_eth(struct xdp_md *ctx, struct xlat_args *args, __u16 proto)
+{
+	void *data = (void *)(long)ctx->data;
+	void *end = (void *)(long)ctx->data_end;
+	struct ethhdr *eth = data;
+
+	if ((void *)(eth + 1) > end)
+		return -1;
+
+	__builtin_memcpy(eth->h_dest, args->fib.dmac, ETH_ALEN);
+	__builtin_memcpy(eth->h_source, args->fib.smac, ETH_ALEN);
+	eth->h_proto = htons(proto);
+	return 0;
+}
+
+INLINE int xlat64(struct xdp_md *ctx, struct xdp_config *cfg)
+{
+	void *data = (void *)(long)ctx->data;
+	void *end = (void *)(long)ctx->data_end;
+	struct ipv6hdr *hdr6 = data + sizeof(struct ethhdr);
+	struct iphdr *hdr4;
+	struct xlat_args args = { 0 };
+	__u32 addrs4[2];
+	__u16 payload_len;
+
+	if ((void *)(hdr6 + 1) > end)
+		return XDP_PASS;
+	if (hdr6->version != 6 || hdr6->hop_limit <= 1)
+		return XDP_PASS;
+	if (hdr6->nexthdr != IPPROTO_TCP && hdr6->nexthdr != IPPROTO_UDP)
+		return XDP_PASS;
+	payload_len = ntohs(hdr6->payload_len);
+	if (payload_len == 0 || (void *)(hdr6 + 1) + payload_len > end)
+		return XDP_PASS;
+
+	args.proto = hdr6->nexthdr;
+	if (read_ports(hdr6 + 1, end, args.proto, &args.fib))
+		return XDP_PASS;
+
+	__builtin_memcpy(args.saddr, &hdr6->saddr, 16);
+	__builtin_memcpy(args.daddr, &hdr6->daddr, 16);
+	if (addr_6to4(cfg, args.saddr, &addrs4[0]))
+		return XDP_PASS;
+	if (addr_6to4(cfg, args.daddr, &addrs4[1]))
+		return XDP_PASS;
+	/* Hairpinning. */
+	if (is_eam4(addrs4[1]))
+		return XDP_PASS;
+
+	args.tot_len = sizeof(struct iphdr) + payload_len;
+	args.ttl = hdr6->hop_limit - 1;
+	args.tos = cfg->reset_tos ? cfg->new_tos
+			: ((hdr6->priority << 4) | (hdr6->flow_lbl[0] >> 4));
+	args.csum_diff = bpf_csum_diff(args.saddr, 32, addrs4, 8, 0);
+
+	args.fib.family = AF_INET;
+	args.fib.tos = args.tos;
+	args.fib.l4_protocol = args.proto;
+	args.fib.tot_len = args.tot_len;
+	args.fib.ifindex = ctx->ingress_ifindex;
+	args.fib.ipv4_src = addrs4[0];
+	args.fib.ipv4_dst = addrs4[1];
+	if (bpf_fib_lookup(ctx, &args.fib, sizeof(args.fib), 0)
+			!= BPF_FIB_LKUP_RET_SUCCESS)
+		return XDP_PASS;
+
+	/* Point of no return; the packet is ours from now on. */
+
+	if (bpf_xdp_adjust_head(ctx, (int)sizeof(struct ipv6hdr)
+			- (int)sizeof(struct iphdr)))
+		return XDP_PASS;
+	if (write_eth(ctx, &args, ETH_P_IP))
+		return XDP_DROP;
+
+	data = (void *)(long)ctx->data;
+	end = (void *)(long)ctx->data_end;
+	hdr4 = data + sizeof(struct ethhdr);
+	if ((void *)(hdr4 + 1) > end)
+		return XDP_DROP;
+
+	hdr4->version = 4;
+	hdr4->ihl = 5;
+	hdr4->tos = args.tos;
+	hdr4->tot_len = htons(args.tot_len);
+	hdr4->id = bpf_get_prandom_u32();
+	hdr4->frag_off = (args.tot_len > 1260) ? htons(IP_DF) : 0;
+	hdr4->ttl = args.ttl;
+	hdr4->protocol = args.proto;
+	hdr4->saddr = addrs4[0];
+	hdr4->daddr = addrs4[1];
+	hdr4->check = 0;
+	hdr4->check = ip4_checksum(hdr4);
+
+	if (update_l4_csum(hdr4 + 1, end, args.proto, args.csum_diff))
+		return XDP_DROP;
+
+	return bpf_redirect(args.fib.ifindex, 0);
+}
+
+INLINE int xlat46(struct xdp_md *ctx, struct xdp_config *cfg)
+{
+	void *data = (void *)(long)ctx->data;
+	void *end = (void *)(long)ctx->data_end;
+	struct iphdr *hdr4 = data + sizeof(struct ethhdr);
+	struct ipv6hdr *hdr6;
+	struct xlat_args args = { 0 };
+	__u32 addrs4[2];
+	__u8 tclass;
+
+	if ((void *)(hdr4 + 1) > end)
+		return XDP_PASS;
+	if (hdr4->version != 4 || hdr4->ihl != 5 || hdr4->ttl <= 1)
+		return XDP_PASS;
+	if (hdr4->frag_off & htons(IP_MF | IP_OFFSET))
+		return XDP_PASS;
+	if (hdr4->protocol != IPPROTO_TCP && hdr4->protocol != IPPROTO_UDP)
+		return XDP_PASS;
+	args.tot_len = ntohs(hdr4->tot_len);
+	if (args.tot_len < sizeof(*hdr4) || (void *)hdr4 + args.tot_len > end)
+		return XDP_PASS;
+	/* The kernel would have validated this. */
+	if (ip4_checksum(hdr4) != 0)
+		return XDP_PASS;
+
+	args.proto = hdr4->protocol;
+	if (read_ports(hdr4 + 1, end, args.proto, &args.fib))
+		return XDP_PASS;
+
+	addrs4[0] = hdr4->saddr;
+	addrs4[1] = hdr4->daddr;
+	if (addr_4to6(cfg, addrs4[0], args.saddr))
+		return XDP_PASS;
+	if (addr_4to6(cfg, addrs4[1], args.daddr))
+		return XDP_PASS;
+
+	args.ttl = hdr4->ttl - 1;
+	tclass = cfg->reset_traffic_class ? 0 : hdr4->tos;
+	args.csum_diff = bpf_csum_diff(addrs4, 8, args.saddr, 32, 0);
+
+	args.fib.family = AF_INET6;
+	args.fib.flowinfo = htonl(tclass << 20);
+	args.fib.l4_protocol = args.proto;
+	args.fib.tot_len = args.tot_len - sizeof(struct iphdr)
+			+ sizeof(struct ipv6hdr);
+	args.fib.ifindex = ctx->ingress_ifindex;
+	__builtin_memcpy(args.fib.ipv6_src, args.saddr, 16);
+	__builtin_memcpy(args.fib.ipv6_dst, args.daddr, 16);
+	if (bpf_fib_lookup(ctx, &args.fib, sizeof(args.fib), 0)
+			!= BPF_FIB_LKUP_RET_SUCCESS)
+		return XDP_PASS;
+
+	/* Point of no return. */
+
+	if (bpf_xdp_adjust_head(ctx, (int)sizeof(struct iphdr)
+			- (int)sizeof(struct ipv6hdr)))
+		return XDP_PASS;
+	if (write_eth(ctx, &args, ETH_P_IPV6))
+		return XDP_DROP;
+
+	data = (void *)(long)ctx->data;
+	end = (void *)(long)ctx->data_end;
+	hdr6 = data + sizeof(struct ethhdr);
+	if ((void *)(hdr6 + 1) > end)
+		return XDP_DROP;
+
+	hdr6->version = 6;
+	hdr6->priority = tclass >> 4;
+	hdr6->flow_lbl[0] = (tclass & 0xF) << 4;
+	hdr6->flow_lbl[1] = 0;
+	hdr6->flow_lbl[2] = 0;
+	hdr6->payload_len = htons(args.tot_len - sizeof(struct iphdr));
+	hdr6->nexthdr = args.proto;
+	hdr6->hop_limit = args.ttl;
+	__builtin_memcpy(&hdr6->saddr, args.saddr, 16);
+	__builtin_memcpy(&hdr6->daddr, args.daddr, 16);
+
+	if (update_l4_csum(hdr6 + 1, end, args.proto, args.csum_diff))
+		return XDP_DROP;
+
+	return bpf_redirect(args.fib.ifindex, 0);
+}
+
+SEC("xdp")
+int jool_siit_xdp(struct xdp_md *ctx)
+{
+	void *data = (void *)(long)ctx->data;
+	void *end = (void *)(long)ctx->data_end;
+	struct ethhdr *eth = data;
+	struct xdp_config *cfg;
+	__u32 zero = 0;
+
+	if ((void *)(eth + 1) > end)
+		return XDP_PASS;
+
+	cfg = bpf_map_lookup_elem(&jool_config, &zero);
+	if (!cfg || !cfg->enabled)
+		return XDP_PASS;
+
+	if (eth->h_proto == htons(ETH_P_IPV6))
+		return xlat64(ctx, cfg);
+	if (eth->h_proto == htons(ETH_P_IP))
+		return xlat46(ctx, cfg);
+
+	return XDP_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
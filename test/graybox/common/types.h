@@ -9,6 +9,7 @@ enum graybox_command {
 	COMMAND_SEND,
 	COMMAND_STATS_DISPLAY,
 	COMMAND_STATS_FLUSH,
+	COMMAND_BENCHMARK,
 };
 
 enum graybox_attribute {
@@ -16,11 +17,15 @@ enum graybox_attribute {
 	ATTR_FILENAME = 1,
 	ATTR_PKT,
 	ATTR_EXCEPTIONS,
+	/* Benchmark: nest of ATTR_PKTs, and how many times to inject them. */
+	ATTR_PKTS,
+	ATTR_ITERATIONS,
 
 	/* Response fields */
 	ATTR_ERROR_CODE,
 	ATTR_ERROR_STRING,
 	ATTR_STATS,
+	ATTR_BENCHMARK,
 
 	__ATTR_MAX,
 };
@@ -36,4 +41,28 @@ struct graybox_stats {
 	struct graybox_proto_stats ipv4;
 };
 
+/** Maximum number of different packets a benchmark can inject. */
+#define GRAYBOX_BENCH_MAX_PKTS 32
+
+/** How one of the benchmark's packets fared. */
+struct graybox_bench_pkt {
+	/** Time spent inside the translator, added up. */
+	__u64 nsecs;
+	/** Same as @nsecs, in CPU cycles. */
+	__u64 cycles;
+	/** Times Jool translated (or queued, if it's a fragment) the packet. */
+	__u32 stolen;
+	/** Times Jool returned the packet to the kernel. */
+	__u32 accepted;
+	/** Times Jool dropped the packet. */
+	__u32 dropped;
+};
+
+struct graybox_bench {
+	/** Number of times the whole packet mix was injected. */
+	__u32 iterations;
+	__u32 pkt_count;
+	struct graybox_bench_pkt pkts[GRAYBOX_BENCH_MAX_PKTS];
+};
+
 #endif
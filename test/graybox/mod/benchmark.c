@@ -0,0 +1,164 @@
+#include "benchmark.h"
+
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/netfilter.h>
+#include <linux/sched.h>
+#include <linux/timex.h>
+#include "nat64/common/types.h"
+#include "nat64/mod/common/core.h"
+#include "nat64/mod/common/send_packet.h"
+#include "sender.h"
+#include "util.h"
+
+/*
+ * The benchmark feeds packets straight to Jool's core, skipping Netfilter and
+ * the network. This needs a Jool compiled with `make benchmark`, which exports
+ * the core and can be told to throw away the translated packets.
+ *
+ * The symbols are requested at runtime so the graybox keeps working (minus
+ * the benchmark) along a normal Jool.
+ */
+typedef unsigned int (*core_fn)(struct sk_buff *, const struct net_device *);
+
+struct bench_symbols {
+	core_fn core_4to6;
+	core_fn core_6to4;
+	void (*set_discard)(bool);
+};
+
+static int get_symbols(struct bench_symbols *symbols)
+{
+	symbols->core_4to6 = symbol_get(core_4to6);
+	symbols->core_6to4 = symbol_get(core_6to4);
+	symbols->set_discard = symbol_get(sendpkt_set_discard);
+
+	if (symbols->core_4to6 && symbols->core_6to4 && symbols->set_discard)
+		return 0;
+
+	log_err("Jool is not loaded, or it was not compiled with `make benchmark`.");
+	if (symbols->core_4to6)
+		symbol_put(core_4to6);
+	if (symbols->core_6to4)
+		symbol_put(core_6to4);
+	if (symbols->set_discard)
+		symbol_put(sendpkt_set_discard);
+	return -ENOENT;
+}
+
+static void put_symbols(void)
+{
+	symbol_put(core_4to6);
+	symbol_put(core_6to4);
+	symbol_put(sendpkt_set_discard);
+}
+
+static int inject(struct bench_symbols *symbols, struct net_device *dev,
+		struct bench_pkt *pkt, struct graybox_bench_pkt *result)
+{
+	struct sk_buff *skb;
+	core_fn core;
+	unsigned int verdict;
+	cycles_t cycles;
+	u64 nsecs;
+
+	skb = sender_create_skb(pkt->bytes, pkt->len);
+	if (!skb)
+		return -ENOMEM;
+	skb->dev = dev;
+	core = (get_l3_proto(pkt->bytes) == 6)
+			? symbols->core_6to4
+			: symbols->core_4to6;
+
+	/* Jool's hooks normally run in softirq context. */
+	local_bh_disable();
+	nsecs = local_clock();
+	cycles = get_cycles();
+	verdict = core(skb, dev);
+	result->cycles += get_cycles() - cycles;
+	result->nsecs += local_clock() - nsecs;
+	local_bh_enable();
+
+	switch (verdict) {
+	case NF_STOLEN:
+		result->stolen++;
+		break;
+	case NF_ACCEPT:
+		result->accepted++;
+		kfree_skb(skb);
+		break;
+	default:
+		result->dropped++;
+		kfree_skb(skb);
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * Hands the @pkt_count packets from @pkts to Jool, one after the other,
+ * @iterations times. The instance that translates them is the one from the
+ * caller's namespace. Whatever Jool translates is routed, but not sent.
+ */
+int bench_run(struct bench_pkt *pkts, unsigned int pkt_count,
+		unsigned int iterations, struct graybox_bench *result)
+{
+	struct bench_symbols symbols;
+	struct net *ns;
+	unsigned int i, p;
+	int error;
+
+	for (p = 0; p < pkt_count; p++) {
+		if (pkts[p].len == 0) {
+			log_err("Packet %u is zero bytes long.", p);
+			return -EINVAL;
+		}
+		switch (get_l3_proto(pkts[p].bytes)) {
+		case 4:
+		case 6:
+			break;
+		default:
+			log_err("Packet %u is neither IPv4 nor IPv6.", p);
+			return -EINVAL;
+		}
+	}
+
+	error = get_symbols(&symbols);
+	if (error)
+		return error;
+
+	ns = find_current_namespace();
+	if (!ns) {
+		put_symbols();
+		return -EINVAL;
+	}
+
+	memset(result, 0, sizeof(*result));
+	result->pkt_count = pkt_count;
+
+	symbols.set_discard(true);
+
+	for (i = 0; i < iterations; i++) {
+		for (p = 0; p < pkt_count; p++) {
+			error = inject(&symbols, ns->loopback_dev, &pkts[p],
+					&result->pkts[p]);
+			if (error)
+				goto end;
+		}
+		result->iterations++;
+
+		if (fatal_signal_pending(current)) {
+			log_info("Interrupted after %u iterations.", i + 1);
+			break;
+		}
+		cond_resched();
+	}
+	/* Fall through. */
+
+end:
+	symbols.set_discard(false);
+	put_net(ns);
+	put_symbols();
+	return error;
+}
@@ -0,0 +1,14 @@
+#ifndef _GRAYBOX_MOD_BENCHMARK_H
+#define _GRAYBOX_MOD_BENCHMARK_H
+
+#include "types.h"
+
+struct bench_pkt {
+	void *bytes;
+	size_t len;
+};
+
+int bench_run(struct bench_pkt *pkts, unsigned int pkt_count,
+		unsigned int iterations, struct graybox_bench *result);
+
+#endif
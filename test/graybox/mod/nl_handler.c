@@ -1,6 +1,7 @@
 #include "nl_handler.h"
 
 #include <linux/version.h>
+#include "benchmark.h"
 #include "expecter.h"
 #include "genetlink.h"
 #include "sender.h"
@@ -97,6 +98,58 @@ static int handle_stats_flush(struct genl_info *info)
 	return genl_respond(info, 0);
 }
 
+static int handle_benchmark(struct genl_info *info)
+{
+	struct bench_pkt pkts[GRAYBOX_BENCH_MAX_PKTS];
+	struct graybox_bench *result;
+	struct nlattr *attr;
+	unsigned int count = 0;
+	unsigned int iterations;
+	int rem;
+	int error;
+
+	if (verify_superpriv())
+		return -EPERM;
+
+	if (!info->attrs[ATTR_PKTS]) {
+		log_err("Request lacks packets.");
+		return genl_respond(info, -EINVAL);
+	}
+	if (!info->attrs[ATTR_ITERATIONS]) {
+		log_err("Request lacks an iteration count.");
+		return genl_respond(info, -EINVAL);
+	}
+	iterations = nla_get_u32(info->attrs[ATTR_ITERATIONS]);
+
+	nla_for_each_nested(attr, info->attrs[ATTR_PKTS], rem) {
+		if (count >= GRAYBOX_BENCH_MAX_PKTS) {
+			log_err("The benchmark can only handle %u different packets.",
+					GRAYBOX_BENCH_MAX_PKTS);
+			return genl_respond(info, -EINVAL);
+		}
+		pkts[count].bytes = nla_data(attr);
+		pkts[count].len = nla_len(attr);
+		count++;
+	}
+	if (count == 0) {
+		log_err("The packet nest is empty.");
+		return genl_respond(info, -EINVAL);
+	}
+
+	result = kmalloc(sizeof(*result), GFP_KERNEL);
+	if (!result)
+		return genl_respond(info, -ENOMEM);
+
+	error = bench_run(pkts, count, iterations, result);
+	error = error
+			? genl_respond(info, error)
+			: genl_respond_attr(info, ATTR_BENCHMARK, result,
+					sizeof(*result));
+
+	kfree(result);
+	return error;
+}
+
 static int handle_userspace_msg(struct sk_buff *skb, struct genl_info *info)
 {
 	int error;
@@ -120,6 +173,9 @@ static int handle_userspace_msg(struct sk_buff *skb, struct genl_info *info)
 	case COMMAND_STATS_FLUSH:
 		error = handle_stats_flush(info);
 		break;
+	case COMMAND_BENCHMARK:
+		error = handle_benchmark(info);
+		break;
 	default:
 		log_err("Unknown command code: %d", info->genlhdr->cmd);
 		error_pool_deactivate();
@@ -153,6 +209,10 @@ static struct genl_ops ops[] = {
 		.cmd = COMMAND_STATS_FLUSH,
 		.doit = handle_userspace_msg,
 	},
+	{
+		.cmd = COMMAND_BENCHMARK,
+		.doit = handle_userspace_msg,
+	},
 };
 
 static struct genl_family family = {
@@ -34,7 +34,7 @@ static int net_hdr_size(void *pkt)
 	return -EINVAL;
 }
 
-static struct net *find_current_namespace(void)
+struct net *find_current_namespace(void)
 {
 	struct net *ns;
 
@@ -81,24 +81,17 @@ static struct dst_entry *route_ipv6(struct net *ns, struct sk_buff *skb)
 	return __route6(ns, skb, nexthdr_to_l4proto(iterator.hdr_type));
 }
 
-int sender_send(char *pkt_name, void *pkt, size_t pkt_len)
+/**
+ * Wraps a copy of @pkt (which starts with the layer 3 header) in a new skb.
+ */
+struct sk_buff *sender_create_skb(void *pkt, size_t pkt_len)
 {
-	struct net *ns;
 	struct sk_buff *skb;
-	struct dst_entry *dst;
-	int error;
-
-	log_debug("Sending packet '%s'...", pkt_name);
-
-	if (pkt_len == 0) {
-		log_err("The packet is zero bytes long.");
-		return -EINVAL;
-	}
 
 	skb = alloc_skb(LL_MAX_HEADER + pkt_len, GFP_KERNEL);
 	if (!skb) {
 		log_err("Could not allocate a skb.");
-		return -ENOMEM;
+		return NULL;
 	}
 
 	skb_reserve(skb, LL_MAX_HEADER);
@@ -110,20 +103,48 @@ int sender_send(char *pkt_name, void *pkt, size_t pkt_len)
 
 	memcpy(skb_network_header(skb), pkt, pkt_len);
 
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+	switch (get_l3_proto(pkt)) {
+	case 6:
+		skb->protocol = htons(ETH_P_IPV6);
+		break;
+	case 4:
+		skb->protocol = htons(ETH_P_IP);
+		break;
+	}
+
+	return skb;
+}
+
+int sender_send(char *pkt_name, void *pkt, size_t pkt_len)
+{
+	struct net *ns;
+	struct sk_buff *skb;
+	struct dst_entry *dst;
+	int error;
+
+	log_debug("Sending packet '%s'...", pkt_name);
+
+	if (pkt_len == 0) {
+		log_err("The packet is zero bytes long.");
+		return -EINVAL;
+	}
+
+	skb = sender_create_skb(pkt, pkt_len);
+	if (!skb)
+		return -ENOMEM;
+
 	ns = find_current_namespace();
 	if (!ns) {
 		kfree_skb(skb);
 		return -EINVAL;
 	}
 
-	skb->ip_summed = CHECKSUM_UNNECESSARY;
 	switch (get_l3_proto(pkt)) {
 	case 6:
-		skb->protocol = htons(ETH_P_IPV6);
 		dst = route_ipv6(ns, skb);
 		break;
 	case 4:
-		skb->protocol = htons(ETH_P_IP);
 		dst = route_ipv4(ns, skb);
 		break;
 	default:
@@ -1,8 +1,11 @@
 #ifndef _GRAYBOX_MOD_SENDER_H
 #define _GRAYBOX_MOD_SENDER_H
 
-#include <linux/types.h>
+#include <linux/skbuff.h>
+#include <net/net_namespace.h>
 
+struct net *find_current_namespace(void);
+struct sk_buff *sender_create_skb(void *pkt, size_t pkt_len);
 int sender_send(char *pkt_name, void *pkt, size_t pkt_len);
 
 #endif
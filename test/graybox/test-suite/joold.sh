@@ -0,0 +1,297 @@
+#!/bin/bash
+
+
+# Measures how well joold keeps up: Creates two NAT64 namespaces that
+# synchronize their sessions (through a veth pair, via joold), drives new
+# sessions into the first one, and reports how long the second one took to
+# learn about them, how much did the first one's queue grow, how many
+# sessions never made it, and how much CPU the daemons spent.
+#
+# Does not use the rest of the suite's network, so it needs neither
+# namespace-create.sh nor graybox.
+#
+# Will return nonzero if any session was not synchronized.
+#
+# Environment variables (all of them optional):
+# SESSION_RATE: New sessions per second. Default 1000.
+# DURATION: Seconds the sessions are driven for. Default 10.
+# WORKERS: Parallel senders. Raise it if the achieved rate falls short of
+#     SESSION_RATE. Default 4.
+# SETTLE: Seconds to wait for the second instance to catch up, once the
+#     traffic stops. Default 30.
+# SS_FLAGS: Extra joold configuration, applied to both instances.
+#     eg. "--ss-window=64 --ss-compact=true --ss-flush-asap=false"
+# IN_KERNEL: 1 means the instances exchange sessions themselves (joold's
+#     "in kernel" mode), and the daemons only configure them. Default 0.
+
+
+if [[ $UID != 0 ]]; then
+	echo "Please start the script as root or sudo."
+	exit 1
+fi
+
+SESSION_RATE=${SESSION_RATE:-1000}
+DURATION=${DURATION:-10}
+WORKERS=${WORKERS:-4}
+SETTLE=${SETTLE:-30}
+IN_KERNEL=${IN_KERNEL:-0}
+TMP=`mktemp -d`
+
+NS1=joold1
+NS2=joold2
+CLIENT_V6=ss_client_v6
+CLIENT_V4=ss_client_v4
+XLAT_V6=ss_xlat_v6
+XLAT_V4=ss_xlat_v4
+SYNC1=ss_sync1
+SYNC2=ss_sync2
+SERVER=64:ff9b::192.0.2.5
+
+# Tenths of a second, since the epoch.
+function now {
+	echo $((`date +%s%N` / 100000000))
+}
+
+# $1: Namespace. Prints its number of UDP sessions.
+function session_count {
+	ip netns exec $1 jool --session --count --udp 2> /dev/null \
+		| grep -m 1 "^[0-9]*$"
+}
+
+# $1: Namespace. $2: Line of `jool --joold`, minus the number.
+function joold_field {
+	ip netns exec $1 jool --joold 2> /dev/null | grep "^$2" \
+		| grep -o "[0-9]*$"
+}
+
+# $1: PID. Prints the clock ticks the process has spent on CPU.
+function cpu_ticks {
+	awk '{ print $14 + $15 }' /proc/$1/stat 2> /dev/null || echo 0
+}
+
+# $1: Namespace. $2: Sync interface.
+function setup_joold {
+	ip netns exec $1 jool --instance --add > /dev/null
+	ip netns exec $1 jool --pool6 --add 64:ff9b::/96 > /dev/null
+	ip netns exec $1 jool -4a 192.0.2.2 1024-65535 > /dev/null
+	ip netns exec $1 jool --ss-enabled=true > /dev/null
+	for flag in $SS_FLAGS; do
+		ip netns exec $1 jool $flag > /dev/null || return 1
+	done
+
+	cat > $TMP/$1.json <<-EOF
+	{
+		"multicast address": "ff08::db8:64:64",
+		"multicast port": "6464",
+		"in interface": "$2",
+		"out interface": "$2",
+		"reuseaddr": 1,
+		"in kernel": `[ $IN_KERNEL = 1 ] && echo true || echo false`
+	}
+	EOF
+	ip netns exec $1 joold $TMP/$1.json > $TMP/$1.log 2>&1 &
+	echo $! > $TMP/$1.pid
+}
+
+function create_network {
+	modprobe -rq jool_siit
+	modprobe -rq jool
+	modprobe jool no_instance=1 || return 1
+
+	ip netns add $NS1
+	ip netns add $NS2
+
+	ip link add name $CLIENT_V6 type veth peer name $XLAT_V6
+	ip link add name $CLIENT_V4 type veth peer name $XLAT_V4
+	ip link add name $SYNC1 type veth peer name $SYNC2
+	ip link set dev $XLAT_V6 netns $NS1
+	ip link set dev $XLAT_V4 netns $NS1
+	ip link set dev $SYNC1 netns $NS1
+	ip link set dev $SYNC2 netns $NS2
+
+	ip addr add 2001:db8::5/96 dev $CLIENT_V6
+	ip addr add 192.0.2.5/24 dev $CLIENT_V4
+	ip link set up dev $CLIENT_V6
+	ip link set up dev $CLIENT_V4
+	ip -6 route add 64:ff9b::/96 via 2001:db8::1
+
+	ip netns exec $NS1 ip addr add 2001:db8::1/96 dev $XLAT_V6
+	ip netns exec $NS1 ip addr add 192.0.2.2/24 dev $XLAT_V4
+	ip netns exec $NS1 ip addr add 2001:db8:64::1/64 dev $SYNC1
+	ip netns exec $NS2 ip addr add 2001:db8:64::2/64 dev $SYNC2
+	ip netns exec $NS1 ip link set up dev $XLAT_V6
+	ip netns exec $NS1 ip link set up dev $XLAT_V4
+	ip netns exec $NS1 ip link set up dev $SYNC1
+	ip netns exec $NS2 ip link set up dev $SYNC2
+	ip netns exec $NS1 sysctl -w net.ipv4.conf.all.forwarding=1 > /dev/null
+	ip netns exec $NS1 sysctl -w net.ipv6.conf.all.forwarding=1 > /dev/null
+
+	setup_joold $NS1 $SYNC1 || return 1
+	setup_joold $NS2 $SYNC2 || return 1
+
+	# Let DAD finish and the daemons join the group.
+	sleep 3
+}
+
+function destroy_network {
+	kill `cat $TMP/$NS1.pid $TMP/$NS2.pid 2> /dev/null` 2> /dev/null
+	wait 2> /dev/null
+	ip netns exec $NS1 jool --instance --remove 2> /dev/null
+	ip netns exec $NS2 jool --instance --remove 2> /dev/null
+	ip link del $CLIENT_V6 2> /dev/null
+	ip link del $CLIENT_V4 2> /dev/null
+	ip netns del $NS1
+	ip netns del $NS2
+	modprobe -r jool
+}
+
+# Sends one UDP datagram to a different port of the server per session, $2 of
+# them every tenth of a second, until tenth $3. (Nobody listens, so each one
+# costs a new BIB entry and session, and an ICMP error.)
+# $1: Worker index.
+function sender {
+	local port=$((1024 + $1))
+	local tick=`now`
+	local i
+
+	while [ $tick -lt $3 ]; do
+		for i in `seq 1 $2`; do
+			echo x 2> /dev/null > /dev/udp/$SERVER/$port
+			port=$((port + WORKERS))
+			if [ $port -gt 65535 ]; then
+				port=$((1024 + $1))
+			fi
+		done
+		tick=$((tick + 1))
+		while [ `now` -lt $tick ]; do
+			sleep 0.01
+		done
+	done
+}
+
+# Writes "<tenth>,<NS1 sessions>,<NS2 sessions>,<NS1 queued>,<NS1 in flight>"
+# lines to $TMP/samples.csv until $TMP/stop exists.
+function sampler {
+	while [ ! -e $TMP/stop ]; do
+		echo "`now`,`session_count $NS1`,`session_count $NS2`,`joold_field $NS1 "Sessions queued: "`,`joold_field $NS1 "Messages awaiting ACK: "`" \
+			>> $TMP/samples.csv
+		sleep 0.2
+	done
+}
+
+# Prints, from the samples, how long every count of $NS1 took to show up in
+# $NS2.
+function lag {
+	awk -F, '
+		{ t[NR] = $1; c1[NR] = $2; c2[NR] = $3 }
+		END {
+			j = 1
+			for (i = 1; i <= NR; i++) {
+				if (j < i)
+					j = i
+				while (j <= NR && c2[j] < c1[i])
+					j++
+				if (j > NR) {
+					unreached++
+					continue
+				}
+				l = (t[j] - t[i]) * 100
+				total += l
+				samples++
+				if (l > max)
+					max = l
+			}
+			if (samples)
+				printf "Replication lag: %d ms average, %d ms max", total / samples, max
+			else
+				printf "Replication lag: unknown"
+			if (unreached)
+				printf " (%d samples never caught up)", unreached
+			printf "\n"
+		}' $TMP/samples.csv
+}
+
+function run {
+	local per_tick=$(((SESSION_RATE + 10 * WORKERS - 1) / (10 * WORKERS)))
+	local cpu1_before cpu2_before cpu1 cpu2 ticks
+	local start end settle_end c1 c2 i
+	local result=0
+
+	echo "Driving $SESSION_RATE sessions/s for $DURATION seconds ($WORKERS workers)."
+	echo "SS_FLAGS: $SS_FLAGS"
+	echo "IN_KERNEL: $IN_KERNEL"
+
+	cpu1_before=`cpu_ticks $(cat $TMP/$NS1.pid)`
+	cpu2_before=`cpu_ticks $(cat $TMP/$NS2.pid)`
+	sampler &
+	local sampler_pid=$!
+
+	start=`now`
+	end=$((start + 10 * DURATION))
+	for i in `seq 1 $WORKERS`; do
+		sender $((i - 1)) $per_tick $end &
+	done
+	while [ `now` -lt $end ]; do
+		sleep 0.5
+	done
+	# Whatever is still sending is behind schedule anyway.
+	for i in `jobs -p`; do
+		[ $i != $sampler_pid ] && kill $i 2> /dev/null
+	done
+
+	c1=`session_count $NS1`
+	settle_end=$((`now` + 10 * SETTLE))
+	while [ `now` -lt $settle_end ]; do
+		c2=`session_count $NS2`
+		[ "${c2:-0}" -ge "${c1:-0}" ] && break
+		sleep 0.2
+	done
+	touch $TMP/stop
+	wait $sampler_pid
+
+	c1=`session_count $NS1`
+	c2=`session_count $NS2`
+	cpu1=$((`cpu_ticks $(cat $TMP/$NS1.pid)` - cpu1_before))
+	cpu2=$((`cpu_ticks $(cat $TMP/$NS2.pid)` - cpu2_before))
+	ticks=`getconf CLK_TCK`
+
+	echo "Sessions: $c1 created ($((c1 / DURATION))/s), $c2 synchronized."
+	lag
+	awk -F, '
+		$4 > q { q = $4 }
+		$5 > f { f = $5 }
+		END { printf "Peak joold queue: %d sessions, %d messages awaiting ACK\n", q, f }
+	' $TMP/samples.csv
+	echo "Daemon CPU: $NS1 $((cpu1 * 1000 / ticks)) ms, $NS2 $((cpu2 * 1000 / ticks)) ms"
+	if [ $IN_KERNEL = 1 ]; then
+		echo "(The in-kernel transport's work is done by kworkers; it is not counted.)"
+	fi
+
+	if [ "${c2:-0}" -lt "${c1:-0}" ]; then
+		echo "Dropped sessions: $((c1 - c2))"
+		result=1
+	fi
+	echo "Samples written to $TMP/samples.csv."
+	return $result
+}
+
+
+create_network
+if [ $? -ne 0 ]; then
+	echo "Could not create the network."
+	destroy_network
+	exit 1
+fi
+
+run
+result=$?
+
+destroy_network
+rm -f $TMP/stop
+
+if [ $result -ne 0 ]; then
+	echo "joold did not synchronize every session."
+	exit $result
+fi
+echo "No errors detected."
+exit 0
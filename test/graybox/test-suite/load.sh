@@ -0,0 +1,212 @@
+#!/bin/bash
+
+
+# The companion of run.sh: Instead of checking the translators' correctness, it
+# pushes sustained traffic through them (on the same network), and reports
+# throughput, connections per second and drop counters.
+#
+# Requires iperf3.
+#
+# Will return nonzero if a translator dropped something, or if its throughput
+# fell below the minimum (if one was given).
+#
+# Environment variables (all of them optional):
+# DURATION: Seconds each measurement lasts. Default 10.
+# STREAMS: Parallel flows of the throughput measurements. Default 8.
+# CPS_WORKERS: Parallel connection openers of the CPS measurement. Default 16.
+# MIN_MBPS_SIIT, MIN_MBPS_NAT64: The lowest acceptable TCP throughput (IPv6 to
+#     IPv4, in Mbits/sec) of each translator. Use them to turn this into a
+#     regression gate. Default 0.
+
+
+if [[ $UID != 0 ]]; then
+	echo "Please start the script as root or sudo."
+	exit 1
+fi
+if ! command -v iperf3 > /dev/null; then
+	echo "Please install iperf3."
+	exit 1
+fi
+
+. config
+
+DURATION=${DURATION:-10}
+STREAMS=${STREAMS:-8}
+CPS_WORKERS=${CPS_WORKERS:-16}
+TMP=`mktemp -d`
+
+# The counters that mean the translator threw packets away. (As opposed to
+# the ones that count packets it returned to the kernel, which can be ND and
+# the like.)
+DROP_COUNTERS="JSTAT_MALFORMED|JSTAT_HAIRPIN_LOOP|JSTAT_ICMP6_FILTER|JSTAT_MASK_DOMAIN_NOT_FOUND|JSTAT_POOL4_EXHAUSTED|JSTAT_SUBSCRIBER_LIMIT|JSTAT_ADF|JSTAT_BIB_ERROR|JSTAT_FRAG_TIMEOUT|JSTAT_FRAG_EVICTED|JSTAT_BAD_CHECKSUM|JSTAT_FAILED_ROUTES|JSTAT_PKT_TOO_BIG"
+
+
+# Prints the last "<number> Mbits/sec" of iperf3's output ($1), which is the
+# receiver's total.
+function mbps {
+	grep receiver $1 | tail -1 \
+		| awk '{ for (i = 2; i <= NF; i++) if ($i == "Mbits/sec") print $(i - 1) }'
+}
+
+# Arguments:
+# $1: Destination (IPv6) address.
+# $2: Name of the measurement.
+# $3...: Extra iperf3 arguments.
+# Leaves the result (in Mbits/sec) in $LAST_MBPS.
+function throughput {
+	local dst=$1
+	local name=$2
+	shift 2
+
+	iperf3 -c $dst -t $DURATION -P $STREAMS -f m "$@" > $TMP/iperf.txt
+	if [ $? -ne 0 ]; then
+		echo "$name: iperf3 failed."
+		cat $TMP/iperf.txt
+		return 1
+	fi
+	LAST_MBPS=`mbps $TMP/iperf.txt`
+	echo "$name: $LAST_MBPS Mbits/sec"
+	# UDP also reports lost datagrams.
+	grep receiver $TMP/iperf.txt | tail -1 | grep -o "[0-9]*/[0-9]* ([0-9.e+-]*%)" \
+		| sed "s/^/$name lost datagrams: /"
+}
+
+# Opens TCP connections to $1 port 9 until $2 (a $SECONDS value), and writes the
+# number of round trips to $3.
+# Nobody listens on the port, so each attempt costs a SYN and a RST through the
+# translator, and (in NAT64) a new BIB entry and session. This way the number
+# measures the translator, not some server.
+function cps_worker {
+	local count=0
+	while [ $SECONDS -lt $2 ]; do
+		: 2> /dev/null 3<> /dev/tcp/$1/9
+		count=$((count + 1))
+		if [ $((count % 64)) -eq 0 ]; then
+			echo $count > $3
+		fi
+	done
+	echo $count > $3
+}
+
+function cps {
+	local end=$((SECONDS + DURATION))
+	local total=0
+	local i
+
+	for i in `seq 1 $CPS_WORKERS`; do
+		cps_worker $1 $end $TMP/cps-$i.txt &
+	done
+	# Attempts whose packets were dropped never return; don't wait for them.
+	sleep $((DURATION + 2))
+	kill `jobs -p` 2> /dev/null
+	wait 2> /dev/null
+
+	for i in `seq 1 $CPS_WORKERS`; do
+		total=$((total + `cat $TMP/cps-$i.txt 2> /dev/null || echo 0`))
+	done
+	echo "Connections per second: $((total / DURATION))"
+}
+
+# Prints the counters of translator $1 ("siit" or "nat64") in CSV.
+function counters {
+	if [ $1 = "siit" ]; then
+		ip netns exec $NS jool_siit --stats --csv
+	else
+		ip netns exec $NS jool --stats --csv
+	fi | grep "^JSTAT_" | cut -d, -f1,2
+}
+
+# Prints the counters that grew between the snapshots $1 and $2, and returns
+# nonzero if any of them was a drop.
+function report_counters {
+	local dropped=0
+	local name before after
+
+	while IFS=, read name before; do
+		after=`grep "^$name," $2 | cut -d, -f2`
+		if [ "$after" != "$before" ]; then
+			echo "	$name: +$((after - before))"
+			if echo $name | grep -qE "^($DROP_COUNTERS)$"; then
+				dropped=1
+			fi
+		fi
+	done < $1
+
+	for name in $CLIENT_V6_INTERFACE $CLIENT_V4_INTERFACE; do
+		for before in rx_dropped tx_dropped; do
+			after=`cat /sys/class/net/$name/statistics/$before`
+			if [ "$after" != "0" ]; then
+				echo "	$name $before: $after"
+			fi
+		done
+	done
+
+	return $dropped
+}
+
+# Arguments:
+# $1: Either "siit" or "nat64". (No quotes.)
+# $2: IPv6 address of the IPv4 server, from the client's point of view.
+# $3: IPv4 address of the server. (The server lives in this namespace.)
+# $4: Minimum TCP throughput, in Mbits/sec.
+function run-load {
+	local result=0
+
+	./network-create.sh $1
+	client/wait.sh $2 || return 1
+
+	if [ $1 = "nat64" ]; then
+		# The test suite's 3000 ports are not enough for the CPS test.
+		ip netns exec $NS jool -4a 192.0.2.2 10000-65535 > /dev/null
+	fi
+
+	iperf3 -s -D -B $3 --pidfile $TMP/iperf3.pid
+	sleep 1
+	counters $1 > $TMP/before.txt
+
+	echo "--- $1 ---"
+	throughput $2 "TCP 6->4" || result=1
+	# (Bash can't compare decimals.)
+	if ! awk "BEGIN { exit !(${LAST_MBPS:-0} >= $4) }"; then
+		echo "The throughput is below the minimum ($4 Mbits/sec)."
+		result=1
+	fi
+	throughput $2 "TCP 4->6" -R || result=1
+	throughput $2 "UDP 6->4" -u -b 0 -l 1400 || result=1
+	cps $2
+
+	counters $1 > $TMP/after.txt
+	echo "Counters:"
+	report_counters $TMP/before.txt $TMP/after.txt
+	if [ $? -ne 0 ]; then
+		echo "The $1 translator dropped packets."
+		result=1
+	fi
+
+	kill `cat $TMP/iperf3.pid`
+	./network-destroy.sh $1
+	return $result
+}
+
+
+./namespace-create.sh
+
+run-load siit 2001:db8:1c6:3364:2:: 198.51.100.2 ${MIN_MBPS_SIIT:-0}
+siit_result=$?
+run-load nat64 64:ff9b::192.0.2.5 192.0.2.5 ${MIN_MBPS_NAT64:-0}
+nat64_result=$?
+
+./namespace-destroy.sh
+rm -rf $TMP
+
+
+if [ $siit_result -ne 0 ]; then
+	echo "The SIIT load test failed."
+	exit $siit_result
+fi
+if [ $nat64_result -ne 0 ]; then
+	echo "The NAT64 load test failed."
+	exit $nat64_result
+fi
+echo "No errors detected."
+exit 0
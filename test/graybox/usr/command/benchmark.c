@@ -0,0 +1,122 @@
+#include "benchmark.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <netlink/attr.h>
+#include "common.h"
+#include "nat64/common/types.h"
+#include "nat64/usr/str_utils.h"
+
+int benchmark_init_request(int argc, char **argv, enum graybox_command *cmd,
+		struct benchmark_request *req)
+{
+	unsigned int i;
+	int error;
+
+	if (argc < 2) {
+		log_err("benchmark needs an iteration count and at least one packet file.");
+		return -EINVAL;
+	}
+
+	if (argc - 1 > GRAYBOX_BENCH_MAX_PKTS) {
+		log_err("benchmark can only handle %u packet files.",
+				GRAYBOX_BENCH_MAX_PKTS);
+		return -EINVAL;
+	}
+
+	*cmd = COMMAND_BENCHMARK;
+	error = str_to_u32(argv[0], &req->iterations, 1, MAX_U32);
+	if (error)
+		return error;
+
+	for (i = 1; i < argc; i++) {
+		req->file_names[req->pkt_count] = argv[i];
+		error = load_pkt(argv[i], &req->pkts[req->pkt_count],
+				&req->pkt_lens[req->pkt_count]);
+		if (error)
+			return error;
+		req->pkt_count++;
+	}
+
+	return 0;
+}
+
+void benchmark_clean(struct benchmark_request *req)
+{
+	unsigned int i;
+
+	for (i = 0; i < req->pkt_count; i++)
+		free(req->pkts[i]);
+}
+
+int benchmark_build_pkt(struct benchmark_request *req, struct nl_msg *pkt)
+{
+	struct nlattr *nest;
+	unsigned int i;
+	int error;
+
+	error = nla_put_u32(pkt, ATTR_ITERATIONS, req->iterations);
+	if (error)
+		return error;
+
+	nest = nla_nest_start(pkt, ATTR_PKTS);
+	if (!nest)
+		return -NLE_NOMEM;
+
+	for (i = 0; i < req->pkt_count; i++) {
+		error = nla_put(pkt, ATTR_PKT, req->pkt_lens[i], req->pkts[i]);
+		if (error)
+			return error;
+	}
+
+	return nla_nest_end(pkt, nest);
+}
+
+static void print_row(char *name, unsigned long long count,
+		unsigned long long nsecs, unsigned long long cycles)
+{
+	if (!count) {
+		log_info("%-24s %12llu %12s %12s %12s", name, count,
+				"-", "-", "-");
+		return;
+	}
+
+	log_info("%-24s %12llu %12llu %12llu %12llu", name, count,
+			nsecs ? (count * 1000000000 / nsecs) : 0,
+			nsecs / count, cycles / count);
+}
+
+int benchmark_response_handle(struct nlattr **attrs, void *arg)
+{
+	struct benchmark_request *req = arg;
+	struct graybox_bench *bench;
+	struct graybox_bench_pkt *pkt;
+	unsigned long long count, nsecs = 0, cycles = 0, total = 0;
+	unsigned int i;
+
+	if (!attrs[ATTR_BENCHMARK]) {
+		log_err("The module's response lacks a benchmark structure.");
+		return -EINVAL;
+	}
+
+	bench = nla_data(attrs[ATTR_BENCHMARK]);
+	log_info("Iterations: %u", bench->iterations);
+	log_info("%-24s %12s %12s %12s %12s", "Packet", "Injected", "pps",
+			"ns/pkt", "cycles/pkt");
+
+	for (i = 0; i < bench->pkt_count && i < req->pkt_count; i++) {
+		pkt = &bench->pkts[i];
+		count = (unsigned long long)pkt->stolen + pkt->accepted + pkt->dropped;
+		print_row(req->file_names[i], count, pkt->nsecs, pkt->cycles);
+		if (pkt->accepted || pkt->dropped)
+			log_info("	(returned to the kernel %u times, dropped %u times)",
+					pkt->accepted, pkt->dropped);
+
+		total += count;
+		nsecs += pkt->nsecs;
+		cycles += pkt->cycles;
+	}
+
+	print_row("Total", total, nsecs, cycles);
+	return 0;
+}
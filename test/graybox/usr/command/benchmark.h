@@ -0,0 +1,22 @@
+#ifndef _GRAYBOX_USR_CMD_BENCHMARK_H
+#define _GRAYBOX_USR_CMD_BENCHMARK_H
+
+#include <stddef.h>
+#include <netlink/msg.h>
+#include "types.h"
+
+struct benchmark_request {
+	__u32 iterations;
+	unsigned int pkt_count;
+	char *file_names[GRAYBOX_BENCH_MAX_PKTS];
+	unsigned char *pkts[GRAYBOX_BENCH_MAX_PKTS];
+	size_t pkt_lens[GRAYBOX_BENCH_MAX_PKTS];
+};
+
+int benchmark_init_request(int argc, char **argv, enum graybox_command *cmd,
+		struct benchmark_request *req);
+void benchmark_clean(struct benchmark_request *req);
+int benchmark_build_pkt(struct benchmark_request *req, struct nl_msg *pkt);
+int benchmark_response_handle(struct nlattr **attrs, void *arg);
+
+#endif
@@ -4,6 +4,7 @@
 
 #include "genetlink.h"
 #include "types.h"
+#include "command/benchmark.h"
 #include "command/expect.h"
 #include "command/send.h"
 #include "command/stats.h"
@@ -14,6 +15,7 @@ struct request {
 	union {
 		struct expect_add_request expect_add;
 		struct send_request send;
+		struct benchmark_request benchmark;
 	};
 };
 
@@ -36,6 +38,9 @@ static int request_init(int argc, char **argv, struct request *request)
 		return send_init_request(argc, argv, &request->cmd, &request->send);
 	} else if (strcasecmp(type, "stats") == 0) {
 		return stats_init_request(argc, argv, &request->cmd);
+	} else if (strcasecmp(type, "benchmark") == 0) {
+		return benchmark_init_request(argc, argv, &request->cmd,
+				&request->benchmark);
 	}
 
 	log_err("'%s' is an unknown operation.", type);
@@ -51,6 +56,9 @@ void request_clean(struct request *req)
 	case COMMAND_SEND:
 		send_clean(&req->send);
 		break;
+	case COMMAND_BENCHMARK:
+		benchmark_clean(&req->benchmark);
+		break;
 	case COMMAND_EXPECT_FLUSH:
 	case COMMAND_STATS_DISPLAY:
 	case COMMAND_STATS_FLUSH:
@@ -74,6 +82,9 @@ static int build_packet(struct request *req, struct nl_msg **result)
 	case COMMAND_SEND:
 		error = send_build_pkt(&req->send, msg);
 		break;
+	case COMMAND_BENCHMARK:
+		error = benchmark_build_pkt(&req->benchmark, msg);
+		break;
 	case COMMAND_EXPECT_FLUSH:
 	case COMMAND_STATS_DISPLAY:
 	case COMMAND_STATS_FLUSH:
@@ -100,6 +111,9 @@ static int send_request(struct request *req, struct nl_msg *msg)
 		return nlsocket_send(msg, NULL, NULL);
 	case COMMAND_STATS_DISPLAY:
 		return nlsocket_send(msg, stats_response_handle, NULL);
+	case COMMAND_BENCHMARK:
+		return nlsocket_send(msg, benchmark_response_handle,
+				&req->benchmark);
 	}
 
 	log_err("Unknown command code: %d", req->cmd);
@@ -0,0 +1,488 @@
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+
+#include "nat64/unit/unit_test.h"
+#include "stateful/bib/db.c"
+
+MODULE_LICENSE(JOOL_LICENSE);
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("BIB/session database scaling benchmark.");
+
+static unsigned int SESSIONS = 1000000;
+module_param(SESSIONS, uint, 0);
+MODULE_PARM_DESC(SESSIONS, "Number of sessions to populate the database with. Default 1000000.");
+
+static unsigned int SESSIONS_PER_BIB = 4;
+module_param(SESSIONS_PER_BIB, uint, 0);
+MODULE_PARM_DESC(SESSIONS_PER_BIB, "Sessions that share each BIB entry. Min 1, max 255, default 4.");
+
+static unsigned int OPERATIONS = 1000000;
+module_param(OPERATIONS, uint, 0);
+MODULE_PARM_DESC(OPERATIONS, "Number of lookups and additions measured by each phase. Default 1000000.");
+
+static unsigned int THREADS = 1;
+module_param(THREADS, uint, 0);
+MODULE_PARM_DESC(THREADS, "Number of kthreads (each pinned to a different online CPU) that share each phase's work. Default 1.");
+
+/*
+ * The keys are derived from indexes, so nothing needs to be stored per session.
+ * Session s of BIB entry b is
+ *
+ *	2001:db8::<salt>:<b>#1024  64:ff9b::192.0.<s>.1#80
+ *	203.0.<b / 60000>#<1024 + b % 60000>  192.0.<s>.1#80
+ *
+ * (The addresses don't need to make sense; they only need to be unique.)
+ */
+#define PORTS_PER_ADDR 60000
+
+static unsigned int bib_count;
+/**
+ * If the database is sharded (see bib_shards), each BIB entry's IPv6 address
+ * is tweaked by this much so it lands on the same shard as its IPv4 address.
+ */
+static __u8 *salts;
+static struct bib *db;
+
+static void init_src6(struct ipv6_transport_addr *addr, unsigned int b)
+{
+	addr->l3.s6_addr32[0] = cpu_to_be32(0x20010db8u);
+	addr->l3.s6_addr32[1] = 0;
+	addr->l3.s6_addr32[2] = cpu_to_be32(salts[b]);
+	addr->l3.s6_addr32[3] = cpu_to_be32(b);
+	addr->l4 = 1024;
+}
+
+static void init_src4(struct ipv4_transport_addr *addr, unsigned int b)
+{
+	addr->l3.s_addr = cpu_to_be32(0xcb000000u | (b / PORTS_PER_ADDR));
+	addr->l4 = 1024 + b % PORTS_PER_ADDR;
+}
+
+static void init_dst4(struct ipv4_transport_addr *addr, unsigned int s)
+{
+	addr->l3.s_addr = cpu_to_be32(0xc0000001u | ((s & 0xFFFF) << 8));
+	addr->l4 = 80;
+}
+
+static void init_dst6(struct ipv6_transport_addr *addr, unsigned int s)
+{
+	struct ipv4_transport_addr dst4;
+
+	init_dst4(&dst4, s);
+	addr->l3.s6_addr32[0] = cpu_to_be32(0x0064ff9bu);
+	addr->l3.s6_addr32[1] = 0;
+	addr->l3.s6_addr32[2] = 0;
+	addr->l3.s6_addr32[3] = dst4.l3.s_addr;
+	addr->l4 = dst4.l4;
+}
+
+static void init_tuple6(struct tuple *tuple, unsigned int b, unsigned int s)
+{
+	init_src6(&tuple->src.addr6, b);
+	init_dst6(&tuple->dst.addr6, s);
+	tuple->l3_proto = L3PROTO_IPV6;
+	tuple->l4_proto = L4PROTO_UDP;
+}
+
+static void init_tuple4(struct tuple *tuple, unsigned int b, unsigned int s)
+{
+	init_dst4(&tuple->src.addr4, s);
+	init_src4(&tuple->dst.addr4, b);
+	tuple->l3_proto = L3PROTO_IPV4;
+	tuple->l4_proto = L4PROTO_UDP;
+}
+
+static int compute_salts(void)
+{
+	struct ipv6_transport_addr src6;
+	struct ipv4_transport_addr src4;
+	unsigned int b;
+
+	salts = vzalloc(bib_count);
+	if (!salts)
+		return -ENOMEM;
+	if (db->shard_count == 1)
+		return 0;
+
+	for (b = 0; b < bib_count; b++) {
+		init_src4(&src4, b);
+		do {
+			init_src6(&src6, b);
+			if (shards_match(db, &src6, &src4))
+				break;
+		} while (++salts[b] != 0);
+
+		if (!shards_match(db, &src6, &src4)) {
+			pr_err("Could not find an IPv6 address for BIB entry %u's shard.\n",
+					b);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/* -- Operations -- */
+
+/*
+ * Each one is the @i'th operation of its phase. They return nonzero on
+ * failure.
+ */
+typedef int (*bench_op)(unsigned int i);
+
+/*
+ * Well after SESSIONS_PER_BIB, so the additions don't collide with the
+ * population.
+ */
+#define NEW_SESSION(i) (SESSIONS_PER_BIB + (i) / bib_count)
+/* Spreads the lookups so consecutive operations don't share cache lines. */
+#define SCATTER(i) (((u64)(i) * 2654435761u) % SESSIONS)
+
+static int populate(unsigned int i)
+{
+	struct session_entry session;
+
+	memset(&session, 0, sizeof(session));
+	init_src6(&session.src6, i / SESSIONS_PER_BIB);
+	init_dst6(&session.dst6, i % SESSIONS_PER_BIB);
+	init_src4(&session.src4, i / SESSIONS_PER_BIB);
+	init_dst4(&session.dst4, i % SESSIONS_PER_BIB);
+	session.proto = L4PROTO_UDP;
+	session.state = ESTABLISHED;
+	session.timer_type = SESSION_TIMER_EST;
+	/*
+	 * Already expired, so the clean phase has work to do. Nothing else
+	 * expires sessions, so the other phases don't notice.
+	 */
+	session.update_time = jiffies - db->udp[0].est_timer.timeout - 1;
+	session.has_stored = false;
+
+	return bib_add_session(db, &session, NULL);
+}
+
+static int find6(unsigned int i)
+{
+	struct tuple tuple6;
+	struct bib_session result;
+
+	i = SCATTER(i);
+	init_tuple6(&tuple6, i / SESSIONS_PER_BIB, i % SESSIONS_PER_BIB);
+	bib_session_init(&result);
+	return bib_find(db, &tuple6, &result) || !result.bib_set;
+}
+
+static int find4(unsigned int i)
+{
+	struct tuple tuple4;
+	struct bib_session result;
+
+	i = SCATTER(i);
+	init_tuple4(&tuple4, i / SESSIONS_PER_BIB, i % SESSIONS_PER_BIB);
+	bib_session_init(&result);
+	return bib_find(db, &tuple4, &result) || !result.bib_set;
+}
+
+/*
+ * The additions reuse the existing BIB entries; allocating transport
+ * addresses is pool4's business. (See pool4-iterations.)
+ */
+static int add6(unsigned int i)
+{
+	struct tuple tuple6;
+	struct ipv4_transport_addr dst4;
+	struct bib_session result;
+
+	init_tuple6(&tuple6, i % bib_count, NEW_SESSION(i));
+	init_dst4(&dst4, NEW_SESSION(i));
+	bib_session_init(&result);
+	return bib_add6(db, NULL, &tuple6, &dst4, 0, &result);
+}
+
+static int add4(unsigned int i)
+{
+	struct tuple tuple4;
+	struct ipv6_transport_addr dst6;
+	struct bib_session result;
+
+	/* Past add6()'s sessions. */
+	i += OPERATIONS;
+	init_tuple4(&tuple4, i % bib_count, NEW_SESSION(i));
+	init_dst6(&dst6, NEW_SESSION(i));
+	bib_session_init(&result);
+	return bib_add4(db, &dst6, &tuple4, 0, &result);
+}
+
+/* -- Threads -- */
+
+struct bench_thread {
+	struct task_struct *task;
+	struct completion done;
+	bench_op op;
+	unsigned int first;
+	unsigned int ops;
+	u64 nsecs;
+	unsigned int errors;
+};
+
+static int bench_thread_fn(void *arg)
+{
+	struct bench_thread *thread = arg;
+	unsigned int i;
+	u64 start;
+
+	start = ktime_get_ns();
+	for (i = thread->first; i < thread->ops; i += THREADS) {
+		if (thread->op(i))
+			thread->errors++;
+		if ((i & 0x3FF) == 0)
+			cond_resched();
+	}
+	thread->nsecs = ktime_get_ns() - start;
+
+	complete(&thread->done);
+	return 0;
+}
+
+static void print_lock_stats(void)
+{
+	struct bib_stats_usr stats;
+
+	if (bib_stats(db, L4PROTO_UDP, &stats) || !stats.lock_samples)
+		return;
+
+	pr_info("	lock (1/%u sampled): wait %llu ns avg, %llu max; hold %llu ns avg, %llu max\n",
+			BIB_LOCK_SAMPLING,
+			stats.lock_wait / stats.lock_samples,
+			stats.lock_wait_max,
+			stats.lock_hold / stats.lock_samples,
+			stats.lock_hold_max);
+}
+
+/**
+ * Splits @ops operations among THREADS kthreads (each on its own CPU), and
+ * prints the aggregate throughput.
+ */
+static int run_phase(char *name, bench_op op, unsigned int ops)
+{
+	struct bench_thread *threads;
+	unsigned int t, started, cpu;
+	unsigned int errors = 0;
+	u64 nsecs = 0;
+
+	threads = kcalloc(THREADS, sizeof(*threads), GFP_KERNEL);
+	if (!threads)
+		return -ENOMEM;
+
+	cpu = cpumask_first(cpu_online_mask);
+	for (t = 0; t < THREADS; t++) {
+		threads[t].op = op;
+		threads[t].first = t;
+		threads[t].ops = ops;
+		init_completion(&threads[t].done);
+		threads[t].task = kthread_create(bench_thread_fn, &threads[t],
+				"jool-bench/%u", t);
+		if (IS_ERR(threads[t].task)) {
+			pr_err("Could not create benchmark thread %u.\n", t);
+			break;
+		}
+		kthread_bind(threads[t].task, cpu);
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+
+	/* Start them all at once; otherwise the first ones get a head start. */
+	started = t;
+	for (t = 0; t < started; t++)
+		wake_up_process(threads[t].task);
+	for (t = 0; t < started; t++) {
+		wait_for_completion(&threads[t].done);
+		nsecs = max(nsecs, threads[t].nsecs);
+		errors += threads[t].errors;
+	}
+
+	kfree(threads);
+	if (started != THREADS) {
+		/* Some threads are missing, so the numbers are meaningless. */
+		return -ENOMEM;
+	}
+
+	pr_info("%s: %u operations in %llu ms; %llu ops/s, %llu ns/op (%u errors)\n",
+			name, ops, nsecs / 1000000,
+			nsecs ? ((u64)ops * 1000000000 / nsecs) : 0,
+			ops ? (nsecs * THREADS / ops) : 0, errors);
+	print_lock_stats();
+	return 0;
+}
+
+/* -- Single-threaded phases -- */
+
+static int count_cb(struct session_entry *session, void *arg)
+{
+	(*(u64 *)arg)++;
+	return 0;
+}
+
+static void dump(void)
+{
+	u64 count = 0;
+	struct session_foreach_func func = { .cb = count_cb, .arg = &count, };
+	u64 start, nsecs;
+
+	start = ktime_get_ns();
+	bib_foreach_session(db, L4PROTO_UDP, &func, NULL, NULL);
+	nsecs = ktime_get_ns() - start;
+
+	pr_info("bib_foreach_session: %llu sessions in %llu ms; %llu ns/session\n",
+			count, nsecs / 1000000, count ? (nsecs / count) : 0);
+}
+
+static void print_memory(void)
+{
+	struct bib_stats_usr stats;
+	size_t bib_size, session_size;
+
+	if (bib_stats(db, L4PROTO_UDP, &stats) || !stats.session_count)
+		return;
+
+	bib_size = kmem_cache_size(bib_cache.slab);
+	session_size = kmem_cache_size(session_cache.slab);
+	pr_info("Memory: %llu BIB entries (%zu bytes each), %llu sessions (%zu bytes each); %llu bytes per session.\n",
+			stats.bib_count, bib_size,
+			stats.session_count, session_size,
+			(stats.bib_count * bib_size
+					+ stats.session_count * session_size)
+					/ stats.session_count);
+	pr_info("Tree depth: IPv6 black height %u, IPv4 black height %u.\n",
+			stats.tree6_black_height, stats.tree4_black_height);
+}
+
+/**
+ * Runs the expirer until every session is gone, and prints how long the tables
+ * stayed locked each time.
+ */
+static void clean(void)
+{
+	struct bib_stats_usr stats;
+	unsigned int runs = 0;
+	unsigned int i;
+	u64 start, nsecs, total = 0, max_pause = 0;
+
+	/* Let the first slot's window end. */
+	msleep(jiffies_to_msecs(WHEEL_GRANULARITY) + 10);
+
+	do {
+		for (i = 0; i < db->shard_count; i++) {
+			start = ktime_get_ns();
+			/* The UDP tables have no packet queues to bother with. */
+			clean_table(&db->udp[i],
+					clean_budget ? clean_budget : UINT_MAX);
+			nsecs = ktime_get_ns() - start;
+			total += nsecs;
+			max_pause = max(max_pause, nsecs);
+		}
+		runs++;
+		/* Let the RCU callbacks return the sessions. */
+		cond_resched();
+
+		if (bib_stats(db, L4PROTO_UDP, &stats))
+			return;
+	} while (stats.session_count && runs < 100000);
+
+	pr_info("bib_clean: %u runs for %u sessions in %llu ms; longest table pause %llu us\n",
+			runs, SESSIONS, total / 1000000, max_pause / 1000);
+}
+
+static int run(void)
+{
+	int error;
+
+	pr_info("SESSIONS: %u\n", SESSIONS);
+	pr_info("SESSIONS_PER_BIB: %u\n", SESSIONS_PER_BIB);
+	pr_info("OPERATIONS: %u\n", OPERATIONS);
+	pr_info("THREADS: %u\n", THREADS);
+	pr_info("bib_shards: %u\n", db->shard_count);
+
+	error = run_phase("bib_add_session (populate)", populate, SESSIONS);
+	if (error)
+		return error;
+	print_memory();
+
+	error = run_phase("bib_find (IPv6)", find6, OPERATIONS);
+	if (error)
+		return error;
+	error = run_phase("bib_find (IPv4)", find4, OPERATIONS);
+	if (error)
+		return error;
+	error = run_phase("bib_add6 (new sessions)", add6, OPERATIONS);
+	if (error)
+		return error;
+	error = run_phase("bib_add4 (new sessions)", add4, OPERATIONS);
+	if (error)
+		return error;
+
+	dump();
+	/* add6() and add4()'s sessions are alive, so only the populace dies. */
+	clean();
+	return 0;
+}
+
+/**
+ * This is what happens when the user execs `sudo insmod bib-benchmark.ko`.
+ */
+int init_module(void)
+{
+	int error;
+
+	if (SESSIONS_PER_BIB < 1 || 255 < SESSIONS_PER_BIB) {
+		pr_err("Error: SESSIONS_PER_BIB is out of range (1-255).\n");
+		return -EINVAL;
+	}
+	if (SESSIONS < SESSIONS_PER_BIB) {
+		pr_err("Error: SESSIONS has to be at least SESSIONS_PER_BIB.\n");
+		return -EINVAL;
+	}
+	if (THREADS < 1) {
+		pr_err("Error: THREADS has to be at least 1.\n");
+		return -EINVAL;
+	}
+	bib_count = SESSIONS / SESSIONS_PER_BIB;
+	if (bib_count / PORTS_PER_ADDR > 255) {
+		pr_err("Error: Too many BIB entries; raise SESSIONS_PER_BIB.\n");
+		return -EINVAL;
+	}
+
+	error = bib_setup();
+	if (error)
+		return error;
+	db = bib_alloc(NULL, NULL);
+	if (!db) {
+		error = -ENOMEM;
+		goto teardown;
+	}
+	error = compute_salts();
+	if (error)
+		goto put;
+
+	error = run();
+	/* Fall through. */
+
+put:
+	vfree(salts);
+	bib_put(db);
+teardown:
+	bib_teardown();
+	return error;
+}
+
+/**
+ * This is what happens when the user execs `sudo rmmod bib-benchmark`.
+ */
+void cleanup_module(void)
+{
+	/* No code. */
+}
@@ -0,0 +1,27 @@
+#!/bin/bash
+
+echo "Note: This will take up lots of CPU and memory (about 2 GB per 10 million sessions)."
+echo "If this freezes, please wait a few minutes; it should come back."
+
+CPUS=`nproc`
+
+function test() {
+	echo "Testing $1 sessions, $2 threads, $3 shards."
+	for i in {1..4}; do
+		echo "Test $i"
+		sudo insmod bib-benchmark.ko SESSIONS=$1 THREADS=$2 bib_shards=$3
+		sudo rmmod bib-benchmark
+		sudo dmesg -ct >> results-$1-$2-$3.txt
+	done
+}
+
+rm -f results*
+sudo dmesg -C
+
+for sessions in 1000000 2000000 5000000 10000000; do
+	test $sessions 1 1
+	test $sessions $CPUS 1
+	test $sessions $CPUS $CPUS
+done
+
+echo "Test results written to result*.txt files."
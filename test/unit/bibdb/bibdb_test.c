@@ -155,6 +155,7 @@ static bool test_flow(void)
 	range.ports.min = 0;
 	range.ports.max = 65535;
 	bib_rm_range(db, PROTO, &range);
+	bib_rm_range_wait();
 
 	drop_bib(0, 10, 1, 21);
 	drop_bib(1, 19, 0, 20);
@@ -170,6 +171,7 @@ static bool test_flow(void)
 	range.ports.min = 11;
 	range.ports.max = 20;
 	bib_rm_range(db, PROTO, &range);
+	bib_rm_range_wait();
 
 	drop_bib(2, 18, 3, 20);
 	drop_bib(0, 20, 2, 12);
@@ -183,6 +185,7 @@ static bool test_flow(void)
 	range.ports.min = 0;
 	range.ports.max = 65535;
 	bib_rm_range(db, PROTO, &range);
+	bib_rm_range_wait();
 
 	drop_bib(3, 10, 3, 10);
 	drop_bib(3, 20, 2, 22);
@@ -208,7 +211,7 @@ enum session_fate tcp_est_expire_cb(struct session_entry *session, void *arg)
 
 static int init(void)
 {
-	db = bib_alloc();
+	db = bib_alloc(NULL, NULL);
 	return db ? 0 : -ENOMEM;
 }
 
@@ -76,14 +76,14 @@ static bool test_foreach(void)
 	/* Empty table, no offset. */
 	args.i = 0;
 	args.offset = 0;
-	error = bib_foreach(db, L4PROTO_UDP, &func, NULL);
+	error = bib_foreach(db, L4PROTO_UDP, &func, NULL, NULL);
 	success &= ASSERT_INT(0, error, "call 1 result");
 	success &= ASSERT_UINT(0, args.i, "call 1 counter");
 
 	/* Empty table, offset, offset not found. */
 	args.i = 0;
 	args.offset = 0;
-	error = bib_foreach(db, L4PROTO_UDP, &func, &offset);
+	error = bib_foreach(db, L4PROTO_UDP, &func, &offset, NULL);
 	success &= ASSERT_INT(0, error, "call 3 result");
 	success &= ASSERT_UINT(0, args.i, "call 3 counter");
 
@@ -95,7 +95,7 @@ static bool test_foreach(void)
 	/* Populated table, no offset. */
 	args.i = 0;
 	args.offset = 0;
-	error = bib_foreach(db, L4PROTO_UDP, &func, NULL);
+	error = bib_foreach(db, L4PROTO_UDP, &func, NULL, NULL);
 	success &= ASSERT_INT(0, error, "call 4 result");
 	success &= ASSERT_UINT(5, args.i, "call 4 counter");
 
@@ -103,7 +103,7 @@ static bool test_foreach(void)
 	args.i = 0;
 	args.offset = 3;
 	offset.l4 = 100;
-	error = bib_foreach(db, L4PROTO_UDP, &func, &offset);
+	error = bib_foreach(db, L4PROTO_UDP, &func, &offset, NULL);
 	success &= ASSERT_INT(0, error, "call 7 result");
 	success &= ASSERT_UINT(2, args.i, "call 7 counter");
 
@@ -111,7 +111,7 @@ static bool test_foreach(void)
 	args.i = 0;
 	args.offset = 3;
 	offset.l4 = 125;
-	error = bib_foreach(db, L4PROTO_UDP, &func, &offset);
+	error = bib_foreach(db, L4PROTO_UDP, &func, &offset, NULL);
 	success &= ASSERT_INT(0, error, "call 8 result");
 	success &= ASSERT_UINT(2, args.i, "call 8 counter");
 
@@ -122,7 +122,7 @@ static bool test_foreach(void)
 	args.offset = 0;
 	offset.l3.s_addr = cpu_to_be32(0xc0000201u);
 	offset.l4 = 50;
-	error = bib_foreach(db, L4PROTO_UDP, &func, &offset);
+	error = bib_foreach(db, L4PROTO_UDP, &func, &offset, NULL);
 	success &= ASSERT_INT(0, error, "call 10 result");
 	success &= ASSERT_UINT(5, args.i, "call 10 counter");
 
@@ -130,7 +130,7 @@ static bool test_foreach(void)
 	args.i = 0;
 	args.offset = 1;
 	offset.l4 = 100;
-	error = bib_foreach(db, L4PROTO_UDP, &func, &offset);
+	error = bib_foreach(db, L4PROTO_UDP, &func, &offset, NULL);
 	success &= ASSERT_INT(0, error, "call 12 result");
 	success &= ASSERT_UINT(4, args.i, "call 12 counter");
 
@@ -138,20 +138,172 @@ static bool test_foreach(void)
 	args.i = 0;
 	offset.l3.s_addr = cpu_to_be32(0xc0000203u);
 	offset.l4 = 100;
-	error = bib_foreach(db, L4PROTO_UDP, &func, &offset);
+	error = bib_foreach(db, L4PROTO_UDP, &func, &offset, NULL);
 	success &= ASSERT_INT(0, error, "call 14 result");
 	success &= ASSERT_UINT(0, args.i, "call 14 counter");
 
 	/* Offset is after last, do not include offset. */
 	args.i = 0;
 	offset.l4 = 150;
-	error = bib_foreach(db, L4PROTO_UDP, &func, &offset);
+	error = bib_foreach(db, L4PROTO_UDP, &func, &offset, NULL);
 	success &= ASSERT_INT(0, error, "call 16 result");
 	success &= ASSERT_UINT(0, args.i, "call 16 counter");
 
 	return success;
 }
 
+static bool test_foreach_filter(void)
+{
+	struct bib_filter filter;
+	struct unit_iteration_args args;
+	struct bib_foreach_func func = { .cb = cb, .arg = &args, };
+	int error;
+	bool success = true;
+
+	if (!insert_test_bibs())
+		return false;
+
+	memset(&filter, 0, sizeof(filter));
+
+	/* One address, part of its ports. */
+	filter.flags = BIB_FILTER_SRC4;
+	filter.src4.prefix.address.s_addr = cpu_to_be32(0xc0000202u);
+	filter.src4.prefix.len = 32;
+	filter.src4.ports.min = 50;
+	filter.src4.ports.max = 100;
+	args.i = 0;
+	args.offset = 1;
+	error = bib_foreach(db, L4PROTO_UDP, &func, NULL, &filter);
+	success &= ASSERT_INT(0, error, "src4 result");
+	success &= ASSERT_UINT(2, args.i, "src4 counter");
+
+	/* The port gap of the last address has to be jumped over. */
+	filter.src4.prefix.len = 31;
+	filter.src4.ports.min = 150;
+	filter.src4.ports.max = 65535;
+	args.i = 0;
+	args.offset = 3;
+	error = bib_foreach(db, L4PROTO_UDP, &func, NULL, &filter);
+	success &= ASSERT_INT(0, error, "gap result");
+	success &= ASSERT_UINT(1, args.i, "gap counter");
+
+	/* IPv6 prefix. */
+	filter.flags = BIB_FILTER_SRC6;
+	success &= ASSERT_INT(0, str_to_addr6("2001:db8::3",
+			&filter.src6.address), "src6 address");
+	filter.src6.len = 128;
+	args.i = 0;
+	args.offset = 4;
+	error = bib_foreach(db, L4PROTO_UDP, &func, NULL, &filter);
+	success &= ASSERT_INT(0, error, "src6 result");
+	success &= ASSERT_UINT(1, args.i, "src6 counter");
+
+	/* Prefixes with suffixes are rejected. */
+	filter.flags = BIB_FILTER_SRC4;
+	filter.src4.prefix.len = 24;
+	success &= ASSERT_INT(-EINVAL, bib_foreach(db, L4PROTO_UDP, &func,
+			NULL, &filter), "suffix result");
+
+	return success;
+}
+
+static bool init_bulk_entry(struct bib_bulk_entry *entry, char *addr6,
+		u16 port6, char *addr4, u16 port4)
+{
+	entry->addr6.l4 = port6;
+	entry->addr4.l4 = port4;
+	return !str_to_addr6(addr6, &entry->addr6.l3)
+			&& !str_to_addr4(addr4, &entry->addr4.l3);
+}
+
+static bool test_bulk(void)
+{
+	struct bib_bulk_entry entries[4];
+	int errors[4] = { 0 };
+	__u64 count;
+	bool success = true;
+
+	if (!init_bulk_entry(&entries[0], "2001:db8::1", 1, "192.0.2.1", 1))
+		return false;
+	if (!init_bulk_entry(&entries[1], "2001:db8::2", 2, "192.0.2.1", 2))
+		return false;
+	/* Same as the first one; fine. */
+	entries[2] = entries[0];
+	/* Collides with the second one's IPv4 address. */
+	if (!init_bulk_entry(&entries[3], "2001:db8::3", 3, "192.0.2.1", 2))
+		return false;
+
+	success &= ASSERT_INT(0, bib_add_static_bulk(db, L4PROTO_UDP, entries,
+			4, errors), "add result");
+	success &= ASSERT_INT(0, errors[0], "add 0");
+	success &= ASSERT_INT(0, errors[1], "add 1");
+	success &= ASSERT_INT(0, errors[2], "add 2");
+	success &= ASSERT_INT(-EEXIST, errors[3], "add 3");
+	success &= ASSERT_INT(0, bib_count(db, L4PROTO_UDP, &count), "count");
+	success &= ASSERT_U64(2, count, "count after add");
+
+	memset(errors, 0, sizeof(errors));
+	success &= ASSERT_INT(0, bib_rm_bulk(db, L4PROTO_UDP, entries, 4,
+			errors), "rm result");
+	success &= ASSERT_INT(0, errors[0], "rm 0");
+	success &= ASSERT_INT(0, errors[1], "rm 1");
+	success &= ASSERT_INT(-ESRCH, errors[2], "rm 2");
+	success &= ASSERT_INT(-ESRCH, errors[3], "rm 3");
+	success &= ASSERT_INT(0, bib_count(db, L4PROTO_UDP, &count), "count");
+	success &= ASSERT_U64(0, count, "count after rm");
+
+	return success;
+}
+
+/**
+ * The packet path finds the static entries through their own index. Make sure
+ * the index follows the entries around.
+ */
+static bool test_static_index(void)
+{
+	struct ipv6_transport_addr dst6;
+	struct tuple tuple4;
+	struct bib_session result;
+	bool success = true;
+
+	if (!insert_test_bibs())
+		return false;
+
+	memset(&tuple4, 0, sizeof(tuple4));
+	tuple4.dst.addr4 = entries[2].ipv4;
+	if (str_to_addr4("203.0.113.1", &tuple4.src.addr4.l3))
+		return false;
+	tuple4.src.addr4.l4 = 5000;
+	tuple4.l3_proto = L3PROTO_IPV4;
+	tuple4.l4_proto = L4PROTO_UDP;
+	if (str_to_addr6("64:ff9b::cb00:7101", &dst6.l3))
+		return false;
+	dst6.l4 = 5000;
+
+	success &= ASSERT_INT(0, bib_add4(db, &dst6, &tuple4, 0, &result),
+			"inbound to static");
+	success &= ASSERT_BOOL(true, result.bib_set, "BIB found");
+	success &= ASSERT_TADDR4(&entries[2].ipv4, &result.session.src4,
+			"BIB's src4");
+	success &= __ASSERT_ADDR6(&entries[2].ipv6.l3, &result.session.src6.l3,
+			"BIB's src6");
+
+	success &= ASSERT_INT(0, bib_rm(db, &entries[2]), "rm");
+	success &= ASSERT_INT(-ESRCH, bib_add4(db, &dst6, &tuple4, 0, &result),
+			"inbound to removed");
+
+	success &= ASSERT_INT(0, bib_add_static(db, &entries[2], NULL),
+			"re-add");
+	success &= ASSERT_INT(0, bib_add4(db, &dst6, &tuple4, 0, &result),
+			"inbound to re-added");
+
+	bib_flush(db);
+	success &= ASSERT_INT(-ESRCH, bib_add4(db, &dst6, &tuple4, 0, &result),
+			"inbound after flush");
+
+	return success;
+}
+
 enum session_fate tcp_est_expire_cb(struct session_entry *session, void *arg)
 {
 	return FATE_RM;
@@ -159,7 +311,7 @@ enum session_fate tcp_est_expire_cb(struct session_entry *session, void *arg)
 
 static int init(void)
 {
-	db = bib_alloc();
+	db = bib_alloc(NULL, NULL);
 	return db ? 0 : -ENOMEM;
 }
 
@@ -182,6 +334,9 @@ int init_module(void)
 		return -EINVAL;
 
 	test_group_test(&test, test_foreach, "Foreach");
+	test_group_test(&test, test_foreach_filter, "Filtered foreach");
+	test_group_test(&test, test_bulk, "Bulk add and remove");
+	test_group_test(&test, test_static_index, "Static index");
 
 	return test_group_end(&test);
 }
@@ -0,0 +1,386 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+
+#include "nat64/unit/unit_test.h"
+#include "stateless/eam.c"
+/* Not linked, so mtrie's vmalloc()ed bytes can be read. */
+#include "common/mtrie.c"
+
+MODULE_LICENSE(JOOL_LICENSE);
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("EAMT lookup and insertion benchmark.");
+
+static unsigned int ENTRIES = 100000;
+module_param(ENTRIES, uint, 0);
+MODULE_PARM_DESC(ENTRIES, "Number of EAMT entries. Min 1, max 16777216, default 100000.");
+
+static bool CLUSTERED;
+module_param(CLUSTERED, bool, 0);
+MODULE_PARM_DESC(CLUSTERED, "Make the entries consecutive, instead of scattered all over the address space. Default false.");
+
+static bool BULK;
+module_param(BULK, bool, 0);
+MODULE_PARM_DESC(BULK, "Insert the entries with a single eamt_add_bulk() instead of one eamt_add() each. Default false.");
+
+static unsigned int LOOKUPS = 1000000;
+module_param(LOOKUPS, uint, 0);
+MODULE_PARM_DESC(LOOKUPS, "Number of translations measured by each phase. Default 1000000.");
+
+/*
+ * Entry e is
+ *
+ *	<v6(e)>/120  <v4(e)>/24
+ *
+ * and translation t queries suffix t % 256 of entry SCATTER(t). The clustered
+ * entries are
+ *
+ *	2001:db8::<e>00/120  64.<e>.0/24
+ *
+ * The scattered ones spread the same bits over the rest of the address
+ * (IPv4's first three bytes, IPv6's third and fourth words), so the tries
+ * branch out as early as they can.
+ */
+#define SUFFIX_BITS 8
+#define MAX_ENTRIES (1u << (32 - SUFFIX_BITS))
+/* Odd, so multiplying by it is a permutation of any power of two. */
+#define GOLDEN 2654435761u
+/* Spreads the lookups so consecutive operations don't share cache lines. */
+#define SCATTER(i) ((unsigned int)(((u64)(i) * GOLDEN) % ENTRIES))
+
+static struct eam_table *eamt;
+
+static __u32 entry_bits(unsigned int e)
+{
+	return (CLUSTERED ? e : (e * GOLDEN)) & (MAX_ENTRIES - 1);
+}
+
+static void init_prefix4(struct ipv4_prefix *prefix, unsigned int e)
+{
+	__u32 bits = entry_bits(e);
+
+	/* 64.0.0.0 onwards; wraps around rather than collide. */
+	if (CLUSTERED)
+		bits = (bits + 0x400000u) & (MAX_ENTRIES - 1);
+	prefix->address.s_addr = cpu_to_be32(bits << SUFFIX_BITS);
+	prefix->len = 32 - SUFFIX_BITS;
+}
+
+static void init_prefix6(struct ipv6_prefix *prefix, unsigned int e)
+{
+	__u32 bits = entry_bits(e);
+
+	prefix->address.s6_addr32[0] = cpu_to_be32(0x20010db8u);
+	prefix->address.s6_addr32[1] = 0;
+	if (CLUSTERED) {
+		prefix->address.s6_addr32[2] = 0;
+		prefix->address.s6_addr32[3] = cpu_to_be32(bits << SUFFIX_BITS);
+	} else {
+		prefix->address.s6_addr32[2] = cpu_to_be32(bits);
+		prefix->address.s6_addr32[3] = cpu_to_be32(e << SUFFIX_BITS);
+	}
+	prefix->len = 128 - SUFFIX_BITS;
+}
+
+static void init_addr4(struct in_addr *addr, unsigned int t)
+{
+	struct ipv4_prefix prefix;
+
+	init_prefix4(&prefix, SCATTER(t));
+	addr->s_addr = prefix.address.s_addr | cpu_to_be32(t & 0xFF);
+}
+
+static void init_addr6(struct in6_addr *addr, unsigned int t)
+{
+	struct ipv6_prefix prefix;
+
+	init_prefix6(&prefix, SCATTER(t));
+	*addr = prefix.address;
+	addr->s6_addr32[3] |= cpu_to_be32(t & 0xFF);
+}
+
+/* -- Insertion -- */
+
+static int insert_one_by_one(void)
+{
+	struct ipv6_prefix prefix6;
+	struct ipv4_prefix prefix4;
+	unsigned int e;
+	int error;
+
+	for (e = 0; e < ENTRIES; e++) {
+		init_prefix6(&prefix6, e);
+		init_prefix4(&prefix4, e);
+		error = eamt_add(eamt, &prefix6, &prefix4, false);
+		if (error) {
+			pr_err("eamt_add() of entry %u failed: %d\n", e, error);
+			return error;
+		}
+		if ((e & 0x3FF) == 0)
+			cond_resched();
+	}
+
+	return 0;
+}
+
+static int insert_bulk(void)
+{
+	struct eamt_entry *entries;
+	unsigned int e;
+	int error;
+
+	entries = vmalloc(ENTRIES * sizeof(*entries));
+	if (!entries)
+		return -ENOMEM;
+
+	for (e = 0; e < ENTRIES; e++) {
+		init_prefix6(&entries[e].prefix6, e);
+		init_prefix4(&entries[e].prefix4, e);
+	}
+
+	error = eamt_add_bulk(eamt, entries, ENTRIES, false);
+	if (error)
+		pr_err("eamt_add_bulk() failed: %d\n", error);
+
+	vfree(entries);
+	return error;
+}
+
+static int insert(void)
+{
+	u64 start, nsecs;
+	int error;
+
+	start = ktime_get_ns();
+	error = BULK ? insert_bulk() : insert_one_by_one();
+	nsecs = ktime_get_ns() - start;
+	if (error)
+		return error;
+
+	pr_info("%s: %u entries in %llu ms; %llu ns/entry\n",
+			BULK ? "eamt_add_bulk" : "eamt_add",
+			ENTRIES, nsecs / 1000000, nsecs / ENTRIES);
+	return 0;
+}
+
+/* -- Lookups -- */
+
+/*
+ * Each one is the @t'th operation of its phase. They return nonzero on
+ * failure (including wrong translations).
+ */
+typedef int (*bench_op)(unsigned int t);
+
+static int xlat6(unsigned int t)
+{
+	struct in6_addr addr6;
+	struct in_addr result, expected;
+
+	init_addr6(&addr6, t);
+	init_addr4(&expected, t);
+	if (eamt_xlat_6to4(eamt, &addr6, &result, 0))
+		return 1;
+	return result.s_addr != expected.s_addr;
+}
+
+static int xlat4(unsigned int t)
+{
+	struct in_addr addr4;
+	struct in6_addr result, expected;
+
+	init_addr4(&addr4, t);
+	init_addr6(&expected, t);
+	if (eamt_xlat_4to6(eamt, &addr4, &result, 0))
+		return 1;
+	return !ipv6_addr_equal(&result, &expected);
+}
+
+/*
+ * These skip the per-CPU caches, so they measure the trie alone. (The caches
+ * only hold 256 translations, so most of the xlat*()s miss them anyway.)
+ */
+
+static int raw6(unsigned int t)
+{
+	struct in6_addr addr6;
+	struct in_addr result, expected;
+	struct eam_counters *counters;
+	int error;
+
+	init_addr6(&addr6, t);
+	init_addr4(&expected, t);
+	rcu_read_lock_bh();
+	error = __xlat_6to4(eamt, &addr6, &result, &counters);
+	rcu_read_unlock_bh();
+	return error || result.s_addr != expected.s_addr;
+}
+
+static int raw4(unsigned int t)
+{
+	struct in_addr addr4;
+	struct in6_addr result, expected;
+	struct eam_counters *counters;
+	int error;
+
+	init_addr4(&addr4, t);
+	init_addr6(&expected, t);
+	rcu_read_lock_bh();
+	error = __xlat_4to6(eamt, &addr4, &result, &counters);
+	rcu_read_unlock_bh();
+	return error || !ipv6_addr_equal(&result, &expected);
+}
+
+static void run_phase(char *backend, char *name, bench_op op)
+{
+	unsigned int t;
+	unsigned int errors = 0;
+	u64 start, nsecs;
+
+	start = ktime_get_ns();
+	for (t = 0; t < LOOKUPS; t++) {
+		if (op(t))
+			errors++;
+		if ((t & 0x3FF) == 0)
+			cond_resched();
+	}
+	nsecs = ktime_get_ns() - start;
+
+	pr_info("%s %s: %u lookups in %llu ms; %llu lookups/s, %llu ns/lookup (%u errors)\n",
+			backend, name, LOOKUPS, nsecs / 1000000,
+			nsecs ? ((u64)LOOKUPS * 1000000000 / nsecs) : 0,
+			LOOKUPS ? (nsecs / LOOKUPS) : 0, errors);
+}
+
+static void run_phases(char *backend)
+{
+	run_phase(backend, "eamt_xlat_6to4", xlat6);
+	run_phase(backend, "eamt_xlat_4to6", xlat4);
+	run_phase(backend, "trie only (6to4)", raw6);
+	run_phase(backend, "trie only (4to6)", raw4);
+}
+
+/* -- Memory -- */
+
+static size_t rtrie_bytes(struct rtrie *trie)
+{
+	struct list_head *node;
+	size_t chunks = 0;
+
+	list_for_each(node, &trie->chunks)
+		chunks++;
+
+	/* See chunk_size(); the nodes are way smaller than a page. */
+	return chunks * max_t(size_t, PAGE_SIZE, trie->node_size);
+}
+
+static void print_rtrie_memory(void)
+{
+	size_t bytes;
+
+	bytes = rtrie_bytes(&eamt->trie6) + rtrie_bytes(&eamt->trie4);
+	pr_info("rtrie memory: %zu bytes; %zu bytes per entry (both tries).\n",
+			bytes, bytes / ENTRIES);
+}
+
+static void print_mtrie_memory(void)
+{
+	struct mtrie *index6 = deref_index(eamt, index6);
+	struct mtrie *index4 = deref_index(eamt, index4);
+
+	pr_info("mtrie memory: %zu bytes; %zu bytes per entry (both indexes). Nodes: %u (IPv6), %u (IPv4).\n",
+			index6->vmalloc_bytes + index4->vmalloc_bytes,
+			(index6->vmalloc_bytes + index4->vmalloc_bytes) / ENTRIES,
+			index6->node_count, index4->node_count);
+}
+
+/* -- Backends -- */
+
+/**
+ * Drops the indexes and prevents them from coming back, so the lookups have to
+ * query the rtries.
+ */
+static void use_rtrie(void)
+{
+	mutex_lock(&lock);
+	invalidate_indexes(eamt);
+	mutex_unlock(&lock);
+	cancel_delayed_work_sync(&eamt->rebuild_work);
+}
+
+/**
+ * Builds the indexes right away, instead of waiting for the rebuild work.
+ * Returns false if they could not be built.
+ */
+static bool use_mtrie(void)
+{
+	u64 start, nsecs;
+	bool success;
+
+	mutex_lock(&lock);
+	start = ktime_get_ns();
+	rebuild_indexes(eamt);
+	nsecs = ktime_get_ns() - start;
+	success = deref_index(eamt, index6) && deref_index(eamt, index4);
+	if (success)
+		print_mtrie_memory();
+	mutex_unlock(&lock);
+
+	pr_info("mtrie build: %llu ms; %llu ns/entry\n", nsecs / 1000000,
+			nsecs / ENTRIES);
+	return success;
+}
+
+static int run(void)
+{
+	int error;
+
+	pr_info("ENTRIES: %u\n", ENTRIES);
+	pr_info("CLUSTERED: %u\n", CLUSTERED);
+	pr_info("BULK: %u\n", BULK);
+	pr_info("LOOKUPS: %u\n", LOOKUPS);
+
+	error = insert();
+	if (error)
+		return error;
+
+	use_rtrie();
+	print_rtrie_memory();
+	run_phases("rtrie");
+
+	if (!use_mtrie()) {
+		pr_info("The mtrie could not be built (too many nodes, or out of memory); skipping it.\n");
+		return 0;
+	}
+	run_phases("mtrie");
+	return 0;
+}
+
+/**
+ * This is what happens when the user execs `sudo insmod eamt-benchmark.ko`.
+ */
+int init_module(void)
+{
+	int error;
+
+	if (ENTRIES < 1 || MAX_ENTRIES < ENTRIES) {
+		pr_err("Error: ENTRIES is out of range (1-%u).\n", MAX_ENTRIES);
+		return -EINVAL;
+	}
+
+	eamt = eamt_alloc();
+	if (!eamt)
+		return -ENOMEM;
+
+	error = run();
+
+	eamt_put(eamt);
+	return error;
+}
+
+/**
+ * This is what happens when the user execs `sudo rmmod eamt-benchmark`.
+ */
+void cleanup_module(void)
+{
+	/* No code. */
+}
@@ -0,0 +1,25 @@
+#!/bin/bash
+
+echo "Note: This will take up lots of CPU."
+echo "If this freezes, please wait a few minutes; it should come back."
+
+function test() {
+	echo "Testing $1 entries, clustered: $2, bulk: $3."
+	for i in {1..4}; do
+		echo "Test $i"
+		sudo insmod eamt-benchmark.ko ENTRIES=$1 CLUSTERED=$2 BULK=$3
+		sudo rmmod eamt-benchmark
+		sudo dmesg -ct >> results-$1-$2-$3.txt
+	done
+}
+
+rm -f results*
+sudo dmesg -C
+
+for entries in 10000 100000 1000000; do
+	test $entries 0 0
+	test $entries 1 0
+	test $entries 0 1
+done
+
+echo "Test results written to result*.txt files."
@@ -104,10 +104,10 @@ static bool test_6to4(char *addr6_str, char *addr4_str)
 		return false;
 
 	if (addr4_str) {
-		success &= ASSERT_INT(0, eamt_xlat_6to4(eamt, &addr6, &addr4), "errcode");
+		success &= ASSERT_INT(0, eamt_xlat_6to4(eamt, &addr6, &addr4, 0), "errcode");
 		success &= ASSERT_ADDR4(addr4_str, &addr4, "resulting address");
 	} else {
-		success &= ASSERT_INT(-ESRCH, eamt_xlat_6to4(eamt, &addr6, &addr4), "errcode");
+		success &= ASSERT_INT(-ESRCH, eamt_xlat_6to4(eamt, &addr6, &addr4, 0), "errcode");
 	}
 
 	return success;
@@ -125,10 +125,10 @@ static bool test_4to6(char *addr4_str, char *addr6_str)
 		return false;
 
 	if (addr6_str) {
-		success &= ASSERT_INT(0, eamt_xlat_4to6(eamt, &addr4, &addr6), "errcode");
+		success &= ASSERT_INT(0, eamt_xlat_4to6(eamt, &addr4, &addr6, 0), "errcode");
 		success &= ASSERT_ADDR6(addr6_str, &addr6, "resulting address");
 	} else {
-		success &= ASSERT_INT(-ESRCH, eamt_xlat_4to6(eamt, &addr4, &addr6), "errcode");
+		success &= ASSERT_INT(-ESRCH, eamt_xlat_4to6(eamt, &addr4, &addr6, 0), "errcode");
 	}
 
 	return success;
@@ -225,6 +225,87 @@ static bool rfc7757_identical_test(void)
 	return success;
 }
 
+/**
+ * Same as the RFC 7757 tests, except through the multibit trie indexes.
+ */
+static bool index_test(void)
+{
+	bool success = true;
+
+	success &= add_entry("192.0.2.1", 32, "2001:db8:aaaa::", 128);
+	success &= add_entry("192.0.2.16", 28, "2001:db8:cccc::", 124);
+	success &= add_entry("192.0.2.128", 26, "2001:db8:dddd::", 64);
+	success &= add_entry("192.0.2.192", 29, "2001:db8:eeee:8::", 62);
+	success &= add_entry("0.0.0.0", 0, "2001:db8:ff00::", 40);
+	success &= add_entry("198.51.100.64", 32, "2001:db8::abcd", 128);
+	if (!success)
+		return false;
+
+	mutex_lock(&lock);
+	rebuild_indexes(eamt);
+	success &= ASSERT_BOOL(true, !!rcu_access_pointer(eamt->index6), "index6");
+	success &= ASSERT_BOOL(true, !!rcu_access_pointer(eamt->index4), "index4");
+	mutex_unlock(&lock);
+	if (!success)
+		return false;
+
+	success &= test("192.0.2.1", "2001:db8:aaaa::");
+	success &= test("192.0.2.24", "2001:db8:cccc::8");
+	success &= test("192.0.2.152", "2001:db8:dddd:0:6000::");
+	success &= test("192.0.2.195", "2001:db8:eeee:9:8000::");
+	success &= test_6to4("2001:db8:ffc6:3364:4000::", "198.51.100.64");
+	success &= test_4to6("198.51.100.64", "2001:db8::abcd");
+	success &= test_6to4("2001:db9::", NULL);
+	success &= test_6to4("2001:db8:aaaa::1", NULL);
+
+	/* Changes drop the indexes; the rtries take over. */
+	success &= add_entry("203.0.113.0", 24, "2001:db8:1::", 120);
+	success &= ASSERT_BOOL(true, !rcu_access_pointer(eamt->index6), "stale index6");
+	success &= test("203.0.113.5", "2001:db8:1::5");
+
+	return success;
+}
+
+static bool init_eam(struct eamt_entry *eam, char *addr4, __u8 len4,
+		char *addr6, __u8 len6)
+{
+	eam->prefix4.len = len4;
+	eam->prefix6.len = len6;
+	return !str_to_addr4(addr4, &eam->prefix4.address)
+			&& !str_to_addr6(addr6, &eam->prefix6.address);
+}
+
+static bool bulk_test(void)
+{
+	struct eamt_entry eams[4];
+	__u64 count;
+	bool success = true;
+
+	success &= init_eam(&eams[0], "192.0.2.16", 28, "2001:db8:cccc::", 124);
+	success &= init_eam(&eams[1], "192.0.2.1", 32, "2001:db8:aaaa::", 128);
+	success &= init_eam(&eams[2], "192.0.2.128", 26, "2001:db8:dddd::", 64);
+	/* Same IPv4 prefix as eams[1]. */
+	success &= init_eam(&eams[3], "192.0.2.1", 32, "2001:db8:bbbb::", 128);
+	if (!success)
+		return false;
+
+	success &= ASSERT_INT(-EEXIST, eamt_add_bulk(eamt, eams, 4, true), "collision");
+	success &= ASSERT_INT(0, eamt_count(eamt, &count), "count 1");
+	success &= ASSERT_U64(0, count, "nothing added");
+
+	success &= ASSERT_INT(0, eamt_add_bulk(eamt, eams, 3, true), "add");
+	success &= ASSERT_INT(0, eamt_count(eamt, &count), "count 2");
+	success &= ASSERT_U64(3, count, "all added");
+	success &= test("192.0.2.1", "2001:db8:aaaa::");
+	success &= test("192.0.2.24", "2001:db8:cccc::8");
+	success &= test("192.0.2.152", "2001:db8:dddd:0:6000::");
+
+	/* Collides with an entry that's already in the table. */
+	success &= ASSERT_INT(-EEXIST, eamt_add_bulk(eamt, &eams[3], 1, true), "old collision");
+
+	return success;
+}
+
 static bool remove_entry(char *addr4, __u8 len4, char *addr6, __u8 len6,
 		int expected_error)
 {
@@ -453,6 +534,66 @@ static bool remove_test(void)
 	return success;
 }
 
+static int copy_usr_cb(struct eamt_entry_usr *entry, void *arg)
+{
+	memcpy(arg, entry, sizeof(*entry));
+	return 0;
+}
+
+static bool assert_counters(__u64 hits, __u64 bytes, bool reset)
+{
+	struct eamt_entry_usr entry;
+	bool success = true;
+
+	memset(&entry, 0xFF, sizeof(entry));
+	success &= ASSERT_INT(0, eamt_foreach_usr(eamt, copy_usr_cb, &entry,
+			NULL, reset), "foreach result");
+	success &= ASSERT_U64(hits, entry.hits, "hits");
+	success &= ASSERT_U64(bytes, entry.bytes, "bytes");
+
+	return success;
+}
+
+static bool counters_test(void)
+{
+	struct in6_addr addr6;
+	struct in_addr addr4;
+	bool success = true;
+
+	eam_counters = true;
+	success &= add_entry("192.0.2.0", 24, "2001:db8::", 120);
+	eam_counters = false;
+	if (!success)
+		return false;
+
+	if (str_to_addr6("2001:db8::5", &addr6))
+		return false;
+	if (str_to_addr4("192.0.2.5", &addr4))
+		return false;
+
+	success &= assert_counters(0, 0, false);
+
+	/* The second one is served by the cache; it has to count too. */
+	success &= ASSERT_INT(0, eamt_xlat_6to4(eamt, &addr6, &addr4, 100),
+			"6to4 errcode");
+	success &= ASSERT_INT(0, eamt_xlat_6to4(eamt, &addr6, &addr4, 100),
+			"cached 6to4 errcode");
+	success &= ASSERT_INT(0, eamt_xlat_4to6(eamt, &addr4, &addr6, 50),
+			"4to6 errcode");
+	success &= assert_counters(3, 250, true);
+	success &= assert_counters(0, 0, false);
+
+	/* Entries added while the counters are disabled are not counted. */
+	eamt_flush(eamt);
+	success &= add_entry("192.0.2.0", 24, "2001:db8::", 120);
+	success &= ASSERT_INT(0, eamt_xlat_6to4(eamt, &addr6, &addr4, 100),
+			"uncounted errcode");
+	success &= assert_counters(0, 0, false);
+
+	eamt_flush(eamt);
+	return success;
+}
+
 static int address_mapping_test_init(void)
 {
 	struct test_group test = {
@@ -470,6 +611,9 @@ static int address_mapping_test_init(void)
 	test_group_test(&test, rfc7757_overlapping_test, "RFC 7757 Section 5, 1st half");
 	test_group_test(&test, rfc7757_identical_test, "RFC 7757 Section 5, 2nd half");
 	test_group_test(&test, remove_test, "remove function");
+	test_group_test(&test, index_test, "multibit trie index");
+	test_group_test(&test, bulk_test, "bulk add");
+	test_group_test(&test, counters_test, "hit counters");
 
 	return test_group_end(&test);
 }
@@ -30,7 +30,7 @@ static bool assert_bib_count(int expected, l4_protocol proto)
 	struct bib_foreach_func func = { .cb = bib_count_fn, .arg = &counter, };
 	bool success = true;
 
-	success &= ASSERT_INT(0, bib_foreach(jool.nat64.bib, proto, &func, NULL), "foreach result");
+	success &= ASSERT_INT(0, bib_foreach(jool.nat64.bib, proto, &func, NULL, NULL), "foreach result");
 	success &= ASSERT_INT(expected, counter, "computed count");
 	success &= ASSERT_INT(0, bib_count(jool.nat64.bib, proto, &stored), "count result");
 	success &= ASSERT_U64((__u64)expected, stored, "stored count");
@@ -76,7 +76,7 @@ static bool assert_session_count(int expected, l4_protocol proto)
 	struct session_foreach_func cb = { .cb = session_count_fn, .arg = &counter, };
 	bool success = true;
 
-	success &= ASSERT_INT(0, bib_foreach_session(jool.nat64.bib, proto, &cb, NULL), "foreach result");
+	success &= ASSERT_INT(0, bib_foreach_session(jool.nat64.bib, proto, &cb, NULL, NULL), "foreach result");
 	success &= ASSERT_INT(expected, counter, "computed count");
 	success &= ASSERT_INT(0, bib_count_sessions(jool.nat64.bib, proto, &stored), "count result");
 	success &= ASSERT_U64((__u64)expected, stored, "stored count");
@@ -116,7 +116,7 @@ static int session_exists(struct session_entry *session)
 	 * This is the closest we have to a session finding function in the
 	 * current API.
 	 */
-	return bib_foreach_session(jool.nat64.bib, session->proto, &func, NULL);
+	return bib_foreach_session(jool.nat64.bib, session->proto, &func, NULL, NULL);
 }
 
 static bool assert_session_exists(char *src6_addr, u16 src6_port,
@@ -430,6 +430,27 @@ static bool test_icmp(void)
 
 	kfree_skb(skb);
 
+	/*
+	 * Same ping, another destination. The new session joins the existing
+	 * BIB entry, so the BIB half of its (ICMP) allocation goes unused.
+	 */
+	if (init_tuple6(&state.in.tuple, "1::2", 1212, "3::5", 1212, L4PROTO_ICMP))
+		return false;
+	if (create_skb6_icmp_info(&state.in.tuple, &skb, 16, 32))
+		return false;
+	if (pkt_init_ipv6(&state.in, skb))
+		return false;
+
+	success &= ASSERT_INT(VERDICT_CONTINUE, ipv6_simple(&state), "result 4");
+	success &= assert_bib_count(1, L4PROTO_ICMP);
+	success &= assert_session_count(2, L4PROTO_ICMP);
+	success &= assert_session_exists("1::2", 1212, "3::5", 1212,
+			"192.0.2.128", 1024, "0.0.0.5", 1024,
+			L4PROTO_ICMP, ESTABLISHED,
+			SESSION_TIMER_EST, ICMP_DEFAULT);
+
+	kfree_skb(skb);
+
 	return success;
 }
 
@@ -494,7 +515,7 @@ static bool test_tcp(void)
 	success &= assert_session_count(1, L4PROTO_TCP);
 	success &= assert_session_exists("1::2", 1212, "3::4", 3434,
 			"192.0.2.128", 1024, "0.0.0.4", 3434,
-			L4PROTO_TCP, TRANS, SESSION_TIMER_TRANS, TCP_TRANS);
+			L4PROTO_TCP, TRANS, SESSION_TIMER_CLOSED, TCP_TRANS);
 
 	kfree_skb(skb);
 
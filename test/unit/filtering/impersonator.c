@@ -1,3 +1,4 @@
+#include "nat64/mod/common/atomic_config.h"
 #include "nat64/mod/stateful/joold.h"
 #include "nat64/unit/unit_test.h"
 
@@ -20,12 +21,41 @@ void cfgcandidate_put(struct config_candidate *candidate)
 	/* No code. */
 }
 
+struct pool6 *atomconfig_clone_pool6(struct pool6 *pool)
+{
+	broken_unit_call(__func__);
+	return NULL;
+}
+
+struct eam_table *atomconfig_clone_eamt(struct eam_table *eamt)
+{
+	broken_unit_call(__func__);
+	return NULL;
+}
+
+struct addr4_pool *atomconfig_clone_blacklist(struct addr4_pool *pool)
+{
+	broken_unit_call(__func__);
+	return NULL;
+}
+
+struct addr4_pool *atomconfig_clone_pool6791(struct addr4_pool *pool)
+{
+	broken_unit_call(__func__);
+	return NULL;
+}
+
 void fragdb_config_copy(struct fragdb *db, struct fragdb_config *config)
 {
 	broken_unit_call(__func__);
 }
 
-struct fragdb *fragdb_alloc(struct net *ns)
+void fragdb_config_set(struct fragdb *db, struct fragdb_config *config)
+{
+	broken_unit_call(__func__);
+}
+
+struct fragdb *fragdb_alloc(struct net *ns, struct jool_stats *stats)
 {
 	return (struct fragdb *)&dummy;
 }
@@ -41,7 +71,7 @@ void fragdb_put(struct fragdb *db)
 }
 
 void joold_add(struct joold_queue *queue, struct session_entry *entry,
-		struct bib *bib)
+		struct bib *bib, struct pool6 *pool6)
 {
 	/* No code. */
 }
@@ -51,6 +81,11 @@ void joold_config_copy(struct joold_queue *queue, struct joold_config *config)
 	broken_unit_call(__func__);
 }
 
+void joold_config_set(struct joold_queue *queue, struct joold_config *config)
+{
+	broken_unit_call(__func__);
+}
+
 struct joold_queue *joold_alloc(struct net *ns)
 {
 	return (struct joold_queue *)&dummy;
@@ -0,0 +1,368 @@
+#include <linux/delay.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/unit/skb_generator.h"
+#include "nat64/unit/types.h"
+#include "stateful/fragment_db.c"
+
+MODULE_LICENSE(JOOL_LICENSE);
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("Fragment database stress and eviction benchmark.");
+
+static unsigned int DATAGRAMS = 10000;
+module_param(DATAGRAMS, uint, 0);
+MODULE_PARM_DESC(DATAGRAMS, "Number of fragmented datagrams each pattern sends. Default 10000.");
+
+static unsigned int FRAGMENTS = 4;
+module_param(FRAGMENTS, uint, 0);
+MODULE_PARM_DESC(FRAGMENTS, "Fragments per datagram. Min 2, max 64, default 4.");
+
+static unsigned int IN_FLIGHT = 1000;
+module_param(IN_FLIGHT, uint, 0);
+MODULE_PARM_DESC(IN_FLIGHT, "Number of datagrams whose fragments arrive interleaved with each other. Default 1000.");
+
+static unsigned int HIGH_THRESH;
+module_param(HIGH_THRESH, uint, 0);
+MODULE_PARM_DESC(HIGH_THRESH, "The database's high memory threshold, in bytes. Zero means the default.");
+
+static unsigned int LOW_THRESH;
+module_param(LOW_THRESH, uint, 0);
+MODULE_PARM_DESC(LOW_THRESH, "The database's low memory threshold, in bytes. Zero means the default.");
+
+/* Payload of every fragment. (The first one's includes the UDP header.) */
+#define FRAG_PAYLOAD 64
+
+/**
+ * The order in which each batch of IN_FLIGHT datagrams sends its fragments.
+ * Within a batch, the k'th fragment of every datagram arrives before the
+ * (k + 1)'th fragment of any of them.
+ */
+enum pattern {
+	/* First fragments first; the rest can be translated on arrival. */
+	PATTERN_IN_ORDER,
+	/* First fragments last; the rest have to be queued until then. */
+	PATTERN_REVERSE,
+	/*
+	 * First fragments never arrive, so the rest stay queued until they
+	 * are evicted or they expire.
+	 */
+	PATTERN_MISSING_FIRST,
+};
+
+static char *pattern_names[] = {
+	"in order",
+	"reverse order",
+	"missing first fragments",
+};
+
+struct phase_stats {
+	unsigned int fragments;
+	unsigned int continued;
+	unsigned int stolen;
+	unsigned int dropped;
+	long peak_mem;
+	u64 nsecs;
+};
+
+static struct fragdb *db;
+/* What the first fragments pretend to have been translated into. */
+static struct sk_buff *template4;
+/* The fragments of the current batch, in arrival order. */
+static struct sk_buff **batch;
+
+/**
+ * Datagram @d comes from 2001:db8::<d / 65536> (so a few hosts send lots of
+ * datagrams each) and has ID @d.
+ */
+static int create_fragment(unsigned int d, unsigned int k,
+		struct sk_buff **result)
+{
+	struct tuple tuple6;
+	struct sk_buff *skb;
+	u16 total = FRAGMENTS * FRAG_PAYLOAD;
+	bool mf = (k != FRAGMENTS - 1);
+	int error;
+
+	error = init_tuple6(&tuple6, "2001:db8::", 5000, "64:ff9b::c000:201",
+			80, L4PROTO_UDP);
+	if (error)
+		return error;
+	tuple6.src.addr6.l3.s6_addr32[3] = cpu_to_be32(d >> 16);
+
+	error = k ? create_skb6_udp_frag(&tuple6, &skb, FRAG_PAYLOAD, total,
+			false, mf, k * FRAG_PAYLOAD, 32)
+		: create_skb6_udp_frag(&tuple6, &skb,
+			FRAG_PAYLOAD - sizeof(struct udphdr), total,
+			false, mf, 0, 32);
+	if (error)
+		return error;
+
+	((struct frag_hdr *)(ipv6_hdr(skb) + 1))->identification =
+			cpu_to_be32(d);
+	/* xlat_subsequent() wants a namespace. */
+	skb->dev = init_net.loopback_dev;
+
+	*result = skb;
+	return 0;
+}
+
+static unsigned int fragment_index(enum pattern pattern, unsigned int i)
+{
+	switch (pattern) {
+	case PATTERN_IN_ORDER:
+		return i;
+	case PATTERN_REVERSE:
+		return (i == FRAGMENTS - 1) ? 0 : (FRAGMENTS - 1 - i);
+	case PATTERN_MISSING_FIRST:
+		return i + 1;
+	}
+
+	return i;
+}
+
+/**
+ * Generates the fragments of datagrams @first through @first + @count - 1.
+ * Returns the number of fragments.
+ */
+static int create_batch(enum pattern pattern, unsigned int first,
+		unsigned int count)
+{
+	unsigned int rounds;
+	unsigned int i, d, f = 0;
+	int error;
+
+	rounds = FRAGMENTS - (pattern == PATTERN_MISSING_FIRST);
+	for (i = 0; i < rounds; i++) {
+		for (d = first; d < first + count; d++) {
+			error = create_fragment(d, fragment_index(pattern, i),
+					&batch[f]);
+			if (error)
+				goto fail;
+			f++;
+		}
+	}
+
+	return f;
+
+fail:
+	while (f > 0)
+		kfree_skb(batch[--f]);
+	return error;
+}
+
+/**
+ * Stands in for the rest of the translation of a first fragment: Lets the
+ * database translate the fragments that were waiting for it.
+ */
+static void resolve(struct packet *pkt)
+{
+	static struct xlation state;
+
+	state.in = *pkt;
+	state.out.skb = template4;
+	fragdb_resolve(db, &state);
+}
+
+static void handle(struct sk_buff *skb, struct phase_stats *stats)
+{
+	struct packet pkt;
+	long mem;
+
+	if (pkt_init_ipv6(&pkt, skb)) {
+		kfree_skb(skb);
+		stats->dropped++;
+		return;
+	}
+
+	switch (fragdb_handle(db, &pkt)) {
+	case VERDICT_CONTINUE:
+		resolve(&pkt);
+		kfree_skb(skb);
+		stats->continued++;
+		break;
+	case VERDICT_STOLEN:
+		stats->stolen++;
+		break;
+	default:
+		/* Includes the translated ones; the route is fake. */
+		kfree_skb(skb);
+		stats->dropped++;
+		break;
+	}
+
+	mem = atomic_long_read(&db->mem);
+	if (mem > stats->peak_mem)
+		stats->peak_mem = mem;
+}
+
+static int run_pattern(enum pattern pattern, struct phase_stats *stats)
+{
+	unsigned int first, count;
+	int f, i;
+	u64 start;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (first = 0; first < DATAGRAMS; first += count) {
+		count = min(IN_FLIGHT, DATAGRAMS - first);
+		f = create_batch(pattern, first, count);
+		if (f < 0)
+			return f;
+
+		start = ktime_get_ns();
+		for (i = 0; i < f; i++)
+			handle(batch[i], stats);
+		stats->nsecs += ktime_get_ns() - start;
+		stats->fragments += f;
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/**
+ * Waits for every flow to expire, then cleans the database one shard at a time,
+ * and prints how long each shard stayed locked.
+ */
+static void clean(void)
+{
+	struct fragdb_shard *shards;
+	unsigned int i;
+	unsigned int deleted = 0;
+	u64 start, nsecs, total = 0, max_pause = 0;
+
+	shards = READ_ONCE(db->shards);
+	if (!shards)
+		return;
+
+	msleep(jiffies_to_msecs(db->timeout) + 10);
+
+	for (i = 0; i < FRAGDB_SHARDS; i++) {
+		start = ktime_get_ns();
+		deleted += clean_shard(db, &shards[i]);
+		nsecs = ktime_get_ns() - start;
+		total += nsecs;
+		max_pause = max(max_pause, nsecs);
+	}
+
+	pr_info("	fragdb_clean: %u flows in %llu us; longest shard pause %llu us. Memory left: %ld bytes.\n",
+			deleted, total / 1000, max_pause / 1000,
+			atomic_long_read(&db->mem));
+}
+
+static int run(enum pattern pattern)
+{
+	struct fragdb_config config;
+	struct phase_stats stats;
+	int error;
+
+	db = fragdb_alloc(NULL, NULL);
+	if (!db)
+		return -ENOMEM;
+
+	fragdb_config_copy(db, &config);
+	config.ttl = msecs_to_jiffies(100);
+	if (HIGH_THRESH)
+		config.high_thresh = HIGH_THRESH;
+	if (LOW_THRESH)
+		config.low_thresh = LOW_THRESH;
+	fragdb_config_set(db, &config);
+
+	error = run_pattern(pattern, &stats);
+	if (error)
+		goto end;
+
+	pr_info("%s: %u fragments in %llu ms; %llu fragments/s, %llu ns/fragment\n",
+			pattern_names[pattern], stats.fragments,
+			stats.nsecs / 1000000,
+			stats.nsecs ? ((u64)stats.fragments * 1000000000
+					/ stats.nsecs) : 0,
+			stats.fragments ? (stats.nsecs / stats.fragments) : 0);
+	pr_info("	verdicts: %u continue, %u stolen, %u drop. Memory high-water mark: %ld bytes.\n",
+			stats.continued, stats.stolen, stats.dropped,
+			stats.peak_mem);
+	clean();
+	/* Fall through. */
+
+end:
+	fragdb_put(db);
+	return error;
+}
+
+static int run_all(void)
+{
+	struct tuple tuple4;
+	int error;
+
+	error = init_tuple4(&tuple4, "192.0.2.1", 5000, "192.0.2.2", 80,
+			L4PROTO_UDP);
+	if (error)
+		return error;
+	error = create_skb4_udp(&tuple4, &template4, 8, 32);
+	if (error)
+		return error;
+
+	batch = vmalloc(IN_FLIGHT * FRAGMENTS * sizeof(*batch));
+	if (!batch) {
+		error = -ENOMEM;
+		goto end;
+	}
+
+	error = run(PATTERN_IN_ORDER);
+	if (!error)
+		error = run(PATTERN_REVERSE);
+	if (!error)
+		error = run(PATTERN_MISSING_FIRST);
+
+	vfree(batch);
+	/* Fall through. */
+end:
+	kfree_skb(template4);
+	return error;
+}
+
+/**
+ * This is what happens when the user execs `sudo insmod fragdb-benchmark.ko`.
+ */
+int init_module(void)
+{
+	int error;
+
+	if (FRAGMENTS < 2 || 64 < FRAGMENTS) {
+		pr_err("Error: FRAGMENTS is out of range (2-64).\n");
+		return -EINVAL;
+	}
+	if (IN_FLIGHT < 1) {
+		pr_err("Error: IN_FLIGHT has to be at least 1.\n");
+		return -EINVAL;
+	}
+
+	pr_info("DATAGRAMS: %u\n", DATAGRAMS);
+	pr_info("FRAGMENTS: %u\n", FRAGMENTS);
+	pr_info("IN_FLIGHT: %u\n", IN_FLIGHT);
+	pr_info("Shards: %u; initial buckets per shard: %u\n", FRAGDB_SHARDS,
+			FRAGDB_TABLE_SIZE);
+
+	/* The buffers are only used with kernels < 3.13; measure the flows. */
+	kernel_defrag = false;
+	error = fragdb_setup();
+	if (error)
+		return error;
+
+	error = run_all();
+
+	fragdb_teardown();
+	return error;
+}
+
+/**
+ * This is what happens when the user execs `sudo rmmod fragdb-benchmark`.
+ */
+void cleanup_module(void)
+{
+	/* No code. */
+}
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+echo "Note: This will take up lots of CPU."
+echo "If this freezes, please wait a few minutes; it should come back."
+
+function test() {
+	echo "Testing $1 datagrams ($2 in flight), high threshold $3."
+	for i in {1..4}; do
+		echo "Test $i"
+		sudo insmod fragdb-benchmark.ko DATAGRAMS=$1 IN_FLIGHT=$2 HIGH_THRESH=$3
+		sudo rmmod fragdb-benchmark
+		sudo dmesg -ct >> results-$SHARD_BITS-$TABLE_SIZE-$1-$2-$3.txt
+	done
+}
+
+rm -f results*
+sudo dmesg -C
+
+for layout in "0 32" "4 32" "4 1024" "6 32"; do
+	set -- $layout
+	SHARD_BITS=$1
+	TABLE_SIZE=$2
+	make clean > /dev/null
+	make SHARD_BITS=$SHARD_BITS TABLE_SIZE=$TABLE_SIZE > /dev/null || exit 1
+
+	test 100000 1000 0
+	test 100000 10000 0
+	test 100000 10000 1048576
+done
+
+echo "Test results written to result*.txt files."
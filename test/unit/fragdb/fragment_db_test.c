@@ -110,15 +110,19 @@ static bool validate_database(int expected_count)
 	int p = 0;
 	bool success = true;
 
+	/* The shards are only allocated when the first fragment arrives. */
+	if (!db->shards)
+		return ASSERT_INT(expected_count, 0, "Packets (no shards)");
+
 	/* list */
-	list_for_each(node, &db->expire_list) {
+	list_for_each(node, &db->shards[0].expire_list) {
 		p++;
 	}
 	success &= ASSERT_INT(expected_count, p, "Packets in the list");
 
 	/* table */
 	p = 0;
-	fragdb_table_for_each(&db->table, fragdb_counter, &p);
+	fragdb_table_for_each(&db->shards[0].table, fragdb_counter, &p);
 	success &= ASSERT_INT(expected_count, p, "Packets in the hash table");
 
 	return success;
@@ -147,6 +151,7 @@ static bool test_no_frags(void)
 	success &= validate_packet(skb, 1);
 	success &= validate_fragment(skb, false, sizeof(struct udphdr) + 10);
 	success &= validate_database(0);
+	success &= ASSERT_PTR(NULL, db->shards, "Shards of a fragmentless db");
 
 	kfree_skb(skb);
 	return success;
@@ -221,7 +226,7 @@ static bool validate_list(struct frag_summary *expected, int expected_count)
 	bool success = true;
 	int c = 0;
 
-	list_for_each_entry(buffer, &db->expire_list, list_hook) {
+	list_for_each_entry(buffer, &db->shards[0].expire_list, list_hook) {
 		if (!ASSERT_BOOL(true, c < expected_count, "List count (%u %u)",
 				c, expected_count))
 			return false;
@@ -314,7 +319,7 @@ static bool test_timer(void)
 	success &= validate_list(&expected_keys[0], 2);
 
 	/* After 2 seconds, packet 1 should die. */
-	dummy_buffer = container_of(db->expire_list.next, struct reassembly_buffer, list_hook);
+	dummy_buffer = container_of(db->shards[0].expire_list.next, struct reassembly_buffer, list_hook);
 	dummy_buffer->dying_time = jiffies - 1;
 	dummy_buffer = container_of(dummy_buffer->list_hook.next, struct reassembly_buffer, list_hook);
 	dummy_buffer->dying_time = jiffies + msecs_to_jiffies(4000);
@@ -332,11 +337,85 @@ static bool test_timer(void)
 	return success;
 }
 
+static bool test_memory_limit(void)
+{
+	struct sk_buff *skb;
+	struct tuple tuple1, tuple2;
+	struct frag_summary expected_key;
+	struct fragdb_config config;
+	struct fragdb_config backup;
+	struct reassembly_buffer *dummy_buffer;
+	bool success = true;
+	int error;
+
+	error = init_tuple6(&tuple1, "1::2", 1212, "3::4", 3434, L4PROTO_UDP);
+	if (error)
+		return false;
+	error = init_tuple6(&tuple2, "8::7", 8787, "6::5", 6565, L4PROTO_UDP);
+	if (error)
+		return false;
+
+	expected_key.src_addr = tuple2.src.addr6.l3;
+	expected_key.dst_addr = tuple2.dst.addr6.l3;
+	expected_key.identification = 4321;
+	expected_key.l4_proto = NEXTHDR_UDP;
+
+	/* Any buffer is over the limit, so only the newest one can survive. */
+	fragdb_config_copy(db, &backup);
+	config = backup;
+	config.high_thresh = 1;
+	config.low_thresh = 0;
+	fragdb_config_set(db, &config);
+
+	/* Fragment 1.1 arrives. It's too big, but it's the one being added. */
+	error = create_skb6_udp_frag(&tuple1, &skb, 100, 1000, true, true, 0, 32);
+	if (error)
+		goto end;
+	success &= assert_fragdb_handle(skb, VERDICT_STOLEN);
+	success &= validate_database(1);
+
+	/* Fragment 2.1 arrives. Packet 1 has to go. */
+	error = create_skb6_udp_frag(&tuple2, &skb, 100, 1000, true, true, 0, 32);
+	if (error)
+		goto end;
+	success &= assert_fragdb_handle(skb, VERDICT_STOLEN);
+	success &= validate_database(1);
+	success &= validate_list(&expected_key, 1);
+
+	/* The cleaner also sheds memory. */
+	fragdb_clean(db);
+	success &= validate_database(0);
+	success &= ASSERT_INT(0, (int)atomic_long_read(&db->mem), "memory");
+
+	/* Without the limit, both can live. */
+	config.high_thresh = 0;
+	fragdb_config_set(db, &config);
+
+	error = create_skb6_udp_frag(&tuple1, &skb, 100, 1000, true, true, 0, 32);
+	if (error)
+		goto end;
+	success &= assert_fragdb_handle(skb, VERDICT_STOLEN);
+	error = create_skb6_udp_frag(&tuple2, &skb, 100, 1000, true, true, 0, 32);
+	if (error)
+		goto end;
+	success &= assert_fragdb_handle(skb, VERDICT_STOLEN);
+	success &= validate_database(2);
+
+	list_for_each_entry(dummy_buffer, &db->shards[0].expire_list, list_hook)
+		dummy_buffer->dying_time = jiffies - 1;
+	fragdb_clean(db);
+	success &= validate_database(0);
+
+end:
+	fragdb_config_set(db, &backup);
+	return success && !error;
+}
+
 #endif
 
 static int init(void)
 {
-	db = fragdb_alloc(NULL);
+	db = fragdb_alloc(NULL, NULL);
 	return db ? 0 : -ENOMEM;
 }
 
@@ -362,6 +441,7 @@ int init_module(void)
 	test_group_test(&test, test_no_frags, "Unfragmented IPv6 packet arrives");
 	test_group_test(&test, test_happy_path, "Happy defragmentation.");
 	test_group_test(&test, test_timer, "Timer test.");
+	test_group_test(&test, test_memory_limit, "Memory limit test.");
 #endif
 
 	return test_group_end(&test);
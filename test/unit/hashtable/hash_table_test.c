@@ -1,6 +1,7 @@
 #include <linux/module.h>
 #include <linux/printk.h>
 #include <linux/inet.h>
+#include <linux/slab.h>
 
 #include "nat64/unit/unit_test.h"
 
@@ -220,6 +221,60 @@ static bool test_for_each_function(void)
 	return true;
 }
 
+#define GROWTH_VALUES 1000
+
+/**
+ * Forces several resizes, removing stuff in the middle of the migrations.
+ */
+static bool test_growth(void)
+{
+	struct test_table table;
+	struct table_key key;
+	struct table_value *values;
+	unsigned int i;
+	bool success = true;
+
+	values = kmalloc(GROWTH_VALUES * sizeof(*values), GFP_KERNEL);
+	if (!values)
+		return false;
+
+	test_table_init(&table, &equals_cb, &hash_code_cb);
+
+	for (i = 0; i < GROWTH_VALUES; i++) {
+		key.key = i;
+		values[i].value = i;
+		if (test_table_put(&table, &key, &values[i]) != 0) {
+			log_err("Put operation failed on value %u.", i);
+			success = false;
+			goto end;
+		}
+		if (i % 3 == 0) {
+			key.key = i / 2;
+			test_table_remove(&table, &key, NULL);
+		}
+	}
+
+	success &= ASSERT_BOOL(true, table.size > 8, "table grew");
+
+	for (i = 0; i < GROWTH_VALUES; i += 3) {
+		key.key = i / 2;
+		success &= ASSERT_PTR(NULL, test_table_get(&table, &key),
+				"%uth value was removed", i / 2);
+	}
+
+	/* The removals never reach these. */
+	for (i = GROWTH_VALUES / 2; i < GROWTH_VALUES; i++) {
+		key.key = i;
+		success &= ASSERT_PTR(&values[i], test_table_get(&table, &key),
+				"%uth value survived", i);
+	}
+
+end:
+	test_table_empty(&table, NULL);
+	kfree(values);
+	return success;
+}
+
 int init_module(void)
 {
 	struct test_group test = {
@@ -231,6 +286,7 @@ int init_module(void)
 
 	test_group_test(&test, most_stuff, "Everything, except for_each");
 	test_group_test(&test, test_for_each_function, "for_each function");
+	test_group_test(&test, test_growth, "resizing");
 
 	return test_group_end(&test);
 }
@@ -1,3 +1,4 @@
+#include "nat64/common/constants.h"
 #include "nat64/mod/stateful/pool4/db.h"
 #include "nat64/mod/stateful/bib/pkt_queue.h"
 #include "nat64/unit/unit_test.h"
@@ -13,6 +14,15 @@ int mask_domain_next(struct mask_domain *masks,
 	return broken_unit_call(__func__);
 }
 
+int mask_domain_next_free(struct mask_domain *masks,
+		struct ipv4_transport_addr *addr,
+		bool *consecutive,
+		const unsigned long *(*get_taken)(const struct in_addr *, void *),
+		void *arg)
+{
+	return broken_unit_call(__func__);
+}
+
 bool mask_domain_matches(struct mask_domain *masks,
 		struct ipv4_transport_addr *addr)
 {
@@ -20,6 +30,41 @@ bool mask_domain_matches(struct mask_domain *masks,
 	return false;
 }
 
+bool mask_domain_contains(struct mask_domain *masks, struct in_addr *addr,
+		unsigned int min, unsigned int max)
+{
+	broken_unit_call(__func__);
+	return false;
+}
+
+void mask_domain_balance(struct mask_domain *masks,
+		unsigned int (*get_used)(const struct in_addr *, void *),
+		void *arg)
+{
+	broken_unit_call(__func__);
+}
+
+void mask_domain_rewind(struct mask_domain *masks)
+{
+	broken_unit_call(__func__);
+}
+
+unsigned int mask_domain_count(struct mask_domain *masks)
+{
+	return broken_unit_call(__func__);
+}
+
+unsigned int mask_domain_offset(struct mask_domain *masks)
+{
+	return broken_unit_call(__func__);
+}
+
+int mask_domain_get(struct mask_domain *masks, unsigned int ordinal,
+		struct ipv4_transport_addr *result)
+{
+	return broken_unit_call(__func__);
+}
+
 bool mask_domain_is_dynamic(struct mask_domain *masks)
 {
 	return false;
@@ -30,7 +75,17 @@ __u32 mask_domain_get_mark(struct mask_domain *masks)
 	return 0;
 }
 
-struct pktqueue *pktqueue_alloc(void)
+unsigned int mask_domain_get_iterations(struct mask_domain *masks)
+{
+	return 0;
+}
+
+bool mask_domain_is_limited(struct mask_domain *masks)
+{
+	return false;
+}
+
+struct pktqueue *pktqueue_alloc(struct net *ns, struct jool_stats *stats)
 {
 	return (struct pktqueue *)&dummy;
 }
@@ -41,7 +96,8 @@ void pktqueue_release(struct pktqueue *queue)
 }
 
 int pktqueue_add(struct pktqueue *queue, struct packet *pkt,
-		struct ipv6_transport_addr *dst6, bool too_many)
+		struct ipv6_transport_addr *dst6, bool too_many,
+		size_t max_bytes, bool stateless)
 {
 	return broken_unit_call(__func__);
 }
@@ -51,6 +107,11 @@ void pktqueue_rm(struct pktqueue *queue, struct ipv4_transport_addr *src4)
 	/* No code. */
 }
 
+unsigned long pktqueue_next_clean(struct pktqueue *queue)
+{
+	return jiffies + msecs_to_jiffies(1000 * TCP_INCOMING_SYN);
+}
+
 struct pktqueue_session *pktqueue_find(struct pktqueue *queue,
 		struct ipv6_transport_addr *addr,
 		struct mask_domain *masks)
@@ -70,7 +131,7 @@ unsigned int pktqueue_prepare_clean(struct pktqueue *queue,
 	return broken_unit_call(__func__);
 }
 
-void pktqueue_clean(struct list_head *probes)
+void pktqueue_clean(struct pktqueue *queue, struct list_head *probes)
 {
 	broken_unit_call(__func__);
 }
@@ -2,15 +2,17 @@
 
 static int sent = 0;
 
-void icmp64_send(struct packet *pkt, icmp_error_code code, __u32 info)
+void icmp64_send(struct jool_stats *stats, struct packet *pkt,
+		icmp_error_code code, __u32 info)
 {
 	log_debug("Pretending I'm sending an ICMP error.");
 	sent++;
 }
 
-void icmp64_send_skb(struct sk_buff *skb, icmp_error_code error, __u32 info)
+void icmp64_send_skb(struct jool_stats *stats, struct sk_buff *skb,
+		icmp_error_code error, __u32 info)
 {
-	icmp64_send(NULL, 0, 0);
+	icmp64_send(stats, NULL, 0, 0);
 }
 
 int icmp64_pop(void)
@@ -1,4 +1,6 @@
 #include "nat64/mod/common/nf_hook.h"
+#include <linux/err.h>
+#include "nat64/mod/common/ingress.h"
 #include "nat64/mod/common/nf_wrapper.h"
 
 static NF_CALLBACK(hook_thingy, skb)
@@ -23,3 +25,18 @@ void init_nf_hook_op4(struct nf_hook_ops *ops)
 	ops->hooknum = NF_INET_PRE_ROUTING;
 	ops->priority = NF_IP_PRI_JOOL;
 }
+
+bool ingress_enabled(void)
+{
+	return false;
+}
+
+struct ingress_hooks *ingress_register(struct net *ns)
+{
+	return ERR_PTR(-EINVAL);
+}
+
+void ingress_unregister(struct ingress_hooks *hooks)
+{
+	/* No code. */
+}
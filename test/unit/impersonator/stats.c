@@ -14,3 +14,25 @@ void inc_stats_skb4(struct sk_buff *skb, int field)
 {
 	/* No code. */
 }
+
+static struct jool_stats dummy_stats;
+
+struct jool_stats *jstat_alloc(void)
+{
+	return &dummy_stats;
+}
+
+void jstat_get(struct jool_stats *stats)
+{
+	/* No code. */
+}
+
+void jstat_put(struct jool_stats *stats)
+{
+	/* No code. */
+}
+
+void jstat_query(struct jool_stats *stats, struct jool_stats_usr *result)
+{
+	memset(result, 0, sizeof(*result));
+}
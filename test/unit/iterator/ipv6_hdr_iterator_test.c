@@ -398,6 +398,50 @@ static bool test_find_unsupported(void)
 	return success;
 }
 
+static bool test_walk(void)
+{
+	bool success = true;
+
+	/* Init */
+	struct ipv6hdr *hdr6;
+	struct ipv6_opt_hdr *hdr_hop;
+	struct ipv6_opt_hdr *hdr_route;
+	struct frag_hdr *hdr_frag;
+	unsigned char *payload;
+	struct hdr6_chain chain;
+
+	hdr6 = kmalloc_packet(OPT_HDR_LEN + ROUTE_HDR_LEN + FRAG_HDR_LEN + 4,
+			NEXTHDR_HOP);
+	if (!hdr6)
+		return false;
+	hdr_hop = add_opt_hdr(hdr6, HDR6_LEN, NEXTHDR_ROUTING);
+	hdr_route = add_route_hdr(hdr_hop, OPT_HDR_LEN, NEXTHDR_UDP);
+	hdr_route->nexthdr = NEXTHDR_FRAGMENT;
+	hdr_frag = add_frag_hdr(hdr_route, ROUTE_HDR_LEN, NEXTHDR_UDP);
+	payload = add_payload(hdr_frag, FRAG_HDR_LEN);
+
+	/* Test */
+	success &= ASSERT_INT(0, hdr6_walk(hdr6, payload + 4, &chain),
+			"Full result");
+	success &= ASSERT_UINT(NEXTHDR_UDP, chain.nexthdr, "Full nexthdr");
+	success &= ASSERT_PTR(payload, chain.l4, "Full l4");
+	success &= ASSERT_PTR(hdr_route, chain.routing, "Full routing");
+	success &= ASSERT_PTR(hdr_frag, chain.frag, "Full frag");
+
+	/* The fragment header doesn't fit. */
+	success &= ASSERT_INT(-EINVAL, hdr6_walk(hdr6, (void *)hdr_frag + 4,
+			&chain), "Truncated result");
+
+	/* Two fragment headers. */
+	hdr_frag->nexthdr = NEXTHDR_FRAGMENT;
+	success &= ASSERT_INT(-ELOOP, hdr6_walk(hdr6, payload + 4, &chain),
+			"Double frag result");
+
+	/* End */
+	kfree(hdr6);
+	return success;
+}
+
 int init_module(void)
 {
 	struct test_group test = {
@@ -419,6 +463,8 @@ int init_module(void)
 	test_group_test(&test, test_find_subheaders, "find function, subheaders");
 	test_group_test(&test, test_find_unsupported, "find function, unsupported hdrs");
 
+	test_group_test(&test, test_walk, "walk function");
+
 	return test_group_end(&test);
 }
 
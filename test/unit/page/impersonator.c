@@ -1,3 +1,4 @@
+#include "nat64/mod/common/atomic_config.h"
 #include "nat64/mod/common/translation_state.h"
 #include "nat64/mod/common/types.h"
 
@@ -22,6 +23,27 @@ void cfgcandidate_put(struct config_candidate *candidate)
 	/* No code. */
 }
 
+/* The page tests never share tables; these are only here for xlator.o. */
+struct pool6 *atomconfig_clone_pool6(struct pool6 *pool)
+{
+	return NULL;
+}
+
+struct eam_table *atomconfig_clone_eamt(struct eam_table *eamt)
+{
+	return NULL;
+}
+
+struct addr4_pool *atomconfig_clone_blacklist(struct addr4_pool *pool)
+{
+	return NULL;
+}
+
+struct addr4_pool *atomconfig_clone_pool6791(struct addr4_pool *pool)
+{
+	return NULL;
+}
+
 verdict sendpkt_send(struct xlation *state)
 {
 	log_debug("Pretending I'm sending a packet.");
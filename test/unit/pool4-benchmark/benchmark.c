@@ -0,0 +1,279 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/mod/stateful/bib/db.h"
+#include "nat64/mod/stateful/pool4/db.h"
+#include "nat64/mod/stateful/pool4/rfc6056.h"
+
+MODULE_LICENSE(JOOL_LICENSE);
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("pool4 allocation cost benchmark.");
+
+static unsigned int RANGE_COUNT = 1;
+module_param(RANGE_COUNT, uint, 0);
+MODULE_PARM_DESC(RANGE_COUNT, "Number of addresses to insert to pool4. Min 1, max 256, default 1.");
+
+static unsigned int TADDRS_PER_RANGE = 64512;
+module_param(TADDRS_PER_RANGE, uint, 0);
+MODULE_PARM_DESC(TADDRS_PER_RANGE, "Number of ports per pool4 address (starting from 1024). Min 1, max 64512, default 64512.");
+
+static unsigned int MAX_ITERATIONS = 0;
+module_param(MAX_ITERATIONS, uint, 0);
+MODULE_PARM_DESC(MAX_ITERATIONS, "Iteration limit. Same as in Jool's pool4. Zero stands for infinity. Default is zero.");
+
+static unsigned int LEVELS[] = { 50, 90, 99 };
+static unsigned int LEVEL_COUNT = ARRAY_SIZE(LEVELS);
+module_param_array(LEVELS, uint, &LEVEL_COUNT, 0);
+MODULE_PARM_DESC(LEVELS, "Comma-separated pool4 utilization percentages at which the allocations will be measured. Ascending, max 99, default 50,90,99.");
+
+static unsigned int PROBES = 1000;
+module_param(PROBES, uint, 0);
+MODULE_PARM_DESC(PROBES, "Number of connections measured at each utilization level. Default 1000.");
+
+/** Total transport addresses in pool4. (RANGE_COUNT times TADDRS_PER_RANGE.) */
+static unsigned int TADDR_COUNT;
+
+/*
+ * Legitimate instances of pool4 and the BIB, so find_available_mask() runs
+ * against a real tree, with real port bitmaps.
+ */
+static struct pool4 *pool;
+static struct bib *db;
+
+/** Number of BIB entries (ie. borrowed transport addresses) so far. */
+static unsigned int taken;
+
+struct probe_stats {
+	u64 nsecs;
+	u64 max_nsecs;
+	u64 iterations;
+	unsigned int max_iterations;
+	unsigned int errors;
+};
+
+static int init(void)
+{
+	struct pool4_entry_usr entry;
+	unsigned int i;
+	int error;
+
+	TADDR_COUNT = RANGE_COUNT * TADDRS_PER_RANGE;
+
+	pr_info("RANGE_COUNT: %u\n", RANGE_COUNT);
+	pr_info("TADDRS_PER_RANGE: %u\n", TADDRS_PER_RANGE);
+	pr_info("TADDR_COUNT (total ports): %u\n", TADDR_COUNT);
+	pr_info("MAX_ITERATIONS: %u\n", MAX_ITERATIONS);
+	pr_info("PROBES: %u\n", PROBES);
+
+	if (RANGE_COUNT < 1 || 256 < RANGE_COUNT) {
+		pr_err("Error: RANGE_COUNT is out of range (1-256).\n");
+		return -EINVAL;
+	}
+	if (TADDRS_PER_RANGE < 1 || 64512 < TADDRS_PER_RANGE) {
+		pr_err("Error: TADDRS_PER_RANGE is out of range (1-64512).\n");
+		return -EINVAL;
+	}
+	for (i = 0; i < LEVEL_COUNT; i++) {
+		if (LEVELS[i] > 99 || (i > 0 && LEVELS[i] <= LEVELS[i - 1])) {
+			pr_err("Error: LEVELS need to be ascending, and smaller than 100.\n");
+			return -EINVAL;
+		}
+	}
+
+	error = rfc6056_setup();
+	if (error)
+		return error;
+	error = bib_setup();
+	if (error)
+		goto rfc6056_fail;
+	pool = pool4db_alloc();
+	if (!pool) {
+		error = -ENOMEM;
+		goto pool4_fail;
+	}
+	db = bib_alloc(NULL, NULL);
+	if (!db) {
+		error = -ENOMEM;
+		goto bib_fail;
+	}
+
+	entry.mark = 0;
+	entry.iterations = MAX_ITERATIONS;
+	entry.flags = ITERATIONS_SET | (MAX_ITERATIONS ? 0 : ITERATIONS_INFINITE);
+	entry.proto = L4PROTO_UDP;
+	entry.range.prefix.len = 32;
+	entry.range.ports.min = 1024;
+	entry.range.ports.max = 1024 + TADDRS_PER_RANGE - 1;
+	for (i = 0; i < RANGE_COUNT; i++) {
+		entry.range.prefix.address.s_addr = cpu_to_be32(0xc0000200 + i);
+		error = pool4db_add(pool, &entry);
+		if (error)
+			goto add_fail;
+	}
+
+	return 0;
+
+add_fail:
+	bib_put(db);
+bib_fail:
+	pool4db_put(pool);
+pool4_fail:
+	bib_teardown();
+rfc6056_fail:
+	rfc6056_teardown();
+	return error;
+}
+
+/**
+ * Simulates the reception of a packet that will need a new transport address
+ * from pool4, from the eyes of Filtering: Finds the mask candidates, and
+ * commits the first one nobody is using as a new BIB entry.
+ *
+ * Every connection comes from a different IPv6 node, so none of them can reuse
+ * a BIB entry.
+ */
+static void new_connection(struct probe_stats *stats)
+{
+	static unsigned int counter;
+	struct route4_args route_args; /* Dummy; mostly not needed. */
+	struct tuple tuple6;
+	struct ipv4_transport_addr dst4;
+	struct mask_domain *masks;
+	struct bib_session result;
+	unsigned int iterations;
+	u64 start, nsecs;
+	int error;
+
+	tuple6.src.addr6.l3.s6_addr32[0] = cpu_to_be32(0x20010db8u);
+	tuple6.src.addr6.l3.s6_addr32[1] = 0;
+	tuple6.src.addr6.l3.s6_addr32[2] = 0;
+	tuple6.src.addr6.l3.s6_addr32[3] = cpu_to_be32(counter++);
+	tuple6.src.addr6.l4 = 5000;
+	tuple6.dst.addr6.l3.s6_addr32[0] = cpu_to_be32(0x0064ff9bu);
+	tuple6.dst.addr6.l3.s6_addr32[1] = 0;
+	tuple6.dst.addr6.l3.s6_addr32[2] = 0;
+	tuple6.dst.addr6.l3.s6_addr32[3] = cpu_to_be32(0xcb007101u);
+	tuple6.dst.addr6.l4 = 80;
+	tuple6.l3_proto = L3PROTO_IPV6;
+	tuple6.l4_proto = L4PROTO_UDP;
+	dst4.l3.s_addr = cpu_to_be32(0xcb007101u);
+	dst4.l4 = 80;
+
+	memset(&route_args, 0, sizeof(route_args));
+	bib_session_init(&result);
+
+	start = ktime_get_ns();
+	masks = mask_domain_find(pool, &tuple6, 11, F_ALGORITHM_MD5,
+			&route_args);
+	if (!masks) {
+		if (stats)
+			stats->errors++;
+		return;
+	}
+	error = bib_add6(db, masks, &tuple6, &dst4, 0, &result);
+	iterations = mask_domain_get_iterations(masks);
+	mask_domain_put(masks);
+	nsecs = ktime_get_ns() - start;
+
+	if (!error)
+		taken++;
+	if (!stats)
+		return;
+
+	stats->nsecs += nsecs;
+	stats->max_nsecs = max(stats->max_nsecs, nsecs);
+	stats->iterations += iterations;
+	stats->max_iterations = max(stats->max_iterations, iterations);
+	if (error)
+		stats->errors++;
+}
+
+/**
+ * Fills pool4 up to each of the LEVELS, and measures PROBES more connections
+ * every time.
+ */
+static void test(void)
+{
+	struct probe_stats stats;
+	unsigned int target;
+	unsigned int i, p;
+
+	pr_info("Utilization, average ns, max ns, average iterations, max iterations, errors\n");
+
+	for (i = 0; i < LEVEL_COUNT; i++) {
+		target = (u64)TADDR_COUNT * LEVELS[i] / 100;
+		if (target + PROBES > TADDR_COUNT) {
+			pr_info("%u%%: Not enough transport addresses for %u probes.\n",
+					LEVELS[i], PROBES);
+			return;
+		}
+
+		while (taken < target) {
+			new_connection(NULL);
+			if ((taken & 0x3FF) == 0)
+				cond_resched();
+		}
+
+		memset(&stats, 0, sizeof(stats));
+		for (p = 0; p < PROBES; p++)
+			new_connection(&stats);
+
+		pr_info("%u%% %llu %llu %llu %u %u\n", LEVELS[i],
+				stats.nsecs / PROBES, stats.max_nsecs,
+				stats.iterations / PROBES, stats.max_iterations,
+				stats.errors);
+	}
+}
+
+/**
+ * Prints find_available_mask()'s own bookkeeping, which covers the filling as
+ * well as the probes.
+ */
+static void print_histogram(void)
+{
+	struct pool4_stats_usr stats;
+	unsigned int i;
+
+	if (bib_mask_stats(db, L4PROTO_UDP, &stats))
+		return;
+
+	pr_info("Searches: %llu allocations, %llu exhaustions, %llu limited; %llu iterations.\n",
+			stats.allocations, stats.exhaustions, stats.limited,
+			stats.iterations);
+	for (i = 0; i < POOL4_HISTOGRAM_BUCKETS; i++) {
+		if (stats.histogram[i])
+			pr_info("	%u+ iterations: %llu\n", i ? (1u << i) : 0,
+					stats.histogram[i]);
+	}
+}
+
+static void cleanup(void)
+{
+	bib_put(db);
+	pool4db_put(pool);
+	bib_teardown();
+	rfc6056_teardown();
+}
+
+/**
+ * This is what happens when the user execs `sudo insmod pool4-benchmark.ko`.
+ */
+int init_module(void)
+{
+	int error = init();
+	if (error)
+		return error;
+	test();
+	print_histogram();
+	cleanup();
+	return 0;
+}
+
+/**
+ * This is what happens when the user execs `sudo rmmod pool4-benchmark`.
+ */
+void cleanup_module(void)
+{
+	/* No code. */
+}
@@ -0,0 +1,25 @@
+#!/bin/bash
+
+echo "Note: This will take up lots of CPU."
+echo "If this freezes, please wait a few minutes; it should come back."
+
+function test() {
+	echo "Testing $1 addresses with $2 ports each, max $3 iterations."
+	for i in {1..8}; do
+		echo "Test $i"
+		sudo insmod pool4-benchmark.ko RANGE_COUNT=$1 TADDRS_PER_RANGE=$2 MAX_ITERATIONS=$3 LEVELS=50,75,90,95,99
+		sudo rmmod pool4-benchmark
+		sudo dmesg -ct >> results-$1-$2-$3.txt
+	done
+}
+
+rm -f results*
+sudo dmesg -C
+
+test 1 64512 0
+test 4 64512 0
+test 16 64512 0
+test 1 64512 1024
+test 16 64512 1024
+
+echo "Test results written to result*.txt files."
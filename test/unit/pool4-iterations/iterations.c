@@ -219,7 +219,8 @@ static void new_connection(unsigned int request)
 	 * connection.
 	 */
 	memset(&route_args, 0, sizeof(route_args));
-	masks = mask_domain_find(pool, &tuple6, 11, &route_args);
+	masks = mask_domain_find(pool, &tuple6, 11, F_ALGORITHM_MD5,
+			&route_args);
 	if (!masks) {
 		iterations[request] = 0;
 		errors[request] = true;
@@ -250,7 +251,7 @@ static void new_connection(unsigned int request)
 		}
 	}
 
-	/* Destroy the masks object. (It belongs to the heap.) */
+	/* Return the masks object. (It belongs to pool4.) */
 	mask_domain_put(masks);
 }
 
@@ -517,6 +517,178 @@ static bool test_flush(void)
 	return success;
 }
 
+/**
+ * Lots of fragmented ranges, to stress the binary search.
+ */
+static bool test_fragmented(void)
+{
+	struct pool4_table *table;
+	struct pool4_range *range;
+	struct in_addr addr;
+	__u16 port;
+	bool success = true;
+
+	/* 192.0.2.1-3, even ports 0-98 only. */
+	for (port = 0; port < 100; port += 2) {
+		if (!add(0xc0000201U, 32, port, port))
+			return false;
+		if (!add(0xc0000202U, 31, port, port))
+			return false;
+	}
+
+	success &= assert_contains_range(0, 0, 0, 100, false);
+	success &= assert_contains_range(4, 4, 0, 100, false);
+	for (port = 0; port < 100; port += 2) {
+		success &= assert_contains_range(1, 3, port, port, true);
+		success &= assert_contains_range(1, 3, port + 1, port + 1,
+				false);
+	}
+
+	/* The mark table holds all three addresses, still sorted. */
+	table = find_by_mark(get_tree(&pool->tree_mark, L4PROTO_TCP), 1);
+	if (!ASSERT_BOOL(true, table != NULL, "mark table"))
+		return false;
+	success &= ASSERT_UINT(150, table->sample_count, "range count");
+
+	addr.s_addr = cpu_to_be32(0xc0000202U);
+	range = bsearch_range(first_table_entry(table), table->sample_count,
+			&addr, 40);
+	success &= ASSERT_BOOL(true, range != NULL, "bsearch 2#40");
+	if (range) {
+		success &= ASSERT_BE32(0xc0000202U, range->addr.s_addr,
+				"bsearch 2#40 addr");
+		success &= ASSERT_UINT(40, range->ports.min, "bsearch 2#40 port");
+	}
+	range = bsearch_range(first_table_entry(table), table->sample_count,
+			&addr, 41);
+	success &= ASSERT_BOOL(true, range == NULL, "bsearch 2#41");
+
+	pool4db_flush(pool);
+	return success;
+}
+
+static bool test_mark_index(void)
+{
+	struct pool4_entry_usr entry;
+	struct pool4_snapshot *snapshot;
+	struct pool4_table *table;
+	__u32 mark;
+	bool success = true;
+
+	entry.iterations = 0;
+	entry.flags = ITERATIONS_SET | ITERATIONS_INFINITE;
+	entry.proto = L4PROTO_UDP;
+	entry.range.prefix.address.s_addr = cpu_to_be32(0xc0000201U);
+	entry.range.prefix.len = 32;
+
+	/* Sparse marks, so some of them collide in the index. */
+	for (mark = 0; mark < 300; mark++) {
+		entry.mark = mark * 1000;
+		entry.range.ports.min = mark;
+		entry.range.ports.max = mark;
+		if (!ASSERT_INT(0, pool4db_add(pool, &entry), "add %u", mark))
+			return false;
+	}
+
+	rcu_read_lock();
+	snapshot = rcu_dereference(pool->snapshot);
+	success &= ASSERT_BOOL(true, snapshot->mark_index[L4PROTO_UDP] != NULL,
+			"UDP index");
+	success &= ASSERT_BOOL(true, snapshot->mark_index[L4PROTO_TCP] == NULL,
+			"TCP index");
+
+	for (mark = 0; mark < 300; mark++) {
+		table = find_snapshot_mark(snapshot, L4PROTO_UDP, mark * 1000);
+		if (!ASSERT_BOOL(true, table != NULL, "find %u", mark)) {
+			success = false;
+			continue;
+		}
+		success &= ASSERT_UINT(mark * 1000, table->mark, "mark %u", mark);
+		success &= ASSERT_UINT(mark, first_table_entry(table)->ports.min,
+				"port %u", mark);
+	}
+
+	table = find_snapshot_mark(snapshot, L4PROTO_UDP, 1);
+	success &= ASSERT_BOOL(true, table == NULL, "absent mark");
+	table = find_snapshot_mark(snapshot, L4PROTO_TCP, 1000);
+	success &= ASSERT_BOOL(true, table == NULL, "other protocol");
+	rcu_read_unlock();
+
+	pool4db_flush(pool);
+	return success;
+}
+
+static unsigned int balance_used[4];
+
+static unsigned int get_used(const struct in_addr *addr, void *arg)
+{
+	return balance_used[be32_to_cpu(addr->s_addr) & 3];
+}
+
+static bool assert_balanced(__u32 expected, char *test_name)
+{
+	struct route4_args route_args;
+	struct tuple tuple6;
+	struct mask_domain *masks;
+	struct ipv4_transport_addr addr;
+	bool consecutive;
+	bool success = true;
+
+	memset(&route_args, 0, sizeof(route_args));
+	route_args.mark = 1;
+	memset(&tuple6, 0, sizeof(tuple6));
+	tuple6.l3_proto = L3PROTO_IPV6;
+	tuple6.l4_proto = L4PROTO_TCP;
+
+	masks = mask_domain_find(pool, &tuple6, 0, 0, &route_args);
+	if (!ASSERT_BOOL(true, masks != NULL, "%s: domain", test_name))
+		return false;
+
+	mask_domain_balance(masks, get_used, NULL);
+	success &= ASSERT_INT(0, mask_domain_next(masks, &addr, &consecutive),
+			"%s: next", test_name);
+	success &= ASSERT_BE32(expected, addr.l3.s_addr, "%s: address",
+			test_name);
+	success &= ASSERT_UINT(1, addr.l4, "%s: port", test_name);
+
+	mask_domain_put(masks);
+	return success;
+}
+
+static bool test_balance(void)
+{
+	bool success = true;
+
+	/* 192.0.2.1 has 20 ports, 192.0.2.2 and 192.0.2.3 have 10 each. */
+	if (!add(0xc0000201U, 32, 1, 20))
+		return false;
+	if (!add(0xc0000202U, 31, 1, 10))
+		return false;
+
+	/* Nobody's used anything; F()'s choice stays. */
+	memset(balance_used, 0, sizeof(balance_used));
+	success &= assert_balanced(0xc0000201U, "empty");
+
+	balance_used[1] = 5;
+	balance_used[2] = 1;
+	balance_used[3] = 3;
+	success &= assert_balanced(0xc0000202U, "least used");
+
+	/* 4 out of 20 is better than 3 out of 10. */
+	balance_used[1] = 4;
+	balance_used[2] = 3;
+	balance_used[3] = 3;
+	success &= assert_balanced(0xc0000201U, "relative");
+
+	balance_used[1] = 10;
+	balance_used[2] = 6;
+	balance_used[3] = 3;
+	success &= assert_balanced(0xc0000203U, "last address");
+
+	pool4db_flush(pool);
+	return success;
+}
+
 static int init(void)
 {
 	pool = pool4db_alloc();
@@ -537,6 +709,8 @@ static void clean(void)
 {
 	put_net(ns);
 	pool4db_put(pool);
+	/* The old snapshots are freed by this module's code. */
+	rcu_barrier();
 }
 
 int init_module(void)
@@ -558,6 +732,9 @@ int init_module(void)
 	test_group_test(&test, test_add, "Add");
 	test_group_test(&test, test_rm, "Rm");
 	test_group_test(&test, test_flush, "Flush");
+	test_group_test(&test, test_fragmented, "Fragmented ranges");
+	test_group_test(&test, test_mark_index, "Mark index");
+	test_group_test(&test, test_balance, "Balanced selection");
 
 	return test_group_end(&test);
 }
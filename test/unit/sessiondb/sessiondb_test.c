@@ -62,7 +62,7 @@ static bool session_exists(struct session_entry *session)
 	};
 
 	/* This is the closest we currently have to a find_session function. */
-	return bib_foreach_session(db, session->proto, &func, NULL);
+	return bib_foreach_session(db, session->proto, &func, NULL, NULL);
 }
 
 static bool assert_session(unsigned int la, unsigned int lp,
@@ -103,11 +103,10 @@ static bool test_db(void)
 	return success;
 }
 
-static bool inject(unsigned int index, __u32 src_addr, __u16 src_id,
-		__u32 dst_addr, __u16 dst_id)
+static struct session_entry *init_session(unsigned int index, __u32 src_addr,
+		__u16 src_id, __u32 dst_addr, __u16 dst_id)
 {
 	struct session_entry *entry;
-	int error;
 
 	entry = &session_instances[index];
 	sessions[src_addr][src_id][dst_addr][dst_id] = entry;
@@ -123,6 +122,16 @@ static bool inject(unsigned int index, __u32 src_addr, __u16 src_id,
 	entry->timeout = UDP_DEFAULT;
 	entry->has_stored = false;
 
+	return entry;
+}
+
+static bool inject(unsigned int index, __u32 src_addr, __u16 src_id,
+		__u32 dst_addr, __u16 dst_id)
+{
+	struct session_entry *entry;
+	int error;
+
+	entry = init_session(index, src_addr, src_id, dst_addr, dst_id);
 	error = bib_add_session(db, entry, NULL);
 	if (error) {
 		log_err("Errcode %d on sessiontable_add.", error);
@@ -185,6 +194,7 @@ static bool simple_session(void)
 	range.ports.min = 1;
 	range.ports.max = 1;
 	bib_rm_range(db, PROTO, &range);
+	bib_rm_range_wait();
 
 	sessions[1][1][2][2] = NULL;
 	sessions[1][1][2][1] = NULL;
@@ -196,6 +206,7 @@ static bool simple_session(void)
 
 	log_debug("Deleting again.");
 	bib_rm_range(db, PROTO, &range);
+	bib_rm_range_wait();
 	success &= test_db();
 
 	/* ---------------------------------------------------------- */
@@ -212,6 +223,7 @@ static bool simple_session(void)
 	range.ports.min = 0;
 	range.ports.max = 1;
 	bib_rm_range(db, PROTO, &range);
+	bib_rm_range_wait();
 
 	sessions[2][1][2][1] = NULL;
 	sessions[2][1][1][1] = NULL;
@@ -237,6 +249,7 @@ static bool simple_session(void)
 	range.ports.min = 0;
 	range.ports.max = 65535;
 	bib_rm_range(db, PROTO, &range);
+	bib_rm_range_wait();
 
 	sessions[1][2][2][2] = NULL;
 	sessions[1][1][2][2] = NULL;
@@ -254,6 +267,123 @@ static bool simple_session(void)
 	return success;
 }
 
+static bool add_batch(struct bib_batch_session *batch, unsigned int count)
+{
+	unsigned int i;
+	bool success = true;
+
+	memset(batch, 0, count * sizeof(*batch));
+	for (i = 0; i < count; i++)
+		batch[i].session = &session_instances[i];
+
+	bib_add_sessions(db, batch, count);
+
+	for (i = 0; i < count; i++)
+		success &= ASSERT_INT(0, batch[i].error, "batch result %u", i);
+	return success;
+}
+
+static bool batch_sessions(void)
+{
+	struct bib_batch_session batch[8];
+	unsigned int i;
+	bool success = true;
+
+	memset(session_instances, 0, sizeof(session_instances));
+	memset(sessions, 0, sizeof(sessions));
+
+	/* Sessions from several BIB entries, out of order. */
+	init_session(0, 1, 2, 2, 2);
+	init_session(1, 2, 1, 2, 1);
+	init_session(2, 1, 2, 1, 1);
+	init_session(3, 2, 2, 2, 2);
+	init_session(4, 1, 1, 2, 2);
+	init_session(5, 2, 1, 1, 1);
+	init_session(6, 1, 2, 1, 2);
+	init_session(7, 2, 2, 1, 1);
+
+	success &= add_batch(batch, ARRAY_SIZE(batch));
+	success &= test_db();
+
+	/* Again; the sessions already exist, so this should change nothing. */
+	success &= add_batch(batch, ARRAY_SIZE(batch));
+	success &= test_db();
+
+	/* A batch that fails halfway shouldn't affect the rest. */
+	success &= flush();
+	init_session(0, 1, 2, 2, 2);
+	init_session(1, 1, 1, 1, 1);
+	session_instances[1].proto = L4PROTO_OTHER;
+	sessions[1][1][1][1] = NULL;
+	init_session(2, 2, 1, 1, 2);
+
+	memset(batch, 0, sizeof(batch));
+	for (i = 0; i < 3; i++)
+		batch[i].session = &session_instances[i];
+	bib_add_sessions(db, batch, 3);
+	for (i = 0; i < 3; i++) {
+		success &= ASSERT_INT(batch[i].session == &session_instances[1]
+				? -EINVAL : 0, batch[i].error,
+				"batch result %u", i);
+	}
+	success &= test_db();
+
+	success &= flush();
+	return success;
+}
+
+static bool assert_timers(__u64 est, __u64 trans)
+{
+	struct bib_stats_usr stats;
+	bool success = true;
+
+	if (!ASSERT_INT(0, bib_stats(db, PROTO, &stats), "bib_stats()"))
+		return false;
+
+	success &= ASSERT_U64(est, stats.est_sessions, "est sessions");
+	success &= ASSERT_U64(trans, stats.trans_sessions, "short sessions");
+	return success;
+}
+
+static bool short_lived_udp(void)
+{
+	struct bib_config config;
+	struct ipv6_transport_addr dst6;
+	struct tuple tuple4;
+	struct bib_session result;
+	bool success = true;
+
+	bib_config_copy(db, &config);
+	config.udp_short.ports[0] = 53;
+	config.udp_short.count = 1;
+	bib_config_set(db, &config);
+
+	memset(session_instances, 0, sizeof(session_instances));
+	memset(sessions, 0, sizeof(sessions));
+	success &= inject(0, 1, 1, 1, 1);
+	success &= assert_timers(1, 0);
+
+	/* Same BIB entry, but the remote port is a short-lived one. */
+	init_dst6(&dst6, 1, 53);
+	init_dst4(&tuple4.src.addr4, 1, 53);
+	init_src4(&tuple4.dst.addr4, 1, 1);
+	tuple4.l3_proto = L3PROTO_IPV4;
+	tuple4.l4_proto = PROTO;
+	success &= ASSERT_INT(0, bib_add4(db, &dst6, &tuple4, 0, &result),
+			"bib_add4()");
+	success &= assert_timers(1, 1);
+
+	/* Refreshing it shouldn't send it to the long timer. */
+	success &= ASSERT_INT(0, bib_add4(db, &dst6, &tuple4, 0, &result),
+			"bib_add4() again");
+	success &= assert_timers(1, 1);
+
+	config.udp_short.count = 0;
+	bib_config_set(db, &config);
+	success &= flush();
+	return success;
+}
+
 enum session_fate tcp_est_expire_cb(struct session_entry *session, void *arg)
 {
 	return FATE_RM;
@@ -261,7 +391,7 @@ enum session_fate tcp_est_expire_cb(struct session_entry *session, void *arg)
 
 static int init(void)
 {
-	db = bib_alloc();
+	db = bib_alloc(NULL, NULL);
 	return db ? 0 : -ENOMEM;
 }
 
@@ -284,6 +414,8 @@ int init_module(void)
 		return -EINVAL;
 
 	test_group_test(&test, simple_session, "Single Session");
+	test_group_test(&test, batch_sessions, "Batched Addition");
+	test_group_test(&test, short_lived_udp, "Short-lived UDP");
 
 	return test_group_end(&test);
 }
@@ -200,25 +200,32 @@ static bool test_function_icmp4_to_icmp6_param_prob(void)
 
 static bool test_function_generate_ipv4_id(void)
 {
+	struct iphdr hdr4;
 	struct frag_hdr hdr;
 	__be16 attempt_1, attempt_2, attempt_3;
 	bool success = true;
 
-	attempt_1 = generate_ipv4_id(NULL);
-	attempt_2 = generate_ipv4_id(NULL);
-	attempt_3 = generate_ipv4_id(NULL);
+	memset(&hdr4, 0, sizeof(hdr4));
+	hdr4.saddr = cpu_to_be32(0xc0000201U);
+	hdr4.daddr = cpu_to_be32(0xc6336402U);
+	hdr4.protocol = IPPROTO_UDP;
+
+	attempt_1 = generate_ipv4_id(&hdr4, NULL);
+	attempt_2 = generate_ipv4_id(&hdr4, NULL);
+	attempt_3 = generate_ipv4_id(&hdr4, NULL);
 	/*
-	 * At least one of the attempts should be nonzero,
-	 * otherwise the random would be sucking major ****.
+	 * Same destination, (probably) same CPU and jiffy, so the same
+	 * counter. It should not repeat itself.
 	 */
-	success &= ASSERT_BOOL(true, (attempt_1 | attempt_2 | attempt_3) != 0, "No frag");
+	success &= ASSERT_BOOL(true, attempt_1 != attempt_2, "No frag 1-2");
+	success &= ASSERT_BOOL(true, attempt_2 != attempt_3, "No frag 2-3");
 
 	hdr.identification = 0;
-	success &= ASSERT_BE16(0, generate_ipv4_id(&hdr), "Simplest id");
+	success &= ASSERT_BE16(0, generate_ipv4_id(&hdr4, &hdr), "Simplest id");
 	hdr.identification = cpu_to_be32(0x0000abcdU);
-	success &= ASSERT_BE16(0xabcd, generate_ipv4_id(&hdr), "No overflow");
+	success &= ASSERT_BE16(0xabcd, generate_ipv4_id(&hdr4, &hdr), "No overflow");
 	hdr.identification = cpu_to_be32(0x12345678U);
-	success &= ASSERT_BE16(0x5678, generate_ipv4_id(&hdr), "Overflow");
+	success &= ASSERT_BE16(0x5678, generate_ipv4_id(&hdr4, &hdr), "Overflow");
 
 	return success;
 }
@@ -252,6 +259,46 @@ static bool test_function_generate_df_flag(void)
  * But that'd be testing the header iterator, not the build_protocol_field() function.
  * Please look elsewhere for that.
  */
+/**
+ * Copies the first @len bytes of @hdr6 into a fresh skb, and runs
+ * pkt_init_ipv6() on it, since that's what walks the extension headers now.
+ * Remember to kfree_skb(pkt->skb) on success.
+ */
+static int init_pkt6(struct packet *pkt, struct ipv6hdr *hdr6, size_t len)
+{
+	struct sk_buff *skb;
+	int error;
+
+	skb = alloc_skb(len, GFP_ATOMIC);
+	if (!skb) {
+		log_err("Could not allocate a test packet.");
+		return -ENOMEM;
+	}
+	skb_put(skb, len);
+	skb_reset_network_header(skb);
+	memcpy(skb->data, hdr6, len);
+	ipv6_hdr(skb)->payload_len = cpu_to_be16(len - sizeof(*hdr6));
+
+	error = pkt_init_ipv6(pkt, skb);
+	if (error)
+		kfree_skb(skb);
+	return error;
+}
+
+static bool test_protocol_field(struct ipv6hdr *hdr6, size_t len,
+		__u8 expected, char *test_name)
+{
+	struct packet pkt;
+	bool success;
+
+	if (!ASSERT_INT(0, init_pkt6(&pkt, hdr6, len), "%s - pkt", test_name))
+		return false;
+	success = ASSERT_UINT(expected, ttp64_xlat_proto(&pkt), "%s",
+			test_name);
+	kfree_skb(pkt.skb);
+	return success;
+}
+
 static bool test_function_build_protocol_field(void)
 {
 	struct ipv6hdr *ip6_hdr;
@@ -259,22 +306,25 @@ static bool test_function_build_protocol_field(void)
 	struct ipv6_opt_hdr *routing_hdr;
 	struct ipv6_opt_hdr *dest_options_hdr;
 	struct icmp6hdr *icmp6_hdr;
+	struct tcphdr *tcp_hdr;
+	bool success = true;
 
-	ip6_hdr = kmalloc(sizeof(*ip6_hdr) + 8 + 16 + 24 + sizeof(struct tcphdr), GFP_ATOMIC);
+	ip6_hdr = kzalloc(sizeof(*ip6_hdr) + 8 + 16 + 24 + sizeof(struct tcphdr), GFP_ATOMIC);
 	if (!ip6_hdr) {
 		log_err("Could not allocate a test packet.");
-		goto failure;
+		return false;
 	}
 
 	/* Just ICMP. */
 	ip6_hdr->nexthdr = NEXTHDR_ICMP;
-	ip6_hdr->payload_len = cpu_to_be16(sizeof(*icmp6_hdr));
-	if (!ASSERT_UINT(IPPROTO_ICMP, ttp64_xlat_proto(ip6_hdr), "Just ICMP"))
-		goto failure;
+	icmp6_hdr = (struct icmp6hdr *) (ip6_hdr + 1);
+	icmp6_hdr->icmp6_type = ICMPV6_ECHO_REQUEST;
+	success &= test_protocol_field(ip6_hdr,
+			sizeof(*ip6_hdr) + sizeof(*icmp6_hdr),
+			IPPROTO_ICMP, "Just ICMP");
 
 	/* Skippable headers then ICMP. */
 	ip6_hdr->nexthdr = NEXTHDR_HOP;
-	ip6_hdr->payload_len = cpu_to_be16(8 + 16 + 24 + sizeof(*icmp6_hdr));
 
 	hop_by_hop_hdr = (struct ipv6_opt_hdr *) (ip6_hdr + 1);
 	hop_by_hop_hdr->nexthdr = NEXTHDR_ROUTING;
@@ -288,21 +338,43 @@ static bool test_function_build_protocol_field(void)
 	dest_options_hdr->nexthdr = NEXTHDR_ICMP;
 	dest_options_hdr->hdrlen = 2;
 
-	if (!ASSERT_UINT(IPPROTO_ICMP, ttp64_xlat_proto(ip6_hdr), "Skippable then ICMP"))
-		goto failure;
+	icmp6_hdr = (struct icmp6hdr *) (((unsigned char *) dest_options_hdr) + 24);
+	icmp6_hdr->icmp6_type = ICMPV6_ECHO_REQUEST;
+	success &= test_protocol_field(ip6_hdr,
+			sizeof(*ip6_hdr) + 8 + 16 + 24 + sizeof(*icmp6_hdr),
+			IPPROTO_ICMP, "Skippable then ICMP");
 
 	/* Skippable headers then something else */
 	dest_options_hdr->nexthdr = NEXTHDR_TCP;
-	ip6_hdr->payload_len = cpu_to_be16(8 + 16 + 24 + sizeof(struct tcphdr));
-	if (!ASSERT_UINT(IPPROTO_TCP, ttp64_xlat_proto(ip6_hdr), "Skippable then TCP"))
-		goto failure;
+	tcp_hdr = (struct tcphdr *) icmp6_hdr;
+	memset(tcp_hdr, 0, sizeof(*tcp_hdr));
+	tcp_hdr->doff = sizeof(*tcp_hdr) / 4;
+	success &= test_protocol_field(ip6_hdr,
+			sizeof(*ip6_hdr) + 8 + 16 + 24 + sizeof(*tcp_hdr),
+			IPPROTO_TCP, "Skippable then TCP");
 
 	kfree(ip6_hdr);
-	return true;
+	return success;
+}
 
-failure:
-	kfree(ip6_hdr);
-	return false;
+static bool test_segments_left(struct ipv6hdr *hdr6, size_t len,
+		bool expected, __u32 expected_offset, char *test_name)
+{
+	struct packet pkt;
+	__u32 offset;
+	bool success;
+
+	if (!ASSERT_INT(0, init_pkt6(&pkt, hdr6, len), "%s - pkt", test_name))
+		return false;
+
+	success = ASSERT_BOOL(expected, has_nonzero_segments_left(&pkt, &offset),
+			"%s - result", test_name);
+	if (expected)
+		success &= ASSERT_UINT(expected_offset, offset, "%s - offset",
+				test_name);
+
+	kfree_skb(pkt.skb);
+	return success;
 }
 
 static bool test_function_has_nonzero_segments_left(void)
@@ -310,20 +382,21 @@ static bool test_function_has_nonzero_segments_left(void)
 	struct ipv6hdr *ip6_hdr;
 	struct ipv6_rt_hdr *routing_hdr;
 	struct frag_hdr *fragment_hdr;
-	__u32 offset;
-
+	/* The routing header has to be 8 bytes long to be legal. */
+	const size_t rt_len = 8;
 	bool success = true;
 
-	ip6_hdr = kmalloc(sizeof(*ip6_hdr) + sizeof(*fragment_hdr) + sizeof(*routing_hdr), GFP_ATOMIC);
+	ip6_hdr = kzalloc(sizeof(*ip6_hdr) + sizeof(*fragment_hdr) + rt_len,
+			GFP_ATOMIC);
 	if (!ip6_hdr) {
 		log_err("Could not allocate a test packet.");
 		return false;
 	}
-	ip6_hdr->payload_len = cpu_to_be16(sizeof(*fragment_hdr) + sizeof(*routing_hdr));
 
 	/* No extension headers. */
-	ip6_hdr->nexthdr = NEXTHDR_TCP;
-	success &= ASSERT_BOOL(false, has_nonzero_segments_left(ip6_hdr, &offset), "No extension headers");
+	ip6_hdr->nexthdr = NEXTHDR_NONE;
+	success &= test_segments_left(ip6_hdr, sizeof(*ip6_hdr), false, 0,
+			"No extension headers");
 
 	if (!success)
 		goto end;
@@ -331,16 +404,18 @@ static bool test_function_has_nonzero_segments_left(void)
 	/* Routing header with nonzero segments left. */
 	ip6_hdr->nexthdr = NEXTHDR_ROUTING;
 	routing_hdr = (struct ipv6_rt_hdr *) (ip6_hdr + 1);
+	routing_hdr->nexthdr = NEXTHDR_NONE;
 	routing_hdr->segments_left = 12;
-	success &= ASSERT_BOOL(true, has_nonzero_segments_left(ip6_hdr, &offset), "Nonzero left - result");
-	success &= ASSERT_UINT(40 + 3, offset, "Nonzero left - offset");
+	success &= test_segments_left(ip6_hdr, sizeof(*ip6_hdr) + rt_len,
+			true, 40 + 3, "Nonzero left");
 
 	if (!success)
 		goto end;
 
 	/* Routing header with zero segments left. */
 	routing_hdr->segments_left = 0;
-	success &= ASSERT_BOOL(false, has_nonzero_segments_left(ip6_hdr, &offset), "Zero left");
+	success &= test_segments_left(ip6_hdr, sizeof(*ip6_hdr) + rt_len,
+			false, 0, "Zero left");
 
 	if (!success)
 		goto end;
@@ -351,11 +426,15 @@ static bool test_function_has_nonzero_segments_left(void)
 	 */
 	ip6_hdr->nexthdr = NEXTHDR_FRAGMENT;
 	fragment_hdr = (struct frag_hdr *) (ip6_hdr + 1);
+	memset(fragment_hdr, 0, sizeof(*fragment_hdr));
 	fragment_hdr->nexthdr = NEXTHDR_ROUTING;
 	routing_hdr = (struct ipv6_rt_hdr *) (fragment_hdr + 1);
+	routing_hdr->nexthdr = NEXTHDR_NONE;
+	routing_hdr->hdrlen = 0;
 	routing_hdr->segments_left = 24;
-	success &= ASSERT_BOOL(true, has_nonzero_segments_left(ip6_hdr, &offset), "Two headers - result");
-	success &= ASSERT_UINT(40 + 8 + 3, offset, "Two headers - offset");
+	success &= test_segments_left(ip6_hdr,
+			sizeof(*ip6_hdr) + sizeof(*fragment_hdr) + rt_len,
+			true, 40 + 8 + 3, "Two headers");
 
 	/* Fall through. */
 end:
@@ -374,15 +453,78 @@ static bool test_function_icmp4_minimum_mtu(void)
 	return success;
 }
 
+static bool test_function_clamp_mss(void)
+{
+	struct xlation state = { .jool.global = config };
+	struct {
+		struct tcphdr hdr;
+		/* The MSS starts on an odd byte, to test the checksum. */
+		unsigned char opts[8];
+	} seg;
+	unsigned char opts[8] = { TCPOPT_NOP, TCPOPT_MSS, TCPOLEN_MSS,
+			0x05, 0xb4, TCPOPT_NOP, TCPOPT_NOP, TCPOPT_EOL };
+	bool success = true;
+
+	state.in.skb = alloc_skb(0, GFP_KERNEL);
+	if (!state.in.skb)
+		return false;
+	state.in.skb->ip_summed = CHECKSUM_NONE;
+
+	memset(&seg.hdr, 0, sizeof(seg.hdr));
+	seg.hdr.doff = sizeof(seg) >> 2;
+	seg.hdr.syn = 1;
+	memcpy(seg.opts, opts, sizeof(opts));
+	seg.hdr.check = csum_fold(csum_partial(&seg, sizeof(seg), 0));
+
+	/* Disabled. */
+	config->cfg.mss_clamp = 0;
+	ttpcomm_clamp_mss(&state, &seg.hdr);
+	success &= ASSERT_UINT(1460, get_unaligned_be16(&seg.opts[2]), "disabled");
+
+	/* Already small enough. */
+	config->cfg.mss_clamp = 1500;
+	ttpcomm_clamp_mss(&state, &seg.hdr);
+	success &= ASSERT_UINT(1460, get_unaligned_be16(&seg.opts[2]), "fits");
+
+	/* Too big. */
+	config->cfg.mss_clamp = 1280;
+	ttpcomm_clamp_mss(&state, &seg.hdr);
+	success &= ASSERT_UINT(1220, get_unaligned_be16(&seg.opts[2]), "clamped");
+	success &= ASSERT_UINT(0, csum_fold(csum_partial(&seg, sizeof(seg), 0)),
+			"checksum");
+
+	/* Not a SYN. */
+	seg.hdr.syn = 0;
+	config->cfg.mss_clamp = 576;
+	ttpcomm_clamp_mss(&state, &seg.hdr);
+	success &= ASSERT_UINT(1220, get_unaligned_be16(&seg.opts[2]), "no SYN");
+
+	config->cfg.mss_clamp = DEFAULT_MSS_CLAMP;
+	kfree_skb(state.in.skb);
+	return success;
+}
+
 static int setup(void)
 {
+	int error;
+
+	error = ttp64_setup();
+	if (error)
+		return error;
+
 	config = config_alloc();
-	return config ? 0 : -ENOMEM;
+	if (!config) {
+		ttp64_teardown();
+		return -ENOMEM;
+	}
+
+	return 0;
 }
 
 static void teardown(void)
 {
 	config_put(config);
+	ttp64_teardown();
 }
 
 int init_module(void)
@@ -407,6 +549,7 @@ int init_module(void)
 	test_group_test(&test, test_function_build_protocol_field, "Build protocol function");
 	test_group_test(&test, test_function_has_nonzero_segments_left, "Segments left indicator function");
 	test_group_test(&test, test_function_icmp4_minimum_mtu, "ICMP4 Minimum MTU function");
+	test_group_test(&test, test_function_clamp_mss, "MSS clamping function");
 
 	return test_group_end(&test);
 }
@@ -105,6 +105,33 @@ static const struct argp_option instance_opt = {
 		.group = 0,
 };
 
+static const struct argp_option xdp_opt = {
+		.name = OPTNAME_XDP,
+		.key = ARGP_XDP,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "The command will operate on the maps of the XDP fast path.",
+		.group = 0,
+};
+
+static const struct argp_option stats_opt = {
+		.name = OPTNAME_STATS,
+		.key = ARGP_STATS,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "The command will operate on the translator's counters.",
+		.group = 0,
+};
+
+static const struct argp_option events_opt = {
+		.name = OPTNAME_EVENTS,
+		.key = ARGP_EVENTS,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "The command will print the BIB and session events streamed by --logging-stream.",
+		.group = 0,
+};
+
 static const struct argp_option display_opt = {
 		.name = OPTNAME_DISPLAY,
 		.key = ARGP_DISPLAY,
@@ -213,6 +240,15 @@ static const struct argp_option max_iterations_opt = {
 		.group = 0,
 };
 
+static const struct argp_option usage_opt = {
+		.name = "usage",
+		.key = ARGP_USAGE,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "Print how much of each address is in use, and how the searches for free ports have been going.",
+		.group = 0,
+};
+
 static const struct argp_option force_opt = {
 		.name = "force",
 		.key = ARGP_FORCE,
@@ -259,6 +295,232 @@ static const struct argp_option numeric_opt = {
 		.group = 0,
 };
 
+static const struct argp_option filter_src6_opt = {
+		.name = "src6",
+		.key = ARGP_FILTER_SRC6,
+		.arg = PREFIX6_FORMAT,
+		.flags = 0,
+		.doc = "Only display the entries whose IPv6 address belongs to "
+				"this prefix. (BIB and session display only.)",
+		.group = 0,
+};
+
+static const struct argp_option filter_src4_opt = {
+		.name = "src4",
+		.key = ARGP_FILTER_SRC4,
+		.arg = PREFIX4_FORMAT,
+		.flags = 0,
+		.doc = "Only display the entries whose IPv4 address belongs to "
+				"this prefix. (BIB and session display only.)",
+		.group = 0,
+};
+
+static const struct argp_option filter_src4_ports_opt = {
+		.name = "src4-ports",
+		.key = ARGP_FILTER_SRC4_PORTS,
+		.arg = "NUM[-NUM]",
+		.flags = 0,
+		.doc = "Only display the entries whose IPv4 port belongs to "
+				"this range. (BIB and session display only.)",
+		.group = 0,
+};
+
+static const struct argp_option filter_dst4_opt = {
+		.name = "dst4",
+		.key = ARGP_FILTER_DST4,
+		.arg = PREFIX4_FORMAT,
+		.flags = 0,
+		.doc = "Only display the sessions whose remote IPv4 address "
+				"belongs to this prefix.",
+		.group = 0,
+};
+
+static const struct argp_option filter_state_opt = {
+		.name = "state",
+		.key = ARGP_FILTER_STATE,
+		.arg = "STATE[,STATE]*",
+		.flags = 0,
+		.doc = "Only display the TCP sessions in these states.",
+		.group = 0,
+};
+
+static const struct argp_option filter_min_age_opt = {
+		.name = "min-age",
+		.key = ARGP_FILTER_MIN_AGE,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Only display the sessions that haven't seen traffic in "
+				"this many milliseconds.",
+		.group = 0,
+};
+
+static const struct argp_option export_opt = {
+		.name = "export",
+		.key = ARGP_EXPORT,
+		.arg = "FILE",
+		.flags = 0,
+		.doc = "Write the table into FILE ('-' is standard output), in "
+				"a binary format --import can read back.",
+		.group = 0,
+};
+
+static const struct argp_option import_opt = {
+		.name = "import",
+		.key = ARGP_IMPORT,
+		.arg = "FILE",
+		.flags = 0,
+		.doc = "Add the entries of FILE ('-' is standard input), which "
+				"is the output of an --export.",
+		.group = 0,
+};
+
+static const struct argp_option follow_opt = {
+		.name = "follow",
+		.key = ARGP_FOLLOW,
+		.arg = "SEQ",
+		.flags = OPTION_ARG_OPTIONAL,
+		.doc = "Print the BIB and session changes as they happen, "
+				"starting after change number SEQ (default: now). "
+				"Needs the change_log_size module parameter.",
+		.group = 0,
+};
+
+static const struct argp_option snapshot_opt = {
+		.name = "snapshot",
+		.key = ARGP_SNAPSHOT,
+		.arg = "FILE",
+		.flags = 0,
+		.doc = "Export the sessions into FILE before removing the "
+				"instance.",
+		.group = 0,
+};
+
+static const struct argp_option restore_opt = {
+		.name = "restore",
+		.key = ARGP_RESTORE,
+		.arg = "FILE",
+		.flags = 0,
+		.doc = "Import the sessions of FILE (a --snapshot) right after "
+				"adding the instance.",
+		.group = 0,
+};
+
+static const struct argp_option share_tables_opt = {
+		.name = "share-tables",
+		.key = ARGP_SHARE_TABLES,
+		.arg = "NAME",
+		.flags = 0,
+		.doc = "Make the new instance use the same pool6 (and EAMT and "
+				"blacklist4, in SIIT) as the other instances added "
+				"with the same NAME.",
+		.group = 0,
+};
+
+static const struct argp_option from_opt = {
+		.name = "from",
+		.key = ARGP_FROM,
+		.arg = "NETNS",
+		.flags = 0,
+		.doc = "Make the new instance a copy of the one in namespace "
+				"NETNS (a name from /var/run/netns, or a path).",
+		.group = 0,
+};
+
+static const struct argp_option bulk_opt = {
+		.name = "bulk",
+		.key = ARGP_BULK,
+		.arg = "FILE",
+		.flags = 0,
+		.doc = "Add or remove all the static BIB entries listed in FILE "
+				"(one '<IPv6 transport address> <IPv4 transport "
+				"address>' per line; '-' is standard input).",
+		.group = 0,
+};
+
+static const struct argp_option policy_opt = {
+		.name = "policy",
+		.key = ARGP_POLICY,
+		.arg = "PATH",
+		.flags = 0,
+		.doc = "Make the socket filter BPF program pinned at PATH decide "
+				"which IPv6 packets get BIB entries and sessions "
+				"('none' removes the current one).",
+		.group = 0,
+};
+
+static const struct argp_option top_opt = {
+		.name = "top",
+		.key = ARGP_TOP,
+		.arg = "N",
+		.flags = 0,
+		.doc = "Print the N groups of BIB entries that hold the most "
+				"ports instead of the count. Available on BIB count "
+				"operation only.",
+		.group = 0,
+};
+
+static const struct argp_option top_by_opt = {
+		.name = "top-by",
+		.key = ARGP_TOP_BY,
+		.arg = "src6[/LEN]|src4[/LEN]",
+		.flags = 0,
+		.doc = "Group the --top entries by the first LEN bits of their "
+				"IPv6 or IPv4 address. (Default: src6/128.)",
+		.group = 0,
+};
+
+static const struct argp_option top_sessions_opt = {
+		.name = "top-sessions",
+		.key = ARGP_TOP_SESSIONS,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "Rank the --top groups by session count instead.",
+		.group = 0,
+};
+
+static const struct argp_option details_opt = {
+		.name = "details",
+		.key = ARGP_DETAILS,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "Also print the shape of the tables and how contended "
+				"their locks are. Available on BIB count operation "
+				"only.",
+		.group = 0,
+};
+
+static const struct argp_option counters_opt = {
+		.name = "counters",
+		.key = ARGP_COUNTERS,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "Also print how many packets (and bytes) each entry has "
+				"translated. Available on EAMT and session display "
+				"operations only.",
+		.group = 0,
+};
+
+static const struct argp_option reset_counters_opt = {
+		.name = "reset-counters",
+		.key = ARGP_RESET_COUNTERS,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "Print the EAMT's counters, then zero them. Available on "
+				"EAMT display operation only.",
+		.group = 0,
+};
+
+static const struct argp_option watch_opt = {
+		.name = "watch",
+		.key = ARGP_WATCH,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Print the counters again every this many seconds, until "
+				"interrupted. Available on stats display operation "
+				"only.",
+		.group = 0,
+};
+
 static const struct argp_option csv_opt = {
 		.name = "csv",
 		.key = ARGP_CSV,
@@ -269,6 +531,16 @@ static const struct argp_option csv_opt = {
 		.group = 0,
 };
 
+static const struct argp_option jsonl_opt = {
+		.name = "jsonl",
+		.key = ARGP_JSONL,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "Print one JSON object per entry, one per line. Available "
+				"on BIB and session display only.",
+		.group = 0,
+};
+
 static const struct argp_option no_hdr_opt = {
 		.name = "no-headers",
 		.key = ARGP_NO_HEADERS,
@@ -352,6 +624,57 @@ static const struct argp_option plateaus_opt = {
 		.group = 0,
 };
 
+static const struct argp_option debug_opt = {
+		.name = OPTNAME_DEBUG,
+		.key = ARGP_DEBUG,
+		.arg = BOOL_FORMAT,
+		.flags = 0,
+		.doc = "Record packet snapshots and print debug messages? "
+				"(The latter also need a module compiled with "
+				"'make debug'.)\n",
+		.group = 0,
+};
+
+static const struct argp_option latency_sampling_opt = {
+		.name = OPTNAME_LATENCY_SAMPLING,
+		.key = ARGP_LATENCY_SAMPLING,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Measure the latency of each translation stage for one out "
+				"of this many packets. (0 = never)\n",
+		.group = 0,
+};
+
+static const struct argp_option mirror_sampling_opt = {
+		.name = OPTNAME_MIRROR_SAMPLING,
+		.key = ARGP_MIRROR_SAMPLING,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Hand the headers of one out of this many packets to the "
+				"jool_mirror tracepoint. (0 = never)\n",
+		.group = 0,
+};
+
+static const struct argp_option packet_budget_opt = {
+		.name = OPTNAME_PACKET_BUDGET,
+		.key = ARGP_PACKET_BUDGET,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum number of packets the instance can "
+				"translate per second per CPU. (0 = unlimited)\n",
+		.group = 0,
+};
+
+static const struct argp_option mss_clamp_opt = {
+		.name = OPTNAME_MSS_CLAMP,
+		.key = ARGP_MSS_CLAMP,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Lower the MSS of translated TCP SYNs so the segments fit "
+				"in packets of this many bytes. (0 = never)\n",
+		.group = 0,
+};
+
 static const struct argp_option adf_opt = {
 		.name = OPTNAME_DROP_BY_ADDR,
 		.key = ARGP_DROP_ADDR,
@@ -390,6 +713,27 @@ static const struct argp_option ttl_udp_opt = {
 		.group = 0,
 };
 
+static const struct argp_option ttl_udp_short_opt = {
+		.name = OPTNAME_UDP_SHORT_TIMEOUT,
+		.key = ARGP_UDP_SHORT_TO,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the lifetime of the UDP sessions whose remote port is "
+				"short-lived (in seconds).\n",
+		.group = 0,
+};
+
+static const struct argp_option udp_short_ports_opt = {
+		.name = OPTNAME_UDP_SHORT_PORTS,
+		.key = ARGP_UDP_SHORT_PORTS,
+		.arg = NUM_ARRAY_FORMAT,
+		.flags = 0,
+		.doc = "Set the list of remote UDP ports whose sessions are "
+				"short-lived (eg. 53,123). \"0\" empties the "
+				"list.\n",
+		.group = 0,
+};
+
 static const struct argp_option ttl_icmp_opt = {
 		.name = OPTNAME_ICMP_TIMEOUT,
 		.key = ARGP_ICMP_TO,
@@ -419,6 +763,17 @@ static const struct argp_option ttl_tcptrans_opt = {
 		.group = 0,
 };
 
+static const struct argp_option ttl_tcpclosed_opt = {
+		.name = OPTNAME_TCPCLOSED_TIMEOUT,
+		.key = ARGP_TCP_CLOSED_TO,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the lifetime of the TCP sessions that saw a RST or "
+				"both FINs (in seconds). Zero means "
+				"--" OPTNAME_TCPTRANS_TIMEOUT ".\n",
+		.group = 0,
+};
+
 static const struct argp_option ttl_frag_opt = {
 		.name = OPTNAME_FRAG_TIMEOUT,
 		.key = ARGP_FRAG_TO,
@@ -428,6 +783,33 @@ static const struct argp_option ttl_frag_opt = {
 		.group = 0,
 };
 
+static const struct argp_option frag_high_thresh_opt = {
+		.name = OPTNAME_FRAG_HIGH_THRESH,
+		.key = ARGP_FRAG_HIGH_THRESH,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Maximum bytes the fragments waiting for reassembly can take. (0 = unlimited)",
+		.group = 0,
+};
+
+static const struct argp_option frag_low_thresh_opt = {
+		.name = OPTNAME_FRAG_LOW_THRESH,
+		.key = ARGP_FRAG_LOW_THRESH,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Bytes the fragment memory is shrunk down to once it reaches the high threshold.",
+		.group = 0,
+};
+
+static const struct argp_option frag_virtual_opt = {
+		.name = OPTNAME_FRAG_VIRTUAL,
+		.key = ARGP_FRAG_VIRTUAL,
+		.arg = BOOL_FORMAT,
+		.flags = 0,
+		.doc = "Translate fragments as they arrive instead of reassembling them first?",
+		.group = 0,
+};
+
 static const struct argp_option max_so_opt = {
 		.name = OPTNAME_MAX_SO,
 		.key = ARGP_STORED_PKTS,
@@ -438,6 +820,179 @@ static const struct argp_option max_so_opt = {
 		.group = 0,
 };
 
+static const struct argp_option max_so_bytes_opt = {
+		.name = OPTNAME_MAX_SO_BYTES,
+		.key = ARGP_STORED_BYTES,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum memory (in bytes) the packets stored "
+				"for Simultaneous Opens can take. (0 = unlimited)\n",
+		.group = 0,
+};
+
+static const struct argp_option stateless_so_opt = {
+		.name = OPTNAME_STATELESS_SO,
+		.key = ARGP_STATELESS_SO,
+		.arg = BOOL_FORMAT,
+		.flags = 0,
+		.doc = "Only keep the headers of the packets stored for "
+				"Simultaneous Opens?\n",
+		.group = 0,
+};
+
+static const struct argp_option max_sessions_tcp_opt = {
+		.name = OPTNAME_MAX_SESSIONS_TCP,
+		.key = ARGP_MAX_SESSIONS_TCP,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum number of TCP sessions. (0 = unlimited)\n",
+		.group = 0,
+};
+
+static const struct argp_option max_sessions_udp_opt = {
+		.name = OPTNAME_MAX_SESSIONS_UDP,
+		.key = ARGP_MAX_SESSIONS_UDP,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum number of UDP sessions. (0 = unlimited)\n",
+		.group = 0,
+};
+
+static const struct argp_option max_sessions_icmp_opt = {
+		.name = OPTNAME_MAX_SESSIONS_ICMP,
+		.key = ARGP_MAX_SESSIONS_ICMP,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum number of ICMP sessions. (0 = unlimited)\n",
+		.group = 0,
+};
+
+static const struct argp_option subscriber_plen_opt = {
+		.name = OPTNAME_SUBSCRIBER_PLEN,
+		.key = ARGP_SUBSCRIBER_PLEN,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the length of the IPv6 prefix that identifies a "
+				"subscriber. (0 = no subscriber quotas)\n",
+		.group = 0,
+};
+
+static const struct argp_option subscriber_max_bibs_opt = {
+		.name = OPTNAME_SUBSCRIBER_MAX_BIBS,
+		.key = ARGP_SUBSCRIBER_MAX_BIBS,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum number of BIB entries each subscriber "
+				"can have per protocol. (0 = unlimited)\n",
+		.group = 0,
+};
+
+static const struct argp_option subscriber_max_sessions_opt = {
+		.name = OPTNAME_SUBSCRIBER_MAX_SESSIONS,
+		.key = ARGP_SUBSCRIBER_MAX_SESSIONS,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum number of sessions each subscriber "
+				"can have per protocol. (0 = unlimited)\n",
+		.group = 0,
+};
+
+static const struct argp_option subscriber_max_rate_opt = {
+		.name = OPTNAME_SUBSCRIBER_MAX_RATE,
+		.key = ARGP_SUBSCRIBER_MAX_RATE,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum number of sessions each subscriber "
+				"can create per second per protocol. "
+				"(0 = unlimited)\n",
+		.group = 0,
+};
+
+static const struct argp_option cps_budget_opt = {
+		.name = OPTNAME_CPS_BUDGET,
+		.key = ARGP_CPS_BUDGET,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum number of sessions the instance can "
+				"create per second per CPU. (0 = unlimited)\n",
+		.group = 0,
+};
+
+static const struct argp_option port_block_size_opt = {
+		.name = OPTNAME_PORT_BLOCK_SIZE,
+		.key = ARGP_PORT_BLOCK_SIZE,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Reserve blocks of this many ports per subscriber, and "
+				"allocate their connections from them. (0 = disabled)\n",
+		.group = 0,
+};
+
+static const struct argp_option deterministic_subscriber_bits_opt = {
+		.name = OPTNAME_DETERMINISTIC_BITS,
+		.key = ARGP_DETERMINISTIC_BITS,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Number of subscriber prefix bits that index the "
+				"deterministic pool4 slices. (0 = disabled)\n",
+		.group = 0,
+};
+
+static const struct argp_option pool4_balance_opt = {
+		.name = OPTNAME_POOL4_BALANCE,
+		.key = ARGP_POOL4_BALANCE,
+		.arg = BOOL_FORMAT,
+		.flags = 0,
+		.doc = "Mask new connections with the least used pool4 "
+				"address?\n",
+		.group = 0,
+};
+
+static const struct argp_option ss_window_opt = {
+		.name = OPTNAME_SS_WINDOW,
+		.key = ARGP_SS_WINDOW,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Maximum number of joold packets that can be awaiting acknowledgement at the same time.",
+		.group = 0,
+};
+
+static const struct argp_option ss_advertise_chunk_opt = {
+		.name = OPTNAME_SS_ADVERTISE_CHUNK,
+		.key = ARGP_SS_ADVERTISE_CHUNK,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Maximum number of sessions per advertisement packet. (0 = as many as fit)",
+		.group = 0,
+};
+
+static const struct argp_option ss_advertise_rate_opt = {
+		.name = OPTNAME_SS_ADVERTISE_RATE,
+		.key = ARGP_SS_ADVERTISE_RATE,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Maximum number of sessions advertised per second. (0 = unlimited)",
+		.group = 0,
+};
+
+static const struct argp_option ss_node_count_opt = {
+		.name = OPTNAME_SS_NODE_COUNT,
+		.key = ARGP_SS_NODE_COUNT,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Number of active/active nodes that split pool4's ports. (0 and 1 = no split)",
+		.group = 0,
+};
+
+static const struct argp_option ss_node_id_opt = {
+		.name = OPTNAME_SS_NODE_ID,
+		.key = ARGP_SS_NODE_ID,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "This node's index (0 to --" OPTNAME_SS_NODE_COUNT " - 1) in the pool4 split.",
+		.group = 0,
+};
+
 static const struct argp_option icmp_src_opt = {
 		.name = OPTNAME_SRC_ICMP6E_BETTER,
 		.key = ARGP_SRC_ICMP6ERRS_BETTER,
@@ -462,6 +1017,16 @@ static const struct argp_option f_args_opt = {
 		.group = 0,
 };
 
+static const struct argp_option f_algorithm_opt = {
+		.name = OPTNAME_F_ALGORITHM,
+		.key = ARGP_F_ALGORITHM,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Defines the hash function F() is built upon.\n"
+				"(0 = MD5; 1 = SipHash)",
+		.group = 0,
+};
+
 static const struct argp_option rst_during_fin_rcv_opt = {
 		.name = OPTNAME_HANDLE_FIN_RCV_RST,
 		.key = ARGP_HANDLE_RST_DURING_FIN_RCV,
@@ -489,6 +1054,15 @@ static const struct argp_option logging_session_opt = {
 		.group = 0,
 };
 
+static const struct argp_option logging_stream_opt = {
+		.name = OPTNAME_LOGGING_STREAM,
+		.key = ARGP_LOGGING_STREAM,
+		.arg = BOOL_FORMAT,
+		.flags = 0,
+		.doc = "Send the BIB and session logs as binary records to the event stream (see --events) instead of the kernel log?\n",
+		.group = 0,
+};
+
 static const struct argp_option csum_fix_opt = {
 		.name = OPTNAME_AMEND_UDP_CSUM,
 		.key = ARGP_COMPUTE_CSUM_ZERO,
@@ -519,6 +1093,17 @@ static const struct argp_option random_pool6791_opt = {
 		.group = 0,
 };
 
+static const struct argp_option clat_opt = {
+		.name = OPTNAME_CLAT,
+		.key = ARGP_CLAT,
+		.arg = BOOL_FORMAT,
+		.flags = 0,
+		.doc = "Translate 464XLAT CLAT traffic (one /96 pool6 prefix, "
+				"one single-address EAM entry) through a "
+				"precomputed mapping instead of the tables?\n",
+		.group = 0,
+};
+
 static const struct argp_option parse_file_opt = {
 		.name = "file",
 		.key = ARGP_PARSE_FILE,
@@ -528,6 +1113,18 @@ static const struct argp_option parse_file_opt = {
 		.group = 0,
 };
 
+static const struct argp_option batch_opt = {
+		.name = "batch",
+		.key = ARGP_BATCH,
+		.arg = "FILE",
+		.flags = 0,
+		.doc = "Run each line of FILE ('-' is standard input) as a "
+				"separate command, over a single socket, without "
+				"waiting for each one to finish before sending the "
+				"next.",
+		.group = 0,
+};
+
 static const struct argp_option ss_enabled_opt = {
 		.name = OPTNAME_SS_ENABLED,
 		.key = ARGP_SS_ENABLED,
@@ -546,6 +1143,24 @@ static const struct argp_option ss_flush_asap_opt = {
 		.group = 0,
 };
 
+static const struct argp_option ss_compact_opt = {
+		.name = OPTNAME_SS_COMPACT,
+		.key = ARGP_SS_COMPACT,
+		.arg = BOOL_FORMAT,
+		.flags = 0,
+		.doc = "Send synchronized sessions in the compact encoding?",
+		.group = 0,
+};
+
+static const struct argp_option ss_resync_interval_opt = {
+		.name = OPTNAME_SS_RESYNC_INTERVAL,
+		.key = ARGP_SS_RESYNC_INTERVAL,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Minimum milliseconds between synchronizations of an unchanged session.",
+		.group = 0,
+};
+
 static const struct argp_option ss_flush_deadline_opt = {
 		.name = OPTNAME_SS_FLUSH_DEADLINE,
 		.key = ARGP_SS_FLUSH_DEADLINE,
@@ -590,7 +1205,10 @@ static const struct argp_option *opts_siit[] = {
 	&pool6791_opt,
 	&global_opt,
 	&parse_file_opt,
+	&batch_opt,
 	&instance_opt,
+	&xdp_opt,
+	&stats_opt,
 
 	&operations_hdr_opt,
 	&display_opt,
@@ -604,6 +1222,11 @@ static const struct argp_option *opts_siit[] = {
 	&csv_opt,
 	&no_hdr_opt,
 	&force_opt,
+	&counters_opt,
+	&reset_counters_opt,
+	&watch_opt,
+	&share_tables_opt,
+	&from_opt,
 
 	&globals_hdr_opt,
 	&enable_opt,
@@ -612,10 +1235,16 @@ static const struct argp_option *opts_siit[] = {
 	&override_tos_opt,
 	&tos_opt,
 	&plateaus_opt,
+	&debug_opt,
+	&latency_sampling_opt,
+	&mirror_sampling_opt,
+	&packet_budget_opt,
+	&mss_clamp_opt,
 	&csum_fix_opt,
 	&hairpin_mode_opt,
 	&random_pool6791_opt,
 	&rfc6791v6_prefix_opt,
+	&clat_opt,
 };
 
 static const struct argp_option *opts_nat64[] = {
@@ -627,7 +1256,10 @@ static const struct argp_option *opts_nat64[] = {
 	&joold_opt,
 	&global_opt,
 	&parse_file_opt,
+	&batch_opt,
 	&instance_opt,
+	&stats_opt,
+	&events_opt,
 
 	&operations_hdr_opt,
 	&display_opt,
@@ -641,15 +1273,38 @@ static const struct argp_option *opts_nat64[] = {
 
 	&db_hdr_opt,
 	&csv_opt,
+	&jsonl_opt,
 	&no_hdr_opt,
 	&quick_opt,
 	&mark_opt,
 	&max_iterations_opt,
+	&usage_opt,
 	&force_opt,
 	&icmp_opt,
 	&tcp_opt,
 	&udp_opt,
 	&numeric_opt,
+	&details_opt,
+	&top_opt,
+	&top_by_opt,
+	&top_sessions_opt,
+	&counters_opt,
+	&watch_opt,
+	&filter_src6_opt,
+	&filter_src4_opt,
+	&filter_src4_ports_opt,
+	&filter_dst4_opt,
+	&filter_state_opt,
+	&filter_min_age_opt,
+	&bulk_opt,
+	&policy_opt,
+	&export_opt,
+	&import_opt,
+	&follow_opt,
+	&snapshot_opt,
+	&restore_opt,
+	&share_tables_opt,
+	&from_opt,
 
 	/* Globals */
 	&globals_hdr_opt,
@@ -659,25 +1314,58 @@ static const struct argp_option *opts_nat64[] = {
 	&override_tos_opt,
 	&tos_opt,
 	&plateaus_opt,
+	&debug_opt,
+	&latency_sampling_opt,
+	&mirror_sampling_opt,
+	&packet_budget_opt,
+	&mss_clamp_opt,
 	&max_so_opt,
+	&max_so_bytes_opt,
+	&stateless_so_opt,
+	&max_sessions_tcp_opt,
+	&max_sessions_udp_opt,
+	&max_sessions_icmp_opt,
+	&subscriber_plen_opt,
+	&subscriber_max_bibs_opt,
+	&subscriber_max_sessions_opt,
+	&subscriber_max_rate_opt,
+	&cps_budget_opt,
+	&port_block_size_opt,
+	&deterministic_subscriber_bits_opt,
+	&pool4_balance_opt,
 	&icmp_src_opt,
 	&f_args_opt,
+	&f_algorithm_opt,
 	&rst_during_fin_rcv_opt,
 	&logging_bib_opt,
 	&logging_session_opt,
+	&logging_stream_opt,
 	&adf_opt,
 	&icmp_filter_opt,
 	&tcp_filter_opt,
 	&ttl_udp_opt,
+	&ttl_udp_short_opt,
+	&udp_short_ports_opt,
 	&ttl_tcpest_opt,
 	&ttl_tcptrans_opt,
+	&ttl_tcpclosed_opt,
 	&ttl_icmp_opt,
 	&ttl_frag_opt,
+	&frag_high_thresh_opt,
+	&frag_low_thresh_opt,
+	&frag_virtual_opt,
 	&ss_enabled_opt,
 	&ss_flush_asap_opt,
 	&ss_flush_deadline_opt,
 	&ss_capacity_opt,
 	&ss_max_payload_opt,
+	&ss_window_opt,
+	&ss_compact_opt,
+	&ss_resync_interval_opt,
+	&ss_advertise_chunk_opt,
+	&ss_advertise_rate_opt,
+	&ss_node_count_opt,
+	&ss_node_id_opt,
 };
 
 struct argp_option *__build_opts(const struct argp_option **template,
@@ -713,10 +1401,16 @@ static const struct argp_option *opts_global_siit[] = {
 	&override_tos_opt,
 	&tos_opt,
 	&plateaus_opt,
+	&debug_opt,
+	&latency_sampling_opt,
+	&mirror_sampling_opt,
+	&packet_budget_opt,
+	&mss_clamp_opt,
 	&csum_fix_opt,
 	&hairpin_mode_opt,
 	&random_pool6791_opt,
 	&rfc6791v6_prefix_opt,
+	&clat_opt,
 };
 
 static const struct argp_option *opts_global_nat64[] = {
@@ -725,25 +1419,58 @@ static const struct argp_option *opts_global_nat64[] = {
 	&override_tos_opt,
 	&tos_opt,
 	&plateaus_opt,
+	&debug_opt,
+	&latency_sampling_opt,
+	&mirror_sampling_opt,
+	&packet_budget_opt,
+	&mss_clamp_opt,
 	&max_so_opt,
+	&max_so_bytes_opt,
+	&stateless_so_opt,
+	&max_sessions_tcp_opt,
+	&max_sessions_udp_opt,
+	&max_sessions_icmp_opt,
+	&subscriber_plen_opt,
+	&subscriber_max_bibs_opt,
+	&subscriber_max_sessions_opt,
+	&subscriber_max_rate_opt,
+	&cps_budget_opt,
+	&port_block_size_opt,
+	&deterministic_subscriber_bits_opt,
+	&pool4_balance_opt,
 	&icmp_src_opt,
 	&f_args_opt,
+	&f_algorithm_opt,
 	&rst_during_fin_rcv_opt,
 	&logging_bib_opt,
 	&logging_session_opt,
+	&logging_stream_opt,
 	&adf_opt,
 	&icmp_filter_opt,
 	&tcp_filter_opt,
 	&ttl_udp_opt,
+	&ttl_udp_short_opt,
+	&udp_short_ports_opt,
 	&ttl_tcpest_opt,
 	&ttl_tcptrans_opt,
+	&ttl_tcpclosed_opt,
 	&ttl_icmp_opt,
 	&ttl_frag_opt,
+	&frag_high_thresh_opt,
+	&frag_low_thresh_opt,
+	&frag_virtual_opt,
 	&ss_enabled_opt,
 	&ss_flush_asap_opt,
 	&ss_flush_deadline_opt,
 	&ss_capacity_opt,
 	&ss_max_payload_opt,
+	&ss_window_opt,
+	&ss_compact_opt,
+	&ss_resync_interval_opt,
+	&ss_advertise_chunk_opt,
+	&ss_advertise_rate_opt,
+	&ss_node_count_opt,
+	&ss_node_id_opt,
 };
 
 struct argp_option *get_global_opts(void)
@@ -1,19 +1,393 @@
 #include "nat64/usr/dns.h"
 
+#include <errno.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "nat64/common/types.h"
 
+/*
+ * Reverse DNS.
+ *
+ * getnameinfo() blocks, and there's one call per printed address, so
+ * displaying a large table used to take forever unless the user remembered
+ * --numeric. So the callers now dns_prefetch*() every address of a batch of
+ * entries, dns_resolve() them all at once (DNS_THREADS lookups at a time), and
+ * then print. The names are cached, so addresses that repeat (which is most of
+ * them, in a session table) are only looked up once.
+ *
+ * getnameinfo() cannot be cancelled, so lookups that take longer than
+ * DNS_TIMEOUT_MS are simply abandoned: the address is printed numerically, and
+ * a new thread takes over the abandoned one's place in the pool. (The old one
+ * dies whenever the resolver library gives up.)
+ */
+
+#define DNS_THREADS 16
+#define DNS_TIMEOUT_MS 2000
+#define DNS_BUCKETS 4096
+
+enum dns_state {
+	/* Queued; no thread has picked it up yet. */
+	DNS_QUEUED,
+	DNS_RESOLVING,
+	/* @name is valid. */
+	DNS_RESOLVED,
+	/* The lookup failed or timed out; print the address numerically. */
+	DNS_FAILED,
+};
+
+struct dns_entry {
+	int family;
+	union {
+		struct in6_addr v6;
+		struct in_addr v4;
+	} addr;
+
+	enum dns_state state;
+	char name[NI_MAXHOST];
+	/* When the lookup started, in milliseconds. (DNS_RESOLVING only.) */
+	__u64 started;
+
+	/* Next entry in the same hash bucket. */
+	struct dns_entry *next;
+	/* Next entry in the work queue. (DNS_QUEUED only.) */
+	struct dns_entry *next_queued;
+};
+
+/*
+ * Entries are never freed: an abandoned thread might still be holding one,
+ * and the process does not live long enough for the cache to matter anyway.
+ */
+static struct dns_entry *cache[DNS_BUCKETS];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when a lookup is queued. */
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+/* Signaled when a lookup ends. */
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static struct dns_entry *queue_head;
+static struct dns_entry *queue_tail;
+/* What each thread of the pool is resolving, if anything. */
+static struct dns_entry *busy[DNS_THREADS];
+static unsigned int busy_count;
+static bool threads_started;
+
+static __u64 now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (__u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int hash_addr(void *addr, size_t len)
+{
+	unsigned char *bytes = addr;
+	unsigned int hash = 2166136261u; /* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+
+	return hash % DNS_BUCKETS;
+}
+
+static size_t addr_len(int family)
+{
+	return (family == AF_INET6)
+			? sizeof(struct in6_addr)
+			: sizeof(struct in_addr);
+}
+
+/* Needs @lock. */
+static struct dns_entry *cache_find(int family, void *addr, bool create)
+{
+	size_t len = addr_len(family);
+	unsigned int bucket = hash_addr(addr, len);
+	struct dns_entry *entry;
+
+	for (entry = cache[bucket]; entry; entry = entry->next)
+		if (entry->family == family && !memcmp(&entry->addr, addr, len))
+			return entry;
+
+	if (!create)
+		return NULL;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return NULL;
+	entry->family = family;
+	memcpy(&entry->addr, addr, len);
+	entry->state = DNS_QUEUED;
+
+	entry->next = cache[bucket];
+	cache[bucket] = entry;
+	if (queue_tail)
+		queue_tail->next_queued = entry;
+	else
+		queue_head = entry;
+	queue_tail = entry;
+
+	return entry;
+}
+
+static int lookup(struct dns_entry *entry, char *name)
+{
+	struct sockaddr_in6 sa6;
+	struct sockaddr_in sa4;
+
+	if (entry->family == AF_INET6) {
+		memset(&sa6, 0, sizeof(sa6));
+		sa6.sin6_family = AF_INET6;
+		sa6.sin6_addr = entry->addr.v6;
+		return getnameinfo((const struct sockaddr *)&sa6, sizeof(sa6),
+				name, NI_MAXHOST, NULL, 0, 0);
+	}
+
+	memset(&sa4, 0, sizeof(sa4));
+	sa4.sin_family = AF_INET;
+	sa4.sin_addr = entry->addr.v4;
+	return getnameinfo((const struct sockaddr *)&sa4, sizeof(sa4),
+			name, NI_MAXHOST, NULL, 0, 0);
+}
+
+static void *worker(void *arg)
+{
+	unsigned int slot = (unsigned long)arg;
+	struct dns_entry *entry;
+	char name[NI_MAXHOST];
+	int error;
+
+	pthread_mutex_lock(&lock);
+
+	while (true) {
+		while (!queue_head)
+			pthread_cond_wait(&work_cond, &lock);
+
+		entry = queue_head;
+		queue_head = entry->next_queued;
+		if (!queue_head)
+			queue_tail = NULL;
+		entry->state = DNS_RESOLVING;
+		entry->started = now_ms();
+		busy[slot] = entry;
+		busy_count++;
+
+		/* @entry's address is immutable, so it can be read unlocked. */
+		pthread_mutex_unlock(&lock);
+		error = lookup(entry, name);
+		pthread_mutex_lock(&lock);
+
+		if (entry->state != DNS_RESOLVING) {
+			/* Abandoned; somebody else has our slot now. */
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+
+		if (error) {
+			log_err("getnameinfo failed: %s", gai_strerror(error));
+			entry->state = DNS_FAILED;
+		} else {
+			strcpy(entry->name, name);
+			entry->state = DNS_RESOLVED;
+		}
+		busy[slot] = NULL;
+		busy_count--;
+		pthread_cond_signal(&done_cond);
+	}
+}
+
+/* Needs @lock. */
+static int start_worker(unsigned int slot)
+{
+	pthread_t thread;
+	int error;
+
+	error = pthread_create(&thread, NULL, worker, (void *)(unsigned long)slot);
+	if (error) {
+		log_perror("Could not create a DNS thread", error);
+		return -error;
+	}
+
+	pthread_detach(thread);
+	return 0;
+}
+
+/* Needs @lock. */
+static int start_workers(void)
+{
+	unsigned int i;
+	int error;
+
+	if (threads_started)
+		return 0;
+
+	for (i = 0; i < DNS_THREADS; i++) {
+		error = start_worker(i);
+		if (error)
+			return error;
+	}
+
+	threads_started = true;
+	return 0;
+}
+
+/*
+ * Gives up on the lookups that have taken too long, and returns the moment
+ * the next one will. Needs @lock.
+ */
+static __u64 abandon_late_lookups(void)
+{
+	__u64 now = now_ms();
+	__u64 next = now + DNS_TIMEOUT_MS;
+	__u64 deadline;
+	unsigned int i;
+
+	for (i = 0; i < DNS_THREADS; i++) {
+		if (!busy[i])
+			continue;
+
+		deadline = busy[i]->started + DNS_TIMEOUT_MS;
+		if (deadline <= now) {
+			busy[i]->state = DNS_FAILED;
+			busy[i] = NULL;
+			busy_count--;
+			start_worker(i);
+		} else if (deadline < next) {
+			next = deadline;
+		}
+	}
+
+	return next;
+}
+
+/* Drops the whole queue. Needs @lock. */
+static void fail_queue(void)
+{
+	for (; queue_head; queue_head = queue_head->next_queued)
+		queue_head->state = DNS_FAILED;
+	queue_tail = NULL;
+}
+
+/**
+ * Queues @addr for resolution by dns_resolve(), unless it's already known.
+ */
+void dns_prefetch6(struct in6_addr *addr, display_flags flags)
+{
+	if (flags & DF_NUMERIC_HOSTNAME)
+		return;
+
+	pthread_mutex_lock(&lock);
+	cache_find(AF_INET6, addr, true);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Queues @addr for resolution by dns_resolve(), unless it's already known.
+ */
+void dns_prefetch4(struct in_addr *addr, display_flags flags)
+{
+	if (flags & DF_NUMERIC_HOSTNAME)
+		return;
+
+	pthread_mutex_lock(&lock);
+	cache_find(AF_INET, addr, true);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Resolves everything that has been prefetched so far, concurrently. Returns
+ * once every lookup has either finished or timed out.
+ */
+void dns_resolve(void)
+{
+	struct timespec deadline;
+	__u64 next;
+
+	pthread_mutex_lock(&lock);
+
+	if (!queue_head) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	if (start_workers()) {
+		fail_queue();
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	pthread_cond_broadcast(&work_cond);
+
+	while (queue_head || busy_count) {
+		next = abandon_late_lookups();
+		if (!queue_head && !busy_count)
+			break;
+		deadline.tv_sec = next / 1000;
+		deadline.tv_nsec = (next % 1000) * 1000000;
+		pthread_cond_timedwait(&done_cond, &lock, &deadline);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Copies @addr's name into @result. Returns false if the address should be
+ * printed numerically.
+ */
+static bool get_name(int family, void *addr, display_flags flags, char *result)
+{
+	struct dns_entry *entry;
+	bool found = false;
+
+	if (flags & DF_NUMERIC_HOSTNAME)
+		return false;
+
+	pthread_mutex_lock(&lock);
+	entry = cache_find(family, addr, false);
+	pthread_mutex_unlock(&lock);
+
+	if (!entry) {
+		/* The caller didn't prefetch; resolve this one alone. */
+		if (family == AF_INET6)
+			dns_prefetch6(addr, flags);
+		else
+			dns_prefetch4(addr, flags);
+		dns_resolve();
+	}
+
+	pthread_mutex_lock(&lock);
+	entry = cache_find(family, addr, false);
+	if (entry && entry->state == DNS_RESOLVED) {
+		strcpy(result, entry->name);
+		found = true;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return found;
+}
+
+/*
+ * Services come from a local database, so they're not worth all the fuss.
+ * Returns false if the port should be printed numerically.
+ */
+static bool get_service(struct sockaddr *sa, socklen_t sa_len, char *result)
+{
+	return !getnameinfo(sa, sa_len, NULL, 0, result, NI_MAXSERV, 0);
+}
+
 void print_addr6(struct ipv6_transport_addr *addr6, display_flags flags,
 		char *separator, __u8 l4_proto)
 {
 	char hostname[NI_MAXHOST], service[NI_MAXSERV];
 	char hostaddr[INET6_ADDRSTRLEN];
 	struct sockaddr_in6 sa6;
-	int err;
 
-	if (flags & DF_NUMERIC_HOSTNAME)
+	if (!get_name(AF_INET6, &addr6->l3, flags, hostname))
 		goto print_numeric;
 
 	memset(&sa6, 0, sizeof(struct sockaddr_in6));
@@ -21,16 +395,10 @@ void print_addr6(struct ipv6_transport_addr *addr6, display_flags flags,
 	sa6.sin6_port = htons(addr6->l4);
 	sa6.sin6_addr = addr6->l3;
 
-	err = getnameinfo((const struct sockaddr*) &sa6, sizeof(sa6),
-			hostname, sizeof(hostname), service, sizeof(service), 0);
-	if (err != 0) {
-		log_err("getnameinfo failed: %s", gai_strerror(err));
-		goto print_numeric;
-	}
-
 	/* Verification because ICMP doesn't use numeric ports, so it makes no sense to have a
 	 * translation of the "ICMP id". */
-	if (l4_proto != L4PROTO_ICMP)
+	if (l4_proto != L4PROTO_ICMP && get_service((struct sockaddr *)&sa6,
+			sizeof(sa6), service))
 		printf("%s%s%s", hostname, separator, service);
 	else
 		printf("%s%s%u", hostname, separator, addr6->l4);
@@ -47,9 +415,8 @@ void print_addr4(struct ipv4_transport_addr *addr4, display_flags flags,
 	char hostname[NI_MAXHOST], service[NI_MAXSERV];
 	char *hostaddr;
 	struct sockaddr_in sa;
-	int err;
 
-	if (flags & DF_NUMERIC_HOSTNAME)
+	if (!get_name(AF_INET, &addr4->l3, flags, hostname))
 		goto print_numeric;
 
 	memset(&sa, 0, sizeof(struct sockaddr_in));
@@ -57,16 +424,10 @@ void print_addr4(struct ipv4_transport_addr *addr4, display_flags flags,
 	sa.sin_port = htons(addr4->l4);
 	sa.sin_addr = addr4->l3;
 
-	err = getnameinfo((const struct sockaddr*) &sa, sizeof(sa),
-			hostname, sizeof(hostname), service, sizeof(service), 0);
-	if (err != 0) {
-		log_err("getnameinfo failed: %s", gai_strerror(err));
-		goto print_numeric;
-	}
-
 	/* Verification because ICMP doesn't use numeric ports, so it makes no sense to have a
 	 * translation of the "ICMP id". */
-	if (l4_proto != L4PROTO_ICMP)
+	if (l4_proto != L4PROTO_ICMP && get_service((struct sockaddr *)&sa,
+			sizeof(sa), service))
 		printf("%s%s%s", hostname, separator, service);
 	else
 		printf("%s%s%u", hostname, separator, addr4->l4);
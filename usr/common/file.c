@@ -3,6 +3,9 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <endian.h>
+#include <string.h>
+#include <time.h>
 #include "nat64/common/types.h"
 
 /**
@@ -74,3 +77,152 @@ fail:
 	fclose(file);
 	return error;
 }
+
+static void init_table_hdr(struct table_file_hdr *hdr,
+		enum table_file_type type, size_t record_size)
+{
+	memcpy(hdr->magic, TABLE_FILE_MAGIC, sizeof(hdr->magic));
+	hdr->version = TABLE_FILE_VERSION;
+	hdr->type = type;
+	hdr->record_size = htons(record_size);
+	memset(hdr->reserved, 0, sizeof(hdr->reserved));
+	hdr->export_time = htobe64(time(NULL));
+}
+
+/**
+ * Opens @file_name ("-" means standard output) for writing, and writes the
+ * header of a @type table file into it.
+ */
+int table_file_create(char *file_name, enum table_file_type type,
+		size_t record_size, FILE **result)
+{
+	struct table_file_hdr hdr;
+	FILE *file;
+	int error;
+
+	file = (strcmp(file_name, "-") == 0) ? stdout : fopen(file_name, "wb");
+	if (!file) {
+		error = -errno;
+		log_perror("Could not create the file", errno);
+		return error;
+	}
+
+	init_table_hdr(&hdr, type, record_size);
+	error = table_file_write(file, &hdr, sizeof(hdr), 1);
+	if (error) {
+		table_file_close(file);
+		return error;
+	}
+
+	*result = file;
+	return 0;
+}
+
+/**
+ * Opens @file_name ("-" means standard input) for reading, and makes sure it
+ * is a @type table file whose records are @record_size bytes long.
+ *
+ * If @hdr is not NULL, the file's header is copied there.
+ */
+int table_file_open(char *file_name, enum table_file_type type,
+		size_t record_size, FILE **result, struct table_file_hdr *hdr)
+{
+	struct table_file_hdr expected;
+	struct table_file_hdr tmp;
+	FILE *file;
+	int error;
+
+	file = (strcmp(file_name, "-") == 0) ? stdin : fopen(file_name, "rb");
+	if (!file) {
+		error = -errno;
+		log_perror("Could not open the file", errno);
+		return error;
+	}
+
+	if (!hdr)
+		hdr = &tmp;
+	error = table_file_read(file, hdr, sizeof(*hdr));
+	if (error == 0) {
+		log_err("The file is empty.");
+		error = -EINVAL;
+	}
+	if (error < 0)
+		goto fail;
+
+	init_table_hdr(&expected, type, record_size);
+	if (memcmp(hdr->magic, expected.magic, sizeof(hdr->magic)) != 0) {
+		log_err("The file is not a Jool table export.");
+		goto einval;
+	}
+	if (hdr->version != expected.version) {
+		log_err("Unknown table file version: %u (I only know %u.)",
+				hdr->version, TABLE_FILE_VERSION);
+		goto einval;
+	}
+	if (hdr->type != expected.type) {
+		log_err("The file is a %s export.",
+				(hdr->type == TABLE_FILE_BIB) ? "BIB" : "session");
+		goto einval;
+	}
+	if (hdr->record_size != expected.record_size) {
+		log_err("The file's records are %u bytes long; I expected %zu.",
+				ntohs(hdr->record_size), record_size);
+		goto einval;
+	}
+
+	*result = file;
+	return 0;
+
+einval:
+	error = -EINVAL;
+fail:
+	table_file_close(file);
+	return error;
+}
+
+int table_file_write(FILE *file, void *records, size_t size, unsigned int count)
+{
+	if (fwrite(records, size, count, file) != count) {
+		log_perror("Could not write to the file", errno);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * Reads the next @size bytes from @file.
+ * Returns 1 on success, 0 on end of file, and a negative error code otherwise.
+ */
+int table_file_read(FILE *file, void *record, size_t size)
+{
+	size_t len;
+
+	len = fread(record, 1, size, file);
+	if (len == size)
+		return 1;
+
+	if (ferror(file)) {
+		log_perror("Could not read the file", errno);
+		return -EIO;
+	}
+	if (len != 0) {
+		log_err("The file ends in the middle of a record.");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/** Returns nonzero if the data could not be flushed. */
+int table_file_close(FILE *file)
+{
+	int error;
+
+	if (file == stdin || file == stdout)
+		return fflush(file) ? -EIO : 0;
+
+	error = fclose(file);
+	if (error)
+		log_perror("Could not close the file", errno);
+	return error ? -EIO : 0;
+}
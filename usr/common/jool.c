@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <argp.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <linux/types.h>
 #include <string.h>
@@ -17,6 +18,7 @@
 #include "nat64/common/xlat.h"
 #include "nat64/usr/str_utils.h"
 #include "nat64/usr/instance.h"
+#include "nat64/usr/xdp.h"
 #include "nat64/usr/file.h"
 #include "nat64/usr/joold.h"
 #include "nat64/usr/json.h"
@@ -26,6 +28,8 @@
 #include "nat64/usr/pool4.h"
 #include "nat64/usr/bib.h"
 #include "nat64/usr/session.h"
+#include "nat64/usr/stats.h"
+#include "nat64/usr/events.h"
 #include "nat64/usr/eam.h"
 #include "nat64/usr/global.h"
 #include "nat64/usr/argp/options.h"
@@ -66,7 +70,26 @@ struct arguments {
 			bool addr6_set;
 			struct ipv4_transport_addr addr4;
 			bool addr4_set;
+			/* Entry list of bulk adds and removes. */
+			char *bulk_file;
+			/* Pinned BPF program of --policy. */
+			char *policy;
+			/* --top, --top-by and --top-sessions. */
+			struct bib_top_query top;
 		} bib;
+
+		/* Table files of --export and --import. */
+		char *export_file;
+		char *import_file;
+		/* Session files of --snapshot and --restore. */
+		char *snapshot_file;
+		char *restore_file;
+		/* --follow's SEQ. */
+		__u64 follow_since;
+		bool follow_since_set;
+
+		/* Narrows down BIB and session displays. */
+		struct bib_filter filter;
 	} db;
 
 	struct {
@@ -76,6 +99,14 @@ struct arguments {
 	} global;
 
 	char *json_filename;
+	/* Seconds between --stats displays. Zero prints them only once. */
+	__u32 watch;
+	/* Commands to run instead of this one. (See run_batch().) */
+	char *batch_file;
+	/* --share-tables of --instance --add. NULL means private tables. */
+	char *shared_tables;
+	/* --from of --instance --add. NULL means a blank instance. */
+	char *from;
 
 	display_flags flags;
 };
@@ -376,6 +407,54 @@ static int set_ip_args(struct arguments *args, char *str)
 	return error;
 }
 
+static int set_filter_states(struct arguments *args, char *str)
+{
+	char *token;
+	tcp_state state;
+
+	args->db.filter.states = 0;
+
+	for (token = strtok(str, ","); token; token = strtok(NULL, ",")) {
+		for (state = ESTABLISHED; state <= TRANS; state++) {
+			if (strcasecmp(token, tcp_state_to_string(state)) == 0)
+				break;
+		}
+		if (state > TRANS) {
+			log_err("'%s' is not a TCP state.", token);
+			return -EINVAL;
+		}
+		args->db.filter.states |= 1u << state;
+	}
+
+	return 0;
+}
+
+static int set_top_by(struct arguments *args, char *str)
+{
+	struct bib_top_query *top = &args->db.bib.top;
+	char *slash;
+	__u8 max;
+
+	slash = strchr(str, '/');
+	if (slash)
+		*slash = '\0';
+
+	if (strcasecmp(str, "src6") == 0) {
+		top->by = BIB_TOP_SRC6;
+		max = 128;
+	} else if (strcasecmp(str, "src4") == 0) {
+		top->by = BIB_TOP_SRC4;
+		max = 32;
+	} else {
+		log_err("'%s' is not a grouping. (Expected 'src6' or 'src4'.)",
+				str);
+		return -EINVAL;
+	}
+
+	top->plen = max;
+	return slash ? str_to_u8(slash + 1, &top->plen, 0, max) : 0;
+}
+
 /*
  * PARSER. Field 2 in ARGP.
  */
@@ -416,6 +495,15 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 	case ARGP_INSTANCE:
 		error = update_state(args, MODE_INSTANCE, INSTANCE_OPS);
 		break;
+	case ARGP_XDP:
+		error = update_state(args, MODE_XDP, XDP_OPS);
+		break;
+	case ARGP_STATS:
+		error = update_state(args, MODE_STATS, STATS_OPS);
+		break;
+	case ARGP_EVENTS:
+		error = update_state(args, MODE_EVENTS, EVENTS_OPS);
+		break;
 
 	case ARGP_DISPLAY:
 		error = update_state(args, DISPLAY_MODES, OP_DISPLAY);
@@ -461,13 +549,134 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 		error = update_state(args, MODE_BIB | MODE_SESSION, OP_DISPLAY);
 		args->flags |= DF_NUMERIC_HOSTNAME;
 		break;
+	case ARGP_DETAILS:
+		error = update_state(args, MODE_BIB, OP_COUNT);
+		args->flags |= DF_DETAILS;
+		break;
+	case ARGP_TOP:
+		error = update_state(args, MODE_BIB, OP_COUNT);
+		if (!error)
+			error = str_to_u16(str, &args->db.bib.top.count, 1,
+					BIB_TOP_MAX);
+		break;
+	case ARGP_TOP_BY:
+		error = update_state(args, MODE_BIB, OP_COUNT);
+		if (!error)
+			error = set_top_by(args, str);
+		break;
+	case ARGP_TOP_SESSIONS:
+		error = update_state(args, MODE_BIB, OP_COUNT);
+		args->db.bib.top.sessions = true;
+		break;
+	case ARGP_COUNTERS:
+		error = update_state(args, MODE_EAMT | MODE_SESSION, OP_DISPLAY);
+		args->flags |= DF_COUNTERS;
+		break;
+	case ARGP_RESET_COUNTERS:
+		error = update_state(args, MODE_EAMT, OP_DISPLAY);
+		args->flags |= DF_COUNTERS | DF_RESET;
+		break;
+	case ARGP_WATCH:
+		error = update_state(args, MODE_STATS, OP_DISPLAY);
+		if (!error)
+			error = str_to_u32(str, &args->watch, 1, MAX_U32);
+		break;
+	case ARGP_BULK:
+		error = update_state(args, MODE_BIB, OP_ADD | OP_REMOVE);
+		args->db.bib.bulk_file = str;
+		break;
+	case ARGP_POLICY:
+		error = update_state(args, MODE_BIB, OP_UPDATE);
+		args->db.bib.policy = str;
+		break;
+	case ARGP_EXPORT:
+		error = update_state(args, MODE_BIB | MODE_SESSION, OP_DISPLAY);
+		args->db.export_file = str;
+		break;
+	case ARGP_FOLLOW:
+		error = update_state(args, MODE_SESSION, OP_FOLLOW);
+		if (!error && str) {
+			error = str_to_u64(str, &args->db.follow_since, 0,
+					MAX_U64);
+			args->db.follow_since_set = true;
+		}
+		break;
+	case ARGP_IMPORT:
+		error = update_state(args, MODE_BIB | MODE_SESSION, OP_ADD);
+		args->db.import_file = str;
+		break;
+	case ARGP_SNAPSHOT:
+		error = update_state(args, MODE_INSTANCE, OP_REMOVE);
+		args->db.snapshot_file = str;
+		break;
+	case ARGP_RESTORE:
+		error = update_state(args, MODE_INSTANCE, OP_ADD);
+		args->db.restore_file = str;
+		break;
+	case ARGP_SHARE_TABLES:
+		error = update_state(args, MODE_INSTANCE, OP_ADD);
+		if (error)
+			break;
+		if (strlen(str) >= SHARED_TABLES_NAME_LEN) {
+			log_err("The name of the shared tables can't be longer than %u characters.",
+					SHARED_TABLES_NAME_LEN - 1);
+			error = -EINVAL;
+			break;
+		}
+		args->shared_tables = str;
+		break;
+	case ARGP_FROM:
+		error = update_state(args, MODE_INSTANCE, OP_ADD);
+		args->from = str;
+		break;
+	case ARGP_FILTER_SRC6:
+		error = update_state(args, MODE_BIB | MODE_SESSION, OP_DISPLAY);
+		if (!error)
+			error = str_to_prefix6(str, &args->db.filter.src6);
+		args->db.filter.flags |= BIB_FILTER_SRC6;
+		break;
+	case ARGP_FILTER_SRC4:
+		error = update_state(args, MODE_BIB | MODE_SESSION, OP_DISPLAY);
+		if (!error)
+			error = str_to_prefix4(str, &args->db.filter.src4.prefix);
+		args->db.filter.flags |= BIB_FILTER_SRC4;
+		break;
+	case ARGP_FILTER_SRC4_PORTS:
+		error = update_state(args, MODE_BIB | MODE_SESSION, OP_DISPLAY);
+		if (!error)
+			error = str_to_port_range(str, &args->db.filter.src4.ports);
+		args->db.filter.flags |= BIB_FILTER_SRC4;
+		break;
+	case ARGP_FILTER_DST4:
+		error = update_state(args, MODE_SESSION, OP_DISPLAY);
+		if (!error)
+			error = str_to_prefix4(str, &args->db.filter.dst4);
+		args->db.filter.flags |= BIB_FILTER_DST4;
+		break;
+	case ARGP_FILTER_STATE:
+		error = update_state(args, MODE_SESSION, OP_DISPLAY);
+		if (!error)
+			error = set_filter_states(args, str);
+		args->db.filter.flags |= BIB_FILTER_STATE;
+		break;
+	case ARGP_FILTER_MIN_AGE:
+		error = update_state(args, MODE_SESSION, OP_DISPLAY);
+		if (!error)
+			error = str_to_u32(str, &args->db.filter.min_age, 0,
+					MAX_U32);
+		args->db.filter.flags |= BIB_FILTER_AGE;
+		break;
 	case ARGP_CSV:
 		error = update_state(args, POOL_MODES | TABLE_MODES
-				| MODE_GLOBAL, OP_DISPLAY);
+				| MODE_GLOBAL | MODE_STATS, OP_DISPLAY);
 		args->flags |= DF_CSV_FORMAT;
 		break;
+	case ARGP_JSONL:
+		error = update_state(args, MODE_BIB | MODE_SESSION, OP_DISPLAY);
+		args->flags |= DF_JSONL | DF_NUMERIC_HOSTNAME;
+		break;
 	case ARGP_NO_HEADERS:
-		error = update_state(args, ANY_MODE, OP_DISPLAY);
+		error = update_state(args, ANY_MODE, OP_DISPLAY | OP_FOLLOW);
 		args->flags &= ~DF_SHOW_HEADERS;
 		break;
 
@@ -485,6 +694,10 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 		if (!error)
 			error = set_max_iterations(args, str);
 		break;
+	case ARGP_USAGE:
+		error = update_state(args, MODE_POOL4, OP_DISPLAY);
+		args->flags |= DF_USAGE;
+		break;
 	case ARGP_FORCE:
 		error = update_state(args, ANY_MODE, ANY_OP);
 		args->db.force = true;
@@ -496,21 +709,31 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 		break;
 	case ARGP_RESET_TCLASS:
 	case ARGP_RESET_TOS:
+	case ARGP_DEBUG:
 	case ARGP_COMPUTE_CSUM_ZERO:
 	case ARGP_RANDOMIZE_RFC6791:
+	case ARGP_CLAT:
 	case ARGP_DROP_ADDR:
 	case ARGP_DROP_INFO:
 	case ARGP_DROP_TCP:
 	case ARGP_SRC_ICMP6ERRS_BETTER:
 	case ARGP_BIB_LOGGING:
 	case ARGP_SESSION_LOGGING:
+	case ARGP_LOGGING_STREAM:
+	case ARGP_STATELESS_SO:
+	case ARGP_POOL4_BALANCE:
 	case ARGP_SS_ENABLED:
 	case ARGP_SS_FLUSH_ASAP:
+	case ARGP_SS_COMPACT:
+	case ARGP_FRAG_VIRTUAL:
 		error = set_global_bool(args, key, str);
 		break;
 	case ARGP_F_ARGS:
 		error = set_global_u8(args, key, str, 0, 0xF);
 		break;
+	case ARGP_F_ALGORITHM:
+		error = set_global_u8(args, key, str, 0, F_ALGORITHM_COUNT - 1);
+		break;
 	case ARGP_HANDLE_RST_DURING_FIN_RCV:
 		error = set_global_bool(args, HANDLE_RST_DURING_FIN_RCV, str);
 		break;
@@ -526,6 +749,12 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 	case ARGP_UDP_TO:
 		error = set_global_u64(args, key, str, UDP_MIN, MAX_U32/1000, 1000);
 		break;
+	case ARGP_UDP_SHORT_TO:
+		error = set_global_u64(args, key, str, UDP_SHORT_MIN, MAX_U32/1000, 1000);
+		break;
+	case ARGP_UDP_SHORT_PORTS:
+		error = set_global_u16_array(args, key, str);
+		break;
 	case ARGP_ICMP_TO:
 		error = set_global_u64(args, key, str, 0, MAX_U32/1000, 1000);
 		break;
@@ -535,15 +764,57 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 	case ARGP_TCP_TRANS_TO:
 		error = set_global_u64(args, key, str, TCP_TRANS, MAX_U32/1000, 1000);
 		break;
+	case ARGP_TCP_CLOSED_TO:
+		error = set_global_u64(args, key, str, 0, MAX_U32/1000, 1000);
+		break;
 	case ARGP_FRAG_TO:
 		error = set_global_u64(args, key, str, FRAGMENT_MIN, MAX_U32/1000, 1000);
 		break;
 	case ARGP_STORED_PKTS:
+	case ARGP_STORED_BYTES:
+	case ARGP_MAX_SESSIONS_TCP:
+	case ARGP_MAX_SESSIONS_UDP:
+	case ARGP_MAX_SESSIONS_ICMP:
+	case ARGP_SUBSCRIBER_MAX_BIBS:
+	case ARGP_SUBSCRIBER_MAX_SESSIONS:
+	case ARGP_SUBSCRIBER_MAX_RATE:
+	case ARGP_CPS_BUDGET:
+	case ARGP_FRAG_HIGH_THRESH:
+	case ARGP_FRAG_LOW_THRESH:
+		error = set_global_u32(args, key, str, 0, MAX_U32);
+		break;
+	case ARGP_SUBSCRIBER_PLEN:
+		error = set_global_u8(args, key, str, 0, 128);
+		break;
+	case ARGP_PORT_BLOCK_SIZE:
+		error = set_global_u16(args, key, str, 0, PORT_BLOCK_MAX);
+		break;
+	case ARGP_DETERMINISTIC_BITS:
+		error = set_global_u8(args, key, str, 0, DETERMINISTIC_BITS_MAX);
+		break;
+	case ARGP_SS_NODE_COUNT:
+	case ARGP_SS_NODE_ID:
+		error = set_global_u8(args, key, str, 0, MAX_U8);
+		break;
+	case ARGP_SS_WINDOW:
+		error = set_global_u16(args, key, str, 1, JOOLD_MAX_WINDOW);
+		break;
+	case ARGP_MSS_CLAMP:
+		error = set_global_u16(args, key, str, 0, MAX_U16);
+		break;
+	case ARGP_SS_ADVERTISE_CHUNK:
+	case ARGP_SS_ADVERTISE_RATE:
+	case ARGP_LATENCY_SAMPLING:
+	case ARGP_MIRROR_SAMPLING:
+	case ARGP_PACKET_BUDGET:
 		error = set_global_u32(args, key, str, 0, MAX_U32);
 		break;
 	case ARGP_SS_FLUSH_DEADLINE:
 		error = set_global_u64(args, key, str, 0, MAX_U32, 1);
 		break;
+	case ARGP_SS_RESYNC_INTERVAL:
+		error = set_global_u64(args, key, str, 0, SYNC_INTERVAL_MAX, 1);
+		break;
 	case ARGP_SS_CAPACITY:
 		error = set_global_u32(args, key, str, 0, MAX_U32);
 		break;
@@ -581,6 +852,9 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 
 		strcpy(args->json_filename, str);
 		break;
+	case ARGP_BATCH:
+		args->batch_file = str;
+		break;
 
 	default:
 		error = ARGP_ERR_UNKNOWN;
@@ -621,7 +895,8 @@ static unsigned int zeroize_upper_bits(__u16 num)
  * Uses argp.h to read the parameters from the user, validates them,
  * translates them to a structure and returns the result.
  */
-static int parse_args(int argc, char **argv, struct arguments *result)
+static int parse_args(int argc, char **argv, struct arguments *result,
+		unsigned int argp_flags)
 {
 	int error;
 	struct argp_option *options = build_opts();
@@ -632,9 +907,11 @@ static int parse_args(int argc, char **argv, struct arguments *result)
 	result->op = ANY_OP;
 	result->db.pool4.ports.min = 0;
 	result->db.pool4.ports.max = 65535U;
+	result->db.filter.src4.ports.max = 65535U;
+	result->db.bib.top.plen = 128;
 	result->flags |= DF_SHOW_HEADERS;
 
-	error = argp_parse(&argp, argc, argv, 0, NULL, result);
+	error = argp_parse(&argp, argc, argv, argp_flags, NULL, result);
 	free(options);
 	if (error)
 		return error;
@@ -644,6 +921,10 @@ static int parse_args(int argc, char **argv, struct arguments *result)
 
 	if ((result->flags & (DF_TCP | DF_UDP | DF_ICMP)) == 0)
 		result->flags |= DF_TCP | DF_UDP | DF_ICMP;
+	if ((result->flags & DF_CSV_FORMAT) && (result->flags & DF_JSONL)) {
+		log_err("--csv and --jsonl are mutually exclusive.");
+		return -EINVAL;
+	}
 
 	return 0;
 }
@@ -794,6 +1075,8 @@ static int handle_pool4(struct arguments *args)
 
 	switch (args->op) {
 	case OP_DISPLAY:
+		if (args->flags & DF_USAGE)
+			return pool4_display_usage(args->flags);
 		return pool4_display(args->flags);
 	case OP_COUNT:
 		return pool4_count();
@@ -823,11 +1106,34 @@ static int handle_bib(struct arguments *args)
 	addr6 = args->db.bib.addr6_set ? &args->db.bib.addr6 : NULL;
 	addr4 = args->db.bib.addr4_set ? &args->db.bib.addr4 : NULL;
 
+	if (args->db.bib.bulk_file) {
+		if (addr6 || addr4) {
+			log_err("--bulk and the transport address arguments are mutually exclusive.");
+			return -EINVAL;
+		}
+		if (args->op != OP_ADD && args->op != OP_REMOVE) {
+			log_err("--bulk needs either --add or --remove.");
+			return -EINVAL;
+		}
+		return bib_bulk(args->flags, args->op, args->db.bib.bulk_file);
+	}
+
+	if (args->db.export_file)
+		return bib_export(args->flags, &args->db.filter,
+				args->db.export_file);
+	if (args->db.import_file) {
+		if (addr6 || addr4) {
+			log_err("--import and the transport address arguments are mutually exclusive.");
+			return -EINVAL;
+		}
+		return bib_import(args->flags, args->db.import_file);
+	}
+
 	switch (args->op) {
 	case OP_DISPLAY:
-		return bib_display(args->flags);
+		return bib_display(args->flags, &args->db.filter);
 	case OP_COUNT:
-		return bib_count(args->flags);
+		return bib_count(args->flags, &args->db.bib.top);
 
 	case OP_ADD:
 		if (!addr6 || !addr4) {
@@ -843,6 +1149,17 @@ static int handle_bib(struct arguments *args)
 		}
 		return bib_remove(args->flags, addr6, addr4);
 
+	case OP_UPDATE:
+		if (!args->db.bib.policy) {
+			log_err("The only thing a BIB update can change is the --policy.");
+			return -EINVAL;
+		}
+		if (addr6 || addr4) {
+			log_err("--policy and the transport address arguments are mutually exclusive.");
+			return -EINVAL;
+		}
+		return bib_policy(args->db.bib.policy);
+
 	default:
 		return unknown_op("BIB", args->op);
 	}
@@ -857,9 +1174,21 @@ static int handle_session(struct arguments *args)
 
 	switch (args->op) {
 	case OP_DISPLAY:
-		return session_display(args->flags);
+		if (args->db.export_file)
+			return session_export(args->flags, &args->db.filter,
+					args->db.export_file);
+		return session_display(args->flags, &args->db.filter);
 	case OP_COUNT:
 		return session_count(args->flags);
+	case OP_FOLLOW:
+		return session_follow(args->flags, args->db.follow_since_set
+				? &args->db.follow_since : NULL);
+	case OP_ADD:
+		if (!args->db.import_file) {
+			log_err("Sessions can only be added through --import.");
+			return -EINVAL;
+		}
+		return session_import(args->flags, args->db.import_file);
 	default:
 		return unknown_op("session", args->op);
 	}
@@ -954,6 +1283,8 @@ static int handle_global(struct arguments *args)
 static int handle_joold(struct arguments *args)
 {
 	switch (args->op) {
+	case OP_DISPLAY:
+		return joold_display();
 	case OP_ADVERTISE:
 		return joold_advertise();
 	case OP_TEST:
@@ -962,18 +1293,98 @@ static int handle_joold(struct arguments *args)
 		return unknown_op("joold", args->op);
 	}
 }
+
+/**
+ * --instance --add, then the sessions of --restore, if any.
+ * (They don't need pool4 or pool6 yet; they're only put back in the tables.)
+ */
+static int instance_add_restore(struct arguments *args)
+{
+	int error;
+
+	if (args->shared_tables && args->from) {
+		log_err("--share-tables and --from are mutually exclusive; a copy already shares its tables with the original.");
+		return -EINVAL;
+	}
+
+	error = instance_add(args->shared_tables, args->from);
+	if (error || !args->db.restore_file)
+		return error;
+
+	return session_import(DF_TCP | DF_UDP | DF_ICMP,
+			args->db.restore_file);
+}
+
+/**
+ * --instance --remove, after exporting the sessions into --snapshot, if any.
+ * If the export fails, the instance is kept so the sessions aren't lost.
+ */
+static int instance_rm_snapshot(struct arguments *args)
+{
+	struct bib_filter filter;
+	int error;
+
+	if (args->db.snapshot_file) {
+		memset(&filter, 0, sizeof(filter));
+		error = session_export(DF_TCP | DF_UDP | DF_ICMP, &filter,
+				args->db.snapshot_file);
+		if (error) {
+			log_err("The snapshot failed, so the instance was not removed.");
+			return error;
+		}
+	}
+
+	return instance_rm();
+}
+
 static int handle_instance(struct arguments *args)
 {
+	if ((args->db.snapshot_file || args->db.restore_file)
+			&& xlat_is_siit()) {
+		log_err("SIIT doesn't have sessions.");
+		return -EINVAL;
+	}
+
 	switch (args->op) {
 	case OP_ADD:
-		return instance_add();
+		return instance_add_restore(args);
 	case OP_REMOVE:
-		return instance_rm();
+		return instance_rm_snapshot(args);
 	default:
 		return unknown_op("instance", args->op);
 	}
 }
 
+static int handle_xdp(struct arguments *args)
+{
+	switch (args->op) {
+	case OP_UPDATE:
+		return xdp_update();
+	default:
+		return unknown_op("xdp", args->op);
+	}
+}
+
+static int handle_stats(struct arguments *args)
+{
+	switch (args->op) {
+	case OP_DISPLAY:
+		return stats_display(args->flags, args->watch);
+	default:
+		return unknown_op("stats", args->op);
+	}
+}
+
+static int handle_events(struct arguments *args)
+{
+	switch (args->op) {
+	case OP_DISPLAY:
+		return events_listen(args->flags);
+	default:
+		return unknown_op("events", args->op);
+	}
+}
+
 static int main_wrapped(struct arguments *args)
 {
 	switch (args->mode) {
@@ -998,6 +1409,12 @@ static int main_wrapped(struct arguments *args)
 		return handle_joold(args);
 	case MODE_INSTANCE:
 		return handle_instance(args);
+	case MODE_XDP:
+		return handle_xdp(args);
+	case MODE_STATS:
+		return handle_stats(args);
+	case MODE_EVENTS:
+		return handle_events(args);
 	}
 
 	log_err("Unknown configuration mode: %u", args->mode);
@@ -1011,12 +1428,109 @@ static void print_assumed_command(struct arguments *args)
 			configop_to_string(args->op));
 }
 
+#define BATCH_MAX_ARGS 64
+
+/**
+ * Splits @line into @argv (whose first element is @program), the way the
+ * shell would if there were no quotes. Returns the resulting argc.
+ */
+static int batch_split(char *program, char *line, char **argv)
+{
+	char *token;
+	int argc = 1;
+
+	argv[0] = program;
+	for (token = strtok(line, " \t\r\n"); token;
+			token = strtok(NULL, " \t\r\n")) {
+		if (argc == BATCH_MAX_ARGS)
+			return -E2BIG;
+		argv[argc++] = token;
+	}
+
+	argv[argc] = NULL;
+	return argc;
+}
+
+/**
+ * Runs every line of @file_name ("-" is standard input) as if it were a
+ * separate invocation of this program. Empty lines and lines starting with
+ * '#' are skipped.
+ *
+ * The point is that the commands share the Netlink socket (so the process
+ * and the family are only set up once), and the ones that only expect an ACK
+ * are pipelined. Failed commands don't stop the batch; their errors are
+ * reported along with their line numbers, and the last one is returned.
+ */
+static int run_batch(char *program, char *file_name)
+{
+	FILE *stream;
+	char *line = NULL;
+	size_t line_size = 0;
+	unsigned int line_number = 0;
+	char *argv[BATCH_MAX_ARGS + 1];
+	int argc;
+	struct arguments args;
+	int result = 0;
+	int error;
+
+	stream = (strcmp(file_name, "-") == 0) ? stdin : fopen(file_name, "r");
+	if (!stream) {
+		error = -errno;
+		log_perror("Could not open the file", errno);
+		return error;
+	}
+
+	netlink_pipeline_begin();
+
+	while (getline(&line, &line_size, stream) != -1) {
+		line_number++;
+
+		argc = batch_split(program, line, argv);
+		if (argc == 1 || argv[1][0] == '#')
+			continue;
+
+		netlink_pipeline_tag(line_number);
+
+		if (argc < 0) {
+			log_err("Too many arguments. (Max is %u.)",
+					BATCH_MAX_ARGS - 1);
+			error = argc;
+		} else {
+			/* argp must not exit() on us halfway through. */
+			error = parse_args(argc, argv, &args, ARGP_NO_EXIT);
+			if (!error) {
+				if (args.batch_file) {
+					log_err("Batches cannot be nested.");
+					error = -EINVAL;
+				} else {
+					error = main_wrapped(&args);
+				}
+				destroy_args(&args);
+			}
+		}
+
+		if (error) {
+			log_err("(Line %u failed.)", line_number);
+			result = error;
+		}
+	}
+
+	error = netlink_pipeline_end();
+	if (error)
+		result = error;
+
+	free(line);
+	if (stream != stdin)
+		fclose(stream);
+	return result;
+}
+
 int main(int argc, char **argv)
 {
 	struct arguments args;
 	int error;
 
-	error = parse_args(argc, argv, &args);
+	error = parse_args(argc, argv, &args, 0);
 	if (error)
 		return error;
 
@@ -1026,9 +1540,13 @@ int main(int argc, char **argv)
 		return error;
 	}
 
-	error = main_wrapped(&args);
-	if (error)
-		print_assumed_command(&args);
+	if (args.batch_file) {
+		error = run_batch(argv[0], args.batch_file);
+	} else {
+		error = main_wrapped(&args);
+		if (error)
+			print_assumed_command(&args);
+	}
 
 	netlink_teardown();
 	destroy_args(&args);
@@ -0,0 +1,259 @@
+#include "nat64/usr/json_stream.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nat64/common/types.h"
+
+int jstream_open(struct json_stream *stream, char *file_name)
+{
+	memset(stream, 0, sizeof(*stream));
+
+	stream->file = fopen(file_name, "rb");
+	if (!stream->file) {
+		perror("fopen() error");
+		return -EINVAL;
+	}
+
+	stream->line = 1;
+	return 0;
+}
+
+void jstream_close(struct json_stream *stream)
+{
+	fclose(stream->file);
+	free(stream->buffer);
+}
+
+static int next_char(struct json_stream *stream)
+{
+	int c;
+
+	c = getc(stream->file);
+	if (c == '\n')
+		stream->line++;
+	return c;
+}
+
+static void unread_char(struct json_stream *stream, int c)
+{
+	if (c == EOF)
+		return;
+	if (c == '\n')
+		stream->line--;
+	ungetc(c, stream->file);
+}
+
+/**
+ * Returns the next character that isn't whitespace, without consuming it.
+ */
+static int peek(struct json_stream *stream)
+{
+	int c;
+
+	do {
+		c = next_char(stream);
+	} while (c != EOF && isspace(c));
+
+	unread_char(stream, c);
+	return c;
+}
+
+static int syntax_error(struct json_stream *stream, char *msg)
+{
+	log_err("JSON syntax error on line %u: %s", stream->line, msg);
+	return -EINVAL;
+}
+
+static int append(struct json_stream *stream, char c)
+{
+	size_t capacity;
+	char *buffer;
+
+	/* +1 for the NULL chara. */
+	if (stream->len + 1 >= stream->capacity) {
+		capacity = stream->capacity ? (2 * stream->capacity) : 256;
+		buffer = realloc(stream->buffer, capacity);
+		if (!buffer) {
+			log_err("Out of memory.");
+			return -ENOMEM;
+		}
+		stream->buffer = buffer;
+		stream->capacity = capacity;
+	}
+
+	stream->buffer[stream->len++] = c;
+	stream->buffer[stream->len] = '\0';
+	return 0;
+}
+
+/**
+ * Copies the text of the next value (of any type) into @stream->buffer.
+ * Containers are handled by counting brackets; whatever is inside is cJSON's
+ * problem.
+ */
+static int read_raw(struct json_stream *stream)
+{
+	unsigned int depth = 0;
+	bool in_string = false;
+	bool escaped = false;
+	int c;
+	int error;
+
+	stream->len = 0;
+	if (peek(stream) == EOF)
+		return syntax_error(stream, "Unexpected end of file.");
+
+	while ((c = next_char(stream)) != EOF) {
+		if (in_string) {
+			if (escaped)
+				escaped = false;
+			else if (c == '\\')
+				escaped = true;
+			else if (c == '"')
+				in_string = false;
+		} else if (c == '"') {
+			in_string = true;
+		} else if (c == '{' || c == '[') {
+			depth++;
+		} else if (c == '}' || c == ']' || c == ',') {
+			/* These end scalars, so they belong to the parent. */
+			if (depth == 0) {
+				unread_char(stream, c);
+				break;
+			}
+			if (c != ',')
+				depth--;
+		}
+
+		error = append(stream, c);
+		if (error)
+			return error;
+
+		/* Strings and containers end themselves. */
+		if (depth == 0 && !in_string && (c == '"' || c == '}' || c == ']'))
+			break;
+	}
+
+	if (in_string || depth > 0)
+		return syntax_error(stream, "Unexpected end of file.");
+	if (stream->len == 0)
+		return syntax_error(stream, "Expected a value.");
+	return 0;
+}
+
+/**
+ * Reads the next value. Remember to cJSON_Delete() @json.
+ */
+int jstream_value(struct json_stream *stream, cJSON **json)
+{
+	int error;
+
+	error = read_raw(stream);
+	if (error)
+		return error;
+
+	*json = cJSON_Parse(stream->buffer);
+	if (!*json) {
+		log_err("The JSON parser got confused around about here (line %u):",
+				stream->line);
+		log_err("%s", cJSON_GetErrorPtr());
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * Consumes the next character, which is expected to be @expected.
+ */
+static int expect(struct json_stream *stream, int expected, char *msg)
+{
+	if (peek(stream) != expected)
+		return syntax_error(stream, msg);
+	next_char(stream);
+	return 0;
+}
+
+int jstream_object_start(struct json_stream *stream)
+{
+	stream->first_key = true;
+	return expect(stream, '{', "Expected an object.");
+}
+
+/**
+ * Reads the next key of the object (and the colon that follows it), so the
+ * caller can read the value any way it wants.
+ *
+ * Returns 1 (and the key in @key, which you need to free) if there was a
+ * key, 0 if the object ended, and a negative error code otherwise.
+ */
+int jstream_next_key(struct json_stream *stream, char **key)
+{
+	cJSON *json;
+	int error;
+
+	if (peek(stream) == '}') {
+		next_char(stream);
+		return 0;
+	}
+
+	if (!stream->first_key) {
+		error = expect(stream, ',', "Expected a comma or a '}'.");
+		if (error)
+			return error;
+	}
+	stream->first_key = false;
+
+	if (peek(stream) != '"')
+		return syntax_error(stream, "Expected a key.");
+	error = jstream_value(stream, &json);
+	if (error)
+		return error;
+	*key = strdup(json->valuestring);
+	cJSON_Delete(json);
+	if (!*key) {
+		log_err("Out of memory.");
+		return -ENOMEM;
+	}
+
+	error = expect(stream, ':', "Expected a colon.");
+	if (error) {
+		free(*key);
+		return error;
+	}
+
+	return 1;
+}
+
+int jstream_array_start(struct json_stream *stream)
+{
+	stream->first_element = true;
+	return expect(stream, '[', "Expected an array.");
+}
+
+/**
+ * Returns 1 (and the element in @json, which you need to cJSON_Delete()) if
+ * there was an element, 0 if the array ended, and a negative error code
+ * otherwise.
+ */
+int jstream_next_element(struct json_stream *stream, cJSON **json)
+{
+	int error;
+
+	if (peek(stream) == ']') {
+		next_char(stream);
+		return 0;
+	}
+
+	if (!stream->first_element) {
+		error = expect(stream, ',', "Expected a comma or a ']'.");
+		if (error)
+			return error;
+	}
+	stream->first_element = false;
+
+	error = jstream_value(stream, json);
+	return error ? error : 1;
+}
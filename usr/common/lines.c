@@ -0,0 +1,153 @@
+#include "nat64/usr/lines.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/* Size of stdout's buffer while the records are being printed. */
+#define LINES_BUFFER_SIZE (1024 * 1024)
+
+static char stdout_buffer[LINES_BUFFER_SIZE];
+
+/**
+ * Makes stdout fully buffered, with a buffer large enough to fit several
+ * thousand records. Has to be called before anything is printed.
+ */
+void lines_init(void)
+{
+	setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer));
+}
+
+void line_start(struct line *line, bool json)
+{
+	line->len = 0;
+	line->json = json;
+	line->fields = 0;
+}
+
+/** Writes the newline, and queues the line on stdout. */
+void line_end(struct line *line)
+{
+	if (line->json)
+		line->buffer[line->len++] = '}';
+	line->buffer[line->len++] = '\n';
+	fwrite_unlocked(line->buffer, 1, line->len, stdout);
+}
+
+static void append(struct line *line, const char *str, size_t len)
+{
+	/* Two bytes stay reserved for line_end(). */
+	if (line->len + len > LINE_CAPACITY - 2)
+		len = LINE_CAPACITY - 2 - line->len;
+	memcpy(line->buffer + line->len, str, len);
+	line->len += len;
+}
+
+/* Writes the separator, and the field name if this is JSON. */
+static void field(struct line *line, const char *name)
+{
+	if (line->json) {
+		append(line, line->fields ? ",\"" : "{\"", 2);
+		append(line, name, strlen(name));
+		append(line, "\":", 2);
+	} else if (line->fields) {
+		append(line, ",", 1);
+	}
+
+	line->fields++;
+}
+
+static void quote(struct line *line)
+{
+	if (line->json)
+		append(line, "\"", 1);
+}
+
+/* The values are ours (names, states, addresses), so they need no escaping. */
+void line_str(struct line *line, const char *name, const char *value)
+{
+	field(line, name);
+	quote(line);
+	append(line, value, strlen(value));
+	quote(line);
+}
+
+static void append_u64(struct line *line, __u64 value)
+{
+	char digits[20];
+	unsigned int i = sizeof(digits);
+
+	do {
+		digits[--i] = '0' + (value % 10);
+		value /= 10;
+	} while (value);
+
+	append(line, digits + i, sizeof(digits) - i);
+}
+
+void line_u64(struct line *line, const char *name, __u64 value)
+{
+	field(line, name);
+	append_u64(line, value);
+}
+
+/* CSV prints them as 0 and 1, like it always did. */
+void line_bool(struct line *line, const char *name, bool value)
+{
+	field(line, name);
+	if (line->json)
+		append(line, value ? "true" : "false", value ? 4 : 5);
+	else
+		append(line, value ? "1" : "0", 1);
+}
+
+void line_addr6(struct line *line, const char *name,
+		const struct in6_addr *addr)
+{
+	char str[INET6_ADDRSTRLEN];
+
+	field(line, name);
+	quote(line);
+	if (inet_ntop(AF_INET6, addr, str, sizeof(str)))
+		append(line, str, strlen(str));
+	quote(line);
+}
+
+void line_addr4(struct line *line, const char *name,
+		const struct in_addr *addr)
+{
+	char str[INET_ADDRSTRLEN];
+
+	field(line, name);
+	quote(line);
+	if (inet_ntop(AF_INET, addr, str, sizeof(str)))
+		append(line, str, strlen(str));
+	quote(line);
+}
+
+static void append_2digits(struct line *line, unsigned int value)
+{
+	if (value < 10)
+		append(line, "0", 1);
+	append_u64(line, value);
+}
+
+/**
+ * JSON gets the milliseconds. CSV gets what print_time_csv() prints.
+ */
+void line_time(struct line *line, const char *name, unsigned int millis)
+{
+	field(line, name);
+	if (line->json) {
+		append_u64(line, millis);
+		return;
+	}
+
+	append_2digits(line, millis / 3600000);
+	append(line, ":", 1);
+	append_2digits(line, (millis / 60000) % 60);
+	append(line, ":", 1);
+	append_2digits(line, (millis / 1000) % 60);
+	append(line, ".", 1);
+	append_u64(line, millis % 1000);
+}
@@ -87,11 +87,9 @@ int netlink_parse_response(void *data, size_t data_len, struct jool_response *re
  * Because NL_SKIP == EPERM and NL_STOP == ENOENT, you should mind the sign of
  * the result HARD.
  */
-static int response_handler(struct nl_msg *msg, void *void_arg)
+static int msg_to_response(struct nl_msg *msg, struct jool_response *response)
 {
-	struct jool_response response;
 	struct nlattr *attrs[__ATTR_MAX + 1];
-	struct response_cb *arg;
 	int error;
 
 	error = genlmsg_parse(nlmsg_hdr(msg), 0, attrs, __ATTR_MAX, NULL);
@@ -106,30 +104,36 @@ static int response_handler(struct nl_msg *msg, void *void_arg)
 	}
 	error = netlink_parse_response(nla_data(attrs[ATTR_DATA]),
 			nla_len(attrs[ATTR_DATA]),
-			&response);
+			response);
+	return -abs(error);
+}
+
+static int response_handler(struct nl_msg *msg, void *void_arg)
+{
+	struct jool_response response;
+	struct response_cb *arg;
+	int error;
+
+	error = msg_to_response(msg, &response);
 	if (error)
-		return -abs(error);
+		return error;
 
 	arg = void_arg;
 	return (arg && arg->cb) ? (-abs(arg->cb(&response, arg->arg))) : 0;
 }
 
-int netlink_request(void *request, __u32 request_len,
-		jool_response_cb cb, void *cb_arg)
+/**
+ * Sends @request, and returns (in @seq, if not NULL) the sequence number the
+ * kernel is going to answer with.
+ */
+static int send_request(void *request, __u32 request_len, __u32 *seq)
 {
 	struct nl_msg *msg;
-	struct response_cb callback = { .cb = cb, .arg = cb_arg };
 	int error;
 
-	error = nl_socket_modify_cb(sk, NL_CB_MSG_IN, NL_CB_CUSTOM,
-			response_handler, &callback);
-	if (error < 0) {
-		log_err("Could not register response handler.");
-		log_err("I will not be able to parse Jool's response, so I won't send the request.");
-		return netlink_print_error(error);
-	}
-
-	msg = nlmsg_alloc();
+	/* Bulk requests might not fit in the default (one page) size. */
+	msg = nlmsg_alloc_size(NLMSG_HDRLEN + GENL_HDRLEN
+			+ nla_total_size(request_len));
 	if (!msg) {
 		log_err("Could not allocate the message to the kernel; it seems we're out of memory.");
 		return -ENOMEM;
@@ -150,12 +154,192 @@ int netlink_request(void *request, __u32 request_len,
 	}
 
 	error = nl_send_auto(sk, msg);
+	if (seq)
+		*seq = nlmsg_hdr(msg)->nlmsg_seq;
 	nlmsg_free(msg);
 	if (error < 0) {
 		log_err("Could not dispatch the request to kernelspace.");
 		return netlink_print_error(error);
 	}
 
+	return 0;
+}
+
+/*
+ * Pipelining.
+ *
+ * While enabled, the requests which only expect an ACK (the ones which don't
+ * provide a response callback) are sent without waiting for it. The ACKs are
+ * collected once PIPELINE_WINDOW requests are in flight (so the kernel never
+ * overflows the socket's receive buffer), before any request which does want
+ * its response, and by netlink_pipeline_end().
+ *
+ * The kernel handles its requests strictly in order, so the responses arrive
+ * in order as well.
+ */
+
+#define PIPELINE_WINDOW 64
+
+struct pipelined_request {
+	__u32 seq;
+	/* Whatever the caller wants to identify the request with. */
+	unsigned int tag;
+};
+
+static struct {
+	bool enabled;
+	/* Queue of the requests whose ACK hasn't arrived yet. */
+	struct pipelined_request reqs[PIPELINE_WINDOW];
+	unsigned int head;
+	unsigned int count;
+	/* Tag of the requests that come next. */
+	unsigned int tag;
+	/* The last error the kernel answered with. */
+	int error;
+} pipeline;
+
+static int pipeline_handler(struct nl_msg *msg, void *arg)
+{
+	struct pipelined_request *req;
+	struct jool_response response;
+	int error;
+
+	if (pipeline.count == 0) {
+		log_err("Jool sent a response nobody was waiting for.");
+		return NL_SKIP;
+	}
+
+	req = &pipeline.reqs[pipeline.head];
+	if (nlmsg_hdr(msg)->nlmsg_seq != req->seq) {
+		log_err("Jool's response seems to be out of order; ignoring it.");
+		return NL_SKIP;
+	}
+	pipeline.head = (pipeline.head + 1) % PIPELINE_WINDOW;
+	pipeline.count--;
+
+	error = msg_to_response(msg, &response);
+	error_handler_called = false;
+	if (error) {
+		log_err("(The request came from line %u.)", req->tag);
+		pipeline.error = error;
+	}
+
+	/* The error has been reported; keep collecting the rest. */
+	return NL_OK;
+}
+
+/**
+ * Collects ACKs until there are no more than @max requests in flight.
+ */
+static int pipeline_drain(unsigned int max)
+{
+	int error;
+
+	if (pipeline.count <= max)
+		return 0;
+
+	error = nl_socket_modify_cb(sk, NL_CB_MSG_IN, NL_CB_CUSTOM,
+			pipeline_handler, NULL);
+	if (error < 0) {
+		log_err("Could not register the response handler.");
+		return netlink_print_error(error);
+	}
+
+	while (pipeline.count > max) {
+		error = nl_recvmsgs_default(sk);
+		if (error < 0) {
+			log_err("Error receiving the kernel module's responses; %u of them are lost.",
+					pipeline.count);
+			pipeline.head = 0;
+			pipeline.count = 0;
+			return netlink_print_error(error);
+		}
+	}
+
+	return 0;
+}
+
+static int pipeline_send(void *request, __u32 request_len)
+{
+	struct pipelined_request *req;
+	__u32 seq;
+	int error;
+
+	error = pipeline_drain(PIPELINE_WINDOW - 1);
+	if (error)
+		return error;
+
+	error = send_request(request, request_len, &seq);
+	if (error)
+		return error;
+
+	req = &pipeline.reqs[(pipeline.head + pipeline.count) % PIPELINE_WINDOW];
+	req->seq = seq;
+	req->tag = pipeline.tag;
+	pipeline.count++;
+	return 0;
+}
+
+/**
+ * Starts pipelining requests. Errors will be reported as the ACKs arrive, so
+ * netlink_request() might return success for a request that ends up failing;
+ * you find out from netlink_pipeline_end().
+ */
+void netlink_pipeline_begin(void)
+{
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.enabled = true;
+}
+
+/**
+ * Labels the requests that follow, so their errors can be traced back to
+ * their origin. (Currently a line number.)
+ */
+void netlink_pipeline_tag(unsigned int tag)
+{
+	pipeline.tag = tag;
+}
+
+/**
+ * Waits for all the pending ACKs and stops pipelining. Returns the last
+ * error the kernel responded with, if any.
+ */
+int netlink_pipeline_end(void)
+{
+	int error;
+
+	error = pipeline_drain(0);
+	pipeline.enabled = false;
+	return error ? : pipeline.error;
+}
+
+int netlink_request(void *request, __u32 request_len,
+		jool_response_cb cb, void *cb_arg)
+{
+	struct response_cb callback = { .cb = cb, .arg = cb_arg };
+	int error;
+
+	if (pipeline.enabled) {
+		if (!cb)
+			return pipeline_send(request, request_len);
+		/* The responses would get mixed up otherwise. */
+		error = pipeline_drain(0);
+		if (error)
+			return error;
+	}
+
+	error = nl_socket_modify_cb(sk, NL_CB_MSG_IN, NL_CB_CUSTOM,
+			response_handler, &callback);
+	if (error < 0) {
+		log_err("Could not register response handler.");
+		log_err("I will not be able to parse Jool's response, so I won't send the request.");
+		return netlink_print_error(error);
+	}
+
+	error = send_request(request, request_len, NULL);
+	if (error)
+		return error;
+
 	error = nl_recvmsgs_default(sk);
 	if (error < 0) {
 		if (error_handler_called) {
@@ -169,6 +353,93 @@ int netlink_request(void *request, __u32 request_len,
 	return 0;
 }
 
+/**
+ * Sends @request as a Netlink dump (NLM_F_DUMP) request. The kernel answers with
+ * as many (full) messages as it needs, and @cb is called once for each of
+ * them. Meant for large tables; there is no need to resend the request
+ * with an offset.
+ */
+int netlink_dump(void *request, __u32 request_len,
+		jool_response_cb cb, void *cb_arg)
+{
+	struct nl_msg *msg;
+	struct nl_cb *nlcb;
+	struct response_cb callback = { .cb = cb, .arg = cb_arg };
+	int error;
+
+	if (pipeline.enabled) {
+		error = pipeline_drain(0);
+		if (error)
+			return error;
+	}
+
+	/*
+	 * Use a private callback set; the socket's NL_CB_MSG_IN (see
+	 * netlink_request()) would otherwise also catch the NLMSG_DONE.
+	 */
+	nlcb = nl_cb_alloc(NL_CB_DEFAULT);
+	if (!nlcb) {
+		log_err("Could not allocate the Netlink callbacks; it seems we're out of memory.");
+		return -ENOMEM;
+	}
+
+	error = nl_cb_set(nlcb, NL_CB_VALID, NL_CB_CUSTOM, response_handler,
+			&callback);
+	if (error < 0) {
+		log_err("Could not register response handler.");
+		log_err("I will not be able to parse Jool's response, so I won't send the request.");
+		nl_cb_put(nlcb);
+		return netlink_print_error(error);
+	}
+
+	msg = nlmsg_alloc();
+	if (!msg) {
+		log_err("Could not allocate the message to the kernel; it seems we're out of memory.");
+		nl_cb_put(nlcb);
+		return -ENOMEM;
+	}
+
+	if (!genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, family, 0, NLM_F_DUMP,
+			JOOL_COMMAND, 1)) {
+		log_err("Unknown error building the packet to the kernel.");
+		error = -EINVAL;
+		goto end;
+	}
+
+	error = nla_put(msg, ATTR_DATA, request_len, request);
+	if (error) {
+		log_err("Could not write on the packet to kernelspace.");
+		error = netlink_print_error(error);
+		goto end;
+	}
+
+	error = nl_send_auto(sk, msg);
+	if (error < 0) {
+		log_err("Could not dispatch the request to kernelspace.");
+		error = netlink_print_error(error);
+		goto end;
+	}
+
+	error = nl_recvmsgs(sk, nlcb);
+	if (error < 0) {
+		if (error_handler_called) {
+			error_handler_called = false;
+			goto end;
+		}
+		log_err("Error receiving the kernel module's response.");
+		error = netlink_print_error(error);
+		goto end;
+	}
+
+	error = 0;
+	/* Fall through. */
+
+end:
+	nlmsg_free(msg);
+	nl_cb_put(nlcb);
+	return error;
+}
+
 int netlink_request_simple(void *request, __u32 request_len)
 {
 	struct nl_msg *msg;
@@ -227,6 +498,24 @@ int netlink_setup(void)
 		goto fail;
 	}
 
+	/*
+	 * Large requests (eg. atomic configuration) would not fit in the
+	 * default send buffer, and large buffers let the kernel pack more
+	 * entries on each dump message.
+	 * The kernel silently caps these at its [rw]mem_max, which is fine.
+	 */
+	error = nl_socket_set_buffer_size(sk, NETLINK_SOCKET_BUFSIZE,
+			NETLINK_SOCKET_BUFSIZE);
+	if (error) {
+		log_err("Could not resize the socket's buffers.");
+		goto fail;
+	}
+	error = nl_socket_set_msg_buf_size(sk, NETLINK_MSG_BUFSIZE);
+	if (error) {
+		log_err("Could not resize the socket's message buffer.");
+		goto fail;
+	}
+
 	family = genl_ctrl_resolve(sk, GNL_JOOL_FAMILY_NAME);
 	if (family < 0) {
 		log_err("Jool's socket family doesn't seem to exist.");
@@ -7,11 +7,15 @@
 #include "nat64/common/types.h"
 #include "nat64/usr/netlink.h"
 
-#define BUFFER_MAX 256
+/*
+ * Used to be 256 bytes, which turned uploading a large configuration into
+ * thousands of round trips.
+ */
+#define BUFFER_MAX NETLINK_REQUEST_MAX
 
 struct nl_buffer {
-	unsigned char chars[BUFFER_MAX];
 	size_t len;
+	unsigned char chars[BUFFER_MAX];
 };
 
 struct nl_buffer *nlbuffer_alloc(void)
@@ -5,7 +5,6 @@
 #include <errno.h>
 #include <stdio.h>
 #include <arpa/inet.h>
-#include <regex.h>
 #include "nat64/common/constants.h"
 #include "nat64/common/types.h"
 #include "nat64/usr/global.h"
@@ -82,6 +81,12 @@ char *configmode_to_string(enum config_mode mode)
 		return OPTNAME_JOOLD;
 	case MODE_INSTANCE:
 		return OPTNAME_INSTANCE;
+	case MODE_XDP:
+		return OPTNAME_XDP;
+	case MODE_STATS:
+		return OPTNAME_STATS;
+	case MODE_EVENTS:
+		return OPTNAME_EVENTS;
 	}
 
 	return "unknown";
@@ -108,6 +113,12 @@ char *configop_to_string(enum config_operation op)
 		return OPTNAME_TEST;
 	case OP_ACK:
 		return OPTNAME_ACK;
+	case OP_ADVERTISE_END:
+		return "advertise end";
+	case OP_BIND:
+		return "bind";
+	case OP_FOLLOW:
+		return "follow";
 	}
 
 	return "unknown";
@@ -115,36 +126,20 @@ char *configop_to_string(enum config_operation op)
 
 int validate_int(const char *str)
 {
-	regex_t integer_regex;
-	int error;
-
 	if (!str) {
 		log_err("Programming error: 'str' is NULL.");
 		return -EINVAL;
 	}
 
-	/* It seems this RE implementation doesn't understand '+'. */
-	if (regcomp(&integer_regex, "^[0-9][0-9]*", 0)) {
-		log_err("Warning: Integer regex didn't compile.");
-		log_err("(I will be unable to validate integer inputs.)");
-		regfree(&integer_regex);
-		/*
-		 * Don't punish the user over our incompetence.
-		 * If the number is valid, this will not bother the user.
-		 * Otherwise strtoull() will just read a random value, but then
-		 * the user is at fault.
-		 */
-		return 0;
-	}
-
-	error = regexec(&integer_regex, str, 0, NULL, 0);
-	if (error) {
-		log_err("'%s' is not a number. (error code %d)", str, error);
-		regfree(&integer_regex);
-		return error;
+	/*
+	 * Only the first character matters; strtoull() stops at the first
+	 * non-digit anyway.
+	 */
+	if (str[0] < '0' || '9' < str[0]) {
+		log_err("'%s' is not a number.", str);
+		return -EINVAL;
 	}
 
-	regfree(&integer_regex);
 	return 0;
 }
 
@@ -245,24 +240,12 @@ int str_to_u64(const char *str, __u64 *u64_out, __u64 min, __u64 max)
 
 int str_to_port_range(char *str, struct port_range *range)
 {
-	unsigned long long int tmp;
-	char *endptr = NULL;
-	int error;
-
-	error = str_to_ull(str, &endptr, 0, 65535, &tmp);
-	if (error)
-		return error;
-	range->min = tmp;
-
-	if (*endptr != '-') {
-		range->max = range->min;
-		return 0;
+	if (parse_port_range(str, strlen(str), range)) {
+		log_err("Cannot parse '%s' as a port range (eg. 1024-65535).",
+				str);
+		return -EINVAL;
 	}
-
-	error = str_to_ull(endptr + 1, NULL, 0, 65535, &tmp);
-	if (!error)
-		range->max = tmp;
-	return error;
+	return 0;
 }
 
 #define STR_MAX_LEN 2048
@@ -342,140 +325,304 @@ int str_to_addr6(const char *str, struct in6_addr *result)
 	return 0;
 }
 
-#undef STR_MAX_LEN
-#define STR_MAX_LEN (INET_ADDRSTRLEN + 1 + 5) /* [addr + null chara] + # + port */
 int str_to_addr4_port(const char *str, struct ipv4_transport_addr *addr_out)
 {
-	const char *FORMAT = "<IPv4 address>#<port> (eg. 203.0.113.8#80)";
-	/* strtok corrupts the string, so we'll be using this copy instead. */
-	char str_copy[STR_MAX_LEN];
-	char *token;
-	int error;
-
-	if (strlen(str) + 1 > STR_MAX_LEN) {
-		log_err("'%s' is too long for this poor, limited parser...", str);
+	if (parse_addr4_port(str, strlen(str), addr_out)) {
+		log_err("Cannot parse '%s' as a <IPv4 address>#<port> (eg. 203.0.113.8#80).",
+				str);
 		return -EINVAL;
 	}
-	strcpy(str_copy, str);
+	return 0;
+}
 
-	token = strtok(str_copy, "#");
-	if (!token) {
-		log_err("Cannot parse '%s' as a %s.", str, FORMAT);
+int str_to_addr6_port(const char *str, struct ipv6_transport_addr *addr_out)
+{
+	if (parse_addr6_port(str, strlen(str), addr_out)) {
+		log_err("Cannot parse '%s' as a <IPv6 address>#<port> (eg. 2001:db8::1#96).",
+				str);
 		return -EINVAL;
 	}
+	return 0;
+}
 
-	error = str_to_addr4(token, &addr_out->l3);
-	if (error)
-		return error;
-
-	token = strtok(NULL, "#");
-	if (!token) {
-		log_err("'%s' does not seem to contain a port (format: %s).", str, FORMAT);
+int str_to_prefix4(const char *str, struct ipv4_prefix *prefix_out)
+{
+	if (parse_prefix4(str, strlen(str), prefix_out)) {
+		log_err("Cannot parse '%s' as a <IPv4 address>[/<mask>] (eg. 192.0.2.0/24; the mask has to be 0-32).",
+				str);
 		return -EINVAL;
 	}
-	return str_to_u16(token, &addr_out->l4, 0, MAX_PORT); /* Error msg already printed. */
+	return 0;
 }
 
-#undef STR_MAX_LEN
-#define STR_MAX_LEN (INET6_ADDRSTRLEN + 1 + 5) /* [addr + null chara] + # + port */
-int str_to_addr6_port(const char *str, struct ipv6_transport_addr *addr_out)
+int str_to_prefix6(const char *str, struct ipv6_prefix *prefix_out)
 {
-	const char *FORMAT = "<IPv6 address>#<port> (eg. 2001:db8::1#96)";
-	/* strtok corrupts the string, so we'll be using this copy instead. */
-	char str_copy[STR_MAX_LEN];
-	char *token;
-	int error;
-
-	if (strlen(str) + 1 > STR_MAX_LEN) {
-		log_err("'%s' is too long for this poor, limited parser...", str);
+	if (parse_prefix6(str, strlen(str), prefix_out)) {
+		log_err("Cannot parse '%s' as a <IPv6 address>[/<length>] (eg. 64:ff9b::/96; the length has to be 0-128).",
+				str);
 		return -EINVAL;
 	}
-	strcpy(str_copy, str);
+	return 0;
+}
 
-	token = strtok(str_copy, "#");
-	if (!token) {
-		log_err("Cannot parse '%s' as a %s.", str, FORMAT);
-		return -EINVAL;
-	}
+/*
+ * The parse_*() functions. Unlike the rest of this file, they are meant for the
+ * bulk loaders, which might parse millions of strings, so they don't allocate,
+ * copy or print anything. They read exactly @len characters and fail on
+ * anything else (including trailing garbage).
+ */
 
-	error = str_to_addr6(token, &addr_out->l3);
-	if (error)
-		return error;
+static int parse_uint(const char *str, size_t len, unsigned int max,
+		unsigned int *result)
+{
+	unsigned int value = 0;
+	size_t i;
 
-	token = strtok(NULL, "#");
-	if (!token) {
-		log_err("'%s' does not seem to contain a port (format: %s).", str, FORMAT);
+	if (len == 0)
 		return -EINVAL;
+
+	for (i = 0; i < len; i++) {
+		if (str[i] < '0' || '9' < str[i])
+			return -EINVAL;
+		value = 10 * value + (str[i] - '0');
+		if (value > max)
+			return -EINVAL;
 	}
-	return str_to_u16(token, &addr_out->l4, 0, MAX_PORT); /* Error msg already printed. */
+
+	*result = value;
+	return 0;
 }
 
-#undef STR_MAX_LEN
-#define STR_MAX_LEN (INET_ADDRSTRLEN + 1 + 2) /* [addr + null chara] + / + mask */
-int str_to_prefix4(const char *str, struct ipv4_prefix *prefix_out)
+static int hex_value(char chara)
 {
-	const char *FORMAT = "<IPv4 address>[/<mask>] (eg. 192.0.2.0/24)";
-	/* strtok corrupts the string, so we'll be using this copy instead. */
-	char str_copy[STR_MAX_LEN];
-	char *token;
-	int error;
+	if ('0' <= chara && chara <= '9')
+		return chara - '0';
+	if ('a' <= chara && chara <= 'f')
+		return chara - 'a' + 10;
+	if ('A' <= chara && chara <= 'F')
+		return chara - 'A' + 10;
+	return -1;
+}
 
-	if (strlen(str) + 1 > STR_MAX_LEN) {
-		log_err("'%s' is too long for this poor, limited parser...", str);
-		return -EINVAL;
+/* Same rules as inet_pton(AF_INET): four decimal octets, no leading zeroes. */
+int parse_addr4(const char *str, size_t len, struct in_addr *result)
+{
+	__u32 addr = 0;
+	unsigned int octet = 0;
+	unsigned int digits = 0;
+	unsigned int dots = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if ('0' <= str[i] && str[i] <= '9') {
+			if (digits && octet == 0)
+				return -EINVAL;
+			octet = 10 * octet + (str[i] - '0');
+			if (octet > 255)
+				return -EINVAL;
+			digits++;
+		} else if (str[i] == '.') {
+			if (!digits || dots == 3)
+				return -EINVAL;
+			addr = (addr << 8) | octet;
+			octet = 0;
+			digits = 0;
+			dots++;
+		} else {
+			return -EINVAL;
+		}
 	}
-	strcpy(str_copy, str);
 
-	token = strtok(str_copy, "/");
-	if (!token) {
-		log_err("Cannot parse '%s' as a %s.", str, FORMAT);
+	if (!digits || dots != 3)
+		return -EINVAL;
+
+	result->s_addr = htonl((addr << 8) | octet);
+	return 0;
+}
+
+/*
+ * Same rules as inet_pton(AF_INET6): up to eight groups of one to four hex
+ * digits, at most one "::", and optionally an IPv4 address in place of the last
+ * two groups.
+ */
+int parse_addr6(const char *str, size_t len, struct in6_addr *result)
+{
+	__u8 *bytes = result->s6_addr;
+	/* Where the "::" was, in bytes. -1 means there wasn't one. */
+	int gap = -1;
+	unsigned int pos = 0;
+	unsigned int value = 0;
+	unsigned int digits = 0;
+	/* Start of the current group, in case it turns out to be IPv4. */
+	size_t group = 0;
+	size_t i = 0;
+	struct in_addr addr4;
+	int hex;
+
+	memset(bytes, 0, 16);
+
+	if (len > 0 && str[0] == ':') {
+		if (len < 2 || str[1] != ':')
+			return -EINVAL;
+		i = 1;
+	}
+
+	for (; i < len; i++) {
+		hex = hex_value(str[i]);
+		if (hex >= 0) {
+			if (++digits > 4)
+				return -EINVAL;
+			value = (value << 4) | hex;
+			continue;
+		}
+
+		if (str[i] == ':') {
+			group = i + 1;
+			if (!digits) {
+				if (gap != -1)
+					return -EINVAL;
+				gap = pos;
+				continue;
+			}
+			if (group == len || pos + 2 > 16)
+				return -EINVAL;
+			bytes[pos++] = value >> 8;
+			bytes[pos++] = value;
+			value = 0;
+			digits = 0;
+			continue;
+		}
+
+		if (str[i] == '.' && pos + 4 <= 16) {
+			if (parse_addr4(str + group, len - group, &addr4))
+				return -EINVAL;
+			memcpy(bytes + pos, &addr4, 4);
+			pos += 4;
+			digits = 0;
+			break;
+		}
+
 		return -EINVAL;
 	}
 
-	error = str_to_addr4(token, &prefix_out->address);
-	if (error)
-		return error;
+	if (digits) {
+		if (pos + 2 > 16)
+			return -EINVAL;
+		bytes[pos++] = value >> 8;
+		bytes[pos++] = value;
+	}
 
-	token = strtok(NULL, "/");
-	if (!token) {
-		prefix_out->len = IPV4_MAX_PREFIX;
-		return 0;
+	if (gap != -1) {
+		if (pos == 16)
+			return -EINVAL;
+		memmove(bytes + 16 - (pos - gap), bytes + gap, pos - gap);
+		memset(bytes + gap, 0, 16 - pos);
+		pos = 16;
 	}
-	return str_to_u8(token, &prefix_out->len, 0, 32); /* Error msg already printed. */
+
+	return (pos == 16) ? 0 : -EINVAL;
 }
 
-#undef STR_MAX_LEN
-#define STR_MAX_LEN (INET6_ADDRSTRLEN + 1 + 3) /* [addr + null chara] + / + pref len */
-int str_to_prefix6(const char *str, struct ipv6_prefix *prefix_out)
+int parse_addr4_port(const char *str, size_t len,
+		struct ipv4_transport_addr *result)
 {
-	const char *FORMAT = "<IPv6 address>[/<length>] (eg. 64:ff9b::/96)";
-	/* strtok corrupts the string, so we'll be using this copy instead. */
-	char str_copy[STR_MAX_LEN];
-	char *token;
-	int error;
+	const char *hash;
+	unsigned int port;
 
-	if (strlen(str) + 1 > STR_MAX_LEN) {
-		log_err("'%s' is too long for this poor, limited parser...", str);
+	hash = memchr(str, '#', len);
+	if (!hash)
+		return -EINVAL;
+	if (parse_addr4(str, hash - str, &result->l3))
+		return -EINVAL;
+	if (parse_uint(hash + 1, len - (hash - str) - 1, MAX_PORT, &port))
 		return -EINVAL;
+
+	result->l4 = port;
+	return 0;
+}
+
+int parse_addr6_port(const char *str, size_t len,
+		struct ipv6_transport_addr *result)
+{
+	const char *hash;
+	unsigned int port;
+
+	hash = memchr(str, '#', len);
+	if (!hash)
+		return -EINVAL;
+	if (parse_addr6(str, hash - str, &result->l3))
+		return -EINVAL;
+	if (parse_uint(hash + 1, len - (hash - str) - 1, MAX_PORT, &port))
+		return -EINVAL;
+
+	result->l4 = port;
+	return 0;
+}
+
+int parse_prefix4(const char *str, size_t len, struct ipv4_prefix *result)
+{
+	const char *slash;
+	unsigned int prefix_len;
+
+	slash = memchr(str, '/', len);
+	if (!slash) {
+		result->len = IPV4_MAX_PREFIX;
+		return parse_addr4(str, len, &result->address);
 	}
-	strcpy(str_copy, str);
 
-	token = strtok(str_copy, "/");
-	if (!token) {
-		log_err("Cannot parse '%s' as a %s.", str, FORMAT);
+	if (parse_addr4(str, slash - str, &result->address))
 		return -EINVAL;
+	if (parse_uint(slash + 1, len - (slash - str) - 1, IPV4_MAX_PREFIX,
+			&prefix_len))
+		return -EINVAL;
+
+	result->len = prefix_len;
+	return 0;
+}
+
+int parse_prefix6(const char *str, size_t len, struct ipv6_prefix *result)
+{
+	const char *slash;
+	unsigned int prefix_len;
+
+	slash = memchr(str, '/', len);
+	if (!slash) {
+		result->len = IPV6_MAX_PREFIX;
+		return parse_addr6(str, len, &result->address);
 	}
 
-	error = str_to_addr6(token, &prefix_out->address);
-	if (error)
-		return error;
+	if (parse_addr6(str, slash - str, &result->address))
+		return -EINVAL;
+	if (parse_uint(slash + 1, len - (slash - str) - 1, IPV6_MAX_PREFIX,
+			&prefix_len))
+		return -EINVAL;
+
+	result->len = prefix_len;
+	return 0;
+}
 
-	token = strtok(NULL, "/");
-	if (!token) {
-		prefix_out->len = IPV6_MAX_PREFIX;
+int parse_port_range(const char *str, size_t len, struct port_range *result)
+{
+	const char *dash;
+	unsigned int min, max;
+
+	dash = memchr(str, '-', len);
+	if (!dash) {
+		if (parse_uint(str, len, MAX_PORT, &min))
+			return -EINVAL;
+		result->min = min;
+		result->max = min;
 		return 0;
 	}
-	return str_to_u8(token, &prefix_out->len, 0, 128); /* Error msg already printed. */
+
+	if (parse_uint(str, dash - str, MAX_PORT, &min))
+		return -EINVAL;
+	if (parse_uint(dash + 1, len - (dash - str) - 1, MAX_PORT, &max))
+		return -EINVAL;
+
+	result->min = min;
+	result->max = max;
+	return 0;
 }
 
 static void print_num_csv(__u64 num, char *separator)
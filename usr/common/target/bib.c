@@ -1,11 +1,20 @@
 #include "nat64/usr/bib.h"
 
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
 #include "nat64/common/config.h"
 #include "nat64/common/str_utils.h"
 #include "nat64/common/types.h"
 #include "nat64/usr/netlink.h"
 #include "nat64/usr/dns.h"
+#include "nat64/usr/file.h"
+#include "nat64/usr/lines.h"
+#include "nat64/usr/str_utils.h"
 
 
 #define HDR_LEN sizeof(struct request_hdr)
@@ -22,8 +31,18 @@ static void print_bib_entry(struct bib_entry_usr *entry,
 		struct display_args *args)
 {
 	l4_protocol proto = entry->l4_proto;
-
-	if (args->flags & DF_CSV_FORMAT) {
+	struct line line;
+
+	if (lines_wanted(args->flags)) {
+		line_start(&line, args->flags & DF_JSONL);
+		line_str(&line, "proto", l4proto_to_string(proto));
+		line_addr6(&line, "addr6", &entry->addr6.l3);
+		line_u64(&line, "addr6_l4", entry->addr6.l4);
+		line_addr4(&line, "addr4", &entry->addr4.l3);
+		line_u64(&line, "addr4_l4", entry->addr4.l4);
+		line_bool(&line, "static", entry->is_static);
+		line_end(&line);
+	} else if (args->flags & DF_CSV_FORMAT) {
 		printf("%s,", l4proto_to_string(proto));
 		print_addr6(&entry->addr6, args->flags, ",", proto);
 		printf(",");
@@ -47,6 +66,11 @@ static int bib_display_response(struct jool_response *response, void *arg)
 
 	entry_count = response->payload_len / sizeof(*entries);
 
+	/* Only the IPv6 addresses are ever resolved. */
+	for (e = 0; e < entry_count; e++)
+		dns_prefetch6(&entries[e].addr6.l3, args->flags);
+	dns_resolve();
+
 	for (e = 0; e < entry_count; e++)
 		print_bib_entry(&entries[e], args);
 
@@ -58,7 +82,8 @@ static int bib_display_response(struct jool_response *response, void *arg)
 	return 0;
 }
 
-static bool display_table(l4_protocol l4_proto, display_flags flags)
+static bool display_table(l4_protocol l4_proto, display_flags flags,
+		struct bib_filter *filter)
 {
 	unsigned char request[HDR_LEN + PAYLOAD_LEN];
 	struct request_hdr *hdr = (struct request_hdr *)request;
@@ -66,22 +91,22 @@ static bool display_table(l4_protocol l4_proto, display_flags flags)
 	struct display_args args;
 	bool error;
 
-	if (!(flags & DF_CSV_FORMAT))
+	if (!(flags & (DF_CSV_FORMAT | DF_JSONL)))
 		printf("%s:\n", l4proto_to_string(l4_proto));
 
 	init_request_hdr(hdr, MODE_BIB, OP_DISPLAY);
 	payload->l4_proto = l4_proto;
+	payload->bulk_count = 0;
 	payload->display.addr4_set = false;
 	memset(&payload->display.addr4, 0, sizeof(payload->display.addr4));
+	payload->display.filter = *filter;
 
 	args.flags = flags;
 	args.row_count = 0;
 	args.request = payload;
 
-	do {
-		error = netlink_request(request, sizeof(request),
-				bib_display_response, &args);
-	} while (!error && payload->display.addr4_set);
+	error = netlink_dump(request, sizeof(request), bib_display_response,
+			&args);
 
 	if (show_footer(flags) && !error) {
 		if (args.row_count > 0)
@@ -97,21 +122,24 @@ static bool display_table(l4_protocol l4_proto, display_flags flags)
  * BTW: This thing is not thread-safe because of the address-to-string v4
  * function.
  */
-int bib_display(display_flags flags)
+int bib_display(display_flags flags, struct bib_filter *filter)
 {
 	int tcp_error = 0;
 	int udp_error = 0;
 	int icmp_error = 0;
 
+	if (lines_wanted(flags))
+		lines_init();
+
 	if ((flags & DF_SHOW_HEADERS) && (flags & DF_CSV_FORMAT))
 		printf("Protocol,IPv6 Address,IPv6 L4-ID,IPv4 Address,IPv4 L4-ID,Static?\n");
 
 	if (flags & DF_TCP)
-		tcp_error = display_table(L4PROTO_TCP, flags);
+		tcp_error = display_table(L4PROTO_TCP, flags, filter);
 	if (flags & DF_UDP)
-		udp_error = display_table(L4PROTO_UDP, flags);
+		udp_error = display_table(L4PROTO_UDP, flags, filter);
 	if (flags & DF_ICMP)
-		icmp_error = display_table(L4PROTO_ICMP, flags);
+		icmp_error = display_table(L4PROTO_ICMP, flags, filter);
 
 	return (tcp_error || udp_error || icmp_error) ? -EINVAL : 0;
 }
@@ -127,8 +155,83 @@ static int bib_count_response(struct jool_response *response, void *arg)
 	return 0;
 }
 
-static bool display_single_count(char *count_name, u_int8_t l4_proto)
+static void print_lock_time(char *name, __u64 total, __u64 samples,
+		__u64 max)
+{
+	printf("    %s: average %llu ns, max %llu ns\n", name,
+			samples ? (unsigned long long)(total / samples) : 0ULL,
+			(unsigned long long)max);
+}
+
+static int bib_stats_response(struct jool_response *response, void *arg)
 {
+	struct bib_stats_usr *stats = response->payload;
+
+	if (response->payload_len != sizeof(*stats)) {
+		log_err("Jool's response has a bogus length. (%zu instead of %zu.)",
+				response->payload_len, sizeof(*stats));
+		return -EINVAL;
+	}
+
+	printf("%llu\n", stats->bib_count);
+	printf("  Sessions: %llu", stats->session_count);
+	if (stats->bib_count)
+		printf(" (%.2f per BIB entry)", (double)stats->session_count
+				/ (double)stats->bib_count);
+	printf("\n");
+	printf("  Expiration queues: %llu established, %llu transitory, %llu type-2\n",
+			stats->est_sessions, stats->trans_sessions,
+			stats->syn4_sessions);
+	printf("  Deepest tree, IPv6 side: %u-%u levels\n",
+			stats->tree6_black_height,
+			2 * stats->tree6_black_height);
+	printf("  Deepest tree, IPv4 side: %u-%u levels\n",
+			stats->tree4_black_height,
+			2 * stats->tree4_black_height);
+	printf("  Lock acquisitions sampled: %llu (1 out of %u)\n",
+			stats->lock_samples, BIB_LOCK_SAMPLING);
+	print_lock_time("Wait", stats->lock_wait, stats->lock_samples,
+			stats->lock_wait_max);
+	print_lock_time("Hold", stats->lock_hold, stats->lock_samples,
+			stats->lock_hold_max);
+	return 0;
+}
+
+static int bib_top_response(struct jool_response *response, void *arg)
+{
+	struct bib_top_query *query = arg;
+	struct bib_top_usr *top = response->payload;
+	unsigned int count;
+	unsigned int i;
+	char str[INET6_ADDRSTRLEN];
+
+	if (response->payload_len % sizeof(*top)) {
+		log_err("Jool's response has a bogus length. (%zu is not a multiple of %zu.)",
+				response->payload_len, sizeof(*top));
+		return -EINVAL;
+	}
+
+	count = response->payload_len / sizeof(*top);
+	printf("%u groups\n", count);
+	for (i = 0; i < count; i++) {
+		if (query->by == BIB_TOP_SRC4)
+			inet_ntop(AF_INET, &top[i].prefix.addr4, str,
+					sizeof(str));
+		else
+			inet_ntop(AF_INET6, &top[i].prefix.addr6, str,
+					sizeof(str));
+		printf("  %u. %s/%u: %llu BIB entries, %llu sessions\n", i + 1,
+				str, query->plen, top[i].bibs, top[i].sessions);
+	}
+
+	return 0;
+}
+
+static bool display_single_count(char *count_name, u_int8_t l4_proto,
+		display_flags flags, struct bib_top_query *top)
+{
+	jool_response_cb cb;
+
 	unsigned char request[HDR_LEN + PAYLOAD_LEN];
 	struct request_hdr *hdr = (struct request_hdr *)request;
 	struct request_bib *payload = (struct request_bib *)(request + HDR_LEN);
@@ -137,23 +240,35 @@ static bool display_single_count(char *count_name, u_int8_t l4_proto)
 
 	init_request_hdr(hdr, MODE_BIB, OP_COUNT);
 	payload->l4_proto = l4_proto;
-
-	return netlink_request(request, sizeof(request), bib_count_response,
-			NULL);
+	payload->bulk_count = 0;
+	payload->count.details = !!(flags & DF_DETAILS);
+	payload->count.top = *top;
+
+	if (top->count)
+		cb = bib_top_response;
+	else if (flags & DF_DETAILS)
+		cb = bib_stats_response;
+	else
+		cb = bib_count_response;
+
+	return netlink_request(request, sizeof(request), cb, top);
 }
 
-int bib_count(display_flags flags)
+int bib_count(display_flags flags, struct bib_top_query *top)
 {
 	int tcp_error = 0;
 	int udp_error = 0;
 	int icmp_error = 0;
 
 	if (flags & DF_TCP)
-		tcp_error = display_single_count("TCP", L4PROTO_TCP);
+		tcp_error = display_single_count("TCP", L4PROTO_TCP,
+				flags, top);
 	if (flags & DF_UDP)
-		udp_error = display_single_count("UDP", L4PROTO_UDP);
+		udp_error = display_single_count("UDP", L4PROTO_UDP,
+				flags, top);
 	if (flags & DF_ICMP)
-		icmp_error = display_single_count("ICMP", L4PROTO_ICMP);
+		icmp_error = display_single_count("ICMP", L4PROTO_ICMP,
+				flags, top);
 
 	return (tcp_error || udp_error || icmp_error) ? -EINVAL : 0;
 }
@@ -200,6 +315,7 @@ int bib_add(display_flags flags,
 	struct request_bib *payload = (struct request_bib *)(request + HDR_LEN);
 
 	init_request_hdr(hdr, MODE_BIB, OP_ADD);
+	payload->bulk_count = 0;
 	payload->add.addr6 = *addr6;
 	payload->add.addr4 = *addr4;
 
@@ -222,6 +338,7 @@ int bib_remove(display_flags flags,
 	struct request_bib *payload = (struct request_bib *)(request + HDR_LEN);
 
 	init_request_hdr(hdr, MODE_BIB, OP_REMOVE);
+	payload->bulk_count = 0;
 	if (addr6) {
 		payload->rm.addr6_set = true;
 		memcpy(&payload->rm.addr6, addr6, sizeof(*addr6));
@@ -240,3 +357,438 @@ int bib_remove(display_flags flags,
 	return exec_request(flags, hdr, sizeof(request), payload,
 			bib_remove_response);
 }
+
+struct bulk_file {
+	struct bib_bulk_entry *entries;
+	/* Line each entry was read from, for the error messages. */
+	unsigned int *lines;
+	unsigned int count;
+	/* What @lines count. ("Line" or "Record".) */
+	char *unit;
+};
+
+struct bulk_args {
+	struct bulk_file *file;
+	/* Index of the first entry of the current request. */
+	unsigned int first;
+	unsigned int failed;
+};
+
+static void bulk_file_free(struct bulk_file *file)
+{
+	free(file->entries);
+	free(file->lines);
+}
+
+static int bulk_file_append(struct bulk_file *file, unsigned int *capacity,
+		struct bib_bulk_entry *entry, unsigned int line)
+{
+	struct bib_bulk_entry *entries;
+	unsigned int *lines;
+
+	if (file->count == *capacity) {
+		*capacity = (*capacity) ? (2 * (*capacity)) : 1024;
+		entries = realloc(file->entries, *capacity * sizeof(*entries));
+		if (!entries)
+			return -ENOMEM;
+		file->entries = entries;
+		lines = realloc(file->lines, *capacity * sizeof(*lines));
+		if (!lines)
+			return -ENOMEM;
+		file->lines = lines;
+	}
+
+	file->entries[file->count] = *entry;
+	file->lines[file->count] = line;
+	file->count++;
+	return 0;
+}
+
+/**
+ * Reads @file_name; one "<IPv6 transport address> <IPv4 transport address>"
+ * per line. Empty lines are ignored. "-" means standard input.
+ *
+ * The whole file is validated before anything is sent, and every malformed
+ * line is reported (not just the first one).
+ */
+static int bulk_file_read(char *file_name, struct bulk_file *file)
+{
+	FILE *stream;
+	char buffer[256];
+	char *addr6, *addr4, *rest;
+	struct bib_bulk_entry entry;
+	unsigned int capacity = 0;
+	unsigned int line = 0;
+	unsigned int malformed = 0;
+	int error = 0;
+
+	memset(file, 0, sizeof(*file));
+	file->unit = "Line";
+
+	stream = (strcmp(file_name, "-") == 0) ? stdin : fopen(file_name, "r");
+	if (!stream) {
+		error = -errno;
+		log_perror("Could not open the file", errno);
+		return error;
+	}
+
+	while (fgets(buffer, sizeof(buffer), stream)) {
+		line++;
+
+		addr6 = strtok(buffer, " \t\r\n");
+		if (!addr6)
+			continue;
+		addr4 = strtok(NULL, " \t\r\n");
+		rest = strtok(NULL, " \t\r\n");
+		if (!addr4 || rest) {
+			log_err("Line %u: Expected an IPv6 and an IPv4 transport address.",
+					line);
+			malformed++;
+			continue;
+		}
+
+		if (parse_addr6_port(addr6, strlen(addr6), &entry.addr6)) {
+			log_err("Line %u: '%s' is not an IPv6 transport address (eg. 2001:db8::1#80).",
+					line, addr6);
+			malformed++;
+			continue;
+		}
+		if (parse_addr4_port(addr4, strlen(addr4), &entry.addr4)) {
+			log_err("Line %u: '%s' is not an IPv4 transport address (eg. 192.0.2.1#80).",
+					line, addr4);
+			malformed++;
+			continue;
+		}
+		if (malformed)
+			continue; /* The file will be rejected anyway. */
+
+		error = bulk_file_append(file, &capacity, &entry, line);
+		if (error) {
+			log_err("Out of memory.");
+			break;
+		}
+	}
+
+	if (!error && malformed) {
+		log_err("%u malformed lines; nothing was sent.", malformed);
+		error = -EINVAL;
+	}
+
+	if (stream != stdin)
+		fclose(stream);
+	if (error)
+		bulk_file_free(file);
+	return error;
+}
+
+static char *bulk_strerror(int error)
+{
+	switch (error) {
+	case -EEXIST:
+		return "Collides with an existing entry.";
+	case -ESRCH:
+		return "The entry wasn't in the database.";
+	case -EINVAL:
+		return "The IPv4 transport address does not belong to pool4, or the addresses don't hash into the same BIB shard.";
+	}
+
+	return strerror(-error);
+}
+
+static int bib_bulk_response(struct jool_response *response, void *arg)
+{
+	struct bulk_args *args = arg;
+	struct bulk_file *file = args->file;
+	__s32 *errors = response->payload;
+	unsigned int count, i, index;
+
+	count = response->payload_len / sizeof(*errors);
+	for (i = 0; i < count && args->first + i < file->count; i++) {
+		if (!errors[i])
+			continue;
+
+		index = args->first + i;
+		log_err("%s %u: %s", file->unit, file->lines[index],
+				bulk_strerror(errors[i]));
+		args->failed++;
+	}
+
+	return 0;
+}
+
+static int bulk_table(l4_protocol proto, enum config_operation op,
+		struct bulk_file *file)
+{
+	unsigned char *request;
+	struct request_hdr *hdr;
+	struct request_bib *payload;
+	struct bulk_args args = { .file = file, .failed = 0 };
+	unsigned int count;
+	size_t len;
+	int error = 0;
+
+	request = malloc(HDR_LEN + PAYLOAD_LEN
+			+ BIB_BULK_MAX * sizeof(struct bib_bulk_entry));
+	if (!request)
+		return -ENOMEM;
+	hdr = (struct request_hdr *)request;
+	payload = (struct request_bib *)(request + HDR_LEN);
+
+	printf("%s:\n", l4proto_to_string(proto));
+
+	for (args.first = 0; args.first < file->count; args.first += count) {
+		count = file->count - args.first;
+		if (count > BIB_BULK_MAX)
+			count = BIB_BULK_MAX;
+
+		init_request_hdr(hdr, MODE_BIB, op);
+		memset(payload, 0, sizeof(*payload));
+		payload->l4_proto = proto;
+		payload->bulk_count = count;
+		memcpy(payload + 1, &file->entries[args.first],
+				count * sizeof(struct bib_bulk_entry));
+
+		len = HDR_LEN + PAYLOAD_LEN
+				+ count * sizeof(struct bib_bulk_entry);
+		error = netlink_request(request, len, bib_bulk_response, &args);
+		if (error)
+			break;
+	}
+
+	free(request);
+	if (!error) {
+		log_info("%u entries %s, %u failed.",
+				file->count - args.failed,
+				(op == OP_ADD) ? "added" : "removed",
+				args.failed);
+	}
+	return (error || args.failed) ? -EINVAL : 0;
+}
+
+/**
+ * Adds or removes (depending on @op) all the static BIB entries listed in
+ * @file_name, in batches of up to BIB_BULK_MAX entries per request.
+ */
+int bib_bulk(display_flags flags, enum config_operation op, char *file_name)
+{
+	struct bulk_file file;
+	int tcp_error = 0;
+	int udp_error = 0;
+	int icmp_error = 0;
+	int error;
+
+	error = bulk_file_read(file_name, &file);
+	if (error)
+		return error;
+
+	if (flags & DF_TCP)
+		tcp_error = bulk_table(L4PROTO_TCP, op, &file);
+	if (flags & DF_UDP)
+		udp_error = bulk_table(L4PROTO_UDP, op, &file);
+	if (flags & DF_ICMP)
+		icmp_error = bulk_table(L4PROTO_ICMP, op, &file);
+
+	bulk_file_free(&file);
+	return (tcp_error || udp_error || icmp_error) ? -EINVAL : 0;
+}
+
+struct export_args {
+	FILE *file;
+	unsigned int count;
+};
+
+static int bib_export_response(struct jool_response *response, void *arg)
+{
+	struct bib_entry_usr *entries = response->payload;
+	struct export_args *args = arg;
+	struct bib_file_record record;
+	unsigned int entry_count;
+	unsigned int e;
+	int error;
+
+	entry_count = response->payload_len / sizeof(*entries);
+	memset(&record, 0, sizeof(record));
+
+	for (e = 0; e < entry_count; e++) {
+		record.addr6 = entries[e].addr6.l3;
+		record.addr4 = entries[e].addr4.l3;
+		record.port6 = htons(entries[e].addr6.l4);
+		record.port4 = htons(entries[e].addr4.l4);
+		record.l4_proto = entries[e].l4_proto;
+		record.is_static = entries[e].is_static;
+
+		error = table_file_write(args->file, &record, sizeof(record), 1);
+		if (error)
+			return error;
+	}
+
+	args->count += entry_count;
+	return 0;
+}
+
+static int export_table(l4_protocol l4_proto, struct bib_filter *filter,
+		struct export_args *args)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *)request;
+	struct request_bib *payload = (struct request_bib *)(request + HDR_LEN);
+
+	memset(request, 0, sizeof(request));
+	init_request_hdr(hdr, MODE_BIB, OP_DISPLAY);
+	payload->l4_proto = l4_proto;
+	payload->display.filter = *filter;
+
+	return netlink_dump(request, sizeof(request), bib_export_response,
+			args);
+}
+
+/**
+ * Writes the BIBs (the ones selected by @flags and @filter) into @file_name,
+ * in a format bib_import() can read back.
+ */
+int bib_export(display_flags flags, struct bib_filter *filter, char *file_name)
+{
+	struct export_args args = { .count = 0 };
+	int error;
+
+	error = table_file_create(file_name, TABLE_FILE_BIB,
+			sizeof(struct bib_file_record), &args.file);
+	if (error)
+		return error;
+
+	if (!error && (flags & DF_TCP))
+		error = export_table(L4PROTO_TCP, filter, &args);
+	if (!error && (flags & DF_UDP))
+		error = export_table(L4PROTO_UDP, filter, &args);
+	if (!error && (flags & DF_ICMP))
+		error = export_table(L4PROTO_ICMP, filter, &args);
+
+	if (table_file_close(args.file))
+		error = -EIO;
+	if (!error && args.file != stdout)
+		log_info("Exported %u BIB entries.", args.count);
+	return error;
+}
+
+/**
+ * Sorts the static entries of @file_name into @result, by protocol.
+ * The dynamic ones are skipped; they come back along with their sessions.
+ */
+static int import_file_read(char *file_name, struct bulk_file *result)
+{
+	struct bib_file_record record;
+	struct bib_bulk_entry entry;
+	FILE *file;
+	unsigned int capacity[L4PROTO_OTHER] = { 0 };
+	unsigned int index = 0;
+	unsigned int p;
+	int error;
+
+	memset(result, 0, L4PROTO_OTHER * sizeof(*result));
+	for (p = 0; p < L4PROTO_OTHER; p++)
+		result[p].unit = "Record";
+
+	error = table_file_open(file_name, TABLE_FILE_BIB, sizeof(record),
+			&file, NULL);
+	if (error)
+		return error;
+
+	while ((error = table_file_read(file, &record, sizeof(record))) > 0) {
+		index++;
+		if (record.l4_proto >= L4PROTO_OTHER || !record.is_static)
+			continue;
+
+		entry.addr6.l3 = record.addr6;
+		entry.addr6.l4 = ntohs(record.port6);
+		entry.addr4.l3 = record.addr4;
+		entry.addr4.l4 = ntohs(record.port4);
+
+		error = bulk_file_append(&result[record.l4_proto],
+				&capacity[record.l4_proto], &entry, index);
+		if (error) {
+			log_err("Out of memory.");
+			break;
+		}
+	}
+
+	table_file_close(file);
+	if (error) {
+		for (p = 0; p < L4PROTO_OTHER; p++)
+			bulk_file_free(&result[p]);
+	}
+	return error;
+}
+
+/**
+ * Adds the static BIB entries from @file_name (a bib_export() output) whose
+ * protocols are selected by @flags.
+ */
+int bib_import(display_flags flags, char *file_name)
+{
+	struct bulk_file files[L4PROTO_OTHER];
+	int tcp_error = 0;
+	int udp_error = 0;
+	int icmp_error = 0;
+	unsigned int p;
+	int error;
+
+	error = import_file_read(file_name, files);
+	if (error)
+		return error;
+
+	if (flags & DF_TCP)
+		tcp_error = bulk_table(L4PROTO_TCP, OP_ADD, &files[L4PROTO_TCP]);
+	if (flags & DF_UDP)
+		udp_error = bulk_table(L4PROTO_UDP, OP_ADD, &files[L4PROTO_UDP]);
+	if (flags & DF_ICMP)
+		icmp_error = bulk_table(L4PROTO_ICMP, OP_ADD,
+				&files[L4PROTO_ICMP]);
+
+	for (p = 0; p < L4PROTO_OTHER; p++)
+		bulk_file_free(&files[p]);
+	return (tcp_error || udp_error || icmp_error) ? -EINVAL : 0;
+}
+
+static int bib_policy_response(struct jool_response *response, void *arg)
+{
+	log_info("The BIB policy was %s successfully.",
+			arg ? "attached" : "removed");
+	return 0;
+}
+
+/**
+ * Hands the BPF program pinned at @path (in a BPF filesystem) over to the
+ * instance, which will then ask it about every IPv6 packet that reaches the
+ * BIB. "none" removes the current program. The policy is shared by all three
+ * protocols.
+ */
+int bib_policy(char *path)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *)request;
+	struct request_bib *payload = (struct request_bib *)(request + HDR_LEN);
+	union bpf_attr attr;
+	int fd = -1;
+	int error;
+
+	if (strcmp(path, "none") != 0) {
+		memset(&attr, 0, sizeof(attr));
+		attr.pathname = (__u64)(unsigned long)path;
+		fd = syscall(__NR_bpf, BPF_OBJ_GET, &attr, sizeof(attr));
+		if (fd < 0) {
+			log_err("Cannot open %s: %s", path, strerror(errno));
+			return -errno;
+		}
+	}
+
+	memset(payload, 0, sizeof(*payload));
+	init_request_hdr(hdr, MODE_BIB, OP_UPDATE);
+	payload->policy.fd = fd;
+
+	/* The kernel takes its own reference; ours can go. */
+	error = netlink_request(hdr, sizeof(request), bib_policy_response,
+			(fd >= 0) ? path : NULL);
+	if (fd >= 0)
+		close(fd);
+	return error;
+}
@@ -13,7 +13,6 @@
 struct display_args {
 	display_flags flags;
 	unsigned int row_count;
-	union request_eamt *request;
 };
 
 static void print_eamt_entry(struct eamt_entry *entry, char *separator)
@@ -29,12 +28,54 @@ static void print_eamt_entry(struct eamt_entry *entry, char *separator)
 	printf("\n");
 }
 
+static void print_eamt_entry_usr(struct eamt_entry_usr *entry,
+		char *separator)
+{
+	char ipv6_str[INET6_ADDRSTRLEN];
+	char *ipv4_str;
+
+	inet_ntop(AF_INET6, &entry->entry.prefix6.address, ipv6_str,
+			sizeof(ipv6_str));
+	ipv4_str = inet_ntoa(entry->entry.prefix4.address);
+	printf("%s/%u", ipv6_str, entry->entry.prefix6.len);
+	printf("%s", separator);
+	printf("%s/%u", ipv4_str, entry->entry.prefix4.len);
+	printf("%s", separator);
+	printf("%llu", (unsigned long long)entry->hits);
+	printf("%s", separator);
+	printf("%llu", (unsigned long long)entry->bytes);
+	printf("\n");
+}
+
+static int eam_display_usr_response(struct jool_response *response,
+		struct display_args *args)
+{
+	struct eamt_entry_usr *entries = response->payload;
+	__u16 entry_count, i;
+
+	entry_count = response->payload_len / sizeof(*entries);
+
+	if (args->flags & DF_CSV_FORMAT) {
+		for (i = 0; i < entry_count; i++)
+			print_eamt_entry_usr(&entries[i], ",");
+	} else {
+		for (i = 0; i < entry_count; i++)
+			print_eamt_entry_usr(&entries[i], " - ");
+	}
+
+	args->row_count += entry_count;
+	return 0;
+}
+
 static int eam_display_response(struct jool_response *response, void *arg)
 {
 	struct eamt_entry *entries = response->payload;
 	struct display_args *args = arg;
 	__u16 entry_count, i;
 
+	if (args->flags & DF_COUNTERS)
+		return eam_display_usr_response(response, args);
+
 	entry_count = response->payload_len / sizeof(*entries);
 
 	if (args->flags & DF_CSV_FORMAT) {
@@ -46,11 +87,6 @@ static int eam_display_response(struct jool_response *response, void *arg)
 	}
 
 	args->row_count += entry_count;
-	args->request->display.prefix4_set = response->hdr->pending_data;
-	if (entry_count > 0) {
-		struct eamt_entry *last = &entries[entry_count - 1];
-		args->request->display.prefix4 = last->prefix4;
-	}
 	return 0;
 }
 
@@ -65,19 +101,23 @@ int eam_display(display_flags flags)
 	init_request_hdr(hdr, MODE_EAMT, OP_DISPLAY);
 	payload->display.prefix4_set = false;
 	memset(&payload->display.prefix4, 0, sizeof(payload->display.prefix4));
+	payload->display.counters = !!(flags & DF_COUNTERS);
+	payload->display.reset = !!(flags & DF_RESET);
 	args.flags = flags;
 	args.row_count = 0;
-	args.request = payload;
 
-	if ((flags & DF_SHOW_HEADERS) && (flags & DF_CSV_FORMAT))
-		printf("IPv6 Prefix,IPv4 Prefix\n");
+	if ((flags & DF_SHOW_HEADERS) && (flags & DF_CSV_FORMAT)) {
+		printf("IPv6 Prefix,IPv4 Prefix");
+		if (flags & DF_COUNTERS)
+			printf(",Hits,Bytes");
+		printf("\n");
+	}
 
-	do {
-		error = netlink_request(request, sizeof(request),
-				eam_display_response, &args);
-		if (error)
-			return error;
-	} while (payload->display.prefix4_set);
+	/* The kernel keeps the cursor; one request fetches the whole table. */
+	error = netlink_dump(request, sizeof(request), eam_display_response,
+			&args);
+	if (error)
+		return error;
 
 	if (show_footer(flags)) {
 		if (args.row_count > 0)
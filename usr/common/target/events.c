@@ -0,0 +1,205 @@
+#include "nat64/usr/events.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <netlink/genl/ctrl.h>
+#include <netlink/genl/genl.h>
+#include "nat64/common/config.h"
+#include "nat64/common/str_utils.h"
+#include "nat64/common/types.h"
+#include "nat64/usr/dns.h"
+#include "nat64/usr/netlink.h"
+
+/*
+ * The kernel doesn't wait for us, so give it plenty of room to burst into
+ * while we're busy writing.
+ */
+#define EVENTS_SOCKET_BUFFER (4 * 1024 * 1024)
+
+char *event_to_string(__u8 type)
+{
+	switch (type) {
+	case BIBEV_BIB_ADD:
+		return "BIB-add";
+	case BIBEV_BIB_RM:
+		return "BIB-rm";
+	case BIBEV_SESSION_ADD:
+		return "session-add";
+	case BIBEV_SESSION_RM:
+		return "session-rm";
+	case BIBEV_BLOCK_ADD:
+		return "block-add";
+	case BIBEV_BLOCK_RM:
+		return "block-rm";
+	}
+
+	return "unknown";
+}
+
+static void print_event(struct bib_event_usr *event)
+{
+	printf("%llu.%09llu,%s,%s,",
+			(unsigned long long)(event->timestamp / 1000000000),
+			(unsigned long long)(event->timestamp % 1000000000),
+			event_to_string(event->type),
+			l4proto_to_string(event->proto));
+
+	print_addr6(&event->src6, DF_NUMERIC_HOSTNAME, ",", event->proto);
+	printf(",");
+	print_addr6(&event->dst6, DF_NUMERIC_HOSTNAME, ",", event->proto);
+	printf(",");
+	print_addr4(&event->src4, DF_NUMERIC_HOSTNAME, ",", event->proto);
+	printf(",");
+	print_addr4(&event->dst4, DF_NUMERIC_HOSTNAME, ",", event->proto);
+	printf(",%u", event->plen);
+	printf(",%llu,%llu,%llu,%llu\n",
+			(unsigned long long)event->counters.packets_6to4,
+			(unsigned long long)event->counters.bytes_6to4,
+			(unsigned long long)event->counters.packets_4to6,
+			(unsigned long long)event->counters.bytes_4to6);
+}
+
+static void print_batch(struct bib_event_usr *events, unsigned int count,
+		void *arg)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		print_event(&events[i]);
+	fflush(stdout);
+}
+
+struct batch_cb {
+	events_batch_cb cb;
+	void *arg;
+};
+
+static int event_batch_cb(struct nl_msg *msg, void *arg)
+{
+	struct batch_cb *callback = arg;
+	struct nlattr *attrs[__ATTR_MAX + 1];
+	struct bib_event_usr *events;
+	size_t data_len;
+	unsigned int count;
+	int error;
+
+	error = genlmsg_parse(nlmsg_hdr(msg), 0, attrs, __ATTR_MAX, NULL);
+	if (error) {
+		log_err("genlmsg_parse() failed: %s", nl_geterror(error));
+		return NL_SKIP;
+	}
+
+	if (!attrs[ATTR_DATA]) {
+		log_err("The event batch lacks a DATA attribute.");
+		return NL_SKIP;
+	}
+
+	data_len = nla_len(attrs[ATTR_DATA]);
+	error = validate_request(nla_data(attrs[ATTR_DATA]), data_len,
+			"the kernel module", "event collector", NULL);
+	if (error)
+		return NL_SKIP;
+
+	events = nla_data(attrs[ATTR_DATA]) + sizeof(struct request_hdr);
+	count = (data_len - sizeof(struct request_hdr)) / sizeof(*events);
+
+	callback->cb(events, count, callback->arg);
+	return NL_OK;
+}
+
+/**
+ * Subscribes to the kernel's event stream (see --logging-stream), and hands
+ * every batch it sends to @cb. Only returns on error.
+ */
+int events_subscribe(events_batch_cb cb, void *arg)
+{
+	struct batch_cb callback = { .cb = cb, .arg = arg };
+	struct nl_sock *sk;
+	int group;
+	int error;
+
+	sk = nl_socket_alloc();
+	if (!sk) {
+		log_err("Could not allocate the socket to kernelspace.");
+		log_err("(I guess we're out of memory.)");
+		return -ENOMEM;
+	}
+
+	/* Multicast messages are not numbered and are not ACKed. */
+	nl_socket_disable_seq_check(sk);
+	nl_socket_disable_auto_ack(sk);
+
+	error = nl_socket_modify_cb(sk, NL_CB_VALID, NL_CB_CUSTOM,
+			event_batch_cb, &callback);
+	if (error) {
+		log_err("Couldn't modify the socket's callbacks.");
+		goto fail;
+	}
+
+	error = genl_connect(sk);
+	if (error) {
+		log_err("Could not open the socket to kernelspace.");
+		goto fail;
+	}
+
+	error = nl_socket_set_buffer_size(sk, EVENTS_SOCKET_BUFFER, 0);
+	if (error) {
+		log_err("Could not enlarge the socket's buffer; carrying on anyway.");
+		netlink_print_error(error);
+		/* Fall through. */
+	}
+
+	group = genl_ctrl_resolve_grp(sk, GNL_JOOL_FAMILY_NAME,
+			GNL_EVENTS_MULTICAST_GRP_NAME);
+	if (group < 0) {
+		log_err("Unable to resolve the events multicast group.");
+		log_err("(This probably means Jool hasn't been modprobed, or it's too old.)");
+		error = group;
+		goto fail;
+	}
+
+	error = nl_socket_add_membership(sk, group);
+	if (error) {
+		log_err("Can't register to the events multicast group.");
+		goto fail;
+	}
+
+	do {
+		error = nl_recvmsgs_default(sk);
+		if (error == -NLE_NOMEM) {
+			/* The socket buffer overflowed. */
+			log_err("We're falling behind; some events were lost.");
+		} else if (error < 0) {
+			log_err("Error receiving events from kernelspace: %s",
+					nl_geterror(error));
+			goto fail;
+		}
+	} while (true);
+
+	return 0; /* Unreachable. */
+
+fail:
+	nl_socket_free(sk);
+	return netlink_print_error(error);
+}
+
+/**
+ * Prints everything the kernel's event stream sends as CSV, until it's
+ * killed.
+ */
+int events_listen(display_flags flags)
+{
+	if (flags & DF_SHOW_HEADERS) {
+		printf("Timestamp,Event,Protocol,");
+		printf("IPv6 Node Address,IPv6 Node Port,");
+		printf("IPv6 Remote Address,IPv6 Remote Port,");
+		printf("IPv4 Local Address,IPv4 Local Port,");
+		printf("IPv4 Remote Address,IPv4 Remote Port,");
+		printf("Prefix Length,");
+		printf("6to4 Packets,6to4 Bytes,4to6 Packets,4to6 Bytes\n");
+		fflush(stdout);
+	}
+
+	return events_subscribe(print_batch, NULL);
+}
@@ -39,6 +39,17 @@ static void print_plateaus(struct global_config_usr *conf, char *separator)
 	}
 }
 
+static void print_udp_short_ports(struct bib_config *conf, char *separator)
+{
+	int i;
+
+	for (i = 0; i < conf->udp_short.count; i++) {
+		printf("%u", conf->udp_short.ports[i]);
+		if (i != conf->udp_short.count - 1)
+			printf("%s", separator);
+	}
+}
+
 static char *int_to_hairpin_mode(enum eam_hairpinning_mode mode)
 {
 	switch (mode) {
@@ -53,6 +64,18 @@ static char *int_to_hairpin_mode(enum eam_hairpinning_mode mode)
 	return "unknown";
 }
 
+static char *int_to_f_algorithm(enum f_algorithm algorithm)
+{
+	switch (algorithm) {
+	case F_ALGORITHM_MD5:
+		return "md5";
+	case F_ALGORITHM_SIPHASH:
+		return "siphash";
+	}
+
+	return "unknown";
+}
+
 static void print_rfc6791v6_prefix(struct full_config *config, bool csv)
 {
 	struct ipv6_prefix *prefix;
@@ -103,11 +126,46 @@ static int handle_display_response(struct jool_response *response, void *arg)
 	printf("  --%s: ", OPTNAME_MTU_PLATEAUS);
 	print_plateaus(&conf->global, ",");
 	printf("\n");
+	printf("  --%s: %s\n", OPTNAME_DEBUG,
+			print_bool(conf->global.debug));
+	printf("  --%s: %u\n", OPTNAME_LATENCY_SAMPLING,
+			conf->global.latency_sampling);
+	printf("  --%s: %u\n", OPTNAME_MIRROR_SAMPLING,
+			conf->global.mirror_sampling);
+	printf("  --%s: %u\n", OPTNAME_PACKET_BUDGET,
+			conf->global.packet_budget);
+	printf("  --%s: %u\n", OPTNAME_MSS_CLAMP, conf->global.mss_clamp);
 
 	if (xlat_is_nat64()) {
 
 		printf("  --%s: %u\n", OPTNAME_MAX_SO,
 				conf->bib.max_stored_pkts);
+		printf("  --%s: %u\n", OPTNAME_MAX_SO_BYTES,
+				conf->bib.max_stored_bytes);
+		printf("  --%s: %s\n", OPTNAME_STATELESS_SO,
+				print_bool(conf->bib.stateless_so));
+		printf("  --%s: %u\n", OPTNAME_MAX_SESSIONS_TCP,
+				conf->bib.max_sessions.tcp);
+		printf("  --%s: %u\n", OPTNAME_MAX_SESSIONS_UDP,
+				conf->bib.max_sessions.udp);
+		printf("  --%s: %u\n", OPTNAME_MAX_SESSIONS_ICMP,
+				conf->bib.max_sessions.icmp);
+		printf("  --%s: %u\n", OPTNAME_SUBSCRIBER_PLEN,
+				conf->bib.subscriber.prefix_len);
+		printf("  --%s: %u\n", OPTNAME_SUBSCRIBER_MAX_BIBS,
+				conf->bib.subscriber.max_bibs);
+		printf("  --%s: %u\n", OPTNAME_SUBSCRIBER_MAX_SESSIONS,
+				conf->bib.subscriber.max_sessions);
+		printf("  --%s: %u\n", OPTNAME_SUBSCRIBER_MAX_RATE,
+				conf->bib.subscriber.max_rate);
+		printf("  --%s: %u\n", OPTNAME_CPS_BUDGET,
+				conf->bib.cps_budget);
+		printf("  --%s: %u\n", OPTNAME_PORT_BLOCK_SIZE,
+				conf->bib.port_block_size);
+		printf("  --%s: %u\n", OPTNAME_DETERMINISTIC_BITS,
+				conf->bib.deterministic_bits);
+		printf("  --%s: %s\n", OPTNAME_POOL4_BALANCE,
+				print_bool(conf->bib.pool4_balance));
 		printf("  --%s: %s\n", OPTNAME_SRC_ICMP6E_BETTER,
 				print_bool(conf->global.nat64.src_icmp6errs_better));
 		printf("  --%s: %s\n", OPTNAME_HANDLE_FIN_RCV_RST,
@@ -120,6 +178,9 @@ static int handle_display_response(struct jool_response *response, void *arg)
 		printf("  SrcPort:%s", print_bool(conf->global.nat64.f_args & F_ARGS_SRC_PORT));
 		printf("  DstAddr:%s", print_bool(conf->global.nat64.f_args & F_ARGS_DST_ADDR));
 		printf("  DstPort:%s\n", print_bool(conf->global.nat64.f_args & F_ARGS_DST_PORT));
+		printf("  --%s: %u (%s)\n", OPTNAME_F_ALGORITHM,
+				conf->global.nat64.f_algorithm,
+				int_to_f_algorithm(conf->global.nat64.f_algorithm));
 
 	} else {
 
@@ -132,6 +193,8 @@ static int handle_display_response(struct jool_response *response, void *arg)
 				print_bool(conf->global.siit.randomize_error_addresses));
 		printf("  --%s: ", OPTNAME_RFC6791V6_PREFIX);
 		print_rfc6791v6_prefix(conf, false);
+		printf("  --%s: %s\n", OPTNAME_CLAT,
+				print_bool(conf->global.siit.clat));
 
 	}
 	printf("\n");
@@ -142,6 +205,8 @@ static int handle_display_response(struct jool_response *response, void *arg)
 				print_bool(conf->bib.bib_logging));
 		printf("    --%s: %s\n", OPTNAME_SESSION_LOGGING,
 				print_bool(conf->bib.session_logging));
+		printf("    --%s: %s\n", OPTNAME_LOGGING_STREAM,
+				print_bool(conf->bib.logging_stream));
 		printf("\n");
 
 		printf("  Filtering:\n");
@@ -156,14 +221,27 @@ static int handle_display_response(struct jool_response *response, void *arg)
 		printf("  Timeouts:\n");
 		printf("    --%s: ", OPTNAME_UDP_TIMEOUT);
 		print_time_friendly(conf->bib.ttl.udp);
+		printf("    --%s: ", OPTNAME_UDP_SHORT_TIMEOUT);
+		print_time_friendly(conf->bib.ttl.udp_short);
+		printf("    --%s: ", OPTNAME_UDP_SHORT_PORTS);
+		if (conf->bib.udp_short.count)
+			print_udp_short_ports(&conf->bib, ",");
+		else
+			printf("(none)");
+		printf("\n");
 		printf("    --%s: ", OPTNAME_TCPEST_TIMEOUT);
 		print_time_friendly(conf->bib.ttl.tcp_est);
 		printf("    --%s: ", OPTNAME_TCPTRANS_TIMEOUT);
 		print_time_friendly(conf->bib.ttl.tcp_trans);
+		printf("    --%s: ", OPTNAME_TCPCLOSED_TIMEOUT);
+		print_time_friendly(conf->bib.ttl.tcp_closed);
 		printf("    --%s: ", OPTNAME_ICMP_TIMEOUT);
 		print_time_friendly(conf->bib.ttl.icmp);
 		printf("    --%s: ", OPTNAME_FRAG_TIMEOUT);
 		print_time_friendly(conf->frag.ttl);
+		printf("    --%s: %u\n", OPTNAME_FRAG_HIGH_THRESH, conf->frag.high_thresh);
+		printf("    --%s: %u\n", OPTNAME_FRAG_LOW_THRESH, conf->frag.low_thresh);
+		printf("    --%s: %s\n", OPTNAME_FRAG_VIRTUAL, print_bool(conf->frag.virtual_reassembly));
 		printf("\n");
 
 		printf("  Synchronization:\n");
@@ -173,6 +251,14 @@ static int handle_display_response(struct jool_response *response, void *arg)
 		print_time_friendly(conf->joold.flush_deadline);
 		printf("    --%s: %u\n", OPTNAME_SS_CAPACITY, conf->joold.capacity);
 		printf("    --%s: %u\n", OPTNAME_SS_MAX_PAYLOAD, conf->joold.max_payload);
+		printf("    --%s: %u\n", OPTNAME_SS_WINDOW, conf->joold.window);
+		printf("    --%s: %u\n", OPTNAME_SS_ADVERTISE_CHUNK, conf->joold.advertise_chunk);
+		printf("    --%s: %u\n", OPTNAME_SS_ADVERTISE_RATE, conf->joold.advertise_rate);
+		printf("    --%s: %s\n", OPTNAME_SS_COMPACT, print_bool(conf->joold.compact));
+		printf("    --%s: ", OPTNAME_SS_RESYNC_INTERVAL);
+		print_time_friendly(conf->bib.sync_interval);
+		printf("    --%s: %u\n", OPTNAME_SS_NODE_COUNT, conf->bib.node_count);
+		printf("    --%s: %u\n", OPTNAME_SS_NODE_ID, conf->bib.node_id);
 	}
 
 	return 0;
@@ -203,6 +289,11 @@ static int handle_display_response_csv(struct jool_response *response, void *arg
 	printf("\"");
 	print_plateaus(global, ",");
 	printf("\"\n");
+	printf("%s,%s\n", OPTNAME_DEBUG, print_csv_bool(global->debug));
+	printf("%s,%u\n", OPTNAME_LATENCY_SAMPLING, global->latency_sampling);
+	printf("%s,%u\n", OPTNAME_MIRROR_SAMPLING, global->mirror_sampling);
+	printf("%s,%u\n", OPTNAME_PACKET_BUDGET, global->packet_budget);
+	printf("%s,%u\n", OPTNAME_MSS_CLAMP, global->mss_clamp);
 
 	if (xlat_is_siit()) {
 		printf("%s,%s\n", OPTNAME_AMEND_UDP_CSUM,
@@ -213,20 +304,52 @@ static int handle_display_response_csv(struct jool_response *response, void *arg
 				print_csv_bool(global->siit.randomize_error_addresses));
 		printf("%s,", OPTNAME_RFC6791V6_PREFIX);
 		print_rfc6791v6_prefix(conf, true);
+		printf("%s,%s\n", OPTNAME_CLAT,
+				print_csv_bool(global->siit.clat));
 
 	} else {
 		printf("%s,%u\n", OPTNAME_MAX_SO,
 				conf->bib.max_stored_pkts);
+		printf("%s,%u\n", OPTNAME_MAX_SO_BYTES,
+				conf->bib.max_stored_bytes);
+		printf("%s,%s\n", OPTNAME_STATELESS_SO,
+				print_csv_bool(conf->bib.stateless_so));
+		printf("%s,%u\n", OPTNAME_MAX_SESSIONS_TCP,
+				conf->bib.max_sessions.tcp);
+		printf("%s,%u\n", OPTNAME_MAX_SESSIONS_UDP,
+				conf->bib.max_sessions.udp);
+		printf("%s,%u\n", OPTNAME_MAX_SESSIONS_ICMP,
+				conf->bib.max_sessions.icmp);
+		printf("%s,%u\n", OPTNAME_SUBSCRIBER_PLEN,
+				conf->bib.subscriber.prefix_len);
+		printf("%s,%u\n", OPTNAME_SUBSCRIBER_MAX_BIBS,
+				conf->bib.subscriber.max_bibs);
+		printf("%s,%u\n", OPTNAME_SUBSCRIBER_MAX_SESSIONS,
+				conf->bib.subscriber.max_sessions);
+		printf("%s,%u\n", OPTNAME_SUBSCRIBER_MAX_RATE,
+				conf->bib.subscriber.max_rate);
+		printf("%s,%u\n", OPTNAME_CPS_BUDGET,
+				conf->bib.cps_budget);
+		printf("%s,%u\n", OPTNAME_PORT_BLOCK_SIZE,
+				conf->bib.port_block_size);
+		printf("%s,%u\n", OPTNAME_DETERMINISTIC_BITS,
+				conf->bib.deterministic_bits);
+		printf("%s,%s\n", OPTNAME_POOL4_BALANCE,
+				print_csv_bool(conf->bib.pool4_balance));
 		printf("%s,%s\n", OPTNAME_SRC_ICMP6E_BETTER,
 				print_csv_bool(global->nat64.src_icmp6errs_better));
 		printf("%s,%u\n", OPTNAME_HANDLE_FIN_RCV_RST,
 				global->nat64.handle_rst_during_fin_rcv);
 		printf("%s,%u\n", OPTNAME_F_ARGS,
 				global->nat64.f_args);
+		printf("%s,%s\n", OPTNAME_F_ALGORITHM,
+				int_to_f_algorithm(global->nat64.f_algorithm));
 		printf("%s,%s\n", OPTNAME_BIB_LOGGING,
 				print_csv_bool(conf->bib.bib_logging));
 		printf("%s,%s\n", OPTNAME_SESSION_LOGGING,
 				print_csv_bool(conf->bib.session_logging));
+		printf("%s,%s\n", OPTNAME_LOGGING_STREAM,
+				print_csv_bool(conf->bib.logging_stream));
 
 		printf("%s,%s\n", OPTNAME_DROP_BY_ADDR,
 				print_csv_bool(conf->bib.drop_by_addr));
@@ -237,14 +360,24 @@ static int handle_display_response_csv(struct jool_response *response, void *arg
 
 		printf("%s,", OPTNAME_UDP_TIMEOUT);
 		print_time_csv(conf->bib.ttl.udp);
+		printf("\n%s,", OPTNAME_UDP_SHORT_TIMEOUT);
+		print_time_csv(conf->bib.ttl.udp_short);
+		printf("\n%s,\"", OPTNAME_UDP_SHORT_PORTS);
+		print_udp_short_ports(&conf->bib, ",");
+		printf("\"");
 		printf("\n%s,", OPTNAME_TCPEST_TIMEOUT);
 		print_time_csv(conf->bib.ttl.tcp_est);
 		printf("\n%s,", OPTNAME_TCPTRANS_TIMEOUT);
 		print_time_csv(conf->bib.ttl.tcp_trans);
+		printf("\n%s,", OPTNAME_TCPCLOSED_TIMEOUT);
+		print_time_csv(conf->bib.ttl.tcp_closed);
 		printf("\n%s,", OPTNAME_ICMP_TIMEOUT);
 		print_time_csv(conf->bib.ttl.icmp);
 		printf("\n%s,", OPTNAME_FRAG_TIMEOUT);
 		print_time_csv(conf->frag.ttl);
+		printf("\n%s,%u", OPTNAME_FRAG_HIGH_THRESH, conf->frag.high_thresh);
+		printf("\n%s,%u", OPTNAME_FRAG_LOW_THRESH, conf->frag.low_thresh);
+		printf("\n%s,%s", OPTNAME_FRAG_VIRTUAL, print_csv_bool(conf->frag.virtual_reassembly));
 		printf("\n");
 
 		printf("joold Enabled,%s\n",
@@ -257,6 +390,21 @@ static int handle_display_response_csv(struct jool_response *response, void *arg
 				conf->joold.capacity);
 		printf("%s,%u\n", OPTNAME_SS_MAX_PAYLOAD,
 				conf->joold.max_payload);
+		printf("%s,%u\n", OPTNAME_SS_WINDOW,
+				conf->joold.window);
+		printf("%s,%u\n", OPTNAME_SS_ADVERTISE_CHUNK,
+				conf->joold.advertise_chunk);
+		printf("%s,%u\n", OPTNAME_SS_ADVERTISE_RATE,
+				conf->joold.advertise_rate);
+		printf("%s,%s\n", OPTNAME_SS_COMPACT,
+				print_csv_bool(conf->joold.compact));
+		printf("%s,", OPTNAME_SS_RESYNC_INTERVAL);
+		print_time_csv(conf->bib.sync_interval);
+		printf("\n");
+		printf("%s,%u\n", OPTNAME_SS_NODE_COUNT,
+				conf->bib.node_count);
+		printf("%s,%u\n", OPTNAME_SS_NODE_ID,
+				conf->bib.node_id);
 	}
 
 	return 0;
@@ -1,15 +1,70 @@
 #include "nat64/usr/instance.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "nat64/common/config.h"
 #include "nat64/usr/netlink.h"
 
 #define HDR_LEN sizeof(struct request_hdr)
+#define PAYLOAD_LEN sizeof(struct request_instance)
+#define NETNS_RUN_DIR "/var/run/netns"
 
-int instance_add(void)
+/**
+ * Opens the namespace @name refers to. Like ip-netns, plain names are looked
+ * up in /var/run/netns; anything containing a slash is a path.
+ */
+static int open_netns(char *name)
 {
-	struct request_hdr hdr;
-	init_request_hdr(&hdr, MODE_INSTANCE, OP_ADD);
-	return netlink_request(&hdr, sizeof(hdr), NULL, NULL);
+	char path[PATH_MAX];
+	int fd;
+
+	if (strchr(name, '/'))
+		fd = open(name, O_RDONLY);
+	else if (snprintf(path, sizeof(path), NETNS_RUN_DIR "/%s", name)
+			>= sizeof(path))
+		return -ENAMETOOLONG;
+	else
+		fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		perror("Cannot open the --from namespace");
+		return -errno;
+	}
+
+	return fd;
+}
+
+int instance_add(char *shared_tables, char *from)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *)request;
+	struct request_instance *payload = (struct request_instance *)(hdr + 1);
+	int error;
+
+	init_request_hdr(hdr, MODE_INSTANCE, OP_ADD);
+	/* Don't send a payload unless needed; old modules don't expect one. */
+	if (!shared_tables && !from)
+		return netlink_request(hdr, HDR_LEN, NULL, NULL);
+
+	memset(payload, 0, sizeof(*payload));
+	if (shared_tables)
+		strcpy(payload->shared_tables, shared_tables);
+	payload->from = -1;
+	if (from) {
+		payload->from = open_netns(from);
+		if (payload->from < 0)
+			return payload->from;
+	}
+
+	/* The module reads the fd while it handles the request, so keep it. */
+	error = netlink_request(request, sizeof(request), NULL, NULL);
+	if (from)
+		close(payload->from);
+	return error;
 }
 
 int instance_rm(void)
@@ -1,8 +1,52 @@
 #include "nat64/usr/joold.h"
 
+#include <errno.h>
 #include <stddef.h>
+#include <stdio.h>
 #include "nat64/common/config.h"
 #include "nat64/usr/netlink.h"
+#include "nat64/usr/str_utils.h"
+
+static int joold_display_response(struct jool_response *response, void *arg)
+{
+	struct joold_status_usr *status = response->payload;
+
+	if (response->payload_len != sizeof(*status)) {
+		log_err("Jool's response has a bogus length. (%zu instead of %zu.)",
+				response->payload_len, sizeof(*status));
+		return -EINVAL;
+	}
+
+	printf("Enabled: %s\n", status->enabled ? "true" : "false");
+	printf("Sessions received: %llu (in %llu messages)\n",
+			status->sessions_received, status->messages_received);
+	if (status->messages_received) {
+		printf("  Last one: ");
+		print_time_friendly(status->last_received);
+	}
+	printf("Complete advertisements received: %llu\n",
+			status->advertisements_received);
+	if (status->advertisements_received) {
+		printf("  Last one: %llu sessions, ",
+				status->advertised_sessions);
+		print_time_friendly(status->last_advertisement);
+	}
+	printf("Advertising: %s (%llu/%llu sessions sent)\n",
+			status->advertising ? "true" : "false",
+			status->adv_sent, status->adv_total);
+	printf("Sessions queued: %u\n", status->queued);
+	printf("Messages awaiting ACK: %u\n", status->in_flight);
+	return 0;
+}
+
+int joold_display(void)
+{
+	struct request_hdr request;
+
+	init_request_hdr(&request, MODE_JOOLD, OP_DISPLAY);
+	return netlink_request(&request, sizeof(request),
+			joold_display_response, NULL);
+}
 
 int joold_advertise(void)
 {
@@ -7,46 +7,57 @@
 #include "nat64/common/constants.h"
 #include "nat64/common/types.h"
 #include "nat64/usr/cJSON.h"
-#include "nat64/usr/file.h"
 #include "nat64/usr/global.h"
+#include "nat64/usr/json_stream.h"
 #include "nat64/usr/netlink.h"
 #include "nat64/usr/nl/buffer.h"
 #include "nat64/usr/str_utils.h"
 #include "nat64/usr/argp/options.h"
 
-static int do_parsing(char *buffer);
-static int parse_siit_json(cJSON *json);
-static int parse_nat64_json(cJSON *json);
+static int parse_siit_json(struct json_stream *stream);
+static int parse_nat64_json(struct json_stream *stream);
 static int handle_global(cJSON *json, bool *globals_found);
 static int handle_pool6(cJSON *pool6_json);
-static int handle_eamt(cJSON *json);
-static int handle_addr4_pool(cJSON *json, enum parse_section section);
-static int handle_pool4(cJSON *pool4);
-static int handle_bib(cJSON *bib);
-
+static int handle_eamt(struct json_stream *stream);
+static int handle_addr4_pool(struct json_stream *stream,
+		enum parse_section section);
+static int handle_pool4(struct json_stream *stream);
+static int handle_bib(void);
+
+/*
+ * The file is streamed: the tables are read and sent one entry at a time, so
+ * memory stays flat no matter how large the file is.
+ */
 int parse_file(char *file_name)
 {
-	char *buffer;
+	struct json_stream stream;
 	int error;
 
-	error = file_to_string(file_name, &buffer);
+	error = jstream_open(&stream, file_name);
 	if (error)
 		return error;
 
-	error = do_parsing(buffer);
-	free(buffer);
+	error = jstream_object_start(&stream);
+	if (!error) {
+		error = xlat_is_siit()
+				? parse_siit_json(&stream)
+				: parse_nat64_json(&stream);
+	}
+
+	jstream_close(&stream);
 	return error;
 }
 
-static int validate_file_type(cJSON *json_structure)
+static int validate_file_type(cJSON *file_type)
 {
 	char *siit = "SIIT";
 	char *nat64 = "NAT64";
 	char *expected;
 
-	cJSON *file_type = cJSON_GetObjectItem(json_structure, "File_Type");
-	if (!file_type)
-		return 0; /* The user doesn't care. */
+	if (file_type->type != cJSON_String) {
+		log_err("File_Type is supposed to be a string.");
+		return -EINVAL;
+	}
 
 	expected = xlat_is_siit() ? siit : nat64;
 
@@ -132,22 +143,33 @@ static int validate_u8(const char *field, struct cJSON *node)
 	return validate_json_uint(field, node, 0, MAX_U8);
 }
 
-static int do_parsing(char *buffer)
+/**
+ * Reads the next value out of @stream, and hands it to @handler.
+ * (For the sections which are small enough to be read in one go.)
+ */
+static int handle_value(struct json_stream *stream,
+		int (*handler)(cJSON *, bool *), bool *globals_found)
 {
+	cJSON *json;
 	int error;
 
-	cJSON *json = cJSON_Parse(buffer);
-	if (!json) {
-		log_err("The JSON parser got confused around about here:");
-		log_err("%s", cJSON_GetErrorPtr());
-		return -EINVAL;
-	}
-
-	error = validate_file_type(json);
+	error = jstream_value(stream, &json);
 	if (error)
 		return error;
 
-	return xlat_is_siit() ? parse_siit_json(json) : parse_nat64_json(json);
+	error = handler(json, globals_found);
+	cJSON_Delete(json);
+	return error;
+}
+
+static int handle_file_type(cJSON *json, bool *unused)
+{
+	return validate_file_type(json);
+}
+
+static int handle_pool6_value(cJSON *json, bool *unused)
+{
+	return handle_pool6(json);
 }
 
 static void check_duplicates(bool *found, char *section)
@@ -247,7 +269,7 @@ static bool *create_globals_found_array(void)
 	return calloc(i, sizeof(bool));
 }
 
-static int parse_siit_json(cJSON *json)
+static int parse_siit_json(struct json_stream *stream)
 {
 	bool global_found = false;
 	bool pool6_found = false;
@@ -255,6 +277,7 @@ static int parse_siit_json(cJSON *json)
 	bool blacklist_found = false;
 	bool pool6791_found = false;
 	bool *globals_found;
+	char *key;
 	int error;
 
 	error = send_ctrl_msg(SEC_INIT);
@@ -267,47 +290,49 @@ static int parse_siit_json(cJSON *json)
 		return -ENOMEM;
 	}
 
-	for (json = json->child; json; json = json->next) {
-		if (strcasecmp(OPTNAME_GLOBAL, json->string) == 0) {
+	while ((error = jstream_next_key(stream, &key)) == 1) {
+		if (strcasecmp(OPTNAME_GLOBAL, key) == 0) {
 			check_duplicates(&global_found, OPTNAME_GLOBAL);
-			error = handle_global(json, globals_found);
-		} else if (strcasecmp(OPTNAME_POOL6, json->string) == 0) {
+			error = handle_value(stream, handle_global,
+					globals_found);
+		} else if (strcasecmp(OPTNAME_POOL6, key) == 0) {
 			check_duplicates(&pool6_found, OPTNAME_POOL6);
-			error = handle_pool6(json);
-		} else if (strcasecmp(OPTNAME_EAMT, json->string) == 0) {
+			error = handle_value(stream, handle_pool6_value, NULL);
+		} else if (strcasecmp(OPTNAME_EAMT, key) == 0) {
 			check_duplicates(&eamt_found, OPTNAME_EAMT);
-			error = handle_eamt(json);
-		} else if (strcasecmp(OPTNAME_BLACKLIST, json->string) == 0) {
+			error = handle_eamt(stream);
+		} else if (strcasecmp(OPTNAME_BLACKLIST, key) == 0) {
 			check_duplicates(&blacklist_found, OPTNAME_BLACKLIST);
-			error = handle_addr4_pool(json, SEC_BLACKLIST);
-		} else if (strcasecmp(OPTNAME_RFC6791, json->string) == 0) {
+			error = handle_addr4_pool(stream, SEC_BLACKLIST);
+		} else if (strcasecmp(OPTNAME_RFC6791, key) == 0) {
 			check_duplicates(&pool6791_found, OPTNAME_RFC6791);
-			error = handle_addr4_pool(json, SEC_POOL6791);
-		} else if (strcasecmp("file_type", json->string) == 0) {
-			/* No code. */
+			error = handle_addr4_pool(stream, SEC_POOL6791);
+		} else if (strcasecmp("file_type", key) == 0) {
+			error = handle_value(stream, handle_file_type, NULL);
 		} else {
-			log_err("I don't know what '%s' is; Canceling.",
-					json->string);
+			log_err("I don't know what '%s' is; Canceling.", key);
 			error = -EINVAL;
 		}
 
-		if (error) {
-			free(globals_found);
-			return error;
-		}
+		free(key);
+		if (error)
+			break;
 	}
 	free(globals_found);
+	if (error)
+		return error;
 
 	return send_ctrl_msg(SEC_COMMIT);
 }
 
-static int parse_nat64_json(cJSON *json)
+static int parse_nat64_json(struct json_stream *stream)
 {
 	bool global_found = false;
 	bool pool6_found = false;
 	bool pool4_found = false;
 	bool bib_found = false;
 	bool *globals_found;
+	char *key;
 	int error;
 
 	error = send_ctrl_msg(SEC_INIT);
@@ -320,34 +345,36 @@ static int parse_nat64_json(cJSON *json)
 		return -ENOMEM;
 	}
 
-	for (json = json->child; json; json = json->next) {
-		if (strcasecmp(OPTNAME_GLOBAL, json->string) == 0) {
+	while ((error = jstream_next_key(stream, &key)) == 1) {
+		if (strcasecmp(OPTNAME_GLOBAL, key) == 0) {
 			check_duplicates(&global_found, OPTNAME_GLOBAL);
-			error = handle_global(json, globals_found);
-		} else if (strcasecmp(OPTNAME_POOL6, json->string) == 0) {
+			error = handle_value(stream, handle_global,
+					globals_found);
+		} else if (strcasecmp(OPTNAME_POOL6, key) == 0) {
 			check_duplicates(&pool6_found, OPTNAME_POOL6);
-			error = handle_pool6(json);
-		} else if (strcasecmp(OPTNAME_POOL4, json->string) == 0) {
+			error = handle_value(stream, handle_pool6_value, NULL);
+		} else if (strcasecmp(OPTNAME_POOL4, key) == 0) {
 			check_duplicates(&pool4_found, OPTNAME_POOL4);
-			error = handle_pool4(json);
-		} else if (strcasecmp(OPTNAME_BIB, json->string) == 0) {
+			error = handle_pool4(stream);
+		} else if (strcasecmp(OPTNAME_BIB, key) == 0) {
 			check_duplicates(&bib_found, OPTNAME_BIB);
-			error = handle_bib(json);
-		} else if (strcasecmp("file_type", json->string) == 0) {
-			/* No code. */
+			error = handle_bib();
+		} else if (strcasecmp("file_type", key) == 0) {
+			error = handle_value(stream, handle_file_type, NULL);
 		} else {
-			log_err("I don't know what '%s' is; Canceling.",
-					json->string);
+			log_err("I don't know what '%s' is; Canceling.", key);
 			error = -EINVAL;
 		}
 
-		if (error) {
-			log_info("Error code: %d", error);
-			free(globals_found);
-			return error;
-		}
+		free(key);
+		if (error)
+			break;
 	}
 	free(globals_found);
+	if (error) {
+		log_info("Error code: %d", error);
+		return error;
+	}
 
 	return send_ctrl_msg(SEC_COMMIT);
 }
@@ -407,15 +434,23 @@ static int write_number(struct nl_buffer *buffer, struct argp_option *opt,
 	msg.hdr.len = sizeof(msg.hdr);
 	switch (opt->key) {
 	case F_ARGS:
+	case F_ALGORITHM:
 	case NEW_TOS:
 	case EAM_HAIRPINNING_MODE:
+	case DETERMINISTIC_BITS:
+	case SUBSCRIBER_PREFIX_LEN:
+	case SS_NODE_COUNT:
+	case SS_NODE_ID:
 		error = validate_u8(opt->name, json);
 		if (error)
 			return error;
 		msg.hdr.len += sizeof(__u8);
 		msg.payload8[0] = json->valueuint;
 		break;
+	case PORT_BLOCK_SIZE:
+	case SS_WINDOW:
 	case SS_MAX_PAYLOAD:
+	case MSS_CLAMP:
 		error = validate_u16(opt->name, json);
 		if (error)
 			return error;
@@ -423,13 +458,31 @@ static int write_number(struct nl_buffer *buffer, struct argp_option *opt,
 		msg.payload16[0] = json->valueuint;
 		break;
 	case MAX_PKTS:
+	case MAX_STORED_BYTES:
+	case MAX_SESSIONS_TCP:
+	case MAX_SESSIONS_UDP:
+	case MAX_SESSIONS_ICMP:
+	case SUBSCRIBER_MAX_BIBS:
+	case SUBSCRIBER_MAX_SESSIONS:
+	case SUBSCRIBER_MAX_RATE:
+	case SS_ADVERTISE_CHUNK:
+	case SS_ADVERTISE_RATE:
+	case LATENCY_SAMPLING:
+	case MIRROR_SAMPLING:
+	case PACKET_BUDGET:
+	case CPS_BUDGET:
 	case SS_CAPACITY:
 	case UDP_TIMEOUT:
+	case UDP_SHORT_TIMEOUT:
 	case ICMP_TIMEOUT:
 	case TCP_EST_TIMEOUT:
 	case TCP_TRANS_TIMEOUT:
+	case TCP_CLOSED_TIMEOUT:
 	case FRAGMENT_TIMEOUT:
+	case FRAGMENT_HIGH_THRESH:
+	case FRAGMENT_LOW_THRESH:
 	case SS_FLUSH_DEADLINE:
+	case SS_RESYNC_INTERVAL:
 		error = validate_u32(opt->name, json);
 		if (error)
 			return error;
@@ -444,20 +497,27 @@ static int write_number(struct nl_buffer *buffer, struct argp_option *opt,
 	return buffer_write(buffer, &msg, msg.hdr.len, SEC_GLOBAL);
 }
 
-static int write_plateaus(struct nl_buffer *buffer, cJSON *root)
+/**
+ * Handles the number arrays: --mtu-plateaus and --udp-short-ports.
+ */
+static int write_u16_array(struct nl_buffer *buffer, struct argp_option *opt,
+		cJSON *root)
 {
 	struct global_value *chunk;
 	size_t size;
 	cJSON *json;
-	__u16 *plateaus;
+	__u16 *array;
+	__u16 max;
 	__u16 i;
 	/* TODO (later) I found a bug in gcc; remove "= -EINVAL." */
 	int error = -EINVAL;
 
+	max = (opt->key == UDP_SHORT_PORTS) ? UDP_SHORT_PORTS_MAX : PLATEAUS_MAX;
+
 	i = 0;
 	for (json = root->child; json; json = json->next) {
-		if (i > PLATEAUS_MAX) {
-			log_err("Too many plateaus. (max is %u)", PLATEAUS_MAX);
+		if (i > max) {
+			log_err("Too many %s. (max is %u)", opt->name, max);
 			return -EINVAL;
 		}
 		i++;
@@ -470,16 +530,16 @@ static int write_plateaus(struct nl_buffer *buffer, cJSON *root)
 		return -ENOMEM;
 	}
 
-	chunk->type = MTU_PLATEAUS;
+	chunk->type = opt->key;
 	chunk->len = size;
-	plateaus = (__u16 *)(chunk + 1);
+	array = (__u16 *)(chunk + 1);
 
 	i = 0;
 	for (json = root->child; json; json = json->next) {
-		error = validate_u16(OPTNAME_MTU_PLATEAUS, json);
+		error = validate_u16(opt->name, json);
 		if (error)
 			goto end;
-		plateaus[i] = json->valueuint;
+		array[i] = json->valueuint;
 		i++;
 	}
 
@@ -520,7 +580,7 @@ static int write_field(cJSON *json, struct argp_option *opt,
 	} else if (strcmp(opt->arg, NUM_FORMAT) == 0) {
 		return write_number(buffer, opt, json);
 	} else if (strcmp(opt->arg, NUM_ARRAY_FORMAT) == 0) {
-		return write_plateaus(buffer, json);
+		return write_u16_array(buffer, opt, json);
 	} else if (strcmp(opt->arg, OPTIONAL_PREFIX6_FORMAT) == 0) {
 		return write_optional_prefix6(buffer, opt->key, json);
 	}
@@ -612,50 +672,40 @@ end:
 	return error;
 }
 
-static int handle_eamt(cJSON *json)
+/**
+ * Writes table entry @json (which is entry number @index) on @buffer.
+ */
+typedef int (*entry_writer)(cJSON *json, unsigned int index,
+		struct nl_buffer *buffer, enum parse_section section);
+
+/**
+ * Sends the array that comes next in @stream, as table @section. Only one
+ * entry is in memory at any given time.
+ */
+static int handle_table(struct json_stream *stream, enum parse_section section,
+		entry_writer write_entry)
 {
 	struct nl_buffer *buffer;
-	cJSON *prefix_json;
-	struct eamt_entry eam;
-	unsigned int i = 1;
+	cJSON *json;
+	unsigned int i;
 	int error;
 
-	if (!json)
-		return 0;
-
-	buffer = buffer_alloc(SEC_EAMT);
+	buffer = buffer_alloc(section);
 	if (!buffer)
 		return -ENOMEM;
 
-	for (json = json->child; json; json = json->next, i++) {
-		prefix_json = cJSON_GetObjectItem(json, "ipv6 Prefix");
-		if (!prefix_json) {
-			log_err("EAM entry #%u lacks an 'ipv6 prefix' field.", i);
-			error = -EINVAL;
-			goto end;
-		}
-		error = str_to_prefix6(prefix_json->valuestring, &eam.prefix6);
-		if (error) {
-			log_err("Error found on EAM entry #%u.", i);
-			goto end;
-		}
-
-		prefix_json = cJSON_GetObjectItem(json, "ipv4 Prefix");
-		if (!prefix_json) {
-			log_err("EAM entry #%u lacks an 'ipv4 prefix' field.", i);
-			error = -EINVAL;
-			goto end;
-		}
-		error = str_to_prefix4(prefix_json->valuestring, &eam.prefix4);
-		if (error) {
-			log_err("Error found on EAM entry #%u.", i);
-			goto end;
-		}
+	error = jstream_array_start(stream);
+	if (error)
+		goto end;
 
-		error = buffer_write(buffer, &eam, sizeof(eam), SEC_EAMT);
+	for (i = 1; (error = jstream_next_element(stream, &json)) == 1; i++) {
+		error = write_entry(json, i, buffer, section);
+		cJSON_Delete(json);
 		if (error)
 			goto end;
 	}
+	if (error)
+		goto end;
 
 	error = nlbuffer_flush(buffer);
 	/* Fall through. */
@@ -665,34 +715,60 @@ end:
 	return error;
 }
 
-static int handle_addr4_pool(cJSON *json, enum parse_section section)
+static int write_eam(cJSON *json, unsigned int i, struct nl_buffer *buffer,
+		enum parse_section section)
 {
-	struct nl_buffer *buffer;
-	struct ipv4_prefix prefix;
+	cJSON *prefix_json;
+	struct eamt_entry eam;
 	int error;
 
-	if (!json)
-		return 0;
-
-	buffer = buffer_alloc(section);
-	if (!buffer)
-		return -ENOMEM;
+	prefix_json = cJSON_GetObjectItem(json, "ipv6 Prefix");
+	if (!prefix_json) {
+		log_err("EAM entry #%u lacks an 'ipv6 prefix' field.", i);
+		return -EINVAL;
+	}
+	error = str_to_prefix6(prefix_json->valuestring, &eam.prefix6);
+	if (error) {
+		log_err("Error found on EAM entry #%u.", i);
+		return error;
+	}
 
-	for (json = json->child; json; json = json->next) {
-		error = str_to_prefix4(json->valuestring, &prefix);
-		if (error)
-			goto end;
-		error = buffer_write(buffer, &prefix, sizeof(prefix), section);
-		if (error)
-			goto end;
+	prefix_json = cJSON_GetObjectItem(json, "ipv4 Prefix");
+	if (!prefix_json) {
+		log_err("EAM entry #%u lacks an 'ipv4 prefix' field.", i);
+		return -EINVAL;
+	}
+	error = str_to_prefix4(prefix_json->valuestring, &eam.prefix4);
+	if (error) {
+		log_err("Error found on EAM entry #%u.", i);
+		return error;
 	}
 
-	error = nlbuffer_flush(buffer);
-	/* Fall through. */
+	return buffer_write(buffer, &eam, sizeof(eam), section);
+}
 
-end:
-	nlbuffer_destroy(buffer);
-	return error;
+static int handle_eamt(struct json_stream *stream)
+{
+	return handle_table(stream, SEC_EAMT, write_eam);
+}
+
+static int write_addr4_prefix(cJSON *json, unsigned int i,
+		struct nl_buffer *buffer, enum parse_section section)
+{
+	struct ipv4_prefix prefix;
+	int error;
+
+	error = str_to_prefix4(json->valuestring, &prefix);
+	if (error)
+		return error;
+
+	return buffer_write(buffer, &prefix, sizeof(prefix), section);
+}
+
+static int handle_addr4_pool(struct json_stream *stream,
+		enum parse_section section)
+{
+	return handle_table(stream, section, write_addr4_prefix);
 }
 
 static int parse_max_iterations(struct cJSON *node,
@@ -731,91 +807,73 @@ static int parse_max_iterations(struct cJSON *node,
 	return error;
 }
 
-static int handle_pool4(cJSON *json)
+static int write_pool4_entry(cJSON *json, unsigned int i,
+		struct nl_buffer *buffer, enum parse_section section)
 {
-	struct nl_buffer *buffer;
 	struct cJSON *child;
 	struct pool4_entry_usr entry;
-	unsigned int i = 1;
 	int error;
 
-	if (!json)
-		return 0;
-
-	buffer = buffer_alloc(SEC_POOL4);
-	if (!buffer)
-		return -ENOMEM;
+	child = cJSON_GetObjectItem(json, OPTNAME_MARK);
+	if (child) {
+		error = validate_u32(OPTNAME_MARK, child);
+		if (error)
+			return error;
+		entry.mark = child->valueuint;
+	} else {
+		entry.mark = 0;
+	}
 
-	for (json = json->child; json; json = json->next, i++) {
-		child = cJSON_GetObjectItem(json, OPTNAME_MARK);
-		if (child) {
-			error = validate_u32(OPTNAME_MARK, child);
-			if (error)
-				goto end;
-			entry.mark = child->valueuint;
-		} else {
-			entry.mark = 0;
-		}
+	child = cJSON_GetObjectItem(json, "protocol");
+	if (!child) {
+		log_err("Pool4 entry %u lacks a protocol field.", i);
+		return -EINVAL;
+	}
+	entry.proto = str_to_l4proto(child->valuestring);
+	if (entry.proto == L4PROTO_OTHER) {
+		log_err("Protocol '%s' is unknown.", child->valuestring);
+		return -EINVAL;
+	}
 
-		child = cJSON_GetObjectItem(json, "protocol");
-		if (!child) {
-			log_err("Pool4 entry %u lacks a protocol field.", i);
-			error = -EINVAL;
-			goto end;
-		}
-		entry.proto = str_to_l4proto(child->valuestring);
-		if (entry.proto == L4PROTO_OTHER) {
-			log_err("Protocol '%s' is unknown.",
-					child->valuestring);
-			error = -EINVAL;
-			goto end;
-		}
+	child = cJSON_GetObjectItem(json, "prefix");
+	if (!child) {
+		log_err("Pool4 entry %u lacks a prefix field.", i);
+		return -EINVAL;
+	}
+	error = str_to_prefix4(child->valuestring, &entry.range.prefix);
+	if (error)
+		return error;
 
-		child = cJSON_GetObjectItem(json, "prefix");
-		if (!child) {
-			log_err("Pool4 entry %u lacks a prefix field.", i);
-			error = -EINVAL;
-			goto end;
-		}
-		error = str_to_prefix4(child->valuestring, &entry.range.prefix);
+	child = cJSON_GetObjectItem(json, "port range");
+	if (child) {
+		error = str_to_port_range(child->valuestring,
+				&entry.range.ports);
 		if (error)
-			goto end;
-
-		child = cJSON_GetObjectItem(json, "port range");
-		if (child) {
-			error = str_to_port_range(child->valuestring,
-					&entry.range.ports);
-			if (error)
-				goto end;
-		} else {
-			entry.range.ports.min = DEFAULT_POOL4_MIN_PORT;
-			entry.range.ports.max = DEFAULT_POOL4_MAX_PORT;
-		}
-
-		child = cJSON_GetObjectItem(json, OPTNAME_MAX_ITERATIONS);
-		if (child) {
-			error = parse_max_iterations(child, &entry);
-			if (error)
-				goto end;
-		} else {
-			entry.iterations = 0;
-			entry.flags = 0;
-		}
+			return error;
+	} else {
+		entry.range.ports.min = DEFAULT_POOL4_MIN_PORT;
+		entry.range.ports.max = DEFAULT_POOL4_MAX_PORT;
+	}
 
-		error = buffer_write(buffer, &entry, sizeof(entry), SEC_POOL4);
+	child = cJSON_GetObjectItem(json, OPTNAME_MAX_ITERATIONS);
+	if (child) {
+		error = parse_max_iterations(child, &entry);
 		if (error)
-			goto end;
+			return error;
+	} else {
+		entry.iterations = 0;
+		entry.flags = 0;
 	}
 
-	error = nlbuffer_flush(buffer);
-	/* Fall through. */
+	return buffer_write(buffer, &entry, sizeof(entry), section);
+}
 
-end:
-	nlbuffer_destroy(buffer);
-	return error;
+static int handle_pool4(struct json_stream *stream)
+{
+	return handle_table(stream, SEC_POOL4, write_pool4_entry);
 }
 
-static int handle_bib(cJSON *json)
+static int handle_bib(void)
 {
 	/*
 	 * xTODO (wontfix) <- The x prevents Eclipse from indexing this to-do.
@@ -184,6 +184,182 @@ int pool4_display(display_flags flags)
 	return 0;
 }
 
+struct usage_args {
+	union request_pool4 *request;
+	display_flags flags;
+	unsigned int row_count;
+	/* One per protocol, indexed by l4_protocol. */
+	struct pool4_stats_usr stats[L4PROTO_OTHER];
+};
+
+static void print_usage_divisor(void)
+{
+	printf("+-------+-----------------+------------+------------+---------+\n");
+}
+
+static int pool4_usage_response(struct jool_response *response, void *arg)
+{
+	struct usage_args *args = arg;
+	struct pool4_usage_usr *usages;
+	unsigned int usage_count, i;
+	__u8 proto = args->request->usage.proto;
+	size_t len = response->payload_len;
+
+	usages = response->payload;
+	if (!args->request->usage.offset_set) {
+		if (len < sizeof(args->stats[proto])) {
+			log_err("Jool's response is not the expected structure.");
+			return -EINVAL;
+		}
+		memcpy(&args->stats[proto], response->payload,
+				sizeof(args->stats[proto]));
+		usages = (struct pool4_usage_usr *)((char *)response->payload
+				+ sizeof(args->stats[proto]));
+		len -= sizeof(args->stats[proto]);
+	}
+
+	usage_count = len / sizeof(*usages);
+	for (i = 0; i < usage_count; i++) {
+		if (args->flags & DF_CSV_FORMAT) {
+			printf("%s,%s,%u,%u\n", l4proto_to_string(proto),
+					inet_ntoa(usages[i].addr),
+					usages[i].ports, usages[i].used);
+		} else {
+			printf("| %5s | %15s | %10u | %10u | %6.2f%% |\n",
+					l4proto_to_string(proto),
+					inet_ntoa(usages[i].addr),
+					usages[i].ports, usages[i].used,
+					usages[i].ports
+					? 100.0 * usages[i].used / usages[i].ports
+					: 0.0);
+		}
+	}
+
+	args->row_count += usage_count;
+	args->request->usage.offset_set = response->hdr->pending_data;
+	if (usage_count > 0)
+		args->request->usage.offset = usages[usage_count - 1].addr;
+
+	return 0;
+}
+
+static int pool4_usage_proto(struct usage_args *args, l4_protocol proto)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *)request;
+	union request_pool4 *payload = (union request_pool4 *)(request + HDR_LEN);
+	int error;
+
+	init_request_hdr(hdr, MODE_POOL4, OP_COUNT);
+	payload->usage.proto = proto;
+	payload->usage.offset_set = false;
+	memset(&payload->usage.offset, 0, sizeof(payload->usage.offset));
+	args->request = payload;
+
+	do {
+		error = netlink_request(&request, sizeof(request),
+				pool4_usage_response, args);
+		if (error)
+			return error;
+	} while (args->request->usage.offset_set);
+
+	return 0;
+}
+
+static void print_stats_csv(struct pool4_stats_usr *stats, l4_protocol proto)
+{
+	unsigned int i;
+
+	printf("%s,%llu,%llu,%llu,%llu", l4proto_to_string(proto),
+			stats->allocations, stats->exhaustions, stats->limited,
+			stats->iterations);
+	for (i = 0; i < POOL4_HISTOGRAM_BUCKETS; i++)
+		printf(",%llu", stats->histogram[i]);
+	printf("\n");
+}
+
+static void print_stats_normal(struct pool4_stats_usr *stats, l4_protocol proto)
+{
+	__u64 searches;
+	unsigned int i;
+
+	searches = stats->allocations + stats->exhaustions + stats->limited;
+
+	printf("%s port searches: %llu\n", l4proto_to_string(proto), searches);
+	if (!searches)
+		return;
+
+	printf("  Successful: %llu\n", stats->allocations);
+	printf("  Ran out of pool4: %llu\n", stats->exhaustions);
+	printf("  Stopped by max-iterations: %llu\n", stats->limited);
+	printf("  Transport addresses tested per search: %.2f (average)\n",
+			(double)stats->iterations / searches);
+	for (i = 0; i < POOL4_HISTOGRAM_BUCKETS; i++) {
+		if (!stats->histogram[i])
+			continue;
+		if (i == 0)
+			printf("    %13s: %llu\n", "0-1", stats->histogram[i]);
+		else if (i == POOL4_HISTOGRAM_BUCKETS - 1)
+			printf("    %12u+: %llu\n", 1U << i, stats->histogram[i]);
+		else
+			printf("    %6u-%6u: %llu\n", 1U << i,
+					(1U << (i + 1)) - 1,
+					stats->histogram[i]);
+	}
+}
+
+int pool4_display_usage(display_flags flags)
+{
+	struct usage_args args;
+	l4_protocol proto;
+	unsigned int i;
+	int error;
+
+	memset(&args, 0, sizeof(args));
+	args.flags = flags;
+
+	if (flags & DF_SHOW_HEADERS) {
+		if (flags & DF_CSV_FORMAT) {
+			printf("Protocol,Address,Ports,Used\n");
+		} else {
+			print_usage_divisor();
+			printf("| Proto |         Address |      Ports |       Used |   Usage |\n");
+		}
+	}
+
+	for (proto = L4PROTO_TCP; proto <= L4PROTO_ICMP; proto++) {
+		if (!(flags & DF_CSV_FORMAT))
+			print_usage_divisor();
+		error = pool4_usage_proto(&args, proto);
+		if (error)
+			return error;
+	}
+
+	if (!(flags & DF_CSV_FORMAT))
+		print_usage_divisor();
+	if (show_footer(flags) && !args.row_count)
+		log_info("  (empty)");
+	printf("\n");
+
+	if ((flags & DF_SHOW_HEADERS) && (flags & DF_CSV_FORMAT)) {
+		printf("Protocol,Successful searches,Exhausted searches,Limited searches,Tested addresses");
+		printf(",Searches testing 0-1");
+		for (i = 1; i < POOL4_HISTOGRAM_BUCKETS - 1; i++)
+			printf(",Searches testing %u-%u", 1U << i,
+					(1U << (i + 1)) - 1);
+		printf(",Searches testing %u+\n", 1U << i);
+	}
+
+	for (proto = L4PROTO_TCP; proto <= L4PROTO_ICMP; proto++) {
+		if (flags & DF_CSV_FORMAT)
+			print_stats_csv(&args.stats[proto], proto);
+		else
+			print_stats_normal(&args.stats[proto], proto);
+	}
+
+	return 0;
+}
+
 int pool4_count(void)
 {
 	log_err("Sorry; --pool4 --count is not implemented anymore.");
@@ -1,7 +1,11 @@
 #include "nat64/usr/session.h"
 
+#include <endian.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include "nat64/common/config.h"
 #include "nat64/common/session.h"
@@ -9,6 +13,9 @@
 #include "nat64/common/types.h"
 #include "nat64/usr/netlink.h"
 #include "nat64/usr/dns.h"
+#include "nat64/usr/events.h"
+#include "nat64/usr/file.h"
+#include "nat64/usr/lines.h"
 
 
 #define HDR_LEN sizeof(struct request_hdr)
@@ -42,11 +49,51 @@ char *tcp_state_to_string(tcp_state state)
 	return "UNKNOWN";
 }
 
+/**
+ * print_session_entry()'s --jsonl and numeric --csv. (CSV keeps the same
+ * columns.)
+ */
+static void print_session_line(struct session_entry_usr *entry,
+		struct display_args *args)
+{
+	l4_protocol proto = args->request->l4_proto;
+	bool counters = args->flags & DF_COUNTERS;
+	struct line line;
+
+	line_start(&line, args->flags & DF_JSONL);
+	line_str(&line, "proto", l4proto_to_string(proto));
+	line_addr6(&line, "src6", &entry->src6.l3);
+	line_u64(&line, "src6_l4", entry->src6.l4);
+	line_addr6(&line, "dst6", &entry->dst6.l3);
+	line_u64(&line, "dst6_l4", entry->dst6.l4);
+	line_addr4(&line, "src4", &entry->src4.l3);
+	line_u64(&line, "src4_l4", entry->src4.l4);
+	line_addr4(&line, "dst4", &entry->dst4.l3);
+	line_u64(&line, "dst4_l4", entry->dst4.l4);
+	line_time(&line, "expires_ms", entry->dying_time);
+	if (proto == L4PROTO_TCP)
+		line_str(&line, "state", tcp_state_to_string(entry->state));
+	else if (counters && !line.json)
+		line_str(&line, "state", ""); /* Keep the columns aligned. */
+	if (counters) {
+		line_u64(&line, "packets_6to4", entry->counters.packets_6to4);
+		line_u64(&line, "bytes_6to4", entry->counters.bytes_6to4);
+		line_u64(&line, "packets_4to6", entry->counters.packets_4to6);
+		line_u64(&line, "bytes_4to6", entry->counters.bytes_4to6);
+	}
+	line_end(&line);
+}
+
 static void print_session_entry(struct session_entry_usr *entry,
 		struct display_args *args)
 {
 	l4_protocol proto = args->request->l4_proto;
 
+	if (lines_wanted(args->flags)) {
+		print_session_line(entry, args);
+		return;
+	}
+
 	if (args->flags & DF_CSV_FORMAT) {
 		printf("%s,", l4proto_to_string(proto));
 		print_addr6(&entry->src6, args->flags, ",", proto);
@@ -58,8 +105,19 @@ static void print_session_entry(struct session_entry_usr *entry,
 		print_addr4(&entry->dst4, args->flags, ",", proto);
 		printf(",");
 		print_time_csv(entry->dying_time);
-		if (proto == L4PROTO_TCP)
+		if (args->flags & DF_COUNTERS) {
+			/* Keep the columns aligned with the header. */
+			printf(",%s", (proto == L4PROTO_TCP)
+					? tcp_state_to_string(entry->state)
+					: "");
+			printf(",%llu,%llu,%llu,%llu",
+				(unsigned long long)entry->counters.packets_6to4,
+				(unsigned long long)entry->counters.bytes_6to4,
+				(unsigned long long)entry->counters.packets_4to6,
+				(unsigned long long)entry->counters.bytes_4to6);
+		} else if (proto == L4PROTO_TCP) {
 			printf(",%s", tcp_state_to_string(entry->state));
+		}
 		printf("\n");
 	} else {
 		if (proto == L4PROTO_TCP)
@@ -80,6 +138,15 @@ static void print_session_entry(struct session_entry_usr *entry,
 		print_addr6(&entry->dst6, DF_NUMERIC_HOSTNAME, "#", proto);
 		printf("\n");
 
+		if (args->flags & DF_COUNTERS) {
+			printf("6->4: %llu packets, %llu bytes\t",
+				(unsigned long long)entry->counters.packets_6to4,
+				(unsigned long long)entry->counters.bytes_6to4);
+			printf("4->6: %llu packets, %llu bytes\n",
+				(unsigned long long)entry->counters.packets_4to6,
+				(unsigned long long)entry->counters.bytes_4to6);
+		}
+
 		printf("---------------------------------\n");
 	}
 }
@@ -92,6 +159,13 @@ static int session_display_response(struct jool_response *response, void *arg)
 
 	entry_count = response->payload_len / sizeof(*entries);
 
+	/* The local addresses are always printed numerically. */
+	for (i = 0; i < entry_count; i++) {
+		dns_prefetch6(&entries[i].src6.l3, args->flags);
+		dns_prefetch4(&entries[i].dst4.l3, args->flags);
+	}
+	dns_resolve();
+
 	for (i = 0; i < entry_count; i++)
 		print_session_entry(&entries[i], args);
 
@@ -106,7 +180,8 @@ static int session_display_response(struct jool_response *response, void *arg)
 	return 0;
 }
 
-static bool display_table(u_int8_t l4_proto, display_flags flags)
+static bool display_table(u_int8_t l4_proto, display_flags flags,
+		struct bib_filter *filter)
 {
 	unsigned char request[HDR_LEN + PAYLOAD_LEN];
 	struct request_hdr *hdr = (struct request_hdr *)request;
@@ -115,27 +190,27 @@ static bool display_table(u_int8_t l4_proto, display_flags flags)
 	struct display_args args;
 	bool error;
 
-	if (!(flags & DF_CSV_FORMAT)) {
+	if (!(flags & (DF_CSV_FORMAT | DF_JSONL))) {
 		printf("%s:\n", l4proto_to_string(l4_proto));
 		printf("---------------------------------\n");
 	}
 
 	init_request_hdr(hdr, MODE_SESSION, OP_DISPLAY);
 	payload->l4_proto = l4_proto;
+	payload->display.export = false;
 	payload->display.offset_set = false;
 	memset(&payload->display.offset.src, 0,
 			sizeof(payload->display.offset.src));
 	memset(&payload->display.offset.dst, 0,
 			sizeof(payload->display.offset.dst));
+	payload->display.filter = *filter;
 
 	args.flags = flags;
 	args.row_count = 0;
 	args.request = payload;
 
-	do {
-		error = netlink_request(request, sizeof(request),
-				session_display_response, &args);
-	} while (!error && args.request->display.offset_set);
+	error = netlink_dump(request, sizeof(request),
+			session_display_response, &args);
 
 	if (show_footer(flags) && !error) {
 		if (args.row_count > 0)
@@ -147,39 +222,57 @@ static bool display_table(u_int8_t l4_proto, display_flags flags)
 	return error;
 }
 
-int session_display(display_flags flags)
+int session_display(display_flags flags, struct bib_filter *filter)
 {
 	int tcp_error = 0;
 	int udp_error = 0;
 	int icmp_error = 0;
 
+	if (lines_wanted(flags))
+		lines_init();
+
 	if ((flags & DF_SHOW_HEADERS) && (flags & DF_CSV_FORMAT)) {
 		printf("Protocol,");
 		printf("IPv6 Remote Address,IPv6 Remote L4-ID,");
 		printf("IPv6 Local Address,IPv6 Local L4-ID,");
 		printf("IPv4 Local Address,IPv4 Local L4-ID,");
 		printf("IPv4 Remote Address,IPv4 Remote L4-ID,");
-		printf("Expires in,State\n");
+		printf("Expires in,State");
+		if (flags & DF_COUNTERS) {
+			printf(",6to4 Packets,6to4 Bytes");
+			printf(",4to6 Packets,4to6 Bytes");
+		}
+		printf("\n");
 	}
 
 	if (flags & DF_TCP)
-		tcp_error = display_table(L4PROTO_TCP, flags);
+		tcp_error = display_table(L4PROTO_TCP, flags, filter);
 	if (flags & DF_UDP)
-		udp_error = display_table(L4PROTO_UDP, flags);
+		udp_error = display_table(L4PROTO_UDP, flags, filter);
 	if (flags & DF_ICMP)
-		icmp_error = display_table(L4PROTO_ICMP, flags);
+		icmp_error = display_table(L4PROTO_ICMP, flags, filter);
 
 	return (tcp_error || udp_error || icmp_error) ? -EINVAL : 0;
 }
 
 static int session_count_response(struct jool_response *response, void *arg)
 {
-	if (response->payload_len != sizeof(__u64)) {
-		log_err("Jool's response is not the expected integer.");
+	struct session_count_usr *count = response->payload;
+
+	/* Modules that predate the eviction counter only send the count. */
+	if (response->payload_len == sizeof(__u64)) {
+		printf("%llu\n", *((__u64 *)response->payload));
+		return 0;
+	}
+
+	if (response->payload_len != sizeof(*count)) {
+		log_err("Jool's response is not the expected structure.");
 		return -EINVAL;
 	}
 
-	printf("%llu\n", *((__u64 *)response->payload));
+	printf("%llu\n", count->count);
+	if (count->evicted)
+		log_info("  (%llu sessions were evicted early.)", count->evicted);
 	return 0;
 }
 
@@ -212,3 +305,292 @@ int session_count(display_flags flags)
 
 	return (tcp_error || udp_error || icmp_error) ? -EINVAL : 0;
 }
+
+/**
+ * Sessions per import request. (64 bytes each, so they stay well below
+ * NETLINK_REQUEST_MAX.)
+ */
+#define IMPORT_MAX 512
+
+struct export_args {
+	FILE *file;
+	unsigned int count;
+};
+
+static int session_export_response(struct jool_response *response, void *arg)
+{
+	struct export_args *args = arg;
+	unsigned int count;
+	int error;
+
+	count = response->payload_len / sizeof(struct joold_session);
+	error = table_file_write(args->file, response->payload,
+			sizeof(struct joold_session), count);
+	if (error)
+		return error;
+
+	args->count += count;
+	return 0;
+}
+
+static int export_table(l4_protocol l4_proto, struct bib_filter *filter,
+		struct export_args *args)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *)request;
+	struct request_session *payload = (struct request_session *)
+			(request + HDR_LEN);
+
+	memset(request, 0, sizeof(request));
+	init_request_hdr(hdr, MODE_SESSION, OP_DISPLAY);
+	payload->l4_proto = l4_proto;
+	payload->display.export = true;
+	payload->display.filter = *filter;
+
+	return netlink_dump(request, sizeof(request), session_export_response,
+			args);
+}
+
+/**
+ * Writes the session tables (the ones selected by @flags and @filter) into
+ * @file_name, in a format session_import() can read back.
+ */
+int session_export(display_flags flags, struct bib_filter *filter,
+		char *file_name)
+{
+	struct export_args args = { .count = 0 };
+	int error;
+
+	error = table_file_create(file_name, TABLE_FILE_SESSION,
+			sizeof(struct joold_session), &args.file);
+	if (error)
+		return error;
+
+	if (!error && (flags & DF_TCP))
+		error = export_table(L4PROTO_TCP, filter, &args);
+	if (!error && (flags & DF_UDP))
+		error = export_table(L4PROTO_UDP, filter, &args);
+	if (!error && (flags & DF_ICMP))
+		error = export_table(L4PROTO_ICMP, filter, &args);
+
+	if (table_file_close(args.file))
+		error = -EIO;
+	if (!error && args.file != stdout)
+		log_info("Exported %u sessions.", args.count);
+	return error;
+}
+
+static bool import_wanted(display_flags flags, struct joold_session *session)
+{
+	switch (session->l4_proto) {
+	case L4PROTO_TCP:
+		return flags & DF_TCP;
+	case L4PROTO_UDP:
+		return flags & DF_UDP;
+	case L4PROTO_ICMP:
+		return flags & DF_ICMP;
+	}
+
+	return false;
+}
+
+static int import_batch(unsigned char *request, unsigned int count)
+{
+	return netlink_request(request, HDR_LEN + PAYLOAD_LEN
+			+ count * sizeof(struct joold_session), NULL, NULL);
+}
+
+/**
+ * Milliseconds since the file described by @hdr was exported. (Zero if the
+ * clock seems to have gone backwards.)
+ */
+static __u64 file_age(struct table_file_hdr *hdr)
+{
+	__s64 age = (__s64)time(NULL) - (__s64)be64toh(hdr->export_time);
+	return (age > 0) ? (1000 * (__u64)age) : 0;
+}
+
+static void age_session(struct joold_session *session, __u64 age)
+{
+	session->update_time = htobe64(be64toh(session->update_time) + age);
+}
+
+/**
+ * Adds the sessions from @file_name (a session_export() output) whose
+ * protocols are selected by @flags.
+ *
+ * The sessions are aged by the time the file spent on disk, so the ones that
+ * expired in the meantime die in the kernel's next cleaning.
+ */
+int session_import(display_flags flags, char *file_name)
+{
+	unsigned char *request;
+	struct request_session *payload;
+	struct joold_session *sessions;
+	struct table_file_hdr hdr;
+	FILE *file;
+	__u64 age;
+	unsigned int count = 0;
+	unsigned int total = 0;
+	int error;
+
+	error = table_file_open(file_name, TABLE_FILE_SESSION,
+			sizeof(struct joold_session), &file, &hdr);
+	if (error)
+		return error;
+	age = file_age(&hdr);
+
+	request = malloc(HDR_LEN + PAYLOAD_LEN
+			+ IMPORT_MAX * sizeof(struct joold_session));
+	if (!request) {
+		log_err("Out of memory.");
+		table_file_close(file);
+		return -ENOMEM;
+	}
+	memset(request, 0, HDR_LEN + PAYLOAD_LEN);
+	init_request_hdr((struct request_hdr *)request, MODE_SESSION, OP_ADD);
+	payload = (struct request_session *)(request + HDR_LEN);
+	sessions = (struct joold_session *)(payload + 1);
+
+	while ((error = table_file_read(file, &sessions[count],
+			sizeof(*sessions))) > 0) {
+		if (!import_wanted(flags, &sessions[count]))
+			continue;
+		age_session(&sessions[count], age);
+
+		count++;
+		total++;
+		if (count == IMPORT_MAX) {
+			error = import_batch(request, count);
+			if (error)
+				break;
+			count = 0;
+		}
+	}
+
+	if (!error && count > 0)
+		error = import_batch(request, count);
+
+	free(request);
+	table_file_close(file);
+	if (!error)
+		log_info("Imported %u sessions.", total);
+	return error;
+}
+
+/* Seconds --follow waits between polls once it has caught up. */
+#define FOLLOW_INTERVAL 1
+
+struct follow_args {
+	struct request_session *request;
+	/* The request only wants to know where the log is. */
+	bool init;
+	bool pending;
+};
+
+static void print_change(struct bib_change_usr *change)
+{
+	printf("%llu,%s,%s,", (unsigned long long)change->seq,
+			event_to_string(change->type),
+			l4proto_to_string(change->proto));
+	print_addr6(&change->src6, DF_NUMERIC_HOSTNAME, ",", change->proto);
+	printf(",");
+	print_addr6(&change->dst6, DF_NUMERIC_HOSTNAME, ",", change->proto);
+	printf(",");
+	print_addr4(&change->src4, DF_NUMERIC_HOSTNAME, ",", change->proto);
+	printf(",");
+	print_addr4(&change->dst4, DF_NUMERIC_HOSTNAME, ",", change->proto);
+	printf("\n");
+}
+
+static int session_follow_response(struct jool_response *response, void *arg)
+{
+	struct follow_args *args = arg;
+	struct bib_changes_hdr *hdr = response->payload;
+	struct bib_change_usr *changes;
+	__u64 since = args->request->follow.since;
+	unsigned int count;
+	unsigned int i;
+
+	if (response->payload_len < sizeof(*hdr)
+			|| (response->payload_len - sizeof(*hdr))
+					% sizeof(*changes)) {
+		log_err("Jool's response has a bogus length. (%zu)",
+				response->payload_len);
+		return -EINVAL;
+	}
+
+	changes = (struct bib_change_usr *)(hdr + 1);
+	count = (response->payload_len - sizeof(*hdr)) / sizeof(*changes);
+	args->pending = response->hdr->pending_data;
+
+	if (args->init) {
+		args->request->follow.since = hdr->next - 1;
+		return 0;
+	}
+
+	if (hdr->first > since + 1) {
+		log_err("Changes %llu through %llu were overwritten before they could be fetched; a full --display is needed to catch up.",
+				(unsigned long long)(since + 1),
+				(unsigned long long)(hdr->first - 1));
+	}
+
+	for (i = 0; i < count; i++)
+		print_change(&changes[i]);
+	if (count > 0)
+		args->request->follow.since = changes[count - 1].seq;
+	fflush(stdout);
+	return 0;
+}
+
+/**
+ * Prints the change log records that follow @since (or the ones that follow
+ * the present, if @since is NULL), forever.
+ */
+int session_follow(display_flags flags, __u64 *since)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *)request;
+	struct request_session *payload = (struct request_session *)
+			(request + HDR_LEN);
+	struct follow_args args;
+	int error;
+
+	init_request_hdr(hdr, MODE_SESSION, OP_FOLLOW);
+	memset(payload, 0, PAYLOAD_LEN);
+	args.request = payload;
+	args.pending = false;
+
+	if (since) {
+		payload->follow.since = *since;
+		args.init = false;
+	} else {
+		payload->follow.since = MAX_U64;
+		args.init = true;
+		error = netlink_request(request, sizeof(request),
+				session_follow_response, &args);
+		if (error)
+			return error;
+		args.init = false;
+	}
+
+	if (flags & DF_SHOW_HEADERS) {
+		printf("Sequence,Event,Protocol,");
+		printf("IPv6 Node Address,IPv6 Node Port,");
+		printf("IPv6 Remote Address,IPv6 Remote Port,");
+		printf("IPv4 Local Address,IPv4 Local Port,");
+		printf("IPv4 Remote Address,IPv4 Remote Port\n");
+		fflush(stdout);
+	}
+
+	do {
+		error = netlink_request(request, sizeof(request),
+				session_follow_response, &args);
+		if (error)
+			return error;
+		if (!args.pending)
+			sleep(FOLLOW_INTERVAL);
+	} while (true);
+
+	return 0;
+}
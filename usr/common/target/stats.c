@@ -0,0 +1,285 @@
+#include "nat64/usr/stats.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "nat64/common/config.h"
+#include "nat64/common/stats.h"
+#include "nat64/common/xlat.h"
+#include "nat64/usr/global.h"
+#include "nat64/usr/netlink.h"
+
+struct stat_metadata {
+	char *name;
+	char *doc;
+};
+
+/* Indexed by enum jool_stat_id. */
+static const struct stat_metadata stats[] = {
+	{ "JSTAT_RECEIVED6", "IPv6 packets received by the translator." },
+	{ "JSTAT_RECEIVED4", "IPv4 packets received by the translator." },
+	{ "JSTAT_SUCCESS", "Packets translated and sent successfully." },
+	{ "JSTAT_MALFORMED", "Packets dropped because their headers were truncated or otherwise malformed." },
+	{ "JSTAT_POOL6_MISMATCH", "IPv6 packets returned to the kernel because their destination did not belong to pool6." },
+	{ "JSTAT_POOL4_MISMATCH", "IPv4 packets returned to the kernel because their destination did not belong to pool4." },
+	{ "JSTAT_UNTRANSLATABLE_ADDR", "Packets returned to the kernel because one of their addresses could not be translated." },
+	{ "JSTAT_HAIRPIN_LOOP", "IPv6 packets dropped because their source belonged to pool6 (hairpinning loop)." },
+	{ "JSTAT_ICMP6_FILTER", "ICMPv6 informational packets dropped because of --drop-icmpv6-info." },
+	{ "JSTAT_MASK_DOMAIN_NOT_FOUND", "IPv6 packets dropped because their mark was not mapped to any pool4 entries." },
+	{ "JSTAT_POOL4_EXHAUSTED", "IPv6 packets dropped because pool4 had no transport addresses left." },
+	{ "JSTAT_SUBSCRIBER_LIMIT", "IPv6 packets dropped because their subscriber reached its session limit or connection rate." },
+	{ "JSTAT_BIB4_NOT_FOUND", "IPv4 packets returned to the kernel because no BIB entry matched them." },
+	{ "JSTAT_ADF", "IPv4 packets dropped by Address-Dependent Filtering." },
+	{ "JSTAT_BIB_ERROR", "Packets dropped because of some other BIB or session table error." },
+	{ "JSTAT_FRAG_TIMEOUT", "Reassembly buffers dropped because they were not completed in time." },
+	{ "JSTAT_FRAG_EVICTED", "Reassembly buffers dropped to stay below --fragment-high-thresh." },
+	{ "JSTAT_BAD_CHECKSUM", "ICMP errors dropped because their checksum was incorrect." },
+	{ "JSTAT_FAILED_ROUTES", "Translated packets the kernel did not know how to route." },
+	{ "JSTAT_PKT_TOO_BIG", "Translated packets dropped because they exceeded the outgoing MTU." },
+	{ "JSTAT_ICMP_LIMITED_ADDR_UNREACHABLE", "Address Unreachable errors not sent because of the ICMP error rate limit." },
+	{ "JSTAT_ICMP_LIMITED_PORT_UNREACHABLE", "Port Unreachable errors not sent because of the ICMP error rate limit." },
+	{ "JSTAT_ICMP_LIMITED_PROTO_UNREACHABLE", "Protocol Unreachable errors not sent because of the ICMP error rate limit." },
+	{ "JSTAT_ICMP_LIMITED_HOP_LIMIT", "Time Exceeded errors not sent because of the ICMP error rate limit." },
+	{ "JSTAT_ICMP_LIMITED_FRAG_NEEDED", "Fragmentation Needed/Packet Too Big errors not sent because of the ICMP error rate limit." },
+	{ "JSTAT_ICMP_LIMITED_HDR_FIELD", "Parameter Problem errors not sent because of the ICMP error rate limit." },
+	{ "JSTAT_ICMP_LIMITED_SRC_ROUTE", "Source Route Failed errors not sent because of the ICMP error rate limit." },
+	{ "JSTAT_ICMP_LIMITED_FILTER", "Administratively Prohibited errors not sent because of the ICMP error rate limit." },
+	{ "JSTAT_OFFLOADED", "Packets translated through the offload cache, without looking up their sessions." },
+	{ "JSTAT_SESSIONS_RECLAIMED", "Idle sessions evicted early because the kernel ran short on memory." },
+	{ "JSTAT_POLICY_DENY", "IPv6 packets dropped by the BIB policy program (--bib --policy)." },
+	{ "JSTAT_BUDGET_PACKETS", "Packets dropped because the instance exceeded --packet-budget." },
+	{ "JSTAT_BUDGET_CPS", "New connections dropped because the instance exceeded --cps-budget." },
+};
+
+/* Indexed by enum jool_stage. */
+static const char *stages[] = {
+	"determine-incoming-tuple",
+	"filtering-and-updating",
+	"compute-outgoing-tuple",
+	"translate",
+	"send",
+};
+
+/* Indexed by enum jool_mem_class. */
+static const char *mem_classes[] = {
+	"bib",
+	"session",
+	"pool4",
+	"fragment",
+	"joold",
+	"trie",
+	"other",
+};
+
+static void print_memory(struct jool_stats_usr *result, display_flags flags)
+{
+	unsigned int i;
+
+	if (!(flags & DF_CSV_FORMAT))
+		printf("\nMemory (module-wide, slab overhead included):\n");
+
+	for (i = 0; i < JMEM_COUNT; i++) {
+		if (flags & DF_CSV_FORMAT)
+			printf("memory-%s,%" PRIu64 ",\"Bytes (in %" PRIu64 " objects) currently allocated\"\n",
+					mem_classes[i],
+					(uint64_t)result->mem_bytes[i],
+					(uint64_t)result->mem_objects[i]);
+		else
+			printf("  %-8s: %" PRIu64 " bytes in %" PRIu64 " objects\n",
+					mem_classes[i],
+					(uint64_t)result->mem_bytes[i],
+					(uint64_t)result->mem_objects[i]);
+	}
+}
+
+static void print_latency(struct jool_stats_usr *result, display_flags flags)
+{
+	__u64 *buckets;
+	__u64 total;
+	unsigned int s, b;
+	bool empty = true;
+
+	for (s = 0; s < JSTAGE_COUNT; s++) {
+		buckets = result->latency[s];
+
+		total = 0;
+		for (b = 0; b < JSTAT_LATENCY_BUCKETS; b++)
+			total += buckets[b];
+		if (!total)
+			continue;
+		empty = false;
+
+		if (!(flags & DF_CSV_FORMAT))
+			printf("\nLatency of stage '%s' (%" PRIu64 " samples):\n",
+					stages[s], (uint64_t)total);
+
+		for (b = 0; b < JSTAT_LATENCY_BUCKETS; b++) {
+			if (!buckets[b])
+				continue;
+			if (flags & DF_CSV_FORMAT)
+				printf("latency-%s-%u,%" PRIu64 ",\"Samples that took 2^%u or more cycles\"\n",
+						stages[s], b,
+						(uint64_t)buckets[b], b);
+			else
+				printf("  >= 2^%-2u cycles: %" PRIu64 " (%.1f%%)\n",
+						b, (uint64_t)buckets[b],
+						100.0 * buckets[b] / total);
+		}
+	}
+
+	if (empty && !(flags & DF_CSV_FORMAT))
+		printf("\n(No latency samples; see --%s.)\n",
+				OPTNAME_LATENCY_SAMPLING);
+}
+
+/* Indexed by l4_protocol. */
+static const char *protos[] = { "tcp", "udp", "icmp" };
+
+static void print_tables(struct jool_stats_usr *result, display_flags flags)
+{
+	unsigned int i;
+
+	if (!xlat_is_nat64())
+		return;
+	if (!(flags & DF_CSV_FORMAT))
+		printf("\nTables:\n");
+
+	for (i = 0; i < JSTAT_PROTOS; i++) {
+		if (flags & DF_CSV_FORMAT) {
+			printf("bib-%s,%" PRIu64 ",\"BIB entries\"\n",
+					protos[i], (uint64_t)result->bibs[i]);
+			printf("sessions-%s,%" PRIu64 ",\"Sessions\"\n",
+					protos[i],
+					(uint64_t)result->sessions[i]);
+			printf("evicted-%s,%" PRIu64 ",\"Sessions evicted to honor the session limit\"\n",
+					protos[i],
+					(uint64_t)result->evicted[i]);
+		} else {
+			printf("  %-4s: %" PRIu64 " BIB entries, %" PRIu64
+					" sessions (%" PRIu64 " evicted)\n",
+					protos[i], (uint64_t)result->bibs[i],
+					(uint64_t)result->sessions[i],
+					(uint64_t)result->evicted[i]);
+		}
+	}
+}
+
+/* Indexed by enum jool_session_hist. */
+static const char *session_hists[] = { "lifetime", "idle" };
+
+static void print_session_hists(struct jool_stats_usr *result,
+		display_flags flags)
+{
+	__u64 *buckets;
+	__u64 total;
+	unsigned int h, p, b;
+
+	if (!xlat_is_nat64())
+		return;
+
+	for (h = 0; h < JHIST_COUNT; h++) {
+		for (p = 0; p < JSTAT_PROTOS; p++) {
+			buckets = result->session_hist[h][p];
+
+			total = 0;
+			for (b = 0; b < JSTAT_SESSION_BUCKETS; b++)
+				total += buckets[b];
+			if (!total)
+				continue;
+
+			if (!(flags & DF_CSV_FORMAT))
+				printf("\n%s session %s (%" PRIu64 " samples):\n",
+						protos[p], session_hists[h],
+						(uint64_t)total);
+
+			for (b = 0; b < JSTAT_SESSION_BUCKETS; b++) {
+				if (!buckets[b])
+					continue;
+				if (flags & DF_CSV_FORMAT)
+					printf("session-%s-%s-%u,%" PRIu64 ",\"Samples that lasted 2^%u or more milliseconds\"\n",
+							session_hists[h],
+							protos[p], b,
+							(uint64_t)buckets[b],
+							b);
+				else
+					printf("  >= 2^%-2u ms: %" PRIu64 " (%.1f%%)\n",
+							b,
+							(uint64_t)buckets[b],
+							100.0 * buckets[b] / total);
+			}
+		}
+	}
+}
+
+static int handle_display_response(struct jool_response *response, void *arg)
+{
+	display_flags flags = *((display_flags *)arg);
+	struct jool_stats_usr *result = response->payload;
+	unsigned int i;
+
+	if (response->payload_len != sizeof(struct jool_stats_usr)) {
+		log_err("Jool's response has a bogus length. (expected %zu, got %zu)",
+				sizeof(struct jool_stats_usr),
+				response->payload_len);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < JSTAT_COUNT; i++) {
+		if (flags & DF_CSV_FORMAT)
+			printf("%s,%" PRIu64 ",\"%s\"\n", stats[i].name,
+					(uint64_t)result->counters[i],
+					stats[i].doc);
+		else
+			printf("%s: %" PRIu64 "\n  %s\n", stats[i].name,
+					(uint64_t)result->counters[i],
+					stats[i].doc);
+	}
+
+	print_latency(result, flags);
+	print_memory(result, flags);
+	print_tables(result, flags);
+	print_session_hists(result, flags);
+	return 0;
+}
+
+/**
+ * Prints the counters. If @interval is nonzero, keeps printing them every
+ * @interval seconds, until interrupted. (Over the same socket, so monitors
+ * don't need to spawn a process and resolve the family for every poll.)
+ */
+int stats_display(display_flags flags, unsigned int interval)
+{
+	struct request_hdr request;
+	int error;
+
+	if ((flags & DF_CSV_FORMAT) && (flags & DF_SHOW_HEADERS))
+		printf("Counter,Value,Description\n");
+
+	init_request_hdr(&request, MODE_STATS, OP_DISPLAY);
+
+	do {
+		if (interval) {
+			if (flags & DF_CSV_FORMAT)
+				printf("timestamp,%ld,\"Seconds since the epoch\"\n",
+						(long)time(NULL));
+			else
+				printf("--- %ld ---\n", (long)time(NULL));
+		}
+
+		error = netlink_request(&request, sizeof(request),
+				handle_display_response, &flags);
+		if (error)
+			return error;
+
+		if (interval) {
+			if (!(flags & DF_CSV_FORMAT))
+				printf("\n");
+			fflush(stdout);
+			sleep(interval);
+		}
+	} while (interval);
+
+	return 0;
+}
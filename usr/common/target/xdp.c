@@ -0,0 +1,480 @@
+#include "nat64/usr/xdp.h"
+
+#include <errno.h>
+#include <ifaddrs.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include "nat64/common/config.h"
+#include "nat64/common/types.h"
+#include "nat64/common/xdp.h"
+#include "nat64/usr/netlink.h"
+
+/*
+ * Copies the kernel module's configuration into the maps of the XDP fast path
+ * (mod/xdp/siit.c). The maps are wiped and refilled every time; they are small,
+ * and this only happens when the user asks for it.
+ *
+ * The program is disabled while the tables are being rewritten, so in the
+ * meantime everything simply goes through the (always correct) slow path.
+ */
+
+#define HDR_LEN sizeof(struct request_hdr)
+
+struct xdp_maps {
+	int config;
+	int eamt6;
+	int eamt4;
+	int blacklist4;
+	int local4;
+};
+
+static int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int map_open(char *name, int *result)
+{
+	union bpf_attr attr;
+	char path[128];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", XDP_PIN_DIR, name);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.pathname = (__u64)(unsigned long)path;
+	fd = sys_bpf(BPF_OBJ_GET, &attr);
+	if (fd < 0) {
+		log_err("Cannot open %s: %s", path, strerror(errno));
+		log_err("(Is the XDP program attached?)");
+		return -errno;
+	}
+
+	*result = fd;
+	return 0;
+}
+
+static int map_update(int fd, void *key, void *value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (__u64)(unsigned long)key;
+	attr.value = (__u64)(unsigned long)value;
+	attr.flags = BPF_ANY;
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr)) {
+		log_err("Cannot write an XDP map entry: %s", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/** Deletes all of @fd's entries. @key has to be big enough for one key. */
+static int map_flush(int fd, void *key)
+{
+	union bpf_attr attr;
+
+	do {
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = fd;
+		attr.key = 0; /* Give me the first one. */
+		attr.next_key = (__u64)(unsigned long)key;
+		if (sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr))
+			return (errno == ENOENT) ? 0 : -errno;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = fd;
+		attr.key = (__u64)(unsigned long)key;
+	} while (!sys_bpf(BPF_MAP_DELETE_ELEM, &attr));
+
+	log_err("Cannot delete an XDP map entry: %s", strerror(errno));
+	return -errno;
+}
+
+static int maps_open(struct xdp_maps *maps)
+{
+	int error;
+
+	error = map_open(XDP_MAP_CONFIG, &maps->config);
+	if (error)
+		return error;
+	error = map_open(XDP_MAP_EAMT6, &maps->eamt6);
+	if (error)
+		goto eamt6_fail;
+	error = map_open(XDP_MAP_EAMT4, &maps->eamt4);
+	if (error)
+		goto eamt4_fail;
+	error = map_open(XDP_MAP_BLACKLIST4, &maps->blacklist4);
+	if (error)
+		goto blacklist_fail;
+	error = map_open(XDP_MAP_LOCAL4, &maps->local4);
+	if (error)
+		goto local4_fail;
+
+	return 0;
+
+local4_fail:
+	close(maps->blacklist4);
+blacklist_fail:
+	close(maps->eamt4);
+eamt4_fail:
+	close(maps->eamt6);
+eamt6_fail:
+	close(maps->config);
+	return error;
+}
+
+static void maps_close(struct xdp_maps *maps)
+{
+	close(maps->local4);
+	close(maps->blacklist4);
+	close(maps->eamt4);
+	close(maps->eamt6);
+	close(maps->config);
+}
+
+static int write_config(struct xdp_maps *maps, struct xdp_config *config)
+{
+	__u32 zero = 0;
+	return map_update(maps->config, &zero, config);
+}
+
+static int global_response(struct jool_response *response, void *arg)
+{
+	struct full_config *conf = response->payload;
+	struct xdp_config *config = arg;
+
+	if (response->payload_len != sizeof(struct full_config)) {
+		log_err("Jool's response has a bogus length. (expected %zu, got %zu)",
+				sizeof(struct full_config),
+				response->payload_len);
+		return -EINVAL;
+	}
+
+	config->enabled = conf->global.status;
+	config->reset_traffic_class = conf->global.reset_traffic_class;
+	config->reset_tos = conf->global.reset_tos;
+	config->new_tos = conf->global.new_tos;
+	return 0;
+}
+
+static int fetch_global(struct xdp_config *config)
+{
+	struct request_hdr request;
+
+	init_request_hdr(&request, MODE_GLOBAL, OP_DISPLAY);
+	return netlink_request(&request, sizeof(request), global_response,
+			config);
+}
+
+struct pool6_args {
+	union request_pool6 *request;
+	struct xdp_config *config;
+};
+
+static int pool6_response(struct jool_response *response, void *arg)
+{
+	struct ipv6_prefix *prefixes = response->payload;
+	struct pool6_args *args = arg;
+	unsigned int prefix_count, i;
+
+	prefix_count = response->payload_len / sizeof(*prefixes);
+
+	for (i = 0; i < prefix_count; i++) {
+		if (args->config->pool6_set)
+			continue;
+		if (prefixes[i].len != 96) {
+			log_info("pool6 prefix length is %u; the XDP program will leave pool6 translation to the kernel.",
+					prefixes[i].len);
+			continue;
+		}
+
+		memcpy(args->config->pool6, &prefixes[i].address,
+				sizeof(args->config->pool6));
+		args->config->pool6_set = true;
+	}
+
+	args->request->prefix_set = response->hdr->pending_data;
+	if (prefix_count > 0)
+		args->request->prefix = prefixes[prefix_count - 1];
+	return 0;
+}
+
+static int fetch_pool6(struct xdp_config *config)
+{
+	unsigned char request[HDR_LEN + sizeof(union request_pool6)];
+	struct request_hdr *hdr = (struct request_hdr *)request;
+	union request_pool6 *payload = (union request_pool6 *)(request + HDR_LEN);
+	struct pool6_args args;
+	int error;
+
+	init_request_hdr(hdr, MODE_POOL6, OP_DISPLAY);
+	payload->prefix_set = false;
+	memset(&payload->prefix, 0, sizeof(payload->prefix));
+	args.request = payload;
+	args.config = config;
+
+	do {
+		error = netlink_request(request, sizeof(request),
+				pool6_response, &args);
+		if (error)
+			return error;
+	} while (payload->prefix_set);
+
+	return 0;
+}
+
+struct eamt_args {
+	union request_eamt *request;
+	struct xdp_maps *maps;
+	unsigned int count;
+};
+
+static int eamt_response(struct jool_response *response, void *arg)
+{
+	struct eamt_entry *entries = response->payload;
+	struct eamt_args *args = arg;
+	struct xdp_key6 key6;
+	struct xdp_key4 key4;
+	struct xdp_eam value;
+	__u16 entry_count, i;
+	int error;
+
+	entry_count = response->payload_len / sizeof(*entries);
+
+	for (i = 0; i < entry_count; i++) {
+		memset(&value, 0, sizeof(value));
+		memcpy(value.addr6, &entries[i].prefix6.address,
+				sizeof(value.addr6));
+		value.addr4 = entries[i].prefix4.address.s_addr;
+		value.suffix_len = 32 - entries[i].prefix4.len;
+
+		key6.prefixlen = entries[i].prefix6.len;
+		memcpy(key6.addr, value.addr6, sizeof(key6.addr));
+		key4.prefixlen = entries[i].prefix4.len;
+		key4.addr = value.addr4;
+
+		error = map_update(args->maps->eamt6, &key6, &value);
+		if (error)
+			return error;
+		error = map_update(args->maps->eamt4, &key4, &value);
+		if (error)
+			return error;
+	}
+
+	args->count += entry_count;
+	args->request->display.prefix4_set = response->hdr->pending_data;
+	if (entry_count > 0)
+		args->request->display.prefix4 = entries[entry_count - 1].prefix4;
+	return 0;
+}
+
+static int sync_eamt(struct xdp_maps *maps)
+{
+	unsigned char request[HDR_LEN + sizeof(union request_eamt)];
+	struct request_hdr *hdr = (struct request_hdr *)request;
+	union request_eamt *payload = (union request_eamt *)(request + HDR_LEN);
+	struct eamt_args args;
+	int error;
+
+	init_request_hdr(hdr, MODE_EAMT, OP_DISPLAY);
+	payload->display.prefix4_set = false;
+	memset(&payload->display.prefix4, 0, sizeof(payload->display.prefix4));
+	args.request = payload;
+	args.maps = maps;
+	args.count = 0;
+
+	do {
+		error = netlink_request(request, sizeof(request),
+				eamt_response, &args);
+		if (error)
+			return error;
+	} while (payload->display.prefix4_set);
+
+	log_info("Copied %u EAMT entries.", args.count);
+	return 0;
+}
+
+struct blacklist_args {
+	union request_pool *request;
+	int fd;
+	unsigned int count;
+};
+
+static int blacklist_response(struct jool_response *response, void *arg)
+{
+	struct ipv4_prefix *prefixes = response->payload;
+	struct blacklist_args *args = arg;
+	unsigned int prefix_count, i;
+	struct xdp_key4 key;
+	__u8 value = 1;
+	int error;
+
+	prefix_count = response->payload_len / sizeof(*prefixes);
+
+	for (i = 0; i < prefix_count; i++) {
+		key.prefixlen = prefixes[i].len;
+		key.addr = prefixes[i].address.s_addr;
+		error = map_update(args->fd, &key, &value);
+		if (error)
+			return error;
+	}
+
+	args->count += prefix_count;
+	args->request->display.offset_set = response->hdr->pending_data;
+	if (prefix_count > 0)
+		args->request->display.offset = prefixes[prefix_count - 1];
+	return 0;
+}
+
+static int sync_blacklist(struct xdp_maps *maps)
+{
+	unsigned char request[HDR_LEN + sizeof(union request_pool)];
+	struct request_hdr *hdr = (struct request_hdr *)request;
+	union request_pool *payload = (union request_pool *)(request + HDR_LEN);
+	struct blacklist_args args;
+	int error;
+
+	init_request_hdr(hdr, MODE_BLACKLIST, OP_DISPLAY);
+	payload->display.offset_set = false;
+	memset(&payload->display.offset, 0, sizeof(payload->display.offset));
+	args.request = payload;
+	args.fd = maps->blacklist4;
+	args.count = 0;
+
+	do {
+		error = netlink_request(request, sizeof(request),
+				blacklist_response, &args);
+		if (error)
+			return error;
+	} while (payload->display.offset_set);
+
+	log_info("Copied %u blacklist prefixes.", args.count);
+	return 0;
+}
+
+static int add_local4(int fd, __u32 addr, unsigned int *count)
+{
+	__u8 value = 1;
+	int error;
+
+	error = map_update(fd, &addr, &value);
+	if (!error)
+		(*count)++;
+	return error;
+}
+
+/**
+ * Copies the addresses interface_contains() would refuse to translate. (The
+ * interfaces' own addresses, except /32s, and their broadcast addresses.)
+ *
+ * These are read from this process' namespace, which is supposed to be the
+ * instance's. Like the rest of the maps, they are not updated automatically.
+ */
+static int sync_local4(struct xdp_maps *maps)
+{
+	struct ifaddrs *ifaddrs, *ifa;
+	__u32 addr, mask;
+	unsigned int count = 0;
+	int error = 0;
+
+	if (getifaddrs(&ifaddrs)) {
+		log_err("Cannot list the interface addresses: %s",
+				strerror(errno));
+		return -errno;
+	}
+
+	for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET)
+			continue;
+
+		addr = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr;
+		mask = ifa->ifa_netmask
+				? ((struct sockaddr_in *)ifa->ifa_netmask)->sin_addr.s_addr
+				: 0xffffffff;
+
+		/* https://github.com/NICMx/Jool/issues/223 */
+		if (mask != 0xffffffff) {
+			error = add_local4(maps->local4, addr, &count);
+			if (error)
+				break;
+		}
+		/* RFC3021: /31 (and /32) networks lack broadcast. */
+		if (ntohl(~mask) > 1) {
+			error = add_local4(maps->local4, addr | ~mask, &count);
+			if (error)
+				break;
+		}
+	}
+
+	freeifaddrs(ifaddrs);
+	if (!error)
+		log_info("Copied %u interface addresses.", count);
+	return error;
+}
+
+int xdp_update(void)
+{
+	struct xdp_maps maps;
+	struct xdp_config config;
+	struct xdp_config disabled;
+	struct xdp_key6 key6;
+	struct xdp_key4 key4;
+	int error;
+
+	memset(&config, 0, sizeof(config));
+	error = fetch_global(&config);
+	if (error)
+		return error;
+	error = fetch_pool6(&config);
+	if (error)
+		return error;
+
+	error = maps_open(&maps);
+	if (error)
+		return error;
+
+	/* Pause the fast path while the tables are incomplete. */
+	memset(&disabled, 0, sizeof(disabled));
+	error = write_config(&maps, &disabled);
+	if (error)
+		goto end;
+
+	error = map_flush(maps.eamt6, &key6);
+	if (error)
+		goto end;
+	error = map_flush(maps.eamt4, &key4);
+	if (error)
+		goto end;
+	error = map_flush(maps.blacklist4, &key4);
+	if (error)
+		goto end;
+	error = map_flush(maps.local4, &key4);
+	if (error)
+		goto end;
+
+	error = sync_eamt(&maps);
+	if (error)
+		goto end;
+	error = sync_blacklist(&maps);
+	if (error)
+		goto end;
+	error = sync_local4(&maps);
+	if (error)
+		goto end;
+
+	error = write_config(&maps, &config);
+	if (!error)
+		log_info("The XDP fast path is %s.",
+				config.enabled ? "enabled" : "disabled (Jool is not translating)");
+	/* Fall through. */
+
+end:
+	maps_close(&maps);
+	return error;
+}
@@ -0,0 +1,426 @@
+#include "nat64/usr/ipfix/exporter.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "nat64/common/types.h"
+
+/**
+ * Largest message we'll send. RFC 7011 forbids IP fragmentation of IPFIX over
+ * UDP, so this stays below any sane path MTU.
+ */
+#define IPFIX_MAX_MSG 1400
+#define IPFIX_VERSION 10
+#define IPFIX_HDR_LEN 16
+#define IPFIX_SET_HDR_LEN 4
+/** Set ID of Template Sets. */
+#define IPFIX_TEMPLATE_SET 2
+
+/* Information Elements. (IANA's "IPFIX Information Elements" registry.) */
+#define IE_PROTOCOL_IDENTIFIER 4
+#define IE_SOURCE_TRANSPORT_PORT 7
+#define IE_DESTINATION_TRANSPORT_PORT 11
+#define IE_SOURCE_IPV6_ADDRESS 27
+#define IE_DESTINATION_IPV6_ADDRESS 28
+#define IE_SOURCE_IPV6_PREFIX_LENGTH 29
+#define IE_POST_NAT_SOURCE_IPV4_ADDRESS 225
+#define IE_POST_NAT_DESTINATION_IPV4_ADDRESS 226
+#define IE_POST_NAPT_SOURCE_TRANSPORT_PORT 227
+#define IE_POST_NAPT_DESTINATION_TRANSPORT_PORT 228
+#define IE_NAT_EVENT 230
+#define IE_OBSERVATION_TIME_MILLISECONDS 323
+#define IE_PORT_RANGE_START 361
+#define IE_PORT_RANGE_END 362
+
+/* natEvent values. (RFC 8158, section 4.1.) */
+#define NAT_EVENT_NAT64_SESSION_CREATE 6
+#define NAT_EVENT_NAT64_SESSION_DELETE 7
+#define NAT_EVENT_NAT64_BIB_CREATE 10
+#define NAT_EVENT_NAT64_BIB_DELETE 11
+#define NAT_EVENT_PORT_BLOCK_ALLOCATION 16
+#define NAT_EVENT_PORT_BLOCK_DEALLOCATION 17
+
+struct ipfix_field {
+	__u16 id;
+	__u16 len;
+};
+
+/* The fields every template starts with. */
+#define COMMON_FIELDS \
+	{ IE_OBSERVATION_TIME_MILLISECONDS, 8 }, \
+	{ IE_NAT_EVENT, 1 }, \
+	{ IE_PROTOCOL_IDENTIFIER, 1 }, \
+	{ IE_SOURCE_IPV6_ADDRESS, 16 }
+
+/* RFC 8158, section 4.4 (NAT64 BIB events). */
+static const struct ipfix_field bib_fields[] = {
+	COMMON_FIELDS,
+	{ IE_SOURCE_TRANSPORT_PORT, 2 },
+	{ IE_POST_NAT_SOURCE_IPV4_ADDRESS, 4 },
+	{ IE_POST_NAPT_SOURCE_TRANSPORT_PORT, 2 },
+};
+
+/* RFC 8158, section 4.3 (NAT64 session events). */
+static const struct ipfix_field session_fields[] = {
+	COMMON_FIELDS,
+	{ IE_SOURCE_TRANSPORT_PORT, 2 },
+	{ IE_POST_NAT_SOURCE_IPV4_ADDRESS, 4 },
+	{ IE_POST_NAPT_SOURCE_TRANSPORT_PORT, 2 },
+	{ IE_DESTINATION_IPV6_ADDRESS, 16 },
+	{ IE_DESTINATION_TRANSPORT_PORT, 2 },
+	{ IE_POST_NAT_DESTINATION_IPV4_ADDRESS, 4 },
+	{ IE_POST_NAPT_DESTINATION_TRANSPORT_PORT, 2 },
+};
+
+/*
+ * RFC 8158, section 4.12 (port block allocation), with the IPv6 subscriber
+ * prefix as the key.
+ */
+static const struct ipfix_field block_fields[] = {
+	COMMON_FIELDS,
+	{ IE_SOURCE_IPV6_PREFIX_LENGTH, 1 },
+	{ IE_POST_NAT_SOURCE_IPV4_ADDRESS, 4 },
+	{ IE_PORT_RANGE_START, 2 },
+	{ IE_PORT_RANGE_END, 2 },
+};
+
+struct ipfix_template {
+	__u16 id;
+	const struct ipfix_field *fields;
+	unsigned int field_count;
+	/** Length of each data record, in bytes. */
+	size_t record_len;
+};
+
+enum template_index {
+	TEMPLATE_BIB,
+	TEMPLATE_SESSION,
+	TEMPLATE_BLOCK,
+	TEMPLATE_COUNT,
+};
+
+#define TEMPLATE(index, array) { \
+	.id = 256 + index, \
+	.fields = array, \
+	.field_count = sizeof(array) / sizeof(array[0]), \
+}
+
+/* Template IDs start at 256. (RFC 7011, section 3.4.1.) */
+static struct ipfix_template templates[] = {
+	[TEMPLATE_BIB] = TEMPLATE(TEMPLATE_BIB, bib_fields),
+	[TEMPLATE_SESSION] = TEMPLATE(TEMPLATE_SESSION, session_fields),
+	[TEMPLATE_BLOCK] = TEMPLATE(TEMPLATE_BLOCK, block_fields),
+};
+
+static struct exporter_config cfg;
+static int sk = -1;
+
+static unsigned char msg[IPFIX_MAX_MSG];
+/** Bytes of @msg in use. Anything below IPFIX_HDR_LEN means "not started". */
+static size_t msg_len;
+/** Data records in @msg. */
+static unsigned int msg_records;
+/** Offset of the set currently open in @msg. */
+static size_t set_offset;
+/** ID of the set currently open in @msg; 0 if none. */
+static __u16 set_id;
+
+/** Data records sent so far; the messages' Sequence Number. (Wraps.) */
+static __u32 sequence;
+/** When the templates were last sent; 0 means "never." */
+static time_t templates_sent;
+
+static unsigned char *put8(unsigned char *buf, __u8 value)
+{
+	*buf = value;
+	return buf + 1;
+}
+
+static unsigned char *put16(unsigned char *buf, __u16 value)
+{
+	value = htons(value);
+	memcpy(buf, &value, sizeof(value));
+	return buf + sizeof(value);
+}
+
+static unsigned char *put32(unsigned char *buf, __u32 value)
+{
+	value = htonl(value);
+	memcpy(buf, &value, sizeof(value));
+	return buf + sizeof(value);
+}
+
+static unsigned char *put64(unsigned char *buf, __u64 value)
+{
+	value = htobe64(value);
+	memcpy(buf, &value, sizeof(value));
+	return buf + sizeof(value);
+}
+
+static unsigned char *put_bytes(unsigned char *buf, void *bytes, size_t len)
+{
+	memcpy(buf, bytes, len);
+	return buf + len;
+}
+
+static void compute_record_lengths(void)
+{
+	unsigned int t, f;
+
+	for (t = 0; t < TEMPLATE_COUNT; t++) {
+		templates[t].record_len = 0;
+		for (f = 0; f < templates[t].field_count; f++)
+			templates[t].record_len += templates[t].fields[f].len;
+	}
+}
+
+static void close_set(void)
+{
+	if (!set_id)
+		return;
+	put16(msg + set_offset + 2, msg_len - set_offset);
+	set_id = 0;
+}
+
+static void open_set(__u16 id)
+{
+	set_offset = msg_len;
+	put16(msg + msg_len, id);
+	msg_len += IPFIX_SET_HDR_LEN; /* The length is written by close_set(). */
+	set_id = id;
+}
+
+static void add_templates(void)
+{
+	unsigned char *buf;
+	unsigned int t, f;
+
+	open_set(IPFIX_TEMPLATE_SET);
+	buf = msg + msg_len;
+	for (t = 0; t < TEMPLATE_COUNT; t++) {
+		buf = put16(buf, templates[t].id);
+		buf = put16(buf, templates[t].field_count);
+		for (f = 0; f < templates[t].field_count; f++) {
+			buf = put16(buf, templates[t].fields[f].id);
+			buf = put16(buf, templates[t].fields[f].len);
+		}
+	}
+	msg_len = buf - msg;
+	close_set();
+
+	templates_sent = time(NULL);
+}
+
+static void start_message(void)
+{
+	time_t now;
+
+	msg_len = IPFIX_HDR_LEN; /* Written by exporter_flush(). */
+	msg_records = 0;
+	set_id = 0;
+
+	/*
+	 * UDP is unreliable and the collector might have restarted, so the
+	 * templates have to be repeated every now and then.
+	 * (RFC 7011, section 8.4.)
+	 */
+	now = time(NULL);
+	if (!templates_sent || now - templates_sent >= cfg.template_refresh)
+		add_templates();
+}
+
+/**
+ * Sends whatever has been exporter_add()ed since the last flush.
+ */
+void exporter_flush(void)
+{
+	unsigned char *buf;
+
+	if (!msg_records)
+		return;
+
+	close_set();
+
+	buf = put16(msg, IPFIX_VERSION);
+	buf = put16(buf, msg_len);
+	buf = put32(buf, time(NULL));
+	buf = put32(buf, sequence);
+	put32(buf, cfg.domain);
+
+	/*
+	 * Errors are not fatal; a collector that is not up yet yields
+	 * ECONNREFUSED, for example. The records are lost either way.
+	 */
+	if (send(sk, msg, msg_len, 0) < 0)
+		log_perror("send() failed", errno);
+
+	sequence += msg_records;
+	msg_len = 0;
+	msg_records = 0;
+}
+
+static __u8 proto_to_ipfix(__u8 proto)
+{
+	switch (proto) {
+	case L4PROTO_TCP:
+		return 6;
+	case L4PROTO_UDP:
+		return 17;
+	case L4PROTO_ICMP:
+		/* The records are keyed by the IPv6 side of the translation. */
+		return 58;
+	}
+
+	return 255;
+}
+
+static int type_to_template(__u8 type, __u8 *nat_event)
+{
+	switch (type) {
+	case BIBEV_BIB_ADD:
+		*nat_event = NAT_EVENT_NAT64_BIB_CREATE;
+		return TEMPLATE_BIB;
+	case BIBEV_BIB_RM:
+		*nat_event = NAT_EVENT_NAT64_BIB_DELETE;
+		return TEMPLATE_BIB;
+	case BIBEV_SESSION_ADD:
+		*nat_event = NAT_EVENT_NAT64_SESSION_CREATE;
+		return TEMPLATE_SESSION;
+	case BIBEV_SESSION_RM:
+		*nat_event = NAT_EVENT_NAT64_SESSION_DELETE;
+		return TEMPLATE_SESSION;
+	case BIBEV_BLOCK_ADD:
+		*nat_event = NAT_EVENT_PORT_BLOCK_ALLOCATION;
+		return TEMPLATE_BLOCK;
+	case BIBEV_BLOCK_RM:
+		*nat_event = NAT_EVENT_PORT_BLOCK_DEALLOCATION;
+		return TEMPLATE_BLOCK;
+	}
+
+	return -EINVAL;
+}
+
+static void write_record(unsigned char *buf, int template,
+		struct bib_event_usr *event, __u8 nat_event)
+{
+	buf = put64(buf, event->timestamp / 1000000);
+	buf = put8(buf, nat_event);
+	buf = put8(buf, proto_to_ipfix(event->proto));
+	buf = put_bytes(buf, &event->src6.l3, 16);
+
+	switch (template) {
+	case TEMPLATE_BIB:
+	case TEMPLATE_SESSION:
+		buf = put16(buf, event->src6.l4);
+		buf = put_bytes(buf, &event->src4.l3, 4);
+		buf = put16(buf, event->src4.l4);
+		if (template == TEMPLATE_BIB)
+			break;
+		buf = put_bytes(buf, &event->dst6.l3, 16);
+		buf = put16(buf, event->dst6.l4);
+		buf = put_bytes(buf, &event->dst4.l3, 4);
+		put16(buf, event->dst4.l4);
+		break;
+	case TEMPLATE_BLOCK:
+		buf = put8(buf, event->plen);
+		buf = put_bytes(buf, &event->src4.l3, 4);
+		buf = put16(buf, event->src4.l4);
+		put16(buf, event->dst4.l4);
+		break;
+	}
+}
+
+/**
+ * Queues @event as an IPFIX data record. The message is sent once it's full
+ * or on the next exporter_flush().
+ */
+void exporter_add(struct bib_event_usr *event)
+{
+	struct ipfix_template *template;
+	__u8 nat_event;
+	int index;
+
+	index = type_to_template(event->type, &nat_event);
+	if (index < 0) {
+		log_err("Unknown event type: %u", event->type);
+		return;
+	}
+	template = &templates[index];
+
+	if (msg_len < IPFIX_HDR_LEN)
+		start_message();
+
+	if (set_id != template->id) {
+		close_set();
+		if (msg_len + IPFIX_SET_HDR_LEN + template->record_len
+				> IPFIX_MAX_MSG) {
+			exporter_flush();
+			start_message();
+		}
+		open_set(template->id);
+	} else if (msg_len + template->record_len > IPFIX_MAX_MSG) {
+		exporter_flush();
+		start_message();
+		open_set(template->id);
+	}
+
+	write_record(msg + msg_len, index, event, nat_event);
+	msg_len += template->record_len;
+	msg_records++;
+}
+
+int exporter_setup(struct exporter_config *config)
+{
+	struct addrinfo hints = { 0 };
+	struct addrinfo *candidates;
+	struct addrinfo *candidate;
+	int error;
+
+	cfg = *config;
+	compute_record_lengths();
+
+	log_info("Getting address info of %s#%s...", cfg.collector_addr,
+			cfg.collector_port);
+
+	hints.ai_socktype = SOCK_DGRAM;
+	error = getaddrinfo(cfg.collector_addr, cfg.collector_port, &hints,
+			&candidates);
+	if (error) {
+		log_err("getaddrinfo() failed: %s", gai_strerror(error));
+		return error;
+	}
+
+	for (candidate = candidates; candidate; candidate = candidate->ai_next) {
+		sk = socket(candidate->ai_family, candidate->ai_socktype,
+				candidate->ai_protocol);
+		if (sk < 0) {
+			log_perror("socket() failed", errno);
+			continue;
+		}
+		if (!connect(sk, candidate->ai_addr, candidate->ai_addrlen))
+			break;
+		log_perror("connect() failed", errno);
+		close(sk);
+		sk = -1;
+	}
+
+	freeaddrinfo(candidates);
+	if (sk < 0) {
+		log_err("None of the candidates yielded a valid socket.");
+		return 1;
+	}
+
+	log_info("The socket to the collector was created.");
+	return 0;
+}
+
+void exporter_teardown(void)
+{
+	exporter_flush();
+	close(sk);
+}
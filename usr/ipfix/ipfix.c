@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nat64/common/types.h"
+#include "nat64/usr/cJSON.h"
+#include "nat64/usr/events.h"
+#include "nat64/usr/file.h"
+#include "nat64/usr/ipfix/exporter.h"
+
+/*
+ * jool-ipfix: subscribes to the kernel's event stream (see --logging-stream)
+ * and forwards it to an IPFIX collector as RFC 8158 NAT logging records.
+ */
+
+static int json_to_uint(cJSON *json, char *field, unsigned int *result)
+{
+	cJSON *child;
+
+	child = cJSON_GetObjectItem(json, field);
+	if (!child)
+		return 0; /* Keep the default. */
+
+	if (!(child->numflags & VALUENUM_INT) || child->valueint < 0) {
+		log_err("%s '%s' is not a valid unsigned integer.", field,
+				child->valuestring);
+		return -EINVAL;
+	}
+
+	*result = child->valueint;
+	return 0;
+}
+
+static int json_to_config(cJSON *json, struct exporter_config *cfg)
+{
+	cJSON *child;
+	unsigned int domain = 0;
+	int error;
+
+	cfg->collector_port = IPFIX_DEFAULT_PORT;
+	cfg->template_refresh = IPFIX_DEFAULT_TEMPLATE_REFRESH;
+
+	child = cJSON_GetObjectItem(json, "collector address");
+	if (!child) {
+		log_err("The field 'collector address' is mandatory; please include it in the file.");
+		return 1;
+	}
+	cfg->collector_addr = child->valuestring;
+
+	child = cJSON_GetObjectItem(json, "collector port");
+	if (child)
+		cfg->collector_port = child->valuestring;
+
+	error = json_to_uint(json, "observation domain", &domain);
+	if (error)
+		return error;
+	cfg->domain = domain;
+
+	return json_to_uint(json, "template refresh", &cfg->template_refresh);
+}
+
+static int read_config(int argc, char **argv, cJSON **result)
+{
+	char *file_name;
+	char *file;
+	cJSON *json;
+	int error;
+
+	file_name = (argc >= 2) ? argv[1] : "ipfix.json";
+	log_info("Opening file %s...", file_name);
+	error = file_to_string(file_name, &file);
+	if (error)
+		return error;
+
+	json = cJSON_Parse(file);
+	if (!json) {
+		log_err("JSON syntax error.");
+		log_err("The JSON parser got confused around about here:");
+		log_err("%s", cJSON_GetErrorPtr());
+		free(file);
+		return 1;
+	}
+
+	free(file);
+	*result = json;
+	return 0;
+}
+
+static void export_batch(struct bib_event_usr *events, unsigned int count,
+		void *arg)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		exporter_add(&events[i]);
+	/* The kernel already did the batching; don't hold the records back. */
+	exporter_flush();
+}
+
+int main(int argc, char **argv)
+{
+	struct exporter_config cfg;
+	cJSON *json;
+	int error;
+
+	openlog("jool-ipfix", 0, LOG_DAEMON);
+
+	error = read_config(argc, argv, &json);
+	if (error)
+		goto end;
+
+	/* @cfg points to @json's strings. */
+	error = json_to_config(json, &cfg);
+	if (!error)
+		error = exporter_setup(&cfg);
+	if (error)
+		goto clean_json;
+
+	error = events_subscribe(export_batch, NULL);
+
+	exporter_teardown();
+	/* Fall through. */
+
+clean_json:
+	cJSON_Delete(json);
+end:
+	closelog();
+	if (error)
+		fprintf(stderr, "jool-ipfix error: %d\n", error);
+	return error;
+}
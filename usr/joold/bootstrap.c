@@ -0,0 +1,121 @@
+#include "nat64/usr/joold/bootstrap.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "nat64/common/config.h"
+#include "nat64/common/types.h"
+#include "nat64/usr/netlink.h"
+#include "nat64/usr/joold/netsocket.h"
+
+/**
+ * Seconds between advertisement requests. (The peers might not be listening
+ * yet, and UDP might lose the request anyway.)
+ */
+#define BOOTSTRAP_RETRY 5
+
+static int status_response(struct jool_response *response, void *arg)
+{
+	if (response->payload_len != sizeof(struct joold_status_usr)) {
+		log_err("Jool's response has a bogus length. (%zu instead of %zu.)",
+				response->payload_len,
+				sizeof(struct joold_status_usr));
+		return -EINVAL;
+	}
+
+	memcpy(arg, response->payload, sizeof(struct joold_status_usr));
+	return 0;
+}
+
+static int get_status(struct joold_status_usr *status)
+{
+	struct request_hdr request;
+
+	init_request_hdr(&request, MODE_JOOLD, OP_DISPLAY);
+	return netlink_request(&request, sizeof(request), status_response,
+			status);
+}
+
+/**
+ * Sends an OP_ADVERTISE to the peers' daemons, which hand it to their kernels
+ * like any other message from the network.
+ *
+ * This borrows the module-to-network thread's queue, so it has to happen
+ * before that thread starts.
+ */
+static void request_advertisement(void)
+{
+	struct request_hdr request;
+
+	log_info("Asking the peers for their session tables...");
+	init_request_hdr(&request, MODE_JOOLD, OP_ADVERTISE);
+	request.castness = 'm';
+	if (!netsocket_queue(&request, sizeof(request)))
+		netsocket_flush();
+}
+
+/**
+ * Blocks until a peer finishes advertising its table to this instance, or
+ * @config->timeout seconds go by. Timing out is not fatal; the instance
+ * simply starts with whatever it got.
+ *
+ * The network reader and kernel writer threads have to be running already,
+ * because they are the ones who deliver the sessions.
+ */
+int bootstrap_run(struct bootstrap_config *config)
+{
+	struct joold_status_usr status;
+	__u64 baseline;
+	time_t start;
+	time_t next_request;
+	time_t now;
+	int error;
+
+	if (!config->enabled)
+		return 0;
+
+	error = netlink_setup();
+	if (error)
+		return error;
+
+	error = get_status(&status);
+	if (error)
+		goto end;
+	if (!status.enabled) {
+		log_err("Cannot bootstrap: joold is disabled on the Jool instance.");
+		error = -EINVAL;
+		goto end;
+	}
+	baseline = status.advertisements_received;
+
+	start = time(NULL);
+	next_request = start;
+	do {
+		now = time(NULL);
+		if (now >= next_request) {
+			request_advertisement();
+			next_request = now + BOOTSTRAP_RETRY;
+		}
+
+		sleep(1);
+
+		error = get_status(&status);
+		if (error)
+			goto end;
+		if (status.advertisements_received > baseline) {
+			log_info("Bootstrap complete: the peer advertised %llu sessions; %llu were received in total.",
+					status.advertised_sessions,
+					status.sessions_received);
+			goto end;
+		}
+	} while (time(NULL) - start < config->timeout);
+
+	log_err("Bootstrap timed out after %u seconds (%llu sessions received); carrying on anyway.",
+			config->timeout, status.sessions_received);
+	/* Fall through. */
+
+end:
+	netlink_teardown();
+	return error;
+}
@@ -1,9 +1,14 @@
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include "nat64/common/types.h"
+#include "nat64/usr/joold/bootstrap.h"
 #include "nat64/usr/joold/modsocket.h"
 #include "nat64/usr/joold/netsocket.h"
+#include "nat64/usr/joold/ring.h"
 
 static void cancel_thread(pthread_t thread)
 {
@@ -20,41 +25,141 @@ static void cancel_thread(pthread_t thread)
 	 */
 }
 
+/**
+ * Pins @thread to @cpu, unless @cpu is negative.
+ * Failure is not fatal; the thread just keeps floating.
+ */
+static void pin_thread(pthread_t thread, int cpu, char *name)
+{
+	cpu_set_t set;
+	int error;
+
+	if (cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	error = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if (error)
+		log_perror(name, error);
+	else
+		log_info("%s pinned to CPU %d.", name, cpu);
+}
+
+static int start_thread(pthread_t *thread, void *(*fn)(void *), int cpu,
+		char *name)
+{
+	int error;
+
+	error = pthread_create(thread, NULL, fn, NULL);
+	if (error) {
+		log_perror(name, error);
+		return error;
+	}
+
+	pin_thread(*thread, cpu, name);
+	return 0;
+}
+
+/**
+ * The kernel does all the work when it owns the socket, so all that's left
+ * is to give the socket back to the daemon when we're told to quit.
+ */
+static int wait_in_kernel_mode(struct bootstrap_config *bootstrap)
+{
+	sigset_t set;
+	int sig;
+	int error;
+
+	if (bootstrap->enabled)
+		log_err("Bootstrap is not available when the kernel owns the socket; ask for an advertisement instead. (jool --joold --advertise)");
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	error = sigprocmask(SIG_BLOCK, &set, NULL);
+	if (error) {
+		log_perror("sigprocmask() failed", errno);
+		return error;
+	}
+
+	error = sigwait(&set, &sig);
+	if (error) {
+		log_perror("sigwait() failed", error);
+		return error;
+	}
+
+	log_info("Received signal %d; quitting.", sig);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
+	/* Kernel to network pipeline. */
 	pthread_t mod2net_thread;
-	pthread_t net2mod_thread;
+	/* Network to kernel pipeline. (They're connected by the ring.) */
+	pthread_t net_reader_thread;
+	pthread_t kernel_writer_thread;
+	struct joold_cpus cpus;
+	struct bootstrap_config bootstrap;
 	int error;
 
 	openlog("joold", 0, LOG_DAEMON);
 
-	error = netsocket_setup(argc, argv);
+	error = netsocket_setup(argc, argv, &cpus, &bootstrap);
 	if (error)
 		goto end;
+	if (netsocket_in_kernel()) {
+		error = wait_in_kernel_mode(&bootstrap);
+		goto clean_netsocket;
+	}
 	error = modsocket_setup();
+	if (error)
+		goto clean_netsocket;
+	error = ring_setup();
+	if (error)
+		goto clean_modsocket;
+
+	/*
+	 * The network-to-kernel pipeline starts first, so the bootstrap can
+	 * receive the peers' tables before we start sending our own.
+	 */
+	error = start_thread(&kernel_writer_thread, modsocket_write,
+			cpus.kernel_writer, "Kernel writer thread");
+	if (error)
+		goto clean;
+	error = start_thread(&net_reader_thread, netsocket_listen,
+			cpus.net_reader, "Network reader thread");
 	if (error) {
-		netsocket_teardown();
-		goto end;
+		cancel_thread(kernel_writer_thread);
+		goto clean;
 	}
-
-	error = pthread_create(&mod2net_thread, NULL, modsocket_listen, NULL);
+	error = bootstrap_run(&bootstrap);
 	if (error) {
-		log_perror("Module-to-network thread initialization", error);
+		cancel_thread(net_reader_thread);
+		cancel_thread(kernel_writer_thread);
 		goto clean;
 	}
-	error = pthread_create(&net2mod_thread, NULL, netsocket_listen, NULL);
+	error = start_thread(&mod2net_thread, modsocket_listen, cpus.mod2net,
+			"Module-to-network thread");
 	if (error) {
-		log_perror("Network-to-module thread initialization", error);
-		cancel_thread(mod2net_thread);
+		cancel_thread(net_reader_thread);
+		cancel_thread(kernel_writer_thread);
 		goto clean;
 	}
 
-	pthread_join(net2mod_thread, NULL);
+	pthread_join(net_reader_thread, NULL);
+	pthread_join(kernel_writer_thread, NULL);
 	pthread_join(mod2net_thread, NULL);
 	/* Fall through. */
 
 clean:
+	ring_teardown();
+	/* Fall through. */
+clean_modsocket:
 	modsocket_teardown();
+	/* Fall through. */
+clean_netsocket:
 	netsocket_teardown();
 	/* Fall through. */
 
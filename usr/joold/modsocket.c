@@ -1,6 +1,7 @@
 #include "nat64/usr/joold/modsocket.h"
 
 #include <errno.h>
+#include <poll.h>
 #include <string.h>
 #include <netlink/genl/ctrl.h>
 #include <netlink/genl/genl.h>
@@ -9,14 +10,40 @@
 #include "nat64/common/types.h"
 #include "nat64/usr/netlink.h"
 #include "nat64/usr/joold/netsocket.h"
+#include "nat64/usr/joold/resync.h"
+#include "nat64/usr/joold/ring.h"
+
+/*
+ * Largest Netlink message a peer's datagram can become.
+ * (It has to contain a full JOOLD_MAX_PAYLOAD attribute.)
+ */
+#define JOOLD_NLMSG_MAX NLMSG_ALIGN(NLMSG_HDRLEN + GENL_HDRLEN \
+		+ NLA_HDRLEN + NLA_ALIGN(JOOLD_MAX_PAYLOAD))
 
 /** Receives Generic Netlink packets from the kernel module. */
 static struct nl_sock *sk;
+/**
+ * Writes the peers' sessions to the kernel module.
+ * It's separate from @sk so the two pipelines don't share a libnl socket.
+ */
+static struct nl_sock *tx_sk;
 static int family;
 
+/*
+ * Sequence number of the last packet from the kernel that still needs to be
+ * ACKed, if @ack_pending.
+ * Only the module-to-network thread touches these.
+ */
+static __be16 ack_seq;
+static bool ack_pending;
+/*
+ * resync_now() at which the last multicast message arrived from the kernel.
+ * Only the module-to-network thread touches it.
+ */
+static unsigned long long last_mcast_time;
 
 /* TODO (duplicate code) this is a ripoff of netlink_request_simple(). */
-void modsocket_send(void *request, size_t request_len)
+static struct nl_msg *build_request(void *request, size_t request_len)
 {
 	struct nl_msg *msg;
 	int error;
@@ -24,20 +51,20 @@ void modsocket_send(void *request, size_t request_len)
 	error = validate_request(request, request_len, "joold peer",
 			"local joold", NULL);
 	if (error)
-		return;
+		return NULL;
 
 	msg = nlmsg_alloc();
 	if (!msg) {
 		log_err("Could not allocate the request to kernelspace.");
 		log_err("(I guess we're out of memory.)");
-		return;
+		return NULL;
 	}
 
 	if (!genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, family, 0, 0,
-			JOOL_COMMAND, 1)) {
+			JOOLD_COMMAND, 1)) {
 		log_err("Unknown error building the packet to the kernel.");
 		nlmsg_free(msg);
-		return;
+		return NULL;
 	}
 
 	error = nla_put(msg, ATTR_DATA, request_len, request);
@@ -45,9 +72,21 @@ void modsocket_send(void *request, size_t request_len)
 		log_err("Could not write on the packet to kernelspace.");
 		netlink_print_error(error);
 		nlmsg_free(msg);
-		return;
+		return NULL;
 	}
 
+	return msg;
+}
+
+void modsocket_send(void *request, size_t request_len)
+{
+	struct nl_msg *msg;
+	int error;
+
+	msg = build_request(request, request_len);
+	if (!msg)
+		return;
+
 	log_debug("Sending %zu bytes to the kernel.", request_len);
 	error = nl_send_auto(sk, msg);
 	if (error < 0) {
@@ -61,15 +100,124 @@ void modsocket_send(void *request, size_t request_len)
 	log_debug("Sent.\n");
 }
 
-static void send_ack(void)
+/**
+ * Returns true if @socket has stuff waiting to be read.
+ */
+static bool more_messages_ready(struct nl_sock *socket)
+{
+	struct pollfd pfd;
+
+	pfd.fd = nl_socket_get_fd(socket);
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/**
+ * Sends the @count peer datagrams described by @requests to the kernel, in a
+ * single write. (The kernel handles the Netlink messages one after the other,
+ * same as if they had been sent separately.)
+ */
+static void modsocket_send_batch(struct iovec *requests, unsigned int count)
+{
+	static char buffer[JOOLD_BATCH * JOOLD_NLMSG_MAX];
+	struct nl_msg *msg;
+	struct nlmsghdr *hdr;
+	size_t len = 0;
+	unsigned int i;
+	int error;
+
+	for (i = 0; i < count; i++) {
+		msg = build_request(requests[i].iov_base, requests[i].iov_len);
+		if (!msg)
+			continue;
+
+		nl_complete_msg(tx_sk, msg);
+		hdr = nlmsg_hdr(msg);
+		if (len + NLMSG_ALIGN(hdr->nlmsg_len) > sizeof(buffer)) {
+			/* Shouldn't happen, given JOOLD_NLMSG_MAX. */
+			log_err("The batch to the kernel is full; dropping a packet.");
+		} else {
+			memcpy(buffer + len, hdr, hdr->nlmsg_len);
+			len += NLMSG_ALIGN(hdr->nlmsg_len);
+		}
+		nlmsg_free(msg);
+	}
+
+	if (!len)
+		return;
+
+	log_debug("Sending %u messages (%zu bytes) to the kernel.", count, len);
+	error = nl_sendto(tx_sk, buffer, len);
+	if (error < 0) {
+		log_err("Could not dispatch the requests to kernelspace.");
+		netlink_print_error(error);
+		return;
+	}
+
+	/*
+	 * The kernel handles the messages during the write, so whatever it
+	 * had to say about them (only errors) is already queued.
+	 */
+	while (more_messages_ready(tx_sk))
+		nl_recvmsgs_default(tx_sk);
+
+	log_debug("Sent.\n");
+}
+
+/**
+ * Writes the datagrams netsocket_listen() puts in the ring to the kernel.
+ */
+void *modsocket_write(void *arg)
+{
+	struct iovec requests[JOOLD_BATCH];
+	unsigned int count;
+
+	do {
+		count = ring_peek(requests, JOOLD_BATCH);
+		modsocket_send_batch(requests, count);
+		ring_release(count);
+	} while (true);
+
+	return NULL;
+}
+
+static void send_ack(__be16 seq)
 {
 	struct request_hdr hdr;
 
 	init_request_hdr(&hdr, MODE_JOOLD, OP_ACK);
+	hdr.seq = seq;
+
+	modsocket_send(&hdr, sizeof(hdr));
+}
+
+/**
+ * Asks the kernel to send the whole session table to the network.
+ * Only the module-to-network thread should call this.
+ */
+void modsocket_advertise(void)
+{
+	struct request_hdr hdr;
 
+	log_info("Requesting an advertisement...");
+	init_request_hdr(&hdr, MODE_JOOLD, OP_ADVERTISE);
 	modsocket_send(&hdr, sizeof(hdr));
 }
 
+/**
+ * The kernel's messages overflowed our socket, so the peers never saw them.
+ * Asks the kernel to send the sessions they might have carried again.
+ * Only the module-to-network thread should call this.
+ */
+static void modsocket_resync(void)
+{
+	struct resync_request request;
+
+	log_info("Some of the kernel's messages got lost; requesting the latest sessions again...");
+	resync_init(&request, last_mcast_time);
+	modsocket_send(&request, sizeof(request));
+}
+
 static void print_pkt_meta(struct request_hdr *hdr)
 {
 	printf("The packet is ");
@@ -153,6 +301,9 @@ static void print_pkt_meta(struct request_hdr *hdr)
 	case OP_ACK:
 		printf("ack");
 		break;
+	case OP_ADVERTISE_END:
+		printf("advertise end");
+		break;
 	default:
 		printf("unknown (%u)", ntohs(hdr->operation));
 	}
@@ -210,8 +361,19 @@ static int updated_entries_cb(struct nl_msg *msg, void *arg)
 	castness = data->castness;
 	switch (castness) {
 	case 'm':
-		netsocket_send(data, data_size); /* handle request. */
-		send_ack();
+		/* handle request. (See modsocket_listen().) */
+		last_mcast_time = resync_now();
+		if (netsocket_queue(data, data_size))
+			return 0;
+		/*
+		 * The kernel's ACKs are cumulative, so each flush only ACKs the
+		 * last packet. Tests are numbered like the last packet the
+		 * kernel already knows we handled, so they must not replace a
+		 * newer number.
+		 */
+		if (!ack_pending || ntohs(data->operation) != OP_TEST)
+			ack_seq = data->seq;
+		ack_pending = true;
 		return 0;
 	case 'u':
 		return netlink_parse_response(data, data_size, &response);
@@ -221,6 +383,41 @@ static int updated_entries_cb(struct nl_msg *msg, void *arg)
 	return -EINVAL;
 }
 
+static int setup_tx_socket(void)
+{
+	int error;
+
+	tx_sk = nl_socket_alloc();
+	if (!tx_sk) {
+		log_err("Could not allocate the socket to kernelspace.");
+		log_err("(I guess we're out of memory.)");
+		return -1;
+	}
+
+	/* Same as @sk. */
+	nl_socket_disable_auto_ack(tx_sk);
+
+	/* Only the kernel's (unicast) responses arrive here. */
+	error = nl_socket_modify_cb(tx_sk, NL_CB_VALID, NL_CB_CUSTOM,
+			updated_entries_cb, NULL);
+	if (error) {
+		log_err("Couldn't modify writer socket's callbacks.");
+		goto fail;
+	}
+
+	error = genl_connect(tx_sk);
+	if (error) {
+		log_err("Could not open the writer socket to kernelspace.");
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	nl_socket_free(tx_sk);
+	return netlink_print_error(error);
+}
+
 int modsocket_setup(void)
 {
 	int family_mc_grp;
@@ -232,6 +429,7 @@ int modsocket_setup(void)
 		log_err("(I guess we're out of memory.)");
 		return -1;
 	}
+	last_mcast_time = resync_now();
 
 	/*
 	 * ACKs are only going to slow us down.
@@ -275,6 +473,12 @@ int modsocket_setup(void)
 		goto fail;
 	}
 
+	error = setup_tx_socket();
+	if (error) {
+		nl_socket_free(sk);
+		return error;
+	}
+
 	return 0;
 
 fail:
@@ -284,6 +488,7 @@ fail:
 
 void modsocket_teardown(void)
 {
+	nl_socket_free(tx_sk);
 	nl_socket_free(sk);
 }
 
@@ -296,6 +501,22 @@ void *modsocket_listen(void *arg)
 		if (error < 0) {
 			log_err("Error receiving packet from kernelspace: %s",
 					nl_geterror(error));
+			/* This is how libnl reports ENOBUFS. */
+			if (error == -NLE_NOMEM)
+				modsocket_resync();
+		}
+
+		/*
+		 * Packets that arrive in a burst leave for the network in a
+		 * single system call.
+		 */
+		if (netsocket_queued() < JOOLD_BATCH && more_messages_ready(sk))
+			continue;
+
+		netsocket_flush();
+		if (ack_pending) {
+			send_ack(ack_seq);
+			ack_pending = false;
 		}
 	} while (true);
 
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* recvmmsg(), sendmmsg() */
 #include "nat64/usr/joold/netsocket.h"
 
 #include <errno.h>
@@ -5,8 +6,10 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <ifaddrs.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include "nat64/common/config.h"
@@ -14,9 +17,25 @@
 #include "nat64/common/types.h"
 #include "nat64/usr/cJSON.h"
 #include "nat64/usr/file.h"
-#include "nat64/usr/joold/modsocket.h"
+#include "nat64/usr/netlink.h"
+#include "nat64/usr/joold/bootstrap.h"
+#include "nat64/usr/joold/resync.h"
+#include "nat64/usr/joold/ring.h"
+#include "nat64/usr/joold/tcpsocket.h"
 
 struct netsocket_config {
+	/**
+	 * Send the sessions to a list of peers over TCP instead of
+	 * multicasting them? (See tcpsocket.h.) Defaults to false.
+	 */
+	bool tcp;
+	/**
+	 * Have the kernel module exchange the sessions with the peers by
+	 * itself, instead of relaying them through us? (UDP only.) Defaults to
+	 * false.
+	 */
+	bool in_kernel;
+
 	/** Address where the sessions will be advertised. Lacks a default. */
 	char *mcast_addr;
 	/** UDP port where the sessions will be advertised. Lacks a default. */
@@ -37,14 +56,32 @@ struct netsocket_config {
 
 	int ttl;
 	bool ttl_set;
+
+	/* CPUs to pin the threads to. */
+	struct joold_cpus cpus;
+	/* What to do before sending our own sessions. */
+	struct bootstrap_config bootstrap;
 };
 
+/** Did the configuration choose the TCP transport? */
+static bool is_tcp;
+/** Did the configuration hand the socket to the kernel? */
+static bool is_in_kernel;
 static int sk;
 /** Processed version of the configuration's hostname and service. */
 static struct addrinfo *addr_candidates;
 /** Candidate from @addr_candidates that we managed to bind the socket with. */
 static struct addrinfo *bound_address;
 
+/*
+ * Datagrams waiting for netsocket_flush().
+ * Only the module-to-network thread touches these.
+ */
+static char out_buffers[JOOLD_BATCH][JOOLD_MAX_PAYLOAD];
+static struct iovec out_iovs[JOOLD_BATCH];
+static struct mmsghdr out_msgs[JOOLD_BATCH];
+static unsigned int out_count;
+
 static struct in_addr *get_addr4(struct addrinfo *addr)
 {
 	return &((struct sockaddr_in *)addr->ai_addr)->sin_addr;
@@ -74,6 +111,93 @@ static int validate_valueint(cJSON *json, char *field)
 	return -EINVAL;
 }
 
+static int json_to_cpu(cJSON *json, char *field, int *result)
+{
+	cJSON *child;
+	int error;
+
+	*result = -1;
+
+	child = cJSON_GetObjectItem(json, field);
+	if (!child)
+		return 0;
+
+	error = validate_valueint(child, field);
+	if (error)
+		return error;
+	if (child->valueint < 0) {
+		log_err("%s '%d' is not a valid CPU.", field, child->valueint);
+		return -EINVAL;
+	}
+
+	*result = child->valueint;
+	return 0;
+}
+
+static int json_to_cpus(cJSON *json, struct joold_cpus *cpus)
+{
+	int error;
+
+	error = json_to_cpu(json, "mod2net cpu", &cpus->mod2net);
+	if (error)
+		return error;
+	error = json_to_cpu(json, "net reader cpu", &cpus->net_reader);
+	if (error)
+		return error;
+	return json_to_cpu(json, "kernel writer cpu", &cpus->kernel_writer);
+}
+
+static int json_to_bootstrap(cJSON *json, struct bootstrap_config *cfg)
+{
+	cJSON *child;
+	int error;
+
+	cfg->enabled = false;
+	cfg->timeout = DEFAULT_BOOTSTRAP_TIMEOUT;
+
+	child = cJSON_GetObjectItem(json, "bootstrap");
+	if (child) {
+		if (child->type != cJSON_True && child->type != cJSON_False) {
+			log_err("bootstrap must be either true or false.");
+			return -EINVAL;
+		}
+		cfg->enabled = (child->type == cJSON_True);
+	}
+
+	child = cJSON_GetObjectItem(json, "bootstrap timeout");
+	if (child) {
+		error = validate_valueint(child, "bootstrap timeout");
+		if (error)
+			return error;
+		if (child->valueint < 1) {
+			log_err("bootstrap timeout must be at least one second.");
+			return -EINVAL;
+		}
+		cfg->timeout = child->valueint;
+	}
+
+	return 0;
+}
+
+static int json_to_transport(cJSON *json, struct netsocket_config *cfg)
+{
+	cJSON *child;
+
+	child = cJSON_GetObjectItem(json, "transport");
+	if (!child || strcasecmp(child->valuestring, "udp") == 0) {
+		cfg->tcp = false;
+		return 0;
+	}
+	if (strcasecmp(child->valuestring, "tcp") == 0) {
+		cfg->tcp = true;
+		return 0;
+	}
+
+	log_err("Unknown transport: '%s'. (Expected 'udp' or 'tcp'.)",
+			child->valuestring);
+	return -EINVAL;
+}
+
 static int json_to_config(cJSON *json, struct netsocket_config *cfg)
 {
 	char *missing;
@@ -82,6 +206,32 @@ static int json_to_config(cJSON *json, struct netsocket_config *cfg)
 
 	memset(cfg, 0, sizeof(*cfg));
 
+	error = json_to_transport(json, cfg);
+	if (error)
+		return error;
+	error = json_to_cpus(json, &cfg->cpus);
+	if (error)
+		return error;
+	error = json_to_bootstrap(json, &cfg->bootstrap);
+	if (error)
+		return error;
+
+	child = cJSON_GetObjectItem(json, "in kernel");
+	if (child) {
+		if (child->type != cJSON_True && child->type != cJSON_False) {
+			log_err("in kernel must be either true or false.");
+			return -EINVAL;
+		}
+		cfg->in_kernel = (child->type == cJSON_True);
+		if (cfg->in_kernel && cfg->tcp) {
+			log_err("The kernel only speaks UDP to the peers.");
+			return -EINVAL;
+		}
+	}
+
+	if (cfg->tcp)
+		return 0; /* The rest is tcpsocket's business. */
+
 	child = cJSON_GetObjectItem(json, "multicast address");
 	if (!child) {
 		missing = "multicast address";
@@ -417,7 +567,136 @@ static int adjust_mcast_opts(struct netsocket_config *cfg)
 	return 1;
 }
 
-int netsocket_setup(int argc, char **argv)
+/**
+ * Returns the index of the interface @str names. On IPv4, @str can also be one
+ * of the interface's addresses, for consistency with the userspace socket.
+ * Returns zero on failure.
+ */
+static unsigned int str_to_ifindex(char *str, int family)
+{
+	struct ifaddrs *ifas;
+	struct ifaddrs *ifa;
+	struct in_addr addr;
+	unsigned int result;
+
+	result = if_nametoindex(str);
+	if (result || family != AF_INET)
+		return result;
+	if (str_to_addr4(str, &addr))
+		return 0;
+
+	if (getifaddrs(&ifas)) {
+		log_perror("getifaddrs() failed", errno);
+		return 0;
+	}
+	for (ifa = ifas; ifa; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET)
+			continue;
+		if (((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr
+				== addr.s_addr) {
+			result = if_nametoindex(ifa->ifa_name);
+			break;
+		}
+	}
+	freeifaddrs(ifas);
+
+	return result;
+}
+
+static int send_bind(struct joold_bind_request *bind)
+{
+	struct {
+		struct request_hdr hdr;
+		struct joold_bind_request bind;
+	} request;
+	int error;
+
+	init_request_hdr(&request.hdr, MODE_JOOLD, OP_BIND);
+	request.bind = *bind;
+
+	error = netlink_setup();
+	if (error)
+		return error;
+	error = netlink_request(&request, sizeof(request), NULL, NULL);
+	netlink_teardown();
+
+	return error;
+}
+
+/**
+ * Hands the socket over to the kernel module: it binds and subscribes it
+ * itself, and the sessions then stop traveling through this process.
+ */
+static int bind_in_kernel(struct netsocket_config *cfg)
+{
+	struct joold_bind_request bind;
+	struct addrinfo hints = { 0 };
+	struct addrinfo *addr;
+	int err;
+
+	hints.ai_socktype = SOCK_DGRAM;
+	err = getaddrinfo(cfg->mcast_addr, cfg->mcast_port, &hints, &addr);
+	if (err) {
+		log_err("getaddrinfo() failed: %s", gai_strerror(err));
+		return err;
+	}
+
+	memset(&bind, 0, sizeof(bind));
+	bind.family = addr->ai_family;
+	bind.reuseaddr = cfg->reuseaddr_set && cfg->reuseaddr;
+	bind.ttl = cfg->ttl_set ? cfg->ttl : 0;
+	switch (addr->ai_family) {
+	case AF_INET:
+		bind.port = ((struct sockaddr_in *)addr->ai_addr)->sin_port;
+		bind.addr.v4 = *get_addr4(addr);
+		break;
+	case AF_INET6:
+		bind.port = ((struct sockaddr_in6 *)addr->ai_addr)->sin6_port;
+		bind.addr.v6 = *get_addr6(addr);
+		break;
+	default:
+		log_err("Unknown address family: %d", addr->ai_family);
+		freeaddrinfo(addr);
+		return -EINVAL;
+	}
+	freeaddrinfo(addr);
+
+	if (cfg->in_interface) {
+		bind.in_ifindex = str_to_ifindex(cfg->in_interface,
+				bind.family);
+		if (!bind.in_ifindex) {
+			log_err("The incoming interface is invalid.");
+			return -EINVAL;
+		}
+	}
+	if (cfg->out_interface) {
+		bind.out_ifindex = str_to_ifindex(cfg->out_interface,
+				bind.family);
+		if (!bind.out_ifindex) {
+			log_err("The outgoing interface is invalid.");
+			return -EINVAL;
+		}
+	}
+
+	log_info("Handing %s#%s over to the kernel...", cfg->mcast_addr,
+			cfg->mcast_port);
+	err = send_bind(&bind);
+	if (!err)
+		log_info("The kernel is now talking to the peers by itself.");
+	return err;
+}
+
+/**
+ * Returns true if the sessions are exchanged by the kernel module, and the
+ * daemon has nothing to relay.
+ */
+bool netsocket_in_kernel(void)
+{
+	return is_in_kernel;
+}
+
+int netsocket_setup(int argc, char **argv, struct joold_cpus *cpus,
+		struct bootstrap_config *bootstrap)
 {
 	cJSON *json;
 	struct netsocket_config cfg;
@@ -431,6 +710,26 @@ int netsocket_setup(int argc, char **argv)
 	if (error)
 		goto end;
 
+	is_tcp = cfg.tcp;
+	if (is_tcp) {
+		error = tcpsocket_setup(json);
+		if (!error) {
+			*cpus = cfg.cpus;
+			*bootstrap = cfg.bootstrap;
+		}
+		goto end;
+	}
+
+	is_in_kernel = cfg.in_kernel;
+	if (is_in_kernel) {
+		error = bind_in_kernel(&cfg);
+		if (!error) {
+			*cpus = cfg.cpus;
+			*bootstrap = cfg.bootstrap;
+		}
+		goto end;
+	}
+
 	error = create_socket(&cfg);
 	if (error)
 		goto end;
@@ -441,6 +740,9 @@ int netsocket_setup(int argc, char **argv)
 		freeaddrinfo(addr_candidates);
 		goto end;
 	}
+
+	*cpus = cfg.cpus;
+	*bootstrap = cfg.bootstrap;
 	/* Fall through. */
 
 end:
@@ -450,42 +752,166 @@ end:
 
 void netsocket_teardown(void)
 {
+	struct joold_bind_request unbind;
+
+	if (is_tcp) {
+		tcpsocket_teardown();
+		return;
+	}
+	if (is_in_kernel) {
+		memset(&unbind, 0, sizeof(unbind));
+		if (!send_bind(&unbind))
+			log_info("The kernel is back to relaying through the daemon.");
+		return;
+	}
+
 	close(sk);
 	freeaddrinfo(addr_candidates);
 }
 
+/**
+ * Receives datagrams from the network straight into the ring, so they can be
+ * written to the kernel by another thread. (See modsocket_write().) This way,
+ * a slow kernel does not keep us from draining the socket.
+ */
 void *netsocket_listen(void *arg)
 {
-	char buffer[JOOLD_MAX_PAYLOAD];
-	int bytes;
+	struct iovec iovs[JOOLD_BATCH];
+	struct mmsghdr msgs[JOOLD_BATCH];
+	struct sockaddr_storage addrs[JOOLD_BATCH];
+	size_t lengths[JOOLD_BATCH];
+	unsigned int reserved;
+	int count;
+	int i;
+
+	if (is_tcp)
+		return tcpsocket_listen(arg);
 
 	log_info("Listening...");
 
 	do {
-		bytes = recv(sk, buffer, sizeof(buffer), 0);
-		if (bytes < 0) {
+		reserved = ring_reserve(iovs, JOOLD_BATCH);
+
+		memset(msgs, 0, reserved * sizeof(*msgs));
+		for (i = 0; i < reserved; i++) {
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			/* The senders are needed for gap detection. */
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		}
+
+		/*
+		 * Wait for the first datagram, then also take whatever else
+		 * has already arrived.
+		 */
+		count = recvmmsg(sk, msgs, reserved, MSG_WAITFORONE, NULL);
+		if (count < 0) {
 			log_perror("Error receiving packet from the network",
 					errno);
+			ring_publish(reserved, 0, NULL);
 			continue;
 		}
 
-		log_debug("Received %d bytes from the network.", bytes);
-		modsocket_send(buffer, bytes);
+		log_debug("Received %d datagrams from the network.", count);
+		for (i = 0; i < count; i++) {
+			lengths[i] = msgs[i].msg_len;
+			resync_check((struct sockaddr *)&addrs[i],
+					msgs[i].msg_hdr.msg_namelen,
+					iovs[i].iov_base, lengths[i]);
+		}
+		ring_publish(reserved, count, lengths);
 	} while (true);
 
 	return NULL;
 }
 
+/**
+ * Schedules @buffer to be sent to the network during the next
+ * netsocket_flush(). Flushes by itself if the queue is full.
+ */
+int netsocket_queue(void *buffer, size_t size)
+{
+	if (size > JOOLD_MAX_PAYLOAD) {
+		log_err("Packet from the kernel is too big (%zu > %u); dropping it.",
+				size, JOOLD_MAX_PAYLOAD);
+		return -EINVAL;
+	}
+
+	if (out_count == JOOLD_BATCH)
+		netsocket_flush();
+
+	memcpy(out_buffers[out_count], buffer, size);
+	out_iovs[out_count].iov_base = out_buffers[out_count];
+	out_iovs[out_count].iov_len = size;
+	out_count++;
+	return 0;
+}
+
+/**
+ * Sends @buffer to the network right away, bypassing the queue. Unlike
+ * netsocket_queue(), any thread can use it.
+ *
+ * TCP doesn't lose anything, so it doesn't need this. (See resync.h.)
+ */
 void netsocket_send(void *buffer, size_t size)
 {
-	int bytes;
+	if (is_tcp)
+		return;
 
-	log_debug("Sending %zu bytes to the network...", size);
-	bytes = sendto(sk, buffer, size, 0,
-			bound_address->ai_addr,
-			bound_address->ai_addrlen);
-	if (bytes < 0)
+	if (sendto(sk, buffer, size, 0, bound_address->ai_addr,
+			bound_address->ai_addrlen) < 0)
 		log_perror("Could not send a packet to the network", errno);
-	else
-		log_debug("Sent %d bytes to the network.\n", bytes);
+}
+
+/**
+ * Returns the number of datagrams currently waiting for netsocket_flush().
+ */
+unsigned int netsocket_queued(void)
+{
+	return out_count;
+}
+
+/**
+ * Sends the queued datagrams to the network, in as few system calls as
+ * possible.
+ */
+void netsocket_flush(void)
+{
+	unsigned int sent;
+	unsigned int i;
+	int result;
+
+	if (!out_count)
+		return;
+
+	if (is_tcp) {
+		for (i = 0; i < out_count; i++)
+			tcpsocket_send(out_iovs[i].iov_base,
+					out_iovs[i].iov_len);
+		out_count = 0;
+		return;
+	}
+
+	memset(out_msgs, 0, out_count * sizeof(*out_msgs));
+	for (i = 0; i < out_count; i++) {
+		out_msgs[i].msg_hdr.msg_name = bound_address->ai_addr;
+		out_msgs[i].msg_hdr.msg_namelen = bound_address->ai_addrlen;
+		out_msgs[i].msg_hdr.msg_iov = &out_iovs[i];
+		out_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	log_debug("Sending %u datagrams to the network...", out_count);
+	for (sent = 0; sent < out_count; sent += result) {
+		result = sendmmsg(sk, &out_msgs[sent], out_count - sent, 0);
+		if (result < 0) {
+			log_perror("Could not send a packet to the network",
+					errno);
+			/* This is UDP anyway; skip it and move on. */
+			result = 1;
+		}
+	}
+	log_debug("Sent.\n");
+
+	out_count = 0;
 }
@@ -0,0 +1,178 @@
+#include "nat64/usr/joold/resync.h"
+
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "nat64/common/types.h"
+#include "nat64/usr/joold/netsocket.h"
+
+/** Maximum number of peers whose sequence numbers are tracked at once. */
+#define RESYNC_MAX_PEERS 16
+/**
+ * Milliseconds added to every window. Sessions can wait in the sender's queue
+ * for up to --ss-flush-deadline before they're sent, so the lost messages might
+ * have carried sessions older than the last message that arrived.
+ */
+#define RESYNC_MARGIN 5000
+/**
+ * Minimum milliseconds between requests to the same peer. Gaps found in the
+ * meantime are lumped into the next request.
+ */
+#define RESYNC_INTERVAL 1000
+
+struct resync_peer {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	bool used;
+
+	/** Sequence number of the peer's latest message. */
+	__u16 seq;
+	/** resync_now() at which it arrived. */
+	unsigned long long last_time;
+
+	/** Is there a gap the peer hasn't been asked about yet? */
+	bool gap;
+	/** Arrival of the last message before the (first) gap. */
+	unsigned long long gap_time;
+	/** resync_now() of the last request. */
+	unsigned long long request_time;
+};
+
+/* Only the network reader thread touches this. */
+static struct resync_peer peers[RESYNC_MAX_PEERS];
+
+/**
+ * Returns the current time, in milliseconds, from an arbitrary but fixed
+ * point.
+ */
+unsigned long long resync_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Builds a request for the sessions updated since @since (resync_now()'s
+ * clock).
+ */
+void resync_init(struct resync_request *request, unsigned long long since)
+{
+	unsigned long long window;
+
+	window = resync_now() - since + RESYNC_MARGIN;
+	if (window > 0xFFFFFFFFu)
+		window = 0xFFFFFFFFu;
+
+	init_request_hdr(&request->hdr, MODE_JOOLD, OP_ADVERTISE);
+	request->hdr.castness = 'm';
+	request->adv.window = htonl(window);
+}
+
+/**
+ * Returns true if @data is one of the numbered messages a kernel multicasts.
+ */
+static bool is_numbered(void *data, size_t data_len)
+{
+	struct request_hdr *hdr = data;
+
+	if (data_len < sizeof(*hdr) || memcmp(hdr->magic, "jool", 4) != 0)
+		return false;
+	if (ntohs(hdr->mode) != MODE_JOOLD)
+		return false;
+
+	switch (ntohs(hdr->operation)) {
+	case OP_ADD:
+	case OP_UPDATE:
+	case OP_ADVERTISE_END:
+		return true;
+	}
+
+	/* Tests reuse numbers, and the peers' requests aren't numbered. */
+	return false;
+}
+
+/**
+ * Returns the peer that sent from @addr. If it's new, it replaces the one that's
+ * been quiet for the longest time.
+ */
+static struct resync_peer *find_peer(struct sockaddr *addr, socklen_t addr_len,
+		__u16 seq, unsigned long long now)
+{
+	struct resync_peer *peer;
+	struct resync_peer *victim = &peers[0];
+	unsigned int i;
+
+	for (i = 0; i < RESYNC_MAX_PEERS; i++) {
+		peer = &peers[i];
+		if (!peer->used) {
+			victim = peer;
+			break;
+		}
+		if (peer->addr_len == addr_len
+				&& memcmp(&peer->addr, addr, addr_len) == 0)
+			return peer;
+		if (peer->last_time < victim->last_time)
+			victim = peer;
+	}
+
+	memset(victim, 0, sizeof(*victim));
+	memcpy(&victim->addr, addr, addr_len);
+	victim->addr_len = addr_len;
+	victim->used = true;
+	/* Whatever came before this one isn't our business. */
+	victim->seq = seq - 1;
+	victim->last_time = now;
+	return victim;
+}
+
+/**
+ * Called for every datagram that arrives from the network. If messages from its
+ * sender are missing, asks for the sessions they might have carried.
+ */
+void resync_check(struct sockaddr *addr, socklen_t addr_len, void *data,
+		size_t data_len)
+{
+	struct resync_request request;
+	struct resync_peer *peer;
+	unsigned long long now;
+	__u16 seq;
+	__u16 distance;
+
+	if (!is_numbered(data, data_len))
+		return;
+	if (addr_len > sizeof(peer->addr))
+		return;
+
+	now = resync_now();
+	seq = ntohs(((struct request_hdr *)data)->seq);
+	peer = find_peer(addr, addr_len, seq, now);
+
+	distance = seq - peer->seq;
+	if (distance == 0)
+		return;
+	if (distance > 1 && distance < 0x8000u) {
+		log_info("%u messages from a peer got lost.", distance - 1);
+		if (!peer->gap) {
+			peer->gap = true;
+			peer->gap_time = peer->last_time;
+		}
+	}
+	/*
+	 * Otherwise it's either the next one, or something weird (reordering,
+	 * or a peer that restarted). The latter just restarts the count.
+	 */
+	peer->seq = seq;
+	peer->last_time = now;
+
+	if (!peer->gap || now - peer->request_time < RESYNC_INTERVAL)
+		return;
+
+	log_info("Asking the peers for the sessions of the last %llu milliseconds.",
+			now - peer->gap_time + RESYNC_MARGIN);
+	resync_init(&request, peer->gap_time);
+	netsocket_send(&request, sizeof(request));
+	peer->gap = false;
+	peer->request_time = now;
+}
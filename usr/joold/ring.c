@@ -0,0 +1,147 @@
+#include "nat64/usr/joold/ring.h"
+
+#include <errno.h>
+#include <semaphore.h>
+#include "nat64/common/config.h"
+#include "nat64/common/types.h"
+
+/* Has to be a power of two. */
+#define RING_SLOTS 256
+
+struct ring_slot {
+	char data[JOOLD_MAX_PAYLOAD];
+	size_t len;
+};
+
+static struct ring_slot slots[RING_SLOTS];
+/*
+ * The indexes are not shared; each side owns one and learns about the other's
+ * progress through the semaphores. (Which also act as the memory barriers.)
+ */
+/** Next slot the producer will reserve. Only the producer touches it. */
+static unsigned int head;
+/** Next slot the consumer will peek. Only the consumer touches it. */
+static unsigned int tail;
+/** Number of free slots nobody has reserved. */
+static sem_t space;
+/** Number of published slots the consumer hasn't peeked yet. */
+static sem_t items;
+
+int ring_setup(void)
+{
+	if (sem_init(&space, 0, RING_SLOTS)) {
+		log_perror("Could not initialize the ring's space semaphore",
+				errno);
+		return -errno;
+	}
+
+	if (sem_init(&items, 0, 0)) {
+		log_perror("Could not initialize the ring's items semaphore",
+				errno);
+		sem_destroy(&space);
+		return -errno;
+	}
+
+	head = 0;
+	tail = 0;
+	return 0;
+}
+
+void ring_teardown(void)
+{
+	sem_destroy(&items);
+	sem_destroy(&space);
+}
+
+/**
+ * Waits until at least one unit of @sem is available, then grabs it, and as
+ * many more (up to @max in total) as it can without waiting.
+ */
+static unsigned int sem_take(sem_t *sem, unsigned int max)
+{
+	unsigned int taken;
+
+	while (sem_wait(sem))
+		; /* EINTR; try again. */
+
+	for (taken = 1; taken < max; taken++)
+		if (sem_trywait(sem))
+			break;
+
+	return taken;
+}
+
+static void sem_give(sem_t *sem, unsigned int count)
+{
+	for (; count > 0; count--)
+		sem_post(sem);
+}
+
+/**
+ * Producer: Waits for free slots, and returns up to @max of them in @result so
+ * the caller can write on them. Please return them to the ring with
+ * ring_publish() afterwards.
+ */
+unsigned int ring_reserve(struct iovec *result, unsigned int max)
+{
+	struct ring_slot *slot;
+	unsigned int count;
+	unsigned int i;
+
+	count = sem_take(&space, max);
+	for (i = 0; i < count; i++) {
+		slot = &slots[(head + i) & (RING_SLOTS - 1)];
+		result[i].iov_base = slot->data;
+		result[i].iov_len = sizeof(slot->data);
+	}
+
+	return count;
+}
+
+/**
+ * Producer: Hands the first @used of the @reserved slots from the last
+ * ring_reserve() over to the consumer. @lengths are the number of bytes
+ * written on each of them. The rest of the slots are given back.
+ */
+void ring_publish(unsigned int reserved, unsigned int used, size_t *lengths)
+{
+	unsigned int i;
+
+	for (i = 0; i < used; i++) {
+		slots[head & (RING_SLOTS - 1)].len = lengths[i];
+		head++;
+	}
+
+	sem_give(&items, used);
+	sem_give(&space, reserved - used);
+}
+
+/**
+ * Consumer: Waits for published slots, and returns up to @max of them in
+ * @result. They stay in the ring until ring_release().
+ */
+unsigned int ring_peek(struct iovec *result, unsigned int max)
+{
+	struct ring_slot *slot;
+	unsigned int count;
+	unsigned int i;
+
+	count = sem_take(&items, max);
+	for (i = 0; i < count; i++) {
+		slot = &slots[(tail + i) & (RING_SLOTS - 1)];
+		result[i].iov_base = slot->data;
+		result[i].iov_len = slot->len;
+	}
+
+	return count;
+}
+
+/**
+ * Consumer: Gives the @count slots from the last ring_peek() back to the
+ * producer.
+ */
+void ring_release(unsigned int count)
+{
+	tail += count;
+	sem_give(&space, count);
+}
@@ -0,0 +1,444 @@
+#include "nat64/usr/joold/tcpsocket.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "nat64/common/config.h"
+#include "nat64/common/types.h"
+#include "nat64/usr/joold/modsocket.h"
+#include "nat64/usr/joold/ring.h"
+
+#define MAX_PEERS 16
+/* Maximum number of peers that can be connected to us at the same time. */
+#define MAX_INCOMING MAX_PEERS
+/* Seconds to wait before trying to reconnect to a peer. */
+#define RECONNECT_INTERVAL 1
+
+/*
+ * Each session packet travels prefixed by its length, as a 16-bit big endian
+ * integer.
+ */
+typedef __be16 frame_len;
+
+struct tcp_peer {
+	char *address;
+	char *port;
+	/** Candidates yielded by @address and @port. */
+	struct addrinfo *addrs;
+	/** -1 means disconnected. */
+	int fd;
+	/** Do not try to reconnect before this. */
+	time_t next_attempt;
+};
+
+/** A peer connected to us, and the frame we're reading from it. */
+struct tcp_incoming {
+	int fd;
+	unsigned char buffer[sizeof(frame_len) + JOOLD_MAX_PAYLOAD];
+	size_t len;
+};
+
+/* Only the module-to-network thread touches these. */
+static struct tcp_peer peers[MAX_PEERS];
+static unsigned int peer_count;
+
+/* Only the network reader thread touches these. */
+static int listener;
+static struct tcp_incoming incoming[MAX_INCOMING];
+
+static int json_to_peer(cJSON *json, struct tcp_peer *peer)
+{
+	struct addrinfo hints = { 0 };
+	cJSON *child;
+	int error;
+
+	child = cJSON_GetObjectItem(json, "address");
+	if (!child) {
+		log_err("A peer lacks an 'address'.");
+		return -EINVAL;
+	}
+	peer->address = child->valuestring;
+
+	child = cJSON_GetObjectItem(json, "port");
+	if (!child) {
+		log_err("Peer %s lacks a 'port'.", peer->address);
+		return -EINVAL;
+	}
+	peer->port = child->valuestring;
+
+	hints.ai_socktype = SOCK_STREAM;
+	error = getaddrinfo(peer->address, peer->port, &hints, &peer->addrs);
+	if (error) {
+		log_err("getaddrinfo() failed on peer %s#%s: %s",
+				peer->address, peer->port, gai_strerror(error));
+		return -EINVAL;
+	}
+
+	peer->fd = -1;
+	peer->next_attempt = 0;
+	return 0;
+}
+
+static void free_peers(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < peer_count; i++) {
+		if (peers[i].fd >= 0)
+			close(peers[i].fd);
+		freeaddrinfo(peers[i].addrs);
+	}
+	peer_count = 0;
+}
+
+static int json_to_peers(cJSON *json)
+{
+	cJSON *list;
+	int count;
+	int i;
+	int error;
+
+	list = cJSON_GetObjectItem(json, "peers");
+	if (!list || list->type != cJSON_Array) {
+		log_err("The TCP transport needs a 'peers' array.");
+		return -EINVAL;
+	}
+
+	count = cJSON_GetArraySize(list);
+	if (count > MAX_PEERS) {
+		log_err("Too many peers. (%d > %d)", count, MAX_PEERS);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < count; i++) {
+		error = json_to_peer(cJSON_GetArrayItem(list, i),
+				&peers[peer_count]);
+		if (error) {
+			free_peers();
+			return error;
+		}
+		peer_count++;
+	}
+
+	return 0;
+}
+
+static int create_listener(cJSON *json)
+{
+	struct addrinfo hints = { 0 };
+	struct addrinfo *addrs;
+	struct addrinfo *addr;
+	cJSON *child;
+	char *address;
+	char *port;
+	int yes = 1;
+	int error;
+
+	child = cJSON_GetObjectItem(json, "tcp address");
+	address = child ? child->valuestring : NULL;
+	child = cJSON_GetObjectItem(json, "tcp port");
+	if (!child) {
+		log_err("The TCP transport needs a 'tcp port'.");
+		return -EINVAL;
+	}
+	port = child->valuestring;
+
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	error = getaddrinfo(address, port, &hints, &addrs);
+	if (error) {
+		log_err("getaddrinfo() failed: %s", gai_strerror(error));
+		return -EINVAL;
+	}
+
+	for (addr = addrs; addr; addr = addr->ai_next) {
+		listener = socket(addr->ai_family, addr->ai_socktype,
+				addr->ai_protocol);
+		if (listener < 0)
+			continue;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes,
+				sizeof(yes));
+		if (!bind(listener, addr->ai_addr, addr->ai_addrlen)
+				&& !listen(listener, MAX_INCOMING))
+			break;
+		close(listener);
+	}
+
+	freeaddrinfo(addrs);
+	if (!addr) {
+		log_err("Could not listen on TCP port %s.", port);
+		return -EINVAL;
+	}
+
+	log_info("Listening for joold peers on TCP port %s.", port);
+	return 0;
+}
+
+int tcpsocket_setup(cJSON *json)
+{
+	unsigned int i;
+	int error;
+
+	error = json_to_peers(json);
+	if (error)
+		return error;
+
+	error = create_listener(json);
+	if (error) {
+		free_peers();
+		return error;
+	}
+
+	for (i = 0; i < MAX_INCOMING; i++)
+		incoming[i].fd = -1;
+
+	return 0;
+}
+
+void tcpsocket_teardown(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_INCOMING; i++)
+		if (incoming[i].fd >= 0)
+			close(incoming[i].fd);
+	close(listener);
+	free_peers();
+}
+
+static void disconnect(struct tcp_peer *peer)
+{
+	close(peer->fd);
+	peer->fd = -1;
+	peer->next_attempt = time(NULL) + RECONNECT_INTERVAL;
+}
+
+static int connect_peer(struct tcp_peer *peer)
+{
+	struct addrinfo *addr;
+
+	if (time(NULL) < peer->next_attempt)
+		return -EAGAIN;
+
+	for (addr = peer->addrs; addr; addr = addr->ai_next) {
+		peer->fd = socket(addr->ai_family, addr->ai_socktype,
+				addr->ai_protocol);
+		if (peer->fd < 0)
+			continue;
+		if (!connect(peer->fd, addr->ai_addr, addr->ai_addrlen))
+			break;
+		close(peer->fd);
+	}
+
+	if (!addr) {
+		peer->fd = -1;
+		peer->next_attempt = time(NULL) + RECONNECT_INTERVAL;
+		log_debug("Could not connect to peer %s#%s.", peer->address,
+				peer->port);
+		return -ECONNREFUSED;
+	}
+
+	log_info("Connected to peer %s#%s.", peer->address, peer->port);
+	/*
+	 * The peer might have missed any number of sessions while we were
+	 * disconnected, so have the kernel send it the whole table.
+	 */
+	modsocket_advertise();
+	return 0;
+}
+
+/**
+ * Writes all of @iov on @fd. Blocks as long as the peer needs it to; that's
+ * the whole point.
+ */
+static int send_all(int fd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg = { 0 };
+	ssize_t sent;
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	while (msg.msg_iovlen > 0) {
+		sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+			sent -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base
+					+ sent;
+			msg.msg_iov->iov_len -= sent;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Sends @buffer (a session packet from the kernel) to every peer.
+ */
+void tcpsocket_send(void *buffer, size_t size)
+{
+	struct tcp_peer *peer;
+	struct iovec iov[2];
+	frame_len len;
+	unsigned int i;
+	int error;
+
+	for (i = 0; i < peer_count; i++) {
+		peer = &peers[i];
+		if (peer->fd < 0 && connect_peer(peer))
+			continue;
+
+		len = htons(size);
+		iov[0].iov_base = &len;
+		iov[0].iov_len = sizeof(len);
+		iov[1].iov_base = buffer;
+		iov[1].iov_len = size;
+
+		error = send_all(peer->fd, iov, 2);
+		if (error) {
+			log_perror("Could not send a packet to a peer", -error);
+			disconnect(peer);
+		}
+	}
+}
+
+static void accept_peer(void)
+{
+	unsigned int i;
+	int fd;
+
+	fd = accept(listener, NULL, NULL);
+	if (fd < 0) {
+		log_perror("accept() failed", errno);
+		return;
+	}
+
+	for (i = 0; i < MAX_INCOMING; i++) {
+		if (incoming[i].fd < 0) {
+			incoming[i].fd = fd;
+			incoming[i].len = 0;
+			log_info("A peer connected to us.");
+			return;
+		}
+	}
+
+	log_err("Too many peers are connected to us; rejecting one.");
+	close(fd);
+}
+
+static void close_incoming(struct tcp_incoming *conn)
+{
+	close(conn->fd);
+	conn->fd = -1;
+}
+
+/**
+ * Hands the complete frames in @conn's buffer over to the kernel writer.
+ * Returns false if the peer is speaking nonsense.
+ */
+static bool consume_frames(struct tcp_incoming *conn)
+{
+	unsigned char *pos = conn->buffer;
+	struct iovec slot;
+	size_t payload;
+
+	while (conn->len >= sizeof(frame_len)) {
+		payload = ntohs(*((frame_len *)pos));
+		if (payload > JOOLD_MAX_PAYLOAD) {
+			log_err("A peer sent a %zu-byte packet. (Max is %u.)",
+					payload, JOOLD_MAX_PAYLOAD);
+			return false;
+		}
+		if (conn->len < sizeof(frame_len) + payload)
+			break;
+
+		/* If the ring is full, this stops reading and the peer waits. */
+		ring_reserve(&slot, 1);
+		memcpy(slot.iov_base, pos + sizeof(frame_len), payload);
+		ring_publish(1, 1, &payload);
+
+		pos += sizeof(frame_len) + payload;
+		conn->len -= sizeof(frame_len) + payload;
+	}
+
+	memmove(conn->buffer, pos, conn->len);
+	return true;
+}
+
+static void read_incoming(struct tcp_incoming *conn)
+{
+	ssize_t bytes;
+
+	bytes = recv(conn->fd, conn->buffer + conn->len,
+			sizeof(conn->buffer) - conn->len, 0);
+	if (bytes < 0 && errno == EINTR)
+		return;
+	if (bytes <= 0) {
+		if (bytes < 0)
+			log_perror("Error receiving from a peer", errno);
+		else
+			log_info("A peer disconnected.");
+		close_incoming(conn);
+		return;
+	}
+
+	conn->len += bytes;
+	if (!consume_frames(conn))
+		close_incoming(conn);
+}
+
+void *tcpsocket_listen(void *arg)
+{
+	struct pollfd pfds[1 + MAX_INCOMING];
+	struct tcp_incoming *conns[1 + MAX_INCOMING];
+	unsigned int count;
+	unsigned int i;
+
+	log_info("Listening...");
+
+	do {
+		pfds[0].fd = listener;
+		pfds[0].events = POLLIN;
+		count = 1;
+		for (i = 0; i < MAX_INCOMING; i++) {
+			if (incoming[i].fd < 0)
+				continue;
+			pfds[count].fd = incoming[i].fd;
+			pfds[count].events = POLLIN;
+			conns[count] = &incoming[i];
+			count++;
+		}
+
+		if (poll(pfds, count, -1) < 0) {
+			if (errno != EINTR)
+				log_perror("poll() failed", errno);
+			continue;
+		}
+
+		for (i = 1; i < count; i++)
+			if (pfds[i].revents)
+				read_incoming(conns[i]);
+		if (pfds[0].revents & POLLIN)
+			accept_peer();
+	} while (true);
+
+	return NULL;
+}